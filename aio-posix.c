@@ -18,6 +18,7 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qapi/error.h"
 #ifdef CONFIG_EPOLL_CREATE1
 #include <sys/epoll.h>
 #endif
@@ -27,6 +28,9 @@ struct AioHandler
     GPollFD pfd;
     IOHandler *io_read;
     IOHandler *io_write;
+    AioPollFn *io_poll;
+    IOHandler *io_poll_begin;
+    IOHandler *io_poll_end;
     int deleted;
     void *opaque;
     bool is_external;
@@ -38,6 +42,32 @@ struct AioHandler
 /* The fd number threashold to switch to epoll */
 #define EPOLL_ENABLE_THRESHOLD 64
 
+/* Make the GSource poll either the epoll fd or every handler */
+static void aio_epoll_set_gsource(AioContext *ctx, bool use_epoll)
+{
+    AioHandler *node;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (node->deleted) {
+            continue;
+        }
+        if (use_epoll) {
+            g_source_remove_poll(&ctx->source, &node->pfd);
+        } else {
+            g_source_add_poll(&ctx->source, &node->pfd);
+        }
+    }
+
+    if (use_epoll) {
+        ctx->epoll_pfd.fd = ctx->epollfd;
+        ctx->epoll_pfd.events = G_IO_IN;
+        ctx->epoll_pfd.revents = 0;
+        g_source_add_poll(&ctx->source, &ctx->epoll_pfd);
+    } else {
+        g_source_remove_poll(&ctx->source, &ctx->epoll_pfd);
+    }
+}
+
 static void aio_epoll_disable(AioContext *ctx)
 {
     ctx->epoll_available = false;
@@ -45,6 +75,7 @@ static void aio_epoll_disable(AioContext *ctx)
         return;
     }
     ctx->epoll_enabled = false;
+    aio_epoll_set_gsource(ctx, false);
     close(ctx->epollfd);
 }
 
@@ -74,9 +105,29 @@ static bool aio_epoll_try_enable(AioContext *ctx)
         }
     }
     ctx->epoll_enabled = true;
+    aio_epoll_set_gsource(ctx, true);
     return true;
 }
 
+/* Contexts that are only run as a GSource, like the one behind
+ * qemu_set_fd_handler(), never go through aio_poll(); switch them to epoll
+ * when handlers are added.  */
+static void aio_epoll_check_handlers(AioContext *ctx)
+{
+    AioHandler *node;
+    unsigned n = 0;
+
+    if (!ctx->epoll_available || ctx->epoll_enabled) {
+        return;
+    }
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        n += !node->deleted;
+    }
+    if (n >= EPOLL_ENABLE_THRESHOLD && !aio_epoll_try_enable(ctx)) {
+        aio_epoll_disable(ctx);
+    }
+}
+
 static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
 {
     struct epoll_event event;
@@ -157,12 +208,25 @@ static bool aio_epoll_check_poll(AioContext *ctx, GPollFD *pfds,
     return false;
 }
 
+/* Called from the GSource check callback */
+static void aio_epoll_gsource_check(AioContext *ctx)
+{
+    if (ctx->epoll_enabled && ctx->epoll_pfd.revents) {
+        ctx->epoll_pfd.revents = 0;
+        aio_epoll(ctx, &ctx->epoll_pfd, 1, 0);
+    }
+}
+
 #else
 
 static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
 {
 }
 
+static void aio_epoll_check_handlers(AioContext *ctx)
+{
+}
+
 static int aio_epoll(AioContext *ctx, GPollFD *pfds,
                      unsigned npfd, int64_t timeout)
 {
@@ -180,6 +244,10 @@ static bool aio_epoll_check_poll(AioContext *ctx, GPollFD *pfds,
     return false;
 }
 
+static void aio_epoll_gsource_check(AioContext *ctx)
+{
+}
+
 #endif
 
 static AioHandler *find_aio_handler(AioContext *ctx, int fd)
@@ -214,7 +282,15 @@ void aio_set_fd_handler(AioContext *ctx,
             return;
         }
 
-        g_source_remove_poll(&ctx->source, &node->pfd);
+        if (!ctx->epoll_enabled) {
+            g_source_remove_poll(&ctx->source, &node->pfd);
+        }
+        /* Take the node out of the epoll set too */
+        node->pfd.events = 0;
+
+        if (!node->io_poll) {
+            ctx->poll_disable_cnt--;
+        }
 
         /* If the lock is held, just mark the node as deleted */
         if (ctx->walking_handlers) {
@@ -235,8 +311,13 @@ void aio_set_fd_handler(AioContext *ctx,
             node->pfd.fd = fd;
             QLIST_INSERT_HEAD(&ctx->aio_handlers, node, node);
 
-            g_source_add_poll(&ctx->source, &node->pfd);
+            if (!ctx->epoll_enabled) {
+                g_source_add_poll(&ctx->source, &node->pfd);
+            }
             is_new = true;
+
+            /* Until it gets an io_poll() callback */
+            ctx->poll_disable_cnt++;
         }
         /* Update handler with latest information */
         node->io_read = io_read;
@@ -249,12 +330,36 @@ void aio_set_fd_handler(AioContext *ctx,
     }
 
     aio_epoll_update(ctx, node, is_new);
+    if (is_new) {
+        aio_epoll_check_handlers(ctx);
+    }
     aio_notify(ctx);
     if (deleted) {
         g_free(node);
     }
 }
 
+void aio_set_fd_poll(AioContext *ctx,
+                     int fd,
+                     AioPollFn *io_poll,
+                     IOHandler *io_poll_begin,
+                     IOHandler *io_poll_end)
+{
+    AioHandler *node = find_aio_handler(ctx, fd);
+
+    if (!node) {
+        return;
+    }
+
+    ctx->poll_disable_cnt += !io_poll - !node->io_poll;
+    node->io_poll = io_poll;
+    node->io_poll_begin = io_poll_begin;
+    node->io_poll_end = io_poll_end;
+
+    /* Let an aio_poll() that is already waiting pick up the change */
+    aio_notify(ctx);
+}
+
 void aio_set_event_notifier(AioContext *ctx,
                             EventNotifier *notifier,
                             bool is_external,
@@ -264,6 +369,17 @@ void aio_set_event_notifier(AioContext *ctx,
                        is_external, (IOHandler *)io_read, NULL, notifier);
 }
 
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll,
+                                 EventNotifierHandler *io_poll_begin,
+                                 EventNotifierHandler *io_poll_end)
+{
+    aio_set_fd_poll(ctx, event_notifier_get_fd(notifier), io_poll,
+                    (IOHandler *)io_poll_begin,
+                    (IOHandler *)io_poll_end);
+}
+
 bool aio_prepare(AioContext *ctx)
 {
     return false;
@@ -273,6 +389,8 @@ bool aio_pending(AioContext *ctx)
 {
     AioHandler *node;
 
+    aio_epoll_gsource_check(ctx);
+
     QLIST_FOREACH(node, &ctx->aio_handlers, node) {
         int revents;
 
@@ -400,12 +518,163 @@ static void add_pollfd(AioHandler *node)
     npfd++;
 }
 
+static void poll_set_started(AioContext *ctx, bool started)
+{
+    AioHandler *node;
+
+    if (started == ctx->poll_started) {
+        return;
+    }
+
+    ctx->poll_started = started;
+
+    ctx->walking_handlers++;
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        IOHandler *fn;
+
+        if (node->deleted) {
+            continue;
+        }
+
+        if (started) {
+            fn = node->io_poll_begin;
+        } else {
+            fn = node->io_poll_end;
+        }
+
+        if (fn) {
+            fn(node->opaque);
+        }
+    }
+    ctx->walking_handlers--;
+}
+
+static bool run_poll_handlers_once(AioContext *ctx)
+{
+    bool progress = false;
+    AioHandler *node;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_poll &&
+            aio_node_check(ctx, node->is_external) &&
+            node->io_poll(node->opaque)) {
+            progress = true;
+        }
+
+        /* Caller handles freeing deleted nodes.  Don't do it here. */
+    }
+
+    return progress;
+}
+
+/* run_poll_handlers:
+ * @ctx: the AioContext
+ * @max_ns: maximum time to poll for, in nanoseconds
+ *
+ * Polls for a given time.
+ *
+ * Note that ctx->notify_me must be non-zero so this function can detect
+ * aio_notify().
+ *
+ * Note that the caller must have incremented ctx->walking_handlers.
+ *
+ * Returns: true if progress was made, false otherwise
+ */
+static bool run_poll_handlers(AioContext *ctx, int64_t max_ns)
+{
+    bool progress;
+    int64_t end_time;
+
+    assert(ctx->notify_me);
+    assert(ctx->walking_handlers > 0);
+    assert(ctx->poll_disable_cnt == 0);
+
+    end_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + max_ns;
+
+    do {
+        progress = run_poll_handlers_once(ctx);
+    } while (!progress && qemu_clock_get_ns(QEMU_CLOCK_REALTIME) < end_time);
+
+    return progress;
+}
+
+/* try_poll_mode:
+ * @ctx: the AioContext
+ * @blocking: busy polling is only attempted when blocking is true
+ *
+ * ctx->notify_me must be non-zero so this function can detect aio_notify().
+ *
+ * Note that the caller must have incremented ctx->walking_handlers.
+ *
+ * Returns: true if progress was made, false otherwise
+ */
+static bool try_poll_mode(AioContext *ctx, bool blocking)
+{
+    if (blocking && ctx->poll_max_ns && ctx->poll_disable_cnt == 0) {
+        /* See qemu_soonest_timeout() uint64_t hack */
+        int64_t max_ns = MIN((uint64_t)aio_compute_timeout(ctx),
+                             (uint64_t)ctx->poll_ns);
+
+        if (max_ns) {
+            poll_set_started(ctx, true);
+
+            if (run_poll_handlers(ctx, max_ns)) {
+                return true;
+            }
+        }
+    }
+
+    poll_set_started(ctx, false);
+
+    if (blocking && ctx->poll_max_ns && ctx->poll_disable_cnt == 0) {
+        /* Notifications were suppressed while polling; look once more in
+         * case something came in just before they were turned back on.
+         */
+        return run_poll_handlers_once(ctx);
+    }
+    return false;
+}
+
+/* Adjust the polling time to how long the last aio_poll() blocked */
+static void poll_adjust(AioContext *ctx, int64_t block_ns)
+{
+    if (block_ns <= ctx->poll_ns) {
+        /* This is the sweet spot, no adjustment needed */
+    } else if (block_ns > ctx->poll_max_ns) {
+        /* We'd have to poll for too long, poll less */
+        if (ctx->poll_shrink) {
+            ctx->poll_ns /= ctx->poll_shrink;
+        } else {
+            ctx->poll_ns = 0;
+        }
+    } else if (ctx->poll_ns < ctx->poll_max_ns &&
+               block_ns < ctx->poll_max_ns) {
+        /* There is room to grow, poll longer */
+        int64_t grow = ctx->poll_grow;
+
+        if (grow == 0) {
+            grow = 2;
+        }
+
+        if (ctx->poll_ns) {
+            ctx->poll_ns *= grow;
+        } else {
+            ctx->poll_ns = 4000; /* start polling at 4 microseconds */
+        }
+
+        if (ctx->poll_ns > ctx->poll_max_ns) {
+            ctx->poll_ns = ctx->poll_max_ns;
+        }
+    }
+}
+
 bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
-    int i, ret;
+    int i, ret = 0;
     bool progress;
     int64_t timeout;
+    int64_t start = 0;
 
     aio_context_acquire(ctx);
     progress = false;
@@ -423,41 +692,55 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     ctx->walking_handlers++;
 
-    assert(npfd == 0);
+    if (ctx->poll_max_ns) {
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    }
 
-    /* fill pollfds */
+    if (try_poll_mode(ctx, blocking)) {
+        progress = true;
+    } else {
+        assert(npfd == 0);
 
-    if (!aio_epoll_enabled(ctx)) {
-        QLIST_FOREACH(node, &ctx->aio_handlers, node) {
-            if (!node->deleted && node->pfd.events
-                && aio_node_check(ctx, node->is_external)) {
-                add_pollfd(node);
+        /* fill pollfds */
+
+        if (!aio_epoll_enabled(ctx)) {
+            QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+                if (!node->deleted && node->pfd.events
+                    && aio_node_check(ctx, node->is_external)) {
+                    add_pollfd(node);
+                }
             }
         }
-    }
 
-    timeout = blocking ? aio_compute_timeout(ctx) : 0;
+        timeout = blocking ? aio_compute_timeout(ctx) : 0;
 
-    /* wait until next event */
-    if (timeout) {
-        aio_context_release(ctx);
+        /* wait until next event */
+        if (timeout) {
+            aio_context_release(ctx);
+        }
+        if (aio_epoll_check_poll(ctx, pollfds, npfd, timeout)) {
+            AioHandler epoll_handler;
+
+            epoll_handler.pfd.fd = ctx->epollfd;
+            epoll_handler.pfd.events = G_IO_IN | G_IO_OUT | G_IO_HUP |
+                                       G_IO_ERR;
+            npfd = 0;
+            add_pollfd(&epoll_handler);
+            ret = aio_epoll(ctx, pollfds, npfd, timeout);
+        } else  {
+            ret = qemu_poll_ns(pollfds, npfd, timeout);
+        }
+        if (timeout) {
+            aio_context_acquire(ctx);
+        }
     }
-    if (aio_epoll_check_poll(ctx, pollfds, npfd, timeout)) {
-        AioHandler epoll_handler;
 
-        epoll_handler.pfd.fd = ctx->epollfd;
-        epoll_handler.pfd.events = G_IO_IN | G_IO_OUT | G_IO_HUP | G_IO_ERR;
-        npfd = 0;
-        add_pollfd(&epoll_handler);
-        ret = aio_epoll(ctx, pollfds, npfd, timeout);
-    } else  {
-        ret = qemu_poll_ns(pollfds, npfd, timeout);
-    }
     if (blocking) {
         atomic_sub(&ctx->notify_me, 2);
     }
-    if (timeout) {
-        aio_context_acquire(ctx);
+
+    if (ctx->poll_max_ns) {
+        poll_adjust(ctx, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
     }
 
     aio_notify_accept(ctx);
@@ -495,3 +778,59 @@ void aio_context_setup(AioContext *ctx)
     }
 #endif
 }
+
+void aio_context_after_fork(AioContext *ctx)
+{
+    AioHandler *node;
+    int old_fd = event_notifier_get_fd(&ctx->notifier);
+#ifdef CONFIG_EPOLL_CREATE1
+    bool use_epoll = ctx->epoll_enabled;
+
+    /* Leave the shared epoll instance alone: changing its interest list
+     * would change it for the parent too.  */
+    if (ctx->epoll_enabled) {
+        ctx->epoll_enabled = false;
+        aio_epoll_set_gsource(ctx, false);
+    }
+    if (ctx->epoll_available) {
+        close(ctx->epollfd);
+    } else {
+        use_epoll = false;
+    }
+#endif
+
+    /* Swap the notifier's eventfd under its handler, so that notifying this
+     * context doesn't wake up other processes.  */
+    event_notifier_cleanup(&ctx->notifier);
+    if (event_notifier_init(&ctx->notifier, false) < 0) {
+        fprintf(stderr, "Failed to initialize event notifier after fork\n");
+        abort();
+    }
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->pfd.fd == old_fd) {
+            node->pfd.fd = event_notifier_get_fd(&ctx->notifier);
+        }
+    }
+
+#ifdef CONFIG_EPOLL_CREATE1
+    ctx->epollfd = 0;
+    aio_context_setup(ctx);
+    if (use_epoll && ctx->epoll_available && !aio_epoll_try_enable(ctx)) {
+        aio_epoll_disable(ctx);
+    }
+#endif
+}
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink, Error **errp)
+{
+    /* No thread synchronization here, it doesn't matter if an incorrect value
+     * is used once.
+     */
+    ctx->poll_max_ns = max_ns;
+    ctx->poll_ns = 0;
+    ctx->poll_grow = grow;
+    ctx->poll_shrink = shrink;
+
+    aio_notify(ctx);
+}
@@ -1927,6 +1927,7 @@ BlockDriverState *bdrv_open(const char *filename, const char *reference,
 
 typedef struct BlockReopenQueueEntry {
      bool prepared;
+     bool was_read_only;
      BDRVReopenState state;
      QSIMPLEQ_ENTRY(BlockReopenQueueEntry) entry;
 } BlockReopenQueueEntry;
@@ -2108,9 +2109,23 @@ int bdrv_reopen_multiple(AioContext *ctx, BlockReopenQueue *bs_queue, Error **er
      * changes
      */
     QSIMPLEQ_FOREACH(bs_entry, bs_queue, entry) {
+        bs_entry->was_read_only = bs_entry->state.bs->read_only;
         bdrv_reopen_commit(&bs_entry->state);
     }
 
+    /* Parents are committed before their children, so driver metadata can
+     * only be written once the whole queue has been committed */
+    QSIMPLEQ_FOREACH(bs_entry, bs_queue, entry) {
+        BlockDriverState *bs = bs_entry->state.bs;
+
+        if (bs_entry->was_read_only && !bs->read_only &&
+            bs->drv->bdrv_reopen_bitmaps_rw &&
+            bs->drv->bdrv_reopen_bitmaps_rw(bs, &local_err) < 0) {
+            error_report_err(local_err);
+            local_err = NULL;
+        }
+    }
+
     ret = 0;
 
 cleanup:
@@ -2322,12 +2337,10 @@ static void bdrv_close(BlockDriverState *bs)
     bdrv_flush(bs);
     bdrv_drain(bs); /* in case flush left pending I/O */
 
-    bdrv_release_named_dirty_bitmaps(bs);
-    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
-
     if (bs->drv) {
         BdrvChild *child, *next;
 
+        /* The driver may still store persistent bitmaps here */
         bs->drv->bdrv_close(bs);
         bs->drv = NULL;
 
@@ -2363,6 +2376,9 @@ static void bdrv_close(BlockDriverState *bs)
         bs->full_open_options = NULL;
     }
 
+    bdrv_release_named_dirty_bitmaps(bs);
+    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
+
     QLIST_FOREACH_SAFE(ban, &bs->aio_notifiers, list, ban_next) {
         g_free(ban);
     }
@@ -49,6 +49,7 @@ void block_acct_cleanup(BlockAcctStats *stats)
     QSLIST_FOREACH_SAFE(s, &stats->intervals, entries, next) {
         g_free(s);
     }
+    block_latency_histograms_clear(stats);
 }
 
 void block_acct_add_interval(BlockAcctStats *stats, unsigned interval_length)
@@ -76,6 +77,69 @@ BlockAcctTimedStats *block_acct_interval_next(BlockAcctStats *stats,
     }
 }
 
+static void block_latency_histogram_account(BlockLatencyHistogram *hist,
+                                            uint64_t latency_ns)
+{
+    int lo = 0, hi = hist->nbins - 1;
+
+    if (hist->nbins == 0) {
+        return;
+    }
+
+    /* Find the first bin whose upper boundary is above the latency */
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (latency_ns < hist->boundaries[mid]) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    hist->bins[lo]++;
+}
+
+/* Set @nb_boundaries boundaries for the histogram of @type and reset its
+ * bins; with no boundaries, the histogram is removed */
+int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
+                                const uint64_t *boundaries,
+                                int nb_boundaries)
+{
+    BlockLatencyHistogram *hist = &stats->latency_histogram[type];
+    int i;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    for (i = 1; i < nb_boundaries; i++) {
+        if (boundaries[i] <= boundaries[i - 1]) {
+            return -EINVAL;
+        }
+    }
+
+    g_free(hist->boundaries);
+    g_free(hist->bins);
+    if (nb_boundaries == 0) {
+        hist->nbins = 0;
+        hist->boundaries = NULL;
+        hist->bins = NULL;
+        return 0;
+    }
+
+    hist->nbins = nb_boundaries + 1;
+    hist->boundaries = g_memdup(boundaries, nb_boundaries * sizeof(uint64_t));
+    hist->bins = g_new0(uint64_t, hist->nbins);
+    return 0;
+}
+
+void block_latency_histograms_clear(BlockAcctStats *stats)
+{
+    int i;
+
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        block_latency_histogram_set(stats, i, NULL, 0);
+    }
+}
+
 void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
                       int64_t bytes, enum BlockAcctType type)
 {
@@ -106,6 +170,8 @@ void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie)
     QSLIST_FOREACH(s, &stats->intervals, entries) {
         timed_average_account(&s->latency[cookie->type], latency_ns);
     }
+    block_latency_histogram_account(&stats->latency_histogram[cookie->type],
+                                    latency_ns);
 }
 
 void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie)
@@ -129,6 +195,8 @@ void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie)
         QSLIST_FOREACH(s, &stats->intervals, entries) {
             timed_average_account(&s->latency[cookie->type], latency_ns);
         }
+        block_latency_histogram_account(
+            &stats->latency_histogram[cookie->type], latency_ns);
     }
 }
 
@@ -42,6 +42,8 @@ typedef struct BackupBlockJob {
     unsigned long *done_bitmap;
     int64_t cluster_size;
     bool compress;
+    /* Try bdrv_co_copy_range() before bouncing data through a buffer */
+    bool use_copy_range;
     NotifierWithReturn before_write;
     QLIST_HEAD(, CowRequest) inflight_reqs;
 } BackupBlockJob;
@@ -89,6 +91,20 @@ static void cow_request_end(CowRequest *req)
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
+/* Whether the source reads as zeroes, without actually reading it */
+static bool coroutine_fn backup_source_is_zero(BackupBlockJob *job,
+                                               int64_t sector_num,
+                                               int nb_sectors)
+{
+    BlockDriverState *file;
+    int64_t ret;
+    int pnum;
+
+    ret = bdrv_get_block_status_above(blk_bs(job->common.blk), NULL,
+                                      sector_num, nb_sectors, &pnum, &file);
+    return ret >= 0 && (ret & BDRV_BLOCK_ZERO) && pnum >= nb_sectors;
+}
+
 static int coroutine_fn backup_do_cow(BackupBlockJob *job,
                                       int64_t sector_num, int nb_sectors,
                                       bool *error_is_read,
@@ -126,6 +142,35 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
                 job->common.len / BDRV_SECTOR_SIZE -
                 start * sectors_per_cluster);
 
+        if (backup_source_is_zero(job, start * sectors_per_cluster, n)) {
+            ret = blk_co_pwrite_zeroes(job->target, start * job->cluster_size,
+                                       n * BDRV_SECTOR_SIZE,
+                                       BDRV_REQ_MAY_UNMAP);
+            if (ret < 0) {
+                trace_backup_do_cow_write_fail(job, start, ret);
+                if (error_is_read) {
+                    *error_is_read = false;
+                }
+                goto out;
+            }
+            goto done;
+        }
+
+        if (job->use_copy_range) {
+            ret = blk_co_copy_range(blk, start * job->cluster_size,
+                                    job->target, start * job->cluster_size,
+                                    n * BDRV_SECTOR_SIZE,
+                                    is_write_notifier ?
+                                    BDRV_REQ_NO_SERIALISING : 0);
+            if (ret >= 0) {
+                goto done;
+            }
+            /* Errors are reported by the read and write below; use bounce
+             * buffers for the rest of the job. */
+            trace_backup_do_cow_copy_range_fail(job, start, ret);
+            job->use_copy_range = false;
+        }
+
         if (!bounce_buffer) {
             bounce_buffer = blk_blockalign(blk, job->cluster_size);
         }
@@ -160,6 +205,7 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
             goto out;
         }
 
+done:
         set_bit(start, job->done_bitmap);
 
         /* Publish progress, guest I/O counts as progress too.  Note that the
@@ -633,6 +679,7 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     job->sync_bitmap = sync_mode == MIRROR_SYNC_MODE_INCREMENTAL ?
                        sync_bitmap : NULL;
     job->compress = compress;
+    job->use_copy_range = !compress;
 
     /* If there is no backing file on the target, we cannot rely on COW if our
      * backup cluster size is smaller than the target cluster size. Even for
@@ -0,0 +1,1301 @@
+/*
+ * Block cache filter with read-ahead and optional write-back
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * The cache works in blocks of block-size bytes, kept in a buffer of
+ * cache-size bytes allocated at open time.  Misses are read from the
+ * protected node in runs of consecutive blocks, so that a large guest
+ * request is still one round trip.  When a read continues where the last
+ * one ended, the following read-ahead bytes are fetched in the background.
+ * The least recently used block that is not busy is replaced first.
+ *
+ * Without write-back, writes go straight to the protected node and update
+ * the blocks that are cached.  With write-back, they only dirty the cache;
+ * dirty blocks are written back in offset order on flush, and when they
+ * have to be replaced.
+ *
+ * A block is busy while it is loaded or written back.  Requests that need
+ * a busy block wait on its queue and then look it up again, as it may have
+ * been replaced in the meantime.  A load that raced with a write going to
+ * the protected node may have read old data; such blocks are marked stale
+ * and dropped once the load completes.
+ *
+ * Read-only nodes can additionally use a cache shared by all processes on
+ * the host, e.g. for the backing file of many VMs.  It is a file that every
+ * process maps, with one direct-mapped table of blocks keyed by the image
+ * and the block index.  Each slot has a sequence count that is odd while the
+ * slot is written; readers copy the data out and only keep it if the count
+ * did not change in the meantime, and writers skip slots that someone else
+ * is writing.  Loads take the blocks at the start and the end of a run from
+ * the shared cache and read the rest from the protected node.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/option.h"
+#include "qemu/atomic.h"
+#include "block/block_int.h"
+#include "trace.h"
+
+#define BLKCACHE_OPT_CACHE_SIZE         "cache-size"
+#define BLKCACHE_OPT_BLOCK_SIZE         "block-size"
+#define BLKCACHE_OPT_READ_AHEAD         "read-ahead"
+#define BLKCACHE_OPT_WRITE_BACK         "write-back"
+#define BLKCACHE_OPT_SHARED             "shared"
+#define BLKCACHE_OPT_SHARED_SIZE        "shared-size"
+#define BLKCACHE_OPT_SHARED_GENERATION  "shared-generation"
+
+#define BLKCACHE_DEFAULT_CACHE_SIZE     (32 * 1024 * 1024)
+#define BLKCACHE_DEFAULT_BLOCK_SIZE     (64 * 1024)
+#define BLKCACHE_DEFAULT_READ_AHEAD     (1024 * 1024)
+#define BLKCACHE_MAX_BLOCK_SIZE         (4 * 1024 * 1024)
+#define BLKCACHE_DEFAULT_SHARED_SIZE    (256 * 1024 * 1024)
+
+#define BLKCACHE_SHARED_MAGIC           0x514b434853485244ULL /* QKCHSHRD */
+#define BLKCACHE_SHARED_VERSION         1
+#define BLKCACHE_SHARED_SLOTS_OFFSET    64
+
+typedef enum {
+    BLKCACHE_LOADING,
+    BLKCACHE_CLEAN,
+    BLKCACHE_DIRTY,
+} BlkcacheBlockState;
+
+typedef struct BlkcacheBlock {
+    uint64_t index;             /* offset / block_size, the hash table key */
+    uint8_t *data;
+    BlkcacheBlockState state;
+    bool busy;                  /* being loaded or written back */
+    bool stale;                 /* overwritten below us while loading */
+    CoQueue waiters;            /* requests waiting for busy to clear */
+    QTAILQ_ENTRY(BlkcacheBlock) next;   /* in the LRU or free list */
+} BlkcacheBlock;
+
+/* Start of the shared cache file, followed by the slots at
+ * BLKCACHE_SHARED_SLOTS_OFFSET and by the data at the next multiple of
+ * block_size.  All fields are in host byte order. */
+typedef struct BlkcacheSharedHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t nb_slots;
+} BlkcacheSharedHeader;
+
+typedef struct BlkcacheSharedSlot {
+    uint32_t seq;               /* odd while the slot is written */
+    uint32_t reserved;
+    uint64_t image;             /* BDRVBlkcacheState.shared_image, 0 if empty */
+    uint64_t index;
+} BlkcacheSharedSlot;
+
+/* A write, write zeroes or discard request on its way to bs->file */
+typedef struct BlkcacheWrite {
+    uint64_t offset;
+    uint64_t bytes;
+    QLIST_ENTRY(BlkcacheWrite) next;
+} BlkcacheWrite;
+
+typedef struct BDRVBlkcacheState {
+    uint64_t block_size;
+    int block_bits;
+    uint64_t read_ahead;
+    bool write_back;
+
+    int nb_slots;
+    BlkcacheBlock *slots;
+    uint8_t *buffer;
+
+    GHashTable *blocks;                     /* index -> cached block */
+    QTAILQ_HEAD(, BlkcacheBlock) lru;       /* least recently used first */
+    QTAILQ_HEAD(, BlkcacheBlock) free;
+    CoQueue free_wait;                      /* waiting for a block to reuse */
+    uint64_t nb_dirty;
+
+    QLIST_HEAD(, BlkcacheWrite) writes;
+
+    /* Sequential read detection */
+    uint64_t last_read_end;
+    uint64_t read_ahead_end;
+
+    /* Cache shared with other processes, if any */
+    void *shared_map;
+    size_t shared_map_size;
+    BlkcacheSharedSlot *shared_slots;
+    uint8_t *shared_data;
+    uint64_t shared_nb_slots;
+    uint64_t shared_image;
+} BDRVBlkcacheState;
+
+typedef struct BlkcacheReadAhead {
+    BlockDriverState *bs;
+    uint64_t index;
+    uint64_t count;
+} BlkcacheReadAhead;
+
+static QemuOptsList blkcache_runtime_opts = {
+    .name = "blkcache",
+    .head = QTAILQ_HEAD_INITIALIZER(blkcache_runtime_opts.head),
+    .desc = {
+        {
+            .name = BLKCACHE_OPT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the cache in bytes",
+        },
+        {
+            .name = BLKCACHE_OPT_BLOCK_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "unit of caching in bytes, a power of two",
+        },
+        {
+            .name = BLKCACHE_OPT_READ_AHEAD,
+            .type = QEMU_OPT_SIZE,
+            .help = "bytes to fetch ahead of sequential reads",
+        },
+        {
+            .name = BLKCACHE_OPT_WRITE_BACK,
+            .type = QEMU_OPT_BOOL,
+            .help = "keep writes in the cache until the next flush",
+        },
+        {
+            .name = BLKCACHE_OPT_SHARED,
+            .type = QEMU_OPT_STRING,
+            .help = "file holding a cache shared with other processes",
+        },
+        {
+            .name = BLKCACHE_OPT_SHARED_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "data size of the shared cache when it is created",
+        },
+        {
+            .name = BLKCACHE_OPT_SHARED_GENERATION,
+            .type = QEMU_OPT_NUMBER,
+            .help = "change to ignore shared data of a modified image",
+        },
+        { /* end of list */ }
+    },
+};
+
+static inline uint64_t blkcache_block_offset(BDRVBlkcacheState *s,
+                                             BlkcacheBlock *blk)
+{
+    return blk->index << s->block_bits;
+}
+
+static BlkcacheBlock *blkcache_lookup(BDRVBlkcacheState *s, uint64_t index)
+{
+    return g_hash_table_lookup(s->blocks, &index);
+}
+
+static void blkcache_touch(BDRVBlkcacheState *s, BlkcacheBlock *blk)
+{
+    QTAILQ_REMOVE(&s->lru, blk, next);
+    QTAILQ_INSERT_TAIL(&s->lru, blk, next);
+}
+
+static void blkcache_insert(BDRVBlkcacheState *s, BlkcacheBlock *blk,
+                            uint64_t index, BlkcacheBlockState state)
+{
+    blk->index = index;
+    blk->state = state;
+    blk->busy = state == BLKCACHE_LOADING;
+    blk->stale = false;
+    g_hash_table_insert(s->blocks, &blk->index, blk);
+    QTAILQ_INSERT_TAIL(&s->lru, blk, next);
+    if (state == BLKCACHE_DIRTY) {
+        s->nb_dirty++;
+    }
+}
+
+/* Return a block that was not inserted yet to the free list */
+static void blkcache_release(BDRVBlkcacheState *s, BlkcacheBlock *blk)
+{
+    QTAILQ_INSERT_HEAD(&s->free, blk, next);
+}
+
+/* Remove a block from the cache; the caller makes sure that its data is
+ * not needed any more */
+static void blkcache_drop(BDRVBlkcacheState *s, BlkcacheBlock *blk)
+{
+    g_hash_table_remove(s->blocks, &blk->index);
+    QTAILQ_REMOVE(&s->lru, blk, next);
+    if (blk->state == BLKCACHE_DIRTY) {
+        s->nb_dirty--;
+    }
+    blkcache_release(s, blk);
+}
+
+static bool blkcache_overlaps(BDRVBlkcacheState *s, BlkcacheBlock *blk,
+                              uint64_t offset, uint64_t bytes)
+{
+    uint64_t start = blkcache_block_offset(s, blk);
+
+    return offset < start + s->block_size && start < offset + bytes;
+}
+
+/* Flag the blocks in a range that are being loaded, so that the data they
+ * get is not kept */
+static void blkcache_mark_stale(BDRVBlkcacheState *s, uint64_t offset,
+                                uint64_t bytes)
+{
+    uint64_t index;
+
+    if (bytes == 0) {
+        return;
+    }
+    for (index = offset >> s->block_bits;
+         index <= (offset + bytes - 1) >> s->block_bits; index++)
+    {
+        BlkcacheBlock *blk = blkcache_lookup(s, index);
+        if (blk && blk->state == BLKCACHE_LOADING) {
+            blk->stale = true;
+        }
+    }
+}
+
+static void blkcache_write_begin(BDRVBlkcacheState *s, BlkcacheWrite *w,
+                                 uint64_t offset, uint64_t bytes)
+{
+    *w = (BlkcacheWrite) {
+        .offset = offset,
+        .bytes  = bytes,
+    };
+    QLIST_INSERT_HEAD(&s->writes, w, next);
+    blkcache_mark_stale(s, offset, bytes);
+}
+
+static void blkcache_write_end(BDRVBlkcacheState *s, BlkcacheWrite *w)
+{
+    blkcache_mark_stale(s, w->offset, w->bytes);
+    QLIST_REMOVE(w, next);
+}
+
+/* Whether the data just loaded into a block may be out of date */
+static bool blkcache_is_stale(BDRVBlkcacheState *s, BlkcacheBlock *blk)
+{
+    BlkcacheWrite *w;
+
+    if (blk->stale) {
+        return true;
+    }
+    QLIST_FOREACH(w, &s->writes, next) {
+        if (blkcache_overlaps(s, blk, w->offset, w->bytes)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Write back @n dirty blocks with consecutive indices in one request */
+static int coroutine_fn blkcache_co_writeback(BlockDriverState *bs,
+                                              BlkcacheBlock **blocks, int n)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    uint64_t offset = blkcache_block_offset(s, blocks[0]);
+    uint64_t bytes = (uint64_t) n << s->block_bits;
+    QEMUIOVector qiov;
+    int64_t len;
+    int i, ret;
+
+    len = bdrv_getlength(bs->file->bs);
+    if (len < 0) {
+        return len;
+    }
+    /* The last block of the image may be shorter */
+    assert(offset < len);
+    bytes = MIN(bytes, len - offset);
+
+    qemu_iovec_init(&qiov, n);
+    for (i = 0; i < n; i++) {
+        assert(blocks[i]->state == BLKCACHE_DIRTY && !blocks[i]->busy);
+        assert(blocks[i]->index == blocks[0]->index + i);
+        blocks[i]->busy = true;
+        qemu_iovec_add(&qiov, blocks[i]->data,
+                       MIN(s->block_size, bytes - i * s->block_size));
+    }
+
+    ret = bdrv_co_pwritev(bs->file, offset, bytes, &qiov, 0);
+    trace_blkcache_writeback(bs, offset, bytes, ret);
+
+    for (i = 0; i < n; i++) {
+        blocks[i]->busy = false;
+        if (ret >= 0) {
+            blocks[i]->state = BLKCACHE_CLEAN;
+            s->nb_dirty--;
+        }
+        qemu_co_queue_restart_all(&blocks[i]->waiters);
+    }
+    qemu_co_queue_restart_all(&s->free_wait);
+    qemu_iovec_destroy(&qiov);
+
+    return ret < 0 ? ret : 0;
+}
+
+/* Get a free block, replacing the least recently used one that is not busy
+ * if necessary.  Without @wait, NULL is returned instead of waiting for a
+ * busy block to become available.
+ *
+ * This may yield, so the caller has to check again whether the block it
+ * wants to cache has shown up in the meantime. */
+static BlkcacheBlock *coroutine_fn blkcache_co_get_free(BlockDriverState *bs,
+                                                        bool wait, int *ret)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheBlock *blk;
+
+    *ret = 0;
+    while (QTAILQ_EMPTY(&s->free)) {
+        QTAILQ_FOREACH(blk, &s->lru, next) {
+            if (!blk->busy) {
+                break;
+            }
+        }
+
+        if (!blk) {
+            if (!wait) {
+                return NULL;
+            }
+            qemu_co_queue_wait(&s->free_wait);
+        } else if (blk->state == BLKCACHE_DIRTY) {
+            *ret = blkcache_co_writeback(bs, &blk, 1);
+            if (*ret < 0) {
+                return NULL;
+            }
+        } else {
+            blkcache_drop(s, blk);
+        }
+    }
+
+    blk = QTAILQ_FIRST(&s->free);
+    QTAILQ_REMOVE(&s->free, blk, next);
+    return blk;
+}
+
+static BlkcacheSharedSlot *blkcache_shared_slot(BDRVBlkcacheState *s,
+                                                uint64_t index,
+                                                uint8_t **data)
+{
+    uint64_t i = ((index ^ s->shared_image) * 0x9E3779B97F4A7C15ULL) %
+                 s->shared_nb_slots;
+
+    *data = s->shared_data + i * s->block_size;
+    return &s->shared_slots[i];
+}
+
+/* Copy block @index from the shared cache to @buf if it is there */
+static bool blkcache_shared_get(BDRVBlkcacheState *s, uint64_t index,
+                                uint8_t *buf)
+{
+    uint8_t *data;
+    BlkcacheSharedSlot *slot = blkcache_shared_slot(s, index, &data);
+    uint32_t seq;
+
+    seq = atomic_read(&slot->seq);
+    smp_rmb();
+    if ((seq & 1) || slot->image != s->shared_image || slot->index != index) {
+        return false;
+    }
+    memcpy(buf, data, s->block_size);
+    smp_rmb();
+
+    /* A writer may have replaced the slot while we copied it */
+    return atomic_read(&slot->seq) == seq;
+}
+
+static void blkcache_shared_put(BDRVBlkcacheState *s, uint64_t index,
+                                const uint8_t *buf)
+{
+    uint8_t *data;
+    BlkcacheSharedSlot *slot = blkcache_shared_slot(s, index, &data);
+    uint32_t seq;
+
+    seq = atomic_read(&slot->seq);
+    smp_rmb();
+    if ((seq & 1) ||
+        (slot->image == s->shared_image && slot->index == index)) {
+        return;
+    }
+    if (atomic_cmpxchg(&slot->seq, seq, seq + 1) != seq) {
+        /* Someone else is writing it */
+        return;
+    }
+
+    slot->image = s->shared_image;
+    slot->index = index;
+    memcpy(data, buf, s->block_size);
+    smp_wmb();
+    atomic_set(&slot->seq, seq + 2);
+}
+
+/* Make loaded blocks available, or drop them if they may be out of date */
+static void coroutine_fn blkcache_load_done(BlockDriverState *bs,
+                                            BlkcacheBlock **blocks, int n)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        BlkcacheBlock *blk = blocks[i];
+
+        assert(blk->state == BLKCACHE_LOADING);
+        blk->busy = false;
+        qemu_co_queue_restart_all(&blk->waiters);
+        if (blkcache_is_stale(s, blk)) {
+            blkcache_drop(s, blk);
+        } else {
+            blk->state = BLKCACHE_CLEAN;
+        }
+    }
+    qemu_co_queue_restart_all(&s->free_wait);
+}
+
+/* Read up to @max blocks starting at @index that are not cached yet into
+ * the cache, stopping at the first one that is.  On success, the number of
+ * blocks is returned and the blocks are stored in @blocks; they stay busy
+ * until the caller passes them to blkcache_load_done(). */
+static int coroutine_fn blkcache_co_load(BlockDriverState *bs, uint64_t index,
+                                         int max, bool wait, bool read_ahead,
+                                         BlkcacheBlock **blocks)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheBlock *blk;
+    QEMUIOVector qiov;
+    int i, n, first, end, ret;
+
+    for (n = 0; n < max && !blkcache_lookup(s, index + n); n++) {
+        /* Only wait for the first block, the others may be held by whoever
+         * we would be waiting for */
+        blk = blkcache_co_get_free(bs, wait && n == 0, &ret);
+        if (!blk) {
+            if (n == 0) {
+                return ret;
+            }
+            break;
+        }
+        if (blkcache_lookup(s, index + n)) {
+            blkcache_release(s, blk);
+            break;
+        }
+        blkcache_insert(s, blk, index + n, BLKCACHE_LOADING);
+        blocks[n] = blk;
+    }
+
+    if (n == 0) {
+        return 0;
+    }
+
+    /* Only blocks first..end-1 need to be read from bs->file */
+    first = 0;
+    end = n;
+    if (s->shared_map) {
+        while (first < n &&
+               blkcache_shared_get(s, index + first, blocks[first]->data)) {
+            first++;
+        }
+        while (end > first &&
+               blkcache_shared_get(s, index + end - 1, blocks[end - 1]->data)) {
+            end--;
+        }
+        trace_blkcache_shared_load(bs, index << s->block_bits, n,
+                                   n - (end - first));
+        if (first == end) {
+            return n;
+        }
+    }
+
+    qemu_iovec_init(&qiov, end - first);
+    for (i = first; i < end; i++) {
+        qemu_iovec_add(&qiov, blocks[i]->data, s->block_size);
+    }
+
+    trace_blkcache_load(bs, (index + first) << s->block_bits,
+                        (uint64_t) (end - first) << s->block_bits, read_ahead);
+    ret = bdrv_co_preadv(bs->file, (index + first) << s->block_bits,
+                         (uint64_t) (end - first) << s->block_bits, &qiov, 0);
+    qemu_iovec_destroy(&qiov);
+
+    if (ret < 0) {
+        for (i = 0; i < n; i++) {
+            blocks[i]->stale = true;
+        }
+        blkcache_load_done(bs, blocks, n);
+        return ret;
+    }
+
+    if (s->shared_map) {
+        for (i = first; i < end; i++) {
+            blkcache_shared_put(s, index + i, blocks[i]->data);
+        }
+    }
+
+    return n;
+}
+
+static void coroutine_fn blkcache_co_read_ahead(void *opaque)
+{
+    BlkcacheReadAhead *ra = opaque;
+    BlockDriverState *bs = ra->bs;
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheBlock **blocks = g_new(BlkcacheBlock *, ra->count);
+
+    while (ra->count > 0) {
+        int n;
+
+        if (blkcache_lookup(s, ra->index)) {
+            ra->index++;
+            ra->count--;
+            continue;
+        }
+
+        /* Read-ahead gives up rather than wait for the cache */
+        n = blkcache_co_load(bs, ra->index, ra->count, false, true, blocks);
+        if (n <= 0) {
+            break;
+        }
+        blkcache_load_done(bs, blocks, n);
+        ra->index += n;
+        ra->count -= n;
+    }
+
+    g_free(blocks);
+    g_free(ra);
+    bdrv_dec_in_flight(bs);
+}
+
+/* Start reading ahead if the read that ended at @end continued the
+ * previous one and the data read ahead so far is about to run out */
+static void coroutine_fn blkcache_read_ahead(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t end)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheReadAhead *ra;
+    uint64_t ra_start, ra_end;
+    int64_t len;
+    Coroutine *co;
+
+    if (offset != s->last_read_end) {
+        s->last_read_end = end;
+        s->read_ahead_end = end;
+        return;
+    }
+    s->last_read_end = end;
+
+    if (!s->read_ahead || end + s->read_ahead / 2 <= s->read_ahead_end) {
+        return;
+    }
+
+    len = bdrv_getlength(bs->file->bs);
+    if (len < 0) {
+        return;
+    }
+    ra_start = MAX(end, s->read_ahead_end);
+    ra_end = MIN(end + s->read_ahead, len);
+    if (ra_start >= ra_end) {
+        return;
+    }
+    s->read_ahead_end = ra_end;
+
+    ra = g_new(BlkcacheReadAhead, 1);
+    *ra = (BlkcacheReadAhead) {
+        .bs     = bs,
+        .index  = ra_start >> s->block_bits,
+        .count  = ((ra_end - 1) >> s->block_bits) -
+                  (ra_start >> s->block_bits) + 1,
+    };
+
+    /* Keep drain from returning before the read-ahead is complete */
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(blkcache_co_read_ahead, ra);
+    qemu_coroutine_enter(co);
+}
+
+/* Copy the part of a cached block that overlaps a request into its qiov */
+static void blkcache_copy_to_qiov(BDRVBlkcacheState *s, BlkcacheBlock *blk,
+                                  uint64_t offset, uint64_t bytes,
+                                  QEMUIOVector *qiov)
+{
+    uint64_t start = MAX(offset, blkcache_block_offset(s, blk));
+    uint64_t end = MIN(offset + bytes,
+                       blkcache_block_offset(s, blk) + s->block_size);
+
+    qemu_iovec_from_buf(qiov, start - offset,
+                        blk->data + (start - blkcache_block_offset(s, blk)),
+                        end - start);
+}
+
+/* Copy the part of a request's qiov that overlaps a cached block into it */
+static void blkcache_copy_from_qiov(BDRVBlkcacheState *s, BlkcacheBlock *blk,
+                                    uint64_t offset, uint64_t bytes,
+                                    QEMUIOVector *qiov)
+{
+    uint64_t start = MAX(offset, blkcache_block_offset(s, blk));
+    uint64_t end = MIN(offset + bytes,
+                       blkcache_block_offset(s, blk) + s->block_size);
+
+    qemu_iovec_to_buf(qiov, start - offset,
+                      blk->data + (start - blkcache_block_offset(s, blk)),
+                      end - start);
+}
+
+static int coroutine_fn blkcache_co_preadv(BlockDriverState *bs,
+                                           uint64_t offset, uint64_t bytes,
+                                           QEMUIOVector *qiov, int flags)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    uint64_t end = offset + bytes;
+    uint64_t last = (end - 1) >> s->block_bits;
+    uint64_t index = offset >> s->block_bits;
+    BlkcacheBlock **blocks = NULL;
+    int i, n, ret = 0;
+
+    if (bytes == 0) {
+        return 0;
+    }
+
+    while (index <= last) {
+        BlkcacheBlock *blk = blkcache_lookup(s, index);
+
+        if (blk && blk->state != BLKCACHE_LOADING) {
+            blkcache_copy_to_qiov(s, blk, offset, bytes, qiov);
+            blkcache_touch(s, blk);
+            index++;
+            continue;
+        } else if (blk) {
+            qemu_co_queue_wait(&blk->waiters);
+            continue;
+        }
+
+        /* Fetch everything that is missing up to the next cached block */
+        if (!blocks) {
+            blocks = g_new(BlkcacheBlock *, last - index + 1);
+        }
+        n = blkcache_co_load(bs, index, MIN(last - index + 1, s->nb_slots / 2),
+                             true, false, blocks);
+        if (n < 0) {
+            ret = n;
+            goto out;
+        }
+        for (i = 0; i < n; i++) {
+            blkcache_copy_to_qiov(s, blocks[i], offset, bytes, qiov);
+        }
+        blkcache_load_done(bs, blocks, n);
+        index += n;
+    }
+
+    blkcache_read_ahead(bs, offset, end);
+
+out:
+    g_free(blocks);
+    return ret;
+}
+
+static int coroutine_fn blkcache_co_pwritev_through(BlockDriverState *bs,
+                                                    uint64_t offset,
+                                                    uint64_t bytes,
+                                                    QEMUIOVector *qiov,
+                                                    int flags)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheWrite w;
+    uint64_t index;
+    int ret;
+
+    blkcache_write_begin(s, &w, offset, bytes);
+    ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov, flags);
+
+    /* Bring the cached copies up to date, or forget them if the write left
+     * the content undefined */
+    for (index = offset >> s->block_bits;
+         index <= (offset + bytes - 1) >> s->block_bits; index++)
+    {
+        BlkcacheBlock *blk = blkcache_lookup(s, index);
+        if (!blk || blk->state == BLKCACHE_LOADING) {
+            continue;
+        }
+        assert(blk->state == BLKCACHE_CLEAN && !blk->busy);
+        if (ret < 0) {
+            blkcache_drop(s, blk);
+        } else {
+            blkcache_copy_from_qiov(s, blk, offset, bytes, qiov);
+        }
+    }
+
+    blkcache_write_end(s, &w);
+    return ret;
+}
+
+static int coroutine_fn blkcache_co_pwritev_back(BlockDriverState *bs,
+                                                 uint64_t offset,
+                                                 uint64_t bytes,
+                                                 QEMUIOVector *qiov)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    uint64_t end = offset + bytes;
+    uint64_t index = offset >> s->block_bits;
+    int n, ret;
+
+    while (index <= (end - 1) >> s->block_bits) {
+        BlkcacheBlock *blk = blkcache_lookup(s, index);
+        uint64_t start = index << s->block_bits;
+
+        if (blk && blk->busy) {
+            qemu_co_queue_wait(&blk->waiters);
+            continue;
+        }
+
+        if (!blk && offset <= start && start + s->block_size <= end) {
+            /* The whole block is overwritten, so there is nothing to read */
+            blk = blkcache_co_get_free(bs, true, &ret);
+            if (!blk) {
+                return ret;
+            }
+            if (blkcache_lookup(s, index)) {
+                blkcache_release(s, blk);
+                continue;
+            }
+            blkcache_insert(s, blk, index, BLKCACHE_DIRTY);
+        } else if (!blk) {
+            n = blkcache_co_load(bs, index, 1, true, false, &blk);
+            if (n < 0) {
+                return n;
+            } else if (n == 0) {
+                continue;
+            }
+            if (blkcache_is_stale(s, blk)) {
+                blkcache_load_done(bs, &blk, 1);
+                continue;
+            }
+            blk->state = BLKCACHE_DIRTY;
+            blk->busy = false;
+            s->nb_dirty++;
+            qemu_co_queue_restart_all(&blk->waiters);
+        } else if (blk->state == BLKCACHE_CLEAN) {
+            blk->state = BLKCACHE_DIRTY;
+            s->nb_dirty++;
+        }
+
+        blkcache_copy_from_qiov(s, blk, offset, bytes, qiov);
+        blkcache_touch(s, blk);
+        index++;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn blkcache_co_pwritev(BlockDriverState *bs,
+                                            uint64_t offset, uint64_t bytes,
+                                            QEMUIOVector *qiov, int flags)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+
+    if (bytes == 0) {
+        return 0;
+    }
+    if (s->write_back) {
+        return blkcache_co_pwritev_back(bs, offset, bytes, qiov);
+    }
+    return blkcache_co_pwritev_through(bs, offset, bytes, qiov, flags);
+}
+
+/* Forget the cached blocks in a range before it is zeroed or discarded.
+ * Dirty blocks that are only partly covered are written back first. */
+static int coroutine_fn blkcache_co_invalidate(BlockDriverState *bs,
+                                               uint64_t offset, uint64_t bytes)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    uint64_t index = offset >> s->block_bits;
+    int ret;
+
+    if (bytes == 0) {
+        return 0;
+    }
+
+    while (index <= (offset + bytes - 1) >> s->block_bits) {
+        BlkcacheBlock *blk = blkcache_lookup(s, index);
+        uint64_t start = index << s->block_bits;
+
+        if (!blk || blk->state == BLKCACHE_LOADING) {
+            /* Loads were marked stale by blkcache_write_begin() */
+            index++;
+            continue;
+        }
+        if (blk->busy) {
+            qemu_co_queue_wait(&blk->waiters);
+            continue;
+        }
+        if (blk->state == BLKCACHE_DIRTY &&
+            (start < offset || start + s->block_size > offset + bytes))
+        {
+            ret = blkcache_co_writeback(bs, &blk, 1);
+            if (ret < 0) {
+                return ret;
+            }
+            continue;
+        }
+        blkcache_drop(s, blk);
+        index++;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn blkcache_co_pwrite_zeroes(BlockDriverState *bs,
+                                                  int64_t offset, int count,
+                                                  BdrvRequestFlags flags)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheWrite w;
+    int ret;
+
+    blkcache_write_begin(s, &w, offset, count);
+    ret = blkcache_co_invalidate(bs, offset, count);
+    if (ret >= 0) {
+        ret = bdrv_co_pwrite_zeroes(bs->file, offset, count, flags);
+    }
+    blkcache_write_end(s, &w);
+
+    return ret;
+}
+
+static int coroutine_fn blkcache_co_pdiscard(BlockDriverState *bs,
+                                             int64_t offset, int count)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheWrite w;
+    int ret;
+
+    blkcache_write_begin(s, &w, offset, count);
+    ret = blkcache_co_invalidate(bs, offset, count);
+    if (ret >= 0) {
+        ret = bdrv_co_pdiscard(bs->file->bs, offset, count);
+    }
+    blkcache_write_end(s, &w);
+
+    return ret;
+}
+
+static int blkcache_index_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Write back every block that is dirty when this is called, merging blocks
+ * with consecutive indices into one request.  This is the flush_to_os step,
+ * so bs->file is only flushed once the data has reached it. */
+static int coroutine_fn blkcache_co_writeback_all(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheBlock *blk, **run;
+    uint64_t *indices;
+    int i, n, len, ret = 0;
+
+    if (!s->nb_dirty) {
+        return 0;
+    }
+
+    indices = g_new(uint64_t, s->nb_dirty);
+    n = 0;
+    QTAILQ_FOREACH(blk, &s->lru, next) {
+        if (blk->state == BLKCACHE_DIRTY) {
+            indices[n++] = blk->index;
+        }
+    }
+    assert(n == s->nb_dirty);
+    qsort(indices, n, sizeof(indices[0]), blkcache_index_cmp);
+    run = g_new(BlkcacheBlock *, n);
+
+    i = 0;
+    while (i < n) {
+        int r;
+
+        blk = blkcache_lookup(s, indices[i]);
+        if (blk && blk->busy) {
+            /* Someone else is writing it back, or it was replaced and is
+             * being loaded again; either way, wait and look again */
+            qemu_co_queue_wait(&blk->waiters);
+            continue;
+        }
+        if (!blk || blk->state != BLKCACHE_DIRTY) {
+            i++;
+            continue;
+        }
+
+        run[0] = blk;
+        for (len = 1; i + len < n; len++) {
+            blk = blkcache_lookup(s, indices[i + len]);
+            if (indices[i + len] != indices[i] + len || !blk ||
+                blk->busy || blk->state != BLKCACHE_DIRTY) {
+                break;
+            }
+            run[len] = blk;
+        }
+
+        r = blkcache_co_writeback(bs, run, len);
+        if (r < 0 && ret == 0) {
+            ret = r;
+        }
+        i += len;
+    }
+
+    g_free(run);
+    g_free(indices);
+    return ret;
+}
+
+static int64_t coroutine_fn blkcache_co_get_block_status(BlockDriverState *bs,
+                                                         int64_t sector_num,
+                                                         int nb_sectors,
+                                                         int *pnum,
+                                                         BlockDriverState **file)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+
+    *pnum = nb_sectors;
+    if (s->write_back) {
+        /* bs->file may not know about the data in the cache yet */
+        return BDRV_BLOCK_DATA;
+    }
+
+    *file = bs->file->bs;
+    return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID |
+           (sector_num << BDRV_SECTOR_BITS);
+}
+
+static int64_t blkcache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+/* Someone else may have changed the image, e.g. the source of a migration */
+static void blkcache_invalidate_cache(BlockDriverState *bs, Error **errp)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheBlock *blk, *next_blk;
+
+    QTAILQ_FOREACH_SAFE(blk, &s->lru, next, next_blk) {
+        if (blk->state == BLKCACHE_CLEAN) {
+            blkcache_drop(s, blk);
+        }
+    }
+}
+
+static int blkcache_reopen_prepare(BDRVReopenState *state,
+                                   BlockReopenQueue *queue, Error **errp)
+{
+    BDRVBlkcacheState *s = state->bs->opaque;
+
+    /* Other processes would never learn about the writes */
+    if (s->shared_map && (state->flags & BDRV_O_RDWR)) {
+        error_setg(errp, "Cannot make a node with a shared cache writable");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+#ifndef _WIN32
+/* Identify the image in the shared cache by its path, length and the
+ * generation the user gave, so that a changed image can be told apart */
+static uint64_t blkcache_shared_image_id(BlockDriverState *bs,
+                                         uint64_t generation, Error **errp)
+{
+    BlockDriverState *file = bs->file->bs;
+    char *path = realpath(file->filename, NULL);
+    const char *p;
+    int64_t len;
+    uint64_t id = 0xcbf29ce484222325ULL;
+
+    len = bdrv_getlength(file);
+    if (len < 0) {
+        error_setg_errno(errp, -len, "Could not get the image length");
+        free(path);
+        return 0;
+    }
+
+    /* FNV-1a */
+    for (p = path ? path : file->filename; *p; p++) {
+        id = (id ^ (uint8_t) *p) * 0x100000001b3ULL;
+    }
+    free(path);
+
+    id ^= len * 0x9E3779B97F4A7C15ULL;
+    id ^= generation * 0xC2B2AE3D27D4EB4FULL;
+
+    /* 0 marks empty slots */
+    return id ? id : 1;
+}
+
+static int blkcache_shared_open(BlockDriverState *bs, const char *filename,
+                                uint64_t size, uint64_t generation,
+                                Error **errp)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheSharedHeader header;
+    struct flock fl = {
+        .l_type     = F_WRLCK,
+        .l_whence   = SEEK_SET,
+    };
+    struct stat st;
+    uint64_t data_offset;
+    void *map;
+    int fd, ret;
+
+    s->shared_image = blkcache_shared_image_id(bs, generation, errp);
+    if (!s->shared_image) {
+        return -EIO;
+    }
+
+    fd = qemu_open(filename, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not open shared cache '%s'",
+                         filename);
+        return ret;
+    }
+
+    /* Whoever comes first creates the header, the others have to wait */
+    if (fcntl(fd, F_SETLKW, &fl) < 0 || fstat(fd, &st) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not lock shared cache '%s'",
+                         filename);
+        goto out;
+    }
+
+    if (st.st_size == 0) {
+        header = (BlkcacheSharedHeader) {
+            .magic      = BLKCACHE_SHARED_MAGIC,
+            .version    = BLKCACHE_SHARED_VERSION,
+            .block_size = s->block_size,
+            .nb_slots   = size / s->block_size,
+        };
+        if (header.nb_slots == 0) {
+            error_setg(errp, "Shared cache size must be at least one block");
+            ret = -EINVAL;
+            goto out;
+        }
+    } else if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+               header.magic != BLKCACHE_SHARED_MAGIC ||
+               header.version != BLKCACHE_SHARED_VERSION ||
+               header.nb_slots == 0)
+    {
+        error_setg(errp, "'%s' is not a shared cache", filename);
+        ret = -EINVAL;
+        goto out;
+    } else if (header.block_size != s->block_size) {
+        error_setg(errp, "Shared cache '%s' has a block size of %" PRIu32
+                   " bytes", filename, header.block_size);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    data_offset = ROUND_UP(BLKCACHE_SHARED_SLOTS_OFFSET +
+                           header.nb_slots * sizeof(BlkcacheSharedSlot),
+                           s->block_size);
+    if (header.nb_slots > (SIZE_MAX - data_offset) / s->block_size) {
+        error_setg(errp, "Shared cache is too large");
+        ret = -EINVAL;
+        goto out;
+    }
+    s->shared_map_size = data_offset + header.nb_slots * s->block_size;
+
+    if (st.st_size == 0) {
+        if (ftruncate(fd, s->shared_map_size) < 0 ||
+            pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+        {
+            ret = -errno;
+            error_setg_errno(errp, errno, "Could not create shared cache '%s'",
+                             filename);
+            goto out;
+        }
+    } else if ((uint64_t) st.st_size < s->shared_map_size) {
+        error_setg(errp, "Shared cache '%s' is truncated", filename);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    map = mmap(NULL, s->shared_map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+               fd, 0);
+    if (map == MAP_FAILED) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not map shared cache '%s'",
+                         filename);
+        goto out;
+    }
+
+    s->shared_map = map;
+    s->shared_slots = (void *) ((uint8_t *) map +
+                                BLKCACHE_SHARED_SLOTS_OFFSET);
+    s->shared_data = (uint8_t *) map + data_offset;
+    s->shared_nb_slots = header.nb_slots;
+    ret = 0;
+out:
+    /* Closing the file drops the lock, the mapping stays */
+    qemu_close(fd);
+    return ret;
+}
+#else
+static int blkcache_shared_open(BlockDriverState *bs, const char *filename,
+                                uint64_t size, uint64_t generation,
+                                Error **errp)
+{
+    error_setg(errp, "Shared caches are not supported on this host");
+    return -ENOTSUP;
+}
+#endif
+
+static int blkcache_open(BlockDriverState *bs, QDict *options, int flags,
+                         Error **errp)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    Error *local_err = NULL;
+    QemuOpts *opts;
+    const char *shared;
+    uint64_t cache_size;
+    int i, ret;
+
+    opts = qemu_opts_create(&blkcache_runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    cache_size = qemu_opt_get_size(opts, BLKCACHE_OPT_CACHE_SIZE,
+                                   BLKCACHE_DEFAULT_CACHE_SIZE);
+    s->block_size = qemu_opt_get_size(opts, BLKCACHE_OPT_BLOCK_SIZE,
+                                      BLKCACHE_DEFAULT_BLOCK_SIZE);
+    s->read_ahead = qemu_opt_get_size(opts, BLKCACHE_OPT_READ_AHEAD,
+                                      BLKCACHE_DEFAULT_READ_AHEAD);
+    s->write_back = qemu_opt_get_bool(opts, BLKCACHE_OPT_WRITE_BACK, false);
+
+    if (!is_power_of_2(s->block_size) || s->block_size < BDRV_SECTOR_SIZE ||
+        s->block_size > BLKCACHE_MAX_BLOCK_SIZE) {
+        error_setg(errp, "Block size must be a power of two between %d and "
+                   "%d", BDRV_SECTOR_SIZE, BLKCACHE_MAX_BLOCK_SIZE);
+        ret = -EINVAL;
+        goto out;
+    }
+    if (cache_size < 2 * s->block_size ||
+        cache_size / s->block_size > INT_MAX) {
+        error_setg(errp, "Cache size must be at least two blocks");
+        ret = -EINVAL;
+        goto out;
+    }
+    if (s->read_ahead > cache_size / 2) {
+        error_setg(errp, "Read-ahead must not exceed half the cache size");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    s->block_bits = ctz64(s->block_size);
+
+    shared = qemu_opt_get(opts, BLKCACHE_OPT_SHARED);
+    if (shared) {
+        if (flags & BDRV_O_RDWR) {
+            error_setg(errp, "A shared cache can only be used read-only");
+            ret = -EINVAL;
+            goto out;
+        }
+        ret = blkcache_shared_open(bs, shared,
+                qemu_opt_get_size(opts, BLKCACHE_OPT_SHARED_SIZE,
+                                  BLKCACHE_DEFAULT_SHARED_SIZE),
+                qemu_opt_get_number(opts, BLKCACHE_OPT_SHARED_GENERATION, 0),
+                errp);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    s->nb_slots = cache_size / s->block_size;
+    s->buffer = qemu_try_blockalign(bs->file->bs,
+                                    (size_t) s->nb_slots * s->block_size);
+    if (!s->buffer) {
+        error_setg(errp, "Could not allocate the cache");
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    s->slots = g_new0(BlkcacheBlock, s->nb_slots);
+    QTAILQ_INIT(&s->lru);
+    QTAILQ_INIT(&s->free);
+    for (i = 0; i < s->nb_slots; i++) {
+        s->slots[i].data = s->buffer + (size_t) i * s->block_size;
+        qemu_co_queue_init(&s->slots[i].waiters);
+        QTAILQ_INSERT_TAIL(&s->free, &s->slots[i], next);
+    }
+    s->blocks = g_hash_table_new(g_int64_hash, g_int64_equal);
+    qemu_co_queue_init(&s->free_wait);
+    QLIST_INIT(&s->writes);
+
+    bs->supported_zero_flags = BDRV_REQ_MAY_UNMAP &
+        bs->file->bs->supported_zero_flags;
+
+    ret = 0;
+    goto out;
+
+fail:
+#ifndef _WIN32
+    if (s->shared_map) {
+        munmap(s->shared_map, s->shared_map_size);
+        s->shared_map = NULL;
+    }
+#endif
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void blkcache_close(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+
+    /* bdrv_close() flushed already, so this is only left after errors */
+    if (s->nb_dirty) {
+        error_report("blkcache: %" PRIu64 " blocks could not be written back",
+                     s->nb_dirty);
+    }
+
+    g_hash_table_destroy(s->blocks);
+    g_free(s->slots);
+    qemu_vfree(s->buffer);
+#ifndef _WIN32
+    if (s->shared_map) {
+        munmap(s->shared_map, s->shared_map_size);
+    }
+#endif
+}
+
+static BlockDriver bdrv_blkcache = {
+    .format_name                = "blkcache",
+    .instance_size              = sizeof(BDRVBlkcacheState),
+
+    .bdrv_open                  = blkcache_open,
+    .bdrv_close                 = blkcache_close,
+    .bdrv_reopen_prepare        = blkcache_reopen_prepare,
+    .bdrv_getlength             = blkcache_getlength,
+    .has_variable_length        = true,
+
+    .bdrv_co_preadv             = blkcache_co_preadv,
+    .bdrv_co_pwritev            = blkcache_co_pwritev,
+    .bdrv_co_pwrite_zeroes      = blkcache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard           = blkcache_co_pdiscard,
+    .bdrv_co_flush_to_os        = blkcache_co_writeback_all,
+    .bdrv_co_get_block_status   = blkcache_co_get_block_status,
+    .bdrv_invalidate_cache      = blkcache_invalidate_cache,
+};
+
+static void bdrv_blkcache_init(void)
+{
+    bdrv_register(&bdrv_blkcache);
+}
+
+block_init(bdrv_blkcache_init);
@@ -1589,6 +1589,37 @@ int coroutine_fn blk_co_pwrite_zeroes(BlockBackend *blk, int64_t offset,
                           flags | BDRV_REQ_ZERO_WRITE);
 }
 
+int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
+                                   BlockBackend *blk_out, int64_t off_out,
+                                   int bytes, BdrvRequestFlags flags)
+{
+    int ret;
+
+    ret = blk_check_byte_request(blk_in, off_in, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = blk_check_byte_request(blk_out, off_out, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* The copy bypasses throttling and can't be made FUA, so leave these
+     * cases to the read/write fallback */
+    if (blk_in->public.throttle_state || blk_out->public.throttle_state ||
+        !blk_out->enable_write_cache) {
+        return -ENOTSUP;
+    }
+
+    bdrv_inc_in_flight(blk_bs(blk_in));
+    bdrv_inc_in_flight(blk_bs(blk_out));
+    ret = bdrv_co_copy_range(blk_in->root, off_in, blk_out->root, off_out,
+                             bytes, flags);
+    bdrv_dec_in_flight(blk_bs(blk_out));
+    bdrv_dec_in_flight(blk_bs(blk_in));
+    return ret;
+}
+
 int blk_pwrite_compressed(BlockBackend *blk, int64_t offset, const void *buf,
                           int count)
 {
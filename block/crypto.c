@@ -22,6 +22,7 @@
 
 #include "block/block_int.h"
 #include "sysemu/block-backend.h"
+#include "block/thread-pool.h"
 #include "crypto/block.h"
 #include "qapi/opts-visitor.h"
 #include "qapi-visit.h"
@@ -35,10 +36,13 @@
 #define BLOCK_CRYPTO_OPT_LUKS_HASH_ALG "hash-alg"
 #define BLOCK_CRYPTO_OPT_LUKS_ITER_TIME "iter-time"
 
+#define BLOCK_CRYPTO_MAX_THREADS 8
+
 typedef struct BlockCrypto BlockCrypto;
 
 struct BlockCrypto {
     QCryptoBlock *block;
+    int n_threads; /* ciphers of block, for as many thread pool jobs */
 };
 
 
@@ -299,6 +303,7 @@ static int block_crypto_open_generic(QCryptoBlockFormat format,
     int ret = -EINVAL;
     QCryptoBlockOpenOptions *open_opts = NULL;
     unsigned int cflags = 0;
+    long host_procs;
 
     opts = qemu_opts_create(opts_spec, NULL, 0, &error_abort);
     qemu_opts_absorb_qdict(opts, options, &local_err);
@@ -315,10 +320,13 @@ static int block_crypto_open_generic(QCryptoBlockFormat format,
     if (flags & BDRV_O_NO_IO) {
         cflags |= QCRYPTO_BLOCK_OPEN_NO_IO;
     }
+    host_procs = sysconf(_SC_NPROCESSORS_ONLN);
+    crypto->n_threads = MIN(MAX(host_procs, 1), BLOCK_CRYPTO_MAX_THREADS);
     crypto->block = qcrypto_block_open(open_opts,
                                        block_crypto_read_func,
                                        bs,
                                        cflags,
+                                       crypto->n_threads,
                                        errp);
 
     if (!crypto->block) {
@@ -393,7 +401,106 @@ static void block_crypto_close(BlockDriverState *bs)
 }
 
 
-#define BLOCK_CRYPTO_MAX_SECTORS 32
+/*
+ * Requests are processed in pieces of up to BLOCK_CRYPTO_MAX_SECTORS.
+ * Each piece is ciphered by up to n_threads thread pool jobs of at least
+ * BLOCK_CRYPTO_MIN_JOB bytes, while the coroutine waits.  Smaller pieces
+ * are ciphered in the coroutine, which costs less than the thread hop.
+ */
+#define BLOCK_CRYPTO_MAX_SECTORS 2048
+#define BLOCK_CRYPTO_MIN_JOB (64 * 1024)
+
+typedef struct BlockCryptoBatch {
+    Coroutine *co;
+    int pending;
+    int ret;
+    bool waiting;
+} BlockCryptoBatch;
+
+typedef struct BlockCryptoJob {
+    QCryptoBlock *block;
+    bool encrypt;
+    uint64_t sector_num;
+    uint8_t *buf;
+    size_t len;
+    BlockCryptoBatch *batch;
+} BlockCryptoJob;
+
+static int block_crypto_job_func(void *opaque)
+{
+    BlockCryptoJob *job = opaque;
+    int ret;
+
+    if (job->encrypt) {
+        ret = qcrypto_block_encrypt(job->block, job->sector_num,
+                                    job->buf, job->len, NULL);
+    } else {
+        ret = qcrypto_block_decrypt(job->block, job->sector_num,
+                                    job->buf, job->len, NULL);
+    }
+    return ret < 0 ? -EIO : 0;
+}
+
+static void block_crypto_job_cb(void *opaque, int ret)
+{
+    BlockCryptoJob *job = opaque;
+    BlockCryptoBatch *batch = job->batch;
+
+    if (ret < 0 && !batch->ret) {
+        batch->ret = ret;
+    }
+    if (--batch->pending == 0 && batch->waiting) {
+        qemu_coroutine_enter(batch->co);
+    }
+}
+
+/* Encrypt or decrypt the nr_sectors sectors in buf in place */
+static coroutine_fn int
+block_crypto_co_cipher(BlockDriverState *bs, bool encrypt,
+                       int64_t sector_num, uint8_t *buf, int nr_sectors)
+{
+    BlockCrypto *crypto = bs->opaque;
+    size_t len = nr_sectors * 512;
+    int njobs = MIN(crypto->n_threads, len / BLOCK_CRYPTO_MIN_JOB);
+    int job_sectors, i;
+    BlockCryptoJob jobs[BLOCK_CRYPTO_MAX_THREADS];
+    BlockCryptoBatch batch = { .co = qemu_coroutine_self() };
+    ThreadPool *pool;
+
+    if (njobs <= 1) {
+        BlockCryptoJob job = {
+            .block = crypto->block,
+            .encrypt = encrypt,
+            .sector_num = sector_num,
+            .buf = buf,
+            .len = len,
+        };
+        return block_crypto_job_func(&job);
+    }
+
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    job_sectors = DIV_ROUND_UP(nr_sectors, njobs);
+    for (i = 0; i < njobs && i * job_sectors < nr_sectors; i++) {
+        jobs[i] = (BlockCryptoJob) {
+            .block = crypto->block,
+            .encrypt = encrypt,
+            .sector_num = sector_num + i * job_sectors,
+            .buf = buf + (size_t)i * job_sectors * 512,
+            .len = MIN(job_sectors, nr_sectors - i * job_sectors) * 512,
+            .batch = &batch,
+        };
+        batch.pending++;
+        thread_pool_submit_aio(pool, block_crypto_job_func, &jobs[i],
+                               block_crypto_job_cb, &jobs[i]);
+    }
+
+    /* completions run from a bottom half, never inside the submit */
+    batch.waiting = true;
+    qemu_coroutine_yield();
+    assert(batch.pending == 0);
+
+    return batch.ret;
+}
 
 static coroutine_fn int
 block_crypto_co_readv(BlockDriverState *bs, int64_t sector_num,
@@ -439,11 +546,9 @@ block_crypto_co_readv(BlockDriverState *bs, int64_t sector_num,
             goto cleanup;
         }
 
-        if (qcrypto_block_decrypt(crypto->block,
-                                  sector_num,
-                                  cipher_data, cur_nr_sectors * 512,
-                                  NULL) < 0) {
-            ret = -EIO;
+        ret = block_crypto_co_cipher(bs, false, sector_num,
+                                     cipher_data, cur_nr_sectors);
+        if (ret < 0) {
             goto cleanup;
         }
 
@@ -500,11 +605,9 @@ block_crypto_co_writev(BlockDriverState *bs, int64_t sector_num,
         qemu_iovec_to_buf(qiov, bytes_done,
                           cipher_data, cur_nr_sectors * 512);
 
-        if (qcrypto_block_encrypt(crypto->block,
-                                  sector_num,
-                                  cipher_data, cur_nr_sectors * 512,
-                                  NULL) < 0) {
-            ret = -EIO;
+        ret = block_crypto_co_cipher(bs, true, sector_num,
+                                     cipher_data, cur_nr_sectors);
+        if (ret < 0) {
             goto cleanup;
         }
 
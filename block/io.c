@@ -1654,6 +1654,125 @@ int coroutine_fn bdrv_co_pwrite_zeroes(BdrvChild *child, int64_t offset,
                            BDRV_REQ_ZERO_WRITE | flags);
 }
 
+static int coroutine_fn bdrv_co_copy_range_internal(BdrvChild *src,
+                                                    uint64_t src_offset,
+                                                    BdrvChild *dst,
+                                                    uint64_t dst_offset,
+                                                    uint64_t bytes,
+                                                    BdrvRequestFlags flags,
+                                                    bool recurse_src)
+{
+    BlockDriverState *src_bs, *dst_bs;
+    BdrvTrackedRequest req;
+    int ret;
+
+    if (!src || !src->bs || !src->bs->drv ||
+        !dst || !dst->bs || !dst->bs->drv) {
+        return -ENOMEDIUM;
+    }
+    src_bs = src->bs;
+    dst_bs = dst->bs;
+
+    ret = bdrv_check_byte_request(src_bs, src_offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = bdrv_check_byte_request(dst_bs, dst_offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+    if (dst_bs->read_only) {
+        return -EPERM;
+    }
+    assert(!(dst_bs->open_flags & BDRV_O_INACTIVE));
+
+    /* Unaligned requests would need a read-modify-write cycle, and encrypted
+     * data can't be copied as is; leave both to the caller's fallback. */
+    if (!src_bs->drv->bdrv_co_copy_range_from ||
+        !dst_bs->drv->bdrv_co_copy_range_to ||
+        src_bs->encrypted || dst_bs->encrypted ||
+        !QEMU_IS_ALIGNED(src_offset | bytes, src_bs->bl.request_alignment) ||
+        !QEMU_IS_ALIGNED(dst_offset | bytes, dst_bs->bl.request_alignment)) {
+        return -ENOTSUP;
+    }
+
+    if (recurse_src) {
+        bdrv_inc_in_flight(src_bs);
+        tracked_request_begin(&req, src_bs, src_offset, bytes,
+                              BDRV_TRACKED_READ);
+        if (!(flags & BDRV_REQ_NO_SERIALISING)) {
+            wait_serialising_requests(&req);
+        }
+
+        ret = src_bs->drv->bdrv_co_copy_range_from(src_bs, src, src_offset,
+                                                   dst, dst_offset, bytes,
+                                                   flags);
+
+        tracked_request_end(&req);
+        bdrv_dec_in_flight(src_bs);
+    } else {
+        bdrv_inc_in_flight(dst_bs);
+        tracked_request_begin(&req, dst_bs, dst_offset, bytes,
+                              BDRV_TRACKED_WRITE);
+        wait_serialising_requests(&req);
+
+        ret = notifier_with_return_list_notify(&dst_bs->before_write_notifiers,
+                                               &req);
+        if (!ret) {
+            ret = dst_bs->drv->bdrv_co_copy_range_to(dst_bs, src, src_offset,
+                                                     dst, dst_offset, bytes,
+                                                     flags);
+        }
+
+        ++dst_bs->write_gen;
+        bdrv_set_dirty(dst_bs, dst_offset >> BDRV_SECTOR_BITS,
+                       DIV_ROUND_UP(dst_offset + bytes, BDRV_SECTOR_SIZE) -
+                       (dst_offset >> BDRV_SECTOR_BITS));
+        if (dst_bs->wr_highest_offset < dst_offset + bytes) {
+            dst_bs->wr_highest_offset = dst_offset + bytes;
+        }
+
+        tracked_request_end(&req);
+        bdrv_dec_in_flight(dst_bs);
+    }
+
+    return ret;
+}
+
+/* Copy range from src to dst; the request is tracked on src and passed on
+ * towards the protocol driver of the source. */
+int coroutine_fn bdrv_co_copy_range_from(BdrvChild *src, uint64_t src_offset,
+                                         BdrvChild *dst, uint64_t dst_offset,
+                                         uint64_t bytes,
+                                         BdrvRequestFlags flags)
+{
+    trace_bdrv_co_copy_range_from(src, src_offset, dst, dst_offset, bytes,
+                                  flags);
+    return bdrv_co_copy_range_internal(src, src_offset, dst, dst_offset,
+                                       bytes, flags, true);
+}
+
+/* Copy range from src to dst; the request is tracked on dst, which sees it
+ * as a write, and passed on towards the protocol driver of the
+ * destination. */
+int coroutine_fn bdrv_co_copy_range_to(BdrvChild *src, uint64_t src_offset,
+                                       BdrvChild *dst, uint64_t dst_offset,
+                                       uint64_t bytes, BdrvRequestFlags flags)
+{
+    trace_bdrv_co_copy_range_to(src, src_offset, dst, dst_offset, bytes,
+                                flags);
+    return bdrv_co_copy_range_internal(src, src_offset, dst, dst_offset,
+                                       bytes, flags, false);
+}
+
+int coroutine_fn bdrv_co_copy_range(BdrvChild *src, uint64_t src_offset,
+                                    BdrvChild *dst, uint64_t dst_offset,
+                                    uint64_t bytes, BdrvRequestFlags flags)
+{
+    return bdrv_co_copy_range_from(src, src_offset, dst, dst_offset,
+                                   bytes, flags);
+}
+
 /*
  * Flush ALL BDSes regardless of if they are reachable via a BlkBackend or not.
  */
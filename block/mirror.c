@@ -22,10 +22,11 @@
 #include "qemu/bitmap.h"
 
 #define SLICE_TIME    100000000ULL /* ns */
-#define MAX_IN_FLIGHT 16
+#define MAX_IN_FLIGHT 64
+#define DEFAULT_IN_FLIGHT 16
 #define MAX_IO_SECTORS ((1 << 20) >> BDRV_SECTOR_BITS) /* 1 Mb */
 #define DEFAULT_MIRROR_BUF_SIZE \
-    (MAX_IN_FLIGHT * MAX_IO_SECTORS * BDRV_SECTOR_SIZE)
+    (DEFAULT_IN_FLIGHT * MAX_IO_SECTORS * BDRV_SECTOR_SIZE)
 
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
@@ -69,6 +70,15 @@ typedef struct MirrorBlockJob {
     bool waiting_for_io;
     int target_cluster_sectors;
     int max_iov;
+
+    /* Copy requests allowed in flight, adjusted by mirror_adjust_depth() */
+    int max_in_flight;
+    /* Lowest recently seen copy latency, in ns per sector */
+    uint64_t lat_base;
+    /* Copy latency accumulated since lat_window_start */
+    int64_t lat_window_start;
+    uint64_t lat_window_ns;
+    int64_t lat_window_sectors;
 } MirrorBlockJob;
 
 typedef struct MirrorOp {
@@ -76,6 +86,8 @@ typedef struct MirrorOp {
     QEMUIOVector qiov;
     int64_t sector_num;
     int nb_sectors;
+    /* Submission time of copy requests, 0 for zero and discard requests */
+    int64_t start_ns;
 } MirrorOp;
 
 static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
@@ -118,6 +130,11 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
             bitmap_set(s->cow_bitmap, chunk_num, nb_chunks);
         }
         s->common.offset += (uint64_t)op->nb_sectors * BDRV_SECTOR_SIZE;
+        if (op->start_ns) {
+            s->lat_window_ns += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                op->start_ns;
+            s->lat_window_sectors += op->nb_sectors;
+        }
     }
 
     qemu_iovec_destroy(&op->qiov);
@@ -265,6 +282,7 @@ static int mirror_do_read(MirrorBlockJob *s, int64_t sector_num,
     op->s = s;
     op->sector_num = sector_num;
     op->nb_sectors = nb_sectors;
+    op->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
     /* Now make a QEMUIOVector taking enough granularity-sized chunks
      * from s->buf_free.
@@ -317,6 +335,45 @@ static void mirror_do_zero_or_discard(MirrorBlockJob *s,
     }
 }
 
+/* Once per SLICE_TIME, compare the average latency of the copies that
+ * completed in that time with the lowest one seen recently.  While the
+ * source and target keep up, allow one more request in flight; when
+ * requests start queueing up, halve the depth.  mirror_iteration() splits
+ * the buffer among fewer, larger requests when the depth is lower.
+ */
+static void mirror_adjust_depth(MirrorBlockJob *s)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    uint64_t lat;
+
+    if (now - s->lat_window_start < SLICE_TIME) {
+        return;
+    }
+    if (s->lat_window_sectors == 0) {
+        s->lat_window_start = now;
+        return;
+    }
+
+    lat = s->lat_window_ns / s->lat_window_sectors;
+    if (s->lat_base == 0 || lat < s->lat_base) {
+        s->lat_base = lat;
+    } else {
+        /* Let the baseline follow slow changes of the devices */
+        s->lat_base += (lat - s->lat_base) >> 4;
+    }
+
+    if (lat > 4 * s->lat_base) {
+        s->max_in_flight = MAX(s->max_in_flight / 2, 1);
+    } else if (lat < 2 * s->lat_base && s->max_in_flight < MAX_IN_FLIGHT) {
+        s->max_in_flight++;
+    }
+    trace_mirror_adjust_depth(s, lat, s->lat_base, s->max_in_flight);
+
+    s->lat_window_start = now;
+    s->lat_window_ns = 0;
+    s->lat_window_sectors = 0;
+}
+
 static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
 {
     BlockDriverState *source = blk_bs(s->common.blk);
@@ -327,8 +384,11 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     int64_t end = s->bdev_length / BDRV_SECTOR_SIZE;
     int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
-    int max_io_sectors = MAX((s->buf_size >> BDRV_SECTOR_BITS) / MAX_IN_FLIGHT,
-                             MAX_IO_SECTORS);
+    int max_io_sectors;
+
+    mirror_adjust_depth(s);
+    max_io_sectors = MAX((s->buf_size >> BDRV_SECTOR_BITS) / s->max_in_flight,
+                         MAX_IO_SECTORS);
 
     sector_num = bdrv_dirty_iter_next(s->dbi);
     if (sector_num < 0) {
@@ -414,7 +474,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
             }
         }
 
-        while (s->in_flight >= MAX_IN_FLIGHT) {
+        while (s->in_flight >= s->max_in_flight) {
             trace_mirror_yield_in_flight(s, sector_num, s->in_flight);
             mirror_wait_for_io(s);
         }
@@ -576,7 +636,7 @@ static int coroutine_fn mirror_dirty_init(MirrorBlockJob *s)
                 return 0;
             }
 
-            if (s->in_flight >= MAX_IN_FLIGHT) {
+            if (s->in_flight >= s->max_in_flight) {
                 trace_mirror_yield(s, s->in_flight, s->buf_free_count, -1);
                 mirror_wait_for_io(s);
                 continue;
@@ -691,6 +751,7 @@ static void coroutine_fn mirror_run(void *opaque)
     mirror_free_init(s);
 
     s->last_pause_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    s->lat_window_start = s->last_pause_ns;
     if (!s->is_none_mode) {
         ret = mirror_dirty_init(s);
         if (ret < 0 || block_job_is_cancelled(&s->common)) {
@@ -728,7 +789,7 @@ static void coroutine_fn mirror_run(void *opaque)
         delta = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - s->last_pause_ns;
         if (delta < SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight >= MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, s->in_flight, s->buf_free_count, cnt);
                 mirror_wait_for_io(s);
@@ -996,6 +1057,7 @@ static void mirror_start_job(const char *job_id, BlockDriverState *bs,
     s->base = base;
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
+    s->max_in_flight = DEFAULT_IN_FLIGHT;
     s->unmap = unmap;
     if (auto_complete) {
         s->should_complete = true;
@@ -28,47 +28,60 @@
  */
 
 #include "qemu/osdep.h"
+#include "qapi/error.h"
 #include "nbd-client.h"
 
-#define HANDLE_TO_INDEX(bs, handle) ((handle) ^ ((uint64_t)(intptr_t)bs))
-#define INDEX_TO_HANDLE(bs, index)  ((index)  ^ ((uint64_t)(intptr_t)bs))
+#define HANDLE_TO_INDEX(conn, handle) ((handle) ^ ((uint64_t)(intptr_t)conn))
+#define INDEX_TO_HANDLE(conn, index)  ((index)  ^ ((uint64_t)(intptr_t)conn))
 
-static void nbd_recv_coroutines_enter_all(NBDClientSession *s)
+static void nbd_recv_coroutines_enter_all(NBDClientConnection *conn)
 {
     int i;
 
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->recv_coroutine[i]) {
-            qemu_coroutine_enter(s->recv_coroutine[i]);
+        if (conn->recv_coroutine[i]) {
+            qemu_coroutine_enter(conn->recv_coroutine[i]);
         }
     }
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_connection_detach_aio_context(NBDClientConnection *conn,
+                                              AioContext *ctx)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
+    aio_set_fd_handler(ctx, conn->sioc->fd, false, NULL, NULL, NULL);
+}
+
+static void nbd_reply_ready(void *opaque);
 
-    if (!client->ioc) { /* Already closed */
+static void nbd_connection_attach_aio_context(NBDClientConnection *conn,
+                                              AioContext *ctx)
+{
+    aio_set_fd_handler(ctx, conn->sioc->fd, false, nbd_reply_ready, NULL,
+                       conn);
+}
+
+static void nbd_teardown_connection(NBDClientConnection *conn)
+{
+    if (!conn->ioc) { /* Already closed */
         return;
     }
 
     /* finish any pending coroutines */
-    qio_channel_shutdown(client->ioc,
+    qio_channel_shutdown(conn->ioc,
                          QIO_CHANNEL_SHUTDOWN_BOTH,
                          NULL);
-    nbd_recv_coroutines_enter_all(client);
+    nbd_recv_coroutines_enter_all(conn);
 
-    nbd_client_detach_aio_context(bs);
-    object_unref(OBJECT(client->sioc));
-    client->sioc = NULL;
-    object_unref(OBJECT(client->ioc));
-    client->ioc = NULL;
+    nbd_connection_detach_aio_context(conn, bdrv_get_aio_context(conn->bs));
+    object_unref(OBJECT(conn->sioc));
+    conn->sioc = NULL;
+    object_unref(OBJECT(conn->ioc));
+    conn->ioc = NULL;
 }
 
 static void nbd_reply_ready(void *opaque)
 {
-    BlockDriverState *bs = opaque;
-    NBDClientSession *s = nbd_get_client_session(bs);
+    NBDClientConnection *s = opaque;
     uint64_t i;
     int ret;
 
@@ -105,21 +118,20 @@ static void nbd_reply_ready(void *opaque)
     }
 
 fail:
-    nbd_teardown_connection(bs);
+    nbd_teardown_connection(s);
 }
 
 static void nbd_restart_write(void *opaque)
 {
-    BlockDriverState *bs = opaque;
+    NBDClientConnection *s = opaque;
 
-    qemu_coroutine_enter(nbd_get_client_session(bs)->send_coroutine);
+    qemu_coroutine_enter(s->send_coroutine);
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+static int nbd_co_send_request(NBDClientConnection *s,
                                NBDRequest *request,
                                QEMUIOVector *qiov)
 {
-    NBDClientSession *s = nbd_get_client_session(bs);
     AioContext *aio_context;
     int rc, ret, i;
 
@@ -142,10 +154,10 @@ static int nbd_co_send_request(BlockDriverState *bs,
     }
 
     s->send_coroutine = qemu_coroutine_self();
-    aio_context = bdrv_get_aio_context(bs);
+    aio_context = bdrv_get_aio_context(s->bs);
 
     aio_set_fd_handler(aio_context, s->sioc->fd, false,
-                       nbd_reply_ready, nbd_restart_write, bs);
+                       nbd_reply_ready, nbd_restart_write, s);
     if (qiov) {
         qio_channel_set_cork(s->ioc, true);
         rc = nbd_send_request(s->ioc, request);
@@ -161,88 +173,175 @@ static int nbd_co_send_request(BlockDriverState *bs,
         rc = nbd_send_request(s->ioc, request);
     }
     aio_set_fd_handler(aio_context, s->sioc->fd, false,
-                       nbd_reply_ready, NULL, bs);
+                       nbd_reply_ready, NULL, s);
     s->send_coroutine = NULL;
+    if (rc < 0) {
+        /* The stream is out of sync now; the read handler sees the
+         * shutdown and tears the connection down. */
+        s->failed = true;
+        qio_channel_shutdown(s->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+    }
     qemu_co_mutex_unlock(&s->send_mutex);
     return rc;
 }
 
-static void nbd_co_receive_reply(NBDClientSession *s,
+static void nbd_co_receive_reply(NBDClientConnection *s,
                                  NBDRequest *request,
                                  NBDReply *reply,
-                                 QEMUIOVector *qiov)
+                                 QEMUIOVector *qiov,
+                                 NBDExtent *extent)
 {
+    uint32_t error = 0;
     int ret;
 
-    /* Wait until we're woken up by the read handler.  TODO: perhaps
-     * peek at the next reply and avoid yielding if it's ours?  */
-    qemu_coroutine_yield();
-    *reply = s->reply;
-    if (reply->handle != request->handle ||
-        !s->ioc) {
-        reply->error = EIO;
-    } else {
-        if (qiov && reply->error == 0) {
-            ret = nbd_wr_syncv(s->ioc, qiov->iov, qiov->niov, request->len,
-                               true);
-            if (ret != request->len) {
-                reply->error = EIO;
+    /* A structured reply can come in several chunks, each with its own
+     * header; the first error chunk decides the result. */
+    for (;;) {
+        /* Wait until we're woken up by the read handler.  TODO: perhaps
+         * peek at the next reply and avoid yielding if it's ours?  */
+        qemu_coroutine_yield();
+        *reply = s->reply;
+        if (reply->handle != request->handle ||
+            !s->ioc) {
+            reply->error = EIO;
+            return;
+        }
+
+        if (!reply->structured) {
+            if (qiov && reply->error == 0) {
+                ret = nbd_wr_syncv(s->ioc, qiov->iov, qiov->niov,
+                                   request->len, true);
+                if (ret != request->len) {
+                    ret = -EIO;
+                }
+            } else {
+                ret = 0;
             }
+        } else {
+            ret = nbd_receive_reply_chunk(s->ioc, request, reply, qiov,
+                                          extent);
+            if (!error) {
+                error = reply->error;
+            }
+        }
+        if (ret < 0) {
+            reply->error = EIO;
+            s->failed = true;
+            qio_channel_shutdown(s->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
         }
 
         /* Tell the read handler to read another header.  */
         s->reply.handle = 0;
+
+        if (ret < 0 || !reply->structured) {
+            return;
+        }
+        if (reply->flags & NBD_REPLY_FLAG_DONE) {
+            reply->error = error;
+            return;
+        }
+    }
+}
+
+/* The least loaded connection that is still up, or NULL if all of them are
+ * closed.  Ties are broken round-robin so that the requests of a single
+ * coroutine stripe over the connections too. */
+static NBDClientConnection *nbd_pick_connection(NBDClientSession *s)
+{
+    NBDClientConnection *best = NULL;
+    int i;
+
+    for (i = 0; i < s->num_conns; i++) {
+        NBDClientConnection *conn = &s->conn[(s->next_conn + i) % s->num_conns];
+
+        if (conn->ioc && !conn->failed &&
+            (!best || conn->in_flight < best->in_flight)) {
+            best = conn;
+        }
     }
+    s->next_conn = (s->next_conn + 1) % s->num_conns;
+    return best;
 }
 
-static void nbd_coroutine_start(NBDClientSession *s,
-                                NBDRequest *request)
+static NBDClientConnection *nbd_coroutine_start(NBDClientSession *s,
+                                                NBDRequest *request)
 {
-    /* Poor man semaphore.  The free_sema is locked when no other request
-     * can be accepted, and unlocked after receiving one reply.  */
-    if (s->in_flight == MAX_NBD_REQUESTS) {
+    NBDClientConnection *conn;
+
+    /* Poor man semaphore.  free_sema is waited on when no connection can
+     * accept another request, and woken after receiving one reply.  */
+    for (;;) {
+        conn = nbd_pick_connection(s);
+        if (!conn || conn->in_flight < MAX_NBD_REQUESTS) {
+            break;
+        }
         qemu_co_queue_wait(&s->free_sema);
-        assert(s->in_flight < MAX_NBD_REQUESTS);
     }
-    s->in_flight++;
+    if (conn) {
+        conn->in_flight++;
+    }
 
-    /* s->recv_coroutine[i] is set as soon as we get the send_lock.  */
+    /* conn->recv_coroutine[i] is set as soon as we get the send_lock.  */
+    return conn;
 }
 
-static void nbd_coroutine_end(NBDClientSession *s,
+static void nbd_coroutine_end(NBDClientSession *s, NBDClientConnection *conn,
                               NBDRequest *request)
 {
-    int i = HANDLE_TO_INDEX(s, request->handle);
-    s->recv_coroutine[i] = NULL;
-    if (s->in_flight-- == MAX_NBD_REQUESTS) {
+    int i = HANDLE_TO_INDEX(conn, request->handle);
+    conn->recv_coroutine[i] = NULL;
+    if (conn->in_flight-- == MAX_NBD_REQUESTS) {
         qemu_co_queue_next(&s->free_sema);
     }
 }
 
+/* Send a request and wait for its reply, on whatever connection is
+ * available.  All requests are idempotent, so one whose connection went
+ * away before the reply arrived is simply sent again. */
+static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
+                          QEMUIOVector *write_qiov, QEMUIOVector *read_qiov,
+                          NBDExtent *extent)
+{
+    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientConnection *conn;
+    NBDReply reply;
+    int ret;
+
+    for (;;) {
+        conn = nbd_coroutine_start(client, request);
+        if (!conn) {
+            return -EPIPE;
+        }
+
+        ret = nbd_co_send_request(conn, request, write_qiov);
+        if (ret < 0) {
+            reply.error = -ret;
+        } else {
+            nbd_co_receive_reply(conn, request, &reply, read_qiov, extent);
+        }
+        nbd_coroutine_end(client, conn, request);
+
+        if (reply.error == 0 || client->num_conns == 1 ||
+            (conn->ioc && !conn->failed)) {
+            /* Success, no other connection, or an error from the server */
+            return -reply.error;
+        }
+    }
+}
+
 int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
                          uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
     NBDRequest request = {
         .type = NBD_CMD_READ,
         .from = offset,
         .len = bytes,
     };
-    NBDReply reply;
-    ssize_t ret;
 
     assert(bytes <= NBD_MAX_BUFFER_SIZE);
     assert(!flags);
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(client, &request, &reply, qiov);
-    }
-    nbd_coroutine_end(client, &request);
-    return -reply.error;
+    return nbd_co_request(bs, &request, NULL, qiov, NULL);
 }
 
 int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
@@ -254,8 +353,6 @@ int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
         .from = offset,
         .len = bytes,
     };
-    NBDReply reply;
-    ssize_t ret;
 
     if (flags & BDRV_REQ_FUA) {
         assert(client->nbdflags & NBD_FLAG_SEND_FUA);
@@ -264,28 +361,18 @@ int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
 
     assert(bytes <= NBD_MAX_BUFFER_SIZE);
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, qiov);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
-    }
-    nbd_coroutine_end(client, &request);
-    return -reply.error;
+    return nbd_co_request(bs, &request, qiov, NULL, NULL);
 }
 
 int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
                                 int count, BdrvRequestFlags flags)
 {
-    ssize_t ret;
     NBDClientSession *client = nbd_get_client_session(bs);
     NBDRequest request = {
         .type = NBD_CMD_WRITE_ZEROES,
         .from = offset,
         .len = count,
     };
-    NBDReply reply;
 
     if (!(client->nbdflags & NBD_FLAG_SEND_WRITE_ZEROES)) {
         return -ENOTSUP;
@@ -299,40 +386,24 @@ int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
         request.flags |= NBD_CMD_FLAG_NO_HOLE;
     }
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
-    }
-    nbd_coroutine_end(client, &request);
-    return -reply.error;
+    return nbd_co_request(bs, &request, NULL, NULL, NULL);
 }
 
 int nbd_client_co_flush(BlockDriverState *bs)
 {
     NBDClientSession *client = nbd_get_client_session(bs);
     NBDRequest request = { .type = NBD_CMD_FLUSH };
-    NBDReply reply;
-    ssize_t ret;
 
     if (!(client->nbdflags & NBD_FLAG_SEND_FLUSH)) {
         return 0;
     }
 
+    /* With several connections, the server's NBD_FLAG_CAN_MULTI_CONN
+     * guarantees that this also covers writes completed on the others. */
     request.from = 0;
     request.len = 0;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
-    }
-    nbd_coroutine_end(client, &request);
-    return -reply.error;
+    return nbd_co_request(bs, &request, NULL, NULL, NULL);
 }
 
 int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int count)
@@ -343,61 +414,122 @@ int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int count)
         .from = offset,
         .len = count,
     };
-    NBDReply reply;
-    ssize_t ret;
 
     if (!(client->nbdflags & NBD_FLAG_SEND_TRIM)) {
         return 0;
     }
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL);
+    return nbd_co_request(bs, &request, NULL, NULL, NULL);
+}
+
+int64_t coroutine_fn nbd_client_co_get_block_status(BlockDriverState *bs,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum,
+                                                    BlockDriverState **file)
+{
+    NBDClientSession *client = nbd_get_client_session(bs);
+    uint64_t offset = sector_num << BDRV_SECTOR_BITS;
+    NBDExtent extent = { 0 };
+    NBDRequest request = {
+        .type = NBD_CMD_BLOCK_STATUS,
+        .flags = NBD_CMD_FLAG_REQ_ONE,
+        .from = offset,
+    };
+    int64_t ret;
+
+    *pnum = nb_sectors;
+    *file = bs;
+    if (!client->ext.base_allocation || offset >= client->size) {
+        return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID | offset;
+    }
+
+    request.len = MIN(MIN((uint64_t) nb_sectors << BDRV_SECTOR_BITS,
+                          client->size - offset),
+                      QEMU_ALIGN_DOWN(INT32_MAX, BDRV_SECTOR_SIZE));
+    ret = nbd_co_request(bs, &request, NULL, NULL, &extent);
     if (ret < 0) {
-        reply.error = -ret;
+        return ret;
+    }
+    if (extent.length == 0 || extent.length > request.len) {
+        return -EIO;
+    }
+
+    if (offset + extent.length == client->size) {
+        /* The last sector may be partial */
+        *pnum = DIV_ROUND_UP(extent.length, BDRV_SECTOR_SIZE);
+    } else if (extent.length >= BDRV_SECTOR_SIZE) {
+        *pnum = extent.length >> BDRV_SECTOR_BITS;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
+        /* Can't describe less than a sector, so play safe */
+        *pnum = 1;
+        return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID | offset;
     }
-    nbd_coroutine_end(client, &request);
-    return -reply.error;
+    *pnum = MIN(*pnum, nb_sectors);
 
+    /* A hole that does not read as zeroes still has to be read */
+    if (!(extent.flags & NBD_STATE_ZERO)) {
+        return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID | offset;
+    }
+    if (extent.flags & NBD_STATE_HOLE) {
+        return BDRV_BLOCK_ZERO;
+    }
+    return BDRV_BLOCK_DATA | BDRV_BLOCK_ZERO | BDRV_BLOCK_OFFSET_VALID | offset;
 }
 
 void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
-    aio_set_fd_handler(bdrv_get_aio_context(bs),
-                       nbd_get_client_session(bs)->sioc->fd,
-                       false, NULL, NULL, NULL);
+    NBDClientSession *client = nbd_get_client_session(bs);
+    int i;
+
+    for (i = 0; i < client->num_conns; i++) {
+        if (client->conn[i].sioc) {
+            nbd_connection_detach_aio_context(&client->conn[i],
+                                              bdrv_get_aio_context(bs));
+        }
+    }
 }
 
 void nbd_client_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
-    aio_set_fd_handler(new_context, nbd_get_client_session(bs)->sioc->fd,
-                       false, nbd_reply_ready, NULL, bs);
+    NBDClientSession *client = nbd_get_client_session(bs);
+    int i;
+
+    for (i = 0; i < client->num_conns; i++) {
+        if (client->conn[i].sioc) {
+            nbd_connection_attach_aio_context(&client->conn[i], new_context);
+        }
+    }
 }
 
 void nbd_client_close(BlockDriverState *bs)
 {
     NBDClientSession *client = nbd_get_client_session(bs);
     NBDRequest request = { .type = NBD_CMD_DISC };
+    int i;
 
-    if (client->ioc == NULL) {
-        return;
-    }
+    for (i = 0; i < client->num_conns; i++) {
+        NBDClientConnection *conn = &client->conn[i];
+
+        if (conn->ioc == NULL) {
+            continue;
+        }
 
-    nbd_send_request(client->ioc, &request);
+        nbd_send_request(conn->ioc, &request);
 
-    nbd_teardown_connection(bs);
+        nbd_teardown_connection(conn);
+    }
 }
 
-int nbd_client_init(BlockDriverState *bs,
-                    QIOChannelSocket *sioc,
-                    const char *export,
-                    QCryptoTLSCreds *tlscreds,
-                    const char *hostname,
-                    Error **errp)
+static int nbd_client_connect(BlockDriverState *bs,
+                              NBDClientConnection *conn,
+                              QIOChannelSocket *sioc,
+                              const char *export,
+                              QCryptoTLSCreds *tlscreds,
+                              const char *hostname,
+                              uint16_t *nbdflags, off_t *size,
+                              NBDExtensions *ext, Error **errp)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
     int ret;
 
     /* NBD handshake */
@@ -405,34 +537,96 @@ int nbd_client_init(BlockDriverState *bs,
     qio_channel_set_blocking(QIO_CHANNEL(sioc), true, NULL);
 
     ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), export,
-                                &client->nbdflags,
+                                nbdflags,
                                 tlscreds, hostname,
-                                &client->ioc,
-                                &client->size, errp);
+                                &conn->ioc,
+                                size, ext, errp);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
         return ret;
     }
-    if (client->nbdflags & NBD_FLAG_SEND_FUA) {
-        bs->supported_write_flags = BDRV_REQ_FUA;
-    }
 
-    qemu_co_mutex_init(&client->send_mutex);
-    qemu_co_queue_init(&client->free_sema);
-    client->sioc = sioc;
-    object_ref(OBJECT(client->sioc));
+    conn->bs = bs;
+    qemu_co_mutex_init(&conn->send_mutex);
+    conn->sioc = sioc;
+    object_ref(OBJECT(conn->sioc));
 
-    if (!client->ioc) {
-        client->ioc = QIO_CHANNEL(sioc);
-        object_ref(OBJECT(client->ioc));
+    if (!conn->ioc) {
+        conn->ioc = QIO_CHANNEL(sioc);
+        object_ref(OBJECT(conn->ioc));
     }
 
     /* Now that we're connected, set the socket to be non-blocking and
      * kick the reply mechanism.  */
     qio_channel_set_blocking(QIO_CHANNEL(sioc), false, NULL);
 
-    nbd_client_attach_aio_context(bs, bdrv_get_aio_context(bs));
+    nbd_connection_attach_aio_context(conn, bdrv_get_aio_context(bs));
 
     logout("Established connection with NBD server\n");
     return 0;
 }
+
+int nbd_client_init(BlockDriverState *bs,
+                    QIOChannelSocket *sioc,
+                    const char *export,
+                    QCryptoTLSCreds *tlscreds,
+                    const char *hostname,
+                    Error **errp)
+{
+    NBDClientSession *client = nbd_get_client_session(bs);
+    int ret;
+
+    client->ext.structured_reply = true;
+    client->ext.base_allocation = true;
+    ret = nbd_client_connect(bs, &client->conn[0], sioc, export, tlscreds,
+                             hostname, &client->nbdflags, &client->size,
+                             &client->ext, errp);
+    if (ret < 0) {
+        return ret;
+    }
+    if (client->nbdflags & NBD_FLAG_SEND_FUA) {
+        bs->supported_write_flags = BDRV_REQ_FUA;
+    }
+
+    qemu_co_queue_init(&client->free_sema);
+    client->num_conns = 1;
+    return 0;
+}
+
+/* Open one more connection to the same export as nbd_client_init() */
+int nbd_client_add_connection(BlockDriverState *bs,
+                              QIOChannelSocket *sioc,
+                              const char *export,
+                              QCryptoTLSCreds *tlscreds,
+                              const char *hostname,
+                              Error **errp)
+{
+    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientConnection *conn;
+    NBDExtensions ext = client->ext;
+    uint16_t nbdflags;
+    off_t size;
+    int ret;
+
+    assert(client->num_conns > 0 && client->num_conns < MAX_NBD_CONNECTIONS);
+    conn = &client->conn[client->num_conns];
+
+    ret = nbd_client_connect(bs, conn, sioc, export, tlscreds, hostname,
+                             &nbdflags, &size, &ext, errp);
+    if (ret < 0) {
+        return ret;
+    }
+    /* Count the connection even on mismatch, so that it gets closed */
+    client->num_conns++;
+
+    /* The reply parser of a connection does not depend on the extensions,
+     * but the requests that we send do */
+    if (nbdflags != client->nbdflags || size != client->size ||
+        ext.structured_reply != client->ext.structured_reply ||
+        ext.base_allocation != client->ext.base_allocation) {
+        error_setg(errp, "NBD server changed export parameters between "
+                   "connections");
+        return -EINVAL;
+    }
+    return 0;
+}
@@ -15,21 +15,37 @@
 #define logout(fmt, ...) ((void)0)
 #endif
 
-#define MAX_NBD_REQUESTS    16
+#define MAX_NBD_REQUESTS    16 /* per connection */
+#define MAX_NBD_CONNECTIONS 16
 
-typedef struct NBDClientSession {
+typedef struct NBDClientConnection {
+    BlockDriverState *bs;
     QIOChannelSocket *sioc; /* The master data channel */
     QIOChannel *ioc; /* The current I/O channel which may differ (eg TLS) */
-    uint16_t nbdflags;
-    off_t size;
 
     CoMutex send_mutex;
-    CoQueue free_sema;
     Coroutine *send_coroutine;
     int in_flight;
+    /* Shut down after an error, waiting for the read handler to close it */
+    bool failed;
 
     Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
     NBDReply reply;
+} NBDClientConnection;
+
+typedef struct NBDClientSession {
+    /* Requests are spread over the connections; one whose connection
+     * breaks before the reply is resent on another. */
+    NBDClientConnection conn[MAX_NBD_CONNECTIONS];
+    int num_conns;
+    int next_conn;
+
+    uint16_t nbdflags;
+    off_t size;
+    NBDExtensions ext;
+
+    /* Waiters for a free request slot on any connection */
+    CoQueue free_sema;
 
     bool is_unix;
 } NBDClientSession;
@@ -42,6 +58,12 @@ int nbd_client_init(BlockDriverState *bs,
                     QCryptoTLSCreds *tlscreds,
                     const char *hostname,
                     Error **errp);
+int nbd_client_add_connection(BlockDriverState *bs,
+                              QIOChannelSocket *sock,
+                              const char *export_name,
+                              QCryptoTLSCreds *tlscreds,
+                              const char *hostname,
+                              Error **errp);
 void nbd_client_close(BlockDriverState *bs);
 
 int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int count);
@@ -52,6 +74,10 @@ int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
                                 int count, BdrvRequestFlags flags);
 int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
                          uint64_t bytes, QEMUIOVector *qiov, int flags);
+int64_t coroutine_fn nbd_client_co_get_block_status(BlockDriverState *bs,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum,
+                                                    BlockDriverState **file);
 
 void nbd_client_detach_aio_context(BlockDriverState *bs);
 void nbd_client_attach_aio_context(BlockDriverState *bs,
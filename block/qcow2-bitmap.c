@@ -0,0 +1,880 @@
+/*
+ * Persistent dirty bitmaps for the QCOW version 2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "block/block_int.h"
+#include "block/dirty-bitmap.h"
+#include "block/qcow2.h"
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
+#include "qemu/cutils.h"
+
+/* Limits of the format (docs/specs/qcow2.txt) as far as QEMU supports it */
+#define BME_MIN_GRANULARITY_BITS    9
+#define BME_MAX_GRANULARITY_BITS    31
+#define BME_MAX_NAME_SIZE           1023
+#define BME_MAX_TABLE_SIZE          0x8000000
+
+/* Bitmap directory entry flags */
+#define BME_FLAG_IN_USE             (1U << 0)
+#define BME_FLAG_AUTO               (1U << 1)
+#define BME_FLAG_EXTRA_DATA_COMPAT  (1U << 2)
+#define BME_RESERVED_FLAGS          0xfffffff8U
+
+#define BME_TYPE_DIRTY_TRACKING     1
+
+/* Bitmap table entries */
+#define BME_TABLE_ENTRY_OFFSET_MASK     0x00fffffffffffe00ULL
+#define BME_TABLE_ENTRY_RESERVED_MASK   0xff000000000001feULL
+#define BME_TABLE_ENTRY_FLAG_ALL_ONES   1ULL
+
+typedef struct Qcow2BitmapDirEntry {
+    uint64_t bitmap_table_offset;
+    uint32_t bitmap_table_size;
+    uint32_t flags;
+    uint8_t type;
+    uint8_t granularity_bits;
+    uint16_t name_size;
+    uint32_t extra_data_size;
+    /* extra data and name follow, padded to a multiple of 8 bytes */
+} QEMU_PACKED Qcow2BitmapDirEntry;
+
+/* In-memory copy of a bitmap directory entry */
+typedef struct Qcow2Bitmap {
+    uint64_t table_offset;
+    uint32_t table_size;
+    uint32_t flags;
+    uint8_t granularity_bits;
+    char *name;
+
+    QSIMPLEQ_ENTRY(Qcow2Bitmap) entry;
+} Qcow2Bitmap;
+
+typedef QSIMPLEQ_HEAD(Qcow2BitmapList, Qcow2Bitmap) Qcow2BitmapList;
+
+static size_t dir_entry_size(size_t name_size)
+{
+    return align_offset(sizeof(Qcow2BitmapDirEntry) + name_size, 8);
+}
+
+/* Number of sectors of the virtual disk described by one bitmap cluster */
+static uint64_t bitmap_sectors_per_cluster(BDRVQcow2State *s,
+                                           uint32_t granularity)
+{
+    return (uint64_t)s->cluster_size * 8 * (granularity >> BDRV_SECTOR_BITS);
+}
+
+static uint64_t bitmap_table_size(BDRVQcow2State *s, uint64_t nb_sectors,
+                                  uint32_t granularity)
+{
+    return DIV_ROUND_UP(nb_sectors,
+                        bitmap_sectors_per_cluster(s, granularity));
+}
+
+static Qcow2BitmapList *bitmap_list_new(void)
+{
+    Qcow2BitmapList *bm_list = g_new(Qcow2BitmapList, 1);
+
+    QSIMPLEQ_INIT(bm_list);
+    return bm_list;
+}
+
+static void bitmap_list_free(Qcow2BitmapList *bm_list)
+{
+    Qcow2Bitmap *bm;
+
+    if (!bm_list) {
+        return;
+    }
+
+    while ((bm = QSIMPLEQ_FIRST(bm_list)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(bm_list, entry);
+        g_free(bm->name);
+        g_free(bm);
+    }
+    g_free(bm_list);
+}
+
+/* Read and check the bitmap directory the header extension points to */
+static Qcow2BitmapList *bitmap_list_load(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list = NULL;
+    uint8_t *dir, *p, *end;
+    uint32_t nb_bitmaps = 0;
+    int ret;
+
+    dir = g_try_malloc(s->bitmap_directory_size);
+    if (dir == NULL) {
+        error_setg(errp, "Could not allocate the bitmap directory");
+        return NULL;
+    }
+
+    ret = bdrv_pread(bs->file, s->bitmap_directory_offset, dir,
+                     s->bitmap_directory_size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the bitmap directory");
+        goto fail;
+    }
+
+    bm_list = bitmap_list_new();
+    p = dir;
+    end = dir + s->bitmap_directory_size;
+    while (p < end) {
+        Qcow2BitmapDirEntry e;
+        Qcow2Bitmap *bm;
+        uint64_t entry_size;
+
+        if (end - p < sizeof(e)) {
+            goto broken;
+        }
+        memcpy(&e, p, sizeof(e));
+        be64_to_cpus(&e.bitmap_table_offset);
+        be32_to_cpus(&e.bitmap_table_size);
+        be32_to_cpus(&e.flags);
+        be16_to_cpus(&e.name_size);
+        be32_to_cpus(&e.extra_data_size);
+
+        entry_size = dir_entry_size((uint64_t)e.extra_data_size + e.name_size);
+        if (e.name_size == 0 || entry_size > end - p) {
+            goto broken;
+        }
+
+        if (e.type != BME_TYPE_DIRTY_TRACKING || e.extra_data_size != 0 ||
+            (e.flags & BME_RESERVED_FLAGS))
+        {
+            error_setg(errp, "Bitmap '%.*s' uses unsupported features",
+                       e.name_size, (char *)p + sizeof(e) + e.extra_data_size);
+            goto fail;
+        }
+        if (e.name_size > BME_MAX_NAME_SIZE ||
+            e.granularity_bits < BME_MIN_GRANULARITY_BITS ||
+            e.granularity_bits > BME_MAX_GRANULARITY_BITS ||
+            e.bitmap_table_size > BME_MAX_TABLE_SIZE)
+        {
+            error_setg(errp, "Bitmap '%.*s' exceeds the supported limits",
+                       e.name_size, (char *)p + sizeof(e));
+            goto fail;
+        }
+        if (offset_into_cluster(s, e.bitmap_table_offset) ||
+            (e.bitmap_table_size != 0) != (e.bitmap_table_offset != 0))
+        {
+            goto broken;
+        }
+
+        bm = g_new0(Qcow2Bitmap, 1);
+        bm->table_offset = e.bitmap_table_offset;
+        bm->table_size = e.bitmap_table_size;
+        bm->flags = e.flags;
+        bm->granularity_bits = e.granularity_bits;
+        bm->name = g_strndup((char *)p + sizeof(e), e.name_size);
+        QSIMPLEQ_INSERT_TAIL(bm_list, bm, entry);
+
+        nb_bitmaps++;
+        p += entry_size;
+    }
+
+    if (nb_bitmaps != s->nb_bitmaps) {
+        goto broken;
+    }
+
+    g_free(dir);
+    return bm_list;
+
+broken:
+    error_setg(errp, "Broken bitmap directory");
+fail:
+    bitmap_list_free(bm_list);
+    g_free(dir);
+    return NULL;
+}
+
+/* Build the on-disk form of a bitmap directory */
+static uint8_t *bitmap_list_serialize(Qcow2BitmapList *bm_list, size_t *size)
+{
+    Qcow2Bitmap *bm;
+    uint8_t *dir, *p;
+    size_t dir_size = 0;
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        dir_size += dir_entry_size(strlen(bm->name));
+    }
+
+    dir = g_malloc0(dir_size);
+    p = dir;
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        Qcow2BitmapDirEntry e = {
+            .bitmap_table_offset    = cpu_to_be64(bm->table_offset),
+            .bitmap_table_size      = cpu_to_be32(bm->table_size),
+            .flags                  = cpu_to_be32(bm->flags),
+            .type                   = BME_TYPE_DIRTY_TRACKING,
+            .granularity_bits       = bm->granularity_bits,
+            .name_size              = cpu_to_be16(strlen(bm->name)),
+        };
+
+        memcpy(p, &e, sizeof(e));
+        memcpy(p + sizeof(e), bm->name, strlen(bm->name));
+        p += dir_entry_size(strlen(bm->name));
+    }
+
+    *size = dir_size;
+    return dir;
+}
+
+static int bitmap_table_load(BlockDriverState *bs, Qcow2Bitmap *bm,
+                             uint64_t **table)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *t;
+    uint32_t i;
+    int ret;
+
+    assert(bm->table_size != 0);
+    t = g_try_new(uint64_t, bm->table_size);
+    if (t == NULL) {
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(bs->file, bm->table_offset, t,
+                     bm->table_size * sizeof(uint64_t));
+    if (ret < 0) {
+        goto fail;
+    }
+
+    for (i = 0; i < bm->table_size; i++) {
+        uint64_t offset;
+
+        be64_to_cpus(&t[i]);
+        offset = t[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+        if ((t[i] & BME_TABLE_ENTRY_RESERVED_MASK) ||
+            (offset && (t[i] & BME_TABLE_ENTRY_FLAG_ALL_ONES)) ||
+            offset_into_cluster(s, offset))
+        {
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+
+    *table = t;
+    return 0;
+
+fail:
+    g_free(t);
+    return ret;
+}
+
+/* Drop the references of a stored bitmap to its table and data clusters */
+static void bitmap_free_clusters(BlockDriverState *bs, Qcow2Bitmap *bm)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *table;
+    uint32_t i;
+
+    if (bm->table_size == 0 || bitmap_table_load(bs, bm, &table) < 0) {
+        /* A broken table is leaked; qemu-img check can reclaim it */
+        return;
+    }
+
+    for (i = 0; i < bm->table_size; i++) {
+        uint64_t offset = table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+        if (offset) {
+            qcow2_free_clusters(bs, offset, s->cluster_size,
+                                QCOW2_DISCARD_OTHER);
+        }
+    }
+    qcow2_free_clusters(bs, bm->table_offset,
+                        bm->table_size * sizeof(uint64_t),
+                        QCOW2_DISCARD_OTHER);
+    g_free(table);
+}
+
+static int bitmap_load_data(BlockDriverState *bs, Qcow2Bitmap *bm,
+                            BdrvDirtyBitmap *bitmap)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint32_t granularity = bdrv_dirty_bitmap_granularity(bitmap);
+    uint64_t nb_sectors = bdrv_dirty_bitmap_size(bitmap);
+    uint64_t spc = bitmap_sectors_per_cluster(s, granularity);
+    uint64_t *table = NULL;
+    uint64_t sector;
+    uint8_t *buf = NULL;
+    uint32_t i;
+    int ret;
+
+    if (bm->table_size != bitmap_table_size(s, nb_sectors, granularity)) {
+        return -EINVAL;
+    }
+    if (bm->table_size == 0) {
+        return 0;
+    }
+
+    ret = bitmap_table_load(bs, bm, &table);
+    if (ret < 0) {
+        return ret;
+    }
+
+    buf = qemu_blockalign(bs->file->bs, s->cluster_size);
+    for (i = 0, sector = 0; i < bm->table_size; i++, sector += spc) {
+        uint64_t offset = table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+        if (offset) {
+            ret = bdrv_pread(bs->file, offset, buf, s->cluster_size);
+            if (ret < 0) {
+                goto out;
+            }
+            bdrv_dirty_bitmap_deserialize_part(bitmap, buf, sector,
+                                               MIN(nb_sectors - sector, spc),
+                                               false);
+        }
+    }
+    bdrv_dirty_bitmap_deserialize_finish(bitmap);
+
+    /* Clusters that read as all ones are set only now, deserialization works
+     * on the lowest level of the bitmap alone */
+    for (i = 0, sector = 0; i < bm->table_size; i++, sector += spc) {
+        if (table[i] == BME_TABLE_ENTRY_FLAG_ALL_ONES) {
+            bdrv_set_dirty_bitmap(bitmap, sector,
+                                  MIN(nb_sectors - sector, spc));
+        }
+    }
+    ret = 0;
+
+out:
+    qemu_vfree(buf);
+    g_free(table);
+    return ret;
+}
+
+/*
+ * Write the data and the bitmap table of @bitmap to newly allocated clusters
+ * and describe them in @bm.  Clusters of the bitmap that are all clear are
+ * not allocated.
+ */
+static int bitmap_store_data(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                             Qcow2Bitmap *bm)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint32_t granularity = bdrv_dirty_bitmap_granularity(bitmap);
+    uint64_t nb_sectors = bdrv_dirty_bitmap_size(bitmap);
+    uint64_t spc = bitmap_sectors_per_cluster(s, granularity);
+    uint64_t table_size = bitmap_table_size(s, nb_sectors, granularity);
+    uint64_t *table = NULL;
+    uint64_t sector;
+    int64_t offset;
+    uint8_t *buf = NULL;
+    uint32_t i;
+    int ret;
+
+    bm->table_offset = 0;
+    bm->table_size = 0;
+    if (table_size > BME_MAX_TABLE_SIZE) {
+        return -EFBIG;
+    }
+    if (table_size == 0) {
+        return 0;
+    }
+
+    table = g_try_new0(uint64_t, table_size);
+    if (table == NULL) {
+        return -ENOMEM;
+    }
+
+    buf = qemu_blockalign(bs->file->bs, s->cluster_size);
+    for (i = 0, sector = 0; i < table_size; i++, sector += spc) {
+        uint64_t count = MIN(nb_sectors - sector, spc);
+        uint64_t area = sector, area_count = count;
+
+        if (!bdrv_dirty_bitmap_next_dirty_area(bitmap, &area, &area_count)) {
+            continue;
+        }
+
+        offset = qcow2_alloc_clusters(bs, s->cluster_size);
+        if (offset < 0) {
+            ret = offset;
+            goto fail;
+        }
+        table[i] = offset;
+
+        memset(buf, 0, s->cluster_size);
+        bdrv_dirty_bitmap_serialize_part(bitmap, buf, sector, count);
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, offset, s->cluster_size);
+        if (ret < 0) {
+            goto fail;
+        }
+        ret = bdrv_pwrite(bs->file, offset, buf, s->cluster_size);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    offset = qcow2_alloc_clusters(bs, table_size * sizeof(uint64_t));
+    if (offset < 0) {
+        ret = offset;
+        goto fail;
+    }
+    bm->table_offset = offset;
+    bm->table_size = table_size;
+
+    for (i = 0; i < table_size; i++) {
+        cpu_to_be64s(&table[i]);
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, bm->table_offset,
+                                        table_size * sizeof(uint64_t));
+    if (ret < 0) {
+        goto fail;
+    }
+    ret = bdrv_pwrite(bs->file, bm->table_offset, table,
+                      table_size * sizeof(uint64_t));
+    if (ret < 0) {
+        goto fail;
+    }
+
+    qemu_vfree(buf);
+    g_free(table);
+    return 0;
+
+fail:
+    if (bm->table_offset) {
+        for (i = 0; i < table_size; i++) {
+            be64_to_cpus(&table[i]);
+        }
+        qcow2_free_clusters(bs, bm->table_offset,
+                            table_size * sizeof(uint64_t),
+                            QCOW2_DISCARD_ALWAYS);
+        bm->table_offset = 0;
+        bm->table_size = 0;
+    }
+    for (i = 0; i < table_size; i++) {
+        if (table[i]) {
+            qcow2_free_clusters(bs, table[i], s->cluster_size,
+                                QCOW2_DISCARD_ALWAYS);
+        }
+    }
+    qemu_vfree(buf);
+    g_free(table);
+    return ret;
+}
+
+/*
+ * Set the in_use flag of all stored bitmaps: from now on the bitmaps in memory
+ * are the valid ones, and a copy in the image that is still flagged when the
+ * image is opened the next time was not written back.
+ */
+static int bitmaps_mark_in_use(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list;
+    Qcow2Bitmap *bm;
+    uint8_t *dir;
+    size_t dir_size;
+    int ret;
+
+    bm_list = bitmap_list_load(bs, errp);
+    if (bm_list == NULL) {
+        return -EINVAL;
+    }
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        bm->flags |= BME_FLAG_IN_USE;
+    }
+    dir = bitmap_list_serialize(bm_list, &dir_size);
+    assert(dir_size == s->bitmap_directory_size);
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, s->bitmap_directory_offset,
+                                        dir_size);
+    if (ret == 0) {
+        ret = bdrv_pwrite_sync(bs->file, s->bitmap_directory_offset, dir,
+                               dir_size);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update the bitmap directory");
+    }
+
+    g_free(dir);
+    bitmap_list_free(bm_list);
+    return ret < 0 ? ret : 0;
+}
+
+int qcow2_load_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list;
+    Qcow2Bitmap *bm;
+    int ret = 0;
+
+    if (s->nb_bitmaps == 0) {
+        s->bitmaps_loaded = true;
+        return 0;
+    }
+
+    bm_list = bitmap_list_load(bs, errp);
+    if (bm_list == NULL) {
+        return -EINVAL;
+    }
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        BdrvDirtyBitmap *bitmap;
+
+        if (bm->flags & BME_FLAG_IN_USE) {
+            /* Dropped from the image the next time the bitmaps are stored */
+            error_report("Bitmap '%s' was not saved when the image was last "
+                         "closed and is discarded", bm->name);
+            continue;
+        }
+
+        /* After a cancelled migration the bitmaps are still in memory */
+        bitmap = bdrv_find_dirty_bitmap(bs, bm->name);
+        if (bitmap) {
+            bdrv_dirty_bitmap_set_persistance(bitmap, true);
+            continue;
+        }
+
+        bitmap = bdrv_create_dirty_bitmap(bs, 1U << bm->granularity_bits,
+                                          bm->name, errp);
+        if (bitmap == NULL) {
+            ret = -EINVAL;
+            goto out;
+        }
+
+        ret = bitmap_load_data(bs, bm, bitmap);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read bitmap '%s'",
+                             bm->name);
+            bdrv_release_dirty_bitmap(bs, bitmap);
+            goto out;
+        }
+
+        if (!(bm->flags & BME_FLAG_AUTO)) {
+            bdrv_disable_dirty_bitmap(bitmap);
+        }
+        bdrv_dirty_bitmap_set_persistance(bitmap, true);
+    }
+
+    if (!bs->read_only) {
+        ret = bitmaps_mark_in_use(bs, errp);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+    s->bitmaps_loaded = true;
+
+out:
+    bitmap_list_free(bm_list);
+    return ret;
+}
+
+int qcow2_reopen_bitmaps_rw(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (!s->bitmaps_loaded || s->nb_bitmaps == 0) {
+        return 0;
+    }
+
+    return bitmaps_mark_in_use(bs, errp);
+}
+
+int qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    Qcow2BitmapList *old_list = NULL, *new_list;
+    Qcow2Bitmap *bm;
+    uint32_t old_nb_bitmaps = s->nb_bitmaps, nb_bitmaps = 0;
+    uint64_t old_dir_offset = s->bitmap_directory_offset;
+    uint64_t old_dir_size = s->bitmap_directory_size;
+    uint64_t old_autoclear_features = s->autoclear_features;
+    int64_t dir_offset = 0;
+    size_t dir_size = 0;
+    uint8_t *dir = NULL;
+    int ret;
+
+    if (!s->bitmaps_loaded || bs->read_only) {
+        return 0;
+    }
+
+    if (s->nb_bitmaps) {
+        old_list = bitmap_list_load(bs, errp);
+        if (old_list == NULL) {
+            return -EINVAL;
+        }
+    }
+
+    new_list = bitmap_list_new();
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap))
+    {
+        const char *name = bdrv_dirty_bitmap_name(bitmap);
+
+        if (!bdrv_dirty_bitmap_get_persistance(bitmap)) {
+            continue;
+        }
+        if (bdrv_dirty_bitmap_frozen(bitmap)) {
+            /* Part of its bits live in the successor of a running job */
+            error_report("Bitmap '%s' is in use by a job and is not saved",
+                         name);
+            continue;
+        }
+
+        bm = g_new0(Qcow2Bitmap, 1);
+        bm->name = g_strdup(name);
+        bm->granularity_bits = ctz32(bdrv_dirty_bitmap_granularity(bitmap));
+        bm->flags = bdrv_dirty_bitmap_enabled(bitmap) ? BME_FLAG_AUTO : 0;
+        QSIMPLEQ_INSERT_TAIL(new_list, bm, entry);
+
+        ret = bitmap_store_data(bs, bitmap, bm);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not write bitmap '%s'", name);
+            goto fail;
+        }
+        nb_bitmaps++;
+    }
+
+    if (nb_bitmaps == 0 && old_nb_bitmaps == 0) {
+        ret = 0;
+        goto out;
+    }
+
+    if (s->qcow_version < 3) {
+        error_setg(errp, "Persistent bitmaps require a qcow2 v3 image");
+        ret = -ENOTSUP;
+        goto fail;
+    }
+
+    if (nb_bitmaps) {
+        dir = bitmap_list_serialize(new_list, &dir_size);
+        if (dir_size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+            error_setg(errp, "The bitmap directory is too large");
+            ret = -EFBIG;
+            goto fail;
+        }
+
+        dir_offset = qcow2_alloc_clusters(bs, dir_size);
+        if (dir_offset < 0) {
+            ret = dir_offset;
+            dir_offset = 0;
+            error_setg_errno(errp, -ret, "Could not allocate the bitmap "
+                             "directory");
+            goto fail;
+        }
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, dir_offset, dir_size);
+        if (ret == 0) {
+            ret = bdrv_pwrite(bs->file, dir_offset, dir, dir_size);
+        }
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not write the bitmap "
+                             "directory");
+            goto fail;
+        }
+    }
+
+    /* The new bitmaps and their refcounts must be stable on disk before the
+     * header points to them */
+    ret = bdrv_flush(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not flush the bitmaps");
+        goto fail;
+    }
+
+    s->nb_bitmaps = nb_bitmaps;
+    s->bitmap_directory_offset = dir_offset;
+    s->bitmap_directory_size = dir_size;
+    if (nb_bitmaps) {
+        s->autoclear_features |= QCOW2_AUTOCLEAR_BITMAPS;
+    } else {
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+    }
+
+    ret = qcow2_update_header(bs);
+    if (ret == 0) {
+        ret = bdrv_flush(bs->file->bs);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update the qcow2 header");
+        s->nb_bitmaps = old_nb_bitmaps;
+        s->bitmap_directory_offset = old_dir_offset;
+        s->bitmap_directory_size = old_dir_size;
+        s->autoclear_features = old_autoclear_features;
+        goto fail;
+    }
+
+    /* Nothing refers to the previous copy of the bitmaps any more */
+    if (old_list) {
+        QSIMPLEQ_FOREACH(bm, old_list, entry) {
+            bitmap_free_clusters(bs, bm);
+        }
+        qcow2_free_clusters(bs, old_dir_offset, old_dir_size,
+                            QCOW2_DISCARD_OTHER);
+    }
+    ret = 0;
+    goto out;
+
+fail:
+    QSIMPLEQ_FOREACH(bm, new_list, entry) {
+        bitmap_free_clusters(bs, bm);
+    }
+    if (dir_offset) {
+        qcow2_free_clusters(bs, dir_offset, dir_size, QCOW2_DISCARD_ALWAYS);
+    }
+out:
+    g_free(dir);
+    bitmap_list_free(old_list);
+    bitmap_list_free(new_list);
+    return ret;
+}
+
+bool qcow2_can_store_new_dirty_bitmap(BlockDriverState *bs, const char *name,
+                                      uint32_t granularity, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    uint64_t dir_size = dir_entry_size(strlen(name));
+    uint32_t nb_bitmaps = 1;
+
+    if (s->qcow_version < 3) {
+        error_setg(errp, "Persistent bitmaps require a qcow2 v3 image "
+                   "(compat=1.1)");
+        return false;
+    }
+    if (bs->read_only || !s->bitmaps_loaded) {
+        error_setg(errp, "Cannot store bitmaps in a read-only or inactive "
+                   "image");
+        return false;
+    }
+    if (strlen(name) > BME_MAX_NAME_SIZE) {
+        error_setg(errp, "Bitmap names are limited to %d bytes",
+                   BME_MAX_NAME_SIZE);
+        return false;
+    }
+    if (ctz32(granularity) < BME_MIN_GRANULARITY_BITS ||
+        ctz32(granularity) > BME_MAX_GRANULARITY_BITS)
+    {
+        error_setg(errp, "Granularity must be between %u and %u bytes",
+                   1U << BME_MIN_GRANULARITY_BITS,
+                   1U << BME_MAX_GRANULARITY_BITS);
+        return false;
+    }
+    if (bitmap_table_size(s, bdrv_nb_sectors(bs), granularity) >
+        BME_MAX_TABLE_SIZE)
+    {
+        error_setg(errp, "Granularity is too small for the image size");
+        return false;
+    }
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap))
+    {
+        if (bdrv_dirty_bitmap_get_persistance(bitmap)) {
+            dir_size += dir_entry_size(strlen(bdrv_dirty_bitmap_name(bitmap)));
+            nb_bitmaps++;
+        }
+    }
+    if (nb_bitmaps > QCOW2_MAX_BITMAPS ||
+        dir_size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE)
+    {
+        error_setg(errp, "Too many persistent bitmaps in the image");
+        return false;
+    }
+
+    return true;
+}
+
+int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                                  void **refcount_table,
+                                  int64_t *refcount_table_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list;
+    Qcow2Bitmap *bm;
+    Error *local_err = NULL;
+    int ret;
+
+    if (s->nb_bitmaps == 0) {
+        return 0;
+    }
+
+    bm_list = bitmap_list_load(bs, &local_err);
+    if (bm_list == NULL) {
+        fprintf(stderr, "ERROR %s\n", error_get_pretty(local_err));
+        error_free(local_err);
+        res->corruptions++;
+        return 0;
+    }
+
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                   refcount_table_size,
+                                   s->bitmap_directory_offset,
+                                   s->bitmap_directory_size);
+    if (ret < 0) {
+        goto out;
+    }
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        uint64_t *table;
+        uint32_t i;
+
+        if (bm->table_size == 0) {
+            continue;
+        }
+
+        ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                       refcount_table_size, bm->table_offset,
+                                       bm->table_size * sizeof(uint64_t));
+        if (ret < 0) {
+            goto out;
+        }
+
+        ret = bitmap_table_load(bs, bm, &table);
+        if (ret < 0) {
+            fprintf(stderr, "ERROR bitmap '%s' has a broken bitmap table\n",
+                    bm->name);
+            res->corruptions++;
+            continue;
+        }
+
+        for (i = 0; i < bm->table_size; i++) {
+            uint64_t offset = table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+            if (offset == 0) {
+                continue;
+            }
+            ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                           refcount_table_size, offset,
+                                           s->cluster_size);
+            if (ret < 0) {
+                g_free(table);
+                goto out;
+            }
+        }
+        g_free(table);
+    }
+    ret = 0;
+
+out:
+    bitmap_list_free(bm_list);
+    return ret;
+}
@@ -27,50 +27,160 @@
 #include "block/block_int.h"
 #include "qemu-common.h"
 #include "qcow2.h"
+#include "qapi/error.h"
+#include "qemu/host-utils.h"
+#include "qemu/atomic.h"
+#include "qemu/timer.h"
+#include "qmp-commands.h"
 #include "trace.h"
 
+/* Interval between two redistributions of the memory budget */
+#define QCOW2_CACHE_BUDGET_INTERVAL_MS  1000
+
+/* Every cache keeps this many tables, whatever the budget */
+#define QCOW2_CACHE_BUDGET_MIN_TABLES   4
+
 typedef struct Qcow2CachedTable {
     int64_t  offset;
     uint64_t lru_counter;
     int      ref;
     bool     dirty;
+    /* Whether the entry is in the free list rather than the LRU list */
+    bool     free;
+    /* Next entry in the same hash bucket, or -1 */
+    int      hash_next;
+    /* Entries with ref == 0, least recently used first; in free_list
+     * instead if no table is cached in them */
+    QTAILQ_ENTRY(Qcow2CachedTable) lru_next;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
     Qcow2CachedTable       *entries;
     struct Qcow2Cache      *depends;
     int                     size;
+    int                     table_size;
     bool                    depends_on_flush;
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+
+    /* Index from table offset to entry; the buckets hold the first entry of
+     * each chain or -1. nb_buckets is a power of two. */
+    int                    *buckets;
+    int                     nb_buckets;
+    int                     hash_bits;
+    QTAILQ_HEAD(Qcow2CachedTableList, Qcow2CachedTable) lru_list;
+    struct Qcow2CachedTableList free_list;
+
+    /* Number of entries that hold a table */
+    int                     nb_used;
+
+    /* Share of the process-wide budget.  limit is set by the rebalancing
+     * code, which runs in whatever thread needed it; the counters are
+     * collected by it. */
+    BlockDriverState       *bs;
+    QEMUBH                 *reclaim_bh;
+    int                     limit;
+    unsigned                hits;
+    unsigned                misses;
+    uint64_t                score;          /* protected by budget.lock */
+    QLIST_ENTRY(Qcow2Cache) budget_next;    /* protected by budget.lock */
 };
 
+/*
+ * The memory budget shared by the caches of all images.  Each cache may use
+ * up to its configured size, but only as many entries as its limit.  Limits
+ * are recomputed at most once per interval, from the number of hits and
+ * misses of each cache during the last intervals: caches that are busy get
+ * a larger share, idle ones shrink towards QCOW2_CACHE_BUDGET_MIN_TABLES.
+ * A cache that has to shrink releases its least recently used clean tables
+ * in its own AioContext.
+ */
+static struct {
+    QemuMutex lock;
+    bool enabled;
+    uint64_t size;
+    int64_t last_rebalance;
+    int nb_caches;
+    QLIST_HEAD(, Qcow2Cache) caches;
+} budget;
+
 static inline void *qcow2_cache_get_table_addr(BlockDriverState *bs,
                     Qcow2Cache *c, int table)
 {
-    BDRVQcow2State *s = bs->opaque;
-    return (uint8_t *) c->table_array + (size_t) table * s->cluster_size;
+    return (uint8_t *) c->table_array + (size_t) table * c->table_size;
 }
 
 static inline int qcow2_cache_get_table_idx(BlockDriverState *bs,
                   Qcow2Cache *c, void *table)
 {
-    BDRVQcow2State *s = bs->opaque;
     ptrdiff_t table_offset = (uint8_t *) table - (uint8_t *) c->table_array;
-    int idx = table_offset / s->cluster_size;
-    assert(idx >= 0 && idx < c->size && table_offset % s->cluster_size == 0);
+    int idx = table_offset / c->table_size;
+    assert(idx >= 0 && idx < c->size && table_offset % c->table_size == 0);
     return idx;
 }
 
+static inline int qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    return ((offset / c->table_size) * 0x9E3779B97F4A7C15ULL)
+           >> (64 - c->hash_bits);
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i)
+{
+    int b = qcow2_cache_hash(c, c->entries[i].offset);
+
+    c->entries[i].hash_next = c->buckets[b];
+    c->buckets[b] = i;
+}
+
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int i)
+{
+    int *p = &c->buckets[qcow2_cache_hash(c, c->entries[i].offset)];
+
+    while (*p != i) {
+        assert(*p != -1);
+        p = &c->entries[*p].hash_next;
+    }
+    *p = c->entries[i].hash_next;
+    c->entries[i].hash_next = -1;
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i = c->buckets[qcow2_cache_hash(c, offset)];
+
+    while (i != -1 && c->entries[i].offset != offset) {
+        i = c->entries[i].hash_next;
+    }
+    return i;
+}
+
+/* Forget the table cached in entry i, which must be unused, and make it the
+ * first candidate for reuse */
+static void qcow2_cache_entry_reset(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    assert(t->ref == 0);
+    if (t->offset) {
+        qcow2_cache_hash_remove(c, i);
+        c->nb_used--;
+    }
+    t->offset = 0;
+    t->lru_counter = 0;
+    QTAILQ_REMOVE(t->free ? &c->free_list : &c->lru_list, t, lru_next);
+    QTAILQ_INSERT_HEAD(&c->free_list, t, lru_next);
+    t->free = true;
+}
+
 static void qcow2_cache_table_release(BlockDriverState *bs, Qcow2Cache *c,
                                       int i, int num_tables)
 {
 #if QEMU_MADV_DONTNEED != QEMU_MADV_INVALID
-    BDRVQcow2State *s = bs->opaque;
     void *t = qcow2_cache_get_table_addr(bs, c, i);
     int align = getpagesize();
-    size_t mem_size = (size_t) s->cluster_size * num_tables;
+    size_t mem_size = (size_t) c->table_size * num_tables;
     size_t offset = QEMU_ALIGN_UP((uintptr_t) t, align) - (uintptr_t) t;
     size_t length = QEMU_ALIGN_DOWN(mem_size - offset, align);
     if (length > 0) {
@@ -79,6 +189,153 @@ static void qcow2_cache_table_release(BlockDriverState *bs, Qcow2Cache *c,
 #endif
 }
 
+/* Release the least recently used clean tables until the cache is within
+ * its share of the budget */
+static void qcow2_cache_reclaim(BlockDriverState *bs, Qcow2Cache *c)
+{
+    Qcow2CachedTable *t, *next;
+    int limit = atomic_read(&c->limit);
+
+    QTAILQ_FOREACH_SAFE(t, &c->lru_list, lru_next, next) {
+        int i = t - c->entries;
+
+        if (c->nb_used <= limit) {
+            break;
+        }
+        if (t->dirty || !t->offset) {
+            continue;
+        }
+        qcow2_cache_entry_reset(c, i);
+        qcow2_cache_table_release(bs, c, i, 1);
+    }
+}
+
+static void qcow2_cache_reclaim_bh(void *opaque)
+{
+    Qcow2Cache *c = opaque;
+
+    qcow2_cache_reclaim(c->bs, c);
+}
+
+/* Divide the budget between the caches in proportion to their recent
+ * activity, where a miss counts twice as much as a hit.  Called with
+ * budget.lock held. */
+static void qcow2_cache_rebalance(void)
+{
+    Qcow2Cache *c;
+    uint64_t total_score = 0, reserved = 0, spare;
+
+    QLIST_FOREACH(c, &budget.caches, budget_next) {
+        unsigned hits = atomic_xchg(&c->hits, 0);
+        unsigned misses = atomic_xchg(&c->misses, 0);
+
+        /* Halve the weight of the history in every interval */
+        c->score = c->score / 2 + hits + 2 * (uint64_t) misses;
+        total_score += c->score;
+        reserved += (uint64_t) MIN(c->size, QCOW2_CACHE_BUDGET_MIN_TABLES) *
+                    c->table_size;
+    }
+
+    spare = budget.size > reserved ? budget.size - reserved : 0;
+
+    QLIST_FOREACH(c, &budget.caches, budget_next) {
+        uint64_t share, limit;
+        int old_limit = atomic_read(&c->limit);
+
+        if (total_score) {
+            share = (double) spare * c->score / total_score;
+        } else {
+            share = spare / budget.nb_caches;
+        }
+        limit = MAX(share / c->table_size, QCOW2_CACHE_BUDGET_MIN_TABLES);
+        limit = MIN(limit, c->size);
+
+        trace_qcow2_cache_rebalance(c, c->score, old_limit, limit);
+        atomic_set(&c->limit, limit);
+        if (limit < old_limit && c->reclaim_bh) {
+            qemu_bh_schedule(c->reclaim_bh);
+        }
+    }
+}
+
+/* Count a lookup and redistribute the budget if it is time for that */
+static void qcow2_cache_account(Qcow2Cache *c, bool hit)
+{
+    int64_t now;
+
+    if (!atomic_read(&budget.enabled)) {
+        return;
+    }
+
+    if ((atomic_fetch_inc(hit ? &c->hits : &c->misses) & 255) != 0) {
+        return;
+    }
+
+    /* Whoever gets the lock does the work for everyone */
+    if (qemu_mutex_trylock(&budget.lock)) {
+        return;
+    }
+    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    if (budget.enabled &&
+        now - budget.last_rebalance >= QCOW2_CACHE_BUDGET_INTERVAL_MS) {
+        budget.last_rebalance = now;
+        qcow2_cache_rebalance();
+    }
+    qemu_mutex_unlock(&budget.lock);
+}
+
+void qcow2_cache_budget_init(void)
+{
+    qemu_mutex_init(&budget.lock);
+    QLIST_INIT(&budget.caches);
+}
+
+/* Set the memory that the caches of all images may use together, or lift
+ * the limit if @size is 0 */
+void qmp_x_qcow2_set_cache_budget(int64_t size, Error **errp)
+{
+    Qcow2Cache *c;
+
+    if (size < 0) {
+        error_setg(errp, "Cache budget must not be negative");
+        return;
+    }
+
+    qemu_mutex_lock(&budget.lock);
+    budget.size = size;
+    atomic_set(&budget.enabled, size > 0);
+    if (size > 0) {
+        budget.last_rebalance = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+        qcow2_cache_rebalance();
+    } else {
+        QLIST_FOREACH(c, &budget.caches, budget_next) {
+            atomic_set(&c->limit, c->size);
+        }
+    }
+    qemu_mutex_unlock(&budget.lock);
+}
+
+void qcow2_cache_detach_aio_context(Qcow2Cache *c)
+{
+    qemu_mutex_lock(&budget.lock);
+    if (c->reclaim_bh) {
+        qemu_bh_delete(c->reclaim_bh);
+        c->reclaim_bh = NULL;
+    }
+    qemu_mutex_unlock(&budget.lock);
+}
+
+void qcow2_cache_attach_aio_context(Qcow2Cache *c, AioContext *new_context)
+{
+    qemu_mutex_lock(&budget.lock);
+    assert(!c->reclaim_bh);
+    c->reclaim_bh = aio_bh_new(new_context, qcow2_cache_reclaim_bh, c);
+    qemu_mutex_unlock(&budget.lock);
+
+    /* The limit may have gone down while there was no BH to tell us */
+    qcow2_cache_reclaim(c->bs, c);
+}
+
 static inline bool can_clean_entry(Qcow2Cache *c, int i)
 {
     Qcow2CachedTable *t = &c->entries[i];
@@ -99,8 +356,7 @@ void qcow2_cache_clean_unused(BlockDriverState *bs, Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
-            c->entries[i].lru_counter = 0;
+            qcow2_cache_entry_reset(c, i);
             i++;
             to_clean++;
         }
@@ -113,23 +369,56 @@ void qcow2_cache_clean_unused(BlockDriverState *bs, Qcow2Cache *c)
     c->cache_clean_lru_counter = c->lru_counter;
 }
 
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size)
 {
-    BDRVQcow2State *s = bs->opaque;
     Qcow2Cache *c;
+    int i;
+
+    assert(num_tables > 0);
+    assert(is_power_of_2(table_size));
 
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
+    c->table_size = table_size;
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
     c->table_array = qemu_try_blockalign(bs->file->bs,
-                                         (size_t) num_tables * s->cluster_size);
+                                         (size_t) num_tables * table_size);
+
+    /* Keep the load factor at or below one half */
+    c->nb_buckets = pow2ceil(MAX((uint64_t) num_tables * 2, 2));
+    c->hash_bits = ctz32(c->nb_buckets);
+    c->buckets = g_try_new(int, c->nb_buckets);
 
-    if (!c->entries || !c->table_array) {
+    if (!c->entries || !c->table_array || !c->buckets) {
         qemu_vfree(c->table_array);
         g_free(c->entries);
+        g_free(c->buckets);
         g_free(c);
-        c = NULL;
+        return NULL;
+    }
+
+    memset(c->buckets, -1, c->nb_buckets * sizeof(int));
+    QTAILQ_INIT(&c->lru_list);
+    QTAILQ_INIT(&c->free_list);
+    for (i = 0; i < num_tables; i++) {
+        c->entries[i].hash_next = -1;
+        c->entries[i].free = true;
+        QTAILQ_INSERT_TAIL(&c->free_list, &c->entries[i], lru_next);
+    }
+
+    c->bs = bs;
+    c->limit = num_tables;
+    c->reclaim_bh = aio_bh_new(bdrv_get_aio_context(bs),
+                               qcow2_cache_reclaim_bh, c);
+
+    qemu_mutex_lock(&budget.lock);
+    QLIST_INSERT_HEAD(&budget.caches, c, budget_next);
+    budget.nb_caches++;
+    if (budget.enabled) {
+        qcow2_cache_rebalance();
     }
+    qemu_mutex_unlock(&budget.lock);
 
     return c;
 }
@@ -142,8 +431,17 @@ int qcow2_cache_destroy(BlockDriverState *bs, Qcow2Cache *c)
         assert(c->entries[i].ref == 0);
     }
 
+    qemu_mutex_lock(&budget.lock);
+    QLIST_REMOVE(c, budget_next);
+    budget.nb_caches--;
+    if (c->reclaim_bh) {
+        qemu_bh_delete(c->reclaim_bh);
+    }
+    qemu_mutex_unlock(&budget.lock);
+
     qemu_vfree(c->table_array);
     g_free(c->entries);
+    g_free(c->buckets);
     g_free(c);
 
     return 0;
@@ -191,13 +489,13 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
 
     if (c == s->refcount_block_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_REFCOUNT_BLOCK,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else if (c == s->l2_table_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L2,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else {
         ret = qcow2_pre_write_overlap_check(bs, 0,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     }
 
     if (ret < 0) {
@@ -211,7 +509,7 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
     }
 
     ret = bdrv_pwrite(bs->file, c->entries[i].offset,
-                      qcow2_cache_get_table_addr(bs, c, i), s->cluster_size);
+                      qcow2_cache_get_table_addr(bs, c, i), c->table_size);
     if (ret < 0) {
         return ret;
     }
@@ -292,9 +590,7 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
     }
 
     for (i = 0; i < c->size; i++) {
-        assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].lru_counter = 0;
+        qcow2_cache_entry_reset(c, i);
     }
 
     qcow2_cache_table_release(bs, c, 0, c->size);
@@ -308,39 +604,38 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2CachedTable *t;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     trace_qcow2_cache_get(qemu_coroutine_self(), c == s->l2_table_cache,
                           offset, read_from_disk);
 
+    assert(offset != 0 && offset % c->table_size == 0);
+
     /* Check if the table is already cached */
-    i = lookup_index = (offset / s->cluster_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
-        }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
+    i = qcow2_cache_lookup(c, offset);
+    qcow2_cache_account(c, i != -1);
+    if (i != -1) {
+        goto found;
+    }
 
-    if (min_lru_index == -1) {
+    /* Use a new entry only as long as the cache is within its share of the
+     * budget, and replace a cached table otherwise */
+    if (!QTAILQ_EMPTY(&c->free_list) &&
+        (c->nb_used < atomic_read(&c->limit) || QTAILQ_EMPTY(&c->lru_list))) {
+        t = QTAILQ_FIRST(&c->free_list);
+    } else {
+        t = QTAILQ_FIRST(&c->lru_list);
+    }
+    if (t == NULL) {
         /* This can't happen in current synchronous code, but leave the check
          * here as a reminder for whoever starts using AIO with the cache */
         abort();
     }
 
-    /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
+    /* Cache miss: write back the least recently used table and replace it */
+    i = t - c->entries;
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
 
@@ -351,7 +646,11 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    if (c->entries[i].offset) {
+        qcow2_cache_hash_remove(c, i);
+        c->entries[i].offset = 0;
+        c->nb_used--;
+    }
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
@@ -359,17 +658,23 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
         ret = bdrv_pread(bs->file, offset,
                          qcow2_cache_get_table_addr(bs, c, i),
-                         s->cluster_size);
+                         c->table_size);
         if (ret < 0) {
             return ret;
         }
     }
 
     c->entries[i].offset = offset;
+    qcow2_cache_hash_insert(c, i);
+    c->nb_used++;
 
     /* And return the right table */
 found:
-    c->entries[i].ref++;
+    if (c->entries[i].ref++ == 0) {
+        t = &c->entries[i];
+        QTAILQ_REMOVE(t->free ? &c->free_list : &c->lru_list, t, lru_next);
+        t->free = false;
+    }
     *table = qcow2_cache_get_table_addr(bs, c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
@@ -399,6 +704,7 @@ void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 
     if (c->entries[i].ref == 0) {
         c->entries[i].lru_counter = ++c->lru_counter;
+        QTAILQ_INSERT_TAIL(&c->lru_list, &c->entries[i], lru_next);
     }
 
     assert(c->entries[i].ref >= 0);
@@ -1047,10 +1047,14 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     bool l1_allocated = false;
     int64_t old_offset, old_l2_offset;
     int i, j, l1_modified = 0, nb_csectors;
+    unsigned slice, slice_size2, n_slices;
     int ret;
 
     assert(addend >= -1 && addend <= 1);
 
+    slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    n_slices = s->cluster_size / slice_size2;
+
     l2_table = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * sizeof(uint64_t);
@@ -1095,93 +1099,98 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                 goto fail;
             }
 
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
-            }
+            for (slice = 0; slice < n_slices; slice++) {
+                ret = qcow2_cache_get(bs, s->l2_table_cache,
+                                      l2_offset + slice * slice_size2,
+                                      (void **) &l2_table);
+                if (ret < 0) {
+                    goto fail;
+                }
 
-            for(j = 0; j < s->l2_size; j++) {
-                uint64_t cluster_index;
-
-                offset = be64_to_cpu(l2_table[j]);
-                old_offset = offset;
-                offset &= ~QCOW_OFLAG_COPIED;
-
-                switch (qcow2_get_cluster_type(offset)) {
-                    case QCOW2_CLUSTER_COMPRESSED:
-                        nb_csectors = ((offset >> s->csize_shift) &
-                                       s->csize_mask) + 1;
-                        if (addend != 0) {
-                            ret = update_refcount(bs,
-                                (offset & s->cluster_offset_mask) & ~511,
-                                nb_csectors * 512, abs(addend), addend < 0,
-                                QCOW2_DISCARD_SNAPSHOT);
-                            if (ret < 0) {
+                for (j = 0; j < s->l2_slice_size; j++) {
+                    uint64_t cluster_index;
+
+                    offset = be64_to_cpu(l2_table[j]);
+                    old_offset = offset;
+                    offset &= ~QCOW_OFLAG_COPIED;
+
+                    switch (qcow2_get_cluster_type(offset)) {
+                        case QCOW2_CLUSTER_COMPRESSED:
+                            nb_csectors = ((offset >> s->csize_shift) &
+                                           s->csize_mask) + 1;
+                            if (addend != 0) {
+                                ret = update_refcount(bs,
+                                    (offset & s->cluster_offset_mask) & ~511,
+                                    nb_csectors * 512, abs(addend), addend < 0,
+                                    QCOW2_DISCARD_SNAPSHOT);
+                                if (ret < 0) {
+                                    goto fail;
+                                }
+                            }
+                            /* compressed clusters are never modified */
+                            refcount = 2;
+                            break;
+
+                        case QCOW2_CLUSTER_NORMAL:
+                        case QCOW2_CLUSTER_ZERO:
+                            if (offset_into_cluster(s,
+                                                    offset & L2E_OFFSET_MASK)) {
+                                qcow2_signal_corruption(bs, true, -1, -1,
+                                    "Data cluster offset %#llx unaligned (L2 "
+                                    "offset: %#" PRIx64 ", L2 index: %#x)",
+                                    offset & L2E_OFFSET_MASK, l2_offset,
+                                    slice * s->l2_slice_size + j);
+                                ret = -EIO;
                                 goto fail;
                             }
-                        }
-                        /* compressed clusters are never modified */
-                        refcount = 2;
-                        break;
-
-                    case QCOW2_CLUSTER_NORMAL:
-                    case QCOW2_CLUSTER_ZERO:
-                        if (offset_into_cluster(s, offset & L2E_OFFSET_MASK)) {
-                            qcow2_signal_corruption(bs, true, -1, -1, "Data "
-                                                    "cluster offset %#llx "
-                                                    "unaligned (L2 offset: %#"
-                                                    PRIx64 ", L2 index: %#x)",
-                                                    offset & L2E_OFFSET_MASK,
-                                                    l2_offset, j);
-                            ret = -EIO;
-                            goto fail;
-                        }
 
-                        cluster_index = (offset & L2E_OFFSET_MASK) >> s->cluster_bits;
-                        if (!cluster_index) {
-                            /* unallocated */
-                            refcount = 0;
-                            break;
-                        }
-                        if (addend != 0) {
-                            ret = qcow2_update_cluster_refcount(bs,
-                                    cluster_index, abs(addend), addend < 0,
-                                    QCOW2_DISCARD_SNAPSHOT);
+                            cluster_index = (offset & L2E_OFFSET_MASK)
+                                            >> s->cluster_bits;
+                            if (!cluster_index) {
+                                /* unallocated */
+                                refcount = 0;
+                                break;
+                            }
+                            if (addend != 0) {
+                                ret = qcow2_update_cluster_refcount(bs,
+                                        cluster_index, abs(addend), addend < 0,
+                                        QCOW2_DISCARD_SNAPSHOT);
+                                if (ret < 0) {
+                                    goto fail;
+                                }
+                            }
+
+                            ret = qcow2_get_refcount(bs, cluster_index,
+                                                     &refcount);
                             if (ret < 0) {
                                 goto fail;
                             }
-                        }
-
-                        ret = qcow2_get_refcount(bs, cluster_index, &refcount);
-                        if (ret < 0) {
-                            goto fail;
-                        }
-                        break;
+                            break;
 
-                    case QCOW2_CLUSTER_UNALLOCATED:
-                        refcount = 0;
-                        break;
+                        case QCOW2_CLUSTER_UNALLOCATED:
+                            refcount = 0;
+                            break;
 
-                    default:
-                        abort();
-                }
+                        default:
+                            abort();
+                    }
 
-                if (refcount == 1) {
-                    offset |= QCOW_OFLAG_COPIED;
-                }
-                if (offset != old_offset) {
-                    if (addend > 0) {
-                        qcow2_cache_set_dependency(bs, s->l2_table_cache,
-                            s->refcount_block_cache);
+                    if (refcount == 1) {
+                        offset |= QCOW_OFLAG_COPIED;
+                    }
+                    if (offset != old_offset) {
+                        if (addend > 0) {
+                            qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                s->refcount_block_cache);
+                        }
+                        l2_table[j] = cpu_to_be64(offset);
+                        qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
+                                                     l2_table);
                     }
-                    l2_table[j] = cpu_to_be64(offset);
-                    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
-                                                 l2_table);
                 }
-            }
 
-            qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+                qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+            }
 
             if (addend != 0) {
                 ret = qcow2_update_cluster_refcount(bs, l2_offset >>
@@ -1309,11 +1318,10 @@ static int realloc_refcount_array(BDRVQcow2State *s, void **array,
  *
  * Modifies the number of errors in res.
  */
-static int inc_refcounts(BlockDriverState *bs,
-                         BdrvCheckResult *res,
-                         void **refcount_table,
-                         int64_t *refcount_table_size,
-                         int64_t offset, int64_t size)
+int qcow2_inc_refcounts_imrt(BlockDriverState *bs, BdrvCheckResult *res,
+                             void **refcount_table,
+                             int64_t *refcount_table_size,
+                             int64_t offset, int64_t size)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t start, last, cluster_offset, k, refcount;
@@ -1358,6 +1366,146 @@ enum {
     CHECK_FRAG_INFO = 0x2,      /* update BlockFragInfo counters */
 };
 
+/* Maximum number of L2 tables that are read ahead while checking */
+#define CHECK_L2_READ_AHEAD 16
+
+typedef struct CheckL2Read {
+    BlockDriverState *bs;
+    int l1_index;
+    uint64_t l2_offset;
+    uint64_t *l2_table;
+    bool done;
+    int ret;
+} CheckL2Read;
+
+/*
+ * Reads the L2 tables referenced by an L1 table in L1 order, for checks that
+ * look at every L2 table.  The next few tables are read in parallel while the
+ * caller processes the current one, so that the check is not limited by the
+ * latency of the image file.
+ */
+typedef struct CheckL2Reader {
+    BlockDriverState *bs;
+    const uint64_t *l1_table;   /* in host byte order */
+    int l1_size;
+    int next_l1_index;          /* where to look for the next table to read */
+    int nb_slots;
+    int head;                   /* slot of the table returned last */
+    int in_use;                 /* slots starting at head that are in use */
+    CheckL2Read slots[CHECK_L2_READ_AHEAD];
+} CheckL2Reader;
+
+static void coroutine_fn check_l2_read_entry(void *opaque)
+{
+    CheckL2Read *r = opaque;
+    BDRVQcow2State *s = r->bs->opaque;
+    QEMUIOVector qiov;
+    struct iovec iov = {
+        .iov_base = r->l2_table,
+        .iov_len  = s->l2_size * sizeof(uint64_t),
+    };
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    r->ret = bdrv_co_preadv(r->bs->file, r->l2_offset, iov.iov_len, &qiov, 0);
+    r->done = true;
+}
+
+static int check_l2_reader_init(BlockDriverState *bs, CheckL2Reader *reader,
+                                const uint64_t *l1_table, int l1_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int i;
+
+    *reader = (CheckL2Reader) {
+        .bs         = bs,
+        .l1_table   = l1_table,
+        .l1_size    = l1_size,
+        /* Without a coroutine of our own, there is nothing to wait in */
+        .nb_slots   = qemu_in_coroutine() ? 1 : CHECK_L2_READ_AHEAD,
+    };
+
+    for (i = 0; i < reader->nb_slots; i++) {
+        reader->slots[i].bs = bs;
+        reader->slots[i].l2_table = qemu_try_blockalign(bs->file->bs,
+                                                        s->cluster_size);
+        if (!reader->slots[i].l2_table) {
+            /* Do with fewer tables in flight */
+            reader->nb_slots = i;
+            break;
+        }
+    }
+
+    return reader->nb_slots ? 0 : -ENOMEM;
+}
+
+/*
+ * Returns the next L2 table, with its L1 index and offset.  The table stays
+ * valid until the next call.  Returns 1 on success, 0 once all L1 entries
+ * have been processed, and -errno if the table could not be read.
+ */
+static int check_l2_reader_next(CheckL2Reader *reader, int *l1_index,
+                                uint64_t *l2_offset, uint64_t **l2_table)
+{
+    CheckL2Read *r;
+
+    /* The table returned last is not needed any more */
+    if (reader->in_use && reader->slots[reader->head].done) {
+        reader->head = (reader->head + 1) % reader->nb_slots;
+        reader->in_use--;
+    }
+
+    while (reader->in_use < reader->nb_slots) {
+        while (reader->next_l1_index < reader->l1_size &&
+               !(reader->l1_table[reader->next_l1_index] & L1E_OFFSET_MASK)) {
+            reader->next_l1_index++;
+        }
+        if (reader->next_l1_index == reader->l1_size) {
+            break;
+        }
+
+        r = &reader->slots[(reader->head + reader->in_use) %
+                           reader->nb_slots];
+        r->l1_index = reader->next_l1_index++;
+        r->l2_offset = reader->l1_table[r->l1_index] & L1E_OFFSET_MASK;
+        r->done = false;
+        reader->in_use++;
+
+        if (qemu_in_coroutine()) {
+            check_l2_read_entry(r);
+        } else {
+            qemu_coroutine_enter(qemu_coroutine_create(check_l2_read_entry,
+                                                       r));
+        }
+    }
+
+    if (!reader->in_use) {
+        return 0;
+    }
+
+    r = &reader->slots[reader->head];
+    BDRV_POLL_WHILE(reader->bs->file->bs, !r->done);
+
+    *l1_index = r->l1_index;
+    *l2_offset = r->l2_offset;
+    *l2_table = r->l2_table;
+    return r->ret < 0 ? r->ret : 1;
+}
+
+static void check_l2_reader_cleanup(CheckL2Reader *reader)
+{
+    int i;
+
+    /* Wait for the reads that are still in flight */
+    for (i = 0; i < reader->in_use; i++) {
+        CheckL2Read *r = &reader->slots[(reader->head + i) % reader->nb_slots];
+        BDRV_POLL_WHILE(reader->bs->file->bs, !r->done);
+    }
+
+    for (i = 0; i < reader->nb_slots; i++) {
+        qemu_vfree(reader->slots[i].l2_table);
+    }
+}
+
 /*
  * Increases the refcount in the given refcount table for the all clusters
  * referenced in the L2 table. While doing so, performs some checks on L2
@@ -1368,24 +1516,13 @@ enum {
  */
 static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                               void **refcount_table,
-                              int64_t *refcount_table_size, int64_t l2_offset,
-                              int flags)
+                              int64_t *refcount_table_size,
+                              const uint64_t *l2_table, int flags)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table, l2_entry;
+    uint64_t l2_entry;
     uint64_t next_contiguous_offset = 0;
-    int i, l2_size, nb_csectors, ret;
-
-    /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
-    l2_table = g_malloc(l2_size);
-
-    ret = bdrv_pread(bs->file, l2_offset, l2_table, l2_size);
-    if (ret < 0) {
-        fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-        res->check_errors++;
-        goto fail;
-    }
+    int i, nb_csectors, ret;
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
@@ -1406,10 +1543,11 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             nb_csectors = ((l2_entry >> s->csize_shift) &
                            s->csize_mask) + 1;
             l2_entry &= s->cluster_offset_mask;
-            ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                                l2_entry & ~511, nb_csectors * 512);
+            ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                           refcount_table_size,
+                                           l2_entry & ~511, nb_csectors * 512);
             if (ret < 0) {
-                goto fail;
+                return ret;
             }
 
             if (flags & CHECK_FRAG_INFO) {
@@ -1445,10 +1583,11 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             }
 
             /* Mark cluster as used */
-            ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                                offset, s->cluster_size);
+            ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                           refcount_table_size,
+                                           offset, s->cluster_size);
             if (ret < 0) {
-                goto fail;
+                return ret;
             }
 
             /* Correct offsets are cluster aligned */
@@ -1468,12 +1607,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
-    g_free(l2_table);
     return 0;
-
-fail:
-    g_free(l2_table);
-    return ret;
 }
 
 /*
@@ -1492,14 +1626,15 @@ static int check_refcounts_l1(BlockDriverState *bs,
                               int flags)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l1_table = NULL, l2_offset, l1_size2;
-    int i, ret;
+    CheckL2Reader reader;
+    uint64_t *l1_table = NULL, *l2_table, l2_offset, l1_size2;
+    int i, ret, read_ret;
 
     l1_size2 = l1_size * sizeof(uint64_t);
 
     /* Mark L1 table as used */
-    ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                        l1_table_offset, l1_size2);
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, refcount_table_size,
+                                   l1_table_offset, l1_size2);
     if (ret < 0) {
         goto fail;
     }
@@ -1522,36 +1657,49 @@ static int check_refcounts_l1(BlockDriverState *bs,
             be64_to_cpus(&l1_table[i]);
     }
 
+    ret = check_l2_reader_init(bs, &reader, l1_table, l1_size);
+    if (ret < 0) {
+        res->check_errors++;
+        goto fail;
+    }
+
     /* Do the actual checks */
-    for(i = 0; i < l1_size; i++) {
-        l2_offset = l1_table[i];
-        if (l2_offset) {
-            /* Mark L2 table as used */
-            l2_offset &= L1E_OFFSET_MASK;
-            ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                                l2_offset, s->cluster_size);
-            if (ret < 0) {
-                goto fail;
-            }
+    while ((read_ret = check_l2_reader_next(&reader, &i, &l2_offset,
+                                            &l2_table)) != 0) {
+        /* Mark L2 table as used */
+        ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                       refcount_table_size,
+                                       l2_offset, s->cluster_size);
+        if (ret < 0) {
+            goto fail_reader;
+        }
 
-            /* L2 tables are cluster aligned */
-            if (offset_into_cluster(s, l2_offset)) {
-                fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
-                    "cluster aligned; L1 entry corrupted\n", l2_offset);
-                res->corruptions++;
-            }
+        /* L2 tables are cluster aligned */
+        if (offset_into_cluster(s, l2_offset)) {
+            fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
+                "cluster aligned; L1 entry corrupted\n", l2_offset);
+            res->corruptions++;
+        }
 
-            /* Process and check L2 entries */
-            ret = check_refcounts_l2(bs, res, refcount_table,
-                                     refcount_table_size, l2_offset, flags);
-            if (ret < 0) {
-                goto fail;
-            }
+        /* Process and check L2 entries */
+        if (read_ret < 0) {
+            fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+            res->check_errors++;
+            ret = read_ret;
+            goto fail_reader;
+        }
+        ret = check_refcounts_l2(bs, res, refcount_table,
+                                 refcount_table_size, l2_table, flags);
+        if (ret < 0) {
+            goto fail_reader;
         }
     }
+    check_l2_reader_cleanup(&reader);
     g_free(l1_table);
     return 0;
 
+fail_reader:
+    check_l2_reader_cleanup(&reader);
 fail:
     g_free(l1_table);
     return ret;
@@ -1569,20 +1717,23 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
                               BdrvCheckMode fix)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table = qemu_blockalign(bs, s->cluster_size);
-    int ret;
+    CheckL2Reader reader;
+    uint64_t *l2_table, l2_offset;
+    int ret, read_ret;
     uint64_t refcount;
     int i, j;
 
-    for (i = 0; i < s->l1_size; i++) {
+    ret = check_l2_reader_init(bs, &reader, s->l1_table, s->l1_size);
+    if (ret < 0) {
+        res->check_errors++;
+        return ret;
+    }
+
+    while ((read_ret = check_l2_reader_next(&reader, &i, &l2_offset,
+                                            &l2_table)) != 0) {
         uint64_t l1_entry = s->l1_table[i];
-        uint64_t l2_offset = l1_entry & L1E_OFFSET_MASK;
         bool l2_dirty = false;
 
-        if (!l2_offset) {
-            continue;
-        }
-
         ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits,
                                  &refcount);
         if (ret < 0) {
@@ -1610,9 +1761,8 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
             }
         }
 
-        ret = bdrv_pread(bs->file, l2_offset, l2_table,
-                         s->l2_size * sizeof(uint64_t));
-        if (ret < 0) {
+        if (read_ret < 0) {
+            ret = read_ret;
             fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
                     strerror(-ret));
             res->check_errors++;
@@ -1676,7 +1826,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
     ret = 0;
 
 fail:
-    qemu_vfree(l2_table);
+    check_l2_reader_cleanup(&reader);
     return ret;
 }
 
@@ -1744,14 +1894,15 @@ static int check_refblocks(BlockDriverState *bs, BdrvCheckResult *res,
                 }
 
                 res->corruptions_fixed++;
-                ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                                    offset, s->cluster_size);
+                ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                               nb_clusters,
+                                               offset, s->cluster_size);
                 if (ret < 0) {
                     return ret;
                 }
                 /* No need to check whether the refcount is now greater than 1:
                  * This area was just allocated and zeroed, so it can only be
-                 * exactly 1 after inc_refcounts() */
+                 * exactly 1 after qcow2_inc_refcounts_imrt() */
                 continue;
 
 resize_fail:
@@ -1766,8 +1917,8 @@ resize_fail:
         }
 
         if (offset != 0) {
-            ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                                offset, s->cluster_size);
+            ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                           offset, s->cluster_size);
             if (ret < 0) {
                 return ret;
             }
@@ -1807,8 +1958,8 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     }
 
     /* header */
-    ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                        0, s->cluster_size);
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                   0, s->cluster_size);
     if (ret < 0) {
         return ret;
     }
@@ -1829,16 +1980,22 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
             return ret;
         }
     }
-    ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                        s->snapshots_offset, s->snapshots_size);
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                   s->snapshots_offset, s->snapshots_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* bitmaps */
+    ret = qcow2_check_bitmaps_refcounts(bs, res, refcount_table, nb_clusters);
     if (ret < 0) {
         return ret;
     }
 
     /* refcount data */
-    ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
-                        s->refcount_table_offset,
-                        s->refcount_table_size * sizeof(uint64_t));
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                   s->refcount_table_offset,
+                                   s->refcount_table_size * sizeof(uint64_t));
     if (ret < 0) {
         return ret;
     }
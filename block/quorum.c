@@ -101,6 +101,7 @@ typedef struct QuorumChildRequest {
     QEMUIOVector qiov;
     uint8_t *buf;
     int ret;
+    bool done;                  /* the child request has completed */
     QuorumAIOCB *parent;
 } QuorumChildRequest;
 
@@ -131,6 +132,10 @@ struct QuorumAIOCB {
     bool is_read;
     int vote_ret;
     int children_read;          /* how many children have been read from */
+
+    bool early_vote;            /* votes are counted as the reads complete */
+    bool completed;             /* the caller has been given the result */
+    QuorumVoteVersion *winner;  /* for an early vote, the version returned */
 };
 
 static bool quorum_vote(QuorumAIOCB *acb);
@@ -143,7 +148,7 @@ static void quorum_aio_cancel(BlockAIOCB *blockacb)
 
     /* cancel all callbacks */
     for (i = 0; i < s->num_children; i++) {
-        if (acb->qcrs[i].aiocb) {
+        if (acb->qcrs[i].aiocb && !acb->qcrs[i].done) {
             bdrv_aio_cancel_async(acb->qcrs[i].aiocb);
         }
     }
@@ -154,9 +159,32 @@ static AIOCBInfo quorum_aiocb_info = {
     .cancel_async       = quorum_aio_cancel,
 };
 
+static void quorum_free_vote_list(QuorumVotes *votes);
+
+/* Give the caller its result.  After an early vote this happens before all
+ * children are done, and the request lives on until quorum_aio_finalize().
+ */
+static void quorum_aio_complete(QuorumAIOCB *acb)
+{
+    if (!acb->completed) {
+        acb->completed = true;
+        acb->common.cb(acb->common.opaque, acb->vote_ret);
+    }
+}
+
 static void quorum_aio_finalize(QuorumAIOCB *acb)
 {
-    acb->common.cb(acb->common.opaque, acb->vote_ret);
+    BDRVQuorumState *s = acb->common.bs->opaque;
+    int i;
+
+    quorum_aio_complete(acb);
+    for (i = 0; i < s->num_children; i++) {
+        if (acb->qcrs[i].buf) {
+            qemu_vfree(acb->qcrs[i].buf);
+            qemu_iovec_destroy(&acb->qcrs[i].qiov);
+        }
+    }
+    quorum_free_vote_list(&acb->votes);
     g_free(acb->qcrs);
     qemu_aio_unref(acb);
 }
@@ -194,10 +222,14 @@ static QuorumAIOCB *quorum_aio_get(BDRVQuorumState *s,
     QLIST_INIT(&acb->votes.vote_list);
     acb->is_read = false;
     acb->vote_ret = 0;
+    acb->early_vote = false;
+    acb->completed = false;
+    acb->winner = NULL;
 
     for (i = 0; i < s->num_children; i++) {
         acb->qcrs[i].buf = NULL;
         acb->qcrs[i].ret = 0;
+        acb->qcrs[i].done = false;
         acb->qcrs[i].parent = acb;
     }
 
@@ -242,11 +274,15 @@ static void quorum_rewrite_aio_cb(void *opaque, int ret)
 {
     QuorumAIOCB *acb = opaque;
 
+    BDRVQuorumState *s = acb->common.bs->opaque;
+
     /* one less rewrite to do */
     acb->rewrite_count--;
 
-    /* wait until all rewrite callbacks have completed */
-    if (acb->rewrite_count) {
+    /* wait until all rewrite callbacks have completed, and after an early
+     * vote until the remaining children are done
+     */
+    if (acb->rewrite_count || acb->count < s->num_children) {
         return;
     }
 
@@ -300,40 +336,44 @@ static void quorum_fifo_aio_cb(void *opaque, int ret)
     quorum_aio_finalize(acb);
 }
 
+static void quorum_early_vote(QuorumAIOCB *acb, int i);
+
 static void quorum_aio_cb(void *opaque, int ret)
 {
     QuorumChildRequest *sacb = opaque;
     QuorumAIOCB *acb = sacb->parent;
     BDRVQuorumState *s = acb->common.bs->opaque;
-    bool rewrite = false;
-    int i;
 
     sacb->ret = ret;
+    sacb->done = true;
     if (ret == 0) {
         acb->success_count++;
-    } else {
+    } else if (!(acb->completed && ret == -ECANCELED)) {
+        /* stragglers cancelled after an early vote aren't at fault */
         quorum_report_bad_acb(sacb, ret);
     }
     acb->count++;
     assert(acb->count <= s->num_children);
     assert(acb->success_count <= s->num_children);
+
+    if (acb->early_vote && ret == 0) {
+        quorum_early_vote(acb, sacb - acb->qcrs);
+    }
     if (acb->count < s->num_children) {
         return;
     }
 
-    /* Do the vote on read */
-    if (acb->is_read) {
-        rewrite = quorum_vote(acb);
-        for (i = 0; i < s->num_children; i++) {
-            qemu_vfree(acb->qcrs[i].buf);
-            qemu_iovec_destroy(&acb->qcrs[i].qiov);
-        }
-    } else {
+    /* Do the vote on read, unless an early vote already returned it */
+    if (acb->is_read && !acb->completed) {
+        /* the early vote found no quorum, the full vote reports why */
+        quorum_free_vote_list(&acb->votes);
+        quorum_vote(acb);
+    } else if (!acb->is_read) {
         quorum_has_too_much_io_failed(acb);
     }
 
-    /* if no rewrite is done the code will finish right away */
-    if (!rewrite) {
+    /* if no rewrite is pending the code will finish right away */
+    if (!acb->rewrite_count) {
         quorum_aio_finalize(acb);
     }
 }
@@ -395,9 +435,9 @@ static bool quorum_rewrite_bad_versions(BDRVQuorumState *s, QuorumAIOCB *acb,
     return count;
 }
 
-static void quorum_count_vote(QuorumVotes *votes,
-                              QuorumVoteValue *value,
-                              int index)
+static QuorumVoteVersion *quorum_count_vote(QuorumVotes *votes,
+                                            QuorumVoteValue *value,
+                                            int index)
 {
     QuorumVoteVersion *v = NULL, *version = NULL;
     QuorumVoteItem *item;
@@ -425,6 +465,8 @@ static void quorum_count_vote(QuorumVotes *votes,
     item = g_new0(QuorumVoteItem, 1);
     item->index = index;
     QLIST_INSERT_HEAD(&version->items, item, next);
+
+    return version;
 }
 
 static void quorum_free_vote_list(QuorumVotes *votes)
@@ -461,6 +503,92 @@ static int quorum_compute_hash(QuorumAIOCB *acb, int i, QuorumVoteValue *hash)
     return 0;
 }
 
+/* Rewrite child i with the version returned by an early vote */
+static void quorum_rewrite_child(QuorumAIOCB *acb, int i)
+{
+    BDRVQuorumState *s = acb->common.bs->opaque;
+
+    /* the caller may already have reused acb->qiov */
+    acb->rewrite_count++;
+    bdrv_aio_writev(s->children[i], acb->sector_num,
+                    &acb->qcrs[acb->winner->index].qiov, acb->nb_sectors,
+                    quorum_rewrite_aio_cb, acb);
+}
+
+/* Count the vote of child i as soon as its read succeeds, and complete the
+ * read once vote-threshold children agree, so that its latency is that of
+ * the fastest quorum rather than of the slowest child.  The remaining
+ * children are cancelled, or, with rewrite-corrupted, still checked against
+ * the winner and rewritten if they differ.  With a threshold of half the
+ * children or less, the first version to reach it wins even if another
+ * would have had more votes in the end.
+ */
+static void quorum_early_vote(QuorumAIOCB *acb, int i)
+{
+    BDRVQuorumState *s = acb->common.bs->opaque;
+    QuorumVoteVersion *version;
+    QuorumVoteVersion *v;
+    QuorumVoteItem *item;
+    QuorumVoteValue hash;
+    int j;
+
+    if (quorum_compute_hash(acb, i, &hash) < 0) {
+        if (!acb->completed) {
+            /* leave it to the full vote once all children are done */
+            acb->early_vote = false;
+            quorum_free_vote_list(&acb->votes);
+        }
+        return;
+    }
+    version = quorum_count_vote(&acb->votes, &hash, i);
+
+    if (acb->completed) {
+        /* a straggler, the caller already has the winning version */
+        if (version != acb->winner) {
+            quorum_report_bad(QUORUM_OP_TYPE_READ, acb->sector_num,
+                              acb->nb_sectors, s->children[i]->bs->node_name,
+                              0);
+            if (s->rewrite_corrupted) {
+                quorum_rewrite_child(acb, i);
+            }
+        }
+        return;
+    }
+    if (version->vote_count < s->threshold) {
+        return;
+    }
+
+    acb->winner = version;
+    quorum_copy_qiov(acb->qiov, &acb->qcrs[version->index].qiov);
+    quorum_report_bad_versions(s, acb, &version->value);
+    if (s->rewrite_corrupted) {
+        QLIST_FOREACH(v, &acb->votes.vote_list, next) {
+            if (v == version) {
+                continue;
+            }
+            QLIST_FOREACH(item, &v->items, next) {
+                quorum_rewrite_child(acb, item->index);
+            }
+        }
+    }
+    acb->vote_ret = 0;
+
+    /* cancelling may complete children right away, which must not free acb
+     * under us
+     */
+    qemu_aio_ref(acb);
+    quorum_aio_complete(acb);
+    if (!s->rewrite_corrupted) {
+        for (j = 0; j < s->num_children && acb->count < s->num_children;
+             j++) {
+            if (!acb->qcrs[j].done) {
+                bdrv_aio_cancel_async(acb->qcrs[j].aiocb);
+            }
+        }
+    }
+    qemu_aio_unref(acb);
+}
+
 static QuorumVoteVersion *quorum_get_vote_winner(QuorumVotes *votes)
 {
     int max = 0;
@@ -656,6 +784,8 @@ static BlockAIOCB *read_quorum_children(QuorumAIOCB *acb)
     int i;
 
     acb->children_read = s->num_children;
+    /* blkverify compares every child byte by byte */
+    acb->early_vote = !s->is_blkverify;
     for (i = 0; i < s->num_children; i++) {
         acb->qcrs[i].buf = qemu_blockalign(s->children[i]->bs, acb->qiov->size);
         qemu_iovec_init(&acb->qcrs[i].qiov, acb->qiov->niov);
@@ -52,15 +52,24 @@
  * bdrv_set_aio_context()). Therefore in this file a thread will
  * access some other BlockBackend's timers only after verifying that
  * that BlockBackend has throttled requests in the queue.
+ *
+ * Members with pending requests are served in start-time fair queueing
+ * order: each member has a virtual time that advances by the cost of
+ * every request it submits divided by its weight, and the member with
+ * the smallest virtual time goes next. A member that was idle catches up
+ * with the virtual time of the group when it queues a request, so it
+ * cannot save up a share it did not use.
  */
 typedef struct ThrottleGroup {
     char *name; /* This is constant during the lifetime of the group */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    QemuMutex lock; /* This lock protects the following five fields */
     ThrottleState ts;
     QLIST_HEAD(, BlockBackendPublic) head;
     BlockBackend *tokens[2];
     bool any_timer_armed[2];
+    /* Virtual time of the last request that was let through */
+    uint64_t vtime[2];
 
     /* These two are protected by the global throttle_groups_lock */
     unsigned refcount;
@@ -184,8 +193,10 @@ static inline bool blk_has_pending_reqs(BlockBackend *blk,
     return blkp->pending_reqs[is_write];
 }
 
-/* Return the next BlockBackend in the round-robin sequence with pending I/O
- * requests.
+/* Return the BlockBackend with pending I/O requests that has the smallest
+ * virtual time. Ties go to the first one in the round-robin sequence after
+ * the current token, so members with equal weights and request sizes are
+ * served round robin.
  *
  * This assumes that tg->lock is held.
  *
@@ -198,28 +209,70 @@ static BlockBackend *next_throttle_token(BlockBackend *blk, bool is_write)
 {
     BlockBackendPublic *blkp = blk_get_public(blk);
     ThrottleGroup *tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
-    BlockBackend *token, *start;
+    BlockBackend *token, *start, *best = NULL;
+    uint64_t best_vtime = 0;
 
     start = token = tg->tokens[is_write];
-
-    /* get next bs round in round robin style */
-    token = throttle_group_next_blk(token);
-    while (token != start && !blk_has_pending_reqs(token, is_write)) {
+    do {
         token = throttle_group_next_blk(token);
-    }
+        if (blk_has_pending_reqs(token, is_write)) {
+            uint64_t vtime = blk_get_public(token)->throttle_vtime[is_write];
+            if (!best || vtime < best_vtime) {
+                best = token;
+                best_vtime = vtime;
+            }
+        }
+    } while (token != start);
 
-    /* If no IO are queued for scheduling on the next round robin token
-     * then decide the token is the current bs because chances are
-     * the current bs get the current request queued.
+    /* If no IO are queued for scheduling then decide the token is the
+     * current bs because chances are the current bs get the current
+     * request queued.
      */
-    if (token == start && !blk_has_pending_reqs(token, is_write)) {
-        token = blk;
+    if (!best) {
+        best = blk;
     }
 
     /* Either we return the original BB, or one with pending requests */
-    assert(token == blk || blk_has_pending_reqs(token, is_write));
+    assert(best == blk || blk_has_pending_reqs(best, is_write));
+
+    return best;
+}
+
+/* Move the virtual time of a BlockBackend up to the one of its group, so
+ * that time it spent idle does not count as service it is owed.
+ *
+ * This assumes that tg->lock is held.
+ */
+static void throttle_group_catch_up(BlockBackend *blk, bool is_write)
+{
+    BlockBackendPublic *blkp = blk_get_public(blk);
+    ThrottleGroup *tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
+
+    blkp->throttle_vtime[is_write] = MAX(blkp->throttle_vtime[is_write],
+                                         tg->vtime[is_write]);
+}
+
+/* Advance the virtual times of a BlockBackend and its group for a request
+ * that is about to be executed.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @blk:       the current BlockBackend
+ * @bytes:     the number of bytes for this I/O
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_group_charge(BlockBackend *blk, unsigned int bytes,
+                                  bool is_write)
+{
+    BlockBackendPublic *blkp = blk_get_public(blk);
+    ThrottleGroup *tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
+    uint64_t cost = (uint64_t) bytes + THROTTLE_GROUP_REQ_COST;
 
-    return token;
+    throttle_group_catch_up(blk, is_write);
+    tg->vtime[is_write] = MAX(tg->vtime[is_write],
+                              blkp->throttle_vtime[is_write]);
+    blkp->throttle_vtime[is_write] +=
+        cost * THROTTLE_GROUP_MAX_WEIGHT / blkp->throttle_weight;
 }
 
 /* Check if the next I/O request for a BlockBackend needs to be throttled or
@@ -285,12 +338,15 @@ static void schedule_next_request(BlockBackend *blk, bool is_write)
 
     /* If it doesn't have to wait, queue it for immediate execution */
     if (!must_wait) {
-        /* Give preference to requests from the current blk */
-        if (qemu_in_coroutine() &&
-            qemu_co_queue_next(&blkp->throttled_reqs[is_write])) {
-            token = blk;
-        } else {
-            ThrottleTimers *tt = &blk_get_public(token)->throttle_timers;
+        BlockBackendPublic *tokenp = blk_get_public(token);
+
+        /* A request that runs in this thread can be restarted as soon as
+         * the current coroutine yields; only waking up a request in
+         * another thread needs a timer */
+        if (!qemu_in_coroutine() ||
+            !aio_context_in_iothread(blk_get_aio_context(token)) ||
+            !qemu_co_queue_next(&tokenp->throttled_reqs[is_write])) {
+            ThrottleTimers *tt = &tokenp->throttle_timers;
             int64_t now = qemu_clock_get_ns(tt->clock_type);
             timer_mod(tt->timers[is_write], now + 1);
             tg->any_timer_armed[is_write] = true;
@@ -324,6 +380,9 @@ void coroutine_fn throttle_group_co_io_limits_intercept(BlockBackend *blk,
 
     /* Wait if there's a timer set or queued requests of this type */
     if (must_wait || blkp->pending_reqs[is_write]) {
+        if (blkp->pending_reqs[is_write] == 0) {
+            throttle_group_catch_up(blk, is_write);
+        }
         blkp->pending_reqs[is_write]++;
         qemu_mutex_unlock(&tg->lock);
         qemu_co_queue_wait(&blkp->throttled_reqs[is_write]);
@@ -333,6 +392,7 @@ void coroutine_fn throttle_group_co_io_limits_intercept(BlockBackend *blk,
 
     /* The I/O will be executed, so do the accounting */
     throttle_account(blkp->throttle_state, is_write, bytes);
+    throttle_group_charge(blk, bytes, is_write);
 
     /* Schedule the next request */
     schedule_next_request(blk, is_write);
@@ -380,6 +440,41 @@ void throttle_group_config(BlockBackend *blk, ThrottleConfig *cfg)
     qemu_co_enter_next(&blkp->throttled_reqs[1]);
 }
 
+/* Set the share of the group's limits that a BlockBackend gets while other
+ * members are busy too. Members get throughput in proportion to their
+ * weights.
+ *
+ * @blk:    a BlockBackend that is a member of a group
+ * @weight: the new weight, between 1 and THROTTLE_GROUP_MAX_WEIGHT
+ */
+void throttle_group_set_weight(BlockBackend *blk, unsigned int weight)
+{
+    BlockBackendPublic *blkp = blk_get_public(blk);
+    ThrottleGroup *tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
+
+    assert(weight >= 1 && weight <= THROTTLE_GROUP_MAX_WEIGHT);
+    qemu_mutex_lock(&tg->lock);
+    blkp->throttle_weight = weight;
+    qemu_mutex_unlock(&tg->lock);
+}
+
+/* Get the weight of a BlockBackend in its group.
+ *
+ * @blk: a BlockBackend that is a member of a group
+ * @ret: the weight
+ */
+unsigned int throttle_group_get_weight(BlockBackend *blk)
+{
+    BlockBackendPublic *blkp = blk_get_public(blk);
+    ThrottleGroup *tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
+    unsigned int weight;
+
+    qemu_mutex_lock(&tg->lock);
+    weight = blkp->throttle_weight;
+    qemu_mutex_unlock(&tg->lock);
+    return weight;
+}
+
 /* Get the throttle configuration from a particular group. Similar to
  * throttle_get_config(), but guarantees atomicity within the
  * throttling group.
@@ -469,6 +564,14 @@ void throttle_group_register_blk(BlockBackend *blk, const char *groupname)
 
     QLIST_INSERT_HEAD(&tg->head, blkp, round_robin);
 
+    /* New members start with the current virtual time of the group */
+    if (!blkp->throttle_weight) {
+        blkp->throttle_weight = THROTTLE_GROUP_DEFAULT_WEIGHT;
+    }
+    for (i = 0; i < 2; i++) {
+        blkp->throttle_vtime[i] = tg->vtime[i];
+    }
+
     throttle_timers_init(&blkp->throttle_timers,
                          blk_get_aio_context(blk),
                          clock_type,
@@ -367,6 +367,8 @@ static void extract_common_blockdev_options(QemuOpts *opts, int *bdrv_flags,
         if ((aio = qemu_opt_get(opts, "aio")) != NULL) {
             if (!strcmp(aio, "native")) {
                 *bdrv_flags |= BDRV_O_NATIVE_AIO;
+            } else if (!strcmp(aio, "io_uring")) {
+                *bdrv_flags |= BDRV_O_IO_URING;
             } else if (!strcmp(aio, "threads")) {
                 /* this is the default */
             } else {
@@ -465,6 +467,7 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
     BlockdevDetectZeroesOptions detect_zeroes =
         BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF;
     const char *throttling_group = NULL;
+    uint64_t throttling_weight;
 
     /* Check common options by copying from bs_opts to opts, all other options
      * stay in bs_opts for processing by bdrv_open(). */
@@ -511,6 +514,15 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
         goto early_err;
     }
 
+    throttling_weight = qemu_opt_get_number(opts, "throttling.group-weight",
+                                            THROTTLE_GROUP_DEFAULT_WEIGHT);
+    if (throttling_weight < 1 ||
+        throttling_weight > THROTTLE_GROUP_MAX_WEIGHT) {
+        error_setg(errp, "throttling.group-weight must be between 1 and %d",
+                   THROTTLE_GROUP_MAX_WEIGHT);
+        goto early_err;
+    }
+
     if ((buf = qemu_opt_get(opts, "format")) != NULL) {
         if (is_help_option(buf)) {
             error_printf("Supported formats:");
@@ -606,6 +618,7 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
             throttling_group = id;
         }
         blk_io_limits_enable(blk, throttling_group);
+        throttle_group_set_weight(blk, throttling_weight);
         blk_set_io_limits(blk, &cfg);
     }
 
@@ -1967,6 +1980,7 @@ static void block_dirty_bitmap_add_prepare(BlkActionState *common,
     /* AIO context taken and released within qmp_block_dirty_bitmap_add */
     qmp_block_dirty_bitmap_add(action->node, action->name,
                                action->has_granularity, action->granularity,
+                               action->has_persistent, action->persistent,
                                &local_err);
 
     if (!local_err) {
@@ -2672,6 +2686,14 @@ void qmp_block_set_io_throttle(BlockIOThrottle *arg, Error **errp)
         goto out;
     }
 
+    if (arg->has_group_weight &&
+        (arg->group_weight < 1 ||
+         arg->group_weight > THROTTLE_GROUP_MAX_WEIGHT)) {
+        error_setg(errp, "group-weight must be between 1 and %d",
+                   THROTTLE_GROUP_MAX_WEIGHT);
+        goto out;
+    }
+
     if (throttle_enabled(&cfg)) {
         /* Enable I/O limits if they're not enabled yet, otherwise
          * just update the throttling group. */
@@ -2683,6 +2705,9 @@ void qmp_block_set_io_throttle(BlockIOThrottle *arg, Error **errp)
         } else if (arg->has_group) {
             blk_io_limits_update_group(blk, arg->group);
         }
+        if (arg->has_group_weight) {
+            throttle_group_set_weight(blk, arg->group_weight);
+        }
         /* Set the new throttling configuration */
         blk_set_io_limits(blk, &cfg);
     } else if (blk_get_public(blk)->throttle_state) {
@@ -2694,12 +2719,102 @@ out:
     aio_context_release(aio_context);
 }
 
+static int block_latency_histogram_set_list(BlockAcctStats *stats,
+                                            enum BlockAcctType type,
+                                            uint64List *list)
+{
+    uint64_t *boundaries;
+    uint64List *entry;
+    int n = 0, ret;
+
+    for (entry = list; entry; entry = entry->next) {
+        n++;
+    }
+    boundaries = g_new(uint64_t, n);
+    for (entry = list, n = 0; entry; entry = entry->next) {
+        boundaries[n++] = entry->value;
+    }
+
+    ret = block_latency_histogram_set(stats, type, boundaries, n);
+    g_free(boundaries);
+    return ret;
+}
+
+void qmp_x_block_latency_histogram_set(const char *device,
+                                       bool has_boundaries,
+                                       uint64List *boundaries,
+                                       bool has_boundaries_read,
+                                       uint64List *boundaries_read,
+                                       bool has_boundaries_write,
+                                       uint64List *boundaries_write,
+                                       bool has_boundaries_flush,
+                                       uint64List *boundaries_flush,
+                                       Error **errp)
+{
+    BlockBackend *blk;
+    BlockAcctStats *stats;
+    AioContext *aio_context;
+    struct {
+        enum BlockAcctType type;
+        bool has_list;
+        uint64List *list;
+        const char *name;
+    } lists[] = {
+        { BLOCK_ACCT_READ, has_boundaries_read, boundaries_read,
+          "boundaries-read" },
+        { BLOCK_ACCT_WRITE, has_boundaries_write, boundaries_write,
+          "boundaries-write" },
+        { BLOCK_ACCT_FLUSH, has_boundaries_flush, boundaries_flush,
+          "boundaries-flush" },
+    };
+    int i;
+
+    blk = qmp_get_blk(device, NULL, errp);
+    if (!blk) {
+        return;
+    }
+
+    aio_context = blk_get_aio_context(blk);
+    aio_context_acquire(aio_context);
+    stats = blk_get_stats(blk);
+
+    if (!has_boundaries && !has_boundaries_read && !has_boundaries_write &&
+        !has_boundaries_flush) {
+        block_latency_histograms_clear(stats);
+        goto out;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(lists); i++) {
+        const char *name = lists[i].name;
+        uint64List *list = lists[i].list;
+
+        if (!lists[i].has_list) {
+            if (!has_boundaries) {
+                continue;
+            }
+            name = "boundaries";
+            list = boundaries;
+        }
+
+        if (block_latency_histogram_set_list(stats, lists[i].type, list)) {
+            error_setg(errp, "Parameter '%s' must be a list of strictly "
+                       "increasing values", name);
+            goto out;
+        }
+    }
+
+out:
+    aio_context_release(aio_context);
+}
+
 void qmp_block_dirty_bitmap_add(const char *node, const char *name,
                                 bool has_granularity, uint32_t granularity,
+                                bool has_persistent, bool persistent,
                                 Error **errp)
 {
     AioContext *aio_context;
     BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
 
     if (!name || name[0] == '\0') {
         error_setg(errp, "Bitmap name cannot be empty");
@@ -2725,7 +2840,15 @@ void qmp_block_dirty_bitmap_add(const char *node, const char *name,
         granularity = bdrv_get_default_bitmap_granularity(bs);
     }
 
-    bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (has_persistent && persistent &&
+        !bdrv_can_store_new_dirty_bitmap(bs, name, granularity, errp)) {
+        goto out;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (bitmap && has_persistent && persistent) {
+        bdrv_dirty_bitmap_set_persistance(bitmap, true);
+    }
 
  out:
     aio_context_release(aio_context);
@@ -3978,7 +4101,7 @@ QemuOptsList qemu_common_drive_opts = {
         },{
             .name = "aio",
             .type = QEMU_OPT_STRING,
-            .help = "host AIO implementation (threads, native)",
+            .help = "host AIO implementation (threads, native, io_uring)",
         },{
             .name = BDRV_OPT_CACHE_WB,
             .type = QEMU_OPT_BOOL,
@@ -4079,6 +4202,10 @@ QemuOptsList qemu_common_drive_opts = {
             .name = "throttling.group",
             .type = QEMU_OPT_STRING,
             .help = "name of the block throttling group",
+        },{
+            .name = "throttling.group-weight",
+            .type = QEMU_OPT_NUMBER,
+            .help = "share of the group limits relative to other members",
         },{
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
@@ -37,7 +37,9 @@
 #include "exec/exec-all.h"
 #include "tcg.h"
 #include "qemu/atomic.h"
+#include "qemu/main-loop.h"
 #include "sysemu/qtest.h"
+#include "sysemu/sysemu.h"
 #include "qemu/timer.h"
 #include "exec/address-spaces.h"
 #include "qemu/rcu.h"
@@ -51,6 +53,7 @@
 
 #include "panda/callback_support.h"
 #include "panda/common.h"
+#include "panda/plugin.h"
 
 #ifdef CONFIG_LLVM
 #include "panda/tcg-llvm.h"
@@ -59,6 +62,85 @@ const int has_llvm_engine = 1;
 
 int generate_llvm = 0;
 int execute_llvm = 0;
+unsigned llvm_tier_threshold = 0;
+unsigned llvm_trace_threshold = 0;
+
+#if defined(CONFIG_LLVM)
+/* Set while a before_block_exec_skip_llvm callback has execute_llvm turned
+   off for one block, so a longjmp out of the block can turn it back on.  */
+static bool panda_llvm_skipped = false;
+
+/* Retranslate tb with LLVM code, now that it has run llvm_tier_threshold
+   times as TCG.  This happens between blocks, where the TCG and LLVM code
+   agree on the guest state, so the new TB just carries on from there.  */
+static void llvm_tier_promote(CPUState *cpu, TranslationBlock *tb)
+{
+    TranslationBlock *hot;
+
+    mmap_lock();
+    tb_lock();
+    tb_phys_invalidate(tb, -1);
+    panda_callbacks_before_block_translate(cpu, tb->pc);
+    hot = tb_gen_code(cpu, tb->pc, tb->cs_base, tb->flags,
+                      tb->cflags | CF_LLVM);
+    panda_callbacks_after_block_translate(cpu, hot);
+    tb_unlock();
+    mmap_unlock();
+}
+
+/* Whether a trace may run its blocks without coming back here in between.
+   Replay has to see every block, and so do these callbacks.  */
+static inline bool llvm_trace_allowed(CPUState *cpu)
+{
+    return rr_mode != RR_REPLAY && !cpu->singlestep_enabled &&
+        !panda_cb_arrays[PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT].n &&
+        !panda_cb_arrays[PANDA_CB_BEFORE_BLOCK_EXEC].n &&
+        !panda_cb_arrays[PANDA_CB_BEFORE_BLOCK_EXEC_SKIP_LLVM].n &&
+        !panda_cb_arrays[PANDA_CB_AFTER_BLOCK_EXEC].n;
+}
+
+/* tb has just been found to run after last_tb.  Once it has done so
+   llvm_trace_threshold times in a row, build a trace from last_tb.  */
+static inline void llvm_trace_note(TranslationBlock *last_tb,
+                                   TranslationBlock *tb)
+{
+    if (last_tb->llvm_trace_next != tb) {
+        last_tb->llvm_trace_next = tb;
+        last_tb->llvm_trace_hits = 0;
+    }
+    if (last_tb->llvm_trace_hits < llvm_trace_threshold &&
+            ++last_tb->llvm_trace_hits == llvm_trace_threshold &&
+            !last_tb->llvm_trace_tc_ptr) {
+        tb_lock();
+        tcg_llvm_gen_trace(tcg_llvm_ctx, last_tb);
+        tb_unlock();
+    }
+}
+
+/* Only the exits that a direct jump could be chained to go on within a
+   trace, and only to the TB that tb_find would have found, i.e. the rules
+   for chaining plus a check of the CPU state. */
+int tcg_llvm_trace_continue(CPUArchState *env, uintptr_t ret,
+                            TranslationBlock *next)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+    target_ulong pc, cs_base;
+    uint32_t flags;
+
+    if (!(ret & ~TB_EXIT_MASK) || (ret & TB_EXIT_MASK) > TB_EXIT_IDX1 ||
+            atomic_read(&cpu->interrupt_request) ||
+            atomic_read(&cpu->exit_request) ||
+            atomic_read(&next->invalid) || !llvm_trace_allowed(cpu)) {
+        return 0;
+    }
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    if (next->pc != pc || next->cs_base != cs_base || next->flags != flags) {
+        return 0;
+    }
+    tcg_llvm_runtime.last_tb = next;
+    return 1;
+}
+#endif
 
 /* -icount align implementation. */
 
@@ -192,14 +274,39 @@ static inline tcg_target_ulong cpu_tb_exec(CPUState *cpu, TranslationBlock *itb)
 
     cpu->can_do_io = !use_icount;
 
-    panda_callbacks_before_block_exec(cpu, itb);
+    if (!itb->panda_inline_exec) {
+        panda_callbacks_before_block_exec(cpu, itb);
+    }
+
+    if (unlikely(tb_profile_enabled)) {
+        itb->prof_entries++;
+        tb_profile_state = TB_PROF_EXEC;
+    }
 
 
 #if defined(CONFIG_LLVM)
-    if (execute_llvm){
+    /* A TB only lacks LLVM code when it isn't hot yet (llvm_tier_threshold)
+       or its code is still being generated (tcg_llvm_async) */
+    bool llvm_cold = execute_llvm && !atomic_read(&itb->llvm_tc_ptr);
+    if (llvm_cold ||
+            (execute_llvm && panda_callbacks_before_block_exec_skip_llvm(cpu, itb))) {
+        /* execute_llvm also tells cpu_restore_state and tb_find_pc which
+           code is running, so it has to be off for the TCG code */
+        assert(tb_ptr);
+        execute_llvm = 0;
+        panda_llvm_skipped = true;
+        ret = tcg_qemu_tb_exec(env, tb_ptr);
+        panda_llvm_skipped = false;
+        execute_llvm = 1;
+    } else if (execute_llvm) {
         assert(itb->llvm_tc_ptr);
         //next_tb = tcg_llvm_qemu_tb_exec(env, tb);
-        ret = tcg_llvm_qemu_tb_exec(env, itb);
+        if (llvm_trace_threshold && itb->llvm_trace_tc_ptr &&
+                llvm_trace_allowed(cpu)) {
+            ret = tcg_llvm_qemu_trace_exec(env, itb);
+        } else {
+            ret = tcg_llvm_qemu_tb_exec(env, itb);
+        }
     } else {
         assert(tb_ptr);
         ret = tcg_qemu_tb_exec(env, tb_ptr);
@@ -214,9 +321,19 @@ static inline tcg_target_ulong cpu_tb_exec(CPUState *cpu, TranslationBlock *itb)
     cpu->can_do_io = 1;
     last_tb = (TranslationBlock *)(ret & ~TB_EXIT_MASK);
 
-    panda_callbacks_after_block_exec(cpu, itb);
+    if (cpu->panda_exec_tb) {
+        /* the last of the TBs that ran, chained or not */
+        panda_callbacks_after_block_exec(cpu, cpu->panda_exec_tb);
+        cpu->panda_exec_tb = NULL;
+    } else if (!itb->panda_inline_exec) {
+        panda_callbacks_after_block_exec(cpu, itb);
+    }
 
     tb_exit = ret & TB_EXIT_MASK;
+    if (unlikely(tb_profile_enabled)) {
+        tb_profile_state = TB_PROF_OTHER;
+        tb_profile_exit(last_tb, tb_exit);
+    }
     trace_exec_tb_exit(last_tb, tb_exit);
 
     if (tb_exit > TB_EXIT_IDX1) {
@@ -243,6 +360,15 @@ static inline tcg_target_ulong cpu_tb_exec(CPUState *cpu, TranslationBlock *itb)
          */
         atomic_set(&cpu->tcg_exit_req, 0);
     }
+#if defined(CONFIG_LLVM)
+    /* CF_LLVM TBs already have their LLVM code on the way (tcg_llvm_async) */
+    if (llvm_cold && llvm_tier_threshold && !itb->panda_uninstr &&
+            !(itb->cflags & (CF_NOCACHE | CF_LLVM)) &&
+            !atomic_read(&itb->invalid) &&
+            ++itb->llvm_exec_count >= llvm_tier_threshold) {
+        llvm_tier_promote(cpu, itb);
+    }
+#endif
     return ret;
 }
 
@@ -313,6 +439,7 @@ struct tb_desc {
     CPUArchState *env;
     tb_page_addr_t phys_page1;
     uint32_t flags;
+    bool panda_uninstr;
 };
 
 static bool tb_cmp(const void *p, const void *d)
@@ -324,6 +451,7 @@ static bool tb_cmp(const void *p, const void *d)
         tb->page_addr[0] == desc->phys_page1 &&
         tb->cs_base == desc->cs_base &&
         tb->flags == desc->flags &&
+        tb->panda_uninstr == desc->panda_uninstr &&
         !atomic_read(&tb->invalid)) {
         /* check next page if needed */
         if (tb->page_addr[1] == -1) {
@@ -355,12 +483,90 @@ static TranslationBlock *tb_htable_lookup(CPUState *cpu,
     desc.cs_base = cs_base;
     desc.flags = flags;
     desc.pc = pc;
+    desc.panda_uninstr = !panda_instr_enabled(cpu);
     phys_pc = get_page_addr_code(desc.env, pc);
     desc.phys_page1 = phys_pc & TARGET_PAGE_MASK;
     h = tb_hash_func(phys_pc, pc, flags);
     return qht_lookup(&tcg_ctx.tb_ctx.htable, tb_cmp, &desc, h);
 }
 
+static inline void tb_jmp_cache_set(TBJmpCacheEntry *e, TranslationBlock *tb,
+                                    unsigned epoch)
+{
+    e->epoch = epoch;
+    atomic_set(&e->tb, tb);
+}
+
+static inline bool tb_jmp_cache_match(TranslationBlock *tb, target_ulong pc,
+                                      target_ulong cs_base, uint32_t flags,
+                                      bool uninstr)
+{
+    return tb && tb->pc == pc && tb->cs_base == cs_base &&
+        tb->flags == flags && !atomic_read(&tb->invalid) &&
+        tb->panda_uninstr == uninstr;
+}
+
+/* Add tb to the front of pc's set, pushing the set's least recently used
+   entry out to the victim buffer.  */
+static void tb_jmp_cache_insert(CPUState *cpu, target_ulong pc,
+                                TranslationBlock *tb)
+{
+    TBJmpCacheSet *set = &cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    TBJmpCacheEntry *last = &set->way[TB_JMP_CACHE_WAYS - 1];
+    unsigned epoch = cpu->tb_jmp_cache_epoch;
+    int i;
+
+    if (last->tb && last->epoch == epoch) {
+        i = cpu->tb_jmp_victim_next++ % TB_JMP_VICTIM_SIZE;
+        tb_jmp_cache_set(&cpu->tb_jmp_victim[i], last->tb, epoch);
+    }
+    for (i = TB_JMP_CACHE_WAYS - 1; i > 0; i--) {
+        tb_jmp_cache_set(&set->way[i], set->way[i - 1].tb,
+                         set->way[i - 1].epoch);
+    }
+    tb_jmp_cache_set(&set->way[0], tb, epoch);
+}
+
+/* Find pc's TB in the jump cache or its victim buffer, and make it the most
+   recently used entry of its set.  */
+static inline TranslationBlock *tb_jmp_cache_lookup(CPUState *cpu,
+                                                    target_ulong pc,
+                                                    target_ulong cs_base,
+                                                    uint32_t flags)
+{
+    TBJmpCacheSet *set = &cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    unsigned epoch = cpu->tb_jmp_cache_epoch;
+    bool uninstr = !panda_instr_enabled(cpu);
+    TranslationBlock *tb;
+    int i;
+
+    for (i = 0; i < TB_JMP_CACHE_WAYS; i++) {
+        tb = atomic_rcu_read(&set->way[i].tb);
+        if (set->way[i].epoch == epoch &&
+            tb_jmp_cache_match(tb, pc, cs_base, flags, uninstr)) {
+            for (; i > 0; i--) {
+                tb_jmp_cache_set(&set->way[i], set->way[i - 1].tb,
+                                 set->way[i - 1].epoch);
+            }
+            tb_jmp_cache_set(&set->way[0], tb, epoch);
+            cpu->tb_jmp_cache_hits++;
+            return tb;
+        }
+    }
+    for (i = 0; i < TB_JMP_VICTIM_SIZE; i++) {
+        tb = atomic_rcu_read(&cpu->tb_jmp_victim[i].tb);
+        if (cpu->tb_jmp_victim[i].epoch == epoch &&
+            tb_jmp_cache_match(tb, pc, cs_base, flags, uninstr)) {
+            atomic_set(&cpu->tb_jmp_victim[i].tb, NULL);
+            tb_jmp_cache_insert(cpu, pc, tb);
+            cpu->tb_jmp_victim_hits++;
+            return tb;
+        }
+    }
+    cpu->tb_jmp_cache_misses++;
+    return NULL;
+}
+
 static inline TranslationBlock *tb_find(CPUState *cpu,
                                         TranslationBlock *last_tb,
                                         int tb_exit)
@@ -375,11 +581,11 @@ static inline TranslationBlock *tb_find(CPUState *cpu,
        always be the same before a given translated block
        is executed. */
     cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
-    tb = atomic_rcu_read(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)]);
-    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
-                 tb->flags != flags)) {
+    tb = tb_jmp_cache_lookup(cpu, pc, cs_base, flags);
+    if (unlikely(!tb)) {
         tb = tb_htable_lookup(cpu, pc, cs_base, flags);
         if (!tb) {
+            cpu->tb_htable_misses++;
 
             /* mmap_lock is needed by tb_gen_code, and mmap_lock must be
              * taken outside tb_lock. As system emulation is currently
@@ -406,7 +612,7 @@ static inline TranslationBlock *tb_find(CPUState *cpu,
         }
 
         /* We add the TB in the virtual pc hash table for the fast lookup */
-        atomic_set(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)], tb);
+        tb_jmp_cache_insert(cpu, pc, tb);
     }
 #ifndef CONFIG_USER_ONLY
     /* We don't take care of direct jumps when address mapping changes in
@@ -416,12 +622,25 @@ static inline TranslationBlock *tb_find(CPUState *cpu,
     if (tb->page_addr[1] != -1) {
         last_tb = NULL;
     }
+#endif
+#if defined(CONFIG_LLVM)
+    /* A chained jump from TCG code would run the next block as TCG and keep
+       cold blocks from being counted */
+    if (execute_llvm && llvm_tier_threshold) {
+        last_tb = NULL;
+    }
 #endif
     /* See if we can patch the calling TB. */
 #ifdef CONFIG_SOFTMMU
     if (rr_mode != RR_REPLAY /* && panda_tb_chaining */) {
 #endif
-    if (last_tb && !qemu_loglevel_mask(CPU_LOG_TB_NOCHAIN)) {
+    /* Another thread may have patched the jump, or invalidated tb, since we
+     * left last_tb; check before contending for tb_lock with everybody
+     * that is translating.  tb_add_jump checks again under the lock.
+     */
+    if (last_tb && !qemu_loglevel_mask(CPU_LOG_TB_NOCHAIN) &&
+        !atomic_read(&last_tb->jmp_list_next[tb_exit]) &&
+        !atomic_read(&tb->invalid)) {
         if (!have_tb_lock) {
             tb_lock();
             have_tb_lock = true;
@@ -439,6 +658,29 @@ static inline TranslationBlock *tb_find(CPUState *cpu,
     return tb;
 }
 
+/* Multi-threaded TCG runs guest code without the BQL; take it around
+ * interrupt delivery and the like, which reach into devices.  Returns
+ * whether it was taken, for cpu_exec_unlock_iothread().  A cpu_loop_exit()
+ * with the BQL held is sorted out when it lands in cpu_exec().
+ */
+static inline bool cpu_exec_lock_iothread(void)
+{
+#ifndef CONFIG_USER_ONLY
+    if (qemu_tcg_mttcg_enabled() && !qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        return true;
+    }
+#endif
+    return false;
+}
+
+static inline void cpu_exec_unlock_iothread(bool locked)
+{
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
 static inline bool cpu_handle_halt(CPUState *cpu)
 {
     if (cpu->halted) {
@@ -446,8 +688,10 @@ static inline bool cpu_handle_halt(CPUState *cpu)
         if ((cpu->interrupt_request & CPU_INTERRUPT_POLL)
             && replay_interrupt()) {
             X86CPU *x86_cpu = X86_CPU(cpu);
+            bool locked = cpu_exec_lock_iothread();
             apic_poll_irq(x86_cpu->apic_state);
             cpu_reset_interrupt(cpu, CPU_INTERRUPT_POLL);
+            cpu_exec_unlock_iothread(locked);
         }
 #endif
         if (!cpu_has_work(cpu) && !rr_in_replay()) {
@@ -501,7 +745,9 @@ static inline bool cpu_handle_exception(CPUState *cpu, int *ret)
 #else
             if (replay_exception()) {
                 CPUClass *cc = CPU_GET_CLASS(cpu);
+                bool locked = cpu_exec_lock_iothread();
                 cc->do_interrupt(cpu);
+                cpu_exec_unlock_iothread(locked);
                 cpu->exception_index = -1;
             } else if (!replay_has_interrupt()) {
                 /* give a chance to iothread in replay mode */
@@ -527,7 +773,7 @@ static inline void cpu_handle_interrupt(CPUState *cpu,
                                         TranslationBlock **last_tb)
 {
     CPUClass *cc = CPU_GET_CLASS(cpu);
-    int interrupt_request = cpu->interrupt_request;
+    int interrupt_request = atomic_read(&cpu->interrupt_request);
 #ifdef CONFIG_SOFTMMU
     //mz Record and Replay.
     //mz it is important to do this in the order written, as
@@ -543,12 +789,14 @@ static inline void cpu_handle_interrupt(CPUState *cpu,
     }
 #endif
     if (unlikely(interrupt_request)) {
+        bool locked = cpu_exec_lock_iothread();
+
         if (unlikely(cpu->singlestep_enabled & SSTEP_NOIRQ)) {
             /* Mask out external interrupts for this step. */
             interrupt_request &= ~CPU_INTERRUPT_SSTEP_MASK;
         }
         if (interrupt_request & CPU_INTERRUPT_DEBUG) {
-            cpu->interrupt_request &= ~CPU_INTERRUPT_DEBUG;
+            cpu_reset_interrupt(cpu, CPU_INTERRUPT_DEBUG);
             cpu->exception_index = EXCP_DEBUG;
             cpu_loop_exit(cpu);
         }
@@ -556,7 +804,7 @@ static inline void cpu_handle_interrupt(CPUState *cpu,
             /* Do nothing */
         } else if (interrupt_request & CPU_INTERRUPT_HALT) {
             replay_interrupt();
-            cpu->interrupt_request &= ~CPU_INTERRUPT_HALT;
+            cpu_reset_interrupt(cpu, CPU_INTERRUPT_HALT);
             cpu->halted = 1;
             cpu->exception_index = EXCP_HLT;
             cpu_loop_exit(cpu);
@@ -600,11 +848,12 @@ static inline void cpu_handle_interrupt(CPUState *cpu,
         }
 #endif
         if (interrupt_request & CPU_INTERRUPT_EXITTB) {
-            cpu->interrupt_request &= ~CPU_INTERRUPT_EXITTB;
+            cpu_reset_interrupt(cpu, CPU_INTERRUPT_EXITTB);
             /* ensure that no TB jump will be modified as
                the program flow was changed */
             *last_tb = NULL;
         }
+        cpu_exec_unlock_iothread(locked);
     }
     if (unlikely(atomic_read(&cpu->exit_request) || replay_has_interrupt())) {
         atomic_set(&cpu->exit_request, 0);
@@ -745,10 +994,21 @@ int cpu_exec(CPUState *cpu)
                 if (rr_in_replay()) {
                     rr_skipped_callsite_location = RR_CALLSITE_MAIN_LOOP_WAIT;
                     rr_replay_skipped_calls();
+                    // the recording switched to another vCPU here
+                    if (unlikely(rr_current_cpu != cpu)) {
+                        cpu->exception_index = EXCP_INTERRUPT;
+                        cpu_loop_exit(cpu);
+                    }
                 }
                 cpu_handle_interrupt(cpu, &last_tb);
                 panda_before_find_fast();
                 tb = tb_find(cpu, last_tb, tb_exit);
+#if defined(CONFIG_LLVM)
+                if (execute_llvm && llvm_trace_threshold && last_tb &&
+                        llvm_trace_allowed(cpu)) {
+                    llvm_trace_note(last_tb, tb);
+                }
+#endif
                 panda_bb_invalidate_done = panda_callbacks_after_find_fast(cpu, tb, panda_bb_invalidate_done);
                 if (qemu_loglevel_mask(CPU_LOG_RR)) {
                     RR_prog_point pp = rr_prog_point();
@@ -782,6 +1042,13 @@ int cpu_exec(CPUState *cpu)
                     qemu_cpu_kick(cpu);
                     break;
                 }
+#ifdef CONFIG_SOFTMMU
+                // -replay-fork forks from the main loop once we've stopped
+                if (rr_mode == RR_REPLAY && rr_replay_fork_due()) {
+                    vm_stop(RUN_STATE_PAUSED);
+                    break;
+                }
+#endif
                 if (!rr_in_replay() || rr_num_instr_before_next_interrupt() > 0) {
                     cpu_loop_exec_tb(cpu, tb, &last_tb, &tb_exit, &sc);
                     /* Try to align the host and virtual clocks
@@ -803,7 +1070,22 @@ int cpu_exec(CPUState *cpu)
             g_assert(cc == CPU_GET_CLASS(cpu));
 #endif /* buggy compiler */
             cpu->can_do_io = 1;
+            /* a TB that exits with an exception gets no after_block_exec */
+            cpu->panda_exec_tb = NULL;
             tb_lock_reset();
+            tb_profile_state = TB_PROF_OTHER;
+#ifndef CONFIG_USER_ONLY
+            /* dropped out of a section that took the BQL */
+            if (qemu_tcg_mttcg_enabled() && qemu_mutex_iothread_locked()) {
+                qemu_mutex_unlock_iothread();
+            }
+#endif
+#if defined(CONFIG_LLVM)
+            if (panda_llvm_skipped) {
+                panda_llvm_skipped = false;
+                execute_llvm = 1;
+            }
+#endif
         }
     } /* for(;;) */
 
@@ -36,6 +36,7 @@
 #include "sysemu/kvm.h"
 #include "qmp-commands.h"
 #include "exec/exec-all.h"
+#include "tcg.h"
 
 #include "qemu/thread.h"
 #include "sysemu/cpus.h"
@@ -561,16 +562,18 @@ static const VMStateDescription vmstate_timers = {
 static void cpu_throttle_thread(CPUState *cpu, run_on_cpu_data opaque)
 {
     double pct;
-    double throttle_ratio;
+    double max_pct = (double)opaque.host_int / 100;
     long sleeptime_ns;
 
-    if (!cpu_throttle_get_percentage()) {
+    if (!cpu_throttle_get_vcpu_percentage(cpu)) {
+        atomic_set(&cpu->throttle_thread_scheduled, 0);
         return;
     }
 
-    pct = (double)cpu_throttle_get_percentage()/100;
-    throttle_ratio = pct / (1 - pct);
-    sleeptime_ns = (long)(throttle_ratio * CPU_THROTTLE_TIMESLICE_NS);
+    /* The timer fires every CPU_THROTTLE_TIMESLICE_NS / (1 - max_pct);
+     * sleep for this vcpu's share of that period. */
+    pct = (double)cpu_throttle_get_vcpu_percentage(cpu) / 100;
+    sleeptime_ns = (long)(pct / (1 - max_pct) * CPU_THROTTLE_TIMESLICE_NS);
 
     qemu_mutex_unlock_iothread();
     atomic_set(&cpu->throttle_thread_scheduled, 0);
@@ -582,19 +585,21 @@ static void cpu_throttle_timer_tick(void *opaque)
 {
     CPUState *cpu;
     double pct;
+    int max_pct = cpu_throttle_get_percentage();
 
     /* Stop the timer if needed */
-    if (!cpu_throttle_get_percentage()) {
+    if (!max_pct) {
         return;
     }
     CPU_FOREACH(cpu) {
-        if (!atomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
+        if (cpu_throttle_get_vcpu_percentage(cpu) &&
+            !atomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
             async_run_on_cpu(cpu, cpu_throttle_thread,
-                             RUN_ON_CPU_NULL);
+                             RUN_ON_CPU_HOST_INT(max_pct));
         }
     }
 
-    pct = (double)cpu_throttle_get_percentage()/100;
+    pct = (double)max_pct / 100;
     timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
                                    CPU_THROTTLE_TIMESLICE_NS / (1-pct));
 }
@@ -611,9 +616,29 @@ void cpu_throttle_set(int new_throttle_pct)
                                        CPU_THROTTLE_TIMESLICE_NS);
 }
 
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct)
+{
+    if (new_throttle_pct) {
+        new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
+        new_throttle_pct = MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
+    }
+
+    atomic_set(&cpu->throttle_percentage, new_throttle_pct);
+
+    if (new_throttle_pct) {
+        timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
+                                           CPU_THROTTLE_TIMESLICE_NS);
+    }
+}
+
 void cpu_throttle_stop(void)
 {
+    CPUState *cpu;
+
     atomic_set(&throttle_percentage, 0);
+    CPU_FOREACH(cpu) {
+        atomic_set(&cpu->throttle_percentage, 0);
+    }
 }
 
 bool cpu_throttle_active(void)
@@ -623,7 +648,19 @@ bool cpu_throttle_active(void)
 
 int cpu_throttle_get_percentage(void)
 {
-    return atomic_read(&throttle_percentage);
+    CPUState *cpu;
+    int pct = atomic_read(&throttle_percentage);
+
+    CPU_FOREACH(cpu) {
+        pct = MAX(pct, atomic_read(&cpu->throttle_percentage));
+    }
+    return pct;
+}
+
+int cpu_throttle_get_vcpu_percentage(CPUState *cpu)
+{
+    return MAX(atomic_read(&throttle_percentage),
+               atomic_read(&cpu->throttle_percentage));
 }
 
 void cpu_ticks_init(void)
@@ -964,6 +1001,26 @@ static void qemu_tcg_wait_io_event(CPUState *cpu)
     }
 }
 
+/* With multi-threaded TCG, each vCPU thread only waits for its own vCPU.
+ * It waits on halt_event rather than halt_cond, so that kicks from threads
+ * that don't hold the BQL can't be lost: the event is reset before the last
+ * look for work, and qemu_cpu_kick() sets it after making the work visible.
+ */
+static void qemu_tcg_mttcg_wait_io_event(CPUState *cpu)
+{
+    while (cpu_thread_is_idle(cpu)) {
+        qemu_event_reset(&cpu->halt_event);
+        if (!cpu_thread_is_idle(cpu)) {
+            break;
+        }
+        qemu_mutex_unlock_iothread();
+        qemu_event_wait(&cpu->halt_event);
+        qemu_mutex_lock_iothread();
+    }
+
+    qemu_wait_io_event_common(cpu);
+}
+
 static void qemu_kvm_wait_io_event(CPUState *cpu)
 {
     while (cpu_thread_is_idle(cpu)) {
@@ -1095,6 +1152,42 @@ static void handle_icount_deadline(void)
     }
 }
 
+/* -accel tcg,thread=multi runs each vCPU on a thread of its own, which
+ * only holds the BQL while it isn't running guest code.  Devices, and
+ * the helpers that reach them, take the BQL themselves.
+ */
+bool mttcg_enabled;
+
+void qemu_tcg_configure(QemuOpts *opts, Error **errp)
+{
+    const char *t = qemu_opt_get(opts, "thread");
+
+    if (!t || strcmp(t, "single") == 0) {
+        mttcg_enabled = false;
+    } else if (strcmp(t, "multi") == 0) {
+#ifndef TARGET_SUPPORTS_MTTCG
+        error_setg(errp, "This guest can't run multi-threaded TCG yet");
+#else
+        if (TCG_OVERSIZED_GUEST) {
+            error_setg(errp, "No multi-threaded TCG when the guest word "
+                       "size is larger than the host's");
+        } else if (use_icount) {
+            error_setg(errp, "No multi-threaded TCG with -icount");
+        } else {
+#if defined(TARGET_I386) && !defined(__i386__) && !defined(__x86_64__)
+            error_report("warning: the guest expects stronger memory "
+                         "ordering than this host provides");
+#endif
+            mttcg_enabled = true;
+            /* LOCKed instructions have to be atomic on the host now */
+            parallel_cpus = true;
+        }
+#endif
+    } else {
+        error_setg(errp, "Invalid 'thread' setting %s", t);
+    }
+}
+
 static int tcg_cpu_exec(CPUState *cpu)
 {
     int ret;
@@ -1162,6 +1255,7 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
 
     qemu_mutex_lock_iothread();
     qemu_thread_get_self(cpu->thread);
+    tb_profile_thread_init();
 
     CPU_FOREACH(cpu) {
         cpu->thread_id = qemu_get_thread_id();
@@ -1195,6 +1289,20 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
 
         for (; cpu != NULL && !exit_request; cpu = CPU_NEXT(cpu)) {
 
+            /* Record logs where it moves on to another vCPU, and replay
+               moves on where the log says (see rr_record_cpu_switch).  */
+            if (rr_in_replay()) {
+                cpu = rr_current_cpu;
+            } else if (rr_in_record() && cpu != rr_current_cpu) {
+                if (cpu_thread_is_idle(cpu)) {
+                    /* it would only return EXCP_HALTED */
+                    continue;
+                }
+                if (cpu_can_run(cpu)) {
+                    rr_record_cpu_switch(cpu);
+                }
+            }
+
             qemu_clock_enable(QEMU_CLOCK_VIRTUAL,
                               (cpu->singlestep_enabled & SSTEP_NOTIMER) == 0);
 
@@ -1226,6 +1334,62 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     return NULL;
 }
 
+/* Multi-threaded TCG: one of these per vCPU.  Guest code runs without
+ * the BQL, so devices and the I/O thread can get at it meanwhile.
+ */
+static void *qemu_tcg_mttcg_cpu_thread_fn(void *arg)
+{
+    CPUState *cpu = arg;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock_iothread();
+    qemu_thread_get_self(cpu->thread);
+    tb_profile_thread_init();
+
+    cpu->thread_id = qemu_get_thread_id();
+    cpu->created = true;
+    cpu->can_do_io = 1;
+    current_cpu = cpu;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    /* process any pending work */
+    cpu->exit_request = 1;
+
+    do {
+        if (cpu_can_run(cpu)) {
+            int r;
+            qemu_mutex_unlock_iothread();
+            r = tcg_cpu_exec(cpu);
+            qemu_mutex_lock_iothread();
+            switch (r) {
+            case EXCP_DEBUG:
+                cpu_handle_guest_debug(cpu);
+                break;
+            case EXCP_ATOMIC:
+                /* an atomic op the host can't do atomically: run it with
+                   every other vCPU stopped */
+                qemu_mutex_unlock_iothread();
+                cpu_exec_step_atomic(cpu);
+                qemu_mutex_lock_iothread();
+                break;
+            default:
+                break;
+            }
+        }
+
+        atomic_mb_set(&cpu->exit_request, 0);
+        qemu_tcg_mttcg_wait_io_event(cpu);
+    } while (!cpu->unplug || cpu_can_run(cpu));
+
+    qemu_tcg_destroy_vcpu(cpu);
+    cpu->created = false;
+    qemu_cond_signal(&qemu_cpu_cond);
+    qemu_mutex_unlock_iothread();
+    rcu_unregister_thread();
+    return NULL;
+}
+
 static void qemu_cpu_kick_thread(CPUState *cpu)
 {
 #ifndef _WIN32
@@ -1260,6 +1424,12 @@ static void qemu_cpu_kick_no_halt(void)
 
 void qemu_cpu_kick(CPUState *cpu)
 {
+    if (tcg_enabled() && qemu_tcg_mttcg_enabled()) {
+        /* a futex wake at most, and none if the vCPU isn't idle */
+        cpu_exit(cpu);
+        qemu_event_set(&cpu->halt_event);
+        return;
+    }
     qemu_cond_broadcast(cpu->halt_cond);
     if (tcg_enabled()) {
         qemu_cpu_kick_no_halt();
@@ -1297,8 +1467,8 @@ void qemu_mutex_lock_iothread(void)
     /* In the simple case there is no need to bump the VCPU thread out of
      * TCG code execution.
      */
-    if (!tcg_enabled() || qemu_in_vcpu_thread() ||
-        !first_cpu || !first_cpu->created) {
+    if (!tcg_enabled() || qemu_tcg_mttcg_enabled() ||
+        qemu_in_vcpu_thread() || !first_cpu || !first_cpu->created) {
         qemu_mutex_lock(&qemu_global_mutex);
         atomic_dec(&iothread_requesting_mutex);
     } else {
@@ -1343,7 +1513,8 @@ void pause_all_vcpus(void)
 
     if (qemu_in_vcpu_thread()) {
         cpu_stop_current();
-        if (!kvm_enabled()) {
+        /* the other vCPUs can't stop while this thread is running them */
+        if (!kvm_enabled() && !qemu_tcg_mttcg_enabled()) {
             CPU_FOREACH(cpu) {
                 cpu->stop = false;
                 cpu->stopped = true;
@@ -1395,11 +1566,32 @@ void cpu_remove_sync(CPUState *cpu)
 /* For temporary buffers for forming a name */
 #define VCPU_THREAD_NAME_SIZE 16
 
+/* the thread and halt condition that all vCPUs share without MTTCG */
+static QemuCond *tcg_halt_cond;
+static QemuThread *tcg_cpu_thread;
+
 static void qemu_tcg_init_vcpu(CPUState *cpu)
 {
     char thread_name[VCPU_THREAD_NAME_SIZE];
-    static QemuCond *tcg_halt_cond;
-    static QemuThread *tcg_cpu_thread;
+
+    if (qemu_tcg_mttcg_enabled()) {
+        cpu->thread = g_malloc0(sizeof(QemuThread));
+        cpu->halt_cond = g_malloc0(sizeof(QemuCond));
+        qemu_cond_init(cpu->halt_cond);
+        qemu_event_init(&cpu->halt_event, false);
+        snprintf(thread_name, VCPU_THREAD_NAME_SIZE, "CPU %d/TCG",
+                 cpu->cpu_index);
+        qemu_thread_create(cpu->thread, thread_name,
+                           qemu_tcg_mttcg_cpu_thread_fn,
+                           cpu, QEMU_THREAD_JOINABLE);
+#ifdef _WIN32
+        cpu->hThread = qemu_thread_get_handle(cpu->thread);
+#endif
+        while (!cpu->created) {
+            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        }
+        return;
+    }
 
     /* share a single thread for all cpus with TCG */
     if (!tcg_cpu_thread) {
@@ -1481,6 +1673,26 @@ void qemu_init_vcpu(CPUState *cpu)
     }
 }
 
+/* fork() only duplicates the calling thread, so a child of a process with
+ * TCG vCPUs has none running.  Start them again, in the stopped state the
+ * parent left them in; the caller holds the iothread lock and has stopped
+ * the VM before forking.
+ */
+void qemu_tcg_vcpus_after_fork(void)
+{
+    CPUState *cpu;
+
+    assert(tcg_enabled());
+    tcg_cpu_thread = NULL;
+    CPU_FOREACH(cpu) {
+        cpu->created = false;
+        cpu->thread_kicked = false;
+    }
+    CPU_FOREACH(cpu) {
+        qemu_tcg_init_vcpu(cpu);
+    }
+}
+
 void cpu_stop_current(void)
 {
     if (current_cpu) {
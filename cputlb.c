@@ -31,6 +31,7 @@
 #include "exec/log.h"
 #include "exec/helper-proto.h"
 #include "qemu/atomic.h"
+#include "qemu/main-loop.h"
 
 #include "panda/rr/rr_log_all.h"
 #include "panda/callback_support.h"
@@ -62,6 +63,173 @@
 
 /* statistics */
 int tlb_flush_count;
+int tlb_asid_switch_count;
+int tlb_asid_hit_count;
+int tlb_resize_count;
+
+/* Number of address spaces besides the current one whose TLBs are kept
+ * for when the guest switches back to them (-tlb-asids); 0 turns
+ * tlb_switch_asid into a plain flush.
+ */
+unsigned tlb_asid_slots;
+
+/* One MMU mode's TLB.  The one in use is also published in env, where
+ * generated code looks it up; with a fixed-size TLB the tables are env's
+ * own arrays, otherwise they're allocated here and resized at flushes to
+ * fit how many entries the mode has been using.
+ */
+struct CPUTLBDesc {
+    CPUTLBEntry *table;
+    CPUIOTLBEntry *iotlb;
+    size_t size;
+    /* entries filled since the last flush, less those evicted */
+    size_t n_used_entries;
+    /* the most n_used_entries has been since window_begin_ns */
+    size_t window_max_entries;
+    int64_t window_begin_ns;
+};
+
+/* The TLB of an address space that isn't current, saved wholesale when
+ * the guest switches away from it.
+ */
+struct CPUTLBAsid {
+    uint64_t asid;
+    uint64_t last_used;         /* 0 if the slot holds nothing */
+    CPUTLBDesc desc[NB_MMU_MODES];  /* tables allocated on first save */
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];
+    CPUIOTLBEntry iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];
+    target_ulong tlb_flush_addr;
+    target_ulong tlb_flush_mask;
+    target_ulong vtlb_index;
+};
+
+static void tlb_desc_alloc(CPUTLBDesc *d, size_t size)
+{
+    d->table = g_new(CPUTLBEntry, size);
+    d->iotlb = g_new(CPUIOTLBEntry, size);
+    d->size = size;
+}
+
+static void tlb_window_reset(CPUTLBDesc *d, int64_t now, size_t max_entries)
+{
+    d->window_begin_ns = now;
+    d->window_max_entries = max_entries;
+}
+
+/* Point env at the tables in use */
+static void tlb_publish(CPUState *cpu)
+{
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    CPUArchState *env = cpu->env_ptr;
+    int mmu_idx;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        CPUTLBDesc *d = &cpu->tlb_desc[mmu_idx];
+
+        env->tlb_table[mmu_idx] = d->table;
+        env->iotlb[mmu_idx] = d->iotlb;
+        env->tlb_mask[mmu_idx] = (d->size - 1) << CPU_TLB_ENTRY_BITS;
+    }
+#endif
+}
+
+void tlb_init(CPUState *cpu)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int mmu_idx;
+
+    if (cpu->tlb_desc) {
+        return;
+    }
+    cpu->tlb_desc = g_new0(CPUTLBDesc, NB_MMU_MODES);
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        CPUTLBDesc *d = &cpu->tlb_desc[mmu_idx];
+
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+        tlb_desc_alloc(d, 1 << CPU_TLB_DYN_DEFAULT_BITS);
+#else
+        CPUArchState *env = cpu->env_ptr;
+
+        d->table = env->tlb_table[mmu_idx];
+        d->iotlb = env->iotlb[mmu_idx];
+        d->size = CPU_TLB_SIZE;
+#endif
+        tlb_window_reset(d, now, 0);
+        memset(d->table, -1, d->size * sizeof(CPUTLBEntry));
+    }
+    tlb_publish(cpu);
+}
+
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+/* Called at flushes, when the TLB is about to be emptied anyway.  The
+ * TLB doubles when more than 70% of it has been in use since the window
+ * began, and if less than 30% of it has been used for a whole 100ms
+ * window it shrinks to fit the most that was, plus room to spare.
+ * Shrinking only after a window spares a guest that flushes often from
+ * losing its TLB to a run of flushes that each come before it filled up.
+ */
+static void tlb_mmu_resize(CPUTLBDesc *d, int64_t now)
+{
+    const int64_t window_len_ns = 100 * 1000 * 1000;
+    bool window_expired = now > d->window_begin_ns + window_len_ns;
+    size_t old_size = d->size;
+    size_t new_size = old_size;
+    size_t rate;
+
+    /* tlb_reset_dirty walks other vCPUs' tables from their threads, so
+     * with multi-threaded TCG the tables can't be freed under it
+     */
+    if (qemu_tcg_mttcg_enabled()) {
+        return;
+    }
+    if (d->n_used_entries > d->window_max_entries) {
+        d->window_max_entries = d->n_used_entries;
+    }
+    rate = d->window_max_entries * 100 / old_size;
+
+    if (rate > 70) {
+        new_size = MIN(old_size << 1, 1 << CPU_TLB_DYN_MAX_BITS);
+    } else if (rate < 30 && window_expired) {
+        size_t ceil = pow2ceil(d->window_max_entries);
+        size_t expected_rate = d->window_max_entries * 100 / ceil;
+
+        /* don't shrink straight back to where it'll want to grow */
+        if (expected_rate > 70) {
+            ceil *= 2;
+        }
+        new_size = MAX(ceil, 1 << CPU_TLB_DYN_MIN_BITS);
+    }
+
+    if (new_size == old_size) {
+        if (window_expired) {
+            tlb_window_reset(d, now, d->n_used_entries);
+        }
+        return;
+    }
+
+    g_free(d->table);
+    g_free(d->iotlb);
+    tlb_desc_alloc(d, new_size);
+    tlb_window_reset(d, now, 0);
+    atomic_inc(&tlb_resize_count);
+}
+#endif
+
+/* Empty one MMU mode's TLB in use, resizing it if it was too big or too
+ * small for what's been going in.  The caller republishes it.
+ */
+static void tlb_flush_one_mmuidx(CPUState *cpu, int mmu_idx, int64_t now)
+{
+    CPUArchState *env = cpu->env_ptr;
+    CPUTLBDesc *d = &cpu->tlb_desc[mmu_idx];
+
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    tlb_mmu_resize(d, now);
+#endif
+    memset(d->table, -1, d->size * sizeof(CPUTLBEntry));
+    memset(env->tlb_v_table[mmu_idx], -1, sizeof(env->tlb_v_table[0]));
+    d->n_used_entries = 0;
+}
 
 /* NOTE:
  * If flush_global is true (the usual case), flush all tlb entries.
@@ -75,25 +243,87 @@ int tlb_flush_count;
  * entries from the TLB at any time, so flushing more entries than
  * required is only an efficiency issue, not a correctness issue.
  */
-void tlb_flush(CPUState *cpu, int flush_global)
+/* With multi-threaded TCG a vCPU's TLB may only be touched by its own
+ * thread, so flushes of other vCPUs' TLBs are queued as work for them.
+ */
+static bool tlb_flush_is_remote(CPUState *cpu)
 {
-    CPUArchState *env = cpu->env_ptr;
+    return qemu_tcg_mttcg_enabled() && !qemu_cpu_is_self(cpu);
+}
 
-    tlb_debug("(%d)\n", flush_global);
+/* Empty the TLB in use, leaving any saved ones alone */
+static void tlb_flush_live(CPUState *cpu)
+{
+    CPUArchState *env = cpu->env_ptr;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int mmu_idx;
 
-    memset(env->tlb_table, -1, sizeof(env->tlb_table));
-    memset(env->tlb_v_table, -1, sizeof(env->tlb_v_table));
-    memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        tlb_flush_one_mmuidx(cpu, mmu_idx, now);
+    }
+    tlb_publish(cpu);
 
     env->vtlb_index = 0;
     env->tlb_flush_addr = -1;
     env->tlb_flush_mask = 0;
-    tlb_flush_count++;
+}
+
+/* Forget the TLBs saved for other address spaces */
+static void tlb_asid_drop_all(CPUState *cpu)
+{
+    unsigned n;
+
+    if (cpu->tlb_asids) {
+        for (n = 0; n < tlb_asid_slots; n++) {
+            cpu->tlb_asids[n].last_used = 0;
+        }
+    }
+}
+
+/* translations made by walking the guest page tables outside the TLB
+ * may be stale now
+ */
+static inline void tlb_bump_flush_gen(CPUState *cpu)
+{
+    atomic_inc(&cpu->tlb_flush_gen);
+}
+
+static void tlb_flush_nocheck(CPUState *cpu, int flush_global)
+{
+    tlb_debug("(%d)\n", flush_global);
+
+    /* also here for CPUs reset before they're realized */
+    tlb_init(cpu);
+    tlb_flush_live(cpu);
+    cpu_tb_jmp_cache_clear(cpu);
+
+    /* whatever gets loaded next can't be told apart from what comes
+     * after the next switch, so it isn't kept then
+     */
+    tlb_asid_drop_all(cpu);
+    cpu->tlb_asid_valid = false;
+    atomic_inc(&tlb_flush_count);
+    tlb_bump_flush_gen(cpu);
+}
+
+static void tlb_flush_async_work(CPUState *cpu, run_on_cpu_data data)
+{
+    tlb_flush_nocheck(cpu, data.host_int);
+}
+
+void tlb_flush(CPUState *cpu, int flush_global)
+{
+    if (tlb_flush_is_remote(cpu)) {
+        async_run_on_cpu(cpu, tlb_flush_async_work,
+                         RUN_ON_CPU_HOST_INT(flush_global));
+    } else {
+        tlb_flush_nocheck(cpu, flush_global);
+    }
 }
 
 static inline void v_tlb_flush_by_mmuidx(CPUState *cpu, va_list argp)
 {
-    CPUArchState *env = cpu->env_ptr;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
     tlb_debug("start\n");
 
@@ -106,22 +336,36 @@ static inline void v_tlb_flush_by_mmuidx(CPUState *cpu, va_list argp)
 
         tlb_debug("%d\n", mmu_idx);
 
-        memset(env->tlb_table[mmu_idx], -1, sizeof(env->tlb_table[0]));
-        memset(env->tlb_v_table[mmu_idx], -1, sizeof(env->tlb_v_table[0]));
+        tlb_flush_one_mmuidx(cpu, mmu_idx, now);
     }
+    tlb_publish(cpu);
 
-    memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
+    cpu_tb_jmp_cache_clear(cpu);
+    tlb_asid_drop_all(cpu);
+    tlb_bump_flush_gen(cpu);
 }
 
 void tlb_flush_by_mmuidx(CPUState *cpu, ...)
 {
     va_list argp;
+
+    if (tlb_flush_is_remote(cpu)) {
+        /* the index list can't be queued; flushing everything will do */
+        tlb_flush(cpu, 1);
+        return;
+    }
     va_start(argp, cpu);
     v_tlb_flush_by_mmuidx(cpu, argp);
     va_end(argp);
 }
 
-static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
+static inline bool tlb_entry_is_empty(const CPUTLBEntry *te)
+{
+    return te->addr_read == -1 && te->addr_write == -1 && te->addr_code == -1;
+}
+
+/* Returns whether it flushed anything */
+static inline bool tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
     if (addr == (tlb_entry->addr_read &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
@@ -130,13 +374,57 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
         addr == (tlb_entry->addr_code &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
         memset(tlb_entry, -1, sizeof(*tlb_entry));
+        return true;
     }
+    return false;
 }
 
-void tlb_flush_page(CPUState *cpu, target_ulong addr)
+/* Flush page addr from one MMU mode's TLB, victims and all */
+static void tlb_flush_page_one_mmuidx(CPUTLBDesc *d, CPUTLBEntry *v_table,
+                                      target_ulong addr)
+{
+    int k;
+
+    if (tlb_flush_entry(&d->table[(addr >> TARGET_PAGE_BITS) & (d->size - 1)],
+                        addr)) {
+        d->n_used_entries--;
+    }
+    for (k = 0; k < CPU_VTLB_SIZE; k++) {
+        tlb_flush_entry(&v_table[k], addr);
+    }
+}
+
+/* Flush page addr, in every MMU mode, from the saved TLBs.  Those that
+ * have it in a large page are dropped.
+ */
+static void tlb_asid_flush_page(CPUState *cpu, target_ulong addr)
+{
+    int mmu_idx;
+    unsigned n;
+
+    if (!cpu->tlb_asids) {
+        return;
+    }
+    for (n = 0; n < tlb_asid_slots; n++) {
+        CPUTLBAsid *s = &cpu->tlb_asids[n];
+
+        if (!s->last_used) {
+            continue;
+        }
+        if ((addr & s->tlb_flush_mask) == s->tlb_flush_addr) {
+            s->last_used = 0;
+            continue;
+        }
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            tlb_flush_page_one_mmuidx(&s->desc[mmu_idx],
+                                      s->tlb_v_table[mmu_idx], addr);
+        }
+    }
+}
+
+static void tlb_flush_page_nocheck(CPUState *cpu, target_ulong addr)
 {
     CPUArchState *env = cpu->env_ptr;
-    int i;
     int mmu_idx;
 
     tlb_debug("page :" TARGET_FMT_lx "\n", addr);
@@ -147,33 +435,46 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
                   TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
                   env->tlb_flush_addr, env->tlb_flush_mask);
 
-        tlb_flush(cpu, 1);
+        tlb_flush_nocheck(cpu, 1);
         return;
     }
 
     addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
-    }
-
-    /* check whether there are entries that need to be flushed in the vtlb */
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        int k;
-        for (k = 0; k < CPU_VTLB_SIZE; k++) {
-            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
-        }
+        tlb_flush_page_one_mmuidx(&cpu->tlb_desc[mmu_idx],
+                                  env->tlb_v_table[mmu_idx], addr);
     }
+    tlb_asid_flush_page(cpu, addr);
+    tlb_bump_flush_gen(cpu);
 
     tb_flush_jmp_cache(cpu, addr);
 }
 
+static void tlb_flush_page_async_work(CPUState *cpu, run_on_cpu_data data)
+{
+    tlb_flush_page_nocheck(cpu, (target_ulong) data.target_ptr);
+}
+
+void tlb_flush_page(CPUState *cpu, target_ulong addr)
+{
+    if (tlb_flush_is_remote(cpu)) {
+        async_run_on_cpu(cpu, tlb_flush_page_async_work,
+                         RUN_ON_CPU_TARGET_PTR(addr));
+    } else {
+        tlb_flush_page_nocheck(cpu, addr);
+    }
+}
+
 void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
 {
     CPUArchState *env = cpu->env_ptr;
-    int i, k;
     va_list argp;
 
+    if (tlb_flush_is_remote(cpu)) {
+        tlb_flush_page(cpu, addr);
+        return;
+    }
+
     va_start(argp, addr);
 
     tlb_debug("addr "TARGET_FMT_lx"\n", addr);
@@ -190,7 +491,6 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
     }
 
     addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
 
     for (;;) {
         int mmu_idx = va_arg(argp, int);
@@ -201,18 +501,213 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
 
         tlb_debug("idx %d\n", mmu_idx);
 
-        tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
-
-        /* check whether there are vltb entries that need to be flushed */
-        for (k = 0; k < CPU_VTLB_SIZE; k++) {
-            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
-        }
+        tlb_flush_page_one_mmuidx(&cpu->tlb_desc[mmu_idx],
+                                  env->tlb_v_table[mmu_idx], addr);
     }
     va_end(argp);
+    /* the saved TLBs lose the page in every mode, which is simpler and
+     * no less correct
+     */
+    tlb_asid_flush_page(cpu, addr);
+    tlb_bump_flush_gen(cpu);
 
     tb_flush_jmp_cache(cpu, addr);
 }
 
+static void tlb_asid_memswap(void *a, void *b, size_t len)
+{
+    uint64_t *x = a, *y = b;
+    size_t i;
+
+    for (i = 0; i < len / sizeof(uint64_t); i++) {
+        uint64_t t = x[i];
+
+        x[i] = y[i];
+        y[i] = t;
+    }
+}
+
+static void tlb_asid_swap_rest(CPUArchState *env, CPUTLBAsid *s)
+{
+    target_ulong t;
+
+    tlb_asid_memswap(env->tlb_v_table, s->tlb_v_table,
+                     sizeof(s->tlb_v_table));
+    tlb_asid_memswap(env->iotlb_v, s->iotlb_v, sizeof(s->iotlb_v));
+
+    t = env->tlb_flush_addr;
+    env->tlb_flush_addr = s->tlb_flush_addr;
+    s->tlb_flush_addr = t;
+    t = env->tlb_flush_mask;
+    env->tlb_flush_mask = s->tlb_flush_mask;
+    s->tlb_flush_mask = t;
+    t = env->vtlb_index;
+    env->vtlb_index = s->vtlb_index;
+    s->vtlb_index = t;
+}
+
+/* Exchange the TLB in use for the one saved in s */
+static void tlb_asid_exchange(CPUState *cpu, CPUTLBAsid *s)
+{
+    int mmu_idx;
+
+    QEMU_BUILD_BUG_ON(sizeof(CPUTLBEntry) % sizeof(uint64_t) != 0);
+    QEMU_BUILD_BUG_ON(sizeof(CPUIOTLBEntry) % sizeof(uint64_t) != 0);
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        CPUTLBDesc *d = &cpu->tlb_desc[mmu_idx];
+        CPUTLBDesc *sd = &s->desc[mmu_idx];
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+        CPUTLBDesc t = *d;
+
+        *d = *sd;
+        *sd = t;
+#else
+        size_t n_used = d->n_used_entries;
+
+        tlb_asid_memswap(d->table, sd->table, d->size * sizeof(CPUTLBEntry));
+        tlb_asid_memswap(d->iotlb, sd->iotlb, d->size * sizeof(CPUIOTLBEntry));
+        d->n_used_entries = sd->n_used_entries;
+        sd->n_used_entries = n_used;
+#endif
+    }
+    tlb_publish(cpu);
+    tlb_asid_swap_rest(cpu->env_ptr, s);
+}
+
+/* Save the TLB in use in s, leaving the one in use to be flushed */
+static void tlb_asid_save(CPUState *cpu, CPUTLBAsid *s)
+{
+    int mmu_idx;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        CPUTLBDesc *d = &cpu->tlb_desc[mmu_idx];
+        CPUTLBDesc *sd = &s->desc[mmu_idx];
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+        /* the tables move to s; the ones in use keep their size and
+         * window, so sizing carries on as if there had been a flush
+         */
+        CPUTLBDesc t = *sd;
+
+        *sd = *d;
+        d->n_used_entries = 0;
+        if (t.table && t.size == d->size) {
+            d->table = t.table;
+            d->iotlb = t.iotlb;
+        } else {
+            g_free(t.table);
+            g_free(t.iotlb);
+            tlb_desc_alloc(d, sd->size);
+        }
+#else
+        if (sd->table == NULL) {
+            tlb_desc_alloc(sd, CPU_TLB_SIZE);
+        }
+        memcpy(sd->table, d->table, d->size * sizeof(CPUTLBEntry));
+        memcpy(sd->iotlb, d->iotlb, d->size * sizeof(CPUIOTLBEntry));
+        sd->n_used_entries = d->n_used_entries;
+#endif
+    }
+    tlb_publish(cpu);
+    tlb_asid_swap_rest(cpu->env_ptr, s);
+}
+
+/* With multi-threaded TCG, tlb_reset_dirty can reach into a vCPU's TLBs
+ * from other threads, which atomic updates make safe for the one in use
+ * but not for saved ones being swapped in, so there's no keeping them.
+ */
+static bool tlb_asids_enabled(void)
+{
+    return tlb_asid_slots && !qemu_tcg_mttcg_enabled();
+}
+
+void tlb_switch_asid(CPUState *cpu, uint64_t asid, bool flush)
+{
+    CPUTLBAsid *hit = NULL, *lru = NULL, *slot;
+    unsigned n;
+
+    if (!tlb_asids_enabled()) {
+        tlb_flush(cpu, 1);
+        return;
+    }
+    if (cpu->tlb_asid_valid && cpu->tlb_asid == asid) {
+        if (flush) {
+            tlb_flush_live(cpu);
+            cpu_tb_jmp_cache_clear(cpu);
+            atomic_inc(&tlb_flush_count);
+            tlb_bump_flush_gen(cpu);
+        }
+        return;
+    }
+
+    tlb_debug("asid %" PRIx64 " -> %" PRIx64 "%s\n", cpu->tlb_asid, asid,
+              flush ? " (flush)" : "");
+
+    if (cpu->tlb_asids == NULL) {
+        cpu->tlb_asids = g_new0(CPUTLBAsid, tlb_asid_slots);
+    }
+    for (n = 0; n < tlb_asid_slots; n++) {
+        CPUTLBAsid *s = &cpu->tlb_asids[n];
+
+        if (s->last_used && s->asid == asid) {
+            hit = s;
+        } else if (lru == NULL || s->last_used < lru->last_used) {
+            lru = s;
+        }
+    }
+
+    /* the slot the new TLB comes from, if there is one, is where the old
+     * one goes
+     */
+    slot = hit ? hit : lru;
+    if (hit && !flush) {
+        tlb_asid_exchange(cpu, slot);
+        atomic_inc(&tlb_asid_hit_count);
+    } else {
+        if (cpu->tlb_asid_valid) {
+            tlb_asid_save(cpu, slot);
+        }
+        tlb_flush_live(cpu);
+    }
+    if (flush) {
+        tlb_bump_flush_gen(cpu);
+    }
+    slot->asid = cpu->tlb_asid;
+    slot->last_used = cpu->tlb_asid_valid ? ++cpu->tlb_asid_tick : 0;
+
+    cpu->tlb_asid = asid;
+    cpu->tlb_asid_valid = true;
+    cpu_tb_jmp_cache_clear(cpu);
+    atomic_inc(&tlb_asid_switch_count);
+}
+
+void tlb_flush_asid(CPUState *cpu, uint64_t asid)
+{
+    unsigned n;
+
+    /* an unlabelled TLB could have anything in it */
+    if (!tlb_asids_enabled() || !cpu->tlb_asid_valid) {
+        tlb_flush(cpu, 1);
+        return;
+    }
+
+    tlb_debug("asid %" PRIx64 "\n", asid);
+
+    if (cpu->tlb_asids) {
+        for (n = 0; n < tlb_asid_slots; n++) {
+            if (cpu->tlb_asids[n].asid == asid) {
+                cpu->tlb_asids[n].last_used = 0;
+            }
+        }
+    }
+    if (cpu->tlb_asid == asid) {
+        tlb_flush_live(cpu);
+        cpu_tb_jmp_cache_clear(cpu);
+        atomic_inc(&tlb_flush_count);
+    }
+    tlb_bump_flush_gen(cpu);
+}
+
 /* update the TLBs so that writes to code in the virtual page 'addr'
    can be detected */
 void tlb_protect_code(ram_addr_t ram_addr)
@@ -241,7 +736,13 @@ void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry, uintptr_t start,
     if (tlb_is_dirty_ram(tlb_entry)) {
         addr = (tlb_entry->addr_write & TARGET_PAGE_MASK) + tlb_entry->addend;
         if ((addr - start) < length) {
+            /* the owning vCPU may be using the entry right now */
+#if TCG_OVERSIZED_GUEST
             tlb_entry->addr_write |= TLB_NOTDIRTY;
+#else
+            atomic_set(&tlb_entry->addr_write,
+                       tlb_entry->addr_write | TLB_NOTDIRTY);
+#endif
         }
     }
 }
@@ -258,32 +759,54 @@ static inline ram_addr_t qemu_ram_addr_from_host_nofail(void *ptr)
     return ram_addr;
 }
 
-void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
+static void tlb_reset_dirty_tables(CPUTLBDesc *desc,
+                                   CPUTLBEntry (*v_table)[CPU_VTLB_SIZE],
+                                   ram_addr_t start1, ram_addr_t length)
 {
-    CPUArchState *env;
-
     int mmu_idx;
 
-    env = cpu->env_ptr;
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        CPUTLBDesc *d = &desc[mmu_idx];
         unsigned int i;
 
-        for (i = 0; i < CPU_TLB_SIZE; i++) {
-            tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
-                                  start1, length);
+        for (i = 0; i < d->size; i++) {
+            tlb_reset_dirty_range(&d->table[i], start1, length);
         }
 
         for (i = 0; i < CPU_VTLB_SIZE; i++) {
-            tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
-                                  start1, length);
+            tlb_reset_dirty_range(&v_table[mmu_idx][i], start1, length);
+        }
+    }
+}
+
+void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
+{
+    CPUArchState *env = cpu->env_ptr;
+    unsigned n;
+
+    tlb_reset_dirty_tables(cpu->tlb_desc, env->tlb_v_table, start1, length);
+
+    /* a saved TLB that still let writes through would miss code and
+     * dirty tracking when it came back
+     */
+    if (cpu->tlb_asids) {
+        for (n = 0; n < tlb_asid_slots; n++) {
+            CPUTLBAsid *s = &cpu->tlb_asids[n];
+
+            if (s->last_used) {
+                tlb_reset_dirty_tables(s->desc, s->tlb_v_table,
+                                       start1, length);
+            }
         }
     }
 }
 
 static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
 {
-    if (tlb_entry->addr_write == (vaddr | TLB_NOTDIRTY)) {
-        tlb_entry->addr_write = vaddr;
+    target_ulong watch = tlb_entry->addr_write & TLB_PANDA_WATCH;
+
+    if (tlb_entry->addr_write == (vaddr | TLB_NOTDIRTY | watch)) {
+        tlb_entry->addr_write = vaddr | watch;
     }
 }
 
@@ -292,13 +815,11 @@ static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
 void tlb_set_dirty(CPUState *cpu, target_ulong vaddr)
 {
     CPUArchState *env = cpu->env_ptr;
-    int i;
     int mmu_idx;
 
     vaddr &= TARGET_PAGE_MASK;
-    i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
+        tlb_set_dirty1(tlb_entry(env, mmu_idx, vaddr), vaddr);
     }
 
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
@@ -351,6 +872,7 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
     uintptr_t addend;
     CPUTLBEntry *te;
     hwaddr iotlb, xlat, sz;
+    target_ulong watch = 0;
     unsigned vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
     int asidx = cpu_asidx_from_attrs(cpu, attrs);
 
@@ -380,20 +902,31 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
     code_address = address;
     iotlb = memory_region_section_get_iotlb(cpu, section, vaddr, paddr, xlat,
                                             prot, &address);
+    if (memory_region_is_ram(section->mr) &&
+        panda_callbacks_tlb_watch_page(cpu,
+                memory_region_get_ram_addr(section->mr) + xlat)) {
+        watch = TLB_PANDA_WATCH;
+    }
 
-    index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    index = tlb_index(env, mmu_idx, vaddr);
     te = &env->tlb_table[mmu_idx][index];
 
     /* do not discard the translation in te, evict it into a victim tlb */
+    if (!tlb_entry_is_empty(te)) {
+        cpu->tlb_desc[mmu_idx].n_used_entries--;
+    }
     env->tlb_v_table[mmu_idx][vidx] = *te;
     env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
+    cpu->tlb_desc[mmu_idx].n_used_entries++;
 
     /* refill the tlb */
     env->iotlb[mmu_idx][index].addr = iotlb - vaddr;
     env->iotlb[mmu_idx][index].attrs = attrs;
+    env->iotlb[mmu_idx][index].panda_memcb =
+        panda_memcb_filter_match(cpu, paddr);
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
-        te->addr_read = address;
+        te->addr_read = address | watch;
     } else {
         te->addr_read = -1;
     }
@@ -411,9 +944,9 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
         } else if (memory_region_is_ram(section->mr)
                    && cpu_physical_memory_is_clean(
                         memory_region_get_ram_addr(section->mr) + xlat)) {
-            te->addr_write = address | TLB_NOTDIRTY;
+            te->addr_write = address | TLB_NOTDIRTY | watch;
         } else {
-            te->addr_write = address;
+            te->addr_write = address | watch;
         }
     } else {
         te->addr_write = -1;
@@ -477,11 +1010,13 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
     CPUState *cpu = ENV_GET_CPU(env1);
     CPUIOTLBEntry *iotlbentry;
 
-    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     mmu_idx = cpu_mmu_index(env1, true);
+    page_index = tlb_index(env1, mmu_idx, addr);
     if (unlikely(env1->tlb_table[mmu_idx][page_index].addr_code !=
                  (addr & TARGET_PAGE_MASK))) {
         cpu_ldub_code(env1, addr);
+        /* filling it may have resized the TLB */
+        page_index = tlb_index(env1, mmu_idx, addr);
     }
     iotlbentry = &env1->iotlb[mmu_idx][page_index];
     pd = iotlbentry->addr & ~TARGET_PAGE_MASK;
@@ -507,6 +1042,7 @@ static uint64_t io_readx(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
     hwaddr physaddr = iotlbentry->addr;
     MemoryRegion *mr = iotlb_to_region(cpu, physaddr, iotlbentry->attrs);
     uint64_t val;
+    bool locked = false;
 
     physaddr = (physaddr & TARGET_PAGE_MASK) + addr;
     cpu->mem_io_pc = retaddr;
@@ -515,12 +1051,21 @@ static uint64_t io_readx(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
     }
 
     cpu->mem_io_vaddr = addr;
+
+    /* with multi-threaded TCG, guest code runs without the BQL */
+    if (mr->global_locking && !qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        locked = true;
+    }
     RR_DO_RECORD_OR_REPLAY(
         /* action= */
         memory_region_dispatch_read(mr, physaddr, &val, size, iotlbentry->attrs),
         /* record= */ rr_input_8(&val),
         /* replay= */ rr_input_8(&val),
         /* location= */ RR_CALLSITE_IO_READ_ALL);
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
     return val;
 }
 
@@ -531,6 +1076,7 @@ static void io_writex(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
     CPUState *cpu = ENV_GET_CPU(env);
     hwaddr physaddr = iotlbentry->addr;
     MemoryRegion *mr = iotlb_to_region(cpu, physaddr, iotlbentry->attrs);
+    bool locked = false;
 
     physaddr = (physaddr & TARGET_PAGE_MASK) + addr;
     if (mr != &io_mem_rom && mr != &io_mem_notdirty && !cpu->can_do_io) {
@@ -539,6 +1085,11 @@ static void io_writex(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
 
     cpu->mem_io_vaddr = addr;
     cpu->mem_io_pc = retaddr;
+
+    if (mr->global_locking && !qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        locked = true;
+    }
     if (mr != &io_mem_rom && mr != &io_mem_notdirty) {
         RR_DO_RECORD_OR_REPLAY(
             /* action= */
@@ -549,6 +1100,9 @@ static void io_writex(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
     } else {
         memory_region_dispatch_write(mr, physaddr, val, size, iotlbentry->attrs);
     }
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 /* Return true if ADDR is present in the victim tlb, and has been copied
@@ -567,6 +1121,9 @@ static bool victim_tlb_hit(CPUArchState *env, size_t mmu_idx, size_t index,
             CPUIOTLBEntry tmpio, *io = &env->iotlb[mmu_idx][index];
             CPUIOTLBEntry *vio = &env->iotlb_v[mmu_idx][vidx];
 
+            if (tlb_entry_is_empty(tlb)) {
+                ENV_GET_CPU(env)->tlb_desc[mmu_idx].n_used_entries++;
+            }
             tmptlb = *tlb; *tlb = *vtlb; *vtlb = tmptlb;
             tmpio = *io; *io = *vio; *vio = tmpio;
             return true;
@@ -589,7 +1146,7 @@ static bool victim_tlb_hit(CPUArchState *env, size_t mmu_idx, size_t index,
 void probe_write(CPUArchState *env, target_ulong addr, int mmu_idx,
                  uintptr_t retaddr)
 {
-    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    int index = tlb_index(env, mmu_idx, addr);
     target_ulong tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
 
     if ((addr & TARGET_PAGE_MASK)
@@ -607,8 +1164,8 @@ static void *atomic_mmu_lookup(CPUArchState *env, target_ulong addr,
                                TCGMemOpIdx oi, uintptr_t retaddr)
 {
     size_t mmu_idx = get_mmuidx(oi);
-    size_t index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    CPUTLBEntry *tlbe = &env->tlb_table[mmu_idx][index];
+    size_t index = tlb_index(env, mmu_idx, addr);
+    CPUTLBEntry *tlbe = tlb_entry(env, mmu_idx, addr);
     target_ulong tlb_addr = tlbe->addr_write;
     TCGMemOp mop = get_memop(oi);
     int a_bits = get_alignment_bits(mop);
@@ -639,9 +1196,16 @@ static void *atomic_mmu_lookup(CPUArchState *env, target_ulong addr,
         if (!VICTIM_TLB_HIT(addr_write, addr)) {
             tlb_fill(ENV_GET_CPU(env), addr, MMU_DATA_STORE, mmu_idx, retaddr);
         }
+        tlbe = tlb_entry(env, mmu_idx, addr);
         tlb_addr = tlbe->addr_write;
     }
 
+    if (unlikely(tlb_addr & TLB_PANDA_WATCH)) {
+        panda_callbacks_tlb_watched_access(ENV_GET_CPU(env), addr,
+                                           1 << s_bits, true, retaddr);
+        tlb_addr &= ~TLB_PANDA_WATCH;
+    }
+
     /* Notice an IO access, or a notdirty page.  */
     if (unlikely(tlb_addr & ~TARGET_PAGE_MASK)) {
         /* There's really nothing that can be done to
@@ -650,7 +1214,7 @@ static void *atomic_mmu_lookup(CPUArchState *env, target_ulong addr,
     }
 
     /* Let the guest notice RMW on a write-only page.  */
-    if (unlikely(tlbe->addr_read != tlb_addr)) {
+    if (unlikely((tlbe->addr_read & ~TLB_PANDA_WATCH) != tlb_addr)) {
         tlb_fill(ENV_GET_CPU(env), addr, MMU_DATA_LOAD, mmu_idx, retaddr);
         /* Since we don't support reads and writes to different addresses,
            and we do have the proper page loaded for write, this shouldn't
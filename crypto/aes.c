@@ -1651,3 +1651,115 @@ void AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
 		}
 	}
 }
+
+const AESAccel *AES_accel;
+
+#if defined(CONFIG_AESNI_OPT)
+#pragma GCC push_options
+#pragma GCC target("sse2,aes")
+#include <cpuid.h>
+#include <wmmintrin.h>
+
+#ifndef bit_AES
+#define bit_AES (1 << 25)
+#endif
+
+#define AESNI_ROUND(name, insn)                                             \
+static void name(uint8_t *out, const uint8_t *st, const uint8_t *rk)        \
+{                                                                           \
+    __m128i x = _mm_loadu_si128((const __m128i *)st);                       \
+    __m128i k = _mm_loadu_si128((const __m128i *)rk);                       \
+    _mm_storeu_si128((__m128i *)out, insn(x, k));                           \
+}
+
+AESNI_ROUND(aesni_enc, _mm_aesenc_si128)
+AESNI_ROUND(aesni_enclast, _mm_aesenclast_si128)
+AESNI_ROUND(aesni_dec, _mm_aesdec_si128)
+AESNI_ROUND(aesni_declast, _mm_aesdeclast_si128)
+
+static void aesni_imc(uint8_t *out, const uint8_t *in)
+{
+    __m128i x = _mm_loadu_si128((const __m128i *)in);
+    _mm_storeu_si128((__m128i *)out, _mm_aesimc_si128(x));
+}
+
+#pragma GCC pop_options
+
+static const AESAccel aes_accel_aesni = {
+    .enc = aesni_enc,
+    .enclast = aesni_enclast,
+    .dec = aesni_dec,
+    .declast = aesni_declast,
+    .imc = aesni_imc,
+};
+
+static void __attribute__((constructor)) aes_accel_init(void)
+{
+    int a, b, c, d;
+
+    if (__get_cpuid_max(0, NULL) >= 1) {
+        __cpuid(1, a, b, c, d);
+        if ((c & bit_AES) && (d & bit_SSE2)) {
+            AES_accel = &aes_accel_aesni;
+        }
+    }
+}
+
+#elif defined(CONFIG_ARM_CRYPTO_OPT)
+#pragma GCC push_options
+#pragma GCC target("+crypto")
+#include <arm_neon.h>
+#include "elf.h"
+
+#ifndef HWCAP_AES
+#define HWCAP_AES (1 << 3)
+#endif
+
+/* AESE and AESD add the round key before the S-box rather than after
+ * MixColumns, so feed them a zero key and add the real one at the end.  */
+static void armv8_enc(uint8_t *out, const uint8_t *st, const uint8_t *rk)
+{
+    uint8x16_t x = vaeseq_u8(vld1q_u8(st), vdupq_n_u8(0));
+    vst1q_u8(out, veorq_u8(vaesmcq_u8(x), vld1q_u8(rk)));
+}
+
+static void armv8_enclast(uint8_t *out, const uint8_t *st, const uint8_t *rk)
+{
+    uint8x16_t x = vaeseq_u8(vld1q_u8(st), vdupq_n_u8(0));
+    vst1q_u8(out, veorq_u8(x, vld1q_u8(rk)));
+}
+
+static void armv8_dec(uint8_t *out, const uint8_t *st, const uint8_t *rk)
+{
+    uint8x16_t x = vaesdq_u8(vld1q_u8(st), vdupq_n_u8(0));
+    vst1q_u8(out, veorq_u8(vaesimcq_u8(x), vld1q_u8(rk)));
+}
+
+static void armv8_declast(uint8_t *out, const uint8_t *st, const uint8_t *rk)
+{
+    uint8x16_t x = vaesdq_u8(vld1q_u8(st), vdupq_n_u8(0));
+    vst1q_u8(out, veorq_u8(x, vld1q_u8(rk)));
+}
+
+static void armv8_imc(uint8_t *out, const uint8_t *in)
+{
+    vst1q_u8(out, vaesimcq_u8(vld1q_u8(in)));
+}
+
+#pragma GCC pop_options
+
+static const AESAccel aes_accel_armv8 = {
+    .enc = armv8_enc,
+    .enclast = armv8_enclast,
+    .dec = armv8_dec,
+    .declast = armv8_declast,
+    .imc = armv8_imc,
+};
+
+static void __attribute__((constructor)) aes_accel_init(void)
+{
+    if (qemu_getauxval(AT_HWCAP) & HWCAP_AES) {
+        AES_accel = &aes_accel_armv8;
+    }
+}
+#endif
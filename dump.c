@@ -1181,173 +1181,315 @@ static inline bool is_zero_page(const uint8_t *buf, size_t page_size)
     return buffer_is_zero(buf, page_size);
 }
 
-static void write_dump_pages(DumpState *s, Error **errp)
+/*
+ * Pages are checked and compressed by a pool of threads, a batch at a time.
+ * While the threads work on one batch, the dump thread writes the previous
+ * one, so compression overlaps with the I/O and the file keeps the order of
+ * the pages.
+ */
+#define DUMP_BATCH_PAGES        256
+#define DUMP_COMPRESS_THREADS   8
+
+typedef struct DumpPageBatch {
+    int nr_pages;
+    uint8_t *in[DUMP_BATCH_PAGES];      /* the guest pages */
+    uint32_t flags[DUMP_BATCH_PAGES];   /* compression format, 0 if none */
+    size_t size[DUMP_BATCH_PAGES];      /* size of the data, 0 if all zero */
+    uint8_t *out;                       /* compressed data, len_buf_out
+                                         * bytes for each page */
+} DumpPageBatch;
+
+typedef struct DumpCompressThread {
+    struct DumpPages *dp;
+    QemuThread thread;
+    QemuSemaphore sem;
+    int index;
+    void *wrkmem;                       /* LZO work memory */
+} DumpCompressThread;
+
+typedef struct DumpPages {
+    DumpState *s;
+    DataCache page_desc;
+    DataCache page_data;
+    PageDescriptor pd_zero;
+    off_t offset_data;
+    size_t len_buf_out;
+
+    DumpPageBatch batches[2];
+    DumpPageBatch *batch;               /* the batch being compressed */
+    DumpCompressThread threads[DUMP_COMPRESS_THREADS];
+    QemuSemaphore sem_done;
+    bool quit;
+} DumpPages;
+
+/*
+ * Fill in the size and the format of page i of the batch. Zero pages get
+ * size 0; they all share the zero page stored first in the page section.
+ *
+ * Only one compression format will be used here, for s->flag_compress is
+ * set. But when compression fails to work, we fall back to save in
+ * plaintext.
+ */
+static void dump_compress_page(DumpPages *dp, DumpPageBatch *b, int i,
+                               void *wrkmem)
 {
-    int ret = 0;
-    DataCache page_desc, page_data;
-    size_t len_buf_out, size_out;
+    DumpState *s = dp->s;
+    size_t page_size = s->dump_info.page_size;
+    uint8_t *buf = b->in[i];
+    uint8_t *buf_out = b->out + i * dp->len_buf_out;
+    size_t size_out = dp->len_buf_out;
+
+    if (is_zero_page(buf, page_size)) {
+        b->size[i] = 0;
+        return;
+    }
+
+    if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
+            (compress2(buf_out, (uLongf *)&size_out, buf,
+                       page_size, Z_BEST_SPEED) == Z_OK) &&
+            (size_out < page_size)) {
+        b->flags[i] = DUMP_DH_COMPRESSED_ZLIB;
 #ifdef CONFIG_LZO
-    lzo_bytep wrkmem = NULL;
+    } else if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
+            (lzo1x_1_compress(buf, page_size, buf_out,
+                              (lzo_uint *)&size_out, wrkmem) == LZO_E_OK) &&
+            (size_out < page_size)) {
+        b->flags[i] = DUMP_DH_COMPRESSED_LZO;
 #endif
-    uint8_t *buf_out = NULL;
-    off_t offset_desc, offset_data;
-    PageDescriptor pd, pd_zero;
-    uint8_t *buf;
-    GuestPhysBlock *block_iter = NULL;
-    uint64_t pfn_iter;
+#ifdef CONFIG_SNAPPY
+    } else if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
+            (snappy_compress((char *)buf, page_size,
+                             (char *)buf_out, &size_out) == SNAPPY_OK) &&
+            (size_out < page_size)) {
+        b->flags[i] = DUMP_DH_COMPRESSED_SNAPPY;
+#endif
+    } else {
+        b->flags[i] = 0;
+        size_out = page_size;
+    }
+    b->size[i] = size_out;
+}
+
+static void *dump_compress_thread(void *opaque)
+{
+    DumpCompressThread *t = opaque;
+    DumpPages *dp = t->dp;
+    int i;
+
+    for (;;) {
+        qemu_sem_wait(&t->sem);
+        if (atomic_read(&dp->quit)) {
+            break;
+        }
+
+        /* Interleave the pages so that zero pages are spread evenly */
+        for (i = t->index; i < dp->batch->nr_pages;
+             i += DUMP_COMPRESS_THREADS) {
+            dump_compress_page(dp, dp->batch, i, t->wrkmem);
+        }
+        qemu_sem_post(&dp->sem_done);
+    }
+
+    return NULL;
+}
+
+static void dump_compress_start(DumpPages *dp, DumpPageBatch *b)
+{
+    int i;
+
+    dp->batch = b;
+    for (i = 0; i < DUMP_COMPRESS_THREADS; i++) {
+        qemu_sem_post(&dp->threads[i].sem);
+    }
+}
+
+static void dump_compress_wait(DumpPages *dp)
+{
+    int i;
+
+    for (i = 0; i < DUMP_COMPRESS_THREADS; i++) {
+        qemu_sem_wait(&dp->sem_done);
+    }
+    dp->batch = NULL;
+}
+
+static void dump_pages_init(DumpPages *dp, DumpState *s)
+{
+    int i;
+
+    dp->s = s;
 
     /* get offset of page_desc and page_data in dump file */
-    offset_desc = s->offset_page;
-    offset_data = offset_desc + sizeof(PageDescriptor) * s->num_dumpable;
+    prepare_data_cache(&dp->page_desc, s, s->offset_page);
+    dp->offset_data = s->offset_page +
+                      sizeof(PageDescriptor) * s->num_dumpable;
+    prepare_data_cache(&dp->page_data, s, dp->offset_data);
 
-    prepare_data_cache(&page_desc, s, offset_desc);
-    prepare_data_cache(&page_data, s, offset_data);
+    /* prepare buffers to store compressed data */
+    dp->len_buf_out = get_len_buf_out(s->dump_info.page_size,
+                                      s->flag_compress);
+    assert(dp->len_buf_out != 0);
+    for (i = 0; i < ARRAY_SIZE(dp->batches); i++) {
+        dp->batches[i].out = g_malloc(DUMP_BATCH_PAGES * dp->len_buf_out);
+    }
 
-    /* prepare buffer to store compressed data */
-    len_buf_out = get_len_buf_out(s->dump_info.page_size, s->flag_compress);
-    assert(len_buf_out != 0);
+    qemu_sem_init(&dp->sem_done, 0);
+    for (i = 0; i < DUMP_COMPRESS_THREADS; i++) {
+        DumpCompressThread *t = &dp->threads[i];
 
+        t->dp = dp;
+        t->index = i;
 #ifdef CONFIG_LZO
-    wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
+        t->wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
 #endif
+        qemu_sem_init(&t->sem, 0);
+        qemu_thread_create(&t->thread, "dump_compress", dump_compress_thread,
+                           t, QEMU_THREAD_JOINABLE);
+    }
+}
 
-    buf_out = g_malloc(len_buf_out);
+static void dump_pages_cleanup(DumpPages *dp)
+{
+    int i;
+
+    atomic_set(&dp->quit, true);
+    for (i = 0; i < DUMP_COMPRESS_THREADS; i++) {
+        DumpCompressThread *t = &dp->threads[i];
+
+        qemu_sem_post(&t->sem);
+        qemu_thread_join(&t->thread);
+        qemu_sem_destroy(&t->sem);
+        g_free(t->wrkmem);
+    }
+    qemu_sem_destroy(&dp->sem_done);
+
+    for (i = 0; i < ARRAY_SIZE(dp->batches); i++) {
+        g_free(dp->batches[i].out);
+    }
+    free_data_cache(&dp->page_desc);
+    free_data_cache(&dp->page_data);
+}
+
+/*
+ * write the page descs and the data of a compressed batch into the caches
+ */
+static int dump_pages_write_batch(DumpPages *dp, DumpPageBatch *b,
+                                  Error **errp)
+{
+    DumpState *s = dp->s;
+    PageDescriptor pd;
+    const void *data;
+    int i;
+
+    for (i = 0; i < b->nr_pages; i++) {
+        if (b->size[i] == 0) {
+            if (write_cache(&dp->page_desc, &dp->pd_zero,
+                            sizeof(PageDescriptor), false) < 0) {
+                error_setg(errp, "dump: failed to write page desc");
+                return -1;
+            }
+        } else {
+            data = b->flags[i] ? b->out + i * dp->len_buf_out : b->in[i];
+            if (write_cache(&dp->page_data, data, b->size[i], false) < 0) {
+                error_setg(errp, "dump: failed to write page data");
+                return -1;
+            }
+
+            pd.flags = cpu_to_dump32(s, b->flags[i]);
+            pd.size = cpu_to_dump32(s, b->size[i]);
+            pd.page_flags = cpu_to_dump64(s, 0);
+            pd.offset = cpu_to_dump64(s, dp->offset_data);
+            dp->offset_data += b->size[i];
+
+            if (write_cache(&dp->page_desc, &pd,
+                            sizeof(PageDescriptor), false) < 0) {
+                error_setg(errp, "dump: failed to write page desc");
+                return -1;
+            }
+        }
+        s->written_size += s->dump_info.page_size;
+    }
+
+    return 0;
+}
+
+static void write_dump_pages(DumpState *s, Error **errp)
+{
+    int ret = 0;
+    DumpPages dp = { 0 };
+    DumpPageBatch *b, *prev = NULL;
+    uint8_t *buf;
+    GuestPhysBlock *block_iter = NULL;
+    uint64_t pfn_iter;
+    bool more = true;
+    int cur = 0;
+
+    dump_pages_init(&dp, s);
 
     /*
      * init zero page's page_desc and page_data, because every zero page
      * uses the same page_data
      */
-    pd_zero.size = cpu_to_dump32(s, s->dump_info.page_size);
-    pd_zero.flags = cpu_to_dump32(s, 0);
-    pd_zero.offset = cpu_to_dump64(s, offset_data);
-    pd_zero.page_flags = cpu_to_dump64(s, 0);
+    dp.pd_zero.size = cpu_to_dump32(s, s->dump_info.page_size);
+    dp.pd_zero.flags = cpu_to_dump32(s, 0);
+    dp.pd_zero.offset = cpu_to_dump64(s, dp.offset_data);
+    dp.pd_zero.page_flags = cpu_to_dump64(s, 0);
     buf = g_malloc0(s->dump_info.page_size);
-    ret = write_cache(&page_data, buf, s->dump_info.page_size, false);
+    ret = write_cache(&dp.page_data, buf, s->dump_info.page_size, false);
     g_free(buf);
     if (ret < 0) {
         error_setg(errp, "dump: failed to write page data (zero page)");
         goto out;
     }
 
-    offset_data += s->dump_info.page_size;
+    dp.offset_data += s->dump_info.page_size;
 
     /*
      * dump memory to vmcore page by page. zero page will all be resided in the
      * first page of page section
      */
-    while (get_next_page(&block_iter, &pfn_iter, &buf, s)) {
-        /* check zero page */
-        if (is_zero_page(buf, s->dump_info.page_size)) {
-            ret = write_cache(&page_desc, &pd_zero, sizeof(PageDescriptor),
-                              false);
-            if (ret < 0) {
-                error_setg(errp, "dump: failed to write page desc");
-                goto out;
+    for (;;) {
+        b = &dp.batches[cur];
+        b->nr_pages = 0;
+        while (more && b->nr_pages < DUMP_BATCH_PAGES) {
+            more = get_next_page(&block_iter, &pfn_iter, &buf, s);
+            if (more) {
+                b->in[b->nr_pages++] = buf;
             }
-        } else {
-            /*
-             * not zero page, then:
-             * 1. compress the page
-             * 2. write the compressed page into the cache of page_data
-             * 3. get page desc of the compressed page and write it into the
-             *    cache of page_desc
-             *
-             * only one compression format will be used here, for
-             * s->flag_compress is set. But when compression fails to work,
-             * we fall back to save in plaintext.
-             */
-             size_out = len_buf_out;
-             if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
-                    (compress2(buf_out, (uLongf *)&size_out, buf,
-                               s->dump_info.page_size, Z_BEST_SPEED) == Z_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_ZLIB);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#ifdef CONFIG_LZO
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
-                    (lzo1x_1_compress(buf, s->dump_info.page_size, buf_out,
-                    (lzo_uint *)&size_out, wrkmem) == LZO_E_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_LZO);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#endif
-#ifdef CONFIG_SNAPPY
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
-                    (snappy_compress((char *)buf, s->dump_info.page_size,
-                    (char *)buf_out, &size_out) == SNAPPY_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_SNAPPY);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#endif
-            } else {
-                /*
-                 * fall back to save in plaintext, size_out should be
-                 * assigned the target's page size
-                 */
-                pd.flags = cpu_to_dump32(s, 0);
-                size_out = s->dump_info.page_size;
-                pd.size = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf,
-                                  s->dump_info.page_size, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-            }
-
-            /* get and write page desc here */
-            pd.page_flags = cpu_to_dump64(s, 0);
-            pd.offset = cpu_to_dump64(s, offset_data);
-            offset_data += size_out;
+        }
 
-            ret = write_cache(&page_desc, &pd, sizeof(PageDescriptor), false);
-            if (ret < 0) {
-                error_setg(errp, "dump: failed to write page desc");
-                goto out;
-            }
+        if (b->nr_pages) {
+            dump_compress_start(&dp, b);
         }
-        s->written_size += s->dump_info.page_size;
+        if (prev) {
+            ret = dump_pages_write_batch(&dp, prev, errp);
+        }
+        if (b->nr_pages) {
+            dump_compress_wait(&dp);
+        }
+        if (ret < 0) {
+            goto out;
+        }
+        if (!b->nr_pages) {
+            break;
+        }
+        prev = b;
+        cur ^= 1;
     }
 
-    ret = write_cache(&page_desc, NULL, 0, true);
+    ret = write_cache(&dp.page_desc, NULL, 0, true);
     if (ret < 0) {
         error_setg(errp, "dump: failed to sync cache for page_desc");
         goto out;
     }
-    ret = write_cache(&page_data, NULL, 0, true);
+    ret = write_cache(&dp.page_data, NULL, 0, true);
     if (ret < 0) {
         error_setg(errp, "dump: failed to sync cache for page_data");
         goto out;
     }
 
 out:
-    free_data_cache(&page_desc);
-    free_data_cache(&page_data);
-
-#ifdef CONFIG_LZO
-    g_free(wrkmem);
-#endif
-
-    g_free(buf_out);
+    dump_pages_cleanup(&dp);
 }
 
 static void create_kdump_vmcore(DumpState *s, Error **errp)
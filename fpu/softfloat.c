@@ -84,6 +84,8 @@ this code that are retained.
  */
 #include "qemu/osdep.h"
 
+#include <float.h>
+
 #include "fpu/softfloat.h"
 
 /* We only need stdlib for abort() */
@@ -2158,6 +2160,113 @@ static float32 subFloat32Sigs(float32 a, float32 b, flag zSign,
 
 }
 
+/*----------------------------------------------------------------------------
+| Hardfloat: the host FPU gives the same results as softfloat for operands
+| that are zero or normal in round-to-nearest-even mode, as long as the result
+| is neither tiny (underflow and flush-to-zero are target-specific) nor
+| infinite (overflow must be raised).  The inexact flag cannot be computed
+| cheaply, so the host is only used once it is already set, which is the
+| common case because the flags accumulate until the guest clears them.
+| Hosts that evaluate float expressions in a wider format, like x87, would
+| double round and are excluded, as are fast-math builds.
+*----------------------------------------------------------------------------*/
+#if defined(__FAST_MATH__) || !defined(FLT_EVAL_METHOD) || FLT_EVAL_METHOD != 0
+#define QEMU_NO_HARDFLOAT
+#endif
+
+typedef enum {
+    HARDFLOAT_ADD,
+    HARDFLOAT_SUB,
+    HARDFLOAT_MUL,
+    HARDFLOAT_DIV,
+} HardfloatOp;
+
+static inline bool hardfloat_allowed(const float_status *status)
+{
+#ifdef QEMU_NO_HARDFLOAT
+    return false;
+#else
+    return likely((status->float_exception_flags & float_flag_inexact) &&
+                  status->float_rounding_mode == float_round_nearest_even);
+#endif
+}
+
+/* Whether a zero result of op is exact, i.e. says nothing about underflow. */
+static inline bool hardfloat_zero_is_exact(HardfloatOp op, bool a_zero,
+                                           bool b_zero)
+{
+    switch (op) {
+    case HARDFLOAT_MUL:
+        return a_zero || b_zero;
+    case HARDFLOAT_DIV:
+        return a_zero;
+    default:
+        return a_zero && b_zero;
+    }
+}
+
+/*----------------------------------------------------------------------------
+| Returns true if the single-precision floating-point value `a' is zero or
+| normal, i.e. an operand the host FPU handles like softfloat.
+*----------------------------------------------------------------------------*/
+
+static inline bool float32_is_hardfloat_operand(float32 a)
+{
+    int aExp = extractFloat32Exp(a);
+
+    return aExp ? aExp != 0xFF : extractFloat32Frac(a) == 0;
+}
+
+/*----------------------------------------------------------------------------
+| Computes `a' op `b' with the host FPU into `*r' and returns true, or returns
+| false if softfloat has to do it.
+*----------------------------------------------------------------------------*/
+
+static inline bool float32_hardfloat(float32 a, float32 b, HardfloatOp op,
+                                     float32 *r, float_status *status)
+{
+    union {
+        float32 s;
+        float h;
+    } ua, ub, ur;
+    uint32_t abs;
+
+    if (!hardfloat_allowed(status) ||
+        !float32_is_hardfloat_operand(a) || !float32_is_hardfloat_operand(b)) {
+        return false;
+    }
+    ua.s = a;
+    ub.s = b;
+    switch (op) {
+    case HARDFLOAT_ADD:
+        ur.h = ua.h + ub.h;
+        break;
+    case HARDFLOAT_SUB:
+        ur.h = ua.h - ub.h;
+        break;
+    case HARDFLOAT_MUL:
+        ur.h = ua.h * ub.h;
+        break;
+    case HARDFLOAT_DIV:
+        if (float32_is_zero(b)) {
+            return false;
+        }
+        ur.h = ua.h / ub.h;
+        break;
+    }
+
+    abs = float32_val(ur.s) & 0x7fffffff;
+    if (unlikely(abs == 0x7f800000)) {
+        float_raise(float_flag_overflow | float_flag_inexact, status);
+    } else if (unlikely(abs <= 0x00800000) &&
+               !hardfloat_zero_is_exact(op, float32_is_zero(a),
+                                        float32_is_zero(b))) {
+        return false;
+    }
+    *r = ur.s;
+    return true;
+}
+
 /*----------------------------------------------------------------------------
 | Returns the result of adding the single-precision floating-point values `a'
 | and `b'.  The operation is performed according to the IEC/IEEE Standard for
@@ -2166,7 +2275,11 @@ static float32 subFloat32Sigs(float32 a, float32 b, flag zSign,
 
 float32 float32_add(float32 a, float32 b, float_status *status)
 {
+    float32 r;
     flag aSign, bSign;
+    if (float32_hardfloat(a, b, HARDFLOAT_ADD, &r, status)) {
+        return r;
+    }
     a = float32_squash_input_denormal(a, status);
     b = float32_squash_input_denormal(b, status);
 
@@ -2189,7 +2302,11 @@ float32 float32_add(float32 a, float32 b, float_status *status)
 
 float32 float32_sub(float32 a, float32 b, float_status *status)
 {
+    float32 r;
     flag aSign, bSign;
+    if (float32_hardfloat(a, b, HARDFLOAT_SUB, &r, status)) {
+        return r;
+    }
     a = float32_squash_input_denormal(a, status);
     b = float32_squash_input_denormal(b, status);
 
@@ -2212,12 +2329,16 @@ float32 float32_sub(float32 a, float32 b, float_status *status)
 
 float32 float32_mul(float32 a, float32 b, float_status *status)
 {
+    float32 r;
     flag aSign, bSign, zSign;
     int aExp, bExp, zExp;
     uint32_t aSig, bSig;
     uint64_t zSig64;
     uint32_t zSig;
 
+    if (float32_hardfloat(a, b, HARDFLOAT_MUL, &r, status)) {
+        return r;
+    }
     a = float32_squash_input_denormal(a, status);
     b = float32_squash_input_denormal(b, status);
 
@@ -2277,9 +2398,13 @@ float32 float32_mul(float32 a, float32 b, float_status *status)
 
 float32 float32_div(float32 a, float32 b, float_status *status)
 {
+    float32 r;
     flag aSign, bSign, zSign;
     int aExp, bExp, zExp;
     uint32_t aSig, bSig, zSig;
+    if (float32_hardfloat(a, b, HARDFLOAT_DIV, &r, status)) {
+        return r;
+    }
     a = float32_squash_input_denormal(a, status);
     b = float32_squash_input_denormal(b, status);
 
@@ -3953,6 +4078,68 @@ static float64 subFloat64Sigs(float64 a, float64 b, flag zSign,
 
 }
 
+/*----------------------------------------------------------------------------
+| Returns true if the double-precision floating-point value `a' is zero or
+| normal, i.e. an operand the host FPU handles like softfloat.
+*----------------------------------------------------------------------------*/
+
+static inline bool float64_is_hardfloat_operand(float64 a)
+{
+    int aExp = extractFloat64Exp(a);
+
+    return aExp ? aExp != 0x7FF : extractFloat64Frac(a) == 0;
+}
+
+/*----------------------------------------------------------------------------
+| Computes `a' op `b' with the host FPU into `*r' and returns true, or returns
+| false if softfloat has to do it.
+*----------------------------------------------------------------------------*/
+
+static inline bool float64_hardfloat(float64 a, float64 b, HardfloatOp op,
+                                     float64 *r, float_status *status)
+{
+    union {
+        float64 s;
+        double h;
+    } ua, ub, ur;
+    uint64_t abs;
+
+    if (!hardfloat_allowed(status) ||
+        !float64_is_hardfloat_operand(a) || !float64_is_hardfloat_operand(b)) {
+        return false;
+    }
+    ua.s = a;
+    ub.s = b;
+    switch (op) {
+    case HARDFLOAT_ADD:
+        ur.h = ua.h + ub.h;
+        break;
+    case HARDFLOAT_SUB:
+        ur.h = ua.h - ub.h;
+        break;
+    case HARDFLOAT_MUL:
+        ur.h = ua.h * ub.h;
+        break;
+    case HARDFLOAT_DIV:
+        if (float64_is_zero(b)) {
+            return false;
+        }
+        ur.h = ua.h / ub.h;
+        break;
+    }
+
+    abs = float64_val(ur.s) & 0x7fffffffffffffffULL;
+    if (unlikely(abs == 0x7ff0000000000000ULL)) {
+        float_raise(float_flag_overflow | float_flag_inexact, status);
+    } else if (unlikely(abs <= 0x0010000000000000ULL) &&
+               !hardfloat_zero_is_exact(op, float64_is_zero(a),
+                                        float64_is_zero(b))) {
+        return false;
+    }
+    *r = ur.s;
+    return true;
+}
+
 /*----------------------------------------------------------------------------
 | Returns the result of adding the double-precision floating-point values `a'
 | and `b'.  The operation is performed according to the IEC/IEEE Standard for
@@ -3961,7 +4148,11 @@ static float64 subFloat64Sigs(float64 a, float64 b, flag zSign,
 
 float64 float64_add(float64 a, float64 b, float_status *status)
 {
+    float64 r;
     flag aSign, bSign;
+    if (float64_hardfloat(a, b, HARDFLOAT_ADD, &r, status)) {
+        return r;
+    }
     a = float64_squash_input_denormal(a, status);
     b = float64_squash_input_denormal(b, status);
 
@@ -3984,7 +4175,11 @@ float64 float64_add(float64 a, float64 b, float_status *status)
 
 float64 float64_sub(float64 a, float64 b, float_status *status)
 {
+    float64 r;
     flag aSign, bSign;
+    if (float64_hardfloat(a, b, HARDFLOAT_SUB, &r, status)) {
+        return r;
+    }
     a = float64_squash_input_denormal(a, status);
     b = float64_squash_input_denormal(b, status);
 
@@ -4007,10 +4202,14 @@ float64 float64_sub(float64 a, float64 b, float_status *status)
 
 float64 float64_mul(float64 a, float64 b, float_status *status)
 {
+    float64 r;
     flag aSign, bSign, zSign;
     int aExp, bExp, zExp;
     uint64_t aSig, bSig, zSig0, zSig1;
 
+    if (float64_hardfloat(a, b, HARDFLOAT_MUL, &r, status)) {
+        return r;
+    }
     a = float64_squash_input_denormal(a, status);
     b = float64_squash_input_denormal(b, status);
 
@@ -4070,11 +4269,15 @@ float64 float64_mul(float64 a, float64 b, float_status *status)
 
 float64 float64_div(float64 a, float64 b, float_status *status)
 {
+    float64 r;
     flag aSign, bSign, zSign;
     int aExp, bExp, zExp;
     uint64_t aSig, bSig, zSig;
     uint64_t rem0, rem1;
     uint64_t term0, term1;
+    if (float64_hardfloat(a, b, HARDFLOAT_DIV, &r, status)) {
+        return r;
+    }
     a = float64_squash_input_denormal(a, status);
     b = float64_squash_input_denormal(b, status);
 
@@ -287,6 +287,22 @@ STEXI
 @item info opcount
 @findex opcount
 Show dynamic compiler opcode counters
+ETEXI
+
+    {
+        .name       = "tb-profile",
+        .args_type  = "count:i?",
+        .params     = "[count]",
+        .help       = "show the TB execution profile and the most executed "
+                      "TBs (default 20)",
+        .cmd        = hmp_info_tb_profile,
+    },
+
+STEXI
+@item info tb-profile [@var{count}]
+@findex tb-profile
+Show where time went in translated code, how TB chains ended, and the
+@var{count} most executed TBs, if QEMU was started with @option{-tb-profile}.
 ETEXI
 
     {
@@ -799,6 +815,37 @@ STEXI
 @item info hotpluggable-cpus
 @findex hotpluggable-cpus
 Show information about hotpluggable CPUs
+ETEXI
+
+    {
+        .name       = "rr-stats",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show record/replay throughput counters",
+        .cmd        = hmp_info_rr_stats,
+    },
+
+STEXI
+@item info rr-stats
+@findex rr-stats
+Show record/replay throughput: guest instructions and nondet log bytes per
+second, log entries by kind, time spent replaying skipped calls and, with
+@option{-panda-profile}, time spent in each type of plugin callback.
+ETEXI
+
+    {
+        .name       = "panda-plugins",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show loaded PANDA plugins",
+        .cmd        = hmp_panda_list_plugins,
+    },
+
+STEXI
+@item info panda-plugins
+@findex panda-plugins
+Show the loaded PANDA plugins and, with @option{-panda-profile}, the calls
+and time spent in each plugin's callbacks by callback type.
 ETEXI
 
 STEXI
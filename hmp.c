@@ -322,6 +322,18 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, " %s: %" PRId64,
             MigrationParameter_lookup[MIGRATION_PARAMETER_X_CHECKPOINT_DELAY],
             params->x_checkpoint_delay);
+        assert(params->has_x_multifd_channels);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS],
+            params->x_multifd_channels);
+        assert(params->has_x_multifd_compression);
+        monitor_printf(mon, " %s: %s",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_MULTIFD_COMPRESSION],
+            MultifdCompression_lookup[params->x_multifd_compression]);
+        assert(params->has_x_postcopy_prefetch);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_POSTCOPY_PREFETCH],
+            params->x_postcopy_prefetch);
         monitor_printf(mon, "\n");
     }
 
@@ -1394,6 +1406,23 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
                 p.has_x_checkpoint_delay = true;
                 use_int_value = true;
                 break;
+            case MIGRATION_PARAMETER_X_MULTIFD_CHANNELS:
+                p.has_x_multifd_channels = true;
+                use_int_value = true;
+                break;
+            case MIGRATION_PARAMETER_X_MULTIFD_COMPRESSION:
+                p.has_x_multifd_compression = true;
+                p.x_multifd_compression =
+                    qapi_enum_parse(MultifdCompression_lookup, valuestr,
+                                    MULTIFD_COMPRESSION__MAX, -1, &err);
+                if (err) {
+                    goto cleanup;
+                }
+                break;
+            case MIGRATION_PARAMETER_X_POSTCOPY_PREFETCH:
+                p.has_x_postcopy_prefetch = true;
+                use_int_value = true;
+                break;
             }
 
             if (use_int_value) {
@@ -1411,6 +1440,8 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
                 p.cpu_throttle_increment = valueint;
                 p.downtime_limit = valueint;
                 p.x_checkpoint_delay = valueint;
+                p.x_multifd_channels = valueint;
+                p.x_postcopy_prefetch = valueint;
             }
 
             qmp_migrate_set_parameters(&p, &err);
@@ -144,5 +144,9 @@ void hmp_begin_record_from(Monitor *mon, const QDict *qdict);
 void hmp_begin_replay(Monitor *mon, const QDict *qdict);
 void hmp_end_record(Monitor *mon, const QDict *qdict);
 void hmp_end_replay(Monitor *mon, const QDict *qdict);
+void hmp_info_rr_stats(Monitor *mon, const QDict *qdict);
+
+// PANDA plugins HMP
+void hmp_panda_list_plugins(Monitor *mon, const QDict *qdict);
 
 #endif
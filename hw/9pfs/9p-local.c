@@ -45,6 +45,91 @@
 
 #define VIRTFS_META_DIR ".virtfs_metadata"
 
+/*
+ * With the mapped security models every lstat also has to read the guest
+ * credentials from xattrs or from the metadata file.  They are cached per
+ * path, together with the inode and ctime they were read for.  Our own
+ * changes to the credentials and to the namespace drop entries, and the
+ * ctime catches xattrs set behind our back.  Host-side edits of the
+ * metadata files of the mapped-file model are not noticed.
+ */
+#define LOCAL_ATTR_CACHE_MAX 4096
+
+typedef struct LocalAttr {
+    dev_t st_dev;
+    ino_t st_ino;
+    struct timespec st_ctim;
+    uid_t st_uid;
+    gid_t st_gid;
+    mode_t st_mode;
+    dev_t st_rdev;
+} LocalAttr;
+
+struct local_data {
+    QemuMutex attr_lock;
+    GHashTable *attr_cache;     /* path -> LocalAttr */
+};
+
+static bool local_attr_cache_lookup(FsContext *ctx, const char *path,
+                                    struct stat *stbuf)
+{
+    struct local_data *data = ctx->private;
+    LocalAttr *attr;
+    bool found = false;
+
+    qemu_mutex_lock(&data->attr_lock);
+    attr = g_hash_table_lookup(data->attr_cache, path);
+    if (attr && attr->st_dev == stbuf->st_dev &&
+        attr->st_ino == stbuf->st_ino &&
+        attr->st_ctim.tv_sec == stbuf->st_ctim.tv_sec &&
+        attr->st_ctim.tv_nsec == stbuf->st_ctim.tv_nsec) {
+        stbuf->st_uid = attr->st_uid;
+        stbuf->st_gid = attr->st_gid;
+        stbuf->st_mode = attr->st_mode;
+        stbuf->st_rdev = attr->st_rdev;
+        found = true;
+    }
+    qemu_mutex_unlock(&data->attr_lock);
+    return found;
+}
+
+static void local_attr_cache_insert(FsContext *ctx, const char *path,
+                                    const struct stat *stbuf)
+{
+    struct local_data *data = ctx->private;
+    LocalAttr *attr = g_new(LocalAttr, 1);
+
+    attr->st_dev = stbuf->st_dev;
+    attr->st_ino = stbuf->st_ino;
+    attr->st_ctim = stbuf->st_ctim;
+    attr->st_uid = stbuf->st_uid;
+    attr->st_gid = stbuf->st_gid;
+    attr->st_mode = stbuf->st_mode;
+    attr->st_rdev = stbuf->st_rdev;
+
+    qemu_mutex_lock(&data->attr_lock);
+    if (g_hash_table_size(data->attr_cache) >= LOCAL_ATTR_CACHE_MAX) {
+        /* cheaper than keeping an LRU list, and refilling is just lookups */
+        g_hash_table_remove_all(data->attr_cache);
+    }
+    g_hash_table_replace(data->attr_cache, g_strdup(path), attr);
+    qemu_mutex_unlock(&data->attr_lock);
+}
+
+/* Drop path, or everything if path is NULL */
+static void local_attr_cache_invalidate(FsContext *ctx, const char *path)
+{
+    struct local_data *data = ctx->private;
+
+    qemu_mutex_lock(&data->attr_lock);
+    if (path) {
+        g_hash_table_remove(data->attr_cache, path);
+    } else {
+        g_hash_table_remove_all(data->attr_cache);
+    }
+    qemu_mutex_unlock(&data->attr_lock);
+}
+
 static char *local_mapped_attr_path(FsContext *ctx, const char *path)
 {
     int dirlen;
@@ -128,6 +213,10 @@ static int local_lstat(FsContext *fs_ctx, V9fsPath *fs_path, struct stat *stbuf)
     if (err) {
         goto err_out;
     }
+    if ((fs_ctx->export_flags & (V9FS_SM_MAPPED | V9FS_SM_MAPPED_FILE)) &&
+        local_attr_cache_lookup(fs_ctx, path, stbuf)) {
+        goto err_out;
+    }
     if (fs_ctx->export_flags & V9FS_SM_MAPPED) {
         /* Actual credentials are part of extended attrs */
         uid_t tmp_uid;
@@ -147,8 +236,10 @@ static int local_lstat(FsContext *fs_ctx, V9fsPath *fs_path, struct stat *stbuf)
         if (getxattr(buffer, "user.virtfs.rdev", &tmp_dev, sizeof(dev_t)) > 0) {
             stbuf->st_rdev = le64_to_cpu(tmp_dev);
         }
+        local_attr_cache_insert(fs_ctx, path, stbuf);
     } else if (fs_ctx->export_flags & V9FS_SM_MAPPED_FILE) {
         local_mapped_file_attr(fs_ctx, path, stbuf);
+        local_attr_cache_insert(fs_ctx, path, stbuf);
     }
 
 err_out:
@@ -183,6 +274,7 @@ static int local_set_mapped_file_attr(FsContext *ctx,
     char *attr_path;
     int uid = -1, gid = -1, mode = -1, rdev = -1;
 
+    local_attr_cache_invalidate(ctx, path);
     attr_path = local_mapped_attr_path(ctx, path);
     fp = local_fopen(attr_path, "r");
     if (!fp) {
@@ -468,6 +560,7 @@ static int local_chmod(FsContext *fs_ctx, V9fsPath *fs_path, FsCred *credp)
     int ret = -1;
     char *path = fs_path->data;
 
+    local_attr_cache_invalidate(fs_ctx, path);
     if (fs_ctx->export_flags & V9FS_SM_MAPPED) {
         buffer = rpath(fs_ctx, path);
         ret = local_set_xattr(buffer, credp);
@@ -540,6 +633,8 @@ err_end:
     errno = serrno;
 out:
     g_free(buffer);
+    /* drop whatever was cached before the credentials were set */
+    local_attr_cache_invalidate(fs_ctx, fullname.data);
     v9fs_string_free(&fullname);
     return err;
 }
@@ -602,6 +697,8 @@ err_end:
     errno = serrno;
 out:
     g_free(buffer);
+    /* drop whatever was cached before the credentials were set */
+    local_attr_cache_invalidate(fs_ctx, fullname.data);
     v9fs_string_free(&fullname);
     return err;
 }
@@ -719,6 +816,8 @@ err_end:
     errno = serrno;
 out:
     g_free(buffer);
+    /* drop whatever was cached before the credentials were set */
+    local_attr_cache_invalidate(fs_ctx, fullname.data);
     v9fs_string_free(&fullname);
     return err;
 }
@@ -823,6 +922,8 @@ err_end:
     errno = serrno;
 out:
     g_free(buffer);
+    /* drop whatever was cached before the credentials were set */
+    local_attr_cache_invalidate(fs_ctx, fullname.data);
     v9fs_string_free(&fullname);
     return err;
 }
@@ -882,6 +983,8 @@ static int local_rename(FsContext *ctx, const char *oldpath,
     int err;
     char *buffer, *buffer1;
 
+    /* every path below oldpath moves, and newpath may be replaced */
+    local_attr_cache_invalidate(ctx, NULL);
     if (ctx->export_flags & V9FS_SM_MAPPED_FILE) {
         err = local_create_mapped_attr_dir(ctx, newpath);
         if (err < 0) {
@@ -912,6 +1015,7 @@ static int local_chown(FsContext *fs_ctx, V9fsPath *fs_path, FsCred *credp)
     int ret = -1;
     char *path = fs_path->data;
 
+    local_attr_cache_invalidate(fs_ctx, path);
     if ((credp->fc_uid == -1 && credp->fc_gid == -1) ||
         (fs_ctx->export_flags & V9FS_SM_PASSTHROUGH) ||
         (fs_ctx->export_flags & V9FS_SM_NONE)) {
@@ -947,6 +1051,7 @@ static int local_remove(FsContext *ctx, const char *path)
     struct stat stbuf;
     char *buffer;
 
+    local_attr_cache_invalidate(ctx, path);
     if (ctx->export_flags & V9FS_SM_MAPPED_FILE) {
         buffer = rpath(ctx, path);
         err =  lstat(buffer, &stbuf);
@@ -1096,6 +1201,7 @@ static int local_unlinkat(FsContext *ctx, V9fsPath *dir,
     v9fs_string_init(&fullname);
 
     v9fs_string_sprintf(&fullname, "%s/%s", dir->data, name);
+    local_attr_cache_invalidate(ctx, fullname.data);
     if (ctx->export_flags & V9FS_SM_MAPPED_FILE) {
         if (flags == AT_REMOVEDIR) {
             /*
@@ -1171,6 +1277,12 @@ static int local_init(FsContext *ctx)
 {
     int err = 0;
     struct statfs stbuf;
+    struct local_data *data = g_new(struct local_data, 1);
+
+    qemu_mutex_init(&data->attr_lock);
+    data->attr_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                             g_free, g_free);
+    ctx->private = data;
 
     if (ctx->export_flags & V9FS_SM_PASSTHROUGH) {
         ctx->xops = passthrough_xattr_ops;
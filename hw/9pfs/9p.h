@@ -182,6 +182,12 @@ static inline void v9fs_readdir_unlock(V9fsDir *dir)
     qemu_mutex_unlock(&dir->readdir_mutex);
 }
 
+/* A directory entry read ahead by v9fs_co_readdir_many() */
+typedef struct V9fsDirEnt {
+    struct dirent *dent;
+    struct V9fsDirEnt *next;
+} V9fsDirEnt;
+
 static inline void v9fs_readdir_init(V9fsDir *dir)
 {
     qemu_mutex_init(&dir->readdir_mutex);
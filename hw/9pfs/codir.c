@@ -42,6 +42,68 @@ int coroutine_fn v9fs_co_readdir(V9fsPDU *pdu, V9fsFidState *fidp,
     return err;
 }
 
+/*
+ * Read as many entries as fit in maxsize bytes of an Rreaddir reply, in a
+ * single trip to the worker thread rather than one per entry.  The stream
+ * is left at the first entry that did not fit.  Returns the number of
+ * entries read; the caller frees *entries even if an error is returned.
+ */
+int coroutine_fn v9fs_co_readdir_many(V9fsPDU *pdu, V9fsFidState *fidp,
+                                      V9fsDirEnt **entries, int32_t maxsize)
+{
+    int err;
+    V9fsState *s = pdu->s;
+
+    *entries = NULL;
+    if (v9fs_request_cancelled(pdu)) {
+        return -EINTR;
+    }
+    v9fs_co_run_in_worker(
+        {
+            V9fsDirEnt **tail = entries;
+            struct dirent *dent;
+            int32_t size = 0;
+            off_t saved_pos;
+
+            v9fs_readdir_lock(&fidp->fs.dir);
+            err = 0;
+            saved_pos = s->ops->telldir(&s->ctx, &fidp->fs);
+            if (saved_pos < 0) {
+                err = -errno;
+            }
+            while (!err) {
+                errno = 0;
+                dent = s->ops->readdir(&s->ctx, &fidp->fs);
+                if (!dent) {
+                    err = -errno;
+                    break;
+                }
+                /*
+                 * Size of each dirent on the wire: size of qid (13) + size
+                 * of offset (8) + size of type (1) + size of name.size (2)
+                 * + strlen(name)
+                 */
+                size += 24 + strlen(dent->d_name);
+                if (size > maxsize) {
+                    s->ops->seekdir(&s->ctx, &fidp->fs, saved_pos);
+                    break;
+                }
+                *tail = g_new0(V9fsDirEnt, 1);
+                (*tail)->dent = g_memdup(dent, sizeof(*dent));
+                tail = &(*tail)->next;
+                saved_pos = dent->d_off;
+            }
+            v9fs_readdir_unlock(&fidp->fs.dir);
+        });
+    if (err < 0) {
+        return err;
+    }
+    for (err = 0; *entries; entries = &(*entries)->next) {
+        err++;
+    }
+    return err;
+}
+
 off_t v9fs_co_telldir(V9fsPDU *pdu, V9fsFidState *fidp)
 {
     off_t err;
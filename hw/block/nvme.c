@@ -18,6 +18,16 @@
  * Usage: add options:
  *      -drive file=<file>,if=none,id=<drive_id>
  *      -device nvme,drive=<drive_id>,serial=<serial>,id=<id[optional]>
+ *
+ * Optional properties:
+ *      num_queues=<n>      queue pairs, admin queue included (default 64)
+ *      iothread=<id>       run the I/O queues in an IOThread
+ *      ioeventfd=off       don't catch doorbells with ioeventfd
+ *
+ * The controller supports Doorbell Buffer Config.  Once the host has set
+ * up shadow doorbells, the I/O queue doorbells are caught by ioeventfds
+ * and the tails and heads read from the shadow doorbells, and the host only
+ * writes a doorbell when the event index asks for it.
  */
 
 #include "qemu/osdep.h"
@@ -29,6 +39,9 @@
 #include "qapi/error.h"
 #include "qapi/visitor.h"
 #include "sysemu/block-backend.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "panda/rr/rr_log_all.h"
 
 #include "nvme.h"
 
@@ -68,7 +81,82 @@ static uint8_t nvme_sq_empty(NvmeSQueue *sq)
     return sq->head == sq->tail;
 }
 
-static void nvme_isr_notify(NvmeCtrl *n, NvmeCQueue *cq)
+/* The I/O queues run in the AioContext of the iothread, if there is one,
+ * the admin queue always in the main loop.
+ */
+static bool nvme_queue_in_iothread(NvmeCtrl *n, uint16_t qid)
+{
+    return qid && n->iothread;
+}
+
+static QEMUTimer *nvme_timer_new(NvmeCtrl *n, uint16_t qid, QEMUTimerCB *cb,
+    void *opaque)
+{
+    if (nvme_queue_in_iothread(n, qid)) {
+        return aio_timer_new(n->ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS, cb, opaque);
+    }
+    return timer_new_ns(QEMU_CLOCK_VIRTUAL, cb, opaque);
+}
+
+static void nvme_set_notifier_handler(NvmeCtrl *n, uint16_t qid,
+    EventNotifier *e, EventNotifierHandler *handler)
+{
+    if (nvme_queue_in_iothread(n, qid)) {
+        aio_set_event_notifier(n->ctx, e, true, handler);
+    } else {
+        event_notifier_set_handler(e, true, handler);
+    }
+}
+
+/* Take the AioContext of the I/O queues in code that runs in the main loop
+ * or a vCPU thread and touches them.
+ */
+static void nvme_lock(NvmeCtrl *n)
+{
+    if (n->iothread) {
+        aio_context_acquire(n->ctx);
+    }
+}
+
+static void nvme_unlock(NvmeCtrl *n)
+{
+    if (n->iothread) {
+        aio_context_release(n->ctx);
+    }
+}
+
+/* Shadow doorbells: the host writes new tails and heads to guest memory,
+ * and only rings the doorbell when it passes the event index we write.
+ */
+static void nvme_update_sq_tail(NvmeSQueue *sq)
+{
+    uint32_t tail = ldl_le_pci_dma(&sq->ctrl->parent_obj, sq->db_addr);
+
+    if (tail < sq->size) {
+        sq->tail = tail;
+    }
+}
+
+static void nvme_update_sq_eventidx(NvmeSQueue *sq)
+{
+    stl_le_pci_dma(&sq->ctrl->parent_obj, sq->ei_addr, sq->tail);
+}
+
+static void nvme_update_cq_head(NvmeCQueue *cq)
+{
+    uint32_t head = ldl_le_pci_dma(&cq->ctrl->parent_obj, cq->db_addr);
+
+    if (head < cq->size) {
+        cq->head = head;
+    }
+}
+
+static void nvme_update_cq_eventidx(NvmeCQueue *cq)
+{
+    stl_le_pci_dma(&cq->ctrl->parent_obj, cq->ei_addr, cq->head);
+}
+
+static void nvme_irq_raise(NvmeCtrl *n, NvmeCQueue *cq)
 {
     if (cq->irq_enabled) {
         if (msix_enabled(&(n->parent_obj))) {
@@ -79,6 +167,86 @@ static void nvme_isr_notify(NvmeCtrl *n, NvmeCQueue *cq)
     }
 }
 
+static void nvme_irq_notifier_read(EventNotifier *e)
+{
+    NvmeCQueue *cq = container_of(e, NvmeCQueue, irq_notifier);
+
+    if (event_notifier_test_and_clear(e)) {
+        nvme_irq_raise(cq->ctrl, cq);
+    }
+}
+
+static void nvme_isr_notify(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    if (nvme_queue_in_iothread(n, cq->cqid)) {
+        /* Interrupts need the global mutex, which the iothread must not
+         * take while it holds the AioContext, so the main loop raises it */
+        event_notifier_set(&cq->irq_notifier);
+    } else {
+        nvme_irq_raise(n, cq);
+    }
+}
+
+/* Interrupt coalescing applies to the I/O completion queues whose vector
+ * hasn't opted out, once the host has set a threshold or a time.
+ */
+static bool nvme_cq_coalesced(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    return cq->cqid && n->features.int_coalescing &&
+        !NVME_INTVC_CD(n->features.int_vector_config[cq->vector]);
+}
+
+/* Signal the posted entries, unless there are fewer than the aggregation
+ * threshold and the aggregation time hasn't run out yet.
+ */
+static void nvme_cq_irq(NvmeCtrl *n, NvmeCQueue *cq, uint32_t posted)
+{
+    uint32_t intc = n->features.int_coalescing;
+
+    if (!nvme_cq_coalesced(n, cq)) {
+        nvme_isr_notify(n, cq);
+        return;
+    }
+
+    cq->irq_pending += posted;
+    if (cq->irq_pending > NVME_INTC_THR(intc) || !NVME_INTC_TIME(intc)) {
+        timer_del(cq->irq_timer);
+        cq->irq_pending = 0;
+        nvme_isr_notify(n, cq);
+    } else if (cq->irq_pending && !timer_pending(cq->irq_timer)) {
+        timer_mod(cq->irq_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                  NVME_INTC_TIME(intc) * 100 * SCALE_US);
+    }
+}
+
+static void nvme_cq_irq_timer(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+
+    if (cq->irq_pending) {
+        cq->irq_pending = 0;
+        nvme_isr_notify(cq->ctrl, cq);
+    }
+}
+
+static void nvme_set_cq_head(NvmeCtrl *n, NvmeCQueue *cq, uint16_t new_head)
+{
+    int start_sqs = nvme_cq_full(cq) ? 1 : 0;
+
+    cq->head = new_head;
+    if (start_sqs) {
+        NvmeSQueue *sq;
+        QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
+            timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+        }
+        timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+    }
+
+    if (cq->tail != cq->head) {
+        nvme_isr_notify(n, cq);
+    }
+}
+
 static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
     uint32_t len, NvmeCtrl *n)
 {
@@ -165,6 +333,11 @@ static void nvme_post_cqes(void *opaque)
     NvmeCQueue *cq = opaque;
     NvmeCtrl *n = cq->ctrl;
     NvmeRequest *req, *next;
+    uint32_t posted = 0;
+
+    if (cq->db_addr) {
+        nvme_update_cq_head(cq);
+    }
 
     QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
         NvmeSQueue *sq;
@@ -184,8 +357,12 @@ static void nvme_post_cqes(void *opaque)
         pci_dma_write(&n->parent_obj, addr, (void *)&req->cqe,
             sizeof(req->cqe));
         QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
+        posted++;
+    }
+    if (cq->db_addr) {
+        nvme_update_cq_eventidx(cq);
     }
-    nvme_isr_notify(n, cq);
+    nvme_cq_irq(n, cq, posted);
 }
 
 static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
@@ -287,11 +464,55 @@ static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     }
 }
 
+static void nvme_sq_notifier(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    if (event_notifier_test_and_clear(e)) {
+        nvme_process_sq(sq);
+    }
+}
+
+/* An ioeventfd only says that the doorbell was written, so it is only
+ * used once the new tail can be read from the shadow doorbell.
+ */
+static void nvme_init_sq_ioeventfd(NvmeSQueue *sq)
+{
+    NvmeCtrl *n = sq->ctrl;
+
+    if (!n->ioeventfd || sq->ioeventfd_enabled ||
+        event_notifier_init(&sq->notifier, 0)) {
+        return;
+    }
+    nvme_set_notifier_handler(n, sq->sqid, &sq->notifier, nvme_sq_notifier);
+    memory_region_add_eventfd(&n->iomem, 0x1000 + (sq->sqid << 3), 4,
+                              false, 0, &sq->notifier);
+    sq->ioeventfd_enabled = true;
+}
+
+static void nvme_init_sq_dbbuf(NvmeSQueue *sq)
+{
+    NvmeCtrl *n = sq->ctrl;
+
+    sq->db_addr = n->dbbuf_dbs + (sq->sqid << 3);
+    sq->ei_addr = n->dbbuf_eis + (sq->sqid << 3);
+    stl_le_pci_dma(&n->parent_obj, sq->db_addr, sq->tail);
+    nvme_update_sq_eventidx(sq);
+    nvme_init_sq_ioeventfd(sq);
+}
+
 static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
 {
     n->sq[sq->sqid] = NULL;
     timer_del(sq->timer);
     timer_free(sq->timer);
+    if (sq->ioeventfd_enabled) {
+        memory_region_del_eventfd(&n->iomem, 0x1000 + (sq->sqid << 3), 4,
+                                  false, 0, &sq->notifier);
+        nvme_set_notifier_handler(n, sq->sqid, &sq->notifier, NULL);
+        event_notifier_cleanup(&sq->notifier);
+        sq->ioeventfd_enabled = false;
+    }
     g_free(sq->io_req);
     if (sq->sqid) {
         g_free(sq);
@@ -345,6 +566,8 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
     sq->size = size;
     sq->cqid = cqid;
     sq->head = sq->tail = 0;
+    sq->db_addr = sq->ei_addr = 0;
+    sq->ioeventfd_enabled = false;
     sq->io_req = g_new(NvmeRequest, sq->size);
 
     QTAILQ_INIT(&sq->req_list);
@@ -353,12 +576,15 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
         sq->io_req[i].sq = sq;
         QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
     }
-    sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
+    sq->timer = nvme_timer_new(n, sqid, nvme_process_sq, sq);
 
     assert(n->cq[cqid]);
     cq = n->cq[cqid];
     QTAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
     n->sq[sqid] = sq;
+    if (sqid && n->dbbuf_dbs) {
+        nvme_init_sq_dbbuf(sq);
+    }
 }
 
 static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -392,11 +618,63 @@ static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
     return NVME_SUCCESS;
 }
 
+static void nvme_cq_notifier(EventNotifier *e)
+{
+    NvmeCQueue *cq = container_of(e, NvmeCQueue, notifier);
+    uint32_t head;
+
+    if (!event_notifier_test_and_clear(e)) {
+        return;
+    }
+    head = ldl_le_pci_dma(&cq->ctrl->parent_obj, cq->db_addr);
+    if (head < cq->size) {
+        nvme_set_cq_head(cq->ctrl, cq, head);
+    }
+}
+
+static void nvme_init_cq_ioeventfd(NvmeCQueue *cq)
+{
+    NvmeCtrl *n = cq->ctrl;
+
+    if (!n->ioeventfd || cq->ioeventfd_enabled ||
+        event_notifier_init(&cq->notifier, 0)) {
+        return;
+    }
+    nvme_set_notifier_handler(n, cq->cqid, &cq->notifier, nvme_cq_notifier);
+    memory_region_add_eventfd(&n->iomem, 0x1000 + (cq->cqid << 3) + 4, 4,
+                              false, 0, &cq->notifier);
+    cq->ioeventfd_enabled = true;
+}
+
+static void nvme_init_cq_dbbuf(NvmeCQueue *cq)
+{
+    NvmeCtrl *n = cq->ctrl;
+
+    cq->db_addr = n->dbbuf_dbs + (cq->cqid << 3) + 4;
+    cq->ei_addr = n->dbbuf_eis + (cq->cqid << 3) + 4;
+    stl_le_pci_dma(&n->parent_obj, cq->db_addr, cq->head);
+    nvme_update_cq_eventidx(cq);
+    nvme_init_cq_ioeventfd(cq);
+}
+
 static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
 {
     n->cq[cq->cqid] = NULL;
     timer_del(cq->timer);
     timer_free(cq->timer);
+    timer_del(cq->irq_timer);
+    timer_free(cq->irq_timer);
+    if (cq->ioeventfd_enabled) {
+        memory_region_del_eventfd(&n->iomem, 0x1000 + (cq->cqid << 3) + 4, 4,
+                                  false, 0, &cq->notifier);
+        nvme_set_notifier_handler(n, cq->cqid, &cq->notifier, NULL);
+        event_notifier_cleanup(&cq->notifier);
+        cq->ioeventfd_enabled = false;
+    }
+    if (nvme_queue_in_iothread(n, cq->cqid)) {
+        event_notifier_set_handler(&cq->irq_notifier, false, NULL);
+        event_notifier_cleanup(&cq->irq_notifier);
+    }
     msix_vector_unuse(&n->parent_obj, cq->vector);
     if (cq->cqid) {
         g_free(cq);
@@ -432,11 +710,23 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     cq->irq_enabled = irq_enabled;
     cq->vector = vector;
     cq->head = cq->tail = 0;
+    cq->db_addr = cq->ei_addr = 0;
+    cq->ioeventfd_enabled = false;
+    cq->irq_pending = 0;
     QTAILQ_INIT(&cq->req_list);
     QTAILQ_INIT(&cq->sq_list);
     msix_vector_use(&n->parent_obj, cq->vector);
     n->cq[cqid] = cq;
-    cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+    cq->timer = nvme_timer_new(n, cqid, nvme_post_cqes, cq);
+    cq->irq_timer = nvme_timer_new(n, cqid, nvme_cq_irq_timer, cq);
+    if (nvme_queue_in_iothread(n, cqid)) {
+        event_notifier_init(&cq->irq_notifier, 0);
+        event_notifier_set_handler(&cq->irq_notifier, false,
+                                   nvme_irq_notifier_read);
+    }
+    if (cqid && n->dbbuf_dbs) {
+        nvme_init_cq_dbbuf(cq);
+    }
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -458,7 +748,7 @@ static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
     if (!prp1) {
         return NVME_INVALID_FIELD | NVME_DNR;
     }
-    if (vector > n->num_queues) {
+    if (vector >= n->num_queues) {
         return NVME_INVALID_IRQ_VECTOR | NVME_DNR;
     }
     if (!(NVME_CQ_FLAGS_PC(qflags))) {
@@ -541,6 +831,7 @@ static uint16_t nvme_identify(NvmeCtrl *n, NvmeCmd *cmd)
 static uint16_t nvme_get_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     uint32_t dw10 = le32_to_cpu(cmd->cdw10);
+    uint32_t dw11 = le32_to_cpu(cmd->cdw11);
     uint32_t result;
 
     switch (dw10) {
@@ -550,6 +841,16 @@ static uint16_t nvme_get_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     case NVME_NUMBER_OF_QUEUES:
         result = cpu_to_le32((n->num_queues - 1) | ((n->num_queues - 1) << 16));
         break;
+    case NVME_INTERRUPT_COALESCING:
+        result = cpu_to_le32(n->features.int_coalescing);
+        break;
+    case NVME_INTERRUPT_VECTOR_CONF:
+        if (NVME_INTVC_IV(dw11) >= n->num_queues) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        result = cpu_to_le32(
+            n->features.int_vector_config[NVME_INTVC_IV(dw11)]);
+        break;
     default:
         return NVME_INVALID_FIELD | NVME_DNR;
     }
@@ -571,12 +872,46 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         req->cqe.result =
             cpu_to_le32((n->num_queues - 1) | ((n->num_queues - 1) << 16));
         break;
+    case NVME_INTERRUPT_COALESCING:
+        n->features.int_coalescing = dw11 & 0xffff;
+        break;
+    case NVME_INTERRUPT_VECTOR_CONF:
+        if (NVME_INTVC_IV(dw11) >= n->num_queues) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        n->features.int_vector_config[NVME_INTVC_IV(dw11)] = dw11 & 0x1ffff;
+        break;
     default:
         return NVME_INVALID_FIELD | NVME_DNR;
     }
     return NVME_SUCCESS;
 }
 
+static uint16_t nvme_dbbuf_config(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    uint64_t dbs_addr = le64_to_cpu(cmd->prp1);
+    uint64_t eis_addr = le64_to_cpu(cmd->prp2);
+    int i;
+
+    if (!dbs_addr || !eis_addr ||
+        (dbs_addr | eis_addr) & (n->page_size - 1)) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    /* the admin queue keeps using its doorbells */
+    n->dbbuf_dbs = dbs_addr;
+    n->dbbuf_eis = eis_addr;
+    for (i = 1; i < n->num_queues; i++) {
+        if (n->sq[i]) {
+            nvme_init_sq_dbbuf(n->sq[i]);
+        }
+        if (n->cq[i]) {
+            nvme_init_cq_dbbuf(n->cq[i]);
+        }
+    }
+    return NVME_SUCCESS;
+}
+
 static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     switch (cmd->opcode) {
@@ -594,6 +929,8 @@ static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         return nvme_set_feature(n, cmd, req);
     case NVME_ADM_CMD_GET_FEATURES:
         return nvme_get_feature(n, cmd, req);
+    case NVME_ADM_CMD_DBBUF_CONFIG:
+        return nvme_dbbuf_config(n, cmd);
     default:
         return NVME_INVALID_OPCODE | NVME_DNR;
     }
@@ -610,24 +947,48 @@ static void nvme_process_sq(void *opaque)
     NvmeCmd cmd;
     NvmeRequest *req;
 
-    while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
-        addr = sq->dma_addr + sq->head * n->sqe_size;
-        pci_dma_read(&n->parent_obj, addr, (void *)&cmd, sizeof(cmd));
-        nvme_inc_sq_head(sq);
-
-        req = QTAILQ_FIRST(&sq->req_list);
-        QTAILQ_REMOVE(&sq->req_list, req, entry);
-        QTAILQ_INSERT_TAIL(&sq->out_req_list, req, entry);
-        memset(&req->cqe, 0, sizeof(req->cqe));
-        req->cqe.cid = cmd.cid;
-
-        status = sq->sqid ? nvme_io_cmd(n, &cmd, req) :
-            nvme_admin_cmd(n, &cmd, req);
-        if (status != NVME_NO_COMPLETE) {
-            req->status = status;
-            nvme_enqueue_req_completion(cq, req);
+    /* admin commands create and delete the I/O queues */
+    if (!sq->sqid) {
+        nvme_lock(n);
+    }
+    if (sq->db_addr) {
+        nvme_update_sq_tail(sq);
+    }
+
+    for (;;) {
+        while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
+            addr = sq->dma_addr + sq->head * n->sqe_size;
+            pci_dma_read(&n->parent_obj, addr, (void *)&cmd, sizeof(cmd));
+            nvme_inc_sq_head(sq);
+
+            req = QTAILQ_FIRST(&sq->req_list);
+            QTAILQ_REMOVE(&sq->req_list, req, entry);
+            QTAILQ_INSERT_TAIL(&sq->out_req_list, req, entry);
+            memset(&req->cqe, 0, sizeof(req->cqe));
+            req->cqe.cid = cmd.cid;
+
+            status = sq->sqid ? nvme_io_cmd(n, &cmd, req) :
+                nvme_admin_cmd(n, &cmd, req);
+            if (status != NVME_NO_COMPLETE) {
+                req->status = status;
+                nvme_enqueue_req_completion(cq, req);
+            }
+        }
+        if (!sq->db_addr) {
+            break;
+        }
+        /* ask for the doorbell, then look for entries that came in before
+         * the host could see the event index */
+        nvme_update_sq_eventidx(sq);
+        nvme_update_sq_tail(sq);
+        if (nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list)) {
+            break;
         }
     }
+
+    if (!sq->sqid) {
+        nvme_unlock(n);
+    }
 }
 
 static void nvme_clear_ctrl(NvmeCtrl *n)
@@ -647,6 +1008,11 @@ static void nvme_clear_ctrl(NvmeCtrl *n)
 
     blk_flush(n->conf.blk);
     n->bar.cc = 0;
+    n->dbbuf_dbs = n->dbbuf_eis = 0;
+    n->features.int_coalescing = 0;
+    for (i = 0; i < n->num_queues; i++) {
+        n->features.int_vector_config[i] = i;
+    }
 }
 
 static int nvme_start_ctrl(NvmeCtrl *n)
@@ -761,7 +1127,6 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
 
     if (((addr - 0x1000) >> 2) & 1) {
         uint16_t new_head = val & 0xffff;
-        int start_sqs;
         NvmeCQueue *cq;
 
         qid = (addr - (0x1000 + (1 << 2))) >> 3;
@@ -774,19 +1139,7 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
             return;
         }
 
-        start_sqs = nvme_cq_full(cq) ? 1 : 0;
-        cq->head = new_head;
-        if (start_sqs) {
-            NvmeSQueue *sq;
-            QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
-                timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
-            }
-            timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
-        }
-
-        if (cq->tail != cq->head) {
-            nvme_isr_notify(n, cq);
-        }
+        nvme_set_cq_head(n, cq, new_head);
     } else {
         uint16_t new_tail = val & 0xffff;
         NvmeSQueue *sq;
@@ -810,11 +1163,14 @@ static void nvme_mmio_write(void *opaque, hwaddr addr, uint64_t data,
     unsigned size)
 {
     NvmeCtrl *n = (NvmeCtrl *)opaque;
+
+    nvme_lock(n);
     if (addr < sizeof(n->bar)) {
         nvme_write_bar(n, addr, data, size);
     } else if (addr >= 0x1000) {
         nvme_process_db(n, addr, data);
     }
+    nvme_unlock(n);
 }
 
 static const MemoryRegionOps nvme_mmio_ops = {
@@ -852,6 +1208,24 @@ static int nvme_init(PCIDevice *pci_dev)
     blkconf_blocksizes(&n->conf);
     blkconf_apply_backend_options(&n->conf);
 
+    if (n->num_queues < 2 || n->num_queues > 2048) {
+        error_report("nvme: num_queues must be between 2 and 2048");
+        return -1;
+    }
+    if (n->iothread) {
+        /* record and replay log device DMA from the main loop only */
+        if (rr_record_requested || rr_replay_requested || !rr_off()) {
+            error_report("nvme: iothread can't be used with record/replay");
+            return -1;
+        }
+        n->ctx = iothread_get_aio_context(n->iothread);
+        aio_context_acquire(n->ctx);
+        blk_set_aio_context(n->conf.blk, n->ctx);
+        aio_context_release(n->ctx);
+    } else {
+        n->ctx = qemu_get_aio_context();
+    }
+
     pci_conf = pci_dev->config;
     pci_conf[PCI_INTERRUPT_PIN] = 1;
     pci_config_set_prog_interface(pci_dev->config, 0x2);
@@ -859,13 +1233,16 @@ static int nvme_init(PCIDevice *pci_dev)
     pcie_endpoint_cap_init(&n->parent_obj, 0x80);
 
     n->num_namespaces = 1;
-    n->num_queues = 64;
     n->reg_size = pow2ceil(0x1004 + 2 * (n->num_queues + 1) * 4);
     n->ns_size = bs_size / (uint64_t)n->num_namespaces;
 
     n->namespaces = g_new0(NvmeNamespace, n->num_namespaces);
     n->sq = g_new0(NvmeSQueue *, n->num_queues);
     n->cq = g_new0(NvmeCQueue *, n->num_queues);
+    n->features.int_vector_config = g_new(uint32_t, n->num_queues);
+    for (i = 0; i < n->num_queues; i++) {
+        n->features.int_vector_config[i] = i;
+    }
 
     memory_region_init_io(&n->iomem, OBJECT(n), &nvme_mmio_ops, n,
                           "nvme", n->reg_size);
@@ -883,7 +1260,7 @@ static int nvme_init(PCIDevice *pci_dev)
     id->ieee[0] = 0x00;
     id->ieee[1] = 0x02;
     id->ieee[2] = 0xb3;
-    id->oacs = cpu_to_le16(0);
+    id->oacs = cpu_to_le16(NVME_OACS_DBBUF);
     id->frmw = 7 << 1;
     id->lpa = 1 << 0;
     id->sqes = (0x6 << 4) | 0x6;
@@ -928,16 +1305,24 @@ static void nvme_exit(PCIDevice *pci_dev)
 {
     NvmeCtrl *n = NVME(pci_dev);
 
+    nvme_lock(n);
     nvme_clear_ctrl(n);
+    if (n->iothread) {
+        blk_set_aio_context(n->conf.blk, qemu_get_aio_context());
+    }
+    nvme_unlock(n);
     g_free(n->namespaces);
     g_free(n->cq);
     g_free(n->sq);
+    g_free(n->features.int_vector_config);
     msix_uninit_exclusive_bar(pci_dev);
 }
 
 static Property nvme_props[] = {
     DEFINE_BLOCK_PROPERTIES(NvmeCtrl, conf),
     DEFINE_PROP_STRING("serial", NvmeCtrl, serial),
+    DEFINE_PROP_UINT32("num_queues", NvmeCtrl, num_queues, 64),
+    DEFINE_PROP_BOOL("ioeventfd", NvmeCtrl, ioeventfd, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -969,6 +1354,10 @@ static void nvme_instance_init(Object *obj)
 {
     NvmeCtrl *s = NVME(obj);
 
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&s->iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, NULL);
     device_add_bootindex_property(obj, &s->conf.bootindex,
                                   "bootindex", "/namespace@1,0",
                                   DEVICE(obj), &error_abort);
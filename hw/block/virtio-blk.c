@@ -28,6 +28,12 @@
 #endif
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
+#include "panda/rr/rr_log_all.h"
+
+#define VIRTIO_BLK_QUEUE_SIZE 128
+
+/* Drive numbers of HD transfers, see rr_hd_addr() */
+static unsigned virtio_blk_rr_drives;
 
 static void virtio_blk_init_request(VirtIOBlock *s, VirtQueue *vq,
                                     VirtIOBlockReq *req)
@@ -86,6 +92,38 @@ static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
     return action != BLOCK_ERROR_ACTION_IGNORE;
 }
 
+/* Log the transfer of len bytes between the drive from sector_num on and
+ * guest RAM: the pieces of sg, which are at the guest physical addresses in
+ * addr, except that the first one starts skip bytes in.
+ */
+static void virtio_blk_record_transfer(VirtIOBlockReq *req,
+                                       Hd_transfer_type type,
+                                       const hwaddr *addr,
+                                       const struct iovec *sg, unsigned num,
+                                       hwaddr skip, size_t len)
+{
+    uint64_t hd_addr = rr_hd_addr(req->dev->rr_drive,
+                                  req->sector_num << BDRV_SECTOR_BITS);
+    unsigned k;
+
+    for (k = 0; k < num && len > 0; k++) {
+        size_t piece = MIN(sg[k].iov_len, len);
+
+        if (type == HD_TRANSFER_HD_TO_RAM) {
+            rr_record_hd_transfer(
+                (RR_callsite_id)rr_skipped_callsite_location, type,
+                hd_addr, addr[k] + skip, piece);
+        } else {
+            rr_record_hd_transfer(
+                (RR_callsite_id)rr_skipped_callsite_location, type,
+                addr[k] + skip, hd_addr, piece);
+        }
+        hd_addr += piece;
+        len -= piece;
+        skip = 0;
+    }
+}
+
 static void virtio_blk_rw_complete(void *opaque, int ret)
 {
     VirtIOBlockReq *next = opaque;
@@ -119,6 +157,17 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
         }
 
         virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
+        /* after virtqueue_push() has logged what the read put in RAM.
+         * iov_discard_back() only shortened the end of in_sg. */
+        if (ret == 0 && rr_record_hd_transfer_now() &&
+            !(virtio_ldl_p(VIRTIO_DEVICE(req->dev), &req->out.type) &
+              VIRTIO_BLK_T_OUT)) {
+            virtio_blk_record_transfer(req, HD_TRANSFER_HD_TO_RAM,
+                                       req->elem.in_addr, req->elem.in_sg,
+                                       req->elem.in_num, 0,
+                                       req->in_len -
+                                       sizeof(struct virtio_blk_inhdr));
+        }
         block_acct_done(blk_get_stats(req->dev->blk), &req->acct);
         virtio_blk_free_request(req);
     }
@@ -189,16 +238,6 @@ out:
 
 #endif
 
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s, VirtQueue *vq)
-{
-    VirtIOBlockReq *req = virtqueue_pop(vq, sizeof(VirtIOBlockReq));
-
-    if (req) {
-        virtio_blk_init_request(s, vq, req);
-    }
-    return req;
-}
-
 static int virtio_blk_handle_scsi_req(VirtIOBlockReq *req)
 {
     int status = VIRTIO_BLK_S_OK;
@@ -538,6 +577,23 @@ static int virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
                          &req->acct, req->qiov.size,
                          is_write ? BLOCK_ACCT_WRITE : BLOCK_ACCT_READ);
 
+        /* The guest may not touch what is written until the request
+         * completes, so the RAM it comes from is logged now, while it is
+         * still known what iov_discard_front() did: the entries of out_sg
+         * before iov held only the header, and iov[0] starts the rest of
+         * it into its entry. */
+        if (is_write && rr_record_hd_transfer_now()) {
+            hwaddr skip = sizeof(req->out);
+            unsigned k;
+
+            for (k = 0; &req->elem.out_sg[k] < iov; k++) {
+                skip -= req->elem.out_sg[k].iov_len;
+            }
+            virtio_blk_record_transfer(req, HD_TRANSFER_RAM_TO_HD,
+                                       &req->elem.out_addr[k], iov, out_num,
+                                       skip, req->qiov.size);
+        }
+
         /* merge would exceed maximum number of requests or IO direction
          * changes */
         if (mrb->num_reqs > 0 && (mrb->num_reqs == VIRTIO_BLK_MAX_MERGE_REQS ||
@@ -581,17 +637,31 @@ static int virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
     return 0;
 }
 
+/* Requests taken off the avail ring at once */
+#define VIRTIO_BLK_POP_BATCH 32
+
 void virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
 {
-    VirtIOBlockReq *req;
+    VirtIOBlockReq *reqs[VIRTIO_BLK_POP_BATCH];
     MultiReqBuffer mrb = {};
+    unsigned int i, n;
 
     blk_io_plug(s->blk);
 
-    while ((req = virtio_blk_get_request(s, vq))) {
-        if (virtio_blk_handle_request(req, &mrb)) {
-            virtqueue_detach_element(req->vq, &req->elem, 0);
-            virtio_blk_free_request(req);
+    while ((n = virtqueue_pop_batch(vq, sizeof(VirtIOBlockReq),
+                                    (void **)reqs, ARRAY_SIZE(reqs)))) {
+        for (i = 0; i < n; i++) {
+            virtio_blk_init_request(s, vq, reqs[i]);
+            if (virtio_blk_handle_request(reqs[i], &mrb)) {
+                break;
+            }
+        }
+        if (i < n) {
+            /* The device is broken now, drop the rest of the batch */
+            for (; i < n; i++) {
+                virtqueue_detach_element(vq, &reqs[i]->elem, 0);
+                virtio_blk_free_request(reqs[i]);
+            }
             break;
         }
     }
@@ -900,6 +970,7 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
 
     blkconf_serial(&conf->conf, &conf->serial);
     blkconf_apply_backend_options(&conf->conf);
+    s->rr_drive = RR_HD_DRIVE_VIRTIO + virtio_blk_rr_drives++;
     s->original_wce = blk_enable_write_cache(conf->conf.blk);
     blkconf_geometry(&conf->conf, NULL, 65535, 255, 255, &err);
     if (err) {
@@ -916,7 +987,7 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     s->sector_mask = (s->conf.conf.logical_block_size / BDRV_SECTOR_SIZE) - 1;
 
     for (i = 0; i < conf->num_queues; i++) {
-        virtio_add_queue(vdev, 128, virtio_blk_handle_output);
+        virtio_add_queue(vdev, VIRTIO_BLK_QUEUE_SIZE, virtio_blk_handle_output);
     }
     virtio_blk_data_plane_create(vdev, conf, &s->dataplane, &err);
     if (err != NULL) {
@@ -930,6 +1001,10 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     blk_set_guest_block_size(s->blk, s->conf.conf.logical_block_size);
 
     blk_iostatus_enable(s->blk);
+
+    /* Every request can be a coroutine, but not every descriptor a request */
+    qemu_coroutine_increase_pool_batch_size(conf->num_queues *
+                                            VIRTIO_BLK_QUEUE_SIZE / 2);
 }
 
 static void virtio_blk_device_unrealize(DeviceState *dev, Error **errp)
@@ -937,6 +1012,8 @@ static void virtio_blk_device_unrealize(DeviceState *dev, Error **errp)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOBlock *s = VIRTIO_BLK(dev);
 
+    qemu_coroutine_decrease_pool_batch_size(s->conf.num_queues *
+                                            VIRTIO_BLK_QUEUE_SIZE / 2);
     virtio_blk_data_plane_destroy(s->dataplane);
     s->dataplane = NULL;
     qemu_del_vm_change_state_handler(s->change);
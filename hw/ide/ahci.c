@@ -147,16 +147,31 @@ static void ahci_irq_lower(AHCIState *s, AHCIDevice *dev)
     }
 }
 
+/* Command completions that are reported through CCC instead of the port */
+#define AHCI_CCC_COMPLETION_IRQS (PORT_IRQ_D2H_REG_FIS | PORT_IRQ_SDB_FIS)
+
+static bool ahci_ccc_port(AHCIState *s, int port)
+{
+    return (s->control_regs.ccc_ctl & HOST_CCC_CTL_EN) &&
+           (s->control_regs.ccc_ports & (1U << port));
+}
+
 static void ahci_check_irq(AHCIState *s)
 {
     int i;
 
     DPRINTF(-1, "check irq %#x\n", s->control_regs.irqstatus);
 
-    s->control_regs.irqstatus = 0;
+    /* The CCC interrupt uses the IS bit after the last port */
+    s->control_regs.irqstatus = s->ccc_irq ? (1U << s->ports) : 0;
     for (i = 0; i < s->ports; i++) {
         AHCIPortRegs *pr = &s->dev[i].port_regs;
-        if (pr->irq_stat & pr->irq_mask) {
+        uint32_t irq_stat = pr->irq_stat & pr->irq_mask;
+
+        if (ahci_ccc_port(s, i)) {
+            irq_stat &= ~AHCI_CCC_COMPLETION_IRQS;
+        }
+        if (irq_stat) {
             s->control_regs.irqstatus |= (1 << i);
         }
     }
@@ -179,6 +194,64 @@ static void ahci_trigger_irq(AHCIState *s, AHCIDevice *d,
     ahci_check_irq(s);
 }
 
+static void ahci_ccc_raise(AHCIState *s)
+{
+    s->ccc_count = 0;
+    s->ccc_irq = true;
+    timer_del(s->ccc_timer);
+    ahci_check_irq(s);
+}
+
+static void ahci_ccc_timer_cb(void *opaque)
+{
+    AHCIState *s = opaque;
+
+    if (s->ccc_count) {
+        ahci_ccc_raise(s);
+    }
+}
+
+/*
+ * Account for n commands completed on a port.  With coalescing enabled for
+ * the port, the guest only gets an interrupt once CC commands have completed
+ * or TV milliseconds after the first completion it has not been told about,
+ * so a queue of NCQ commands costs one interrupt rather than one per tag.
+ */
+static void ahci_ccc_complete(AHCIDevice *ad, int n)
+{
+    AHCIState *s = ad->hba;
+    uint32_t cc = (s->control_regs.ccc_ctl >> HOST_CCC_CTL_CC_SHIFT) & 0xff;
+    uint32_t tv = s->control_regs.ccc_ctl >> HOST_CCC_CTL_TV_SHIFT;
+
+    if (!n || !ahci_ccc_port(s, ad->port_no)) {
+        return;
+    }
+
+    s->ccc_count += n;
+    if ((cc && s->ccc_count >= cc) || !tv) {
+        ahci_ccc_raise(s);
+    } else if (!timer_pending(s->ccc_timer)) {
+        timer_mod(s->ccc_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) + tv);
+    }
+}
+
+static void ahci_ccc_reset(AHCIState *s)
+{
+    /* reset values from the spec: one completion or 1 ms, disabled */
+    s->control_regs.ccc_ctl = (1 << HOST_CCC_CTL_TV_SHIFT) |
+                              (1 << HOST_CCC_CTL_CC_SHIFT);
+    if (s->control_regs.cap & HOST_CAP_CCCS) {
+        s->control_regs.ccc_ctl |= s->ports << HOST_CCC_CTL_INT_SHIFT;
+    }
+    s->control_regs.ccc_ports = 0;
+    s->ccc_count = 0;
+    s->ccc_irq = false;
+    if (s->ccc_timer) {
+        timer_del(s->ccc_timer);
+    }
+}
+
 static void map_page(AddressSpace *as, uint8_t **ptr, uint64_t addr,
                      uint32_t wanted)
 {
@@ -340,6 +413,12 @@ static uint64_t ahci_mem_read_32(void *opaque, hwaddr addr)
         case HOST_VERSION:
             val = s->control_regs.version;
             break;
+        case HOST_CCC_CTL:
+            val = s->control_regs.ccc_ctl;
+            break;
+        case HOST_CCC_PORTS:
+            val = s->control_regs.ccc_ports;
+            break;
         }
 
         DPRINTF(-1, "(addr 0x%08X), val 0x%08X\n", (unsigned) addr, val);
@@ -418,6 +497,9 @@ static void ahci_mem_write(void *opaque, hwaddr addr,
                 break;
             case HOST_IRQ_STAT: /* R/WC, RO */
                 s->control_regs.irqstatus &= ~val;
+                if (s->ccc_irq && (val & (1U << s->ports))) {
+                    s->ccc_irq = false;
+                }
                 ahci_check_irq(s);
                 break;
             case HOST_PORTS_IMPL: /* R/WO, RO */
@@ -426,6 +508,25 @@ static void ahci_mem_write(void *opaque, hwaddr addr,
             case HOST_VERSION: /* RO */
                 /* FIXME report write? */
                 break;
+            case HOST_CCC_CTL: /* R/W, INT is RO */
+                if (!(s->control_regs.cap & HOST_CAP_CCCS)) {
+                    break;
+                }
+                s->control_regs.ccc_ctl =
+                    (s->control_regs.ccc_ctl & HOST_CCC_CTL_INT_MASK) |
+                    (val & ~HOST_CCC_CTL_INT_MASK);
+                if (!(val & HOST_CCC_CTL_EN)) {
+                    s->ccc_count = 0;
+                    timer_del(s->ccc_timer);
+                }
+                ahci_check_irq(s);
+                break;
+            case HOST_CCC_PORTS: /* R/W */
+                if (s->control_regs.cap & HOST_CAP_CCCS) {
+                    s->control_regs.ccc_ports = val & s->control_regs.impl;
+                    ahci_check_irq(s);
+                }
+                break;
             default:
                 DPRINTF(-1, "write to unknown register 0x%x\n", (unsigned)addr);
         }
@@ -489,6 +590,10 @@ static void ahci_reg_init(AHCIState *s)
                           (AHCI_NUM_COMMAND_SLOTS << 8) |
                           (AHCI_SUPPORTED_SPEED_GEN1 << AHCI_SUPPORTED_SPEED) |
                           HOST_CAP_NCQ | HOST_CAP_AHCI;
+    /* CCC needs an IS bit that no port uses */
+    if (s->ports < 32) {
+        s->control_regs.cap |= HOST_CAP_CCCS;
+    }
 
     s->control_regs.impl = (1 << s->ports) - 1;
 
@@ -719,12 +824,13 @@ static void ahci_write_fis_sdb(AHCIState *s, NCQTransferState *ncq_tfs)
         (ad->port.ifs[0].status & 0x77) |
         (pr->tfdata & 0x88);
     pr->scr_act &= ~ad->finished;
-    ad->finished = 0;
 
     /* Trigger IRQ if interrupt bit is set (which currently, it always is) */
     if (sdb_fis->flags & 0x40) {
         ahci_trigger_irq(s, ad, PORT_IRQ_SDB_FIS);
     }
+    ahci_ccc_complete(ad, ctpop32(ad->finished));
+    ad->finished = 0;
 }
 
 static void ahci_write_fis_pio(AHCIDevice *ad, uint16_t len)
@@ -1424,7 +1530,9 @@ static void ahci_cmd_done(IDEDMA *dma)
     DPRINTF(ad->port_no, "cmd done\n");
 
     /* update d2h status */
-    ahci_write_fis_d2h(ad);
+    if (ahci_write_fis_d2h(ad)) {
+        ahci_ccc_complete(ad, 1);
+    }
 
     if (!ad->check_bh) {
         /* maybe we still have something to process, check later */
@@ -1466,6 +1574,7 @@ void ahci_realize(AHCIState *s, DeviceState *qdev, AddressSpace *as, int ports)
     s->as = as;
     s->ports = ports;
     s->dev = g_new0(AHCIDevice, ports);
+    s->ccc_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL, ahci_ccc_timer_cb, s);
     ahci_reg_init(s);
     irqs = qemu_allocate_irqs(ahci_irq_set, s, s->ports);
     for (i = 0; i < s->ports; i++) {
@@ -1485,6 +1594,7 @@ void ahci_realize(AHCIState *s, DeviceState *qdev, AddressSpace *as, int ports)
 
 void ahci_uninit(AHCIState *s)
 {
+    timer_free(s->ccc_timer);
     g_free(s->dev);
 }
 
@@ -1503,6 +1613,7 @@ void ahci_reset(AHCIState *s)
      * We set HOST_CAP_AHCI so we must enable AHCI at reset.
      */
     s->control_regs.ghc = HOST_CTL_AHCI_EN;
+    ahci_ccc_reset(s);
 
     for (i = 0; i < s->ports; i++) {
         pr = &s->dev[i].port_regs;
@@ -1644,6 +1755,29 @@ static int ahci_state_post_load(void *opaque, int version_id)
     return 0;
 }
 
+static bool ahci_ccc_needed(void *opaque)
+{
+    AHCIState *s = opaque;
+
+    return (s->control_regs.ccc_ctl & HOST_CCC_CTL_EN) ||
+           s->control_regs.ccc_ports || s->ccc_irq;
+}
+
+static const VMStateDescription vmstate_ahci_ccc = {
+    .name = "ahci/ccc",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = ahci_ccc_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(control_regs.ccc_ctl, AHCIState),
+        VMSTATE_UINT32(control_regs.ccc_ports, AHCIState),
+        VMSTATE_UINT32(ccc_count, AHCIState),
+        VMSTATE_BOOL(ccc_irq, AHCIState),
+        VMSTATE_TIMER_PTR(ccc_timer, AHCIState),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 const VMStateDescription vmstate_ahci = {
     .name = "ahci",
     .version_id = 1,
@@ -1660,6 +1794,10 @@ const VMStateDescription vmstate_ahci = {
         VMSTATE_INT32_EQUAL(ports, AHCIState),
         VMSTATE_END_OF_LIST()
     },
+    .subsections = (const VMStateDescription*[]) {
+        &vmstate_ahci_ccc,
+        NULL
+    },
 };
 
 static const VMStateDescription vmstate_sysbus_ahci = {
@@ -36,6 +36,7 @@
 #include "qemu/cutils.h"
 
 #include "hw/ide/internal.h"
+#include "panda/rr/rr_log_all.h"
 
 /* These values were based on a Seagate ST3500418AS but have been modified
    to make more sense in QEMU */
@@ -810,6 +811,32 @@ int ide_handle_rw_error(IDEState *s, int error, int op)
     return action != BLOCK_ERROR_ACTION_IGNORE;
 }
 
+/* Log where in guest RAM the sectors from sector_num on that the DMA
+ * transfer in s->sg has just moved went, or came from.  The scatter list
+ * holds guest physical addresses, as there is no IOMMU in the way.
+ */
+static void ide_dma_record_hd_transfer(IDEState *s, int64_t sector_num)
+{
+    uint64_t hd_addr = rr_hd_addr(s->bus->bus_id * 2 + s->unit,
+                                  sector_num << BDRV_SECTOR_BITS);
+    int i;
+
+    for (i = 0; i < s->sg.nsg; i++) {
+        ScatterGatherEntry *e = &s->sg.sg[i];
+
+        if (s->dma_cmd == IDE_DMA_READ) {
+            rr_record_hd_transfer(
+                (RR_callsite_id)rr_skipped_callsite_location,
+                HD_TRANSFER_HD_TO_RAM, hd_addr, e->base, e->len);
+        } else {
+            rr_record_hd_transfer(
+                (RR_callsite_id)rr_skipped_callsite_location,
+                HD_TRANSFER_RAM_TO_HD, e->base, hd_addr, e->len);
+        }
+        hd_addr += e->len;
+    }
+}
+
 static void ide_dma_cb(void *opaque, int ret)
 {
     IDEState *s = opaque;
@@ -841,6 +868,10 @@ static void ide_dma_cb(void *opaque, int ret)
     sector_num = ide_get_sector(s);
     if (n > 0) {
         assert(n * 512 == s->sg.size);
+        if (ret >= 0 && rr_record_hd_transfer_now() &&
+            (s->dma_cmd == IDE_DMA_READ || s->dma_cmd == IDE_DMA_WRITE)) {
+            ide_dma_record_hd_transfer(s, sector_num);
+        }
         dma_buf_commit(s, s->sg.size);
         sector_num += n;
         ide_set_sector(s, sector_num);
@@ -16,6 +16,7 @@
 #include "hw/virtio/virtio.h"
 #include "net/net.h"
 #include "net/checksum.h"
+#include "net/eth.h"
 #include "net/tap.h"
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
@@ -25,6 +26,7 @@
 #include "qapi/qmp/qjson.h"
 #include "qapi-event.h"
 #include "hw/virtio/virtio-access.h"
+#include "panda/rr/rr_log_all.h"
 
 #define VIRTIO_NET_VM_VERSION    11
 
@@ -1015,14 +1017,20 @@ static void virtio_net_hdr_swap(VirtIODevice *vdev, struct virtio_net_hdr *hdr)
  * we should provide a mechanism to disable it to avoid polluting the host
  * cache.
  */
-static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
-                                        uint8_t *buf, size_t size)
+static bool is_broken_dhclient_packet(const struct virtio_net_hdr *hdr,
+                                      const uint8_t *buf, size_t size)
 {
-    if ((hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && /* missing csum */
+    return (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && /* missing csum */
         (size > 27 && size < 1500) && /* normal sized MTU */
         (buf[12] == 0x08 && buf[13] == 0x00) && /* ethertype == IPv4 */
         (buf[23] == 17) && /* ip.protocol == UDP */
-        (buf[34] == 0 && buf[35] == 67)) { /* udp.srcport == bootps */
+        (buf[34] == 0 && buf[35] == 67); /* udp.srcport == bootps */
+}
+
+static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
+                                        uint8_t *buf, size_t size)
+{
+    if (is_broken_dhclient_packet(hdr, buf, size)) {
         net_checksum_calculate(buf, size);
         hdr->flags &= ~VIRTIO_NET_HDR_F_NEEDS_CSUM;
     }
@@ -1101,6 +1109,66 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
+/* Backends that deliver a batch of packets get one notification at the
+ * end, from virtio_net_flush_batch */
+static void virtio_net_rx_notify(NetClientState *nc)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    if (nc->batching) {
+        q->rx_notify = true;
+        return;
+    }
+
+    virtio_notify(VIRTIO_DEVICE(n), q->rx_vq);
+}
+
+static void virtio_net_flush_batch(NetClientState *nc)
+{
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    if (q->rx_notify) {
+        q->rx_notify = false;
+        virtio_net_rx_notify(nc);
+    }
+}
+
+/* With -record-packets, log which guest RAM holds bytes [pkt_offset,
+ * pkt_offset + len) of the packet: the part of sg from sg_offset on, whose
+ * pieces are at the guest physical addresses in addr.
+ */
+static void virtio_net_record_transfer(Net_transfer_type type,
+                                       const hwaddr *addr,
+                                       const struct iovec *sg, unsigned num,
+                                       size_t sg_offset, size_t pkt_offset,
+                                       size_t len)
+{
+    unsigned k;
+
+    for (k = 0; k < num && len > 0; k++) {
+        size_t piece;
+
+        if (sg_offset >= sg[k].iov_len) {
+            sg_offset -= sg[k].iov_len;
+            continue;
+        }
+        piece = MIN(sg[k].iov_len - sg_offset, len);
+        if (type == NET_TRANSFER_IOB_TO_RAM) {
+            rr_record_net_transfer(
+                (RR_callsite_id)rr_skipped_callsite_location, type,
+                pkt_offset, addr[k] + sg_offset, piece);
+        } else {
+            rr_record_net_transfer(
+                (RR_callsite_id)rr_skipped_callsite_location, type,
+                addr[k] + sg_offset, pkt_offset, piece);
+        }
+        pkt_offset += piece;
+        len -= piece;
+        sg_offset = 0;
+    }
+}
+
 static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
@@ -1110,6 +1178,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     struct virtio_net_hdr_mrg_rxbuf mhdr;
     unsigned mhdr_cnt = 0;
     size_t offset, i, guest_offset;
+    bool record_packet;
 
     if (!virtio_net_can_receive(nc)) {
         return -1;
@@ -1123,6 +1192,14 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     if (!receive_filter(n, buf, size))
         return size;
 
+    record_packet = rr_record_packet_now();
+    if (record_packet) {
+        rr_record_handle_packet_call(
+            (RR_callsite_id)rr_skipped_callsite_location,
+            (uint8_t *)buf + n->host_hdr_len, size - n->host_hdr_len,
+            PANDA_NET_RX);
+    }
+
     offset = i = 0;
 
     while (offset < size) {
@@ -1175,6 +1252,11 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         /* copy in packet.  ugh */
         len = iov_from_buf(sg, elem->in_num, guest_offset,
                            buf + offset, size - offset);
+        if (record_packet) {
+            virtio_net_record_transfer(NET_TRANSFER_IOB_TO_RAM, elem->in_addr,
+                                       sg, elem->in_num, guest_offset,
+                                       offset - n->host_hdr_len, len);
+        }
         total += len;
         offset += len;
         /* If buffers can't be merged, at this point we
@@ -1199,11 +1281,110 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    virtio_net_rx_notify(nc);
 
     return size;
 }
 
+/* Zero-copy receive: the backend reads a packet, vnet header included,
+ * straight into a single receive buffer.  That only works if the header
+ * needs no conversion and rr is not watching guest memory.
+ */
+static int virtio_net_rx_map(NetClientState *nc, struct iovec *iov,
+                             int iovcnt)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    VirtQueueElement *elem;
+
+    assert(!q->rx_elem);
+
+    if (!rr_off() || !n->has_vnet_hdr || n->needs_vnet_hdr_swap ||
+        n->host_hdr_len != n->guest_hdr_len) {
+        return 0;
+    }
+
+    if (!virtio_net_can_receive(nc) || !virtio_net_has_buffers(q, 1)) {
+        return 0;
+    }
+
+    elem = virtqueue_pop(q->rx_vq, sizeof(VirtQueueElement));
+    if (!elem) {
+        return 0;
+    }
+
+    /* Leave anything unusual to virtio_net_receive */
+    if (elem->in_num < 1 || elem->in_num > iovcnt ||
+        iov_size(elem->in_sg, elem->in_num) < n->guest_hdr_len) {
+        virtqueue_unpop(q->rx_vq, elem, 0);
+        g_free(elem);
+        return 0;
+    }
+
+    memcpy(iov, elem->in_sg, elem->in_num * sizeof(*iov));
+    q->rx_elem = elem;
+    return elem->in_num;
+}
+
+static bool virtio_net_rx_commit(NetClientState *nc, size_t size)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtQueueElement *elem = q->rx_elem;
+    /* Enough for receive_filter and is_broken_dhclient_packet */
+    uint8_t head[sizeof(struct virtio_net_hdr_mrg_rxbuf) + 36];
+    size_t len;
+
+    /* Packets that need more than one buffer or a checksum fixup, and
+     * runts, go the slow way */
+    if (size > iov_size(elem->in_sg, elem->in_num) ||
+        size < n->host_hdr_len + ETH_HLEN) {
+        return false;
+    }
+
+    len = iov_to_buf(elem->in_sg, elem->in_num, 0, head,
+                     MIN(size, sizeof(head)));
+    if (is_broken_dhclient_packet((struct virtio_net_hdr *)head,
+                                  head + n->host_hdr_len,
+                                  size - n->host_hdr_len)) {
+        return false;
+    }
+
+    q->rx_elem = NULL;
+
+    if (!receive_filter(n, head, len)) {
+        virtqueue_unpop(q->rx_vq, elem, 0);
+        g_free(elem);
+        return true;
+    }
+
+    if (n->mergeable_rx_bufs) {
+        uint16_t num_buffers;
+
+        virtio_stw_p(vdev, &num_buffers, 1);
+        iov_from_buf(elem->in_sg, elem->in_num,
+                     offsetof(struct virtio_net_hdr_mrg_rxbuf, num_buffers),
+                     &num_buffers, sizeof(num_buffers));
+    }
+
+    virtqueue_fill(q->rx_vq, elem, size, 0);
+    g_free(elem);
+    virtqueue_flush(q->rx_vq, 1);
+    virtio_net_rx_notify(nc);
+
+    return true;
+}
+
+static void virtio_net_rx_cancel(NetClientState *nc)
+{
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    virtqueue_unpop(q->rx_vq, q->rx_elem, 0);
+    g_free(q->rx_elem);
+    q->rx_elem = NULL;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
@@ -1223,12 +1404,24 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 }
 
 /* TX */
-static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
+
+/* Complete the packets that virtio_net_flush_tx() has sent, with a single
+ * used index update and notification for all of them */
+static void virtio_net_tx_used(VirtIONetQueue *q, unsigned int count)
+{
+    if (count) {
+        virtqueue_flush(q->tx_vq, count);
+        virtio_notify(VIRTIO_DEVICE(q->n), q->tx_vq);
+    }
+}
+
+static int32_t virtio_net_do_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     VirtQueueElement *elem;
     int32_t num_packets = 0;
+    unsigned int num_used = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
@@ -1256,6 +1449,7 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
             virtio_error(vdev, "virtio-net header not in first element");
             virtqueue_detach_element(q->tx_vq, elem, 0);
             g_free(elem);
+            virtio_net_tx_used(q, num_used);
             return -EINVAL;
         }
 
@@ -1265,6 +1459,7 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
                 virtio_error(vdev, "virtio-net header incorrect");
                 virtqueue_detach_element(q->tx_vq, elem, 0);
                 g_free(elem);
+                virtio_net_tx_used(q, num_used);
                 return -EINVAL;
             }
             if (n->needs_vnet_hdr_swap) {
@@ -1298,26 +1493,60 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
             out_sg = sg;
         }
 
+        if (rr_record_packet_now() &&
+            iov_size(elem->out_sg, elem->out_num) > n->guest_hdr_len) {
+            /* the packet as the guest wrote it, after its header */
+            size_t len = iov_size(elem->out_sg, elem->out_num) -
+                         n->guest_hdr_len;
+            uint8_t *pkt = g_malloc(len);
+
+            iov_to_buf(elem->out_sg, elem->out_num, n->guest_hdr_len,
+                       pkt, len);
+            rr_record_handle_packet_call(
+                (RR_callsite_id)rr_skipped_callsite_location,
+                pkt, len, PANDA_NET_TX);
+            virtio_net_record_transfer(NET_TRANSFER_RAM_TO_IOB,
+                                       elem->out_addr, elem->out_sg,
+                                       elem->out_num, n->guest_hdr_len, 0,
+                                       len);
+            g_free(pkt);
+        }
+
         ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
                                       out_sg, out_num, virtio_net_tx_complete);
         if (ret == 0) {
             virtio_queue_set_notification(q->tx_vq, 0);
             q->async_tx.elem = elem;
+            virtio_net_tx_used(q, num_used);
             return -EBUSY;
         }
 
 drop:
-        virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
+        virtqueue_fill(q->tx_vq, elem, 0, num_used++);
         g_free(elem);
 
         if (++num_packets >= n->tx_burst) {
             break;
         }
     }
+    virtio_net_tx_used(q, num_used);
     return num_packets;
 }
 
+/* Let the backend send the packets of one flush as a batch */
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
+{
+    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    NetClientState *nc = qemu_get_subqueue(q->n->nic, queue_index);
+    int32_t ret;
+
+    qemu_net_batch_begin(nc);
+    ret = virtio_net_do_flush_tx(q);
+    qemu_net_batch_end(nc);
+
+    return ret;
+}
+
 static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -1669,6 +1898,10 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .rx_map = virtio_net_rx_map,
+    .rx_commit = virtio_net_rx_commit,
+    .rx_cancel = virtio_net_rx_cancel,
+    .flush_batch = virtio_net_flush_batch,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
 };
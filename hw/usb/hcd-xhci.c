@@ -138,6 +138,9 @@
 #define IMAN_IP         (1<<0)
 #define IMAN_IE         (1<<1)
 
+#define IMOD_IMODI_MASK     0xffff
+#define IMOD_NS_PER_UNIT    250
+
 #define ERDP_EHB        (1<<3)
 
 #define TRB_SIZE 16
@@ -422,6 +425,9 @@ typedef struct XHCIEvent {
 } XHCIEvent;
 
 typedef struct XHCIInterrupter {
+    XHCIState *xhci;
+    int v;
+
     uint32_t iman;
     uint32_t imod;
     uint32_t erstsz;
@@ -440,6 +446,9 @@ typedef struct XHCIInterrupter {
     unsigned int ev_buffer_put;
     unsigned int ev_buffer_get;
 
+    /* interrupt moderation: no interrupt before imod_deadline */
+    QEMUTimer *imod_timer;
+    int64_t imod_deadline;
 } XHCIInterrupter;
 
 struct XHCIState {
@@ -785,20 +794,15 @@ static void xhci_msix_update(XHCIState *xhci, int v)
     }
 }
 
-static void xhci_intr_raise(XHCIState *xhci, int v)
+static void xhci_intr_notify(XHCIState *xhci, int v)
 {
     PCIDevice *pci_dev = PCI_DEVICE(xhci);
+    XHCIInterrupter *intr = &xhci->intr[v];
+    uint32_t imodi = intr->imod & IMOD_IMODI_MASK;
 
-    xhci->intr[v].erdp_low |= ERDP_EHB;
-    xhci->intr[v].iman |= IMAN_IP;
-    xhci->usbsts |= USBSTS_EINT;
-
-    if (!(xhci->intr[v].iman & IMAN_IE)) {
-        return;
-    }
-
-    if (!(xhci->usbcmd & USBCMD_INTE)) {
-        return;
+    if (imodi) {
+        intr->imod_deadline = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                              (int64_t)imodi * IMOD_NS_PER_UNIT;
     }
 
     if (msix_enabled(pci_dev)) {
@@ -819,6 +823,56 @@ static void xhci_intr_raise(XHCIState *xhci, int v)
     }
 }
 
+/*
+ * Events written while the Event Handler Busy bit is set are covered by the
+ * interrupt that set it, so a burst of completions costs one interrupt.
+ * On top of that the interrupt is held off until the interval programmed
+ * into IMOD has passed since the previous one (xHCI 4.17.2).
+ */
+static void xhci_intr_raise(XHCIState *xhci, int v)
+{
+    XHCIInterrupter *intr = &xhci->intr[v];
+    bool pending = intr->erdp_low & ERDP_EHB;
+    int64_t now;
+
+    intr->erdp_low |= ERDP_EHB;
+    intr->iman |= IMAN_IP;
+    xhci->usbsts |= USBSTS_EINT;
+
+    if (pending) {
+        return;
+    }
+
+    if (!(intr->iman & IMAN_IE)) {
+        return;
+    }
+
+    if (!(xhci->usbcmd & USBCMD_INTE)) {
+        return;
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    if ((intr->imod & IMOD_IMODI_MASK) && now < intr->imod_deadline) {
+        timer_mod(intr->imod_timer, intr->imod_deadline);
+        return;
+    }
+
+    xhci_intr_notify(xhci, v);
+}
+
+static void xhci_imod_timer(void *opaque)
+{
+    XHCIInterrupter *intr = opaque;
+    XHCIState *xhci = intr->xhci;
+
+    /* the guest may have picked up the events by polling meanwhile */
+    if (!(intr->iman & IMAN_IP) || !(intr->iman & IMAN_IE) ||
+        !(xhci->usbcmd & USBCMD_INTE)) {
+        return;
+    }
+    xhci_intr_notify(xhci, intr->v);
+}
+
 static inline int xhci_running(XHCIState *xhci)
 {
     return !(xhci->usbsts & USBSTS_HCH) && !xhci->intr[0].er_full;
@@ -2976,6 +3030,8 @@ static void xhci_reset(DeviceState *dev)
         xhci->intr[i].er_full = 0;
         xhci->intr[i].ev_buffer_put = 0;
         xhci->intr[i].ev_buffer_get = 0;
+        xhci->intr[i].imod_deadline = 0;
+        timer_del(xhci->intr[i].imod_timer);
     }
 
     xhci->mfindex_start = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
@@ -3333,6 +3389,12 @@ static void xhci_runtime_write(void *ptr, hwaddr reg,
         break;
     case 0x04: /* IMOD */
         intr->imod = val;
+        /* the counter restarts from the new interval */
+        if (timer_pending(intr->imod_timer)) {
+            intr->imod_deadline = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                (int64_t)(val & IMOD_IMODI_MASK) * IMOD_NS_PER_UNIT;
+            timer_mod(intr->imod_timer, intr->imod_deadline);
+        }
         break;
     case 0x08: /* ERSTSZ */
         intr->erstsz = val & 0xffff;
@@ -3668,6 +3730,13 @@ static void usb_xhci_realize(struct PCIDevice *dev, Error **errp)
     }
 
     xhci->mfwrap_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, xhci_mfwrap_timer, xhci);
+    for (i = 0; i < xhci->numintrs; i++) {
+        xhci->intr[i].xhci = xhci;
+        xhci->intr[i].v = i;
+        xhci->intr[i].imod_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                                xhci_imod_timer,
+                                                &xhci->intr[i]);
+    }
 
     memory_region_init(&xhci->mem, OBJECT(xhci), "xhci", LEN_REGS);
     memory_region_init_io(&xhci->mem_cap, OBJECT(xhci), &xhci_cap_ops, xhci,
@@ -3729,6 +3798,14 @@ static void usb_xhci_exit(PCIDevice *dev)
         xhci->mfwrap_timer = NULL;
     }
 
+    for (i = 0; i < xhci->numintrs; i++) {
+        if (xhci->intr[i].imod_timer) {
+            timer_del(xhci->intr[i].imod_timer);
+            timer_free(xhci->intr[i].imod_timer);
+            xhci->intr[i].imod_timer = NULL;
+        }
+    }
+
     memory_region_del_subregion(&xhci->mem, &xhci->mem_cap);
     memory_region_del_subregion(&xhci->mem, &xhci->mem_oper);
     memory_region_del_subregion(&xhci->mem, &xhci->mem_runtime);
@@ -3802,6 +3879,11 @@ static int usb_xhci_post_load(void *opaque, int version_id)
         } else {
             msix_vector_unuse(pci_dev, intr);
         }
+        /* a moderated interrupt may have been pending; resend it */
+        if (xhci->intr[intr].iman & IMAN_IP) {
+            timer_mod(xhci->intr[intr].imod_timer,
+                      qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+        }
     }
 
     return 0;
@@ -32,6 +32,8 @@
 #include "hw/hw.h"
 #include "qemu/error-report.h"
 #include "qemu/range.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
 #include "sysemu/kvm.h"
 #include "trace.h"
 #include "qapi/error.h"
@@ -243,6 +245,67 @@ static int vfio_dma_map(VFIOContainer *container, hwaddr iova,
     return -errno;
 }
 
+/*
+ * VFIO_IOMMU_MAP_DMA pins the whole range from a single thread, so for
+ * large guests most of it is spent faulting in and zeroing memory that
+ * the guest never touched.  Fault big anonymous regions in from several
+ * threads first; the kernel then only has to pin present pages.
+ */
+#define VFIO_PREFAULT_MIN           (1ULL << 30)
+#define VFIO_PREFAULT_THREADS_MAX   16
+
+typedef struct VFIOPrefaultJob {
+    QemuThread thread;
+    uint8_t *start;
+    size_t size;
+    size_t pagesize;
+} VFIOPrefaultJob;
+
+static void *vfio_prefault_thread(void *opaque)
+{
+    VFIOPrefaultJob *job = opaque;
+    size_t off;
+
+    for (off = 0; off < job->size; off += job->pagesize) {
+        /* a write fault that can't lose a concurrent guest write */
+        atomic_fetch_add(job->start + off, 0);
+    }
+    return NULL;
+}
+
+static void vfio_prefault(MemoryRegion *mr, void *vaddr, ram_addr_t size)
+{
+    VFIOPrefaultJob *jobs;
+    size_t pagesize = getpagesize();
+    size_t chunk;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i, nthreads;
+
+    /* file backed memory could SIGBUS here; leave it to the kernel */
+    if (size < VFIO_PREFAULT_MIN || memory_region_get_fd(mr) >= 0) {
+        return;
+    }
+
+    nthreads = MIN(MAX(ncpus, 1), VFIO_PREFAULT_THREADS_MAX);
+    nthreads = MIN(nthreads, size / VFIO_PREFAULT_MIN);
+    chunk = QEMU_ALIGN_UP(DIV_ROUND_UP(size, nthreads), pagesize);
+    trace_vfio_prefault(vaddr, size, nthreads);
+
+    jobs = g_new0(VFIOPrefaultJob, nthreads);
+    for (i = 0; i < nthreads; i++) {
+        jobs[i].start = (uint8_t *)vaddr + i * chunk;
+        jobs[i].size = MIN(chunk, size - MIN(size, i * chunk));
+        jobs[i].pagesize = pagesize;
+        qemu_thread_create(&jobs[i].thread, "vfio-prefault",
+                           vfio_prefault_thread, &jobs[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < nthreads; i++) {
+        qemu_thread_join(&jobs[i].thread);
+    }
+    g_free(jobs);
+}
+
 static void vfio_host_win_add(VFIOContainer *container,
                               hwaddr min_iova, hwaddr max_iova,
                               uint64_t iova_pgsizes)
@@ -473,6 +536,10 @@ static void vfio_listener_region_add(MemoryListener *listener,
 
     llsize = int128_sub(llend, int128_make64(iova));
 
+    if (!section->readonly) {
+        vfio_prefault(section->mr, vaddr, int128_get64(llsize));
+    }
+
     ret = vfio_dma_map(container, iova, int128_get64(llsize),
                        vaddr, section->readonly);
     if (ret) {
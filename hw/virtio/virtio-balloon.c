@@ -25,6 +25,8 @@
 #include "exec/address-spaces.h"
 #include "qapi/visitor.h"
 #include "qapi-event.h"
+#include "migration/migration.h"
+#include "panda/rr/rr_log_all.h"
 #include "trace.h"
 
 #include "hw/virtio/virtio-bus.h"
@@ -32,12 +34,50 @@
 
 #define BALLOON_PAGE_SIZE  (1 << VIRTIO_BALLOON_PFN_SHIFT)
 
-static void balloon_page(void *addr, int deflate)
+static bool balloon_can_discard(void)
 {
-    if (!qemu_balloon_is_inhibited() && (!kvm_enabled() ||
-                                         kvm_has_sync_mmu())) {
-        qemu_madvise(addr, BALLOON_PAGE_SIZE,
+    /* a recording doesn't log the guest RAM that a discard zeroes */
+    return !qemu_balloon_is_inhibited() && rr_off() &&
+        (!kvm_enabled() || kvm_has_sync_mmu());
+}
+
+static void balloon_range(void *addr, size_t len, int deflate)
+{
+    if (balloon_can_discard()) {
+        qemu_madvise(addr, len,
                 deflate ? QEMU_MADV_WILLNEED : QEMU_MADV_DONTNEED);
+        if (!deflate) {
+            qemu_guest_free_page_hint(addr, len);
+        }
+    }
+}
+
+/* Pages of an inflate or deflate request that are contiguous in host
+ * memory, so that a single madvise() covers them.
+ */
+typedef struct BalloonRun {
+    void *start;
+    size_t len;
+} BalloonRun;
+
+static void balloon_run_add(BalloonRun *run, void *addr, int deflate)
+{
+    if (run->len && addr == run->start + run->len) {
+        run->len += BALLOON_PAGE_SIZE;
+        return;
+    }
+    if (run->len) {
+        balloon_range(run->start, run->len, deflate);
+    }
+    run->start = addr;
+    run->len = BALLOON_PAGE_SIZE;
+}
+
+static void balloon_run_flush(BalloonRun *run, int deflate)
+{
+    if (run->len) {
+        balloon_range(run->start, run->len, deflate);
+        run->len = 0;
     }
 }
 
@@ -213,6 +253,8 @@ static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
     for (;;) {
         size_t offset = 0;
         uint32_t pfn;
+        BalloonRun run = { NULL, 0 };
+
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
         if (!elem) {
             return;
@@ -236,10 +278,11 @@ static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
             /* Using memory_region_get_ram_ptr is bending the rules a bit, but
                should be OK because we only want a single page.  */
             addr = section.offset_within_region;
-            balloon_page(memory_region_get_ram_ptr(section.mr) + addr,
-                         !!(vq == s->dvq));
+            balloon_run_add(&run, memory_region_get_ram_ptr(section.mr) + addr,
+                            !!(vq == s->dvq));
             memory_region_unref(section.mr);
         }
+        balloon_run_flush(&run, !!(vq == s->dvq));
 
         virtqueue_push(vq, elem, offset);
         virtio_notify(vdev, vq);
@@ -247,6 +290,63 @@ static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
     }
 }
 
+/* Give a reported free range back to the host.  MADV_FREE lets the kernel
+ * reclaim it lazily, and costs nothing if the guest reuses the range first;
+ * RAM it doesn't apply to, such as shared memory, is dropped as for an
+ * inflate request instead.
+ */
+static void balloon_discard_range(void *addr, size_t size)
+{
+    if (qemu_madvise(addr, size, QEMU_MADV_FREE) < 0) {
+        qemu_madvise(addr, size, QEMU_MADV_DONTNEED);
+    }
+    qemu_guest_free_page_hint(addr, size);
+}
+
+/* With free page reporting, the guest hands large ranges of its free memory
+ * to the device, one buffer per range, and takes them back once they are
+ * returned; a reported range's contents are undefined when the guest reuses
+ * it.
+ */
+static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtQueueElement *elem;
+
+    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
+        unsigned int i;
+
+        if (!balloon_can_discard()) {
+            goto skip_element;
+        }
+
+        for (i = 0; i < elem->in_num; i++) {
+            void *addr = elem->in_sg[i].iov_base;
+            size_t size = elem->in_sg[i].iov_len;
+            ram_addr_t ram_offset;
+            RAMBlock *rb;
+
+            /* Buffers outside of RAM were mapped through a bounce buffer,
+             * which isn't in any RAMBlock.
+             */
+            rb = qemu_ram_block_from_host(addr, false, &ram_offset);
+            if (!rb) {
+                continue;
+            }
+            if (!QEMU_IS_ALIGNED(ram_offset | size, qemu_ram_pagesize(rb)) ||
+                ram_offset + size > qemu_ram_get_used_length(rb)) {
+                continue;
+            }
+            trace_virtio_balloon_handle_report(addr, size);
+            balloon_discard_range(addr, size);
+        }
+
+skip_element:
+        virtqueue_push(vq, elem, 0);
+        virtio_notify(vdev, vq);
+        g_free(elem);
+    }
+}
+
 static void virtio_balloon_receive_stats(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
@@ -437,6 +537,9 @@ static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
     s->ivq = virtio_add_queue(vdev, 128, virtio_balloon_handle_output);
     s->dvq = virtio_add_queue(vdev, 128, virtio_balloon_handle_output);
     s->svq = virtio_add_queue(vdev, 128, virtio_balloon_receive_stats);
+    if (virtio_has_feature(s->host_features, VIRTIO_BALLOON_F_REPORTING)) {
+        s->rvq = virtio_add_queue(vdev, 32, virtio_balloon_handle_report);
+    }
 
     reset_stats(s);
 }
@@ -500,6 +603,8 @@ static const VMStateDescription vmstate_virtio_balloon = {
 static Property virtio_balloon_properties[] = {
     DEFINE_PROP_BIT("deflate-on-oom", VirtIOBalloon, host_features,
                     VIRTIO_BALLOON_F_DEFLATE_ON_OOM, false),
+    DEFINE_PROP_BIT("free-page-reporting", VirtIOBalloon, host_features,
+                    VIRTIO_BALLOON_F_REPORTING, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -23,6 +23,7 @@
 #include "hw/virtio/virtio-bus.h"
 #include "migration/migration.h"
 #include "hw/virtio/virtio-access.h"
+#include "panda/rr/rr_log_all.h"
 
 /*
  * The alignment to use between consumer and producer parts of vring.
@@ -59,6 +60,24 @@ typedef struct VRingUsed
     VRingUsedElem ring[0];
 } VRingUsed;
 
+typedef struct VRingHostRegion
+{
+    MemoryRegion *mr;
+    hwaddr offset;
+    uint8_t *ptr;
+} VRingHostRegion;
+
+/* Host addresses of the rings, so that accessing them needs no lookup in
+ * the memory map.  A ring that is not entirely in one RAM region has a
+ * NULL ptr and is accessed through address_space_memory. */
+typedef struct VRingHostMap
+{
+    struct rcu_head rcu;
+    VRingHostRegion desc;
+    VRingHostRegion avail;
+    VRingHostRegion used;
+} VRingHostMap;
+
 typedef struct VRing
 {
     unsigned int num;
@@ -67,6 +86,8 @@ typedef struct VRing
     hwaddr desc;
     hwaddr avail;
     hwaddr used;
+    /* RCU-protected, rebuilt by virtio_queue_update_host_map() */
+    VRingHostMap *host_map;
 } VRing;
 
 struct VirtQueue
@@ -103,6 +124,82 @@ struct VirtQueue
     QLIST_ENTRY(VirtQueue) node;
 };
 
+static void vring_host_region_init(VRingHostRegion *r, hwaddr pa,
+                                   hwaddr len, bool is_write)
+{
+    MemoryRegion *mr;
+    hwaddr xlat, l = len;
+
+    r->mr = NULL;
+    r->ptr = NULL;
+    if (!pa) {
+        return;
+    }
+    mr = address_space_translate(&address_space_memory, pa, &xlat, &l,
+                                 is_write);
+    if (l < len || !memory_access_is_direct(mr, is_write)) {
+        return;
+    }
+    memory_region_ref(mr);
+    r->mr = mr;
+    r->offset = xlat;
+    r->ptr = (uint8_t *)memory_region_get_ram_ptr(mr) + xlat;
+}
+
+static void vring_host_map_free(VRingHostMap *map)
+{
+    if (map->desc.mr) {
+        memory_region_unref(map->desc.mr);
+    }
+    if (map->avail.mr) {
+        memory_region_unref(map->avail.mr);
+    }
+    if (map->used.mr) {
+        memory_region_unref(map->used.mr);
+    }
+    g_free(map);
+}
+
+/* Called with the iothread lock held whenever the rings or the memory map
+ * change */
+static void virtio_queue_update_host_map(VirtIODevice *vdev, int n)
+{
+    VRing *vring = &vdev->vq[n].vring;
+    VRingHostMap *old = vring->host_map;
+    VRingHostMap *new = NULL;
+
+    if (vring->num && vring->desc) {
+        new = g_new0(VRingHostMap, 1);
+        rcu_read_lock();
+        vring_host_region_init(&new->desc, vring->desc,
+                               vring->num * sizeof(VRingDesc), false);
+        /* Including used_event and avail_event */
+        vring_host_region_init(&new->avail, vring->avail,
+                               offsetof(VRingAvail, ring[vring->num + 1]),
+                               false);
+        vring_host_region_init(&new->used, vring->used,
+                               offsetof(VRingUsed, ring[vring->num]) +
+                               sizeof(uint16_t), true);
+        rcu_read_unlock();
+    }
+
+    atomic_rcu_set(&vring->host_map, new);
+    if (old) {
+        call_rcu(old, vring_host_map_free, rcu);
+    }
+}
+
+/* Called within RCU critical section.  */
+static VRingHostMap *vring_get_host_map(VirtQueue *vq)
+{
+    /* Record and replay have to see every access of devices to guest
+     * memory */
+    if (!rr_off()) {
+        return NULL;
+    }
+    return atomic_rcu_read(&vq->vring.host_map);
+}
+
 /* virt queue functions */
 void virtio_queue_update_rings(VirtIODevice *vdev, int n)
 {
@@ -116,39 +213,123 @@ void virtio_queue_update_rings(VirtIODevice *vdev, int n)
     vring->used = vring_align(vring->avail +
                               offsetof(VRingAvail, ring[vring->num]),
                               vring->align);
+    virtio_queue_update_host_map(vdev, n);
+}
+
+/* The descriptor table that a chain is read from: the one of the ring, or
+ * an indirect table.  Only valid within the RCU critical section that it
+ * was set up in. */
+typedef struct VRingDescTable {
+    hwaddr pa;
+    const uint8_t *ptr;
+} VRingDescTable;
+
+/* Called within RCU critical section.  */
+static void vring_desc_table_ring(VirtQueue *vq, VRingDescTable *table)
+{
+    VRingHostMap *map = vring_get_host_map(vq);
+
+    table->pa = vq->vring.desc;
+    table->ptr = map ? map->desc.ptr : NULL;
+}
+
+/* Called within RCU critical section.  */
+static void vring_desc_table_indirect(VRingDescTable *table, hwaddr pa,
+                                      hwaddr len)
+{
+    MemoryRegion *mr;
+    hwaddr xlat, l = len;
+
+    table->pa = pa;
+    table->ptr = NULL;
+    if (!rr_off()) {
+        return;
+    }
+    mr = address_space_translate(&address_space_memory, pa, &xlat, &l, false);
+    if (l >= len && memory_access_is_direct(mr, false)) {
+        table->ptr = (uint8_t *)memory_region_get_ram_ptr(mr) + xlat;
+    }
 }
 
 static void vring_desc_read(VirtIODevice *vdev, VRingDesc *desc,
-                            hwaddr desc_pa, int i)
+                            VRingDescTable *table, int i)
 {
-    address_space_read(&address_space_memory, desc_pa + i * sizeof(VRingDesc),
-                       MEMTXATTRS_UNSPECIFIED, (void *)desc, sizeof(VRingDesc));
+    if (table->ptr) {
+        memcpy(desc, table->ptr + i * sizeof(VRingDesc), sizeof(VRingDesc));
+    } else {
+        address_space_read(&address_space_memory,
+                           table->pa + i * sizeof(VRingDesc),
+                           MEMTXATTRS_UNSPECIFIED, (void *)desc,
+                           sizeof(VRingDesc));
+    }
     virtio_tswap64s(vdev, &desc->addr);
     virtio_tswap32s(vdev, &desc->len);
     virtio_tswap16s(vdev, &desc->flags);
     virtio_tswap16s(vdev, &desc->next);
 }
 
+static uint16_t vring_avail_lduw(VirtQueue *vq, hwaddr off)
+{
+    VRingHostMap *map;
+    uint16_t val;
+
+    rcu_read_lock();
+    map = vring_get_host_map(vq);
+    if (map && map->avail.ptr) {
+        val = virtio_lduw_p(vq->vdev, map->avail.ptr + off);
+    } else {
+        val = virtio_lduw_phys(vq->vdev, vq->vring.avail + off);
+    }
+    rcu_read_unlock();
+    return val;
+}
+
+static uint16_t vring_used_lduw(VirtQueue *vq, hwaddr off)
+{
+    VRingHostMap *map;
+    uint16_t val;
+
+    rcu_read_lock();
+    map = vring_get_host_map(vq);
+    if (map && map->used.ptr) {
+        val = virtio_lduw_p(vq->vdev, map->used.ptr + off);
+    } else {
+        val = virtio_lduw_phys(vq->vdev, vq->vring.used + off);
+    }
+    rcu_read_unlock();
+    return val;
+}
+
+static void vring_used_stw(VirtQueue *vq, hwaddr off, uint16_t val)
+{
+    VRingHostMap *map;
+
+    rcu_read_lock();
+    map = vring_get_host_map(vq);
+    if (map && map->used.ptr) {
+        virtio_stw_p(vq->vdev, map->used.ptr + off, val);
+        memory_region_set_dirty(map->used.mr, map->used.offset + off,
+                                sizeof(val));
+    } else {
+        virtio_stw_phys(vq->vdev, vq->vring.used + off, val);
+    }
+    rcu_read_unlock();
+}
+
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, flags);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_avail_lduw(vq, offsetof(VRingAvail, flags));
 }
 
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    vq->shadow_avail_idx = virtio_lduw_phys(vq->vdev, pa);
+    vq->shadow_avail_idx = vring_avail_lduw(vq, offsetof(VRingAvail, idx));
     return vq->shadow_avail_idx;
 }
 
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_avail_lduw(vq, offsetof(VRingAvail, ring[i]));
 }
 
 static inline uint16_t vring_get_used_event(VirtQueue *vq)
@@ -159,53 +340,56 @@ static inline uint16_t vring_get_used_event(VirtQueue *vq)
 static inline void vring_used_write(VirtQueue *vq, VRingUsedElem *uelem,
                                     int i)
 {
-    hwaddr pa;
+    VRingHostMap *map;
+    hwaddr off = offsetof(VRingUsed, ring[i]);
+
     virtio_tswap32s(vq->vdev, &uelem->id);
     virtio_tswap32s(vq->vdev, &uelem->len);
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i]);
-    address_space_write(&address_space_memory, pa, MEMTXATTRS_UNSPECIFIED,
-                       (void *)uelem, sizeof(VRingUsedElem));
+    rcu_read_lock();
+    map = vring_get_host_map(vq);
+    if (map && map->used.ptr) {
+        memcpy(map->used.ptr + off, uelem, sizeof(VRingUsedElem));
+        memory_region_set_dirty(map->used.mr, map->used.offset + off,
+                                sizeof(VRingUsedElem));
+    } else {
+        address_space_write(&address_space_memory, vq->vring.used + off,
+                            MEMTXATTRS_UNSPECIFIED, (void *)uelem,
+                            sizeof(VRingUsedElem));
+    }
+    rcu_read_unlock();
 }
 
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_used_lduw(vq, offsetof(VRingUsed, idx));
 }
 
 static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    virtio_stw_phys(vq->vdev, pa, val);
+    vring_used_stw(vq, offsetof(VRingUsed, idx), val);
     vq->used_idx = val;
 }
 
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 {
-    VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) | mask);
+    hwaddr off = offsetof(VRingUsed, flags);
+
+    vring_used_stw(vq, off, vring_used_lduw(vq, off) | mask);
 }
 
 static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
 {
-    VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) & ~mask);
+    hwaddr off = offsetof(VRingUsed, flags);
+
+    vring_used_stw(vq, off, vring_used_lduw(vq, off) & ~mask);
 }
 
 static inline void vring_set_avail_event(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
     if (!vq->notification) {
         return;
     }
-    pa = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]);
-    virtio_stw_phys(vq->vdev, pa, val);
+    vring_used_stw(vq, offsetof(VRingUsed, ring[vq->vring.num]), val);
 }
 
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
@@ -363,6 +547,18 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
     virtqueue_flush(vq, 1);
 }
 
+/* Complete @count elements with a single update of the used index */
+void virtqueue_push_batch(VirtQueue *vq, VirtQueueElement *const *elems,
+                          const unsigned int *lens, unsigned int count)
+{
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        virtqueue_fill(vq, elems[i], lens[i], i);
+    }
+    virtqueue_flush(vq, count);
+}
+
 static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
 {
     uint16_t num_heads = vring_avail_idx(vq) - idx;
@@ -405,7 +601,7 @@ enum {
 };
 
 static int virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
-                                    hwaddr desc_pa, unsigned int max,
+                                    VRingDescTable *table, unsigned int max,
                                     unsigned int *next)
 {
     /* If this descriptor says it doesn't chain, we're done. */
@@ -423,7 +619,7 @@ static int virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
         return VIRTQUEUE_READ_DESC_ERROR;
     }
 
-    vring_desc_read(vdev, desc, desc_pa, *next);
+    vring_desc_read(vdev, desc, table, *next);
     return VIRTQUEUE_READ_DESC_MORE;
 }
 
@@ -437,12 +633,13 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
     idx = vq->last_avail_idx;
 
+    rcu_read_lock();
     total_bufs = in_total = out_total = 0;
     while ((rc = virtqueue_num_heads(vq, idx)) > 0) {
         VirtIODevice *vdev = vq->vdev;
         unsigned int max, num_bufs, indirect = 0;
         VRingDesc desc;
-        hwaddr desc_pa;
+        VRingDescTable table;
         unsigned int i;
 
         max = vq->vring.num;
@@ -452,8 +649,8 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
             goto err;
         }
 
-        desc_pa = vq->vring.desc;
-        vring_desc_read(vdev, &desc, desc_pa, i);
+        vring_desc_table_ring(vq, &table);
+        vring_desc_read(vdev, &desc, &table, i);
 
         if (desc.flags & VRING_DESC_F_INDIRECT) {
             if (desc.len % sizeof(VRingDesc)) {
@@ -470,9 +667,9 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
             /* loop over the indirect descriptor table */
             indirect = 1;
             max = desc.len / sizeof(VRingDesc);
-            desc_pa = desc.addr;
+            vring_desc_table_indirect(&table, desc.addr, desc.len);
             num_bufs = i = 0;
-            vring_desc_read(vdev, &desc, desc_pa, i);
+            vring_desc_read(vdev, &desc, &table, i);
         }
 
         do {
@@ -491,7 +688,7 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                 goto done;
             }
 
-            rc = virtqueue_read_next_desc(vdev, &desc, desc_pa, max, &i);
+            rc = virtqueue_read_next_desc(vdev, &desc, &table, max, &i);
         } while (rc == VIRTQUEUE_READ_DESC_MORE);
 
         if (rc == VIRTQUEUE_READ_DESC_ERROR) {
@@ -509,6 +706,7 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
     }
 
 done:
+    rcu_read_unlock();
     if (in_bytes) {
         *in_bytes = in_total;
     }
@@ -653,10 +851,12 @@ static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_nu
     return elem;
 }
 
-void *virtqueue_pop(VirtQueue *vq, size_t sz)
+/* Pop the element at last_avail_idx, which the caller has checked to be
+ * available */
+static void *virtqueue_pop_head(VirtQueue *vq, size_t sz, bool set_event)
 {
     unsigned int i, head, max;
-    hwaddr desc_pa = vq->vring.desc;
+    VRingDescTable table;
     VirtIODevice *vdev = vq->vdev;
     VirtQueueElement *elem;
     unsigned out_num, in_num;
@@ -665,16 +865,6 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     VRingDesc desc;
     int rc;
 
-    if (unlikely(vdev->broken)) {
-        return NULL;
-    }
-    if (virtio_queue_empty(vq)) {
-        return NULL;
-    }
-    /* Needed after virtio_queue_empty(), see comment in
-     * virtqueue_num_heads(). */
-    smp_rmb();
-
     /* When we start there are none of either input nor output. */
     out_num = in_num = 0;
 
@@ -689,23 +879,26 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
         return NULL;
     }
 
-    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+    if (set_event && virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
         vring_set_avail_event(vq, vq->last_avail_idx);
     }
 
+    rcu_read_lock();
     i = head;
-    vring_desc_read(vdev, &desc, desc_pa, i);
+    vring_desc_table_ring(vq, &table);
+    vring_desc_read(vdev, &desc, &table, i);
     if (desc.flags & VRING_DESC_F_INDIRECT) {
         if (desc.len % sizeof(VRingDesc)) {
             virtio_error(vdev, "Invalid size for indirect buffer table");
+            rcu_read_unlock();
             return NULL;
         }
 
         /* loop over the indirect descriptor table */
         max = desc.len / sizeof(VRingDesc);
-        desc_pa = desc.addr;
+        vring_desc_table_indirect(&table, desc.addr, desc.len);
         i = 0;
-        vring_desc_read(vdev, &desc, desc_pa, i);
+        vring_desc_read(vdev, &desc, &table, i);
     }
 
     /* Collect all the descriptors */
@@ -736,12 +929,13 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
             goto err_undo_map;
         }
 
-        rc = virtqueue_read_next_desc(vdev, &desc, desc_pa, max, &i);
+        rc = virtqueue_read_next_desc(vdev, &desc, &table, max, &i);
     } while (rc == VIRTQUEUE_READ_DESC_MORE);
 
     if (rc == VIRTQUEUE_READ_DESC_ERROR) {
         goto err_undo_map;
     }
+    rcu_read_unlock();
 
     /* Now copy what we have collected and mapped */
     elem = virtqueue_alloc_element(sz, out_num, in_num);
@@ -761,10 +955,62 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     return elem;
 
 err_undo_map:
+    rcu_read_unlock();
     virtqueue_undo_map_desc(out_num, in_num, iov);
     return NULL;
 }
 
+void *virtqueue_pop(VirtQueue *vq, size_t sz)
+{
+    if (unlikely(vq->vdev->broken)) {
+        return NULL;
+    }
+    if (virtio_queue_empty(vq)) {
+        return NULL;
+    }
+    /* Needed after virtio_queue_empty(), see comment in
+     * virtqueue_num_heads(). */
+    smp_rmb();
+
+    return virtqueue_pop_head(vq, sz, true);
+}
+
+/*
+ * Pop up to @max elements into @elems, with a single read of the avail
+ * index and a single update of the avail event for all of them.
+ *
+ * Returns the number of elements popped.
+ */
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max)
+{
+    VirtIODevice *vdev = vq->vdev;
+    unsigned int i;
+    int avail;
+
+    if (unlikely(vdev->broken)) {
+        return 0;
+    }
+
+    /* Includes the barrier before the descriptors are read */
+    avail = virtqueue_num_heads(vq, vq->last_avail_idx);
+    if (avail <= 0) {
+        return 0;
+    }
+
+    for (i = 0; i < MIN(avail, max); i++) {
+        elems[i] = virtqueue_pop_head(vq, sz, false);
+        if (!elems[i]) {
+            break;
+        }
+    }
+
+    if (i && virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+    return i;
+}
+
 /* Reading and writing a structure directly to QEMUFile is *awful*, but
  * it is what QEMU has always done by mistake.  We can change it sooner
  * or later by bumping the version number of the affected vm states.
@@ -962,6 +1208,7 @@ void virtio_reset(void *opaque)
         vdev->vq[i].notification = true;
         vdev->vq[i].vring.num = vdev->vq[i].vring.num_default;
         vdev->vq[i].inuse = 0;
+        virtio_queue_update_host_map(vdev, i);
     }
 }
 
@@ -1171,6 +1418,7 @@ void virtio_queue_set_rings(VirtIODevice *vdev, int n, hwaddr desc,
     vdev->vq[n].vring.desc = desc;
     vdev->vq[n].vring.avail = avail;
     vdev->vq[n].vring.used = used;
+    virtio_queue_update_host_map(vdev, n);
 }
 
 void virtio_queue_set_num(VirtIODevice *vdev, int n, int num)
@@ -1184,6 +1432,7 @@ void virtio_queue_set_num(VirtIODevice *vdev, int n, int num)
         return;
     }
     vdev->vq[n].vring.num = num;
+    virtio_queue_update_host_map(vdev, n);
 }
 
 VirtQueue *virtio_vector_first_queue(VirtIODevice *vdev, uint16_t vector)
@@ -1316,6 +1565,7 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
 
     vdev->vq[n].vring.num = 0;
     vdev->vq[n].vring.num_default = 0;
+    virtio_queue_update_host_map(vdev, n);
 }
 
 static void virtio_set_isr(VirtIODevice *vdev, int value)
@@ -1837,6 +2087,7 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
     }
 
     for (i = 0; i < num; i++) {
+        virtio_queue_update_host_map(vdev, i);
         if (vdev->vq[i].vring.desc) {
             uint16_t nheads;
             nheads = vring_avail_idx(&vdev->vq[i]) - vdev->vq[i].last_avail_idx;
@@ -1874,6 +2125,16 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        VRingHostMap *map = vdev->vq[i].vring.host_map;
+
+        if (map) {
+            atomic_rcu_set(&vdev->vq[i].vring.host_map, NULL);
+            call_rcu(map, vring_host_map_free, rcu);
+        }
+    }
     qemu_del_vm_change_state_handler(vdev->vmstate);
     g_free(vdev->config);
     g_free(vdev->vq);
@@ -2047,6 +2308,37 @@ static void virtio_queue_host_notifier_aio_read(EventNotifier *n)
     }
 }
 
+static void virtio_queue_host_notifier_aio_poll_begin(EventNotifier *n)
+{
+    VirtQueue *vq = container_of(n, VirtQueue, host_notifier);
+
+    virtio_queue_set_notification(vq, 0);
+}
+
+static bool virtio_queue_host_notifier_aio_poll(void *opaque)
+{
+    EventNotifier *n = opaque;
+    VirtQueue *vq = container_of(n, VirtQueue, host_notifier);
+
+    if (virtio_queue_empty(vq)) {
+        return false;
+    }
+
+    virtio_queue_notify_aio_vq(vq);
+
+    /* In case the handler function re-enabled notifications */
+    virtio_queue_set_notification(vq, 0);
+    return true;
+}
+
+static void virtio_queue_host_notifier_aio_poll_end(EventNotifier *n)
+{
+    VirtQueue *vq = container_of(n, VirtQueue, host_notifier);
+
+    /* Caller polls once more after this to catch requests that race with us */
+    virtio_queue_set_notification(vq, 1);
+}
+
 void virtio_queue_aio_set_host_notifier_handler(VirtQueue *vq, AioContext *ctx,
                                                 VirtIOHandleOutput handle_output)
 {
@@ -2054,6 +2346,10 @@ void virtio_queue_aio_set_host_notifier_handler(VirtQueue *vq, AioContext *ctx,
         vq->handle_aio_output = handle_output;
         aio_set_event_notifier(ctx, &vq->host_notifier, true,
                                virtio_queue_host_notifier_aio_read);
+        aio_set_event_notifier_poll(ctx, &vq->host_notifier,
+                                    virtio_queue_host_notifier_aio_poll,
+                                    virtio_queue_host_notifier_aio_poll_begin,
+                                    virtio_queue_host_notifier_aio_poll_end);
     } else {
         aio_set_event_notifier(ctx, &vq->host_notifier, true, NULL);
         /* Test and clear notifier before after disabling event,
@@ -2098,6 +2394,18 @@ void GCC_FMT_ATTR(2, 3) virtio_error(VirtIODevice *vdev, const char *fmt, ...)
     }
 }
 
+static void virtio_memory_listener_commit(MemoryListener *listener)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice, listener);
+    int i;
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        if (vdev->vq[i].vring.desc || vdev->vq[i].vring.host_map) {
+            virtio_queue_update_host_map(vdev, i);
+        }
+    }
+}
+
 static void virtio_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
@@ -2120,6 +2428,9 @@ static void virtio_device_realize(DeviceState *dev, Error **errp)
         error_propagate(errp, err);
         return;
     }
+
+    vdev->listener.commit = virtio_memory_listener_commit;
+    memory_listener_register(&vdev->listener, &address_space_memory);
 }
 
 static void virtio_device_unrealize(DeviceState *dev, Error **errp)
@@ -2128,6 +2439,7 @@ static void virtio_device_unrealize(DeviceState *dev, Error **errp)
     VirtioDeviceClass *vdc = VIRTIO_DEVICE_GET_CLASS(dev);
     Error *err = NULL;
 
+    memory_listener_unregister(&vdev->listener);
     virtio_bus_device_unplugged(vdev);
 
     if (vdc->unrealize != NULL) {
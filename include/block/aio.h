@@ -124,16 +124,38 @@ struct AioContext {
      */
     struct LinuxAioState *linux_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    /* State for Linux io_uring.  Uses aio_context_acquire/release for
+     * locking.
+     */
+    struct LuringState *linux_io_uring;
+#endif
 
     /* TimerLists for calling timers - one per clock type */
     QEMUTimerListGroup tlg;
 
     int external_disable_cnt;
 
+    /* Number of AioHandlers without .io_poll() */
+    int poll_disable_cnt;
+
+    /* Polling mode parameters */
+    int64_t poll_ns;        /* current polling time in nanoseconds */
+    int64_t poll_max_ns;    /* maximum polling time in nanoseconds */
+    int64_t poll_grow;      /* polling time growth factor */
+    int64_t poll_shrink;    /* polling time shrink factor */
+
+    /* Are we in polling mode or monitoring file descriptors? */
+    bool poll_started;
+
     /* epoll(7) state used when built with CONFIG_EPOLL */
     int epollfd;
     bool epoll_enabled;
     bool epoll_available;
+
+    /* While epoll is enabled, the GSource polls this instead of the
+     * file descriptors of all handlers.  */
+    GPollFD epoll_pfd;
 };
 
 /**
@@ -327,6 +349,23 @@ void aio_set_fd_handler(AioContext *ctx,
                         IOHandler *io_write,
                         void *opaque);
 
+/* Returns true if io_poll() made progress, e.g. processed a request */
+typedef bool AioPollFn(void *opaque);
+
+/* Register polling callbacks for a handler already set up with
+ * aio_set_fd_handler().  While the AioContext is in polling mode,
+ * io_poll() is called in a loop instead of waiting for the fd to become
+ * readable; io_poll_begin() and io_poll_end() are called when polling
+ * mode starts and stops, e.g. to suppress notifications that polling
+ * makes redundant.  Polling is only used while every handler in the
+ * AioContext has an io_poll() callback.
+ */
+void aio_set_fd_poll(AioContext *ctx,
+                     int fd,
+                     AioPollFn *io_poll,
+                     IOHandler *io_poll_begin,
+                     IOHandler *io_poll_end);
+
 /* Register an event notifier and associated callbacks.  Behaves very similarly
  * to event_notifier_set_handler.  Unlike event_notifier_set_handler, these callbacks
  * will be invoked when using aio_poll().
@@ -339,6 +378,15 @@ void aio_set_event_notifier(AioContext *ctx,
                             bool is_external,
                             EventNotifierHandler *io_read);
 
+/* Like aio_set_fd_poll(), for a notifier set up with
+ * aio_set_event_notifier().
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll,
+                                 EventNotifierHandler *io_poll_begin,
+                                 EventNotifierHandler *io_poll_end);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
@@ -350,6 +398,10 @@ struct ThreadPool *aio_get_thread_pool(AioContext *ctx);
 /* Return the LinuxAioState bound to this AioContext */
 struct LinuxAioState *aio_get_linux_aio(AioContext *ctx);
 
+/* Return the LuringState bound to this AioContext, or NULL if the host
+ * kernel has no io_uring */
+struct LuringState *aio_get_linux_io_uring(AioContext *ctx);
+
 /**
  * aio_timer_new:
  * @ctx: the aio context
@@ -474,4 +526,30 @@ static inline bool aio_context_in_iothread(AioContext *ctx)
  */
 void aio_context_setup(AioContext *ctx);
 
+/**
+ * aio_context_after_fork:
+ * @ctx: the aio context
+ *
+ * Give the aio context of a forked child its own event notifier and epoll
+ * instance, instead of those it shares with its parent.
+ */
+void aio_context_after_fork(AioContext *ctx);
+
+/**
+ * aio_context_set_poll_params:
+ * @ctx: the aio context
+ * @max_ns: how long to busy poll for, in nanoseconds
+ * @grow: polling time growth factor
+ * @shrink: polling time shrink factor
+ *
+ * Poll mode can be disabled by setting poll_max_ns to 0.  The polling
+ * time grows from a few microseconds up to @max_ns while blocking in
+ * aio_poll() takes longer than the current polling time, and shrinks once
+ * it takes longer than @max_ns.  0 means the default factor, 2 for growing
+ * and resetting to 0 for shrinking.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink,
+                                 Error **errp);
+
 #endif
@@ -165,6 +165,22 @@ struct BlockDriver {
         int64_t offset, int count, BdrvRequestFlags flags);
     int coroutine_fn (*bdrv_co_pdiscard)(BlockDriverState *bs,
         int64_t offset, int count);
+
+    /*
+     * Copy a range from src to dst without going through a buffer in QEMU.
+     * bdrv_co_copy_range_from() is called on the driver of the source and
+     * typically recurses into its children or calls
+     * bdrv_co_copy_range_to(); bdrv_co_copy_range_to() is called on the
+     * driver of the destination, which does the actual copy.  Either may
+     * return -ENOTSUP, and the caller then has to read and write the data
+     * itself.
+     */
+    int coroutine_fn (*bdrv_co_copy_range_from)(BlockDriverState *bs,
+        BdrvChild *src, uint64_t src_offset, BdrvChild *dst,
+        uint64_t dst_offset, uint64_t bytes, BdrvRequestFlags flags);
+    int coroutine_fn (*bdrv_co_copy_range_to)(BlockDriverState *bs,
+        BdrvChild *src, uint64_t src_offset, BdrvChild *dst,
+        uint64_t dst_offset, uint64_t bytes, BdrvRequestFlags flags);
     int64_t coroutine_fn (*bdrv_co_get_block_status)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, int *pnum,
         BlockDriverState **file);
@@ -320,6 +336,21 @@ struct BlockDriver {
     void (*bdrv_del_child)(BlockDriverState *parent, BdrvChild *child,
                            Error **errp);
 
+    /**
+     * Called after all nodes of a reopen transaction that made @bs
+     * writable have been committed, so that the driver can mark its
+     * persistent bitmaps as in use before the first write.
+     */
+    int (*bdrv_reopen_bitmaps_rw)(BlockDriverState *bs, Error **errp);
+    /**
+     * Check whether a new bitmap with @name and @granularity could be
+     * stored in the image when @bs is closed.
+     */
+    bool (*bdrv_can_store_new_dirty_bitmap)(BlockDriverState *bs,
+                                            const char *name,
+                                            uint32_t granularity,
+                                            Error **errp);
+
     QLIST_ENTRY(BlockDriver) list;
 };
 
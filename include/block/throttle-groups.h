@@ -28,6 +28,13 @@
 #include "qemu/throttle.h"
 #include "block/block_int.h"
 
+#define THROTTLE_GROUP_DEFAULT_WEIGHT 100
+#define THROTTLE_GROUP_MAX_WEIGHT     1000
+
+/* Bytes each request costs on top of its size when sharing a group,
+ * standing for the per-operation overhead */
+#define THROTTLE_GROUP_REQ_COST       4096
+
 const char *throttle_group_get_name(BlockBackend *blk);
 
 ThrottleState *throttle_group_incref(const char *name);
@@ -35,6 +42,8 @@ void throttle_group_unref(ThrottleState *ts);
 
 void throttle_group_config(BlockBackend *blk, ThrottleConfig *cfg);
 void throttle_group_get_config(BlockBackend *blk, ThrottleConfig *cfg);
+void throttle_group_set_weight(BlockBackend *blk, unsigned int weight);
+unsigned int throttle_group_get_weight(BlockBackend *blk);
 
 void throttle_group_register_blk(BlockBackend *blk, const char *groupname);
 void throttle_group_unregister_blk(BlockBackend *blk);
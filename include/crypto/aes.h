@@ -64,4 +64,21 @@ extern const uint32_t AES_Te0[256], AES_Te1[256], AES_Te2[256],
 extern const uint32_t AES_Td0[256], AES_Td1[256], AES_Td2[256],
                       AES_Td3[256], AES_Td4[256];
 
+/* Single rounds with the semantics of the x86 AESENC, AESENCLAST, AESDEC,
+ * AESDECLAST and AESIMC instructions, on 16 byte blocks in FIPS-197 byte
+ * order, done with the AES instructions of the host.  The output may
+ * overlap the inputs.  AES_accel is NULL if the host has no AES
+ * instructions, and callers fall back to the tables above; both give the
+ * same results.
+ */
+typedef struct AESAccel {
+    void (*enc)(uint8_t *out, const uint8_t *st, const uint8_t *rk);
+    void (*enclast)(uint8_t *out, const uint8_t *st, const uint8_t *rk);
+    void (*dec)(uint8_t *out, const uint8_t *st, const uint8_t *rk);
+    void (*declast)(uint8_t *out, const uint8_t *st, const uint8_t *rk);
+    void (*imc)(uint8_t *out, const uint8_t *in);
+} AESAccel;
+
+extern const AESAccel *AES_accel;
+
 #endif
@@ -74,6 +74,7 @@ typedef enum {
  * @readfunc: callback for reading data from the volume
  * @opaque: data to pass to @readfunc
  * @flags: bitmask of QCryptoBlockOpenFlags values
+ * @n_threads: allow concurrent I/O from up to @n_threads threads
  * @errp: pointer to a NULL-initialized error object
  *
  * Create a new block encryption object for an existing
@@ -105,6 +106,7 @@ QCryptoBlock *qcrypto_block_open(QCryptoBlockOpenOptions *options,
                                  QCryptoBlockReadFunc readfunc,
                                  void *opaque,
                                  unsigned int flags,
+                                 size_t n_threads,
                                  Error **errp);
 
 /**
@@ -163,7 +165,8 @@ QCryptoBlockInfo *qcrypto_block_get_info(QCryptoBlock *block,
  * @errp: pointer to a NULL-initialized error object
  *
  * Decrypt @len bytes of cipher text in @buf, writing
- * plain text back into @buf
+ * plain text back into @buf.  Up to the @n_threads passed
+ * to qcrypto_block_open() may do this at the same time.
  *
  * Returns 0 on success, -1 on failure
  */
@@ -182,7 +185,8 @@ int qcrypto_block_decrypt(QCryptoBlock *block,
  * @errp: pointer to a NULL-initialized error object
  *
  * Encrypt @len bytes of plain text in @buf, writing
- * cipher text back into @buf
+ * cipher text back into @buf.  Like qcrypto_block_decrypt()
+ * this may be called from several threads at once.
  *
  * Returns 0 on success, -1 on failure
  */
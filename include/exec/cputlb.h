@@ -26,6 +26,9 @@ void tlb_unprotect_code(ram_addr_t ram_addr);
 void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry, uintptr_t start,
                            uintptr_t length);
 extern int tlb_flush_count;
+extern int tlb_asid_switch_count;
+extern int tlb_asid_hit_count;
+extern int tlb_resize_count;
 
 #endif
 #endif
@@ -99,6 +99,14 @@ void cpu_reloading_memory_map(void);
  */
 void cpu_address_space_init(CPUState *cpu, AddressSpace *as, int asidx);
 /* cputlb.c */
+/**
+ * tlb_init:
+ * @cpu: CPU whose TLB is to be set up
+ *
+ * Allocate the CPU's TLB, as the backend's TLB lookup needs it.  Called
+ * when the CPU is realized.
+ */
+void tlb_init(CPUState *cpu);
 /**
  * tlb_flush_page:
  * @cpu: CPU whose TLB should be flushed
@@ -139,6 +147,33 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...);
  * MMU indexes.
  */
 void tlb_flush_by_mmuidx(CPUState *cpu, ...);
+/**
+ * tlb_switch_asid:
+ * @cpu: CPU whose TLB is switching
+ * @asid: the address space the CPU is switching to
+ * @flush: whether TLB entries already held for @asid are stale
+ *
+ * Tell the TLB the CPU now translates for address space @asid, as
+ * the target architecture defines one (x86 PCID, ARM ASID).  With
+ * -tlb-asids the TLB in use is put aside, tagged with the address space
+ * it belongs to, and the one kept for @asid, if any, comes back, so
+ * switching back and forth doesn't have to refill it.  Entries that
+ * would be global on the guest are kept in each copy, so the target
+ * must only use this when something guarantees changes to them are
+ * flushed from every address space: tlb_flush_page() and friends
+ * apply to all the saved TLBs.  Without -tlb-asids this is tlb_flush().
+ */
+void tlb_switch_asid(CPUState *cpu, uint64_t asid, bool flush);
+/**
+ * tlb_flush_asid:
+ * @cpu: CPU whose TLB should be flushed
+ * @asid: address space to flush, as for tlb_switch_asid()
+ *
+ * Flush the entries of one address space, wherever they are kept.
+ */
+void tlb_flush_asid(CPUState *cpu, uint64_t asid);
+/* tlb_switch_asid() keeps this many address spaces' TLBs (-tlb-asids) */
+extern unsigned tlb_asid_slots;
 /**
  * tlb_set_page_with_attrs:
  * @cpu: CPU to add this TLB entry for
@@ -177,6 +212,10 @@ void tb_invalidate_phys_addr(AddressSpace *as, hwaddr addr);
 void probe_write(CPUArchState *env, target_ulong addr, int mmu_idx,
                  uintptr_t retaddr);
 #else
+static inline void tlb_init(CPUState *cpu)
+{
+}
+
 static inline void tlb_flush_page(CPUState *cpu, target_ulong addr)
 {
 }
@@ -193,6 +232,14 @@ static inline void tlb_flush_page_by_mmuidx(CPUState *cpu,
 static inline void tlb_flush_by_mmuidx(CPUState *cpu, ...)
 {
 }
+
+static inline void tlb_switch_asid(CPUState *cpu, uint64_t asid, bool flush)
+{
+}
+
+static inline void tlb_flush_asid(CPUState *cpu, uint64_t asid)
+{
+}
 #endif
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
@@ -227,6 +274,8 @@ struct Function;
 #endif
 #endif
 
+#define PANDA_TB_DATA_SLOTS 4
+
 struct TranslationBlock {
     target_ulong pc;   /* simulated PC corresponding to this block (EIP + CS base) */
     target_ulong cs_base; /* CS base for this block */
@@ -240,6 +289,7 @@ struct TranslationBlock {
 #define CF_NOCACHE     0x10000 /* To be freed after execution */
 #define CF_USE_ICOUNT  0x20000
 #define CF_IGNORE_ICOUNT 0x40000 /* Do not generate icount code */
+#define CF_LLVM        0x80000 /* Generate LLVM code even if tiering */
 
     uint16_t invalid;
 
@@ -281,6 +331,28 @@ struct TranslationBlock {
     uintptr_t jmp_list_next[2];
     uintptr_t jmp_list_first;
 
+    /* Facts PANDA plugins record about this TB at translation time, one
+     * slot per plugin that asked for one (panda_tb_data_slot_alloc()).
+     * Zeroed when the TB is allocated, so they go away with it on a flush.
+     */
+    uint64_t panda_data[PANDA_TB_DATA_SLOTS];
+    /* panda_current_asid() when it was translated, if a plugin asked for
+       it with panda_enable_tb_asid(); otherwise 0 */
+    target_ulong asid;
+    /* translated without PANDA instrumentation: panda_instr_enabled() was
+       false, and gets no block callbacks */
+    bool panda_uninstr;
+    /* the code calls the block exec callbacks itself, from the top of the
+       TB, so the TB can be chained to without missing them */
+    bool panda_inline_exec;
+
+    /* -tb-profile counters: times the code was entered (chained or not),
+       times cpu_tb_exec() started a chain here, and profiler samples that
+       landed in the code */
+    uint64_t prof_execs;
+    uint64_t prof_entries;
+    uint32_t prof_samples;
+
 #ifdef CONFIG_LLVM
     /* pointer to LLVM translated code */
     struct TCGLLVMContext *tcg_llvm_context;
@@ -292,6 +364,14 @@ struct TranslationBlock {
     uint8_t *llvm_tc_ptr;
     uint8_t *llvm_tc_end;
     struct TranslationBlock* llvm_tb_next[2];
+    /* times run as TCG for want of LLVM code (see llvm_tier_threshold) */
+    uint32_t llvm_exec_count;
+    /* superblock starting at this TB (see llvm_trace_threshold) */
+    uint8_t *llvm_trace_tc_ptr;
+    uint8_t *llvm_trace_tc_end;
+    /* TB that last ran right after this one, and how many times in a row */
+    struct TranslationBlock *llvm_trace_next;
+    uint32_t llvm_trace_hits;
 #endif
 
 };
@@ -299,6 +379,67 @@ struct TranslationBlock {
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUState *cpu);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
+int tb_invalidate_matching(bool (*match)(TranslationBlock *tb, void *opaque),
+                           void *opaque);
+
+/* TB hot-path profiler (-tb-profile).  Where a thread is, for the samples */
+enum {
+    TB_PROF_OTHER,
+    TB_PROF_EXEC,
+    TB_PROF_TRANSLATE,
+};
+/* Where samples landed: generated code, elsewhere while executing TBs
+   (helpers, softmmu slow path, LLVM code), translation, everything else */
+enum {
+    TB_PROF_SAMPLE_CODE,
+    TB_PROF_SAMPLE_HELPER,
+    TB_PROF_SAMPLE_TRANSLATE,
+    TB_PROF_SAMPLE_OTHER,
+    TB_PROF_SAMPLE_NB,
+};
+/* How cpu_tb_exec() got control back: the four TB_EXIT_* codes, then
+   exit_tb(0), i.e. an indirect jump or a helper ending the TB */
+#define TB_PROF_EXIT_NOCHAIN 4
+#define TB_PROF_EXIT_NB 5
+
+/* Counters are bumped without atomics, so they are approximate with
+   several vCPU threads */
+typedef struct TBProfile {
+    unsigned period_us;
+    uint64_t samples[TB_PROF_SAMPLE_NB];
+    uint64_t samples_dropped;   /* code samples never resolved to a TB */
+    uint64_t exits[TB_PROF_EXIT_NB];
+} TBProfile;
+
+extern bool tb_profile_enabled;
+extern TBProfile tb_profile;
+extern __thread int tb_profile_state;
+
+void tb_profile_start(unsigned period_us);
+void tb_profile_thread_init(void);
+static inline void tb_profile_exit(TranslationBlock *last_tb, int tb_exit)
+{
+    tb_profile.exits[last_tb ? tb_exit : TB_PROF_EXIT_NOCHAIN]++;
+}
+/* Fill tbs with up to n of the most executed TBs, most executed first, and
+   return how many; call with tb_lock held */
+int tb_profile_top(TranslationBlock **tbs, int n);
+
+/* Emulation counters for benchmarks (-exec-stats) */
+typedef struct ExecStats {
+    int64_t start_ns;
+    uint64_t tb_translated;
+    int64_t translate_ns;
+    uint64_t retired_insns;     /* executed in TBs that are gone */
+} ExecStats;
+
+extern bool exec_stats_enabled;
+extern ExecStats exec_stats;
+
+/* Count from now on, and have exec_stats_dump() write the counters to
+   path as JSON.  Also counts helper calls (tcg_count_helpers).  */
+void exec_stats_start(const char *path);
+void exec_stats_dump(void);
 
 #if defined(USE_DIRECT_JUMP)
 
@@ -376,7 +517,7 @@ static inline void tb_add_jump(TranslationBlock *tb, int n,
     tb_set_jmp_target(tb, n, (uintptr_t)tb_next->tc_ptr);
 
     /* add in TB jmp circular list */
-    tb->jmp_list_next[n] = tb_next->jmp_list_first;
+    atomic_set(&tb->jmp_list_next[n], tb_next->jmp_list_first);
     tb_next->jmp_list_first = (uintptr_t)tb | n;
 #ifdef CONFIG_LLVM
     tb->llvm_tb_next[n] = tb_next;
@@ -456,6 +597,13 @@ extern bool exit_request;
 extern int generate_llvm;
 extern int execute_llvm;
 extern const int has_llvm_engine;
+/* With execute_llvm, translate a TB to LLVM only once it has run this many
+   times as TCG; 0 translates every TB to LLVM straight away.  */
+extern unsigned llvm_tier_threshold;
+/* With execute_llvm, once the same TB has followed a TB this many times in
+   a row, compile the chain of such TBs starting there into one function
+   (a trace); 0 never does.  */
+extern unsigned llvm_trace_threshold;
 
 // panda needs
 void breakpoint_invalidate(CPUState *cpu, target_ulong pc);
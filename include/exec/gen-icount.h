@@ -9,6 +9,17 @@ static int icount_start_insn_idx;
 static TCGLabel *icount_label;
 static TCGLabel *exitreq_label;
 
+/* Call the block exec callbacks from the TB, once it is sure to run */
+static inline void gen_panda_block_exec(TranslationBlock *tb)
+{
+    if (tb->panda_inline_exec) {
+        TCGv_ptr ptr = tcg_const_ptr(tb);
+
+        gen_helper_panda_block_exec(cpu_env, ptr);
+        tcg_temp_free_ptr(ptr);
+    }
+}
+
 static inline void gen_tb_start(TranslationBlock *tb)
 {
     TCGv_i32 count, flag, imm;
@@ -20,7 +31,19 @@ static inline void gen_tb_start(TranslationBlock *tb)
     tcg_gen_brcondi_i32(TCG_COND_NE, flag, 0, exitreq_label);
     tcg_temp_free_i32(flag);
 
+    if (tb_profile_enabled || exec_stats_enabled) {
+        TCGv_ptr ptr = tcg_const_ptr(&tb->prof_execs);
+        TCGv_i64 execs = tcg_temp_new_i64();
+
+        tcg_gen_ld_i64(execs, ptr, 0);
+        tcg_gen_addi_i64(execs, execs, 1);
+        tcg_gen_st_i64(execs, ptr, 0);
+        tcg_temp_free_i64(execs);
+        tcg_temp_free_ptr(ptr);
+    }
+
     if (!(tb->cflags & CF_USE_ICOUNT)) {
+        gen_panda_block_exec(tb);
         return;
     }
 
@@ -43,6 +66,7 @@ static inline void gen_tb_start(TranslationBlock *tb)
     tcg_gen_st16_i32(count, cpu_env,
                      -ENV_OFFSET + offsetof(CPUState, icount_decr.u16.low));
     tcg_temp_free_i32(count);
+    gen_panda_block_exec(tb);
 }
 
 static void gen_tb_end(TranslationBlock *tb, int num_insns)
@@ -76,10 +100,12 @@ static inline void gen_io_end(void)
     tcg_temp_free_i32(tmp);
 }
 
-// Record and replay
+// Record and replay.  LLVM translation generates its own version of these,
+// so they're left out of it.
 static inline void gen_op_update_rr_icount(void)
 {
     TCGv_i64 count;
+    int first = tcg_op_buf_count();
 
     count = tcg_temp_new_i64();
 
@@ -88,13 +114,16 @@ static inline void gen_op_update_rr_icount(void)
     tcg_gen_st_i64(count, cpu_env, -ENV_OFFSET + offsetof(CPUState, rr_guest_instr_count));
 
     tcg_temp_free_i64(count);
+    tcg_mark_tcg_only_ops(first);
 }
 
 static inline void gen_op_update_panda_pc(uint64_t new_pc)
 {
+    int first = tcg_op_buf_count();
     TCGv_i64 tmp_pc = tcg_const_i64(new_pc);
     tcg_gen_st_i64(tmp_pc, cpu_env, -ENV_OFFSET + offsetof(CPUState, panda_guest_pc));
     tcg_temp_free_i64(tmp_pc);
+    tcg_mark_tcg_only_ops(first);
 }
 
 #endif
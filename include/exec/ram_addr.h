@@ -21,6 +21,7 @@
 
 #ifndef CONFIG_USER_ONLY
 #include "hw/xen/xen.h"
+#include "qemu/cutils.h"
 
 struct RAMBlock {
     struct rcu_head rcu;
@@ -37,6 +38,10 @@ struct RAMBlock {
     QLIST_ENTRY(RAMBlock) next;
     int fd;
     size_t page_size;
+    /* Copy that a COLO secondary loads checkpoints into, and the pages of
+     * it that have been loaded since the last flush */
+    uint8_t *colo_cache;
+    unsigned long *colo_bmap;
 };
 
 static inline bool offset_in_ramblock(RAMBlock *b, ram_addr_t offset)
@@ -416,17 +421,31 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
         src = atomic_rcu_read(
                 &ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION])->blocks;
 
-        for (k = page; k < page + nr; k++) {
-            if (src[idx][offset]) {
-                unsigned long bits = atomic_xchg(&src[idx][offset], 0);
-                unsigned long new_dirty;
-                new_dirty = ~dest[k];
-                dest[k] |= bits;
-                new_dirty &= bits;
-                num_dirty += ctpopl(new_dirty);
+        k = page;
+        while (k < page + nr) {
+            /* Skip clean stretches with the vectorized zero check; they
+             * are the common case in a large guest */
+            int n = MIN(page + nr - k, 64);
+            int j;
+
+            n = MIN(n, BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE) - offset);
+            if (!buffer_is_zero(&src[idx][offset], n * sizeof(unsigned long))) {
+                for (j = 0; j < n; j++) {
+                    if (src[idx][offset + j]) {
+                        unsigned long bits =
+                            atomic_xchg(&src[idx][offset + j], 0);
+                        unsigned long new_dirty;
+                        new_dirty = ~dest[k + j];
+                        dest[k + j] |= bits;
+                        new_dirty &= bits;
+                        num_dirty += ctpopl(new_dirty);
+                    }
+                }
             }
 
-            if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
+            k += n;
+            offset += n;
+            if (offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
                 offset = 0;
                 idx++;
             }
@@ -26,6 +26,15 @@
 #define CODE_GEN_HTABLE_BITS     15
 #define CODE_GEN_HTABLE_SIZE     (1 << CODE_GEN_HTABLE_BITS)
 
+/* The code buffer, and tbs[] with it, is split into regions that are
+ * filled one after the other.  Once the last one is full the oldest is
+ * evicted and filled again, so running out of room costs one region's
+ * worth of retranslation rather than all of it.  Buffers too small for
+ * two regions of TB_REGION_MIN_SIZE are flushed whole, as before.
+ */
+#define TB_MAX_REGIONS           8
+#define TB_REGION_MIN_SIZE       (4 * 1024 * 1024)
+
 typedef struct TranslationBlock TranslationBlock;
 typedef struct TBContext TBContext;
 
@@ -33,12 +42,21 @@ struct TBContext {
 
     TranslationBlock *tbs;
     struct qht htable;
-    int nb_tbs;
+    int nb_tbs;             /* over all regions */
     /* any access to the tbs or the page table must use this lock */
     QemuMutex tb_lock;
 
+    /* 0 until the first TB is allocated */
+    int nb_regions;
+    int region;             /* the one being filled */
+    size_t region_size;     /* of code; the last region gets the remainder */
+    int region_max_tbs;
+    int region_nb_tbs[TB_MAX_REGIONS];
+    void *region_end[TB_MAX_REGIONS];   /* end of code, but for 'region' */
+
     /* statistics */
     unsigned tb_flush_count;
+    unsigned tb_evict_count;
     int tb_phys_invalidate_count;
 };
 
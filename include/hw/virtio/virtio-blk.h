@@ -56,6 +56,7 @@ typedef struct VirtIOBlock {
     bool dataplane_disabled;
     bool dataplane_started;
     struct VirtIOBlockDataPlane *dataplane;
+    unsigned rr_drive;
 } VirtIOBlock;
 
 typedef struct VirtIOBlockReq {
@@ -50,6 +50,10 @@ typedef struct VirtIONetQueue {
     struct {
         VirtQueueElement *elem;
     } async_tx;
+    /* Receive buffer handed to the backend by virtio_net_rx_map */
+    VirtQueueElement *rx_elem;
+    /* Packets were received during a batch of the backend */
+    bool rx_notify;
     struct VirtIONet *n;
 } VirtIONetQueue;
 
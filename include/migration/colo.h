@@ -33,6 +33,11 @@ bool migration_incoming_in_colo_state(void);
 
 COLOMode get_colo_mode(void);
 
+/* RAM cache of the secondary */
+int colo_init_ram_cache(void);
+void colo_flush_ram_cache(void);
+void colo_release_ram_cache(void);
+
 /* failover */
 void colo_do_failover(MigrationState *s);
 #endif
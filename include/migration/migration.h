@@ -180,6 +180,11 @@ struct MigrationState
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(src_page_requests, MigrationSrcPageRequest) src_page_requests;
+    /* Requests for more than a host page are read ahead by the destination
+     * and only served when src_page_requests is empty; the oldest are
+     * dropped when there are too many. */
+    struct src_page_requests src_page_prefetch_requests;
+    int src_page_prefetch_count;
     /* The RAMBlock used in the last src_page_request */
     RAMBlock *last_req_rb;
 
@@ -252,9 +257,20 @@ void migrate_compress_threads_create(void);
 void migrate_compress_threads_join(void);
 void migrate_decompress_threads_create(void);
 void migrate_decompress_threads_join(void);
+int multifd_send_threads_create(Error **errp);
+void multifd_send_threads_join(void);
+void multifd_send_shutdown(void);
+void multifd_recv_new_channel(QIOChannel *ioc);
+void multifd_recv_threads_join(void);
+QIOChannel *socket_send_channel_create(Error **errp);
+void socket_recv_channels_close(void);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
+/* The guest no longer needs the RAM at host address addr, so an outgoing
+ * migration need not send it unless the guest writes it again.
+ */
+void qemu_guest_free_page_hint(void *addr, size_t len);
 void free_xbzrle_decoded_buf(void);
 
 void acct_update_position(QEMUFile *f, size_t size, bool zero);
@@ -302,6 +318,9 @@ bool migrate_auto_converge(void);
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+/* Switch xbzrle_encode_buffer() to the next slower implementation; returns
+ * false if there is none left */
+bool test_xbzrle_next_accel(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
@@ -313,6 +332,10 @@ bool migrate_use_compression(void);
 int migrate_compress_level(void);
 int migrate_compress_threads(void);
 int migrate_decompress_threads(void);
+bool migrate_use_multifd(void);
+int migrate_multifd_channels(void);
+MultifdCompression migrate_multifd_compression(void);
+int migrate_postcopy_prefetch(void);
 bool migrate_use_events(void);
 
 /* Sending on the return path - generic and then for each message type */
@@ -352,6 +375,10 @@ void savevm_skip_configuration(void);
 int global_state_store(void);
 void global_state_store_running(void);
 
+/* Write RAM to, or map it from, the image at @path instead of the stream
+ * in the following savevm or loadvm; NULL goes back to the stream */
+void ram_set_mapped_image(const char *path);
+
 void flush_page_queue(MigrationState *ms);
 int ram_save_queue_pages(MigrationState *ms, const char *rbname,
                          ram_addr_t start, ram_addr_t len);
@@ -946,6 +946,7 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, int version_id);
 void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
                         void *opaque, QJSON *vmdesc);
+int64_t vmstate_estimate_size(const VMStateDescription *vmsd, void *opaque);
 
 bool vmstate_save_needed(const VMStateDescription *vmsd, void *opaque);
 
@@ -62,6 +62,10 @@ typedef void (SetOffload)(NetClientState *, int, int, int, int, int);
 typedef void (SetVnetHdrLen)(NetClientState *, int);
 typedef int (SetVnetLE)(NetClientState *, bool);
 typedef int (SetVnetBE)(NetClientState *, bool);
+typedef int (RxMap)(NetClientState *, struct iovec *, int);
+typedef bool (RxCommit)(NetClientState *, size_t);
+typedef void (RxCancel)(NetClientState *);
+typedef void (FlushBatch)(NetClientState *);
 typedef struct SocketReadState SocketReadState;
 typedef void (SocketReadStateFinalize)(SocketReadState *rs);
 
@@ -84,6 +88,18 @@ typedef struct NetClientInfo {
     SetVnetHdrLen *set_vnet_hdr_len;
     SetVnetLE *set_vnet_le;
     SetVnetBE *set_vnet_be;
+    /* Let a backend read the next packet straight into a receive buffer.
+     * rx_map returns the number of entries of the buffer that it stored
+     * in the iovec, or 0 if the packet has to be sent the normal way.
+     * rx_commit returns false if the packet read into the buffer has to be
+     * sent the normal way after all; it is then followed by rx_cancel. */
+    RxMap *rx_map;
+    RxCommit *rx_commit;
+    RxCancel *rx_cancel;
+    /* Called when the peer ends a batch of packets, see qemu_net_batch_begin.
+     * Receivers may hold back work like notifications or partial writes
+     * while nc->batching is nonzero. */
+    FlushBatch *flush_batch;
 } NetClientInfo;
 
 struct NetClientState {
@@ -101,6 +117,7 @@ struct NetClientState {
     unsigned rxfilter_notify_enabled:1;
     int vring_enable;
     QTAILQ_HEAD(NetFilterHead, NetFilterState) filters;
+    unsigned int batching;
 };
 
 typedef struct NICState {
@@ -149,6 +166,13 @@ void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_async(NetClientState *nc, const uint8_t *buf,
                                int size, NetPacketSent *sent_cb);
+int qemu_rx_map(NetClientState *nc, struct iovec *iov, int iovcnt);
+bool qemu_rx_commit(NetClientState *nc, size_t size);
+void qemu_rx_cancel(NetClientState *nc);
+void qemu_net_batch_begin(NetClientState *nc);
+void qemu_net_batch_end(NetClientState *nc);
+int qemu_send_packets_async(NetClientState *nc, const struct iovec *pkts,
+                            int count, NetPacketSent *sent_cb);
 void qemu_purge_queued_packets(NetClientState *nc);
 void qemu_flush_queued_packets(NetClientState *nc);
 void qemu_format_nic_info_str(NetClientState *nc, uint8_t macaddr[6]);
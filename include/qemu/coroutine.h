@@ -106,6 +106,21 @@ bool qemu_in_coroutine(void);
  */
 bool qemu_coroutine_entered(Coroutine *co);
 
+/**
+ * Grow the coroutine free lists
+ *
+ * Devices that can have many requests in flight call this when they are
+ * created, so that their coroutines are recycled instead of being freed and
+ * allocated again all the time.  This has no effect without
+ * CONFIG_COROUTINE_POOL.
+ */
+void qemu_coroutine_increase_pool_batch_size(unsigned int additional_pool_size);
+
+/**
+ * Undo qemu_coroutine_increase_pool_batch_size() when a device goes away
+ */
+void qemu_coroutine_decrease_pool_batch_size(unsigned int removing_pool_size);
+
 
 /**
  * CoQueues are a mechanism to queue coroutines in order to continue executing
@@ -84,6 +84,19 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size);
  */
 bool hbitmap_merge(HBitmap *a, const HBitmap *b);
 
+/**
+ * hbitmap_intersect:
+ * @a: The bitmap to store the result in.
+ * @b: The bitmap to intersect with @a.
+ * @return true if the intersection was successful,
+ *         false if it was not attempted.
+ *
+ * A := A (BITAND) B.
+ * B is left unmodified.  Like hbitmap_merge, this only visits the words
+ * that have bits set.
+ */
+bool hbitmap_intersect(HBitmap *a, const HBitmap *b);
+
 /**
  * hbitmap_empty:
  * @hb: HBitmap to operate on.
@@ -224,6 +237,44 @@ void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
  */
 void hbitmap_deserialize_finish(HBitmap *hb);
 
+/**
+ * hbitmap_serialize_extents
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer to store the serialized bitmap.
+ * @size: Size of @buf in bytes.
+ * @start: First bit to store.
+ * @count: Number of bits to store.
+ * @end: Where to store the end of the range that has been described.
+ *
+ * Stores the set ranges between @start and @start + @count as pairs of
+ * little-endian 64-bit start and count, which is far smaller than the
+ * format of hbitmap_serialize_part for sparse bitmaps.  If @buf runs out,
+ * *@end is less than @start + @count and the caller can go on from there.
+ *
+ * Return the number of bytes used in @buf.
+ */
+size_t hbitmap_serialize_extents(const HBitmap *hb, uint8_t *buf,
+                                 size_t size, uint64_t start, uint64_t count,
+                                 uint64_t *end);
+
+/**
+ * hbitmap_deserialize_extents
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer to restore the bitmap from.
+ * @size: Number of bytes in @buf.
+ * @start: First bit of the range that @buf describes.
+ * @end: End of that range, as returned by hbitmap_serialize_extents.
+ *
+ * Resets the bits between @start and @end, then sets the ranges stored by
+ * hbitmap_serialize_extents.  @start and @end should be aligned to the
+ * granularity, except for an @end at the end of the bitmap.  The bitmap is
+ * ready for use afterwards.
+ *
+ * Return false, possibly after changing some bits, if @buf is malformed.
+ */
+bool hbitmap_deserialize_extents(HBitmap *hb, const uint8_t *buf,
+                                 size_t size, uint64_t start, uint64_t end);
+
 /**
  * hbitmap_free:
  * @hb: HBitmap to operate on.
@@ -250,6 +301,33 @@ void hbitmap_free(HBitmap *hb);
  */
 void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first);
 
+/**
+ * hbitmap_next_zero:
+ * @hb: HBitmap to operate on.
+ * @start: First bit to look at (0-based, must be strictly less than the
+ * size of the bitmap).
+ *
+ * Return the first bit at or after @start that is not set, or -1 if all
+ * of them are.
+ */
+int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start);
+
+/**
+ * hbitmap_next_dirty_area:
+ * @hb: HBitmap to operate on.
+ * @start: First bit to look at; updated to the start of the area found.
+ * @count: Number of bits to look at; updated to the length of the area.
+ *
+ * Find the first run of set bits that starts in the range, cut to fit in
+ * it.  The bits before the run are skipped with the upper levels, so this
+ * is cheap on mostly clear bitmaps.
+ *
+ * Return true if a run was found, false (and leave @start and @count
+ * alone) if all the bits in the range are clear.
+ */
+bool hbitmap_next_dirty_area(const HBitmap *hb, uint64_t *start,
+                             uint64_t *count);
+
 /* hbitmap_iter_skip_words:
  * @hbi: HBitmapIter to operate on.
  *
@@ -15,6 +15,7 @@ struct qht {
     struct qht_map *map;
     QemuMutex lock; /* serializes setters of ht->map */
     unsigned int mode;
+    unsigned int n_resizes; /* changes of map size, protected by lock */
 };
 
 /**
@@ -26,6 +27,7 @@ struct qht {
  *         chain, excluding empty chains.
  * @occupancy: frequency distribution representing chain occupancy rate.
  *             Valid range: from 0.0 (empty) to 1.0 (full occupancy).
+ * @resizes: number of times the number of head buckets has changed.
  *
  * An entry is a pointer-hash pair.
  * Each bucket can host several entries.
@@ -37,12 +39,14 @@ struct qht_stats {
     size_t entries;
     struct qdist chain;
     struct qdist occupancy;
+    unsigned int resizes;
 };
 
 typedef bool (*qht_lookup_func_t)(const void *obj, const void *userp);
 typedef void (*qht_iter_func_t)(struct qht *ht, void *p, uint32_t h, void *up);
 
-#define QHT_MODE_AUTO_RESIZE 0x1 /* auto-resize when heavily loaded */
+/* auto-resize when heavily loaded or when chains get long */
+#define QHT_MODE_AUTO_RESIZE 0x1
 
 /**
  * qht_init - Initialize a QHT
@@ -117,6 +117,13 @@ struct rcu_head {
 
 extern void call_rcu1(struct rcu_head *head, RCUCBFunc *func);
 
+/* Wait until every callback queued so far has run, without the batching
+ * delay of the call_rcu thread.  Drops the iothread lock while waiting if
+ * the caller holds it, and it must not be called from an RCU read-side
+ * critical section or from a callback.
+ */
+extern void drain_call_rcu(void);
+
 /* The operands of the minus operator must have the same type,
  * which must be the one that we specify in the cast.
  */
@@ -75,6 +75,9 @@ typedef void (*CPUUnassignedAccess)(CPUState *cpu, hwaddr addr,
 
 struct TranslationBlock;
 
+typedef struct CPUTLBAsid CPUTLBAsid;
+typedef struct CPUTLBDesc CPUTLBDesc;
+
 /**
  * CPUClass:
  * @class_by_name: Callback to map -cpu command line model name to an
@@ -227,8 +230,27 @@ struct CPUWatchpoint {
 struct KVMState;
 struct kvm_run;
 
+/* The jump cache maps a guest pc to its TB.  It has TB_JMP_CACHE_SIZE
+ * sets of TB_JMP_CACHE_WAYS entries, most recently used first; entries
+ * pushed out of a set go to a small victim buffer that is checked before
+ * falling back to the TB hash table.
+ */
 #define TB_JMP_CACHE_BITS 12
 #define TB_JMP_CACHE_SIZE (1 << TB_JMP_CACHE_BITS)
+#ifndef TB_JMP_CACHE_WAYS
+#define TB_JMP_CACHE_WAYS 4     /* 1 (direct-mapped), 2 or 4 */
+#endif
+#define TB_JMP_VICTIM_SIZE 8
+
+typedef struct TBJmpCacheEntry {
+    struct TranslationBlock *tb;
+    /* the entry is stale unless this is the CPU's tb_jmp_cache_epoch */
+    unsigned epoch;
+} TBJmpCacheEntry;
+
+typedef struct TBJmpCacheSet {
+    TBJmpCacheEntry way[TB_JMP_CACHE_WAYS];
+} TBJmpCacheSet;
 
 /* work queue */
 
@@ -260,10 +282,13 @@ struct qemu_work_item;
  * @numa_node: NUMA node this CPU is belonging to.
  * @host_tid: Host thread ID.
  * @running: #true if CPU is currently running (lockless).
+ * @halt_event: With MTTCG, what the vCPU's thread waits on while idle;
+ * qemu_cpu_kick() sets it without needing the BQL.
  * @has_waiter: #true if a CPU is currently waiting for the cpu_exec_end;
  * valid under cpu_list_lock.
  * @created: Indicates whether the CPU thread has been successfully created.
- * @interrupt_request: Indicates a pending interrupt request.
+ * @interrupt_request: Indicates a pending interrupt request.  Updated
+ * atomically, so that cpu_interrupt() doesn't need the BQL.
  * @halted: Nonzero if the CPU is in suspended state.
  * @stop: Indicates a pending stop request.
  * @stopped: Indicates the CPU has been artificially stopped.
@@ -316,6 +341,7 @@ struct CPUState {
     uint32_t host_tid;
     bool running, has_waiter;
     struct QemuCond *halt_cond;
+    QemuEvent halt_event;
     bool thread_kicked;
     bool created;
     bool stop;
@@ -338,8 +364,32 @@ struct CPUState {
 
     void *env_ptr; /* CPUArchState */
 
-    /* Writes protected by tb_lock, reads not thread-safe  */
-    struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];
+    /* Filled by the vCPU's own thread; entries are cleared by whoever
+       invalidates their TB, with tb_lock held */
+    TBJmpCacheSet tb_jmp_cache[TB_JMP_CACHE_SIZE];
+    TBJmpCacheEntry tb_jmp_victim[TB_JMP_VICTIM_SIZE];
+    unsigned tb_jmp_victim_next;
+    unsigned tb_jmp_cache_epoch;
+    /* tb_find() lookups, for 'info jit' */
+    uint64_t tb_jmp_cache_hits;
+    uint64_t tb_jmp_victim_hits;
+    uint64_t tb_jmp_cache_misses;
+    /* jump cache misses that the TB hash table didn't find either */
+    uint64_t tb_htable_misses;
+
+    /* the softmmu TLB in use, per MMU mode; see cputlb.c */
+    CPUTLBDesc *tlb_desc;
+
+    /* softmmu TLBs kept for other address spaces (-tlb-asids), and the
+       one the TLB in use belongs to, if tlb_asid_valid */
+    CPUTLBAsid *tlb_asids;
+    uint64_t tlb_asid;
+    uint64_t tlb_asid_tick;
+    bool tlb_asid_valid;
+    /* bumped by every flush, of a page or more, from any of them; the
+       translations panda_virt_to_phys() caches are only good for the
+       generation they were made in */
+    unsigned tlb_flush_gen;
 
     struct GDBRegisterState *gdb_regs;
     int gdb_num_regs;
@@ -364,6 +414,8 @@ struct CPUState {
     bool kvm_vcpu_dirty;
     struct KVMState *kvm_state;
     struct kvm_run *kvm_run;
+    struct kvm_dirty_gfn *kvm_dirty_gfns;
+    uint32_t kvm_fetch_index;
 
     /*
      * Used for events with 'vcpu' and *without* the 'disabled' properties.
@@ -383,11 +435,21 @@ struct CPUState {
     int32_t exception_index; /* used by m68k TCG */
     uint64_t rr_guest_instr_count;
     uint64_t panda_guest_pc;
+    struct panda_mem_batch *panda_mem_batch;
+    /* TB whose after_block_exec callbacks are still due, for TBs that call
+       their block exec callbacks themselves (panda_inline_exec) */
+    struct TranslationBlock *panda_exec_tb;
 
     /* Used to keep track of an outstanding cpu throttle thread for migration
      * autoconverge
      */
     bool throttle_thread_scheduled;
+    /* Throttle percentage of this vcpu alone, see cpu_throttle_set_vcpu */
+    int throttle_percentage;
+    /* Pages this vcpu dirtied for migration (TCG only), and the value
+     * migration saw when it last measured the vcpu's dirty rate */
+    uint32_t dirty_pages;
+    uint32_t dirty_pages_sampled;
 
     /* Note that this is accessed at the start of every TB via a negative
        offset from AREG0.  Leave this field at the end so as to make the
@@ -619,6 +681,23 @@ static inline bool cpu_has_work(CPUState *cpu)
     return cc->has_work(cpu);
 }
 
+/**
+ * cpu_tb_jmp_cache_clear:
+ * @cpu: The vCPU whose jump cache to empty.
+ *
+ * Drops every entry of the jump cache, by moving on to a new epoch rather
+ * than clearing the whole array.  Called from @cpu's thread, or with every
+ * vCPU stopped.
+ */
+static inline void cpu_tb_jmp_cache_clear(CPUState *cpu)
+{
+    if (++cpu->tb_jmp_cache_epoch == 0) {
+        /* wrapped around: entries from the last epoch 0 look current */
+        memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
+        memset(cpu->tb_jmp_victim, 0, sizeof(cpu->tb_jmp_victim));
+    }
+}
+
 /**
  * qemu_cpu_is_self:
  * @cpu: The vCPU to check against.
@@ -629,6 +708,16 @@ static inline bool cpu_has_work(CPUState *cpu)
  */
 bool qemu_cpu_is_self(CPUState *cpu);
 
+/**
+ * qemu_tcg_mttcg_enabled:
+ * Check whether TCG runs each vCPU on a host thread of its own
+ * (-accel tcg,thread=multi).  Not available in user mode.
+ *
+ * Returns: %true if it does, %false if all vCPUs share one thread.
+ */
+extern bool mttcg_enabled;
+#define qemu_tcg_mttcg_enabled() (mttcg_enabled)
+
 /**
  * qemu_cpu_kick:
  * @cpu: The vCPU to kick.
@@ -728,10 +817,21 @@ bool cpu_exists(int64_t id);
  */
 void cpu_throttle_set(int new_throttle_pct);
 
+/**
+ * cpu_throttle_set_vcpu:
+ * @cpu: The vcpu to throttle.
+ * @new_throttle_pct: Percent of sleep time, 0 to stop throttling @cpu.
+ *
+ * Like cpu_throttle_set, but only for @cpu.  A vcpu sleeps for the higher
+ * of its own percentage and the one set with cpu_throttle_set.
+ */
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct);
+
 /**
  * cpu_throttle_stop:
  *
- * Stops the vcpu throttling started by cpu_throttle_set.
+ * Stops the vcpu throttling started by cpu_throttle_set and
+ * cpu_throttle_set_vcpu.
  */
 void cpu_throttle_stop(void);
 
@@ -746,11 +846,20 @@ bool cpu_throttle_active(void);
  * cpu_throttle_get_percentage:
  *
  * Returns the vcpu throttle percentage. See cpu_throttle_set for details.
+ * If single vcpus are throttled harder, the highest percentage is returned.
  *
  * Returns: The throttle percentage in range 1 to 99.
  */
 int cpu_throttle_get_percentage(void);
 
+/**
+ * cpu_throttle_get_vcpu_percentage:
+ * @cpu: The vcpu to check.
+ *
+ * Returns: The throttle percentage that applies to @cpu, or 0.
+ */
+int cpu_throttle_get_vcpu_percentage(CPUState *cpu);
+
 #ifndef CONFIG_USER_ONLY
 
 typedef void (*CPUInterruptHandler)(CPUState *, int);
@@ -762,7 +871,8 @@ extern CPUInterruptHandler cpu_interrupt_handler;
  * @cpu: The CPU to set an interrupt on.
  * @mask: The interupts to set.
  *
- * Invokes the interrupt handler.
+ * Invokes the interrupt handler.  With TCG this may be called without the
+ * BQL, e.g. by a vCPU thread raising an IPI.
  */
 static inline void cpu_interrupt(CPUState *cpu, int mask)
 {
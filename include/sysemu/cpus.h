@@ -7,9 +7,11 @@ void qemu_init_cpu_loop(void);
 void resume_all_vcpus(void);
 void pause_all_vcpus(void);
 void cpu_stop_current(void);
+void qemu_tcg_vcpus_after_fork(void);
 void cpu_ticks_init(void);
 
 void configure_icount(QemuOpts *opts, Error **errp);
+void qemu_tcg_configure(QemuOpts *opts, Error **errp);
 extern int use_icount;
 extern int icount_align_option;
 
@@ -49,6 +49,24 @@
  */
 #define PAGE_SIZE getpagesize()
 
+/* Dirty ring interface of Linux 5.11, for builds against older headers */
+#ifndef KVM_CAP_DIRTY_LOG_RING
+#define KVM_CAP_DIRTY_LOG_RING 192
+#define KVM_EXIT_DIRTY_RING_FULL 31
+#define KVM_DIRTY_LOG_PAGE_OFFSET 64
+#define KVM_DIRTY_GFN_F_DIRTY 1
+#define KVM_DIRTY_GFN_F_RESET 2
+#define KVM_RESET_DIRTY_RINGS _IO(KVMIO, 0xc7)
+struct kvm_dirty_gfn {
+    __u32 flags;
+    __u32 slot; /* as_id << 16 | slot id */
+    __u64 offset;
+};
+#endif
+
+/* address spaces whose slots can show up in a dirty ring */
+#define KVM_DIRTY_RING_MAX_AS 2
+
 //#define DEBUG_KVM
 
 #ifdef DEBUG_KVM
@@ -101,6 +119,9 @@ struct KVMState
 #endif
     KVMMemoryListener memory_listener;
     QLIST_HEAD(, KVMParkedVcpu) kvm_parked_vcpus;
+    /* entries in each vcpu's dirty ring, 0 when using the dirty bitmap */
+    uint32_t kvm_dirty_ring_size;
+    KVMMemoryListener *as_listener[KVM_DIRTY_RING_MAX_AS];
 };
 
 KVMState *kvm_state;
@@ -273,6 +294,15 @@ int kvm_destroy_vcpu(CPUState *cpu)
         goto err;
     }
 
+    if (cpu->kvm_dirty_gfns) {
+        ret = munmap(cpu->kvm_dirty_gfns,
+                     s->kvm_dirty_ring_size * sizeof(struct kvm_dirty_gfn));
+        if (ret < 0) {
+            goto err;
+        }
+        cpu->kvm_dirty_gfns = NULL;
+    }
+
     vcpu = g_malloc0(sizeof(*vcpu));
     vcpu->vcpu_id = kvm_arch_vcpu_id(cpu);
     vcpu->kvm_fd = cpu->kvm_fd;
@@ -337,6 +367,21 @@ int kvm_init_vcpu(CPUState *cpu)
             (void *)cpu->kvm_run + s->coalesced_mmio * PAGE_SIZE;
     }
 
+    if (s->kvm_dirty_ring_size) {
+        cpu->kvm_dirty_gfns = mmap(NULL, s->kvm_dirty_ring_size *
+                                   sizeof(struct kvm_dirty_gfn),
+                                   PROT_READ | PROT_WRITE, MAP_SHARED,
+                                   cpu->kvm_fd,
+                                   PAGE_SIZE * KVM_DIRTY_LOG_PAGE_OFFSET);
+        if (cpu->kvm_dirty_gfns == MAP_FAILED) {
+            cpu->kvm_dirty_gfns = NULL;
+            ret = -errno;
+            DPRINTF("mmap'ing vcpu dirty ring failed\n");
+            goto err;
+        }
+        cpu->kvm_fetch_index = 0;
+    }
+
     ret = kvm_arch_init_vcpu(cpu);
 err:
     return ret;
@@ -502,6 +547,86 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
     return ret;
 }
 
+/* Mark the page of a dirty ring entry dirty.  Entries may name slots that
+ * have been removed since the guest wrote to them; those are dropped.
+ */
+static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t slot_id,
+                                     uint64_t offset)
+{
+    KVMMemoryListener *kml;
+    KVMSlot *mem;
+    uint32_t as_id = slot_id >> 16;
+    ram_addr_t ram_addr;
+
+    slot_id &= 0xffff;
+    if (as_id >= KVM_DIRTY_RING_MAX_AS || slot_id >= s->nr_slots) {
+        return;
+    }
+    kml = s->as_listener[as_id];
+    if (!kml) {
+        return;
+    }
+    mem = &kml->slots[slot_id];
+    if (!mem->memory_size || offset >= mem->memory_size / getpagesize()) {
+        return;
+    }
+
+    ram_addr = qemu_ram_addr_from_host(mem->ram + offset * getpagesize());
+    if (ram_addr != RAM_ADDR_INVALID) {
+        cpu_physical_memory_set_dirty_range(ram_addr, getpagesize(),
+                                            DIRTY_CLIENTS_NOCODE);
+    }
+}
+
+/* Collect the entries the kernel has published in the ring of one vcpu. */
+static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
+{
+    struct kvm_dirty_gfn *gfn;
+    uint32_t count = 0;
+
+    if (!cpu->kvm_dirty_gfns) {
+        return 0;
+    }
+    for (;;) {
+        gfn = &cpu->kvm_dirty_gfns[cpu->kvm_fetch_index &
+                                   (s->kvm_dirty_ring_size - 1)];
+        if (!(atomic_load_acquire(&gfn->flags) & KVM_DIRTY_GFN_F_DIRTY)) {
+            break;
+        }
+        kvm_dirty_ring_mark_page(s, gfn->slot, gfn->offset);
+        atomic_store_release(&gfn->flags, KVM_DIRTY_GFN_F_RESET);
+        cpu->kvm_fetch_index++;
+        count++;
+    }
+    return count;
+}
+
+/**
+ * kvm_dirty_ring_reap - Collect the dirty rings of all vcpus
+ *
+ * Only the entries written so far are seen: pages logged by a running vcpu
+ * whose hardware buffer (e.g. Intel PML) has not been flushed yet show up
+ * once it exits.  Callers that need every page, like the last pass of a
+ * migration, therefore reap with the vcpus stopped.  Must be called with
+ * the iothread lock held.
+ */
+static void kvm_dirty_ring_reap(KVMState *s)
+{
+    CPUState *cpu;
+    uint64_t total = 0;
+
+    CPU_FOREACH(cpu) {
+        total += kvm_dirty_ring_reap_one(s, cpu);
+    }
+    if (total) {
+        /* hand the collected entries back to the kernel */
+        if (kvm_vm_ioctl(s, KVM_RESET_DIRTY_RINGS) < 0) {
+            DPRINTF("KVM_RESET_DIRTY_RINGS failed\n");
+            abort();
+        }
+    }
+}
+
 static void kvm_coalesce_mmio_region(MemoryListener *listener,
                                      MemoryRegionSection *secion,
                                      hwaddr start, hwaddr size)
@@ -875,6 +1000,12 @@ static void kvm_log_sync(MemoryListener *listener,
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
     int r;
 
+    if (kvm_state->kvm_dirty_ring_size) {
+        /* the rings cover all slots, and are empty after the first section */
+        kvm_dirty_ring_reap(kvm_state);
+        return;
+    }
+
     r = kvm_physical_sync_dirty_bitmap(kml, section);
     if (r < 0) {
         abort();
@@ -957,6 +1088,9 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
 
     kml->slots = g_malloc0(s->nr_slots * sizeof(KVMSlot));
     kml->as_id = as_id;
+    if (as_id < KVM_DIRTY_RING_MAX_AS) {
+        s->as_listener[as_id] = kml;
+    }
 
     for (i = 0; i < s->nr_slots; i++) {
         kml->slots[i].slot = i;
@@ -1743,6 +1877,37 @@ static int kvm_init(MachineState *ms)
     kvm_ioeventfd_any_length_allowed =
         (kvm_check_extension(s, KVM_CAP_IOEVENTFD_ANY_LENGTH) > 0);
 
+    /*
+     * With a dirty ring, KVM pushes each page it logs to a ring of the vcpu
+     * that dirtied it, so syncing costs in proportion to the pages written
+     * instead of to the size of guest memory.
+     */
+    if (machine_kvm_dirty_ring_size(ms) > 0) {
+        uint64_t ring_size = machine_kvm_dirty_ring_size(ms);
+        uint64_t ring_bytes = ring_size * sizeof(struct kvm_dirty_gfn);
+
+        ret = kvm_vm_check_extension(s, KVM_CAP_DIRTY_LOG_RING);
+        if (ret <= 0) {
+            fprintf(stderr, "kvm does not support the dirty ring\n");
+            ret = -EINVAL;
+            goto err;
+        }
+        if (ring_size & (ring_size - 1) || ring_bytes > ret) {
+            fprintf(stderr, "kvm-dirty-ring-size must be a power of two "
+                    "of at most %" PRIu64 " entries\n",
+                    (uint64_t)ret / sizeof(struct kvm_dirty_gfn));
+            ret = -EINVAL;
+            goto err;
+        }
+        ret = kvm_vm_enable_cap(s, KVM_CAP_DIRTY_LOG_RING, 0, ring_bytes);
+        if (ret) {
+            fprintf(stderr, "kvm: cannot enable the dirty ring: %s\n",
+                    strerror(-ret));
+            goto err;
+        }
+        s->kvm_dirty_ring_size = ring_size;
+    }
+
     ret = kvm_arch_init(ms, s);
     if (ret < 0) {
         goto err;
@@ -1976,6 +2141,14 @@ int kvm_cpu_exec(CPUState *cpu)
             DPRINTF("irq_window_open\n");
             ret = EXCP_INTERRUPT;
             break;
+        case KVM_EXIT_DIRTY_RING_FULL:
+            /* the vcpu won't run again until its ring has been emptied */
+            DPRINTF("dirty ring full\n");
+            qemu_mutex_lock_iothread();
+            kvm_dirty_ring_reap(cpu->kvm_state);
+            qemu_mutex_unlock_iothread();
+            ret = 0;
+            break;
         case KVM_EXIT_SHUTDOWN:
             DPRINTF("shutdown\n");
             qemu_system_reset_request();
@@ -3748,6 +3748,12 @@ static void handle_arg_trace(const char *arg)
     trace_file = trace_opt_parse(arg);
 }
 
+static const char *exec_stats_file;
+static void handle_arg_exec_stats(const char *arg)
+{
+    exec_stats_file = arg;
+}
+
 struct qemu_argument {
     const char *argv;
     const char *env;
@@ -3797,6 +3803,8 @@ static const struct qemu_argument arg_table[] = {
      "",           "Seed for pseudo-random number generator"},
     {"trace",      "QEMU_TRACE",       true,  handle_arg_trace,
      "",           "[[enable=]<pattern>][,events=<file>][,file=<file>]"},
+    {"exec-stats", "QEMU_EXEC_STATS",  true,  handle_arg_exec_stats,
+     "file",       "write emulation counters to 'file' as JSON at exit"},
     {"version",    "QEMU_VERSION",     false, handle_arg_version,
      "",           "display version information and exit"},
     {NULL, NULL, false, NULL, NULL, NULL}
@@ -4550,6 +4558,9 @@ int main(int argc, char **argv, char **envp)
         }
         gdb_handlesig(cpu, 0);
     }
+    if (exec_stats_file) {
+        exec_stats_start(exec_stats_file);
+    }
     cpu_loop(env);
     /* never exits */
     return 0;
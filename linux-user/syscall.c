@@ -7603,6 +7603,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         _mcleanup();
 #endif
         gdb_exit(cpu_env, arg1);
+        exec_stats_dump();
         _exit(arg1);
         ret = 0; /* avoid warning */
         break;
@@ -9642,6 +9643,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         _mcleanup();
 #endif
         gdb_exit(cpu_env, arg1);
+        exec_stats_dump();
         ret = get_errno(exit_group(arg1));
         break;
 #endif
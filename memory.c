@@ -222,12 +222,19 @@ struct FlatRange {
 /* Flattened global view of current active memory hierarchy.  Kept in sorted
  * order.
  */
+/* Address spaces whose roots render the same share one FlatView, together
+ * with the dispatch built from it.  The sections of the dispatch and its
+ * subpages refer to @as, which is private to the view, so that they remain
+ * valid no matter which of the sharing address spaces goes away first.
+ */
 struct FlatView {
     struct rcu_head rcu;
     unsigned ref;
     FlatRange *ranges;
     unsigned nr;
     unsigned nr_allocated;
+    AddressSpaceDispatch *dispatch;
+    AddressSpace as;
 };
 
 typedef struct AddressSpaceOps AddressSpaceOps;
@@ -257,12 +264,33 @@ static bool flatrange_equal(FlatRange *a, FlatRange *b)
         && a->readonly == b->readonly;
 }
 
+static bool flatview_equal(FlatView *a, FlatView *b)
+{
+    unsigned i;
+
+    if (a->nr != b->nr) {
+        return false;
+    }
+    for (i = 0; i < a->nr; i++) {
+        if (!flatrange_equal(&a->ranges[i], &b->ranges[i])
+            || a->ranges[i].dirty_log_mask != b->ranges[i].dirty_log_mask) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static void flatview_init(FlatView *view)
 {
     view->ref = 1;
     view->ranges = NULL;
     view->nr = 0;
     view->nr_allocated = 0;
+    view->dispatch = NULL;
+    memset(&view->as, 0, sizeof(view->as));
+    view->as.ref_count = 1;
+    view->as.current_map = view;
+    QTAILQ_INIT(&view->as.listeners);
 }
 
 /* Insert a range into a given position.  Caller is responsible for maintaining
@@ -289,6 +317,9 @@ static void flatview_destroy(FlatView *view)
     for (i = 0; i < view->nr; i++) {
         memory_region_unref(view->ranges[i].mr);
     }
+    if (view->dispatch) {
+        address_space_dispatch_free(view->dispatch);
+    }
     g_free(view->ranges);
     g_free(view);
 }
@@ -700,10 +731,12 @@ static void render_memory_region(FlatView *view,
     }
 }
 
-/* Render a memory topology into a list of disjoint absolute ranges. */
+/* Render a memory topology into a list of disjoint absolute ranges, and
+ * build the dispatch for it. */
 static FlatView *generate_memory_topology(MemoryRegion *mr)
 {
     FlatView *view;
+    FlatRange *fr;
 
     view = g_new(FlatView, 1);
     flatview_init(view);
@@ -714,9 +747,63 @@ static FlatView *generate_memory_topology(MemoryRegion *mr)
     }
     flatview_simplify(view);
 
+    view->as.root = mr;
+    view->dispatch = address_space_dispatch_new(&view->as);
+    FOR_EACH_FLAT_RANGE(fr, view) {
+        MemoryRegionSection mrs = section_from_flat_range(fr, &view->as);
+        address_space_dispatch_add(view->dispatch, &mrs);
+    }
+    address_space_dispatch_compact(view->dispatch);
+
     return view;
 }
 
+/* Skip containers with a single enabled child and aliases that cover their
+ * whole target at offset zero, since they render the same as what they
+ * contain.  This is what lets e.g. all PCI bus master address spaces, whose
+ * roots are distinct containers aliasing the same memory, share a view.
+ * Returns NULL if nothing is visible at all.
+ */
+static MemoryRegion *memory_region_get_flatview_root(MemoryRegion *mr)
+{
+    while (mr && mr->enabled) {
+        if (mr->alias) {
+            if (!mr->alias_offset && !mr->readonly
+                && int128_ge(mr->size, mr->alias->size)) {
+                mr = mr->alias;
+                continue;
+            }
+        } else if (!mr->terminates) {
+            MemoryRegion *child, *next = NULL;
+            unsigned int found = 0;
+
+            QTAILQ_FOREACH(child, &mr->subregions, subregions_link) {
+                if (child->enabled) {
+                    if (++found > 1) {
+                        next = NULL;
+                        break;
+                    }
+                    if (!child->addr && !mr->readonly
+                        && int128_ge(mr->size, child->size)) {
+                        next = child;
+                    }
+                }
+            }
+            if (found == 0) {
+                return NULL;
+            }
+            if (next) {
+                mr = next;
+                continue;
+            }
+        }
+
+        return mr;
+    }
+
+    return NULL;
+}
+
 static void address_space_add_del_ioeventfds(AddressSpace *as,
                                              MemoryRegionIoeventfd *fds_new,
                                              unsigned fds_new_nb,
@@ -777,6 +864,11 @@ static FlatView *address_space_get_flatview(AddressSpace *as)
     return view;
 }
 
+AddressSpaceDispatch *address_space_to_dispatch(AddressSpace *as)
+{
+    return atomic_rcu_read(&as->current_map)->dispatch;
+}
+
 static void address_space_update_ioeventfds(AddressSpace *as)
 {
     FlatView *view;
@@ -879,11 +971,49 @@ static void address_space_update_topology_pass(AddressSpace *as,
 }
 
 
+/* Point as->next_map to the new topology of @as, leaving it NULL if
+ * nothing in this address space has changed.  @views holds the views
+ * rendered so far in this transaction, keyed by their root.  */
+static bool address_space_prepare_topology(AddressSpace *as,
+                                           GHashTable *views)
+{
+    MemoryRegion *root = memory_region_get_flatview_root(as->root);
+    FlatView *new_view = g_hash_table_lookup(views, root);
+
+    if (!new_view) {
+        new_view = generate_memory_topology(root);
+        g_hash_table_insert(views, root, new_view);
+    }
+    if (flatview_equal(as->current_map, new_view)) {
+        return false;
+    }
+    flatview_ref(new_view);
+    as->next_map = new_view;
+    return true;
+}
+
+/* Only the listeners of address spaces whose topology changed see the
+ * transaction; the others, including their dispatch, are left untouched.  */
+static void memory_listener_call_changed(bool commit)
+{
+    MemoryListener *listener;
+
+    QTAILQ_FOREACH(listener, &memory_listeners, link) {
+        void (*fn)(MemoryListener *) = commit ? listener->commit
+                                              : listener->begin;
+
+        if (fn && listener->address_space->next_map) {
+            fn(listener);
+        }
+    }
+}
+
 static void address_space_update_topology(AddressSpace *as)
 {
     FlatView *old_view = address_space_get_flatview(as);
-    FlatView *new_view = generate_memory_topology(as->root);
+    FlatView *new_view = as->next_map;
 
+    flatview_ref(new_view);
     address_space_update_topology_pass(as, old_view, new_view, false);
     address_space_update_topology_pass(as, old_view, new_view, true);
 
@@ -917,18 +1047,40 @@ static void memory_region_clear_pending(void)
 void memory_region_transaction_commit(void)
 {
     AddressSpace *as;
+    bool changed = false;
 
     assert(memory_region_transaction_depth);
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth) {
         if (memory_region_update_pending) {
-            MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
+            GHashTable *views;
 
+            views = g_hash_table_new_full(NULL, NULL, NULL,
+                                          (GDestroyNotify) flatview_unref);
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
-                address_space_update_topology(as);
+                changed |= address_space_prepare_topology(as, views);
             }
+            g_hash_table_destroy(views);
 
-            MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
+            if (changed) {
+                memory_listener_call_changed(false);
+            }
+            QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+                if (as->next_map) {
+                    address_space_update_topology(as);
+                } else if (ioeventfd_update_pending) {
+                    address_space_update_ioeventfds(as);
+                }
+            }
+            if (changed) {
+                memory_listener_call_changed(true);
+                QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+                    if (as->next_map) {
+                        flatview_unref(as->next_map);
+                        as->next_map = NULL;
+                    }
+                }
+            }
         } else if (ioeventfd_update_pending) {
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
                 address_space_update_ioeventfds(as);
@@ -2380,14 +2532,13 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
     as->ref_count = 1;
     as->root = root;
     as->malloced = false;
-    as->current_map = g_new(FlatView, 1);
-    flatview_init(as->current_map);
+    as->current_map = generate_memory_topology(NULL);
+    as->next_map = NULL;
     as->ioeventfd_nb = 0;
     as->ioeventfds = NULL;
     QTAILQ_INIT(&as->listeners);
     QTAILQ_INSERT_TAIL(&address_spaces, as, address_spaces_link);
     as->name = g_strdup(name ? name : "anonymous");
-    address_space_init_dispatch(as);
     memory_region_update_pending |= root->enabled;
     memory_region_transaction_commit();
 }
@@ -2396,7 +2547,6 @@ static void do_address_space_destroy(AddressSpace *as)
 {
     bool do_free = as->malloced;
 
-    address_space_destroy_dispatch(as);
     assert(QTAILQ_EMPTY(&as->listeners));
 
     flatview_unref(as->current_map);
@@ -2438,11 +2588,10 @@ void address_space_destroy(AddressSpace *as)
     as->root = NULL;
     memory_region_transaction_commit();
     QTAILQ_REMOVE(&address_spaces, as, address_spaces_link);
-    address_space_unregister(as);
 
-    /* At this point, as->dispatch and as->current_map are dummy
-     * entries that the guest should never use.  Wait for the old
-     * values to expire before freeing the data.
+    /* At this point, as->current_map is a dummy
+     * entry that the guest should never use.  Wait for the old
+     * value to expire before freeing the data.
      */
     as->root = root;
     call_rcu(as, do_address_space_destroy, rcu);
@@ -518,6 +518,18 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
     int ret = -EIO;
 
     for (sector = bmds->cur_dirty; sector < bmds->total_sectors;) {
+        uint64_t area = sector, count = total_sectors - sector;
+
+        /* Skip clean chunks in bulk.  The bitmap granularity is a chunk,
+         * so this lands on the start of one. */
+        if (!bdrv_dirty_bitmap_next_dirty_area(bmds->dirty_bitmap,
+                                               &area, &count)) {
+            bmds->cur_dirty = total_sectors;
+            break;
+        }
+        sector = QEMU_ALIGN_DOWN(area, BDRV_SECTORS_PER_DIRTY_CHUNK);
+        bmds->cur_dirty = sector;
+
         blk_mig_lock();
         if (bmds_aio_inflight(bmds, sector)) {
             blk_mig_unlock();
@@ -428,6 +428,17 @@ void *colo_process_incoming_thread(void *opaque)
      */
     qemu_file_set_blocking(mis->from_src_file, true);
 
+    /* Pages sent on the x-multifd channels must not reach guest RAM before
+     * the rest of their checkpoint */
+    if (migrate_use_multifd()) {
+        qemu_mutex_lock_iothread();
+        if (colo_init_ram_cache() < 0) {
+            qemu_mutex_unlock_iothread();
+            goto out;
+        }
+        qemu_mutex_unlock_iothread();
+    }
+
     bioc = qio_channel_buffer_new(COLO_BUFFER_BASE_SIZE);
     fb = qemu_fopen_channel_input(QIO_CHANNEL(bioc));
     object_unref(OBJECT(bioc));
@@ -501,6 +512,9 @@ void *colo_process_incoming_thread(void *opaque)
             qemu_mutex_unlock_iothread();
             goto out;
         }
+        if (migrate_use_multifd()) {
+            colo_flush_ram_cache();
+        }
         qemu_mutex_unlock_iothread();
 
         colo_send_message(mis->to_src_file, COLO_MESSAGE_VMSTATE_LOADED,
@@ -68,6 +68,12 @@
  */
 #define DEFAULT_MIGRATE_X_CHECKPOINT_DELAY 200
 
+/* Number of connections for RAM pages with x-multifd */
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+/* Host pages requested after a postcopy fault; 0 requests only the fault */
+#define DEFAULT_MIGRATE_POSTCOPY_PREFETCH 0
+#define MAX_MIGRATE_POSTCOPY_PREFETCH 1024
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -101,6 +107,9 @@ MigrationState *migrate_get_current(void)
             .max_bandwidth = MAX_THROTTLE,
             .downtime_limit = DEFAULT_MIGRATE_SET_DOWNTIME,
             .x_checkpoint_delay = DEFAULT_MIGRATE_X_CHECKPOINT_DELAY,
+            .x_multifd_channels = DEFAULT_MIGRATE_MULTIFD_CHANNELS,
+            .x_multifd_compression = MULTIFD_COMPRESSION_NONE,
+            .x_postcopy_prefetch = DEFAULT_MIGRATE_POSTCOPY_PREFETCH,
         },
     };
 
@@ -391,6 +400,11 @@ static void process_incoming_migration_co(void *opaque)
     migrate_set_state(&mis->state, MIGRATION_STATUS_NONE,
                       MIGRATION_STATUS_ACTIVE);
     ret = qemu_loadvm_state(f);
+    /* All pages on the other channels have been placed by now; COLO keeps
+     * using the channels for its checkpoints */
+    if (ret < 0 || !migration_incoming_enable_colo()) {
+        multifd_recv_threads_join();
+    }
 
     ps = postcopy_state_get();
     trace_process_incoming_migration_co_end(ret, ps);
@@ -423,6 +437,8 @@ static void process_incoming_migration_co(void *opaque)
 
         /* Wait checkpoint incoming thread exit before free resource */
         qemu_thread_join(&mis->colo_incoming_thread);
+        multifd_recv_threads_join();
+        colo_release_ram_cache();
     }
 
     qemu_fclose(f);
@@ -595,6 +611,12 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->downtime_limit = s->parameters.downtime_limit;
     params->has_x_checkpoint_delay = true;
     params->x_checkpoint_delay = s->parameters.x_checkpoint_delay;
+    params->has_x_multifd_channels = true;
+    params->x_multifd_channels = s->parameters.x_multifd_channels;
+    params->has_x_multifd_compression = true;
+    params->x_multifd_compression = s->parameters.x_multifd_compression;
+    params->has_x_postcopy_prefetch = true;
+    params->x_postcopy_prefetch = s->parameters.x_postcopy_prefetch;
 
     return params;
 }
@@ -798,6 +820,18 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
                 false;
         }
     }
+
+    if (migrate_use_multifd()) {
+        /* The pages on the other connections are not seen by the code that
+         * handles these on the main stream */
+        if (migrate_use_xbzrle() || migrate_use_compression() ||
+            migrate_postcopy_ram()) {
+            error_report("x-multifd is not compatible with xbzrle, compress "
+                         "or postcopy-ram; use x-multifd-compression to "
+                         "compress its pages");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD] = false;
+        }
+    }
 }
 
 void qmp_migrate_set_parameters(MigrationParameters *params, Error **errp)
@@ -858,6 +892,35 @@ void qmp_migrate_set_parameters(MigrationParameters *params, Error **errp)
                     "x_checkpoint_delay",
                     "is invalid, it should be positive");
     }
+    if (params->has_x_multifd_channels &&
+        (params->x_multifd_channels < 1 || params->x_multifd_channels > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_multifd_channels",
+                   "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (params->has_x_postcopy_prefetch &&
+        (params->x_postcopy_prefetch < 0 ||
+         params->x_postcopy_prefetch > MAX_MIGRATE_POSTCOPY_PREFETCH)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_postcopy_prefetch",
+                   "is invalid, it should be in the range of 0 to 1024");
+        return;
+    }
+#ifndef CONFIG_LZ4
+    if (params->has_x_multifd_compression &&
+        params->x_multifd_compression == MULTIFD_COMPRESSION_LZ4) {
+        error_setg(errp, "lz4 is not supported by this QEMU binary");
+        return;
+    }
+#endif
+#ifndef CONFIG_ZSTD
+    if (params->has_x_multifd_compression &&
+        params->x_multifd_compression == MULTIFD_COMPRESSION_ZSTD) {
+        error_setg(errp, "zstd is not supported by this QEMU binary");
+        return;
+    }
+#endif
 
     if (params->has_compress_level) {
         s->parameters.compress_level = params->compress_level;
@@ -896,6 +959,15 @@ void qmp_migrate_set_parameters(MigrationParameters *params, Error **errp)
     if (params->has_x_checkpoint_delay) {
         s->parameters.x_checkpoint_delay = params->x_checkpoint_delay;
     }
+    if (params->has_x_multifd_channels) {
+        s->parameters.x_multifd_channels = params->x_multifd_channels;
+    }
+    if (params->has_x_multifd_compression) {
+        s->parameters.x_multifd_compression = params->x_multifd_compression;
+    }
+    if (params->has_x_postcopy_prefetch) {
+        s->parameters.x_postcopy_prefetch = params->x_postcopy_prefetch;
+    }
 }
 
 
@@ -950,6 +1022,7 @@ static void migrate_fd_cleanup(void *opaque)
         qemu_mutex_lock_iothread();
 
         migrate_compress_threads_join();
+        multifd_send_threads_join();
         qemu_fclose(s->to_dst_file);
         s->to_dst_file = NULL;
     }
@@ -987,6 +1060,7 @@ static void migrate_fd_cancel(MigrationState *s)
         /* shutdown the rp socket, so causing the rp thread to shutdown */
         qemu_file_shutdown(s->rp_state.from_dst_file);
     }
+    multifd_send_shutdown();
 
     do {
         old_state = s->state;
@@ -1079,6 +1153,8 @@ MigrationState *migrate_init(const MigrationParams *params)
     migrate_set_state(&s->state, MIGRATION_STATUS_NONE, MIGRATION_STATUS_SETUP);
 
     QSIMPLEQ_INIT(&s->src_page_requests);
+    QSIMPLEQ_INIT(&s->src_page_prefetch_requests);
+    s->src_page_prefetch_count = 0;
 
     s->total_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     return s;
@@ -1160,6 +1236,17 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (migrate_use_multifd()) {
+        if (!strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+            error_setg(errp, "x-multifd requires a tcp or unix migration URI");
+            return;
+        }
+        if (s->parameters.tls_creds && *s->parameters.tls_creds) {
+            error_setg(errp, "x-multifd does not support TLS");
+            return;
+        }
+    }
+
     s = migrate_init(&params);
 
     if (strstart(uri, "tcp:", &p)) {
@@ -1314,6 +1401,42 @@ int migrate_decompress_threads(void)
     return s->parameters.decompress_threads;
 }
 
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_multifd_channels;
+}
+
+MultifdCompression migrate_multifd_compression(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_multifd_compression;
+}
+
+int migrate_postcopy_prefetch(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_postcopy_prefetch;
+}
+
 bool migrate_use_events(void)
 {
     MigrationState *s;
@@ -1870,7 +1993,20 @@ static void *migration_thread(void *opaque)
                                          initial_bytes;
             uint64_t time_spent = current_time - initial_time;
             double bandwidth = (double)transferred_bytes / time_spent;
+            uint64_t device_size;
+
+            /*
+             * The device state is sent after the last RAM pass while the
+             * VM is stopped, so leave room for it in the downtime budget;
+             * keep at least half of the budget for RAM so that guests
+             * with large device state still converge.
+             */
+            qemu_mutex_lock_iothread();
+            device_size = qemu_savevm_state_device_size();
+            qemu_mutex_unlock_iothread();
             max_size = bandwidth * s->parameters.downtime_limit;
+            max_size -= MIN(device_size, (uint64_t)max_size / 2);
+            trace_migrate_device_state(device_size, max_size);
 
             s->mbps = (((double) transferred_bytes * 8.0) /
                     ((double) time_spent / 1000.0)) / 1000.0 / 1000.0;
@@ -1880,7 +2016,8 @@ static void *migration_thread(void *opaque)
             /* if we haven't sent anything, we don't want to recalculate
                10000 is a small enough number for our purposes */
             if (s->dirty_bytes_rate && transferred_bytes > 10000) {
-                s->expected_downtime = s->dirty_bytes_rate / bandwidth;
+                s->expected_downtime = (s->dirty_bytes_rate + device_size) /
+                                       bandwidth;
             }
 
             qemu_file_reset_rate_limit(s->to_dst_file);
@@ -1944,6 +2081,8 @@ static void *migration_thread(void *opaque)
 
 void migrate_fd_connect(MigrationState *s)
 {
+    Error *local_err = NULL;
+
     s->expected_downtime = s->parameters.downtime_limit;
     s->cleanup_bh = qemu_bh_new(migrate_fd_cleanup, s);
 
@@ -1968,6 +2107,14 @@ void migrate_fd_connect(MigrationState *s)
         }
     }
 
+    if (multifd_send_threads_create(&local_err) < 0) {
+        error_report_err(local_err);
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        migrate_fd_cleanup(s);
+        return;
+    }
+
     migrate_compress_threads_create();
     qemu_thread_create(&s->thread, "migration", migration_thread, s,
                        QEMU_THREAD_JOINABLE);
@@ -423,6 +423,10 @@ static void *postcopy_ram_fault_thread(void *opaque)
     size_t hostpagesize = getpagesize();
     RAMBlock *rb = NULL;
     RAMBlock *last_rb = NULL; /* last RAMBlock we sent part of */
+    /* Area of last_rb that has been requested ahead of faults */
+    ram_addr_t prefetch_start = 0, prefetch_end = 0;
+    ram_addr_t prefetch_len = (ram_addr_t)migrate_postcopy_prefetch() *
+                              hostpagesize;
 
     trace_postcopy_ram_fault_thread_entry();
     qemu_sem_post(&mis->fault_thread_sem);
@@ -498,6 +502,7 @@ static void *postcopy_ram_fault_thread(void *opaque)
          */
         if (rb != last_rb) {
             last_rb = rb;
+            prefetch_start = prefetch_end = 0;
             migrate_send_rp_req_pages(mis, qemu_ram_get_idstr(rb),
                                      rb_offset, hostpagesize);
         } else {
@@ -505,6 +510,31 @@ static void *postcopy_ram_fault_thread(void *opaque)
             migrate_send_rp_req_pages(mis, NULL,
                                      rb_offset, hostpagesize);
         }
+
+        /*
+         * Then ask for the pages that follow, which the source sends
+         * after the pages that faulted.  A fault in the window requested
+         * before only extends it, once half of it has been used up.
+         */
+        if (prefetch_len) {
+            ram_addr_t start = rb_offset + hostpagesize;
+            ram_addr_t end = MIN(start + prefetch_len,
+                                 qemu_ram_get_used_length(rb));
+
+            if (rb_offset >= prefetch_start && rb_offset < prefetch_end) {
+                if (prefetch_end - start > prefetch_len / 2) {
+                    continue;
+                }
+                start = prefetch_end;
+            }
+            if (end > start) {
+                trace_postcopy_ram_fault_thread_prefetch(qemu_ram_get_idstr(rb),
+                                                         start, end - start);
+                migrate_send_rp_req_pages(mis, NULL, start, end - start);
+                prefetch_start = rb_offset;
+                prefetch_end = end;
+            }
+        }
     }
     trace_postcopy_ram_fault_thread_exit();
     return NULL;
@@ -29,6 +29,12 @@
 #include "qemu-common.h"
 #include "cpu.h"
 #include <zlib.h>
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
 #include "qapi-event.h"
 #include "qemu/cutils.h"
 #include "qemu/bitops.h"
@@ -44,6 +50,7 @@
 #include "exec/ram_addr.h"
 #include "qemu/rcu_queue.h"
 #include "migration/colo.h"
+#include "io/channel.h"
 
 #ifdef DEBUG_MIGRATION_RAM
 #define DPRINTF(fmt, ...) \
@@ -60,7 +67,8 @@ static uint64_t bitmap_sync_count;
 /***********************************************************/
 /* ram save/restore */
 
-#define RAM_SAVE_FLAG_FULL     0x01 /* Obsolete, not used anymore */
+/* 0x01 was RAM_SAVE_FLAG_FULL, which has not been sent for a long time */
+#define RAM_SAVE_FLAG_MAPPED   0x01 /* RAM is in the image, not the stream */
 #define RAM_SAVE_FLAG_COMPRESS 0x02
 #define RAM_SAVE_FLAG_MEM_SIZE 0x04
 #define RAM_SAVE_FLAG_PAGE     0x08
@@ -69,6 +77,8 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+/* All pages sent so far on the x-multifd channels must be in place */
+#define RAM_SAVE_FLAG_MULTIFD_SYNC     0x200
 
 static uint8_t *ZERO_TARGET_PAGE;
 
@@ -424,11 +434,60 @@ static size_t save_page_header(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
  * migration. Some workloads dirty memory way too fast and will not effectively
  * converge, even with auto-converge.
  */
+/* Pages dirtied by @cpu since mig_vcpu_dirty_sample() last ran */
+static uint32_t mig_vcpu_dirty_pages(CPUState *cpu)
+{
+    return atomic_read(&cpu->dirty_pages) - cpu->dirty_pages_sampled;
+}
+
+static void mig_vcpu_dirty_sample(void)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        cpu->dirty_pages_sampled = atomic_read(&cpu->dirty_pages);
+    }
+}
+
+/* When the accelerator tells which vcpu dirtied a page, only the vcpus that
+ * dirtied at least their share of the pages are throttled, and the ones that
+ * dirty fastest are throttled hardest.  A single thread that keeps writing
+ * to memory then does not slow down the whole guest.
+ */
 static void mig_throttle_guest_down(void)
 {
     MigrationState *s = migrate_get_current();
     uint64_t pct_initial = s->parameters.cpu_throttle_initial;
     uint64_t pct_icrement = s->parameters.cpu_throttle_increment;
+    uint64_t total_dirty = 0;
+    uint32_t max_dirty = 0;
+    int nr_vcpus = 0;
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        uint32_t dirty = mig_vcpu_dirty_pages(cpu);
+
+        total_dirty += dirty;
+        max_dirty = MAX(max_dirty, dirty);
+        nr_vcpus++;
+    }
+
+    if (max_dirty) {
+        CPU_FOREACH(cpu) {
+            uint32_t dirty = mig_vcpu_dirty_pages(cpu);
+            int pct = atomic_read(&cpu->throttle_percentage);
+            uint64_t step = pct ? pct_icrement : pct_initial;
+
+            if ((uint64_t)dirty * nr_vcpus < total_dirty) {
+                continue;
+            }
+            pct += DIV_ROUND_UP(step * dirty, max_dirty);
+            cpu_throttle_set_vcpu(cpu, pct);
+            trace_migration_throttle_vcpu(cpu->cpu_index, dirty,
+                                          cpu_throttle_get_vcpu_percentage(cpu));
+        }
+        return;
+    }
 
     /* We have not started throttling yet. Let's start it. */
     if (!cpu_throttle_active()) {
@@ -574,16 +633,62 @@ static inline bool migration_bitmap_clear_dirty(ram_addr_t addr)
 {
     bool ret;
     int nr = addr >> TARGET_PAGE_BITS;
-    unsigned long *bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+    unsigned long *bitmap;
 
+    /* against qemu_guest_free_page_hint() in the main thread */
+    qemu_mutex_lock(&migration_bitmap_mutex);
+    bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
     ret = test_and_clear_bit(nr, bitmap);
 
     if (ret) {
         migration_dirty_pages--;
     }
+    qemu_mutex_unlock(&migration_bitmap_mutex);
     return ret;
 }
 
+/*
+ * Pages the guest hints are free are cleared from the migration bitmap, so
+ * that they are not sent.  Should the guest write them again, the dirty log
+ * sets them again at the next sync.  Postcopy tracks what was sent in the
+ * unsentmap as well, so hints are only taken before it starts.
+ */
+void qemu_guest_free_page_hint(void *addr, size_t len)
+{
+    struct BitmapRcu *bitmap;
+    RAMBlock *block;
+    ram_addr_t offset;
+    size_t used_len;
+    unsigned long start, npages, i;
+
+    rcu_read_lock();
+    bitmap = atomic_rcu_read(&migration_bitmap_rcu);
+    if (!bitmap || migration_in_postcopy(migrate_get_current())) {
+        rcu_read_unlock();
+        return;
+    }
+
+    for (; len > 0; len -= used_len, addr += used_len) {
+        block = qemu_ram_block_from_host(addr, false, &offset);
+        if (!block || offset >= block->used_length) {
+            break;
+        }
+        used_len = MIN(len, block->used_length - offset);
+        start = (block->offset + offset) >> TARGET_PAGE_BITS;
+        npages = used_len >> TARGET_PAGE_BITS;
+
+        qemu_mutex_lock(&migration_bitmap_mutex);
+        bitmap = atomic_rcu_read(&migration_bitmap_rcu);
+        for (i = start; i < start + npages; i++) {
+            if (test_and_clear_bit(i, bitmap->bmap)) {
+                migration_dirty_pages--;
+            }
+        }
+        qemu_mutex_unlock(&migration_bitmap_mutex);
+    }
+    rcu_read_unlock();
+}
+
 static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
 {
     unsigned long *bitmap;
@@ -592,6 +697,130 @@ static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
         cpu_physical_memory_sync_dirty_bitmap(bitmap, start, length);
 }
 
+/*
+ * Merging the dirty log of a guest with terabytes of RAM takes long enough
+ * to be worth splitting the RAMBlocks in chunks for several threads.  The
+ * chunks start and end on a word of the bitmaps, so that threads never
+ * update the same word; RAMBlocks that are not aligned like that are merged
+ * by the migration thread once the others are done.
+ */
+#define BITMAP_SYNC_CHUNK       ((ram_addr_t)1 << 30)
+#define BITMAP_SYNC_MIN_CHUNKS  16
+#define BITMAP_SYNC_MAX_THREADS 8
+#define BITMAP_SYNC_ALIGN       ((ram_addr_t)BITS_PER_LONG << TARGET_PAGE_BITS)
+
+typedef struct BitmapSyncChunk {
+    ram_addr_t start;
+    ram_addr_t length;
+} BitmapSyncChunk;
+
+typedef struct BitmapSyncJob {
+    unsigned long *bitmap;
+    BitmapSyncChunk *chunks;
+    int nr_chunks;
+    int next_chunk;
+} BitmapSyncJob;
+
+typedef struct BitmapSyncWorker {
+    QemuThread thread;
+    BitmapSyncJob *job;
+    uint64_t num_dirty;
+} BitmapSyncWorker;
+
+static uint64_t bitmap_sync_do_chunks(BitmapSyncJob *job)
+{
+    uint64_t num_dirty = 0;
+    int i;
+
+    while ((i = atomic_fetch_inc(&job->next_chunk)) < job->nr_chunks) {
+        num_dirty += cpu_physical_memory_sync_dirty_bitmap(job->bitmap,
+                                                           job->chunks[i].start,
+                                                           job->chunks[i].length);
+    }
+    return num_dirty;
+}
+
+static void *bitmap_sync_thread(void *opaque)
+{
+    BitmapSyncWorker *worker = opaque;
+
+    rcu_register_thread();
+    worker->num_dirty = bitmap_sync_do_chunks(worker->job);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static bool bitmap_sync_block_aligned(RAMBlock *block)
+{
+    return QEMU_IS_ALIGNED(block->offset, BITMAP_SYNC_ALIGN) &&
+           QEMU_IS_ALIGNED(block->used_length, BITMAP_SYNC_ALIGN);
+}
+
+/* Called with migration_bitmap_mutex and the RCU read lock held */
+static void migration_bitmap_sync_blocks(void)
+{
+    BitmapSyncJob job = {};
+    BitmapSyncWorker *workers;
+    RAMBlock *block;
+    int nr_threads, i;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (bitmap_sync_block_aligned(block)) {
+            job.nr_chunks += DIV_ROUND_UP(block->used_length,
+                                          BITMAP_SYNC_CHUNK);
+        }
+    }
+
+    if (job.nr_chunks < BITMAP_SYNC_MIN_CHUNKS) {
+        QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+            migration_bitmap_sync_range(block->offset, block->used_length);
+        }
+        return;
+    }
+
+    job.bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+    job.chunks = g_new(BitmapSyncChunk, job.nr_chunks);
+    i = 0;
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        ram_addr_t pos;
+
+        if (!bitmap_sync_block_aligned(block)) {
+            continue;
+        }
+        for (pos = 0; pos < block->used_length; pos += BITMAP_SYNC_CHUNK) {
+            job.chunks[i].start = block->offset + pos;
+            job.chunks[i].length = MIN(BITMAP_SYNC_CHUNK,
+                                       block->used_length - pos);
+            i++;
+        }
+    }
+
+    /* The migration thread works on chunks as well */
+    nr_threads = MIN(job.nr_chunks / BITMAP_SYNC_MIN_CHUNKS,
+                     BITMAP_SYNC_MAX_THREADS);
+    workers = g_new0(BitmapSyncWorker, nr_threads);
+    for (i = 0; i < nr_threads; i++) {
+        workers[i].job = &job;
+        qemu_thread_create(&workers[i].thread, "bitmapsync",
+                           bitmap_sync_thread, &workers[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    migration_dirty_pages += bitmap_sync_do_chunks(&job);
+    for (i = 0; i < nr_threads; i++) {
+        qemu_thread_join(&workers[i].thread);
+        migration_dirty_pages += workers[i].num_dirty;
+    }
+    trace_migration_bitmap_sync_parallel(job.nr_chunks, nr_threads);
+    g_free(workers);
+    g_free(job.chunks);
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (!bitmap_sync_block_aligned(block)) {
+            migration_bitmap_sync_range(block->offset, block->used_length);
+        }
+    }
+}
+
 /* Fix me: there are too many global variables used in migration process. */
 static int64_t start_time;
 static int64_t bytes_xfer_prev;
@@ -606,15 +835,16 @@ static void migration_bitmap_sync_init(void)
     num_dirty_pages_period = 0;
     xbzrle_cache_miss_prev = 0;
     iterations_prev = 0;
+    mig_vcpu_dirty_sample();
 }
 
 static void migration_bitmap_sync(void)
 {
-    RAMBlock *block;
     uint64_t num_dirty_pages_init = migration_dirty_pages;
     MigrationState *s = migrate_get_current();
     int64_t end_time;
     int64_t bytes_xfer_now;
+    int64_t xfer_rate, dirty_rate, remaining_ms;
 
     bitmap_sync_count++;
 
@@ -631,9 +861,7 @@ static void migration_bitmap_sync(void)
 
     qemu_mutex_lock(&migration_bitmap_mutex);
     rcu_read_lock();
-    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-        migration_bitmap_sync_range(block->offset, block->used_length);
-    }
+    migration_bitmap_sync_blocks();
     rcu_read_unlock();
     qemu_mutex_unlock(&migration_bitmap_mutex);
 
@@ -652,6 +880,20 @@ static void migration_bitmap_sync(void)
                throttling */
             bytes_xfer_now = ram_bytes_transferred();
 
+            /* Predict when the remaining pages are sent if the guest keeps
+             * dirtying memory at the rate of the last period */
+            xfer_rate = (bytes_xfer_now - bytes_xfer_prev) * 1000
+                        / (end_time - start_time);
+            dirty_rate = num_dirty_pages_period * TARGET_PAGE_SIZE * 1000
+                         / (end_time - start_time);
+            remaining_ms = -1;
+            if (xfer_rate > dirty_rate) {
+                remaining_ms = migration_dirty_pages * TARGET_PAGE_SIZE * 1000
+                               / (xfer_rate - dirty_rate);
+            }
+            trace_migration_converge_predict(xfer_rate, dirty_rate,
+                                             remaining_ms);
+
             if (s->dirty_pages_rate &&
                (num_dirty_pages_period * TARGET_PAGE_SIZE >
                    (bytes_xfer_now - bytes_xfer_prev)/2) &&
@@ -678,6 +920,7 @@ static void migration_bitmap_sync(void)
         s->dirty_bytes_rate = s->dirty_pages_rate * TARGET_PAGE_SIZE;
         start_time = end_time;
         num_dirty_pages_period = 0;
+        mig_vcpu_dirty_sample();
     }
     s->dirty_sync_count = bitmap_sync_count;
     if (migrate_use_events()) {
@@ -907,155 +1150,896 @@ static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
  * @last_stage: if we are at the completion stage
  * @bytes_transferred: increase it with the number of transferred bytes
  */
-static int ram_save_compressed_page(QEMUFile *f, PageSearchStatus *pss,
-                                    bool last_stage,
-                                    uint64_t *bytes_transferred)
-{
-    int pages = -1;
-    uint64_t bytes_xmit = 0;
-    uint8_t *p;
-    int ret, blen;
-    RAMBlock *block = pss->block;
-    ram_addr_t offset = pss->offset;
+/* Multiple channels for RAM pages (x-multifd)
+ *
+ * Every channel is a connection of its own with a thread at each end.  The
+ * migration thread gathers the normal pages of one RAMBlock into a packet
+ * and hands it to an idle channel; everything else still goes through the
+ * main stream.  A channel starts with a header:
+ *
+ *   be32 MULTIFD_MAGIC, be32 MULTIFD_VERSION, be32 channel index,
+ *   be32 MultifdCompression
+ *
+ * followed by packets that start with a be32 type.  MULTIFD_PACKET_PAGES is
+ * followed by a be32 page count, the RAMBlock idstr (length byte and name),
+ * a be64 offset for every page and then the page data.  With compression,
+ * the page data is replaced by a be32 length and that many bytes of
+ * compressed data, which the channel thread produces straight from guest
+ * memory.  MULTIFD_PACKET_SYNC has no payload.
+ *
+ * The same page may be sent several times on different channels, so at the
+ * end of every round the source sends a SYNC packet on every channel and
+ * RAM_SAVE_FLAG_MULTIFD_SYNC on the main stream.  The destination does not
+ * go past that flag until all channels have reached their SYNC, and the
+ * channels wait there until it does.
+ */
 
-    p = block->host + offset;
+#define MULTIFD_MAGIC 0x514d4644 /* "QMFD" */
+#define MULTIFD_VERSION 1
+#define MULTIFD_MAX_CHANNELS 255
+#define MULTIFD_PACKET_MAX_PAGES 64
 
-    ret = ram_control_save_page(f, block->offset,
-                                offset, TARGET_PAGE_SIZE, &bytes_xmit);
-    if (bytes_xmit) {
-        *bytes_transferred += bytes_xmit;
-        pages = 1;
-    }
-    if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
-        if (ret != RAM_SAVE_CONTROL_DELAYED) {
-            if (bytes_xmit > 0) {
-                acct_info.norm_pages++;
-            } else if (bytes_xmit == 0) {
-                acct_info.dup_pages++;
-            }
-        }
-    } else {
-        /* When starting the process of a new block, the first page of
-         * the block should be sent out before other pages in the same
-         * block, and all the pages in last block should have been sent
-         * out, keeping this order is important, because the 'cont' flag
-         * is used to avoid resending the block name.
-         */
-        if (block != last_sent_block) {
-            flush_compressed_data(f);
-            pages = save_zero_page(f, block, offset, p, bytes_transferred);
-            if (pages == -1) {
-                /* Make sure the first page is sent out before other pages */
-                bytes_xmit = save_page_header(f, block, offset |
-                                              RAM_SAVE_FLAG_COMPRESS_PAGE);
-                blen = qemu_put_compression_data(f, p, TARGET_PAGE_SIZE,
-                                                 migrate_compress_level());
-                if (blen > 0) {
-                    *bytes_transferred += bytes_xmit + blen;
-                    acct_info.norm_pages++;
-                    pages = 1;
-                } else {
-                    qemu_file_set_error(f, blen);
-                    error_report("compressed data failed!");
-                }
-            }
-        } else {
-            offset |= RAM_SAVE_FLAG_CONTINUE;
-            pages = save_zero_page(f, block, offset, p, bytes_transferred);
-            if (pages == -1) {
-                pages = compress_page_with_multi_thread(f, block, offset,
-                                                        bytes_transferred);
-            }
-        }
+#define MULTIFD_PACKET_PAGES 1
+#define MULTIFD_PACKET_SYNC 2
+
+typedef struct MultiFDPages {
+    RAMBlock *block;
+    int num;
+    ram_addr_t offset[MULTIFD_PACKET_MAX_PAGES];
+} MultiFDPages;
+
+struct MultiFDSendParam {
+    int id;
+    bool done;
+    bool quit;
+    bool sync;
+    QIOChannel *c;
+    QEMUFile *file;
+    QemuMutex mutex;
+    QemuCond cond;
+    MultiFDPages pages;
+    /* Bytes written since the migration thread last looked, under
+     * multifd_send.done_lock */
+    uint64_t bytes;
+    /* Compression state and output buffer */
+    void *data;
+    uint8_t *zbuf;
+    size_t zbuf_len;
+};
+typedef struct MultiFDSendParam MultiFDSendParam;
+
+struct MultiFDRecvParam {
+    QemuThread thread;
+    QIOChannel *c;
+    QEMUFile *file;
+    /* Number of SYNC packets seen, read by the main loop */
+    unsigned int synced;
+    /* Posted when the main stream has reached the same SYNC */
+    QemuSemaphore sem_sync;
+    /* Decompression state and input buffer */
+    const struct MultiFDMethods *ops;
+    void *data;
+    uint8_t *zbuf;
+    size_t zbuf_len;
+};
+typedef struct MultiFDRecvParam MultiFDRecvParam;
+
+/* Compression of the page data on a channel */
+typedef struct MultiFDMethods {
+    int (*send_setup)(MultiFDSendParam *p, Error **errp);
+    void (*send_cleanup)(MultiFDSendParam *p);
+    /* Compress the pages into p->zbuf; returns the length or -1 */
+    ssize_t (*send_prepare)(MultiFDSendParam *p, MultiFDPages *pages);
+    int (*recv_setup)(MultiFDRecvParam *p);
+    void (*recv_cleanup)(MultiFDRecvParam *p);
+    /* Decompress len bytes of p->zbuf into the num pages at host */
+    int (*recv_pages)(MultiFDRecvParam *p, uint8_t **host, int num,
+                      size_t len);
+} MultiFDMethods;
+
+static int zlib_send_setup(MultiFDSendParam *p, Error **errp)
+{
+    z_stream *zs = g_new0(z_stream, 1);
+
+    if (deflateInit(zs, migrate_compress_level()) != Z_OK) {
+        error_setg(errp, "multifd: deflateInit failed");
+        g_free(zs);
+        return -1;
     }
+    p->data = zs;
+    p->zbuf_len = compressBound(MULTIFD_PACKET_MAX_PAGES * TARGET_PAGE_SIZE);
+    p->zbuf = g_malloc(p->zbuf_len);
+    return 0;
+}
 
-    return pages;
+static void zlib_send_cleanup(MultiFDSendParam *p)
+{
+    deflateEnd(p->data);
+    g_free(p->data);
+    g_free(p->zbuf);
 }
 
-/*
- * Find the next dirty page and update any state associated with
- * the search process.
- *
- * Returns: True if a page is found
- *
- * @f: Current migration stream.
- * @pss: Data about the state of the current dirty page scan.
- * @*again: Set to false if the search has scanned the whole of RAM
- * *ram_addr_abs: Pointer into which to store the address of the dirty page
- *               within the global ram_addr space
- */
-static bool find_dirty_block(QEMUFile *f, PageSearchStatus *pss,
-                             bool *again, ram_addr_t *ram_addr_abs)
+static ssize_t zlib_send_prepare(MultiFDSendParam *p, MultiFDPages *pages)
 {
-    pss->offset = migration_bitmap_find_dirty(pss->block, pss->offset,
-                                              ram_addr_abs);
-    if (pss->complete_round && pss->block == last_seen_block &&
-        pss->offset >= last_offset) {
-        /*
-         * We've been once around the RAM and haven't found anything.
-         * Give up.
-         */
-        *again = false;
-        return false;
+    z_stream *zs = p->data;
+    int ret = Z_OK;
+    int i;
+
+    if (deflateReset(zs) != Z_OK) {
+        return -1;
     }
-    if (pss->offset >= pss->block->used_length) {
-        /* Didn't find anything in this RAM Block */
-        pss->offset = 0;
-        pss->block = QLIST_NEXT_RCU(pss->block, next);
-        if (!pss->block) {
-            /* Hit the end of the list */
-            pss->block = QLIST_FIRST_RCU(&ram_list.blocks);
-            /* Flag that we've looped */
-            pss->complete_round = true;
-            ram_bulk_stage = false;
-            if (migrate_use_xbzrle()) {
-                /* If xbzrle is on, stop using the data compression at this
-                 * point. In theory, xbzrle can do better than compression.
-                 */
-                flush_compressed_data(f);
-                compression_switch = false;
-            }
+    zs->next_out = p->zbuf;
+    zs->avail_out = p->zbuf_len;
+    for (i = 0; i < pages->num; i++) {
+        zs->next_in = pages->block->host + pages->offset[i];
+        zs->avail_in = TARGET_PAGE_SIZE;
+        ret = deflate(zs, i == pages->num - 1 ? Z_FINISH : Z_NO_FLUSH);
+        if ((ret != Z_OK && ret != Z_STREAM_END) || zs->avail_in) {
+            return -1;
         }
-        /* Didn't find anything this time, but try again on the new block */
-        *again = true;
-        return false;
-    } else {
-        /* Can go around again, but... */
-        *again = true;
-        /* We've found something so probably don't need to */
-        return true;
     }
+    if (ret != Z_STREAM_END) {
+        return -1;
+    }
+    return p->zbuf_len - zs->avail_out;
 }
 
-/*
- * Helper for 'get_queued_page' - gets a page off the queue
- *      ms:      MigrationState in
- * *offset:      Used to return the offset within the RAMBlock
- * ram_addr_abs: global offset in the dirty/sent bitmaps
- *
- * Returns:      block (or NULL if none available)
- */
-static RAMBlock *unqueue_page(MigrationState *ms, ram_addr_t *offset,
-                              ram_addr_t *ram_addr_abs)
+static int zlib_recv_setup(MultiFDRecvParam *p)
 {
-    RAMBlock *block = NULL;
+    z_stream *zs = g_new0(z_stream, 1);
 
-    qemu_mutex_lock(&ms->src_page_req_mutex);
-    if (!QSIMPLEQ_EMPTY(&ms->src_page_requests)) {
-        struct MigrationSrcPageRequest *entry =
-                                QSIMPLEQ_FIRST(&ms->src_page_requests);
-        block = entry->rb;
-        *offset = entry->offset;
-        *ram_addr_abs = (entry->offset + entry->rb->offset) &
-                        TARGET_PAGE_MASK;
+    if (inflateInit(zs) != Z_OK) {
+        g_free(zs);
+        return -1;
+    }
+    p->data = zs;
+    p->zbuf_len = compressBound(MULTIFD_PACKET_MAX_PAGES * TARGET_PAGE_SIZE);
+    p->zbuf = g_malloc(p->zbuf_len);
+    return 0;
+}
 
-        if (entry->len > TARGET_PAGE_SIZE) {
-            entry->len -= TARGET_PAGE_SIZE;
+static void zlib_recv_cleanup(MultiFDRecvParam *p)
+{
+    inflateEnd(p->data);
+    g_free(p->data);
+    g_free(p->zbuf);
+}
+
+static int zlib_recv_pages(MultiFDRecvParam *p, uint8_t **host, int num,
+                           size_t len)
+{
+    z_stream *zs = p->data;
+    int ret = Z_OK;
+    int i;
+
+    if (inflateReset(zs) != Z_OK) {
+        return -1;
+    }
+    zs->next_in = p->zbuf;
+    zs->avail_in = len;
+    for (i = 0; i < num; i++) {
+        zs->next_out = host[i];
+        zs->avail_out = TARGET_PAGE_SIZE;
+        while (zs->avail_out && ret == Z_OK) {
+            ret = inflate(zs, Z_NO_FLUSH);
+        }
+        if (zs->avail_out || (ret != Z_OK && ret != Z_STREAM_END)) {
+            return -1;
+        }
+    }
+    if (ret != Z_STREAM_END) {
+        /* The output ended right before the end of the stream */
+        ret = inflate(zs, Z_FINISH);
+    }
+    return ret == Z_STREAM_END && !zs->avail_in ? 0 : -1;
+}
+
+static const MultiFDMethods multifd_zlib_ops = {
+    .send_setup = zlib_send_setup,
+    .send_cleanup = zlib_send_cleanup,
+    .send_prepare = zlib_send_prepare,
+    .recv_setup = zlib_recv_setup,
+    .recv_cleanup = zlib_recv_cleanup,
+    .recv_pages = zlib_recv_pages,
+};
+
+#ifdef CONFIG_LZ4
+/* lz4 needs contiguous input, so every page is a block of its own that is
+ * preceded by its be32 compressed length */
+#define LZ4_ZBUF_LEN \
+    (MULTIFD_PACKET_MAX_PAGES * (4 + LZ4_COMPRESSBOUND(TARGET_PAGE_SIZE)))
+
+static int lz4_send_setup(MultiFDSendParam *p, Error **errp)
+{
+    p->zbuf_len = LZ4_ZBUF_LEN;
+    p->zbuf = g_malloc(p->zbuf_len);
+    return 0;
+}
+
+static void lz4_send_cleanup(MultiFDSendParam *p)
+{
+    g_free(p->zbuf);
+}
+
+static ssize_t lz4_send_prepare(MultiFDSendParam *p, MultiFDPages *pages)
+{
+    size_t pos = 0;
+    int i, n;
+
+    for (i = 0; i < pages->num; i++) {
+        n = LZ4_compress_default((char *)pages->block->host +
+                                 pages->offset[i],
+                                 (char *)p->zbuf + pos + 4,
+                                 TARGET_PAGE_SIZE,
+                                 LZ4_COMPRESSBOUND(TARGET_PAGE_SIZE));
+        if (n <= 0) {
+            return -1;
+        }
+        stl_be_p(p->zbuf + pos, n);
+        pos += 4 + n;
+    }
+    return pos;
+}
+
+static int lz4_recv_setup(MultiFDRecvParam *p)
+{
+    p->zbuf_len = LZ4_ZBUF_LEN;
+    p->zbuf = g_malloc(p->zbuf_len);
+    return 0;
+}
+
+static void lz4_recv_cleanup(MultiFDRecvParam *p)
+{
+    g_free(p->zbuf);
+}
+
+static int lz4_recv_pages(MultiFDRecvParam *p, uint8_t **host, int num,
+                          size_t len)
+{
+    size_t pos = 0;
+    uint32_t n;
+    int i;
+
+    for (i = 0; i < num; i++) {
+        if (len - pos < 4) {
+            return -1;
+        }
+        n = ldl_be_p(p->zbuf + pos);
+        pos += 4;
+        if (n > len - pos ||
+            LZ4_decompress_safe((char *)p->zbuf + pos, (char *)host[i],
+                                n, TARGET_PAGE_SIZE) != TARGET_PAGE_SIZE) {
+            return -1;
+        }
+        pos += n;
+    }
+    return pos == len ? 0 : -1;
+}
+
+static const MultiFDMethods multifd_lz4_ops = {
+    .send_setup = lz4_send_setup,
+    .send_cleanup = lz4_send_cleanup,
+    .send_prepare = lz4_send_prepare,
+    .recv_setup = lz4_recv_setup,
+    .recv_cleanup = lz4_recv_cleanup,
+    .recv_pages = lz4_recv_pages,
+};
+#endif
+
+#ifdef CONFIG_ZSTD
+static int zstd_send_setup(MultiFDSendParam *p, Error **errp)
+{
+    ZSTD_CStream *zcs = ZSTD_createCStream();
+
+    if (!zcs) {
+        error_setg(errp, "multifd: ZSTD_createCStream failed");
+        return -1;
+    }
+    p->data = zcs;
+    p->zbuf_len = ZSTD_compressBound(MULTIFD_PACKET_MAX_PAGES *
+                                     TARGET_PAGE_SIZE);
+    p->zbuf = g_malloc(p->zbuf_len);
+    return 0;
+}
+
+static void zstd_send_cleanup(MultiFDSendParam *p)
+{
+    ZSTD_freeCStream(p->data);
+    g_free(p->zbuf);
+}
+
+static ssize_t zstd_send_prepare(MultiFDSendParam *p, MultiFDPages *pages)
+{
+    ZSTD_CStream *zcs = p->data;
+    ZSTD_outBuffer out = { p->zbuf, p->zbuf_len, 0 };
+    size_t ret;
+    int i;
+
+    if (ZSTD_isError(ZSTD_initCStream(zcs, migrate_compress_level()))) {
+        return -1;
+    }
+    for (i = 0; i < pages->num; i++) {
+        ZSTD_inBuffer in = { pages->block->host + pages->offset[i],
+                             TARGET_PAGE_SIZE, 0 };
+
+        while (in.pos < in.size) {
+            if (out.pos == out.size ||
+                ZSTD_isError(ZSTD_compressStream(zcs, &out, &in))) {
+                return -1;
+            }
+        }
+    }
+    ret = ZSTD_endStream(zcs, &out);
+    /* A non-zero result means that the output buffer is too small */
+    return ret == 0 ? out.pos : -1;
+}
+
+static int zstd_recv_setup(MultiFDRecvParam *p)
+{
+    ZSTD_DStream *zds = ZSTD_createDStream();
+
+    if (!zds) {
+        return -1;
+    }
+    p->data = zds;
+    p->zbuf_len = ZSTD_compressBound(MULTIFD_PACKET_MAX_PAGES *
+                                     TARGET_PAGE_SIZE);
+    p->zbuf = g_malloc(p->zbuf_len);
+    return 0;
+}
+
+static void zstd_recv_cleanup(MultiFDRecvParam *p)
+{
+    ZSTD_freeDStream(p->data);
+    g_free(p->zbuf);
+}
+
+static int zstd_recv_pages(MultiFDRecvParam *p, uint8_t **host, int num,
+                           size_t len)
+{
+    ZSTD_DStream *zds = p->data;
+    ZSTD_inBuffer in = { p->zbuf, len, 0 };
+    int i;
+
+    if (ZSTD_isError(ZSTD_initDStream(zds))) {
+        return -1;
+    }
+    for (i = 0; i < num; i++) {
+        ZSTD_outBuffer out = { host[i], TARGET_PAGE_SIZE, 0 };
+
+        while (out.pos < out.size) {
+            size_t in_pos = in.pos, out_pos = out.pos;
+
+            if (ZSTD_isError(ZSTD_decompressStream(zds, &out, &in)) ||
+                (in.pos == in_pos && out.pos == out_pos)) {
+                return -1;
+            }
+        }
+    }
+    return in.pos == in.size ? 0 : -1;
+}
+
+static const MultiFDMethods multifd_zstd_ops = {
+    .send_setup = zstd_send_setup,
+    .send_cleanup = zstd_send_cleanup,
+    .send_prepare = zstd_send_prepare,
+    .recv_setup = zstd_recv_setup,
+    .recv_cleanup = zstd_recv_cleanup,
+    .recv_pages = zstd_recv_pages,
+};
+#endif
+
+/* NULL for uncompressed pages and methods that are not compiled in */
+static const MultiFDMethods *multifd_ops[MULTIFD_COMPRESSION__MAX] = {
+    [MULTIFD_COMPRESSION_ZLIB] = &multifd_zlib_ops,
+#ifdef CONFIG_LZ4
+    [MULTIFD_COMPRESSION_LZ4] = &multifd_lz4_ops,
+#endif
+#ifdef CONFIG_ZSTD
+    [MULTIFD_COMPRESSION_ZSTD] = &multifd_zstd_ops,
+#endif
+};
+
+static struct {
+    MultiFDSendParam *params;
+    QemuThread *threads;
+    int count;
+    int next;
+    MultifdCompression compression;
+    const MultiFDMethods *ops;
+    /* done_cond wakes up the migration thread when a channel is idle */
+    QemuMutex done_lock;
+    QemuCond done_cond;
+    /* The packet being filled by the migration thread */
+    MultiFDPages pages;
+} multifd_send;
+
+/* Returns the number of bytes written, or -1 if compression failed */
+static ssize_t multifd_send_pages(MultiFDSendParam *p, MultiFDPages *pages)
+{
+    QEMUFile *f = p->file;
+    size_t len = strlen(pages->block->idstr);
+    ssize_t bytes;
+    int i;
+
+    qemu_put_be32(f, MULTIFD_PACKET_PAGES);
+    qemu_put_be32(f, pages->num);
+    qemu_put_byte(f, len);
+    qemu_put_buffer(f, (uint8_t *)pages->block->idstr, len);
+    for (i = 0; i < pages->num; i++) {
+        qemu_put_be64(f, pages->offset[i]);
+    }
+    bytes = 9 + len + pages->num * 8;
+
+    if (!multifd_send.ops) {
+        for (i = 0; i < pages->num; i++) {
+            qemu_put_buffer_async(f, pages->block->host + pages->offset[i],
+                                  TARGET_PAGE_SIZE);
+        }
+        return bytes + pages->num * TARGET_PAGE_SIZE;
+    }
+
+    len = multifd_send.ops->send_prepare(p, pages);
+    if ((ssize_t)len < 0) {
+        return -1;
+    }
+    qemu_put_be32(f, len);
+    /* p->zbuf is not touched again before the caller flushes */
+    qemu_put_buffer_async(f, p->zbuf, len);
+    return bytes + 4 + len;
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParam *p = opaque;
+    MultiFDPages pages;
+    ssize_t bytes;
+    bool sync;
+    int ret;
+
+    qemu_put_be32(p->file, MULTIFD_MAGIC);
+    qemu_put_be32(p->file, MULTIFD_VERSION);
+    qemu_put_be32(p->file, p->id);
+    qemu_put_be32(p->file, multifd_send.compression);
+    qemu_fflush(p->file);
+
+    qemu_mutex_lock(&p->mutex);
+    while (!p->quit) {
+        if (p->pages.num || p->sync) {
+            pages = p->pages;
+            sync = p->sync;
+            p->pages.num = 0;
+            p->sync = false;
+            qemu_mutex_unlock(&p->mutex);
+
+            bytes = 0;
+            if (pages.num) {
+                bytes = multifd_send_pages(p, &pages);
+                if (bytes < 0) {
+                    error_report("multifd: compression failed");
+                    qemu_file_set_error(p->file, -EIO);
+                }
+            }
+            if (sync) {
+                qemu_put_be32(p->file, MULTIFD_PACKET_SYNC);
+                bytes += 4;
+            }
+            qemu_fflush(p->file);
+            ret = qemu_file_get_error(p->file);
+            if (ret < 0) {
+                qemu_file_set_error(migrate_get_current()->to_dst_file, ret);
+            }
+
+            qemu_mutex_lock(&multifd_send.done_lock);
+            p->bytes += MAX(bytes, 0);
+            p->done = true;
+            qemu_cond_signal(&multifd_send.done_cond);
+            qemu_mutex_unlock(&multifd_send.done_lock);
+
+            qemu_mutex_lock(&p->mutex);
+        } else {
+            qemu_cond_wait(&p->cond, &p->mutex);
+        }
+    }
+    qemu_mutex_unlock(&p->mutex);
+
+    return NULL;
+}
+
+int multifd_send_threads_create(Error **errp)
+{
+    int i, thread_count;
+
+    if (!migrate_use_multifd()) {
+        return 0;
+    }
+    thread_count = migrate_multifd_channels();
+    multifd_send.params = g_new0(MultiFDSendParam, thread_count);
+    multifd_send.threads = g_new0(QemuThread, thread_count);
+    multifd_send.count = 0;
+    multifd_send.next = 0;
+    multifd_send.pages.block = NULL;
+    multifd_send.pages.num = 0;
+    multifd_send.compression = migrate_multifd_compression();
+    multifd_send.ops = multifd_ops[multifd_send.compression];
+    qemu_mutex_init(&multifd_send.done_lock);
+    qemu_cond_init(&multifd_send.done_cond);
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParam *p = &multifd_send.params[i];
+
+        if (multifd_send.ops && multifd_send.ops->send_setup(p, errp) < 0) {
+            return -1;
+        }
+        p->c = socket_send_channel_create(errp);
+        if (!p->c) {
+            if (multifd_send.ops) {
+                multifd_send.ops->send_cleanup(p);
+            }
+            return -1;
+        }
+        p->id = i;
+        p->file = qemu_fopen_channel_output(p->c);
+        p->done = true;
+        p->quit = false;
+        qemu_mutex_init(&p->mutex);
+        qemu_cond_init(&p->cond);
+        qemu_thread_create(multifd_send.threads + i, "multifd_send",
+                           multifd_send_thread, p, QEMU_THREAD_JOINABLE);
+        multifd_send.count++;
+    }
+    return 0;
+}
+
+void multifd_send_threads_join(void)
+{
+    int i;
+
+    if (!multifd_send.params) {
+        return;
+    }
+    for (i = 0; i < multifd_send.count; i++) {
+        MultiFDSendParam *p = &multifd_send.params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->quit = true;
+        qemu_cond_signal(&p->cond);
+        qemu_mutex_unlock(&p->mutex);
+        qemu_thread_join(multifd_send.threads + i);
+        qemu_fclose(p->file);
+        object_unref(OBJECT(p->c));
+        qemu_mutex_destroy(&p->mutex);
+        qemu_cond_destroy(&p->cond);
+        if (multifd_send.ops) {
+            multifd_send.ops->send_cleanup(p);
+        }
+    }
+    qemu_mutex_destroy(&multifd_send.done_lock);
+    qemu_cond_destroy(&multifd_send.done_cond);
+    g_free(multifd_send.threads);
+    g_free(multifd_send.params);
+    multifd_send.threads = NULL;
+    multifd_send.params = NULL;
+    multifd_send.count = 0;
+}
+
+/* Unblock the channel threads if the network is stuck */
+void multifd_send_shutdown(void)
+{
+    int i;
+
+    for (i = 0; i < multifd_send.count; i++) {
+        qio_channel_shutdown(multifd_send.params[i].c,
+                             QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+    }
+}
+
+/* Charge what channel p has written to the main stream, so that it counts
+ * against the bandwidth limit.  Called with done_lock held. */
+static uint64_t multifd_send_collect(MultiFDSendParam *p)
+{
+    uint64_t bytes = p->bytes;
+
+    p->bytes = 0;
+    return bytes;
+}
+
+static void multifd_send_account(QEMUFile *f, uint64_t bytes)
+{
+    qemu_file_update_transfer(f, bytes);
+    bytes_transferred += bytes;
+}
+
+/* Called by the migration thread; wait until channel p is idle */
+static void multifd_send_wait(QEMUFile *f, MultiFDSendParam *p)
+{
+    uint64_t bytes;
+
+    qemu_mutex_lock(&multifd_send.done_lock);
+    while (!p->done) {
+        qemu_cond_wait(&multifd_send.done_cond, &multifd_send.done_lock);
+    }
+    bytes = multifd_send_collect(p);
+    qemu_mutex_unlock(&multifd_send.done_lock);
+    multifd_send_account(f, bytes);
+}
+
+/* Hand the packet being filled to the next idle channel */
+static void multifd_send_flush(QEMUFile *f)
+{
+    MultiFDSendParam *p = NULL;
+    uint64_t bytes;
+    int i;
+
+    if (!multifd_send.pages.num) {
+        return;
+    }
+
+    qemu_mutex_lock(&multifd_send.done_lock);
+    while (!p) {
+        for (i = 0; i < multifd_send.count; i++) {
+            int idx = (multifd_send.next + i) % multifd_send.count;
+
+            if (multifd_send.params[idx].done) {
+                p = &multifd_send.params[idx];
+                multifd_send.next = idx + 1;
+                break;
+            }
+        }
+        if (!p) {
+            qemu_cond_wait(&multifd_send.done_cond, &multifd_send.done_lock);
+        }
+    }
+    p->done = false;
+    bytes = multifd_send_collect(p);
+    qemu_mutex_unlock(&multifd_send.done_lock);
+    multifd_send_account(f, bytes);
+
+    qemu_mutex_lock(&p->mutex);
+    p->pages = multifd_send.pages;
+    qemu_cond_signal(&p->cond);
+    qemu_mutex_unlock(&p->mutex);
+
+    multifd_send.pages.num = 0;
+}
+
+/**
+ * multifd_send_sync: End a round of pages on the x-multifd channels
+ *
+ * Returns once everything queued so far has been written, so no channel
+ * uses a RAMBlock after the caller drops the RCU read lock.
+ *
+ * @f: main stream, which gets RAM_SAVE_FLAG_MULTIFD_SYNC
+ */
+static void multifd_send_sync(QEMUFile *f)
+{
+    int i;
+
+    if (!migrate_use_multifd()) {
+        return;
+    }
+    trace_multifd_send_sync(multifd_send.count);
+
+    multifd_send_flush(f);
+    for (i = 0; i < multifd_send.count; i++) {
+        MultiFDSendParam *p = &multifd_send.params[i];
+
+        multifd_send_wait(f, p);
+        qemu_mutex_lock(&multifd_send.done_lock);
+        p->done = false;
+        qemu_mutex_unlock(&multifd_send.done_lock);
+
+        qemu_mutex_lock(&p->mutex);
+        p->sync = true;
+        qemu_cond_signal(&p->cond);
+        qemu_mutex_unlock(&p->mutex);
+    }
+    for (i = 0; i < multifd_send.count; i++) {
+        multifd_send_wait(f, &multifd_send.params[i]);
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+    qemu_put_be32(f, multifd_send.count);
+    bytes_transferred += 12;
+}
+
+/**
+ * ram_save_multifd_page: Send the given page on an x-multifd channel
+ *
+ * Zero pages still go through the main stream, as that is cheaper.
+ *
+ * Returns: Number of pages written.
+ *
+ * @f: QEMUFile where to send the data
+ * @pss: data about the page we want to send
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static int ram_save_multifd_page(QEMUFile *f, PageSearchStatus *pss,
+                                 uint64_t *bytes_transferred)
+{
+    RAMBlock *block = pss->block;
+    ram_addr_t offset = pss->offset;
+    int pages;
+
+    pages = save_zero_page(f, block,
+                           offset | (block == last_sent_block ?
+                                     RAM_SAVE_FLAG_CONTINUE : 0),
+                           block->host + offset, bytes_transferred);
+    if (pages > 0) {
+        /* Only pages on the main stream can use RAM_SAVE_FLAG_CONTINUE */
+        last_sent_block = block;
+        return pages;
+    }
+
+    if (multifd_send.pages.block != block ||
+        multifd_send.pages.num == MULTIFD_PACKET_MAX_PAGES) {
+        multifd_send_flush(f);
+        multifd_send.pages.block = block;
+    }
+    multifd_send.pages.offset[multifd_send.pages.num++] = offset;
+
+    /* The bytes are accounted once the channel has written them */
+    acct_info.norm_pages++;
+    return 1;
+}
+
+static int ram_save_compressed_page(QEMUFile *f, PageSearchStatus *pss,
+                                    bool last_stage,
+                                    uint64_t *bytes_transferred)
+{
+    int pages = -1;
+    uint64_t bytes_xmit = 0;
+    uint8_t *p;
+    int ret, blen;
+    RAMBlock *block = pss->block;
+    ram_addr_t offset = pss->offset;
+
+    p = block->host + offset;
+
+    ret = ram_control_save_page(f, block->offset,
+                                offset, TARGET_PAGE_SIZE, &bytes_xmit);
+    if (bytes_xmit) {
+        *bytes_transferred += bytes_xmit;
+        pages = 1;
+    }
+    if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
+        if (ret != RAM_SAVE_CONTROL_DELAYED) {
+            if (bytes_xmit > 0) {
+                acct_info.norm_pages++;
+            } else if (bytes_xmit == 0) {
+                acct_info.dup_pages++;
+            }
+        }
+    } else {
+        /* When starting the process of a new block, the first page of
+         * the block should be sent out before other pages in the same
+         * block, and all the pages in last block should have been sent
+         * out, keeping this order is important, because the 'cont' flag
+         * is used to avoid resending the block name.
+         */
+        if (block != last_sent_block) {
+            flush_compressed_data(f);
+            pages = save_zero_page(f, block, offset, p, bytes_transferred);
+            if (pages == -1) {
+                /* Make sure the first page is sent out before other pages */
+                bytes_xmit = save_page_header(f, block, offset |
+                                              RAM_SAVE_FLAG_COMPRESS_PAGE);
+                blen = qemu_put_compression_data(f, p, TARGET_PAGE_SIZE,
+                                                 migrate_compress_level());
+                if (blen > 0) {
+                    *bytes_transferred += bytes_xmit + blen;
+                    acct_info.norm_pages++;
+                    pages = 1;
+                } else {
+                    qemu_file_set_error(f, blen);
+                    error_report("compressed data failed!");
+                }
+            }
+        } else {
+            offset |= RAM_SAVE_FLAG_CONTINUE;
+            pages = save_zero_page(f, block, offset, p, bytes_transferred);
+            if (pages == -1) {
+                pages = compress_page_with_multi_thread(f, block, offset,
+                                                        bytes_transferred);
+            }
+        }
+    }
+
+    return pages;
+}
+
+/*
+ * Find the next dirty page and update any state associated with
+ * the search process.
+ *
+ * Returns: True if a page is found
+ *
+ * @f: Current migration stream.
+ * @pss: Data about the state of the current dirty page scan.
+ * @*again: Set to false if the search has scanned the whole of RAM
+ * *ram_addr_abs: Pointer into which to store the address of the dirty page
+ *               within the global ram_addr space
+ */
+static bool find_dirty_block(QEMUFile *f, PageSearchStatus *pss,
+                             bool *again, ram_addr_t *ram_addr_abs)
+{
+    pss->offset = migration_bitmap_find_dirty(pss->block, pss->offset,
+                                              ram_addr_abs);
+    if (pss->complete_round && pss->block == last_seen_block &&
+        pss->offset >= last_offset) {
+        /*
+         * We've been once around the RAM and haven't found anything.
+         * Give up.
+         */
+        *again = false;
+        return false;
+    }
+    if (pss->offset >= pss->block->used_length) {
+        /* Didn't find anything in this RAM Block */
+        pss->offset = 0;
+        pss->block = QLIST_NEXT_RCU(pss->block, next);
+        if (!pss->block) {
+            /* Hit the end of the list */
+            pss->block = QLIST_FIRST_RCU(&ram_list.blocks);
+            /* Flag that we've looped */
+            pss->complete_round = true;
+            ram_bulk_stage = false;
+            if (migrate_use_xbzrle()) {
+                /* If xbzrle is on, stop using the data compression at this
+                 * point. In theory, xbzrle can do better than compression.
+                 */
+                flush_compressed_data(f);
+                compression_switch = false;
+            }
+        }
+        /* Didn't find anything this time, but try again on the new block */
+        *again = true;
+        return false;
+    } else {
+        /* Can go around again, but... */
+        *again = true;
+        /* We've found something so probably don't need to */
+        return true;
+    }
+}
+
+/*
+ * Helper for 'get_queued_page' - gets a page off the queue
+ *      ms:      MigrationState in
+ * *offset:      Used to return the offset within the RAMBlock
+ * ram_addr_abs: global offset in the dirty/sent bitmaps
+ *
+ * Returns:      block (or NULL if none available)
+ */
+/* Read-ahead windows from the destination that are kept at most */
+#define MAX_PREFETCH_REQUESTS 16
+
+static RAMBlock *unqueue_page(MigrationState *ms, ram_addr_t *offset,
+                              ram_addr_t *ram_addr_abs)
+{
+    RAMBlock *block = NULL;
+    struct src_page_requests *queue = &ms->src_page_requests;
+
+    qemu_mutex_lock(&ms->src_page_req_mutex);
+    if (QSIMPLEQ_EMPTY(queue)) {
+        queue = &ms->src_page_prefetch_requests;
+    }
+    if (!QSIMPLEQ_EMPTY(queue)) {
+        struct MigrationSrcPageRequest *entry = QSIMPLEQ_FIRST(queue);
+        block = entry->rb;
+        *offset = entry->offset;
+        *ram_addr_abs = (entry->offset + entry->rb->offset) &
+                        TARGET_PAGE_MASK;
+
+        if (entry->len > TARGET_PAGE_SIZE) {
+            entry->len -= TARGET_PAGE_SIZE;
             entry->offset += TARGET_PAGE_SIZE;
         } else {
             memory_region_unref(block->mr);
-            QSIMPLEQ_REMOVE_HEAD(&ms->src_page_requests, next_req);
+            QSIMPLEQ_REMOVE_HEAD(queue, next_req);
             g_free(entry);
+            if (queue == &ms->src_page_prefetch_requests) {
+                ms->src_page_prefetch_count--;
+            }
         }
     }
     qemu_mutex_unlock(&ms->src_page_req_mutex);
@@ -1147,6 +2131,13 @@ void flush_page_queue(MigrationState *ms)
         QSIMPLEQ_REMOVE_HEAD(&ms->src_page_requests, next_req);
         g_free(mspr);
     }
+    QSIMPLEQ_FOREACH_SAFE(mspr, &ms->src_page_prefetch_requests, next_req,
+                          next_mspr) {
+        memory_region_unref(mspr->rb->mr);
+        QSIMPLEQ_REMOVE_HEAD(&ms->src_page_prefetch_requests, next_req);
+        g_free(mspr);
+    }
+    ms->src_page_prefetch_count = 0;
     rcu_read_unlock();
 }
 
@@ -1203,7 +2194,23 @@ int ram_save_queue_pages(MigrationState *ms, const char *rbname,
 
     memory_region_ref(ramblock->mr);
     qemu_mutex_lock(&ms->src_page_req_mutex);
-    QSIMPLEQ_INSERT_TAIL(&ms->src_page_requests, new_entry, next_req);
+    if (len > qemu_host_page_size) {
+        /* The guest has moved on if it did not fault in the old windows */
+        if (ms->src_page_prefetch_count == MAX_PREFETCH_REQUESTS) {
+            struct MigrationSrcPageRequest *old =
+                QSIMPLEQ_FIRST(&ms->src_page_prefetch_requests);
+
+            QSIMPLEQ_REMOVE_HEAD(&ms->src_page_prefetch_requests, next_req);
+            memory_region_unref(old->rb->mr);
+            g_free(old);
+            ms->src_page_prefetch_count--;
+        }
+        QSIMPLEQ_INSERT_TAIL(&ms->src_page_prefetch_requests, new_entry,
+                             next_req);
+        ms->src_page_prefetch_count++;
+    } else {
+        QSIMPLEQ_INSERT_TAIL(&ms->src_page_requests, new_entry, next_req);
+    }
     qemu_mutex_unlock(&ms->src_page_req_mutex);
     rcu_read_unlock();
 
@@ -1234,6 +2241,7 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
                                 ram_addr_t dirty_ram_abs)
 {
     int res = 0;
+    bool multifd = false;
 
     /* Check the pages is dirty and if it is send it */
     if (migration_bitmap_clear_dirty(dirty_ram_abs)) {
@@ -1242,6 +2250,10 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
             res = ram_save_compressed_page(f, pss,
                                            last_stage,
                                            bytes_transferred);
+        } else if (migrate_use_multifd()) {
+            /* Updates last_sent_block itself */
+            res = ram_save_multifd_page(f, pss, bytes_transferred);
+            multifd = true;
         } else {
             res = ram_save_page(f, pss, last_stage,
                                 bytes_transferred);
@@ -1258,7 +2270,7 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
          * might have decided the page was identical so didn't bother writing
          * to the stream.
          */
-        if (res > 0) {
+        if (res > 0 && !multifd) {
             last_sent_block = pss->block;
         }
     }
@@ -1894,56 +2906,255 @@ static int ram_save_init_globals(void)
         }
         XBZRLE_cache_unlock();
 
-        /* We prefer not to abort if there is no memory */
-        XBZRLE.encoded_buf = g_try_malloc0(TARGET_PAGE_SIZE);
-        if (!XBZRLE.encoded_buf) {
-            error_report("Error allocating encoded_buf");
-            return -1;
+        /* We prefer not to abort if there is no memory */
+        XBZRLE.encoded_buf = g_try_malloc0(TARGET_PAGE_SIZE);
+        if (!XBZRLE.encoded_buf) {
+            error_report("Error allocating encoded_buf");
+            return -1;
+        }
+
+        XBZRLE.current_buf = g_try_malloc(TARGET_PAGE_SIZE);
+        if (!XBZRLE.current_buf) {
+            error_report("Error allocating current_buf");
+            g_free(XBZRLE.encoded_buf);
+            XBZRLE.encoded_buf = NULL;
+            return -1;
+        }
+
+        acct_clear();
+    }
+
+    /* For memory_global_dirty_log_start below.  */
+    qemu_mutex_lock_iothread();
+
+    qemu_mutex_lock_ramlist();
+    rcu_read_lock();
+    bytes_transferred = 0;
+    reset_ram_globals();
+
+    ram_bitmap_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+    migration_bitmap_rcu = g_new0(struct BitmapRcu, 1);
+    migration_bitmap_rcu->bmap = bitmap_new(ram_bitmap_pages);
+    bitmap_set(migration_bitmap_rcu->bmap, 0, ram_bitmap_pages);
+
+    if (migrate_postcopy_ram()) {
+        migration_bitmap_rcu->unsentmap = bitmap_new(ram_bitmap_pages);
+        bitmap_set(migration_bitmap_rcu->unsentmap, 0, ram_bitmap_pages);
+    }
+
+    /*
+     * Count the total number of pages used by ram blocks not including any
+     * gaps due to alignment or unplugs.
+     */
+    migration_dirty_pages = ram_bytes_total() >> TARGET_PAGE_BITS;
+
+    memory_global_dirty_log_start();
+    migration_bitmap_sync();
+    qemu_mutex_unlock_ramlist();
+    qemu_mutex_unlock_iothread();
+    rcu_read_unlock();
+
+    return 0;
+}
+
+/*
+ * Mapped RAM images
+ *
+ * Instead of going through the stream, RAM can be written to an image file
+ * in which every RAMBlock starts at a RAM_IMAGE_ALIGN boundary.  The stream
+ * then only has RAM_SAVE_FLAG_MAPPED, and loading maps the image
+ * copy-on-write over guest RAM, which takes the same time whatever the size
+ * of RAM.  Record/replay snapshots use this.
+ */
+#define RAM_IMAGE_MAGIC "QEMURAMI"
+#define RAM_IMAGE_VERSION 1
+#define RAM_IMAGE_ALIGN (64 * 1024)
+
+typedef struct QEMU_PACKED RAMImageHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nr_blocks;
+} RAMImageHeader;
+
+typedef struct QEMU_PACKED RAMImageBlock {
+    char idstr[256];
+    uint64_t length;
+    uint64_t offset;
+} RAMImageBlock;
+
+static char *ram_mapped_image;
+
+void ram_set_mapped_image(const char *path)
+{
+    g_free(ram_mapped_image);
+    ram_mapped_image = g_strdup(path);
+}
+
+#ifdef CONFIG_POSIX
+/* Called with the RCU read lock held */
+static int ram_save_mapped_image(void)
+{
+    RAMImageHeader hdr = {};
+    RAMImageBlock *entries;
+    RAMBlock *block;
+    uint32_t nr_blocks = 0;
+    uint64_t offset;
+    size_t entries_len;
+    int fd, i = 0, ret = 0;
+
+    fd = qemu_open(ram_mapped_image, O_WRONLY | O_CREAT | O_TRUNC, 0660);
+    if (fd < 0) {
+        ret = -errno;
+        error_report("Cannot create RAM image %s: %s", ram_mapped_image,
+                     strerror(errno));
+        return ret;
+    }
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        nr_blocks++;
+    }
+    entries = g_new0(RAMImageBlock, nr_blocks);
+    entries_len = nr_blocks * sizeof(*entries);
+    offset = ROUND_UP(sizeof(hdr) + entries_len, RAM_IMAGE_ALIGN);
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        ram_addr_t pos;
+
+        pstrcpy(entries[i].idstr, sizeof(entries[i].idstr), block->idstr);
+        entries[i].length = cpu_to_be64(block->used_length);
+        entries[i].offset = cpu_to_be64(offset);
+        i++;
+
+        /* Zero chunks are left as holes, which read back as zeroes */
+        for (pos = 0; pos < block->used_length && !ret;
+             pos += RAM_IMAGE_ALIGN) {
+            size_t len = MIN(RAM_IMAGE_ALIGN, block->used_length - pos);
+
+            if (!buffer_is_zero(block->host + pos, len) &&
+                pwrite(fd, block->host + pos, len, offset + pos) != len) {
+                ret = errno ? -errno : -EIO;
+            }
+        }
+        offset += ROUND_UP(block->used_length, RAM_IMAGE_ALIGN);
+    }
+
+    memcpy(hdr.magic, RAM_IMAGE_MAGIC, sizeof(hdr.magic));
+    hdr.version = cpu_to_be32(RAM_IMAGE_VERSION);
+    hdr.nr_blocks = cpu_to_be32(nr_blocks);
+    if (!ret &&
+        (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+         pwrite(fd, entries, entries_len, sizeof(hdr)) != entries_len ||
+         ftruncate(fd, offset) < 0)) {
+        ret = errno ? -errno : -EIO;
+    }
+    if (ret) {
+        error_report("Cannot write RAM image %s: %s", ram_mapped_image,
+                     strerror(-ret));
+    }
+
+    g_free(entries);
+    qemu_close(fd);
+    return ret;
+}
+
+static int ram_load_mapped_block(int fd, RAMBlock *block, uint64_t offset)
+{
+    ram_addr_t pos;
+    ssize_t len;
+
+    /* Anonymous RAM is replaced by a private mapping of the image.  RAM
+     * backed by a file keeps its mapping, so that it stays shared. */
+    if (block->fd < 0 &&
+        QEMU_IS_ALIGNED((uintptr_t)block->host, qemu_real_host_page_size) &&
+        QEMU_IS_ALIGNED(block->used_length, qemu_real_host_page_size)) {
+        if (mmap(block->host, block->used_length, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_FIXED, fd, offset) == MAP_FAILED) {
+            error_report("Cannot map RAM image for RAMBlock \"%s\": %s",
+                         block->idstr, strerror(errno));
+            return -errno;
         }
+        return 0;
+    }
 
-        XBZRLE.current_buf = g_try_malloc(TARGET_PAGE_SIZE);
-        if (!XBZRLE.current_buf) {
-            error_report("Error allocating current_buf");
-            g_free(XBZRLE.encoded_buf);
-            XBZRLE.encoded_buf = NULL;
-            return -1;
+    for (pos = 0; pos < block->used_length; pos += len) {
+        len = pread(fd, block->host + pos, block->used_length - pos,
+                    offset + pos);
+        if (len <= 0) {
+            error_report("Cannot read RAM image for RAMBlock \"%s\": %s",
+                         block->idstr, len ? strerror(errno) : "short read");
+            return -EIO;
         }
+    }
+    return 0;
+}
 
-        acct_clear();
+/* Called with the RCU read lock held, after the RAMBlocks have been resized
+ * to the lengths in the stream */
+static int ram_load_mapped_image(void)
+{
+    RAMImageHeader hdr;
+    RAMImageBlock entry;
+    uint32_t i, nr_blocks;
+    int fd, ret = 0;
+
+    if (!ram_mapped_image) {
+        error_report("The stream keeps RAM in an image, but none was given");
+        return -EINVAL;
+    }
+    fd = qemu_open(ram_mapped_image, O_RDONLY);
+    if (fd < 0) {
+        ret = -errno;
+        error_report("Cannot open RAM image %s: %s", ram_mapped_image,
+                     strerror(errno));
+        return ret;
     }
 
-    /* For memory_global_dirty_log_start below.  */
-    qemu_mutex_lock_iothread();
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        memcmp(hdr.magic, RAM_IMAGE_MAGIC, sizeof(hdr.magic)) ||
+        be32_to_cpu(hdr.version) != RAM_IMAGE_VERSION) {
+        error_report("%s is not a RAM image", ram_mapped_image);
+        qemu_close(fd);
+        return -EINVAL;
+    }
 
-    qemu_mutex_lock_ramlist();
-    rcu_read_lock();
-    bytes_transferred = 0;
-    reset_ram_globals();
+    nr_blocks = be32_to_cpu(hdr.nr_blocks);
+    for (i = 0; i < nr_blocks && !ret; i++) {
+        RAMBlock *block;
 
-    ram_bitmap_pages = last_ram_offset() >> TARGET_PAGE_BITS;
-    migration_bitmap_rcu = g_new0(struct BitmapRcu, 1);
-    migration_bitmap_rcu->bmap = bitmap_new(ram_bitmap_pages);
-    bitmap_set(migration_bitmap_rcu->bmap, 0, ram_bitmap_pages);
+        if (pread(fd, &entry, sizeof(entry),
+                  sizeof(hdr) + i * sizeof(entry)) != sizeof(entry)) {
+            error_report("%s is truncated", ram_mapped_image);
+            ret = -EINVAL;
+            break;
+        }
+        entry.idstr[sizeof(entry.idstr) - 1] = 0;
 
-    if (migrate_postcopy_ram()) {
-        migration_bitmap_rcu->unsentmap = bitmap_new(ram_bitmap_pages);
-        bitmap_set(migration_bitmap_rcu->unsentmap, 0, ram_bitmap_pages);
+        block = qemu_ram_block_by_name(entry.idstr);
+        if (!block || be64_to_cpu(entry.length) != block->used_length) {
+            error_report("RAMBlock \"%s\" in %s does not match the guest",
+                         entry.idstr, ram_mapped_image);
+            ret = -EINVAL;
+            break;
+        }
+        ret = ram_load_mapped_block(fd, block, be64_to_cpu(entry.offset));
     }
 
-    /*
-     * Count the total number of pages used by ram blocks not including any
-     * gaps due to alignment or unplugs.
-     */
-    migration_dirty_pages = ram_bytes_total() >> TARGET_PAGE_BITS;
-
-    memory_global_dirty_log_start();
-    migration_bitmap_sync();
-    qemu_mutex_unlock_ramlist();
-    qemu_mutex_unlock_iothread();
-    rcu_read_unlock();
+    qemu_close(fd);
+    return ret;
+}
+#else
+static int ram_save_mapped_image(void)
+{
+    error_report("RAM images are not supported on this host");
+    return -ENOTSUP;
+}
 
-    return 0;
+static int ram_load_mapped_image(void)
+{
+    error_report("RAM images are not supported on this host");
+    return -ENOTSUP;
 }
+#endif
 
 /* Each of ram_save_setup, ram_save_iterate and ram_save_complete has
  * long-running RCU critical section.  When rcu-reclaims in the code
@@ -1989,6 +3200,12 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     int64_t t0;
     int done = 0;
 
+    if (ram_mapped_image) {
+        /* RAM is written to the image when completing */
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        return 1;
+    }
+
     rcu_read_lock();
     if (ram_list.version != last_version) {
         reset_ram_globals();
@@ -2028,6 +3245,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
     flush_compressed_data(f);
+    multifd_send_sync(f);
     rcu_read_unlock();
 
     /*
@@ -2050,6 +3268,21 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 /* Called with iothread lock */
 static int ram_save_complete(QEMUFile *f, void *opaque)
 {
+    if (ram_mapped_image) {
+        /* Written only now, when the vcpus cannot change RAM any more */
+        int ret;
+
+        rcu_read_lock();
+        ret = ram_save_mapped_image();
+        rcu_read_unlock();
+        if (ret < 0) {
+            return ret;
+        }
+        qemu_put_be64(f, RAM_SAVE_FLAG_MAPPED);
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        return 0;
+    }
+
     rcu_read_lock();
 
     if (!migration_in_postcopy(migrate_get_current())) {
@@ -2073,6 +3306,7 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     }
 
     flush_compressed_data(f);
+    multifd_send_sync(f);
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
     rcu_read_unlock();
@@ -2185,9 +3419,170 @@ static inline void *host_from_ram_block_offset(RAMBlock *block,
         return NULL;
     }
 
+    if (block->colo_cache) {
+        set_bit_atomic(offset >> TARGET_PAGE_BITS, block->colo_bmap);
+        return block->colo_cache + offset;
+    }
     return block->host + offset;
 }
 
+/*
+ * COLO RAM cache
+ *
+ * With x-multifd, the pages of a COLO checkpoint arrive on the other
+ * channels while the main stream is still being buffered, so they can't be
+ * written to guest RAM before the whole checkpoint is there: the secondary
+ * would be left with half a checkpoint on failover.  Instead the secondary
+ * loads them into a copy of guest RAM and copies the pages that changed
+ * into the guest once the checkpoint has been loaded, with several threads
+ * for large guests.  The chunks start on a word of the bitmaps so that
+ * threads never clear the same word.
+ */
+#define COLO_FLUSH_CHUNK        ((ram_addr_t)64 << 20)
+#define COLO_FLUSH_MIN_CHUNKS   4
+#define COLO_FLUSH_MAX_THREADS  8
+
+typedef struct ColoFlushChunk {
+    RAMBlock *block;
+    unsigned long start;
+    unsigned long end;
+} ColoFlushChunk;
+
+typedef struct ColoFlushJob {
+    ColoFlushChunk *chunks;
+    int nr_chunks;
+    int next_chunk;
+} ColoFlushJob;
+
+static uint64_t colo_flush_do_chunks(ColoFlushJob *job)
+{
+    uint64_t num_pages = 0;
+    int i;
+
+    while ((i = atomic_fetch_inc(&job->next_chunk)) < job->nr_chunks) {
+        ColoFlushChunk *chunk = &job->chunks[i];
+        unsigned long *bmap = chunk->block->colo_bmap;
+        unsigned long first = chunk->start, last;
+
+        for (;;) {
+            first = find_next_bit(bmap, chunk->end, first);
+            if (first >= chunk->end) {
+                break;
+            }
+            last = find_next_zero_bit(bmap, chunk->end, first);
+            memcpy(chunk->block->host + (first << TARGET_PAGE_BITS),
+                   chunk->block->colo_cache + (first << TARGET_PAGE_BITS),
+                   (last - first) << TARGET_PAGE_BITS);
+            bitmap_clear(bmap, first, last - first);
+            num_pages += last - first;
+            first = last;
+        }
+    }
+    return num_pages;
+}
+
+static void *colo_flush_thread(void *opaque)
+{
+    ColoFlushJob *job = opaque;
+
+    rcu_register_thread();
+    colo_flush_do_chunks(job);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/* Called by the COLO incoming thread when x-multifd is enabled, before
+ * the first checkpoint */
+int colo_init_ram_cache(void)
+{
+    RAMBlock *block;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        block->colo_cache = qemu_anon_ram_alloc(block->used_length, NULL);
+        if (!block->colo_cache) {
+            error_report("COLO: can't allocate the RAM cache of %s",
+                         block->idstr);
+            rcu_read_unlock();
+            colo_release_ram_cache();
+            return -ENOMEM;
+        }
+        memcpy(block->colo_cache, block->host, block->used_length);
+        block->colo_bmap = bitmap_new(block->used_length >> TARGET_PAGE_BITS);
+    }
+    rcu_read_unlock();
+    return 0;
+}
+
+/* Copy the pages loaded since the last call into guest RAM.  Called with
+ * the iothread lock held once a checkpoint has been loaded. */
+void colo_flush_ram_cache(void)
+{
+    ColoFlushJob job = {};
+    QemuThread *threads;
+    RAMBlock *block;
+    unsigned long pages_per_chunk = COLO_FLUSH_CHUNK >> TARGET_PAGE_BITS;
+    int nr_threads, i;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (block->colo_cache) {
+            job.nr_chunks += DIV_ROUND_UP(block->used_length,
+                                          COLO_FLUSH_CHUNK);
+        }
+    }
+    job.chunks = g_new(ColoFlushChunk, job.nr_chunks);
+    i = 0;
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+        unsigned long start;
+
+        if (!block->colo_cache) {
+            continue;
+        }
+        for (start = 0; start < pages; start += pages_per_chunk) {
+            job.chunks[i].block = block;
+            job.chunks[i].start = start;
+            job.chunks[i].end = MIN(start + pages_per_chunk, pages);
+            i++;
+        }
+    }
+
+    /* The calling thread works on chunks as well */
+    nr_threads = MIN(job.nr_chunks / COLO_FLUSH_MIN_CHUNKS,
+                     COLO_FLUSH_MAX_THREADS);
+    threads = g_new(QemuThread, nr_threads);
+    for (i = 0; i < nr_threads; i++) {
+        qemu_thread_create(&threads[i], "coloflush", colo_flush_thread, &job,
+                           QEMU_THREAD_JOINABLE);
+    }
+    trace_colo_flush_ram_cache(colo_flush_do_chunks(&job), nr_threads);
+    for (i = 0; i < nr_threads; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    rcu_read_unlock();
+
+    g_free(threads);
+    g_free(job.chunks);
+}
+
+/* Called once the channels that load into the cache have been joined */
+void colo_release_ram_cache(void)
+{
+    RAMBlock *block;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (block->colo_cache) {
+            qemu_anon_ram_free(block->colo_cache, block->used_length);
+            block->colo_cache = NULL;
+        }
+        g_free(block->colo_bmap);
+        block->colo_bmap = NULL;
+    }
+    rcu_read_unlock();
+}
+
 /*
  * If a page (or a whole RDMA chunk) has been
  * determined to be zero, then zap it.
@@ -2329,6 +3724,288 @@ static void decompress_data_with_multi_threads(QEMUFile *f,
     qemu_mutex_unlock(&decomp_done_lock);
 }
 
+static struct {
+    MultiFDRecvParam *params[MULTIFD_MAX_CHANNELS];
+    int count;
+    bool quit;
+    int error;
+    /* Number of RAM_SAVE_FLAG_MULTIFD_SYNC seen on the main stream */
+    unsigned int expected;
+    /* Kicked by the channels; re-enters the coroutine waiting in sync */
+    QEMUBH *bh;
+    Coroutine *waiting_co;
+    /* Set by the channels for the COLO thread, which loads outside of
+     * a coroutine */
+    QemuEvent event;
+} multifd_recv;
+
+static void multifd_recv_bh(void *opaque)
+{
+    Coroutine *co = multifd_recv.waiting_co;
+
+    if (co) {
+        multifd_recv.waiting_co = NULL;
+        qemu_coroutine_enter(co);
+    }
+}
+
+static int multifd_recv_pages(MultiFDRecvParam *p)
+{
+    QEMUFile *f = p->file;
+    ram_addr_t offset[MULTIFD_PACKET_MAX_PAGES];
+    uint8_t *host[MULTIFD_PACKET_MAX_PAGES];
+    RAMBlock *block;
+    char id[256];
+    uint32_t num, zlen;
+    uint8_t len;
+    int ret, i;
+
+    num = qemu_get_be32(f);
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)id, len);
+    id[len] = 0;
+    if (num == 0 || num > MULTIFD_PACKET_MAX_PAGES) {
+        error_report("multifd: invalid page count %" PRIu32, num);
+        return -EINVAL;
+    }
+    for (i = 0; i < num; i++) {
+        offset[i] = qemu_get_be64(f);
+    }
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+
+    rcu_read_lock();
+    block = qemu_ram_block_by_name(id);
+    if (!block) {
+        error_report("multifd: can't find block %s", id);
+        ret = -EINVAL;
+        goto out;
+    }
+    for (i = 0; i < num; i++) {
+        host[i] = host_from_ram_block_offset(block, offset[i]);
+        if (!host[i] || (offset[i] & ~TARGET_PAGE_MASK)) {
+            error_report("multifd: illegal offset " RAM_ADDR_FMT
+                         " in block %s", offset[i], id);
+            ret = -EINVAL;
+            goto out;
+        }
+    }
+
+    if (!p->ops) {
+        for (i = 0; i < num; i++) {
+            qemu_get_buffer(f, host[i], TARGET_PAGE_SIZE);
+        }
+        ret = qemu_file_get_error(f);
+        goto out;
+    }
+
+    zlen = qemu_get_be32(f);
+    if (zlen > p->zbuf_len) {
+        error_report("multifd: compressed data too long (%" PRIu32 ")", zlen);
+        ret = -EINVAL;
+        goto out;
+    }
+    qemu_get_buffer(f, p->zbuf, zlen);
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        goto out;
+    }
+    if (p->ops->recv_pages(p, host, num, zlen) < 0) {
+        error_report("multifd: can't decompress pages in block %s", id);
+        ret = -EINVAL;
+    }
+out:
+    rcu_read_unlock();
+    return ret;
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParam *p = opaque;
+    QEMUFile *f = p->file;
+    uint32_t type, compression;
+    int ret = 0;
+
+    rcu_register_thread();
+
+    if (qemu_get_be32(f) != MULTIFD_MAGIC ||
+        qemu_get_be32(f) != MULTIFD_VERSION) {
+        error_report("multifd: channel without a valid header");
+        ret = -EINVAL;
+        goto out;
+    }
+    trace_multifd_recv_channel(qemu_get_be32(f));
+    compression = qemu_get_be32(f);
+    if (compression >= MULTIFD_COMPRESSION__MAX ||
+        (compression != MULTIFD_COMPRESSION_NONE &&
+         !multifd_ops[compression])) {
+        error_report("multifd: compression method %" PRIu32
+                     " is not supported", compression);
+        ret = -EINVAL;
+        goto out;
+    }
+    p->ops = multifd_ops[compression];
+    if (p->ops && p->ops->recv_setup(p) < 0) {
+        error_report("multifd: can't set up decompression");
+        p->ops = NULL;
+        ret = -EINVAL;
+        goto out;
+    }
+
+    while (!atomic_read(&multifd_recv.quit)) {
+        type = qemu_get_be32(f);
+        ret = qemu_file_get_error(f);
+        if (ret) {
+            break;
+        }
+        if (type == MULTIFD_PACKET_SYNC) {
+            atomic_inc(&p->synced);
+            qemu_bh_schedule(multifd_recv.bh);
+            qemu_event_set(&multifd_recv.event);
+            qemu_sem_wait(&p->sem_sync);
+        } else if (type == MULTIFD_PACKET_PAGES) {
+            ret = multifd_recv_pages(p);
+            if (ret) {
+                break;
+            }
+        } else {
+            error_report("multifd: unknown packet type %" PRIu32, type);
+            ret = -EINVAL;
+            break;
+        }
+    }
+
+out:
+    if (ret && !atomic_read(&multifd_recv.quit)) {
+        atomic_cmpxchg(&multifd_recv.error, 0, ret);
+        qemu_bh_schedule(multifd_recv.bh);
+        qemu_event_set(&multifd_recv.event);
+    }
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void multifd_recv_init(void)
+{
+    if (!multifd_recv.bh) {
+        multifd_recv.bh = qemu_bh_new(multifd_recv_bh, NULL);
+        qemu_event_init(&multifd_recv.event, false);
+    }
+}
+
+/* Called from the main loop for every connection after the main stream */
+void multifd_recv_new_channel(QIOChannel *ioc)
+{
+    MultiFDRecvParam *p;
+
+    if (multifd_recv.count == MULTIFD_MAX_CHANNELS) {
+        error_report("multifd: too many channels");
+        return;
+    }
+    multifd_recv_init();
+
+    p = g_new0(MultiFDRecvParam, 1);
+    qio_channel_set_blocking(ioc, true, NULL);
+    object_ref(OBJECT(ioc));
+    p->c = ioc;
+    p->file = qemu_fopen_channel_input(ioc);
+    qemu_sem_init(&p->sem_sync, 0);
+    qemu_thread_create(&p->thread, "multifd_recv", multifd_recv_thread, p,
+                       QEMU_THREAD_JOINABLE);
+    multifd_recv.params[multifd_recv.count++] = p;
+}
+
+/* Wait until all channels have placed the pages sent before the SYNC
+ * that the main stream has just read.  Called from the incoming coroutine,
+ * or from the COLO incoming thread with the iothread lock held. */
+static int multifd_recv_sync(uint32_t channels)
+{
+    int ret, i, synced;
+
+    if (!migrate_use_multifd()) {
+        error_report("multifd: x-multifd is not enabled");
+        return -EINVAL;
+    }
+    if (channels == 0 || channels > MULTIFD_MAX_CHANNELS) {
+        error_report("multifd: invalid number of channels %" PRIu32,
+                     channels);
+        return -EINVAL;
+    }
+    multifd_recv_init();
+    multifd_recv.expected++;
+    trace_multifd_recv_sync(multifd_recv.expected);
+
+    for (;;) {
+        if (!qemu_in_coroutine()) {
+            qemu_event_reset(&multifd_recv.event);
+        }
+        ret = atomic_read(&multifd_recv.error);
+        if (ret) {
+            return ret;
+        }
+        if (multifd_recv.count > channels) {
+            error_report("multifd: more channels than announced");
+            return -EINVAL;
+        }
+        synced = 0;
+        for (i = 0; i < multifd_recv.count; i++) {
+            if (atomic_read(&multifd_recv.params[i]->synced) >=
+                multifd_recv.expected) {
+                synced++;
+            }
+        }
+        if (synced == channels) {
+            break;
+        }
+        if (qemu_in_coroutine()) {
+            multifd_recv.waiting_co = qemu_coroutine_self();
+            qemu_coroutine_yield();
+        } else {
+            qemu_event_wait(&multifd_recv.event);
+        }
+    }
+
+    for (i = 0; i < multifd_recv.count; i++) {
+        qemu_sem_post(&multifd_recv.params[i]->sem_sync);
+    }
+    return 0;
+}
+
+void multifd_recv_threads_join(void)
+{
+    int i;
+
+    socket_recv_channels_close();
+    atomic_set(&multifd_recv.quit, true);
+    for (i = 0; i < multifd_recv.count; i++) {
+        MultiFDRecvParam *p = multifd_recv.params[i];
+
+        qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        qemu_sem_post(&p->sem_sync);
+        qemu_thread_join(&p->thread);
+        qemu_fclose(p->file);
+        object_unref(OBJECT(p->c));
+        qemu_sem_destroy(&p->sem_sync);
+        if (p->ops) {
+            p->ops->recv_cleanup(p);
+        }
+        g_free(p);
+        multifd_recv.params[i] = NULL;
+    }
+    if (multifd_recv.bh) {
+        qemu_bh_delete(multifd_recv.bh);
+        multifd_recv.bh = NULL;
+        qemu_event_destroy(&multifd_recv.event);
+    }
+    multifd_recv.count = 0;
+    multifd_recv.expected = 0;
+    multifd_recv.waiting_co = NULL;
+    multifd_recv.error = 0;
+    multifd_recv.quit = false;
+}
+
 /*
  * Allocate data structures etc needed by incoming migration with postcopy-ram
  * postcopy-ram's similarly names postcopy_ram_incoming_init does the work
@@ -2575,6 +4252,12 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            ret = multifd_recv_sync(qemu_get_be32(f));
+            break;
+        case RAM_SAVE_FLAG_MAPPED:
+            ret = ram_load_mapped_image();
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
@@ -50,6 +50,15 @@
 
 #define RDMA_REG_CHUNK_SHIFT 20 /* 1 MB */
 
+/*
+ * When a chunk has to be registered on the destination, the chunks after
+ * it in the same block that are not zero are registered in the same
+ * request; this many are looked at, and at most RDMA_REG_BATCH_MAX
+ * registered.
+ */
+#define RDMA_REG_BATCH_SCAN 64
+#define RDMA_REG_BATCH_MAX  32
+
 /*
  * This is only for non-live state being migrated.
  * Instead of RDMA_WRITE messages, we use RDMA_SEND
@@ -1867,11 +1876,12 @@ static int qemu_rdma_write_one(QEMUFile *f, RDMAContext *rdma,
     struct ibv_sge sge;
     struct ibv_send_wr send_wr = { 0 };
     struct ibv_send_wr *bad_wr;
-    int reg_result_idx, ret, count = 0;
-    uint64_t chunk, chunks;
+    int reg_result_idx, ret, i;
+    uint64_t chunk, chunks, next;
     uint8_t *chunk_start, *chunk_end;
     RDMALocalBlock *block = &(rdma->local_ram_blocks.block[current_index]);
-    RDMARegister reg;
+    RDMARegister regs[RDMA_REG_BATCH_MAX];
+    uint64_t reg_chunks[RDMA_REG_BATCH_MAX];
     RDMARegisterResult *reg_result;
     RDMAControlHeader resp = { .type = RDMA_CONTROL_REGISTER_RESULT };
     RDMAControlHeader head = { .len = sizeof(RDMARegister),
@@ -1910,24 +1920,30 @@ retry:
 
     if (!rdma->pin_all) {
 #ifdef RDMA_UNREGISTRATION_EXAMPLE
+        int count = 0;
+
         qemu_rdma_unregister_waiting(rdma);
-#endif
-    }
 
-    while (test_bit(chunk, block->transit_bitmap)) {
-        (void)count;
-        trace_qemu_rdma_write_one_block(count++, current_index, chunk,
-                sge.addr, length, rdma->nb_sent, block->nb_chunks);
+        /*
+         * A chunk can only be unregistered once nothing is in flight for
+         * it.  Writes on the queue pair are performed in order, so without
+         * unregistration several writes to one chunk can be posted at once.
+         */
+        while (test_bit(chunk, block->transit_bitmap)) {
+            trace_qemu_rdma_write_one_block(count++, current_index, chunk,
+                    sge.addr, length, rdma->nb_sent, block->nb_chunks);
 
-        ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE, NULL);
+            ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE, NULL);
 
-        if (ret < 0) {
-            error_report("Failed to Wait for previous write to complete "
-                    "block %d chunk %" PRIu64
-                    " current %" PRIu64 " len %" PRIu64 " %d",
-                    current_index, chunk, sge.addr, length, rdma->nb_sent);
-            return ret;
+            if (ret < 0) {
+                error_report("Failed to Wait for previous write to complete "
+                        "block %d chunk %" PRIu64
+                        " current %" PRIu64 " len %" PRIu64 " %d",
+                        current_index, chunk, sge.addr, length, rdma->nb_sent);
+                return ret;
+            }
         }
+#endif
     }
 
     if (!rdma->pin_all || !block->is_ram_block) {
@@ -1966,21 +1982,54 @@ retry:
             }
 
             /*
-             * Otherwise, tell other side to register.
+             * Otherwise, tell other side to register, and to register the
+             * chunks that follow while at it, so that the next writes do
+             * not need a round trip each.
              */
-            reg.current_index = current_index;
+            regs[0].current_index = current_index;
             if (block->is_ram_block) {
-                reg.key.current_addr = current_addr;
+                regs[0].key.current_addr = current_addr;
             } else {
-                reg.key.chunk = chunk;
+                regs[0].key.chunk = chunk;
             }
-            reg.chunks = chunks;
+            regs[0].chunks = chunks;
+            reg_chunks[0] = chunk;
+            head.repeat = 1;
 
             trace_qemu_rdma_write_one_sendreg(chunk, sge.length, current_index,
                                               current_addr);
 
-            register_to_network(rdma, &reg);
-            ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *) &reg,
+            for (next = chunk + chunks + 1;
+                 next < block->nb_chunks &&
+                 next <= chunk + chunks + RDMA_REG_BATCH_SCAN &&
+                 head.repeat < RDMA_REG_BATCH_MAX;
+                 next++) {
+                uint8_t *next_start = ram_chunk_start(block, next);
+                uint8_t *next_end = ram_chunk_end(block, next);
+                RDMARegister *reg = &regs[head.repeat];
+
+                /* Zero chunks are better sent as RDMA_CONTROL_COMPRESS */
+                if (block->remote_keys[next] ||
+                    buffer_is_zero(next_start, next_end - next_start)) {
+                    continue;
+                }
+                reg->current_index = current_index;
+                if (block->is_ram_block) {
+                    reg->key.current_addr = block->offset +
+                        (next_start - block->local_host_addr);
+                } else {
+                    reg->key.chunk = next;
+                }
+                reg->chunks = 0;
+                reg_chunks[head.repeat++] = next;
+            }
+            head.len = head.repeat * sizeof(RDMARegister);
+            trace_qemu_rdma_write_one_sendreg_batch(head.repeat);
+
+            for (i = 0; i < head.repeat; i++) {
+                register_to_network(rdma, &regs[i]);
+            }
+            ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *) regs,
                                     &resp, &reg_result_idx, NULL);
             if (ret < 0) {
                 return ret;
@@ -1997,12 +2046,20 @@ retry:
             reg_result = (RDMARegisterResult *)
                     rdma->wr_data[reg_result_idx].control_curr;
 
-            network_to_result(reg_result);
+            if (resp.repeat != head.repeat) {
+                error_report("rdma: %d registrations answered of %d",
+                             resp.repeat, head.repeat);
+                return -EINVAL;
+            }
+            for (i = 0; i < head.repeat; i++) {
+                network_to_result(&reg_result[i]);
 
-            trace_qemu_rdma_write_one_recvregres(block->remote_keys[chunk],
-                                                 reg_result->rkey, chunk);
+                trace_qemu_rdma_write_one_recvregres(
+                        block->remote_keys[reg_chunks[i]],
+                        reg_result[i].rkey, reg_chunks[i]);
 
-            block->remote_keys[chunk] = reg_result->rkey;
+                block->remote_keys[reg_chunks[i]] = reg_result[i].rkey;
+            }
             block->remote_host_addr = reg_result->host_addr;
         } else {
             /* already registered before */
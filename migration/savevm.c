@@ -1070,6 +1070,7 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
     SaveStateEntry *se;
     int ret;
     bool in_postcopy = migration_in_postcopy(migrate_get_current());
+    int64_t device_start, device_bytes;
 
     trace_savevm_state_complete_precopy();
 
@@ -1105,6 +1106,8 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
         return;
     }
 
+    device_start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    device_bytes = qemu_ftell(f);
     vmdesc = qjson_new();
     json_prop_int(vmdesc, "page_size", TARGET_PAGE_SIZE);
     json_start_array(vmdesc, "devices");
@@ -1131,6 +1134,8 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
 
         json_end_object(vmdesc);
     }
+    trace_savevm_state_complete_devices(qemu_ftell(f) - device_bytes,
+                    qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - device_start);
 
     if (!in_postcopy) {
         /* Postcopy stream will still be going */
@@ -1179,6 +1184,29 @@ void qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size,
     }
 }
 
+/*
+ * Estimate the bytes of the non-iterative device state that
+ * qemu_savevm_state_complete_precopy() sends after the VM is stopped.
+ * Handlers that still use save_state are not counted.
+ * Must be called with the iothread lock held.
+ */
+uint64_t qemu_savevm_state_device_size(void)
+{
+    SaveStateEntry *se;
+    uint64_t total = 0;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (!se->vmsd || !vmstate_save_needed(se->vmsd, se->opaque)) {
+            continue;
+        }
+        /* Section header and footer */
+        total += 1 + 4 + 1 + strlen(se->idstr) + 4 + 4 + 5;
+        total += vmstate_estimate_size(se->vmsd, se->opaque);
+    }
+
+    return total;
+}
+
 void qemu_savevm_state_cleanup(void)
 {
     SaveStateEntry *se;
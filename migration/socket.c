@@ -22,6 +22,7 @@
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
 #include "io/channel-socket.h"
+#include "qapi/clone-visitor.h"
 #include "trace.h"
 
 
@@ -55,6 +56,40 @@ static SocketAddress *unix_build_address(const char *path)
 }
 
 
+/* Address of the current outgoing migration, for the x-multifd channels */
+static SocketAddress *outgoing_saddr;
+
+/* Watch on the listening socket while it accepts x-multifd channels */
+static guint incoming_listen_tag;
+static int incoming_channels;
+
+QIOChannel *socket_send_channel_create(Error **errp)
+{
+    QIOChannelSocket *sioc;
+
+    if (!outgoing_saddr) {
+        error_setg(errp, "x-multifd requires a tcp or unix migration URI");
+        return NULL;
+    }
+
+    sioc = qio_channel_socket_new();
+    qio_channel_set_name(QIO_CHANNEL(sioc), "migration-socket-multifd");
+    if (qio_channel_socket_connect_sync(sioc, outgoing_saddr, errp) < 0) {
+        object_unref(OBJECT(sioc));
+        return NULL;
+    }
+    return QIO_CHANNEL(sioc);
+}
+
+void socket_recv_channels_close(void)
+{
+    if (incoming_listen_tag) {
+        /* Dropping the watch drops the last reference to the listener */
+        g_source_remove(incoming_listen_tag);
+        incoming_listen_tag = 0;
+    }
+}
+
 struct SocketConnectData {
     MigrationState *s;
     char *hostname;
@@ -100,6 +135,9 @@ static void socket_start_outgoing_migration(MigrationState *s,
         data->hostname = g_strdup(saddr->u.inet.data->host);
     }
 
+    qapi_free_SocketAddress(outgoing_saddr);
+    outgoing_saddr = QAPI_CLONE(SocketAddress, saddr);
+
     qio_channel_set_name(QIO_CHANNEL(sioc), "migration-socket-outgoing");
     qio_channel_socket_connect_async(sioc,
                                      saddr,
@@ -147,14 +185,28 @@ static gboolean socket_accept_incoming_migration(QIOChannel *ioc,
 
     trace_migration_socket_incoming_accepted();
 
+    if (migrate_use_multifd() && incoming_channels++ > 0) {
+        /* Every connection after the main one carries RAM pages */
+        qio_channel_set_name(QIO_CHANNEL(sioc), "migration-socket-multifd");
+        multifd_recv_new_channel(QIO_CHANNEL(sioc));
+        object_unref(OBJECT(sioc));
+        return TRUE;
+    }
+
     qio_channel_set_name(QIO_CHANNEL(sioc), "migration-socket-incoming");
     migration_channel_process_incoming(migrate_get_current(),
                                        QIO_CHANNEL(sioc));
     object_unref(OBJECT(sioc));
 
+    if (migrate_use_multifd()) {
+        /* Keep listening for the other channels until the end of loadvm */
+        return TRUE;
+    }
+
 out:
     /* Close listening socket as its no longer needed */
     qio_channel_close(ioc, NULL);
+    incoming_listen_tag = 0;
     return FALSE; /* unregister */
 }
 
@@ -173,11 +225,13 @@ static void socket_start_incoming_migration(SocketAddress *saddr,
         return;
     }
 
-    qio_channel_add_watch(QIO_CHANNEL(listen_ioc),
-                          G_IO_IN,
-                          socket_accept_incoming_migration,
-                          listen_ioc,
-                          (GDestroyNotify)object_unref);
+    incoming_channels = 0;
+    incoming_listen_tag =
+        qio_channel_add_watch(QIO_CHANNEL(listen_ioc),
+                              G_IO_IN,
+                              socket_accept_incoming_migration,
+                              listen_ioc,
+                              (GDestroyNotify)object_unref);
     qapi_free_SocketAddress(saddr);
 }
 
@@ -284,6 +284,57 @@ static void vmsd_desc_field_end(const VMStateDescription *vmsd, QJSON *vmdesc,
 }
 
 
+/*
+ * Estimate the number of bytes vmstate_save_state() would write, without
+ * calling pre_save or touching the device.  Variable sized fields are
+ * sized from their current length fields.
+ */
+int64_t vmstate_estimate_size(const VMStateDescription *vmsd, void *opaque)
+{
+    const VMStateDescription **sub = vmsd->subsections;
+    VMStateField *field = vmsd->fields;
+    int64_t total = 0;
+
+    while (field->name) {
+        if (!field->field_exists ||
+            field->field_exists(opaque, vmsd->version_id)) {
+            int i, n_elems = vmstate_n_elems(opaque, field);
+            int size = vmstate_size(opaque, field);
+
+            if (n_elems <= 0 || size < 0) {
+                field++;
+                continue;
+            }
+            if (!(field->flags & VMS_STRUCT)) {
+                total += (int64_t)n_elems * size;
+            } else {
+                void *base_addr = vmstate_base_addr(opaque, field, false);
+
+                for (i = 0; i < n_elems; i++) {
+                    void *addr = base_addr + size * i;
+
+                    if (field->flags & VMS_ARRAY_OF_POINTER) {
+                        addr = *(void **)addr;
+                    }
+                    total += vmstate_estimate_size(field->vmsd, addr);
+                }
+            }
+        }
+        field++;
+    }
+
+    while (sub && *sub && (*sub)->needed) {
+        if ((*sub)->needed(opaque)) {
+            /* QEMU_VM_SUBSECTION, name length, name and version */
+            total += 1 + 1 + strlen((*sub)->name) + 4;
+            total += vmstate_estimate_size(*sub, opaque);
+        }
+        sub++;
+    }
+
+    return total;
+}
+
 bool vmstate_save_needed(const VMStateDescription *vmsd, void *opaque)
 {
     if (vmsd->needed && !vmsd->needed(opaque)) {
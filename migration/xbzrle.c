@@ -12,8 +12,193 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "include/migration/migration.h"
 
+/*
+ * The encoder alternates between finding the end of a run of unchanged
+ * bytes and the end of a run of changed bytes.  Both searches have a
+ * portable version that works a long at a time, and vector versions that
+ * are selected at startup.  Since they produce the same runs, the encoded
+ * data does not depend on the host.
+ */
+
+/* Returns the first index from i on where old and new differ, or len */
+static int find_diff_int(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int i, int len)
+{
+    /* not aligned to sizeof(long) */
+    while (i < len && (i & (sizeof(long) - 1))) {
+        if (old_buf[i] != new_buf[i]) {
+            return i;
+        }
+        i++;
+    }
+
+    /* word at a time for speed */
+    while (i < len &&
+           (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+        i += sizeof(long);
+    }
+
+    /* go over the rest */
+    while (i < len && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+/* Returns the first index from i on where old and new are equal, or len */
+static int find_same_int(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int i, int len)
+{
+    /* truncation to 32-bit long okay */
+    unsigned long mask = (unsigned long)0x0101010101010101ULL;
+
+    /* not aligned to sizeof(long) */
+    while (i < len && (i & (sizeof(long) - 1))) {
+        if (old_buf[i] == new_buf[i]) {
+            return i;
+        }
+        i++;
+    }
+
+    /* word at a time for speed, stop at a word with an equal byte */
+    while (i < len) {
+        unsigned long xor;
+        xor = *(unsigned long *)(old_buf + i)
+            ^ *(unsigned long *)(new_buf + i);
+        if ((xor - mask) & ~xor & (mask << 7)) {
+            break;
+        }
+        i += sizeof(long);
+    }
+
+    while (i < len && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static int find_diff_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int len)
+{
+    while (i + 32 <= len) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t ne = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+        if (ne) {
+            return i + ctz32(ne);
+        }
+        i += 32;
+    }
+    return find_diff_int(old_buf, new_buf, i, len);
+}
+
+static int find_same_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int len)
+{
+    while (i + 32 <= len) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+        i += 32;
+    }
+    return find_same_int(old_buf, new_buf, i, len);
+}
+#pragma GCC pop_options
+
+#include <cpuid.h>
+
+static bool use_accel;
+
+static void __attribute__((constructor)) init_xbzrle_accel(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+
+    /* We must check that AVX is not just available, but usable.  */
+    if (max >= 7) {
+        __cpuid(1, a, b, c, d);
+        if ((c & bit_OSXSAVE) && (c & bit_AVX)) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            use_accel = (bv & 6) == 6 && (b & bit_AVX2);
+        }
+    }
+}
+
+#define find_diff_accel find_diff_avx2
+#define find_same_accel find_same_avx2
+
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+
+/* The vector loops only skip 16 bytes at a time that certainly belong to
+ * the run; the integer versions find where exactly it ends.  */
+static int find_diff_neon(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int len)
+{
+    while (i + 16 <= len) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8(old_buf + i), vld1q_u8(new_buf + i));
+
+        if (vminvq_u8(eq) != 0xff) {
+            break;
+        }
+        i += 16;
+    }
+    return find_diff_int(old_buf, new_buf, i, len);
+}
+
+static int find_same_neon(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int len)
+{
+    while (i + 16 <= len) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8(old_buf + i), vld1q_u8(new_buf + i));
+
+        if (vmaxvq_u8(eq) != 0) {
+            break;
+        }
+        i += 16;
+    }
+    return find_same_int(old_buf, new_buf, i, len);
+}
+
+/* NEON is always available on aarch64 */
+static bool use_accel = true;
+
+#define find_diff_accel find_diff_neon
+#define find_same_accel find_same_neon
+
+#else
+static bool use_accel;
+
+#define find_diff_accel find_diff_int
+#define find_same_accel find_same_int
+#endif
+
+bool test_xbzrle_next_accel(void)
+{
+    /* There is only one accelerated version; the next one is the
+     * integer version, after which there is nothing left to test.  */
+    if (!use_accel) {
+        return false;
+    }
+    use_accel = false;
+    return true;
+}
+
 /*
   page = zrun nzrun
        | zrun nzrun page
@@ -27,10 +212,9 @@
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen)
 {
-    uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res;
-    uint8_t *nzrun_start = NULL;
+    uint32_t zrun_len, nzrun_len;
+    int d = 0, i = 0, end;
+    bool accel = use_accel;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
                sizeof(long)));
@@ -41,28 +225,10 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        end = accel ? find_diff_accel(old_buf, new_buf, i, slen)
+                    : find_diff_int(old_buf, new_buf, i, slen);
+        zrun_len = end - i;
+        i = end;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -76,51 +242,23 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
-        nzrun_start = new_buf + i;
-
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        end = accel ? find_same_accel(old_buf, new_buf, i, slen)
+                    : find_same_int(old_buf, new_buf, i, slen);
+        nzrun_len = end - i;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
         if (d + nzrun_len > dlen) {
             return -1;
         }
-        memcpy(dst + d, nzrun_start, nzrun_len);
+        memcpy(dst + d, new_buf + i, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
+        i = end;
     }
 
     return d;
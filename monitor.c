@@ -1057,6 +1057,12 @@ static void hmp_info_opcount(Monitor *mon, const QDict *qdict)
     dump_opcount_info((FILE *)mon, monitor_fprintf);
 }
 
+static void hmp_info_tb_profile(Monitor *mon, const QDict *qdict)
+{
+    dump_tb_profile((FILE *)mon, monitor_fprintf,
+                    qdict_get_try_int(qdict, "count", 20));
+}
+
 static void hmp_info_history(Monitor *mon, const QDict *qdict)
 {
     int i;
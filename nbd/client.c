@@ -94,7 +94,7 @@ static ssize_t drop_sync(QIOChannel *ioc, size_t size)
     char small[1024];
     char *buffer;
 
-    buffer = sizeof(small) < size ? small : g_malloc(MIN(65536, size));
+    buffer = sizeof(small) >= size ? small : g_malloc(MIN(65536, size));
     while (size > 0) {
         ssize_t count = read_sync(ioc, buffer, MIN(65536, size));
 
@@ -258,6 +258,11 @@ static int nbd_handle_reply_err(QIOChannel *ioc, nbd_opt_reply *reply,
                    reply->option);
         break;
 
+    case NBD_REP_ERR_UNKNOWN:
+        error_setg(errp, "Export unknown to server for option %" PRIx32,
+                   reply->option);
+        break;
+
     default:
         error_setg(errp, "Unknown error code when asking for option %" PRIx32,
                    reply->option);
@@ -454,21 +459,135 @@ static QIOChannel *nbd_receive_starttls(QIOChannel *ioc,
 }
 
 
+/* Ask for NBD_OPT_STRUCTURED_REPLY.  Return 1 if the server agreed, 0 if
+ * it does not support it, or -1 with errp set if it is impossible to
+ * continue. */
+static int nbd_request_structured_reply(QIOChannel *ioc, Error **errp)
+{
+    nbd_opt_reply reply;
+    int ret;
+
+    if (nbd_send_option_request(ioc, NBD_OPT_STRUCTURED_REPLY, 0, NULL,
+                                errp) < 0) {
+        return -1;
+    }
+    if (nbd_receive_option_reply(ioc, NBD_OPT_STRUCTURED_REPLY, &reply,
+                                 errp) < 0) {
+        return -1;
+    }
+    ret = nbd_handle_reply_err(ioc, &reply, errp);
+    if (ret <= 0) {
+        return ret;
+    }
+    if (reply.type != NBD_REP_ACK || reply.length != 0) {
+        error_setg(errp, "Unexpected reply type %" PRIx32 " len %" PRIu32
+                   " to structured reply request", reply.type, reply.length);
+        nbd_send_opt_abort(ioc);
+        return -1;
+    }
+    return 1;
+}
+
+/* Select the base:allocation meta context for export @name with
+ * NBD_OPT_SET_META_CONTEXT.  Return 1 if the server selected it, 0 if
+ * not, or -1 with errp set if it is impossible to continue. */
+static int nbd_request_base_allocation(QIOChannel *ioc, const char *name,
+                                       Error **errp)
+{
+    const char *query = NBD_META_BASE_ALLOCATION;
+    size_t name_len = strlen(name);
+    size_t query_len = strlen(query);
+    uint32_t len = 4 + name_len + 4 + 4 + query_len;
+    char *data = g_malloc(len);
+    char *p = data;
+    nbd_opt_reply reply;
+    bool found = false;
+    int ret = -1;
+
+    /* [ 0 ..  3]   export name length
+       [ 4 ..  xx]  export name
+       [xx .. +3]   number of queries (1)
+       [   .. +3]   query length
+       [   .. yy]   query
+     */
+    stl_be_p(p, name_len);
+    memcpy(p + 4, name, name_len);
+    p += 4 + name_len;
+    stl_be_p(p, 1);
+    stl_be_p(p + 4, query_len);
+    memcpy(p + 8, query, query_len);
+
+    if (nbd_send_option_request(ioc, NBD_OPT_SET_META_CONTEXT, len, data,
+                                errp) < 0) {
+        goto out;
+    }
+
+    for (;;) {
+        char buf[4 + sizeof(NBD_META_BASE_ALLOCATION)];
+
+        if (nbd_receive_option_reply(ioc, NBD_OPT_SET_META_CONTEXT, &reply,
+                                     errp) < 0) {
+            goto out;
+        }
+        ret = nbd_handle_reply_err(ioc, &reply, errp);
+        if (ret <= 0) {
+            goto out;
+        }
+        if (reply.type == NBD_REP_ACK) {
+            break;
+        }
+
+        /* The only context that we asked for is the only one we accept */
+        ret = -1;
+        if (reply.type != NBD_REP_META_CONTEXT ||
+            reply.length != 4 + query_len) {
+            error_setg(errp, "Unexpected reply type %" PRIx32 " len %" PRIu32
+                       " to meta context request", reply.type, reply.length);
+            nbd_send_opt_abort(ioc);
+            goto out;
+        }
+        if (read_sync(ioc, buf, reply.length) != reply.length) {
+            error_setg(errp, "Failed to read meta context reply");
+            nbd_send_opt_abort(ioc);
+            goto out;
+        }
+        if (memcmp(buf + 4, query, query_len) != 0) {
+            error_setg(errp, "Server selected an unexpected meta context");
+            nbd_send_opt_abort(ioc);
+            goto out;
+        }
+        TRACE("Server selected meta context %s", query);
+        found = true;
+    }
+    ret = found;
+
+out:
+    g_free(data);
+    return ret;
+}
+
 int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
                           QCryptoTLSCreds *tlscreds, const char *hostname,
                           QIOChannel **outioc,
-                          off_t *size, Error **errp)
+                          off_t *size, NBDExtensions *ext, Error **errp)
 {
     char buf[256];
     uint64_t magic, s;
     int rc;
     bool zeroes = true;
+    NBDExtensions want = { 0 };
 
     TRACE("Receiving negotiation tlscreds=%p hostname=%s.",
           tlscreds, hostname ? hostname : "<null>");
 
     rc = -EINVAL;
 
+    /* Only what the server agrees to is reported back */
+    if (ext) {
+        want = *ext;
+        memset(ext, 0, sizeof(*ext));
+    }
+
     if (outioc) {
         *outioc = NULL;
     }
@@ -565,6 +684,22 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
             if (nbd_receive_query_exports(ioc, name, errp) < 0) {
                 goto fail;
             }
+
+            if (want.structured_reply) {
+                int ret = nbd_request_structured_reply(ioc, errp);
+                if (ret < 0) {
+                    goto fail;
+                }
+                ext->structured_reply = ret;
+            }
+            /* Block status replies are always structured */
+            if (want.base_allocation && ext->structured_reply) {
+                int ret = nbd_request_base_allocation(ioc, name, errp);
+                if (ret < 0) {
+                    goto fail;
+                }
+                ext->base_allocation = ret;
+            }
         }
         /* write the export name request */
         if (nbd_send_option_request(ioc, NBD_OPT_EXPORT_NAME, -1, name,
@@ -773,27 +908,63 @@ ssize_t nbd_send_request(QIOChannel *ioc, NBDRequest *request)
 
 ssize_t nbd_receive_reply(QIOChannel *ioc, NBDReply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
     uint32_t magic;
     ssize_t ret;
 
-    ret = read_sync(ioc, buf, sizeof(buf));
+    /* Both kinds of header are at least this long */
+    ret = read_sync(ioc, buf, NBD_REPLY_SIZE);
     if (ret < 0) {
         return ret;
     }
 
-    if (ret != sizeof(buf)) {
+    if (ret != NBD_REPLY_SIZE) {
         LOG("read failed");
         return -EINVAL;
     }
 
+    magic = ldl_be_p(buf);
+    if (magic == NBD_STRUCTURED_REPLY_MAGIC) {
+        /* Structured reply chunk
+           [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+           [ 4 ..  5]    flags
+           [ 6 ..  7]    type
+           [ 8 .. 15]    handle
+           [16 .. 19]    length of the payload
+         */
+        do {
+            ret = read_sync(ioc, buf + NBD_REPLY_SIZE,
+                            NBD_STRUCTURED_REPLY_SIZE - NBD_REPLY_SIZE);
+            if (ret == -EAGAIN) {
+                /* The rest of the header is surely on its way */
+                qio_channel_wait(ioc, G_IO_IN);
+            }
+        } while (ret == -EAGAIN);
+        if (ret != NBD_STRUCTURED_REPLY_SIZE - NBD_REPLY_SIZE) {
+            LOG("read failed");
+            return -EINVAL;
+        }
+
+        reply->structured = true;
+        reply->error  = 0;
+        reply->flags  = lduw_be_p(buf + 4);
+        reply->type   = lduw_be_p(buf + 6);
+        reply->handle = ldq_be_p(buf + 8);
+        reply->length = ldl_be_p(buf + 16);
+
+        TRACE("Got chunk: { .flags = %" PRIx16 ", .type = %" PRIu16
+              ", handle = %" PRIu64 ", .length = %" PRIu32 " }",
+              reply->flags, reply->type, reply->handle, reply->length);
+        return 0;
+    }
+
     /* Reply
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
        [ 7 .. 15]    handle
      */
 
-    magic = ldl_be_p(buf);
+    reply->structured = false;
     reply->error  = ldl_be_p(buf + 4);
     reply->handle = ldq_be_p(buf + 8);
 
@@ -815,3 +986,128 @@ ssize_t nbd_receive_reply(QIOChannel *ioc, NBDReply *reply)
     return 0;
 }
 
+
+/* Whether the chunk [offset, offset + len) lies within @request */
+static bool nbd_chunk_in_request(NBDRequest *request, uint64_t offset,
+                                 uint32_t len)
+{
+    return offset >= request->from && len <= request->len &&
+           offset - request->from <= request->len - len;
+}
+
+/* Read the payload of the structured reply chunk @reply to @request.
+ * Data of NBD_CMD_READ goes to @qiov, and the first descriptor of
+ * NBD_CMD_BLOCK_STATUS to @extent; an error chunk sets reply->error.
+ * Return 0 if successful, or -errno if the stream can no longer be
+ * trusted. */
+int nbd_receive_reply_chunk(QIOChannel *ioc, NBDRequest *request,
+                            NBDReply *reply, QEMUIOVector *qiov,
+                            NBDExtent *extent)
+{
+    uint8_t buf[12];
+    uint64_t offset;
+    uint32_t len, error;
+    uint16_t msg_len;
+    QEMUIOVector sub;
+    ssize_t ret;
+
+    switch (reply->type) {
+    case NBD_REPLY_TYPE_NONE:
+        return reply->length ? -EINVAL : 0;
+
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+        /* [ 0 ..  7]    offset
+           [ 8 ..  xx]   data
+         */
+        if (request->type != NBD_CMD_READ || reply->length < 8) {
+            return -EINVAL;
+        }
+        if (read_sync(ioc, buf, 8) != 8) {
+            return -EIO;
+        }
+        offset = ldq_be_p(buf);
+        len = reply->length - 8;
+        if (!nbd_chunk_in_request(request, offset, len)) {
+            LOG("data chunk outside of the request");
+            return -EINVAL;
+        }
+
+        qemu_iovec_init(&sub, qiov->niov);
+        qemu_iovec_concat(&sub, qiov, offset - request->from, len);
+        ret = nbd_wr_syncv(ioc, sub.iov, sub.niov, len, true);
+        qemu_iovec_destroy(&sub);
+        return ret == len ? 0 : -EIO;
+
+    case NBD_REPLY_TYPE_OFFSET_HOLE:
+        /* [ 0 ..  7]    offset
+           [ 8 .. 11]    length of the hole
+         */
+        if (request->type != NBD_CMD_READ || reply->length != 12) {
+            return -EINVAL;
+        }
+        if (read_sync(ioc, buf, 12) != 12) {
+            return -EIO;
+        }
+        offset = ldq_be_p(buf);
+        len = ldl_be_p(buf + 8);
+        if (!nbd_chunk_in_request(request, offset, len)) {
+            LOG("hole chunk outside of the request");
+            return -EINVAL;
+        }
+        qemu_iovec_memset(qiov, offset - request->from, 0, len);
+        return 0;
+
+    case NBD_REPLY_TYPE_BLOCK_STATUS:
+        /* [ 0 ..  3]    meta context id
+           [ 4 ..  7]    length of the first extent
+           [ 8 .. 11]    its flags
+           ...           more descriptors
+         */
+        if (request->type != NBD_CMD_BLOCK_STATUS || reply->length < 12 ||
+            (reply->length - 4) % 8) {
+            return -EINVAL;
+        }
+        if (read_sync(ioc, buf, 12) != 12) {
+            return -EIO;
+        }
+        extent->length = ldl_be_p(buf + 4);
+        extent->flags = ldl_be_p(buf + 8);
+
+        /* We asked for NBD_CMD_FLAG_REQ_ONE, but need not insist */
+        len = reply->length - 12;
+        return drop_sync(ioc, len) == len ? 0 : -EIO;
+
+    default:
+        if (!(reply->type & NBD_REPLY_ERR(0))) {
+            /* Unknown informational chunk */
+            LOG("ignoring chunk type %" PRIu16, reply->type);
+            return drop_sync(ioc, reply->length) == reply->length ? 0 : -EIO;
+        }
+        /* fall through */
+    case NBD_REPLY_TYPE_ERROR:
+    case NBD_REPLY_TYPE_ERROR_OFFSET:
+        /* [ 0 ..  3]    error
+           [ 4 ..  5]    message length
+           ...           message, and the offset for ERROR_OFFSET
+         */
+        if (reply->length < 6) {
+            return -EINVAL;
+        }
+        if (read_sync(ioc, buf, 6) != 6) {
+            return -EIO;
+        }
+        error = ldl_be_p(buf);
+        msg_len = lduw_be_p(buf + 4);
+        len = reply->length - 6;
+        if (msg_len > len) {
+            return -EINVAL;
+        }
+        if (drop_sync(ioc, len) != len) {
+            return -EIO;
+        }
+
+        reply->error = error ? nbd_errno_to_system_errno(error) : EINVAL;
+        TRACE("Got error chunk: %" PRIu32, reply->error);
+        return 0;
+    }
+}
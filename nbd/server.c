@@ -84,6 +84,8 @@ struct NBDClient {
     void (*close)(NBDClient *client);
 
     bool no_zeroes;
+    bool structured_reply;
+    bool base_allocation; /* Meta context BASE_ALLOCATION_ID selected */
     NBDExport *exp;
     QCryptoTLSCreds *tlscreds;
     char *tlsaclname;
@@ -102,6 +104,15 @@ struct NBDClient {
     bool closing;
 };
 
+/* We only ever offer one meta context */
+#define BASE_ALLOCATION_ID 0
+
+/* Largest NBD_OPT_SET_META_CONTEXT payload that we bother to parse */
+#define NBD_MAX_META_CONTEXT_PAYLOAD 4096
+
+/* Most descriptors sent in one NBD_CMD_BLOCK_STATUS reply */
+#define NBD_MAX_BLOCK_STATUS_EXTENTS 128
+
 /* That's all folks */
 
 static void nbd_set_handlers(NBDClient *client);
@@ -365,6 +376,142 @@ fail:
     return rc;
 }
 
+/* Process the NBD_OPT_STRUCTURED_REPLY command.
+ * Return -errno on error, 0 on success. */
+static int nbd_negotiate_handle_structured_reply(NBDClient *client,
+                                                 uint32_t length)
+{
+    if (length) {
+        if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
+            return -EIO;
+        }
+        return nbd_negotiate_send_rep_err(client->ioc, NBD_REP_ERR_INVALID,
+                                          NBD_OPT_STRUCTURED_REPLY,
+                                          "OPT_STRUCTURED_REPLY should not "
+                                          "have length");
+    }
+
+    TRACE("Client uses structured replies");
+    client->structured_reply = true;
+    return nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK,
+                                  NBD_OPT_STRUCTURED_REPLY);
+}
+
+/* Process the NBD_OPT_SET_META_CONTEXT command.  The only context is
+ * base:allocation, the allocation status for NBD_CMD_BLOCK_STATUS.
+ * Return -errno on error, 0 on success. */
+static int nbd_negotiate_handle_meta_context(NBDClient *client,
+                                             uint32_t length)
+{
+    const char *context = NBD_META_BASE_ALLOCATION;
+    size_t context_len = strlen(context);
+    char name[NBD_MAX_NAME_SIZE + 1];
+    uint32_t name_len, nb_queries, query_len, i, id;
+    uint8_t *data, *p;
+    bool match = false;
+    int ret;
+
+    /* Client sends:
+        [ 0 ..   3]   export name length
+        [ 4 ..  xx]   export name
+        [xx .. +3]    number of queries
+        ...           queries, each a 32-bit length and a string
+     */
+    if (length > NBD_MAX_META_CONTEXT_PAYLOAD) {
+        if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
+            return -EIO;
+        }
+        return nbd_negotiate_send_rep_err(client->ioc, NBD_REP_ERR_INVALID,
+                                          NBD_OPT_SET_META_CONTEXT,
+                                          "OPT_SET_META_CONTEXT too long");
+    }
+
+    data = p = g_malloc(length);
+    if (nbd_negotiate_read(client->ioc, data, length) != length) {
+        LOG("read failed");
+        ret = -EIO;
+        goto out;
+    }
+
+    if (!client->structured_reply) {
+        ret = nbd_negotiate_send_rep_err(client->ioc, NBD_REP_ERR_INVALID,
+                                         NBD_OPT_SET_META_CONTEXT,
+                                         "Structured replies not negotiated");
+        goto out;
+    }
+
+#define TAKE(n) do { \
+        if (length - (p - data) < (n)) { \
+            goto invalid; \
+        } \
+        p += (n); \
+    } while (0)
+
+    TAKE(4);
+    name_len = ldl_be_p(p - 4);
+    if (name_len > NBD_MAX_NAME_SIZE) {
+        goto invalid;
+    }
+    TAKE(name_len);
+    memcpy(name, p - name_len, name_len);
+    name[name_len] = '\0';
+
+    TAKE(4);
+    nb_queries = ldl_be_p(p - 4);
+    for (i = 0; i < nb_queries; i++) {
+        TAKE(4);
+        query_len = ldl_be_p(p - 4);
+        TAKE(query_len);
+        if (query_len == context_len &&
+            memcmp(p - query_len, context, context_len) == 0) {
+            match = true;
+        }
+    }
+    if (p - data != length) {
+        goto invalid;
+    }
+#undef TAKE
+
+    if (!nbd_export_find(name)) {
+        ret = nbd_negotiate_send_rep_err(client->ioc, NBD_REP_ERR_UNKNOWN,
+                                         NBD_OPT_SET_META_CONTEXT,
+                                         "Export '%s' not present", name);
+        goto out;
+    }
+
+    /* A later SET_META_CONTEXT replaces the selection of an earlier one */
+    TRACE("Client %s meta context %s", match ? "selected" : "did not select",
+          context);
+    client->base_allocation = match;
+    if (match) {
+        ret = nbd_negotiate_send_rep_len(client->ioc, NBD_REP_META_CONTEXT,
+                                         NBD_OPT_SET_META_CONTEXT,
+                                         sizeof(id) + context_len);
+        if (ret < 0) {
+            goto out;
+        }
+        id = cpu_to_be32(BASE_ALLOCATION_ID);
+        if (nbd_negotiate_write(client->ioc, &id, sizeof(id)) != sizeof(id) ||
+            nbd_negotiate_write(client->ioc, context, context_len) !=
+            context_len) {
+            LOG("write failed (meta context)");
+            ret = -EIO;
+            goto out;
+        }
+    }
+    ret = nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK,
+                                 NBD_OPT_SET_META_CONTEXT);
+    goto out;
+
+invalid:
+    ret = nbd_negotiate_send_rep_err(client->ioc, NBD_REP_ERR_INVALID,
+                                     NBD_OPT_SET_META_CONTEXT,
+                                     "Malformed OPT_SET_META_CONTEXT");
+out:
+    g_free(data);
+    return ret;
+}
+
 /* Handle NBD_OPT_STARTTLS. Return NULL to drop connection, or else the
  * new channel for all further (now-encrypted) communication. */
 static QIOChannel *nbd_negotiate_handle_starttls(NBDClient *client,
@@ -573,6 +720,21 @@ static int nbd_negotiate_options(NBDClient *client)
                     return ret;
                 }
                 break;
+
+            case NBD_OPT_STRUCTURED_REPLY:
+                ret = nbd_negotiate_handle_structured_reply(client, length);
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+
+            case NBD_OPT_SET_META_CONTEXT:
+                ret = nbd_negotiate_handle_meta_context(client, length);
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+
             default:
                 if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
                     return -EIO;
@@ -615,9 +777,12 @@ static coroutine_fn int nbd_negotiate(NBDClientNewData *data)
     NBDClient *client = data->client;
     char buf[8 + 8 + 8 + 128];
     int rc;
+    /* All clients of an export share its BlockBackend, so a flush from one
+     * connection covers the writes completed on all of them. */
     const uint16_t myflags = (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_TRIM |
                               NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA |
-                              NBD_FLAG_SEND_WRITE_ZEROES);
+                              NBD_FLAG_SEND_WRITE_ZEROES |
+                              NBD_FLAG_CAN_MULTI_CONN);
     bool oldStyle;
     size_t len;
 
@@ -1067,6 +1232,226 @@ static ssize_t nbd_co_send_reply(NBDRequestData *req, NBDReply *reply,
     return rc;
 }
 
+/* Send one structured reply chunk whose payload is @iov.
+ * Return -errno on error, 0 on success. */
+static int nbd_co_send_chunk(NBDClient *client, uint64_t handle,
+                             uint16_t flags, uint16_t type,
+                             struct iovec *iov, int niov)
+{
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
+    struct iovec all[4];
+    size_t len = iov_size(iov, niov);
+    ssize_t ret;
+
+    TRACE("Sending chunk to client: { .flags = %" PRIx16 ", .type = %" PRIu16
+          ", handle = %" PRIu64 ", .length = %zu }", flags, type, handle, len);
+
+    /* Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags
+       [ 6 ..  7]    type
+       [ 8 .. 15]    handle
+       [16 .. 19]    length of the payload
+     */
+    stl_be_p(buf, NBD_STRUCTURED_REPLY_MAGIC);
+    stw_be_p(buf + 4, flags);
+    stw_be_p(buf + 6, type);
+    stq_be_p(buf + 8, handle);
+    stl_be_p(buf + 16, len);
+
+    assert(niov < ARRAY_SIZE(all));
+    all[0].iov_base = buf;
+    all[0].iov_len = sizeof(buf);
+    if (niov) {
+        memcpy(&all[1], iov, niov * sizeof(*iov));
+    }
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+    nbd_set_handlers(client);
+
+    ret = nbd_wr_syncv(client->ioc, all, niov + 1, sizeof(buf) + len, false);
+
+    client->send_coroutine = NULL;
+    nbd_set_handlers(client);
+    qemu_co_mutex_unlock(&client->send_lock);
+    return ret == sizeof(buf) + len ? 0 : -EIO;
+}
+
+/* Finish a structured reply with an error chunk.
+ * Return -errno on error, 0 on success. */
+static int nbd_co_send_structured_error(NBDClient *client, uint64_t handle,
+                                        uint32_t error)
+{
+    uint8_t buf[4 + 2];
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+
+    /* [ 0 ..  3]    error
+       [ 4 ..  5]    message length (no message)
+     */
+    stl_be_p(buf, system_errno_to_nbd_errno(error));
+    stw_be_p(buf + 4, 0);
+    return nbd_co_send_chunk(client, handle, NBD_REPLY_FLAG_DONE,
+                             NBD_REPLY_TYPE_ERROR, &iov, 1);
+}
+
+/* Find the allocation status at @offset in the export: store the length
+ * of the extent that starts there, at most @bytes, in *@len and return its
+ * NBD_STATE_* flags, or -errno. */
+static int nbd_export_block_status(NBDExport *exp, uint64_t offset,
+                                   uint32_t bytes, uint32_t *len)
+{
+    BlockDriverState *file;
+    int64_t sector_num;
+    int nb_sectors, pnum;
+    int64_t ret;
+    int flags = 0;
+
+    offset += exp->dev_offset;
+    if (!QEMU_IS_ALIGNED(offset, BDRV_SECTOR_SIZE) ||
+        bytes < BDRV_SECTOR_SIZE) {
+        /* Not worth a query, just call it data */
+        *len = MIN(bytes, BDRV_SECTOR_SIZE - (offset % BDRV_SECTOR_SIZE));
+        return 0;
+    }
+
+    sector_num = offset >> BDRV_SECTOR_BITS;
+    nb_sectors = MIN(bytes >> BDRV_SECTOR_BITS, BDRV_REQUEST_MAX_SECTORS);
+    ret = bdrv_get_block_status_above(blk_bs(exp->blk), NULL, sector_num,
+                                      nb_sectors, &pnum, &file);
+    if (ret < 0) {
+        return ret;
+    }
+    if (pnum == 0) {
+        /* Past the end of the image */
+        *len = bytes;
+        return 0;
+    }
+
+    *len = pnum << BDRV_SECTOR_BITS;
+    if (ret & BDRV_BLOCK_ZERO) {
+        flags |= NBD_STATE_ZERO;
+    }
+    if (!(ret & BDRV_BLOCK_DATA)) {
+        flags |= NBD_STATE_HOLE;
+    }
+    return flags;
+}
+
+/* Answer NBD_CMD_READ with structured replies, sending holes for the
+ * parts that read as zeroes instead of their data.
+ * Return -errno if the connection must be dropped, 0 otherwise. */
+static int nbd_co_send_sparse_read(NBDRequestData *req, NBDRequest *request)
+{
+    NBDClient *client = req->client;
+    NBDExport *exp = client->exp;
+    uint32_t done = 0, len;
+    uint8_t buf[8 + 4];
+    struct iovec iov[2];
+    int status, ret;
+
+    if (request->len == 0) {
+        return nbd_co_send_chunk(client, request->handle, NBD_REPLY_FLAG_DONE,
+                                 NBD_REPLY_TYPE_NONE, NULL, 0);
+    }
+
+    while (done < request->len) {
+        uint64_t offset = request->from + done;
+        uint16_t flags;
+
+        ret = status = nbd_export_block_status(exp, offset,
+                                               request->len - done, &len);
+        if (status >= 0 && !(status & NBD_STATE_ZERO)) {
+            ret = blk_pread(exp->blk, offset + exp->dev_offset,
+                            req->data + done, len);
+        }
+        if (ret < 0) {
+            LOG("reading from file failed");
+            return nbd_co_send_structured_error(client, request->handle,
+                                                -ret);
+        }
+
+        done += len;
+        flags = done == request->len ? NBD_REPLY_FLAG_DONE : 0;
+        stq_be_p(buf, offset);
+        iov[0].iov_base = buf;
+        if (status & NBD_STATE_ZERO) {
+            /* [ 0 ..  7]    offset
+               [ 8 .. 11]    length of the hole
+             */
+            stl_be_p(buf + 8, len);
+            iov[0].iov_len = 12;
+            ret = nbd_co_send_chunk(client, request->handle, flags,
+                                    NBD_REPLY_TYPE_OFFSET_HOLE, iov, 1);
+        } else {
+            /* [ 0 ..  7]    offset
+               [ 8 ..  xx]   data
+             */
+            iov[0].iov_len = 8;
+            iov[1].iov_base = req->data + done - len;
+            iov[1].iov_len = len;
+            ret = nbd_co_send_chunk(client, request->handle, flags,
+                                    NBD_REPLY_TYPE_OFFSET_DATA, iov, 2);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    TRACE("Read %" PRIu32" byte(s)", request->len);
+    return 0;
+}
+
+/* Answer NBD_CMD_BLOCK_STATUS with the base:allocation descriptors of the
+ * requested range, merging neighbours with the same flags.
+ * Return -errno if the connection must be dropped, 0 otherwise. */
+static int nbd_co_send_block_status(NBDClient *client, NBDRequest *request)
+{
+    int max_extents = request->flags & NBD_CMD_FLAG_REQ_ONE ?
+                      1 : NBD_MAX_BLOCK_STATUS_EXTENTS;
+    uint8_t *buf = g_malloc(4 + max_extents * 8);
+    struct iovec iov = { .iov_base = buf };
+    uint32_t done = 0, len;
+    int n = 0, last_flags = -1;
+    int ret;
+
+    /* [ 0 ..  3]    meta context id
+       [ 4 ..  7]    length of the first extent
+       [ 8 .. 11]    its flags
+       ...           more descriptors
+     */
+    stl_be_p(buf, BASE_ALLOCATION_ID);
+    while (done < request->len) {
+        ret = nbd_export_block_status(client->exp, request->from + done,
+                                      request->len - done, &len);
+        if (ret < 0) {
+            LOG("block status failed");
+            ret = nbd_co_send_structured_error(client, request->handle,
+                                               -ret);
+            goto out;
+        }
+        if (ret == last_flags) {
+            stl_be_p(buf + 4 + (n - 1) * 8,
+                     ldl_be_p(buf + 4 + (n - 1) * 8) + len);
+        } else if (n < max_extents) {
+            stl_be_p(buf + 4 + n * 8, len);
+            stl_be_p(buf + 8 + n * 8, ret);
+            last_flags = ret;
+            n++;
+        } else {
+            break;
+        }
+        done += len;
+    }
+
+    iov.iov_len = 4 + n * 8;
+    ret = nbd_co_send_chunk(client, request->handle, NBD_REPLY_FLAG_DONE,
+                            NBD_REPLY_TYPE_BLOCK_STATUS, &iov, 1);
+out:
+    g_free(buf);
+    return ret;
+}
+
 /* Collect a client request.  Return 0 if request looks valid, -EAGAIN
  * to keep trying the collection, -EIO to drop connection right away,
  * and any other negative value to report an error to the client
@@ -1147,7 +1532,8 @@ static ssize_t nbd_co_receive_request(NBDRequestData *req,
         rc = request->type == NBD_CMD_WRITE ? -ENOSPC : -EINVAL;
         goto out;
     }
-    if (request->flags & ~(NBD_CMD_FLAG_FUA | NBD_CMD_FLAG_NO_HOLE)) {
+    if (request->flags & ~(NBD_CMD_FLAG_FUA | NBD_CMD_FLAG_NO_HOLE |
+                           NBD_CMD_FLAG_REQ_ONE)) {
         LOG("unsupported flags (got 0x%x)", request->flags);
         rc = -EINVAL;
         goto out;
@@ -1158,6 +1544,12 @@ static ssize_t nbd_co_receive_request(NBDRequestData *req,
         rc = -EINVAL;
         goto out;
     }
+    if (request->type != NBD_CMD_BLOCK_STATUS &&
+        (request->flags & NBD_CMD_FLAG_REQ_ONE)) {
+        LOG("unexpected flags (got 0x%x)", request->flags);
+        rc = -EINVAL;
+        goto out;
+    }
 
     rc = 0;
 
@@ -1222,6 +1614,13 @@ static void nbd_trip(void *opaque)
             }
         }
 
+        if (client->structured_reply) {
+            if (nbd_co_send_sparse_read(req, &request) < 0) {
+                goto out;
+            }
+            break;
+        }
+
         ret = blk_pread(exp->blk, request.from + exp->dev_offset,
                         req->data, request.len);
         if (ret < 0) {
@@ -1309,6 +1708,18 @@ static void nbd_trip(void *opaque)
             goto out;
         }
         break;
+    case NBD_CMD_BLOCK_STATUS:
+        TRACE("Request type is BLOCK_STATUS");
+
+        if (!client->base_allocation || request.len == 0) {
+            reply.error = EINVAL;
+            goto error_reply;
+        }
+        if (nbd_co_send_block_status(client, &request) < 0) {
+            goto out;
+        }
+        break;
+
     case NBD_CMD_TRIM:
         TRACE("Request type is TRIM");
         ret = blk_co_pdiscard(exp->blk, request.from + exp->dev_offset,
@@ -1325,6 +1736,17 @@ static void nbd_trip(void *opaque)
         LOG("invalid request type (%" PRIu32 ") received", request.type);
         reply.error = EINVAL;
     error_reply:
+        /* Structured replies do not allow a simple reply to these */
+        if (client->structured_reply &&
+            (request.type == NBD_CMD_READ ||
+             request.type == NBD_CMD_BLOCK_STATUS)) {
+            if (nbd_co_send_structured_error(client, request.handle,
+                                             reply.error) < 0) {
+                goto out;
+            }
+            break;
+        }
+
         /* We must disconnect after NBD_CMD_WRITE if we did not
          * read the payload.
          */
@@ -20,20 +20,86 @@
 #include "net/checksum.h"
 #include "net/eth.h"
 
-uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+/* Sum the 16-bit words of a buffer whose length is a multiple of 16 */
+static uint64_t net_checksum_add_sse2(const uint8_t *buf, int len)
 {
-    uint32_t sum = 0;
-    int i;
+    const __m128i zero = _mm_setzero_si128();
+    uint64_t sum = 0;
+    uint32_t lanes[4];
+    int i = 0;
 
-    for (i = seq; i < seq + len; i++) {
-        if (i & 1) {
-            sum += (uint32_t)buf[i - seq];
-        } else {
-            sum += (uint32_t)buf[i - seq] << 8;
+    while (i < len) {
+        __m128i acc = _mm_setzero_si128();
+        /* Each step adds at most 0x1fffe to a lane; stop before a carry */
+        int end = MIN(len, i + 0x8000 * 16);
+
+        for (; i < end; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+
+            acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_unpacklo_epi16(v, zero),
+                                                   _mm_unpackhi_epi16(v, zero)));
         }
+        _mm_storeu_si128((__m128i *)lanes, acc);
+        sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
     }
     return sum;
 }
+#endif
+
+/*
+ * The ones' complement sum doesn't depend on the byte order it is computed
+ * in, as long as the result is swapped back, and on a buffer that starts at
+ * an odd position it is the byte-swapped sum of the same buffer starting at
+ * an even one (RFC 1071).  So sum host-endian words with a wide accumulator
+ * and fix the byte order of the folded result.  The result is already
+ * folded to 16 bits.
+ */
+uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+{
+    uint64_t sum = 0;
+    uint16_t res;
+    int i = 0;
+
+    if (len <= 0) {
+        return 0;
+    }
+
+#ifdef __SSE2__
+    i = len & ~15;
+    sum = net_checksum_add_sse2(buf, i);
+#endif
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w = ldq_he_p(buf + i);
+
+        sum += w;
+        sum += sum < w;
+    }
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    for (; i + 2 <= len; i += 2) {
+        sum += lduw_he_p(buf + i);
+    }
+    if (i < len) {
+        uint8_t tail[2] = { buf[i], 0 };
+
+        sum += lduw_he_p(tail);
+    }
+
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    res = sum;
+
+#ifndef HOST_WORDS_BIGENDIAN
+    res = bswap16(res);
+#endif
+    if (seq & 1) {
+        res = bswap16(res);
+    }
+    return res;
+}
 
 uint16_t net_checksum_finish(uint32_t sum)
 {
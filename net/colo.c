@@ -153,11 +153,13 @@ void connection_destroy(void *opaque)
     g_slice_free(Connection, conn);
 }
 
+/* The data follows the Packet in the same allocation */
 Packet *packet_new(const void *data, int size)
 {
-    Packet *pkt = g_slice_new(Packet);
+    Packet *pkt = g_malloc(sizeof(Packet) + size);
 
-    pkt->data = g_memdup(data, size);
+    pkt->data = pkt + 1;
+    memcpy(pkt->data, data, size);
     pkt->size = size;
     pkt->creation_ms = qemu_clock_get_ms(QEMU_CLOCK_HOST);
 
@@ -168,8 +170,7 @@ void packet_destroy(void *opaque, void *user_data)
 {
     Packet *pkt = opaque;
 
-    g_free(pkt->data);
-    g_slice_free(Packet, pkt);
+    g_free(pkt);
 }
 
 /*
@@ -667,6 +667,83 @@ ssize_t qemu_send_packet_async(NetClientState *sender,
                                              buf, size, sent_cb);
 }
 
+/* Map a receive buffer of the peer of @nc for the next packet.  This is
+ * only possible while nothing else could see the packet on its way: no
+ * filters on either side and no packets queued before it.
+ */
+int qemu_rx_map(NetClientState *nc, struct iovec *iov, int iovcnt)
+{
+    NetClientState *peer = nc->peer;
+
+    if (nc->link_down || !peer || peer->link_down || !peer->info->rx_map) {
+        return 0;
+    }
+
+    if (!QTAILQ_EMPTY(&nc->filters) || !QTAILQ_EMPTY(&peer->filters) ||
+        !qemu_net_queue_empty(peer->incoming_queue) ||
+        !qemu_can_send_packet(nc)) {
+        return 0;
+    }
+
+    return peer->info->rx_map(peer, iov, iovcnt);
+}
+
+bool qemu_rx_commit(NetClientState *nc, size_t size)
+{
+    return nc->peer->info->rx_commit(nc->peer, size);
+}
+
+void qemu_rx_cancel(NetClientState *nc)
+{
+    nc->peer->info->rx_cancel(nc->peer);
+}
+
+/* Packets that @nc sends between qemu_net_batch_begin and
+ * qemu_net_batch_end form one burst for its peer, which gets a chance to
+ * complete them together in its flush_batch callback.  Batches nest.
+ */
+void qemu_net_batch_begin(NetClientState *nc)
+{
+    if (nc->peer) {
+        nc->peer->batching++;
+    }
+}
+
+void qemu_net_batch_end(NetClientState *nc)
+{
+    NetClientState *peer = nc->peer;
+
+    if (!peer) {
+        return;
+    }
+
+    assert(peer->batching > 0);
+    if (--peer->batching == 0 && peer->info->flush_batch) {
+        peer->info->flush_batch(peer);
+    }
+}
+
+/* Send @count packets, one per element of @pkts, as one batch.  Returns
+ * the number of packets that had to be queued; @sent_cb is called for each
+ * of them once the peer has taken it.
+ */
+int qemu_send_packets_async(NetClientState *nc, const struct iovec *pkts,
+                            int count, NetPacketSent *sent_cb)
+{
+    int i, queued = 0;
+
+    qemu_net_batch_begin(nc);
+    for (i = 0; i < count; i++) {
+        if (qemu_send_packet_async(nc, pkts[i].iov_base, pkts[i].iov_len,
+                                   sent_cb) == 0) {
+            queued++;
+        }
+    }
+    qemu_net_batch_end(nc);
+
+    return queued;
+}
+
 void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size)
 {
     qemu_send_packet_async(nc, buf, size, NULL);
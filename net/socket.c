@@ -34,6 +34,13 @@
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
 
+#ifdef CONFIG_SENDMMSG
+/* Datagrams moved by one recvmmsg or sendmmsg call */
+#define NET_SOCKET_BATCH    16
+/* Outgoing datagrams are copied here until they are sent */
+#define NET_SOCKET_TX_ARENA (64 * 1024)
+#endif
+
 typedef struct NetSocketState {
     NetClientState nc;
     int listen_fd;
@@ -44,6 +51,15 @@ typedef struct NetSocketState {
     IOHandler *send_fn;           /* differs between SOCK_STREAM/SOCK_DGRAM */
     bool read_poll;               /* waiting to receive data? */
     bool write_poll;              /* waiting to transmit data? */
+#ifdef CONFIG_SENDMMSG
+    uint8_t *rx_buf;              /* NET_SOCKET_BATCH buffers (SOCK_DGRAM) */
+    uint8_t *tx_arena;            /* data of tx_msg (SOCK_DGRAM) */
+    struct mmsghdr tx_msg[NET_SOCKET_BATCH];
+    struct iovec tx_iov[NET_SOCKET_BATCH];
+    int tx_head;                  /* first entry of tx_msg not sent yet */
+    int tx_count;                 /* entries of tx_msg in use */
+    size_t tx_used;               /* bytes of tx_arena in use */
+#endif
 } NetSocketState;
 
 static void net_socket_accept(void *opaque);
@@ -69,12 +85,56 @@ static void net_socket_write_poll(NetSocketState *s, bool enable)
     net_socket_update_fd_handler(s);
 }
 
+#ifdef CONFIG_SENDMMSG
+/* Send the datagrams collected by net_socket_receive_dgram */
+static void net_socket_flush_dgram(NetSocketState *s)
+{
+    int ret;
+
+    while (s->tx_head < s->tx_count) {
+        do {
+            ret = sendmmsg(s->fd, s->tx_msg + s->tx_head,
+                           s->tx_count - s->tx_head, 0);
+        } while (ret == -1 && errno == EINTR);
+
+        if (ret == -1) {
+            if (errno == EAGAIN) {
+                net_socket_write_poll(s, true);
+                return;
+            }
+            /* Drop the datagram that failed, like sendto() would */
+            ret = 1;
+        }
+        s->tx_head += ret;
+    }
+
+    s->tx_head = s->tx_count = 0;
+    s->tx_used = 0;
+}
+
+static void net_socket_flush_batch(NetClientState *nc)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+
+    if (!s->write_poll) {
+        net_socket_flush_dgram(s);
+    }
+}
+#endif
+
 static void net_socket_writable(void *opaque)
 {
     NetSocketState *s = opaque;
 
     net_socket_write_poll(s, false);
 
+#ifdef CONFIG_SENDMMSG
+    net_socket_flush_dgram(s);
+    if (s->write_poll) {
+        return;
+    }
+#endif
+
     qemu_flush_queued_packets(&s->nc);
 }
 
@@ -118,6 +178,40 @@ static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf,
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
     ssize_t ret;
 
+#ifdef CONFIG_SENDMMSG
+    /* Keep datagrams in order behind the ones that are still pending */
+    if (s->tx_count == NET_SOCKET_BATCH ||
+        s->tx_used + size > NET_SOCKET_TX_ARENA) {
+        net_socket_flush_dgram(s);
+    }
+    if (s->tx_count > 0 && (s->tx_count == NET_SOCKET_BATCH ||
+                            s->tx_used + size > NET_SOCKET_TX_ARENA)) {
+        return 0;
+    }
+
+    if (size <= NET_SOCKET_TX_ARENA) {
+        struct mmsghdr *msg = &s->tx_msg[s->tx_count];
+        struct iovec *iov = &s->tx_iov[s->tx_count];
+
+        memcpy(s->tx_arena + s->tx_used, buf, size);
+        iov->iov_base = s->tx_arena + s->tx_used;
+        iov->iov_len = size;
+        memset(msg, 0, sizeof(*msg));
+        msg->msg_hdr.msg_name = &s->dgram_dst;
+        msg->msg_hdr.msg_namelen = sizeof(s->dgram_dst);
+        msg->msg_hdr.msg_iov = iov;
+        msg->msg_hdr.msg_iovlen = 1;
+        s->tx_count++;
+        s->tx_used += size;
+
+        /* The peer calls net_socket_flush_batch at the end of a batch */
+        if (!nc->batching && !s->write_poll) {
+            net_socket_flush_dgram(s);
+        }
+        return size;
+    }
+#endif
+
     do {
         ret = qemu_sendto(s->fd, buf, size, 0,
                           (struct sockaddr *)&s->dgram_dst,
@@ -189,6 +283,44 @@ static void net_socket_send(void *opaque)
     }
 }
 
+#ifdef CONFIG_SENDMMSG
+static void net_socket_send_dgram(void *opaque)
+{
+    NetSocketState *s = opaque;
+    struct mmsghdr msg[NET_SOCKET_BATCH];
+    struct iovec iov[NET_SOCKET_BATCH];
+    int i, count;
+
+    memset(msg, 0, sizeof(msg));
+    for (i = 0; i < NET_SOCKET_BATCH; i++) {
+        iov[i].iov_base = s->rx_buf + i * NET_BUFSIZE;
+        iov[i].iov_len = NET_BUFSIZE;
+        msg[i].msg_hdr.msg_iov = &iov[i];
+        msg[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    do {
+        count = recvmmsg(s->fd, msg, NET_SOCKET_BATCH, MSG_DONTWAIT, NULL);
+    } while (count == -1 && errno == EINTR);
+    if (count <= 0) {
+        return;
+    }
+
+    /* Reuse iov to describe the packets, up to an end of connection */
+    for (i = 0; i < count && msg[i].msg_len > 0; i++) {
+        iov[i].iov_len = msg[i].msg_len;
+    }
+
+    if (qemu_send_packets_async(&s->nc, iov, i,
+                                net_socket_send_completed) > 0) {
+        net_socket_read_poll(s, false);
+    }
+    if (i < count) {
+        net_socket_read_poll(s, false);
+        net_socket_write_poll(s, false);
+    }
+}
+#else
 static void net_socket_send_dgram(void *opaque)
 {
     NetSocketState *s = opaque;
@@ -208,6 +340,7 @@ static void net_socket_send_dgram(void *opaque)
         net_socket_read_poll(s, false);
     }
 }
+#endif
 
 static int net_socket_mcast_create(struct sockaddr_in *mcastaddr, struct in_addr *localaddr)
 {
@@ -308,6 +441,12 @@ static void net_socket_cleanup(NetClientState *nc)
         closesocket(s->listen_fd);
         s->listen_fd = -1;
     }
+#ifdef CONFIG_SENDMMSG
+    g_free(s->rx_buf);
+    s->rx_buf = NULL;
+    g_free(s->tx_arena);
+    s->tx_arena = NULL;
+#endif
 }
 
 static NetClientInfo net_dgram_socket_info = {
@@ -315,6 +454,9 @@ static NetClientInfo net_dgram_socket_info = {
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive_dgram,
     .cleanup = net_socket_cleanup,
+#ifdef CONFIG_SENDMMSG
+    .flush_batch = net_socket_flush_batch,
+#endif
 };
 
 static NetSocketState *net_socket_fd_init_dgram(NetClientState *peer,
@@ -366,6 +508,10 @@ static NetSocketState *net_socket_fd_init_dgram(NetClientState *peer,
     s->fd = fd;
     s->listen_fd = -1;
     s->send_fn = net_socket_send_dgram;
+#ifdef CONFIG_SENDMMSG
+    s->rx_buf = g_malloc(NET_SOCKET_BATCH * NET_BUFSIZE);
+    s->tx_arena = g_malloc(NET_SOCKET_TX_ARENA);
+#endif
     net_socket_rs_init(&s->rs, net_socket_rs_finalize);
     net_socket_read_poll(s, true);
 
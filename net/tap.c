@@ -40,11 +40,15 @@
 #include "qemu-common.h"
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
+#include "qemu/iov.h"
 
 #include "net/tap.h"
 
 #include "net/vhost_net.h"
 
+/* Receive buffers with more entries than this are not read into directly */
+#define TAP_RX_MAP_IOV 64
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
@@ -179,31 +183,81 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
     tap_read_poll(s, true);
 }
 
+/* Read the next packet into a receive buffer of the peer if it offers one.
+ * Returns the size of the packet; *delivered tells whether the peer took it
+ * or it is in s->buf.
+ */
+static ssize_t tap_read_mapped(TAPState *s, bool *delivered)
+{
+    struct iovec iov[TAP_RX_MAP_IOV + 1];
+    size_t cap;
+    ssize_t size;
+    int iovcnt = 0;
+
+    *delivered = false;
+
+    /* The peer gets the packet with the vnet header */
+    if (!s->host_vnet_hdr_len || s->using_vnet_hdr) {
+        iovcnt = qemu_rx_map(&s->nc, iov, TAP_RX_MAP_IOV);
+    }
+    if (iovcnt <= 0) {
+        return tap_read_packet(s->fd, s->buf, sizeof(s->buf));
+    }
+
+    /* Whatever doesn't fit goes to s->buf after the part that does */
+    cap = iov_size(iov, iovcnt);
+    if (cap < sizeof(s->buf)) {
+        iov[iovcnt].iov_base = s->buf + cap;
+        iov[iovcnt].iov_len = sizeof(s->buf) - cap;
+        iovcnt++;
+    }
+
+    size = readv(s->fd, iov, iovcnt);
+    if (size <= 0) {
+        qemu_rx_cancel(&s->nc);
+        return size;
+    }
+
+    if (qemu_rx_commit(&s->nc, size)) {
+        *delivered = true;
+        return size;
+    }
+
+    iov_to_buf(iov, iovcnt, 0, s->buf, MIN(size, cap));
+    qemu_rx_cancel(&s->nc);
+    return size;
+}
+
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
     int size;
     int packets = 0;
 
+    qemu_net_batch_begin(&s->nc);
     while (true) {
         uint8_t *buf = s->buf;
+        bool delivered;
 
-        size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
+        size = tap_read_mapped(s, &delivered);
         if (size <= 0) {
             break;
         }
 
-        if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
-            buf  += s->host_vnet_hdr_len;
-            size -= s->host_vnet_hdr_len;
-        }
+        if (!delivered) {
+            if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+                buf  += s->host_vnet_hdr_len;
+                size -= s->host_vnet_hdr_len;
+            }
 
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
-        if (size == 0) {
-            tap_read_poll(s, false);
-            break;
-        } else if (size < 0) {
-            break;
+            size = qemu_send_packet_async(&s->nc, buf, size,
+                                          tap_send_completed);
+            if (size == 0) {
+                tap_read_poll(s, false);
+                break;
+            } else if (size < 0) {
+                break;
+            }
         }
 
         /*
@@ -217,6 +271,7 @@ static void tap_send(void *opaque)
             break;
         }
     }
+    qemu_net_batch_end(&s->nc);
 }
 
 static bool tap_has_ufo(NetClientState *nc)
@@ -1,6 +1,7 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is set-associative: the page address selects a set of
+ * CACHE_WAYS entries and the page can be stored in any of them
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -29,11 +30,17 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/* Entries per set.  With a direct-mapped cache, two hot pages that map to
+ * the same entry keep evicting each other. */
+#define CACHE_WAYS 4
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
+    /* Hits since the page was inserted, to break ties between equal ages */
+    uint64_t it_hits;
     uint8_t *it_data;
 };
 
@@ -43,6 +50,9 @@ struct PageCache {
     int64_t max_num_items;
     uint64_t max_item_age;
     int64_t num_items;
+    /* max_num_items == num_sets * ways, both powers of 2 */
+    int64_t num_sets;
+    unsigned int ways;
 };
 
 PageCache *cache_init(int64_t num_pages, unsigned int page_size)
@@ -71,6 +81,8 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->ways = MIN(CACHE_WAYS, num_pages);
+    cache->num_sets = num_pages / cache->ways;
 
     DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
 
@@ -86,6 +98,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     for (i = 0; i < cache->max_num_items; i++) {
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
+        cache->page_cache[i].it_hits = 0;
         cache->page_cache[i].it_addr = -1;
     }
 
@@ -108,28 +121,59 @@ void cache_fini(PageCache *cache)
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+/* Returns the first entry of the set that addr maps to */
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t addr)
 {
-    g_assert(cache->max_num_items);
-    return (address / cache->page_size) & (cache->max_num_items - 1);
+    size_t set;
+
+    g_assert(cache);
+    g_assert(cache->page_cache);
+
+    set = (addr / cache->page_size) & (cache->num_sets - 1);
+    return &cache->page_cache[set * cache->ways];
 }
 
 static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set = cache_get_set(cache, addr);
+    unsigned int i;
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    for (i = 0; i < cache->ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
+}
 
-    pos = cache_get_cache_pos(cache, addr);
+/* Returns the entry to replace for addr: an empty one if there is any,
+ * otherwise the least recently used one, and of those the one with the
+ * fewest hits */
+static CacheItem *cache_get_victim(const PageCache *cache, uint64_t addr)
+{
+    CacheItem *set = cache_get_set(cache, addr);
+    CacheItem *victim = &set[0];
+    unsigned int i;
 
-    return &cache->page_cache[pos];
+    for (i = 0; i < cache->ways; i++) {
+        CacheItem *it = &set[i];
+
+        if (!it->it_data) {
+            return it;
+        }
+        if (it->it_age < victim->it_age ||
+            (it->it_age == victim->it_age && it->it_hits < victim->it_hits)) {
+            victim = it;
+        }
+    }
+    return victim;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
 bool cache_is_cached(const PageCache *cache, uint64_t addr,
@@ -139,9 +183,10 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
 
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_addr == addr) {
+    if (it) {
         /* update the it_age when the cache hit */
         it->it_age = current_age;
+        it->it_hits++;
         return true;
     }
     return false;
@@ -155,11 +200,13 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
 
     /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
-
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
+    if (!it) {
+        it = cache_get_victim(cache, addr);
+        if (it->it_data && it->it_age + CACHED_PAGE_LIFETIME > current_age) {
+            /* all pages in the set are fresh, don't replace any */
+            return -1;
+        }
+        it->it_hits = 0;
     }
     /* allocate page */
     if (!it->it_data) {
@@ -209,8 +256,11 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         old_it = &cache->page_cache[i];
         if (old_it->it_addr != -1) {
             /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data && new_it->it_age >= old_it->it_age) {
+            new_it = cache_get_victim(new_cache, old_it->it_addr);
+            if (new_it->it_data &&
+                (new_it->it_age > old_it->it_age ||
+                 (new_it->it_age == old_it->it_age &&
+                  new_it->it_hits >= old_it->it_hits))) {
                 /* keep the MRU page */
                 g_free(old_it->it_data);
             } else {
@@ -220,6 +270,7 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
                 g_free(new_it->it_data);
                 new_it->it_data = old_it->it_data;
                 new_it->it_age = old_it->it_age;
+                new_it->it_hits = old_it->it_hits;
                 new_it->it_addr = old_it->it_addr;
             }
         }
@@ -229,6 +280,8 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
     cache->page_cache = new_cache->page_cache;
     cache->max_num_items = new_cache->max_num_items;
     cache->num_items = new_cache->num_items;
+    cache->num_sets = new_cache->num_sets;
+    cache->ways = new_cache->ways;
 
     g_free(new_cache);
 
@@ -10,23 +10,53 @@ void panda_callbacks_after_block_exec(CPUState *cpu, TranslationBlock *tb);
 void panda_callbacks_before_block_translate(CPUState *cpu, target_ulong pc);
 void panda_callbacks_after_block_translate(CPUState *cpu, TranslationBlock *tb);
 bool panda_callbacks_after_find_fast(CPUState *cpu, TranslationBlock *tb, bool panda_bb_invalidate_done);
+bool panda_callbacks_before_block_exec_skip_llvm(CPUState *cpu, TranslationBlock *tb);
+// translate-all.c: whether TBs translated now should call the block exec
+// callbacks from their own code (helper_panda_block_exec), which lets them
+// stay chained
+bool panda_inline_block_exec(void);
 
 // target-i386/translate.c
 bool panda_callbacks_insn_translate(CPUState *env, target_ulong pc);
 // softmmu_template.h
+// paddr points at the access's physical address, or -1 if not yet known; the
+// phys callbacks fill it in so the before and after callbacks look it up once.
 void panda_callbacks_before_mem_read(CPUState *env, target_ulong pc, target_ulong addr,
-                                     uint32_t data_size, void *ram_ptr);
+                                     uint32_t data_size, void *ram_ptr, hwaddr *paddr);
 void panda_callbacks_after_mem_read(CPUState *env, target_ulong pc, target_ulong addr,
-                                    uint32_t data_size, uint64_t result, void *ram_ptr);
+                                    uint32_t data_size, uint64_t result, void *ram_ptr,
+                                    hwaddr *paddr);
 void panda_callbacks_before_mem_write(CPUState *env, target_ulong pc, target_ulong addr,
-                                      uint32_t data_size, uint64_t result, void *ram_ptr);
+                                      uint32_t data_size, uint64_t result, void *ram_ptr,
+                                      hwaddr *paddr);
 void panda_callbacks_after_mem_write(CPUState *env, target_ulong pc, target_ulong addr,
-                                     uint32_t data_size, uint64_t val, void *ram_ptr);
+                                     uint32_t data_size, uint64_t val, void *ram_ptr,
+                                     hwaddr *paddr);
+// Whether memory callbacks only run for accesses to pages that match the
+// filters of panda_memcb_filter_add_range(); TLB entries remember the
+// outcome of panda_memcb_filter_match() for theirs.
+extern bool panda_memcb_filtered;
+bool panda_memcb_filter_match(CPUState *cpu, hwaddr paddr);
+// for accesses that miss the TLB
+bool panda_memcb_filter_vaddr(CPUState *cpu, target_ulong addr);
+// cputlb.c, softmmu_template.h
+bool panda_callbacks_tlb_watch_page(CPUState *cpu, uint64_t ram_addr);
+// restarts the accessing instruction, not returning, if a callback asks to
+void panda_callbacks_tlb_watched_access(CPUState *cpu, target_ulong addr,
+                                        uint32_t size, bool is_write,
+                                        uintptr_t retaddr);
 // target-i386/misc_helper.c
 void panda_callbacks_cpuid(CPUState *env);
 // translate-all.c
 void panda_callbacks_cpu_restore_state(CPUState *env, TranslationBlock *tb);
 // target-i386/helper.c
 void panda_callbacks_asid_changed(CPUState *env, target_ulong old_asid, target_ulong new_asid);
+// rr_log.c
+void panda_callbacks_replay_handle_packet(CPUState *env, uint8_t *buf, int size,
+                                          uint8_t direction, uint64_t old_buf_addr);
+void panda_callbacks_replay_hd_transfer(CPUState *env, uint32_t type, uint64_t src_addr,
+                                        uint64_t dest_addr, uint32_t num_bytes);
+void panda_callbacks_replay_net_transfer(CPUState *env, uint32_t type, uint64_t src_addr,
+                                         uint64_t dest_addr, uint32_t num_bytes);
 
 #endif
@@ -23,6 +23,8 @@ void panda_set_os_name(char *os_name);
 // is_write == 0 is a read from that addr into buf.  
 int panda_physical_memory_rw(hwaddr addr, uint8_t *buf, int len, int is_write);
 
+// Translations are cached per CPU and asid until the guest flushes its
+// TLB, so plugins can translate the same pages over and over cheaply.
 hwaddr panda_virt_to_phys(CPUState *env, target_ulong addr);
 
 int panda_virtual_memory_rw(CPUState *env, target_ulong addr,
@@ -32,6 +34,22 @@ int panda_virtual_memory_read(CPUState *env, target_ulong addr,
 int panda_virtual_memory_write(CPUState *env, target_ulong addr,
                                uint8_t *buf, int len);
 
+// Same as panda_virt_to_phys() and panda_virtual_memory_read(), which
+// used to translate every page afresh.
+hwaddr panda_virt_to_phys_cached(CPUState *env, target_ulong addr);
+int panda_virtual_memory_read_cached(CPUState *env, target_ulong addr,
+                                     uint8_t *buf, int len);
+
+typedef struct {
+    target_ulong addr;
+    void *buf;
+    int len;
+} PandaMemRead;
+
+// Reads each of reads[0..n) into its buffer, zero-filling the ones that
+// fail.  Returns how many failed.
+int panda_virtual_memory_gather(CPUState *env, PandaMemRead *reads, int n);
+
 
 void panda_before_find_fast(void);
 
@@ -19,10 +19,7 @@ PANDAENDCOMMENT */
 
 void helper_panda_insn_exec(target_ulong pc) {
     // PANDA instrumentation: before basic block
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_INSN_EXEC]; plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.insn_exec(first_cpu, pc);
-    }
+    PANDA_CB_ARRAY_CALL(PANDA_CB_INSN_EXEC, insn_exec, first_cpu, pc);
 }
 
 #endif
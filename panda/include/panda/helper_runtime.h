@@ -17,6 +17,7 @@ PANDAENDCOMMENT */
 
 #ifdef __cplusplus
 
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/Pass.h"
 #include "llvm/InstVisitor.h"
@@ -28,9 +29,14 @@ class PandaCallMorphFunctionPass;
 /* 
  * PandaHelperCallVisitor class
  * Changes all LLVM call instructions to call LLVM versions of helper functions.
+ * The LLVM version of each callee is looked up once and remembered, NULL for
+ * callees that are left alone, since every TB calls the same few helpers.
  */
 class PandaHelperCallVisitor: public InstVisitor<PandaHelperCallVisitor> {
     PandaCallMorphFunctionPass *PCMFP;
+    DenseMap<Function *, Function *> llvmVersions;
+
+    Function *getLLVMVersion(Function *f);
 public:
     PandaHelperCallVisitor(PandaCallMorphFunctionPass *pass) :
         PCMFP(pass) {}
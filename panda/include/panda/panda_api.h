@@ -0,0 +1,67 @@
+#ifndef __PANDA_API_H_
+#define __PANDA_API_H_
+
+// Embedding PANDA: a long-lived program links libpanda-<target>.so (built
+// with configure --enable-libpanda) instead of starting qemu-system-<target>
+// for every replay.  The machine and the plugins are set up once from a
+// qemu command line, then any number of recordings of that machine are
+// replayed one after the other in the same process.
+//
+// Plugins resolve PANDA's symbols from the program, so the library must be
+// linked in or dlopen()ed with RTLD_GLOBAL.  All calls are made from the
+// thread that called panda_init().  Callbacks are registered with
+// panda_register_callback() from panda/plugin.h, using panda_api_handle()
+// as the plugin.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// how much of qemu's main() main_aux() runs
+typedef enum PandaMainMode {
+    PANDA_NORMAL,   // everything, as qemu-system-<target> does
+    PANDA_INIT,     // set up the machine and return before the main loop
+} PandaMainMode;
+
+int main_aux(int argc, char **argv, char **envp, PandaMainMode pmm);
+void main_loop_run(void);
+void main_cleanup(void);
+
+// Set up the machine from a qemu command line; argv[0] locates the plugins
+// as it does for qemu-system-<target>.  Plugins given with -panda are
+// loaded now.  -no-shutdown is refused, since it keeps panda_replay() from
+// returning.  Returns 0 on success.
+int panda_init(int argc, char **argv, char **envp);
+
+// Load a plugin, with args as after the ':' of -panda name:args.
+bool panda_api_load_plugin(const char *name, const char *args);
+
+// Replay the recording name (its path without -rr-snp) from its start, or
+// from the last checkpoint before start_instr if it has any, until
+// end_instr (0 for the whole recording).  Returns 0 once the replay has
+// ended and the machine has been stopped, or -1 if it could not start.
+int panda_replay(const char *name, uint64_t start_instr, uint64_t end_instr);
+
+// Owner for the callbacks that the program registers itself
+void *panda_api_handle(void);
+
+// Guest instructions executed so far in the current replay
+uint64_t panda_api_instr_count(void);
+
+// Read guest memory through the first CPU, at a virtual address in its
+// current address space or at a physical one.  Returns 0 on success, or -1
+// if part of the range is not mapped.
+int panda_api_read_memory(uint64_t addr, void *buf, int len, bool physical);
+
+// Shut the machine down and unload the plugins.  Nothing else may be
+// called afterwards.
+void panda_finish(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -7,11 +7,19 @@
 #include <zlib.h>
 #include "plog.pb-c.h"
 
-#define PL_CURRENT_VERSION 2
+#define PL_CURRENT_VERSION 4
 // compression level
 #define PL_Z_LEVEL 9
+// chunks are compressed and written by this many threads unless
+// -pandalog-threads says otherwise
+#define PL_DEFAULT_THREADS 2
 // 16 MB chunk
 #define PL_CHUNKSIZE (1024 * 1024 * 16)
+// a chunk being written can run this far past its size to keep an
+// instruction's entries together before they spill into the next one
+#define PL_CHUNK_SLACK(size) ((size) / 8)
+// entry arena grows in blocks of this size
+#define PL_ARENA_BLOCK_SIZE (1024 * 1024)
 // header at most this many bytes
 #define PL_HEADER_SIZE 128
 
@@ -23,12 +31,26 @@ typedef enum {
     PL_MODE_UNKNOWN
 } PlMode;
 
+// how chunk data is stored in the file
+typedef enum {
+    PL_CODEC_ZLIB,
+    PL_CODEC_NONE
+} PlCodec;
+
 typedef struct pandalog_header_struct {
     uint32_t version;     // version number
     uint64_t dir_pos;     // position in file of directory
     uint32_t chunk_size;  // chunk size
+    uint32_t codec;       // PlCodec of every chunk (version 3 and up; zlib before)
+    uint64_t types_pos;   // position in file of the type index (version 4 and up)
 } PlHeader;
 
+// The type index follows the directory and says which LogEntry fields the
+// entries of each chunk set, so readers after a few kinds of entry can skip
+// the chunks that have none without decompressing them.  For each chunk in
+// directory order: a uint32_t count, then that many uint32_t field numbers
+// in increasing order.
+
 typedef struct instr_interval_struct {
     uint64_t start;
     uint64_t end;
@@ -53,10 +75,11 @@ typedef struct pandalog_chunk_struct {
     uint32_t size;              // in bytes of a chunk
     uint32_t zsize;             // in bytes of a compressed chunk. 
     unsigned char *buf;         // uncompressed chunk data
+    uint32_t buf_size;          // bytes allocated for buf (used while writing)
     unsigned char *buf_p;       // pointer into uncompressed chunk (used while writing)
     unsigned char *zbuf;        // corresponding compressed chunk
     // these are used while writing to remember things needed for dir entry
-    uint32_t start_instr;       // first instruction in current chunk 
+    uint64_t start_instr;       // first instruction in current chunk 
     uint64_t start_pos;         // pos in file of start of current chunk
     // these are used while reading and contain current chunk data, expanded into pl entries
     Panda__LogEntry **entry;    // this will be array of entries in current chunk 
@@ -72,8 +95,34 @@ typedef struct pandalog_struct {
     PandalogDir dir;            // chunk directory
     PandalogChunk chunk;        // current chunk
     uint32_t chunk_num;         // current chunk number
+    PlCodec codec;              // codec of the chunks
+    struct PandalogWriter *writer;  // compression threads (write mode)
+    uint64_t spills;            // continuation chunks started mid-instruction
 } Pandalog;
 
+// Codec, zlib level and number of compression threads for the pandalog
+// being written.  Can be set any time before the first chunk is flushed.
+extern PlCodec pandalog_codec;
+extern int pandalog_zlevel;
+extern int pandalog_threads;
+// most memory, in bytes, that chunks handed to those threads may hold
+// before the emulation thread waits for them; 0 for no limit beyond the
+// 2 * pandalog_threads chunks in flight.  pandalog_threads 0 writes each
+// chunk on the emulation thread.
+extern uint64_t pandalog_mem_limit;
+
+// parse "zlib", "zlib:<level>" or "none" into the settings above.
+// returns 0 if spec isn't one of those.
+int pandalog_set_codec(const char *spec);
+
+// columnar copy of the pandalog being written (see plog_columns.h), or NULL.
+// pandalog_write_entry adds every entry to it, and pandalog_close closes
+// it.  it can be set without a pandalog file for columns only.
+extern struct PlColumns *pandalog_columns;
+
+// start pandalog_columns in dir.  returns 0 if that can't be done.
+int pandalog_open_columns(const char *dir);
+
 // open pandalog for write with this uncompressed chunk size
 void pandalog_open_write(const char *path, uint32_t chunk_size);
 
@@ -93,6 +142,18 @@ int  pandalog_close(void);
 // b/c those will get added by this fn
 void pandalog_write_entry(Panda__LogEntry *entry);
 
+// Arena for building entries without a malloc and free per record.
+// Memory from these is zeroed and 8-byte aligned, is never freed by the
+// caller, and is all reclaimed at once by the pandalog_write_entry call
+// that hands a full chunk off to be written (or after every entry with
+// -pandalog-columns on its own).  So it is good for the entry being built
+// and its submessages up to when that entry is written; don't keep
+// pointers into it any longer.
+void *pandalog_arena_alloc(size_t n);
+void *pandalog_arena_memdup(const void *p, size_t n);
+char *pandalog_arena_strdup(const char *s);
+#define pandalog_arena_new(T) ((T *) pandalog_arena_alloc(sizeof(T)))
+
 // read next element from pandalog.
 // allocates memory, which caller will free
 // nb depending on thePandalog->mode this could represent 
@@ -108,6 +169,46 @@ void pandalog_seek(uint64_t instr);
 // Must call this to free the entry returned by pandalog_read_entry
 void pandalog_free_entry(Panda__LogEntry *entry);
 
+// Step over the top-level field of a packed LogEntry that starts at p:
+// returns where the next one starts, with the field's number in *id and,
+// if it is a varint, its value in *val.  Returns NULL at end or if the
+// field runs past it.
+static inline const unsigned char *pandalog_raw_field(const unsigned char *p,
+                                                      const unsigned char *end,
+                                                      uint32_t *id, uint64_t *val) {
+    uint64_t key = 0, v = 0;
+    int shift = 0;
+    if (p >= end) return NULL;
+    do {
+        if (p >= end || shift > 63) return NULL;
+        key |= (uint64_t) (*p & 0x7f) << shift;
+        shift += 7;
+    } while (*p++ & 0x80);
+    *id = key >> 3;
+    *val = 0;
+    switch (key & 7) {
+    case 0:
+    case 2:
+        shift = 0;
+        do {
+            if (p >= end || shift > 63) return NULL;
+            v |= (uint64_t) (*p & 0x7f) << shift;
+            shift += 7;
+        } while (*p++ & 0x80);
+        if ((key & 7) == 0) {
+            *val = v;
+            return p;
+        }
+        return (v <= (uint64_t) (end - p)) ? p + v : NULL;
+    case 1:
+        return (end - p >= 8) ? p + 8 : NULL;
+    case 5:
+        return (end - p >= 4) ? p + 4 : NULL;
+    default:
+        return NULL;
+    }
+}
+
 extern int pandalog;
 
 #endif
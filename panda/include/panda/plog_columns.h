@@ -0,0 +1,47 @@
+#ifndef __PANDALOG_COLUMNS_H_
+#define __PANDALOG_COLUMNS_H_
+
+/*
+  Columnar copy of a pandalog, for analytics that only look at a few
+  fields of a great many entries.
+
+  A column store is a directory with one numpy .npy file per field that
+  any entry has set, one row per entry, in log order:
+
+    <field>.npy         the values.  0 in rows where the field isn't set.
+    <field>.valid.npy   bool, whether the row has the field.  Every field
+                        but pc and instr has one.
+    <field>.dict        string fields are stored as uint32 codes, and line
+                        i of this file is the string for code i, with
+                        newlines and backslashes escaped as \n and \\.
+    <field>.count.npy   number of elements, for repeated fields.
+    columns.txt         one line per column: name, dtype, then "valid"
+                        and/or "dict" if it has those files.
+
+  Fields of a message field are flattened into columns named
+  <field>.<subfield>, e.g. tainted_branch_summary.asid, down to
+  PL_COLUMNS_MAX_DEPTH levels.  Bytes fields are left out.
+
+  The field list comes from the Panda__LogEntry descriptor, so plugins'
+  fields get columns without anything here knowing about them.
+*/
+
+#include <stdint.h>
+#include "plog.pb-c.h"
+
+// message fields are flattened this many levels below LogEntry
+#define PL_COLUMNS_MAX_DEPTH 2
+
+typedef struct PlColumns PlColumns;
+
+// start a column store in dir, creating it if need be.  returns NULL,
+// having said why on stderr, if that can't be done.
+PlColumns *pandalog_columns_open(const char *dir);
+
+// append entry as the next row
+void pandalog_columns_add(PlColumns *pc, const Panda__LogEntry *entry);
+
+// finish every column and write columns.txt.  returns the number of rows.
+uint64_t pandalog_columns_close(PlColumns *pc);
+
+#endif
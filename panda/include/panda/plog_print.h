@@ -17,6 +17,10 @@ void pprint_attack_point(Panda__AttackPoint *ap);
 void pprint_src_info(Panda__SrcInfo *si);
 void pprint_src_info_pri(Panda__SrcInfoPri *sip);
 void pprint_taint_query_unique_label_set(Panda__TaintQueryUniqueLabelSet *tquls);
+// taint queries with a label set id print that set's labels if it has been
+// added to the dictionary first
+void pprint_add_label_set(Panda__TaintLabelSet *tls);
+void pprint_taint_label_set(Panda__TaintLabelSet *tls);
 void pprint_taint_query(Panda__TaintQuery *tq);
 void pprint_taint_query_hypercall(Panda__TaintQueryHypercall *tqh);
 void pprint_taint_query_pri(Panda__TaintQueryPri *tqp);
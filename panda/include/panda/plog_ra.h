@@ -0,0 +1,89 @@
+#ifndef __PANDALOG_RA_H_
+#define __PANDALOG_RA_H_
+
+/*
+  Random-access pandalog reader.
+
+  Unlike pandalog_open_read(), which decompresses a whole chunk and
+  unpacks every entry in it to hand back one, this maps the file,
+  decompresses a chunk only when an iterator first gets to it, and keeps
+  the last few decompressed chunks in an LRU cache.  Entries come back as
+  raw packed protobuf plus their instruction count; unpack only the ones
+  you want with pandalog_raw_entry_unpack().
+
+  Any number of readers can be open at once, and the old pandalog_* API
+  is still there alongside them.
+*/
+
+#include <stdint.h>
+#include "plog.pb-c.h"
+
+// decompressed chunks kept per reader unless told otherwise
+#define PL_RA_DEFAULT_CACHE_CHUNKS 4
+
+typedef struct PandalogReader PandalogReader;
+
+typedef struct {
+    const unsigned char *data;  // packed Panda__LogEntry
+    uint32_t len;
+    uint64_t instr;             // entry's instr, -1 if written outside the main loop
+    uint32_t chunk;
+    uint32_t index;             // within chunk
+} PandalogRawEntry;
+
+typedef struct {
+    PandalogReader *reader;
+    uint32_t chunk;
+    uint32_t index;             // next entry to return
+    uint64_t end_instr;         // stop before this instr, -1 for no end
+    const uint32_t *types;      // LogEntry field numbers wanted, unless num_types is 0
+    uint32_t num_types;
+    uint8_t all_instrs;         // also the entries written outside the main loop
+} PandalogIter;
+
+// map the pandalog at path.  cache_chunks is how many decompressed chunks
+// to keep (0 for the default).  returns NULL, having said why on stderr,
+// if the file can't be read as a pandalog.
+PandalogReader *pandalog_reader_open(const char *path, uint32_t cache_chunks);
+void pandalog_reader_close(PandalogReader *r);
+
+uint32_t pandalog_reader_num_chunks(PandalogReader *r);
+// number of entries in chunk c, from the directory (no decompression)
+uint64_t pandalog_reader_chunk_entries(PandalogReader *r, uint32_t c);
+// chunk cache hits and misses so far
+void pandalog_reader_cache_stats(PandalogReader *r, uint64_t *hits, uint64_t *misses);
+
+// position it at the first entry of the log
+void pandalog_iter_begin(PandalogReader *r, PandalogIter *it);
+// position it at the first entry for an instruction >= instr
+void pandalog_iter_seek(PandalogReader *r, PandalogIter *it, uint64_t instr);
+// fill in e with the next entry and return 1, or return 0 at end of log.
+// e->data points into the chunk cache and stays valid until the reader has
+// to evict that chunk, i.e. until cache_chunks other chunks have been read.
+int pandalog_iter_next(PandalogIter *it, PandalogRawEntry *e);
+
+// position it at the first entry for an instruction >= start_instr, and
+// have it stop before end_instr (-1 for the end of the log) and return
+// only entries that set one of the num_types LogEntry fields in types (all
+// of them if num_types is 0).  types must outlive the iteration.  the
+// window leaves out entries written outside the main loop.  with a
+// version 4 log, chunks that have none of the types are skipped without
+// being decompressed.
+void pandalog_iter_window(PandalogReader *r, PandalogIter *it,
+                          uint64_t start_instr, uint64_t end_instr,
+                          const uint32_t *types, uint32_t num_types);
+
+// position it at the first entry of the log, and have it return only
+// entries that set one of the num_types LogEntry fields in types, wherever
+// they are, including outside the main loop.  chunks are skipped as they
+// are by pandalog_iter_window().
+void pandalog_iter_types(PandalogReader *r, PandalogIter *it,
+                         const uint32_t *types, uint32_t num_types);
+
+// LogEntry field number for a field name, e.g. "asid", or 0 if there's none
+uint32_t pandalog_entry_type(const char *name);
+
+// unpack a raw entry.  free the result with panda__log_entry__free_unpacked.
+Panda__LogEntry *pandalog_raw_entry_unpack(const PandalogRawEntry *e);
+
+#endif
@@ -71,13 +71,30 @@ typedef enum panda_cb_type {
 #endif
     PANDA_CB_ASID_CHANGED,           // When CPU asid (address space identifier) changes
     PANDA_CB_REPLAY_HD_TRANSFER,     // in replay, hd transfer
-    PANDA_CB_REPLAY_NET_TRANSFER,    // in replay, transfers within network card (currently only E1000)
+    PANDA_CB_REPLAY_NET_TRANSFER,    // in replay, transfers within network card (currently only virtio-net)
     PANDA_CB_REPLAY_BEFORE_DMA,      // in replay, just before RAM case of cpu_physical_mem_rw
     PANDA_CB_REPLAY_AFTER_DMA,       // in replay, just after RAM case of cpu_physical_mem_rw
     PANDA_CB_REPLAY_HANDLE_PACKET,   // in replay, packet in / out
+    PANDA_CB_MEM_ACCESS_BATCH,       // Memory accesses of a basic block, batched
+    PANDA_CB_BEFORE_BLOCK_EXEC_SKIP_LLVM, // Before each basic block, in LLVM mode: run the TCG code instead?
+    PANDA_CB_TLB_WATCH_PAGE,         // When a RAM page enters the TLB: watch accesses to it?
+    PANDA_CB_TLB_WATCHED_ACCESS,     // Access to a watched page (from any code)
     PANDA_CB_LAST
 } panda_cb_type;
 
+// One guest memory access, as delivered by PANDA_CB_MEM_ACCESS_BATCH
+typedef struct panda_mem_access {
+    target_ulong pc;    // guest PC doing the access
+    target_ulong vaddr;
+    uint64_t paddr;     // -1 if vaddr didn't translate
+    uint64_t value;     // the data read or written, zero-extended
+    uint32_t size;      // in bytes
+    bool is_write;
+} panda_mem_access;
+
+// accesses buffered per CPU before a batch is delivered early
+#define PANDA_MEM_BATCH_SIZE 4096
+
 // Union of all possible callback function types
 typedef union panda_cb {
     /* Callback ID: PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT
@@ -621,7 +638,12 @@ typedef union panda_cb {
 /* Callback ID:     PANDA_CB_REPLAY_HD_TRANSFER,
 
        In replay only, some kind of data transfer involving hard drive.
-       NB: We are neither before nor after, really.  In replay the transfer
+       Currently these are IDE (and AHCI) DMA and virtio-blk transfers:
+       HD_TRANSFER_HD_TO_RAM (read) or HD_TRANSFER_RAM_TO_HD (written), one
+       per piece of guest RAM, right after the guest RAM they wrote.  The HD
+       address is the offset on the drive with the drive number from bit
+       RR_HD_DRIVE_SHIFT up, see rr_hd_addr(); the RAM address is a guest
+       physical address.  NB: We are neither before nor after, really.  In replay the transfer
        doesn't really happen.  We are *at* the point at which it happened, really.
        Arguments:
         CPUState* env: pointer to CPUState
@@ -665,13 +687,18 @@ typedef union panda_cb {
   /* Callback ID:   PANDA_CB_REPLAY_HANDLE_PACKET,
 
      In replay only, we have a packet (incoming / outgoing) in hand.
+     Recordings only have packets if made with -record-packets, by a NIC
+     that logs them (virtio-net).  The replay_net_transfer callbacks that
+     follow say where in guest RAM the packet is.
 
      Arguments:
      CPUState *env          pointer to CPUState
-     uint8_t *buf           buffer containing packet data
+     uint8_t *buf           buffer containing the packet, from the
+                            Ethernet header on
      int size               num bytes in buffer
-     uint8_t direction      XXX read or write.  not sure which is which.
-     uint64_t old_buf_addr  XXX this is a mystery
+     uint8_t direction      PANDA_NET_RX or PANDA_NET_TX
+     uint64_t old_buf_addr  where buf was in the recording QEMU; only good
+                            for telling packets apart
   */
 
   int (*replay_handle_packet)(CPUState *env, uint8_t *buf, int size, uint8_t
@@ -680,7 +707,11 @@ typedef union panda_cb {
 /* Callback ID:     PANDA_CB_REPLAY_NET_TRANSFER,
 
        In replay only, some kind of data transfer within the network card
-       (currently, only the E1000 is supported).  NB: We are neither before nor
+       (currently, only virtio-net, with -record-packets).  For the packet of
+       the last replay_handle_packet, NET_TRANSFER_IOB_TO_RAM (received) or
+       NET_TRANSFER_RAM_TO_IOB (sent) gives a piece of it in guest RAM: the
+       IOB address is the offset in the packet and the RAM address is a
+       guest physical address.  NB: We are neither before nor
        after, really.  In replay the transfer doesn't really happen.  We are
        *at* the point at which it happened, really.
        Arguments:
@@ -695,6 +726,87 @@ typedef union panda_cb {
  */
   int (*replay_net_transfer)(CPUState *env, uint32_t type, uint64_t src_addr, uint64_t dest_addr, uint32_t num_bytes);
 
+    /* Callback ID: PANDA_CB_MEM_ACCESS_BATCH
+
+       mem_access_batch: called with the memory accesses made by a basic
+       block, in program order, when the block finishes executing.  If a
+       block makes more than PANDA_MEM_BATCH_SIZE accesses, they are
+       delivered in several batches.  Like the other memory callbacks this
+       needs panda_enable_memcb().  Plugins that look at every access should
+       prefer this to virt_mem_after_read/write: it costs one call per block
+       rather than one per access.
+
+       Arguments:
+        CPUState *env: the current CPU state
+        const panda_mem_access *accesses: the accesses, valid only for the
+                                          duration of the call
+        size_t n: number of accesses
+
+       Return value:
+        unused
+    */
+    int (*mem_access_batch)(CPUState *env, const panda_mem_access *accesses, size_t n);
+
+    /* Callback ID: PANDA_CB_BEFORE_BLOCK_EXEC_SKIP_LLVM
+
+       before_block_exec_skip_llvm: called before execution of every basic
+       block while LLVM is enabled, after before_block_exec.  Every TB in
+       LLVM mode has TCG code as well; if at least one of these callbacks is
+       registered and all of them return true, the TCG code runs this time.
+
+       Arguments:
+        CPUState *env: the current CPU state
+        TranslationBlock *tb: the TB we are about to execute
+
+       Return value:
+        true if this execution of the block doesn't need the LLVM code
+
+       Notes:
+        Guest instructions are counted for record/replay either way, but
+        only target-i386 generates that counting in its TCG code, so this
+        is only safe during replay there.
+    */
+    bool (*before_block_exec_skip_llvm)(CPUState *env, TranslationBlock *tb);
+
+    /* Callback ID: PANDA_CB_TLB_WATCH_PAGE
+
+       tlb_watch_page: called when a page of guest RAM is added to the
+       softmmu TLB.  Accesses to a watched page always take the slow path,
+       where PANDA_CB_TLB_WATCHED_ACCESS sees them, even those made by TCG
+       code without memory callbacks or by helpers.
+
+       Arguments:
+        CPUState *env: the current CPU state
+        uint64_t ram_addr: ram address of the start of the page
+
+       Return value:
+        true to watch the page
+
+       Notes:
+        Only asked on a TLB fill: a plugin that starts watching a page
+        already in the TLB has to tlb_flush() first.
+    */
+    bool (*tlb_watch_page)(CPUState *env, uint64_t ram_addr);
+
+    /* Callback ID: PANDA_CB_TLB_WATCHED_ACCESS
+
+       tlb_watched_access: called before each access to a page that a
+       tlb_watch_page callback asked to watch
+
+       Arguments:
+        CPUState *env: the current CPU state
+        target_ulong addr: the virtual address accessed
+        uint32_t size: size of the access in bytes
+        bool is_write: true for a store
+
+       Return value:
+        true to abandon the access: the guest state is rolled back to the
+        start of the instruction that made it, which is then executed again
+        (memory callbacks that already ran for the access will run again).
+        Ignored when the access didn't come from translated code.
+    */
+    bool (*tlb_watched_access)(CPUState *env, target_ulong addr, uint32_t size, bool is_write);
+
 } panda_cb;
 
 // Doubly linked list that stores a callback, along with its owner
@@ -705,10 +817,35 @@ struct _panda_cb_list {
     panda_cb_list *next;
     panda_cb_list *prev;
     bool enabled;
+    // filled in by PANDA_CB_CALL when -panda-profile is on
+    uint64_t prof_calls;
+    uint64_t prof_ns;
 };
+// first and next enabled callbacks of a panda_cbs[] list
+panda_cb_list* panda_cb_list_first(panda_cb_type type);
 panda_cb_list* panda_cb_list_next(panda_cb_list* plist);
 void panda_enable_plugin(void *plugin);
 void panda_disable_plugin(void *plugin);
+// The same, once the guest instruction count reaches instr, as checked
+// before each block.  TBs are flushed so translate time callbacks see the
+// code again.  With plugin NULL they wake or put to sleep all plugins (see
+// panda_wake_plugins()).
+void panda_enable_plugin_at(void *plugin, uint64_t instr);
+void panda_disable_plugin_at(void *plugin, uint64_t instr);
+extern uint64_t panda_next_trigger_instr;
+void panda_run_plugin_triggers(uint64_t instr);
+
+// Analysis window.  While the plugins are asleep no callbacks run and
+// memory callbacks, precise pc and LLVM are off whatever the plugins asked
+// for, so replay runs as plain TCG.  Waking them flushes TBs and restores
+// what they asked for in the meantime.  A plugin that stays awake can
+// keep watching for an event (say, a PPP callback of another plugin that
+// stays awake) and call panda_wake_plugins() when it sees it.
+// -panda-start <instr> puts the plugins to sleep until instr.
+void panda_sleep_plugins(void);
+void panda_wake_plugins(void);
+void panda_stay_awake(void *plugin);
+extern bool panda_plugins_dormant;
 
 // Structure to store metadata about a plugin
 typedef struct panda_plugin {
@@ -717,6 +854,12 @@ typedef struct panda_plugin {
 } panda_plugin;
 
 void   panda_register_callback(void *plugin, panda_cb_type type, panda_cb cb);
+
+// Reserve one of the PANDA_TB_DATA_SLOTS words in every TranslationBlock
+// (tb->panda_data[slot]) for facts computed at translation time, such as
+// from after_block_translate, and read back cheaply at exec time.  Returns
+// the slot, or -1 if they're all taken.
+int    panda_tb_data_slot_alloc(void);
 void   panda_unregister_callbacks(void *plugin);
 bool   panda_load_plugin(const char *filename);
 bool   panda_add_arg(const char *arg, int arglen);
@@ -730,10 +873,51 @@ void   panda_unload_plugins(void);
 bool panda_flush_tb(void);
 
 void panda_do_flush_tb(void);
+// Retranslate only some TBs, the next time they run, rather than all of
+// them as panda_do_flush_tb() does.  Can be called from any callback.
+// Return how many TBs were invalidated.
+// TBs with code in [start, end):
+int  panda_invalidate_tb_range(target_ulong start, target_ulong end);
+// TBs translated while asid was current; needs panda_enable_tb_asid(),
+// called before those TBs were translated (e.g. in init_plugin).  TBs are
+// shared between address spaces, so this also catches, say, kernel code
+// that happened to be translated while asid was current.
+int  panda_invalidate_tb_asid(target_ulong asid);
+void panda_enable_tb_asid(void);
+
+// Selective instrumentation.  Once a plugin picks address spaces with
+// panda_instrument_asid(), only code running in them is translated with
+// insn_translate instrumentation and LLVM code, and only its blocks get
+// the block translate and exec callbacks.  Everything else runs as plain
+// TCG.  Both kinds of TB can be cached side by side.
+#define PANDA_MAX_INSTR_ASIDS 16
+// add asid to (on) or remove it from (!on) the instrumented address spaces
+void panda_instrument_asid(target_ulong asid, bool on);
+// whether kernel code in those address spaces is instrumented (default yes)
+void panda_instrument_kernel(bool on);
+// back to instrumenting everything
+void panda_instrument_all(void);
+extern bool panda_instr_selective;
+bool panda_instr_current(CPUState *cpu);
+// whether code translated now should be instrumented
+static inline bool panda_instr_enabled(CPUState *cpu) {
+    return !panda_instr_selective || panda_instr_current(cpu);
+}
 void panda_enable_precise_pc(void);
 void panda_disable_precise_pc(void);
 void panda_enable_memcb(void);
 void panda_disable_memcb(void);
+// Narrow down the accesses memory callbacks are called for: only those to
+// pages that overlap one of the plugin's guest physical ranges (all pages
+// if it has none), made while the current ASID is one of its ASIDs (any if
+// it has none).  Checked once per TLB fill, so rejects cost almost nothing,
+// but accesses elsewhere on a matching page still get through.  Only takes
+// effect while every plugin with memory callbacks has a filter, the
+// accesses matching any of them then going to all of them, so handlers
+// must still check.  Each change flushes the TLBs.
+void panda_memcb_filter_add_range(void *plugin, uint64_t start, uint64_t len);
+void panda_memcb_filter_add_asid(void *plugin, target_ulong asid);
+void panda_memcb_filter_clear(void *plugin);
 void panda_enable_llvm(void);
 void panda_disable_llvm(void);
 void panda_enable_llvm_helpers(void);
@@ -745,9 +929,61 @@ void panda_memsavep(FILE *f);
 extern bool panda_update_pc;
 extern bool panda_use_memcb;
 extern panda_cb_list *panda_cbs[PANDA_CB_LAST];
+
+// The enabled entries of each panda_cbs[] list, flattened in list order.
+// Rebuilt whenever a callback is registered, unregistered, enabled or
+// disabled, so the hot dispatch paths (memory accesses, insn_exec, block
+// exec) can walk an array instead of chasing list pointers.
+typedef struct panda_cb_array {
+    int n;
+    int cap;
+    panda_cb_list **cbs;
+} panda_cb_array;
+extern panda_cb_array panda_cb_arrays[PANDA_CB_LAST];
 extern bool panda_plugins_to_unload[MAX_PANDA_PLUGINS];
 extern bool panda_plugin_to_unload;
 extern bool panda_tb_chaining;
+extern bool panda_tb_asid;
+
+// Opt-in callback profiling (-panda-profile).  When on, every callback
+// invocation is timed and the time charged both to its callback type and to
+// the panda_cb_list entry (i.e. plugin) it came from.
+extern bool panda_cb_profiling;
+extern uint64_t panda_cb_type_ns[PANDA_CB_LAST];
+int64_t panda_cb_profile_clock(void);
+const char *panda_cb_type_name(panda_cb_type type);
+// The per-plugin counters, for query-rr-stats; empty without -panda-profile
+struct RrPluginStatsList *panda_plugin_profile_stats(void);
+
+// Wrap a single callback invocation of list entry plist in a panda_cbs[type]
+// loop.
+#define PANDA_CB_CALL(type, plist, call)                                    \
+    do {                                                                    \
+        if (unlikely(panda_cb_profiling)) {                                 \
+            int64_t __panda_cb_ns = panda_cb_profile_clock();               \
+            call;                                                           \
+            __panda_cb_ns = panda_cb_profile_clock() - __panda_cb_ns;       \
+            panda_cb_type_ns[type] += __panda_cb_ns;                        \
+            (plist)->prof_ns += __panda_cb_ns;                              \
+            (plist)->prof_calls++;                                          \
+        } else {                                                            \
+            call;                                                           \
+        }                                                                   \
+    } while (0)
+
+// Call plist->entry.field(...) for every enabled callback of this type, from
+// panda_cb_arrays[].  The count is re-read each iteration since a callback may
+// change the set of enabled callbacks.
+#define PANDA_CB_ARRAY_CALL(type, field, ...)                               \
+    do {                                                                    \
+        const panda_cb_array *__panda_cb_arr = &panda_cb_arrays[type];      \
+        int __panda_cb_i;                                                   \
+        for (__panda_cb_i = 0; __panda_cb_i < __panda_cb_arr->n; __panda_cb_i++) { \
+            panda_cb_list *__panda_cb_plist = __panda_cb_arr->cbs[__panda_cb_i]; \
+            PANDA_CB_CALL(type, __panda_cb_plist,                           \
+                __panda_cb_plist->entry.field(__VA_ARGS__));                \
+        }                                                                   \
+    } while (0)
 
 extern char panda_argv[MAX_PANDA_PLUGIN_ARGS][256];
 extern int panda_argc;
@@ -792,6 +1028,7 @@ char** str_split(char* a_str, const char a_delim);
 
 char *panda_plugin_path(const char *name);
 void panda_require(const char *plugin_name);
+bool panda_load_plugin_list(const char *list);
 
 void panda_cleanup(void);
 
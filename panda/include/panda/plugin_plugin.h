@@ -63,6 +63,10 @@ void ppp_add_cb_##cb_name##_slot(cb_name##_t fptr, int slot_num) ;
   callbacks are in an array and we will call them in order, one may want to
   take advantage of that fact by ordering them carefully.  However, be careful
   as there isnt any attempt, here, to detect if you leave a slot empty
+
+  ppp_<cb_name>_num_cb is one past the last slot in use, so it is 0 exactly
+  when nobody is listening.  Check it with PPP_CHECK_CB before computing
+  arguments that are only needed by the callbacks.
 */
 
 #define PPP_CB_BOILERPLATE(cb_name)		\
@@ -78,7 +82,7 @@ void ppp_add_cb_##cb_name(cb_name##_t fptr) {			\
 void ppp_add_cb_##cb_name##_slot(cb_name##_t fptr, int slot_num) {	\
   assert (slot_num < PPP_MAX_CB);					\
   ppp_##cb_name##_cb[slot_num] = fptr;					\
-  ppp_##cb_name##_num_cb = MAX(slot_num, ppp_##cb_name##_num_cb);	\
+  ppp_##cb_name##_num_cb = MAX(slot_num + 1, ppp_##cb_name##_num_cb);	\
 }									
 
 #define PPP_CB_EXTERN(cb_name) \
@@ -86,20 +90,29 @@ extern cb_name##_t ppp_##cb_name##_cb[PPP_MAX_CB]; \
 extern int ppp_##cb_name##_num_cb;
 
 /*
-  And employ this where you want the callback functions to be called 
+  And employ this where you want the callback functions to be called.
+  Most callbacks have no subscriber or a single one, so those two cases
+  don't go through the loop.
 */
  
 #define PPP_RUN_CB(cb_name, ...)					\
   {									\
-    int ppp_cb_ind;							\
-    for (ppp_cb_ind = 0; ppp_cb_ind < ppp_##cb_name##_num_cb; ppp_cb_ind++) { \
-      if (ppp_##cb_name##_cb[ppp_cb_ind] != NULL) {			\
-	ppp_##cb_name##_cb[ppp_cb_ind]( __VA_ARGS__ ) ;			\
+    int ppp_cb_num = ppp_##cb_name##_num_cb;				\
+    if (ppp_cb_num == 1) {						\
+      if (ppp_##cb_name##_cb[0] != NULL) {				\
+	ppp_##cb_name##_cb[0]( __VA_ARGS__ ) ;				\
+      }									\
+    } else if (ppp_cb_num > 1) {					\
+      int ppp_cb_ind;							\
+      for (ppp_cb_ind = 0; ppp_cb_ind < ppp_cb_num; ppp_cb_ind++) {	\
+	if (ppp_##cb_name##_cb[ppp_cb_ind] != NULL) {			\
+	  ppp_##cb_name##_cb[ppp_cb_ind]( __VA_ARGS__ ) ;		\
+	}								\
       }									\
     }									\
   }
 
-#define PPP_CHECK_CB(cb_name) (ppp_##cb_name##_num_cb > 0)
+#define PPP_CHECK_CB(cb_name) (__builtin_expect(ppp_##cb_name##_num_cb > 0, 0))
 
 /****************************************************************
 This stuff gets used in "plugin B", i.e., the plugin that wants
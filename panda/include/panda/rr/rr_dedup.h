@@ -0,0 +1,54 @@
+/*
+ * Payload deduplication dictionary for record/replay nondet logs
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef __RR_DEDUP_H_
+#define __RR_DEDUP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Record and replay each keep one of these and feed it the same sequence of
+// DMA payloads, so a payload's sequence number means the same thing on both
+// sides.  The dictionary remembers the most recent payloads (oldest evicted
+// first) up to a slot and byte budget.  Recording looks payloads up to turn
+// repeats into references; replay only inserts and resolves references.
+//
+// Both sides reset the dictionary at every RR_CALL_DEDUP_RESET entry in the
+// log, which recording writes at the start of the log and at every
+// checkpoint, so replay can begin at a checkpoint without the history
+// before it.
+#define RR_DEDUP_MAX_SLOTS 8192
+#define RR_DEDUP_MAX_BYTES (64 << 20)
+// payloads outside this range are always stored in full
+#define RR_DEDUP_MIN_LEN 64
+#define RR_DEDUP_MAX_LEN (64 << 10)
+
+typedef struct RR_dedup RR_dedup;
+
+// with_index is true for recording, which needs to find payloads by content.
+// Replay passes false and copy_payloads == false if the payloads it inserts
+// stay valid until the dictionary is freed (i.e. they point into a mapped
+// log); otherwise the dictionary keeps its own copies.
+RR_dedup *rr_dedup_new(bool with_index, bool copy_payloads);
+void rr_dedup_free(RR_dedup *dd);
+void rr_dedup_reset(RR_dedup *dd);
+
+static inline bool rr_dedup_eligible(uint64_t len)
+{
+    return len >= RR_DEDUP_MIN_LEN && len <= RR_DEDUP_MAX_LEN;
+}
+
+// Recording: return the sequence number of an identical payload still in the
+// dictionary, or -1 after inserting this one.  Only for eligible payloads.
+int64_t rr_dedup_lookup_insert(RR_dedup *dd, const uint8_t *buf, uint32_t len);
+// Replay: mirror the insertion recording did for a payload stored in full.
+void rr_dedup_insert(RR_dedup *dd, const uint8_t *buf, uint32_t len);
+// Replay: the payload with this sequence number, or NULL if it was evicted
+// (which means the log is corrupt).
+const uint8_t *rr_dedup_get(RR_dedup *dd, uint64_t seq, uint32_t len);
+
+#endif
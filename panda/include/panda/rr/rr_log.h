@@ -105,6 +105,8 @@ typedef struct {
         RR_hd_transfer_args hd_transfer_args;
         RR_net_transfer_args net_transfer_args;
         RR_handle_packet_args handle_packet_args;
+        RR_checksum_args checksum_args;
+        RR_cpu_switch_args cpu_switch_args;
     } variant;
     // mz XXX HACK
     uint64_t old_buf_addr;
@@ -136,6 +138,9 @@ typedef struct rr_log_entry_t {
     struct rr_log_entry_t* next;
 } RR_log_entry;
 
+struct RR_zlog;
+struct RR_dedup;
+
 // a program-point indexed record/replay log
 typedef enum { RECORD, REPLAY } RR_log_type;
 typedef struct RR_log_t {
@@ -145,6 +150,11 @@ typedef struct RR_log_t {
 
     char* name; // file name
     FILE* fp;   // file pointer for log
+    struct RR_zlog* zlog; // non-NULL if the log body is block-compressed
+    uint8_t* map;         // uncompressed replay logs are read from this mapping
+    struct RR_dedup* dedup; // non-NULL if DMA payloads are deduplicated
+    uint8_t* wbuf;          // record: bytes not yet handed to fp or zlog
+    size_t wbuf_used;
     unsigned long long
         size; // for a log being opened for read, this will be the size in bytes
     uint64_t bytes_read;
@@ -154,23 +164,52 @@ typedef struct RR_log_t {
     uint64_t item_number;
 } RR_log;
 
+// one record of the <name>-rr-nondet.idx checkpoint index
+typedef struct {
+    uint64_t guest_instr_count;
+    uint64_t log_offset; // logical offset of the first entry after the checkpoint
+    uint32_t id;         // 0 is <name>-rr-snp, n is <name>-rr-snp-<n>
+    uint32_t cpu_index;  // the vCPU that runs first from here
+} RR_checkpoint;
+
+// Checkpoints of the recording being replayed, in order; NULL with *n = 0 if
+// it has no index.
+const RR_checkpoint* rr_replay_checkpoints(size_t* n);
+// The checkpoint the replay started from; id 0 is the start of the recording.
+const RR_checkpoint* rr_replay_start_checkpoint(void);
+// <path>/<name> of the replay, for naming files that go with it.  NULL
+// before the first replay.
+const char* rr_replay_base_name(void);
+
 RR_log_entry* rr_get_queue_head(void);
+// offset in the nondet log of the next entry replay will consume
+uint64_t rr_next_entry_file_pos(void);
 
 void panda_end_replay(void);
 
 extern RR_log_entry *rr_queue_tail;
+
+// With more than one vCPU, record and replay run them one at a time and the
+// count of guest instructions passes from one to the next at each switch.
+// This is the vCPU that has it, i.e. the one running or about to run.
+extern CPUState *rr_current_cpu;
+
 static inline uint64_t rr_get_guest_instr_count(void) {
     assert(first_cpu);
-    return first_cpu->rr_guest_instr_count;
+    return (rr_current_cpu ? rr_current_cpu : first_cpu)->rr_guest_instr_count;
 }
 
 //mz program execution state
 static inline RR_prog_point rr_prog_point(void) {
     RR_prog_point ret = {0};
-    ret.guest_instr_count = first_cpu->rr_guest_instr_count;
+    ret.guest_instr_count = rr_get_guest_instr_count();
     return ret;
 }
 
+// Record that the round-robin scheduler is about to run cpu instead of
+// rr_current_cpu, and hand the instruction count over to it.
+void rr_record_cpu_switch(CPUState *cpu);
+
 static inline uint64_t rr_num_instr_before_next_interrupt(void) {
     if (!rr_queue_tail) {
         return -1;
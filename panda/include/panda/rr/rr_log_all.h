@@ -60,6 +60,32 @@ extern volatile int rr_end_record_requested;
 extern volatile int rr_end_replay_requested;
 extern char* rr_requested_name;
 extern char* rr_snapshot_name;
+// write compressed nondet logs for new recordings (-record-compress)
+extern bool rr_record_compressed;
+// deduplicate repeated DMA payloads in new recordings (-record-dedup)
+extern bool rr_record_dedup;
+// keep guest RAM of new recordings in mappable images (-record-mapped-ram)
+extern bool rr_record_mapped_ram;
+// log the packets NICs send and receive, and where they are in guest RAM
+// (-record-packets)
+extern bool rr_record_packets;
+// checkpoint every N guest instructions while recording (-record-checkpoint-interval)
+extern uint64_t rr_checkpoint_interval;
+// log guest checksums every N instructions while recording (-record-checksum-interval)
+extern uint64_t rr_checksum_interval;
+// start replay at the nearest checkpoint before this instruction (-replay-start)
+extern uint64_t rr_replay_start_instr;
+// stop replay once this many instructions have executed (-replay-end)
+extern uint64_t rr_replay_end_instr;
+// fork a child replay per plugin set in a file at this instruction (-replay-fork)
+extern uint64_t rr_replay_fork_instr;
+extern const char* rr_replay_fork_file;
+extern uint32_t rr_replay_fork_jobs;
+extern volatile int rr_replay_fork_requested;
+// write throughput counters to the pandalog every N instructions (-replay-stats)
+extern uint64_t rr_replay_stats_interval;
+// write query-rr-stats to this file as JSON when the replay ends (-replay-stats-file)
+extern const char* rr_replay_stats_file;
 
 // used from monitor.c
 int rr_do_begin_record(const char* name, CPUState* cpu_state);
@@ -67,6 +93,12 @@ void rr_do_end_record(void);
 int rr_do_begin_replay(const char* name, CPUState* cpu_state);
 void rr_do_end_replay(int is_error);
 void rr_reset_state(CPUState* cpu_state);
+void rr_maybe_checkpoint(void);
+void rr_maybe_checksum(void);
+// true once the replay reaches rr_replay_fork_instr; the vCPU then stops and
+// the main loop calls rr_do_replay_fork(), which only returns in the children
+bool rr_replay_fork_due(void);
+void rr_do_replay_fork(void);
 
 void qmp_begin_record(const char* file_name, Error** errp);
 void qmp_begin_record_from(const char* snapshot, const char* file_name,
@@ -126,6 +158,13 @@ extern void rr_signal_disagreement(RR_prog_point current,
     ACTION(RR_CALL_HD_TRANSFER),        /* hd transfer */ \
     ACTION(RR_CALL_NET_TRANSFER),       /* network transfer in device */ \
     ACTION(RR_CALL_HANDLE_PACKET),      /* packet handling on send/receive */ \
+    ACTION(RR_CALL_CPU_MEM_RW_ZERO),    /* log-only: all-zero CPU_MEM_RW */ \
+    ACTION(RR_CALL_CPU_MEM_RW_REF),     /* log-only: repeated CPU_MEM_RW */ \
+    ACTION(RR_CALL_CPU_MEM_UNMAP_ZERO), /* log-only: all-zero CPU_MEM_UNMAP */ \
+    ACTION(RR_CALL_CPU_MEM_UNMAP_REF),  /* log-only: repeated CPU_MEM_UNMAP */ \
+    ACTION(RR_CALL_DEDUP_RESET),        /* log-only: clear the dedup dictionary */ \
+    ACTION(RR_CALL_CHECKSUM),           /* log-only: guest checksums for replay */ \
+    ACTION(RR_CALL_CPU_SWITCH),         /* log-only: another vCPU runs from here */ \
     ACTION(RR_CALL_LAST)
 
 typedef enum {
@@ -611,6 +650,26 @@ void rr_record_hd_transfer(RR_callsite_id call_site,
                            Hd_transfer_type transfer_type, uint64_t src_addr,
                            uint64_t dest_addr, uint32_t num_bytes);
 
+// The HD address of a byte is its offset on the drive, with the drive's
+// number (IDE bus * 2 + unit, or RR_HD_DRIVE_VIRTIO plus the number of
+// virtio-blk devices created before it) from bit RR_HD_DRIVE_SHIFT up.
+#define RR_HD_DRIVE_SHIFT 48
+#define RR_HD_DRIVE_VIRTIO 0x100
+static inline uint64_t rr_hd_addr(unsigned drive, uint64_t offset)
+{
+    return ((uint64_t)drive << RR_HD_DRIVE_SHIFT) | offset;
+}
+
+// whether a disk controller should log, with one rr_record_hd_transfer()
+// (HD_TRANSFER_HD_TO_RAM or HD_TRANSFER_RAM_TO_HD) per piece of guest RAM,
+// the DMA transfer it has just completed.  They go in the log right after
+// the guest RAM the transfer wrote.
+static inline bool rr_record_hd_transfer_now(void)
+{
+    return rr_in_record() &&
+        (rr_record_in_progress || rr_record_in_main_loop_wait);
+}
+
 /* Network stuff. */
 
 typedef enum {
@@ -627,6 +686,12 @@ typedef struct {
     uint32_t num_bytes;
 } RR_net_transfer_args;
 
+// direction of a handle_packet
+typedef enum {
+    PANDA_NET_RX = 0, // received by the guest
+    PANDA_NET_TX = 1  // sent by the guest
+} Panda_net_direction;
+
 // structure for args to handle_packet
 typedef struct {
     uint8_t* buf;
@@ -634,6 +699,20 @@ typedef struct {
     uint8_t direction;
 } RR_handle_packet_args;
 
+// structure for args to checksum, which replay compares with its own
+typedef struct {
+    uint64_t instrs; // instructions since the previous checksum
+    uint64_t pages;  // pages written since the previous checksum
+    uint32_t regs;   // crc32 of the guest registers
+    uint32_t mem;    // crc32 of the addresses and contents of those pages
+} RR_checksum_args;
+
+// structure for args to a vCPU switch: the round-robin scheduler moved on
+// to this vCPU, which runs until the next switch
+typedef struct {
+    uint32_t cpu_index;
+} RR_cpu_switch_args;
+
 void rr_record_handle_packet_call(RR_callsite_id call_site, uint8_t* buf,
                                   int size, uint8_t direction);
 
@@ -641,6 +720,16 @@ void rr_record_net_transfer(RR_callsite_id call_site,
                             Net_transfer_type transfer_type, uint64_t src_addr,
                             uint64_t dest_addr, uint32_t num_bytes);
 
+// whether a NIC should log the packet it is handling right now, with
+// rr_record_handle_packet_call() and then one rr_record_net_transfer() per
+// piece of guest RAM the packet is in.  For those the packet is the IOB, and
+// its address is the offset in the packet.
+static inline bool rr_record_packet_now(void)
+{
+    return rr_record_packets && rr_in_record() &&
+        (rr_record_in_progress || rr_record_in_main_loop_wait);
+}
+
 // Needed from main-loop.c which is not target-specific
 void rr_tracked_mem_regions_record(void);
 
@@ -0,0 +1,64 @@
+/*
+ * Block-compressed byte stream for record/replay nondet logs
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef __RR_ZLOG_H_
+#define __RR_ZLOG_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+// A compressed nondet log keeps the usual RR_prog_point header at the start
+// of the file so that tools which only look at the instruction count keep
+// working.  Uncompressed logs always have pc == 0 in that header; compressed
+// ones store RR_ZLOG_MAGIC there and the logical (uncompressed) size of the
+// log, header included, in the secondary field.
+//
+// The header is followed by a sequence of frames:
+//
+//   uint32_t raw_len;    // bytes of log data in this frame
+//   uint32_t comp_len;   // bytes of deflate data that follow
+//   uint8_t  data[comp_len];
+//
+// Frames are compressed and written by a background thread so that the
+// emulation thread only ever does a memcpy into the current block.
+#define RR_ZLOG_MAGIC 0x31474f4c5a5252ULL /* "RRZLOG1" */
+
+#define RR_ZLOG_DEFAULT_BLOCK_SIZE (1 << 20)
+
+typedef struct RR_zlog RR_zlog;
+
+// Start writing frames to fp at its current position.  Takes ownership of
+// nothing; the caller still closes fp after rr_zlog_close().
+RR_zlog *rr_zlog_open_write(FILE *fp, size_t block_size, int level);
+// Start reading frames from fp at its current position.
+RR_zlog *rr_zlog_open_read(FILE *fp);
+
+// Copy len bytes into the stream.  Never blocks on disk unless the writer
+// thread has fallen a full queue behind.
+size_t rr_zlog_write(RR_zlog *zl, const void *buf, size_t len);
+// Returns the number of bytes read, which is short only at end of stream or
+// on a corrupt frame.
+size_t rr_zlog_read(RR_zlog *zl, void *buf, size_t len);
+// Discard len bytes of stream data without copying them anywhere.
+size_t rr_zlog_skip(RR_zlog *zl, size_t len);
+
+// Number of uncompressed bytes written to / consumed from the stream.
+uint64_t rr_zlog_tell(RR_zlog *zl);
+// Number of compressed bytes (frame headers included) written so far.
+uint64_t rr_zlog_compressed_bytes(RR_zlog *zl);
+
+// Flush any partial block, wait for the writer thread to drain and free the
+// stream.  Returns 0 on success, -1 if any frame failed to write.
+int rr_zlog_close(RR_zlog *zl);
+
+static inline bool rr_zlog_is_compressed_header(uint64_t header_pc)
+{
+    return header_pc == RR_ZLOG_MAGIC;
+}
+
+#endif
@@ -63,10 +63,22 @@ struct TCGLLVMRuntime {
 
     TranslationBlock *last_tb;
     uint64_t last_pc;
+    /* TB whose trace is running, if any; last_tb is the block of it that is */
+    TranslationBlock *trace_tb;
 };
 
 extern struct TCGLLVMRuntime tcg_llvm_runtime;
 
+/* Generated functions are kept when their TB is freed, and handed to any
+ * later TB translated to the same TCG ops.  This many that no TB is using
+ * are kept, least recently used going first; 0 turns the cache off. */
+#define TCG_LLVM_TB_CACHE_DEFAULT 8192
+extern unsigned tcg_llvm_tb_cache_size;
+
+/* Generate LLVM code on a background thread.  A TB runs as TCG until its
+ * function is ready; set this before the first TB is translated. */
+extern int tcg_llvm_async;
+
 struct TCGLLVMContext* tcg_llvm_initialize(void);
 void tcg_llvm_destroy(void);
 
@@ -79,6 +91,18 @@ const char* tcg_llvm_get_func_name(struct TranslationBlock *tb);
 
 uintptr_t tcg_llvm_qemu_tb_exec(CPUArchState *env, TranslationBlock *tb);
 
+/* A trace (see llvm_trace_threshold) is at most this many TBs, not
+ * counting the jump back to the first if it loops */
+#define TCG_LLVM_TRACE_MAX_TBS 8
+
+/* Compile the trace starting at tb, if its successors are hot enough */
+void tcg_llvm_gen_trace(struct TCGLLVMContext *l, struct TranslationBlock *tb);
+uintptr_t tcg_llvm_qemu_trace_exec(CPUArchState *env, TranslationBlock *tb);
+/* In cpu-exec.c.  Called by a trace between two of its blocks with what
+ * the first returned; nonzero if next may run straight away. */
+int tcg_llvm_trace_continue(CPUArchState *env, uintptr_t ret,
+                            TranslationBlock *next);
+
 void tcg_llvm_write_module(struct TCGLLVMContext *l, const char *path);
 
 #ifdef __cplusplus
@@ -121,6 +145,9 @@ public:
 
     void generateCode(struct TCGContext *s,
                       struct TranslationBlock *tb);
+    /* tb is done with its function */
+    void releaseTB(struct TranslationBlock *tb);
+    void generateTrace(struct TranslationBlock *tb);
 
     void writeModule(const char *path);
 };
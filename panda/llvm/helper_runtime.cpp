@@ -82,24 +82,34 @@ const static std::set<std::string> ignore_funcs{
     "helper_inb", "helper_inw", "helper_inl", "helper_inq",
     "helper_outb", "helper_outw", "helper_outl", "helper_outq"
 };
-void PandaHelperCallVisitor::visitCallInst(CallInst &I) {
-    Function *f = I.getCalledFunction();
-    assert(f);
+Function *PandaHelperCallVisitor::getLLVMVersion(Function *f) {
+    auto it = llvmVersions.find(f);
+    if (it != llvmVersions.end()) {
+        return it->second;
+    }
 
+    Function *newFunction = NULL;
     std::string name = f->getName();
-    if (f->isIntrinsic() || !f->hasName()
-            || ignore_funcs.count(name) > 0) {
-        return; // Ignore intrinsics, declarations, memory, and I/O  functions
+    // Ignore intrinsics, declarations, memory, and I/O  functions
+    if (!f->isIntrinsic() && f->hasName() && ignore_funcs.count(name) == 0) {
+        name.append("_llvm");
+        newFunction = f->getParent()->getFunction(name);
+        assert(newFunction);
     }
+    llvmVersions[f] = newFunction;
+    return newFunction;
+}
+
+void PandaHelperCallVisitor::visitCallInst(CallInst &I) {
+    Function *f = I.getCalledFunction();
+    assert(f);
 
     // Call LLVM version of helper
-    Module *m = I.getParent()->getParent()->getParent();
-    assert(m);
-    name.append("_llvm");
-    Function *newFunction = m->getFunction(name);
-    assert(newFunction);
-    I.setCalledFunction(newFunction);
-    f = newFunction;
+    f = getLLVMVersion(f);
+    if (!f) {
+        return;
+    }
+    I.setCalledFunction(f);
 
     // Fix up argument types to match LLVM function signature
     Function::arg_iterator func_arg = f->arg_begin();
@@ -49,15 +49,20 @@
 #include <llvm/IR/DataLayout.h>
 #include <llvm/Transforms/IPO/PassManagerBuilder.h>
 #include <llvm/Transforms/Scalar.h>
+#include <llvm/Transforms/Utils/Cloning.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/Support/Threading.h>
 
 #include <llvm/Support/DynamicLibrary.h>
 #include <llvm/Support/raw_ostream.h>
 
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <map>
+#include <list>
+#include <vector>
+#include <unordered_map>
 
 #include "panda/cheaders.h"
 #include "panda/tcg-llvm.h"
@@ -78,6 +83,14 @@ extern "C" {
 
     /* These data is accessible from generated code */
     TCGLLVMRuntime tcg_llvm_runtime = {0};
+
+    /* Functions no TB is using that are kept for reuse */
+    unsigned tcg_llvm_tb_cache_size = TCG_LLVM_TB_CACHE_DEFAULT;
+
+    /* Generate LLVM code on a background thread */
+    int tcg_llvm_async = 0;
+
+    extern bool panda_use_memcb;
 }
 
 extern CPUState *env;
@@ -103,6 +116,55 @@ struct TCGLLVMContextPrivate {
     /* Count of generated translation blocks */
     int m_tbCount;
 
+    /* Generated functions by the TCG ops they were generated from (see
+     * getTBKey), so that a TB which is retranslated after a flush or an
+     * invalidation gets its old function back instead of having it
+     * generated, optimized and instrumented all over again. */
+    struct CachedTB {
+        std::vector<uint64_t> key;
+        Function *function;
+        uint8_t *tc_ptr;
+        uint8_t *tc_end;
+        unsigned users;                         /* live TBs running it */
+        std::list<CachedTB *>::iterator unused; /* if users == 0 */
+    };
+    std::unordered_multimap<uint64_t, CachedTB *> m_tbCache;
+    std::map<const Function *, CachedTB *> m_tbCacheByFunction;
+    /* Entries no TB is using, most recently released first */
+    std::list<CachedTB *> m_unusedTBs;
+    /* Bumped whenever the passes may have changed */
+    uint64_t m_passGeneration;
+
+    /* With tcg_llvm_async, TBs waiting for the compile thread.  Each has
+     * its own copy of the TCGContext as it was when the TB was translated,
+     * with the labels copied too since they live in the TCG pool.  The
+     * thread holds m_lock while it compiles, and anything else that touches
+     * the module takes it, so LLVM only ever runs on one thread at a time. */
+    struct TBJob {
+        TranslationBlock *tb;
+        TCGContext *s;
+        std::vector<TCGLabel> labels;
+    };
+    std::list<TBJob *> m_jobs;
+    QemuMutex m_lock;
+    QemuCond m_jobCond;
+    QemuThread m_compileThread;
+    bool m_compileThreadRunning;
+    bool m_stopCompileThread;
+
+    /* Traces (see generateTrace) by their first TB, and by every TB they
+     * run, since a trace has to go as soon as any of them does */
+    struct Trace {
+        Function *function;
+        std::vector<TranslationBlock *> tbs;
+    };
+    std::map<TranslationBlock *, Trace *> m_traces;
+    std::multimap<TranslationBlock *, TranslationBlock *> m_traceHeads;
+    int m_traceCount;
+    Function *m_traceContinue;
+    /* Traces are optimized as a whole once their TBs are inlined */
+    FunctionPassManager *m_tracePassManager;
+
     /* XXX: The following members are "local" to generateCode method */
 
     /* TCGContext for current translation block */
@@ -110,6 +172,7 @@ struct TCGLLVMContextPrivate {
 
     /* Function for current translation block */
     Function *m_tbFunction;
+    TranslationBlock *m_tb;
 
     /* Current temp m_values */
     Value* m_values[TCG_MAX_TEMPS];
@@ -140,7 +203,12 @@ public:
         }
     }
 
-    FunctionPassManager *getFunctionPassManager() const {
+    FunctionPassManager *getFunctionPassManager() {
+        /* whoever asks is probably about to add a pass, which mustn't
+         * happen under the compile thread's feet */
+        stopCompileThread();
+        m_passGeneration++;
+        flushTBCache();
         return m_functionPassManager;
     }
 
@@ -215,8 +283,60 @@ public:
     void generateTraceCall(uintptr_t pc);
     int generateOperation(int opc, const TCGOp *op, const TCGArg *args);
     void generateCode(TCGContext *s, TranslationBlock *tb);
+
+    /* Cache of generated functions */
+    void getTBKey(TCGContext *s, TranslationBlock *tb,
+                  std::vector<uint64_t> &key);
+    bool reuseCachedTB(const std::vector<uint64_t> &key, uint64_t hash,
+                       TranslationBlock *tb);
+    void releaseTB(TranslationBlock *tb);
+    void evictTB(CachedTB *c);
+    void trimTBCache(unsigned max);
+    void flushTBCache() { trimTBCache(0); }
+
+    /* Background compilation */
+    void generateCodeAsync(TCGContext *s, TranslationBlock *tb);
+    static void *compileThread(void *opaque);
+    void stopCompileThread();
+
+    /* Traces */
+    void generateTrace(TranslationBlock *head);
+    void dropTrace(TranslationBlock *head);
+    void dropTraces(TranslationBlock *tb);
 };
 
+/* Where, if anywhere, an op has a label argument */
+static int labelArg(int opc)
+{
+    switch(opc) {
+    case INDEX_op_br:
+    case INDEX_op_set_label:
+        return 0;
+    case INDEX_op_brcond_i32:
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_brcond_i64:
+#endif
+        return 3;
+#if TCG_TARGET_REG_BITS == 32
+    case INDEX_op_brcond2_i32:
+        return 5;
+#endif
+    default:
+        return -1;
+    }
+}
+
+/* Hand tb its function.  tc_ptr goes last: with tcg_llvm_async the vCPU
+ * thread may be looking, and it runs the LLVM code as soon as it sees it. */
+static void publishTB(TranslationBlock *tb, Function *F,
+        uint8_t *tc_ptr, uint8_t *tc_end)
+{
+    tb->llvm_function = F;
+    tb->llvm_tc_end = tc_end;
+    smp_wmb();
+    atomic_set(&tb->llvm_tc_ptr, tc_ptr);
+}
+
 /* Custom JITMemoryManager in order to capture the size of
  * the last generated function */
 class TJITMemoryManager: public SectionMemoryManager {
@@ -300,12 +420,17 @@ public:
 
 TCGLLVMContextPrivate::TCGLLVMContextPrivate()
     : m_context(getGlobalContext()), m_builder(m_context), m_tbCount(0),
-      m_tcgContext(NULL), m_tbFunction(NULL)
+      m_passGeneration(0),
+      m_compileThreadRunning(false), m_stopCompileThread(false),
+      m_traceCount(0), m_traceContinue(NULL),
+      m_tcgContext(NULL), m_tbFunction(NULL), m_tb(NULL)
 {
     std::memset(m_values, 0, sizeof(m_values));
     std::memset(m_memValuesPtr, 0, sizeof(m_memValuesPtr));
     std::memset(m_globalsIdx, 0, sizeof(m_globalsIdx));
     std::memset(m_labels, 0, sizeof(m_labels));
+    qemu_mutex_init(&m_lock);
+    qemu_cond_init(&m_jobCond);
 
     InitializeNativeTarget();
 
@@ -334,6 +459,15 @@ TCGLLVMContextPrivate::TCGLLVMContextPrivate()
 
     m_functionPassManager->doInitialization();
 
+    m_tracePassManager = new FunctionPassManager(m_module);
+    m_tracePassManager->add(
+            new DataLayout(*m_executionEngine->getDataLayout()));
+    m_tracePassManager->add(createInstructionCombiningPass());
+    m_tracePassManager->add(createGVNPass());
+    m_tracePassManager->add(createDeadStoreEliminationPass());
+    m_tracePassManager->add(createCFGSimplificationPass());
+    m_tracePassManager->doInitialization();
+
 #define XSTR(x) STR(x)
 #define STR(x) #x
     m_CPUArchStateName = XSTR(CPUArchState);
@@ -349,6 +483,31 @@ TCGLLVMContextPrivate::TCGLLVMContextPrivate()
  */
 TCGLLVMContextPrivate::~TCGLLVMContextPrivate()
 {
+    if (m_compileThreadRunning) {
+        /* no point finishing these now */
+        qemu_mutex_lock(&m_lock);
+        for (TBJob *job : m_jobs) {
+            g_free(job->s);
+            delete job;
+        }
+        m_jobs.clear();
+        qemu_mutex_unlock(&m_lock);
+    }
+    stopCompileThread();
+
+    // the functions themselves go with the module
+    for (auto &it : m_tbCacheByFunction) {
+        delete it.second;
+    }
+    for (auto &it : m_traces) {
+        delete it.second;
+    }
+
+    if (m_tracePassManager) {
+        delete m_tracePassManager;
+        m_tracePassManager = NULL;
+    }
+
     if (m_functionPassManager) {
         delete m_functionPassManager;
         m_functionPassManager = NULL;
@@ -638,6 +797,9 @@ inline Value* TCGLLVMContextPrivate::getEnv() {
 /*
  * rwhelan: This now just calls the helper functions for whole system mode, and
  * we take care of the logging in there.  For user mode, we log in the IR.
+ *
+ * Unless memory callbacks are on, the helper is only called on a TLB miss: the
+ * TLB lookup is done inline first, the way tcg_out_tlb_load does it.
  */
 inline Value* TCGLLVMContextPrivate::generateQemuMemOp(bool ld,
         Value *value, Value *addr, int flags, int mem_index, int bits, uintptr_t ret_addr)
@@ -692,8 +854,107 @@ inline Value* TCGLLVMContextPrivate::generateQemuMemOp(bool ld,
                                             (void*) helperFuncAddr);
     }
 
-    return m_builder.CreateCall(helperFunction, ArrayRef<Value*>(argValues));
+    /* Memory callbacks (and so taint2, which needs them) have to see every
+     * access, and only the helper makes them. */
+    if (panda_use_memcb) {
+        return m_builder.CreateCall(helperFunction, ArrayRef<Value*>(argValues));
+    }
+
+    /* The comparison fails for anything the helper has to deal with: a
+     * different page, or an entry with flags set in the low bits (invalid,
+     * I/O, not dirty, watched), or an access that is misaligned or crosses
+     * a page.  No temps change across the branch, so unlike a TCG label
+     * this doesn't start a new basic block as far as m_values goes. */
+    unsigned s_mask = (1 << (opc & MO_SIZE)) - 1;
+    unsigned a_bits = get_alignment_bits(opc);
+    unsigned a_mask = (1 << a_bits) - 1;
+    llvm::Type *tlType = intType(TARGET_LONG_BITS);
+
+    Value *cmpAddr = addr;
+    if (a_bits < (opc & MO_SIZE)) {
+        cmpAddr = m_builder.CreateAdd(cmpAddr,
+                ConstantInt::get(tlType, s_mask - a_mask));
+    }
+    cmpAddr = m_builder.CreateAnd(cmpAddr,
+            ConstantInt::get(tlType, TARGET_PAGE_MASK | a_mask));
+
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    /* the TLB is sized at runtime, so its mask and table come from env */
+    Value *tlbMask = m_builder.CreateLoad(m_builder.CreateIntToPtr(
+            m_builder.CreateAdd(m_envInt, ConstantInt::get(wordType(),
+                    offsetof(CPUArchState, tlb_mask[mem_index]))),
+            wordPtrType()));
+    Value *tlbTable = m_builder.CreateLoad(m_builder.CreateIntToPtr(
+            m_builder.CreateAdd(m_envInt, ConstantInt::get(wordType(),
+                    offsetof(CPUArchState, tlb_table[mem_index]))),
+            wordPtrType()));
+    Value *index = m_builder.CreateZExt(
+            m_builder.CreateLShr(addr, ConstantInt::get(tlType,
+                    TARGET_PAGE_BITS - CPU_TLB_ENTRY_BITS)),
+            wordType());
+    Value *entry = m_builder.CreateAdd(tlbTable,
+            m_builder.CreateAnd(index, tlbMask));
+#else
+    Value *index = m_builder.CreateAnd(
+            m_builder.CreateLShr(addr, ConstantInt::get(tlType, TARGET_PAGE_BITS)),
+            ConstantInt::get(tlType, CPU_TLB_SIZE - 1));
+    index = m_builder.CreateZExt(index, wordType());
+    Value *entry = m_builder.CreateAdd(m_envInt, ConstantInt::get(wordType(),
+            offsetof(CPUArchState, tlb_table) +
+            mem_index * sizeof(((CPUArchState *)0)->tlb_table[0])));
+    entry = m_builder.CreateAdd(entry, m_builder.CreateShl(index,
+            ConstantInt::get(wordType(), CPU_TLB_ENTRY_BITS)));
+#endif
+
+    size_t cmpOffset = ld ? offsetof(CPUTLBEntry, addr_read)
+                          : offsetof(CPUTLBEntry, addr_write);
+    Value *tlbAddr = m_builder.CreateLoad(m_builder.CreateIntToPtr(
+            m_builder.CreateAdd(entry, ConstantInt::get(wordType(), cmpOffset)),
+            intPtrType(TARGET_LONG_BITS)));
+    Value *hit = m_builder.CreateICmpEQ(cmpAddr, tlbAddr);
+
+    BasicBlock *hitBB = BasicBlock::Create(m_context, "tlb_hit", m_tbFunction);
+    BasicBlock *missBB = BasicBlock::Create(m_context, "tlb_miss", m_tbFunction);
+    BasicBlock *doneBB = BasicBlock::Create(m_context, "tlb_done", m_tbFunction);
+    m_builder.CreateCondBr(hit, hitBB, missBB);
+
+    m_builder.SetInsertPoint(hitBB);
+    Value *addend = m_builder.CreateLoad(m_builder.CreateIntToPtr(
+            m_builder.CreateAdd(entry, ConstantInt::get(wordType(),
+                    offsetof(CPUTLBEntry, addend))),
+            wordPtrType()));
+    Value *hostAddr = m_builder.CreateIntToPtr(
+            m_builder.CreateAdd(m_builder.CreateZExt(addr, wordType()), addend),
+            intPtrType(bits));
+    Function *bswap = NULL;
+    if ((opc & MO_BSWAP) && bits > 8) {
+        llvm::Type* Tys[] = { intType(bits) };
+        bswap = Intrinsic::getDeclaration(m_module,
+                Intrinsic::bswap, ArrayRef<llvm::Type*>(Tys,1));
+    }
+    Value *hitValue = NULL;
+    if (ld) {
+        hitValue = m_builder.CreateLoad(hostAddr);
+        if (bswap) hitValue = m_builder.CreateCall(bswap, hitValue);
+    } else {
+        m_builder.CreateStore(bswap ? m_builder.CreateCall(bswap, value) : value,
+                              hostAddr);
+    }
+    m_builder.CreateBr(doneBB);
+
+    m_builder.SetInsertPoint(missBB);
+    Value *missValue = m_builder.CreateCall(helperFunction,
+            ArrayRef<Value*>(argValues));
+    m_builder.CreateBr(doneBB);
 
+    m_builder.SetInsertPoint(doneBB);
+    if (!ld) {
+        return NULL;
+    }
+    PHINode *result = m_builder.CreatePHI(intType(bits), 2);
+    result->addIncoming(hitValue, hitBB);
+    result->addIncoming(missValue, missBB);
+    return result;
 
 #else // CONFIG_SOFTMMU
     std::vector<Value*> argValues2;
@@ -1226,7 +1487,25 @@ int TCGLLVMContextPrivate::generateOperation(int opc, const TCGOp *op,
 #undef __OP_QEMU_ST
 
     case INDEX_op_exit_tb:
-        m_builder.CreateRet(ConstantInt::get(wordType(), args[0]));
+        if ((args[0] & ~(TCGArg)TB_EXIT_MASK) == (uintptr_t)m_tb) {
+            /* Return the TB that is running rather than this one, so any
+             * TB with the same ops can share the function. */
+            MDNode *RuntimeMD = MDNode::get(m_context,
+                    MDString::get(m_context, "runtime"));
+            Value *LastTBPtr = m_builder.CreateIntToPtr(
+                    constInt(sizeof(uintptr_t) * 8,
+                        (uintptr_t)&tcg_llvm_runtime.last_tb),
+                    wordPtrType(), "lasttb");
+            Instruction *LastTB = m_builder.CreateLoad(LastTBPtr, true);
+            LastTB->setMetadata("host", RuntimeMD);
+            Value *Ret = m_builder.CreateAdd(LastTB,
+                    ConstantInt::get(wordType(), args[0] & TB_EXIT_MASK));
+            if (Instruction *RetI = dyn_cast<Instruction>(Ret))
+                RetI->setMetadata("host", RuntimeMD);
+            m_builder.CreateRet(Ret);
+        } else {
+            m_builder.CreateRet(ConstantInt::get(wordType(), args[0]));
+        }
         break;
 
     case INDEX_op_goto_tb:
@@ -1299,10 +1578,392 @@ int TCGLLVMContextPrivate::generateOperation(int opc, const TCGOp *op,
     return nb_args;
 }
 
+/* Everything generateCode looks at to build a TB's function: the pass
+ * generation, the temps and the ops with their arguments, leaving out what
+ * differs between translations of the same code, i.e. label addresses and
+ * the TB's own address in exit_tb.  The ops already reflect the guest code,
+ * the TB's pc and flags, and whatever instrumentation plugins added. */
+void TCGLLVMContextPrivate::getTBKey(TCGContext *s, TranslationBlock *tb,
+        std::vector<uint64_t> &key)
+{
+    key.clear();
+    key.push_back(m_passGeneration);
+    key.push_back(panda_use_memcb);
+    key.push_back(s->nb_temps);
+    for(int i = s->nb_globals; i < s->nb_temps; ++i) {
+        key.push_back((s->temps[i].type << 1) | s->temps[i].temp_local);
+    }
+
+    TCGOp *op;
+    for(int opc_index = s->gen_op_buf[0].next; opc_index != 0;
+            opc_index = op->next) {
+        op = &s->gen_op_buf[opc_index];
+        const TCGArg *args = &s->gen_opparam_buf[op->args];
+        int opc = op->opc;
+
+        if (test_bit(opc_index, s->panda_tcg_only_ops)) {
+            continue;
+        }
+
+        TCGOpDef &def = tcg_op_defs[opc];
+        int nb_args = def.nb_args;
+        int label = labelArg(opc);
+        if (opc == INDEX_op_call) {
+            nb_args = op->callo + op->calli + def.nb_cargs;
+        }
+
+        key.push_back(((uint64_t)opc << 32) | nb_args);
+        for(int i = 0; i < nb_args; ++i) {
+            if (i == label) {
+                key.push_back(arg_label(args[i])->id);
+            } else if (opc == INDEX_op_exit_tb) {
+                bool own = (args[0] & ~(TCGArg)TB_EXIT_MASK) == (uintptr_t)tb;
+                key.push_back(own);
+                key.push_back(own ? args[0] & TB_EXIT_MASK : args[0]);
+            } else {
+                key.push_back(args[i]);
+            }
+        }
+    }
+}
+
+static uint64_t hashTBKey(const std::vector<uint64_t> &key)
+{
+    return std::hash<std::string>()(std::string((const char *)key.data(),
+                key.size() * sizeof(uint64_t)));
+}
+
+bool TCGLLVMContextPrivate::reuseCachedTB(const std::vector<uint64_t> &key,
+        uint64_t hash, TranslationBlock *tb)
+{
+    auto range = m_tbCache.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        CachedTB *c = it->second;
+        if (c->key != key) continue;
+
+        if (c->users++ == 0) {
+            m_unusedTBs.erase(c->unused);
+        }
+        if (!c->tc_ptr &&
+                (execute_llvm || qemu_loglevel_mask(CPU_LOG_LLVM_ASM))) {
+            c->tc_ptr = (uint8_t*)
+                    m_executionEngine->getPointerToFunction(c->function);
+            c->tc_end = c->tc_ptr +
+                    m_jitMemoryManager->getFunctionSize(c->function);
+        }
+        publishTB(tb, c->function, c->tc_ptr, c->tc_end);
+        return true;
+    }
+    return false;
+}
+
+void TCGLLVMContextPrivate::evictTB(CachedTB *c)
+{
+    assert(c->users == 0);
+    auto range = m_tbCache.equal_range(hashTBKey(c->key));
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == c) {
+            m_tbCache.erase(it);
+            break;
+        }
+    }
+    m_tbCacheByFunction.erase(c->function);
+    m_unusedTBs.erase(c->unused);
+    c->function->eraseFromParent();
+    delete c;
+}
+
+void TCGLLVMContextPrivate::trimTBCache(unsigned max)
+{
+    while (m_unusedTBs.size() > max) {
+        evictTB(m_unusedTBs.back());
+    }
+}
+
+void TCGLLVMContextPrivate::releaseTB(TranslationBlock *tb)
+{
+    if (m_compileThreadRunning) {
+        qemu_mutex_lock(&m_lock);
+        /* a job for tb that hasn't been done yet never will be */
+        for (TBJob *job : m_jobs) {
+            if (job->tb == tb) job->tb = NULL;
+        }
+    }
+
+    dropTraces(tb);
+
+    if (tb->llvm_function) {
+        auto it = m_tbCacheByFunction.find(tb->llvm_function);
+        if (it == m_tbCacheByFunction.end()) {
+            tb->llvm_function->eraseFromParent();
+        } else {
+            CachedTB *c = it->second;
+            assert(c->users > 0);
+            if (--c->users == 0) {
+                m_unusedTBs.push_front(c);
+                c->unused = m_unusedTBs.begin();
+                trimTBCache(tcg_llvm_tb_cache_size);
+            }
+        }
+    }
+
+    if (m_compileThreadRunning) {
+        qemu_mutex_unlock(&m_lock);
+    }
+}
+
+void TCGLLVMContextPrivate::generateCodeAsync(TCGContext *s,
+        TranslationBlock *tb)
+{
+    TBJob *job = new TBJob;
+    job->tb = tb;
+    job->s = (TCGContext *) g_memdup(s, sizeof(TCGContext));
+    job->labels.resize(s->nb_labels);
+
+    /* point the copy's label arguments at copies of the labels */
+    TCGOp *op;
+    for(int opc_index = s->gen_op_buf[0].next; opc_index != 0;
+            opc_index = op->next) {
+        op = &job->s->gen_op_buf[opc_index];
+        int label = labelArg(op->opc);
+        if (label < 0) continue;
+        TCGArg *arg = &job->s->gen_opparam_buf[op->args + label];
+        TCGLabel *l = arg_label(*arg);
+        job->labels[l->id] = *l;
+        *arg = label_arg(&job->labels[l->id]);
+    }
+
+    qemu_mutex_lock(&m_lock);
+    if (!m_compileThreadRunning) {
+        m_compileThreadRunning = true;
+        qemu_thread_create(&m_compileThread, "llvm_compile", compileThread,
+                           this, QEMU_THREAD_JOINABLE);
+    }
+    m_jobs.push_back(job);
+    qemu_cond_signal(&m_jobCond);
+    qemu_mutex_unlock(&m_lock);
+}
+
+void *TCGLLVMContextPrivate::compileThread(void *opaque)
+{
+    TCGLLVMContextPrivate *p = (TCGLLVMContextPrivate *) opaque;
+    qemu_mutex_lock(&p->m_lock);
+    for (;;) {
+        while (p->m_jobs.empty() && !p->m_stopCompileThread) {
+            qemu_cond_wait(&p->m_jobCond, &p->m_lock);
+        }
+        if (p->m_stopCompileThread) break;
+        TBJob *job = p->m_jobs.front();
+        p->m_jobs.pop_front();
+        if (job->tb) {
+            p->generateCode(job->s, job->tb);
+        }
+        g_free(job->s);
+        delete job;
+    }
+    qemu_mutex_unlock(&p->m_lock);
+    return NULL;
+}
+
+void TCGLLVMContextPrivate::stopCompileThread()
+{
+    if (!m_compileThreadRunning) return;
+    qemu_mutex_lock(&m_lock);
+    m_stopCompileThread = true;
+    qemu_cond_signal(&m_jobCond);
+    qemu_mutex_unlock(&m_lock);
+    qemu_thread_join(&m_compileThread);
+    m_compileThreadRunning = false;
+    m_stopCompileThread = false;
+    /* finish what's left here, so no TB waits forever */
+    for (TBJob *job : m_jobs) {
+        if (job->tb) {
+            generateCode(job->s, job->tb);
+        }
+        g_free(job->s);
+        delete job;
+    }
+    m_jobs.clear();
+}
+
+/* A trace is one function for a chain of TBs that have been following
+ * one another, found by walking llvm_trace_next from head.  It calls each
+ * TB's function in turn, calling tcg_llvm_trace_continue in between, and
+ * returns what the last TB returned as soon as that says no, so cpu_exec
+ * carries on from there just as if the TBs had run one at a time.  A chain
+ * that comes back to head becomes a loop.  The calls are inlined and the
+ * whole optimized, so LLVM gets to work across TB boundaries. */
+void TCGLLVMContextPrivate::generateTrace(TranslationBlock *head)
+{
+    if (m_compileThreadRunning) {
+        qemu_mutex_lock(&m_lock);
+    }
+
+    std::vector<TranslationBlock *> tbs;
+    bool loops = false;
+    TranslationBlock *tb = head;
+    while (!m_traces.count(head) && tbs.size() < TCG_LLVM_TRACE_MAX_TBS) {
+        /* as for chaining, nothing that spans two pages */
+        if (!atomic_read(&tb->llvm_tc_ptr) || atomic_read(&tb->invalid) ||
+                (tb->cflags & CF_NOCACHE) || tb->page_addr[1] != -1) {
+            break;
+        }
+        tbs.push_back(tb);
+        TranslationBlock *next = tb->llvm_trace_next;
+        if (!next || tb->llvm_trace_hits < (llvm_trace_threshold + 1) / 2) {
+            break;
+        }
+        if (next == head) {
+            loops = true;
+            break;
+        }
+        if (std::find(tbs.begin(), tbs.end(), next) != tbs.end()) {
+            break;
+        }
+        tb = next;
+    }
+    if (tbs.size() < 2 && !loops) {
+        goto out;
+    }
+
+    {
+        Function *first = tbs[0]->llvm_function;
+        if (!m_traceContinue) {
+            FunctionType *continueType = FunctionType::get(intType(32),
+                    std::vector<llvm::Type*>{
+                        first->arg_begin()->getType(), wordType(), wordType()},
+                    false);
+            m_traceContinue = Function::Create(continueType,
+                    Function::ExternalLinkage, "tcg_llvm_trace_continue",
+                    m_module);
+            m_executionEngine->addGlobalMapping(m_traceContinue,
+                    (void*) tcg_llvm_trace_continue);
+        }
+
+        std::ostringstream fName;
+        fName << "tcg-llvm-trace-" << (m_traceCount++) << "-"
+              << std::hex << head->pc;
+        Function *trace = Function::Create(first->getFunctionType(),
+                Function::PrivateLinkage, fName.str(), m_module);
+        Value *env = trace->arg_begin();
+
+        std::vector<BasicBlock *> blocks;
+        for (size_t i = 0; i < tbs.size(); ++i) {
+            blocks.push_back(BasicBlock::Create(m_context, "tb", trace));
+        }
+        std::vector<CallInst *> calls;
+        for (size_t i = 0; i < tbs.size(); ++i) {
+            m_builder.SetInsertPoint(blocks[i]);
+            CallInst *ret = m_builder.CreateCall(tbs[i]->llvm_function, env);
+            calls.push_back(ret);
+            size_t next = i + 1;
+            if (next == tbs.size()) {
+                if (!loops) {
+                    m_builder.CreateRet(ret);
+                    continue;
+                }
+                next = 0;
+            }
+            std::vector<Value*> args{env, ret,
+                constInt(TCG_TARGET_REG_BITS, (uintptr_t)tbs[next])};
+            Value *cont = m_builder.CreateCall(m_traceContinue,
+                    ArrayRef<Value*>(args));
+            BasicBlock *exit = BasicBlock::Create(m_context, "exit", trace);
+            m_builder.CreateCondBr(
+                    m_builder.CreateICmpNE(cont, constInt(32, 0)),
+                    blocks[next], exit);
+            m_builder.SetInsertPoint(exit);
+            m_builder.CreateRet(ret);
+        }
+
+        InlineFunctionInfo inlineInfo(NULL,
+                m_executionEngine->getDataLayout());
+        for (CallInst *call : calls) {
+            if (!InlineFunction(call, inlineInfo)) {
+                trace->eraseFromParent();
+                goto out;
+            }
+        }
+        m_tracePassManager->run(*trace);
+
+#ifndef NDEBUG
+        verifyFunction(*trace);
+#endif
+
+        uint8_t *tc_ptr = (uint8_t*)
+                m_executionEngine->getPointerToFunction(trace);
+        uint8_t *tc_end = tc_ptr + m_jitMemoryManager->getFunctionSize(trace);
+        assert(tc_end > tc_ptr);
+
+        Trace *t = new Trace;
+        t->function = trace;
+        t->tbs = tbs;
+        m_traces[head] = t;
+        for (TranslationBlock *member : tbs) {
+            m_traceHeads.insert(std::make_pair(member, head));
+        }
+        head->llvm_trace_tc_end = tc_end;
+        head->llvm_trace_tc_ptr = tc_ptr;
+
+        if(qemu_loglevel_mask(CPU_LOG_LLVM_IR)) {
+            std::string fcnString;
+            llvm::raw_string_ostream s(fcnString);
+            s << *trace;
+            qemu_log("OUT (LLVM IR):\n");
+            qemu_log("%s", s.str().c_str());
+            qemu_log("\n");
+            qemu_log_flush();
+        }
+    }
+
+out:
+    if (m_compileThreadRunning) {
+        qemu_mutex_unlock(&m_lock);
+    }
+}
+
+void TCGLLVMContextPrivate::dropTrace(TranslationBlock *head)
+{
+    auto it = m_traces.find(head);
+    if (it == m_traces.end()) return;
+    Trace *t = it->second;
+    for (TranslationBlock *member : t->tbs) {
+        auto range = m_traceHeads.equal_range(member);
+        for (auto h = range.first; h != range.second; ++h) {
+            if (h->second == head) {
+                m_traceHeads.erase(h);
+                break;
+            }
+        }
+    }
+    head->llvm_trace_tc_ptr = NULL;
+    head->llvm_trace_tc_end = NULL;
+    t->function->eraseFromParent();
+    m_traces.erase(it);
+    delete t;
+}
+
+void TCGLLVMContextPrivate::dropTraces(TranslationBlock *tb)
+{
+    std::multimap<TranslationBlock *, TranslationBlock *>::iterator it;
+    while ((it = m_traceHeads.find(tb)) != m_traceHeads.end()) {
+        dropTrace(it->second);
+    }
+}
+
 void TCGLLVMContextPrivate::generateCode(TCGContext *s, TranslationBlock *tb)
 {
+    std::vector<uint64_t> key;
+    uint64_t hash = 0;
+    if (tcg_llvm_tb_cache_size) {
+        getTBKey(s, tb, key);
+        hash = hashTBKey(key);
+        if (reuseCachedTB(key, hash, tb)) {
+            return;
+        }
+    }
+
     /* Create new function for current translation block */
-    /* TODO: compute the checksum of the tb to see if we can reuse some code */
     std::ostringstream fName;
 
     fName << "tcg-llvm-tb-" << (m_tbCount++) << "-" << std::hex << tb->pc;
@@ -1334,6 +1995,7 @@ void TCGLLVMContextPrivate::generateCode(TCGContext *s, TranslationBlock *tb)
     m_builder.SetInsertPoint(basicBlock);
 
     m_tcgContext = s;
+    m_tb = tb;
 
     /* Prepare globals and temps information */
     initGlobalsAndLocalTemps();
@@ -1374,6 +2036,10 @@ void TCGLLVMContextPrivate::generateCode(TCGContext *s, TranslationBlock *tb)
         args = &s->gen_opparam_buf[op->args];
         int opc = op->opc;
 
+        if (test_bit(opc_index, s->panda_tcg_only_ops)) {
+            continue;
+        }
+
         if (opc == INDEX_op_insn_start) {
             // volatile store of current PC
             Constant *PC = ConstantInt::get(intType(64), args[0]);
@@ -1422,19 +2088,26 @@ void TCGLLVMContextPrivate::generateCode(TCGContext *s, TranslationBlock *tb)
     verifyFunction(*m_tbFunction);
 #endif
 
-    tb->llvm_function = m_tbFunction;
-
+    uint8_t *tc_ptr = 0, *tc_end = 0;
     if(execute_llvm || qemu_loglevel_mask(CPU_LOG_LLVM_ASM)) {
-        tb->llvm_tc_ptr = (uint8_t*)
+        tc_ptr = (uint8_t*)
                 m_executionEngine->getPointerToFunction(m_tbFunction);
-        tb->llvm_tc_end = tb->llvm_tc_ptr +
-                m_jitMemoryManager->getFunctionSize(m_tbFunction);
+        tc_end = tc_ptr + m_jitMemoryManager->getFunctionSize(m_tbFunction);
 
-        assert(tb->llvm_tc_ptr);
-        assert(tb->llvm_tc_end > tb->llvm_tc_ptr);
-    } else {
-        tb->llvm_tc_ptr = 0;
-        tb->llvm_tc_end = 0;
+        assert(tc_ptr);
+        assert(tc_end > tc_ptr);
+    }
+    publishTB(tb, m_tbFunction, tc_ptr, tc_end);
+
+    if (tcg_llvm_tb_cache_size) {
+        CachedTB *c = new CachedTB;
+        c->key.swap(key);
+        c->function = m_tbFunction;
+        c->tc_ptr = tc_ptr;
+        c->tc_end = tc_end;
+        c->users = 1;
+        m_tbCache.insert(std::make_pair(hash, c));
+        m_tbCacheByFunction[m_tbFunction] = c;
     }
 
     if(qemu_loglevel_mask(CPU_LOG_LLVM_IR)) {
@@ -1492,7 +2165,21 @@ void TCGLLVMContext::generateCode(TCGContext *s, TranslationBlock *tb)
     assert(tb->llvm_function == NULL);
 
     tb->tcg_llvm_context = this;
-    m_private->generateCode(s, tb);
+    if (tcg_llvm_async) {
+        m_private->generateCodeAsync(s, tb);
+    } else {
+        m_private->generateCode(s, tb);
+    }
+}
+
+void TCGLLVMContext::releaseTB(TranslationBlock *tb)
+{
+    m_private->releaseTB(tb);
+}
+
+void TCGLLVMContext::generateTrace(TranslationBlock *tb)
+{
+    m_private->generateTrace(tb);
 }
 
 void TCGLLVMContext::writeModule(const char *path) {
@@ -1534,12 +2221,20 @@ void tcg_llvm_tb_alloc(TranslationBlock *tb)
 {
     tb->tcg_llvm_context = NULL;
     tb->llvm_function = NULL;
+    tb->llvm_tc_ptr = NULL;
+    tb->llvm_tc_end = NULL;
+    tb->llvm_exec_count = 0;
+    tb->llvm_trace_tc_ptr = NULL;
+    tb->llvm_trace_tc_end = NULL;
+    tb->llvm_trace_next = NULL;
+    tb->llvm_trace_hits = 0;
 }
 
 void tcg_llvm_tb_free(TranslationBlock *tb)
 {
-    if(tb->llvm_function) {
-        tb->llvm_function->eraseFromParent();
+    if(tb->tcg_llvm_context) {
+        tb->tcg_llvm_context->releaseTB(tb);
+        tb->tcg_llvm_context = NULL;
         tb->llvm_function = NULL;
         tb->llvm_tc_ptr = NULL;
         tb->llvm_tc_end = NULL;
@@ -1558,11 +2253,29 @@ const char* tcg_llvm_get_func_name(TranslationBlock *tb)
 uintptr_t tcg_llvm_qemu_tb_exec(CPUArchState *env, TranslationBlock *tb)
 {
     tcg_llvm_runtime.last_tb = tb;
+    tcg_llvm_runtime.trace_tb = NULL;
     uintptr_t next_tb;
     next_tb = ((uintptr_t (*)(void*)) tb->llvm_tc_ptr)(env);
     return next_tb;
 }
 
+void tcg_llvm_gen_trace(TCGLLVMContext *l, TranslationBlock *tb)
+{
+    if (tb->tcg_llvm_context) {
+        l->generateTrace(tb);
+    }
+}
+
+uintptr_t tcg_llvm_qemu_trace_exec(CPUArchState *env, TranslationBlock *tb)
+{
+    tcg_llvm_runtime.last_tb = tb;
+    tcg_llvm_runtime.trace_tb = tb;
+    uintptr_t next_tb;
+    next_tb = ((uintptr_t (*)(void*)) tb->llvm_trace_tc_ptr)(env);
+    tcg_llvm_runtime.trace_tb = NULL;
+    return next_tb;
+}
+
 void tcg_llvm_write_module(TCGLLVMContext *l, const char *path) {
     l->writeModule(path);
 }
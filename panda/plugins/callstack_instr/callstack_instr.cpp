@@ -15,6 +15,7 @@ PANDAENDCOMMENT */
 
 #include <cstdio>
 #include <cstdlib>
+#include <dlfcn.h>
 
 #include <map>
 #include <set>
@@ -32,9 +33,11 @@ namespace distorm {
 
 #include "callstack_instr.h"
 #include "prog_point.h"
+#include "open_hash_map.h"
 
 extern "C" {
 #include "panda/plog.h"
+#include "osi/osi_types.h"
 
 #include "callstack_instr_int_fns.h"
 
@@ -67,9 +70,48 @@ enum instr_type {
   INSTR_IRET,
 };
 
-struct stack_entry {
-    target_ulong pc;
-    instr_type kind;
+struct stack_frame {
+    target_ulong caller;    // return address of the call
+    target_ulong function;  // entry point of the function called
+};
+
+// frames kept per stack unless the max_depth argument says otherwise;
+// deeper calls drop the oldest frames
+#define DEFAULT_MAX_DEPTH 4096
+static uint32_t max_depth = DEFAULT_MAX_DEPTH;
+
+// The shadow stack of one thread: a ring buffer of frames that starts out
+// small and doubles up to max_depth (a power of two), after which each
+// call overwrites the oldest frame.
+struct shadow_stack {
+    std::vector<stack_frame> frames;
+    uint32_t base = 0;      // oldest frame
+    uint32_t depth = 0;     // frames held
+
+    uint32_t mask() const { return frames.size() - 1; }
+
+    void push(const stack_frame &f) {
+        if (depth == frames.size()) {
+            if (frames.size() == max_depth) {
+                frames[base] = f;
+                base = (base + 1) & mask();
+                return;
+            }
+            // only a full ring has wrapped, so the frames are in order
+            frames.resize(std::min<size_t>(std::max<size_t>(16, 2 * frames.size()), max_depth));
+        }
+        frames[(base + depth) & mask()] = f;
+        depth++;
+    }
+
+    // i-th frame from the top, 0 being the most recent call
+    const stack_frame &top(uint32_t i) const {
+        return frames[(base + depth - 1 - i) & mask()];
+    }
+
+    void pop(uint32_t n) {
+        depth -= n;
+    }
 };
 
 #define MAX_STACK_DIFF 5000
@@ -88,12 +130,12 @@ target_ulong cached_asid = 0;
 typedef target_ulong stackid;
 #endif
 
-// stackid -> shadow stack
-std::map<stackid, std::vector<stack_entry>> callstacks;
-// stackid -> function entry points
-std::map<stackid, std::vector<target_ulong>> function_stacks;
-// EIP -> instr_type
-std::map<target_ulong, instr_type> call_cache;
+// stackid -> shadow stack.  only after_block_exec adds stacks, and
+// process exits take them out again; everything else looks them up with
+// find(), so that stays valid across the on_call and on_ret callbacks.
+open_hash_map<stackid, shadow_stack> callstacks;
+// tb->panda_data[] slot holding the TB's instr_type
+int tb_type_slot = -1;
 int last_ret_size = 0;
 
 static inline bool in_kernelspace(CPUArchState* env) {
@@ -257,26 +299,23 @@ done:
 
 int after_block_translate(CPUState *cpu, TranslationBlock *tb) {
     CPUArchState* env = (CPUArchState*)cpu->env_ptr;
-    call_cache[tb->pc] = disas_block(env, tb->pc, tb->size);
+    tb->panda_data[tb_type_slot] = disas_block(env, tb->pc, tb->size);
 
     return 1;
 }
 
 int before_block_exec(CPUState *cpu, TranslationBlock *tb) {
     CPUArchState* env = (CPUArchState*)cpu->env_ptr;
-    std::vector<stack_entry> &v = callstacks[get_stackid(env)];
-    std::vector<target_ulong> &w = function_stacks[get_stackid(env)];
-    if (v.empty()) return 1;
+    shadow_stack *s = callstacks.find(get_stackid(env));
+    if (!s || s->depth == 0) return 1;
 
     // Search up to 10 down
-    for (int i = v.size()-1; i > ((int)(v.size()-10)) && i >= 0; i--) {
-        if (tb->pc == v[i].pc) {
-            //printf("Matched at depth %d\n", v.size()-i);
-            //v.erase(v.begin()+i, v.end());
+    for (uint32_t i = 0; i < s->depth && i < 9; i++) {
+        if (tb->pc == s->top(i).caller) {
+            //printf("Matched at depth %d\n", i+1);
 
-            PPP_RUN_CB(on_ret, cpu, w[i]);
-            v.erase(v.begin()+i, v.end());
-            w.erase(w.begin()+i, w.end());
+            PPP_RUN_CB(on_ret, cpu, s->top(i).function);
+            s->pop(i + 1);
 
             break;
         }
@@ -287,18 +326,16 @@ int before_block_exec(CPUState *cpu, TranslationBlock *tb) {
 
 int after_block_exec(CPUState* cpu, TranslationBlock *tb) {
     CPUArchState* env = (CPUArchState*)cpu->env_ptr;
-    instr_type tb_type = call_cache[tb->pc];
+    instr_type tb_type = (instr_type)tb->panda_data[tb_type_slot];
 
     if (tb_type == INSTR_CALL) {
-        stack_entry se = {tb->pc+tb->size,tb_type};
-        callstacks[get_stackid(env)].push_back(se);
-
         // Also track the function that gets called
         target_ulong pc, cs_base;
         uint32_t flags;
         // This retrieves the pc in an architecture-neutral way
         cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
-        function_stacks[get_stackid(env)].push_back(pc);
+        stack_frame f = {tb->pc+tb->size, pc};
+        callstacks[get_stackid(env)].push(f);
 
         PPP_RUN_CB(on_call, cpu, pc);
     }
@@ -313,11 +350,10 @@ int after_block_exec(CPUState* cpu, TranslationBlock *tb) {
 // Public interface implementation
 int get_callers(target_ulong callers[], int n, CPUState* cpu) {
     CPUArchState* env = (CPUArchState*)cpu->env_ptr;
-    std::vector<stack_entry> &v = callstacks[get_stackid(env)];
-    auto rit = v.rbegin();
+    shadow_stack *s = callstacks.find(get_stackid(env));
     int i = 0;
-    for (/*no init*/; rit != v.rend() && i < n; ++rit, ++i) {
-        callers[i] = rit->pc;
+    for (/*no init*/; s && i < (int)s->depth && i < n; ++i) {
+        callers[i] = s->top(i).caller;
     }
     return i;
 }
@@ -328,42 +364,30 @@ Panda__CallStack *pandalog_callstack_create() {
     assert (pandalog);
     CPUState *cpu = first_cpu;
     CPUArchState* env = (CPUArchState*)cpu->env_ptr;
-    uint32_t n = 0;
-    std::vector<stack_entry> &v = callstacks[get_stackid(env)];
-    auto rit = v.rbegin();
-    for (/*no init*/; rit != v.rend() && n < 16; ++rit) {
-        n ++;
-    }
-    Panda__CallStack *cs = (Panda__CallStack *) malloc (sizeof(Panda__CallStack));
+    shadow_stack *s = callstacks.find(get_stackid(env));
+    uint32_t n = s ? std::min(s->depth, (uint32_t) 16) : 0;
+    Panda__CallStack *cs = pandalog_arena_new(Panda__CallStack);
     *cs = PANDA__CALL_STACK__INIT;
     cs->n_addr = n;
-    cs->addr = (uint64_t *) malloc (sizeof(uint64_t) * n);
-    v = callstacks[get_stackid(env)];
-    rit = v.rbegin();
-    uint32_t i=0;
-    for (/*no init*/; rit != v.rend() && n < 16; ++rit, ++i) {
-        cs->addr[i] = rit->pc;
+    cs->addr = (uint64_t *) pandalog_arena_alloc(sizeof(uint64_t) * n);
+    for (uint32_t i = 0; i < n; ++i) {
+        cs->addr[i] = s->top(i).caller;
     }
     return cs;
 }
 
 
+// nothing to do since it came from the pandalog arena
 void pandalog_callstack_free(Panda__CallStack *cs) {
-    free(cs->addr);
-    free(cs);
 }
 
 
 int get_functions(target_ulong functions[], int n, CPUState* cpu) {
     CPUArchState* env = (CPUArchState*)cpu->env_ptr;
-    std::vector<target_ulong> &v = function_stacks[get_stackid(env)];
-    if (v.empty()) {
-        return 0;
-    }
-    auto rit = v.rbegin();
+    shadow_stack *s = callstacks.find(get_stackid(env));
     int i = 0;
-    for (/*no init*/; rit != v.rend() && i < n; ++rit, ++i) {
-        functions[i] = *rit;
+    for (/*no init*/; s && i < (int)s->depth && i < n; ++i) {
+        functions[i] = s->top(i).function;
     }
     return i;
 }
@@ -396,10 +420,59 @@ void get_prog_point(CPUState* cpu, prog_point *p) {
 
 
 
+// The stacks of a process that has exited are never used again, and its
+// asid may be reused by a new one.
+static void finished_process(CPUState *cpu, OsiProc *p) {
+#ifdef USE_STACK_HEURISTIC
+    std::vector<stackid> dead;
+    callstacks.for_each([&](const stackid &id, shadow_stack &s) {
+        if (id.first == p->asid) dead.push_back(id);
+    });
+    for (auto &id : dead) {
+        callstacks.erase(id);
+    }
+    stacks_seen.erase(p->asid);
+    if (cached_asid == p->asid) {
+        cached_asid = 0;
+    }
+#else
+    callstacks.erase(p->asid);
+#endif
+}
+
 bool init_plugin(void *self) {
     printf("Initializing plugin callstack_instr\n");
 
     panda_cb pcb;
+    panda_arg_list *args = panda_get_args("callstack_instr");
+    uint32_t depth = panda_parse_uint32(args, "max_depth", DEFAULT_MAX_DEPTH);
+    bool reclaim = panda_parse_bool(args, "reclaim");
+    panda_free_args(args);
+
+    // the ring needs a power of two
+    max_depth = 16;
+    while (max_depth < depth && max_depth < (1U << 31)) {
+        max_depth <<= 1;
+    }
+
+    if (reclaim) {
+        panda_require("osi");
+        void *osi = panda_get_plugin_by_name("panda_osi.so");
+        void (*add_cb)(void (*)(CPUState *, OsiProc *)) =
+            (void (*)(void (*)(CPUState *, OsiProc *))) (osi ?
+                dlsym(osi, "ppp_add_cb_on_finished_process") : NULL);
+        if (!add_cb) {
+            printf("callstack_instr: reclaim needs osi built with OSI_PROC_EVENTS\n");
+            return false;
+        }
+        add_cb(finished_process);
+    }
+
+    tb_type_slot = panda_tb_data_slot_alloc();
+    if (tb_type_slot < 0) {
+        printf("callstack_instr: no TB data slot left\n");
+        return false;
+    }
 
     panda_enable_memcb();
     panda_enable_precise_pc();
@@ -17,10 +17,11 @@ int get_functions(target_ulong *functions, int n, CPUState *cpu);
 // right now to have a "utilities" library, this will have to do
 void get_prog_point(CPUState *cpu, prog_point *p);
 
-// create pandalog message for callstack info 
+// create pandalog message for callstack info.  it is allocated in the
+// pandalog arena, so it only lives until the entry it goes in is written.
 Panda__CallStack *pandalog_callstack_create(void);
 
-// free that data structure
+// free that data structure (a no-op; kept for existing callers)
 void pandalog_callstack_free(Panda__CallStack *cs);
 
 
@@ -0,0 +1,150 @@
+/* PANDABEGINCOMMENT
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+#ifndef __OPEN_HASH_MAP_H
+#define __OPEN_HASH_MAP_H
+
+// Open-addressing (linear probing) hash map for the small, trivially
+// copyable keys plugins look things up by on every basic block or memory
+// access: addresses, stackids and prog_points.  Much cheaper than std::map
+// for those, and than std::unordered_map, which allocates a node per entry.
+//
+// Only a subset of the std::map interface: operator[], find, count, erase,
+// size, clear and for_each.  As with std::unordered_map, inserting may move
+// every value, so don't hold a reference from operator[] across an insert
+// into the same map.
+
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// 64-bit finalizer from splitmix64: every input bit affects every output bit,
+// which linear probing needs since addresses share most of their high bits.
+static inline uint64_t panda_hash_mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static inline uint64_t panda_hash_combine(uint64_t h, uint64_t v) {
+    return panda_hash_mix(h ^ (v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2)));
+}
+
+template <typename K> struct panda_hash {
+    uint64_t operator()(const K &k) const { return panda_hash_mix((uint64_t)k); }
+};
+
+template <typename A, typename B> struct panda_hash<std::pair<A,B>> {
+    uint64_t operator()(const std::pair<A,B> &k) const {
+        return panda_hash_combine(panda_hash<A>()(k.first), panda_hash<B>()(k.second));
+    }
+};
+
+template <typename K, typename V, typename Hash = panda_hash<K>>
+class open_hash_map {
+    struct slot {
+        K key;
+        V value;
+        bool used;
+    };
+    std::vector<slot> slots;
+    size_t n = 0;
+
+    size_t mask() const { return slots.size() - 1; }
+
+    // index of key's slot, or of the empty slot where it would go
+    size_t probe(const K &key) const {
+        size_t i = Hash()(key) & mask();
+        while (slots[i].used && !(slots[i].key == key)) {
+            i = (i + 1) & mask();
+        }
+        return i;
+    }
+
+    void grow() {
+        std::vector<slot> old;
+        old.swap(slots);
+        slots.resize(old.empty() ? 16 : old.size() * 2);
+        for (slot &s : slots) s.used = false;
+        for (slot &s : old) {
+            if (!s.used) continue;
+            slot &d = slots[probe(s.key)];
+            d.key = s.key;
+            d.value = std::move(s.value);
+            d.used = true;
+        }
+    }
+
+public:
+    size_t size() const { return n; }
+    bool empty() const { return n == 0; }
+
+    void clear() {
+        slots.clear();
+        n = 0;
+    }
+
+    V *find(const K &key) {
+        if (n == 0) return nullptr;
+        slot &s = slots[probe(key)];
+        return s.used ? &s.value : nullptr;
+    }
+
+    size_t count(const K &key) const {
+        return n != 0 && slots[probe(key)].used;
+    }
+
+    V &operator[](const K &key) {
+        // keep the load factor at or below 1/2 so probe runs stay short
+        if ((n + 1) * 2 > slots.size()) grow();
+        slot &s = slots[probe(key)];
+        if (!s.used) {
+            s.key = key;
+            s.value = V();
+            s.used = true;
+            n++;
+        }
+        return s.value;
+    }
+
+    bool erase(const K &key) {
+        if (n == 0) return false;
+        size_t i = probe(key);
+        if (!slots[i].used) return false;
+        // backward-shift deletion: pull later entries of the probe run into
+        // the hole so no tombstones are needed
+        size_t j = i;
+        for (;;) {
+            j = (j + 1) & mask();
+            if (!slots[j].used) break;
+            size_t home = Hash()(slots[j].key) & mask();
+            // entry j can fill hole i unless its home lies cyclically in (i, j]
+            bool stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+            if (stays) continue;
+            slots[i].key = slots[j].key;
+            slots[i].value = std::move(slots[j].value);
+            i = j;
+        }
+        slots[i].used = false;
+        slots[i].value = V();
+        n--;
+        return true;
+    }
+
+    // fn(const K &key, V &value) for every entry, in no particular order
+    template <typename F>
+    void for_each(F fn) {
+        for (slot &s : slots) {
+            if (s.used) fn(s.key, s.value);
+        }
+    }
+};
+
+#endif
@@ -11,6 +11,9 @@
  * See the COPYING file in the top-level directory. 
  * 
 PANDAENDCOMMENT */
+#ifndef __PROG_POINT_H
+#define __PROG_POINT_H
+
 struct prog_point {
     target_ulong caller;
     target_ulong pc;
@@ -29,16 +32,23 @@ struct prog_point {
 
 #ifdef __GXX_EXPERIMENTAL_CXX0X__
 
-#include <functional>
+#include "open_hash_map.h"
+
 struct hash_prog_point{
     size_t operator()(const prog_point &p) const
     {
-        size_t h1 = std::hash<target_ulong>()(p.caller);
-        size_t h2 = std::hash<target_ulong>()(p.pc);
-        size_t h3 = std::hash<target_ulong>()(p.cr3);
-        return h1 ^ h2 ^ h3;
+        uint64_t h = panda_hash_mix(p.pc);
+        h = panda_hash_combine(h, p.caller);
+        return panda_hash_combine(h, p.cr3);
     }
 };
 
+template <> struct panda_hash<prog_point> : hash_prog_point {};
+
+// prog_point -> V, for tap-point state looked up on every memory access
+template <typename V>
+using prog_point_map = open_hash_map<prog_point, V, hash_prog_point>;
+
+#endif
 
 #endif
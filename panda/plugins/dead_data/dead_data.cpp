@@ -15,6 +15,7 @@ PANDAENDCOMMENT */
 // the PRIx64 macro
 #define __STDC_FORMAT_MACROS
 
+#include <algorithm>
 #include <cstdio>
 #include <map>
 #include <vector>
@@ -59,9 +60,22 @@ void uninit_plugin(void *);
 
 */
 
-// dde[l] is a vector of instructions at which
-// this label was observed to participate in a tainted branch
-std::map < uint32_t, float > dead_data;
+// dead_data[l] for the labels up to DD_MAX_FLAT_LABEL, which positional
+// labels of an input file are, in a flat array; the odd bigger label (a
+// uniform label chosen by a hypercall, say) goes in the map instead
+#define DD_MAX_FLAT_LABEL (1 << 24)
+std::vector < float > dead_data;
+std::map < uint32_t, float > dead_data_big;
+
+static inline float &dd_value(uint32_t l) {
+    if (l >= DD_MAX_FLAT_LABEL) {
+        return dead_data_big[l];
+    }
+    if (l >= dead_data.size()) {
+        dead_data.resize(std::max<size_t>(l + 1, 2 * dead_data.size()), 0);
+    }
+    return dead_data[l];
+}
 
 uint64_t first_tainted_branch = 0xffffffffffffffff;
 uint64_t last_tainted_branch = 0;
@@ -77,15 +91,9 @@ void dd_spit(){
         printf ("computing dead data and writing to stdout\n");
     }
 
+    // every applied label gets a value, 0 if it never reached a branch
     uint32_t *al = taint2_labels_applied();
     uint32_t n = taint2_num_labels_applied();
-    for (uint32_t i=0; i<n; i++) {
-        uint32_t l = al[i];
-        if (dead_data.count(l) == 0) {
-            dead_data[l] = 0;
-        }
-    }
-    free(al);
 
     /*
     for ( auto &kvp : dde ) {
@@ -103,19 +111,19 @@ void dd_spit(){
         ple.n_dead_data = n;
         ple.dead_data =  (float *) malloc(sizeof(float) * n);
         for (uint32_t i=0; i<n; i++) {
-            ple.dead_data[i] = dead_data[i];
+            ple.dead_data[i] = dd_value(al[i]);
         }
         pandalog_write_entry(&ple);
+        free(ple.dead_data);
     }
     else {
         printf ("\n\n-----------------------------------------\n");
         printf ("Dead Data Summary\n");
-        for ( auto &kvp : dead_data ) {
-            uint32_t el = kvp.first;
-            float val = kvp.second;
-            printf ("%6d %0.2f\n", el, val);
+        for (uint32_t i=0; i<n; i++) {
+            printf ("%6d %0.2f\n", al[i], dd_value(al[i]));
         }
     }
+    free(al);
 }
 
 
@@ -132,7 +140,7 @@ uint64_t total_instr;
 
 // el is a label
 int dd_each_label(uint32_t el, void *stuff1) {
-    dead_data[el] += ((float)(total_instr - current_instr)) / ((float)total_instr);
+    dd_value(el) += ((float)(total_instr - current_instr)) / ((float)total_instr);
     // continue iteration
     return 0;
 }
@@ -58,40 +58,50 @@ std::map< std::pair<uint32_t, uint32_t>, char *> asidfd_to_filename;
 
 std::map <target_ulong, OsiProc> running_procs;
 
-// label this virtual address.  might fail, so
-// returns true iff byte was labeled
-bool label_byte(CPUState *cpu, target_ulong virt_addr, uint32_t label_num) {
-    hwaddr pa = panda_virt_to_phys(cpu, virt_addr);
-    if (pa == (hwaddr) -1) {
-        printf ("label_byte: virtual addr " TARGET_FMT_lx " not available\n", virt_addr);
-        return false;
-    }
-    if (no_taint) {
-        // don't print a message -- you'd have too many in this case
-        return false;
-    }
-    if (positional_labels) {
-        taint2_label_ram(pa, label_num);
-    }
-    else {
-        taint2_label_ram(pa, 1);
-    }
-    if (pandalog) {
-        Panda__LogEntry ple = PANDA__LOG_ENTRY__INIT;
-        ple.has_taint_label_virtual_addr = 1;
-        ple.has_taint_label_physical_addr = 1;
-        ple.has_taint_label_number = 1;
-        ple.taint_label_virtual_addr = virt_addr;
-        ple.taint_label_physical_addr = pa;
+// label the len bytes from this virtual address, with label_num,
+// label_num + 1, ... if labels are positional and with 1 if not.  each
+// page is labeled in one go.  pages might not be mapped, so returns the
+// number of bytes actually labeled
+uint32_t label_range(CPUState *cpu, target_ulong virt_addr, uint32_t len, uint32_t label_num) {
+    uint32_t num_labeled = 0;
+    uint32_t done = 0;
+    while (done < len) {
+        target_ulong va = virt_addr + done;
+        uint32_t n = std::min<uint32_t>(len - done,
+                TARGET_PAGE_SIZE - (va & ~TARGET_PAGE_MASK));
+        uint32_t l = positional_labels ? label_num + done : 1;
+        done += n;
+        hwaddr pa = panda_virt_to_phys(cpu, va);
+        if (pa == (hwaddr) -1) {
+            printf ("label_range: virtual addrs " TARGET_FMT_lx ".." TARGET_FMT_lx
+                    " not available\n", va, va + n - 1);
+            continue;
+        }
+        if (no_taint) {
+            // don't print a message -- you'd have too many in this case
+            continue;
+        }
         if (positional_labels) {
-            ple.taint_label_number = label_num;
+            taint2_label_ram_seq(pa, n, l);
         }
         else {
-            ple.taint_label_number = 1;
+            taint2_label_ram_range(pa, n, l);
+        }
+        num_labeled += n;
+        if (pandalog) {
+            for (uint32_t i = 0; i < n; i++) {
+                Panda__LogEntry ple = PANDA__LOG_ENTRY__INIT;
+                ple.has_taint_label_virtual_addr = 1;
+                ple.has_taint_label_physical_addr = 1;
+                ple.has_taint_label_number = 1;
+                ple.taint_label_virtual_addr = va + i;
+                ple.taint_label_physical_addr = pa + i;
+                ple.taint_label_number = positional_labels ? l + i : l;
+                pandalog_write_entry(&ple);
+            }
         }
-        pandalog_write_entry(&ple);
     }
-    return true;
+    return num_labeled;
 }
 
 
@@ -238,15 +248,11 @@ void read_return(CPUState *cpu, target_ulong pc, uint32_t buf, uint32_t actual_c
             printf("*** applying %s taint labels %u..%u to buffer @ %lu\n",
                     positional_labels ? "positional" : "uniform",
                     range_start, range_end - 1, rr_get_guest_instr_count());
-            uint32_t num_labeled = 0;
-            uint32_t i = 0;
-            for (uint32_t l = range_start; l < range_end; l++) {
-                if (label_byte(cpu, last_read_buf + i,
-                               positional_labels ? l : 1))
-                    num_labeled ++;
-                i ++;
-            }
-            printf("%u bytes labeled for this read\n", range_end - range_start);
+            // range_start is a file offset; the read put read_start at buf
+            uint32_t num_labeled = label_range(cpu,
+                    last_read_buf + (range_start - read_start),
+                    range_end - range_start, range_start);
+            printf("%u bytes labeled for this read\n", num_labeled);
         }
         last_pos += actual_count;
         //        printf (" ... done applying labels\n");
@@ -441,6 +447,10 @@ bool init_plugin(void *self) {
     }
 
     if (panda_os_type == OST_WINDOWS) {
+        // every NtReadFile looks its handle up, so let wintrospection cache
+        // them (unless the command line says otherwise, its args come first)
+        const char *cache_arg = "wintrospection:handle_cache=true";
+        panda_add_arg(cache_arg, strlen(cache_arg));
         panda_require("wintrospection");
         assert(init_wintrospection_api());
 
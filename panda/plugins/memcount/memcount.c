@@ -0,0 +1,52 @@
+/* PANDABEGINCOMMENT
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+// Counts guest memory accesses through the per-access memory callbacks and
+// does nothing else, so a replay with it loaded costs what turning memory
+// callbacks on costs.  The replay benchmark (panda/scripts/replay_bench.py)
+// uses it as its memcb-only configuration.
+
+// This needs to be defined before anything is included in order to get
+// the PRIx64 macro
+#define __STDC_FORMAT_MACROS
+
+#include "panda/plugin.h"
+
+bool init_plugin(void *);
+void uninit_plugin(void *);
+
+static uint64_t reads, writes, bytes_read, bytes_written;
+
+static int mem_read(CPUState *env, target_ulong pc, target_ulong addr,
+                    target_ulong size, void *buf) {
+    reads++;
+    bytes_read += size;
+    return 0;
+}
+
+static int mem_write(CPUState *env, target_ulong pc, target_ulong addr,
+                     target_ulong size, void *buf) {
+    writes++;
+    bytes_written += size;
+    return 0;
+}
+
+bool init_plugin(void *self) {
+    panda_cb pcb;
+
+    panda_enable_memcb();
+    pcb.phys_mem_after_read = mem_read;
+    panda_register_callback(self, PANDA_CB_PHYS_MEM_AFTER_READ, pcb);
+    pcb.phys_mem_after_write = mem_write;
+    panda_register_callback(self, PANDA_CB_PHYS_MEM_AFTER_WRITE, pcb);
+    return true;
+}
+
+void uninit_plugin(void *self) {
+    printf("memcount: %" PRIu64 " reads (%" PRIu64 " bytes), %" PRIu64
+           " writes (%" PRIu64 " bytes)\n",
+           reads, bytes_read, writes, bytes_written);
+}
@@ -28,6 +28,7 @@ PANDAENDCOMMENT */
 #include "osi_types.h"
 #include "osi_int_fns.h"
 #include "os_intro.h"
+#include "osi_index.h"
 #ifdef OSI_PROC_EVENTS
 #include "osi_proc_events.h"
 #endif
@@ -65,40 +66,60 @@ PPP_CB_BOILERPLATE(on_finished_process)
 // The copious use of pointers to pointers in this file is due to
 // the fact that PPP doesn't support return values (since it assumes
 // that you will be running multiple callbacks at one site)
+//
+// With a process index loaded (osi:index=...), the current process and its
+// libraries come from the index and there is no provider to ask for the
+// rest; whatever is returned then is freed with the generic inlines.
 
 OsiProcs *get_processes(CPUState *cpu) {
     OsiProcs *p = NULL;
+    if (osi_index_loaded()) return NULL;
     PPP_RUN_CB(on_get_processes, cpu, &p);
     return p;
 }
 
 OsiProc *get_current_process(CPUState *cpu) {
     OsiProc *p = NULL;
+    if (osi_index_loaded()) return osi_index_current_process();
     PPP_RUN_CB(on_get_current_process, cpu, &p);
     return p;
 }
 
 OsiModules *get_modules(CPUState *cpu) {
     OsiModules *m = NULL;
+    if (osi_index_loaded()) return NULL;
     PPP_RUN_CB(on_get_modules, cpu, &m);
     return m;
 }
 
 OsiModules *get_libraries(CPUState *cpu, OsiProc *p) {
     OsiModules *m = NULL;
+    if (osi_index_loaded()) return osi_index_libraries(p);
     PPP_RUN_CB(on_get_libraries, cpu, p, &m);
     return m;
 }
 
 void free_osiproc(OsiProc *p) {
+    if (osi_index_loaded()) {
+        free_osiproc_g(p);
+        return;
+    }
     PPP_RUN_CB(on_free_osiproc, p);
 }
 
 void free_osiprocs(OsiProcs *ps) {
+    if (osi_index_loaded()) {
+        free_osiprocs_g(ps);
+        return;
+    }
     PPP_RUN_CB(on_free_osiprocs, ps);
 }
 
 void free_osimodules(OsiModules *ms) {
+    if (osi_index_loaded()) {
+        free_osimodules_g(ms);
+        return;
+    }
     PPP_RUN_CB(on_free_osimodules, ms);
 }
 
@@ -139,6 +160,22 @@ int vmi_pgd_changed(CPUState *cpu, target_ulong oldval, target_ulong newval) {
 extern char **gargv;
 
 bool init_plugin(void *self) {
+    panda_arg_list *args = panda_get_args("osi");
+    const char *index_path = panda_parse_string(args, "index", NULL);
+    const char *write_index_path = panda_parse_string(args, "write_index", NULL);
+
+    // answer from a process index instead of introspecting the guest
+    if (index_path != NULL) {
+        bool ok = osi_index_load(index_path);
+        panda_free_args(args);
+        return ok;
+    }
+    if (write_index_path != NULL && !osi_index_start_writing(self, write_index_path)) {
+        panda_free_args(args);
+        return false;
+    }
+    panda_free_args(args);
+
 #ifdef OSI_PROC_EVENTS
     panda_cb pcb = { .after_PGD_write = vmi_pgd_changed };
     panda_register_callback(self, PANDA_CB_VMI_PGD_CHANGED, pcb);
@@ -211,4 +248,6 @@ bool init_plugin(void *self) {
     return true;
 }
 
-void uninit_plugin(void *self) { }
+void uninit_plugin(void *self) {
+    osi_index_close();
+}
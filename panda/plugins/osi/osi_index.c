@@ -0,0 +1,319 @@
+/* PANDABEGINCOMMENT
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+// This needs to be defined before anything is included in order to get
+// the PRIx64 macro
+#define __STDC_FORMAT_MACROS
+
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+
+#include "panda/plugin.h"
+#include "panda/rr/rr_log.h"
+
+#include "osi_types.h"
+#include "osi_int_fns.h"
+#include "osi_index.h"
+
+// File format (native byte order): the magic and version, then one record
+// per change of the running process, in instruction order.  Each record is
+// an OsiIndexRecord, the process name, and num_libs library records, each
+// an OsiIndexLibRecord followed by the library name and file.
+#define OSI_INDEX_MAGIC "PANDAOSI"
+#define OSI_INDEX_VERSION 1
+
+typedef struct {
+    uint64_t instr; // first instruction the record applies to
+    uint64_t asid;
+    uint64_t pid;
+    uint64_t ppid;
+    uint64_t offset;
+    uint32_t name_len;
+    uint32_t num_libs;
+} OsiIndexRecord;
+
+typedef struct {
+    uint64_t base;
+    uint64_t size;
+    uint64_t offset;
+    uint32_t name_len;
+    uint32_t file_len;
+} OsiIndexLibRecord;
+
+typedef struct {
+    uint64_t instr;
+    OsiProc proc;
+    OsiModules libs;
+} OsiIndexEntry;
+
+// writing
+static FILE *index_out = NULL;
+static bool index_sample_pending = true;
+static bool index_have_last = false;
+static OsiIndexRecord index_last;
+static char *index_last_name = NULL;
+
+// reading
+static GArray *index_entries = NULL;
+
+/*
+ * Writing
+ */
+
+static void write_string(const char *s, uint32_t len) {
+    if (len > 0 && fwrite(s, 1, len, index_out) != len) {
+        fprintf(stderr, "osi: cannot write the process index.\n");
+    }
+}
+
+// Append a record if the running process isn't the one of the last record.
+static void index_sample(CPUState *cpu) {
+    OsiProc *p = get_current_process(cpu);
+    OsiModules *ms;
+    OsiIndexRecord rec = {0};
+    const char *name;
+    uint32_t i;
+
+    if (p == NULL) {
+        return;
+    }
+    name = p->name ? p->name : "";
+    if (index_have_last && index_last.pid == p->pid &&
+            index_last.asid == p->asid && !strcmp(index_last_name, name)) {
+        free_osiproc(p);
+        return;
+    }
+
+    rec.instr = rr_get_guest_instr_count();
+    rec.asid = p->asid;
+    rec.pid = p->pid;
+    rec.ppid = p->ppid;
+    rec.offset = p->offset;
+    rec.name_len = strlen(name);
+    ms = get_libraries(cpu, p);
+    rec.num_libs = ms ? ms->num : 0;
+
+    if (fwrite(&rec, sizeof(rec), 1, index_out) != 1) {
+        fprintf(stderr, "osi: cannot write the process index.\n");
+    }
+    write_string(name, rec.name_len);
+    for (i = 0; i < rec.num_libs; i++) {
+        OsiModule *m = &ms->module[i];
+        OsiIndexLibRecord lib = {0};
+        lib.base = m->base;
+        lib.size = m->size;
+        lib.offset = m->offset;
+        lib.name_len = m->name ? strlen(m->name) : 0;
+        lib.file_len = m->file ? strlen(m->file) : 0;
+        if (fwrite(&lib, sizeof(lib), 1, index_out) != 1) {
+            fprintf(stderr, "osi: cannot write the process index.\n");
+        }
+        write_string(m->name, lib.name_len);
+        write_string(m->file, lib.file_len);
+    }
+
+    index_last = rec;
+    index_have_last = true;
+    g_free(index_last_name);
+    index_last_name = g_strdup(name);
+    if (ms) {
+        free_osimodules(ms);
+    }
+    free_osiproc(p);
+}
+
+// The guest updates its notion of the current process around the asid
+// switch, so look again once the new process runs in user mode.
+static int index_asid_changed(CPUState *cpu, target_ulong oldval,
+                              target_ulong newval) {
+    index_sample(cpu);
+    index_sample_pending = true;
+    return 0;
+}
+
+static int index_before_block_exec(CPUState *cpu, TranslationBlock *tb) {
+    if (index_sample_pending && !panda_in_kernel(cpu)) {
+        index_sample(cpu);
+        index_sample_pending = false;
+    }
+    return 0;
+}
+
+bool osi_index_start_writing(void *self, const char *path) {
+    panda_cb pcb;
+
+    index_out = fopen(path, "wb");
+    if (index_out == NULL) {
+        fprintf(stderr, "osi: cannot create process index %s.\n", path);
+        return false;
+    }
+    uint32_t version = OSI_INDEX_VERSION;
+    fwrite(OSI_INDEX_MAGIC, 1, strlen(OSI_INDEX_MAGIC), index_out);
+    fwrite(&version, sizeof(version), 1, index_out);
+
+    pcb.asid_changed = index_asid_changed;
+    panda_register_callback(self, PANDA_CB_ASID_CHANGED, pcb);
+    pcb.before_block_exec = index_before_block_exec;
+    panda_register_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC, pcb);
+    printf("osi: writing process index to %s.\n", path);
+    return true;
+}
+
+/*
+ * Reading
+ */
+
+static char *read_string(FILE *f, uint32_t len, bool *ok) {
+    char *s = g_malloc(len + 1);
+    if (len > 0 && fread(s, 1, len, f) != len) {
+        *ok = false;
+    }
+    s[len] = '\0';
+    return s;
+}
+
+static void free_entry(OsiIndexEntry *e) {
+    uint32_t i;
+    g_free(e->proc.name);
+    for (i = 0; i < e->libs.num; i++) {
+        g_free(e->libs.module[i].name);
+        g_free(e->libs.module[i].file);
+    }
+    g_free(e->libs.module);
+}
+
+bool osi_index_load(const char *path) {
+    char magic[sizeof(OSI_INDEX_MAGIC) - 1];
+    uint32_t version;
+    OsiIndexRecord rec;
+    bool ok = true;
+    FILE *f = fopen(path, "rb");
+
+    if (f == NULL) {
+        fprintf(stderr, "osi: cannot open process index %s.\n", path);
+        return false;
+    }
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+            memcmp(magic, OSI_INDEX_MAGIC, sizeof(magic)) ||
+            fread(&version, sizeof(version), 1, f) != 1 ||
+            version != OSI_INDEX_VERSION) {
+        fprintf(stderr, "osi: %s is not a process index.\n", path);
+        fclose(f);
+        return false;
+    }
+
+    index_entries = g_array_new(FALSE, TRUE, sizeof(OsiIndexEntry));
+    while (ok && fread(&rec, sizeof(rec), 1, f) == 1) {
+        OsiIndexEntry e = {0};
+        uint32_t i;
+
+        e.instr = rec.instr;
+        e.proc.asid = rec.asid;
+        e.proc.pid = rec.pid;
+        e.proc.ppid = rec.ppid;
+        e.proc.offset = rec.offset;
+        e.proc.name = read_string(f, rec.name_len, &ok);
+        e.libs.module = g_new0(OsiModule, rec.num_libs);
+        for (i = 0; ok && i < rec.num_libs; i++) {
+            OsiIndexLibRecord lib;
+            OsiModule *m = &e.libs.module[i];
+            if (fread(&lib, sizeof(lib), 1, f) != 1) {
+                ok = false;
+                break;
+            }
+            m->base = lib.base;
+            m->size = lib.size;
+            m->offset = lib.offset;
+            m->name = read_string(f, lib.name_len, &ok);
+            m->file = read_string(f, lib.file_len, &ok);
+            e.libs.num++;
+        }
+        if (!ok) {
+            free_entry(&e);
+            break;
+        }
+        g_array_append_val(index_entries, e);
+    }
+    fclose(f);
+    if (!ok) {
+        fprintf(stderr, "osi: process index %s is truncated.\n", path);
+    }
+    printf("osi: %u process changes in %s.\n", index_entries->len, path);
+    return true;
+}
+
+bool osi_index_loaded(void) {
+    return index_entries != NULL;
+}
+
+// the last entry at or before instr, or -1
+static int index_find(uint64_t instr) {
+    int lo = 0, hi = index_entries->len;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (g_array_index(index_entries, OsiIndexEntry, mid).instr <= instr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo - 1;
+}
+
+OsiProc *osi_index_current_process(void) {
+    int i = index_find(rr_get_guest_instr_count());
+    if (i < 0) {
+        return NULL;
+    }
+    return copy_osiproc_g(&g_array_index(index_entries, OsiIndexEntry, i).proc,
+                          NULL);
+}
+
+// Libraries of p as of its most recent record, which is the current one
+// unless p is some other process.
+OsiModules *osi_index_libraries(OsiProc *p) {
+    int i = index_find(rr_get_guest_instr_count());
+    OsiModules *ms;
+    OsiIndexEntry *e = NULL;
+    uint32_t j;
+
+    for (; i >= 0; i--) {
+        e = &g_array_index(index_entries, OsiIndexEntry, i);
+        if (p == NULL || (e->proc.pid == p->pid && e->proc.asid == p->asid)) {
+            break;
+        }
+    }
+    if (i < 0) {
+        return NULL;
+    }
+    ms = g_new0(OsiModules, 1);
+    ms->num = e->libs.num;
+    ms->module = g_new0(OsiModule, ms->num);
+    for (j = 0; j < ms->num; j++) {
+        copy_osimod_g(&e->libs.module[j], &ms->module[j]);
+    }
+    return ms;
+}
+
+void osi_index_close(void) {
+    guint i;
+
+    if (index_out) {
+        fclose(index_out);
+        index_out = NULL;
+    }
+    g_free(index_last_name);
+    index_last_name = NULL;
+    if (index_entries) {
+        for (i = 0; i < index_entries->len; i++) {
+            free_entry(&g_array_index(index_entries, OsiIndexEntry, i));
+        }
+        g_array_free(index_entries, TRUE);
+        index_entries = NULL;
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef OSI_INDEX_H
+#define OSI_INDEX_H
+
+// Process timeline index: a side-car file that maps instruction counts of
+// a replay to the process that was running, with its libraries.  One replay
+// writes it with the usual introspection provider; later replays of the
+// same recording can then answer get_current_process() and get_libraries()
+// from it without looking at guest memory.
+
+// Write the index to path while replaying.  Registers its own callbacks.
+bool osi_index_start_writing(void *self, const char *path);
+// Load an index written earlier.  Returns false if it can't be read.
+bool osi_index_load(const char *path);
+// true once an index has been loaded, i.e. OSI answers from it
+bool osi_index_loaded(void);
+void osi_index_close(void);
+
+// Answers from a loaded index, as of the current instruction count.  They
+// are allocated with glib and freed with the generic free_*_g inlines.
+OsiProc *osi_index_current_process(void);
+OsiModules *osi_index_libraries(OsiProc *p);
+
+#endif
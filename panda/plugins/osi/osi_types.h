@@ -60,6 +60,19 @@ static inline void free_osiprocs_g(OsiProcs *ps) {
 	return;
 }
 
+/*! @brief Frees an OsiModules struct. */
+static inline void free_osimodules_g(OsiModules *ms) {
+	uint32_t i;
+	if (ms == NULL) return;
+	for (i=0; i< ms->num; i++) {
+		g_free(ms->module[i].file);
+		g_free(ms->module[i].name);
+	}
+	g_free(ms->module);
+	g_free(ms);
+	return;
+}
+
 static inline void free_osimodule_g(OsiModule *m) {
     g_free(m->file);
     g_free(m->name);
@@ -10,6 +10,8 @@
 #define __STDC_FORMAT_MACROS
 
 #include <map>
+#include <string>
+#include <unordered_map>
 
 #include "panda/plugin.h"
 #include "panda/plugin_plugin.h"
@@ -91,7 +93,7 @@ static PTR get_file_struct_ptr(CPUState *env, PTR task_struct, int fd) {
 	// fds is a flat array with struct file pointers.
 	// Calculate the address of the nth pointer and read it.
 	fd_file_ptr = fds + fd*sizeof(PTR);
-	if (-1 == panda_virtual_memory_rw(env, fd_file_ptr, (uint8_t *)&fd_file, sizeof(PTR), 0)) {
+	if (-1 == panda_virtual_memory_read_cached(env, fd_file_ptr, (uint8_t *)&fd_file, sizeof(PTR))) {
 		return (PTR)NULL;
 	}
 	if (fd_file == (PTR)NULL) {
@@ -186,6 +188,166 @@ static void fill_osimodule(CPUState *env, OsiModule *m, PTR vma_addr) {
 
 
 
+/* ******************************************************************
+ Introspection cache
+****************************************************************** */
+
+/*
+ * Walking the task list and the VMA chains takes many small guest reads,
+ * each with its own page walk, and most of what they read is the same from
+ * one call to the next.  So results are cached, and only a few cheap fields
+ * are re-read to check them:
+ *  - the current process, per (asid, thread_info), is reused until the
+ *	  next asid change, and after that while thread_info->task is the same;
+ *  - a task met in a process list walk keeps its name, pid and ppid while
+ *	  its pgd is the same;
+ *  - a file-backed VMA met in a module walk keeps its name and file while
+ *	  its start, end and vm_file are the same.
+ * The lists themselves are still walked on every call, so tasks and VMAs
+ * that come and go are always seen.
+ */
+static bool use_cache = true;
+static uint64_t asid_epoch = 0;			// bumped on each asid change
+static target_ulong last_asid = 0;
+
+struct CachedTask {
+	std::string name;	// all ki.task.comm_size bytes of comm
+	target_ulong pid, ppid, asid;
+};
+
+struct CurrentProc {
+	PTR task;
+	uint64_t epoch;
+	CachedTask t;
+};
+
+struct CachedVma {
+	target_ulong start, end;
+	PTR vm_file;
+	std::string file;
+	bool has_name;
+	std::string name;
+};
+
+typedef std::unordered_map<PTR, CachedTask> TaskCache;
+
+static std::map<std::pair<target_ulong, PTR>, CurrentProc> current_cache;
+static TaskCache task_cache;
+static std::unordered_map<PTR, CachedVma> vma_cache;
+
+// Bounds on the caches that aren't rebuilt by every walk.  Keys include the
+// stack page, so a long replay keeps making new ones.
+#define MAX_CURRENT_CACHE 4096
+#define MAX_VMA_CACHE 65536
+
+static uint64_t cache_hits, cache_misses;
+
+/**
+ * @brief Notes an asid change.  Called from the asid_changed callback
+ * where the target has it, and on every lookup otherwise.
+ */
+static void cache_note_asid(CPUState *env) {
+	target_ulong asid = panda_current_asid(env);
+	if (asid != last_asid) {
+		last_asid = asid;
+		asid_epoch++;
+	}
+}
+
+static int asid_changed(CPUState *env, target_ulong oldval, target_ulong newval) {
+	asid_epoch++;
+	return 0;
+}
+
+static void cached_task_save(CachedTask &c, const OsiProc *p) {
+	c.name.assign(p->name, ki.task.comm_size);
+	c.pid = p->pid;
+	c.ppid = p->ppid;
+	c.asid = p->asid;
+}
+
+static void cached_task_fill(const CachedTask &c, OsiProc *p, PTR task_addr) {
+	p->offset = task_addr;
+	p->name = (char *)g_malloc(ki.task.comm_size);
+	memcpy(p->name, c.name.data(), ki.task.comm_size);
+	p->pid = c.pid;
+	p->ppid = c.ppid;
+	p->pages = NULL;
+	p->asid = c.asid;
+}
+
+/**
+ * @brief fill_osiproc(), reusing what the last walk read if the task's
+ * pgd hasn't changed.  The task is added to seen.
+ */
+static void fill_osiproc_cached(CPUState *env, OsiProc *p, PTR task_addr, TaskCache &seen) {
+	if (!use_cache) {
+		fill_osiproc(env, p, task_addr);
+		return;
+	}
+	target_ulong asid = get_pgd(env, task_addr);
+	auto it = task_cache.find(task_addr);
+	if (it != task_cache.end() && it->second.asid == asid) {
+		cache_hits++;
+		cached_task_fill(it->second, p, task_addr);
+		seen[task_addr] = it->second;
+		return;
+	}
+	cache_misses++;
+	fill_osiproc(env, p, task_addr);
+	cached_task_save(seen[task_addr], p);
+}
+
+/**
+ * @brief fill_osimodule(), reusing the names read for a file-backed VMA
+ * if it still covers the same range of the same file.
+ */
+static void fill_osimodule_cached(CPUState *env, OsiModule *m, PTR vma_addr) {
+	if (!use_cache) {
+		fill_osimodule(env, m, vma_addr);
+		return;
+	}
+	target_ulong vma_start, vma_end;
+	PTR vma_vm_file;
+	PandaMemRead reads[] = {
+		{ vma_addr + ki.vma.vm_start_offset, &vma_start, sizeof(vma_start) },
+		{ vma_addr + ki.vma.vm_end_offset, &vma_end, sizeof(vma_end) },
+		{ vma_addr + ki.vma.vm_file_offset, &vma_vm_file, sizeof(vma_vm_file) },
+	};
+	panda_memory_errors += panda_virtual_memory_gather(env, reads, 3);
+
+	auto it = vma_cache.find(vma_addr);
+	if (vma_vm_file != (PTR)NULL && it != vma_cache.end() &&
+			it->second.start == vma_start && it->second.end == vma_end &&
+			it->second.vm_file == vma_vm_file) {
+		cache_hits++;
+		m->offset = vma_addr;
+		m->base = vma_start;
+		m->size = vma_end - vma_start;
+		m->file = g_strdup(it->second.file.c_str());
+		m->name = it->second.has_name ? g_strdup(it->second.name.c_str()) : NULL;
+		return;
+	}
+	cache_misses++;
+	fill_osimodule(env, m, vma_addr);
+	// anonymous areas are named from the mm's brk and stack, which move
+	// without the VMA changing, so they're never cached
+	if (vma_vm_file == (PTR)NULL || m->file == NULL) {
+		if (it != vma_cache.end()) vma_cache.erase(it);
+		return;
+	}
+	if (vma_cache.size() >= MAX_VMA_CACHE) vma_cache.clear();
+	CachedVma &c = vma_cache[vma_addr];
+	c.start = vma_start;
+	c.end = vma_end;
+	c.vm_file = vma_vm_file;
+	c.file = m->file;
+	c.has_name = m->name != NULL;
+	c.name = m->name ? m->name : "";
+}
+
+
+
 /* ******************************************************************
  PPP Callbacks
 ****************************************************************** */
@@ -197,14 +359,41 @@ void on_get_current_process(CPUState *env, OsiProc **out_p) {
 	OsiProc *p = NULL;
 	PTR ts;
 
-	//	target_long asid = panda_current_asid(env);
-	ts = get_task_struct(env, (_ESP & THREADINFO_MASK));
+	PTR thread_info = _ESP & THREADINFO_MASK;
+	std::pair<target_ulong, PTR> key;
+
+	if (use_cache) {
+		cache_note_asid(env);
+		key = std::make_pair(panda_current_asid(env), thread_info);
+		auto it = current_cache.find(key);
+		if (it != current_cache.end()) {
+			CurrentProc &c = it->second;
+			if (c.epoch == asid_epoch || get_task_struct(env, thread_info) == c.task) {
+				cache_hits++;
+				c.epoch = asid_epoch;
+				p = (OsiProc *)g_malloc0(sizeof(OsiProc));
+				cached_task_fill(c.t, p, c.task);
+				*out_p = p;
+				return;
+			}
+		}
+		cache_misses++;
+	}
+
+	ts = get_task_struct(env, thread_info);
 	if (ts) {
 		// valid task struct
 		// got a reasonable looking process.
 		// return it and save in cache
 		p = (OsiProc *)g_malloc0(sizeof(OsiProc));
 		fill_osiproc(env, p, ts);
+		if (use_cache) {
+			if (current_cache.size() >= MAX_CURRENT_CACHE) current_cache.clear();
+			CurrentProc &c = current_cache[key];
+			c.task = ts;
+			c.epoch = asid_epoch;
+			cached_task_save(c.t, p);
+		}
 	}
 	*out_p = p;
 }
@@ -217,6 +406,7 @@ void on_get_processes(CPUState *env, OsiProcs **out_ps) {
 	OsiProcs *ps;
 	OsiProc *p;
 	uint32_t ps_capacity = 16;
+	TaskCache seen;
 #ifdef OSI_LINUX_LIST_THREADS
 	PTR tg_first, tg_next;
 #endif
@@ -244,7 +434,7 @@ void on_get_processes(CPUState *env, OsiProcs **out_ps) {
 		}
 		p = &ps->proc[ps->num++];
 		memset(p, 0, sizeof(OsiProc));	// fill_osiproc() expects p to be zeroed-out.
-		fill_osiproc(env, p, ts_current);
+		fill_osiproc_cached(env, p, ts_current, seen);
 
 #ifdef OSI_LINUX_LIST_THREADS
 		// Traverse thread group list.
@@ -258,7 +448,7 @@ void on_get_processes(CPUState *env, OsiProcs **out_ps) {
 			}
 			p = &ps->proc[ps->num++];
 			memset(p, 0, sizeof(OsiProc)); // fill_osiproc() expects p to be zeroed-out.
-			fill_osiproc(env, p, ts_current);
+			fill_osiproc_cached(env, p, ts_current, seen);
 		}
 		ts_current = tg_first-ki.task.thread_group_offset;
 #endif
@@ -281,6 +471,8 @@ void on_get_processes(CPUState *env, OsiProcs **out_ps) {
 	// memory read error
 	if (ts_current == (PTR)NULL) goto error1;
 
+	// tasks that have gone are dropped from the cache
+	if (use_cache) task_cache.swap(seen);
 	*out_ps = ps;
 	return;
 
@@ -359,7 +551,7 @@ pid_found:
 
 		m = &ms->module[ms->num++];
 		memset(m, 0, sizeof(OsiModule));
-		fill_osimodule(env, m, vma_current);
+		fill_osimodule_cached(env, m, vma_current);
 
 		vma_current = get_vma_next(env, vma_current);
 	} while(vma_current != (PTR)NULL && vma_current != vma_first);
@@ -514,6 +706,7 @@ bool init_plugin(void *self) {
 	panda_arg_list *plugin_args = panda_get_args(PLUGIN_NAME);
 	char *kconf_file = g_strdup(panda_parse_string(plugin_args, "kconf_file", DEFAULT_KERNELINFO_FILE));
 	char *kconf_group = g_strdup(panda_parse_string(plugin_args, "kconf_group", DEFAULT_KERNELINFO_GROUP));
+	use_cache = !panda_parse_bool(plugin_args, "no_cache");
 	panda_free_args(plugin_args);
 
 	// Load kernel offsets.
@@ -525,6 +718,15 @@ bool init_plugin(void *self) {
 	g_free(kconf_file);
 	g_free(kconf_group);
 
+	if (use_cache) {
+		panda_cb pcb;
+		pcb.asid_changed = asid_changed;
+		panda_register_callback(self, PANDA_CB_ASID_CHANGED, pcb);
+	}
+	else {
+		LOG_INFO("Not caching introspection results.");
+	}
+
 	PPP_REG_CB("osi", on_get_current_process, on_get_current_process);
 	PPP_REG_CB("osi", on_get_processes, on_get_processes);
 	PPP_REG_CB("osi", on_free_osiproc, on_free_osiproc);
@@ -546,7 +748,9 @@ error:
  */
 void uninit_plugin(void *self) {
 #if defined(TARGET_I386) || defined(TARGET_ARM)
-	// Nothing to do...
+	if (use_cache) {
+		LOG_INFO("introspection cache: %" PRIu64 " hits, %" PRIu64 " misses", cache_hits, cache_misses);
+	}
 #endif
 	return;
 }
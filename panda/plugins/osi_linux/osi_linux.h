@@ -89,7 +89,7 @@ extern int panda_memory_errors;
 #define IMPLEMENT_OFFSET_GET(_name, _paramName, _retType, _offset, _errorRetValue) \
 static inline _retType _name(CPUState* env, PTR _paramName) { \
 	_retType _t; \
-	if (-1 == panda_virtual_memory_rw(env, _paramName + _offset, (uint8_t *)&_t, sizeof(_retType), 0)) { \
+	if (-1 == panda_virtual_memory_read_cached(env, _paramName + _offset, (uint8_t *)&_t, sizeof(_retType))) { \
 		panda_memory_errors++; \
 		return (_errorRetValue); \
 	} \
@@ -104,11 +104,11 @@ static inline _retType _name(CPUState* env, PTR _paramName) { \
 static inline _retType2 _name(CPUState* env, PTR _paramName) { \
 	_retType1 _t1; \
 	_retType2 _t2; \
-	if (-1 == panda_virtual_memory_rw(env, _paramName + _offset1, (uint8_t *)&_t1, sizeof(_retType1), 0)) { \
+	if (-1 == panda_virtual_memory_read_cached(env, _paramName + _offset1, (uint8_t *)&_t1, sizeof(_retType1))) { \
 		panda_memory_errors++; \
 		return (_errorRetValue); \
 	} \
-	if (-1 == panda_virtual_memory_rw(env, _t1 + _offset2, (uint8_t *)&_t2, sizeof(_retType2), 0)) { \
+	if (-1 == panda_virtual_memory_read_cached(env, _t1 + _offset2, (uint8_t *)&_t2, sizeof(_retType2))) { \
 		panda_memory_errors++; \
 		return (_errorRetValue); \
 	} \
@@ -314,7 +314,7 @@ static inline PTR get_fd_file(CPUState *env, PTR fd_file_array, int n) {
 	fd_file_ptr = fd_file_array+n*sizeof(PTR);
 
 	// Read address of the file struct.
-	if (-1 == panda_virtual_memory_rw(env, fd_file_ptr, (uint8_t *)&fd_file, sizeof(PTR), 0)) {
+	if (-1 == panda_virtual_memory_read_cached(env, fd_file_ptr, (uint8_t *)&fd_file, sizeof(PTR))) {
 		panda_memory_errors++;
 		return (PTR)NULL;
 	}
@@ -357,7 +357,7 @@ static inline char *read_dentry_name(CPUState *env, PTR dentry) {
 		current_dentry = dentry;
 
 		// read d_name qstr
-		err = panda_virtual_memory_rw(env, current_dentry + ki.fs.d_name_offset, d_name, _SIZEOF_QSTR, 0);
+		err = panda_virtual_memory_read_cached(env, current_dentry + ki.fs.d_name_offset, d_name, _SIZEOF_QSTR);
 		if (-1 == err) goto error;
 
 		// read component
@@ -366,7 +366,7 @@ static inline char *read_dentry_name(CPUState *env, PTR dentry) {
 			pcomp_capacity = pcomp_length;
 			pcomp = (char *)g_realloc(pcomp, pcomp_capacity * sizeof(char));
 		}
-		err = panda_virtual_memory_rw(env, *(PTR *)(d_name + 2*sizeof(target_uint)), (uint8_t *)pcomp, pcomp_length*sizeof(char), 0);
+		err = panda_virtual_memory_read_cached(env, *(PTR *)(d_name + 2*sizeof(target_uint)), (uint8_t *)pcomp, pcomp_length*sizeof(char));
 		if (-1 == err) goto error;
 
 		// copy component
@@ -377,7 +377,7 @@ static inline char *read_dentry_name(CPUState *env, PTR dentry) {
 		pcomps[pcomps_idx++] = g_strdup(pcomp);
 
 		// read the parent dentry
-		err = panda_virtual_memory_rw(env, current_dentry + ki.fs.d_parent_offset, (uint8_t *)&dentry, sizeof(PTR), 0);
+		err = panda_virtual_memory_read_cached(env, current_dentry + ki.fs.d_parent_offset, (uint8_t *)&dentry, sizeof(PTR));
 		if (-1 == err) goto error;
 	} while (dentry != current_dentry);
 
@@ -478,7 +478,7 @@ static inline char *read_vfsmount_name(CPUState *env, PTR vfsmount) {
 static inline char *get_name(CPUState *env, PTR task_struct, char *name) {
 	if (name == NULL) { name = (char *)g_malloc0(ki.task.comm_size * sizeof(char)); }
 	else { name = (char *)g_realloc(name, ki.task.comm_size * sizeof(char)); }
-	if (-1 == panda_virtual_memory_rw(env, task_struct + ki.task.comm_offset, (uint8_t *)name, ki.task.comm_size * sizeof(char), 0)) {
+	if (-1 == panda_virtual_memory_read_cached(env, task_struct + ki.task.comm_offset, (uint8_t *)name, ki.task.comm_size * sizeof(char))) {
 		panda_memory_errors++;
 		strncpy(name, "N/A", ki.task.comm_size*sizeof(char));
 	}
@@ -148,11 +148,24 @@ struct VarInfo {
     std::string var_name;
     Dwarf_Locdesc** locations;
     Dwarf_Signed num_locations;
+    // union of the pc ranges of all locations, so that variables that are
+    // not live can be skipped without looking at each of them
+    Dwarf_Addr lowpc, highpc;
 
     VarInfo(void *var_type, std::string var_name,
             Dwarf_Locdesc** locations, Dwarf_Signed num_locations) :
         var_type(var_type), var_name(var_name),
-        locations(locations), num_locations(num_locations) {}
+        locations(locations), num_locations(num_locations),
+        lowpc(~(Dwarf_Addr)0), highpc(0) {
+        for (Dwarf_Signed i = 0; i < num_locations; i++){
+            lowpc = std::min(lowpc, locations[i]->ld_lopc);
+            highpc = std::max(highpc, locations[i]->ld_hipc);
+        }
+    }
+
+    bool maybe_live(target_ulong pc) const {
+        return pc >= lowpc && pc <= highpc;
+    }
 };
 
 std::map<Dwarf_Addr,std::vector<VarInfo>> funcvars;
@@ -183,7 +196,12 @@ std::map<Dwarf_Addr,std::pair<Dwarf_Locdesc**, Dwarf_Signed>> funct_to_framepoin
 bool sortRange(const LineRange &x1,
                const LineRange &x2){
     return x1.lowpc < x2.lowpc ||
-           x1.highpc < x2.highpc;
+           (x1.lowpc == x2.lowpc && x1.highpc < x2.highpc);
+}
+
+bool sortRangeLowpc(const LineRange &x1,
+                    const LineRange &x2){
+    return x1.lowpc < x2.lowpc;
 }
 
 struct CompareRangeAndPC
@@ -542,6 +560,73 @@ Dwarf_Unsigned get_struct_member_offset(Dwarf_Die the_die) {
 
 }
 
+// Every query of a variable walks its type again, so keep the DIEs and
+// struct layouts that libdwarf returned instead of asking (and allocating)
+// again.  They stay valid as long as their Dwarf_Debug, which is never
+// closed.
+std::map<std::pair<Dwarf_Debug, Dwarf_Off>, Dwarf_Die> type_die_cache;
+
+struct StructMember {
+    std::string name;
+    Dwarf_Unsigned offset;
+    Dwarf_Die die;
+};
+std::map<std::pair<Dwarf_Debug, Dwarf_Off>, std::vector<StructMember>> struct_members_cache;
+
+Dwarf_Die offdie_cached(Dwarf_Debug dbg, Dwarf_Off offset){
+    Dwarf_Error err;
+    Dwarf_Die die = NULL;
+    auto key = std::make_pair(dbg, offset);
+    auto it = type_die_cache.find(key);
+
+    if (it != type_die_cache.end())
+        return it->second;
+    dwarf_offdie_b(dbg, offset, 1, &die, &err);
+    type_die_cache[key] = die;
+    return die;
+}
+
+const std::vector<StructMember> &struct_members_cached(Dwarf_Debug dbg, Dwarf_Die struct_die){
+    Dwarf_Error err;
+    Dwarf_Off die_offset;
+    Dwarf_Die struct_child;
+    int rc;
+
+    dwarf_dieoffset(struct_die, &die_offset, &err);
+    auto key = std::make_pair(dbg, die_offset);
+    auto it = struct_members_cache.find(key);
+    if (it != struct_members_cache.end())
+        return it->second;
+
+    std::vector<StructMember> &members = struct_members_cache[key];
+    if (dwarf_child(struct_die, &struct_child, &err) != DW_DLV_OK)
+    {
+        //printf("  Couldn't parse struct for var: %s\n",cur_astnodename.c_str() );
+        return members;
+    }
+    while (1) // enumerate struct arguments
+    {
+        char *field_name;
+        Dwarf_Unsigned struct_offset;
+
+        rc = dwarf_diename(struct_child, &field_name, &err);
+        struct_offset = get_struct_member_offset(struct_child);
+        if (rc != DW_DLV_OK){
+            break;
+        }
+        members.push_back({field_name, struct_offset, struct_child});
+        rc = dwarf_siblingof(dbg, struct_child, &struct_child, &err);
+        if (rc == DW_DLV_ERROR) {
+            die("Struct: Error getting sibling of DIE\n");
+            break;
+        }
+        else if (rc == DW_DLV_NO_ENTRY) {
+            break;
+        }
+    }
+    return members;
+}
+
 int die_get_type_size (Dwarf_Debug dbg, Dwarf_Die the_die){
     Dwarf_Error err;
     Dwarf_Half tag;
@@ -578,7 +663,7 @@ int die_get_type_size (Dwarf_Debug dbg, Dwarf_Die the_die){
             // user swann outlines these two functions are necessary to jump to a dwarf reference
 
             dwarf_global_formref(type_attr, &offset, &err);
-            dwarf_offdie_b(dbg, offset, 1, &type_die, &err);
+            type_die = offdie_cached(dbg, offset);
             // end swann code
             dwarf_tag(type_die, &tag, &err);
             cur_die = type_die;
@@ -737,7 +822,7 @@ void __dwarf_type_iter (CPUState *cpu, target_ulong base_addr, LocType loc_t,
             // user swann outlines these two functions are necessary to jump to a dwarf reference
 
             dwarf_global_formref(type_attr, &offset, &err);
-            dwarf_offdie_b(dbg, offset, 1, &type_die, &err);
+            type_die = offdie_cached(dbg, offset);
             // end swann code
             dwarf_tag(type_die, &tag, &err);
             cur_die = type_die;
@@ -758,34 +843,13 @@ void __dwarf_type_iter (CPUState *cpu, target_ulong base_addr, LocType loc_t,
                         else
                             cur_astnodename = "(*" + cur_astnodename + ")";
                         
-                        Dwarf_Die struct_child;
-                        if (dwarf_child(type_die, &struct_child, &err) != DW_DLV_OK)
-                        {
-                            //printf("  Couldn't parse struct for var: %s\n",cur_astnodename.c_str() );
-                            return;
-                        }
-                        Dwarf_Unsigned struct_offset;
                         std::string temp_name;
-                        char *field_name;
-                        while (1) // enumerate struct arguments
+                        for (const auto &member : struct_members_cached(dbg, type_die))
                         {
-                            rc = dwarf_diename(struct_child, &field_name, &err);
-                            struct_offset = get_struct_member_offset(struct_child);
-                            if (rc != DW_DLV_OK){
-                                break;
-                            }
-                            temp_name = "&(" + cur_astnodename + "." + field_name + ")";
-                            //printf(" struct: %s, offset: %llu\n", temp_name.c_str(), struct_offset);
-                            __dwarf_type_iter(cpu, cur_base_addr + struct_offset, loc_t, dbg,
-                                           struct_child, temp_name, cb, recursion_level - 1);
-                            rc = dwarf_siblingof(dbg, struct_child, &struct_child, &err);
-                            if (rc == DW_DLV_ERROR) {
-                                die("Struct: Error getting sibling of DIE\n");
-                                break;
-                            }
-                            else if (rc == DW_DLV_NO_ENTRY) {
-                                break;
-                            }
+                            temp_name = "&(" + cur_astnodename + "." + member.name + ")";
+                            //printf(" struct: %s, offset: %llu\n", temp_name.c_str(), member.offset);
+                            __dwarf_type_iter(cpu, cur_base_addr + member.offset, loc_t, dbg,
+                                           member.die, temp_name, cb, recursion_level - 1);
                         }
                         return;
                     }
@@ -836,7 +900,7 @@ void __dwarf_type_iter (CPUState *cpu, target_ulong base_addr, LocType loc_t,
                         Dwarf_Die tmp_die;
                         rc = dwarf_attr (cur_die, DW_AT_type, &type_attr, &err);
                         dwarf_global_formref(type_attr, &offset, &err);
-                        dwarf_offdie_b(dbg, offset, 1, &tmp_die, &err);
+                        tmp_die = offdie_cached(dbg, offset);
                         dwarf_tag(tmp_die, &tag, &err);
                         if (tag == DW_TAG_structure_type) {
                             cur_astnodename = "*(" + cur_astnodename + ")";
@@ -997,7 +1061,7 @@ const char *dwarf_type_to_string ( DwarfVarType *var_ty ){
              * user swann outlines these two functions are necessary to jump to a dwarf reference
              */
             dwarf_global_formref(type_attr, &offset, &err);
-            dwarf_offdie_b(dbg, offset, 1, &type_die, &err);
+            type_die = offdie_cached(dbg, offset);
             // end swann code
 
             dwarf_tag(type_die, &tag, &err);
@@ -1156,8 +1220,11 @@ int get_die_loc_info(Dwarf_Debug dbg, Dwarf_Die the_die, Dwarf_Half attr, Dwarf_
 
 }
 
+// cu_lines_begin and cu_lines_end delimit the line ranges of the current
+// compilation unit in line_range_list, sorted by lowpc
 void load_func_from_die(Dwarf_Debug *dbg, Dwarf_Die the_die,
-        const char *basename,  uint64_t base_address,uint64_t cu_base_address, bool needs_reloc){
+        const char *basename,  uint64_t base_address,uint64_t cu_base_address, bool needs_reloc,
+        size_t cu_lines_begin, size_t cu_lines_end){
     char* die_name = 0;
     Dwarf_Error err;
     Dwarf_Half tag;
@@ -1243,20 +1310,18 @@ void load_func_from_die(Dwarf_Debug *dbg, Dwarf_Die the_die,
             highpc += base_address;
         }
         //functions[std::string(basename)+"!"+die_name] = std::make_pair(lowpc, highpc);
-        auto lineToFuncAddress = [lowpc, highpc](LineRange &x){
-                // if a line range (we just need to check its lowpc) fits between range of a function
-                // we update the LineRange to reflect that the line is in the current function
-                if (x.lowpc < highpc && x.lowpc >= lowpc){
-                    x.function_addr = lowpc;
-                }
-        };
-        auto lineIsFunctionDef = [lowpc](LineRange &x){
-            return x.lowpc == lowpc;
-        };
-        auto funct_line_it = std::find_if(line_range_list.begin(), line_range_list.end(), lineIsFunctionDef);
-
-        if (funct_line_it != line_range_list.end()){
-            fn_start_line_range_list.push_back(*funct_line_it);
+        // the lines of the function are the ones of its compilation unit that
+        // start between lowpc and highpc; binary search for the first one
+        // instead of scanning every line loaded so far
+        size_t first_line = std::lower_bound(line_range_list.begin() + cu_lines_begin,
+                line_range_list.begin() + cu_lines_end,
+                LineRange(lowpc, lowpc, 0, NULL, 0, 0), sortRangeLowpc) - line_range_list.begin();
+
+        if (first_line < cu_lines_end && line_range_list[first_line].lowpc == lowpc){
+            // copy it, the plt entries pushed below may reallocate line_range_list
+            const LineRange funct_line = line_range_list[first_line];
+
+            fn_start_line_range_list.push_back(funct_line);
             // add the LineRange information for the function to fn_name_to_line_info for later use
             // when resolving dwarf information for .plt functions
             // NOTE: this assumes that all function names are unique.
@@ -1264,10 +1329,10 @@ void load_func_from_die(Dwarf_Debug *dbg, Dwarf_Die the_die,
             fn_name_to_line_info.insert(std::make_pair(std::string(die_name),
                         LineRange(lowpc,
                             highpc,
-                            funct_line_it->line_number,
-                            funct_line_it->filename,
+                            funct_line.line_number,
+                            funct_line.filename,
                             lowpc,
-                            funct_line_it->line_off)));
+                            funct_line.line_off)));
 
             // now check if current function we are processing is in dynl_functions if so
             // point the dynl_function to this function's line number, filename, and line_off
@@ -1280,10 +1345,10 @@ void load_func_from_die(Dwarf_Debug *dbg, Dwarf_Die the_die,
 
                     line_range_list.push_back(LineRange(plt_addr,
                                                         plt_addr,
-                                                        funct_line_it->line_number,
-                                                        funct_line_it->filename,
+                                                        funct_line.line_number,
+                                                        funct_line.filename,
                                                         lowpc,
-                                                        funct_line_it->line_off));
+                                                        funct_line.line_off));
 
                 }
             }
@@ -1298,7 +1363,11 @@ void load_func_from_die(Dwarf_Debug *dbg, Dwarf_Die the_die,
         //    ++funct_line_it;
         //    fn_start_line_range_list.push_back(*funct_line_it);
         //}
-        std::for_each(line_range_list.begin(), line_range_list.end(), lineToFuncAddress);
+        // if a line range (we just need to check its lowpc) fits between range of a function
+        // we update the LineRange to reflect that the line is in the current function
+        for (size_t j = first_line; j < cu_lines_end && line_range_list[j].lowpc < highpc; j++){
+            line_range_list[j].function_addr = lowpc;
+        }
         funcaddrs[lowpc] = std::string(basename) + "!" + die_name;
         // now add functions frame pointer locaiton list funct_to_framepointers mapping
         if (found_fp_info){
@@ -1448,6 +1517,7 @@ bool load_debug_info(Dwarf_Debug *dbg, const char *basename, uint64_t base_addre
             //printf("CU did have low pc 0x%llx\n", cu_base_address);
         }
         int i;
+        size_t cu_lines_begin = line_range_list.size();
         if (DW_DLV_OK == dwarf_srclines(cu_die, &dwarf_lines, &line_count, &err)){
             char *filenm_tmp;
             char *filenm_cu;
@@ -1492,6 +1562,10 @@ bool load_debug_info(Dwarf_Debug *dbg, const char *basename, uint64_t base_addre
         }
         else
             printf("Could not get get function line number\n");
+        // sort the lines of this CU so that its functions can find their lines
+        // with a binary search; keep the line table order for equal addresses
+        size_t cu_lines_end = line_range_list.size();
+        std::stable_sort(line_range_list.begin() + cu_lines_begin, line_range_list.end(), sortRangeLowpc);
 
         /* Expect the CU DIE to have children */
         if (dwarf_child(cu_die, &child_die, &err) == DW_DLV_ERROR) {
@@ -1509,7 +1583,8 @@ bool load_debug_info(Dwarf_Debug *dbg, const char *basename, uint64_t base_addre
                 die("Error in dwarf_tag\n");
 
             if (tag == DW_TAG_subprogram){
-                load_func_from_die(dbg, child_die, basename, base_address, cu_base_address, needs_reloc);
+                load_func_from_die(dbg, child_die, basename, base_address, cu_base_address, needs_reloc,
+                                   cu_lines_begin, cu_lines_end);
             }
             else if (tag == DW_TAG_variable){
 
@@ -1742,7 +1817,7 @@ target_ulong get_cur_fp(CPUState *cpu, target_ulong pc){
 bool dwarf_in_target_code(CPUState *cpu, target_ulong pc){
     if (!correct_asid(cpu)) return false;
     auto it = std::lower_bound(line_range_list.begin(), line_range_list.end(), pc, CompareRangeAndPC());
-    if (pc < it->lowpc || it == line_range_list.end())
+    if (it == line_range_list.end() || pc < it->lowpc)
         return false;
     return true;
 }
@@ -1783,7 +1858,7 @@ bool translate_callback_dwarf(CPUState *cpu, target_ulong pc) {
     */
     // after the call to lower_bound the `pc` should be between it2->lowpc and it2->highpc
     // if it2 == line_range_list.end() we know we definitely didn't find out pc in our line_range_list
-    if (pc < it2->lowpc || it2 == line_range_list.end())
+    if (it2 == line_range_list.end() || pc < it2->lowpc)
         return false;
 
 
@@ -1801,7 +1876,7 @@ void dwarf_log_callsite(CPUState *cpu, char *file_callee, char *fn_callee, uint6
 
     ra -= 5; // subtract 5 to get address of call instead of return address
     auto it = std::lower_bound(line_range_list.begin(), line_range_list.end(), ra, CompareRangeAndPC());
-    if (ra < it->lowpc || it == line_range_list.end()){
+    if (it == line_range_list.end() || ra < it->lowpc){
         //printf("No DWARF information for callsite 0x%x for current function.\n", ra);
         //printf("Callsite must be in an external library we do not have DWARF information for.\n");
         return;
@@ -1827,7 +1902,7 @@ void dwarf_log_callsite(CPUState *cpu, char *file_callee, char *fn_callee, uint6
 void on_call(CPUState *cpu, target_ulong pc) {
     if (!correct_asid(cpu)) return;
     auto it = std::lower_bound(line_range_list.begin(), line_range_list.end(), pc, CompareRangeAndPC());
-    if (pc < it->lowpc || it == line_range_list.end()){
+    if (it == line_range_list.end() || pc < it->lowpc){
         auto it_dyn = addr_to_dynl_function.find(pc);
         if (it_dyn != addr_to_dynl_function.end()){
             pri_runcb_on_fn_start(cpu, pc, NULL, it_dyn->second.c_str());
@@ -1878,7 +1953,7 @@ void on_ret(CPUState *cpu, target_ulong pc_func) {
     if (!correct_asid(cpu)) return;
     //printf(" on_ret address: %x\n", func);
     auto it = std::lower_bound(line_range_list.begin(), line_range_list.end(), pc_func, CompareRangeAndPC());
-    if (pc_func < it->lowpc || it == line_range_list.end()){
+    if (it == line_range_list.end() || pc_func < it->lowpc){
         auto it_dyn = addr_to_dynl_function.find(pc_func);
         if (it_dyn != addr_to_dynl_function.end()){
             pri_runcb_on_fn_return(cpu, pc_func, NULL, it_dyn->second.c_str());
@@ -1898,18 +1973,21 @@ void on_ret(CPUState *cpu, target_ulong pc_func) {
 
 void __livevar_iter(CPUState *cpu,
         target_ulong pc,
-        std::vector<VarInfo> vars,
+        const std::vector<VarInfo> &vars,
         liveVarCB f,
         void *args,
         target_ulong fp){
     //printf("size of vars: %ld\n", vars.size());
-    for (auto it : vars){
+    for (const auto &it : vars){
         // skip 40% of variables
         if (rand() % 100 < 40){
             return;
         }
+        if (!it.maybe_live(pc)){
+            continue;
+        }
         void *var_type    = it.var_type;
-        std::string var_name    = it.var_name;
+        const std::string &var_name = it.var_name;
         Dwarf_Locdesc **locdesc = it.locations;
         Dwarf_Signed loc_cnt    = it.num_locations;
         for (int i=0; i < loc_cnt; i++){
@@ -1945,7 +2023,7 @@ void __livevar_iter(CPUState *cpu,
 // will assign found variable to ret_var
 int livevar_find(CPUState *cpu,
         target_ulong pc,
-        std::vector<VarInfo> vars,
+        const std::vector<VarInfo> &vars,
         liveVarPred pred,
         void *args,
         VarInfo &ret_var){
@@ -1955,9 +2033,12 @@ int livevar_find(CPUState *cpu,
         printf("Error: was not able to get the Frame Pointer for the function %s at @ 0x" TARGET_FMT_lx "\n", funcaddrs[cur_function].c_str(), pc);
         return 0;
     }
-    for (auto it : vars){
+    for (const auto &it : vars){
+        if (!it.maybe_live(pc)){
+            continue;
+        }
         void *var_type    = it.var_type;
-        std::string var_name    = it.var_name;
+        const std::string &var_name = it.var_name;
         Dwarf_Locdesc **locdesc = it.locations;
         Dwarf_Signed loc_cnt    = it.num_locations;
         for (int i=0; i < loc_cnt; i++){
@@ -2008,7 +2089,7 @@ void dwarf_get_vma_symbol (CPUState *cpu, target_ulong pc, target_ulong vma, cha
     target_ulong fn_address;
 
     auto it = std::lower_bound(line_range_list.begin(), line_range_list.end(), pc, CompareRangeAndPC());
-    if (pc < it->lowpc || it == line_range_list.end() ) {
+    if (it == line_range_list.end() || pc < it->lowpc) {
         *symbol_name = NULL;
         return;
     }
@@ -2039,7 +2120,7 @@ void dwarf_get_pc_source_info(CPUState *cpu, target_ulong pc, SrcInfo *info, int
         return;
     }
     auto it = std::lower_bound(line_range_list.begin(), line_range_list.end(), pc, CompareRangeAndPC());
-    if (pc < it->lowpc || it == line_range_list.end()){
+    if (it == line_range_list.end() || pc < it->lowpc){
         auto it_dyn = addr_to_dynl_function.find(pc);
         if (it_dyn != addr_to_dynl_function.end()){
             //printf("In a a plt function\n");
@@ -51,7 +51,7 @@ uint64_t global_src_linenum;
 bool debug = false;
 
 Panda__SrcInfoPri *pandalog_src_info_pri_create(const char *src_filename, uint64_t src_linenum, const char *src_ast_node_name) {
-    Panda__SrcInfoPri *si = (Panda__SrcInfoPri *) malloc(sizeof(Panda__SrcInfoPri));
+    Panda__SrcInfoPri *si = pandalog_arena_new(Panda__SrcInfoPri);
     *si = PANDA__SRC_INFO_PRI__INIT;
 
     si->filename = (char *) src_filename;
@@ -142,7 +142,7 @@ void lava_taint_query ( target_ulong buf, LocType loc_t, target_ulong buf_len, c
         if (num_tainted) {
             // ok at least one byte in the extent is tainted
             // 1. write the pandalog entry that tells us something was tainted on this extent
-            Panda__TaintQueryPri *tqh = (Panda__TaintQueryPri *) malloc (sizeof (Panda__TaintQueryPri));
+            Panda__TaintQueryPri *tqh = pandalog_arena_new(Panda__TaintQueryPri);
             *tqh = PANDA__TAINT_QUERY_PRI__INIT;
             tqh->buf = buf;
             tqh->len = len;
@@ -191,22 +191,15 @@ void lava_taint_query ( target_ulong buf, LocType loc_t, target_ulong buf_len, c
             if (debug)
                 printf("num taint queries: %lu\n", tq.size());
             tqh->n_taint_query = tq.size();
-            tqh->taint_query = (Panda__TaintQuery **) malloc(sizeof(Panda__TaintQuery *) * tqh->n_taint_query);
+            tqh->taint_query = (Panda__TaintQuery **) pandalog_arena_alloc(sizeof(Panda__TaintQuery *) * tqh->n_taint_query);
             for (uint32_t i=0; i<tqh->n_taint_query; i++) {
                 tqh->taint_query[i] = tq[i];
             }
             Panda__LogEntry ple;
             ple = PANDA__LOG_ENTRY__INIT;
             ple.taint_query_pri = tqh;
+            // everything in tqh came from the pandalog arena
             pandalog_write_entry(&ple);
-            // can't free this here because src_info will be used by other
-            // variables
-            free(tqh->src_info);
-            pandalog_callstack_free(tqh->call_stack);
-            for (uint32_t i=0; i<tqh->n_taint_query; i++) {
-                pandalog_taint_query_free(tqh->taint_query[i]);
-            }
-            free(tqh);
         }
     }
 }
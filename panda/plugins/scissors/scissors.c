@@ -153,6 +153,29 @@ static RR_prog_point copy_entry(void) {
                             args->variant.handle_packet_args.size, 1,
                             oldlog, newlog);
                     break;
+                case RR_CALL_CPU_MEM_RW_ZERO:
+                    RR_COPY_ITEM(args->variant.cpu_mem_rw_args);
+                    break;
+                case RR_CALL_CPU_MEM_UNMAP_ZERO:
+                    RR_COPY_ITEM(args->variant.cpu_mem_unmap);
+                    break;
+                case RR_CALL_DEDUP_RESET:
+                    break;
+                case RR_CALL_CHECKSUM:
+                    // replay skips the dirty pages of the first one, whose
+                    // interval starts before the cut
+                    RR_COPY_ITEM(args->variant.checksum_args);
+                    break;
+                case RR_CALL_CPU_SWITCH:
+                    RR_COPY_ITEM(args->variant.cpu_switch_args);
+                    break;
+                case RR_CALL_CPU_MEM_RW_REF:
+                case RR_CALL_CPU_MEM_UNMAP_REF:
+                    // the payload may be from before the cut
+                    fprintf(stderr, "scissors: %s has deduplicated DMA "
+                            "payloads; cannot cut it.\n", rr_nondet_log->name);
+                    sassert(0, 12);
+                    break;
                 default:
                     //mz unimplemented
                     sassert(0, 3);
@@ -171,6 +194,25 @@ static RR_prog_point copy_entry(void) {
     return original_prog_point;
 }
 
+// Replay of the cut starts on the first vCPU, so switch to the one that's
+// running now, as the recording did.
+static void write_cpu_switch(uint32_t cpu_index) {
+    RR_log_entry item;
+    RR_skipped_call_args *args = &item.variant.call_args;
+
+    memset(&item, 0, sizeof(item));
+    item.header.kind = RR_SKIPPED_CALL;
+    item.header.callsite_loc = RR_CALLSITE_MAIN_LOOP_WAIT;
+    args->kind = RR_CALL_CPU_SWITCH;
+    args->variant.cpu_switch_args.cpu_index = cpu_index;
+    rr_fwrite(&item.header.prog_point, sizeof(item.header.prog_point), 1, newlog);
+    rr_fwrite(&item.header.kind, sizeof(item.header.kind), 1, newlog);
+    rr_fwrite(&item.header.callsite_loc, sizeof(item.header.callsite_loc), 1, newlog);
+    rr_fwrite(&args->kind, sizeof(args->kind), 1, newlog);
+    rr_fwrite(&args->variant.cpu_switch_args,
+              sizeof(args->variant.cpu_switch_args), 1, newlog);
+}
+
 static void end_snip(void) {
     RR_prog_point prog_point = rr_prog_point();
     printf("Ending cut-and-paste on prog point:\n");
@@ -195,6 +237,12 @@ static void end_snip(void) {
 int before_block_exec(CPUState *env, TranslationBlock *tb) {
     uint64_t count = rr_get_guest_instr_count();
     if (!snipping && count+tb->icount > start_count) {
+        // entries are copied byte-for-byte from the log file
+        if (rr_nondet_log->zlog) {
+            fprintf(stderr, "scissors: %s is compressed; cannot cut it.\n",
+                    rr_nondet_log->name);
+            sassert(false, 11);
+        }
         sassert((oldlog = fopen(rr_nondet_log->name, "r")), 8);
         sassert(fread(&orig_last_prog_point, sizeof(RR_prog_point), 1, oldlog) == 1, 9);
         printf("Original ending prog point: ");
@@ -220,13 +268,14 @@ int before_block_exec(CPUState *env, TranslationBlock *tb) {
         // We'll fix this up later.
         RR_prog_point prog_point = {0, 0, 0};
         fwrite(&prog_point, sizeof(RR_prog_point), 1, newlog);
+        if (rr_current_cpu && rr_current_cpu != first_cpu) {
+            write_cpu_switch(rr_current_cpu->cpu_index);
+        }
 
-        fseek(oldlog, ftell(rr_nondet_log->fp), SEEK_SET);
-
-        // If there are items in the queue, then start copying the log
-        // from there
-        RR_log_entry *item = rr_get_queue_head();
-        if (item != NULL) fseek(oldlog, item->header.file_pos, SEEK_SET);
+        // Start copying from the first entry replay hasn't consumed yet.
+        // rr_nondet_log->fp is no good for this, since the replay prefetch
+        // thread reads ahead of the queue.
+        fseek(oldlog, rr_next_entry_file_pos(), SEEK_SET);
 
         while (prog_point.guest_instr_count < end_count && !feof(oldlog)) {
             prog_point = copy_entry();
@@ -20,6 +20,7 @@ PANDAENDCOMMENT */
 #include <ctype.h>
 #include <math.h>
 #include <map>
+#include <vector>
 #include <fstream>
 #include <sstream>
 #include <string>
@@ -54,15 +55,90 @@ PPP_PROT_REG_CB(on_ssm);
 
 }
 
-// Silly: since we use these as map values, they have to be
-// copy constructible. Plain arrays aren't, but structs containing
-// arrays are. So we make these goofy wrappers.
-struct match_strings {
-    int val[MAX_STRINGS];
-};
-struct string_pos {
-    uint32_t val[MAX_STRINGS];
+// Aho-Corasick automaton over all the search strings, so each byte costs one
+// state transition no matter how many strings there are.  State 0 is the
+// root; a tap point's search position is just its current state.
+class string_matcher {
+    struct node {
+        std::vector<std::pair<uint8_t,uint32_t>> next; // sorted by byte
+        uint32_t fail = 0;
+        int32_t dict = -1;  // nearest proper suffix state that ends a string
+        std::vector<int> ends; // strings ending exactly here
+    };
+    std::vector<node> nodes;
+    uint32_t root_next[256];  // transitions out of the root, dense
+
+    int32_t child(uint32_t s, uint8_t c) const {
+        const std::vector<std::pair<uint8_t,uint32_t>> &next = nodes[s].next;
+        for (auto &e : next) {
+            if (e.first == c) return e.second;
+            if (e.first > c) break;
+        }
+        return -1;
+    }
+
+public:
+    string_matcher() : nodes(1) {}
+
+    void add(const uint8_t *str, uint32_t len, int idx) {
+        uint32_t s = 0;
+        for (uint32_t i = 0; i < len; i++) {
+            int32_t t = child(s, str[i]);
+            if (t < 0) {
+                t = nodes.size();
+                std::vector<std::pair<uint8_t,uint32_t>> &next = nodes[s].next;
+                auto pos = next.begin();
+                while (pos != next.end() && pos->first < str[i]) pos++;
+                next.insert(pos, std::make_pair(str[i], (uint32_t)t));
+                nodes.emplace_back();
+            }
+            s = t;
+        }
+        nodes[s].ends.push_back(idx);
+    }
+
+    // call once all strings are added
+    void build() {
+        std::vector<uint32_t> queue;
+        for (int c = 0; c < 256; c++) {
+            int32_t t = child(0, c);
+            root_next[c] = t < 0 ? 0 : t;
+            if (t > 0) queue.push_back(t);
+        }
+        // breadth first, so a state's fail target is always done before it
+        for (size_t qi = 0; qi < queue.size(); qi++) {
+            uint32_t s = queue[qi];
+            for (auto &e : nodes[s].next) {
+                uint32_t t = e.second;
+                uint32_t f = nodes[s].fail;
+                nodes[t].fail = step(f, e.first);
+                uint32_t ft = nodes[t].fail;
+                nodes[t].dict = nodes[ft].ends.empty() ? nodes[ft].dict : ft;
+                queue.push_back(t);
+            }
+        }
+    }
+
+    uint32_t step(uint32_t s, uint8_t c) const {
+        while (s != 0) {
+            int32_t t = child(s, c);
+            if (t >= 0) return t;
+            s = nodes[s].fail;
+        }
+        return root_next[c];
+    }
+
+    // call fn(idx) for every string that ends at state s
+    template <typename F>
+    void for_each_match(uint32_t s, F fn) const {
+        if (nodes[s].ends.empty() && nodes[s].dict < 0) return;
+        for (int32_t m = nodes[s].ends.empty() ? nodes[s].dict : s; m >= 0;
+             m = nodes[m].dict) {
+            for (int idx : nodes[m].ends) fn(idx);
+        }
+    }
 };
+
 struct fullstack {
     int n;
     target_ulong callers[MAX_CALLERS];
@@ -71,11 +147,13 @@ struct fullstack {
 };
 
 std::map<prog_point,fullstack> matchstacks;
-std::map<prog_point,match_strings> matches;
-std::map<prog_point,string_pos> read_text_tracker;
-std::map<prog_point,string_pos> write_text_tracker;
-uint8_t tofind[MAX_STRINGS][MAX_STRLEN];
-uint32_t strlens[MAX_STRINGS];
+// matches[p][i] is the number of matches of string i at tap point p
+std::map<prog_point,std::vector<int>> matches;
+// current matcher state of each tap point
+prog_point_map<uint32_t> read_text_tracker;
+prog_point_map<uint32_t> write_text_tracker;
+std::vector<std::string> tofind;
+string_matcher matcher;
 int num_strings = 0;
 int n_callers = 16;
 
@@ -87,39 +165,34 @@ PPP_CB_BOILERPLATE(on_ssm)
 
 int mem_callback(CPUState *env, target_ulong pc, target_ulong addr,
                        target_ulong size, void *buf, bool is_write,
-                       std::map<prog_point,string_pos> &text_tracker) {
+                       prog_point_map<uint32_t> &text_tracker) {
     prog_point p = {};
     get_prog_point(env, &p);
 
-    string_pos &sp = text_tracker[p];
+    uint32_t &state = text_tracker[p];
 
     for (unsigned int i = 0; i < size; i++) {
         uint8_t val = ((uint8_t *)buf)[i];
-        for(int str_idx = 0; str_idx < num_strings; str_idx++) {
-            if (tofind[str_idx][sp.val[str_idx]] == val)
-                sp.val[str_idx]++;
-            else
-                sp.val[str_idx] = 0;
-
-            if (sp.val[str_idx] == strlens[str_idx]) {
-                // Victory!
-                printf("%s Match of str %d at: instr_count=%lu :  " TARGET_FMT_lx " " TARGET_FMT_lx " " TARGET_FMT_lx "\n",
-                       (is_write ? "WRITE" : "READ"), str_idx, rr_get_guest_instr_count(), p.caller, p.pc, p.cr3);
-                matches[p].val[str_idx]++;
-                sp.val[str_idx] = 0;
-
-                // Also get the full stack here
-                fullstack f = {0};
-                f.n = get_callers(f.callers, n_callers, env);
-                f.pc = p.pc;
-                f.asid = p.cr3;
-                matchstacks[p] = f;
-
-                // call the i-found-a-match registered callbacks here
-                PPP_RUN_CB(on_ssm, env, pc, addr, tofind[str_idx], strlens[str_idx], is_write)
-
-            }
-        }
+        state = matcher.step(state, val);
+        matcher.for_each_match(state, [&](int str_idx) {
+            // Victory!
+            printf("%s Match of str %d at: instr_count=%lu :  " TARGET_FMT_lx " " TARGET_FMT_lx " " TARGET_FMT_lx "\n",
+                   (is_write ? "WRITE" : "READ"), str_idx, rr_get_guest_instr_count(), p.caller, p.pc, p.cr3);
+            std::vector<int> &counts = matches[p];
+            if (counts.empty()) counts.resize(num_strings);
+            counts[str_idx]++;
+
+            // Also get the full stack here
+            fullstack f = {0};
+            f.n = get_callers(f.callers, n_callers, env);
+            f.pc = p.pc;
+            f.asid = p.cr3;
+            matchstacks[p] = f;
+
+            // call the i-found-a-match registered callbacks here
+            uint8_t *str = (uint8_t *)tofind[str_idx].data();
+            PPP_RUN_CB(on_ssm, env, pc, addr, str, tofind[str_idx].size(), is_write)
+        });
     }
  
     return 1;
@@ -150,8 +223,7 @@ bool init_plugin(void *self) {
     const char *arg_str = panda_parse_string(args, "str", "");
     size_t arg_len = strlen(arg_str);
     if (arg_len > 0) {
-        memcpy(tofind[num_strings], arg_str, arg_len);
-        strlens[num_strings] = arg_len;
+        tofind.push_back(std::string(arg_str, arg_len));
         num_strings++;
     }
 
@@ -177,24 +249,23 @@ bool init_plugin(void *self) {
     while(std::getline(search_strings, line)) {
         std::istringstream iss(line);
 
+        std::string str;
         if (line[0] == '"') {
-            size_t len = line.size() - 2;
-            memcpy(tofind[num_strings], line.substr(1, len).c_str(), len);
-            strlens[num_strings] = len;
+            str = line.substr(1, line.size() - 2);
         } else {
             std::string x;
-            int i = 0;
             while (std::getline(iss, x, ':')) {
-                tofind[num_strings][i++] = (uint8_t)strtoul(x.c_str(), NULL, 16);
-                if (i >= MAX_STRLEN) {
+                str.push_back((char)strtoul(x.c_str(), NULL, 16));
+                if (str.size() >= MAX_STRLEN) {
                     printf("WARN: Reached max number of characters (%d) on string %d, truncating.\n", MAX_STRLEN, num_strings);
                     break;
                 }
             }
-            strlens[num_strings] = i;
         }
- 
-        printf("stringsearch: added string of length %d to search set\n", strlens[num_strings]);
+        if (str.empty()) continue;
+        tofind.push_back(str);
+
+        printf("stringsearch: added string of length %zu to search set\n", str.size());
 
         if(++num_strings >= MAX_STRINGS) {
             printf("WARN: maximum number of strings (%d) reached, will not load any more.\n", MAX_STRINGS);
@@ -202,6 +273,11 @@ bool init_plugin(void *self) {
         }
     }
 
+    for (int i = 0; i < num_strings; i++) {
+        matcher.add((const uint8_t *)tofind[i].data(), tofind[i].size(), i);
+    }
+    matcher.build();
+
     char matchfile[128] = {};
     sprintf(matchfile, "%s_string_matches.txt", prefix);
     mem_report = fopen(matchfile, "w");
@@ -218,17 +294,17 @@ bool init_plugin(void *self) {
     // Enable memory logging
     panda_enable_memcb();
 
-    pcb.virt_mem_write = mem_write_callback;
-    panda_register_callback(self, PANDA_CB_VIRT_MEM_WRITE, pcb);
-    pcb.virt_mem_read = mem_read_callback;
-    panda_register_callback(self, PANDA_CB_VIRT_MEM_READ, pcb);
+    pcb.virt_mem_before_write = mem_write_callback;
+    panda_register_callback(self, PANDA_CB_VIRT_MEM_BEFORE_WRITE, pcb);
+    pcb.virt_mem_after_read = mem_read_callback;
+    panda_register_callback(self, PANDA_CB_VIRT_MEM_AFTER_READ, pcb);
 
 
     return true;
 }
 
 void uninit_plugin(void *self) {
-    std::map<prog_point,match_strings>::iterator it;
+    std::map<prog_point,std::vector<int>>::iterator it;
     for(it = matches.begin(); it != matches.end(); it++) {
         // Print prog point
 
@@ -243,7 +319,7 @@ void uninit_plugin(void *self) {
 
         // Print strings that matched and how many times
         for(int i = 0; i < num_strings; i++)
-            fprintf(mem_report, " %d", it->second.val[i]);
+            fprintf(mem_report, " %d", it->second[i]);
         fprintf(mem_report, "\n");
     }
     fclose(mem_report);
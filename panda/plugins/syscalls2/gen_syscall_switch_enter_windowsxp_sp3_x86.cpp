@@ -11,14 +11,303 @@ extern "C" {
 #include "gen_syscall_ppp_extern_return.h"
 }
 
+#ifdef TARGET_I386                                          // GUARD
+static const SyscallSubscribers syscall_subscribers_windowsxp_sp3_x86[] = {
+/* 0 */ { &ppp_on_NtAcceptConnectPort_enter_num_cb, &ppp_on_NtAcceptConnectPort_return_num_cb },
+/* 1 */ { &ppp_on_NtAccessCheck_enter_num_cb, &ppp_on_NtAccessCheck_return_num_cb },
+/* 2 */ { &ppp_on_NtAccessCheckAndAuditAlarm_enter_num_cb, &ppp_on_NtAccessCheckAndAuditAlarm_return_num_cb },
+/* 3 */ { &ppp_on_NtAccessCheckByType_enter_num_cb, &ppp_on_NtAccessCheckByType_return_num_cb },
+/* 4 */ { &ppp_on_NtAccessCheckByTypeAndAuditAlarm_enter_num_cb, &ppp_on_NtAccessCheckByTypeAndAuditAlarm_return_num_cb },
+/* 5 */ { &ppp_on_NtAccessCheckByTypeResultList_enter_num_cb, &ppp_on_NtAccessCheckByTypeResultList_return_num_cb },
+/* 6 */ { &ppp_on_NtAccessCheckByTypeResultListAndAuditAlarm_enter_num_cb, &ppp_on_NtAccessCheckByTypeResultListAndAuditAlarm_return_num_cb },
+/* 7 */ { &ppp_on_NtAccessCheckByTypeResultListAndAuditAlarmByHandle_enter_num_cb, &ppp_on_NtAccessCheckByTypeResultListAndAuditAlarmByHandle_return_num_cb },
+/* 8 */ { &ppp_on_NtAddAtom_enter_num_cb, &ppp_on_NtAddAtom_return_num_cb },
+/* 9 */ { &ppp_on_NtEnumerateBootEntries_enter_num_cb, &ppp_on_NtEnumerateBootEntries_return_num_cb },
+/* 10 */ { &ppp_on_NtAdjustGroupsToken_enter_num_cb, &ppp_on_NtAdjustGroupsToken_return_num_cb },
+/* 11 */ { &ppp_on_NtAdjustPrivilegesToken_enter_num_cb, &ppp_on_NtAdjustPrivilegesToken_return_num_cb },
+/* 12 */ { &ppp_on_NtAlertResumeThread_enter_num_cb, &ppp_on_NtAlertResumeThread_return_num_cb },
+/* 13 */ { &ppp_on_NtAlertThread_enter_num_cb, &ppp_on_NtAlertThread_return_num_cb },
+/* 14 */ { &ppp_on_NtAllocateLocallyUniqueId_enter_num_cb, &ppp_on_NtAllocateLocallyUniqueId_return_num_cb },
+/* 15 */ { &ppp_on_NtAllocateUserPhysicalPages_enter_num_cb, &ppp_on_NtAllocateUserPhysicalPages_return_num_cb },
+/* 16 */ { &ppp_on_NtAllocateUuids_enter_num_cb, &ppp_on_NtAllocateUuids_return_num_cb },
+/* 17 */ { &ppp_on_NtAllocateVirtualMemory_enter_num_cb, &ppp_on_NtAllocateVirtualMemory_return_num_cb },
+/* 18 */ { &ppp_on_NtAreMappedFilesTheSame_enter_num_cb, &ppp_on_NtAreMappedFilesTheSame_return_num_cb },
+/* 19 */ { &ppp_on_NtAssignProcessToJobObject_enter_num_cb, &ppp_on_NtAssignProcessToJobObject_return_num_cb },
+/* 20 */ { &ppp_on_NtCallbackReturn_enter_num_cb, &ppp_on_NtCallbackReturn_return_num_cb },
+/* 21 */ { &ppp_on_NtModifyBootEntry_enter_num_cb, &ppp_on_NtModifyBootEntry_return_num_cb },
+/* 22 */ { &ppp_on_NtCancelIoFile_enter_num_cb, &ppp_on_NtCancelIoFile_return_num_cb },
+/* 23 */ { &ppp_on_NtCancelTimer_enter_num_cb, &ppp_on_NtCancelTimer_return_num_cb },
+/* 24 */ { &ppp_on_NtClearEvent_enter_num_cb, &ppp_on_NtClearEvent_return_num_cb },
+/* 25 */ { &ppp_on_NtClose_enter_num_cb, &ppp_on_NtClose_return_num_cb },
+/* 26 */ { &ppp_on_NtCloseObjectAuditAlarm_enter_num_cb, &ppp_on_NtCloseObjectAuditAlarm_return_num_cb },
+/* 27 */ { &ppp_on_NtCompactKeys_enter_num_cb, &ppp_on_NtCompactKeys_return_num_cb },
+/* 28 */ { &ppp_on_NtCompareTokens_enter_num_cb, &ppp_on_NtCompareTokens_return_num_cb },
+/* 29 */ { &ppp_on_NtCompleteConnectPort_enter_num_cb, &ppp_on_NtCompleteConnectPort_return_num_cb },
+/* 30 */ { &ppp_on_NtCompressKey_enter_num_cb, &ppp_on_NtCompressKey_return_num_cb },
+/* 31 */ { &ppp_on_NtConnectPort_enter_num_cb, &ppp_on_NtConnectPort_return_num_cb },
+/* 32 */ { &ppp_on_NtContinue_enter_num_cb, &ppp_on_NtContinue_return_num_cb },
+/* 33 */ { &ppp_on_NtCreateDebugObject_enter_num_cb, &ppp_on_NtCreateDebugObject_return_num_cb },
+/* 34 */ { &ppp_on_NtCreateDirectoryObject_enter_num_cb, &ppp_on_NtCreateDirectoryObject_return_num_cb },
+/* 35 */ { &ppp_on_NtCreateEvent_enter_num_cb, &ppp_on_NtCreateEvent_return_num_cb },
+/* 36 */ { &ppp_on_NtCreateEventPair_enter_num_cb, &ppp_on_NtCreateEventPair_return_num_cb },
+/* 37 */ { &ppp_on_NtCreateFile_enter_num_cb, &ppp_on_NtCreateFile_return_num_cb },
+/* 38 */ { &ppp_on_NtCreateIoCompletion_enter_num_cb, &ppp_on_NtCreateIoCompletion_return_num_cb },
+/* 39 */ { &ppp_on_NtCreateJobObject_enter_num_cb, &ppp_on_NtCreateJobObject_return_num_cb },
+/* 40 */ { &ppp_on_NtCreateJobSet_enter_num_cb, &ppp_on_NtCreateJobSet_return_num_cb },
+/* 41 */ { &ppp_on_NtCreateKey_enter_num_cb, &ppp_on_NtCreateKey_return_num_cb },
+/* 42 */ { &ppp_on_NtCreateMailslotFile_enter_num_cb, &ppp_on_NtCreateMailslotFile_return_num_cb },
+/* 43 */ { &ppp_on_NtCreateMutant_enter_num_cb, &ppp_on_NtCreateMutant_return_num_cb },
+/* 44 */ { &ppp_on_NtCreateNamedPipeFile_enter_num_cb, &ppp_on_NtCreateNamedPipeFile_return_num_cb },
+/* 45 */ { &ppp_on_NtCreatePagingFile_enter_num_cb, &ppp_on_NtCreatePagingFile_return_num_cb },
+/* 46 */ { &ppp_on_NtCreatePort_enter_num_cb, &ppp_on_NtCreatePort_return_num_cb },
+/* 47 */ { &ppp_on_NtCreateProcess_enter_num_cb, &ppp_on_NtCreateProcess_return_num_cb },
+/* 48 */ { &ppp_on_NtCreateProcessEx_enter_num_cb, &ppp_on_NtCreateProcessEx_return_num_cb },
+/* 49 */ { &ppp_on_NtCreateProfile_enter_num_cb, &ppp_on_NtCreateProfile_return_num_cb },
+/* 50 */ { &ppp_on_NtCreateSection_enter_num_cb, &ppp_on_NtCreateSection_return_num_cb },
+/* 51 */ { &ppp_on_NtCreateSemaphore_enter_num_cb, &ppp_on_NtCreateSemaphore_return_num_cb },
+/* 52 */ { &ppp_on_NtCreateSymbolicLinkObject_enter_num_cb, &ppp_on_NtCreateSymbolicLinkObject_return_num_cb },
+/* 53 */ { &ppp_on_NtCreateThread_enter_num_cb, &ppp_on_NtCreateThread_return_num_cb },
+/* 54 */ { &ppp_on_NtCreateTimer_enter_num_cb, &ppp_on_NtCreateTimer_return_num_cb },
+/* 55 */ { &ppp_on_NtCreateToken_enter_num_cb, &ppp_on_NtCreateToken_return_num_cb },
+/* 56 */ { &ppp_on_NtCreateWaitablePort_enter_num_cb, &ppp_on_NtCreateWaitablePort_return_num_cb },
+/* 57 */ { &ppp_on_NtDebugActiveProcess_enter_num_cb, &ppp_on_NtDebugActiveProcess_return_num_cb },
+/* 58 */ { &ppp_on_NtDebugContinue_enter_num_cb, &ppp_on_NtDebugContinue_return_num_cb },
+/* 59 */ { &ppp_on_NtDelayExecution_enter_num_cb, &ppp_on_NtDelayExecution_return_num_cb },
+/* 60 */ { &ppp_on_NtDeleteAtom_enter_num_cb, &ppp_on_NtDeleteAtom_return_num_cb },
+/* 61 */ { &ppp_on_NtDeleteFile_enter_num_cb, &ppp_on_NtDeleteFile_return_num_cb },
+/* 62 */ { &ppp_on_NtDeleteKey_enter_num_cb, &ppp_on_NtDeleteKey_return_num_cb },
+/* 63 */ { &ppp_on_NtDeleteObjectAuditAlarm_enter_num_cb, &ppp_on_NtDeleteObjectAuditAlarm_return_num_cb },
+/* 64 */ { &ppp_on_NtDeleteValueKey_enter_num_cb, &ppp_on_NtDeleteValueKey_return_num_cb },
+/* 65 */ { &ppp_on_NtDeviceIoControlFile_enter_num_cb, &ppp_on_NtDeviceIoControlFile_return_num_cb },
+/* 66 */ { &ppp_on_NtDisplayString_enter_num_cb, &ppp_on_NtDisplayString_return_num_cb },
+/* 67 */ { &ppp_on_NtDuplicateObject_enter_num_cb, &ppp_on_NtDuplicateObject_return_num_cb },
+/* 68 */ { &ppp_on_NtDuplicateToken_enter_num_cb, &ppp_on_NtDuplicateToken_return_num_cb },
+/* 69 */ { &ppp_on_NtEnumerateKey_enter_num_cb, &ppp_on_NtEnumerateKey_return_num_cb },
+/* 70 */ { &ppp_on_NtEnumerateSystemEnvironmentValuesEx_enter_num_cb, &ppp_on_NtEnumerateSystemEnvironmentValuesEx_return_num_cb },
+/* 71 */ { &ppp_on_NtEnumerateValueKey_enter_num_cb, &ppp_on_NtEnumerateValueKey_return_num_cb },
+/* 72 */ { &ppp_on_NtExtendSection_enter_num_cb, &ppp_on_NtExtendSection_return_num_cb },
+/* 73 */ { &ppp_on_NtFilterToken_enter_num_cb, &ppp_on_NtFilterToken_return_num_cb },
+/* 74 */ { &ppp_on_NtFindAtom_enter_num_cb, &ppp_on_NtFindAtom_return_num_cb },
+/* 75 */ { &ppp_on_NtFlushBuffersFile_enter_num_cb, &ppp_on_NtFlushBuffersFile_return_num_cb },
+/* 76 */ { &ppp_on_NtFlushInstructionCache_enter_num_cb, &ppp_on_NtFlushInstructionCache_return_num_cb },
+/* 77 */ { &ppp_on_NtFlushKey_enter_num_cb, &ppp_on_NtFlushKey_return_num_cb },
+/* 78 */ { &ppp_on_NtFlushVirtualMemory_enter_num_cb, &ppp_on_NtFlushVirtualMemory_return_num_cb },
+/* 79 */ { &ppp_on_NtFlushWriteBuffer_enter_num_cb, &ppp_on_NtFlushWriteBuffer_return_num_cb },
+/* 80 */ { &ppp_on_NtFreeUserPhysicalPages_enter_num_cb, &ppp_on_NtFreeUserPhysicalPages_return_num_cb },
+/* 81 */ { &ppp_on_NtFreeVirtualMemory_enter_num_cb, &ppp_on_NtFreeVirtualMemory_return_num_cb },
+/* 82 */ { &ppp_on_NtFsControlFile_enter_num_cb, &ppp_on_NtFsControlFile_return_num_cb },
+/* 83 */ { &ppp_on_NtGetContextThread_enter_num_cb, &ppp_on_NtGetContextThread_return_num_cb },
+/* 84 */ { &ppp_on_NtGetDevicePowerState_enter_num_cb, &ppp_on_NtGetDevicePowerState_return_num_cb },
+/* 85 */ { &ppp_on_NtGetPlugPlayEvent_enter_num_cb, &ppp_on_NtGetPlugPlayEvent_return_num_cb },
+/* 86 */ { &ppp_on_NtGetWriteWatch_enter_num_cb, &ppp_on_NtGetWriteWatch_return_num_cb },
+/* 87 */ { &ppp_on_NtImpersonateAnonymousToken_enter_num_cb, &ppp_on_NtImpersonateAnonymousToken_return_num_cb },
+/* 88 */ { &ppp_on_NtImpersonateClientOfPort_enter_num_cb, &ppp_on_NtImpersonateClientOfPort_return_num_cb },
+/* 89 */ { &ppp_on_NtImpersonateThread_enter_num_cb, &ppp_on_NtImpersonateThread_return_num_cb },
+/* 90 */ { &ppp_on_NtInitializeRegistry_enter_num_cb, &ppp_on_NtInitializeRegistry_return_num_cb },
+/* 91 */ { &ppp_on_NtInitiatePowerAction_enter_num_cb, &ppp_on_NtInitiatePowerAction_return_num_cb },
+/* 92 */ { &ppp_on_NtIsProcessInJob_enter_num_cb, &ppp_on_NtIsProcessInJob_return_num_cb },
+/* 93 */ { &ppp_on_NtIsSystemResumeAutomatic_enter_num_cb, &ppp_on_NtIsSystemResumeAutomatic_return_num_cb },
+/* 94 */ { &ppp_on_NtListenPort_enter_num_cb, &ppp_on_NtListenPort_return_num_cb },
+/* 95 */ { &ppp_on_NtLoadDriver_enter_num_cb, &ppp_on_NtLoadDriver_return_num_cb },
+/* 96 */ { &ppp_on_NtLoadKey_enter_num_cb, &ppp_on_NtLoadKey_return_num_cb },
+/* 97 */ { &ppp_on_NtLoadKey2_enter_num_cb, &ppp_on_NtLoadKey2_return_num_cb },
+/* 98 */ { &ppp_on_NtLockFile_enter_num_cb, &ppp_on_NtLockFile_return_num_cb },
+/* 99 */ { &ppp_on_NtLockProductActivationKeys_enter_num_cb, &ppp_on_NtLockProductActivationKeys_return_num_cb },
+/* 100 */ { &ppp_on_NtLockRegistryKey_enter_num_cb, &ppp_on_NtLockRegistryKey_return_num_cb },
+/* 101 */ { &ppp_on_NtLockVirtualMemory_enter_num_cb, &ppp_on_NtLockVirtualMemory_return_num_cb },
+/* 102 */ { &ppp_on_NtMakePermanentObject_enter_num_cb, &ppp_on_NtMakePermanentObject_return_num_cb },
+/* 103 */ { &ppp_on_NtMakeTemporaryObject_enter_num_cb, &ppp_on_NtMakeTemporaryObject_return_num_cb },
+/* 104 */ { &ppp_on_NtMapUserPhysicalPages_enter_num_cb, &ppp_on_NtMapUserPhysicalPages_return_num_cb },
+/* 105 */ { &ppp_on_NtMapUserPhysicalPagesScatter_enter_num_cb, &ppp_on_NtMapUserPhysicalPagesScatter_return_num_cb },
+/* 106 */ { &ppp_on_NtMapViewOfSection_enter_num_cb, &ppp_on_NtMapViewOfSection_return_num_cb },
+/* 107 */ { &ppp_on_NtNotifyChangeDirectoryFile_enter_num_cb, &ppp_on_NtNotifyChangeDirectoryFile_return_num_cb },
+/* 108 */ { &ppp_on_NtNotifyChangeKey_enter_num_cb, &ppp_on_NtNotifyChangeKey_return_num_cb },
+/* 109 */ { &ppp_on_NtNotifyChangeMultipleKeys_enter_num_cb, &ppp_on_NtNotifyChangeMultipleKeys_return_num_cb },
+/* 110 */ { &ppp_on_NtOpenDirectoryObject_enter_num_cb, &ppp_on_NtOpenDirectoryObject_return_num_cb },
+/* 111 */ { &ppp_on_NtOpenEvent_enter_num_cb, &ppp_on_NtOpenEvent_return_num_cb },
+/* 112 */ { &ppp_on_NtOpenEventPair_enter_num_cb, &ppp_on_NtOpenEventPair_return_num_cb },
+/* 113 */ { &ppp_on_NtOpenFile_enter_num_cb, &ppp_on_NtOpenFile_return_num_cb },
+/* 114 */ { &ppp_on_NtOpenIoCompletion_enter_num_cb, &ppp_on_NtOpenIoCompletion_return_num_cb },
+/* 115 */ { &ppp_on_NtOpenJobObject_enter_num_cb, &ppp_on_NtOpenJobObject_return_num_cb },
+/* 116 */ { &ppp_on_NtOpenKey_enter_num_cb, &ppp_on_NtOpenKey_return_num_cb },
+/* 117 */ { &ppp_on_NtOpenMutant_enter_num_cb, &ppp_on_NtOpenMutant_return_num_cb },
+/* 118 */ { &ppp_on_NtOpenObjectAuditAlarm_enter_num_cb, &ppp_on_NtOpenObjectAuditAlarm_return_num_cb },
+/* 119 */ { &ppp_on_NtOpenProcess_enter_num_cb, &ppp_on_NtOpenProcess_return_num_cb },
+/* 120 */ { &ppp_on_NtOpenProcessToken_enter_num_cb, &ppp_on_NtOpenProcessToken_return_num_cb },
+/* 121 */ { &ppp_on_NtOpenProcessTokenEx_enter_num_cb, &ppp_on_NtOpenProcessTokenEx_return_num_cb },
+/* 122 */ { &ppp_on_NtOpenSection_enter_num_cb, &ppp_on_NtOpenSection_return_num_cb },
+/* 123 */ { &ppp_on_NtOpenSemaphore_enter_num_cb, &ppp_on_NtOpenSemaphore_return_num_cb },
+/* 124 */ { &ppp_on_NtOpenSymbolicLinkObject_enter_num_cb, &ppp_on_NtOpenSymbolicLinkObject_return_num_cb },
+/* 125 */ { &ppp_on_NtOpenThread_enter_num_cb, &ppp_on_NtOpenThread_return_num_cb },
+/* 126 */ { &ppp_on_NtOpenThreadToken_enter_num_cb, &ppp_on_NtOpenThreadToken_return_num_cb },
+/* 127 */ { &ppp_on_NtOpenThreadTokenEx_enter_num_cb, &ppp_on_NtOpenThreadTokenEx_return_num_cb },
+/* 128 */ { &ppp_on_NtOpenTimer_enter_num_cb, &ppp_on_NtOpenTimer_return_num_cb },
+/* 129 */ { &ppp_on_NtPlugPlayControl_enter_num_cb, &ppp_on_NtPlugPlayControl_return_num_cb },
+/* 130 */ { &ppp_on_NtPowerInformation_enter_num_cb, &ppp_on_NtPowerInformation_return_num_cb },
+/* 131 */ { &ppp_on_NtPrivilegeCheck_enter_num_cb, &ppp_on_NtPrivilegeCheck_return_num_cb },
+/* 132 */ { &ppp_on_NtPrivilegeObjectAuditAlarm_enter_num_cb, &ppp_on_NtPrivilegeObjectAuditAlarm_return_num_cb },
+/* 133 */ { &ppp_on_NtPrivilegedServiceAuditAlarm_enter_num_cb, &ppp_on_NtPrivilegedServiceAuditAlarm_return_num_cb },
+/* 134 */ { &ppp_on_NtProtectVirtualMemory_enter_num_cb, &ppp_on_NtProtectVirtualMemory_return_num_cb },
+/* 135 */ { &ppp_on_NtPulseEvent_enter_num_cb, &ppp_on_NtPulseEvent_return_num_cb },
+/* 136 */ { &ppp_on_NtQueryAttributesFile_enter_num_cb, &ppp_on_NtQueryAttributesFile_return_num_cb },
+/* 137 */ { &ppp_on_NtQueryDebugFilterState_enter_num_cb, &ppp_on_NtQueryDebugFilterState_return_num_cb },
+/* 138 */ { &ppp_on_NtQueryDefaultLocale_enter_num_cb, &ppp_on_NtQueryDefaultLocale_return_num_cb },
+/* 139 */ { &ppp_on_NtQueryDefaultUILanguage_enter_num_cb, &ppp_on_NtQueryDefaultUILanguage_return_num_cb },
+/* 140 */ { &ppp_on_NtQueryDirectoryFile_enter_num_cb, &ppp_on_NtQueryDirectoryFile_return_num_cb },
+/* 141 */ { &ppp_on_NtQueryDirectoryObject_enter_num_cb, &ppp_on_NtQueryDirectoryObject_return_num_cb },
+/* 142 */ { &ppp_on_NtQueryEaFile_enter_num_cb, &ppp_on_NtQueryEaFile_return_num_cb },
+/* 143 */ { &ppp_on_NtQueryEvent_enter_num_cb, &ppp_on_NtQueryEvent_return_num_cb },
+/* 144 */ { &ppp_on_NtQueryFullAttributesFile_enter_num_cb, &ppp_on_NtQueryFullAttributesFile_return_num_cb },
+/* 145 */ { &ppp_on_NtQueryInformationAtom_enter_num_cb, &ppp_on_NtQueryInformationAtom_return_num_cb },
+/* 146 */ { &ppp_on_NtQueryInformationFile_enter_num_cb, &ppp_on_NtQueryInformationFile_return_num_cb },
+/* 147 */ { &ppp_on_NtQueryInformationJobObject_enter_num_cb, &ppp_on_NtQueryInformationJobObject_return_num_cb },
+/* 148 */ { &ppp_on_NtQueryInformationPort_enter_num_cb, &ppp_on_NtQueryInformationPort_return_num_cb },
+/* 149 */ { &ppp_on_NtQueryInformationProcess_enter_num_cb, &ppp_on_NtQueryInformationProcess_return_num_cb },
+/* 150 */ { &ppp_on_NtQueryInformationThread_enter_num_cb, &ppp_on_NtQueryInformationThread_return_num_cb },
+/* 151 */ { &ppp_on_NtQueryInformationToken_enter_num_cb, &ppp_on_NtQueryInformationToken_return_num_cb },
+/* 152 */ { &ppp_on_NtQueryInstallUILanguage_enter_num_cb, &ppp_on_NtQueryInstallUILanguage_return_num_cb },
+/* 153 */ { &ppp_on_NtQueryIntervalProfile_enter_num_cb, &ppp_on_NtQueryIntervalProfile_return_num_cb },
+/* 154 */ { &ppp_on_NtQueryIoCompletion_enter_num_cb, &ppp_on_NtQueryIoCompletion_return_num_cb },
+/* 155 */ { &ppp_on_NtQueryKey_enter_num_cb, &ppp_on_NtQueryKey_return_num_cb },
+/* 156 */ { &ppp_on_NtQueryMultipleValueKey_enter_num_cb, &ppp_on_NtQueryMultipleValueKey_return_num_cb },
+/* 157 */ { &ppp_on_NtQueryMutant_enter_num_cb, &ppp_on_NtQueryMutant_return_num_cb },
+/* 158 */ { &ppp_on_NtQueryObject_enter_num_cb, &ppp_on_NtQueryObject_return_num_cb },
+/* 159 */ { &ppp_on_NtQueryOpenSubKeys_enter_num_cb, &ppp_on_NtQueryOpenSubKeys_return_num_cb },
+/* 160 */ { &ppp_on_NtQueryPerformanceCounter_enter_num_cb, &ppp_on_NtQueryPerformanceCounter_return_num_cb },
+/* 161 */ { &ppp_on_NtQueryQuotaInformationFile_enter_num_cb, &ppp_on_NtQueryQuotaInformationFile_return_num_cb },
+/* 162 */ { &ppp_on_NtQuerySection_enter_num_cb, &ppp_on_NtQuerySection_return_num_cb },
+/* 163 */ { &ppp_on_NtQuerySecurityObject_enter_num_cb, &ppp_on_NtQuerySecurityObject_return_num_cb },
+/* 164 */ { &ppp_on_NtQuerySemaphore_enter_num_cb, &ppp_on_NtQuerySemaphore_return_num_cb },
+/* 165 */ { &ppp_on_NtQuerySymbolicLinkObject_enter_num_cb, &ppp_on_NtQuerySymbolicLinkObject_return_num_cb },
+/* 166 */ { &ppp_on_NtQuerySystemEnvironmentValue_enter_num_cb, &ppp_on_NtQuerySystemEnvironmentValue_return_num_cb },
+/* 167 */ { &ppp_on_NtQuerySystemEnvironmentValueEx_enter_num_cb, &ppp_on_NtQuerySystemEnvironmentValueEx_return_num_cb },
+/* 168 */ { &ppp_on_NtQuerySystemInformation_enter_num_cb, &ppp_on_NtQuerySystemInformation_return_num_cb },
+/* 169 */ { &ppp_on_NtQuerySystemTime_enter_num_cb, &ppp_on_NtQuerySystemTime_return_num_cb },
+/* 170 */ { &ppp_on_NtQueryTimer_enter_num_cb, &ppp_on_NtQueryTimer_return_num_cb },
+/* 171 */ { &ppp_on_NtQueryTimerResolution_enter_num_cb, &ppp_on_NtQueryTimerResolution_return_num_cb },
+/* 172 */ { &ppp_on_NtQueryValueKey_enter_num_cb, &ppp_on_NtQueryValueKey_return_num_cb },
+/* 173 */ { &ppp_on_NtQueryVirtualMemory_enter_num_cb, &ppp_on_NtQueryVirtualMemory_return_num_cb },
+/* 174 */ { &ppp_on_NtQueryVolumeInformationFile_enter_num_cb, &ppp_on_NtQueryVolumeInformationFile_return_num_cb },
+/* 175 */ { &ppp_on_NtQueueApcThread_enter_num_cb, &ppp_on_NtQueueApcThread_return_num_cb },
+/* 176 */ { &ppp_on_NtRaiseException_enter_num_cb, &ppp_on_NtRaiseException_return_num_cb },
+/* 177 */ { &ppp_on_NtRaiseHardError_enter_num_cb, &ppp_on_NtRaiseHardError_return_num_cb },
+/* 178 */ { &ppp_on_NtReadFile_enter_num_cb, &ppp_on_NtReadFile_return_num_cb },
+/* 179 */ { &ppp_on_NtReadFileScatter_enter_num_cb, &ppp_on_NtReadFileScatter_return_num_cb },
+/* 180 */ { &ppp_on_NtReadRequestData_enter_num_cb, &ppp_on_NtReadRequestData_return_num_cb },
+/* 181 */ { &ppp_on_NtReadVirtualMemory_enter_num_cb, &ppp_on_NtReadVirtualMemory_return_num_cb },
+/* 182 */ { &ppp_on_NtRegisterThreadTerminatePort_enter_num_cb, &ppp_on_NtRegisterThreadTerminatePort_return_num_cb },
+/* 183 */ { &ppp_on_NtReleaseMutant_enter_num_cb, &ppp_on_NtReleaseMutant_return_num_cb },
+/* 184 */ { &ppp_on_NtReleaseSemaphore_enter_num_cb, &ppp_on_NtReleaseSemaphore_return_num_cb },
+/* 185 */ { &ppp_on_NtRemoveIoCompletion_enter_num_cb, &ppp_on_NtRemoveIoCompletion_return_num_cb },
+/* 186 */ { &ppp_on_NtRemoveProcessDebug_enter_num_cb, &ppp_on_NtRemoveProcessDebug_return_num_cb },
+/* 187 */ { &ppp_on_NtRenameKey_enter_num_cb, &ppp_on_NtRenameKey_return_num_cb },
+/* 188 */ { &ppp_on_NtReplaceKey_enter_num_cb, &ppp_on_NtReplaceKey_return_num_cb },
+/* 189 */ { &ppp_on_NtReplyPort_enter_num_cb, &ppp_on_NtReplyPort_return_num_cb },
+/* 190 */ { &ppp_on_NtReplyWaitReceivePort_enter_num_cb, &ppp_on_NtReplyWaitReceivePort_return_num_cb },
+/* 191 */ { &ppp_on_NtReplyWaitReceivePortEx_enter_num_cb, &ppp_on_NtReplyWaitReceivePortEx_return_num_cb },
+/* 192 */ { &ppp_on_NtReplyWaitReplyPort_enter_num_cb, &ppp_on_NtReplyWaitReplyPort_return_num_cb },
+/* 193 */ { NULL, NULL },
+/* 194 */ { &ppp_on_NtRequestPort_enter_num_cb, &ppp_on_NtRequestPort_return_num_cb },
+/* 195 */ { &ppp_on_NtRequestWaitReplyPort_enter_num_cb, &ppp_on_NtRequestWaitReplyPort_return_num_cb },
+/* 196 */ { NULL, NULL },
+/* 197 */ { &ppp_on_NtResetEvent_enter_num_cb, &ppp_on_NtResetEvent_return_num_cb },
+/* 198 */ { &ppp_on_NtResetWriteWatch_enter_num_cb, &ppp_on_NtResetWriteWatch_return_num_cb },
+/* 199 */ { &ppp_on_NtRestoreKey_enter_num_cb, &ppp_on_NtRestoreKey_return_num_cb },
+/* 200 */ { &ppp_on_NtResumeProcess_enter_num_cb, &ppp_on_NtResumeProcess_return_num_cb },
+/* 201 */ { &ppp_on_NtResumeThread_enter_num_cb, &ppp_on_NtResumeThread_return_num_cb },
+/* 202 */ { &ppp_on_NtSaveKey_enter_num_cb, &ppp_on_NtSaveKey_return_num_cb },
+/* 203 */ { &ppp_on_NtSaveKeyEx_enter_num_cb, &ppp_on_NtSaveKeyEx_return_num_cb },
+/* 204 */ { &ppp_on_NtSaveMergedKeys_enter_num_cb, &ppp_on_NtSaveMergedKeys_return_num_cb },
+/* 205 */ { &ppp_on_NtSecureConnectPort_enter_num_cb, &ppp_on_NtSecureConnectPort_return_num_cb },
+/* 206 */ { &ppp_on_NtSetContextThread_enter_num_cb, &ppp_on_NtSetContextThread_return_num_cb },
+/* 207 */ { &ppp_on_NtSetDebugFilterState_enter_num_cb, &ppp_on_NtSetDebugFilterState_return_num_cb },
+/* 208 */ { &ppp_on_NtSetDefaultHardErrorPort_enter_num_cb, &ppp_on_NtSetDefaultHardErrorPort_return_num_cb },
+/* 209 */ { &ppp_on_NtSetDefaultLocale_enter_num_cb, &ppp_on_NtSetDefaultLocale_return_num_cb },
+/* 210 */ { &ppp_on_NtSetDefaultUILanguage_enter_num_cb, &ppp_on_NtSetDefaultUILanguage_return_num_cb },
+/* 211 */ { &ppp_on_NtSetEaFile_enter_num_cb, &ppp_on_NtSetEaFile_return_num_cb },
+/* 212 */ { &ppp_on_NtSetEvent_enter_num_cb, &ppp_on_NtSetEvent_return_num_cb },
+/* 213 */ { &ppp_on_NtSetEventBoostPriority_enter_num_cb, &ppp_on_NtSetEventBoostPriority_return_num_cb },
+/* 214 */ { &ppp_on_NtSetHighEventPair_enter_num_cb, &ppp_on_NtSetHighEventPair_return_num_cb },
+/* 215 */ { &ppp_on_NtSetHighWaitLowEventPair_enter_num_cb, &ppp_on_NtSetHighWaitLowEventPair_return_num_cb },
+/* 216 */ { &ppp_on_NtSetInformationDebugObject_enter_num_cb, &ppp_on_NtSetInformationDebugObject_return_num_cb },
+/* 217 */ { &ppp_on_NtSetInformationFile_enter_num_cb, &ppp_on_NtSetInformationFile_return_num_cb },
+/* 218 */ { &ppp_on_NtSetInformationJobObject_enter_num_cb, &ppp_on_NtSetInformationJobObject_return_num_cb },
+/* 219 */ { &ppp_on_NtSetInformationKey_enter_num_cb, &ppp_on_NtSetInformationKey_return_num_cb },
+/* 220 */ { &ppp_on_NtSetInformationObject_enter_num_cb, &ppp_on_NtSetInformationObject_return_num_cb },
+/* 221 */ { &ppp_on_NtSetInformationProcess_enter_num_cb, &ppp_on_NtSetInformationProcess_return_num_cb },
+/* 222 */ { &ppp_on_NtSetInformationThread_enter_num_cb, &ppp_on_NtSetInformationThread_return_num_cb },
+/* 223 */ { &ppp_on_NtSetInformationToken_enter_num_cb, &ppp_on_NtSetInformationToken_return_num_cb },
+/* 224 */ { &ppp_on_NtSetIntervalProfile_enter_num_cb, &ppp_on_NtSetIntervalProfile_return_num_cb },
+/* 225 */ { &ppp_on_NtSetIoCompletion_enter_num_cb, &ppp_on_NtSetIoCompletion_return_num_cb },
+/* 226 */ { &ppp_on_NtSetLdtEntries_enter_num_cb, &ppp_on_NtSetLdtEntries_return_num_cb },
+/* 227 */ { &ppp_on_NtSetLowEventPair_enter_num_cb, &ppp_on_NtSetLowEventPair_return_num_cb },
+/* 228 */ { &ppp_on_NtSetLowWaitHighEventPair_enter_num_cb, &ppp_on_NtSetLowWaitHighEventPair_return_num_cb },
+/* 229 */ { &ppp_on_NtSetQuotaInformationFile_enter_num_cb, &ppp_on_NtSetQuotaInformationFile_return_num_cb },
+/* 230 */ { &ppp_on_NtSetSecurityObject_enter_num_cb, &ppp_on_NtSetSecurityObject_return_num_cb },
+/* 231 */ { &ppp_on_NtSetSystemEnvironmentValue_enter_num_cb, &ppp_on_NtSetSystemEnvironmentValue_return_num_cb },
+/* 232 */ { &ppp_on_NtSetSystemInformation_enter_num_cb, &ppp_on_NtSetSystemInformation_return_num_cb },
+/* 233 */ { &ppp_on_NtSetSystemPowerState_enter_num_cb, &ppp_on_NtSetSystemPowerState_return_num_cb },
+/* 234 */ { &ppp_on_NtSetSystemTime_enter_num_cb, &ppp_on_NtSetSystemTime_return_num_cb },
+/* 235 */ { &ppp_on_NtSetThreadExecutionState_enter_num_cb, &ppp_on_NtSetThreadExecutionState_return_num_cb },
+/* 236 */ { &ppp_on_NtSetTimer_enter_num_cb, &ppp_on_NtSetTimer_return_num_cb },
+/* 237 */ { &ppp_on_NtSetTimerResolution_enter_num_cb, &ppp_on_NtSetTimerResolution_return_num_cb },
+/* 238 */ { &ppp_on_NtSetUuidSeed_enter_num_cb, &ppp_on_NtSetUuidSeed_return_num_cb },
+/* 239 */ { &ppp_on_NtSetValueKey_enter_num_cb, &ppp_on_NtSetValueKey_return_num_cb },
+/* 240 */ { &ppp_on_NtSetVolumeInformationFile_enter_num_cb, &ppp_on_NtSetVolumeInformationFile_return_num_cb },
+/* 241 */ { &ppp_on_NtShutdownSystem_enter_num_cb, &ppp_on_NtShutdownSystem_return_num_cb },
+/* 242 */ { &ppp_on_NtSignalAndWaitForSingleObject_enter_num_cb, &ppp_on_NtSignalAndWaitForSingleObject_return_num_cb },
+/* 243 */ { &ppp_on_NtStartProfile_enter_num_cb, &ppp_on_NtStartProfile_return_num_cb },
+/* 244 */ { &ppp_on_NtStopProfile_enter_num_cb, &ppp_on_NtStopProfile_return_num_cb },
+/* 245 */ { &ppp_on_NtSuspendProcess_enter_num_cb, &ppp_on_NtSuspendProcess_return_num_cb },
+/* 246 */ { &ppp_on_NtSuspendThread_enter_num_cb, &ppp_on_NtSuspendThread_return_num_cb },
+/* 247 */ { &ppp_on_NtSystemDebugControl_enter_num_cb, &ppp_on_NtSystemDebugControl_return_num_cb },
+/* 248 */ { &ppp_on_NtTerminateJobObject_enter_num_cb, &ppp_on_NtTerminateJobObject_return_num_cb },
+/* 249 */ { &ppp_on_NtTerminateProcess_enter_num_cb, &ppp_on_NtTerminateProcess_return_num_cb },
+/* 250 */ { &ppp_on_NtTerminateThread_enter_num_cb, &ppp_on_NtTerminateThread_return_num_cb },
+/* 251 */ { &ppp_on_NtTestAlert_enter_num_cb, &ppp_on_NtTestAlert_return_num_cb },
+/* 252 */ { &ppp_on_NtTraceEvent_enter_num_cb, &ppp_on_NtTraceEvent_return_num_cb },
+/* 253 */ { &ppp_on_NtTranslateFilePath_enter_num_cb, &ppp_on_NtTranslateFilePath_return_num_cb },
+/* 254 */ { &ppp_on_NtUnloadDriver_enter_num_cb, &ppp_on_NtUnloadDriver_return_num_cb },
+/* 255 */ { &ppp_on_NtUnloadKey_enter_num_cb, &ppp_on_NtUnloadKey_return_num_cb },
+/* 256 */ { &ppp_on_NtUnloadKeyEx_enter_num_cb, &ppp_on_NtUnloadKeyEx_return_num_cb },
+/* 257 */ { &ppp_on_NtUnlockFile_enter_num_cb, &ppp_on_NtUnlockFile_return_num_cb },
+/* 258 */ { &ppp_on_NtUnlockVirtualMemory_enter_num_cb, &ppp_on_NtUnlockVirtualMemory_return_num_cb },
+/* 259 */ { &ppp_on_NtUnmapViewOfSection_enter_num_cb, &ppp_on_NtUnmapViewOfSection_return_num_cb },
+/* 260 */ { &ppp_on_NtVdmControl_enter_num_cb, &ppp_on_NtVdmControl_return_num_cb },
+/* 261 */ { &ppp_on_NtWaitForDebugEvent_enter_num_cb, &ppp_on_NtWaitForDebugEvent_return_num_cb },
+/* 262 */ { &ppp_on_NtWaitForMultipleObjects_enter_num_cb, &ppp_on_NtWaitForMultipleObjects_return_num_cb },
+/* 263 */ { &ppp_on_NtWaitForSingleObject_enter_num_cb, &ppp_on_NtWaitForSingleObject_return_num_cb },
+/* 264 */ { &ppp_on_NtWaitHighEventPair_enter_num_cb, &ppp_on_NtWaitHighEventPair_return_num_cb },
+/* 265 */ { &ppp_on_NtWaitLowEventPair_enter_num_cb, &ppp_on_NtWaitLowEventPair_return_num_cb },
+/* 266 */ { &ppp_on_NtWriteFile_enter_num_cb, &ppp_on_NtWriteFile_return_num_cb },
+/* 267 */ { &ppp_on_NtWriteFileGather_enter_num_cb, &ppp_on_NtWriteFileGather_return_num_cb },
+/* 268 */ { &ppp_on_NtWriteRequestData_enter_num_cb, &ppp_on_NtWriteRequestData_return_num_cb },
+/* 269 */ { &ppp_on_NtWriteVirtualMemory_enter_num_cb, &ppp_on_NtWriteVirtualMemory_return_num_cb },
+/* 270 */ { &ppp_on_NtYieldExecution_enter_num_cb, &ppp_on_NtYieldExecution_return_num_cb },
+/* 271 */ { &ppp_on_NtCreateKeyedEvent_enter_num_cb, &ppp_on_NtCreateKeyedEvent_return_num_cb },
+/* 272 */ { &ppp_on_NtOpenKeyedEvent_enter_num_cb, &ppp_on_NtOpenKeyedEvent_return_num_cb },
+/* 273 */ { &ppp_on_NtReleaseKeyedEvent_enter_num_cb, &ppp_on_NtReleaseKeyedEvent_return_num_cb },
+/* 274 */ { &ppp_on_NtWaitForKeyedEvent_enter_num_cb, &ppp_on_NtWaitForKeyedEvent_return_num_cb },
+/* 275 */ { &ppp_on_NtQueryPortInformationProcess_enter_num_cb, &ppp_on_NtQueryPortInformationProcess_return_num_cb },
+};
+#endif
+
 void syscall_enter_switch_windowsxp_sp3_x86 ( CPUState *cpu, target_ulong pc ) {  // osarch
 #ifdef TARGET_I386                                          // GUARD
     CPUArchState *env = (CPUArchState*)cpu->env_ptr;
+    target_ulong callno = env->regs[R_EAX];                        // CALLNO
     ReturnPoint rp;
-    rp.ordinal = env->regs[R_EAX];                        // CALLNO
-    rp.proc_id = panda_current_asid(cpu);
-    rp.retaddr = calc_retaddr(cpu, pc);
-    switch( env->regs[R_EAX] ) {                          // CALLNO
+    // Calls past the end of the table are left to the switch
+    bool known = true, want_enter = true, want_return = true;
+    if (callno < ARRAY_SIZE(syscall_subscribers_windowsxp_sp3_x86)) {   // osarch
+        const SyscallSubscribers &subs = syscall_subscribers_windowsxp_sp3_x86[callno];
+        known = subs.enter != NULL;
+        want_enter = known && *subs.enter > 0;
+        want_return = known && *subs.ret > 0;
+    }
+    // Only decode the arguments of calls somebody is listening for
+    if (want_enter || want_return || !known) {
+    switch( callno ) {
 // 0 NTSTATUS NtAcceptConnectPort ['PHANDLE PortHandle', ' PVOID PortContext', ' PPORT_MESSAGE ConnectionRequest', ' BOOLEAN AcceptConnection', ' PPORT_VIEW ServerView', ' PREMOTE_PORT_VIEW ClientView']
 case 0: {
 uint32_t arg0 = get_32(cpu, 0);
@@ -3878,9 +4167,17 @@ if (PPP_CHECK_CB(on_NtQueryPortInformationProcess_return)) {
 PPP_RUN_CB(on_NtQueryPortInformationProcess_enter, cpu,pc) ; 
 }; break;
 default:
-PPP_RUN_CB(on_unknown_sys_enter, cpu, pc, env->regs[R_EAX]);
+known = false;
+PPP_RUN_CB(on_unknown_sys_enter, cpu, pc, callno);
+}
+}
+PPP_RUN_CB(on_all_sys_enter, cpu, pc, callno);
+if (want_return || PPP_CHECK_CB(on_all_sys_return) ||
+        (!known && PPP_CHECK_CB(on_unknown_sys_return))) {
+rp.ordinal = callno;
+rp.proc_id = panda_current_asid(cpu);
+rp.retaddr = calc_retaddr(cpu, pc);
+appendReturnPoint(cpu, rp);
 }
-PPP_RUN_CB(on_all_sys_enter, cpu, pc, env->regs[R_EAX]);
-appendReturnPoint(rp);
 #endif
  } 
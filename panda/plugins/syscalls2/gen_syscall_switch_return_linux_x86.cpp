@@ -7,12 +7,373 @@
 
 extern "C" {
 #include "gen_syscalls_ext_typedefs.h"
+#include "gen_syscall_ppp_extern_enter.h"
 #include "gen_syscall_ppp_extern_return.h"
 }
 
+#ifdef TARGET_I386                                          // GUARD
+static const SyscallSubscribers syscall_subscribers_linux_x86[] = {
+/* 0 */ { &ppp_on_sys_restart_syscall_enter_num_cb, &ppp_on_sys_restart_syscall_return_num_cb },
+/* 1 */ { &ppp_on_sys_exit_enter_num_cb, &ppp_on_sys_exit_return_num_cb },
+/* 2 */ { &ppp_on_sys_fork_enter_num_cb, &ppp_on_sys_fork_return_num_cb },
+/* 3 */ { &ppp_on_sys_read_enter_num_cb, &ppp_on_sys_read_return_num_cb },
+/* 4 */ { &ppp_on_sys_write_enter_num_cb, &ppp_on_sys_write_return_num_cb },
+/* 5 */ { &ppp_on_sys_open_enter_num_cb, &ppp_on_sys_open_return_num_cb },
+/* 6 */ { &ppp_on_sys_close_enter_num_cb, &ppp_on_sys_close_return_num_cb },
+/* 7 */ { &ppp_on_sys_waitpid_enter_num_cb, &ppp_on_sys_waitpid_return_num_cb },
+/* 8 */ { &ppp_on_sys_creat_enter_num_cb, &ppp_on_sys_creat_return_num_cb },
+/* 9 */ { &ppp_on_sys_link_enter_num_cb, &ppp_on_sys_link_return_num_cb },
+/* 10 */ { &ppp_on_sys_unlink_enter_num_cb, &ppp_on_sys_unlink_return_num_cb },
+/* 11 */ { &ppp_on_sys_execve_enter_num_cb, &ppp_on_sys_execve_return_num_cb },
+/* 12 */ { &ppp_on_sys_chdir_enter_num_cb, &ppp_on_sys_chdir_return_num_cb },
+/* 13 */ { &ppp_on_sys_time_enter_num_cb, &ppp_on_sys_time_return_num_cb },
+/* 14 */ { &ppp_on_sys_mknod_enter_num_cb, &ppp_on_sys_mknod_return_num_cb },
+/* 15 */ { &ppp_on_sys_chmod_enter_num_cb, &ppp_on_sys_chmod_return_num_cb },
+/* 16 */ { &ppp_on_sys_lchown16_enter_num_cb, &ppp_on_sys_lchown16_return_num_cb },
+/* 17 */ { NULL, NULL },
+/* 18 */ { &ppp_on_sys_stat_enter_num_cb, &ppp_on_sys_stat_return_num_cb },
+/* 19 */ { &ppp_on_sys_lseek_enter_num_cb, &ppp_on_sys_lseek_return_num_cb },
+/* 20 */ { &ppp_on_sys_getpid_enter_num_cb, &ppp_on_sys_getpid_return_num_cb },
+/* 21 */ { &ppp_on_sys_mount_enter_num_cb, &ppp_on_sys_mount_return_num_cb },
+/* 22 */ { &ppp_on_sys_oldumount_enter_num_cb, &ppp_on_sys_oldumount_return_num_cb },
+/* 23 */ { &ppp_on_sys_setuid16_enter_num_cb, &ppp_on_sys_setuid16_return_num_cb },
+/* 24 */ { &ppp_on_sys_getuid16_enter_num_cb, &ppp_on_sys_getuid16_return_num_cb },
+/* 25 */ { &ppp_on_sys_stime_enter_num_cb, &ppp_on_sys_stime_return_num_cb },
+/* 26 */ { &ppp_on_sys_ptrace_enter_num_cb, &ppp_on_sys_ptrace_return_num_cb },
+/* 27 */ { &ppp_on_sys_alarm_enter_num_cb, &ppp_on_sys_alarm_return_num_cb },
+/* 28 */ { &ppp_on_sys_fstat_enter_num_cb, &ppp_on_sys_fstat_return_num_cb },
+/* 29 */ { &ppp_on_sys_pause_enter_num_cb, &ppp_on_sys_pause_return_num_cb },
+/* 30 */ { &ppp_on_sys_utime_enter_num_cb, &ppp_on_sys_utime_return_num_cb },
+/* 31 */ { NULL, NULL },
+/* 32 */ { NULL, NULL },
+/* 33 */ { &ppp_on_sys_access_enter_num_cb, &ppp_on_sys_access_return_num_cb },
+/* 34 */ { &ppp_on_sys_nice_enter_num_cb, &ppp_on_sys_nice_return_num_cb },
+/* 35 */ { NULL, NULL },
+/* 36 */ { &ppp_on_sys_sync_enter_num_cb, &ppp_on_sys_sync_return_num_cb },
+/* 37 */ { &ppp_on_sys_kill_enter_num_cb, &ppp_on_sys_kill_return_num_cb },
+/* 38 */ { &ppp_on_sys_rename_enter_num_cb, &ppp_on_sys_rename_return_num_cb },
+/* 39 */ { &ppp_on_sys_mkdir_enter_num_cb, &ppp_on_sys_mkdir_return_num_cb },
+/* 40 */ { &ppp_on_sys_rmdir_enter_num_cb, &ppp_on_sys_rmdir_return_num_cb },
+/* 41 */ { &ppp_on_sys_dup_enter_num_cb, &ppp_on_sys_dup_return_num_cb },
+/* 42 */ { &ppp_on_sys_pipe_enter_num_cb, &ppp_on_sys_pipe_return_num_cb },
+/* 43 */ { &ppp_on_sys_times_enter_num_cb, &ppp_on_sys_times_return_num_cb },
+/* 44 */ { NULL, NULL },
+/* 45 */ { &ppp_on_sys_brk_enter_num_cb, &ppp_on_sys_brk_return_num_cb },
+/* 46 */ { &ppp_on_sys_setgid16_enter_num_cb, &ppp_on_sys_setgid16_return_num_cb },
+/* 47 */ { &ppp_on_sys_getgid16_enter_num_cb, &ppp_on_sys_getgid16_return_num_cb },
+/* 48 */ { &ppp_on_sys_signal_enter_num_cb, &ppp_on_sys_signal_return_num_cb },
+/* 49 */ { &ppp_on_sys_geteuid16_enter_num_cb, &ppp_on_sys_geteuid16_return_num_cb },
+/* 50 */ { &ppp_on_sys_getegid16_enter_num_cb, &ppp_on_sys_getegid16_return_num_cb },
+/* 51 */ { &ppp_on_sys_acct_enter_num_cb, &ppp_on_sys_acct_return_num_cb },
+/* 52 */ { &ppp_on_sys_umount_enter_num_cb, &ppp_on_sys_umount_return_num_cb },
+/* 53 */ { NULL, NULL },
+/* 54 */ { &ppp_on_sys_ioctl_enter_num_cb, &ppp_on_sys_ioctl_return_num_cb },
+/* 55 */ { &ppp_on_sys_fcntl_enter_num_cb, &ppp_on_sys_fcntl_return_num_cb },
+/* 56 */ { NULL, NULL },
+/* 57 */ { &ppp_on_sys_setpgid_enter_num_cb, &ppp_on_sys_setpgid_return_num_cb },
+/* 58 */ { NULL, NULL },
+/* 59 */ { &ppp_on_sys_olduname_enter_num_cb, &ppp_on_sys_olduname_return_num_cb },
+/* 60 */ { &ppp_on_sys_umask_enter_num_cb, &ppp_on_sys_umask_return_num_cb },
+/* 61 */ { &ppp_on_sys_chroot_enter_num_cb, &ppp_on_sys_chroot_return_num_cb },
+/* 62 */ { &ppp_on_sys_ustat_enter_num_cb, &ppp_on_sys_ustat_return_num_cb },
+/* 63 */ { &ppp_on_sys_dup2_enter_num_cb, &ppp_on_sys_dup2_return_num_cb },
+/* 64 */ { &ppp_on_sys_getppid_enter_num_cb, &ppp_on_sys_getppid_return_num_cb },
+/* 65 */ { &ppp_on_sys_getpgrp_enter_num_cb, &ppp_on_sys_getpgrp_return_num_cb },
+/* 66 */ { &ppp_on_sys_setsid_enter_num_cb, &ppp_on_sys_setsid_return_num_cb },
+/* 67 */ { &ppp_on_sigaction_enter_num_cb, &ppp_on_sigaction_return_num_cb },
+/* 68 */ { &ppp_on_sys_sgetmask_enter_num_cb, &ppp_on_sys_sgetmask_return_num_cb },
+/* 69 */ { &ppp_on_sys_ssetmask_enter_num_cb, &ppp_on_sys_ssetmask_return_num_cb },
+/* 70 */ { &ppp_on_sys_setreuid16_enter_num_cb, &ppp_on_sys_setreuid16_return_num_cb },
+/* 71 */ { &ppp_on_sys_setregid16_enter_num_cb, &ppp_on_sys_setregid16_return_num_cb },
+/* 72 */ { &ppp_on_sigsuspend_enter_num_cb, &ppp_on_sigsuspend_return_num_cb },
+/* 73 */ { &ppp_on_sys_sigpending_enter_num_cb, &ppp_on_sys_sigpending_return_num_cb },
+/* 74 */ { &ppp_on_sys_sethostname_enter_num_cb, &ppp_on_sys_sethostname_return_num_cb },
+/* 75 */ { &ppp_on_sys_setrlimit_enter_num_cb, &ppp_on_sys_setrlimit_return_num_cb },
+/* 76 */ { &ppp_on_sys_old_getrlimit_enter_num_cb, &ppp_on_sys_old_getrlimit_return_num_cb },
+/* 77 */ { &ppp_on_sys_getrusage_enter_num_cb, &ppp_on_sys_getrusage_return_num_cb },
+/* 78 */ { &ppp_on_sys_gettimeofday_enter_num_cb, &ppp_on_sys_gettimeofday_return_num_cb },
+/* 79 */ { &ppp_on_sys_settimeofday_enter_num_cb, &ppp_on_sys_settimeofday_return_num_cb },
+/* 80 */ { &ppp_on_sys_getgroups16_enter_num_cb, &ppp_on_sys_getgroups16_return_num_cb },
+/* 81 */ { &ppp_on_sys_setgroups16_enter_num_cb, &ppp_on_sys_setgroups16_return_num_cb },
+/* 82 */ { &ppp_on_sys_old_select_enter_num_cb, &ppp_on_sys_old_select_return_num_cb },
+/* 83 */ { &ppp_on_sys_symlink_enter_num_cb, &ppp_on_sys_symlink_return_num_cb },
+/* 84 */ { &ppp_on_sys_lstat_enter_num_cb, &ppp_on_sys_lstat_return_num_cb },
+/* 85 */ { &ppp_on_sys_readlink_enter_num_cb, &ppp_on_sys_readlink_return_num_cb },
+/* 86 */ { &ppp_on_sys_uselib_enter_num_cb, &ppp_on_sys_uselib_return_num_cb },
+/* 87 */ { &ppp_on_sys_swapon_enter_num_cb, &ppp_on_sys_swapon_return_num_cb },
+/* 88 */ { &ppp_on_sys_reboot_enter_num_cb, &ppp_on_sys_reboot_return_num_cb },
+/* 89 */ { &ppp_on_sys_old_readdir_enter_num_cb, &ppp_on_sys_old_readdir_return_num_cb },
+/* 90 */ { &ppp_on_sys_old_mmap_enter_num_cb, &ppp_on_sys_old_mmap_return_num_cb },
+/* 91 */ { &ppp_on_sys_munmap_enter_num_cb, &ppp_on_sys_munmap_return_num_cb },
+/* 92 */ { &ppp_on_sys_truncate_enter_num_cb, &ppp_on_sys_truncate_return_num_cb },
+/* 93 */ { &ppp_on_sys_ftruncate_enter_num_cb, &ppp_on_sys_ftruncate_return_num_cb },
+/* 94 */ { &ppp_on_sys_fchmod_enter_num_cb, &ppp_on_sys_fchmod_return_num_cb },
+/* 95 */ { &ppp_on_sys_fchown16_enter_num_cb, &ppp_on_sys_fchown16_return_num_cb },
+/* 96 */ { &ppp_on_sys_getpriority_enter_num_cb, &ppp_on_sys_getpriority_return_num_cb },
+/* 97 */ { &ppp_on_sys_setpriority_enter_num_cb, &ppp_on_sys_setpriority_return_num_cb },
+/* 98 */ { NULL, NULL },
+/* 99 */ { &ppp_on_sys_statfs_enter_num_cb, &ppp_on_sys_statfs_return_num_cb },
+/* 100 */ { &ppp_on_sys_fstatfs_enter_num_cb, &ppp_on_sys_fstatfs_return_num_cb },
+/* 101 */ { &ppp_on_sys_ioperm_enter_num_cb, &ppp_on_sys_ioperm_return_num_cb },
+/* 102 */ { &ppp_on_sys_socketcall_enter_num_cb, &ppp_on_sys_socketcall_return_num_cb },
+/* 103 */ { &ppp_on_sys_syslog_enter_num_cb, &ppp_on_sys_syslog_return_num_cb },
+/* 104 */ { &ppp_on_sys_setitimer_enter_num_cb, &ppp_on_sys_setitimer_return_num_cb },
+/* 105 */ { &ppp_on_sys_getitimer_enter_num_cb, &ppp_on_sys_getitimer_return_num_cb },
+/* 106 */ { &ppp_on_sys_newstat_enter_num_cb, &ppp_on_sys_newstat_return_num_cb },
+/* 107 */ { &ppp_on_sys_newlstat_enter_num_cb, &ppp_on_sys_newlstat_return_num_cb },
+/* 108 */ { &ppp_on_sys_newfstat_enter_num_cb, &ppp_on_sys_newfstat_return_num_cb },
+/* 109 */ { &ppp_on_sys_uname_enter_num_cb, &ppp_on_sys_uname_return_num_cb },
+/* 110 */ { &ppp_on_sys_iopl_enter_num_cb, &ppp_on_sys_iopl_return_num_cb },
+/* 111 */ { &ppp_on_sys_vhangup_enter_num_cb, &ppp_on_sys_vhangup_return_num_cb },
+/* 112 */ { NULL, NULL },
+/* 113 */ { &ppp_on_sys_vm86old_enter_num_cb, &ppp_on_sys_vm86old_return_num_cb },
+/* 114 */ { &ppp_on_sys_wait4_enter_num_cb, &ppp_on_sys_wait4_return_num_cb },
+/* 115 */ { &ppp_on_sys_swapoff_enter_num_cb, &ppp_on_sys_swapoff_return_num_cb },
+/* 116 */ { &ppp_on_sys_sysinfo_enter_num_cb, &ppp_on_sys_sysinfo_return_num_cb },
+/* 117 */ { &ppp_on_sys_ipc_enter_num_cb, &ppp_on_sys_ipc_return_num_cb },
+/* 118 */ { &ppp_on_sys_fsync_enter_num_cb, &ppp_on_sys_fsync_return_num_cb },
+/* 119 */ { &ppp_on_sys_sigreturn_enter_num_cb, &ppp_on_sys_sigreturn_return_num_cb },
+/* 120 */ { &ppp_on_sys_clone_enter_num_cb, &ppp_on_sys_clone_return_num_cb },
+/* 121 */ { &ppp_on_sys_setdomainname_enter_num_cb, &ppp_on_sys_setdomainname_return_num_cb },
+/* 122 */ { &ppp_on_sys_newuname_enter_num_cb, &ppp_on_sys_newuname_return_num_cb },
+/* 123 */ { &ppp_on_sys_modify_ldt_enter_num_cb, &ppp_on_sys_modify_ldt_return_num_cb },
+/* 124 */ { &ppp_on_sys_adjtimex_enter_num_cb, &ppp_on_sys_adjtimex_return_num_cb },
+/* 125 */ { &ppp_on_sys_mprotect_enter_num_cb, &ppp_on_sys_mprotect_return_num_cb },
+/* 126 */ { &ppp_on_sys_sigprocmask_enter_num_cb, &ppp_on_sys_sigprocmask_return_num_cb },
+/* 127 */ { NULL, NULL },
+/* 128 */ { &ppp_on_sys_init_module_enter_num_cb, &ppp_on_sys_init_module_return_num_cb },
+/* 129 */ { &ppp_on_sys_delete_module_enter_num_cb, &ppp_on_sys_delete_module_return_num_cb },
+/* 130 */ { NULL, NULL },
+/* 131 */ { &ppp_on_sys_quotactl_enter_num_cb, &ppp_on_sys_quotactl_return_num_cb },
+/* 132 */ { &ppp_on_sys_getpgid_enter_num_cb, &ppp_on_sys_getpgid_return_num_cb },
+/* 133 */ { &ppp_on_sys_fchdir_enter_num_cb, &ppp_on_sys_fchdir_return_num_cb },
+/* 134 */ { &ppp_on_sys_bdflush_enter_num_cb, &ppp_on_sys_bdflush_return_num_cb },
+/* 135 */ { &ppp_on_sys_sysfs_enter_num_cb, &ppp_on_sys_sysfs_return_num_cb },
+/* 136 */ { &ppp_on_sys_personality_enter_num_cb, &ppp_on_sys_personality_return_num_cb },
+/* 137 */ { NULL, NULL },
+/* 138 */ { &ppp_on_sys_setfsuid16_enter_num_cb, &ppp_on_sys_setfsuid16_return_num_cb },
+/* 139 */ { &ppp_on_sys_setfsgid16_enter_num_cb, &ppp_on_sys_setfsgid16_return_num_cb },
+/* 140 */ { &ppp_on_sys_llseek_enter_num_cb, &ppp_on_sys_llseek_return_num_cb },
+/* 141 */ { &ppp_on_sys_getdents_enter_num_cb, &ppp_on_sys_getdents_return_num_cb },
+/* 142 */ { &ppp_on_sys_select_enter_num_cb, &ppp_on_sys_select_return_num_cb },
+/* 143 */ { &ppp_on_sys_flock_enter_num_cb, &ppp_on_sys_flock_return_num_cb },
+/* 144 */ { &ppp_on_sys_msync_enter_num_cb, &ppp_on_sys_msync_return_num_cb },
+/* 145 */ { &ppp_on_sys_readv_enter_num_cb, &ppp_on_sys_readv_return_num_cb },
+/* 146 */ { &ppp_on_sys_writev_enter_num_cb, &ppp_on_sys_writev_return_num_cb },
+/* 147 */ { &ppp_on_sys_getsid_enter_num_cb, &ppp_on_sys_getsid_return_num_cb },
+/* 148 */ { &ppp_on_sys_fdatasync_enter_num_cb, &ppp_on_sys_fdatasync_return_num_cb },
+/* 149 */ { &ppp_on_sys_sysctl_enter_num_cb, &ppp_on_sys_sysctl_return_num_cb },
+/* 150 */ { &ppp_on_sys_mlock_enter_num_cb, &ppp_on_sys_mlock_return_num_cb },
+/* 151 */ { &ppp_on_sys_munlock_enter_num_cb, &ppp_on_sys_munlock_return_num_cb },
+/* 152 */ { &ppp_on_sys_mlockall_enter_num_cb, &ppp_on_sys_mlockall_return_num_cb },
+/* 153 */ { &ppp_on_sys_munlockall_enter_num_cb, &ppp_on_sys_munlockall_return_num_cb },
+/* 154 */ { &ppp_on_sys_sched_setparam_enter_num_cb, &ppp_on_sys_sched_setparam_return_num_cb },
+/* 155 */ { &ppp_on_sys_sched_getparam_enter_num_cb, &ppp_on_sys_sched_getparam_return_num_cb },
+/* 156 */ { &ppp_on_sys_sched_setscheduler_enter_num_cb, &ppp_on_sys_sched_setscheduler_return_num_cb },
+/* 157 */ { &ppp_on_sys_sched_getscheduler_enter_num_cb, &ppp_on_sys_sched_getscheduler_return_num_cb },
+/* 158 */ { &ppp_on_sys_sched_yield_enter_num_cb, &ppp_on_sys_sched_yield_return_num_cb },
+/* 159 */ { &ppp_on_sys_sched_get_priority_max_enter_num_cb, &ppp_on_sys_sched_get_priority_max_return_num_cb },
+/* 160 */ { &ppp_on_sys_sched_get_priority_min_enter_num_cb, &ppp_on_sys_sched_get_priority_min_return_num_cb },
+/* 161 */ { &ppp_on_sys_sched_rr_get_interval_enter_num_cb, &ppp_on_sys_sched_rr_get_interval_return_num_cb },
+/* 162 */ { &ppp_on_sys_nanosleep_enter_num_cb, &ppp_on_sys_nanosleep_return_num_cb },
+/* 163 */ { &ppp_on_sys_mremap_enter_num_cb, &ppp_on_sys_mremap_return_num_cb },
+/* 164 */ { &ppp_on_sys_setresuid16_enter_num_cb, &ppp_on_sys_setresuid16_return_num_cb },
+/* 165 */ { &ppp_on_sys_getresuid16_enter_num_cb, &ppp_on_sys_getresuid16_return_num_cb },
+/* 166 */ { &ppp_on_sys_vm86_enter_num_cb, &ppp_on_sys_vm86_return_num_cb },
+/* 167 */ { NULL, NULL },
+/* 168 */ { &ppp_on_sys_poll_enter_num_cb, &ppp_on_sys_poll_return_num_cb },
+/* 169 */ { NULL, NULL },
+/* 170 */ { &ppp_on_sys_setresgid16_enter_num_cb, &ppp_on_sys_setresgid16_return_num_cb },
+/* 171 */ { &ppp_on_sys_getresgid16_enter_num_cb, &ppp_on_sys_getresgid16_return_num_cb },
+/* 172 */ { &ppp_on_sys_prctl_enter_num_cb, &ppp_on_sys_prctl_return_num_cb },
+/* 173 */ { &ppp_on_sys_rt_sigreturn_enter_num_cb, &ppp_on_sys_rt_sigreturn_return_num_cb },
+/* 174 */ { &ppp_on_rt_sigaction_enter_num_cb, &ppp_on_rt_sigaction_return_num_cb },
+/* 175 */ { &ppp_on_sys_rt_sigprocmask_enter_num_cb, &ppp_on_sys_rt_sigprocmask_return_num_cb },
+/* 176 */ { &ppp_on_sys_rt_sigpending_enter_num_cb, &ppp_on_sys_rt_sigpending_return_num_cb },
+/* 177 */ { &ppp_on_sys_rt_sigtimedwait_enter_num_cb, &ppp_on_sys_rt_sigtimedwait_return_num_cb },
+/* 178 */ { &ppp_on_sys_rt_sigqueueinfo_enter_num_cb, &ppp_on_sys_rt_sigqueueinfo_return_num_cb },
+/* 179 */ { &ppp_on_sys_rt_sigsuspend_enter_num_cb, &ppp_on_sys_rt_sigsuspend_return_num_cb },
+/* 180 */ { &ppp_on_sys_pread64_enter_num_cb, &ppp_on_sys_pread64_return_num_cb },
+/* 181 */ { &ppp_on_sys_pwrite64_enter_num_cb, &ppp_on_sys_pwrite64_return_num_cb },
+/* 182 */ { &ppp_on_sys_chown16_enter_num_cb, &ppp_on_sys_chown16_return_num_cb },
+/* 183 */ { &ppp_on_sys_getcwd_enter_num_cb, &ppp_on_sys_getcwd_return_num_cb },
+/* 184 */ { &ppp_on_sys_capget_enter_num_cb, &ppp_on_sys_capget_return_num_cb },
+/* 185 */ { &ppp_on_sys_capset_enter_num_cb, &ppp_on_sys_capset_return_num_cb },
+/* 186 */ { &ppp_on_sys_sigaltstack_enter_num_cb, &ppp_on_sys_sigaltstack_return_num_cb },
+/* 187 */ { &ppp_on_sys_sendfile_enter_num_cb, &ppp_on_sys_sendfile_return_num_cb },
+/* 188 */ { NULL, NULL },
+/* 189 */ { NULL, NULL },
+/* 190 */ { &ppp_on_sys_vfork_enter_num_cb, &ppp_on_sys_vfork_return_num_cb },
+/* 191 */ { &ppp_on_sys_getrlimit_enter_num_cb, &ppp_on_sys_getrlimit_return_num_cb },
+/* 192 */ { &ppp_on_sys_mmap_pgoff_enter_num_cb, &ppp_on_sys_mmap_pgoff_return_num_cb },
+/* 193 */ { &ppp_on_sys_truncate64_enter_num_cb, &ppp_on_sys_truncate64_return_num_cb },
+/* 194 */ { &ppp_on_sys_ftruncate64_enter_num_cb, &ppp_on_sys_ftruncate64_return_num_cb },
+/* 195 */ { &ppp_on_sys_stat64_enter_num_cb, &ppp_on_sys_stat64_return_num_cb },
+/* 196 */ { &ppp_on_sys_lstat64_enter_num_cb, &ppp_on_sys_lstat64_return_num_cb },
+/* 197 */ { &ppp_on_sys_fstat64_enter_num_cb, &ppp_on_sys_fstat64_return_num_cb },
+/* 198 */ { &ppp_on_sys_lchown_enter_num_cb, &ppp_on_sys_lchown_return_num_cb },
+/* 199 */ { &ppp_on_sys_getuid_enter_num_cb, &ppp_on_sys_getuid_return_num_cb },
+/* 200 */ { &ppp_on_sys_getgid_enter_num_cb, &ppp_on_sys_getgid_return_num_cb },
+/* 201 */ { &ppp_on_sys_geteuid_enter_num_cb, &ppp_on_sys_geteuid_return_num_cb },
+/* 202 */ { &ppp_on_sys_getegid_enter_num_cb, &ppp_on_sys_getegid_return_num_cb },
+/* 203 */ { &ppp_on_sys_setreuid_enter_num_cb, &ppp_on_sys_setreuid_return_num_cb },
+/* 204 */ { &ppp_on_sys_setregid_enter_num_cb, &ppp_on_sys_setregid_return_num_cb },
+/* 205 */ { &ppp_on_sys_getgroups_enter_num_cb, &ppp_on_sys_getgroups_return_num_cb },
+/* 206 */ { &ppp_on_sys_setgroups_enter_num_cb, &ppp_on_sys_setgroups_return_num_cb },
+/* 207 */ { &ppp_on_sys_fchown_enter_num_cb, &ppp_on_sys_fchown_return_num_cb },
+/* 208 */ { &ppp_on_sys_setresuid_enter_num_cb, &ppp_on_sys_setresuid_return_num_cb },
+/* 209 */ { &ppp_on_sys_getresuid_enter_num_cb, &ppp_on_sys_getresuid_return_num_cb },
+/* 210 */ { &ppp_on_sys_setresgid_enter_num_cb, &ppp_on_sys_setresgid_return_num_cb },
+/* 211 */ { &ppp_on_sys_getresgid_enter_num_cb, &ppp_on_sys_getresgid_return_num_cb },
+/* 212 */ { &ppp_on_sys_chown_enter_num_cb, &ppp_on_sys_chown_return_num_cb },
+/* 213 */ { &ppp_on_sys_setuid_enter_num_cb, &ppp_on_sys_setuid_return_num_cb },
+/* 214 */ { &ppp_on_sys_setgid_enter_num_cb, &ppp_on_sys_setgid_return_num_cb },
+/* 215 */ { &ppp_on_sys_setfsuid_enter_num_cb, &ppp_on_sys_setfsuid_return_num_cb },
+/* 216 */ { &ppp_on_sys_setfsgid_enter_num_cb, &ppp_on_sys_setfsgid_return_num_cb },
+/* 217 */ { &ppp_on_sys_pivot_root_enter_num_cb, &ppp_on_sys_pivot_root_return_num_cb },
+/* 218 */ { &ppp_on_sys_mincore_enter_num_cb, &ppp_on_sys_mincore_return_num_cb },
+/* 219 */ { &ppp_on_sys_madvise_enter_num_cb, &ppp_on_sys_madvise_return_num_cb },
+/* 220 */ { &ppp_on_sys_getdents64_enter_num_cb, &ppp_on_sys_getdents64_return_num_cb },
+/* 221 */ { &ppp_on_sys_fcntl64_enter_num_cb, &ppp_on_sys_fcntl64_return_num_cb },
+/* 222 */ { NULL, NULL },
+/* 223 */ { NULL, NULL },
+/* 224 */ { &ppp_on_sys_gettid_enter_num_cb, &ppp_on_sys_gettid_return_num_cb },
+/* 225 */ { &ppp_on_sys_readahead_enter_num_cb, &ppp_on_sys_readahead_return_num_cb },
+/* 226 */ { &ppp_on_sys_setxattr_enter_num_cb, &ppp_on_sys_setxattr_return_num_cb },
+/* 227 */ { &ppp_on_sys_lsetxattr_enter_num_cb, &ppp_on_sys_lsetxattr_return_num_cb },
+/* 228 */ { &ppp_on_sys_fsetxattr_enter_num_cb, &ppp_on_sys_fsetxattr_return_num_cb },
+/* 229 */ { &ppp_on_sys_getxattr_enter_num_cb, &ppp_on_sys_getxattr_return_num_cb },
+/* 230 */ { &ppp_on_sys_lgetxattr_enter_num_cb, &ppp_on_sys_lgetxattr_return_num_cb },
+/* 231 */ { &ppp_on_sys_fgetxattr_enter_num_cb, &ppp_on_sys_fgetxattr_return_num_cb },
+/* 232 */ { &ppp_on_sys_listxattr_enter_num_cb, &ppp_on_sys_listxattr_return_num_cb },
+/* 233 */ { &ppp_on_sys_llistxattr_enter_num_cb, &ppp_on_sys_llistxattr_return_num_cb },
+/* 234 */ { &ppp_on_sys_flistxattr_enter_num_cb, &ppp_on_sys_flistxattr_return_num_cb },
+/* 235 */ { &ppp_on_sys_removexattr_enter_num_cb, &ppp_on_sys_removexattr_return_num_cb },
+/* 236 */ { &ppp_on_sys_lremovexattr_enter_num_cb, &ppp_on_sys_lremovexattr_return_num_cb },
+/* 237 */ { &ppp_on_sys_fremovexattr_enter_num_cb, &ppp_on_sys_fremovexattr_return_num_cb },
+/* 238 */ { &ppp_on_sys_tkill_enter_num_cb, &ppp_on_sys_tkill_return_num_cb },
+/* 239 */ { &ppp_on_sys_sendfile64_enter_num_cb, &ppp_on_sys_sendfile64_return_num_cb },
+/* 240 */ { &ppp_on_sys_futex_enter_num_cb, &ppp_on_sys_futex_return_num_cb },
+/* 241 */ { &ppp_on_sys_sched_setaffinity_enter_num_cb, &ppp_on_sys_sched_setaffinity_return_num_cb },
+/* 242 */ { &ppp_on_sys_sched_getaffinity_enter_num_cb, &ppp_on_sys_sched_getaffinity_return_num_cb },
+/* 243 */ { &ppp_on_set_thread_area_enter_num_cb, &ppp_on_set_thread_area_return_num_cb },
+/* 244 */ { &ppp_on_get_thread_area_enter_num_cb, &ppp_on_get_thread_area_return_num_cb },
+/* 245 */ { &ppp_on_sys_io_setup_enter_num_cb, &ppp_on_sys_io_setup_return_num_cb },
+/* 246 */ { &ppp_on_sys_io_destroy_enter_num_cb, &ppp_on_sys_io_destroy_return_num_cb },
+/* 247 */ { &ppp_on_sys_io_getevents_enter_num_cb, &ppp_on_sys_io_getevents_return_num_cb },
+/* 248 */ { &ppp_on_sys_io_submit_enter_num_cb, &ppp_on_sys_io_submit_return_num_cb },
+/* 249 */ { &ppp_on_sys_io_cancel_enter_num_cb, &ppp_on_sys_io_cancel_return_num_cb },
+/* 250 */ { &ppp_on_sys_fadvise64_enter_num_cb, &ppp_on_sys_fadvise64_return_num_cb },
+/* 251 */ { NULL, NULL },
+/* 252 */ { &ppp_on_sys_exit_group_enter_num_cb, &ppp_on_sys_exit_group_return_num_cb },
+/* 253 */ { &ppp_on_sys_lookup_dcookie_enter_num_cb, &ppp_on_sys_lookup_dcookie_return_num_cb },
+/* 254 */ { &ppp_on_sys_epoll_create_enter_num_cb, &ppp_on_sys_epoll_create_return_num_cb },
+/* 255 */ { &ppp_on_sys_epoll_ctl_enter_num_cb, &ppp_on_sys_epoll_ctl_return_num_cb },
+/* 256 */ { &ppp_on_sys_epoll_wait_enter_num_cb, &ppp_on_sys_epoll_wait_return_num_cb },
+/* 257 */ { &ppp_on_sys_remap_file_pages_enter_num_cb, &ppp_on_sys_remap_file_pages_return_num_cb },
+/* 258 */ { &ppp_on_sys_set_tid_address_enter_num_cb, &ppp_on_sys_set_tid_address_return_num_cb },
+/* 259 */ { &ppp_on_sys_timer_create_enter_num_cb, &ppp_on_sys_timer_create_return_num_cb },
+/* 260 */ { &ppp_on_sys_timer_settime_enter_num_cb, &ppp_on_sys_timer_settime_return_num_cb },
+/* 261 */ { &ppp_on_sys_timer_gettime_enter_num_cb, &ppp_on_sys_timer_gettime_return_num_cb },
+/* 262 */ { &ppp_on_sys_timer_getoverrun_enter_num_cb, &ppp_on_sys_timer_getoverrun_return_num_cb },
+/* 263 */ { &ppp_on_sys_timer_delete_enter_num_cb, &ppp_on_sys_timer_delete_return_num_cb },
+/* 264 */ { &ppp_on_sys_clock_settime_enter_num_cb, &ppp_on_sys_clock_settime_return_num_cb },
+/* 265 */ { &ppp_on_sys_clock_gettime_enter_num_cb, &ppp_on_sys_clock_gettime_return_num_cb },
+/* 266 */ { &ppp_on_sys_clock_getres_enter_num_cb, &ppp_on_sys_clock_getres_return_num_cb },
+/* 267 */ { &ppp_on_sys_clock_nanosleep_enter_num_cb, &ppp_on_sys_clock_nanosleep_return_num_cb },
+/* 268 */ { &ppp_on_sys_statfs64_enter_num_cb, &ppp_on_sys_statfs64_return_num_cb },
+/* 269 */ { &ppp_on_sys_fstatfs64_enter_num_cb, &ppp_on_sys_fstatfs64_return_num_cb },
+/* 270 */ { &ppp_on_sys_tgkill_enter_num_cb, &ppp_on_sys_tgkill_return_num_cb },
+/* 271 */ { &ppp_on_sys_utimes_enter_num_cb, &ppp_on_sys_utimes_return_num_cb },
+/* 272 */ { &ppp_on_sys_fadvise64_64_enter_num_cb, &ppp_on_sys_fadvise64_64_return_num_cb },
+/* 273 */ { NULL, NULL },
+/* 274 */ { &ppp_on_sys_mbind_enter_num_cb, &ppp_on_sys_mbind_return_num_cb },
+/* 275 */ { &ppp_on_sys_get_mempolicy_enter_num_cb, &ppp_on_sys_get_mempolicy_return_num_cb },
+/* 276 */ { &ppp_on_sys_set_mempolicy_enter_num_cb, &ppp_on_sys_set_mempolicy_return_num_cb },
+/* 277 */ { &ppp_on_sys_mq_open_enter_num_cb, &ppp_on_sys_mq_open_return_num_cb },
+/* 278 */ { &ppp_on_sys_mq_unlink_enter_num_cb, &ppp_on_sys_mq_unlink_return_num_cb },
+/* 279 */ { &ppp_on_sys_mq_timedsend_enter_num_cb, &ppp_on_sys_mq_timedsend_return_num_cb },
+/* 280 */ { &ppp_on_sys_mq_timedreceive_enter_num_cb, &ppp_on_sys_mq_timedreceive_return_num_cb },
+/* 281 */ { &ppp_on_sys_mq_notify_enter_num_cb, &ppp_on_sys_mq_notify_return_num_cb },
+/* 282 */ { &ppp_on_sys_mq_getsetattr_enter_num_cb, &ppp_on_sys_mq_getsetattr_return_num_cb },
+/* 283 */ { &ppp_on_sys_kexec_load_enter_num_cb, &ppp_on_sys_kexec_load_return_num_cb },
+/* 284 */ { &ppp_on_sys_waitid_enter_num_cb, &ppp_on_sys_waitid_return_num_cb },
+/* 285 */ { NULL, NULL },
+/* 286 */ { &ppp_on_sys_add_key_enter_num_cb, &ppp_on_sys_add_key_return_num_cb },
+/* 287 */ { &ppp_on_sys_request_key_enter_num_cb, &ppp_on_sys_request_key_return_num_cb },
+/* 288 */ { &ppp_on_sys_keyctl_enter_num_cb, &ppp_on_sys_keyctl_return_num_cb },
+/* 289 */ { &ppp_on_sys_ioprio_set_enter_num_cb, &ppp_on_sys_ioprio_set_return_num_cb },
+/* 290 */ { &ppp_on_sys_ioprio_get_enter_num_cb, &ppp_on_sys_ioprio_get_return_num_cb },
+/* 291 */ { &ppp_on_sys_inotify_init_enter_num_cb, &ppp_on_sys_inotify_init_return_num_cb },
+/* 292 */ { &ppp_on_sys_inotify_add_watch_enter_num_cb, &ppp_on_sys_inotify_add_watch_return_num_cb },
+/* 293 */ { &ppp_on_sys_inotify_rm_watch_enter_num_cb, &ppp_on_sys_inotify_rm_watch_return_num_cb },
+/* 294 */ { &ppp_on_sys_migrate_pages_enter_num_cb, &ppp_on_sys_migrate_pages_return_num_cb },
+/* 295 */ { &ppp_on_sys_openat_enter_num_cb, &ppp_on_sys_openat_return_num_cb },
+/* 296 */ { &ppp_on_sys_mkdirat_enter_num_cb, &ppp_on_sys_mkdirat_return_num_cb },
+/* 297 */ { &ppp_on_sys_mknodat_enter_num_cb, &ppp_on_sys_mknodat_return_num_cb },
+/* 298 */ { &ppp_on_sys_fchownat_enter_num_cb, &ppp_on_sys_fchownat_return_num_cb },
+/* 299 */ { &ppp_on_sys_futimesat_enter_num_cb, &ppp_on_sys_futimesat_return_num_cb },
+/* 300 */ { &ppp_on_sys_fstatat64_enter_num_cb, &ppp_on_sys_fstatat64_return_num_cb },
+/* 301 */ { &ppp_on_sys_unlinkat_enter_num_cb, &ppp_on_sys_unlinkat_return_num_cb },
+/* 302 */ { &ppp_on_sys_renameat_enter_num_cb, &ppp_on_sys_renameat_return_num_cb },
+/* 303 */ { &ppp_on_sys_linkat_enter_num_cb, &ppp_on_sys_linkat_return_num_cb },
+/* 304 */ { &ppp_on_sys_symlinkat_enter_num_cb, &ppp_on_sys_symlinkat_return_num_cb },
+/* 305 */ { &ppp_on_sys_readlinkat_enter_num_cb, &ppp_on_sys_readlinkat_return_num_cb },
+/* 306 */ { &ppp_on_sys_fchmodat_enter_num_cb, &ppp_on_sys_fchmodat_return_num_cb },
+/* 307 */ { &ppp_on_sys_faccessat_enter_num_cb, &ppp_on_sys_faccessat_return_num_cb },
+/* 308 */ { &ppp_on_sys_pselect6_enter_num_cb, &ppp_on_sys_pselect6_return_num_cb },
+/* 309 */ { &ppp_on_sys_ppoll_enter_num_cb, &ppp_on_sys_ppoll_return_num_cb },
+/* 310 */ { &ppp_on_sys_unshare_enter_num_cb, &ppp_on_sys_unshare_return_num_cb },
+/* 311 */ { &ppp_on_sys_set_robust_list_enter_num_cb, &ppp_on_sys_set_robust_list_return_num_cb },
+/* 312 */ { &ppp_on_sys_get_robust_list_enter_num_cb, &ppp_on_sys_get_robust_list_return_num_cb },
+/* 313 */ { &ppp_on_sys_splice_enter_num_cb, &ppp_on_sys_splice_return_num_cb },
+/* 314 */ { &ppp_on_sys_sync_file_range_enter_num_cb, &ppp_on_sys_sync_file_range_return_num_cb },
+/* 315 */ { &ppp_on_sys_tee_enter_num_cb, &ppp_on_sys_tee_return_num_cb },
+/* 316 */ { &ppp_on_sys_vmsplice_enter_num_cb, &ppp_on_sys_vmsplice_return_num_cb },
+/* 317 */ { &ppp_on_sys_move_pages_enter_num_cb, &ppp_on_sys_move_pages_return_num_cb },
+/* 318 */ { &ppp_on_sys_getcpu_enter_num_cb, &ppp_on_sys_getcpu_return_num_cb },
+/* 319 */ { &ppp_on_sys_epoll_pwait_enter_num_cb, &ppp_on_sys_epoll_pwait_return_num_cb },
+/* 320 */ { &ppp_on_sys_utimensat_enter_num_cb, &ppp_on_sys_utimensat_return_num_cb },
+/* 321 */ { &ppp_on_sys_signalfd_enter_num_cb, &ppp_on_sys_signalfd_return_num_cb },
+/* 322 */ { &ppp_on_sys_timerfd_create_enter_num_cb, &ppp_on_sys_timerfd_create_return_num_cb },
+/* 323 */ { &ppp_on_sys_eventfd_enter_num_cb, &ppp_on_sys_eventfd_return_num_cb },
+/* 324 */ { &ppp_on_sys_fallocate_enter_num_cb, &ppp_on_sys_fallocate_return_num_cb },
+/* 325 */ { &ppp_on_sys_timerfd_settime_enter_num_cb, &ppp_on_sys_timerfd_settime_return_num_cb },
+/* 326 */ { &ppp_on_sys_timerfd_gettime_enter_num_cb, &ppp_on_sys_timerfd_gettime_return_num_cb },
+/* 327 */ { &ppp_on_sys_signalfd4_enter_num_cb, &ppp_on_sys_signalfd4_return_num_cb },
+/* 328 */ { &ppp_on_sys_eventfd2_enter_num_cb, &ppp_on_sys_eventfd2_return_num_cb },
+/* 329 */ { &ppp_on_sys_epoll_create1_enter_num_cb, &ppp_on_sys_epoll_create1_return_num_cb },
+/* 330 */ { &ppp_on_sys_dup3_enter_num_cb, &ppp_on_sys_dup3_return_num_cb },
+/* 331 */ { &ppp_on_sys_pipe2_enter_num_cb, &ppp_on_sys_pipe2_return_num_cb },
+/* 332 */ { &ppp_on_sys_inotify_init1_enter_num_cb, &ppp_on_sys_inotify_init1_return_num_cb },
+/* 333 */ { &ppp_on_sys_preadv_enter_num_cb, &ppp_on_sys_preadv_return_num_cb },
+/* 334 */ { &ppp_on_sys_pwritev_enter_num_cb, &ppp_on_sys_pwritev_return_num_cb },
+/* 335 */ { &ppp_on_sys_rt_tgsigqueueinfo_enter_num_cb, &ppp_on_sys_rt_tgsigqueueinfo_return_num_cb },
+/* 336 */ { &ppp_on_sys_perf_event_open_enter_num_cb, &ppp_on_sys_perf_event_open_return_num_cb },
+/* 337 */ { &ppp_on_sys_recvmmsg_enter_num_cb, &ppp_on_sys_recvmmsg_return_num_cb },
+/* 338 */ { &ppp_on_sys_fanotify_init_enter_num_cb, &ppp_on_sys_fanotify_init_return_num_cb },
+/* 339 */ { &ppp_on_sys_fanotify_mark_enter_num_cb, &ppp_on_sys_fanotify_mark_return_num_cb },
+/* 340 */ { &ppp_on_sys_prlimit64_enter_num_cb, &ppp_on_sys_prlimit64_return_num_cb },
+/* 341 */ { &ppp_on_sys_name_to_handle_at_enter_num_cb, &ppp_on_sys_name_to_handle_at_return_num_cb },
+/* 342 */ { &ppp_on_sys_open_by_handle_at_enter_num_cb, &ppp_on_sys_open_by_handle_at_return_num_cb },
+/* 343 */ { &ppp_on_sys_clock_adjtime_enter_num_cb, &ppp_on_sys_clock_adjtime_return_num_cb },
+/* 344 */ { &ppp_on_sys_syncfs_enter_num_cb, &ppp_on_sys_syncfs_return_num_cb },
+/* 345 */ { &ppp_on_sys_sendmmsg_enter_num_cb, &ppp_on_sys_sendmmsg_return_num_cb },
+/* 346 */ { &ppp_on_sys_setns_enter_num_cb, &ppp_on_sys_setns_return_num_cb },
+/* 347 */ { &ppp_on_sys_process_vm_readv_enter_num_cb, &ppp_on_sys_process_vm_readv_return_num_cb },
+/* 348 */ { &ppp_on_sys_process_vm_writev_enter_num_cb, &ppp_on_sys_process_vm_writev_return_num_cb },
+};
+#endif
+
 void syscall_return_switch_linux_x86 ( CPUState *cpu, target_ulong pc, target_ulong ordinal, ReturnPoint &rp) {  // osarch
 #ifdef TARGET_I386                                          // GUARD
     CPUArchState *env = (CPUArchState*)cpu->env_ptr;
+    bool want_return = true;
+    if (ordinal < ARRAY_SIZE(syscall_subscribers_linux_x86)) {   // osarch
+        const SyscallSubscribers &subs = syscall_subscribers_linux_x86[ordinal];
+        want_return = subs.ret == NULL || *subs.ret > 0;
+    }
+    if (want_return) {
     switch( ordinal ) {                          // CALLNO
 // 0 long sys_restart_syscall ['void']
 case 0: {
@@ -3607,6 +3968,7 @@ PPP_RUN_CB(on_sys_process_vm_writev_return, cpu,pc,arg0,arg1,arg2,arg3,arg4,arg5
 default:
 PPP_RUN_CB(on_unknown_sys_return, cpu, pc, env->regs[R_EAX]);
 }
+}
 PPP_RUN_CB(on_all_sys_return, cpu, pc, env->regs[R_EAX]);
 #endif
  } 
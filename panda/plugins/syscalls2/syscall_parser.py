@@ -113,15 +113,27 @@ extern "C" {
 #include "gen_syscall_ppp_extern_return.h"
 }
 
+%s                                          // GUARD
+""" % GUARD
+
+    syscall_enter_switch_body = """
 void syscall_enter_switch_%s ( CPUState *cpu, target_ulong pc ) {  // osarch
 %s                                          // GUARD
     CPUArchState *env = (CPUArchState*)cpu->env_ptr;
+    target_ulong callno = %s;                        // CALLNO
     ReturnPoint rp;
-    rp.ordinal = %s;                        // CALLNO
-    rp.proc_id = panda_current_asid(cpu);
-    rp.retaddr = calc_retaddr(cpu, pc);
-    switch( %s ) {                          // CALLNO
-""" % (osarch, GUARD, CALLNO, CALLNO)
+    // Calls past the end of the table are left to the switch
+    bool known = true, want_enter = true, want_return = true;
+    if (callno < ARRAY_SIZE(syscall_subscribers_%s)) {   // osarch
+        const SyscallSubscribers &subs = syscall_subscribers_%s[callno];
+        known = subs.enter != NULL;
+        want_enter = known && *subs.enter > 0;
+        want_return = known && *subs.ret > 0;
+    }
+    // Only decode the arguments of calls somebody is listening for
+    if (want_enter || want_return || !known) {
+    switch( callno ) {
+""" % (osarch, GUARD, CALLNO, osarch, osarch)
 
 
     syscall_return_switch = """
@@ -133,15 +145,31 @@ void syscall_enter_switch_%s ( CPUState *cpu, target_ulong pc ) {  // osarch
 
 extern "C" {
 #include "gen_syscalls_ext_typedefs.h"
+#include "gen_syscall_ppp_extern_enter.h"
 #include "gen_syscall_ppp_extern_return.h"
 }
 
+%s                                          // GUARD
+""" % GUARD
+
+    syscall_return_switch_body = """
 void syscall_return_switch_%s ( CPUState *cpu, target_ulong pc, target_ulong ordinal, ReturnPoint &rp) {  // osarch
 %s                                          // GUARD
     CPUArchState *env = (CPUArchState*)cpu->env_ptr;
+    bool want_return = true;
+    if (ordinal < ARRAY_SIZE(syscall_subscribers_%s)) {   // osarch
+        const SyscallSubscribers &subs = syscall_subscribers_%s[ordinal];
+        want_return = subs.ret == NULL || *subs.ret > 0;
+    }
+    if (want_return) {
     switch( ordinal ) {                          // CALLNO
-""" % (osarch, GUARD)
+""" % (osarch, GUARD, osarch, osarch)
 
+    # Calls numbered below this get a slot in the subscriber table, which
+    # keeps it dense; ARM's private calls (0x9f0000 and up) go through the
+    # switch alone
+    TABLE_LIMIT = 0x10000
+    subscribers = {}
 
 
 
@@ -234,8 +262,10 @@ void syscall_return_switch_%s ( CPUState *cpu, target_ulong pc, target_ulong ord
             callname = fields.group(3)
             args = fields.group(4).split(',')
             arg_types = []
-            syscall_enter_switch += "// " + str(callno)+" "+ str(rettype)+" "+ str(callname)+" "+ str(args) + '\n'
-            syscall_return_switch += "// " + str(callno)+" "+ str(rettype)+" "+ str(callname)+" "+ str(args) + '\n'
+            syscall_enter_switch_body += "// " + str(callno)+" "+ str(rettype)+" "+ str(callname)+" "+ str(args) + '\n'
+            syscall_return_switch_body += "// " + str(callno)+" "+ str(rettype)+" "+ str(callname)+" "+ str(args) + '\n'
+            if int(callno) < TABLE_LIMIT:
+                subscribers[int(callno)] = callname
             for argno, arg in enumerate(args):
                 # the .split() can leave us with args = ['']
                 if arg == '':
@@ -277,25 +307,25 @@ void syscall_return_switch_%s ( CPUState *cpu, target_ulong pc, target_ulong ord
                     thisarg.type = BYTES_4
                     arg_types.append(thisarg)
 
-            syscall_enter_switch += "case " + callno + ": {\n"
-            syscall_return_switch += "case " + callno + ": {\n"
+            syscall_enter_switch_body += "case " + callno + ": {\n"
+            syscall_return_switch_body += "case " + callno + ": {\n"
             argno = 0
             for i, val in enumerate(arg_types):
                 arg_type = val.type
                 arg_name = val.name
                 if arg_type == CHAR_STAR:
-                    syscall_enter_switch += get_pointer(i)
+                    syscall_enter_switch_body += get_pointer(i)
                 elif arg_type == POINTER:
-                    syscall_enter_switch += get_pointer(i)
+                    syscall_enter_switch_body += get_pointer(i)
                 elif arg_type == BYTES_4:
-                    syscall_enter_switch += get_32(i)
+                    syscall_enter_switch_body += get_32(i)
                 elif arg_type == SIGNED_4:
-                    syscall_enter_switch += get_s32(i)
+                    syscall_enter_switch_body += get_s32(i)
                 elif arg_type == BYTES_8:
                     # alignment sadness. Linux tried to make sure none of these happen
                     if (argno % 2) == 1:
                         argno+= 1
-                    syscall_enter_switch += get_64(i)
+                    syscall_enter_switch_body += get_64(i)
                     argno+=1
                 argno+=1
 
@@ -317,34 +347,56 @@ void syscall_return_switch_%s ( CPUState *cpu, target_ulong pc, target_ulong ord
             # Marshal the args into the ReturnPoint for use at the return site
             # Note: not a typo; we want to check if anyone is listening for the
             # *return* before doing the memcpys in to the ReturnPoint
-            syscall_enter_switch += "if (PPP_CHECK_CB(on_{0}_return)) {{\n".format(callname)
+            syscall_enter_switch_body += "if (PPP_CHECK_CB(on_{0}_return)) {{\n".format(callname)
             for i, x in enumerate(arg_types):
-                syscall_enter_switch += "memcpy(rp.params[{0}], &arg{0}, sizeof({1}));\n".format(i, ARG_TYPE_C_TRANSLATIONS[x.type])
-            syscall_enter_switch += "}\n"
+                syscall_enter_switch_body += "memcpy(rp.params[{0}], &arg{0}, sizeof({1}));\n".format(i, ARG_TYPE_C_TRANSLATIONS[x.type])
+            syscall_enter_switch_body += "}\n"
             # Unmarshal the args from the ReturnPoint
             for i, x in enumerate(arg_types):
-                syscall_return_switch += "%s arg%d;\n" % (ARG_TYPE_C_TRANSLATIONS[x.type], i)
-            syscall_return_switch += "if (PPP_CHECK_CB(on_{0}_return)) {{\n".format(callname)
+                syscall_return_switch_body += "%s arg%d;\n" % (ARG_TYPE_C_TRANSLATIONS[x.type], i)
+            syscall_return_switch_body += "if (PPP_CHECK_CB(on_{0}_return)) {{\n".format(callname)
             for i, x in enumerate(arg_types):
-                syscall_return_switch += "memcpy(&arg%d, rp.params[%d], sizeof(%s));\n" % (i, i, ARG_TYPE_C_TRANSLATIONS[x.type])
-            syscall_return_switch += "}\n"
+                syscall_return_switch_body += "memcpy(&arg%d, rp.params[%d], sizeof(%s));\n" % (i, i, ARG_TYPE_C_TRANSLATIONS[x.type])
+            syscall_return_switch_body += "}\n"
             # prototype for the C++ callback (with arg types and names)
-            syscall_enter_switch += "PPP_RUN_CB(on_{0}_enter, {1}) ; \n".format(callname, _c_args)
-            syscall_enter_switch += "}; break;"+'\n'
-            syscall_return_switch += "PPP_RUN_CB(on_{0}_return, {1}) ; \n".format(callname, _c_args)
-            syscall_return_switch += "}; break;"+'\n'
+            syscall_enter_switch_body += "PPP_RUN_CB(on_{0}_enter, {1}) ; \n".format(callname, _c_args)
+            syscall_enter_switch_body += "}; break;"+'\n'
+            syscall_return_switch_body += "PPP_RUN_CB(on_{0}_return, {1}) ; \n".format(callname, _c_args)
+            syscall_return_switch_body += "}; break;"+'\n'
 
         # The "all" and "unknown" callbacks
-        syscall_enter_switch += "default:\n"
-        syscall_enter_switch += "PPP_RUN_CB(on_unknown_sys_enter, cpu, pc, %s);\n" % CALLNO
-        syscall_enter_switch += "}"+'\n'
-        syscall_enter_switch += "PPP_RUN_CB(on_all_sys_enter, cpu, pc, %s);\n" % CALLNO
-        syscall_enter_switch += "appendReturnPoint(rp);\n"
-
-        syscall_return_switch += "default:\n"
-        syscall_return_switch += "PPP_RUN_CB(on_unknown_sys_return, cpu, pc, %s);\n" % CALLNO
-        syscall_return_switch += "}"+'\n'
-        syscall_return_switch += "PPP_RUN_CB(on_all_sys_return, cpu, pc, %s);\n" % CALLNO
+        syscall_enter_switch_body += "default:\n"
+        syscall_enter_switch_body += "known = false;\n"
+        syscall_enter_switch_body += "PPP_RUN_CB(on_unknown_sys_enter, cpu, pc, callno);\n"
+        syscall_enter_switch_body += "}"+'\n'
+        syscall_enter_switch_body += "}"+'\n'
+        syscall_enter_switch_body += "PPP_RUN_CB(on_all_sys_enter, cpu, pc, callno);\n"
+        # Nothing will run at the return, so don't track it
+        syscall_enter_switch_body += "if (want_return || PPP_CHECK_CB(on_all_sys_return) ||\n"
+        syscall_enter_switch_body += "        (!known && PPP_CHECK_CB(on_unknown_sys_return))) {\n"
+        syscall_enter_switch_body += "rp.ordinal = callno;\n"
+        syscall_enter_switch_body += "rp.proc_id = panda_current_asid(cpu);\n"
+        syscall_enter_switch_body += "rp.retaddr = calc_retaddr(cpu, pc);\n"
+        syscall_enter_switch_body += "appendReturnPoint(cpu, rp);\n"
+        syscall_enter_switch_body += "}\n"
+
+        syscall_return_switch_body += "default:\n"
+        syscall_return_switch_body += "PPP_RUN_CB(on_unknown_sys_return, cpu, pc, %s);\n" % CALLNO
+        syscall_return_switch_body += "}"+'\n'
+        syscall_return_switch_body += "}"+'\n'
+        syscall_return_switch_body += "PPP_RUN_CB(on_all_sys_return, cpu, pc, %s);\n" % CALLNO
+
+    # Subscriber counts for each call, by number; the dispatch functions
+    # check these before decoding anything
+    table = "static const SyscallSubscribers syscall_subscribers_%s[] = {\n" % osarch
+    for no in range(max(subscribers) + 1):
+        if no in subscribers:
+            table += "/* %d */ { &ppp_on_%s_enter_num_cb, &ppp_on_%s_return_num_cb },\n" % (no, subscribers[no], subscribers[no])
+        else:
+            table += "/* %d */ { NULL, NULL },\n" % no
+    table += "};\n"
+    syscall_enter_switch += table + "#endif\n" + syscall_enter_switch_body
+    syscall_return_switch += table + "#endif\n" + syscall_return_switch_body
 
     syscall_return_switch += "#endif\n } \n"
     syscall_enter_switch += "#endif\n } \n"
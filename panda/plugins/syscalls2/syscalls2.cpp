@@ -23,6 +23,8 @@ PANDAENDCOMMENT */
 #include <string>
 #include <map>
 #include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include <algorithm>
 #include <memory>
 #include <vector>
@@ -380,34 +382,58 @@ void registerExecPreCallback(void (*callback)(CPUState*, target_ulong)){
     preExecCallbacks.push_back(callback);
 }
 
-// always return to same process
-static std::map < std::pair < target_ulong, target_ulong >, ReturnPoint > returns;
-
-void appendReturnPoint(ReturnPoint &rp){
-    returns[std::make_pair(rp.retaddr,rp.proc_id)] = rp;
+#if defined(TARGET_I386) || defined(TARGET_ARM)
+static target_ulong get_stack_pointer(CPUState *cpu) {
+    CPUArchState *env = (CPUArchState*)cpu->env_ptr;
+#if defined(TARGET_I386)
+    return env->regs[R_ESP];
+#else
+    return env->regs[13];
+#endif
 }
+#endif
 
+struct ReturnKeyHash {
+    size_t operator()(const std::pair<target_ulong, target_ulong> &k) const {
+        return std::hash<uint64_t>()(((uint64_t)k.first << 32) ^ k.second);
+    }
+};
 
-static int returned_check_callback(CPUState *cpu, TranslationBlock* tb){
-    // check if any of the internally tracked syscalls has returned
-    // only one should be at its return point for any given basic block
-    std::pair < target_ulong, target_ulong > ret_key = std::make_pair(tb->pc, panda_current_asid(cpu));
-    if (returns.count(ret_key) != 0) {
-        ReturnPoint &retVal = returns[ret_key];
-        syscalls_profile->return_switch(cpu, tb->pc, retVal.ordinal, retVal);
-        // used by remove_if to delete from returns list those values
-        // that have been processed
-        //        retVal.retaddr = retVal.proc_id = 0;
-        returns.erase(ret_key);
+// Pending returns, keyed on (asid, stack pointer at the call).  Every
+// supported calling convention comes back from the kernel with the stack
+// pointer it went in with, so this tells apart threads of one process
+// sitting in the same call, which keying on the return address can't.
+static std::unordered_map < std::pair < target_ulong, target_ulong >, ReturnPoint, ReturnKeyHash > returns;
+
+// Every return address a call has been recorded for.  translate_callback
+// instruments just these instructions, so nothing is checked anywhere else.
+static std::unordered_set < target_ulong > return_pcs;
+
+void appendReturnPoint(CPUState *cpu, ReturnPoint &rp){
+    returns[std::make_pair(rp.proc_id, get_stack_pointer(cpu))] = rp;
+    if (return_pcs.insert(rp.retaddr).second) {
+        // A block at the return address may already have been translated
+        // without the check; have it retranslated
+        panda_invalidate_single_tb(cpu, rp.retaddr);
     }
+}
 
-    return false;
+static void returned_check(CPUState *cpu, target_ulong pc){
+    auto it = returns.find(std::make_pair(panda_current_asid(cpu), get_stack_pointer(cpu)));
+    if (it != returns.end() && it->second.retaddr == pc) {
+        ReturnPoint retVal = it->second;
+        returns.erase(it);
+        syscalls_profile->return_switch(cpu, pc, retVal.ordinal, retVal);
+    }
 }
 
 
 // This will only be called for instructions where the
 // translate_callback returned true
 int exec_callback(CPUState *cpu, target_ulong pc) {
+    if (return_pcs.count(pc) != 0) {
+        returned_check(cpu, pc);
+    }
     // check if pc, asid pair was for a valid syscall translation point
     // if so run exec_callback
     if (syscallPCpoints.end() != syscallPCpoints.find(std::make_pair(pc, panda_current_asid(cpu)))){
@@ -422,7 +448,7 @@ int exec_callback(CPUState *cpu, target_ulong pc) {
 
 // Check if the instruction is sysenter (0F 34),
 // syscall (0F 05) or int 0x80 (CD 80)
-bool translate_callback(CPUState *cpu, target_ulong pc) {
+static bool translate_syscall_insn(CPUState *cpu, target_ulong pc) {
 #if defined(TARGET_I386)
     unsigned char buf[2] = {};
     panda_virtual_memory_rw(cpu, pc, buf, 2, 0);
@@ -475,6 +501,11 @@ bool translate_callback(CPUState *cpu, target_ulong pc) {
 #endif
 }
 
+bool translate_callback(CPUState *cpu, target_ulong pc) {
+    // not ||: translate_syscall_insn has to record syscall points
+    return translate_syscall_insn(cpu, pc) | (return_pcs.count(pc) != 0);
+}
+
 
 extern "C" {
 
@@ -557,10 +588,6 @@ bool init_plugin(void *self) {
     panda_register_callback(self, PANDA_CB_INSN_TRANSLATE, pcb);
     pcb.insn_exec = exec_callback;
     panda_register_callback(self, PANDA_CB_INSN_EXEC, pcb);
-    //    pcb.before_block_exec_invalidate_opt = returned_check_callback;
-    //   panda_register_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT, pcb);
-    pcb.before_block_exec = returned_check_callback;
-    panda_register_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC, pcb);
 #else
 
     fwrite(stderr,"The syscalls plugin is not currently supported on this platform.\n");
@@ -17,7 +17,7 @@ void syscall_enter_switch_windowsxp_sp3_x86 ( CPUState *env, target_ulong pc ) ;
 void syscall_enter_switch_windows7_x86 ( CPUState *env, target_ulong pc ) ;
 
 
-void appendReturnPoint(ReturnPoint& rp);
+void appendReturnPoint(CPUState *cpu, ReturnPoint& rp);
 
 
 #endif
@@ -41,6 +41,15 @@ struct ReturnPoint {
     uint8_t params[SYSCALL_MAX_ARGS][8];
 };
 
+// One entry per known system call in the generated dispatch tables: the
+// PPP callback counts for its enter and return callbacks, so a call nobody
+// is listening for can be skipped without decoding its arguments.  Both are
+// NULL for numbers the prototypes file doesn't have.
+struct SyscallSubscribers {
+    const int *enter;
+    const int *ret;
+};
+
 typedef void (*pre_exec_callback_t)(CPUState*, target_ulong);
 
 #endif
@@ -24,50 +24,187 @@ PANDAENDCOMMENT */
 
 #include <sys/mman.h>
 
+#include <algorithm>
+
 #include "defines.h"
 #include "fast_shad.h"
 
 #include <set>
 #include <string>
 
-typedef const std::set<uint32_t> *LabelSetP;
+uint8_t *FastShad::zero_page = NULL;
+bool FastShad::track_tcn = true;
+bool FastShad::track_cb = true;
+
+FastShad::FastShad(std::string name, uint64_t labelsets, bool paged)
+        : tcn_on(track_tcn), cb_on(track_cb), pages(NULL), page_taint(NULL),
+        tainted_pages(0), page_taint_events(0), _name(name) {
+    size = labelsets;
+
+    if (paged) {
+        uint64_t num_pages = (labelsets + FAST_SHAD_PAGE_SIZE - 1) >> FAST_SHAD_PAGE_BITS;
+        if (!zero_page) {
+            // big enough for any layout, and read-only, so a write that
+            // skipped alloc_page faults
+            size_t max_bytes = FAST_SHAD_PAGE_SIZE *
+                (sizeof(LabelSetP) + sizeof(uint32_t) + sizeof(TaintCB));
+            zero_page = (uint8_t *)mmap(NULL, max_bytes, PROT_READ,
+                    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+            assert(zero_page != (uint8_t *)MAP_FAILED);
+        }
+        printf("taint2: Allocating paged fast_shad (%" PRIu64 " pages of %lu bytes).\n",
+                num_pages, FAST_SHAD_PAGE_SIZE * entry_bytes());
+        pages = (uint8_t **)malloc(num_pages * sizeof(uint8_t *));
+        page_taint = (uint32_t *)calloc(num_pages, sizeof(uint32_t));
+        assert(pages && page_taint);
+        for (uint64_t i = 0; i < num_pages; i++) {
+            pages[i] = zero_page;
+        }
+        labels = orig_labels = NULL;
+        tcns = orig_tcns = NULL;
+        cbs = orig_cbs = NULL;
+        return;
+    }
 
-FastShad::FastShad(std::string name, uint64_t labelsets) : _name(name) {
-    uint64_t bytes = sizeof(TaintData) * labelsets;
+    uint64_t bytes = entry_bytes() * labelsets;
 
-    TaintData *array;
+    uint8_t *array;
     if (labelsets < (1UL << 24)) {
-        array = (TaintData *)malloc(bytes);
+        array = (uint8_t *)malloc(bytes);
         printf("taint2: Allocating small fast_shad (%" PRIu64 " bytes) using malloc @ %lx.\n",
                 bytes, (uint64_t)array);
         assert(array);
         memset(array, 0, bytes);
     } else {
         printf("taint2: Allocating large fast_shad (%lu bytes).\n", bytes);
-        array = (TaintData *)mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+        array = (uint8_t *)mmap(NULL, bytes, PROT_READ | PROT_WRITE,
                 MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB,
                 -1, 0);
-        if (array == (TaintData *)MAP_FAILED) {
+        if (array == (uint8_t *)MAP_FAILED) {
             printf("taint2: Hugetlb failed. Trying without.\n");
             // try without HUGETLB
-            array = (TaintData *)mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+            array = (uint8_t *)mmap(NULL, bytes, PROT_READ | PROT_WRITE,
                     MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
         }
-        if (array == (TaintData *)MAP_FAILED) {
+        if (array == (uint8_t *)MAP_FAILED) {
             puts(strerror(errno));
         }
     }
 
-    labels = array;
-    orig_labels = array;
-    size = labelsets;
+    columns(array, labelsets, &orig_labels, &orig_tcns, &orig_cbs);
+    reset_frame();
 }
 
 // release all memory associated with this fast_shad.
 FastShad::~FastShad() {
-    if (size < (1UL << 24)) {
+    if (pages) {
+        uint64_t num_pages = (size + FAST_SHAD_PAGE_SIZE - 1) >> FAST_SHAD_PAGE_BITS;
+        for (uint64_t i = 0; i < num_pages; i++) {
+            if (pages[i] != zero_page) free(pages[i]);
+        }
+        free(pages);
+        free(page_taint);
+    } else if (size < (1UL << 24)) {
         free(orig_labels);
     } else {
-        munmap(orig_labels, sizeof(TaintData) * size);
+        munmap(orig_labels, entry_bytes() * size);
+    }
+}
+
+// copy-on-write: give a page its own (still clean) storage
+void FastShad::alloc_page(uint64_t page) {
+    uint8_t *p = (uint8_t *)calloc(FAST_SHAD_PAGE_SIZE, entry_bytes());
+    assert(p);
+    pages[page] = p;
+    page_taint[page] = 0;
+}
+
+void FastShad::free_page(uint64_t page) {
+    free(pages[page]);
+    pages[page] = zero_page;
+    add_page_taint(page, -(int64_t)page_taint[page]);
+}
+
+void FastShad::remove_paged(uint64_t addr, uint64_t remove_size) {
+    while (remove_size > 0) {
+        uint64_t page = addr >> FAST_SHAD_PAGE_BITS;
+        uint64_t off = addr & FAST_SHAD_PAGE_MASK;
+        uint64_t n = std::min(remove_size, (uint64_t)FAST_SHAD_PAGE_SIZE - off);
+
+        if (pages[page] == zero_page) {
+            // already clean
+        } else if (n == FAST_SHAD_PAGE_SIZE) {
+            free_page(page);
+        } else {
+            LabelSetP *ls;
+            uint32_t *tcn;
+            TaintCB *cb;
+            columns(pages[page], FAST_SHAD_PAGE_SIZE, &ls, &tcn, &cb);
+            if (page_taint[page]) {
+                add_page_taint(page, -(int64_t)fast_shad_count_labels(ls + off, n));
+            }
+            if (!span_zero(cell(addr), n)) {
+                memset(ls + off, 0, n * sizeof(LabelSetP));
+                if (tcn) memset(tcn + off, 0, n * sizeof(uint32_t));
+                if (cb) memset(cb + off, 0, n * sizeof(TaintCB));
+            }
+        }
+        addr += n;
+        remove_size -= n;
+    }
+}
+
+// A span of the source that's all zero becomes a clear of the destination,
+// which for RAM is free on pages that were never written; anything else is
+// a block move per column.
+void FastShad::copy_spans(FastShad *shad_dest, uint64_t dest,
+        FastShad *shad_src, uint64_t src, uint64_t size) {
+    if (shad_dest == shad_src && src < dest && dest < src + size) {
+        // overlapping with the destination above: entry by entry from the
+        // top, as memmove would
+        for (uint64_t i = size; i-- > 0;) {
+            shad_dest->store(dest + i, shad_src->load(src + i));
+        }
+        return;
+    }
+    while (size > 0) {
+        uint64_t n = shad_dest->span_len(dest, shad_src->span_len(src, size));
+
+        if (shad_src->range_zero(src, n)) {
+            shad_dest->clear(dest, n);
+        } else {
+            TaintCell s = shad_src->cell(src);
+            TaintCell d = shad_dest->span_mut(dest);
+            int64_t before = shad_dest->pages ?
+                fast_shad_count_labels(d.ls, n) : 0;
+            memmove(d.ls, s.ls, n * sizeof(LabelSetP));
+            if (d.tcn) memmove(d.tcn, s.tcn, n * sizeof(uint32_t));
+            if (d.cb) memmove(d.cb, s.cb, n * sizeof(TaintCB));
+            if (shad_dest->pages) {
+                shad_dest->add_page_taint(dest >> FAST_SHAD_PAGE_BITS,
+                        fast_shad_count_labels(d.ls, n) - before);
+            }
+        }
+        dest += n;
+        src += n;
+        size -= n;
+    }
+}
+
+// td is not all zero
+void FastShad::fill_spans(uint64_t addr, uint64_t size, const TaintData &td) {
+    TaintCB cb = { td.cb_mask, td.one_mask, td.zero_mask };
+    while (size > 0) {
+        uint64_t n = span_len(addr, size);
+        TaintCell c = span_mut(addr);
+        if (pages) {
+            add_page_taint(addr >> FAST_SHAD_PAGE_BITS, (int64_t)(td.ls ? n : 0) -
+                    (int64_t)fast_shad_count_labels(c.ls, n));
+        }
+        std::fill(c.ls, c.ls + n, td.ls);
+        if (c.tcn) std::fill(c.tcn, c.tcn + n, td.tcn);
+        if (c.cb) std::fill(c.cb, c.cb + n, cb);
+        addr += n;
+        size -= n;
     }
 }
@@ -15,6 +15,7 @@ PANDAENDCOMMENT */
 #ifndef __FAST_SHAD_H
 #define __FAST_SHAD_H
 
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
 #include <string>
@@ -91,36 +92,345 @@ struct TaintData {
     }
 };
 
+// Controlled-bit state of one entry; see TaintData.
+struct TaintCB {
+    uint8_t cb_mask;
+    uint8_t one_mask;
+    uint8_t zero_mask;
+};
+
+// True if the bytes are all zero.  Written as a 64-byte-at-a-time OR
+// reduction so the compiler turns it into vector loads.
+static inline bool fast_shad_zero(const void *p, size_t bytes) {
+    const uint8_t *b = (const uint8_t *)p;
+    size_t i = 0;
+    for (; i + 64 <= bytes; i += 64) {
+        uint64_t w[8];
+        memcpy(w, b + i, sizeof(w));
+        if (w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) return false;
+    }
+    uint8_t acc = 0;
+    for (; i < bytes; i++) acc |= b[i];
+    return acc == 0;
+}
+
+// Number of non-NULL label sets among n.
+static inline uint64_t fast_shad_count_labels(const LabelSetP *ls, uint64_t n) {
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < n; i++) count += ls[i] != NULL;
+    return count;
+}
+
+// Paged shadows (guest RAM) are split into pages of this many entries.
+#define FAST_SHAD_PAGE_BITS 12
+#define FAST_SHAD_PAGE_SIZE (1UL << FAST_SHAD_PAGE_BITS)
+#define FAST_SHAD_PAGE_MASK (FAST_SHAD_PAGE_SIZE - 1)
+
+// Shadow storage is structure-of-arrays: a label set column, plus a tcn
+// column and a controlled-bit column only if those are tracked.  Untracked
+// fields read back as 0 and writes to them are dropped, so an analysis that
+// only wants label sets moves half the bytes.
 class FastShad {
 private:
-    TaintData *labels;
-    TaintData *orig_labels;
+    // Layout of a flat shadow's, or of each page's, storage: size entries of
+    // LabelSetP, then (if tracked) of uint32_t tcn, then of TaintCB.
+    bool tcn_on;
+    bool cb_on;
+
+    // Flat shadows are one block, addressed through these column pointers
+    // so that the LLVM shadow can move its frame pointer.
+    LabelSetP *labels;
+    uint32_t *tcns;
+    TaintCB *cbs;
+    LabelSetP *orig_labels;
+    uint32_t *orig_tcns;
+    TaintCB *orig_cbs;
+    // Paged shadows have NULL labels.  Each page is either private or the
+    // shared, read-only zero_page, which stands for a page that has never
+    // held anything; page_taint counts the labelled entries in each page.
+    uint8_t **pages;
+    uint32_t *page_taint;
+    uint64_t tainted_pages; // pages with a nonzero page_taint
+    uint64_t page_taint_events; // times a page_taint went from 0 to nonzero
+    static uint8_t *zero_page;
     uint64_t size; // Number of labelsets contained.
     std::string _name;
 
-    inline TaintData *get_td_p(uint64_t guest_addr) {
+    struct TaintCell {
+        LabelSetP *ls;
+        uint32_t *tcn; // NULL if not tracked
+        TaintCB *cb;   // ditto
+    };
+
+    // page_taint[page] += delta, keeping the page totals in step
+    inline void add_page_taint(uint64_t page, int64_t delta) {
+        uint32_t &count = page_taint[page];
+        if (delta == 0) return;
+        if (count == 0) {
+            tainted_pages++;
+            page_taint_events++;
+        }
+        count += delta;
+        if (count == 0) tainted_pages--;
+    }
+
+    inline size_t entry_bytes() const {
+        return sizeof(LabelSetP) + (tcn_on ? sizeof(uint32_t) : 0) +
+            (cb_on ? sizeof(TaintCB) : 0);
+    }
+
+    // column pointers into a block of n entries
+    inline void columns(uint8_t *block, uint64_t n, LabelSetP **ls, uint32_t **tcn,
+            TaintCB **cb) const {
+        *ls = (LabelSetP *)block;
+        block += n * sizeof(LabelSetP);
+        *tcn = tcn_on ? (uint32_t *)block : NULL;
+        block += tcn_on ? n * sizeof(uint32_t) : 0;
+        *cb = cb_on ? (TaintCB *)block : NULL;
+    }
+
+    // For reading; a never-written RAM entry reads as the zero page's.
+    inline TaintCell cell(uint64_t guest_addr) {
         //taint_log("  %lx->get_ls_p(%lx)\n", (uint64_t)this, guest_addr);
         tassert(guest_addr < size);
-        return &labels[guest_addr];
+        TaintCell c;
+        if (likely(!pages)) {
+            c.ls = labels + guest_addr;
+            c.tcn = tcns ? tcns + guest_addr : NULL;
+            c.cb = cbs ? cbs + guest_addr : NULL;
+            return c;
+        }
+        uint64_t off = guest_addr & FAST_SHAD_PAGE_MASK;
+        columns(pages[guest_addr >> FAST_SHAD_PAGE_BITS], FAST_SHAD_PAGE_SIZE,
+                &c.ls, &c.tcn, &c.cb);
+        c.ls += off;
+        if (c.tcn) c.tcn += off;
+        if (c.cb) c.cb += off;
+        return c;
+    }
+
+    // Entries from addr that are contiguous in storage: to the end of its
+    // page in a paged shadow.
+    inline uint64_t span_len(uint64_t addr, uint64_t size) {
+        if (likely(!pages)) return size;
+        return std::min(size, (uint64_t)FAST_SHAD_PAGE_SIZE - (addr & FAST_SHAD_PAGE_MASK));
+    }
+
+    // cell(addr) for writing a span: a paged shadow's page gets its own
+    // storage first
+    inline TaintCell span_mut(uint64_t addr) {
+        if (pages && pages[addr >> FAST_SHAD_PAGE_BITS] == zero_page) {
+            alloc_page(addr >> FAST_SHAD_PAGE_BITS);
+        }
+        return cell(addr);
+    }
+
+    inline bool span_zero(const TaintCell &c, uint64_t n) {
+        return fast_shad_zero(c.ls, n * sizeof(LabelSetP)) &&
+            (!c.tcn || fast_shad_zero(c.tcn, n * sizeof(uint32_t))) &&
+            (!c.cb || fast_shad_zero(c.cb, n * sizeof(TaintCB)));
+    }
+
+    // True if every field of every entry in the range is 0, i.e. clearing
+    // it would change nothing.
+    inline bool range_zero(uint64_t addr, uint64_t size) {
+        while (size > 0) {
+            uint64_t n = span_len(addr, size);
+            if (!pages || pages[addr >> FAST_SHAD_PAGE_BITS] != zero_page) {
+                if (!span_zero(cell(addr), n)) return false;
+            }
+            addr += n;
+            size -= n;
+        }
+        return true;
     }
 
-    inline bool range_tainted(uint64_t addr, uint64_t size) {
-        for (unsigned i = addr; i < addr+size; i++) {
-            if (get_td_p(i)->ls) return true;
+    inline void clear(uint64_t addr, uint64_t size) {
+        if (likely(!pages)) {
+            // skip the stores (and dirtying the cache) if already clean
+            if (range_zero(addr, size)) return;
+            memset(labels + addr, 0, size * sizeof(LabelSetP));
+            if (tcns) memset(tcns + addr, 0, size * sizeof(uint32_t));
+            if (cbs) memset(cbs + addr, 0, size * sizeof(TaintCB));
+        } else {
+            remove_paged(addr, size);
+        }
+    }
+
+    inline TaintData load(uint64_t guest_addr) {
+        TaintCell c = cell(guest_addr);
+        TaintData td;
+        td.ls = *c.ls;
+        if (c.tcn) td.tcn = *c.tcn;
+        if (c.cb) {
+            td.cb_mask = c.cb->cb_mask;
+            td.one_mask = c.cb->one_mask;
+            td.zero_mask = c.cb->zero_mask;
+        }
+        return td;
+    }
+
+    // td as it would read back after being stored
+    inline TaintData trim(TaintData td) const {
+        if (!tcn_on) td.tcn = 0;
+        if (!cb_on) td.cb_mask = td.one_mask = td.zero_mask = 0;
+        return td;
+    }
+
+    inline void store(uint64_t guest_addr, const TaintData &td) {
+        if (unlikely(pages != NULL)) {
+            uint64_t page = guest_addr >> FAST_SHAD_PAGE_BITS;
+            if (pages[page] == zero_page) {
+                if (trim(td) == TaintData()) return;
+                alloc_page(page);
+            }
+            add_page_taint(page, (int)(td.ls != NULL) - (int)(query(guest_addr) != NULL));
+        }
+        TaintCell c = cell(guest_addr);
+        *c.ls = td.ls;
+        if (c.tcn) *c.tcn = td.tcn;
+        if (c.cb) {
+            c.cb->cb_mask = td.cb_mask;
+            c.cb->one_mask = td.one_mask;
+            c.cb->zero_mask = td.zero_mask;
         }
-        return false;
     }
 
+    void alloc_page(uint64_t page);
+    void free_page(uint64_t page);
+    void remove_paged(uint64_t addr, uint64_t remove_size);
+    static void copy_spans(FastShad *shad_dest, uint64_t dest,
+            FastShad *shad_src, uint64_t src, uint64_t size);
+    void fill_spans(uint64_t addr, uint64_t size, const TaintData &td);
+
 public:
-    FastShad(std::string name, uint64_t size);
+    // Which optional columns shadows created from now on have.  Both are
+    // tracked unless taint2 is told otherwise.
+    static bool track_tcn;
+    static bool track_cb;
+
+    // A paged shadow only allocates the pages that are ever written, so it
+    // can cover a large guest's RAM.  It can't hold LLVM frames.
+    FastShad(std::string name, uint64_t size, bool paged = false);
     ~FastShad();
 
     uint64_t get_size() { return size; }
 
+    inline bool tracks_tcn() { return tcn_on; }
+    inline bool tracks_cb() { return cb_on; }
+
+    // Paged shadows only.  True if no entry has a label set.
+    inline bool clean() const {
+        tassert(pages);
+        return tainted_pages == 0;
+    }
+
+    // Paged shadows only.  True if no page overlapping the range has a
+    // label set anywhere in it: coarser than range_clean, but O(1) a page.
+    inline bool pages_clean(uint64_t addr, uint64_t size) {
+        tassert(pages);
+        if (size == 0 || addr >= this->size) return true;
+        uint64_t last = std::min(addr + size, this->size) - 1;
+        for (uint64_t page = addr >> FAST_SHAD_PAGE_BITS;
+                page <= last >> FAST_SHAD_PAGE_BITS; page++) {
+            if (page_taint[page]) return false;
+        }
+        return true;
+    }
+
+    // Paged shadows only.  Goes up each time a clean page gets a label, so
+    // a caller can tell whether any has since it last looked.
+    inline uint64_t get_page_taint_events() const {
+        return page_taint_events;
+    }
+
+    // True if no entry in the range has a label set; clean pages of a
+    // paged shadow are skipped without looking at them.
+    inline bool range_clean(uint64_t addr, uint64_t size) {
+        while (size > 0) {
+            uint64_t n = span_len(addr, size);
+            if (!pages || page_taint[addr >> FAST_SHAD_PAGE_BITS]) {
+                if (!fast_shad_zero(cell(addr).ls, n * sizeof(LabelSetP))) return false;
+            }
+            addr += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    // fn(addr, td) for each entry in the range that has a label set, in
+    // address order; clean pages of a paged shadow are skipped without
+    // looking at them.
+    template <typename F>
+    void for_each_tainted(uint64_t addr, uint64_t size, F fn) {
+        while (size > 0) {
+            uint64_t n = span_len(addr, size);
+            if (!pages || page_taint[addr >> FAST_SHAD_PAGE_BITS]) {
+                LabelSetP *ls = cell(addr).ls;
+                for (uint64_t i = 0; i < n; i++) {
+                    if (ls[i]) fn(addr + i, load(addr + i));
+                }
+            }
+            addr += n;
+            size -= n;
+        }
+    }
+
+    // fn(addr, n, td) for each run of n entries all holding the same td that
+    // isn't all zero, in address order.  Never-written pages of a paged
+    // shadow are skipped.  For saving the shadow.
+    template <typename F>
+    void for_each_run(F fn) {
+        uint64_t run_addr = 0, run_len = 0;
+        TaintData run_td;
+        for (uint64_t addr = 0; addr < size; ) {
+            uint64_t n = span_len(addr, size - addr);
+            if (pages && pages[addr >> FAST_SHAD_PAGE_BITS] == zero_page) {
+                addr += n;
+                continue;
+            }
+            for (uint64_t end = addr + n; addr < end; addr++) {
+                TaintData td = load(addr);
+                if (run_len && addr == run_addr + run_len && td == run_td) {
+                    run_len++;
+                    continue;
+                }
+                if (run_len && !(run_td == TaintData())) fn(run_addr, run_len, run_td);
+                run_addr = addr;
+                run_len = 1;
+                run_td = td;
+            }
+        }
+        if (run_len && !(run_td == TaintData())) fn(run_addr, run_len, run_td);
+    }
+
+    // Replace each label set held with fn(ls), for the label set collector.
+    // Tainted counts don't change, so no page bookkeeping is needed.
+    template <typename F>
+    void map_labels(F fn) {
+        if (!pages) {
+            for (uint64_t i = 0; i < size; i++) {
+                if (orig_labels[i]) orig_labels[i] = fn(orig_labels[i]);
+            }
+            return;
+        }
+        uint64_t num_pages = (size + FAST_SHAD_PAGE_SIZE - 1) >> FAST_SHAD_PAGE_BITS;
+        for (uint64_t page = 0; page < num_pages; page++) {
+            if (!page_taint[page]) continue;
+            LabelSetP *ls;
+            uint32_t *tcn;
+            TaintCB *cb;
+            columns(pages[page], FAST_SHAD_PAGE_SIZE, &ls, &tcn, &cb);
+            for (uint64_t i = 0; i < FAST_SHAD_PAGE_SIZE; i++) {
+                if (ls[i]) ls[i] = fn(ls[i]);
+            }
+        }
+    }
+
     // Taint an address with a labelset.
     inline void label(uint64_t addr, LabelSetP ls) {
         taint_log("LABEL: %s[%lx] (%p)\n", name(), addr, ls);
-        *get_td_p(addr) = TaintData(ls);
+        store(addr, TaintData(ls));
     }
 
     static inline void copy(FastShad *shad_dest, uint64_t dest, FastShad *shad_src, uint64_t src, uint64_t size) {
@@ -131,22 +441,36 @@ public:
         
 #ifdef TAINTDEBUG
         for (unsigned i = 0; i < size; i++) {
-            if (shad_src->get_td_p(src + i)->ls != NULL) {
+            if (shad_src->query(src + i) != NULL) {
                 taint_log("TAINTED_COPY: %s[%lx] <- %s[%lx] (%lx)\n",
                         shad_dest->name(), dest + i,
                         shad_src->name(), src + i,
-                        (uint64_t)shad_src->get_td_p(src + i)->ls);
+                        (uint64_t)shad_src->query(src + i));
                 break;
             }
         }
 #endif
 
         bool change = false;
-        if (track_taint_state && (shad_dest->range_tainted(dest, size) ||
-                    shad_src->range_tainted(src, size)))
+        if (track_taint_state && (!shad_dest->range_clean(dest, size) ||
+                    !shad_src->range_clean(src, size)))
             change = true;
 
-        memcpy(shad_dest->get_td_p(dest), shad_src->get_td_p(src), size * sizeof(TaintData));
+        if (likely(!shad_dest->pages && !shad_src->pages && size <= 16)) {
+            // all shadows are created with the same layout
+            memmove(shad_dest->labels + dest, shad_src->labels + src,
+                    size * sizeof(LabelSetP));
+            if (shad_dest->tcns) {
+                memmove(shad_dest->tcns + dest, shad_src->tcns + src,
+                        size * sizeof(uint32_t));
+            }
+            if (shad_dest->cbs) {
+                memmove(shad_dest->cbs + dest, shad_src->cbs + src,
+                        size * sizeof(TaintCB));
+            }
+        } else {
+            copy_spans(shad_dest, dest, shad_src, src, size);
+        }
 
         if (change) taint_state_changed(shad_dest, dest, size);
     }
@@ -158,7 +482,7 @@ public:
         
 #ifdef TAINTDEBUG
         for (unsigned i = 0; i < remove_size && remove_size < 64; i++) {
-            if (get_td_p(addr + i)->ls != NULL) {
+            if (query(addr + i) != NULL) {
                 taint_log("TAINTED_DELETE: %s[%lx+%lx]\n",
                         name(), addr, remove_size);
                 break;
@@ -167,50 +491,81 @@ public:
 #endif
 
         bool change = false;
-        if (track_taint_state && range_tainted(addr, remove_size))
+        if (track_taint_state && !range_clean(addr, remove_size))
             change = true;
-        memset(get_td_p(addr), 0, remove_size * sizeof(TaintData));
+        clear(addr, remove_size);
 
         if (change) taint_state_changed(this, addr, remove_size);
     }
 
     // Query. NULL if untainted.
     inline LabelSetP query(uint64_t addr) {
-        return get_td_p(addr)->ls;
+        return *cell(addr).ls;
     } 
 
     inline void reset_frame() {
         labels = orig_labels;
+        tcns = orig_tcns;
+        cbs = orig_cbs;
         //taint_log("reset: %lx\n", (uint64_t)labels);
     }
 
     inline void push_frame(uint64_t framesize) {
+        tassert(!pages);
         labels += framesize;
+        if (tcns) tcns += framesize;
+        if (cbs) cbs += framesize;
         tassert(labels < orig_labels + size);
         taint_log("push: %lx\n", (uint64_t)labels);
     }
 
     inline void pop_frame(uint64_t framesize) {
+        tassert(!pages);
         labels -= framesize;
+        if (tcns) tcns -= framesize;
+        if (cbs) cbs -= framesize;
         tassert(labels >= orig_labels);
         taint_log("pop: %lx\n", (uint64_t)labels);
     }
 
     inline TaintData query_full(uint64_t addr) {
-        return labels[addr];
+        return load(addr);
     }
 
     inline void set_full(uint64_t addr, TaintData td) {
         tassert(addr < size);
 
-        bool change = !(td == *get_td_p(addr));
-        labels[addr] = td;
+        bool change = !(trim(td) == load(addr));
+        store(addr, td);
 
         if (change) taint_state_changed(this, addr, 1);
     }
 
+    // set_full on each entry of the range, with one change notification
+    inline void fill(uint64_t addr, uint64_t size, TaintData td) {
+        tassert(addr + size <= this->size);
+        td = trim(td);
+        if (size == 1) {
+            set_full(addr, td);
+            return;
+        }
+
+        bool change = false;
+        if (td == TaintData()) {
+            change = !range_zero(addr, size);
+            if (change) clear(addr, size);
+        } else {
+            for (uint64_t i = 0; i < size && !change; i++) {
+                change = !(load(addr + i) == td);
+            }
+            if (change) fill_spans(addr, size, td);
+        }
+
+        if (change) taint_state_changed(this, addr, size);
+    }
+
     inline uint32_t query_tcn(uint64_t addr) {
-        return (query_full(addr)).tcn;
+        return tcn_on ? *cell(addr).tcn : 0;
     }
 
     inline const char *name() {
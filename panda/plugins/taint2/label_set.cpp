@@ -3,7 +3,10 @@ extern "C" {
 }
 
 #include <cassert>
+#include <cstring>
 
+#include <algorithm>
+#include <atomic>
 #include <map>
 #include <vector>
 #include <set>
@@ -13,112 +16,355 @@ extern "C" {
 
 #include "label_set.h"
 
-template<typename T>
+// Label set representation.  A set of at most LS_SMALL_MAX labels is just
+// its labels, sorted, stored inline after the header.  A bigger set is split,
+// roaring-bitmap style, into chunks by the high 16 bits of each label; a
+// chunk holding at most LS_ARRAY_MAX labels is a sorted array of their low
+// 16 bits, a fuller one is a 64K-bit bitmap.  Both sets and chunks are
+// hash-consed, so a chunk is shared by every set that contains it and the
+// union of two big sets only builds the chunks where they actually differ.
+//
+// Each distinct set has exactly one representation (small iff card <=
+// LS_SMALL_MAX, bitmap chunk iff chunk card > LS_ARRAY_MAX), which is what
+// lets equal sets be equal pointers.
+
+#define LS_SMALL_MAX 16
+#define LS_ARRAY_MAX 4096
+#define LS_BITMAP_WORDS (65536 / 64)
+
+struct LabelChunk {
+    uint64_t hash;
+    uint32_t card;
+    uint32_t is_bitmap;
+    // followed by uint16_t lows[card] or uint64_t bits[LS_BITMAP_WORDS]
+};
+
+struct LabelChunkRef {
+    uint64_t high;
+    const LabelChunk *chunk;
+};
+
+struct LabelSet {
+    uint64_t hash;
+    uint32_t card;
+    uint32_t n_chunks; // 0 for a small set
+    // followed by uint32_t labels[card] or LabelChunkRef chunks[n_chunks]
+};
+
+static inline const uint16_t *chunk_lows(const LabelChunk *c) {
+    return (const uint16_t *)(c + 1);
+}
+
+static inline const uint64_t *chunk_bits(const LabelChunk *c) {
+    return (const uint64_t *)(c + 1);
+}
+
+static inline size_t chunk_size(const LabelChunk *c) {
+    return sizeof(LabelChunk) + (c->is_bitmap ?
+            LS_BITMAP_WORDS * sizeof(uint64_t) : c->card * sizeof(uint16_t));
+}
+
+static inline const uint32_t *set_labels(const LabelSet *ls) {
+    return (const uint32_t *)(ls + 1);
+}
+
+static inline const LabelChunkRef *set_chunks(const LabelSet *ls) {
+    return (const LabelChunkRef *)(ls + 1);
+}
+
+static inline size_t set_size(const LabelSet *ls) {
+    return sizeof(LabelSet) + (ls->n_chunks ?
+            ls->n_chunks * sizeof(LabelChunkRef) : ls->card * sizeof(uint32_t));
+}
+
+static inline uint64_t ls_hash_mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static inline uint64_t ls_hash_combine(uint64_t h, uint64_t v) {
+    return ls_hash_mix(h ^ (v + 0x9e3779b97f4a7c15ULL));
+}
+
 class ArenaAlloc {
 private:
     uint8_t *next = NULL;
     std::vector<std::pair<uint8_t *, size_t>> blocks;
     size_t next_block_size = 1 << 15;
+    // read by the emulation thread while the shadow thread allocates
+    std::atomic<uint64_t> used;
 
-    void alloc_block() {
+    void alloc_block(size_t min_size) {
+        while (next_block_size < min_size) next_block_size <<= 1;
         //printf("taint2: allocating block of size %lu\n", next_block_size);
         next = (uint8_t *)mmap(NULL, next_block_size, PROT_READ | PROT_WRITE,
                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        assert(next);
+        assert(next != MAP_FAILED);
         blocks.push_back(std::make_pair(next, next_block_size));
         next_block_size <<= 1;
     }
 
-    T *alloc_imp() {
-        assert(blocks.size() > 0);
+public:
+    ArenaAlloc() : used(0) {
+        alloc_block(0);
+    }
+
+    // copy of the size bytes at src, 8-byte aligned
+    void *alloc(const void *src, size_t size) {
+        size = (size + 7) & ~(size_t)7;
         std::pair<uint8_t *, size_t>& block = blocks.back();
-        if (next + sizeof(T) > block.first + block.second) {
-            alloc_block();
-            assert(next != NULL);
+        if (next + size > block.first + block.second) {
+            alloc_block(size);
         }
 
-        T *result = new(next) T;
-        next += sizeof(T);
+        void *result = next;
+        memcpy(result, src, size);
+        next += size;
+        used.store(used.load(std::memory_order_relaxed) + size,
+                std::memory_order_relaxed);
         return result;
     }
 
-public:
-    ArenaAlloc() {
-        alloc_block();
+    uint64_t bytes_used() const { return used.load(std::memory_order_relaxed); }
+
+    ~ArenaAlloc() {
+        for (auto&& block : blocks) {
+            munmap(block.first, block.second);
+        }
     }
+};
+
+// Replaced by a fresh arena on each collection.
+static ArenaAlloc *LSA = new ArenaAlloc;
+
+// Interning tables, keyed by content.  Candidates are built in a scratch
+// buffer and only copied into the arena if they are new.
+template<typename T, size_t (*size_of)(const T *)>
+struct ContentHash {
+    size_t operator()(const T *x) const { return x->hash; }
+};
 
-    const T *alloc() {
-        return alloc_imp();
+template<typename T, size_t (*size_of)(const T *)>
+struct ContentEqual {
+    bool operator()(const T *a, const T *b) const {
+        size_t sa = size_of(a);
+        return a->hash == b->hash && sa == size_of(b) && memcmp(a, b, sa) == 0;
     }
+};
+
+template<typename T, size_t (*size_of)(const T *)>
+class Interner {
+    std::unordered_set<const T *, ContentHash<T, size_of>,
+        ContentEqual<T, size_of>> table;
 
-    const T *alloc(T &old) {
-        T *result = alloc_imp();
-        result->swap(old);
+public:
+    const T *intern(const T *candidate) {
+        auto it = table.find(candidate);
+        if (it != table.end()) return *it;
+        const T *result = (const T *)LSA->alloc(candidate, size_of(candidate));
+        table.insert(result);
         return result;
     }
 
-    ~ArenaAlloc() {
-        for (auto&& block : blocks) {
-            munmap(block.first, block.second);
-        }
+    void clear() {
+        decltype(table)().swap(table);
     }
+
+    size_t size() const { return table.size(); }
 };
 
-static ArenaAlloc<std::set<uint32_t>> LSA;
-
-namespace std {
-template<>
-class hash<set<uint32_t>> {
-  public:
-    size_t operator()(const set<uint32_t> &labels) const {
-        uint64_t result = 0;
-        for (uint32_t l : labels) {
-            result ^= l;
-            result = result << 11 | result >> 53;
+static Interner<LabelChunk, chunk_size> label_chunks;
+static Interner<LabelSet, set_size> label_sets;
+
+// scratch space holding one candidate object; uint64_t for alignment
+static std::vector<uint64_t> scratch;
+
+template<typename T>
+static T *scratch_obj(size_t size) {
+    scratch.assign((size + 7) / 8, 0);
+    return (T *)scratch.data();
+}
+
+static const LabelChunk *make_bitmap_chunk(const uint64_t *bits, uint32_t card) {
+    LabelChunk *c = scratch_obj<LabelChunk>(
+            sizeof(LabelChunk) + LS_BITMAP_WORDS * sizeof(uint64_t));
+    c->card = card;
+    c->is_bitmap = 1;
+    uint64_t h = 1;
+    uint64_t *dst = (uint64_t *)(c + 1);
+    for (unsigned i = 0; i < LS_BITMAP_WORDS; i++) {
+        dst[i] = bits[i];
+        if (bits[i]) h = ls_hash_combine(h, bits[i] ^ i);
+    }
+    c->hash = h;
+    return label_chunks.intern(c);
+}
+
+static const LabelChunk *make_array_chunk(const uint16_t *lows, uint32_t n) {
+    if (n > LS_ARRAY_MAX) {
+        uint64_t bits[LS_BITMAP_WORDS] = {};
+        for (uint32_t i = 0; i < n; i++) {
+            bits[lows[i] / 64] |= 1ULL << (lows[i] % 64);
         }
-        return result;
+        return make_bitmap_chunk(bits, n);
     }
-};
+    LabelChunk *c = scratch_obj<LabelChunk>(sizeof(LabelChunk) + n * sizeof(uint16_t));
+    c->card = n;
+    c->is_bitmap = 0;
+    uint64_t h = 0;
+    memcpy(c + 1, lows, n * sizeof(uint16_t));
+    for (uint32_t i = 0; i < n; i++) h = ls_hash_combine(h, lows[i]);
+    c->hash = h;
+    return label_chunks.intern(c);
+}
+
+static const LabelChunk *chunk_union(const LabelChunk *a, const LabelChunk *b) {
+    if (a == b) return a;
 
-template<>
-class hash<pair<LabelSetP, LabelSetP>> {
-  public:
-    size_t operator()(const pair<LabelSetP, LabelSetP> &labels) const {
-        return hash<LabelSetP>()(labels.first) ^
-            (hash<LabelSetP>()(labels.second) << (sizeof(LabelSetP) / 2));
+    if (!a->is_bitmap && !b->is_bitmap) {
+        std::vector<uint16_t> lows(a->card + b->card);
+        auto end = std::set_union(chunk_lows(a), chunk_lows(a) + a->card,
+                chunk_lows(b), chunk_lows(b) + b->card, lows.begin());
+        return make_array_chunk(lows.data(), end - lows.begin());
     }
-};
+
+    if (!a->is_bitmap) std::swap(a, b);
+    uint64_t bits[LS_BITMAP_WORDS];
+    uint32_t card = 0;
+    if (b->is_bitmap) {
+        for (unsigned i = 0; i < LS_BITMAP_WORDS; i++) {
+            bits[i] = chunk_bits(a)[i] | chunk_bits(b)[i];
+            card += __builtin_popcountll(bits[i]);
+        }
+    } else {
+        memcpy(bits, chunk_bits(a), sizeof(bits));
+        card = a->card;
+        for (uint32_t i = 0; i < b->card; i++) {
+            uint16_t low = chunk_lows(b)[i];
+            uint64_t bit = 1ULL << (low % 64);
+            card += !(bits[low / 64] & bit);
+            bits[low / 64] |= bit;
+        }
+    }
+    return make_bitmap_chunk(bits, card);
 }
 
-static std::unordered_set<std::set<uint32_t>> label_sets;
-LabelSetP label_set_union(LabelSetP ls1, LabelSetP ls2) {
-    static std::unordered_map<std::pair<LabelSetP, LabelSetP>, LabelSetP> memoized_unions;
+static LabelSetP make_small_set(const uint32_t *labels, uint32_t n) {
+    LabelSet *ls = scratch_obj<LabelSet>(sizeof(LabelSet) + n * sizeof(uint32_t));
+    ls->card = n;
+    ls->n_chunks = 0;
+    uint64_t h = 0;
+    memcpy(ls + 1, labels, n * sizeof(uint32_t));
+    for (uint32_t i = 0; i < n; i++) h = ls_hash_combine(h, labels[i]);
+    ls->hash = h;
+    return label_sets.intern(ls);
+}
+
+static LabelSetP make_chunked_set(const std::vector<LabelChunkRef> &refs, uint32_t card) {
+    LabelSet *ls = scratch_obj<LabelSet>(
+            sizeof(LabelSet) + refs.size() * sizeof(LabelChunkRef));
+    ls->card = card;
+    ls->n_chunks = refs.size();
+    uint64_t h = 1;
+    memcpy(ls + 1, refs.data(), refs.size() * sizeof(LabelChunkRef));
+    for (const LabelChunkRef &r : refs) {
+        h = ls_hash_combine(ls_hash_combine(h, r.high), r.chunk->hash);
+    }
+    ls->hash = h;
+    return label_sets.intern(ls);
+}
+
+// chunks of the sorted labels
+static void labels_to_chunks(const uint32_t *labels, uint32_t n,
+        std::vector<LabelChunkRef> &refs) {
+    std::vector<uint16_t> lows;
+    uint32_t i = 0;
+    while (i < n) {
+        uint32_t high = labels[i] >> 16;
+        lows.clear();
+        for (; i < n && labels[i] >> 16 == high; i++) {
+            lows.push_back(labels[i] & 0xffff);
+        }
+        refs.push_back({ high, make_array_chunk(lows.data(), lows.size()) });
+    }
+}
+
+static void set_to_chunks(LabelSetP ls, std::vector<LabelChunkRef> &refs) {
+    if (ls->n_chunks) {
+        refs.assign(set_chunks(ls), set_chunks(ls) + ls->n_chunks);
+    } else {
+        labels_to_chunks(set_labels(ls), ls->card, refs);
+    }
+}
+
+static LabelSetP label_set_union_slow(LabelSetP a, LabelSetP b) {
+    if (!a->n_chunks && !b->n_chunks) {
+        uint32_t labels[2 * LS_SMALL_MAX];
+        uint32_t n = std::set_union(set_labels(a), set_labels(a) + a->card,
+                set_labels(b), set_labels(b) + b->card, labels) - labels;
+        if (n <= LS_SMALL_MAX) return make_small_set(labels, n);
+        std::vector<LabelChunkRef> refs;
+        labels_to_chunks(labels, n, refs);
+        return make_chunked_set(refs, n);
+    }
+
+    std::vector<LabelChunkRef> ra, rb, refs;
+    set_to_chunks(a, ra);
+    set_to_chunks(b, rb);
+    uint32_t card = 0;
+    size_t i = 0, j = 0;
+    while (i < ra.size() || j < rb.size()) {
+        LabelChunkRef r;
+        if (j == rb.size() || (i < ra.size() && ra[i].high < rb[j].high)) {
+            r = ra[i++];
+        } else if (i == ra.size() || rb[j].high < ra[i].high) {
+            r = rb[j++];
+        } else {
+            r = { ra[i].high, chunk_union(ra[i].chunk, rb[j].chunk) };
+            i++, j++;
+        }
+        card += r.chunk->card;
+        refs.push_back(r);
+    }
+    return make_chunked_set(refs, card);
+}
+
+// Direct-mapped memo of recent unions.  Tight loops (checksums, ciphers)
+// union the same few pairs of sets for every byte they touch, so even a
+// small table catches nearly all of them; a collision just evicts.
+#define LS_MEMO_BITS 16
 
+struct LabelSetMemoEntry {
+    LabelSetP min, max, result;
+};
+
+static LabelSetMemoEntry union_memo[1 << LS_MEMO_BITS];
+static uint64_t union_memo_hits, union_memo_misses;
+
+LabelSetP label_set_union(LabelSetP ls1, LabelSetP ls2) {
     if (ls1 == ls2) {
         return ls1;
     } else if (ls1 && ls2) {
         LabelSetP min = std::min(ls1, ls2);
         LabelSetP max = std::max(ls1, ls2);
-        std::pair<LabelSetP, LabelSetP> minmax(min, max);
-
-        {
-            auto it = memoized_unions.find(minmax);
-            if (it != memoized_unions.end()) {
-                return it->second;
-            }
-        }
 
-        std::set<uint32_t> temp(*min);
-        for (auto l : *max) {
-            temp.insert(l);
+        LabelSetMemoEntry &e = union_memo[
+            ls_hash_combine(min->hash, max->hash) & ((1 << LS_MEMO_BITS) - 1)];
+        if (e.min == min && e.max == max) {
+            union_memo_hits++;
+            return e.result;
         }
+        union_memo_misses++;
 
-        // insert returns a pair <iterator, bool>; second is whether it happened
-        // first is iterator to new/existing element
-        auto it = label_sets.insert(temp).first;
-        const std::set<uint32_t> *result = &(*it);
+        LabelSetP result = label_set_union_slow(min, max);
 
-        memoized_unions.insert(std::make_pair(minmax, result));
+        e.min = min;
+        e.max = max;
+        e.result = result;
         return result;
     } else if (ls1) {
         return ls1;
@@ -127,13 +373,109 @@ LabelSetP label_set_union(LabelSetP ls1, LabelSetP ls2) {
     } else return nullptr;
 }
 
+void label_set_union_stats(uint64_t *hits, uint64_t *misses) {
+    *hits = union_memo_hits;
+    *misses = union_memo_misses;
+}
+
+uint64_t label_set_memory(void) {
+    return LSA->bytes_used();
+}
+
+uint64_t label_set_count(void) {
+    return label_sets.size();
+}
+
+static uint64_t collections, collected_bytes;
+
+// Copying collector.  The tables are emptied and a fresh arena started, and
+// each set the roots still hold is rebuilt there the first time it comes
+// up; its chunks are re-interned straight from the old copies, so chunks
+// stay shared.  Rebuilding goes through the usual constructors, so the new
+// tables hold exactly the live sets and chunks.
+void label_set_collect(const std::function<void(const LabelSetForward &)> &roots) {
+    ArenaAlloc *old = LSA;
+    uint64_t before = old->bytes_used();
+    LSA = new ArenaAlloc;
+    label_chunks.clear();
+    label_sets.clear();
+
+    std::unordered_map<LabelSetP, LabelSetP> moved;
+    std::vector<LabelChunkRef> refs;
+    roots([&](LabelSetP ls) -> LabelSetP {
+        if (!ls) return nullptr;
+        auto it = moved.find(ls);
+        if (it != moved.end()) return it->second;
+        LabelSetP result;
+        if (!ls->n_chunks) {
+            result = make_small_set(set_labels(ls), ls->card);
+        } else {
+            refs.assign(set_chunks(ls), set_chunks(ls) + ls->n_chunks);
+            for (LabelChunkRef &r : refs) r.chunk = label_chunks.intern(r.chunk);
+            result = make_chunked_set(refs, ls->card);
+        }
+        moved[ls] = result;
+        return result;
+    });
+
+    memset(union_memo, 0, sizeof(union_memo));
+    delete old;
+    collections++;
+    collected_bytes += before - LSA->bytes_used();
+}
+
+void label_set_collect_stats(uint64_t *count, uint64_t *freed) {
+    *count = collections;
+    *freed = collected_bytes;
+}
+
 LabelSetP label_set_singleton(uint32_t label) {
-    std::set<uint32_t> temp;
-    temp.insert(label);
-    return LSA.alloc(temp);
+    return make_small_set(&label, 1);
+}
+
+LabelSetP label_set_from_sorted(const uint32_t *labels, uint32_t n) {
+    if (n == 0) return nullptr;
+    if (n <= LS_SMALL_MAX) return make_small_set(labels, n);
+    std::vector<LabelChunkRef> refs;
+    labels_to_chunks(labels, n, refs);
+    return make_chunked_set(refs, n);
+}
+
+uint32_t label_set_card(LabelSetP ls) {
+    return ls ? ls->card : 0;
+}
+
+// calls fn(label) for each label of ls in increasing order
+template<typename F>
+static void label_set_for_each(LabelSetP ls, F fn) {
+    if (!ls) return;
+    if (!ls->n_chunks) {
+        for (uint32_t i = 0; i < ls->card; i++) fn(set_labels(ls)[i]);
+        return;
+    }
+    for (uint32_t k = 0; k < ls->n_chunks; k++) {
+        const LabelChunkRef &r = set_chunks(ls)[k];
+        uint32_t base = r.high << 16;
+        if (!r.chunk->is_bitmap) {
+            for (uint32_t i = 0; i < r.chunk->card; i++) {
+                fn(base | chunk_lows(r.chunk)[i]);
+            }
+            continue;
+        }
+        for (unsigned w = 0; w < LS_BITMAP_WORDS; w++) {
+            for (uint64_t bits = chunk_bits(r.chunk)[w]; bits; bits &= bits - 1) {
+                fn(base | (w * 64 + __builtin_ctzll(bits)));
+            }
+        }
+    }
+}
+
+void label_set_iter(LabelSetP ls, void (*leaf)(uint32_t, void *), void *user) {
+    label_set_for_each(ls, [=](uint32_t l) { leaf(l, user); });
 }
 
 std::set<uint32_t> label_set_render_set(LabelSetP ls) {
-    if (ls) return *ls;
-    else return std::set<uint32_t>();
+    std::set<uint32_t> result;
+    label_set_for_each(ls, [&](uint32_t l) { result.insert(result.end(), l); });
+    return result;
 }
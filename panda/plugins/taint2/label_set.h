@@ -16,16 +16,37 @@ PANDAENDCOMMENT */
 #define __LABEL_SET_H_
 
 #include <cstdint>
+#include <functional>
 #include <set>
 
+// Label sets are immutable and hash-consed, so two sets with the same labels
+// are always the same pointer.  NULL is the empty set.
 extern "C" {
-typedef const std::set<uint32_t> *LabelSetP;
+typedef const struct LabelSet *LabelSetP;
 
 LabelSetP label_set_union(LabelSetP ls1, LabelSetP ls2);
 LabelSetP label_set_singleton(uint32_t label);
+// the set of n labels, which must be sorted and distinct
+LabelSetP label_set_from_sorted(const uint32_t *labels, uint32_t n);
+uint32_t label_set_card(LabelSetP ls);
+// hits and misses of the union memo so far
+void label_set_union_stats(uint64_t *hits, uint64_t *misses);
 }
 
 void label_set_iter(LabelSetP ls, void (*leaf)(uint32_t, void *), void *user);
 std::set<uint32_t> label_set_render_set(LabelSetP ls);
 
+// Label sets live until a collection, which moves the ones still in use to
+// fresh memory and frees the rest.  roots(fwd) must pass every label set
+// still held anywhere through fwd and keep what it returns instead; any
+// other LabelSetP is dangling afterwards.
+typedef std::function<LabelSetP(LabelSetP)> LabelSetForward;
+void label_set_collect(const std::function<void(const LabelSetForward &)> &roots);
+// bytes of label set storage, live or not
+uint64_t label_set_memory(void);
+// distinct label sets made since the last collection, live or not
+uint64_t label_set_count(void);
+// collections so far and the bytes they freed
+void label_set_collect_stats(uint64_t *collections, uint64_t *freed);
+
 #endif
@@ -29,6 +29,7 @@ PANDAENDCOMMENT */
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/Transforms/Utils/Cloning.h>
 #include <llvm/IR/Instruction.h>
+#include <llvm/Support/CFG.h>
 
 #include "panda/rr/rr_log.h"
 #include "panda/addr.h"
@@ -39,6 +40,7 @@ PANDAENDCOMMENT */
 #include "fast_shad.h"
 #include "llvm_taint_lib.h"
 #include "taint_ops.h"
+#include "taint_queue.h"
 #include "taint2.h"
 
 extern "C" {
@@ -95,6 +97,8 @@ static void taint_branch_run(FastShad *shad, uint64_t src) {
 }
 
 extern "C" { extern TCGLLVMContext *tcg_llvm_ctx; }
+bool decoupled_taint = false;
+bool optimize_taint_ops = true;
 bool PandaTaintFunctionPass::doInitialization(Module &M) {
     // Add taint functions to module
     char *exe = strdup(gargv[0]);
@@ -185,27 +189,33 @@ bool PandaTaintFunctionPass::doInitialization(Module &M) {
 #define ADD_MAPPING(func) \
     EE->addGlobalMapping(M.getFunction(#func), (void *)(func));\
     M.getFunction(#func)->deleteBody();
-    ADD_MAPPING(taint_delete);
-    ADD_MAPPING(taint_mix);
-    ADD_MAPPING(taint_pointer);
-    ADD_MAPPING(taint_mix_compute);
-    ADD_MAPPING(taint_parallel_compute);
-    ADD_MAPPING(taint_copy);
-    ADD_MAPPING(taint_sext);
-    ADD_MAPPING(taint_select);
-    ADD_MAPPING(taint_host_copy);
-    ADD_MAPPING(taint_host_memcpy);
-    ADD_MAPPING(taint_host_delete);
-
-    ADD_MAPPING(taint_push_frame);
-    ADD_MAPPING(taint_pop_frame);
-    ADD_MAPPING(taint_reset_frame);
+    // Ops that touch shadow state; with decoupled=true they only queue up.
+#define ADD_OP_MAPPING(func) \
+    EE->addGlobalMapping(M.getFunction(#func), \
+            decoupled_taint ? (void *)(func##_queued) : (void *)(func));\
+    M.getFunction(#func)->deleteBody();
+    ADD_OP_MAPPING(taint_delete);
+    ADD_OP_MAPPING(taint_mix);
+    ADD_OP_MAPPING(taint_pointer);
+    ADD_OP_MAPPING(taint_mix_compute);
+    ADD_OP_MAPPING(taint_parallel_compute);
+    ADD_OP_MAPPING(taint_copy);
+    ADD_OP_MAPPING(taint_sext);
+    ADD_OP_MAPPING(taint_select);
+    ADD_OP_MAPPING(taint_host_copy);
+    ADD_OP_MAPPING(taint_host_memcpy);
+    ADD_OP_MAPPING(taint_host_delete);
+
+    ADD_OP_MAPPING(taint_push_frame);
+    ADD_OP_MAPPING(taint_pop_frame);
+    ADD_OP_MAPPING(taint_reset_frame);
     ADD_MAPPING(taint_breadcrumb);
 
     ADD_MAPPING(taint_memlog_pop);
 
     //ADD_MAPPING(label_set_union);
     //ADD_MAPPING(label_set_singleton);
+#undef ADD_OP_MAPPING
 #undef ADD_MAPPING
 
     std::cout << "taint2: Done initializing taint transformation." << std::endl;
@@ -231,6 +241,9 @@ bool PandaTaintFunctionPass::runOnFunction(Function &F) {
             PTV.visit(I);
         }
     }
+    if (optimize_taint_ops && F.getName().startswith("tcg-llvm-tb-")) {
+        PTV.optimizeTaintOps(F);
+    }
 #ifdef TAINTDEBUG
     //F.dump();
     /*std::string err;
@@ -1320,3 +1333,406 @@ void PandaTaintVisitor::visitInstruction(Instruction &I) {
     printf("Error: Unhandled instruction\n");
     assert(1==0);
 }
+
+/***
+ *** Taint op cleanup
+ ***/
+
+// The visitor instruments each instruction on its own, so a guest register
+// moved through a couple of LLVM temporaries turns into a chain of copies,
+// each paying for a call and a controlled-bit update.  This cleans up the
+// ops of a generated block afterwards:
+//  - copies whose instruction only moves bits get a null instruction, so
+//    the op skips update_cb, which would write back what it just copied;
+//  - reads of a temporary that is still an exact copy of some (LLVM,
+//    register or CPU state) shadow read that shadow instead, also in
+//    blocks whose only predecessor left the copy in place;
+//  - ops that only write LLVM shadow bytes nothing reads again are removed;
+//  - register and CPU state shadow writes that a later op in the block
+//    overwrites before anything could look are removed, so a register
+//    updated several times in a block has its shadow written once;
+//  - adjacent deletes, and adjacent pure copies, of adjacent ranges merge.
+// Memory shadow addresses come from the memlog at run time, so memory is
+// only ever a barrier here.
+
+namespace {
+
+struct TaintRange {
+    Constant *shad;
+    bool known;      // off is a constant
+    uint64_t off, size;
+    int shad_arg, off_arg; // arguments that name it, or -1
+};
+
+struct TaintOpEffect {
+    bool op = false;          // a taint op call
+    bool barrier = false;     // may touch any shadow
+    uint64_t reads_llv_from = ~0UL; // reads all of llv from here on
+    bool has_write = false;
+    TaintRange write;
+    vector<TaintRange> reads;
+};
+
+// An LLVM shadow range that currently holds an unmodified copy of another.
+struct TaintCopyOf {
+    uint64_t dest, size;
+    Constant *shad;
+    uint64_t src;
+};
+
+static bool ranges_overlap(uint64_t a, uint64_t na, uint64_t b, uint64_t nb) {
+    return a < b + nb && b < a + na;
+}
+
+static bool const_arg(CallInst *CI, int i, uint64_t *val) {
+    ConstantInt *C = dyn_cast<ConstantInt>(CI->getArgOperand(i));
+    if (!C) return false;
+    *val = C->getZExtValue();
+    return true;
+}
+
+// The instruction a taint op was given (as an inttoptr of its address), or
+// NULL for a null one.
+static Instruction *op_instruction(Value *V) {
+    if (isa<ConstantPointerNull>(V)) return NULL;
+    ConstantExpr *CE = dyn_cast<ConstantExpr>(V);
+    assert(CE && CE->getOpcode() == Instruction::IntToPtr);
+    return (Instruction *)cast<ConstantInt>(CE->getOperand(0))->getZExtValue();
+}
+
+// Opcodes for which update_cb after a copy of at most 8 bytes just writes
+// back the masks the copy already moved.
+static bool copies_cb(Instruction *I) {
+    if (!I) return true;
+    switch (I->getOpcode()) {
+        case Instruction::ZExt:
+        case Instruction::IntToPtr:
+        case Instruction::PtrToInt:
+        case Instruction::BitCast:
+        case Instruction::SExt:
+        case Instruction::Store:
+        case Instruction::Load:
+        case Instruction::ExtractValue:
+        case Instruction::InsertValue:
+            return true;
+        default:
+            return false;
+    }
+}
+
+} // namespace
+
+static TaintRange taint_range(CallInst *CI, int shad_arg, int off_arg, uint64_t size) {
+    TaintRange r;
+    r.shad = cast<Constant>(CI->getArgOperand(shad_arg));
+    r.known = const_arg(CI, off_arg, &r.off);
+    r.size = size;
+    r.shad_arg = shad_arg;
+    r.off_arg = off_arg;
+    return r;
+}
+
+static TaintOpEffect taint_op_effect(PandaTaintVisitor &PTV, Instruction &I) {
+    TaintOpEffect e;
+    CallInst *CI = dyn_cast<CallInst>(&I);
+    if (!CI) return e;
+    Function *F = CI->getCalledFunction();
+    if (F == PTV.memlogPopF || F == PTV.breadcrumbF) return e;
+    if (!F || F->isIntrinsic()) {
+        e.barrier = !F;
+        return e;
+    }
+
+    uint64_t size = 0, size2 = 0;
+    e.op = true;
+    if (F == PTV.copyF && const_arg(CI, 4, &size)) {
+        e.write = taint_range(CI, 0, 1, size);
+        e.reads.push_back(taint_range(CI, 2, 3, size));
+    } else if (F == PTV.deleteF && const_arg(CI, 2, &size)) {
+        e.write = taint_range(CI, 0, 1, size);
+    } else if ((F == PTV.mixF || F == PTV.sextF) &&
+            const_arg(CI, 2, &size) && const_arg(CI, 4, &size2)) {
+        e.write = taint_range(CI, 0, 1, size);
+        e.reads.push_back(taint_range(CI, 0, 3, size2));
+    } else if ((F == PTV.parallelCompF || F == PTV.mixCompF) &&
+            const_arg(CI, 2, &size) && const_arg(CI, 5, &size2)) {
+        e.write = taint_range(CI, 0, 1, F == PTV.parallelCompF ? size2 : size);
+        e.reads.push_back(taint_range(CI, 0, 3, size2));
+        e.reads.push_back(taint_range(CI, 0, 4, size2));
+    } else if (F == PTV.selectF && const_arg(CI, 2, &size)) {
+        e.write = taint_range(CI, 0, 1, size);
+        for (unsigned i = 4; i + 1 < CI->getNumArgOperands(); i += 2) {
+            e.reads.push_back(taint_range(CI, 0, i, size));
+        }
+    } else if (F == PTV.pointerF && const_arg(CI, 4, &size2) &&
+            const_arg(CI, 7, &size)) {
+        e.write = taint_range(CI, 0, 1, size);
+        e.reads.push_back(taint_range(CI, 2, 3, size2));
+        e.reads.push_back(taint_range(CI, 5, 6, size));
+    } else if (F == PTV.branchF) {
+        // on_branch2 callbacks get the slot and may query it
+        e.reads.push_back(taint_range(CI, 0, 1, MAXREGSIZE));
+        return e;
+    } else if (F == PTV.pushFrameF) {
+        // the callee's frame starts past this one, where the arguments are
+        e.barrier = true;
+        e.reads_llv_from = 0;
+        return e;
+    } else if (F == PTV.hostCopyF) {
+        e.barrier = true;
+        if (const_arg(CI, 6, &size)) {
+            e.reads.push_back(taint_range(CI, 2, 3, size));
+        } else {
+            e.reads_llv_from = 0;
+        }
+        return e;
+    } else {
+        // frame changes, host ops, helpers, anything else
+        e.op = F->getName().startswith("taint");
+        e.barrier = true;
+        if (F == PTV.resetFrameF) e.reads_llv_from = 0;
+        return e;
+    }
+    e.has_write = true;
+    // constWeakSlot of a constant: nothing to read
+    for (auto it = e.reads.begin(); it != e.reads.end(); ) {
+        if (it->known && it->off == ~0UL) it = e.reads.erase(it);
+        else it++;
+    }
+    return e;
+}
+
+// Shadow size for a shadow constant, for bounds checks on merged ranges.
+uint64_t PandaTaintVisitor::shadSize(Constant *shadConst) {
+    if (shadConst == llvConst) return shad->llv->get_size();
+    if (shadConst == memConst) return shad->ram->get_size();
+    if (shadConst == grvConst) return shad->grv->get_size();
+    if (shadConst == gsvConst) return shad->gsv->get_size();
+    if (shadConst == retConst) return shad->ret->get_size();
+    return 0;
+}
+
+// True if some read of llv in effects overlaps [off, off + size).
+static bool llv_read_overlaps(PandaTaintVisitor &PTV,
+        const vector<TaintOpEffect> &effects, size_t begin, size_t end,
+        uint64_t off, uint64_t size) {
+    for (size_t i = begin; i < end; i++) {
+        const TaintOpEffect &e = effects[i];
+        if (e.reads_llv_from != ~0UL && off + size > e.reads_llv_from) return true;
+        for (const TaintRange &r : e.reads) {
+            if (r.shad != PTV.llvConst) continue;
+            if (!r.known || ranges_overlap(off, size, r.off, r.size)) return true;
+        }
+    }
+    return false;
+}
+
+void PandaTaintVisitor::optimizeTaintOps(Function &F) {
+    LLVMContext &ctx = F.getContext();
+    std::map<BasicBlock *, vector<Instruction *>> insts;
+    std::map<BasicBlock *, vector<TaintOpEffect>> effects;
+
+    // Forward: pure copies and copy forwarding, block by block.  A block
+    // with one predecessor starts from what was known at its end.
+    std::map<BasicBlock *, vector<TaintCopyOf>> copies_out;
+    for (BasicBlock &BB : F) {
+        vector<TaintCopyOf> copies;
+        BasicBlock *pred = BB.getSinglePredecessor();
+        if (pred && copies_out.count(pred)) copies = copies_out[pred];
+        for (Instruction &I : BB) {
+            TaintOpEffect e = taint_op_effect(*this, I);
+            if (e.barrier) copies.clear();
+            if (!e.op || !e.has_write) continue;
+            CallInst *CI = cast<CallInst>(&I);
+
+            for (TaintRange &r : e.reads) {
+                if (r.shad != llvConst || !r.known) continue;
+                for (const TaintCopyOf &c : copies) {
+                    if (r.off < c.dest || r.off + r.size > c.dest + c.size) continue;
+                    // ops with one shadow argument can only read llv
+                    Constant *shad_arg = cast<Constant>(CI->getArgOperand(r.shad_arg));
+                    bool shared = r.shad_arg == e.write.shad_arg;
+                    if (shared && c.shad != shad_arg) break;
+                    if (!shared) CI->setArgOperand(r.shad_arg, c.shad);
+                    r.shad = c.shad;
+                    r.off = c.src + (r.off - c.dest);
+                    CI->setArgOperand(r.off_arg, const_uint64(ctx, r.off));
+                    optForwarded++;
+                    break;
+                }
+            }
+
+            const TaintRange &w = e.write;
+            for (auto it = copies.begin(); it != copies.end(); ) {
+                bool clobbered = (w.shad == llvConst &&
+                        (!w.known || ranges_overlap(w.off, w.size, it->dest, it->size))) ||
+                    (w.shad == it->shad &&
+                        (!w.known || ranges_overlap(w.off, w.size, it->src, it->size)));
+                if (clobbered) it = copies.erase(it);
+                else it++;
+            }
+
+            if (CI->getCalledFunction() != copyF) continue;
+            const TaintRange &r = e.reads[0];
+            bool overlap = w.shad == r.shad && (!w.known || !r.known ||
+                    ranges_overlap(w.off, w.size, r.off, r.size));
+            if (w.size > 8 || overlap || !copies_cb(op_instruction(CI->getArgOperand(5)))) {
+                continue;
+            }
+            if (!isa<ConstantPointerNull>(CI->getArgOperand(5))) {
+                CI->setArgOperand(5, constNull(ctx));
+                optPureCopies++;
+            }
+            // in bounds, so the op can't skip it as IO
+            if (w.shad == llvConst && w.known && r.known && r.shad != memConst &&
+                    w.off + w.size < shadSize(w.shad) &&
+                    r.off + r.size < shadSize(r.shad)) {
+                copies.push_back(TaintCopyOf{ w.off, w.size, r.shad, r.off });
+            }
+        }
+        copies_out[&BB] = copies;
+        for (Instruction &I : BB) {
+            TaintOpEffect e = taint_op_effect(*this, I);
+            if (!e.op && !e.barrier) continue;
+            insts[&BB].push_back(&I);
+            effects[&BB].push_back(e);
+        }
+    }
+
+    // Dead LLVM shadow writes.  Nothing reads llv after the function
+    // returns, so a write is dead if no later op in its block, and no op in
+    // any other block, reads any of it; in a block that can reach itself,
+    // earlier reads count too.
+    for (BasicBlock &BB : F) {
+        bool cyclic = false;
+        std::set<BasicBlock *> seen;
+        vector<BasicBlock *> work(succ_begin(&BB), succ_end(&BB));
+        while (!work.empty() && !cyclic) {
+            BasicBlock *S = work.back();
+            work.pop_back();
+            if (S == &BB) cyclic = true;
+            if (!seen.insert(S).second) continue;
+            work.insert(work.end(), succ_begin(S), succ_end(S));
+        }
+
+        vector<TaintOpEffect> &es = effects[&BB];
+        vector<Instruction *> &is = insts[&BB];
+        for (size_t k = 0; k < es.size(); k++) {
+            const TaintRange &w = es[k].write;
+            if (!es[k].has_write || w.shad != llvConst || !w.known) continue;
+            if (llv_read_overlaps(*this, es, cyclic ? 0 : k + (size_t)1, es.size(),
+                        w.off, w.size)) {
+                continue;
+            }
+            bool read_elsewhere = false;
+            for (auto &other : effects) {
+                if (other.first == &BB) continue;
+                if (llv_read_overlaps(*this, other.second, 0, other.second.size(),
+                            w.off, w.size)) {
+                    read_elsewhere = true;
+                    break;
+                }
+            }
+            if (read_elsewhere) continue;
+            is[k]->eraseFromParent();
+            is[k] = NULL;
+            optRemoved++;
+        }
+    }
+
+    // Overwritten register shadow writes.  A copy or delete into grv or gsv
+    // is dead if a later op in the block surely overwrites all of it and
+    // nothing in between reads it.  Helper calls, host ops and branches
+    // (whose callbacks may query registers) end the search.
+    for (BasicBlock &BB : F) {
+        vector<TaintOpEffect> &es = effects[&BB];
+        vector<Instruction *> &is = insts[&BB];
+        for (size_t k = 0; k < es.size(); k++) {
+            const TaintRange &w = es[k].write;
+            if (!is[k] || !es[k].has_write || !w.known ||
+                    (w.shad != grvConst && w.shad != gsvConst)) {
+                continue;
+            }
+            Function *fn = cast<CallInst>(is[k])->getCalledFunction();
+            if (fn != copyF && fn != deleteF) continue;
+            for (size_t j = k + 1; j < es.size(); j++) {
+                if (!is[j]) continue;
+                const TaintOpEffect &e = es[j];
+                Function *fj = cast<CallInst>(is[j])->getCalledFunction();
+                if (e.barrier || fj == branchF) break;
+                bool read = false;
+                for (const TaintRange &r : e.reads) {
+                    if (r.shad == w.shad &&
+                            (!r.known || ranges_overlap(w.off, w.size, r.off, r.size))) {
+                        read = true;
+                    }
+                }
+                if (read) break;
+                // copies out of range and deletes past the end are skipped
+                // by the op, so only in-range ones surely write
+                const TaintRange &wj = e.write;
+                bool writes = e.has_write && wj.known && wj.shad == w.shad &&
+                    wj.off <= w.off && w.off + w.size <= wj.off + wj.size &&
+                    ((fj == deleteF && wj.off < shadSize(wj.shad)) ||
+                     (fj == copyF && e.reads[0].known &&
+                      wj.off + wj.size < shadSize(wj.shad) &&
+                      e.reads[0].off + e.reads[0].size < shadSize(e.reads[0].shad)));
+                if (!writes) continue;
+                is[k]->eraseFromParent();
+                is[k] = NULL;
+                optRegStores++;
+                break;
+            }
+        }
+    }
+
+    // Merge an op into the next one when they are adjacent deletes or pure
+    // copies of adjacent ranges, with nothing touching shadow in between.
+    for (BasicBlock &BB : F) {
+        vector<TaintOpEffect> &es = effects[&BB];
+        vector<Instruction *> &is = insts[&BB];
+        size_t prev = ~(size_t)0;
+        for (size_t k = 0; k < es.size(); k++) {
+            if (!is[k]) continue;
+            size_t p = prev;
+            prev = k;
+            if (p == ~(size_t)0) continue;
+            CallInst *A = cast<CallInst>(is[p]), *B = cast<CallInst>(is[k]);
+            Function *fn = A->getCalledFunction();
+            if (fn != B->getCalledFunction() || (fn != deleteF && fn != copyF) ||
+                    !es[p].has_write || !es[k].has_write) {
+                continue;
+            }
+            const TaintRange &wa = es[p].write, &wb = es[k].write;
+            if (!wa.known || !wb.known || wa.shad != wb.shad) continue;
+            if (wa.off + wa.size != wb.off && wb.off + wb.size != wa.off) continue;
+            uint64_t lo = std::min(wa.off, wb.off), size = wa.size + wb.size;
+            if (lo + size >= shadSize(wa.shad)) continue;
+            uint64_t src_lo = 0;
+            if (fn == copyF) {
+                const TaintRange &ra = es[p].reads[0], &rb = es[k].reads[0];
+                if (!isa<ConstantPointerNull>(A->getArgOperand(5)) ||
+                        !isa<ConstantPointerNull>(B->getArgOperand(5)) ||
+                        !ra.known || !rb.known || ra.shad != rb.shad ||
+                        rb.off - ra.off != wb.off - wa.off) {
+                    continue;
+                }
+                src_lo = std::min(ra.off, rb.off);
+                if (ra.shad == wa.shad && ranges_overlap(lo, size, src_lo, size)) continue;
+                if (src_lo + size >= shadSize(ra.shad)) continue;
+                B->setArgOperand(3, const_uint64(ctx, src_lo));
+                B->setArgOperand(4, const_uint64(ctx, size));
+                es[k].reads[0].off = src_lo;
+                es[k].reads[0].size = size;
+            } else {
+                B->setArgOperand(2, const_uint64(ctx, size));
+            }
+            B->setArgOperand(1, const_uint64(ctx, lo));
+            es[k].write.off = lo;
+            es[k].write.size = size;
+            A->eraseFromParent();
+            is[p] = NULL;
+            optMerged++;
+        }
+    }
+}
@@ -120,6 +120,7 @@ private:
             Constant *shad, Value *dest, Value *size);
     void insertTaintBranch(Instruction &I, Value *cond);
     void insertStateOp(Instruction &I);
+    uint64_t shadSize(Constant *shadConst);
 
 public:
     DataLayout *dataLayout = NULL;
@@ -157,6 +158,10 @@ public:
 
     Type *instrT;
 
+    // What optimizeTaintOps has done so far
+    uint64_t optPureCopies = 0, optForwarded = 0, optRemoved = 0, optMerged = 0;
+    uint64_t optRegStores = 0;
+
     PandaTaintVisitor(Shad *shad, taint2_memlog *taint_memlog)
         : shad(shad), taint_memlog(taint_memlog) {}
 
@@ -193,6 +198,9 @@ public:
     void visitMemCpyInst(MemTransferInst &I);
     void visitMemMoveInst(MemTransferInst &I);
     void visitMemSetInst(MemSetInst &I);
+
+    // Clean up the taint ops just inserted into F.
+    void optimizeTaintOps(Function &F);
 };
 
 /* PandaTaintFunctionPass class
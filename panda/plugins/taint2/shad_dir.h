@@ -15,10 +15,24 @@ PANDAENDCOMMENT */
 #ifndef __SHAD_DIR_H_
 #define __SHAD_DIR_H_
 
+// a run of offsets within a page that have the same label set
+typedef struct sd_run_struct {
+  uint32_t start;
+  uint32_t len;
+  LabelSetP ls;
+} SdRun;
+
 // struct for a page
 typedef struct sd_page_struct {
   // array of pointers to label sets, one for each offset within the page
+  // (32-bit directories)
   LabelSetP *labels;
+  // or the runs of offsets that have label sets, in order, without overlaps
+  // and with no two adjacent runs having the same label set (64-bit
+  // directories, whose pages shadow whole disk sectors at a time)
+  SdRun *runs;
+  uint32_t num_runs;
+  uint32_t max_runs;
   // count non-empty label sets in page
   int32_t num_non_empty;
 } SdPage;
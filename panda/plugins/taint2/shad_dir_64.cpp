@@ -28,11 +28,12 @@ PANDAENDCOMMENT */
 
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <cassert>
 
 #include "shad_dir_64.h"
 
-typedef const std::set<uint32_t> *LabelSetP;
+typedef const struct LabelSet *LabelSetP;
 
 // 64-bit addresses
 // create a new table
@@ -63,20 +64,114 @@ static void __shad_dir_table_free_64(SdDir64 *shad_dir, SdTable *table) {
   free(table);
 }
 
+// pages start with no runs
 static SdPage *__shad_dir_page_new_64(SdDir64 *shad_dir) {
   SdPage *page = (SdPage *) calloc(1, sizeof(SdPage));
-  page->labels = (LabelSetP *) calloc(shad_dir->page_size, sizeof(LabelSetP ));
   page->num_non_empty = 0;
   return page;
 }
 
 static void __shad_dir_page_free_64(SdDir64 *shad_dir, SdPage *page) {
   assert (page->num_non_empty == 0);
-  free(page->labels);
+  free(page->runs);
   free(page);
 }
 
 
+// index of the first run that ends after offset
+static uint32_t __shad_dir_page_run_64(SdPage *page, uint32_t offset) {
+  uint32_t lo = 0, hi = page->num_runs;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (page->runs[mid].start + page->runs[mid].len <= offset) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// label set at offset, or NULL
+static LabelSetP __shad_dir_page_find_64(SdPage *page, uint32_t offset) {
+  uint32_t i = __shad_dir_page_run_64(page, offset);
+  if (i < page->num_runs && page->runs[i].start <= offset) {
+    return page->runs[i].ls;
+  }
+  return NULL;
+}
+
+/*
+  map offsets [offset, offset+len) of the page to ls, or to nothing if ls
+  is NULL.  The runs overlapping them are replaced with what is left of
+  the first and last, around the new run, which is merged with whichever
+  neighbours have the same label set.
+*/
+static void __shad_dir_page_set_64(SdPage *page, uint32_t offset, uint32_t len, LabelSetP ls) {
+  uint32_t end = offset + len;
+  uint32_t i = __shad_dir_page_run_64(page, offset);
+  uint32_t j = i;
+  int32_t removed = 0;
+  SdRun piece[3];
+  uint32_t k = 0;
+
+  while (j < page->num_runs && page->runs[j].start < end) {
+    uint32_t run_end = page->runs[j].start + page->runs[j].len;
+    removed += (run_end < end ? run_end : end) -
+      (page->runs[j].start > offset ? page->runs[j].start : offset);
+    j++;
+  }
+  if (i < j && page->runs[i].start < offset) {
+    SdRun left = { page->runs[i].start, offset - page->runs[i].start, page->runs[i].ls };
+    piece[k++] = left;
+  }
+  if (ls != NULL) {
+    if (k > 0 && piece[k-1].ls == ls) {
+      piece[k-1].len += len;
+    }
+    else {
+      SdRun mid = { offset, len, ls };
+      piece[k++] = mid;
+    }
+  }
+  if (i < j && page->runs[j-1].start + page->runs[j-1].len > end) {
+    SdRun right = { end, page->runs[j-1].start + page->runs[j-1].len - end, page->runs[j-1].ls };
+    if (k > 0 && piece[k-1].start + piece[k-1].len == end && piece[k-1].ls == right.ls) {
+      piece[k-1].len += right.len;
+    }
+    else {
+      piece[k++] = right;
+    }
+  }
+  // the runs just outside only ever merge with the new one
+  if (k > 0 && i > 0 &&
+      page->runs[i-1].start + page->runs[i-1].len == piece[0].start &&
+      page->runs[i-1].ls == piece[0].ls) {
+    i--;
+    piece[0].len += page->runs[i].len;
+    piece[0].start = page->runs[i].start;
+  }
+  if (k > 0 && j < page->num_runs &&
+      piece[k-1].start + piece[k-1].len == page->runs[j].start &&
+      page->runs[j].ls == piece[k-1].ls) {
+    piece[k-1].len += page->runs[j].len;
+    j++;
+  }
+
+  uint32_t num_runs = page->num_runs - (j - i) + k;
+  if (num_runs > page->max_runs) {
+    page->max_runs = page->max_runs ? 2 * page->max_runs : 4;
+    if (page->max_runs < num_runs) page->max_runs = num_runs;
+    page->runs = (SdRun *) realloc(page->runs, page->max_runs * sizeof(SdRun));
+  }
+  memmove(&page->runs[i + k], &page->runs[j], (page->num_runs - j) * sizeof(SdRun));
+  memcpy(&page->runs[i], piece, k * sizeof(SdRun));
+  page->num_runs = num_runs;
+  page->num_non_empty += (ls != NULL ? (int32_t) len : 0) - removed;
+}
+
+
 /*
   creates initial, empty page directory.
   this is a mapping from addresses, which are unsigned integers of width
@@ -118,7 +213,6 @@ SdDir64 *shad_dir_new_64
   "table" points to the SdTable for the current page
   "page" points to the SdPage for the current page
   "page_base_addr" is the guest physical address of the page for the current page
-  "label_set_array" points to the array of ptrs to label sets for this page
 */
 /* 64-bit addresses */				   \
 #define SD_PAGE_ITER(do_this) \
@@ -146,7 +240,6 @@ SdDir64 *shad_dir_new_64
           page_base_addr = (page_base_addr << shad_dir->num_table_bits) | t2i;	\
           page_base_addr = (page_base_addr << shad_dir->num_table_bits) | t3i;	\
           page_base_addr = page_base_addr << shad_dir->num_page_bits;           \
-          __attribute__((__unused__)) LabelSetP * label_set_array = page->labels;                            \
           do_this ;         \
         }                   \
       }                     \
@@ -187,15 +280,14 @@ void shad_dir_iter_64
       void *stuff2) {
   SD_PAGE_ITER(
 	  { int iter_finished;
-	    unsigned int ai;
-	    for (ai=0; ai<shad_dir->page_size; ai++) {
-	      uint64_t addr;
-	      addr = page_base_addr | ai;
-	      LabelSetP ls = label_set_array[ai];
-	      iter_finished = 0;
-	      if (ls != NULL)
-		iter_finished = app(addr, ls, stuff2);
-	      if (iter_finished != 0) return;
+	    uint32_t ri;
+	    uint32_t ai;
+	    for (ri=0; ri<page->num_runs; ri++) {
+	      SdRun run = page->runs[ri];
+	      for (ai=run.start; ai<run.start+run.len; ai++) {
+		iter_finished = app(page_base_addr | ai, run.ls, stuff2);
+		if (iter_finished != 0) return;
+	      }
 	    } }
 	  )
 }
@@ -212,7 +304,7 @@ uint32_t shad_dir_occ_64(SdDir64 *shad_dir) {
 
 
 int shad_dir_free_aux_64(uint64_t pa, SdPage *page, void *stuff) {
-  free(page->labels);
+  free(page->runs);
   return 0;
 }
 
@@ -237,11 +329,13 @@ void shad_dir_free_64(SdDir64 *shad_dir) {
   After this macro, the following useful things exist
   table: points to the SdTable for this addr
   page: points to the SdPage for this addr
+  offset: addr's offset within the page
   ls: points to the labelset for this addr (might be NULL)
+  SD_GET_PAGE_64 is the same without the last step.
 */
 
 
-#define SD_GET_LABELSET_64(addr, no_table1_action, no_table2_action, no_table3_action, no_page_action, no_labelset_action)			       \
+#define SD_GET_PAGE_64(addr, no_table1_action, no_table2_action, no_table3_action, no_page_action)			       \
   uint32_t di = addr >> shad_dir->dir_shift;  \
   SdTable *table1 = shad_dir->table[di];      \
   if (table1 == NULL) { no_table1_action ; }  \
@@ -257,9 +351,11 @@ void shad_dir_free_64(SdDir64 *shad_dir) {
   uint32_t t3i = (addr & shad_dir->table3_mask) >> sh; 	\
   SdPage *page = table3->page[t3i];		  \
   if (page == NULL) { no_page_action ; }	  \
-  LabelSetP *label_set_array = page->labels;      \
-  uint32_t offset = (addr & shad_dir->page_mask); \
-  LabelSetP ls = label_set_array[offset];         \
+  uint32_t offset = (addr & shad_dir->page_mask);
+
+#define SD_GET_LABELSET_64(addr, no_table1_action, no_table2_action, no_table3_action, no_page_action, no_labelset_action)			       \
+  SD_GET_PAGE_64(addr, no_table1_action, no_table2_action, no_table3_action, no_page_action) \
+  LabelSetP ls = __shad_dir_page_find_64(page, offset); \
   if (ls == NULL) { no_labelset_action ; }
 
 
@@ -302,73 +398,137 @@ static SdPage *__shad_dir_add_page_to_table_64(SdDir64 *shad_dir, SdTable *table
 
 
 
+// release page, and the tables above it that it leaves empty
+static void __shad_dir_release_page_64(SdDir64 *shad_dir, uint32_t di,
+    SdTable *table1, uint32_t t1i, SdTable *table2, uint32_t t2i,
+    SdTable *table3, uint32_t t3i, SdPage *page) {
+  __shad_dir_page_free_64(shad_dir, page);
+  table3->page[t3i] = NULL;
+  table3->num_non_empty--;
+  assert (table3->num_non_empty >= 0);
+  if (table3->num_non_empty == 0) {
+    // level 3 table empty -- release it
+    __shad_dir_table_free_64(shad_dir, table3);
+    table2->table[t2i] = NULL;
+    table2->num_non_empty--;
+    assert (table2->num_non_empty >= 0);
+    if (table2->num_non_empty == 0) {
+      // level 2 table empty -- release it
+      __shad_dir_table_free_64(shad_dir, table2);
+      table1->table[t1i] = NULL;
+      table1->num_non_empty--;
+      assert (table1->num_non_empty >= 0);
+      if (table1->num_non_empty == 0) {
+	// level 1 table empty -- release it
+	__shad_dir_table_free_64(shad_dir, table1);
+	shad_dir->table[di] = NULL;
+	shad_dir->num_non_empty--;
+	assert (shad_dir->num_non_empty >= 0);
+      }
+    }
+  }
+}
+
+
+// shad_dir_set_range_64 for a range within one page
+static void __shad_dir_set_in_page_64(SdDir64 *shad_dir, uint64_t addr, uint32_t len, LabelSetP ls_new) {
+  if (ls_new != NULL) {
+    SD_GET_PAGE_64(
+      addr,
+      table1 = __shad_dir_add_table_to_dir_64(shad_dir, di),
+      table2 = __shad_dir_add_something_to_table_64(shad_dir, table1, t1i, 1),
+      table3 = __shad_dir_add_something_to_table_64(shad_dir, table2, t2i, 0),
+      page = __shad_dir_add_page_to_table_64(shad_dir, table3, t3i)
+    )
+    __shad_dir_page_set_64(page, offset, len, ls_new);
+  }
+  else {
+    SD_GET_PAGE_64(
+      addr,
+      return,
+      return,
+      return,
+      return
+    )
+    __shad_dir_page_set_64(page, offset, len, NULL);
+    assert (page->num_non_empty >= 0);
+    if (page->num_non_empty == 0) {
+      // page empty -- release it
+      __shad_dir_release_page_64(shad_dir, di, table1, t1i, table2, t2i,
+                                 table3, t3i, page);
+    }
+  }
+}
+
+
+/*
+  map every address in [addr, addr+len) to ls_new, or remove their
+  mappings if ls_new is NULL.  Costs the same for a whole sector as for a
+  byte, give or take the runs it splits.
+*/
+void shad_dir_set_range_64(SdDir64 *shad_dir, uint64_t addr, uint64_t len, LabelSetP ls_new) {
+  while (len > 0) {
+    uint64_t n = shad_dir->page_size - (addr & shad_dir->page_mask);
+    if (n > len) n = len;
+    __shad_dir_set_in_page_64(shad_dir, addr, n, ls_new);
+    addr += n;
+    len -= n;
+  }
+}
+
+
 /*
   add this mapping from addr to ls_new
   if a prior mapping exists, remove it first
   labelset is *not* copied.  We copy its slots.
 */
 void shad_dir_add_64(SdDir64 *shad_dir, uint64_t addr, LabelSetP ls_new) {
-  // get ls, the labelset currently associated with this addr
-  SD_GET_LABELSET_64(
-    addr,
-    table1 = __shad_dir_add_table_to_dir_64(shad_dir, di),
-    table2 = __shad_dir_add_something_to_table_64(shad_dir, table1, t1i, 1),
-    table3 = __shad_dir_add_something_to_table_64(shad_dir, table2, t2i, 0),
-    page = __shad_dir_add_page_to_table_64(shad_dir, table3, t3i),
-    SD_DO_NOTHING
-  )
-  if (ls == NULL) {
-    // nothing there.
-    // we are adding an addr -> label_set mapping
-    page->num_non_empty++;
-  }
-  label_set_array[offset] = ls_new;
+  shad_dir_set_range_64(shad_dir, addr, 1, ls_new);
 }
 
 
 // remove this mapping from addr to labelset
 void shad_dir_remove_64(SdDir64 *shad_dir, uint64_t addr) {
-  // get ls, the labelset currently associated with addr
-  SD_GET_LABELSET_64(
+  shad_dir_set_range_64(shad_dir, addr, 1, NULL);
+}
+
+
+// the runs of one page that overlap [addr, addr+len), clipped to it
+static int __shad_dir_iter_runs_in_page_64(SdDir64 *shad_dir, uint64_t addr, uint32_t len,
+    int (*app)(uint64_t addr, uint64_t len, LabelSetP labels, void *stuff1),
+    void *stuff2) {
+  SD_GET_PAGE_64(
     addr,
-    return,
-    return,
-    return,
-    return,
-    return)
-  if (ls != 0) {
-    // we are removing an addr -> label_set mapping
-    page->num_non_empty --;
+    return 0,
+    return 0,
+    return 0,
+    return 0
+  )
+  uint64_t page_base_addr = addr - offset;
+  uint32_t end = offset + len;
+  uint32_t ri;
+  for (ri = __shad_dir_page_run_64(page, offset);
+       ri < page->num_runs && page->runs[ri].start < end; ri++) {
+    SdRun run = page->runs[ri];
+    uint32_t start = run.start > offset ? run.start : offset;
+    uint32_t run_end = run.start + run.len < end ? run.start + run.len : end;
+    int iter_finished = app(page_base_addr + start, run_end - start, run.ls, stuff2);
+    if (iter_finished != 0) return iter_finished;
   }
-  page->labels[offset] = NULL;
-  assert (page->num_non_empty >= 0);
-  if (page->num_non_empty == 0) {
-    // page empty -- release it
-    __shad_dir_page_free_64(shad_dir, page);
-    table3->page[t3i] = NULL;
-    table3->num_non_empty--;
-    assert (table3->num_non_empty >= 0);
-    if (table3->num_non_empty == 0) {
-      // level 3 table empty -- release it
-      __shad_dir_table_free_64(shad_dir, table3);
-      table2->table[t2i] = NULL;
-      table2->num_non_empty--;
-      assert (table2->num_non_empty >= 0);
-      if (table2->num_non_empty == 0) {
-	// level 2 table empty -- release it
-	__shad_dir_table_free_64(shad_dir, table2);
-	table1->table[t1i] = NULL;
-	table1->num_non_empty--;
-	assert (table1->num_non_empty >= 0);
-	if (table1->num_non_empty == 0) {
-	  // level 1 table empty -- release it
-	  __shad_dir_table_free_64(shad_dir, table1);
-	  shad_dir->table[di] = NULL;
-	  shad_dir->num_non_empty--;
-	  assert (shad_dir->num_non_empty >= 0);
-	}
-      }
-    }
+  return 0;
+}
+
+
+void shad_dir_iter_runs_64
+     (SdDir64 *shad_dir, uint64_t addr, uint64_t len,
+      int (*app)(uint64_t addr, uint64_t len, LabelSetP labels, void *stuff1),
+      void *stuff2) {
+  while (len > 0) {
+    uint64_t n = shad_dir->page_size - (addr & shad_dir->page_mask);
+    if (n > len) n = len;
+    if (__shad_dir_iter_runs_in_page_64(shad_dir, addr, n, app, stuff2) != 0) return;
+    addr += n;
+    len -= n;
   }
 }
 
@@ -64,6 +64,16 @@ void shad_dir_iter_64
 // returns the number of addr to labelset mappings
 uint32_t shad_dir_occ_64(SdDir64 *shad_dir);
 
+/*
+  like shad_dir_iter_64, but calls app once for each run of addresses in
+  [addr, addr+len) that have the same labelset, in address order, with
+  the first address and the length of the run
+*/
+void shad_dir_iter_runs_64
+     (SdDir64 *shad_dir, uint64_t addr, uint64_t len,
+      int (*app)(uint64_t addr, uint64_t len, LabelSetP labelset, void *stuff1),
+      void *stuff2);
+
 // release all memory associated with this shad_dir
 void shad_dir_free_64(SdDir64 *shad_dir);
 int shad_dir_free_aux_64(uint64_t pa, SdPage *page, void *stuff);
@@ -78,6 +88,13 @@ int shad_dir_free_aux_64(uint64_t pa, SdPage *page, void *stuff);
 // remove this mapping from addr to labelset
 /*inline*/ void shad_dir_remove_64(SdDir64 *shad_dir, uint64_t addr);
 
+/*
+  map every address in [addr, addr+len) to ls_new, or remove their
+  mappings if ls_new is NULL.  Pages keep runs of addresses with the same
+  labelset, so whole sectors cost about as much as single bytes.
+*/
+void shad_dir_set_range_64(SdDir64 *shad_dir, uint64_t addr, uint64_t len, LabelSetP ls_new);
+
 // Return TRUE if this addr has a labelset (possibly empty), FALSE otherwise
 /*inline*/ uint32_t shad_dir_mem_64(SdDir64 *shad_dir, uint64_t addr);
 
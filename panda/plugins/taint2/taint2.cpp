@@ -37,11 +37,19 @@
 #include <llvm/ExecutionEngine/ExecutionEngine.h>
 #include <llvm/Transforms/IPO/PassManagerBuilder.h>
 
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <regex>
+#include <unordered_map>
+#include <vector>
+
 #include "shad_dir_32.h"
 #include "shad_dir_64.h"
 #include "llvm_taint_lib.h"
 #include "fast_shad.h"
 #include "taint_ops.h"
+#include "taint_queue.h"
 #include "taint2.h"
 #include "label_set.h"
 
@@ -54,6 +62,7 @@
 extern "C" {
 
 #include <sys/time.h>
+#include <unistd.h>
 
 #include "panda/rr/rr_log.h"
 #include "panda/addr.h"
@@ -70,6 +79,8 @@ extern int loglevel;
 void taint2_enable_taint(void);
 int taint2_enabled(void);
 void taint2_label_ram(uint64_t pa, uint32_t l) ;
+void taint2_label_ram_range(uint64_t pa, uint64_t len, uint32_t l);
+void taint2_label_ram_seq(uint64_t pa, uint64_t len, uint32_t first);
 void taint2_add_taint_ram_pos(CPUState *cpu, uint64_t addr, uint32_t length);
 void taint2_add_taint_ram_single_label(CPUState *cpu, uint64_t addr,
     uint32_t length, long label);
@@ -92,6 +103,9 @@ uint32_t taint2_query_tcn_llvm(int reg_num, int offset);
 
 uint64_t taint2_query_cb_mask(Addr a, uint8_t size);
 
+uint32_t taint2_query_range(Addr a, uint32_t len, TaintRangeSummary *summary);
+uint32_t taint2_query_ram_range(uint64_t pa, uint32_t len, TaintRangeSummary *summary);
+
 void taint2_labelset_spit(LabelSetP ls);
 
 void taint2_labelset_addr_iter(void *addr, int (*app)(uint32_t el, void *stuff1), void *stuff2);
@@ -105,6 +119,8 @@ uint32_t taint2_num_labels_applied(void);
 
 void taint2_track_taint_state(void);
 
+void taint2_union_cache_stats(uint64_t *hits, uint64_t *misses);
+
 }
 
 // These need to be extern "C" so that the ABI is compatible with
@@ -121,10 +137,16 @@ int after_block_exec(CPUState *cpu, TranslationBlock *tb);
 //int cb_cpu_restore_state(CPUState *cpu, TranslationBlock *tb);
 int guest_hypercall_callback(CPUState *cpu);
 
+bool before_block_exec_skip_llvm(CPUState *cpu, TranslationBlock *tb);
+bool tlb_watch_page(CPUState *cpu, uint64_t ram_addr);
+bool tlb_watched_access(CPUState *cpu, target_ulong addr, uint32_t size, bool is_write);
+
 int phys_mem_write_callback(CPUState *cpu, target_ulong pc, target_ulong addr,
                        target_ulong size, void *buf);
 int phys_mem_read_callback(CPUState *cpu, target_ulong pc, target_ulong addr,
         target_ulong size, void *buf);
+int replay_hd_transfer(CPUState *cpu, uint32_t type, uint64_t src_addr,
+        uint64_t dest_addr, uint32_t num_bytes);
 
 void taint_state_changed(FastShad *, uint64_t, uint64_t);
 PPP_PROT_REG_CB(on_taint_change);
@@ -161,6 +183,25 @@ static TaintGranularity granularity;
 static TaintLabelMode mode;
 bool optimize_llvm = true;
 extern bool inline_taint;
+extern bool decoupled_taint;
+extern bool optimize_taint_ops;
+
+// Two-tier mode: a block runs as its plain TCG code while no guest register
+// is tainted.  Tainted RAM pages are watched in the TLB, and an access to
+// one from TCG code is restarted, with the rest of the block run as LLVM.
+static bool tiered = false;
+static int tier_slot = -1; // tb->panda_data[] slot with the TIER_* flags
+// The block only touches guest memory through its own loads and stores,
+// which can be restarted; helpers that access memory can't be.
+#define TIER_TCG_OK 1
+// The block hit a tainted page running as TCG, so likely will again.
+#define TIER_HIT_TAINT 2
+static bool tier_force_llvm = false; // for the block after a restart
+static TranslationBlock *tier_tb = NULL; // last block run as TCG
+// ram's page taint events as of the last TLB flush: pages tainted since
+// may be in the TLB without TLB_PANDA_WATCH
+static uint64_t tier_watch_events = 0;
+static uint64_t tier_tcg_blocks = 0, tier_llvm_blocks = 0, tier_restarts = 0;
 
 
 /*
@@ -185,6 +226,21 @@ int phys_mem_read_callback(CPUState *cpu, target_ulong pc, target_ulong addr,
     return 0;
 }
 
+// Whole sectors at a time, between the disk shadow and the RAM shadow
+int replay_hd_transfer(CPUState *cpu, uint32_t type, uint64_t src_addr,
+        uint64_t dest_addr, uint32_t num_bytes) {
+    if (type != HD_TRANSFER_HD_TO_RAM && type != HD_TRANSFER_RAM_TO_HD) {
+        return 0;
+    }
+    taint_queue_drain();
+    if (type == HD_TRANSFER_HD_TO_RAM) {
+        tp_hd_to_ram(shadow, src_addr, dest_addr, num_bytes);
+    } else {
+        tp_ram_to_hd(shadow, src_addr, dest_addr, num_bytes);
+    }
+    return 0;
+}
+
 void verify(void) {
     llvm::Module *mod = tcg_llvm_ctx->getModule();
     std::string err;
@@ -211,12 +267,13 @@ void __taint2_enable_taint(void) {
     panda_register_callback(plugin_ptr, PANDA_CB_PHYS_MEM_READ, pcb);
     pcb.phys_mem_write = phys_mem_write_callback;
     panda_register_callback(plugin_ptr, PANDA_CB_PHYS_MEM_WRITE, pcb);
+    // taint follows the bytes DMA moves between disks and RAM
+    pcb.replay_hd_transfer = replay_hd_transfer;
+    panda_register_callback(plugin_ptr, PANDA_CB_REPLAY_HD_TRANSFER, pcb);
 /*
     pcb.cb_cpu_restore_state = cb_cpu_restore_state;
     panda_register_callback(plugin_ptr, PANDA_CB_CPU_RESTORE_STATE, pcb);
-    // for hd and network taint
-    pcb.replay_hd_transfer = cb_replay_hd_transfer_taint;
-    panda_register_callback(plugin_ptr, PANDA_CB_REPLAY_HD_TRANSFER, pcb);
+    // for network taint
     pcb.replay_net_transfer = cb_replay_net_transfer_taint;
     panda_register_callback(plugin_ptr, PANDA_CB_REPLAY_NET_TRANSFER, pcb);
     pcb.replay_before_cpu_physical_mem_rw_ram = cb_replay_cpu_physical_mem_rw_ram;
@@ -224,6 +281,17 @@ void __taint2_enable_taint(void) {
 */
     panda_enable_precise_pc(); //before_block_exec requires precise_pc for panda_current_asid
 
+    if (llvm_tier_threshold || tcg_llvm_async) {
+        // a block run as TCG would drop taint on the floor
+        printf("taint2: turning off -llvm-tier and -llvm-async, every block "
+                "needs taint ops.\n");
+        llvm_tier_threshold = 0;
+        tcg_llvm_async = 0;
+        // and blocks translated until now may have no LLVM code
+        if (execute_llvm) panda_do_flush_tb();
+    }
+    // taint ops are per block, and the trace passes would rework them
+    llvm_trace_threshold = 0;
     if (!execute_llvm){
         panda_enable_llvm();
     }
@@ -233,12 +301,32 @@ void __taint2_enable_taint(void) {
      * Taint processor initialization
      */
 
-    shadow = tp_init(TAINT_BYTE_LABEL, TAINT_GRANULARITY_BYTE);
+    shadow = tp_init(TAINT_BYTE_LABEL, TAINT_GRANULARITY_BYTE, tiered);
     if (shadow == NULL){
         printf("Error initializing shadow memory...\n");
         exit(1);
     }
 
+    if (tiered) {
+        tier_slot = panda_tb_data_slot_alloc();
+        if (tier_slot < 0) {
+            printf("taint2: No TB data slot left, not running in tiers.\n");
+            tiered = false;
+        }
+    }
+    if (decoupled_taint && !track_taint_state) {
+        taint_queue_start();
+    }
+
+    if (tiered) {
+        pcb.before_block_exec_skip_llvm = before_block_exec_skip_llvm;
+        panda_register_callback(plugin_ptr, PANDA_CB_BEFORE_BLOCK_EXEC_SKIP_LLVM, pcb);
+        pcb.tlb_watch_page = tlb_watch_page;
+        panda_register_callback(plugin_ptr, PANDA_CB_TLB_WATCH_PAGE, pcb);
+        pcb.tlb_watched_access = tlb_watched_access;
+        panda_register_callback(plugin_ptr, PANDA_CB_TLB_WATCHED_ACCESS, pcb);
+    }
+
     // Initialize memlog.
     memset(&taint_memlog, 0, sizeof(taint_memlog));
 
@@ -277,6 +365,71 @@ void __taint2_enable_taint(void) {
     printf("taint2: Done verifying module. Running...\n");
 }
 
+// TCG's own loads and stores, which call these in TCG code too
+static const std::regex tcgMemRegex("helper_(ret|be|le)_(ld|st)[us]?[bwlq]_mmu_panda");
+
+// Calls the taint pass adds: taint ops, and with inline=true whatever they
+// call, which is all C++ or label sets.  QEMU helpers are C.
+static bool tier_is_taint_op(const std::string &name) {
+    return name.compare(0, 2, "_Z") == 0 || name.compare(0, 6, "taint_") == 0 ||
+        name.compare(0, 10, "label_set_") == 0;
+}
+
+// Functions outside the module that never touch guest memory
+static const char *tier_pure_prefixes[] = {
+    "float", "int32_to_float", "int64_to_float", "uint64_to_float",
+    "raise_exception", "cpu_loop_exit",
+};
+
+static std::unordered_map<llvm::Function *, bool> tier_helper_memo;
+
+// Whether calling F might access guest memory.  Helpers are in the module
+// as LLVM, so we look inside them; anything else is assumed to.
+static bool tier_helper_touches_mem(llvm::Function *F) {
+    auto it = tier_helper_memo.find(F);
+    if (it != tier_helper_memo.end()) return it->second;
+    if (F->isIntrinsic()) return false;
+
+    std::string name = F->getName().str();
+    if (F->isDeclaration()) {
+        bool pure = false;
+        for (const char *prefix : tier_pure_prefixes) {
+            pure |= name.compare(0, strlen(prefix), prefix) == 0;
+        }
+        return tier_helper_memo[F] = !pure;
+    }
+
+    // assumed to while we look, in case it's recursive
+    tier_helper_memo[F] = true;
+    for (auto &BB : *F) {
+        for (auto &I : BB) {
+            llvm::CallInst *CI = llvm::dyn_cast<llvm::CallInst>(&I);
+            if (!CI) continue;
+            llvm::Function *callee = CI->getCalledFunction();
+            if (!callee || tier_helper_touches_mem(callee)) return true;
+        }
+    }
+    return tier_helper_memo[F] = false;
+}
+
+static bool tier_tcg_ok(llvm::Function *F) {
+    for (auto &BB : *F) {
+        for (auto &I : BB) {
+            llvm::CallInst *CI = llvm::dyn_cast<llvm::CallInst>(&I);
+            if (!CI) continue;
+            llvm::Function *callee = CI->getCalledFunction();
+            if (!callee) return false;
+            if (callee->isIntrinsic()) continue;
+            std::string name = callee->getName().str();
+            if (tier_is_taint_op(name) || std::regex_match(name, tcgMemRegex)) {
+                continue;
+            }
+            if (tier_helper_touches_mem(callee)) return false;
+        }
+    }
+    return true;
+}
+
 // Derive taint ops
 int after_block_translate(CPUState *cpu, TranslationBlock *tb){
 
@@ -285,11 +438,48 @@ int after_block_translate(CPUState *cpu, TranslationBlock *tb){
         // taintfp will make sure it never runs twice.
         //FPM->run(*(tb->llvm_function));
         //tb->llvm_function->dump();
+        if (tiered) {
+            tb->panda_data[tier_slot] = tier_tcg_ok(tb->llvm_function) ? TIER_TCG_OK : 0;
+        }
     }
 
     return 0;
 }
 
+// Tiered mode: run the block's TCG code if it can only pick up taint from
+// RAM, where tlb_watched_access catches it.
+bool before_block_exec_skip_llvm(CPUState *cpu, TranslationBlock *tb) {
+    uint64_t flags = tb->panda_data[tier_slot];
+    if (!taintEnabled || tier_force_llvm || !(flags & TIER_TCG_OK) ||
+            ((flags & TIER_HIT_TAINT) && !shadow->ram->clean()) ||
+            !shadow->grv->clean() || !shadow->gsv->clean()) {
+        tier_force_llvm = false;
+        tier_llvm_blocks++;
+        return false;
+    }
+    if (shadow->ram->get_page_taint_events() != tier_watch_events) {
+        tier_watch_events = shadow->ram->get_page_taint_events();
+        tlb_flush(cpu, 1);
+    }
+    tier_tb = tb;
+    tier_tcg_blocks++;
+    return true;
+}
+
+bool tlb_watch_page(CPUState *cpu, uint64_t ram_addr) {
+    return taintEnabled && !shadow->ram->pages_clean(ram_addr, TARGET_PAGE_SIZE);
+}
+
+// A tainted page accessed from TCG code: restart the instruction as LLVM.
+// execute_llvm is only off while a block runs as TCG.
+bool tlb_watched_access(CPUState *cpu, target_ulong addr, uint32_t size, bool is_write) {
+    if (!taintEnabled || execute_llvm) return false;
+    tier_tb->panda_data[tier_slot] |= TIER_HIT_TAINT;
+    tier_force_llvm = true;
+    tier_restarts++;
+    return true;
+}
+
 // Execute taint ops
 int after_block_exec(CPUState *cpu, TranslationBlock *tb) {
     if (taintJustDisabled){
@@ -383,7 +573,7 @@ void panda_virtual_string_read(CPUState *cpu, target_ulong vaddr, char *str) {
  */
 
 Panda__SrcInfo *pandalog_src_info_create(PandaHypercallStruct phs) {
-    Panda__SrcInfo *si = (Panda__SrcInfo *) malloc(sizeof(Panda__SrcInfo));
+    Panda__SrcInfo *si = pandalog_arena_new(Panda__SrcInfo);
     *si = PANDA__SRC_INFO__INIT;
     si->filename = phs.src_filename;
     si->astnodename = phs.src_ast_node_name;
@@ -399,8 +589,29 @@ Panda__SrcInfo *pandalog_src_info_create(PandaHypercallStruct phs) {
 }
 
 
-// used to ensure that we only write a label sets to pandalog once
-std::set < LabelSetP > ls_returned;
+// pandalog label set dictionary: the id each set queried so far was given,
+// and the sets given one since the last taint_label_set entries went out.
+// those can't be written from the query, which is in the middle of
+// building some other plugin's entry in the pandalog arena, so they wait
+// for the block boundary.
+static std::unordered_map<LabelSetP, uint32_t> ls_ids;
+static std::vector<std::pair<uint32_t, LabelSetP>> ls_pending;
+static uint32_t ls_next_id = 1;
+
+static void write_label_sets(void) {
+    for (auto &p : ls_pending) {
+        Panda__TaintLabelSet tls = PANDA__TAINT_LABEL_SET__INIT;
+        tls.id = p.first;
+        tls.n_label = ls_card(p.second);
+        tls.label = (uint32_t *) pandalog_arena_alloc(sizeof(uint32_t) * tls.n_label);
+        el_arr_ind = 0;
+        tp_ls_iter(p.second, collect_query_labels_pandalog, (void *) tls.label);
+        Panda__LogEntry ple = PANDA__LOG_ENTRY__INIT;
+        ple.taint_label_set = &tls;
+        pandalog_write_entry(&ple);
+    }
+    ls_pending.clear();
+}
 
 
 /*
@@ -421,28 +632,20 @@ std::set < LabelSetP > ls_returned;
 */
 
 Panda__TaintQuery *__taint2_query_pandalog (Addr a, uint32_t offset) {
+    taint_queue_drain();
     LabelSetP ls = tp_query(shadow, a);
     if (ls) {
-        Panda__TaintQuery *tq = (Panda__TaintQuery *) malloc(sizeof(Panda__TaintQuery));
+        Panda__TaintQuery *tq = pandalog_arena_new(Panda__TaintQuery);
         *tq = PANDA__TAINT_QUERY__INIT;
-        if (ls_returned.count(ls) == 0) {
-            // we only want to actually write a particular set contents to pandalog once
-            // this ls hasn't yet been written to pandalog
-            // write out mapping from ls pointer to labelset contents
-            // as its own separate log entry
-            ls_returned.insert(ls);
-            Panda__TaintQueryUniqueLabelSet *tquls =
-                (Panda__TaintQueryUniqueLabelSet *)
-                malloc (sizeof (Panda__TaintQueryUniqueLabelSet));
-            *tquls = PANDA__TAINT_QUERY_UNIQUE_LABEL_SET__INIT;
-            tquls->ptr = (uint64_t) ls;
-            tquls->n_label = ls_card(ls);
-            tquls->label = (uint32_t *) malloc (sizeof(uint32_t) * tquls->n_label);
-            el_arr_ind = 0;
-            tp_ls_iter(ls, collect_query_labels_pandalog, (void *) tquls->label);
-            tq->unique_label_set = tquls;
+        // the labels go to the pandalog once per set, as a taint_label_set
+        // entry, and queries refer to them by id
+        auto it = ls_ids.find(ls);
+        if (it == ls_ids.end()) {
+            it = ls_ids.emplace(ls, ls_next_id++).first;
+            ls_pending.emplace_back(it->second, ls);
         }
-        tq->ptr = (uint64_t) ls;
+        tq->has_label_set = 1;
+        tq->label_set = it->second;
         tq->tcn = taint2_query_tcn(a);
         // offset within larger thing being queried
         tq->offset = offset;
@@ -452,13 +655,8 @@ Panda__TaintQuery *__taint2_query_pandalog (Addr a, uint32_t offset) {
 }
 
 
+// nothing to do since it all came from the pandalog arena
 void __pandalog_taint_query_free(Panda__TaintQuery *tq) {
-    if (tq->unique_label_set) {
-        if (tq->unique_label_set->label) {
-            free(tq->unique_label_set->label);
-        }
-        free(tq->unique_label_set);
-    }
 }
 
 
@@ -499,7 +697,7 @@ void lava_taint_query (PandaHypercallStruct phs) {
         if (num_tainted) {
             // ok at least one byte in the extent is tainted
             // 1. write the pandalog entry that tells us something was tainted on this extent
-            Panda__TaintQueryHypercall *tqh = (Panda__TaintQueryHypercall *) malloc (sizeof (Panda__TaintQueryHypercall));
+            Panda__TaintQueryHypercall *tqh = pandalog_arena_new(Panda__TaintQueryHypercall);
             *tqh = PANDA__TAINT_QUERY_HYPERCALL__INIT;
             tqh->buf = phs.buf;
             tqh->len = len;
@@ -537,19 +735,13 @@ void lava_taint_query (PandaHypercallStruct phs) {
                 }
             }
             tqh->n_taint_query = tq.size();
-            tqh->taint_query = (Panda__TaintQuery **) malloc(sizeof(Panda__TaintQuery *) * tqh->n_taint_query);
+            tqh->taint_query = (Panda__TaintQuery **) pandalog_arena_alloc(sizeof(Panda__TaintQuery *) * tqh->n_taint_query);
             for (uint32_t i=0; i<tqh->n_taint_query; i++) {
                 tqh->taint_query[i] = tq[i];
             }
             Panda__LogEntry ple = PANDA__LOG_ENTRY__INIT;
             ple.taint_query_hypercall = tqh;
             pandalog_write_entry(&ple);
-            free(tqh->src_info);
-            pandalog_callstack_free(tqh->call_stack);
-            for (uint32_t i=0; i<tqh->n_taint_query; i++) {
-                __pandalog_taint_query_free(tqh->taint_query[i]);
-            }
-            free(tqh);
         }
     }
 }
@@ -557,7 +749,7 @@ void lava_taint_query (PandaHypercallStruct phs) {
 
 void lava_attack_point(PandaHypercallStruct phs) {
     if (pandalog) {
-        Panda__AttackPoint *ap = (Panda__AttackPoint *) malloc (sizeof (Panda__AttackPoint));
+        Panda__AttackPoint *ap = pandalog_arena_new(Panda__AttackPoint);
         *ap = PANDA__ATTACK_POINT__INIT;
         ap->info = phs.info;
         Panda__LogEntry ple = PANDA__LOG_ENTRY__INIT;
@@ -565,9 +757,6 @@ void lava_attack_point(PandaHypercallStruct phs) {
         ple.attack_point->src_info = pandalog_src_info_create(phs);
         ple.attack_point->call_stack = pandalog_callstack_create();
         pandalog_write_entry(&ple);
-        free(ple.attack_point->src_info);
-        pandalog_callstack_free(ple.attack_point->call_stack);
-        free(ap);
     }
 }
 
@@ -711,9 +900,20 @@ bool __taint2_enabled() {
 
 // label this phys addr in memory with this label
 void __taint2_label_ram(uint64_t pa, uint32_t l) {
+    taint_queue_drain();
     tp_label_ram(shadow, pa, l);
 }
 
+void __taint2_label_ram_range(uint64_t pa, uint64_t len, uint32_t l) {
+    taint_queue_drain();
+    tp_label_ram_range(shadow, pa, len, l);
+}
+
+void __taint2_label_ram_seq(uint64_t pa, uint64_t len, uint32_t first) {
+    taint_queue_drain();
+    tp_label_ram_seq(shadow, pa, len, first);
+}
+
 uint32_t taint_pos_count = 0;
 
 void label_byte(CPUState *cpu, target_ulong virt_addr, uint32_t label_num) {
@@ -764,6 +964,7 @@ void taint2_add_taint_ram_single_label(CPUState *cpu, uint64_t addr,
 }
 
 uint32_t __taint2_query(Addr a) {
+    taint_queue_drain();
     LabelSetP ls = tp_query(shadow, a);
     return ls_card(ls);
 }
@@ -771,17 +972,20 @@ uint32_t __taint2_query(Addr a) {
 // if phys addr pa is untainted, return 0.
 // else returns label set cardinality
 uint32_t __taint2_query_ram(uint64_t pa) {
+    taint_queue_drain();
     LabelSetP ls = tp_query_ram(shadow, pa);
     return ls_card(ls);
 }
 
 
 uint32_t __taint2_query_reg(int reg_num, int offset) {
+    taint_queue_drain();
     LabelSetP ls = tp_query_reg(shadow, reg_num, offset);
     return ls_card(ls);
 }
 
 uint32_t __taint2_query_llvm(int reg_num, int offset) {
+    taint_queue_drain();
     LabelSetP ls = tp_query_llvm(shadow, reg_num, offset);
     return ls_card(ls);
 }
@@ -789,31 +993,47 @@ uint32_t __taint2_query_llvm(int reg_num, int offset) {
 
 
 uint32_t __taint2_query_tcn(Addr a) {
+    taint_queue_drain();
     return tp_query_tcn(shadow, a);
 }
 
 uint32_t __taint2_query_tcn_ram(uint64_t pa) {
+    taint_queue_drain();
     return tp_query_tcn_ram(shadow, pa);
 }
 
 uint32_t __taint2_query_tcn_reg(int reg_num, int offset) {
+    taint_queue_drain();
     return tp_query_tcn_reg(shadow, reg_num, offset);
 }
 
 uint32_t __taint2_query_tcn_llvm(int reg_num, int offset) {
+    taint_queue_drain();
     return tp_query_tcn_llvm(shadow, reg_num, offset);
 }
 
 uint64_t __taint2_query_cb_mask(Addr a, uint8_t size) {
+    taint_queue_drain();
     return tp_query_cb_mask(shadow, a, size);
 }
 
+uint32_t __taint2_query_range(Addr a, uint32_t len, TaintRangeSummary *summary) {
+    taint_queue_drain();
+    return tp_query_range(shadow, a, len, summary);
+}
+
+uint32_t __taint2_query_ram_range(uint64_t pa, uint32_t len, TaintRangeSummary *summary) {
+    return __taint2_query_range(make_maddr(pa), len, summary);
+}
+
 
 uint32_t *__taint2_labels_applied(void) {
+    taint_queue_drain();
     return tp_labels_applied();
 }
 
 uint32_t __taint2_num_labels_applied(void) {
+    taint_queue_drain();
     return tp_num_labels_applied();
 }
 
@@ -821,10 +1041,12 @@ uint32_t __taint2_num_labels_applied(void) {
 
 
 void __taint2_delete_ram(uint64_t pa) {
+    taint_queue_drain();
     tp_delete_ram(shadow, pa);
 }
 
 void __taint2_labelset_spit(LabelSetP ls) {
+    taint_queue_drain();
     std::set<uint32_t> rendered(label_set_render_set(ls));
     for (uint32_t l : rendered) {
         printf("%u ", l);
@@ -834,26 +1056,42 @@ void __taint2_labelset_spit(LabelSetP ls) {
 
 
 void __taint2_labelset_iter(LabelSetP ls,  int (*app)(uint32_t el, void *stuff1), void *stuff2) {
+    taint_queue_drain();
     tp_ls_iter(ls, app, stuff2);
 }
 
 void __taint2_labelset_addr_iter(Addr *a, int (*app)(uint32_t el, void *stuff1), void *stuff2) {
+    taint_queue_drain();
     tp_ls_a_iter(shadow, a, app, stuff2);
 }
 
 void __taint2_labelset_ram_iter(uint64_t pa, int (*app)(uint32_t el, void *stuff1), void *stuff2) {
+    taint_queue_drain();
     tp_ls_ram_iter(shadow, pa, app, stuff2);
 }
 
 void __taint2_labelset_reg_iter(int reg_num, int offset, int (*app)(uint32_t el, void *stuff1), void *stuff2) {
+    taint_queue_drain();
     tp_ls_reg_iter(shadow, reg_num, offset, app, stuff2);
 }
 
 void __taint2_labelset_llvm_iter(int reg_num, int offset, int (*app)(uint32_t el, void *stuff1), void *stuff2) {
+    taint_queue_drain();
     tp_ls_llvm_iter(shadow, reg_num, offset, app, stuff2);
 }
 
 void __taint2_track_taint_state(void) {
+    // on_taint_change callbacks have to run on the emulation thread
+    if (taint_queue_running()) {
+        printf("taint2: Tracking taint state, so no more shadow thread.\n");
+        taint_queue_stop();
+    }
+    // on_taint_change should see every LLVM shadow write, including the
+    // ones the op cleanup drops, so retranslate without it
+    if (optimize_taint_ops) {
+        optimize_taint_ops = false;
+        if (taintEnabled) panda_do_flush_tb();
+    }
     track_taint_state = true;
 }
 
@@ -875,6 +1113,14 @@ void taint2_label_ram(uint64_t pa, uint32_t l) {
     __taint2_label_ram(pa, l);
 }
 
+void taint2_label_ram_range(uint64_t pa, uint64_t len, uint32_t l) {
+    __taint2_label_ram_range(pa, len, l);
+}
+
+void taint2_label_ram_seq(uint64_t pa, uint64_t len, uint32_t first) {
+    __taint2_label_ram_seq(pa, len, first);
+}
+
 
 Panda__TaintQuery *taint2_query_pandalog (Addr addr, uint32_t offset) {
     return __taint2_query_pandalog(addr, offset);
@@ -914,6 +1160,14 @@ uint64_t taint2_query_cb_mask(Addr a, uint8_t size) {
     return __taint2_query_cb_mask(a, size);
 }
 
+uint32_t taint2_query_range(Addr a, uint32_t len, TaintRangeSummary *summary) {
+    return __taint2_query_range(a, len, summary);
+}
+
+uint32_t taint2_query_ram_range(uint64_t pa, uint32_t len, TaintRangeSummary *summary) {
+    return __taint2_query_ram_range(pa, len, summary);
+}
+
 
 void taint2_delete_ram(uint64_t pa) {
   __taint2_delete_ram(pa);
@@ -967,13 +1221,41 @@ void taint2_track_taint_state(void) {
     __taint2_track_taint_state();
 }
 
+void taint2_union_cache_stats(uint64_t *hits, uint64_t *misses) {
+    taint_queue_drain();
+    label_set_union_stats(hits, misses);
+}
 
-////////////////////////////////////////////////////////////////////////////////////
-
-int before_block_exec(CPUState *cpu, TranslationBlock *tb) {
 
+////////////////////////////////////////////////////////////////////////////////////
 
+// Label set collection: once label sets take more than label_set_limit
+// bytes, the ones the shadow no longer holds are freed between blocks.
+static uint64_t label_set_limit = 0; // 0 to never collect
+static uint64_t label_set_next_collect = 0;
+
+static void collect_label_sets(void) {
+    taint_queue_drain();
+    tp_collect_labels(shadow);
+    // the dictionary names sets by address, which the collection changes, so
+    // each set gets a new id the next time it's queried
+    ls_ids.clear();
+    uint64_t live = label_set_memory();
+    label_set_next_collect = std::max(label_set_limit, 2 * live);
+    if (live > label_set_limit) {
+        printf("taint2: %" PRIu64 " MB of label sets still in use after "
+                "collecting, over ls_mem\n", live >> 20);
+    }
+}
 
+int before_block_exec(CPUState *cpu, TranslationBlock *tb) {
+    // before any collection, which moves the pending sets
+    if (!ls_pending.empty()) {
+        write_label_sets();
+    }
+    if (label_set_limit && label_set_memory() > label_set_next_collect) {
+        collect_label_sets();
+    }
     return 0;
 }
 
@@ -992,6 +1274,160 @@ void prstr(CPUState *cpu, uint32_t o, uint32_t va) {
 
 
 
+// Taint checkpoints: the taint state is saved as <replay>-taint-<n> when
+// the replay passes recording checkpoint n, and loaded back when a replay
+// starts from checkpoint n.
+static bool checkpoints = false;
+static size_t ckpt_next = 0; // next entry of rr_replay_checkpoints() to save at
+static bool ckpt_started = false;
+
+static std::string taint_checkpoint_path(uint32_t id) {
+    return std::string(rr_replay_base_name()) + "-taint-" + std::to_string(id);
+}
+
+static void taint_checkpoint_resume(void) {
+    const RR_checkpoint *start = rr_replay_start_checkpoint();
+    size_t n;
+    const RR_checkpoint *ckpts = rr_replay_checkpoints(&n);
+    while (ckpt_next < n &&
+            ckpts[ckpt_next].guest_instr_count <= start->guest_instr_count) {
+        ckpt_next++;
+    }
+    if (start->id == 0) return;
+
+    std::string path = taint_checkpoint_path(start->id);
+    if (access(path.c_str(), R_OK) != 0) {
+        printf("taint2: no taint checkpoint %s, starting with no taint\n",
+                path.c_str());
+        return;
+    }
+    __taint2_enable_taint();
+    uint64_t instr_count;
+    if (!tp_load(shadow, path.c_str(), &instr_count, &taint_pos_count)) return;
+    if (instr_count != start->guest_instr_count) {
+        printf("taint2: %s was taken at instr %" PRIu64 ", replay starts at %"
+                PRIu64 "\n", path.c_str(), instr_count, start->guest_instr_count);
+    }
+    printf("taint2: loaded taint checkpoint %s\n", path.c_str());
+}
+
+int checkpoint_before_block_exec(CPUState *cpu, TranslationBlock *tb) {
+    if (!rr_in_replay()) return 0;
+    if (!ckpt_started) {
+        ckpt_started = true;
+        taint_checkpoint_resume();
+    }
+
+    size_t n;
+    const RR_checkpoint *ckpts = rr_replay_checkpoints(&n);
+    uint64_t instr_count = rr_get_guest_instr_count();
+    if (ckpt_next >= n || instr_count < ckpts[ckpt_next].guest_instr_count) {
+        return 0;
+    }
+    // blocks don't end on checkpoints, so this is the first boundary after
+    const RR_checkpoint *ckpt = &ckpts[ckpt_next];
+    while (ckpt_next < n && ckpts[ckpt_next].guest_instr_count <= instr_count) {
+        ckpt_next++;
+    }
+    if (!taintEnabled) return 0;
+
+    taint_queue_drain();
+    std::string path = taint_checkpoint_path(ckpt->id);
+    if (tp_save(shadow, path.c_str(), instr_count, taint_pos_count)) {
+        printf("taint2: saved taint checkpoint %s\n", path.c_str());
+    } else {
+        printf("taint2: couldn't write taint checkpoint %s\n", path.c_str());
+    }
+    return 0;
+}
+
+// Network taint: in a replay of a recording made with -record-packets,
+// the bytes of each received packet are labeled where the NIC put them in
+// guest RAM, with one label for the whole packet or for its flow.
+static bool net_taint = false;
+static bool net_per_flow = false;
+static uint32_t net_label_base = 0;
+static uint32_t net_next_label = 0;
+static bool net_have_packet = false; // last packet was received
+static uint32_t net_label;           // and its label
+static uint64_t net_packets = 0;
+static uint64_t net_bytes = 0;
+static std::map<std::string, uint32_t> net_flows;
+
+// A flow is the protocol and the two endpoints, in the same order for both
+// directions.  Packets that aren't IP fall in one flow per ethertype.
+static std::string net_flow_key(const uint8_t *pkt, int size) {
+    int off = 12;
+    uint16_t ethertype = 0;
+    if (size >= off + 2) ethertype = (pkt[off] << 8) | pkt[off + 1];
+    while ((ethertype == 0x8100 || ethertype == 0x88a8) && size >= off + 6) {
+        off += 4;
+        ethertype = (pkt[off] << 8) | pkt[off + 1];
+    }
+    off += 2;
+
+    const uint8_t *src = NULL, *dst = NULL;
+    int addr_len = 0, l4 = -1;
+    uint8_t proto = 0;
+    if (ethertype == 0x0800 && size >= off + 20) {
+        const uint8_t *ip = pkt + off;
+        proto = ip[9];
+        src = ip + 12;
+        dst = ip + 16;
+        addr_len = 4;
+        // only the first fragment has the ports
+        if (((ip[6] & 0x1f) | ip[7]) == 0) l4 = off + (ip[0] & 0xf) * 4;
+    } else if (ethertype == 0x86dd && size >= off + 40) {
+        const uint8_t *ip = pkt + off;
+        proto = ip[6];
+        src = ip + 8;
+        dst = ip + 24;
+        addr_len = 16;
+        l4 = off + 40;
+    }
+
+    std::string key(1, (char)(ethertype >> 8));
+    key += (char)ethertype;
+    if (!src) return key;
+
+    std::string a((const char *)src, addr_len), b((const char *)dst, addr_len);
+    if ((proto == 6 || proto == 17) && l4 >= 0 && size >= l4 + 4) {
+        a.append((const char *)pkt + l4, 2);
+        b.append((const char *)pkt + l4 + 2, 2);
+    }
+    key += (char)proto;
+    if (b < a) std::swap(a, b);
+    return key + a + b;
+}
+
+int net_replay_handle_packet(CPUState *cpu, uint8_t *buf, int size,
+        uint8_t direction, uint64_t old_buf_addr) {
+    net_have_packet = (direction == PANDA_NET_RX);
+    if (!net_have_packet) return 0;
+
+    net_packets++;
+    if (!net_per_flow) {
+        net_label = net_label_base + net_next_label++;
+        return 0;
+    }
+    auto it = net_flows.insert(std::make_pair(net_flow_key(buf, size),
+                net_label_base + net_next_label));
+    if (it.second) net_next_label++;
+    net_label = it.first->second;
+    return 0;
+}
+
+int net_replay_net_transfer(CPUState *cpu, uint32_t type, uint64_t src_addr,
+        uint64_t dest_addr, uint32_t num_bytes) {
+    if (!net_have_packet || type != NET_TRANSFER_IOB_TO_RAM) return 0;
+
+    if (!taintEnabled) __taint2_enable_taint();
+    taint_queue_drain();
+    tp_label_ram_range(shadow, dest_addr, num_bytes, net_label);
+    net_bytes += num_bytes;
+    return 0;
+}
+
 bool before_block_exec_invalidate_opt(CPUState *cpu, TranslationBlock *tb) {
 
 
@@ -1045,6 +1481,65 @@ bool init_plugin(void *self) {
     if (panda_parse_bool(args, "binary")) mode = TAINT_BINARY_LABEL;
     if (panda_parse_bool(args, "word")) granularity = TAINT_GRANULARITY_WORD;
     optimize_llvm = panda_parse_bool(args, "opt");
+    FastShad::track_tcn = !panda_parse_bool(args, "no_tcn");
+    FastShad::track_cb = !panda_parse_bool(args, "no_cb");
+    tiered = panda_parse_bool(args, "tiered");
+#ifndef TARGET_I386
+    if (tiered) {
+        printf("taint2: tiered needs TCG code that counts instructions, "
+                "which only i386 has. Ignoring it.\n");
+        tiered = false;
+    }
+#endif
+    if (tiered) {
+        printf("taint2: Running blocks without taint as TCG.\n");
+    }
+    optimize_taint_ops = !panda_parse_bool(args, "no_taint_opt");
+    if (!optimize_taint_ops) {
+        printf("taint2: Not cleaning up generated taint ops.\n");
+    }
+    decoupled_taint = panda_parse_bool(args, "decoupled");
+    if (decoupled_taint && tiered) {
+        // tiered looks at the shadow before every block
+        printf("taint2: decoupled doesn't work with tiered. Ignoring it.\n");
+        decoupled_taint = false;
+    }
+    label_set_limit = panda_parse_uint64(args, "ls_mem", 0) << 20;
+    label_set_next_collect = label_set_limit;
+    if (label_set_limit) {
+        printf("taint2: Collecting unused label sets past %" PRIu64 " MB.\n",
+                label_set_limit >> 20);
+    }
+    checkpoints = panda_parse_bool(args, "checkpoints");
+    if (checkpoints) {
+        printf("taint2: Saving and loading taint at replay checkpoints.\n");
+        pcb.before_block_exec = checkpoint_before_block_exec;
+        panda_register_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC, pcb);
+    }
+    const char *net = panda_parse_string(args, "net", NULL);
+    if (net) {
+        if (!strcmp(net, "packet") || !strcmp(net, "flow")) {
+            net_taint = true;
+            net_per_flow = !strcmp(net, "flow");
+            net_label_base = panda_parse_uint32(args, "net_label_base",
+                    0x10000000);
+            printf("taint2: Labeling received packets by %s, from label "
+                    "0x%x.\n", net, net_label_base);
+            pcb.replay_handle_packet = net_replay_handle_packet;
+            panda_register_callback(self, PANDA_CB_REPLAY_HANDLE_PACKET, pcb);
+            pcb.replay_net_transfer = net_replay_net_transfer;
+            panda_register_callback(self, PANDA_CB_REPLAY_NET_TRANSFER, pcb);
+        } else {
+            printf("taint2: net must be packet or flow, not %s. Ignoring "
+                    "it.\n", net);
+        }
+    }
+    if (!FastShad::track_tcn) {
+        printf("taint2: Not tracking taint compute numbers.\n");
+    }
+    if (!FastShad::track_cb) {
+        printf("taint2: Not tracking controlled bits.\n");
+    }
 
     panda_require("callstack_instr");
     assert(init_callstack_instr_api());
@@ -1058,6 +1553,43 @@ void uninit_plugin(void *self) {
 
     printf ("uninit taint plugin\n");
 
+    taint_queue_stop();
+    if (pandalog) {
+        write_label_sets();
+    }
+
+    uint64_t hits, misses;
+    label_set_union_stats(&hits, &misses);
+    printf("taint2: label set union cache: %" PRIu64 " hits, %" PRIu64 " misses\n",
+            hits, misses);
+    printf("taint2: %" PRIu64 " label sets in %" PRIu64 " KB, %u labels applied\n",
+            label_set_count(), label_set_memory() >> 10, tp_num_labels_applied());
+    if (net_taint) {
+        printf("taint2: labeled %" PRIu64 " bytes of %" PRIu64 " received "
+                "packets with %u labels\n", net_bytes, net_packets,
+                net_next_label);
+    }
+    if (label_set_limit) {
+        uint64_t collections, freed;
+        label_set_collect_stats(&collections, &freed);
+        printf("taint2: label sets: %" PRIu64 " collections freed %" PRIu64
+                " MB, %" PRIu64 " MB in use\n", collections, freed >> 20,
+                label_set_memory() >> 20);
+    }
+    if (PTFP) {
+        llvm::PandaTaintVisitor &PTV = PTFP->PTV;
+        printf("taint2: op cleanup: %" PRIu64 " copies made pure, %" PRIu64
+                " reads forwarded, %" PRIu64 " dead ops removed, %" PRIu64
+                " overwritten register writes removed, %" PRIu64
+                " ops merged\n", PTV.optPureCopies, PTV.optForwarded,
+                PTV.optRemoved, PTV.optRegStores, PTV.optMerged);
+    }
+    if (tiered) {
+        printf("taint2: tiered: %" PRIu64 " blocks run as TCG, %" PRIu64
+                " as LLVM, %" PRIu64 " restarted\n",
+                tier_tcg_blocks, tier_llvm_blocks, tier_restarts);
+    }
+
     if (shadow) tp_free(shadow);
 
     panda_disable_llvm();
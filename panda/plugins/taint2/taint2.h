@@ -30,7 +30,7 @@
 
 //#define TAINTDEBUG // print out all debugging info for taint ops
 
-typedef const std::set<uint32_t> *LabelSetP;
+typedef const struct LabelSet *LabelSetP;
 typedef struct FastShad FastShad;
 typedef struct SdDir32 SdDir32;
 typedef struct SdDir64 SdDir64;
@@ -74,17 +74,37 @@ typedef struct shad_struct {
     TaintGranularity granularity;
 } Shad;
 
+// What a range query found in the bytes it looked at.
+typedef struct TaintRangeSummary {
+    uint32_t num_tainted; // bytes with a label set
+    LabelSetP ls;         // union of their label sets
+    uint32_t min_tcn;     // smallest and largest tcn of a tainted byte,
+    uint32_t max_tcn;     // 0 if none is tainted
+} TaintRangeSummary;
+
 // returns a shadow memory to be used by taint processor
-Shad *tp_init(TaintLabelMode mode, TaintGranularity granularity);
+Shad *tp_init(TaintLabelMode mode, TaintGranularity granularity, bool paged_regs);
 
 // Delete a shadow memory
 void tp_free(Shad *shad);
 
+// Free label sets that nothing in the shadow holds any more.
+void tp_collect_labels(Shad *shad);
+
 // label -- associate label l with address a
 void tp_label(Shad *shad, Addr *a, uint32_t l);
 
 
 void tp_label_ram(Shad *shad, uint64_t pa, uint32_t l);
+// label the len bytes of RAM from pa with l in one go
+void tp_label_ram_range(Shad *shad, uint64_t pa, uint64_t len, uint32_t l);
+// label the len bytes of RAM from pa with first, first + 1, ..., one
+// label per byte, as positional labeling of an input does
+void tp_label_ram_seq(Shad *shad, uint64_t pa, uint64_t len, uint32_t first);
+// move the taint of len bytes between the disk and RAM, as DMA moved the
+// bytes; whatever the destination held is replaced
+void tp_hd_to_ram(Shad *shad, uint64_t ha, uint64_t pa, uint64_t len);
+void tp_ram_to_hd(Shad *shad, uint64_t pa, uint64_t ha, uint64_t len);
 
 LabelSetP tp_query(Shad *shad, Addr a);
 LabelSetP tp_query_ram(Shad *shad, uint64_t pa) ;
@@ -98,6 +118,12 @@ uint32_t tp_query_tcn_llvm(Shad *shad, int reg_num, int offset);
 
 uint64_t tp_query_cb_mask(Shad *shad, Addr a, uint8_t size);
 
+// Summarize the taint on the len bytes from a, returning how many are
+// tainted.  summary may be NULL if only the count is wanted, which saves
+// building the union.  Clean pages of RAM are skipped without looking at
+// them.
+uint32_t tp_query_range(Shad *shad, Addr a, uint64_t len, TaintRangeSummary *summary);
+
 // label set cardinality
 uint32_t ls_card(LabelSetP ls);
 
@@ -110,6 +136,31 @@ void tp_ls_ram_iter(Shad *shad, uint64_t pa, int (*app)(uint32_t el, void *stuff
 void tp_ls_reg_iter(Shad *shad, int reg_num, int offset, int (*app)(uint32_t el, void *stuff1), void *stuff2);
 void tp_ls_llvm_iter(Shad *shad, int reg_num, int offset, int (*app)(uint32_t el, void *stuff1), void *stuff2);
 
+// The labels applied so far, as disjoint runs of consecutive labels, so
+// that labeling a big input positionally costs one entry rather than a
+// set node per byte.
+class LabelsApplied {
+    std::map<uint32_t, uint32_t> runs; // first label -> last label
+    uint64_t n = 0;
+
+public:
+    // add the labels first..last
+    void insert(uint32_t first, uint32_t last);
+    void insert(uint32_t l) { insert(l, l); }
+    uint64_t size() const { return n; }
+    void clear() { runs.clear(); n = 0; }
+
+    // fn(label) for each label, in increasing order
+    template <typename F>
+    void for_each(F fn) const {
+        for (auto &r : runs) {
+            for (uint64_t l = r.first; l <= r.second; l++) fn((uint32_t) l);
+        }
+    }
+};
+
+extern LabelsApplied labels_applied;
+
 // returns set of so-far applied labels as a sorted array
 // NB: This allocates memory. Caller frees.
 uint32_t *tp_labels_applied(void);
@@ -117,6 +168,14 @@ uint32_t *tp_labels_applied(void);
 // just tells how big that labels_applied set will be
 uint32_t tp_num_labels_applied(void);
 
+// Write the shadow state and applied labels to path, or load them back.
+// False if the file can't be written or isn't a taint checkpoint for
+// shadows of this size.
+bool tp_save(Shad *shad, const char *path, uint64_t guest_instr_count,
+        uint32_t taint_pos_count);
+bool tp_load(Shad *shad, const char *path, uint64_t *guest_instr_count,
+        uint32_t *taint_pos_count);
+
 Addr make_haddr(uint64_t a);
 Addr make_maddr(uint64_t a);
 Addr make_laddr(uint64_t a, uint64_t o);
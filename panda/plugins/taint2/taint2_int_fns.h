@@ -9,6 +9,7 @@
 
 typedef void *LabelSetP;
 typedef void Panda__TaintQuery;
+typedef struct TaintRangeSummary TaintRangeSummary;
 
 // turns on taint
 void taint2_enable_taint(void);
@@ -19,6 +20,12 @@ int taint2_enabled(void);
 // label this phys addr in memory with label l
 void taint2_label_ram(uint64_t pa, uint32_t l);
 
+// label the len bytes of physical memory from pa in one go, with l or, for
+// _seq, with first, first + 1, ..., one label per byte.  the range must not
+// cross a guest page unless the pages are contiguous in physical memory.
+void taint2_label_ram_range(uint64_t pa, uint64_t len, uint32_t l);
+void taint2_label_ram_seq(uint64_t pa, uint64_t len, uint32_t first);
+
 // query fns return 0 if untainted, else cardinality of taint set
 uint32_t taint2_query(Addr a);
 uint32_t taint2_query_ram(uint64_t pa);
@@ -35,6 +42,12 @@ uint32_t taint2_query_tcn_llvm(int reg_num, int offset);
 // reversibly from input).
 uint64_t taint2_query_cb_mask(Addr a, uint8_t size);
 
+// returns how many of the len bytes from a (or phys addr pa) are tainted.
+// if summary isn't NULL, it also gets the union of their label sets and
+// their smallest and largest tcn.  clean pages of ram cost O(1).
+uint32_t taint2_query_range(Addr a, uint32_t len, TaintRangeSummary *summary);
+uint32_t taint2_query_ram_range(uint64_t pa, uint32_t len, TaintRangeSummary *summary);
+
 // delete taint from this phys addr
 void taint2_delete_ram(uint64_t pa) ;
 
@@ -70,14 +83,20 @@ uint32_t taint2_num_labels_applied(void);
 // Track whether taint state actually changed during a BB
 void taint2_track_taint_state(void);
 
+// hits and misses so far of the memo of recent label set unions
+void taint2_union_cache_stats(uint64_t *hits, uint64_t *misses);
+
 
 // queries taint on this virtual addr and, if any taint there,
 // writes an entry to pandalog with lots of stuff like
 // label set, taint compute #, call stack
 // offset is needed since this is likely a query in the middle of an extent (of 4, 8, or more bytes)
+// the result is allocated in the pandalog arena, so it only lives until the
+// entry it goes in is written
 Panda__TaintQuery *taint2_query_pandalog (Addr addr, uint32_t offset) ;
 
-// used to free memory associated with that struct
+// used to free memory associated with that struct (a no-op now; kept for
+// existing callers)
 void pandalog_taint_query_free(Panda__TaintQuery *tq);
 
 #endif                                                                                   
@@ -0,0 +1,275 @@
+/* PANDABEGINCOMMENT
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+
+// Saving and restoring the whole taint state, so an analysis can pick up
+// from a replay checkpoint instead of from the start of the replay.
+//
+// A file is: a header, the distinct label sets in use (each as its sorted
+// labels), the labels ever applied, then each shadow as runs of equal
+// entries, with label sets as indices into the table (0 is the empty set).
+// Shadows are written sparsely, so a file's size goes with how much is
+// tainted rather than with guest RAM.  LLVM registers are dead between
+// blocks, where checkpoints are taken, so llv and ret aren't saved.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "panda/plugin.h"
+
+#include "shad_dir_32.h"
+#include "shad_dir_64.h"
+#include "taint2.h"
+#include "fast_shad.h"
+#include "label_set.h"
+
+
+#define TAINT_CKPT_MAGIC "PTAINT\0\1"
+
+struct TaintCkptHeader {
+    char magic[8];
+    uint64_t guest_instr_count;
+    uint32_t taint_pos_count;
+    uint32_t n_label_sets;
+    uint32_t n_labels_applied;
+    uint32_t pad;
+};
+
+struct TaintCkptRun {
+    uint64_t addr;
+    uint64_t len;
+    uint32_t ls;
+    uint32_t tcn;
+    uint8_t cb_mask;
+    uint8_t one_mask;
+    uint8_t zero_mask;
+    uint8_t pad[5];
+};
+
+struct TaintCkptDirEntry {
+    uint64_t addr;
+    uint32_t ls;
+    uint32_t pad;
+};
+
+namespace {
+
+// Label sets get their index the first time they're seen.
+class LabelSetTable {
+    std::unordered_map<LabelSetP, uint32_t> ids;
+public:
+    std::vector<LabelSetP> sets;
+
+    uint32_t id(LabelSetP ls) {
+        if (!ls) return 0;
+        auto it = ids.find(ls);
+        if (it != ids.end()) return it->second;
+        sets.push_back(ls);
+        return ids[ls] = sets.size();
+    }
+};
+
+struct SavedShad {
+    uint64_t size;
+    std::vector<TaintCkptRun> runs;
+};
+
+static void save_fast_shad(FastShad *fs, LabelSetTable &table, SavedShad &out) {
+    out.size = fs->get_size();
+    fs->for_each_run([&](uint64_t addr, uint64_t len, const TaintData &td) {
+        TaintCkptRun r;
+        memset(&r, 0, sizeof(r));
+        r.addr = addr;
+        r.len = len;
+        r.ls = table.id(td.ls);
+        r.tcn = td.tcn;
+        r.cb_mask = td.cb_mask;
+        r.one_mask = td.one_mask;
+        r.zero_mask = td.zero_mask;
+        out.runs.push_back(r);
+    });
+}
+
+struct DirSaver {
+    LabelSetTable *table;
+    std::vector<TaintCkptDirEntry> entries;
+};
+
+static int save_dir_entry_64(uint64_t addr, LabelSetP ls, void *opaque) {
+    DirSaver *ds = (DirSaver *)opaque;
+    TaintCkptDirEntry e = { addr, ds->table->id(ls), 0 };
+    ds->entries.push_back(e);
+    return 0;
+}
+
+static int save_dir_entry_32(uint32_t addr, LabelSetP ls, void *opaque) {
+    return save_dir_entry_64(addr, ls, opaque);
+}
+
+template <typename T>
+static bool write_vec(FILE *f, const std::vector<T> &v) {
+    uint64_t n = v.size();
+    return fwrite(&n, sizeof(n), 1, f) == 1 &&
+        (n == 0 || fwrite(v.data(), sizeof(T), n, f) == n);
+}
+
+template <typename T>
+static bool read_vec(FILE *f, std::vector<T> &v) {
+    uint64_t n;
+    if (fread(&n, sizeof(n), 1, f) != 1) return false;
+    v.resize(n);
+    return n == 0 || fread(v.data(), sizeof(T), n, f) == n;
+}
+
+static void collect_label(uint32_t l, void *opaque) {
+    ((std::vector<uint32_t> *)opaque)->push_back(l);
+}
+
+static bool load_fast_shad(FILE *f, FastShad *fs, const std::vector<LabelSetP> &sets) {
+    uint64_t size;
+    std::vector<TaintCkptRun> runs;
+    if (fread(&size, sizeof(size), 1, f) != 1 || !read_vec(f, runs)) return false;
+    if (size != fs->get_size()) {
+        printf("taint2: checkpoint has a %s shadow of %" PRIu64 " entries, not %"
+                PRIu64 "\n", fs->name(), size, fs->get_size());
+        return false;
+    }
+    fs->remove(0, size);
+    for (const TaintCkptRun &r : runs) {
+        if (r.ls > sets.size() || r.addr + r.len > size) return false;
+        TaintData td(r.ls ? sets[r.ls - 1] : NULL, r.tcn, r.cb_mask,
+                r.one_mask, r.zero_mask);
+        fs->fill(r.addr, r.len, td);
+    }
+    return true;
+}
+
+} // namespace
+
+bool tp_save(Shad *shad, const char *path, uint64_t guest_instr_count,
+        uint32_t taint_pos_count) {
+    LabelSetTable table;
+    SavedShad ram, grv, gsv;
+    save_fast_shad(shad->ram, table, ram);
+    save_fast_shad(shad->grv, table, grv);
+    save_fast_shad(shad->gsv, table, gsv);
+    DirSaver hd = { &table }, io = { &table }, ports = { &table };
+    shad_dir_iter_64(shad->hd, save_dir_entry_64, &hd);
+    shad_dir_iter_64(shad->io, save_dir_entry_64, &io);
+    shad_dir_iter_32(shad->ports, save_dir_entry_32, &ports);
+
+    // written under another name and moved into place, so a crash never
+    // leaves a truncated checkpoint behind
+    std::string tmp = std::string(path) + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f) return false;
+
+    TaintCkptHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TAINT_CKPT_MAGIC, sizeof(h.magic));
+    h.guest_instr_count = guest_instr_count;
+    h.taint_pos_count = taint_pos_count;
+    h.n_label_sets = table.sets.size();
+    h.n_labels_applied = labels_applied.size();
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+
+    std::vector<uint32_t> labels;
+    for (LabelSetP ls : table.sets) {
+        labels.clear();
+        label_set_iter(ls, collect_label, &labels);
+        std::sort(labels.begin(), labels.end());
+        ok = ok && write_vec(f, labels);
+    }
+    labels.clear();
+    labels_applied.for_each([&](uint32_t l) { labels.push_back(l); });
+    ok = ok && write_vec(f, labels);
+
+    for (SavedShad *s : { &ram, &grv, &gsv }) {
+        ok = ok && fwrite(&s->size, sizeof(s->size), 1, f) == 1 &&
+            write_vec(f, s->runs);
+    }
+    for (DirSaver *d : { &hd, &io, &ports }) {
+        ok = ok && write_vec(f, d->entries);
+    }
+
+    ok = fclose(f) == 0 && ok;
+    if (ok) ok = rename(tmp.c_str(), path) == 0;
+    if (!ok) remove(tmp.c_str());
+    return ok;
+}
+
+static SdDir64 *renew_dir_64(SdDir64 *dir) {
+    SdDir64 *fresh = shad_dir_new_64(dir->num_dir_bits, dir->num_table_bits,
+            dir->num_page_bits);
+    shad_dir_free_64(dir);
+    return fresh;
+}
+
+static SdDir32 *renew_dir_32(SdDir32 *dir) {
+    SdDir32 *fresh = shad_dir_new_32(dir->num_dir_bits, dir->num_table_bits,
+            dir->num_page_bits);
+    shad_dir_free_32(dir);
+    return fresh;
+}
+
+bool tp_load(Shad *shad, const char *path, uint64_t *guest_instr_count,
+        uint32_t *taint_pos_count) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return false;
+
+    TaintCkptHeader h;
+    bool ok = fread(&h, sizeof(h), 1, f) == 1 &&
+        memcmp(h.magic, TAINT_CKPT_MAGIC, sizeof(h.magic)) == 0;
+
+    std::vector<LabelSetP> sets;
+    std::vector<uint32_t> labels;
+    for (uint32_t i = 0; ok && i < h.n_label_sets; i++) {
+        ok = read_vec(f, labels);
+        if (ok) sets.push_back(label_set_from_sorted(labels.data(), labels.size()));
+    }
+    ok = ok && read_vec(f, labels);
+    if (ok) {
+        labels_applied.clear();
+        for (uint32_t l : labels) labels_applied.insert(l);
+    }
+
+    ok = ok && load_fast_shad(f, shad->ram, sets) &&
+        load_fast_shad(f, shad->grv, sets) && load_fast_shad(f, shad->gsv, sets);
+
+    std::vector<TaintCkptDirEntry> entries;
+    if (ok) {
+        shad->hd = renew_dir_64(shad->hd);
+        shad->io = renew_dir_64(shad->io);
+        shad->ports = renew_dir_32(shad->ports);
+    }
+    for (int d = 0; ok && d < 3; d++) {
+        ok = read_vec(f, entries);
+        for (const TaintCkptDirEntry &e : entries) {
+            if (!ok || e.ls == 0 || e.ls > sets.size()) {
+                ok = false;
+                break;
+            }
+            LabelSetP ls = sets[e.ls - 1];
+            if (d == 0) shad_dir_add_64(shad->hd, e.addr, ls);
+            else if (d == 1) shad_dir_add_64(shad->io, e.addr, ls);
+            else shad_dir_add_32(shad->ports, e.addr, ls);
+        }
+    }
+    fclose(f);
+
+    if (!ok) {
+        printf("taint2: %s isn't a usable taint checkpoint\n", path);
+        return false;
+    }
+    *guest_instr_count = h.guest_instr_count;
+    *taint_pos_count = h.taint_pos_count;
+    return true;
+}
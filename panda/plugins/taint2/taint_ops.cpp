@@ -75,16 +75,37 @@ struct CBMasks {
 static void update_cb(
         FastShad *shad_dest, uint64_t dest,
         FastShad *shad_src, uint64_t src, uint64_t size,
-        llvm::Instruction *I);
+        const TaintOpInst &ti);
 
 static inline CBMasks compile_cb_masks(FastShad *shad, uint64_t addr, uint64_t size);
 static inline void write_cb_masks(FastShad *shad, uint64_t addr, uint64_t size, CBMasks value);
 
+TaintOpInst taint_op_inst(FastShad *shad, llvm::Instruction *I) {
+    TaintOpInst ti = {0};
+    if (!I || !shad->tracks_cb()) return ti;
+
+    ti.opcode = I->getOpcode();
+    llvm::Value *rhs = I->getNumOperands() >= 2 ? I->getOperand(1) : nullptr;
+    llvm::ConstantInt *CI = rhs ? llvm::dyn_cast<llvm::ConstantInt>(rhs) : nullptr;
+    ti.literal = CI ? CI->getZExtValue() : ~0UL;
+    llvm::GetElementPtrInst *GEPI = llvm::dyn_cast<llvm::GetElementPtrInst>(I);
+    ti.gep_constant = GEPI && GEPI->hasAllConstantIndices();
+    return ti;
+}
+
 // Taint operations
 void taint_copy(
         FastShad *shad_dest, uint64_t dest,
         FastShad *shad_src, uint64_t src,
         uint64_t size, llvm::Instruction *I) {
+    taint_copy_ti(shad_dest, dest, shad_src, src, size,
+            taint_op_inst(shad_dest, I));
+}
+
+void taint_copy_ti(
+        FastShad *shad_dest, uint64_t dest,
+        FastShad *shad_src, uint64_t src,
+        uint64_t size, TaintOpInst ti) {
     taint_log("copy: %s[%lx+%lx] <- %s[%lx] (",
             shad_dest->name(), dest, size, shad_src->name(), src);
 #ifdef TAINTDEBUG
@@ -102,7 +123,7 @@ void taint_copy(
 
     FastShad::copy(shad_dest, dest, shad_src, src, size);
 
-    if (I) update_cb(shad_dest, dest, shad_src, src, size, I);
+    update_cb(shad_dest, dest, shad_src, src, size, ti);
 }
 
 void taint_parallel_compute(
@@ -110,6 +131,14 @@ void taint_parallel_compute(
         uint64_t dest, uint64_t ignored,
         uint64_t src1, uint64_t src2, uint64_t src_size,
         llvm::Instruction *I) {
+    taint_parallel_compute_ti(shad, dest, src1, src2, src_size,
+            taint_op_inst(shad, I));
+}
+
+void taint_parallel_compute_ti(
+        FastShad *shad, uint64_t dest,
+        uint64_t src1, uint64_t src2, uint64_t src_size,
+        TaintOpInst ti) {
     taint_log("pcompute: %s[%lx+%lx] <- %lx + %lx\n",
             shad->name(), dest, src_size, src1, src2);
     uint64_t i;
@@ -120,13 +149,15 @@ void taint_parallel_compute(
         shad->set_full(dest + i, td);
     }
 
+    if (!shad->tracks_cb()) return;
+
     // Unlike mixed computes, parallel computes guaranteed to be bitwise.
     // This means we can honestly compute CB masks; in fact we have to because
     // of the way e.g. the deposit TCG op is lifted to LLVM.
     CBMasks cb_mask_1 = compile_cb_masks(shad, src1, src_size);
     CBMasks cb_mask_2 = compile_cb_masks(shad, src2, src_size);
     CBMasks cb_mask_out = {0};
-    if (I && I->getOpcode() == llvm::Instruction::Or) {
+    if (ti.opcode == llvm::Instruction::Or) {
         cb_mask_out.one_mask = cb_mask_1.one_mask | cb_mask_2.one_mask;
         cb_mask_out.zero_mask = cb_mask_1.zero_mask & cb_mask_2.zero_mask;
         // Anything that's a literal zero in one operand will not affect
@@ -134,7 +165,7 @@ void taint_parallel_compute(
         cb_mask_out.cb_mask =
             (cb_mask_1.zero_mask & cb_mask_2.cb_mask) |
             (cb_mask_2.zero_mask & cb_mask_1.cb_mask);
-    } else if (I && I->getOpcode() == llvm::Instruction::And) {
+    } else if (ti.opcode == llvm::Instruction::And) {
         cb_mask_out.one_mask = cb_mask_1.one_mask & cb_mask_2.one_mask;
         cb_mask_out.zero_mask = cb_mask_1.zero_mask | cb_mask_2.zero_mask;
         // Anything that's a literal one in one operand will not affect
@@ -160,10 +191,7 @@ static inline TaintData mixed_labels(FastShad *shad, uint64_t addr, uint64_t siz
 }
 
 static inline void bulk_set(FastShad *shad, uint64_t addr, uint64_t size, TaintData td) {
-    uint64_t i;
-    for (i = 0; i < size; ++i) {
-        shad->set_full(addr + i, td);
-    }
+    shad->fill(addr, size, td);
 }
 
 void taint_mix_compute(
@@ -200,12 +228,20 @@ void taint_mix(
         uint64_t dest, uint64_t dest_size,
         uint64_t src, uint64_t src_size,
         llvm::Instruction *I) {
+    taint_mix_ti(shad, dest, dest_size, src, src_size, taint_op_inst(shad, I));
+}
+
+void taint_mix_ti(
+        FastShad *shad,
+        uint64_t dest, uint64_t dest_size,
+        uint64_t src, uint64_t src_size,
+        TaintOpInst ti) {
     taint_log("mix: %s[%lx+%lx] <- %lx+%lx\n",
             shad->name(), dest, dest_size, src, src_size);
     TaintData td = mixed_labels(shad, src, src_size, true);
     bulk_set(shad, dest, dest_size, td);
 
-    if (I) update_cb(shad, dest, shad, src, dest_size, I);
+    update_cb(shad, dest, shad, src, dest_size, ti);
 }
 
 static const uint64_t ones = ~0UL;
@@ -412,6 +448,7 @@ void taint_host_delete(
 // to reconstruct and deconstruct the full mask.
 static inline CBMasks compile_cb_masks(FastShad *shad, uint64_t addr, uint64_t size) {
     CBMasks result = {0};
+    if (!shad->tracks_cb()) return result;
     for (int i = size - 1; i >= 0; i--) {
         TaintData td = shad->query_full(addr + i);
         result.cb_mask <<= 8;
@@ -425,6 +462,7 @@ static inline CBMasks compile_cb_masks(FastShad *shad, uint64_t addr, uint64_t s
 }
 
 static inline void write_cb_masks(FastShad *shad, uint64_t addr, uint64_t size, CBMasks cb_masks) {
+    if (!shad->tracks_cb()) return;
     for (unsigned i = 0; i < size; i++) {
         TaintData td = shad->query_full(addr + i);
         td.cb_mask = (uint8_t)cb_masks.cb_mask;
@@ -440,8 +478,8 @@ static inline void write_cb_masks(FastShad *shad, uint64_t addr, uint64_t size,
 static void update_cb(
         FastShad *shad_dest, uint64_t dest,
         FastShad *shad_src, uint64_t src, uint64_t size,
-        llvm::Instruction *I) {
-    if (!I) return;
+        const TaintOpInst &ti) {
+    if (!ti.opcode || !shad_dest->tracks_cb()) return;
 
     CBMasks cb_masks = compile_cb_masks(shad_src, src, size);
     uint64_t &cb_mask = cb_masks.cb_mask;
@@ -449,12 +487,10 @@ static void update_cb(
     uint64_t &zero_mask = cb_masks.zero_mask;
 
     uint64_t orig_one_mask = one_mask, orig_zero_mask = zero_mask;
-    llvm::Value *rhs = I->getNumOperands() >= 2 ? I->getOperand(1) : nullptr;
-    llvm::ConstantInt *CI = rhs ? llvm::dyn_cast<llvm::ConstantInt>(rhs) : nullptr;
-    uint64_t literal = CI ? CI->getZExtValue() : ~0UL;
+    uint64_t literal = ti.literal;
     int log2 = 0;
 
-    switch (I->getOpcode()) {
+    switch (ti.opcode) {
         // Totally reversible cases.
         case llvm::Instruction::Add:
         case llvm::Instruction::Sub:
@@ -581,22 +617,17 @@ static void update_cb(
             break;
 
         case llvm::Instruction::GetElementPtr:
-        {
-            llvm::GetElementPtrInst *GEPI =
-                llvm::dyn_cast<llvm::GetElementPtrInst>(I);
-            tassert(GEPI);
             one_mask = 0;
             zero_mask = 0;
             // Constant indices => fully reversible
-            if (GEPI->hasAllConstantIndices()) break;
+            if (ti.gep_constant) break;
             // Otherwise we know nothing.
             cb_mask = 0;
             break;
-        }
 
         default:
-            printf("Unknown instruction in update_cb: ");
-            I->dump();
+            printf("Unknown instruction in update_cb: %s\n",
+                    llvm::Instruction::getOpcodeName(ti.opcode));
             fflush(stdout);
             return;
     }
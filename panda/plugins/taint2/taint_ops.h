@@ -56,6 +56,17 @@ void taint_breadcrumb(uint64_t *dest_ptr, uint64_t bb_slot);
 // Call out to PPP callback.
 void taint_branch(FastShad *shad, uint64_t src);
 
+// What update_cb needs from the instruction behind a copy, mix or parallel
+// compute.  Ops that run after their block is gone (with decoupled=true)
+// carry this instead of the llvm::Instruction.
+typedef struct TaintOpInst {
+    uint32_t opcode; // 0 when there's no instruction or cb isn't tracked
+    bool gep_constant; // all-constant GEP indices
+    uint64_t literal; // constant second operand, or ~0
+} TaintOpInst;
+
+TaintOpInst taint_op_inst(FastShad *shad, llvm::Instruction *I);
+
 // Taint operations
 //
 // These are all the taint operations which we will inline into the LLVM code
@@ -81,6 +92,21 @@ void taint_mix_compute(
         uint64_t src1, uint64_t src2, uint64_t src_size,
         llvm::Instruction *ignored);
 
+// The same three, with the instruction already boiled down.
+void taint_copy_ti(
+        FastShad *shad_dest, uint64_t dest,
+        FastShad *shad_src, uint64_t src,
+        uint64_t size, TaintOpInst ti);
+void taint_parallel_compute_ti(
+        FastShad *shad, uint64_t dest,
+        uint64_t src1, uint64_t src2, uint64_t src_size,
+        TaintOpInst ti);
+void taint_mix_ti(
+        FastShad *shad,
+        uint64_t dest, uint64_t dest_size,
+        uint64_t src, uint64_t src_size,
+        TaintOpInst ti);
+
 // Clear taint.
 void taint_delete(FastShad *shad, uint64_t dest, uint64_t size);
 
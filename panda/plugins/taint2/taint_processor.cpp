@@ -16,7 +16,9 @@ PANDAENDCOMMENT */
  * taint system - we've mostly left in place hard drive taint, etc.
  */
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
 
 #include "panda/addr.h"
 #include "panda/plugin.h"
@@ -84,9 +86,11 @@ Addr make_greg(uint64_t r, uint16_t off) {
 }
 
 /*
-   Initialize the shadow memory for taint processing.
+   Initialize the shadow memory for taint processing.  paged_regs pages the
+   guest register shadows too, which makes asking whether any register is
+   tainted O(1), at some cost to every register taint op.
  */
-Shad *tp_init(TaintLabelMode mode, TaintGranularity granularity) {
+Shad *tp_init(TaintLabelMode mode, TaintGranularity granularity, bool paged_regs) {
     //    Shad *shad = (Shad *) my_malloc(sizeof(Shad), poolid_taint_processor);
     void *tmp = malloc(sizeof(Shad));
     Shad *shad = new(tmp) Shad;
@@ -103,21 +107,21 @@ Shad *tp_init(TaintLabelMode mode, TaintGranularity granularity) {
 
     if (granularity == TAINT_GRANULARITY_BYTE) {
         printf("taint2: Creating byte-level taint processor\n");
-        shad->ram = new FastShad("RAM", ram_size);
+        shad->ram = new FastShad("RAM", ram_size, true);
         // we're working with LLVM values that can be up to 128 bits
         shad->llv = new FastShad("LLVM", MAXFRAMESIZE * FUNCTIONFRAMES * MAXREGSIZE);
         shad->ret = new FastShad("Ret", MAXREGSIZE);
         // guest registers are generally the size of the guest architecture
-        shad->grv = new FastShad("Reg", NUMREGS * sizeof(target_ulong));
+        shad->grv = new FastShad("Reg", NUMREGS * sizeof(target_ulong), paged_regs);
     } else {
         printf("taint2: Creating word-level taint processor\n");
-        shad->ram = new FastShad("RAM", ram_size / sizeof(target_ulong));
+        shad->ram = new FastShad("RAM", ram_size / sizeof(target_ulong), true);
         shad->llv = new FastShad("LLVM", MAXFRAMESIZE * FUNCTIONFRAMES);
         shad->ret = new FastShad("Ret", 1);
-        shad->grv = new FastShad("Reg", NUMREGS);
+        shad->grv = new FastShad("Reg", NUMREGS, paged_regs);
     }
 
-    shad->gsv = new FastShad("CPUArchState", sizeof(CPUArchState));
+    shad->gsv = new FastShad("CPUArchState", sizeof(CPUArchState), paged_regs);
 
     return shad;
 }
@@ -138,6 +142,38 @@ void tp_free(Shad *shad){
     free(shad);
 }
 
+static int forward_dir_64(uint64_t addr, LabelSetP ls, void *stuff) {
+    SdDir64 *dir = ((std::pair<SdDir64 *, const LabelSetForward *> *)stuff)->first;
+    const LabelSetForward &fwd =
+        *((std::pair<SdDir64 *, const LabelSetForward *> *)stuff)->second;
+    // addr is already mapped, so this only swaps the pointer
+    shad_dir_add_64(dir, addr, fwd(ls));
+    return 0;
+}
+
+static int forward_dir_32(uint32_t addr, LabelSetP ls, void *stuff) {
+    SdDir32 *dir = ((std::pair<SdDir32 *, const LabelSetForward *> *)stuff)->first;
+    const LabelSetForward &fwd =
+        *((std::pair<SdDir32 *, const LabelSetForward *> *)stuff)->second;
+    shad_dir_add_32(dir, addr, fwd(ls));
+    return 0;
+}
+
+// Free every label set the shadow no longer holds.  Only safe between
+// blocks, and with nothing else holding a LabelSetP.
+void tp_collect_labels(Shad *shad) {
+    label_set_collect([shad](const LabelSetForward &fwd) {
+        for (FastShad *fs : { shad->ram, shad->llv, shad->ret, shad->grv, shad->gsv }) {
+            fs->map_labels(fwd);
+        }
+        std::pair<SdDir64 *, const LabelSetForward *> hd(shad->hd, &fwd), io(shad->io, &fwd);
+        std::pair<SdDir32 *, const LabelSetForward *> ports(shad->ports, &fwd);
+        shad_dir_iter_64(shad->hd, forward_dir_64, &hd);
+        shad_dir_iter_64(shad->io, forward_dir_64, &io);
+        shad_dir_iter_32(shad->ports, forward_dir_32, &ports);
+    });
+}
+
 // returns a copy of the labelset associated with a.  or NULL if none.
 // so you'll need to call labelset_free on this pointer when done with it.
 LabelSetP tp_labelset_get(Shad *shad, Addr *a) {
@@ -259,8 +295,70 @@ uint64_t tp_query_cb_mask(Shad *shad, Addr a, uint8_t size) {
     return cb_mask;
 }
 
+static void summarize_byte(TaintRangeSummary *summary, LabelSetP ls, uint32_t tcn) {
+    if (summary->num_tainted == 0 || tcn < summary->min_tcn) summary->min_tcn = tcn;
+    if (summary->num_tainted == 0 || tcn > summary->max_tcn) summary->max_tcn = tcn;
+    summary->ls = label_set_union(summary->ls, ls);
+    summary->num_tainted++;
+}
+
+uint32_t tp_query_range(Shad *shad, Addr a, uint64_t len, TaintRangeSummary *summary) {
+    assert(shad != NULL);
+    TaintRangeSummary local;
+    if (summary == NULL) summary = &local;
+    memset(summary, 0, sizeof(*summary));
+
+    FastShad *fs;
+    uint64_t base;
+    switch (a.typ) {
+    case MADDR:
+        fs = shad->ram;
+        base = a.val.ma + a.off;
+        break;
+    case LADDR:
+        fs = shad->llv;
+        base = a.val.la*MAXREGSIZE + a.off;
+        break;
+    case GREG:
+        fs = shad->grv;
+        base = a.val.gr * sizeof(target_ulong) + a.off;
+        break;
+    case GSPEC:
+        fs = shad->gsv;
+        base = a.val.gs - NUMREGS + a.off;
+        break;
+    case RET:
+        fs = shad->ret;
+        base = a.off;
+        break;
+    case CONST:
+        return 0;
+    default:
+        // the directories hold no tcn, and have no counts to skip with
+        for (uint64_t i = 0; i < len; i++, a.off++) {
+            LabelSetP ls = tp_labelset_get(shad, &a);
+            if (ls) summarize_byte(summary, ls, 0);
+        }
+        return summary->num_tainted;
+    }
+    if (base >= fs->get_size()) return 0;
+    len = std::min(len, fs->get_size() - base);
+
+    if (summary == &local) {
+        // only the count is wanted
+        fs->for_each_tainted(base, len, [&](uint64_t, const TaintData &) {
+            local.num_tainted++;
+        });
+    } else {
+        fs->for_each_tainted(base, len, [&](uint64_t, const TaintData &td) {
+            summarize_byte(summary, td.ls, td.tcn);
+        });
+    }
+    return summary->num_tainted;
+}
+
 uint32_t ls_card(LabelSetP ls) {
-    return label_set_render_set(ls).size();
+    return label_set_card(ls);
 }
 
 
@@ -430,7 +528,28 @@ void addr_spit(Addr *a) {
 
 
 // used to keep track of labels that have been applied
-std::set < uint32_t > labels_applied;
+LabelsApplied labels_applied;
+
+void LabelsApplied::insert(uint32_t first, uint32_t last) {
+    // merge with the runs that overlap or touch first..last
+    auto it = runs.upper_bound(first);
+    if (it != runs.begin()) {
+        auto prev = std::prev(it);
+        if ((uint64_t) prev->second + 1 >= first) {
+            if (prev->second >= last) return;
+            first = prev->first;
+            n -= (uint64_t) prev->second - prev->first + 1;
+            runs.erase(prev);
+        }
+    }
+    while (it != runs.end() && it->first <= (uint64_t) last + 1) {
+        last = std::max(last, it->second);
+        n -= (uint64_t) it->second - it->first + 1;
+        it = runs.erase(it);
+    }
+    runs.emplace_hint(it, first, last);
+    n += (uint64_t) last - first + 1;
+}
 
 // label -- associate label l with address a
 void tp_label(Shad *shad, Addr *a, uint32_t l) {
@@ -446,10 +565,10 @@ void tp_label(Shad *shad, Addr *a, uint32_t l) {
 uint32_t *tp_labels_applied(void) {
     uint32_t *labels = (uint32_t *) malloc(sizeof(uint32_t) * labels_applied.size());
     uint32_t i=0;
-    for ( auto el : labels_applied ) {
+    labels_applied.for_each([&](uint32_t el) {
         labels[i] = el;
         i++;
-    }
+    });
     return labels;
 }
 
@@ -463,6 +582,70 @@ void tp_label_ram(Shad *shad, uint64_t pa, uint32_t l) {
     tp_label(shad, &a, l);
 }
 
+void tp_label_ram_range(Shad *shad, uint64_t pa, uint64_t len, uint32_t l) {
+    assert (shad != NULL);
+    uint64_t size = shad->ram->get_size();
+    if (pa >= size) return;
+    len = std::min(len, size - pa);
+    shad->ram->fill(pa, len, TaintData(label_set_singleton(l)));
+    labels_applied.insert(l);
+}
+
+void tp_label_ram_seq(Shad *shad, uint64_t pa, uint64_t len, uint32_t first) {
+    assert (shad != NULL);
+    uint64_t size = shad->ram->get_size();
+    if (pa >= size || len == 0) return;
+    len = std::min(len, size - pa);
+    // the labels stop at the last one rather than wrap
+    len = std::min(len, (uint64_t) UINT32_MAX - first + 1);
+    for (uint64_t i = 0; i < len; i++) {
+        shad->ram->label(pa + i, label_set_singleton(first + i));
+    }
+    labels_applied.insert(first, first + (uint32_t) (len - 1));
+}
+
+static int hd_run_to_ram(uint64_t ha, uint64_t len, LabelSetP ls, void *stuff) {
+    std::pair<Shad *, int64_t> *to = (std::pair<Shad *, int64_t> *)stuff;
+    to->first->ram->fill(ha + to->second, len, TaintData(ls));
+    return 0;
+}
+
+// The disk only keeps label sets, so the bytes come back with a fresh
+// compute number and all of their bits controlled.
+void tp_hd_to_ram(Shad *shad, uint64_t ha, uint64_t pa, uint64_t len) {
+    assert (shad != NULL);
+    uint64_t size = shad->ram->get_size();
+    if (pa >= size) return;
+    len = std::min(len, size - pa);
+    shad->ram->fill(pa, len, TaintData());
+    std::pair<Shad *, int64_t> to(shad, (int64_t)(pa - ha));
+    shad_dir_iter_runs_64(shad->hd, ha, len, hd_run_to_ram, &to);
+}
+
+void tp_ram_to_hd(Shad *shad, uint64_t pa, uint64_t ha, uint64_t len) {
+    assert (shad != NULL);
+    uint64_t size = shad->ram->get_size();
+    if (pa >= size) return;
+    len = std::min(len, size - pa);
+    shad_dir_set_range_64(shad->hd, ha, len, NULL);
+    if (shad->ram->range_clean(pa, len)) return;
+
+    // runs of bytes with the same label set go to the disk shadow in one go
+    uint64_t run_pa = 0, run_len = 0;
+    LabelSetP run_ls = NULL;
+    shad->ram->for_each_tainted(pa, len, [&](uint64_t a, const TaintData &td) {
+        if (run_len && a == run_pa + run_len && td.ls == run_ls) {
+            run_len++;
+            return;
+        }
+        if (run_len) shad_dir_set_range_64(shad->hd, ha + (run_pa - pa), run_len, run_ls);
+        run_pa = a;
+        run_len = 1;
+        run_ls = td.ls;
+    });
+    if (run_len) shad_dir_set_range_64(shad->hd, ha + (run_pa - pa), run_len, run_ls);
+}
+
 void tp_delete_ram(Shad *shad, uint64_t pa) {
     Addr a = make_maddr(pa);
     tp_delete(shad, &a);
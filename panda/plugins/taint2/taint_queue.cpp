@@ -0,0 +1,450 @@
+/* PANDABEGINCOMMENT
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+
+#ifndef __STDC_FORMAT_MACROS
+#define __STDC_FORMAT_MACROS
+#endif
+
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+#include <initializer_list>
+
+#include <sched.h>
+
+#include "panda/plugin.h"
+
+#include "qemu/thread.h"
+
+#include "fast_shad.h"
+#include "taint_ops.h"
+#include "taint_queue.h"
+
+// Ring size in words.  Most ops are 4-8 words, so this holds around a
+// million of them before the emulation thread has to wait.
+#define TAINT_QUEUE_WORDS (1UL << 22)
+#define TAINT_QUEUE_MASK (TAINT_QUEUE_WORDS - 1)
+
+// Spins on an empty ring before the shadow thread goes to sleep.
+#define TAINT_QUEUE_SPINS 4096
+
+enum TaintQueueOp {
+    TQ_COPY,
+    TQ_PARALLEL_COMPUTE,
+    TQ_MIX_COMPUTE,
+    TQ_DELETE,
+    TQ_SET,
+    TQ_MIX,
+    TQ_POINTER,
+    TQ_SEXT,
+    TQ_SELECT_COPY,
+    TQ_HOST_COPY,
+    TQ_HOST_MEMCPY,
+    TQ_HOST_DELETE,
+    TQ_RESET_FRAME,
+    TQ_PUSH_FRAME,
+    TQ_POP_FRAME,
+    TQ_NUM_OPS
+};
+
+// Argument words after the op word, in TaintQueueOp order.  A TaintOpInst
+// takes two.
+static const unsigned tq_arity[] = {
+    7, // TQ_COPY
+    7, // TQ_PARALLEL_COMPUTE
+    6, // TQ_MIX_COMPUTE
+    3, // TQ_DELETE
+    5, // TQ_SET
+    7, // TQ_MIX
+    8, // TQ_POINTER
+    5, // TQ_SEXT
+    4, // TQ_SELECT_COPY
+    9, // TQ_HOST_COPY
+    7, // TQ_HOST_MEMCPY
+    6, // TQ_HOST_DELETE
+    1, // TQ_RESET_FRAME
+    1, // TQ_PUSH_FRAME
+    1, // TQ_POP_FRAME
+};
+static_assert(sizeof(tq_arity) / sizeof(tq_arity[0]) == TQ_NUM_OPS,
+        "tq_arity out of date");
+
+// Single producer (the emulation thread), single consumer (the shadow
+// thread).  head and tail only grow; each is written by one side.
+static struct {
+    uint64_t *ring;
+    bool running;
+
+    alignas(64) std::atomic<uint64_t> head; // next word to write
+    uint64_t tail_seen; // the producer's last look at tail
+
+    alignas(64) std::atomic<uint64_t> tail; // next word to run
+    std::atomic<bool> sleeping;
+    bool stopping;
+
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+
+    uint64_t ops;
+    uint64_t drains;
+    uint64_t full_waits;
+} tq;
+
+static __thread bool on_shadow_thread;
+
+static inline uint64_t tq_inst_word(const TaintOpInst &ti) {
+    return ti.opcode | ((uint64_t)ti.gep_constant << 32);
+}
+
+static inline TaintOpInst tq_inst(uint64_t word, uint64_t literal) {
+    TaintOpInst ti;
+    ti.opcode = (uint32_t)word;
+    ti.gep_constant = (word >> 32) & 1;
+    ti.literal = literal;
+    return ti;
+}
+
+static void tq_wake(void) {
+    qemu_mutex_lock(&tq.lock);
+    qemu_cond_signal(&tq.cond);
+    qemu_mutex_unlock(&tq.lock);
+}
+
+static inline void tq_push(std::initializer_list<uint64_t> words) {
+    uint64_t n = words.size();
+    uint64_t h = tq.head.load(std::memory_order_relaxed);
+    while (TAINT_QUEUE_WORDS - (h - tq.tail_seen) < n) {
+        tq.tail_seen = tq.tail.load(std::memory_order_acquire);
+        if (TAINT_QUEUE_WORDS - (h - tq.tail_seen) >= n) break;
+        tq.full_waits++;
+        tq_wake();
+        sched_yield();
+    }
+
+    for (uint64_t w : words) {
+        tq.ring[h++ & TAINT_QUEUE_MASK] = w;
+    }
+    tq.head.store(h, std::memory_order_release);
+    tq.ops++;
+
+    // Without a fence this can miss the shadow thread just going to sleep.
+    // That only delays the op: the next push or any drain wakes it.
+    if (unlikely(tq.sleeping.load(std::memory_order_relaxed))) tq_wake();
+}
+
+// Run the op at word t and return how many words it took.
+static uint64_t tq_run(uint64_t t) {
+    uint64_t op = tq.ring[t & TAINT_QUEUE_MASK];
+    uint64_t a[9];
+    unsigned n = tq_arity[op];
+    for (unsigned i = 0; i < n; i++) {
+        a[i] = tq.ring[(t + 1 + i) & TAINT_QUEUE_MASK];
+    }
+
+#define S(i) ((FastShad *)a[i])
+    switch (op) {
+        case TQ_COPY:
+            taint_copy_ti(S(0), a[1], S(2), a[3], a[4], tq_inst(a[5], a[6]));
+            break;
+        case TQ_PARALLEL_COMPUTE:
+            taint_parallel_compute_ti(S(0), a[1], a[2], a[3], a[4],
+                    tq_inst(a[5], a[6]));
+            break;
+        case TQ_MIX_COMPUTE:
+            taint_mix_compute(S(0), a[1], a[2], a[3], a[4], a[5], nullptr);
+            break;
+        case TQ_DELETE:
+            taint_delete(S(0), a[1], a[2]);
+            break;
+        case TQ_SET:
+            taint_set(S(0), a[1], a[2], S(3), a[4]);
+            break;
+        case TQ_MIX:
+            taint_mix_ti(S(0), a[1], a[2], a[3], a[4], tq_inst(a[5], a[6]));
+            break;
+        case TQ_POINTER:
+            taint_pointer(S(0), a[1], S(2), a[3], a[4], S(5), a[6], a[7]);
+            break;
+        case TQ_SEXT:
+            taint_sext(S(0), a[1], a[2], a[3], a[4]);
+            break;
+        case TQ_SELECT_COPY:
+            FastShad::copy(S(0), a[1], S(0), a[2], a[3]);
+            break;
+        case TQ_HOST_COPY:
+            taint_host_copy(a[0], a[1], S(2), a[3], S(4), S(5), a[6], a[7], a[8]);
+            break;
+        case TQ_HOST_MEMCPY:
+            taint_host_memcpy(a[0], a[1], a[2], S(3), S(4), a[5], a[6]);
+            break;
+        case TQ_HOST_DELETE:
+            taint_host_delete(a[0], a[1], S(2), S(3), a[4], a[5]);
+            break;
+        case TQ_RESET_FRAME:
+            taint_reset_frame(S(0));
+            break;
+        case TQ_PUSH_FRAME:
+            taint_push_frame(S(0));
+            break;
+        case TQ_POP_FRAME:
+            taint_pop_frame(S(0));
+            break;
+        default:
+            assert(false && "bad taint queue op");
+    }
+#undef S
+
+    return 1 + n;
+}
+
+static void *taint_queue_thread(void *opaque) {
+    on_shadow_thread = true;
+    uint64_t t = tq.tail.load(std::memory_order_relaxed);
+
+    for (;;) {
+        uint64_t h = tq.head.load(std::memory_order_acquire);
+        for (unsigned i = 0; h == t && i < TAINT_QUEUE_SPINS; i++) {
+            cpu_relax();
+            h = tq.head.load(std::memory_order_acquire);
+        }
+        if (h == t) {
+            qemu_mutex_lock(&tq.lock);
+            tq.sleeping.store(true);
+            while ((h = tq.head.load()) == t && !tq.stopping) {
+                qemu_cond_wait(&tq.cond, &tq.lock);
+            }
+            tq.sleeping.store(false, std::memory_order_relaxed);
+            bool stop = h == t && tq.stopping;
+            qemu_mutex_unlock(&tq.lock);
+            if (stop) break;
+        }
+
+        while (t != h) {
+            t += tq_run(t);
+            tq.tail.store(t, std::memory_order_release);
+        }
+    }
+    return NULL;
+}
+
+void taint_queue_start(void) {
+    if (tq.running) return;
+    tq.ring = new uint64_t[TAINT_QUEUE_WORDS];
+    tq.head = 0;
+    tq.tail = 0;
+    tq.tail_seen = 0;
+    tq.stopping = false;
+    tq.sleeping = false;
+    qemu_mutex_init(&tq.lock);
+    qemu_cond_init(&tq.cond);
+    tq.running = true;
+    qemu_thread_create(&tq.thread, "taint2_shadow", taint_queue_thread,
+            NULL, QEMU_THREAD_JOINABLE);
+    printf("taint2: Running taint ops on a shadow thread.\n");
+}
+
+void taint_queue_stop(void) {
+    if (!tq.running) return;
+    qemu_mutex_lock(&tq.lock);
+    tq.stopping = true;
+    qemu_cond_signal(&tq.cond);
+    qemu_mutex_unlock(&tq.lock);
+    qemu_thread_join(&tq.thread);
+    assert(tq.tail.load() == tq.head.load());
+    tq.running = false;
+
+    qemu_cond_destroy(&tq.cond);
+    qemu_mutex_destroy(&tq.lock);
+    delete[] tq.ring;
+    tq.ring = NULL;
+    printf("taint2: shadow thread: %" PRIu64 " ops, %" PRIu64 " drains, %"
+            PRIu64 " waits on a full ring\n", tq.ops, tq.drains, tq.full_waits);
+}
+
+void taint_queue_drain(void) {
+    if (!tq.running || on_shadow_thread) return;
+    uint64_t h = tq.head.load(std::memory_order_relaxed);
+    if (tq.tail.load(std::memory_order_acquire) == h) return;
+    tq.drains++;
+    // The lock means it's either waiting and gets this or hasn't yet looked
+    // at head and will see everything.
+    tq_wake();
+    while (tq.tail.load(std::memory_order_acquire) != h) {
+        sched_yield();
+    }
+}
+
+bool taint_queue_running(void) {
+    return tq.running;
+}
+
+// The queued ops.  The llvm::Instruction is boiled down here, on the
+// emulation thread, since its block may be freed before the op runs.
+
+void taint_copy_queued(
+        FastShad *shad_dest, uint64_t dest,
+        FastShad *shad_src, uint64_t src,
+        uint64_t size, llvm::Instruction *I) {
+    if (!tq.running) return taint_copy(shad_dest, dest, shad_src, src, size, I);
+    TaintOpInst ti = taint_op_inst(shad_dest, I);
+    tq_push({ TQ_COPY, (uint64_t)shad_dest, dest, (uint64_t)shad_src, src,
+            size, tq_inst_word(ti), ti.literal });
+}
+
+void taint_parallel_compute_queued(
+        FastShad *shad,
+        uint64_t dest, uint64_t ignored,
+        uint64_t src1, uint64_t src2, uint64_t src_size,
+        llvm::Instruction *I) {
+    if (!tq.running) {
+        return taint_parallel_compute(shad, dest, ignored, src1, src2, src_size, I);
+    }
+    TaintOpInst ti = taint_op_inst(shad, I);
+    tq_push({ TQ_PARALLEL_COMPUTE, (uint64_t)shad, dest, src1, src2, src_size,
+            tq_inst_word(ti), ti.literal });
+}
+
+void taint_mix_compute_queued(
+        FastShad *shad,
+        uint64_t dest, uint64_t dest_size,
+        uint64_t src1, uint64_t src2, uint64_t src_size,
+        llvm::Instruction *ignored) {
+    if (!tq.running) {
+        return taint_mix_compute(shad, dest, dest_size, src1, src2, src_size, ignored);
+    }
+    tq_push({ TQ_MIX_COMPUTE, (uint64_t)shad, dest, dest_size, src1, src2,
+            src_size });
+}
+
+void taint_delete_queued(FastShad *shad, uint64_t dest, uint64_t size) {
+    if (!tq.running) return taint_delete(shad, dest, size);
+    tq_push({ TQ_DELETE, (uint64_t)shad, dest, size });
+}
+
+void taint_set_queued(
+        FastShad *shad_dest, uint64_t dest, uint64_t dest_size,
+        FastShad *shad_src, uint64_t src) {
+    if (!tq.running) return taint_set(shad_dest, dest, dest_size, shad_src, src);
+    tq_push({ TQ_SET, (uint64_t)shad_dest, dest, dest_size, (uint64_t)shad_src,
+            src });
+}
+
+void taint_mix_queued(
+        FastShad *shad,
+        uint64_t dest, uint64_t dest_size,
+        uint64_t src, uint64_t src_size,
+        llvm::Instruction *I) {
+    if (!tq.running) return taint_mix(shad, dest, dest_size, src, src_size, I);
+    TaintOpInst ti = taint_op_inst(shad, I);
+    tq_push({ TQ_MIX, (uint64_t)shad, dest, dest_size, src, src_size,
+            tq_inst_word(ti), ti.literal });
+}
+
+void taint_pointer_queued(
+        FastShad *shad_dest, uint64_t dest,
+        FastShad *shad_ptr, uint64_t ptr, uint64_t ptr_size,
+        FastShad *shad_src, uint64_t src, uint64_t size) {
+    if (!tq.running) {
+        return taint_pointer(shad_dest, dest, shad_ptr, ptr, ptr_size,
+                shad_src, src, size);
+    }
+    tq_push({ TQ_POINTER, (uint64_t)shad_dest, dest, (uint64_t)shad_ptr, ptr,
+            ptr_size, (uint64_t)shad_src, src, size });
+}
+
+void taint_sext_queued(
+        FastShad *shad,
+        uint64_t dest, uint64_t dest_size,
+        uint64_t src, uint64_t src_size) {
+    if (!tq.running) return taint_sext(shad, dest, dest_size, src, src_size);
+    tq_push({ TQ_SEXT, (uint64_t)shad, dest, dest_size, src, src_size });
+}
+
+// The selector is only known here, so pick the source now and queue a copy.
+void taint_select_queued(
+        FastShad *shad,
+        uint64_t dest, uint64_t size, uint64_t selector,
+        ...) {
+    const uint64_t ones = ~0UL;
+    va_list argp;
+    uint64_t src, srcsel;
+
+    va_start(argp, selector);
+    src = va_arg(argp, uint64_t);
+    srcsel = va_arg(argp, uint64_t);
+    while (!(src == ones && srcsel == ones)) {
+        if (srcsel == selector) {
+            va_end(argp);
+            if (src == ones) return; // constant
+            if (!tq.running) {
+                FastShad::copy(shad, dest, shad, src, size);
+            } else {
+                tq_push({ TQ_SELECT_COPY, (uint64_t)shad, dest, src, size });
+            }
+            return;
+        }
+
+        src = va_arg(argp, uint64_t);
+        srcsel = va_arg(argp, uint64_t);
+    }
+    va_end(argp);
+
+    tassert(false && "Couldn't find selected argument!!");
+}
+
+void taint_host_copy_queued(
+        uint64_t env_ptr, uint64_t addr,
+        FastShad *llv, uint64_t llv_offset,
+        FastShad *greg, FastShad *gspec,
+        uint64_t size, uint64_t labels_per_reg, bool is_store) {
+    if (!tq.running) {
+        return taint_host_copy(env_ptr, addr, llv, llv_offset, greg, gspec,
+                size, labels_per_reg, is_store);
+    }
+    tq_push({ TQ_HOST_COPY, env_ptr, addr, (uint64_t)llv, llv_offset,
+            (uint64_t)greg, (uint64_t)gspec, size, labels_per_reg, is_store });
+}
+
+void taint_host_memcpy_queued(
+        uint64_t env_ptr, uint64_t dest, uint64_t src,
+        FastShad *greg, FastShad *gspec,
+        uint64_t size, uint64_t labels_per_reg) {
+    if (!tq.running) {
+        return taint_host_memcpy(env_ptr, dest, src, greg, gspec, size,
+                labels_per_reg);
+    }
+    tq_push({ TQ_HOST_MEMCPY, env_ptr, dest, src, (uint64_t)greg,
+            (uint64_t)gspec, size, labels_per_reg });
+}
+
+void taint_host_delete_queued(
+        uint64_t env_ptr, uint64_t dest_addr,
+        FastShad *greg, FastShad *gspec,
+        uint64_t size, uint64_t labels_per_reg) {
+    if (!tq.running) {
+        return taint_host_delete(env_ptr, dest_addr, greg, gspec, size,
+                labels_per_reg);
+    }
+    tq_push({ TQ_HOST_DELETE, env_ptr, dest_addr, (uint64_t)greg,
+            (uint64_t)gspec, size, labels_per_reg });
+}
+
+void taint_reset_frame_queued(FastShad *shad) {
+    if (!tq.running) return taint_reset_frame(shad);
+    tq_push({ TQ_RESET_FRAME, (uint64_t)shad });
+}
+
+void taint_push_frame_queued(FastShad *shad) {
+    if (!tq.running) return taint_push_frame(shad);
+    tq_push({ TQ_PUSH_FRAME, (uint64_t)shad });
+}
+
+void taint_pop_frame_queued(FastShad *shad) {
+    if (!tq.running) return taint_pop_frame(shad);
+    tq_push({ TQ_POP_FRAME, (uint64_t)shad });
+}
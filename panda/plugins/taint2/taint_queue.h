@@ -0,0 +1,86 @@
+/* PANDABEGINCOMMENT
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+
+#ifndef __TAINT_QUEUE_H_
+#define __TAINT_QUEUE_H_
+
+// Decoupled taint propagation.  Generated code calls the _queued versions of
+// the taint ops, which only append the op and its arguments to a ring; a
+// shadow thread takes them off and runs the real ops in order.  Anything
+// else that reads or writes shadow state (queries, labeling, label set
+// iteration) must call taint_queue_drain() first.
+
+#include <cstdint>
+
+namespace llvm { class Instruction; }
+
+class FastShad;
+
+// Start the shadow thread.  Until then, and after taint_queue_stop(), the
+// _queued ops just run the op.
+void taint_queue_start(void);
+// Run everything queued and stop the shadow thread.
+void taint_queue_stop(void);
+// Wait until the shadow thread has run everything queued so far.  A no-op on
+// the shadow thread itself or when it isn't running.
+void taint_queue_drain(void);
+
+bool taint_queue_running(void);
+
+void taint_copy_queued(
+        FastShad *shad_dest, uint64_t dest,
+        FastShad *shad_src, uint64_t src,
+        uint64_t size, llvm::Instruction *I);
+void taint_parallel_compute_queued(
+        FastShad *shad,
+        uint64_t dest, uint64_t ignored,
+        uint64_t src1, uint64_t src2, uint64_t src_size,
+        llvm::Instruction *I);
+void taint_mix_compute_queued(
+        FastShad *shad,
+        uint64_t dest, uint64_t dest_size,
+        uint64_t src1, uint64_t src2, uint64_t src_size,
+        llvm::Instruction *ignored);
+void taint_delete_queued(FastShad *shad, uint64_t dest, uint64_t size);
+void taint_set_queued(
+        FastShad *shad_dest, uint64_t dest, uint64_t dest_size,
+        FastShad *shad_src, uint64_t src);
+void taint_mix_queued(
+        FastShad *shad,
+        uint64_t dest, uint64_t dest_size,
+        uint64_t src, uint64_t src_size,
+        llvm::Instruction *I);
+void taint_pointer_queued(
+        FastShad *shad_dest, uint64_t dest,
+        FastShad *shad_ptr, uint64_t ptr, uint64_t ptr_size,
+        FastShad *shad_src, uint64_t src, uint64_t size);
+void taint_sext_queued(
+        FastShad *shad,
+        uint64_t dest, uint64_t dest_size,
+        uint64_t src, uint64_t src_size);
+void taint_select_queued(
+        FastShad *shad,
+        uint64_t dest, uint64_t size, uint64_t selector,
+        ...);
+void taint_host_copy_queued(
+        uint64_t env_ptr, uint64_t addr,
+        FastShad *llv, uint64_t llv_offset,
+        FastShad *greg, FastShad *gspec,
+        uint64_t size, uint64_t labels_per_reg, bool is_store);
+void taint_host_memcpy_queued(
+        uint64_t env_ptr, uint64_t dest, uint64_t src,
+        FastShad *greg, FastShad *gspec,
+        uint64_t size, uint64_t labels_per_reg);
+void taint_host_delete_queued(
+        uint64_t env_ptr, uint64_t dest_addr,
+        FastShad *greg, FastShad *gspec,
+        uint64_t size, uint64_t labels_per_reg);
+void taint_reset_frame_queued(FastShad *shad);
+void taint_push_frame_queued(FastShad *shad);
+void taint_pop_frame_queued(FastShad *shad);
+
+#endif
@@ -0,0 +1,147 @@
+/*
+ * Guest side of the taint2 benchmarks.  Fills a buffer from /dev/urandom,
+ * labels it, runs one kernel over it and queries the result, so that
+ * nearly all of a recording of it is taint propagation through the kernel.
+ *
+ * usage: taint_bench <kernel> [bytes] [iterations] [pos]
+ *
+ * Kernels:
+ *   memcpy  copy the buffer
+ *   strcpy  copy the buffer as one NUL-free string
+ *   arith   a multiply/shift/xor mix over each word
+ *   crypto  RC4 keyed from the buffer, then the keystream xored over it;
+ *           every output byte comes out of a tainted table lookup
+ *   chase   follow a random cycle through the buffer, as indices; every
+ *           load goes through a tainted pointer
+ *
+ * "pos" labels each byte with its offset instead of every byte with one
+ * label, which makes for many more label sets.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "panda_mark.h"
+
+static void bench_memcpy(uint8_t *dst, const uint8_t *src, size_t n) {
+    memcpy(dst, src, n);
+}
+
+static void bench_strcpy(uint8_t *dst, uint8_t *src, size_t n) {
+    size_t i;
+    for (i = 0; i < n - 1; i++) {
+        if (src[i] == 0) src[i] = 1;
+    }
+    src[n - 1] = 0;
+    strcpy((char *)dst, (const char *)src);
+}
+
+static void bench_arith(uint8_t *dst, const uint8_t *src, size_t n) {
+    const uint32_t *in = (const uint32_t *)src;
+    uint32_t *out = (uint32_t *)dst;
+    uint32_t acc = 0x9e3779b9;
+    size_t i;
+    for (i = 0; i < n / 4; i++) {
+        acc = acc * 31 + in[i];
+        acc ^= acc >> 7;
+        out[i] = acc + (in[i] << 3);
+    }
+}
+
+static void bench_crypto(uint8_t *dst, const uint8_t *src, size_t n) {
+    uint8_t S[256];
+    unsigned i, j = 0;
+    size_t k;
+    for (i = 0; i < 256; i++) S[i] = i;
+    for (i = 0; i < 256; i++) {
+        uint8_t t = S[i];
+        j = (j + t + src[i % 16]) & 0xff;
+        S[i] = S[j];
+        S[j] = t;
+    }
+    i = j = 0;
+    for (k = 0; k < n; k++) {
+        uint8_t t;
+        i = (i + 1) & 0xff;
+        j = (j + S[i]) & 0xff;
+        t = S[i];
+        S[i] = S[j];
+        S[j] = t;
+        dst[k] = src[k] ^ S[(S[i] + S[j]) & 0xff];
+    }
+}
+
+static void bench_chase(uint8_t *dst, const uint8_t *src, size_t n) {
+    // Sattolo's shuffle, driven by the tainted input, makes next[] a single
+    // cycle through every slot
+    uint32_t *next = (uint32_t *)dst;
+    const uint32_t *rnd = (const uint32_t *)src;
+    size_t slots = n / 4, i;
+    uint32_t p = 0, sum = 0;
+    for (i = 0; i < slots; i++) next[i] = i;
+    for (i = slots - 1; i > 0; i--) {
+        size_t j = rnd[i] % i;
+        uint32_t t = next[i];
+        next[i] = next[j];
+        next[j] = t;
+    }
+    for (i = 0; i < slots; i++) {
+        p = next[p];
+        sum += p;
+    }
+    next[0] = sum;
+}
+
+int main(int argc, char *argv[]) {
+    const char *kernel;
+    size_t n = 1 << 20;
+    unsigned long iters = 1, it;
+    int pos = 0;
+    uint8_t *src, *dst;
+    FILE *f;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s memcpy|strcpy|arith|crypto|chase "
+                "[bytes] [iterations] [pos]\n", argv[0]);
+        return 1;
+    }
+    kernel = argv[1];
+    if (argc > 2) n = strtoul(argv[2], NULL, 0);
+    if (argc > 3) iters = strtoul(argv[3], NULL, 0);
+    if (argc > 4) pos = strcmp(argv[4], "pos") == 0;
+    n &= ~(size_t)3;
+    if (n < 16) n = 16;
+
+    src = malloc(n);
+    dst = malloc(n);
+    f = fopen("/dev/urandom", "r");
+    if (!src || !dst || !f || fread(src, 1, n, f) != n) {
+        fprintf(stderr, "couldn't set up a %zu byte buffer\n", n);
+        return 1;
+    }
+    fclose(f);
+
+    if (pos) {
+        hypercall((unsigned long)src, n, 0, LABEL_BUFFER_POS);
+    } else {
+        label_buffer((unsigned long)src, n);
+    }
+
+    for (it = 0; it < iters; it++) {
+        if (!strcmp(kernel, "memcpy")) bench_memcpy(dst, src, n);
+        else if (!strcmp(kernel, "strcpy")) bench_strcpy(dst, src, n);
+        else if (!strcmp(kernel, "arith")) bench_arith(dst, src, n);
+        else if (!strcmp(kernel, "crypto")) bench_crypto(dst, src, n);
+        else if (!strcmp(kernel, "chase")) bench_chase(dst, src, n);
+        else {
+            fprintf(stderr, "unknown kernel %s\n", kernel);
+            return 1;
+        }
+    }
+
+    query_buffer((unsigned long)dst, n);
+    printf("bench: %s %zu bytes x %lu\n", kernel, n, iters);
+    return 0;
+}
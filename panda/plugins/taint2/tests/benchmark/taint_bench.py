@@ -0,0 +1,120 @@
+#!/usr/bin/env python
+
+# Replay recordings of taint_bench under taint2 in a few configurations and
+# write one JSON object per (kernel, configuration) run, so results can be
+# compared across builds.
+#
+# usage: taint_bench.py [-o results.json] [--bytes N] [--iters N]
+#                       <qemu> <kernel>=<rr_basename> ... [-- qemu args]
+#
+# Each recording should be of "taint_bench <kernel> <bytes> <iters>" and
+# little else, since the whole replay is timed.  Every recording is
+# replayed once without taint, which gives the replay's own cost, and once
+# per taint2 configuration.  Throughput is guest bytes processed (bytes *
+# iters) per second of replay; "overhead" is the run's time over the replay
+# without taint.  Peak RSS is that of the QEMU process.
+
+from __future__ import print_function
+
+import sys, os
+import argparse
+import json
+import re
+import subprocess
+import time
+
+CONFIGS = [
+    ('notaint', None),
+    ('taint', ''),
+    ('no_tcn', 'no_tcn=y'),
+    ('no_cb', 'no_cb=y'),
+    ('no_tcn_cb', 'no_tcn=y,no_cb=y'),
+]
+
+# taint2's stats lines at exit
+LABEL_SETS_RE = re.compile(r'taint2: (\d+) label sets in (\d+) KB, (\d+) labels applied')
+UNION_RE = re.compile(r'taint2: label set union cache: (\d+) hits, (\d+) misses')
+
+def git_rev():
+    try:
+        return subprocess.check_output(['git', 'describe', '--always', '--dirty'],
+                cwd=os.path.dirname(os.path.abspath(__file__))).decode().strip()
+    except (EnvironmentError, subprocess.CalledProcessError):
+        return None
+
+# run cmd, returning (seconds, peak RSS in KB, exit status, output)
+def run(cmd, logname):
+    with open(logname, 'w') as log:
+        start = time.time()
+        p = subprocess.Popen(cmd, stdout=log, stderr=subprocess.STDOUT)
+        (_, status, usage) = os.wait4(p.pid, 0)
+        elapsed = time.time() - start
+    with open(logname) as log:
+        out = log.read()
+    return (elapsed, usage.ru_maxrss, status, out)
+
+def main():
+    argv = sys.argv[1:]
+    qemu_args = []
+    if '--' in argv:
+        qemu_args = argv[argv.index('--') + 1:]
+        argv = argv[:argv.index('--')]
+    parser = argparse.ArgumentParser(description="Benchmark taint2 propagation on taint_bench recordings")
+    parser.add_argument('-o', default='taint_bench.json', help="results, one JSON object per line (default taint_bench.json)")
+    parser.add_argument('--bytes', type=int, default=1 << 20, help="buffer size the recordings were made with (default 1M)")
+    parser.add_argument('--iters', type=int, default=1, help="iterations the recordings were made with (default 1)")
+    parser.add_argument('--taint-args', default='', help="extra taint2 arguments for every taint run")
+    parser.add_argument('qemu')
+    parser.add_argument('replays', nargs='+', metavar='kernel=rr_basename')
+    args = parser.parse_args(argv)
+
+    rev = git_rev()
+    guest_bytes = args.bytes * args.iters
+    failed = False
+    with open(args.o, 'a') as results:
+        for spec in args.replays:
+            if '=' not in spec:
+                print("expected kernel=rr_basename, not %s" % spec, file=sys.stderr)
+                sys.exit(1)
+            (kernel, base) = spec.split('=', 1)
+            baseline = None
+            for (name, taint_args) in CONFIGS:
+                cmd = [args.qemu] + qemu_args + ['-replay', base]
+                if taint_args is not None:
+                    plugin_args = ','.join(a for a in [taint_args, args.taint_args] if a)
+                    cmd += ['-panda', 'taint2' + (':' + plugin_args if plugin_args else '')]
+                logname = '%s.%s.out' % (base, name)
+                (secs, rss, status, out) = run(cmd, logname)
+                if status != 0:
+                    print("%s/%s failed; see %s" % (kernel, name, logname), file=sys.stderr)
+                    failed = True
+                    continue
+                if taint_args is None: baseline = secs
+                r = {
+                    'rev': rev,
+                    'kernel': kernel,
+                    'config': name,
+                    'guest_bytes': guest_bytes,
+                    'seconds': round(secs, 3),
+                    'bytes_per_sec': round(guest_bytes / secs) if secs > 0 else None,
+                    'overhead': round(secs / baseline, 2) if baseline else None,
+                    'peak_rss_kb': rss,
+                }
+                m = LABEL_SETS_RE.search(out)
+                if m:
+                    r['label_sets'] = int(m.group(1))
+                    r['label_set_kb'] = int(m.group(2))
+                    r['labels_applied'] = int(m.group(3))
+                m = UNION_RE.search(out)
+                if m:
+                    r['union_hits'] = int(m.group(1))
+                    r['union_misses'] = int(m.group(2))
+                results.write(json.dumps(r, sort_keys=True) + '\n')
+                results.flush()
+                print("%-8s %-10s %8.2fs %12s B/s %8d KB RSS %s label sets" % (kernel, name, secs,
+                    r['bytes_per_sec'], rss, r.get('label_sets', '-')))
+    if failed:
+        sys.exit(1)
+
+if __name__ == '__main__':
+    main()
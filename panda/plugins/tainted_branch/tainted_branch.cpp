@@ -54,12 +54,69 @@ void uninit_plugin(void *);
 #ifdef CONFIG_SOFTMMU
 
 bool summary = false;
+// in summary mode, write the counts every this many instructions (0: only
+// at the end of the replay)
+uint64_t summary_interval = 0;
+uint64_t next_summary_instr = 0;
+
+#include <unordered_map>
+
+// summary mode counts the executions of each tainted branch instead of
+// logging them one by one
+struct BranchKey {
+    uint64_t asid;
+    uint64_t pc;
+    uint64_t ls_hash;   // hash of the labels the branch depends on
+
+    bool operator==(const BranchKey &other) const {
+        return asid == other.asid && pc == other.pc &&
+               ls_hash == other.ls_hash;
+    }
+};
 
-#include <map>
-#include <set>
+struct BranchKeyHash {
+    size_t operator()(const BranchKey &k) const {
+        return std::hash<uint64_t>()(k.pc ^ (k.asid * 0x9E3779B97F4A7C15ULL)
+                                     ^ (k.ls_hash << 1));
+    }
+};
+
+struct BranchCount {
+    uint64_t count;
+    uint64_t first_instr;
+    uint64_t last_instr;
+};
+
+std::unordered_map<BranchKey, BranchCount, BranchKeyHash> tainted_branch;
+
+// FNV-1a over the labels of a set, which come in the same order for equal
+// sets
+static int hash_label(uint32_t el, void *stuff) {
+    uint64_t *h = (uint64_t *) stuff;
+    *h = (*h ^ el) * 0x100000001b3ULL;
+    return 0;
+}
 
-// map from asid -> pc
-std::map<uint64_t,std::set<uint64_t>> tainted_branch;
+static void write_summary(void) {
+    Panda__TaintedBranchSummary tbs;
+    for (auto &kvp : tainted_branch) {
+        tbs = PANDA__TAINTED_BRANCH_SUMMARY__INIT;
+        tbs.asid = kvp.first.asid;
+        tbs.pc = kvp.first.pc;
+        tbs.has_label_set_hash = true;
+        tbs.label_set_hash = kvp.first.ls_hash;
+        tbs.has_count = true;
+        tbs.count = kvp.second.count;
+        tbs.has_first_instr = true;
+        tbs.first_instr = kvp.second.first_instr;
+        tbs.has_last_instr = true;
+        tbs.last_instr = kvp.second.last_instr;
+        Panda__LogEntry ple = PANDA__LOG_ENTRY__INIT;
+        ple.tainted_branch_summary = &tbs;
+        pandalog_write_entry(&ple);
+    }
+    tainted_branch.clear();
+}
 
 
 void tbranch_on_branch_taint2(Addr a) {
@@ -68,24 +125,39 @@ void tbranch_on_branch_taint2(Addr a) {
         assert (a.typ == LADDR);
         // count number of tainted bytes on this reg
         // NB: assuming 8 bytes
-        uint32_t num_tainted = 0;
-        for (uint32_t o=0; o<8; o++) {
-            Addr ao =a;
-            ao.off = o;
-            num_tainted += (taint2_query(ao) != 0);
-        }
+        Addr a0 = a;
+        a0.off = 0;
+        TaintRangeSummary trs;
+        uint32_t num_tainted = taint2_query_range(a0, 8, summary ? &trs : NULL);
         if (num_tainted > 0) {
             if (summary) {
                 CPUState *cpu = first_cpu;
-                target_ulong asid = panda_current_asid(cpu);
-                tainted_branch[asid].insert(panda_current_pc(cpu));
+                uint64_t instr = rr_get_guest_instr_count();
+                BranchKey key;
+                key.asid = panda_current_asid(cpu);
+                key.pc = panda_current_pc(cpu);
+                key.ls_hash = 0xcbf29ce484222325ULL;
+                taint2_labelset_iter(trs.ls, hash_label, &key.ls_hash);
+
+                if (summary_interval && instr >= next_summary_instr) {
+                    write_summary();
+                    next_summary_instr = (instr / summary_interval + 1) * summary_interval;
+                }
+                auto it = tainted_branch.find(key);
+                if (it == tainted_branch.end()) {
+                    tainted_branch[key] = {1, instr, instr};
+                }
+                else {
+                    it->second.count++;
+                    it->second.last_instr = instr;
+                }
             }
             else {
-                Panda__TaintedBranch *tb = (Panda__TaintedBranch *) malloc(sizeof(Panda__TaintedBranch));
+                Panda__TaintedBranch *tb = pandalog_arena_new(Panda__TaintedBranch);
                 *tb = PANDA__TAINTED_BRANCH__INIT;
                 tb->call_stack = pandalog_callstack_create();
                 tb->n_taint_query = num_tainted;
-                tb->taint_query = (Panda__TaintQuery **) malloc (sizeof (Panda__TaintQuery *) * num_tainted);
+                tb->taint_query = (Panda__TaintQuery **) pandalog_arena_alloc(sizeof (Panda__TaintQuery *) * num_tainted);
                 uint32_t i=0;
                 for (uint32_t o=0; o<8; o++) {
                     Addr ao = a;
@@ -96,12 +168,8 @@ void tbranch_on_branch_taint2(Addr a) {
                 }
                 Panda__LogEntry ple = PANDA__LOG_ENTRY__INIT;
                 ple.tainted_branch = tb;
+                // everything in tb came from the pandalog arena
                 pandalog_write_entry(&ple);
-                pandalog_callstack_free(tb->call_stack);
-                for (uint32_t i=0; i<num_tainted; i++) {
-                    pandalog_taint_query_free(tb->taint_query[i]);
-                }
-                free(tb);
             }
         }
     }
@@ -115,9 +183,11 @@ bool init_plugin(void *self) {
     assert (init_callstack_instr_api());
     panda_require("taint2");
     assert (init_taint2_api());    
-    panda_arg_list *args = panda_get_args("tainted_instr");
+    panda_arg_list *args = panda_get_args("tainted_branch");
     summary = panda_parse_bool(args, "summary");
-    if (summary) printf ("tainted_instr summary mode\n"); else printf ("tainted_instr full mode\n");
+    summary_interval = panda_parse_uint64(args, "interval", 0);
+    next_summary_instr = summary_interval;
+    if (summary) printf ("tainted_branch summary mode\n"); else printf ("tainted_branch full mode\n");
     /*
     panda_cb pcb;
     pcb.after_block_exec = tbranch_after_block_exec;
@@ -129,20 +199,9 @@ bool init_plugin(void *self) {
 
 
 void uninit_plugin(void *self) {
+#ifdef CONFIG_SOFTMMU
     if (summary) {
-        Panda__TaintedBranchSummary *tbs = (Panda__TaintedBranchSummary *) malloc(sizeof(Panda__TaintedBranchSummary));
-        for (auto kvp : tainted_branch) {
-            uint64_t asid = kvp.first;
-            for (auto pc : kvp.second) {
-                *tbs = PANDA__TAINTED_BRANCH_SUMMARY__INIT;
-                tbs->asid = asid;
-                tbs->pc = pc;
-                Panda__LogEntry ple = PANDA__LOG_ENTRY__INIT;
-                ple.tainted_branch_summary = tbs;
-                pandalog_write_entry(&ple);
-            }
-        }
-        free(tbs);
-    }    
-    
+        write_summary();
+    }
+#endif
 }
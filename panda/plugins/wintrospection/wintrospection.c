@@ -18,6 +18,7 @@ PANDAENDCOMMENT */
 #include <dirent.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <glib.h>
 
 #include "panda/rr/rr_log.h"
 #include "panda/plugin.h"
@@ -45,12 +46,12 @@ void uninit_plugin(void *);
 
 uint32_t get_pid(CPUState *cpu, uint32_t eproc) {
     uint32_t pid;
-    panda_virtual_memory_rw(cpu, eproc+EPROC_PID_OFF, (uint8_t *)&pid, 4, false);
+    panda_virtual_memory_read_cached(cpu, eproc+EPROC_PID_OFF, (uint8_t *)&pid, 4);
     return pid;
 }
 
 void get_procname(CPUState *cpu, uint32_t eproc, char *name) {
-    panda_virtual_memory_rw(cpu, eproc+EPROC_NAME_OFF, (uint8_t *)name, 16, false);
+    panda_virtual_memory_read_cached(cpu, eproc+EPROC_NAME_OFF, (uint8_t *)name, 16);
     name[16] = '\0';
 }
 
@@ -61,15 +62,15 @@ uint32_t get_current_proc(CPUState *cpu) {
     uint32_t fs_base, thread, proc;
 
     // Read out the two 32-bit ints that make up a segment descriptor
-    panda_virtual_memory_rw(cpu, env->gdt.base + KMODE_FS, (uint8_t *)&e1, 4, false);
-    panda_virtual_memory_rw(cpu, env->gdt.base + KMODE_FS + 4, (uint8_t *)&e2, 4, false);
+    panda_virtual_memory_read_cached(cpu, env->gdt.base + KMODE_FS, (uint8_t *)&e1, 4);
+    panda_virtual_memory_read_cached(cpu, env->gdt.base + KMODE_FS + 4, (uint8_t *)&e2, 4);
 
     // Turn wacky segment into base
     fs_base = (e1 >> 16) | ((e2 & 0xff) << 16) | (e2 & 0xff000000);
 
     // Read KPCR->CurrentThread->Process
-    panda_virtual_memory_rw(cpu, fs_base+KPCR_CURTHREAD_OFF, (uint8_t *)&thread, 4, false);
-    panda_virtual_memory_rw(cpu, thread+KTHREAD_KPROC_OFF, (uint8_t *)&proc, 4, false);
+    panda_virtual_memory_read_cached(cpu, fs_base+KPCR_CURTHREAD_OFF, (uint8_t *)&thread, 4);
+    panda_virtual_memory_read_cached(cpu, thread+KTHREAD_KPROC_OFF, (uint8_t *)&proc, 4);
 
     return proc;
 }
@@ -144,7 +145,7 @@ typedef enum {
 static uint32_t handle_table_code(CPUState *cpu, uint32_t table_vaddr) {
     uint32_t tableCode;
     // HANDLE_TABLE.TableCode is offest 0
-    panda_virtual_memory_rw(cpu, table_vaddr, (uint8_t *)&tableCode, 4, false);
+    panda_virtual_memory_read_cached(cpu, table_vaddr, (uint8_t *)&tableCode, 4);
     return (tableCode & TABLE_MASK);
 }
 
@@ -184,7 +185,7 @@ static uint32_t handle_table_L3_entry(uint32_t table_vaddr, uint32_t L2_table, u
 uint32_t get_handle_table_entry(CPUState *cpu, uint32_t pHandleTable, uint32_t handle) {
     uint32_t tableCode, tableLevels;
     // get tablecode
-    panda_virtual_memory_rw(cpu, pHandleTable, (uint8_t *)&tableCode, 4, false);
+    panda_virtual_memory_read_cached(cpu, pHandleTable, (uint8_t *)&tableCode, 4);
     //printf ("tableCode = 0x%x\n", tableCode);
     // extract levels
     tableLevels = tableCode & LEVEL_MASK;
@@ -202,7 +203,7 @@ uint32_t get_handle_table_entry(CPUState *cpu, uint32_t pHandleTable, uint32_t h
         uint32_t L1_index = (handle & HANDLE_MASK2) >> HANDLE_SHIFT2;
         uint32_t L1_table_off = handle_table_L1_addr(cpu, pHandleTable, L1_index);
         uint32_t L1_table;
-        panda_virtual_memory_rw(cpu, L1_table_off, (uint8_t *) &L1_table, 4, false);
+        panda_virtual_memory_read_cached(cpu, L1_table_off, (uint8_t *) &L1_table, 4);
         uint32_t index = (handle & HANDLE_MASK1) >> HANDLE_SHIFT1;
         pEntry = handle_table_L2_entry(pHandleTable, L1_table, index);
     }
@@ -210,16 +211,16 @@ uint32_t get_handle_table_entry(CPUState *cpu, uint32_t pHandleTable, uint32_t h
         uint32_t L1_index = (handle & HANDLE_MASK3) >> HANDLE_SHIFT3;
         uint32_t L1_table_off = handle_table_L1_addr(cpu, pHandleTable, L1_index);
         uint32_t L1_table;
-        panda_virtual_memory_rw(cpu, L1_table_off, (uint8_t *) &L1_table, 4, false);
+        panda_virtual_memory_read_cached(cpu, L1_table_off, (uint8_t *) &L1_table, 4);
         uint32_t L2_index = (handle & HANDLE_MASK2) >> HANDLE_SHIFT2;
         uint32_t L2_table_off = handle_table_L2_addr(L1_table, L2_index);
         uint32_t L2_table;
-        panda_virtual_memory_rw(cpu, L2_table_off, (uint8_t *) &L2_table, 4, false);
+        panda_virtual_memory_read_cached(cpu, L2_table_off, (uint8_t *) &L2_table, 4);
         uint32_t index = (handle & HANDLE_MASK1) >> HANDLE_SHIFT1;
         pEntry = handle_table_L3_entry(pHandleTable, L2_table, index);
     }
     uint32_t pObjectHeader;
-    if ((panda_virtual_memory_rw(cpu, pEntry, (uint8_t *) &pObjectHeader, 4, false)) == -1) {
+    if ((panda_virtual_memory_read_cached(cpu, pEntry, (uint8_t *) &pObjectHeader, 4)) == -1) {
         return 0;
     }
     //  printf ("processHandle_to_pid pObjectHeader = 0x%x\n", pObjectHeader);
@@ -242,15 +243,15 @@ char *read_unicode_string(CPUState *cpu, uint32_t pUstr) {
     char *fileName = (char *)calloc(1, 260);
     char fileNameUnicode[260*2] = {};
 
-    panda_virtual_memory_rw(cpu, pUstr,
-            (uint8_t *) &fileNameLen, 2, false);
-    panda_virtual_memory_rw(cpu, pUstr+4,
-            (uint8_t *) &fileNamePtr, 4, false);
+    panda_virtual_memory_read_cached(cpu, pUstr,
+            (uint8_t *) &fileNameLen, 2);
+    panda_virtual_memory_read_cached(cpu, pUstr+4,
+            (uint8_t *) &fileNamePtr, 4);
 
     if (fileNameLen > 259*2) {
         fileNameLen = 259*2;
     }
-    panda_virtual_memory_rw(cpu, fileNamePtr, (uint8_t *)fileNameUnicode, fileNameLen, false);
+    panda_virtual_memory_read_cached(cpu, fileNamePtr, (uint8_t *)fileNameUnicode, fileNameLen);
     unicode_to_ascii(fileNameUnicode, fileName, fileNameLen/2);
 
     return fileName;
@@ -260,8 +261,8 @@ char *read_unicode_string(CPUState *cpu, uint32_t pUstr) {
 char * get_objname(CPUState *cpu, uint32_t obj) {
   uint32_t pObjectName;
 
-  panda_virtual_memory_rw(cpu, obj+OBJNAME_OFF,
-              (uint8_t *) &pObjectName, 4, false);
+  panda_virtual_memory_read_cached(cpu, obj+OBJNAME_OFF,
+              (uint8_t *) &pObjectName, 4);
   return read_unicode_string(cpu, pObjectName);
 }
 
@@ -273,35 +274,142 @@ char *get_file_obj_name(CPUState *cpu, uint32_t fobj) {
 #define FILE_OBJECT_POS_OFF 0x38
 int64_t get_file_obj_pos(CPUState *cpu, uint32_t fobj) {
     int64_t file_pos = -1;
-    if (-1 == panda_virtual_memory_rw(cpu, fobj+FILE_OBJECT_POS_OFF, (uint8_t *)&file_pos, 8, false))
+    if (-1 == panda_virtual_memory_read_cached(cpu, fobj+FILE_OBJECT_POS_OFF, (uint8_t *)&file_pos, 8))
         return -1;
     else
         return file_pos;
 }
 
-HandleObject *get_handle_object(CPUState *cpu, uint32_t eproc, uint32_t handle) {
+// Handle cache.  With handle_cache=true, the object (and, once asked for,
+// the name) behind each handle is remembered per EPROCESS, so that repeated
+// queries on the same handle don't walk the handle table and re-read the
+// object's UNICODE_STRING.  Entries are dropped when syscalls2 sees the
+// handle closed or handed out again; anything that may close handles of
+// some other process throws away the whole cache.
+typedef struct {
+    HandleObject ho;
+    char *name;
+} HandleCacheEntry;
+
+// eproc -> (handle -> HandleCacheEntry)
+static GHashTable *handle_cache = NULL;
+
+static void handle_cache_entry_free(gpointer data) {
+    HandleCacheEntry *e = (HandleCacheEntry *) data;
+    g_free(e->name);
+    g_free(e);
+}
+
+static GHashTable *handle_cache_proc(uint32_t eproc, bool create) {
+    GHashTable *proc = g_hash_table_lookup(handle_cache, GUINT_TO_POINTER(eproc));
+    if (proc == NULL && create) {
+        proc = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                     handle_cache_entry_free);
+        g_hash_table_insert(handle_cache, GUINT_TO_POINTER(eproc), proc);
+    }
+    return proc;
+}
+
+static void handle_cache_drop(CPUState *cpu, uint32_t handle) {
+    GHashTable *proc = handle_cache_proc(get_current_proc(cpu), false);
+    if (proc) {
+        g_hash_table_remove(proc, GUINT_TO_POINTER(handle));
+    }
+}
+
+// The new handle is returned through PHANDLE, its value may be that of a
+// handle closed behind our back.
+static void handle_cache_drop_ptr(CPUState *cpu, uint32_t pHandle) {
+    uint32_t handle;
+    if (-1 == panda_virtual_memory_read(cpu, pHandle, (uint8_t *)&handle, 4)) {
+        g_hash_table_remove_all(handle_cache);
+        return;
+    }
+    handle_cache_drop(cpu, handle);
+}
+
+static void handle_cache_NtClose_return(CPUState *cpu, target_ulong pc, uint32_t Handle) {
+    handle_cache_drop(cpu, Handle);
+}
+
+static void handle_cache_NtCreateFile_return(CPUState *cpu, target_ulong pc, uint32_t FileHandle, uint32_t DesiredAccess, uint32_t ObjectAttributes, uint32_t IoStatusBlock, uint32_t AllocationSize, uint32_t FileAttributes, uint32_t ShareAccess, uint32_t CreateDisposition, uint32_t CreateOptions, uint32_t EaBuffer, uint32_t EaLength) {
+    handle_cache_drop_ptr(cpu, FileHandle);
+}
+
+static void handle_cache_NtOpenFile_return(CPUState *cpu, target_ulong pc, uint32_t FileHandle, uint32_t DesiredAccess, uint32_t ObjectAttributes, uint32_t IoStatusBlock, uint32_t ShareAccess, uint32_t OpenOptions) {
+    handle_cache_drop_ptr(cpu, FileHandle);
+}
+
+// DUPLICATE_CLOSE_SOURCE and process exit close handles without NtClose
+static void handle_cache_NtDuplicateObject_return(CPUState *cpu, target_ulong pc, uint32_t SourceProcessHandle, uint32_t SourceHandle, uint32_t TargetProcessHandle, uint32_t TargetHandle, uint32_t DesiredAccess, uint32_t HandleAttributes, uint32_t Options) {
+    g_hash_table_remove_all(handle_cache);
+}
+
+static void handle_cache_NtTerminateProcess_enter(CPUState *cpu, target_ulong pc, uint32_t ProcessHandle, uint32_t ExitStatus) {
+    g_hash_table_remove_all(handle_cache);
+}
+
+static void handle_cache_init(void) {
+    panda_require("syscalls2");
+    handle_cache = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                         (GDestroyNotify) g_hash_table_destroy);
+    PPP_REG_CB("syscalls2", on_NtClose_return, handle_cache_NtClose_return);
+    PPP_REG_CB("syscalls2", on_NtCreateFile_return, handle_cache_NtCreateFile_return);
+    PPP_REG_CB("syscalls2", on_NtOpenFile_return, handle_cache_NtOpenFile_return);
+    PPP_REG_CB("syscalls2", on_NtDuplicateObject_return, handle_cache_NtDuplicateObject_return);
+    PPP_REG_CB("syscalls2", on_NtTerminateProcess_enter, handle_cache_NtTerminateProcess_enter);
+}
+
+static bool lookup_handle_object(CPUState *cpu, uint32_t eproc, uint32_t handle, HandleObject *ho) {
     uint32_t pObjectTable;
-    if (-1 == panda_virtual_memory_rw(cpu, eproc+EPROC_OBJTABLE_OFF, (uint8_t *)&pObjectTable, 4, false)) {
-        return NULL;
+    if (-1 == panda_virtual_memory_read_cached(cpu, eproc+EPROC_OBJTABLE_OFF, (uint8_t *)&pObjectTable, 4)) {
+        return false;
     }
     uint32_t pObjHeader = get_handle_table_entry(cpu, pObjectTable, handle);
-    if (pObjHeader == 0) return NULL;
-    uint32_t pObj = pObjHeader + 0x18;
+    if (pObjHeader == 0) return false;
     uint8_t objType = 0;
-    if (-1 == panda_virtual_memory_rw(cpu, pObjHeader+0xc, &objType, 1, false)) {
-        return NULL;
+    if (-1 == panda_virtual_memory_read_cached(cpu, pObjHeader+0xc, &objType, 1)) {
+        return false;
     }
-    HandleObject *ho = (HandleObject *) malloc(sizeof(HandleObject));
     ho->objType = objType;
-    ho->pObj = pObj;
-    return ho;
+    ho->pObj = pObjHeader + 0x18;
+    return true;
+}
+
+// Only handles that resolved are cached; the others may be paged in later.
+static HandleCacheEntry *handle_cache_lookup(CPUState *cpu, uint32_t eproc, uint32_t handle) {
+    GHashTable *proc = handle_cache_proc(eproc, true);
+    HandleCacheEntry *e = g_hash_table_lookup(proc, GUINT_TO_POINTER(handle));
+    HandleObject ho;
+
+    if (e == NULL && lookup_handle_object(cpu, eproc, handle, &ho)) {
+        e = g_new0(HandleCacheEntry, 1);
+        e->ho = ho;
+        g_hash_table_insert(proc, GUINT_TO_POINTER(handle), e);
+    }
+    return e;
+}
+
+HandleObject *get_handle_object(CPUState *cpu, uint32_t eproc, uint32_t handle) {
+    HandleObject *ho = (HandleObject *) malloc(sizeof(HandleObject));
+    if (handle_cache) {
+        HandleCacheEntry *e = handle_cache_lookup(cpu, eproc, handle);
+        if (e) {
+            *ho = e->ho;
+            return ho;
+        }
+    } else if (lookup_handle_object(cpu, eproc, handle, ho)) {
+        return ho;
+    }
+    free(ho);
+    return NULL;
 }
 
 /*
 HandleObject *get_handle_object_current(CPUState *cpu, uint32_t HandleVariable) {
   uint32_t eproc = get_current_proc(cpu);
   uint32_t handle;
-  if (-1 == panda_virtual_memory_rw(cpu, HandleVariable, (uint8_t *)&handle, 4, false)) {
+  if (-1 == panda_virtual_memory_read_cached(cpu, HandleVariable, (uint8_t *)&handle, 4)) {
     return NULL;
   }
   return get_handle_object(cpu, eproc, handle);
@@ -342,18 +450,35 @@ char *get_handle_object_name(CPUState *cpu, HandleObject *ho) {
 
 
 char * get_handle_name(CPUState *cpu, uint32_t eproc, uint32_t handle) {
+    if (handle_cache) {
+        HandleCacheEntry *e = handle_cache_lookup(cpu, eproc, handle);
+        if (e == NULL) {
+            return get_handle_object_name(cpu, NULL);
+        }
+        if (e->name == NULL) {
+            char *name = get_handle_object_name(cpu, &e->ho);
+            e->name = g_strdup(name);
+            free(name);
+        }
+        // callers own (and may free()) what we return
+        return strdup(e->name);
+    }
     HandleObject *ho = get_handle_object(cpu, eproc, handle);
-    return get_handle_object_name(cpu, ho);
+    char *name = get_handle_object_name(cpu, ho);
+    free(ho);
+    return name;
 }
 
+// The position changes with every read, so it is never cached.
 int64_t get_file_handle_pos(CPUState *cpu, uint32_t eproc, uint32_t handle) {
     HandleObject *ho = get_handle_object(cpu, eproc, handle);
+    int64_t pos;
     if (!ho) {
         return -1;
     }
-    else {
-        return get_file_obj_pos(cpu, ho->pObj);
-    }
+    pos = get_file_obj_pos(cpu, ho->pObj);
+    free(ho);
+    return pos;
 }
 
 #endif
@@ -367,6 +492,14 @@ bool init_plugin(void *self) {
     assert (panda_os_type == OST_WINDOWS);
     assert (panda_os_bits == 32);
     assert (0 == strcmp(panda_os_details, "7"));
+
+    panda_arg_list *args = panda_get_args("wintrospection");
+    bool use_cache = panda_parse_bool(args, "handle_cache");
+    panda_free_args(args);
+    if (use_cache) {
+        handle_cache_init();
+        printf("wintrospection: caching handle lookups.\n");
+    }
     return true;
 #else
     fprintf(stderr, "Plugin is not supported on this platform.\n");
@@ -377,4 +510,10 @@ bool init_plugin(void *self) {
 
 void uninit_plugin(void *self) {
     printf("Unloading wintrospection plugin\n");
+#ifdef TARGET_I386
+    if (handle_cache) {
+        g_hash_table_destroy(handle_cache);
+        handle_cache = NULL;
+    }
+#endif
 }
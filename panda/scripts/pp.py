@@ -114,6 +114,46 @@ package panda;
 
 """)
 
+# messages written by panda itself rather than by a plugin
+f.write("""
+message RrStats {
+required double instr_per_sec = 1;
+required uint64 log_bytes = 2;
+required double log_bytes_per_sec = 3;
+repeated uint64 entries = 4;
+required uint64 skipped_calls_ns = 5;
+repeated uint64 callback_ns = 6;
+}
+
+message TbProfileBlock {
+required uint64 pc = 1;
+required uint32 size = 2;
+required uint32 icount = 3;
+required uint64 executions = 4;
+required uint64 entries = 5;
+required uint32 samples = 6;
+}
+
+message TbProfile {
+required uint32 period_us = 1;
+repeated uint64 samples = 2;
+required uint64 samples_dropped = 3;
+repeated uint64 exits = 4;
+repeated TbProfileBlock blocks = 5;
+}
+
+message BlockLatencyHistogram {
+required string device = 1;
+required string type = 2;
+repeated uint64 boundaries = 3;
+repeated uint64 bins = 4;
+}
+
+message BlockLatency {
+repeated BlockLatencyHistogram histograms = 1;
+}
+""")
+
 for message in messages:
     f.write( message + "\n" )
 
@@ -123,6 +163,9 @@ message LogEntry {
 
 required uint64 pc = 1;
 required uint64 instr = 2;
+optional RrStats rr_stats = 1000;
+optional TbProfile tb_profile = 1001;
+optional BlockLatency block_latency = 1002;
 
 """)
 
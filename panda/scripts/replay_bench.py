@@ -0,0 +1,205 @@
+#!/usr/bin/env python
+
+# Measure PANDA's overhead: replay a set of reference recordings under a
+# fixed matrix of plugin configurations and report, for each pair, the
+# wall time, guest instructions per second, peak RSS and the time each
+# plugin spent in its callbacks, as JSON.
+#
+# usage: replay_bench.py [options] <qemu> <recording dir>
+#
+# The recording directory holds <name>-rr-snp / <name>-rr-nondet.log
+# pairs.  A <name>.bench.json next to them says what the recording needs
+# and what the configurations should look for, all of it optional:
+#
+#   { "qemu_args": ["-m", "256M"],
+#     "syscalls_profile": "linux_x86",      # syscalls2:profile=
+#     "kconf_group": "debian-3.2.65-i686",  # osi_linux:kconf_group=
+#     "kconf_file": "kernelinfo.conf",      # osi_linux:kconf_file=
+#     "search": "password",                 # stringsearch:str=
+#     "taint_file": "foo.txt" }             # file_taint:filename=
+#
+# A configuration is skipped for recordings that lack what it needs.
+# Replays run with -panda-profile, which times every callback, so the
+# absolute numbers are a little worse than without it; the comparisons
+# between configurations and between builds are what this is for.
+#
+# With --baseline <earlier report>, it also prints how each run's guest
+# instructions per second changed and exits 1 if any of them dropped by
+# more than --threshold.
+
+import argparse
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+def osi_linux(rec):
+    if 'kconf_group' not in rec or 'syscalls_profile' not in rec:
+        return None
+    osi = 'osi_linux:kconf_group=' + rec['kconf_group']
+    if 'kconf_file' in rec:
+        osi += ',kconf_file=' + rec['kconf_file']
+    return ['osi', osi, 'syscalls2:profile=' + rec['syscalls_profile']]
+
+def file_taint(rec):
+    base = osi_linux(rec)
+    if base is None or 'taint_file' not in rec:
+        return None
+    return base + ['taint2', 'file_taint:filename=' + rec['taint_file']]
+
+# name -> the -panda arguments for a recording, or None if it can't run
+CONFIGS = [
+    ('bare', lambda rec: []),
+    ('memcb', lambda rec: ['memcount']),
+    ('callstack_instr', lambda rec: ['callstack_instr']),
+    ('stringsearch', lambda rec: ['callstack_instr',
+                                  'stringsearch:str=' + rec['search']]
+                                 if 'search' in rec else None),
+    ('syscalls2_osi_linux', osi_linux),
+    ('taint2_file_taint', file_taint),
+]
+
+def find_recordings(d):
+    recs = []
+    for f in sorted(os.listdir(d)):
+        if not f.endswith('-rr-nondet.log'):
+            continue
+        name = f[:-len('-rr-nondet.log')]
+        rec = {}
+        side = os.path.join(d, name + '.bench.json')
+        if os.path.exists(side):
+            with open(side) as sf:
+                rec = json.load(sf)
+        rec['name'] = name
+        rec['base'] = os.path.abspath(os.path.join(d, name))
+        recs.append(rec)
+    return recs
+
+def run_one(qemu, rec, plugins, log):
+    tmp = tempfile.mkdtemp(prefix='replay_bench')
+    try:
+        stats_file = os.path.join(tmp, 'stats.json')
+        cmd = [qemu] + rec.get('qemu_args', []) + [
+            '-display', 'none', '-panda-profile',
+            '-replay-stats-file', stats_file, '-replay', rec['base']]
+        for p in plugins:
+            cmd += ['-panda', p]
+        log.write('$ ' + ' '.join(cmd) + '\n')
+        log.flush()
+        start = time.time()
+        proc = subprocess.Popen(cmd, cwd=tmp, stdout=log,
+                                stderr=subprocess.STDOUT)
+        _, status, usage = os.wait4(proc.pid, 0)
+        wall = time.time() - start
+        if status != 0 or not os.path.exists(stats_file):
+            return {'error': 'exit status %d' % status}
+        with open(stats_file) as f:
+            stats = json.load(f)
+    finally:
+        shutil.rmtree(tmp)
+
+    result = {
+        'wall-s': wall,
+        'guest-instructions': stats['guest-instructions'],
+        'instructions-per-sec': stats['instructions-per-sec'],
+        # kilobytes on Linux
+        'peak-rss-kb': usage.ru_maxrss,
+        'skipped-calls-ns': stats['skipped-calls-ns'],
+        'callback-ns': sum(c['ns'] for c in stats['callbacks']),
+        'plugins': {},
+    }
+    for p in stats['plugins']:
+        result['plugins'][p['name']] = {
+            'ns': p['ns'],
+            'callbacks': dict((c['type'], {'calls': c['calls'], 'ns': c['ns']})
+                              for c in p['callbacks']),
+        }
+    return result
+
+def compare(results, baseline, threshold):
+    old = dict(((r['recording'], r['config']), r) for r in baseline)
+    failed = False
+    for r in results:
+        b = old.get((r['recording'], r['config']))
+        if b is None or 'error' in r or 'error' in b:
+            continue
+        change = r['instructions-per-sec'] / b['instructions-per-sec'] - 1
+        r['change'] = change
+        mark = ''
+        if change < -threshold:
+            mark = '  <-- slower'
+            failed = True
+        sys.stderr.write('%-24s %-20s %12.0f instr/s (%+.1f%%)%s\n' %
+                         (r['recording'], r['config'],
+                          r['instructions-per-sec'], change * 100, mark))
+    return failed
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Replay reference recordings under standard plugin '
+                    'configurations and report the cost as JSON')
+    parser.add_argument('qemu', help='qemu-system-<arch> to run')
+    parser.add_argument('recordings', help='directory of recordings')
+    parser.add_argument('-c', '--config', action='append',
+                        choices=[c[0] for c in CONFIGS],
+                        help='run only these configurations')
+    parser.add_argument('-n', '--repeat', type=int, default=1,
+                        help='replays per pair; the fastest is reported')
+    parser.add_argument('-o', '--output', help='write the report here')
+    parser.add_argument('--log', default=os.devnull,
+                        help="where QEMU's output goes")
+    parser.add_argument('--baseline', help='earlier report to compare with')
+    parser.add_argument('--threshold', type=float, default=0.05,
+                        help='loss of instructions per second that counts '
+                             'as a regression (default 0.05)')
+    args = parser.parse_args()
+
+    recs = find_recordings(args.recordings)
+    if not recs:
+        sys.exit('no recordings in %s' % args.recordings)
+
+    results = []
+    with open(args.log, 'a') as log:
+        for rec in recs:
+            bare_wall = None
+            for name, plugins_for in CONFIGS:
+                if args.config and name not in args.config:
+                    continue
+                plugins = plugins_for(rec)
+                if plugins is None:
+                    continue
+                runs = [run_one(args.qemu, rec, plugins, log)
+                        for i in range(args.repeat)]
+                ok = [r for r in runs if 'error' not in r]
+                r = min(ok, key=lambda r: r['wall-s']) if ok else runs[0]
+                r['recording'] = rec['name']
+                r['config'] = name
+                if 'error' not in r:
+                    if name == 'bare':
+                        bare_wall = r['wall-s']
+                    elif bare_wall:
+                        r['slowdown'] = r['wall-s'] / bare_wall
+                else:
+                    sys.stderr.write('%s under %s failed: %s\n' %
+                                     (rec['name'], name, r['error']))
+                results.append(r)
+
+    failed = False
+    if args.baseline:
+        with open(args.baseline) as f:
+            failed = compare(results, json.load(f), args.threshold)
+
+    report = json.dumps(results, indent=4, sort_keys=True)
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(report + '\n')
+    else:
+        print(report)
+    if failed or any('error' in r for r in results):
+        sys.exit(1)
+
+if __name__ == '__main__':
+    main()
@@ -4,6 +4,7 @@ import sys, os
 import subprocess
 import struct
 import hashlib
+import glob
 
 RRPACK_MAGIC = "PANDA_RR"
 
@@ -40,7 +41,17 @@ outf.write(RRPACK_MAGIC)
 outf.write(struct.pack("<Q", num_guest_insns))
 outf.write("\0" * 16) # Placeholder for checksum
 outf.flush()
-subprocess.check_call(['tar', 'cJf', '-', base + '-rr-snp', base + '-rr-nondet.log'], stdout=outf)
+files = [base + '-rr-snp', base + '-rr-nondet.log']
+# RAM image from -record-mapped-ram, if any (checkpoint images match below)
+if os.path.exists(base + '-rr-snp.ram'):
+    files.append(base + '-rr-snp.ram')
+# Checkpoints from -record-checkpoint-interval, if any
+if os.path.exists(base + '-rr-nondet.idx'):
+    files.append(base + '-rr-nondet.idx')
+    files.extend(sorted(glob.glob(base + '-rr-snp-*')))
+# RAM images are sparse; xz -T0 compresses on all cores
+subprocess.check_call(['tar', '--sparse', '--use-compress-program', 'xz -T0',
+                       '-cf', '-'] + files, stdout=outf)
 outf.close()
 
 print "Calculating checksum...",
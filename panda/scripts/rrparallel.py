@@ -0,0 +1,194 @@
+#!/usr/bin/env python
+
+# Replay a checkpointed recording (see -record-checkpoint-interval) as K
+# independent segments, one QEMU process per segment, and merge the
+# pandalogs they produce into a single log in instruction order.
+#
+# usage: rrparallel.py [-j K] [-o out.plog] <qemu> <rr_basename> [-- qemu args]
+#
+# Everything after "--" is passed to every QEMU process, so that's where the
+# machine options and -panda plugin list go.  Segment i is replayed with
+#   -replay <rr_basename> -replay-start <start_i> -replay-end <start_i+1>
+# and writes <out.plog>.<i>, which is removed once merged.
+
+import sys, os
+import argparse
+import struct
+import subprocess
+import zlib
+
+# must match RR_checkpoint in panda/include/panda/rr/rr_log.h
+CKPT_FMT = "<QQII"
+CKPT_SIZE = struct.calcsize(CKPT_FMT)
+
+# must match PlHeader / PL_HEADER_SIZE in panda/include/panda/plog.h
+PL_HEADER_FMT = "<I4xQII"
+PL_HEADER_SIZE = 128
+PL_CURRENT_VERSION = 3
+PL_CODEC_ZLIB = 0
+PL_CODEC_NONE = 1
+
+# pandalog entries written outside the main loop have instr == -1
+NO_INSTR = (1 << 64) - 1
+
+def read_checkpoints(base):
+    ckpts = []
+    with open(base + '-rr-nondet.idx', 'rb') as f:
+        while True:
+            rec = f.read(CKPT_SIZE)
+            if len(rec) < CKPT_SIZE: break
+            (instr, offset, cid, _) = struct.unpack(CKPT_FMT, rec)
+            ckpts.append((instr, cid))
+    return ckpts
+
+def read_num_instructions(base):
+    with open(base + '-rr-nondet.log', 'rb') as f:
+        # num_guest_insns is 64-bit int at offset 16
+        f.seek(16)
+        return struct.unpack("<Q", f.read(8))[0]
+
+# pick up to k segment start points, each of them a checkpoint
+def plan_segments(ckpts, total, k):
+    starts = []
+    for i in range(k):
+        target = total * i / k
+        best = max(c[0] for c in ckpts if c[0] <= target)
+        if best not in starts:
+            starts.append(best)
+    return [(s, e) for (s, e) in zip(starts, starts[1:] + [None])]
+
+def read_varint(buf, i):
+    shift = 0
+    val = 0
+    while True:
+        b = ord(buf[i])
+        i += 1
+        val |= (b & 0x7f) << shift
+        if not (b & 0x80): return (val, i)
+        shift += 7
+
+# LogEntry.instr is field 2; protobuf-c packs fields in order so this only
+# ever looks at pc and instr.
+def entry_instr(buf, i, end):
+    while i < end:
+        (key, i) = read_varint(buf, i)
+        (field, wt) = (key >> 3, key & 7)
+        if wt == 0:
+            (val, i) = read_varint(buf, i)
+            if field == 2: return val
+        elif wt == 1: i += 8
+        elif wt == 5: i += 4
+        elif wt == 2:
+            (n, i) = read_varint(buf, i)
+            i += n
+        else: break
+    return NO_INSTR
+
+def read_plog_chunks(path):
+    with open(path, 'rb') as f:
+        data = f.read()
+    (version, dir_pos, chunk_size, codec) = struct.unpack_from(PL_HEADER_FMT, data, 0)
+    # codec was added in version 3; everything before is zlib
+    if version < 3: codec = PL_CODEC_ZLIB
+    (nc,) = struct.unpack_from("<I", data, dir_pos)
+    dirents = [struct.unpack_from("<QQQ", data, dir_pos + 4 + 24 * i) for i in range(nc)]
+    for i in range(nc):
+        start = dirents[i][1]
+        end = dirents[i+1][1] if i + 1 < nc else dir_pos
+        if codec == PL_CODEC_NONE:
+            yield (chunk_size, data[start:end])
+        else:
+            yield (chunk_size, zlib.decompressobj().decompress(data[start:end]))
+
+# copy entries of segment log path with start <= instr < end into outf.
+# returns the directory entries for the chunks written.
+def merge_segment(path, start, end, outf, chunk_size):
+    dirents = []
+    for (cs, raw) in read_plog_chunks(path):
+        chunk_size[0] = max(chunk_size[0], cs)
+        kept = []
+        first_instr = None
+        i = 0
+        while i < len(raw):
+            (n,) = struct.unpack_from("<I", raw, i)
+            instr = entry_instr(raw, i + 4, i + 4 + n)
+            in_range = instr >= start and (end is None or instr < end)
+            # out-of-main-loop entries (uninit_plugin etc) come from every
+            # segment; keep them all, in segment order
+            if in_range or instr == NO_INSTR:
+                kept.append(raw[i:i + 4 + n])
+                if first_instr is None and instr != NO_INSTR:
+                    first_instr = instr
+            i += 4 + n
+        if not kept: continue
+        pos = outf.tell()
+        outf.write(zlib.compress("".join(kept), 9))
+        dirents.append((first_instr if first_instr is not None else start, pos, len(kept)))
+    return dirents
+
+def main():
+    argv = sys.argv[1:]
+    qemu_args = []
+    if '--' in argv:
+        qemu_args = argv[argv.index('--') + 1:]
+        argv = argv[:argv.index('--')]
+    parser = argparse.ArgumentParser(description="Replay a checkpointed recording in parallel segments")
+    parser.add_argument('-j', type=int, default=4, help="number of segments (default 4)")
+    parser.add_argument('-o', default=None, help="merged pandalog (default <rr_basename>.plog)")
+    parser.add_argument('qemu')
+    parser.add_argument('base')
+    args = parser.parse_args(argv)
+    out = args.o if args.o else args.base + '.plog'
+
+    try:
+        ckpts = read_checkpoints(args.base)
+    except EnvironmentError:
+        print >>sys.stderr, "No checkpoint index for %s; record with -record-checkpoint-interval. Aborting." % args.base
+        sys.exit(1)
+    total = read_num_instructions(args.base)
+    segments = plan_segments(ckpts, total, args.j)
+    print "Replaying %s (%d instructions) in %d segments" % (args.base, total, len(segments))
+
+    procs = []
+    for (i, (start, end)) in enumerate(segments):
+        cmd = [args.qemu] + qemu_args + ['-replay', args.base,
+                '-pandalog', '%s.%d' % (out, i)]
+        if start > 0: cmd += ['-replay-start', str(start)]
+        if end is not None: cmd += ['-replay-end', str(end)]
+        log = open('%s.%d.out' % (out, i), 'w')
+        print "segment %d: [%d, %s)" % (i, start, end if end is not None else total)
+        procs.append((subprocess.Popen(cmd, stdout=log, stderr=subprocess.STDOUT), log))
+
+    failed = False
+    for (i, (p, log)) in enumerate(procs):
+        if p.wait() != 0:
+            print >>sys.stderr, "segment %d failed; see %s" % (i, log.name)
+            failed = True
+        log.close()
+    if failed:
+        sys.exit(1)
+
+    print "Merging pandalogs into %s" % out
+    chunk_size = [0]
+    dirents = []
+    with open(out, 'wb') as outf:
+        outf.write("\0" * PL_HEADER_SIZE)
+        for (i, (start, end)) in enumerate(segments):
+            seg = '%s.%d' % (out, i)
+            if os.path.exists(seg):
+                dirents += merge_segment(seg, start, end, outf, chunk_size)
+        if not dirents:
+            print >>sys.stderr, "No pandalog entries written by any segment."
+            sys.exit(1)
+        dir_pos = outf.tell()
+        outf.write(struct.pack("<I", len(dirents)))
+        for d in dirents:
+            outf.write(struct.pack("<QQQ", *d))
+        outf.seek(0)
+        outf.write(struct.pack(PL_HEADER_FMT, PL_CURRENT_VERSION, dir_pos, chunk_size[0], PL_CODEC_ZLIB))
+    for i in range(len(segments)):
+        seg = '%s.%d' % (out, i)
+        if os.path.exists(seg): os.remove(seg)
+
+if __name__ == '__main__':
+    main()
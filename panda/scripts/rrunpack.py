@@ -40,7 +40,8 @@ try:
             print "Success."
         f.seek(0x20)
         print "Unacking RR log %s with %d instructions..." % (infname, num_guest_insns),
-        subprocess.check_call(['tar', 'xJvf', '-'], stdin=f)
+        subprocess.check_call(['tar', '--use-compress-program', 'xz -T0',
+                               '-xvf', '-'], stdin=f)
         print "Done."
 except EnvironmentError:
     print >>sys.stderr, "Failed to open", infname
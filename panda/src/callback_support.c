@@ -8,6 +8,7 @@
 
 #include "panda/rr/rr_log.h"
 #include "exec/cpu-common.h"
+#include "exec/helper-proto.h"
 
 
 
@@ -15,9 +16,10 @@
 void panda_callbacks_before_dma(CPUState *cpu, hwaddr addr1, const uint8_t *buf, hwaddr l, int is_write) {
     if (rr_mode == RR_REPLAY) {
         panda_cb_list *plist;
-        for (plist = panda_cbs[PANDA_CB_REPLAY_BEFORE_DMA];
+        for (plist = panda_cb_list_first(PANDA_CB_REPLAY_BEFORE_DMA);
              plist != NULL; plist = panda_cb_list_next(plist)) {
-            plist->entry.replay_before_dma(cpu, is_write, (uint8_t *) buf, (uint64_t) addr1, l);
+            PANDA_CB_CALL(PANDA_CB_REPLAY_BEFORE_DMA, plist,
+                plist->entry.replay_before_dma(cpu, is_write, (uint8_t *) buf, (uint64_t) addr1, l));
         }
     }
 }
@@ -25,46 +27,127 @@ void panda_callbacks_before_dma(CPUState *cpu, hwaddr addr1, const uint8_t *buf,
 void panda_callbacks_after_dma(CPUState *cpu, hwaddr addr1, const uint8_t *buf, hwaddr l, int is_write) {
     if (rr_mode == RR_REPLAY) {
         panda_cb_list *plist;
-       for (plist = panda_cbs[PANDA_CB_REPLAY_AFTER_DMA];
+       for (plist = panda_cb_list_first(PANDA_CB_REPLAY_AFTER_DMA);
             plist != NULL; plist = panda_cb_list_next(plist)) {
-            plist->entry.replay_after_dma(cpu, is_write, (uint8_t *) buf, (uint64_t) addr1, l);
+            PANDA_CB_CALL(PANDA_CB_REPLAY_AFTER_DMA, plist,
+                plist->entry.replay_after_dma(cpu, is_write, (uint8_t *) buf, (uint64_t) addr1, l));
         }
     }
 }
 
+// Accesses waiting to be delivered to PANDA_CB_MEM_ACCESS_BATCH, one buffer
+// per CPU, allocated on first use.
+typedef struct panda_mem_batch {
+    size_t n;
+    panda_mem_access accesses[PANDA_MEM_BATCH_SIZE];
+} panda_mem_batch;
+
+static void panda_mem_batch_flush(CPUState *cpu) {
+    panda_mem_batch *batch = cpu->panda_mem_batch;
+    if (batch == NULL || batch->n == 0) {
+        return;
+    }
+    PANDA_CB_ARRAY_CALL(PANDA_CB_MEM_ACCESS_BATCH, mem_access_batch,
+                        cpu, batch->accesses, batch->n);
+    batch->n = 0;
+}
+
+static void panda_mem_batch_add(CPUState *cpu, target_ulong addr, hwaddr paddr,
+                                uint32_t size, uint64_t value, bool is_write) {
+    panda_mem_batch *batch = cpu->panda_mem_batch;
+    panda_mem_access *acc;
+    if (unlikely(batch == NULL)) {
+        batch = cpu->panda_mem_batch = g_new0(panda_mem_batch, 1);
+    }
+    acc = &batch->accesses[batch->n++];
+    acc->pc = cpu->panda_guest_pc;
+    acc->vaddr = addr;
+    acc->paddr = paddr;
+    acc->value = value;
+    acc->size = size;
+    acc->is_write = is_write;
+    if (batch->n == PANDA_MEM_BATCH_SIZE) {
+        panda_mem_batch_flush(cpu);
+    }
+}
+
+// whether tb's exec callbacks run.  chained TBs are entered without a
+// lookup, so an instrumented one can be reached from an address space
+// that isn't; that's checked here rather than trusting the tag.
+static inline bool panda_tb_instr(CPUState *cpu, TranslationBlock *tb) {
+    return !tb->panda_uninstr &&
+        (!panda_instr_selective || panda_instr_current(cpu));
+}
+
 // These are used in cpu-exec.c
 void panda_callbacks_before_block_exec(CPUState *cpu, TranslationBlock *tb) {
-    panda_cb_list *plist;
-    for (plist = panda_cbs[PANDA_CB_BEFORE_BLOCK_EXEC];
-         plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.before_block_exec(cpu, tb);
-    }
+    // a block that exited early (exception) didn't get to deliver its batch
+    panda_mem_batch_flush(cpu);
+    if (!panda_tb_instr(cpu, tb)) return;
+    PANDA_CB_ARRAY_CALL(PANDA_CB_BEFORE_BLOCK_EXEC, before_block_exec, cpu, tb);
 }
 
 
 void panda_callbacks_after_block_exec(CPUState *cpu, TranslationBlock *tb) {
-    panda_cb_list *plist;
-    for (plist = panda_cbs[PANDA_CB_AFTER_BLOCK_EXEC];
-         plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.after_block_exec(cpu, tb);
+    panda_mem_batch_flush(cpu);
+    if (!panda_tb_instr(cpu, tb)) return;
+    PANDA_CB_ARRAY_CALL(PANDA_CB_AFTER_BLOCK_EXEC, after_block_exec, cpu, tb);
+}
+
+
+bool panda_inline_block_exec(void) {
+    // LLVM code returns to cpu_exec() after every block anyway
+    return !generate_llvm &&
+        (panda_cb_arrays[PANDA_CB_BEFORE_BLOCK_EXEC].n ||
+         panda_cb_arrays[PANDA_CB_AFTER_BLOCK_EXEC].n);
+}
+
+// Called at the top of a panda_inline_exec TB.  A TB entered by a chained
+// jump from another one is also where that one is known to have finished,
+// so its after_block_exec callbacks run here; for the last TB before
+// returning to cpu_exec() they run in cpu_tb_exec().
+void helper_panda_block_exec(CPUArchState *env, void *opaque) {
+    CPUState *cpu = ENV_GET_CPU(env);
+    TranslationBlock *tb = opaque;
+    if (cpu->panda_exec_tb) {
+        panda_callbacks_after_block_exec(cpu, cpu->panda_exec_tb);
+    }
+    cpu->panda_exec_tb = tb;
+    panda_callbacks_before_block_exec(cpu, tb);
+}
+
+
+bool panda_callbacks_before_block_exec_skip_llvm(CPUState *cpu, TranslationBlock *tb) {
+    const panda_cb_array *arr = &panda_cb_arrays[PANDA_CB_BEFORE_BLOCK_EXEC_SKIP_LLVM];
+    bool skip = arr->n > 0 && !tb->panda_uninstr;
+    int i;
+    for (i = 0; i < arr->n && skip; i++) {
+        panda_cb_list *plist = arr->cbs[i];
+        PANDA_CB_CALL(PANDA_CB_BEFORE_BLOCK_EXEC_SKIP_LLVM, plist,
+            skip = plist->entry.before_block_exec_skip_llvm(cpu, tb));
     }
+    return skip;
 }
 
 
 void panda_callbacks_before_block_translate(CPUState *cpu, target_ulong pc) {
     panda_cb_list *plist;
-    for (plist = panda_cbs[PANDA_CB_BEFORE_BLOCK_TRANSLATE];
+    if (!panda_instr_enabled(cpu)) return;
+    for (plist = panda_cb_list_first(PANDA_CB_BEFORE_BLOCK_TRANSLATE);
          plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.before_block_translate(cpu, pc);
+        PANDA_CB_CALL(PANDA_CB_BEFORE_BLOCK_TRANSLATE, plist,
+            plist->entry.before_block_translate(cpu, pc));
     }
 }
 
 
 void panda_callbacks_after_block_translate(CPUState *cpu, TranslationBlock *tb) {
     panda_cb_list *plist;
-    for (plist = panda_cbs[PANDA_CB_AFTER_BLOCK_TRANSLATE];
+    if (tb->panda_uninstr) return;
+    for (plist = panda_cb_list_first(PANDA_CB_AFTER_BLOCK_TRANSLATE);
          plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.after_block_translate(cpu, tb);
+        PANDA_CB_CALL(PANDA_CB_AFTER_BLOCK_TRANSLATE, plist,
+            plist->entry.after_block_translate(cpu, tb));
     }
 }
 
@@ -79,6 +162,9 @@ void panda_before_find_fast(void) {
             }
         }
     }
+    if (unlikely(rr_get_guest_instr_count() >= panda_next_trigger_instr)) {
+        panda_run_plugin_triggers(rr_get_guest_instr_count());
+    }
     if (panda_flush_tb()) {
         tb_flush(first_cpu);
     }
@@ -88,11 +174,12 @@ void panda_before_find_fast(void) {
 bool panda_callbacks_after_find_fast(CPUState *cpu, TranslationBlock *tb, bool bb_invalidate_done) {
     panda_cb_list *plist;
     bool panda_invalidate_tb = false;
-    if (unlikely(!bb_invalidate_done)) {
-        for(plist = panda_cbs[PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT];
+    if (unlikely(!bb_invalidate_done) && !tb->panda_uninstr) {
+        for (plist = panda_cb_list_first(PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT);
             plist != NULL; plist = panda_cb_list_next(plist)) {
-            panda_invalidate_tb |=
-                plist->entry.before_block_exec_invalidate_opt(cpu, tb);
+            PANDA_CB_CALL(PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT, plist,
+                panda_invalidate_tb |=
+                    plist->entry.before_block_exec_invalidate_opt(cpu, tb));
         }
         return true;
     }
@@ -104,107 +191,132 @@ bool panda_callbacks_after_find_fast(CPUState *cpu, TranslationBlock *tb, bool b
 bool panda_callbacks_insn_translate(CPUState *env, target_ulong pc) {
     panda_cb_list *plist;
     bool panda_exec_cb = false;
-    for(plist = panda_cbs[PANDA_CB_INSN_TRANSLATE]; plist != NULL;
+    if (!panda_instr_enabled(env)) return false;
+    for (plist = panda_cb_list_first(PANDA_CB_INSN_TRANSLATE); plist != NULL;
         plist = panda_cb_list_next(plist)) {
-        panda_exec_cb |= plist->entry.insn_translate(env, pc);
+        PANDA_CB_CALL(PANDA_CB_INSN_TRANSLATE, plist,
+            panda_exec_cb |= plist->entry.insn_translate(env, pc));
     }
     return panda_exec_cb;
 }
 
+// *paddr starts out as -1 and is filled in by the first phys callback of an
+// access that needs it, so the before and after callbacks share one lookup.
 static inline hwaddr get_paddr(CPUState *cpu, target_ulong addr,
-                                     void *ram_ptr) {
-    hwaddr paddr;
-    if (!ram_ptr) {
-        return panda_virt_to_phys(cpu, addr);
+                               void *ram_ptr, hwaddr *paddr) {
+    if (*paddr != (hwaddr)-1) {
+        return *paddr;
     }
-
-    paddr = qemu_ram_addr_from_host(ram_ptr);
-    if (paddr == RAM_ADDR_INVALID) {
-        return panda_virt_to_phys(cpu, addr);
-    } else {
-        assert(paddr == panda_virt_to_phys(cpu, addr));
-        return paddr;
+    if (ram_ptr) {
+        *paddr = qemu_ram_addr_from_host(ram_ptr);
+    }
+    if (!ram_ptr || *paddr == RAM_ADDR_INVALID) {
+        *paddr = panda_virt_to_phys(cpu, addr);
     }
+    return *paddr;
 }
 
 // These are used in softmmu_template.h
 // ram_ptr is a possible pointer into host memory from the TLB code. Can be NULL.
 void panda_callbacks_before_mem_read(CPUState *env, target_ulong pc,
                                      target_ulong addr, uint32_t data_size,
-                                     void *ram_ptr) {
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_BEFORE_READ]; plist != NULL;
-        plist = panda_cb_list_next(plist)) {
-        plist->entry.virt_mem_before_read(env, env->panda_guest_pc, addr,
-                                          data_size);
-    }
-    if (panda_cbs[PANDA_CB_PHYS_MEM_BEFORE_READ]) {
-        hwaddr paddr = get_paddr(env, addr, ram_ptr);
-        for(plist = panda_cbs[PANDA_CB_PHYS_MEM_BEFORE_READ]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-            plist->entry.phys_mem_before_read(env, env->panda_guest_pc, paddr,
-                                              data_size);
-        }
+                                     void *ram_ptr, hwaddr *paddr) {
+    PANDA_CB_ARRAY_CALL(PANDA_CB_VIRT_MEM_BEFORE_READ, virt_mem_before_read,
+                        env, env->panda_guest_pc, addr, data_size);
+    if (panda_cb_arrays[PANDA_CB_PHYS_MEM_BEFORE_READ].n) {
+        get_paddr(env, addr, ram_ptr, paddr);
+        PANDA_CB_ARRAY_CALL(PANDA_CB_PHYS_MEM_BEFORE_READ, phys_mem_before_read,
+                            env, env->panda_guest_pc, *paddr, data_size);
     }
 }
 
 
 void panda_callbacks_after_mem_read(CPUState *env, target_ulong pc,
                                     target_ulong addr, uint32_t data_size,
-                                    uint64_t result, void *ram_ptr) {
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_AFTER_READ]; plist != NULL;
-        plist = panda_cb_list_next(plist)) {
-        plist->entry.virt_mem_after_read(env, env->panda_guest_pc, addr,
-                                         data_size, &result);
-    }
-    if (panda_cbs[PANDA_CB_PHYS_MEM_AFTER_READ]) {
-        hwaddr paddr = get_paddr(env, addr, ram_ptr);
-        for(plist = panda_cbs[PANDA_CB_PHYS_MEM_AFTER_READ]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-            plist->entry.phys_mem_after_read(env, env->panda_guest_pc, paddr,
-                                             data_size, &result);
-        }
+                                    uint64_t result, void *ram_ptr,
+                                    hwaddr *paddr) {
+    PANDA_CB_ARRAY_CALL(PANDA_CB_VIRT_MEM_AFTER_READ, virt_mem_after_read,
+                        env, env->panda_guest_pc, addr, data_size, &result);
+    if (panda_cb_arrays[PANDA_CB_PHYS_MEM_AFTER_READ].n) {
+        get_paddr(env, addr, ram_ptr, paddr);
+        PANDA_CB_ARRAY_CALL(PANDA_CB_PHYS_MEM_AFTER_READ, phys_mem_after_read,
+                            env, env->panda_guest_pc, *paddr, data_size, &result);
+    }
+    if (panda_cb_arrays[PANDA_CB_MEM_ACCESS_BATCH].n) {
+        panda_mem_batch_add(env, addr, get_paddr(env, addr, ram_ptr, paddr),
+                            data_size, result, false);
     }
 }
 
 
 void panda_callbacks_before_mem_write(CPUState *env, target_ulong pc,
                                       target_ulong addr, uint32_t data_size,
-                                      uint64_t val, void *ram_ptr) {
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_BEFORE_WRITE]; plist != NULL;
-        plist = panda_cb_list_next(plist)) {
-        plist->entry.virt_mem_before_write(env, env->panda_guest_pc, addr,
-                                           data_size, &val);
-    }
-    if (panda_cbs[PANDA_CB_PHYS_MEM_BEFORE_WRITE]) {
-        hwaddr paddr = get_paddr(env, addr, ram_ptr);
-        for(plist = panda_cbs[PANDA_CB_PHYS_MEM_BEFORE_WRITE]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-            plist->entry.phys_mem_before_write(env, env->panda_guest_pc, paddr,
-                                               data_size, &val);
-        }
+                                      uint64_t val, void *ram_ptr,
+                                      hwaddr *paddr) {
+    PANDA_CB_ARRAY_CALL(PANDA_CB_VIRT_MEM_BEFORE_WRITE, virt_mem_before_write,
+                        env, env->panda_guest_pc, addr, data_size, &val);
+    if (panda_cb_arrays[PANDA_CB_PHYS_MEM_BEFORE_WRITE].n) {
+        get_paddr(env, addr, ram_ptr, paddr);
+        PANDA_CB_ARRAY_CALL(PANDA_CB_PHYS_MEM_BEFORE_WRITE, phys_mem_before_write,
+                            env, env->panda_guest_pc, *paddr, data_size, &val);
     }
 }
 
 
 void panda_callbacks_after_mem_write(CPUState *env, target_ulong pc,
                                      target_ulong addr, uint32_t data_size,
-                                     uint64_t val, void *ram_ptr) {
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_AFTER_WRITE]; plist != NULL;
-        plist = panda_cb_list_next(plist)) {
-        plist->entry.virt_mem_after_write(env, env->panda_guest_pc, addr,
-                                          data_size, &val);
-    }
-    if (panda_cbs[PANDA_CB_PHYS_MEM_AFTER_WRITE]) {
-        hwaddr paddr = get_paddr(env, addr, ram_ptr);
-        for(plist = panda_cbs[PANDA_CB_PHYS_MEM_AFTER_WRITE]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-            plist->entry.phys_mem_after_write(env, env->panda_guest_pc, paddr,
-                                              data_size, &val);
+                                     uint64_t val, void *ram_ptr,
+                                     hwaddr *paddr) {
+    PANDA_CB_ARRAY_CALL(PANDA_CB_VIRT_MEM_AFTER_WRITE, virt_mem_after_write,
+                        env, env->panda_guest_pc, addr, data_size, &val);
+    if (panda_cb_arrays[PANDA_CB_PHYS_MEM_AFTER_WRITE].n) {
+        get_paddr(env, addr, ram_ptr, paddr);
+        PANDA_CB_ARRAY_CALL(PANDA_CB_PHYS_MEM_AFTER_WRITE, phys_mem_after_write,
+                            env, env->panda_guest_pc, *paddr, data_size, &val);
+    }
+    if (panda_cb_arrays[PANDA_CB_MEM_ACCESS_BATCH].n) {
+        panda_mem_batch_add(env, addr, get_paddr(env, addr, ram_ptr, paddr),
+                            data_size, val, true);
+    }
+}
+
+
+// These are used in cputlb.c and softmmu_template.h
+bool panda_callbacks_tlb_watch_page(CPUState *cpu, uint64_t ram_addr) {
+    const panda_cb_array *arr = &panda_cb_arrays[PANDA_CB_TLB_WATCH_PAGE];
+    bool watch = false;
+    int i;
+    for (i = 0; i < arr->n; i++) {
+        panda_cb_list *plist = arr->cbs[i];
+        PANDA_CB_CALL(PANDA_CB_TLB_WATCH_PAGE, plist,
+            watch |= plist->entry.tlb_watch_page(cpu, ram_addr));
+    }
+    return watch;
+}
+
+
+void panda_callbacks_tlb_watched_access(CPUState *cpu, target_ulong addr,
+                                        uint32_t size, bool is_write,
+                                        uintptr_t retaddr) {
+    const panda_cb_array *arr = &panda_cb_arrays[PANDA_CB_TLB_WATCHED_ACCESS];
+    bool restart = false;
+    int i;
+    for (i = 0; i < arr->n; i++) {
+        panda_cb_list *plist = arr->cbs[i];
+        PANDA_CB_CALL(PANDA_CB_TLB_WATCHED_ACCESS, plist,
+            restart |= plist->entry.tlb_watched_access(cpu, addr, size, is_write));
+    }
+    if (restart && retaddr && cpu_restore_state(cpu, retaddr)) {
+        // The instruction was counted as it started and will be again.  LLVM
+        // code always counts; of the TCG front ends only target-i386 does.
+#if defined(TARGET_I386)
+        if (execute_llvm || generate_llvm || rr_mode != RR_OFF) {
+#else
+        if (execute_llvm) {
+#endif
+            cpu->rr_guest_instr_count--;
         }
+        cpu_loop_exit_noexc(cpu);
     }
 }
 
@@ -212,25 +324,62 @@ void panda_callbacks_after_mem_write(CPUState *env, target_ulong pc,
 // target-i386/misc_helpers.c
 void panda_callbacks_cpuid(CPUState *env) {
     panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_GUEST_HYPERCALL]; plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.guest_hypercall(env);
+    for (plist = panda_cb_list_first(PANDA_CB_GUEST_HYPERCALL); plist != NULL; plist = panda_cb_list_next(plist)) {
+        PANDA_CB_CALL(PANDA_CB_GUEST_HYPERCALL, plist,
+            plist->entry.guest_hypercall(env));
     }
 }
 
 
 void panda_callbacks_cpu_restore_state(CPUState *env, TranslationBlock *tb) {
     panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_CPU_RESTORE_STATE]; plist != NULL;
+    for (plist = panda_cb_list_first(PANDA_CB_CPU_RESTORE_STATE); plist != NULL;
         plist = panda_cb_list_next(plist)) {
-        plist->entry.cb_cpu_restore_state(env, tb);
+        PANDA_CB_CALL(PANDA_CB_CPU_RESTORE_STATE, plist,
+            plist->entry.cb_cpu_restore_state(env, tb));
     }
 }
 
 
 void panda_callbacks_asid_changed(CPUState *env, target_ulong old_asid, target_ulong new_asid) {
     panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_ASID_CHANGED]; plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.asid_changed(env, old_asid, new_asid);
+    for (plist = panda_cb_list_first(PANDA_CB_ASID_CHANGED); plist != NULL; plist = panda_cb_list_next(plist)) {
+        PANDA_CB_CALL(PANDA_CB_ASID_CHANGED, plist,
+            plist->entry.asid_changed(env, old_asid, new_asid));
+    }
+}
+
+
+// rr_log.c
+void panda_callbacks_replay_handle_packet(CPUState *env, uint8_t *buf, int size,
+                                          uint8_t direction, uint64_t old_buf_addr) {
+    panda_cb_list *plist;
+    for (plist = panda_cb_list_first(PANDA_CB_REPLAY_HANDLE_PACKET); plist != NULL;
+         plist = panda_cb_list_next(plist)) {
+        PANDA_CB_CALL(PANDA_CB_REPLAY_HANDLE_PACKET, plist,
+            plist->entry.replay_handle_packet(env, buf, size, direction, old_buf_addr));
+    }
+}
+
+
+void panda_callbacks_replay_hd_transfer(CPUState *env, uint32_t type, uint64_t src_addr,
+                                        uint64_t dest_addr, uint32_t num_bytes) {
+    panda_cb_list *plist;
+    for (plist = panda_cb_list_first(PANDA_CB_REPLAY_HD_TRANSFER); plist != NULL;
+         plist = panda_cb_list_next(plist)) {
+        PANDA_CB_CALL(PANDA_CB_REPLAY_HD_TRANSFER, plist,
+            plist->entry.replay_hd_transfer(env, type, src_addr, dest_addr, num_bytes));
+    }
+}
+
+
+void panda_callbacks_replay_net_transfer(CPUState *env, uint32_t type, uint64_t src_addr,
+                                         uint64_t dest_addr, uint32_t num_bytes) {
+    panda_cb_list *plist;
+    for (plist = panda_cb_list_first(PANDA_CB_REPLAY_NET_TRANSFER); plist != NULL;
+         plist = panda_cb_list_next(plist)) {
+        PANDA_CB_CALL(PANDA_CB_REPLAY_NET_TRANSFER, plist,
+            plist->entry.replay_net_transfer(env, type, src_addr, dest_addr, num_bytes));
     }
 }
 
@@ -22,6 +22,7 @@ PANDAENDCOMMENT */
 #include "qapi/error.h"
 
 #include "monitor/monitor.h"
+#include "qemu/timer.h"
 
 #include <libgen.h>
 
@@ -43,6 +44,7 @@ PANDAENDCOMMENT */
 
 // Array of pointers to PANDA callback lists, one per callback type
 panda_cb_list *panda_cbs[PANDA_CB_LAST];
+panda_cb_array panda_cb_arrays[PANDA_CB_LAST];
 
 // Storage for command line options
 char panda_argv[MAX_PANDA_PLUGIN_ARGS][256];
@@ -62,6 +64,98 @@ bool panda_please_flush_tb = false;
 bool panda_update_pc = false;
 bool panda_use_memcb = false;
 bool panda_tb_chaining = true;
+bool panda_tb_asid = false;
+
+// Analysis window.  While the plugins are dormant no callbacks run, except
+// those of plugins that asked to stay awake, and the memory callback,
+// precise pc and LLVM settings they asked for are held back until they wake.
+bool panda_plugins_dormant = false;
+static void *panda_awake_plugins[MAX_PANDA_PLUGINS];
+static int panda_nb_awake_plugins;
+static bool panda_dormant_memcb;
+static bool panda_dormant_precise_pc;
+#ifdef CONFIG_LLVM
+static int panda_dormant_execute_llvm;
+static int panda_dormant_generate_llvm;
+#endif
+
+// Instruction-count triggers, sorted by instr; a NULL plugin stands for
+// the whole plugin set.
+typedef struct panda_plugin_trigger {
+    uint64_t instr;
+    void *plugin;
+    bool enable;
+} panda_plugin_trigger;
+#define PANDA_MAX_PLUGIN_TRIGGERS (2 * MAX_PANDA_PLUGINS + 2)
+static panda_plugin_trigger panda_triggers[PANDA_MAX_PLUGIN_TRIGGERS];
+static int panda_nb_triggers;
+uint64_t panda_next_trigger_instr = UINT64_MAX;
+
+bool panda_instr_selective = false;
+static bool panda_instr_kernel = true;
+static target_ulong panda_instr_asids[PANDA_MAX_INSTR_ASIDS];
+static int panda_instr_nb_asids;
+
+bool panda_cb_profiling = false;
+uint64_t panda_cb_type_ns[PANDA_CB_LAST];
+
+int64_t panda_cb_profile_clock(void) {
+    return get_clock();
+}
+
+static const char *panda_cb_type_names[PANDA_CB_LAST] = {
+    [PANDA_CB_BEFORE_BLOCK_TRANSLATE] = "before_block_translate",
+    [PANDA_CB_AFTER_BLOCK_TRANSLATE] = "after_block_translate",
+    [PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT] = "before_block_exec_invalidate_opt",
+    [PANDA_CB_BEFORE_BLOCK_EXEC] = "before_block_exec",
+    [PANDA_CB_AFTER_BLOCK_EXEC] = "after_block_exec",
+    [PANDA_CB_INSN_TRANSLATE] = "insn_translate",
+    [PANDA_CB_INSN_EXEC] = "insn_exec",
+    [PANDA_CB_VIRT_MEM_READ] = "virt_mem_read",
+    [PANDA_CB_VIRT_MEM_WRITE] = "virt_mem_write",
+    [PANDA_CB_PHYS_MEM_READ] = "phys_mem_read",
+    [PANDA_CB_PHYS_MEM_WRITE] = "phys_mem_write",
+    [PANDA_CB_VIRT_MEM_BEFORE_READ] = "virt_mem_before_read",
+    [PANDA_CB_VIRT_MEM_BEFORE_WRITE] = "virt_mem_before_write",
+    [PANDA_CB_PHYS_MEM_BEFORE_READ] = "phys_mem_before_read",
+    [PANDA_CB_PHYS_MEM_BEFORE_WRITE] = "phys_mem_before_write",
+    [PANDA_CB_VIRT_MEM_AFTER_READ] = "virt_mem_after_read",
+    [PANDA_CB_VIRT_MEM_AFTER_WRITE] = "virt_mem_after_write",
+    [PANDA_CB_PHYS_MEM_AFTER_READ] = "phys_mem_after_read",
+    [PANDA_CB_PHYS_MEM_AFTER_WRITE] = "phys_mem_after_write",
+    [PANDA_CB_HD_READ] = "hd_read",
+    [PANDA_CB_HD_WRITE] = "hd_write",
+    [PANDA_CB_GUEST_HYPERCALL] = "guest_hypercall",
+    [PANDA_CB_MONITOR] = "monitor",
+    [PANDA_CB_CPU_RESTORE_STATE] = "cpu_restore_state",
+    [PANDA_CB_BEFORE_REPLAY_LOADVM] = "before_replay_loadvm",
+#ifndef CONFIG_SOFTMMU
+    [PANDA_CB_USER_BEFORE_SYSCALL] = "user_before_syscall",
+    [PANDA_CB_USER_AFTER_SYSCALL] = "user_after_syscall",
+#endif
+#ifdef CONFIG_PANDA_VMI
+    [PANDA_CB_VMI_AFTER_FORK] = "vmi_after_fork",
+    [PANDA_CB_VMI_AFTER_EXEC] = "vmi_after_exec",
+    [PANDA_CB_VMI_AFTER_CLONE] = "vmi_after_clone",
+#endif
+    [PANDA_CB_ASID_CHANGED] = "asid_changed",
+    [PANDA_CB_REPLAY_HD_TRANSFER] = "replay_hd_transfer",
+    [PANDA_CB_REPLAY_NET_TRANSFER] = "replay_net_transfer",
+    [PANDA_CB_REPLAY_BEFORE_DMA] = "replay_before_dma",
+    [PANDA_CB_REPLAY_AFTER_DMA] = "replay_after_dma",
+    [PANDA_CB_REPLAY_HANDLE_PACKET] = "replay_handle_packet",
+    [PANDA_CB_MEM_ACCESS_BATCH] = "mem_access_batch",
+    [PANDA_CB_BEFORE_BLOCK_EXEC_SKIP_LLVM] = "before_block_exec_skip_llvm",
+    [PANDA_CB_TLB_WATCH_PAGE] = "tlb_watch_page",
+    [PANDA_CB_TLB_WATCHED_ACCESS] = "tlb_watched_access",
+};
+
+const char *panda_cb_type_name(panda_cb_type type) {
+    if (type < PANDA_CB_LAST && panda_cb_type_names[type]) {
+        return panda_cb_type_names[type];
+    }
+    return "unknown";
+}
 
 
 
@@ -145,6 +239,43 @@ void panda_require(const char *plugin_name) {
     }
 }
 
+// Load a plugin list in the form -panda takes, "name:arg=val,...;name2",
+// right away instead of after machine setup.  Returns false if any of the
+// plugins fails to load.
+bool panda_load_plugin_list(const char *list) {
+    char **specs = g_strsplit(list, ";", -1);
+    char **spec;
+    bool ok = true;
+
+    for (spec = specs; *spec != NULL; spec++) {
+        char *name = g_strstrip(*spec);
+        char *opts = strchr(name, ':');
+
+        if (opts != NULL) {
+            char **args = g_strsplit(opts + 1, ",", -1);
+            char **arg;
+            *opts = '\0';
+            for (arg = args; *arg != NULL; arg++) {
+                char *arg_str = g_strdup_printf("%s:%s", name, *arg);
+                if (!panda_add_arg(arg_str, strlen(arg_str))) {
+                    fprintf(stderr, "WARN: Couldn't add PANDA arg '%s': "
+                            "argument too long,\n", arg_str);
+                }
+                g_free(arg_str);
+            }
+            g_strfreev(args);
+        }
+        // "general" only collects general panda args
+        if (name[0] != '\0' && strcmp(name, "general") != 0) {
+            char *plugin_path = panda_plugin_path(name);
+            ok = panda_load_plugin(plugin_path) && ok;
+            g_free(plugin_path);
+        }
+    }
+    g_strfreev(specs);
+    return ok;
+}
+
     
 
 // Internal: remove a plugin from the global array
@@ -155,6 +286,74 @@ static void panda_delete_plugin(int i) {
     nb_panda_plugins--;
 }
 
+// Per-callback-type totals for one plugin, summed over its panda_cb_list
+// entries.  Returns the plugin's total time.
+static uint64_t panda_plugin_profile(void *plugin, uint64_t *calls, uint64_t *ns) {
+    uint64_t total = 0;
+    int i;
+    for (i = 0; i < PANDA_CB_LAST; i++) {
+        panda_cb_list *plist;
+        calls[i] = ns[i] = 0;
+        for (plist = panda_cbs[i]; plist != NULL; plist = plist->next) {
+            if (plist->owner == plugin) {
+                calls[i] += plist->prof_calls;
+                ns[i] += plist->prof_ns;
+            }
+        }
+        total += ns[i];
+    }
+    return total;
+}
+
+// caller frees the returned string
+static char *panda_plugin_profile_str(int plugin_idx) {
+    uint64_t calls[PANDA_CB_LAST], ns[PANDA_CB_LAST];
+    uint64_t total;
+    GString *str = g_string_new(NULL);
+    int i;
+    total = panda_plugin_profile(panda_plugins[plugin_idx].plugin, calls, ns);
+    g_string_append_printf(str, "%s: %.3f seconds in callbacks\n",
+                           panda_plugins[plugin_idx].name, total / 1e9);
+    for (i = 0; i < PANDA_CB_LAST; i++) {
+        if (calls[i] == 0) continue;
+        g_string_append_printf(str, "    %-32s %12" PRIu64 " calls %10.3f seconds %8.1f ns/call\n",
+                               panda_cb_type_name(i), calls[i], ns[i] / 1e9,
+                               (double) ns[i] / calls[i]);
+    }
+    return g_string_free(str, false);
+}
+
+struct RrPluginStatsList *panda_plugin_profile_stats(void) {
+    RrPluginStatsList *head = NULL, **tail = &head;
+    uint64_t calls[PANDA_CB_LAST], ns[PANDA_CB_LAST];
+    int p, i;
+    if (!panda_cb_profiling) {
+        return NULL;
+    }
+    for (p = 0; p < nb_panda_plugins; p++) {
+        RrPluginStatsList *e = g_new0(RrPluginStatsList, 1);
+        RrPluginCallbackStatsList **cbs;
+        e->value = g_new0(RrPluginStats, 1);
+        e->value->name = g_strdup(panda_plugins[p].name);
+        e->value->ns = panda_plugin_profile(panda_plugins[p].plugin, calls, ns);
+        cbs = &e->value->callbacks;
+        for (i = 0; i < PANDA_CB_LAST; i++) {
+            RrPluginCallbackStatsList *c;
+            if (calls[i] == 0) continue;
+            c = g_new0(RrPluginCallbackStatsList, 1);
+            c->value = g_new0(RrPluginCallbackStats, 1);
+            c->value->type = g_strdup(panda_cb_type_name(i));
+            c->value->calls = calls[i];
+            c->value->ns = ns[i];
+            *cbs = c;
+            cbs = &c->next;
+        }
+        *tail = e;
+        tail = &e->next;
+    }
+    return head;
+}
+
 void panda_do_unload_plugin(int plugin_idx){
     void *plugin = panda_plugins[plugin_idx].plugin;
     void (*uninit_fn)(void *) = dlsym(plugin, "uninit_plugin");
@@ -164,6 +363,13 @@ void panda_do_unload_plugin(int plugin_idx){
     else {
         uninit_fn(plugin);
     }
+    // the counters live in the callback list entries, so report before
+    // they go away
+    if (panda_cb_profiling) {
+        char *prof = panda_plugin_profile_str(plugin_idx);
+        fputs(prof, stderr);
+        g_free(prof);
+    }
     panda_unregister_callbacks(plugin);
     panda_delete_plugin(plugin_idx);
     dlclose(plugin);
@@ -204,6 +410,69 @@ void * panda_get_plugin_by_name(const char *plugin_name) {
     return NULL;
 }
 
+static bool panda_plugin_awake(void *plugin) {
+    int i;
+    for (i = 0; i < panda_nb_awake_plugins; i++) {
+        if (panda_awake_plugins[i] == plugin) return true;
+    }
+    return false;
+}
+
+// whether plist gets called
+static void panda_memcb_filter_update(void);
+
+static inline bool panda_cb_live(panda_cb_list *plist) {
+    return plist->enabled &&
+        (!panda_plugins_dormant || panda_plugin_awake(plist->owner));
+}
+
+// Rewrites each array in place, so a callback that registers or disables
+// callbacks doesn't pull the array out from under the loop that called it.
+// Arrays only grow, and a grown array's old storage is deliberately not freed
+// for the same reason.
+static void panda_cb_arrays_rebuild(void) {
+    bool block_exec = panda_cb_arrays[PANDA_CB_BEFORE_BLOCK_EXEC].n ||
+                      panda_cb_arrays[PANDA_CB_AFTER_BLOCK_EXEC].n;
+    int i;
+    for (i = 0; i < PANDA_CB_LAST; i++) {
+        panda_cb_array *arr = &panda_cb_arrays[i];
+        panda_cb_list *plist;
+        int n = 0;
+        for (plist = panda_cbs[i]; plist != NULL; plist = plist->next) {
+            if (panda_cb_live(plist)) n++;
+        }
+        if (n > arr->cap) {
+            panda_cb_list **cbs = g_new0(panda_cb_list *, n);
+            if (arr->n > 0) {
+                memcpy(cbs, arr->cbs, arr->n * sizeof(*cbs));
+            }
+            arr->cbs = cbs;
+            arr->cap = n;
+        }
+        n = 0;
+        for (plist = panda_cbs[i]; plist != NULL; plist = plist->next) {
+            if (panda_cb_live(plist)) arr->cbs[n++] = plist;
+        }
+        arr->n = n;
+    }
+    // TBs translated without them don't call them from their code, and
+    // could be reached by chained jumps without seeing them
+    if (!block_exec && (panda_cb_arrays[PANDA_CB_BEFORE_BLOCK_EXEC].n ||
+                        panda_cb_arrays[PANDA_CB_AFTER_BLOCK_EXEC].n)) {
+        panda_do_flush_tb();
+    }
+    panda_memcb_filter_update();
+}
+
+static int panda_tb_data_slots_used = 0;
+
+int panda_tb_data_slot_alloc(void) {
+    if (panda_tb_data_slots_used >= PANDA_TB_DATA_SLOTS) {
+        return -1;
+    }
+    return panda_tb_data_slots_used++;
+}
+
 void panda_register_callback(void *plugin, panda_cb_type type, panda_cb cb) {
     panda_cb_list *new_list = g_new0(panda_cb_list,1);
     new_list->entry = cb;
@@ -216,6 +485,7 @@ void panda_register_callback(void *plugin, panda_cb_type type, panda_cb cb) {
         panda_cbs[type]->prev = new_list;
     }
     panda_cbs[type] = new_list;
+    panda_cb_arrays_rebuild();
 }
 
 
@@ -273,6 +543,8 @@ void panda_unregister_callbacks(void *plugin) {
         // update head
         panda_cbs[i] = plist_head;
     }
+    panda_memcb_filter_clear(plugin);
+    panda_cb_arrays_rebuild();
     //  printf ("panda_unregister_callbacks(%x) exit\n", plugin);  spit_cbs();  printf ("\n\n");
 }
 
@@ -288,6 +560,7 @@ void panda_enable_plugin(void *plugin) {
             plist = plist->next;
         }
     }
+    panda_cb_arrays_rebuild();
 }
 
 void panda_disable_plugin(void *plugin) {
@@ -302,20 +575,121 @@ void panda_disable_plugin(void *plugin) {
             plist = plist->next;
         }
     }
+    panda_cb_arrays_rebuild();
 }
 
-panda_cb_list* panda_cb_list_next(panda_cb_list* plist) {
-    // Allows to navigate the callback linked list skipping disabled callbacks
-    panda_cb_list* node = plist->next;
-    if (node == NULL) {
-        return node;
+// Add a trigger, keeping the list sorted.  Triggers for the same instr
+// run in the order they were added.
+static void panda_add_trigger(void *plugin, uint64_t instr, bool enable) {
+    int i;
+    if (panda_nb_triggers == PANDA_MAX_PLUGIN_TRIGGERS) {
+        fprintf(stderr, "PANDA: too many plugin triggers, ignoring the one "
+                "at instr %" PRIu64 "\n", instr);
+        return;
+    }
+    for (i = panda_nb_triggers; i > 0 && panda_triggers[i - 1].instr > instr; i--) {
+        panda_triggers[i] = panda_triggers[i - 1];
     }
+    panda_triggers[i].instr = instr;
+    panda_triggers[i].plugin = plugin;
+    panda_triggers[i].enable = enable;
+    panda_nb_triggers++;
+    panda_next_trigger_instr = panda_triggers[0].instr;
+}
+
+void panda_enable_plugin_at(void *plugin, uint64_t instr) {
+    panda_add_trigger(plugin, instr, true);
+}
+
+void panda_disable_plugin_at(void *plugin, uint64_t instr) {
+    panda_add_trigger(plugin, instr, false);
+}
+
+void panda_run_plugin_triggers(uint64_t instr) {
+    int i, n = 0;
+    while (n < panda_nb_triggers && panda_triggers[n].instr <= instr) {
+        n++;
+    }
+    // consume them first: a plugin being woken may add triggers of its own
+    panda_plugin_trigger due[PANDA_MAX_PLUGIN_TRIGGERS];
+    memcpy(due, panda_triggers, n * sizeof(*due));
+    memmove(panda_triggers, panda_triggers + n,
+            (panda_nb_triggers - n) * sizeof(*panda_triggers));
+    panda_nb_triggers -= n;
+    panda_next_trigger_instr =
+        panda_nb_triggers ? panda_triggers[0].instr : UINT64_MAX;
+
+    for (i = 0; i < n; i++) {
+        if (due[i].plugin == NULL) {
+            if (due[i].enable) {
+                panda_wake_plugins();
+            } else {
+                panda_sleep_plugins();
+            }
+        } else {
+            if (due[i].enable) {
+                panda_enable_plugin(due[i].plugin);
+            } else {
+                panda_disable_plugin(due[i].plugin);
+            }
+            // translate time callbacks have to see the code again
+            panda_do_flush_tb();
+        }
+    }
+}
+
+void panda_stay_awake(void *plugin) {
+    if (panda_plugin_awake(plugin)) return;
+    assert(panda_nb_awake_plugins < MAX_PANDA_PLUGINS);
+    panda_awake_plugins[panda_nb_awake_plugins++] = plugin;
+    panda_cb_arrays_rebuild();
+}
+
+void panda_sleep_plugins(void) {
+    if (panda_plugins_dormant) return;
+    panda_plugins_dormant = true;
+    panda_dormant_memcb = panda_use_memcb;
+    panda_dormant_precise_pc = panda_update_pc;
+    panda_use_memcb = false;
+    panda_update_pc = false;
+#ifdef CONFIG_LLVM
+    panda_dormant_execute_llvm = execute_llvm;
+    panda_dormant_generate_llvm = generate_llvm;
+    execute_llvm = 0;
+    generate_llvm = 0;
+#endif
+    panda_cb_arrays_rebuild();
+    panda_do_flush_tb();
+}
+
+void panda_wake_plugins(void) {
+    if (!panda_plugins_dormant) return;
+    panda_plugins_dormant = false;
+    panda_use_memcb = panda_dormant_memcb;
+    panda_update_pc = panda_dormant_precise_pc;
+#ifdef CONFIG_LLVM
+    execute_llvm = panda_dormant_execute_llvm;
+    generate_llvm = panda_dormant_generate_llvm;
+#endif
+    panda_cb_arrays_rebuild();
+    panda_do_flush_tb();
+}
 
-    if (node->enabled) {
+panda_cb_list* panda_cb_list_first(panda_cb_type type) {
+    panda_cb_list* node = panda_cbs[type];
+    if (node == NULL || panda_cb_live(node)) {
         return node;
-    } else {
-        return panda_cb_list_next(node);
     }
+    return panda_cb_list_next(node);
+}
+
+panda_cb_list* panda_cb_list_next(panda_cb_list* plist) {
+    // Allows to navigate the callback linked list skipping disabled callbacks
+    panda_cb_list* node = plist->next;
+    while (node != NULL && !panda_cb_live(node)) {
+        node = node->next;
+    }
+    return node;
 }
 
 bool panda_flush_tb(void) {
@@ -330,20 +704,254 @@ void panda_do_flush_tb(void) {
     panda_please_flush_tb = true;
 }
 
+static bool tb_in_pc_range(TranslationBlock *tb, void *opaque) {
+    target_ulong *range = (target_ulong *) opaque;
+    return tb->pc < range[1] && tb->pc + tb->size > range[0];
+}
+
+int panda_invalidate_tb_range(target_ulong start, target_ulong end) {
+    target_ulong range[2] = { start, end };
+    return tb_invalidate_matching(tb_in_pc_range, range);
+}
+
+static bool tb_in_asid(TranslationBlock *tb, void *opaque) {
+    return tb->asid == *(target_ulong *) opaque;
+}
+
+int panda_invalidate_tb_asid(target_ulong asid) {
+    assert(panda_tb_asid);
+    return tb_invalidate_matching(tb_in_asid, &asid);
+}
+
+void panda_enable_tb_asid(void) {
+    panda_tb_asid = true;
+}
+
+bool panda_instr_current(CPUState *cpu) {
+    int i;
+    if (!panda_instr_kernel && panda_in_kernel(cpu)) return false;
+    target_ulong asid = panda_current_asid(cpu);
+    for (i = 0; i < panda_instr_nb_asids; i++) {
+        if (panda_instr_asids[i] == asid) return true;
+    }
+    return false;
+}
+
+void panda_instrument_asid(target_ulong asid, bool on) {
+    int i;
+    for (i = 0; i < panda_instr_nb_asids; i++) {
+        if (panda_instr_asids[i] == asid) break;
+    }
+    if (on == (i < panda_instr_nb_asids)) return;
+    if (on) {
+        assert(panda_instr_nb_asids < PANDA_MAX_INSTR_ASIDS);
+        panda_instr_asids[panda_instr_nb_asids++] = asid;
+    } else {
+        panda_instr_asids[i] = panda_instr_asids[--panda_instr_nb_asids];
+    }
+    if (!panda_instr_selective) {
+        // everything so far was translated instrumented
+        panda_instr_selective = true;
+        panda_tb_asid = true;
+        panda_do_flush_tb();
+        return;
+    }
+    // lookups already ask for the other kind of TB for this asid; dropping
+    // the old ones unchains them, so nothing jumps straight into them
+    panda_invalidate_tb_asid(asid);
+}
+
+void panda_instrument_kernel(bool on) {
+    if (on == panda_instr_kernel) return;
+    panda_instr_kernel = on;
+    if (panda_instr_selective) panda_do_flush_tb();
+}
+
+void panda_instrument_all(void) {
+    if (!panda_instr_selective) return;
+    panda_instr_selective = false;
+    panda_instr_nb_asids = 0;
+    panda_do_flush_tb();
+}
+
 void panda_enable_precise_pc(void) {
-    panda_update_pc = true;
+    if (panda_plugins_dormant) {
+        panda_dormant_precise_pc = true;
+    } else {
+        panda_update_pc = true;
+    }
 }
 
 void panda_disable_precise_pc(void) {
-    panda_update_pc = false;
+    if (panda_plugins_dormant) {
+        panda_dormant_precise_pc = false;
+    } else {
+        panda_update_pc = false;
+    }
 }
 
 void panda_enable_memcb(void) {
-    panda_use_memcb = true;
+    if (panda_plugins_dormant) {
+        panda_dormant_memcb = true;
+    } else {
+        panda_use_memcb = true;
+    }
 }
 
 void panda_disable_memcb(void) {
-    panda_use_memcb = false;
+    if (panda_plugins_dormant) {
+        panda_dormant_memcb = false;
+    } else {
+        panda_use_memcb = false;
+    }
+}
+
+// Memory callback filters, one per plugin that has added to it.  An empty
+// list of ranges or ASIDs doesn't restrict.
+typedef struct {
+    uint64_t start;
+    uint64_t end;       // exclusive
+} panda_memcb_range;
+
+typedef struct {
+    void *owner;
+    GArray *ranges;     // of panda_memcb_range
+    GArray *asids;      // of target_ulong
+} panda_memcb_filter;
+
+static GPtrArray *panda_memcb_filters;
+bool panda_memcb_filtered = false;
+
+static panda_memcb_filter *panda_memcb_filter_find(void *plugin) {
+    guint i;
+    if (panda_memcb_filters == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < panda_memcb_filters->len; i++) {
+        panda_memcb_filter *f = g_ptr_array_index(panda_memcb_filters, i);
+        if (f->owner == plugin) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+static panda_memcb_filter *panda_memcb_filter_get(void *plugin) {
+    panda_memcb_filter *f = panda_memcb_filter_find(plugin);
+    if (f == NULL) {
+        if (panda_memcb_filters == NULL) {
+            panda_memcb_filters = g_ptr_array_new();
+        }
+        f = g_new0(panda_memcb_filter, 1);
+        f->owner = plugin;
+        f->ranges = g_array_new(FALSE, FALSE, sizeof(panda_memcb_range));
+        f->asids = g_array_new(FALSE, FALSE, sizeof(target_ulong));
+        g_ptr_array_add(panda_memcb_filters, f);
+    }
+    return f;
+}
+
+// Filtering is only safe while every plugin that would be called has asked
+// for it
+static void panda_memcb_filter_update(void) {
+    bool any = false;
+    int type, i;
+
+    for (type = PANDA_CB_VIRT_MEM_READ; type <= PANDA_CB_PHYS_MEM_AFTER_WRITE;
+         type++) {
+        const panda_cb_array *arr = &panda_cb_arrays[type];
+        for (i = 0; i < arr->n; i++) {
+            if (!panda_memcb_filter_find(arr->cbs[i]->owner)) {
+                panda_memcb_filtered = false;
+                return;
+            }
+            any = true;
+        }
+    }
+    for (i = 0; i < panda_cb_arrays[PANDA_CB_MEM_ACCESS_BATCH].n; i++) {
+        if (!panda_memcb_filter_find(
+                panda_cb_arrays[PANDA_CB_MEM_ACCESS_BATCH].cbs[i]->owner)) {
+            panda_memcb_filtered = false;
+            return;
+        }
+        any = true;
+    }
+    panda_memcb_filtered = any;
+}
+
+// TLB entries hold the outcome of panda_memcb_filter_match() for their page
+static void panda_memcb_filter_changed(void) {
+    CPUState *cpu;
+    CPU_FOREACH(cpu) {
+        tlb_flush(cpu, 1);
+    }
+    panda_memcb_filter_update();
+}
+
+void panda_memcb_filter_add_range(void *plugin, uint64_t start, uint64_t len) {
+    panda_memcb_range r = { start, start + len };
+    if (len == 0) {
+        return;
+    }
+    g_array_append_val(panda_memcb_filter_get(plugin)->ranges, r);
+    panda_memcb_filter_changed();
+}
+
+void panda_memcb_filter_add_asid(void *plugin, target_ulong asid) {
+    g_array_append_val(panda_memcb_filter_get(plugin)->asids, asid);
+    panda_memcb_filter_changed();
+}
+
+void panda_memcb_filter_clear(void *plugin) {
+    panda_memcb_filter *f = panda_memcb_filter_find(plugin);
+    if (f == NULL) {
+        return;
+    }
+    g_ptr_array_remove(panda_memcb_filters, f);
+    g_array_free(f->ranges, TRUE);
+    g_array_free(f->asids, TRUE);
+    g_free(f);
+    panda_memcb_filter_changed();
+}
+
+bool panda_memcb_filter_match(CPUState *cpu, hwaddr paddr) {
+    hwaddr page = paddr & TARGET_PAGE_MASK;
+    target_ulong asid = 0;
+    bool have_asid = false;
+    guint i, j;
+
+    if (panda_memcb_filters == NULL) {
+        return false;
+    }
+    for (i = 0; i < panda_memcb_filters->len; i++) {
+        panda_memcb_filter *f = g_ptr_array_index(panda_memcb_filters, i);
+        bool match = f->ranges->len == 0;
+        for (j = 0; !match && j < f->ranges->len; j++) {
+            panda_memcb_range *r = &g_array_index(f->ranges,
+                                                  panda_memcb_range, j);
+            match = r->start < page + TARGET_PAGE_SIZE && page < r->end;
+        }
+        if (match && f->asids->len > 0) {
+            if (!have_asid) {
+                asid = panda_current_asid(cpu);
+                have_asid = true;
+            }
+            match = false;
+            for (j = 0; !match && j < f->asids->len; j++) {
+                match = g_array_index(f->asids, target_ulong, j) == asid;
+            }
+        }
+        if (match) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool panda_memcb_filter_vaddr(CPUState *cpu, target_ulong addr) {
+    hwaddr paddr = panda_virt_to_phys(cpu, addr);
+    // unmapped: the access is going to fault, let the callbacks see it
+    return paddr == -1 || panda_memcb_filter_match(cpu, paddr);
 }
 
 void panda_enable_tb_chaining(void){
@@ -357,8 +965,13 @@ void panda_disable_tb_chaining(void){
 #ifdef CONFIG_LLVM
 void panda_enable_llvm(void){
     panda_do_flush_tb();
-    execute_llvm = 1;
-    generate_llvm = 1;
+    if (panda_plugins_dormant) {
+        panda_dormant_execute_llvm = 1;
+        panda_dormant_generate_llvm = 1;
+    } else {
+        execute_llvm = 1;
+        generate_llvm = 1;
+    }
     tcg_llvm_ctx = tcg_llvm_initialize();
 }
 
@@ -367,6 +980,8 @@ extern CPUState *env;
 void panda_disable_llvm(void){
     execute_llvm = 0;
     generate_llvm = 0;
+    panda_dormant_execute_llvm = 0;
+    panda_dormant_generate_llvm = 0;
     tcg_llvm_destroy();
     tcg_llvm_ctx = NULL;
 }
@@ -649,14 +1264,22 @@ void hmp_panda_list_plugins(Monitor *mon, const QDict *qdict) {
     for (i = 0; i < nb_panda_plugins; i++) {
         monitor_printf(mon, "%d\t%-20s\t%p\n", i, panda_plugins[i].name, panda_plugins[i].plugin);
     }
+    if (panda_cb_profiling) {
+        for (i = 0; i < nb_panda_plugins; i++) {
+            char *prof = panda_plugin_profile_str(i);
+            monitor_printf(mon, "%s", prof);
+            g_free(prof);
+        }
+    }
     qmp_list_plugins(&err);
 }
 
 void hmp_panda_plugin_cmd(Monitor *mon, const QDict *qdict) {
     panda_cb_list *plist;
     const char *cmd = qdict_get_try_str(qdict, "cmd");
-    for(plist = panda_cbs[PANDA_CB_MONITOR]; plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.monitor(mon, cmd);
+    for (plist = panda_cb_list_first(PANDA_CB_MONITOR); plist != NULL; plist = panda_cb_list_next(plist)) {
+        PANDA_CB_CALL(PANDA_CB_MONITOR, plist,
+            plist->entry.monitor(mon, cmd));
     }
 }
 
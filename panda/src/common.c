@@ -1,10 +1,12 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "panda/plugin.h"
 #include "panda/common.h"
 #include "panda/plog.h"
+#include "sysemu/block-backend.h"
 
 target_ulong panda_current_pc(CPUState *cpu) {
     target_ulong pc, cs_base;
@@ -93,6 +95,8 @@ bool arm_get_vaddr_table(CPUState *cpu, uint32_t *table, uint32_t address)
 target_ulong panda_current_asid(CPUState *cpu) {
 #if defined(TARGET_I386)
   CPUArchState *env = (CPUArchState *)cpu->env_ptr;
+  // with PCIDs on, the low bits say which TLB entries to use
+  if (env->cr[4] & CR4_PCIDE_MASK) return env->cr[3] & ~0xfff;
   return env->cr[3];
 #elif defined(TARGET_ARM)
   target_ulong table;
@@ -203,16 +207,57 @@ int panda_physical_memory_rw(hwaddr addr, uint8_t *buf, int len, int is_write) {
 }
 
 
-hwaddr panda_virt_to_phys(CPUState *env, target_ulong addr){
+/* Translations for plugins, a small software TLB in front of the page
+ * walks of cpu_get_phys_page_debug().  An entry is good for the CPU and
+ * asid it was made for until that CPU's TLB is flushed in any way
+ * (tlb_flush_gen): the guest has to flush after changing a mapping it
+ * may have used, so plugins see what the guest's own accesses would.
+ * A switch to another asid keeps the entries only if the guest keeps its
+ * TLB too, as with PCIDs.  Without TCG nothing tells us about flushes,
+ * so every translation walks the page tables.  Pages that aren't mapped
+ * are never cached, since they may be mapped without a flush. */
+#define PANDA_XLAT_BITS 8
+typedef struct {
+    bool valid;
+    int cpu_index;
+    unsigned flush_gen;
+    target_ulong asid;
     target_ulong page;
-    hwaddr phys_addr;
-    page = addr & TARGET_PAGE_MASK;
-    phys_addr = cpu_get_phys_page_debug(env, page);
-    /* if no physical page mapped, return an error */
-    if (phys_addr == -1)
-        return -1;
-    phys_addr += (addr & ~TARGET_PAGE_MASK);
-    return phys_addr;
+    hwaddr phys_page;
+} PandaXlatEntry;
+static PandaXlatEntry panda_xlat[1 << PANDA_XLAT_BITS];
+
+hwaddr panda_virt_to_phys(CPUState *env, target_ulong addr) {
+    target_ulong page = addr & TARGET_PAGE_MASK;
+    hwaddr phys_page;
+
+    if (tcg_enabled()) {
+        target_ulong asid = panda_current_asid(env);
+        unsigned gen = atomic_read(&env->tlb_flush_gen);
+        PandaXlatEntry *e = &panda_xlat[(page >> TARGET_PAGE_BITS) &
+                                        ((1 << PANDA_XLAT_BITS) - 1)];
+        if (e->valid && e->page == page && e->asid == asid &&
+            e->cpu_index == env->cpu_index && e->flush_gen == gen) {
+            return e->phys_page + (addr & ~TARGET_PAGE_MASK);
+        }
+        phys_page = cpu_get_phys_page_debug(env, page);
+        /* if no physical page mapped, return an error */
+        if (phys_page == -1) {
+            return -1;
+        }
+        e->valid = true;
+        e->cpu_index = env->cpu_index;
+        e->flush_gen = gen;
+        e->asid = asid;
+        e->page = page;
+        e->phys_page = phys_page;
+    } else {
+        phys_page = cpu_get_phys_page_debug(env, page);
+        if (phys_page == -1) {
+            return -1;
+        }
+    }
+    return phys_page + (addr & ~TARGET_PAGE_MASK);
 }
 
 int panda_virtual_memory_rw(CPUState *env, target_ulong addr,
@@ -221,22 +266,19 @@ int panda_virtual_memory_rw(CPUState *env, target_ulong addr,
     int l;
     int ret;
     hwaddr phys_addr;
-    target_ulong page;
 
     /* Yes, this func should be called something else.
      * If you really want to write to memory, remove this assert.
      */
     assert (!is_write);
     while (len > 0) {
-        page = addr & TARGET_PAGE_MASK;
-        phys_addr = cpu_get_phys_page_debug(env, page);
+        phys_addr = panda_virt_to_phys(env, addr);
         /* if no physical page mapped, return an error */
         if (phys_addr == -1)
             return -1;
-        l = (page + TARGET_PAGE_SIZE) - addr;
+        l = TARGET_PAGE_SIZE - (addr & ~TARGET_PAGE_MASK);
         if (l > len)
             l = len;
-        phys_addr += (addr & ~TARGET_PAGE_MASK);
         ret = panda_physical_memory_rw(phys_addr, buf, l, is_write);
         if(ret < 0) return ret;
         len -= l;
@@ -252,6 +294,29 @@ int panda_virtual_memory_read(CPUState *env, target_ulong addr,
     return panda_virtual_memory_rw(env, addr, buf, len, 0);
 }
 
+// panda_virt_to_phys() caches every translation now; these stay for the
+// plugins that use them.
+hwaddr panda_virt_to_phys_cached(CPUState *env, target_ulong addr) {
+    return panda_virt_to_phys(env, addr);
+}
+
+int panda_virtual_memory_read_cached(CPUState *env, target_ulong addr,
+                                     uint8_t *buf, int len) {
+    return panda_virtual_memory_rw(env, addr, buf, len, 0);
+}
+
+int panda_virtual_memory_gather(CPUState *env, PandaMemRead *reads, int n) {
+    int i, failed = 0;
+    for (i = 0; i < n; i++) {
+        if (panda_virtual_memory_read_cached(env, reads[i].addr, reads[i].buf,
+                                             reads[i].len) < 0) {
+            memset(reads[i].buf, 0, reads[i].len);
+            failed++;
+        }
+    }
+    return failed;
+}
+
 
 int panda_virtual_memory_write(CPUState *env, target_ulong addr,
                                uint8_t *buf, int len) {
@@ -259,10 +324,100 @@ int panda_virtual_memory_write(CPUState *env, target_ulong addr,
 }
 
 
+// TBs listed in the TbProfile entry written at exit with -tb-profile
+#define PANDA_TB_PROFILE_BLOCKS 100
+
+static void panda_write_tb_profile(void) {
+    Panda__LogEntry ple = PANDA__LOG_ENTRY__INIT;
+    Panda__TbProfile tp = PANDA__TB_PROFILE__INIT;
+    TranslationBlock *top[PANDA_TB_PROFILE_BLOCKS];
+    int i, n;
+
+    tb_lock();
+    n = tb_profile_top(top, PANDA_TB_PROFILE_BLOCKS);
+    tp.period_us = tb_profile.period_us;
+    tp.n_samples = TB_PROF_SAMPLE_NB;
+    tp.samples = tb_profile.samples;
+    tp.samples_dropped = tb_profile.samples_dropped;
+    tp.n_exits = TB_PROF_EXIT_NB;
+    tp.exits = tb_profile.exits;
+    tp.n_blocks = n;
+    tp.blocks = pandalog_arena_alloc(n * sizeof(Panda__TbProfileBlock *));
+    for (i = 0; i < n; i++) {
+        Panda__TbProfileBlock *b = pandalog_arena_new(Panda__TbProfileBlock);
+        panda__tb_profile_block__init(b);
+        b->pc = top[i]->pc;
+        b->size = top[i]->size;
+        b->icount = top[i]->icount;
+        b->executions = top[i]->prof_execs;
+        b->entries = top[i]->prof_entries;
+        b->samples = top[i]->prof_samples;
+        tp.blocks[i] = b;
+    }
+    tb_unlock();
+    ple.tb_profile = &tp;
+    pandalog_write_entry(&ple);
+}
+
+static const char *const panda_block_acct_type_names[BLOCK_MAX_IOTYPE] = {
+    [BLOCK_ACCT_READ] = "read",
+    [BLOCK_ACCT_WRITE] = "write",
+    [BLOCK_ACCT_FLUSH] = "flush",
+};
+
+// Write the latency histograms set with x-block-latency-histogram-set
+static void panda_write_block_latency(void) {
+    Panda__LogEntry ple = PANDA__LOG_ENTRY__INIT;
+    Panda__BlockLatency bl = PANDA__BLOCK_LATENCY__INIT;
+    BlockBackend *blk;
+    size_t n = 0;
+    int type;
+
+    for (blk = blk_next(NULL); blk; blk = blk_next(blk)) {
+        BlockAcctStats *stats = blk_get_stats(blk);
+        for (type = 0; type < BLOCK_MAX_IOTYPE; type++) {
+            n += stats->latency_histogram[type].nbins > 0;
+        }
+    }
+    if (n == 0) {
+        return;
+    }
+
+    bl.n_histograms = 0;
+    bl.histograms =
+        pandalog_arena_alloc(n * sizeof(Panda__BlockLatencyHistogram *));
+    for (blk = blk_next(NULL); blk; blk = blk_next(blk)) {
+        BlockAcctStats *stats = blk_get_stats(blk);
+        for (type = 0; type < BLOCK_MAX_IOTYPE; type++) {
+            BlockLatencyHistogram *hist = &stats->latency_histogram[type];
+            Panda__BlockLatencyHistogram *h;
+
+            if (hist->nbins == 0) {
+                continue;
+            }
+            h = pandalog_arena_new(Panda__BlockLatencyHistogram);
+            panda__block_latency_histogram__init(h);
+            h->device = (char *) blk_name(blk);
+            h->type = (char *) panda_block_acct_type_names[type];
+            h->n_boundaries = hist->nbins - 1;
+            h->boundaries = hist->boundaries;
+            h->n_bins = hist->nbins;
+            h->bins = hist->bins;
+            bl.histograms[bl.n_histograms++] = h;
+        }
+    }
+    ple.block_latency = &bl;
+    pandalog_write_entry(&ple);
+}
+
 void panda_cleanup(void) {
     // PANDA: unload plugins
     panda_unload_plugins();
     if (pandalog) {
+        if (tb_profile_enabled) {
+            panda_write_tb_profile();
+        }
+        panda_write_block_latency();
         pandalog_close();
     }
 }
@@ -0,0 +1,120 @@
+/* PANDABEGINCOMMENT
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+
+// The embedding API of libpanda, see panda/panda_api.h.  main_aux() does
+// everything that qemu-system's main() does up to the main loop; replays
+// then run main_loop_run() until rr_do_end_replay() requests a shutdown.
+
+#include <signal.h>
+
+#include "panda/plugin.h"
+#include "panda/common.h"
+#include "panda/panda_api.h"
+#include "panda/rr/rr_log.h"
+#include "qemu/timer.h"
+#include "sysemu/sysemu.h"
+
+// panda_register_callback() only compares owners, so any unique pointer
+// will do for the program itself
+static char panda_api_owner;
+
+int panda_init(int argc, char **argv, char **envp) {
+    int ret = main_aux(argc, argv, envp, PANDA_INIT);
+    if (ret != 0) {
+        return ret;
+    }
+    if (no_shutdown) {
+        fprintf(stderr, "panda_init: -no-shutdown can't be used with "
+                "libpanda\n");
+        return -1;
+    }
+    return 0;
+}
+
+bool panda_api_load_plugin(const char *name, const char *args) {
+    char *plugin_path;
+    bool ok;
+
+    if (args != NULL && args[0] != '\0') {
+        char **opts = g_strsplit(args, ",", -1);
+        char **opt;
+        for (opt = opts; *opt != NULL; opt++) {
+            char *arg = g_strdup_printf("%s:%s", name, *opt);
+            if (!panda_add_arg(arg, strlen(arg))) {
+                fprintf(stderr, "WARN: Couldn't add PANDA arg '%s': "
+                        "argument too long,\n", arg);
+            }
+            g_free(arg);
+        }
+        g_strfreev(opts);
+    }
+    plugin_path = panda_plugin_path(name);
+    ok = panda_load_plugin(plugin_path);
+    g_free(plugin_path);
+    return ok;
+}
+
+int panda_replay(const char *name, uint64_t start_instr, uint64_t end_instr) {
+    sigset_t blockset, oldset;
+    int ret;
+
+    if (rr_mode != RR_OFF) {
+        fprintf(stderr, "panda_replay: a replay is already running\n");
+        return -1;
+    }
+    if (runstate_is_running()) {
+        vm_stop(RUN_STATE_PAUSED);
+    }
+    rr_replay_start_instr = start_instr;
+    rr_replay_end_instr = end_instr;
+
+    // as vl.c does for -replay
+    sigemptyset(&blockset);
+    sigaddset(&blockset, SIGALRM);
+    sigaddset(&blockset, SIGUSR2);
+    sigaddset(&blockset, SIGIO);
+    sigprocmask(SIG_BLOCK, &blockset, &oldset);
+    ret = rr_do_begin_replay(name, first_cpu);
+    if (ret == 0) {
+        qemu_rr_quit_timers();
+    }
+    sigprocmask(SIG_SETMASK, &oldset, NULL);
+    if (ret != 0) {
+        fprintf(stderr, "panda_replay: failed to start replay of %s\n", name);
+        return -1;
+    }
+
+    vm_start();
+    main_loop_run();
+    // the main loop stops at the shutdown requested by the end of the
+    // replay, with the vCPUs still going
+    vm_stop(RUN_STATE_PAUSED);
+    return 0;
+}
+
+void *panda_api_handle(void) {
+    return &panda_api_owner;
+}
+
+uint64_t panda_api_instr_count(void) {
+    return rr_get_guest_instr_count();
+}
+
+int panda_api_read_memory(uint64_t addr, void *buf, int len, bool physical) {
+    int ret;
+
+    if (physical) {
+        ret = panda_physical_memory_rw(addr, buf, len, 0);
+    } else {
+        ret = panda_virtual_memory_read(first_cpu, addr, buf, len);
+    }
+    return ret == 0 ? 0 : -1;
+}
+
+void panda_finish(void) {
+    main_cleanup();
+}
@@ -59,19 +59,24 @@
 
 #include "../include/panda/common.h"
 #include "panda/rr/rr_log.h"
+#include "qemu/thread.h"
 #endif
 
+#include <inttypes.h>
 #include <string.h>
 #include <math.h>
 #include "../include/panda/plog.h"
+#include "../include/panda/plog_columns.h"
 
 #include <zlib.h>
 #include <stdlib.h>
 
 Pandalog *thePandalog = NULL;
+// columnar copy of every entry written, with -pandalog-columns
+PlColumns *pandalog_columns = NULL;
 
 void pandalog_create(uint32_t chunk_size);
-void add_dir_entry(uint32_t chunk);
+void add_dir_entry(uint32_t chunk, uint64_t start_instr, uint64_t start_pos, uint32_t num_entries);
 void write_current_chunk(void);
 void write_header(PlHeader *plh);
 void write_dir(void);
@@ -113,10 +118,11 @@ void pandalog_create(uint32_t chunk_size) {
     thePandalog->dir.num_entries = 0;
     thePandalog->chunk.size = chunk_size;
     thePandalog->chunk.zsize = chunk_size;
-    // NB: malloc chunk a little big since we need to maintain
-    // the invariant that all log entries for an instruction reside in same
-    // chunk.  this should be big enough but don't worry, we'll be monitoring it.
-    thePandalog->chunk.buf = (unsigned char *) malloc(thePandalog->chunk.size);
+    // NB: malloc chunk a little big so that all the log entries for an
+    // instruction can usually stay in the same chunk.  groups that don't
+    // fit in the slack spill into the next chunk.
+    thePandalog->chunk.buf_size = chunk_size + PL_CHUNK_SLACK(chunk_size);
+    thePandalog->chunk.buf = (unsigned char *) malloc(thePandalog->chunk.buf_size);
     thePandalog->chunk.buf_p = thePandalog->chunk.buf;
     thePandalog->chunk.zbuf = (unsigned char *) malloc(thePandalog->chunk.zsize);
     thePandalog->chunk.start_instr = 0;
@@ -125,6 +131,9 @@ void pandalog_create(uint32_t chunk_size) {
     thePandalog->chunk.num_entries = 0;
     thePandalog->chunk.max_num_entries = 0;
     thePandalog->chunk.ind_entry = 0;
+    thePandalog->codec = PL_CODEC_ZLIB;
+    thePandalog->writer = NULL;
+    thePandalog->spills = 0;
     return;
 }
 
@@ -135,8 +144,82 @@ void pandalog_create(uint32_t chunk_size) {
 
 #ifndef PLOG_READER
 
+PlCodec pandalog_codec = PL_CODEC_ZLIB;
+int pandalog_zlevel = PL_Z_LEVEL;
+int pandalog_threads = PL_DEFAULT_THREADS;
+uint64_t pandalog_mem_limit = 0;
+
+int pandalog_set_codec(const char *spec) {
+    if (0 == strcmp(spec, "none")) {
+        pandalog_codec = PL_CODEC_NONE;
+        return 1;
+    }
+    if (0 == strncmp(spec, "zlib", 4)) {
+        int level = PL_Z_LEVEL;
+        if (spec[4] == ':') {
+            char *end;
+            level = strtol(spec + 5, &end, 0);
+            if (*end != '\0' || level < 0 || level > 9) return 0;
+        }
+        else if (spec[4] != '\0') return 0;
+        pandalog_codec = PL_CODEC_ZLIB;
+        pandalog_zlevel = level;
+        return 1;
+    }
+    return 0;
+}
+
+int pandalog_open_columns(const char *dir) {
+    assert (pandalog_columns == NULL);
+    pandalog_columns = pandalog_columns_open(dir);
+    return pandalog_columns != NULL;
+}
+
+// LogEntry fields set by the entries of the chunk being built, and those of
+// each chunk handed off so far, for the type index.  Only the emulation
+// thread touches these.
+typedef struct {
+    uint32_t *ids;              // in increasing order
+    uint32_t num;
+    uint32_t max;
+} PlTypeSet;
+
+static PlTypeSet cur_types;
+static PlTypeSet *chunk_types = NULL;
+static uint32_t max_chunk_types = 0;
+
+static void type_set_add(PlTypeSet *s, uint32_t id) {
+    uint32_t lo = 0, hi = s->num;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (s->ids[mid] == id) return;
+        if (s->ids[mid] < id) lo = mid + 1;
+        else hi = mid;
+    }
+    if (s->num == s->max) {
+        s->max = s->max ? 2 * s->max : 16;
+        s->ids = (uint32_t *) realloc(s->ids, sizeof(uint32_t) * s->max);
+        assert (s->ids != NULL);
+    }
+    memmove(s->ids + lo + 1, s->ids + lo, sizeof(uint32_t) * (s->num - lo));
+    s->ids[lo] = id;
+    s->num ++;
+}
+
+// record which fields the packed entry at p sets
+static void note_entry_types(const unsigned char *p, size_t n) {
+    const unsigned char *end = p + n;
+    uint32_t id, last = 0;
+    uint64_t val;
+    while ((p = pandalog_raw_field(p, end, &id, &val)) != NULL) {
+        // the common fields come first in every entry
+        if (id != last) type_set_add(&cur_types, id);
+        last = id;
+    }
+}
+
 // add dir entry for this chunk
-void add_dir_entry(uint32_t chunk) {
+void add_dir_entry(uint32_t chunk, uint64_t start_instr, uint64_t start_pos, uint32_t num_entries) {
     if (chunk >= thePandalog->dir.max_chunks) {
         uint32_t new_size = thePandalog->dir.max_chunks * 2;
         thePandalog->dir.instr = (uint64_t *) realloc(thePandalog->dir.instr, sizeof(uint64_t) * new_size);
@@ -147,47 +230,230 @@ void add_dir_entry(uint32_t chunk) {
     }
     assert (chunk <= thePandalog->dir.max_chunks);
     // this is start instr and start file position for this chunk
-    thePandalog->dir.instr[chunk] = thePandalog->chunk.start_instr;
-    thePandalog->dir.pos[chunk] = thePandalog->chunk.start_pos;
+    thePandalog->dir.instr[chunk] = start_instr;
+    thePandalog->dir.pos[chunk] = start_pos;
     // and this is the number of entries in this chunk
-    thePandalog->dir.num_entries[chunk] = thePandalog->chunk.ind_entry;
+    thePandalog->dir.num_entries[chunk] = num_entries;
+}
+
+/*
+  Full chunks are handed to a pool of threads which compress them
+  concurrently and then take turns, in chunk order, writing them to the
+  file and filling in their directory entries.  Whichever thread holds
+  the turn (next_write == its chunk) is the only one touching the file or
+  the directory, so that needs no lock; the emulation thread keeps off
+  both until pandalog_close_write has joined the pool.
+
+  The emulation thread waits before handing over a chunk while
+  2 * threads chunks are already in flight, or while that chunk would
+  take the memory they hold (uncompressed and compressed copies) over
+  -pandalog-mem.  It never waits with nothing in flight, so one chunk
+  bigger than the cap still gets through.  With -pandalog-threads 0
+  there is no pool and chunks are written on the emulation thread.
+*/
+
+typedef struct PandalogJob {
+    uint32_t chunk_num;
+    unsigned char *buf;         // uncompressed chunk; the job owns it
+    unsigned long len;
+    uint64_t start_instr;
+    uint32_t num_entries;
+    struct PandalogJob *next;
+} PandalogJob;
+
+typedef struct PandalogWriter {
+    QemuThread *threads;
+    int num_threads;
+    PlCodec codec;
+    int level;
+    QemuMutex lock;
+    QemuCond cond;
+    PandalogJob *queue_head;    // waiting for a thread to compress them
+    PandalogJob *queue_tail;
+    uint32_t in_flight;         // handed over but not yet written
+    uint32_t max_in_flight;
+    uint64_t bytes_in_flight;   // memory those hold, counting compression buffers
+    uint64_t max_bytes;         // 0 for no limit
+    uint64_t stalls;            // times the emulation thread had to wait
+    uint32_t next_write;        // number of the chunk to be written next
+    bool stopping;
+    uint64_t raw_bytes;
+    uint64_t stored_bytes;
+} PandalogWriter;
+
+// memory a job holds until it has been written
+static uint64_t job_bytes(PandalogWriter *w, PandalogJob *job) {
+    return job->len + ((w->codec == PL_CODEC_ZLIB) ? compressBound(job->len) : 0);
+}
+
+static void write_job(PandalogWriter *w, PandalogJob *job) {
+    unsigned char *out = job->buf;
+    unsigned long outlen = job->len;
+    unsigned char *zbuf = NULL;
+    if (w->codec == PL_CODEC_ZLIB) {
+        outlen = compressBound(job->len);
+        zbuf = (unsigned char *) malloc(outlen);
+        assert (zbuf != NULL);
+        int ret = compress2(zbuf, &outlen, job->buf, job->len, w->level);
+        assert (ret == Z_OK);
+        out = zbuf;
+    }
+    // wait for our turn at the file
+    qemu_mutex_lock(&w->lock);
+    while (w->next_write != job->chunk_num) {
+        qemu_cond_wait(&w->cond, &w->lock);
+    }
+    qemu_mutex_unlock(&w->lock);
+    uint64_t start_pos = ftell(thePandalog->file);
+    size_t n = fwrite(out, 1, outlen, thePandalog->file);
+    assert (n == outlen);
+    add_dir_entry(job->chunk_num, job->start_instr, start_pos, job->num_entries);
+    qemu_mutex_lock(&w->lock);
+    w->next_write ++;
+    w->in_flight --;
+    w->bytes_in_flight -= job_bytes(w, job);
+    w->raw_bytes += job->len;
+    w->stored_bytes += outlen;
+    qemu_cond_broadcast(&w->cond);
+    qemu_mutex_unlock(&w->lock);
+    free(zbuf);
+}
+
+static void *pandalog_writer_thread(void *opaque) {
+    PandalogWriter *w = (PandalogWriter *) opaque;
+    qemu_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->queue_head == NULL && !w->stopping) {
+            qemu_cond_wait(&w->cond, &w->lock);
+        }
+        PandalogJob *job = w->queue_head;
+        if (job == NULL) {
+            // stopping and nothing left to compress
+            break;
+        }
+        w->queue_head = job->next;
+        if (w->queue_head == NULL) w->queue_tail = NULL;
+        qemu_mutex_unlock(&w->lock);
+        write_job(w, job);
+        free(job->buf);
+        free(job);
+        qemu_mutex_lock(&w->lock);
+    }
+    qemu_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+// started with the first chunk, so the -pandalog-* options can come after
+// -pandalog on the command line
+static PandalogWriter *pandalog_writer_start(void) {
+    PandalogWriter *w = (PandalogWriter *) calloc(1, sizeof(PandalogWriter));
+    int i;
+    w->num_threads = pandalog_threads > 0 ? pandalog_threads : 0;
+    w->codec = pandalog_codec;
+    w->level = pandalog_zlevel;
+    // each thread can be working on one chunk with one more queued behind
+    // it before the emulation thread has to wait
+    w->max_in_flight = 2 * w->num_threads;
+    w->max_bytes = pandalog_mem_limit;
+    qemu_mutex_init(&w->lock);
+    qemu_cond_init(&w->cond);
+    w->threads = (QemuThread *) calloc(w->num_threads, sizeof(QemuThread));
+    for (i = 0; i < w->num_threads; i++) {
+        qemu_thread_create(&w->threads[i], "pandalog_writer", pandalog_writer_thread,
+                           w, QEMU_THREAD_JOINABLE);
+    }
+    thePandalog->codec = w->codec;
+    return w;
+}
+
+// wait for every chunk handed over to be written, then stop the threads
+static void pandalog_writer_finish(PandalogWriter *w) {
+    int i;
+    qemu_mutex_lock(&w->lock);
+    w->stopping = true;
+    qemu_cond_broadcast(&w->cond);
+    qemu_mutex_unlock(&w->lock);
+    for (i = 0; i < w->num_threads; i++) {
+        qemu_thread_join(&w->threads[i]);
+    }
+    assert (w->in_flight == 0);
+    if (w->raw_bytes > 0) {
+        printf ("pandalog: %d chunks, %" PRIu64 " bytes stored as %" PRIu64 " = %.2f compression\n",
+                (int) w->next_write, w->raw_bytes, w->stored_bytes,
+                ((double) w->raw_bytes) / ((double) w->stored_bytes));
+    }
+    if (w->stalls > 0) {
+        printf ("pandalog: emulation waited for the writer %" PRIu64 " times\n", w->stalls);
+    }
+    qemu_cond_destroy(&w->cond);
+    qemu_mutex_destroy(&w->lock);
+    free(w->threads);
+    free(w);
 }
 
-// compress current chunk and write it to file,
-// also update directory map
+// hand current chunk to the compression threads and start a fresh one.
+// the directory entry is filled in once the chunk has been written.
 void write_current_chunk(void) {
-    // uncompressed chunk size
-    unsigned long cs = thePandalog->chunk.buf_p - thePandalog->chunk.buf;
-    unsigned long ccs = thePandalog->chunk.zsize;
-    int ret;
-    // loop allows compress2 to fail and resize output buffer as needed
-    // not sure why compress2 needs output buf to be bigger than input
-    // even though ultimately it is smaller.  scratch space?
-    // 10 is just a random guess.  shouldn't need more than 1 re-try
-    uint32_t i;
-    for (i=0; i<10; i++) {
-        ret = compress2(thePandalog->chunk.zbuf, &ccs, thePandalog->chunk.buf, cs, Z_BEST_COMPRESSION);
-        if (ret == Z_OK) break;
-        // bigger output buffer needed to perform compression?
-        thePandalog->chunk.zsize *= 2;
-        thePandalog->chunk.zbuf = (unsigned char *) realloc(thePandalog->chunk.zbuf, thePandalog->chunk.zsize);
-        assert (thePandalog->chunk.zbuf != NULL);
-    }
-    // ccs is final compressed chunk size
-    assert (ret == Z_OK);
-    assert(ccs > 0);
-    assert(cs >= ccs);
-    printf ("writing chunk %d of pandalog %d / %d = %.2f compression\n",
-            (int) thePandalog->chunk_num, (int) cs, (int) ccs, ((float) cs) / ((float) ccs)); 
-    fwrite(thePandalog->chunk.zbuf, 1, ccs, thePandalog->file);
-    add_dir_entry(thePandalog->chunk_num);
-    // reset start instr / pos
-    thePandalog->chunk.start_instr = rr_get_guest_instr_count();
-    thePandalog->chunk.start_pos = ftell(thePandalog->file);
-    // rewind chunk buf and inc chunk #
-    thePandalog->chunk.buf_p = thePandalog->chunk.buf;
+    PandalogChunk *chunk = &(thePandalog->chunk);
+    if (thePandalog->writer == NULL) {
+        thePandalog->writer = pandalog_writer_start();
+    }
+    PandalogWriter *w = thePandalog->writer;
+    PandalogJob *job = (PandalogJob *) malloc(sizeof(PandalogJob));
+    job->chunk_num = thePandalog->chunk_num;
+    job->buf = chunk->buf;
+    job->len = chunk->buf_p - chunk->buf;
+    job->start_instr = chunk->start_instr;
+    job->num_entries = chunk->ind_entry;
+    job->next = NULL;
+    uint64_t bytes = job_bytes(w, job);
+    qemu_mutex_lock(&w->lock);
+    if (w->num_threads == 0) {
+        w->in_flight ++;
+        w->bytes_in_flight += bytes;
+        qemu_mutex_unlock(&w->lock);
+        write_job(w, job);
+        free(job->buf);
+        free(job);
+    }
+    else {
+        if (w->in_flight > 0
+            && (w->in_flight >= w->max_in_flight
+                || (w->max_bytes && w->bytes_in_flight + bytes > w->max_bytes))) {
+            w->stalls ++;
+        }
+        while (w->in_flight > 0
+               && (w->in_flight >= w->max_in_flight
+                   || (w->max_bytes && w->bytes_in_flight + bytes > w->max_bytes))) {
+            qemu_cond_wait(&w->cond, &w->lock);
+        }
+        if (w->queue_tail) w->queue_tail->next = job;
+        else w->queue_head = job;
+        w->queue_tail = job;
+        w->in_flight ++;
+        w->bytes_in_flight += bytes;
+        qemu_cond_broadcast(&w->cond);
+        qemu_mutex_unlock(&w->lock);
+    }
+    // the chunk's types go in the type index
+    if (thePandalog->chunk_num >= max_chunk_types) {
+        uint32_t new_max = max_chunk_types ? 2 * max_chunk_types : 128;
+        chunk_types = (PlTypeSet *) realloc(chunk_types, sizeof(PlTypeSet) * new_max);
+        assert (chunk_types != NULL);
+        max_chunk_types = new_max;
+    }
+    chunk_types[thePandalog->chunk_num] = cur_types;
+    memset(&cur_types, 0, sizeof(cur_types));
+    // reset start instr 
+    chunk->start_instr = rr_get_guest_instr_count();
+    // the job owns the old buffer now.  the new one is the usual size
+    // again even if the old one had to grow for an outsize entry.
+    chunk->buf_size = chunk->size + PL_CHUNK_SLACK(chunk->size);
+    chunk->buf = (unsigned char *) malloc(chunk->buf_size);
+    assert (chunk->buf != NULL);
+    chunk->buf_p = chunk->buf;
     thePandalog->chunk_num ++;
-    thePandalog->chunk.ind_entry = 0;
+    chunk->ind_entry = 0;
 }
 
 // write the pandalog header
@@ -208,10 +474,12 @@ void write_dir(void) {
     assert (num_chunks > 0);
     // create header
     PlHeader plh;
+    memset(&plh, 0, sizeof(plh));
     plh.version = PL_CURRENT_VERSION;
     // file position of directory info
     plh.dir_pos = ftell(thePandalog->file);        
     plh.chunk_size = thePandalog->chunk.size;
+    plh.codec = thePandalog->codec;
     printf ("header: version=%d  dir_pos=%" PRIx64 " chunk_size=%d\n",
             plh.version, plh.dir_pos, plh.chunk_size);   
     // now go ahead and write dir where we are in logfile
@@ -222,6 +490,17 @@ void write_dir(void) {
         fwrite(&(dir->pos[i]), sizeof(dir->pos[i]), 1, thePandalog->file);
         fwrite(&(dir->num_entries[i]), sizeof(dir->num_entries[i]), 1, thePandalog->file);
     }
+    // then the type index
+    plh.types_pos = ftell(thePandalog->file);
+    for (i=0; i<num_chunks; i++) {
+        PlTypeSet *s = &chunk_types[i];
+        fwrite(&(s->num), sizeof(s->num), 1, thePandalog->file);
+        fwrite(s->ids, sizeof(uint32_t), s->num, thePandalog->file);
+        free(s->ids);
+    }
+    free(chunk_types);
+    chunk_types = NULL;
+    max_chunk_types = 0;
     // finally write header
     write_header(&plh);
 }
@@ -250,6 +529,62 @@ extern int panda_in_main_loop;
 
 uint64_t instr_last_entry = -1;
 
+// blocks are kept across resets, so after the first chunk building entries
+// allocates nothing
+typedef struct PandalogArenaBlock {
+    struct PandalogArenaBlock *next;
+    size_t size;
+    size_t used;
+    unsigned char data[];
+} PandalogArenaBlock;
+
+static PandalogArenaBlock *arena_first = NULL;
+static PandalogArenaBlock *arena_cur = NULL;
+
+void *pandalog_arena_alloc(size_t n) {
+    n = (n + 7) & ~(size_t) 7;
+    while (arena_cur == NULL || arena_cur->used + n > arena_cur->size) {
+        if (arena_cur && arena_cur->next && n <= arena_cur->next->size) {
+            arena_cur = arena_cur->next;
+            arena_cur->used = 0;
+            continue;
+        }
+        size_t size = (n > PL_ARENA_BLOCK_SIZE) ? n : PL_ARENA_BLOCK_SIZE;
+        PandalogArenaBlock *b = (PandalogArenaBlock *) malloc(sizeof(PandalogArenaBlock) + size);
+        assert (b != NULL);
+        b->size = size;
+        b->used = 0;
+        if (arena_cur) {
+            b->next = arena_cur->next;
+            arena_cur->next = b;
+        }
+        else {
+            b->next = NULL;
+            arena_first = b;
+        }
+        arena_cur = b;
+    }
+    void *p = arena_cur->data + arena_cur->used;
+    arena_cur->used += n;
+    memset(p, 0, n);
+    return p;
+}
+
+void *pandalog_arena_memdup(const void *p, size_t n) {
+    void *q = pandalog_arena_alloc(n);
+    memcpy(q, p, n);
+    return q;
+}
+
+char *pandalog_arena_strdup(const char *s) {
+    return (char *) pandalog_arena_memdup(s, strlen(s) + 1);
+}
+
+static void pandalog_arena_reset(void) {
+    arena_cur = arena_first;
+    if (arena_cur) arena_cur->used = 0;
+}
+
 void pandalog_write_entry(Panda__LogEntry *entry) {
     // fill in required fields. 
     if (panda_in_main_loop) {
@@ -260,50 +595,66 @@ void pandalog_write_entry(Panda__LogEntry *entry) {
         entry->pc = -1;
         entry->instr = -1;
     }
+    if (pandalog_columns) {
+        pandalog_columns_add(pandalog_columns, entry);
+        // -pandalog-columns on its own, which copies everything it needs
+        if (thePandalog == NULL) {
+            pandalog_arena_reset();
+            return;
+        }
+    }
+    uint8_t flushed = 0;
+    PandalogChunk *chunk = &(thePandalog->chunk);
     size_t n = panda__log_entry__get_packed_size(entry);
-    // possibly compress and write current chunk and move on to next chunk
-    // but dont do so if it would spread log entries for same instruction between chunks
-    // invariant: all log entries for an instruction belong in a single chunk
-    if ((instr_last_entry != -1)  // first entry written
-        && (instr_last_entry != entry->instr) 
-        && (thePandalog->chunk.buf_p + n >= thePandalog->chunk.buf + thePandalog->chunk.size)) {
-        // entry  won't fit in current chunk
-        // and new entry is a different instr from last entry written
+    size_t used = chunk->buf_p - chunk->buf;
+    // hand off the current chunk if the entry won't fit.  all the entries
+    // for an instruction stay in one chunk if they fit in the chunk's
+    // slack; a bigger group spills into a continuation chunk, whose
+    // directory entry starts at that same instruction, rather than
+    // growing the buffer without bound.
+    size_t need = used + sizeof(uint32_t) + n;
+    if (chunk->ind_entry > 0 && need > chunk->size
+        && (instr_last_entry != entry->instr || need > chunk->size + PL_CHUNK_SLACK(chunk->size))) {
+        if (instr_last_entry == entry->instr) thePandalog->spills ++;
         write_current_chunk();
+        flushed = 1;
+        used = 0;
+    }
+    // an entry bigger than a whole chunk gets a chunk to itself
+    if (used + sizeof(uint32_t) + n > chunk->buf_size) {
+        chunk->buf_size = used + sizeof(uint32_t) + n;
+        chunk->buf = (unsigned char *) realloc(chunk->buf, chunk->buf_size);
+        assert (chunk->buf != NULL);
+        chunk->buf_p = chunk->buf + used;
     }
-    
-    // sanity check.  If this fails, that means a large number of pandalog entries
-    // for same instr went off the end of a chunk, which was already allocated bigger than needed.  
-    // possible.  but I'd rather assert its not and understand why before adding auto realloc here.
-    // TRL 2016-05-10: Ok here's a time when this legit happens.  When you pandalog in uninit_plugin
-    // this can be a lot of entries for the same instr (the very last one in the trace).  
-    // So no more assert.  
-    if (thePandalog->chunk.buf_p + sizeof(uint32_t) + n 
-        >= thePandalog->chunk.buf + ((int)(floor(thePandalog->chunk.size)))) {
-        uint32_t offset = thePandalog->chunk.buf_p - thePandalog->chunk.buf;
-        uint32_t new_size = offset * 2;
-        printf ("reallocing chunk.buf to %d bytes\n", new_size);
-        thePandalog->chunk.buf = (unsigned char *) realloc(thePandalog->chunk.buf, new_size);
-        thePandalog->chunk.buf_p = thePandalog->chunk.buf + offset;
-        assert (thePandalog->chunk.buf != NULL);
-    }                                                          
     // now write the entry itself to the buffer.  size then entry itself
     *((uint32_t *) thePandalog->chunk.buf_p) = n;
     thePandalog->chunk.buf_p += sizeof(uint32_t);
     // and then the entry itself (packed)
     panda__log_entry__pack(entry, thePandalog->chunk.buf_p);
+    note_entry_types(thePandalog->chunk.buf_p, n);
     thePandalog->chunk.buf_p += n;
     // remember instr for last entry
     instr_last_entry = entry->instr;
     thePandalog->chunk.ind_entry ++;
+    // entries built in the arena before this one have all been packed, and
+    // this one just was
+    if (flushed) pandalog_arena_reset();
 }
 
 int pandalog_close_write(void) {
     // finish current chunk then write directory info and header
     write_current_chunk();        
+    pandalog_writer_finish(thePandalog->writer);
+    thePandalog->writer = NULL;
+    if (thePandalog->spills > 0) {
+        printf ("pandalog: %" PRIu64 " continuation chunks for instructions that overflowed one\n",
+                thePandalog->spills);
+    }
     // Not a mistake!
     // this will add one more dir entry for last instr and file pos
-    add_dir_entry(thePandalog->chunk_num);
+    add_dir_entry(thePandalog->chunk_num, thePandalog->chunk.start_instr,
+                  ftell(thePandalog->file), 0);
     write_dir();
     return 0;
 }
@@ -334,6 +685,8 @@ void read_dir(void) {
     assert (thePandalog->file != NULL);
     assert(in_read_mode());
     PlHeader *plh = read_header();
+    // codec was added in version 3; everything before is zlib
+    thePandalog->codec = (plh->version >= 3) ? (PlCodec) plh->codec : PL_CODEC_ZLIB;
     thePandalog->chunk.size = plh->chunk_size;
     thePandalog->chunk.zsize = plh->chunk_size;
     // realloc those chunk bufs
@@ -404,6 +757,12 @@ void pandalog_open(const char *path, const char *mode) {
 }
 
 int  pandalog_close(void) {
+    if (pandalog_columns) {
+        uint64_t rows = pandalog_columns_close(pandalog_columns);
+        printf ("pandalog: %" PRIu64 " rows in columns\n", rows);
+        pandalog_columns = NULL;
+        if (thePandalog == NULL) return 0;
+    }
     if (thePandalog->mode == PL_MODE_WRITE) {
 #ifndef PLOG_READER
         pandalog_close_write();
@@ -427,32 +786,52 @@ void unmarshall_chunk(uint32_t c) {
     int ret = fseek(thePandalog->file, thePandalog->dir.pos[c], SEEK_SET);
     assert (ret == 0);
     unsigned long ccs = thePandalog->dir.pos[c+1] - thePandalog->dir.pos[c] + 1;
+    if (ccs > chunk->zsize) {
+        chunk->zsize = ccs;
+        chunk->zbuf = (unsigned char *) realloc(chunk->zbuf, chunk->zsize);
+        assert (chunk->zbuf != NULL);
+    }
     uint32_t n = fread(chunk->zbuf, 1, ccs, thePandalog->file);
-    assert (ccs == n);
     unsigned long cs = chunk->size;
-    // uncompress it
-    printf ("cs=%d ccs=%d\n", (int) cs, (int) ccs);
-    uint8_t done = 0;
-    while (!done) {
-        ret = uncompress(chunk->buf, &cs, chunk->zbuf, ccs);
-        printf ("ret = %d\n", ret);
-        if (ret == Z_OK) done = 1;
-        else {
-            if (ret == Z_BUF_ERROR) {
-                // need a bigger buffer
-                // make sure we won't int overflow
-                assert (chunk->size < UINT32_MAX/2);
-                chunk->size *= 2;
-                printf ("grew chunk buffer to %d\n", chunk->size);
-                chunk->buf = (unsigned char *) 
-                    realloc(chunk->buf,chunk->size);
-                chunk->buf_p = chunk->buf;
-                cs = chunk->size;
-            }
+    if (thePandalog->codec == PL_CODEC_NONE) {
+        // stored as is.  NB: ccs runs one byte into the next chunk
+        // (or the directory), which fread may not get for the last one
+        cs = ccs - 1;
+        assert (n >= cs);
+        if (cs > chunk->size) {
+            chunk->size = cs;
+            chunk->buf = (unsigned char *) realloc(chunk->buf, chunk->size);
+            assert (chunk->buf != NULL);
         }
-    }                                
-    printf ("ret =%d\n", ret);
-    assert (ret == Z_OK);
+        memcpy(chunk->buf, chunk->zbuf, cs);
+        chunk->buf_p = chunk->buf;
+    }
+    else {
+        assert (ccs == n);
+        // uncompress it
+        printf ("cs=%d ccs=%d\n", (int) cs, (int) ccs);
+        uint8_t done = 0;
+        while (!done) {
+            ret = uncompress(chunk->buf, &cs, chunk->zbuf, ccs);
+            printf ("ret = %d\n", ret);
+            if (ret == Z_OK) done = 1;
+            else {
+                if (ret == Z_BUF_ERROR) {
+                    // need a bigger buffer
+                    // make sure we won't int overflow
+                    assert (chunk->size < UINT32_MAX/2);
+                    chunk->size *= 2;
+                    printf ("grew chunk buffer to %d\n", chunk->size);
+                    chunk->buf = (unsigned char *) 
+                        realloc(chunk->buf,chunk->size);
+                    chunk->buf_p = chunk->buf;
+                    cs = chunk->size;
+                }
+            }
+        }                                
+        printf ("ret =%d\n", ret);
+        assert (ret == Z_OK);
+    }
     thePandalog->chunk_num = c;
     // realloc current chunk arrays if necessary
     if (chunk->max_num_entries < thePandalog->dir.num_entries[c]) {
@@ -0,0 +1,299 @@
+/*
+  Columnar pandalog writer; see panda/include/panda/plog_columns.h.
+
+  Every column is two files written as rows come in: values and, for
+  nullable columns, validity.  A column is created the first time a row
+  has its field, and rows are only written to it when they have the
+  field, so it lags behind; it is padded with empty rows up to the
+  current one before the next value goes in, and up to the end at close.
+  The .npy headers are fixed size so the row count can be patched in
+  then.
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <glib.h>
+
+#include "../include/panda/plog_columns.h"
+
+// .npy header, magic through padding.  a multiple of 64, as numpy likes.
+#define NPY_HEADER_SIZE 128
+
+typedef struct {
+    char *name;
+    char descr[4];          // numpy dtype, e.g. "<u8"
+    size_t width;
+    FILE *values;
+    FILE *valid;            // NULL if every row has the field
+    uint64_t rows;          // rows written so far
+    GHashTable *dict;       // string columns: string -> code + 1
+    FILE *dict_file;
+    uint32_t dict_size;
+} PlColumn;
+
+typedef struct PlColumnSet {
+    const ProtobufCMessageDescriptor *desc;
+    char *prefix;           // "" for LogEntry, else "<field>." down to here
+    int depth;
+    uint8_t nullable;       // whether the message itself can be missing
+    PlColumn **cols;        // per field, created when a row first has it
+    struct PlColumnSet **children;  // per message field, likewise
+} PlColumnSet;
+
+struct PlColumns {
+    char *dir;
+    PlColumnSet *root;
+    uint64_t rows;
+    GPtrArray *all;         // every column, in the order they were created
+};
+
+static void npy_header(FILE *f, const char *descr, uint64_t rows) {
+    char h[NPY_HEADER_SIZE];
+    memset(h, ' ', sizeof(h));
+    memcpy(h, "\x93NUMPY\x01\x00", 8);
+    h[8] = (NPY_HEADER_SIZE - 10) & 0xff;
+    h[9] = (NPY_HEADER_SIZE - 10) >> 8;
+    int n = snprintf(h + 10, sizeof(h) - 10,
+                     "{'descr': '%s', 'fortran_order': False, 'shape': (%" PRIu64 ",), }",
+                     descr, rows);
+    assert (n > 0 && n < NPY_HEADER_SIZE - 11);
+    h[10 + n] = ' ';
+    h[NPY_HEADER_SIZE - 1] = '\n';
+    fseek(f, 0, SEEK_SET);
+    fwrite(h, 1, sizeof(h), f);
+}
+
+static FILE *column_file(PlColumns *pc, const char *name, const char *suffix) {
+    char *path = g_strdup_printf("%s/%s%s", pc->dir, name, suffix);
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    g_free(path);
+    return f;
+}
+
+// numpy dtype a field's column is stored as.  returns 0 for fields that
+// don't get a column.
+static int field_dtype(const ProtobufCFieldDescriptor *f, char *descr, size_t *width) {
+    char kind;
+    const char *order = (G_BYTE_ORDER == G_LITTLE_ENDIAN) ? "<" : ">";
+    if (f->label == PROTOBUF_C_LABEL_REPEATED) {
+        // element count
+        kind = 'u'; *width = 4;
+    }
+    else switch (f->type) {
+    case PROTOBUF_C_TYPE_INT32:
+    case PROTOBUF_C_TYPE_SINT32:
+    case PROTOBUF_C_TYPE_SFIXED32:
+    case PROTOBUF_C_TYPE_ENUM:
+        kind = 'i'; *width = 4; break;
+    case PROTOBUF_C_TYPE_UINT32:
+    case PROTOBUF_C_TYPE_FIXED32:
+    case PROTOBUF_C_TYPE_STRING:    // dictionary code
+        kind = 'u'; *width = 4; break;
+    case PROTOBUF_C_TYPE_INT64:
+    case PROTOBUF_C_TYPE_SINT64:
+    case PROTOBUF_C_TYPE_SFIXED64:
+        kind = 'i'; *width = 8; break;
+    case PROTOBUF_C_TYPE_UINT64:
+    case PROTOBUF_C_TYPE_FIXED64:
+        kind = 'u'; *width = 8; break;
+    case PROTOBUF_C_TYPE_FLOAT:
+        kind = 'f'; *width = 4; break;
+    case PROTOBUF_C_TYPE_DOUBLE:
+        kind = 'f'; *width = 8; break;
+    case PROTOBUF_C_TYPE_BOOL:
+        kind = 'b'; *width = 1; order = "|"; break;
+    default:
+        return 0;
+    }
+    snprintf(descr, 4, "%s%c%zu", order, kind, *width);
+    return 1;
+}
+
+static PlColumnSet *column_set_new(const ProtobufCMessageDescriptor *desc,
+                                   const char *prefix, int depth, uint8_t nullable) {
+    PlColumnSet *set = g_new0(PlColumnSet, 1);
+    set->desc = desc;
+    set->prefix = g_strdup(prefix);
+    set->depth = depth;
+    set->nullable = nullable;
+    set->cols = g_new0(PlColumn *, desc->n_fields);
+    set->children = g_new0(PlColumnSet *, desc->n_fields);
+    return set;
+}
+
+static void column_set_free(PlColumnSet *set) {
+    unsigned i;
+    for (i = 0; i < set->desc->n_fields; i++) {
+        if (set->children[i]) column_set_free(set->children[i]);
+    }
+    g_free(set->cols);
+    g_free(set->children);
+    g_free(set->prefix);
+    g_free(set);
+}
+
+static PlColumn *get_column(PlColumns *pc, PlColumnSet *set, unsigned i) {
+    if (set->cols[i]) return set->cols[i];
+    const ProtobufCFieldDescriptor *f = &set->desc->fields[i];
+    PlColumn *col = g_new0(PlColumn, 1);
+    int ok = field_dtype(f, col->descr, &col->width);
+    assert (ok);
+    col->name = g_strdup_printf("%s%s%s", set->prefix, f->name,
+                                (f->label == PROTOBUF_C_LABEL_REPEATED) ? ".count" : "");
+    col->values = column_file(pc, col->name, ".npy");
+    npy_header(col->values, col->descr, 0);
+    if (set->nullable || f->label != PROTOBUF_C_LABEL_REQUIRED) {
+        col->valid = column_file(pc, col->name, ".valid.npy");
+        npy_header(col->valid, "|b1", 0);
+    }
+    if (f->label != PROTOBUF_C_LABEL_REPEATED && f->type == PROTOBUF_C_TYPE_STRING) {
+        col->dict = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        col->dict_file = column_file(pc, col->name, ".dict");
+    }
+    set->cols[i] = col;
+    g_ptr_array_add(pc->all, col);
+    return col;
+}
+
+// write empty rows until col has rows rows
+static void column_pad(PlColumn *col, uint64_t rows) {
+    static const uint8_t zero[8] = { 0 };
+    for (; col->rows < rows; col->rows++) {
+        fwrite(zero, 1, col->width, col->values);
+        if (col->valid) fputc(0, col->valid);
+    }
+}
+
+static void column_put(PlColumns *pc, PlColumn *col, const void *value) {
+    column_pad(col, pc->rows);
+    fwrite(value, 1, col->width, col->values);
+    if (col->valid) fputc(1, col->valid);
+    col->rows++;
+}
+
+static uint32_t dict_code(PlColumn *col, const char *s) {
+    gpointer code;
+    if (g_hash_table_lookup_extended(col->dict, s, NULL, &code)) {
+        return GPOINTER_TO_UINT(code) - 1;
+    }
+    g_hash_table_insert(col->dict, g_strdup(s), GUINT_TO_POINTER(col->dict_size + 1));
+    for (; *s; s++) {
+        if (*s == '\n') fputs("\\n", col->dict_file);
+        else if (*s == '\\') fputs("\\\\", col->dict_file);
+        else fputc(*s, col->dict_file);
+    }
+    fputc('\n', col->dict_file);
+    return col->dict_size++;
+}
+
+static int field_present(const ProtobufCFieldDescriptor *f, const char *msg) {
+    if (f->label == PROTOBUF_C_LABEL_REQUIRED) return 1;
+    if (f->type == PROTOBUF_C_TYPE_STRING || f->type == PROTOBUF_C_TYPE_MESSAGE) {
+        return *(void * const *) (msg + f->offset) != NULL;
+    }
+    if (f->label == PROTOBUF_C_LABEL_OPTIONAL) {
+        return *(const protobuf_c_boolean *) (msg + f->quantifier_offset);
+    }
+    return 1;
+}
+
+static void add_message(PlColumns *pc, PlColumnSet *set, const ProtobufCMessage *m) {
+    const char *msg = (const char *) m;
+    unsigned i;
+    for (i = 0; i < set->desc->n_fields; i++) {
+        const ProtobufCFieldDescriptor *f = &set->desc->fields[i];
+        const char *member = msg + f->offset;
+        if (f->label == PROTOBUF_C_LABEL_REPEATED) {
+            uint32_t n = *(const size_t *) (msg + f->quantifier_offset);
+            if (n != 0) column_put(pc, get_column(pc, set, i), &n);
+            continue;
+        }
+        if (f->type == PROTOBUF_C_TYPE_BYTES || !field_present(f, msg)) continue;
+        if (f->type == PROTOBUF_C_TYPE_MESSAGE) {
+            if (set->depth >= PL_COLUMNS_MAX_DEPTH) continue;
+            if (set->children[i] == NULL) {
+                char *prefix = g_strdup_printf("%s%s.", set->prefix, f->name);
+                set->children[i] = column_set_new(
+                    (const ProtobufCMessageDescriptor *) f->descriptor,
+                    prefix, set->depth + 1, 1);
+                g_free(prefix);
+            }
+            add_message(pc, set->children[i], *(ProtobufCMessage * const *) member);
+        }
+        else if (f->type == PROTOBUF_C_TYPE_STRING) {
+            PlColumn *col = get_column(pc, set, i);
+            uint32_t code = dict_code(col, *(char * const *) member);
+            column_put(pc, col, &code);
+        }
+        else if (f->type == PROTOBUF_C_TYPE_BOOL) {
+            uint8_t b = *(const protobuf_c_boolean *) member != 0;
+            column_put(pc, get_column(pc, set, i), &b);
+        }
+        else {
+            // every other type is stored as is
+            column_put(pc, get_column(pc, set, i), member);
+        }
+    }
+}
+
+PlColumns *pandalog_columns_open(const char *dir) {
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        perror(dir);
+        return NULL;
+    }
+    PlColumns *pc = g_new0(PlColumns, 1);
+    pc->dir = g_strdup(dir);
+    pc->root = column_set_new(&panda__log_entry__descriptor, "", 0, 0);
+    pc->all = g_ptr_array_new();
+    return pc;
+}
+
+void pandalog_columns_add(PlColumns *pc, const Panda__LogEntry *entry) {
+    add_message(pc, pc->root, &entry->base);
+    pc->rows++;
+}
+
+uint64_t pandalog_columns_close(PlColumns *pc) {
+    char *path = g_strdup_printf("%s/columns.txt", pc->dir);
+    FILE *schema = fopen(path, "w");
+    if (schema == NULL) perror(path);
+    g_free(path);
+    unsigned i;
+    for (i = 0; i < pc->all->len; i++) {
+        PlColumn *col = (PlColumn *) g_ptr_array_index(pc->all, i);
+        column_pad(col, pc->rows);
+        npy_header(col->values, col->descr, col->rows);
+        fclose(col->values);
+        if (col->valid) {
+            npy_header(col->valid, "|b1", col->rows);
+            fclose(col->valid);
+        }
+        if (col->dict) {
+            g_hash_table_destroy(col->dict);
+            fclose(col->dict_file);
+        }
+        if (schema) {
+            fprintf(schema, "%s %s%s%s\n", col->name, col->descr,
+                    col->valid ? " valid" : "", col->dict ? " dict" : "");
+        }
+        g_free(col->name);
+        g_free(col);
+    }
+    if (schema) fclose(schema);
+    uint64_t rows = pc->rows;
+    g_ptr_array_free(pc->all, TRUE);
+    column_set_free(pc->root);
+    g_free(pc->dir);
+    g_free(pc);
+    return rows;
+}
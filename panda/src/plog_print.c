@@ -1,9 +1,11 @@
 #define __STDC_FORMAT_MACROS
 
+#include <assert.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "../include/panda/plog.h"
 #include "../include/panda/plog_print.h"
@@ -129,7 +131,59 @@ void pprint_taint_query_unique_label_set(Panda__TaintQueryUniqueLabelSet *tquls)
     printf (")");
 }
 
+// the taint_label_set entries seen so far, indexed by id
+typedef struct {
+    size_t n_label;
+    uint32_t *label;
+} PprintLabelSet;
+
+static PprintLabelSet *label_sets = NULL;
+static uint32_t num_label_sets = 0;
+
+void pprint_add_label_set(Panda__TaintLabelSet *tls) {
+    if (tls->id >= num_label_sets) {
+        uint32_t n = num_label_sets ? num_label_sets : 1024;
+        while (n <= tls->id) n *= 2;
+        label_sets = (PprintLabelSet *) realloc(label_sets, sizeof(PprintLabelSet) * n);
+        assert (label_sets != NULL);
+        memset(label_sets + num_label_sets, 0,
+               sizeof(PprintLabelSet) * (n - num_label_sets));
+        num_label_sets = n;
+    }
+    PprintLabelSet *ls = &label_sets[tls->id];
+    free(ls->label);
+    ls->n_label = tls->n_label;
+    ls->label = (uint32_t *) malloc(sizeof(uint32_t) * (tls->n_label + 1));
+    assert (ls->label != NULL);
+    memcpy(ls->label, tls->label, sizeof(uint32_t) * tls->n_label);
+}
+
+void pprint_taint_label_set(Panda__TaintLabelSet *tls) {
+    printf("(taint_label_set,%u,", tls->id);
+    size_t i;
+    for (i=0; i<tls->n_label; i++) {
+        printf ("%d,", tls->label[i]);
+    }
+    printf (")");
+}
+
 void pprint_taint_query(Panda__TaintQuery *tq) {
+    if (tq->has_label_set) {
+        printf ("(taint_query,%u,%d,%d,", tq->label_set, tq->tcn, tq->offset);
+        PprintLabelSet *ls = (tq->label_set < num_label_sets) ? &label_sets[tq->label_set] : NULL;
+        if (ls && ls->label) {
+            printf("(label_set,%u,", tq->label_set);
+            size_t i;
+            for (i=0; i<ls->n_label; i++) {
+                printf ("%d,", ls->label[i]);
+            }
+            printf (")");
+        }
+        else
+            printf ("None");
+        printf (")");
+        return;
+    }
     printf ("(taint_query,0x%" PRIx64 ",%d,%d,",
             tq->ptr, tq->tcn, tq->offset);
     if (tq->unique_label_set) {
@@ -319,6 +373,10 @@ void pprint_ple(Panda__LogEntry *ple) {
         pprint_taint_query_pri(ple->taint_query_pri);
     }
 
+    if (ple->taint_label_set) {
+        pprint_taint_label_set(ple->taint_label_set);
+    }
+
     /*if (ple->tainted_instr) {*/
         /*pprint_tainted_instr(ple->tainted_instr);*/
     /*}*/
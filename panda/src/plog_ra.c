@@ -0,0 +1,407 @@
+/*
+  Random-access pandalog reader; see panda/include/panda/plog_ra.h.
+
+  The file is mapped read-only, so the directory is read in place and the
+  compressed chunks are handed to zlib straight from the mapping.  A chunk
+  is decompressed the first time an iterator reaches it, and indexed in
+  the same pass: the offset of every entry and its instr, which lets seeks
+  within a chunk skip protobuf unpacking altogether.
+*/
+
+#include <assert.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "../include/panda/plog.h"
+#include "../include/panda/plog_ra.h"
+
+// one directory record, as write_dir lays them out
+#define PL_DIR_RECORD_SIZE (3 * sizeof(uint64_t))
+
+typedef struct {
+    uint32_t chunk;             // chunk held, or num_chunks if slot is empty
+    uint64_t last_used;
+    const unsigned char *data;  // uncompressed chunk: buf, or the mapping
+    unsigned char *buf;
+    unsigned long buf_size;
+    uint32_t *off;              // off[i] is where entry i's length prefix is
+    uint64_t *instr;            // instr[i] is entry i's instr
+    uint32_t num_entries;
+    uint32_t max_entries;
+} PlCachedChunk;
+
+struct PandalogReader {
+    int fd;
+    const unsigned char *map;
+    size_t map_len;
+    PlCodec codec;
+    uint32_t chunk_size;
+    uint64_t dir_pos;
+    uint32_t num_chunks;
+    const unsigned char *dir;   // num_chunks records, in the mapping
+    const unsigned char **types;    // each chunk's type index record, or NULL
+    PlCachedChunk *cache;
+    uint32_t cache_chunks;
+    uint64_t tick;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+static uint64_t dir_field(PandalogReader *r, uint32_t c, int field) {
+    uint64_t v;
+    memcpy(&v, r->dir + c * PL_DIR_RECORD_SIZE + field * sizeof(uint64_t), sizeof(v));
+    return v;
+}
+
+static uint64_t dir_instr(PandalogReader *r, uint32_t c) { return dir_field(r, c, 0); }
+static uint64_t dir_pos(PandalogReader *r, uint32_t c) { return dir_field(r, c, 1); }
+
+uint64_t pandalog_reader_chunk_entries(PandalogReader *r, uint32_t c) {
+    assert (c < r->num_chunks);
+    return dir_field(r, c, 2);
+}
+
+uint32_t pandalog_reader_num_chunks(PandalogReader *r) {
+    return r->num_chunks;
+}
+
+void pandalog_reader_cache_stats(PandalogReader *r, uint64_t *hits, uint64_t *misses) {
+    *hits = r->hits;
+    *misses = r->misses;
+}
+
+// find each chunk's record in the type index.  without it every chunk has
+// to be looked at.
+static void read_types(PandalogReader *r, const char *path, uint64_t pos) {
+    const unsigned char **types = (const unsigned char **)
+        malloc(sizeof(*types) * (r->num_chunks ? r->num_chunks : 1));
+    uint32_t c;
+    for (c = 0; c < r->num_chunks; c++) {
+        uint32_t n;
+        if (pos + sizeof(n) > r->map_len) break;
+        memcpy(&n, r->map + pos, sizeof(n));
+        if (n > (r->map_len - pos - sizeof(n)) / sizeof(uint32_t)) break;
+        types[c] = r->map + pos;
+        pos += sizeof(n) + (uint64_t) n * sizeof(uint32_t);
+    }
+    if (c < r->num_chunks) {
+        fprintf(stderr, "%s: type index is truncated, not using it\n", path);
+        free(types);
+        return;
+    }
+    r->types = types;
+}
+
+PandalogReader *pandalog_reader_open(const char *path, uint32_t cache_chunks) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < PL_HEADER_SIZE) {
+        fprintf(stderr, "%s: too short to be a pandalog\n", path);
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        perror(path);
+        close(fd);
+        return NULL;
+    }
+    PandalogReader *r = (PandalogReader *) calloc(1, sizeof(PandalogReader));
+    r->fd = fd;
+    r->map = (const unsigned char *) map;
+    r->map_len = st.st_size;
+    PlHeader plh;
+    memcpy(&plh, r->map, sizeof(plh));
+    // codec was added in version 3; everything before is zlib
+    r->codec = (plh.version >= 3) ? (PlCodec) plh.codec : PL_CODEC_ZLIB;
+    r->chunk_size = plh.chunk_size;
+    r->dir_pos = plh.dir_pos;
+    if (r->dir_pos < PL_HEADER_SIZE || r->dir_pos + sizeof(uint32_t) > r->map_len) {
+        fprintf(stderr, "%s: bad directory position %" PRIx64 "\n", path, r->dir_pos);
+        pandalog_reader_close(r);
+        return NULL;
+    }
+    memcpy(&r->num_chunks, r->map + r->dir_pos, sizeof(uint32_t));
+    r->dir = r->map + r->dir_pos + sizeof(uint32_t);
+    if (r->dir + (uint64_t) r->num_chunks * PL_DIR_RECORD_SIZE > r->map + r->map_len) {
+        fprintf(stderr, "%s: directory runs off the end of the file\n", path);
+        pandalog_reader_close(r);
+        return NULL;
+    }
+    if (plh.version >= 4 && plh.types_pos != 0) {
+        read_types(r, path, plh.types_pos);
+    }
+    r->cache_chunks = cache_chunks ? cache_chunks : PL_RA_DEFAULT_CACHE_CHUNKS;
+    r->cache = (PlCachedChunk *) calloc(r->cache_chunks, sizeof(PlCachedChunk));
+    uint32_t i;
+    for (i = 0; i < r->cache_chunks; i++) {
+        r->cache[i].chunk = r->num_chunks;
+    }
+    return r;
+}
+
+void pandalog_reader_close(PandalogReader *r) {
+    uint32_t i;
+    if (r->cache) {
+        for (i = 0; i < r->cache_chunks; i++) {
+            free(r->cache[i].buf);
+            free(r->cache[i].off);
+            free(r->cache[i].instr);
+        }
+        free(r->cache);
+    }
+    free(r->types);
+    munmap((void *) r->map, r->map_len);
+    close(r->fd);
+    free(r);
+}
+
+// instr is field 2 of LogEntry, right after pc; protobuf-c packs fields in
+// order, so this only ever looks at the first couple of fields
+static uint64_t raw_entry_instr(const unsigned char *p, const unsigned char *end) {
+    uint32_t id;
+    uint64_t val;
+    while ((p = pandalog_raw_field(p, end, &id, &val)) != NULL) {
+        if (id == 2) return val;
+    }
+    return (uint64_t) -1;
+}
+
+static int type_wanted(const PandalogIter *it, uint32_t id) {
+    uint32_t i;
+    for (i = 0; i < it->num_types; i++) {
+        if (it->types[i] == id) return 1;
+    }
+    return 0;
+}
+
+// whether chunk c may have entries of the iterator's types
+static int chunk_wanted(const PandalogIter *it, uint32_t c) {
+    PandalogReader *r = it->reader;
+    uint32_t n, i;
+    if (it->num_types == 0 || r->types == NULL) return 1;
+    memcpy(&n, r->types[c], sizeof(n));
+    for (i = 0; i < n; i++) {
+        uint32_t id;
+        memcpy(&id, r->types[c] + sizeof(n) + i * sizeof(id), sizeof(id));
+        if (type_wanted(it, id)) return 1;
+    }
+    return 0;
+}
+
+// whether the entry at p sets one of the iterator's fields
+static int entry_wanted(const PandalogIter *it, const unsigned char *p, uint32_t len) {
+    const unsigned char *end = p + len;
+    uint32_t id;
+    uint64_t val;
+    if (it->num_types == 0) return 1;
+    while ((p = pandalog_raw_field(p, end, &id, &val)) != NULL) {
+        if (type_wanted(it, id)) return 1;
+    }
+    return 0;
+}
+
+uint32_t pandalog_entry_type(const char *name) {
+    const ProtobufCFieldDescriptor *f =
+        protobuf_c_message_descriptor_get_field_by_name(&panda__log_entry__descriptor, name);
+    return f ? f->id : 0;
+}
+
+static void decompress_chunk(PandalogReader *r, PlCachedChunk *cc, uint32_t c) {
+    const unsigned char *z = r->map + dir_pos(r, c);
+    uint64_t end = (c + 1 < r->num_chunks) ? dir_pos(r, c + 1) : r->dir_pos;
+    assert (z + (end - dir_pos(r, c)) <= r->map + r->map_len);
+    unsigned long zlen = end - dir_pos(r, c);
+    unsigned long len;
+    if (r->codec == PL_CODEC_NONE) {
+        // nothing to do but index it where it is
+        len = zlen;
+        cc->data = z;
+    }
+    else {
+        if (cc->buf_size < r->chunk_size) {
+            cc->buf_size = r->chunk_size;
+            cc->buf = (unsigned char *) realloc(cc->buf, cc->buf_size);
+            assert (cc->buf != NULL);
+        }
+        int ret;
+        for (;;) {
+            len = cc->buf_size;
+            ret = uncompress(cc->buf, &len, z, zlen);
+            if (ret != Z_BUF_ERROR) break;
+            // chunk grew past chunk_size while it was being written
+            assert (cc->buf_size < UINT32_MAX / 2);
+            cc->buf_size *= 2;
+            cc->buf = (unsigned char *) realloc(cc->buf, cc->buf_size);
+            assert (cc->buf != NULL);
+        }
+        assert (ret == Z_OK);
+        cc->data = cc->buf;
+    }
+    // index the entries
+    uint64_t n = pandalog_reader_chunk_entries(r, c);
+    if (cc->max_entries < n) {
+        cc->max_entries = n;
+        cc->off = (uint32_t *) realloc(cc->off, sizeof(uint32_t) * n);
+        cc->instr = (uint64_t *) realloc(cc->instr, sizeof(uint64_t) * n);
+        assert (cc->off != NULL && cc->instr != NULL);
+    }
+    uint32_t i;
+    unsigned long p = 0;
+    for (i = 0; i < n && p + sizeof(uint32_t) <= len; i++) {
+        uint32_t elen;
+        memcpy(&elen, cc->data + p, sizeof(elen));
+        assert (p + sizeof(uint32_t) + elen <= len);
+        cc->off[i] = p;
+        cc->instr[i] = raw_entry_instr(cc->data + p + sizeof(uint32_t),
+                                       cc->data + p + sizeof(uint32_t) + elen);
+        p += sizeof(uint32_t) + elen;
+    }
+    cc->num_entries = i;
+    cc->chunk = c;
+}
+
+// chunk c, from the cache or freshly decompressed into the least recently
+// used slot
+static PlCachedChunk *get_chunk(PandalogReader *r, uint32_t c) {
+    PlCachedChunk *victim = &r->cache[0];
+    uint32_t i;
+    r->tick ++;
+    for (i = 0; i < r->cache_chunks; i++) {
+        PlCachedChunk *cc = &r->cache[i];
+        if (cc->chunk == c) {
+            cc->last_used = r->tick;
+            r->hits ++;
+            return cc;
+        }
+        if (cc->last_used < victim->last_used) victim = cc;
+    }
+    r->misses ++;
+    decompress_chunk(r, victim, c);
+    victim->last_used = r->tick;
+    return victim;
+}
+
+void pandalog_iter_begin(PandalogReader *r, PandalogIter *it) {
+    it->reader = r;
+    it->chunk = 0;
+    it->index = 0;
+    it->end_instr = (uint64_t) -1;
+    it->types = NULL;
+    it->num_types = 0;
+    it->all_instrs = 1;
+}
+
+void pandalog_iter_seek(PandalogReader *r, PandalogIter *it, uint64_t instr) {
+    it->reader = r;
+    it->index = 0;
+    it->end_instr = (uint64_t) -1;
+    it->types = NULL;
+    it->num_types = 0;
+    it->all_instrs = 1;
+    if (r->num_chunks == 0) {
+        it->chunk = 0;
+        return;
+    }
+    // last chunk starting before instr.  one starting at instr may be a
+    // continuation chunk, with the first of instr's entries at the end of
+    // the chunk before it; if they aren't there, the scan below runs off
+    // the end of the chunk and iteration carries on into the next one.
+    uint32_t lo = 0, hi = r->num_chunks - 1;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo + 1) / 2;
+        if (dir_instr(r, mid) < instr) lo = mid;
+        else hi = mid - 1;
+    }
+    it->chunk = lo;
+    // entries from before the main loop (instr -1) can come ahead of the
+    // rest, so this is a scan rather than a binary search; it's over the
+    // index, not the entries
+    PlCachedChunk *cc = get_chunk(r, it->chunk);
+    uint8_t in_main_loop = 0;
+    while (it->index < cc->num_entries) {
+        uint64_t ei = cc->instr[it->index];
+        if (ei != (uint64_t) -1) in_main_loop = 1;
+        else if (in_main_loop) break;
+        if (in_main_loop && ei >= instr) break;
+        it->index ++;
+    }
+}
+
+void pandalog_iter_window(PandalogReader *r, PandalogIter *it,
+                          uint64_t start_instr, uint64_t end_instr,
+                          const uint32_t *types, uint32_t num_types) {
+    pandalog_iter_seek(r, it, start_instr);
+    it->end_instr = end_instr;
+    it->types = types;
+    it->num_types = num_types;
+    it->all_instrs = 0;
+}
+
+void pandalog_iter_types(PandalogReader *r, PandalogIter *it,
+                         const uint32_t *types, uint32_t num_types) {
+    pandalog_iter_begin(r, it);
+    it->types = types;
+    it->num_types = num_types;
+}
+
+int pandalog_iter_next(PandalogIter *it, PandalogRawEntry *e) {
+    PandalogReader *r = it->reader;
+    int windowed = (it->end_instr != (uint64_t) -1 || it->num_types != 0);
+    while (it->chunk < r->num_chunks) {
+        // a chunk at or past the end of the window, or without any entries
+        // of the types asked for, is never decompressed.  the chunk a seek
+        // lands in already is, and is kept.
+        if (it->index == 0) {
+            if (it->end_instr != (uint64_t) -1
+                && dir_instr(r, it->chunk) >= it->end_instr) {
+                it->chunk = r->num_chunks;
+                break;
+            }
+            if (!chunk_wanted(it, it->chunk)) {
+                it->chunk ++;
+                continue;
+            }
+        }
+        PlCachedChunk *cc = get_chunk(r, it->chunk);
+        while (it->index < cc->num_entries) {
+            uint32_t off = cc->off[it->index];
+            uint64_t ei = cc->instr[it->index];
+            memcpy(&e->len, cc->data + off, sizeof(e->len));
+            e->data = cc->data + off + sizeof(uint32_t);
+            e->instr = ei;
+            e->chunk = it->chunk;
+            e->index = it->index;
+            it->index ++;
+            if (!windowed) return 1;
+            // entries from outside the main loop belong to no window
+            if (ei == (uint64_t) -1) {
+                if (it->all_instrs && entry_wanted(it, e->data, e->len)) return 1;
+                continue;
+            }
+            if (ei >= it->end_instr) {
+                it->chunk = r->num_chunks;
+                return 0;
+            }
+            if (entry_wanted(it, e->data, e->len)) return 1;
+        }
+        it->chunk ++;
+        it->index = 0;
+    }
+    return 0;
+}
+
+Panda__LogEntry *pandalog_raw_entry_unpack(const PandalogRawEntry *e) {
+    return panda__log_entry__unpack(NULL, e->len, e->data);
+}
@@ -18,35 +18,84 @@ extern "C" {
     #include <stdio.h>
     #include <stdlib.h>
     #include <stdint.h>
+    #include <string.h>
     //#include "../include/panda/plog.h"
     //#include "../include/panda/plog_print.h"
     #include "panda/plog.h"
     #include "panda/plog_print.h"
+    #include "panda/plog_ra.h"
+    #include "panda/plog_columns.h"
 }
 //#include <map>
 //#include <string>
 
 int main (int argc, char **argv) {
-    if (argc < 2) {
-         printf("USAGE: %s <plog>\n", argv[0]);
+    // -c <dir> converts to a column store instead of printing
+    PlColumns *columns = NULL;
+    // -t <field>[,<field>...] keeps only entries that set one of the fields
+    uint32_t types[64];
+    uint32_t num_types = 0;
+    while (argc > 2 && argv[1][0] == '-') {
+        if (0 == strcmp(argv[1], "-c") && !columns) {
+            columns = pandalog_columns_open(argv[2]);
+            if (!columns) exit(1);
+        }
+        else if (0 == strcmp(argv[1], "-t")) {
+            char *names = strdup(argv[2]);
+            for (char *name = strtok(names, ","); name; name = strtok(NULL, ",")) {
+                uint32_t id = pandalog_entry_type(name);
+                if (id == 0) {
+                    fprintf(stderr, "%s: no field %s in LogEntry\n", argv[0], name);
+                    exit(1);
+                }
+                if (num_types == sizeof(types) / sizeof(types[0])) {
+                    fprintf(stderr, "%s: too many fields for -t\n", argv[0]);
+                    exit(1);
+                }
+                types[num_types++] = id;
+            }
+            free(names);
+        }
+        else break;
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc < 2 || argc > 4) {
+         printf("USAGE: %s [-c <column dir>] [-t <field>[,<field>...]] <plog> [<start instr> [<end instr>]]\n", argv[0]);
          exit(1);
     }
-    pandalog_open((const char *) argv[1], (const char*) "r");
-    Panda__LogEntry *ple;
-    while (1) {
-        ple = pandalog_read_entry();
-        if (ple == (Panda__LogEntry *)1) {
-            continue;
+    PandalogReader *r = pandalog_reader_open(argv[1], 0);
+    if (!r) exit(1);
+    // print entries for start <= instr < end, or all of them
+    uint64_t start = (argc > 2) ? strtoull(argv[2], NULL, 0) : 0;
+    uint64_t end = (argc > 3) ? strtoull(argv[3], NULL, 0) : UINT64_MAX;
+    PandalogIter it;
+    if (!columns) {
+        // taint queries name their label sets by id, and taint2 writes each
+        // set's labels once, after the query, so load those first
+        uint32_t ls_type = pandalog_entry_type("taint_label_set");
+        if (ls_type) {
+            pandalog_iter_types(r, &it, &ls_type, 1);
+            PandalogRawEntry e;
+            while (pandalog_iter_next(&it, &e)) {
+                Panda__LogEntry *ple = pandalog_raw_entry_unpack(&e);
+                pprint_add_label_set(ple->taint_label_set);
+                panda__log_entry__free_unpacked(ple, NULL);
+            }
         }
-        if (ple == NULL) {
-	    break;
-        }
-        pprint_ple(ple);
-#warning Figure out how to properly free ple
-        // for some reason this leads to some sort of double-free
-        // but i'm leaving in here to investigate further
-        // so we don't have leaky plog_readers
-        //panda__log_entry__free_unpacked(ple, NULL);
     }
-    pandalog_close();
+    // entries from outside the main loop only go with the whole log
+    if (argc > 2 || num_types) pandalog_iter_window(r, &it, start, end, types, num_types);
+    else pandalog_iter_begin(r, &it);
+    PandalogRawEntry e;
+    while (pandalog_iter_next(&it, &e)) {
+        Panda__LogEntry *ple = pandalog_raw_entry_unpack(&e);
+        if (columns) pandalog_columns_add(columns, ple);
+        else pprint_ple(ple);
+        panda__log_entry__free_unpacked(ple, NULL);
+    }
+    pandalog_reader_close(r);
+    if (columns) {
+        printf("%" PRIu64 " rows\n", pandalog_columns_close(columns));
+    }
 }
@@ -0,0 +1,362 @@
+/*
+ * Cut a piece out of a checkpointed recording without replaying it
+ *
+ *   rr_cut <name> <new-name> <start-instr> [<end-instr>]
+ *
+ * The new recording starts at the last checkpoint at or before
+ * <start-instr>: its snapshot (and RAM image, if any) is copied, and the
+ * nondet log entries from the checkpoint's offset up to <end-instr> are
+ * copied with their instruction counts made relative to the checkpoint.
+ * Nothing is replayed, so a cut costs about as much as copying its part of
+ * the log.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#define RR_LOG_STANDALONE
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "cpu.h"
+#include "panda/rr/rr_log.h"
+#include "panda/rr/rr_zlog.h"
+
+#define COPY_CHUNK (1 << 20)
+
+// referenced by the rr headers, as in rr_print
+volatile RR_mode rr_mode = RR_REPLAY;
+volatile sig_atomic_t rr_record_in_progress = 0;
+volatile sig_atomic_t rr_record_in_main_loop_wait = 0;
+volatile sig_atomic_t rr_skipped_callsite_location = 0;
+RR_log *rr_nondet_log = NULL;
+RR_debug_level_type rr_debug_level = RR_DEBUG_WHISPER;
+
+static FILE *in_fp;
+static RR_zlog *in_zlog;
+static FILE *out_fp;
+static uint64_t base_count;
+
+static void die(const char *msg)
+{
+    fprintf(stderr, "rr_cut: %s\n", msg);
+    exit(1);
+}
+
+static void in_read(void *buf, size_t len)
+{
+    size_t n;
+
+    if (in_zlog) {
+        n = rr_zlog_read(in_zlog, buf, len);
+    } else {
+        n = fread(buf, 1, len, in_fp);
+    }
+    if (n != len) {
+        die("nondet log is truncated");
+    }
+}
+
+static void out_write(const void *buf, size_t len)
+{
+    if (fwrite(buf, 1, len, out_fp) != len) {
+        die("cannot write the new nondet log");
+    }
+}
+
+// copy len bytes of payload from the old log to the new one
+static void copy_bytes(uint64_t len)
+{
+    static uint8_t buf[COPY_CHUNK];
+
+    while (len > 0) {
+        size_t n = MIN(len, sizeof(buf));
+        in_read(buf, n);
+        out_write(buf, n);
+        len -= n;
+    }
+}
+
+#define COPY_ITEM(field) do {               \
+        in_read(&(field), sizeof(field));   \
+        out_write(&(field), sizeof(field)); \
+    } while (0)
+
+// Copy the entry whose header has been read.  Returns false for RR_LAST.
+static bool copy_entry(RR_log_entry *item)
+{
+    RR_prog_point pp = item->header.prog_point;
+
+    pp.guest_instr_count -= base_count;
+    out_write(&pp, sizeof(pp));
+    out_write(&item->header.kind, sizeof(item->header.kind));
+    out_write(&item->header.callsite_loc, sizeof(item->header.callsite_loc));
+
+    switch (item->header.kind) {
+        case RR_INPUT_1:
+            COPY_ITEM(item->variant.input_1);
+            break;
+        case RR_INPUT_2:
+            COPY_ITEM(item->variant.input_2);
+            break;
+        case RR_INPUT_4:
+            COPY_ITEM(item->variant.input_4);
+            break;
+        case RR_INPUT_8:
+            COPY_ITEM(item->variant.input_8);
+            break;
+        case RR_INTERRUPT_REQUEST:
+            COPY_ITEM(item->variant.interrupt_request);
+            break;
+        case RR_EXIT_REQUEST:
+            COPY_ITEM(item->variant.exit_request);
+            break;
+        case RR_SKIPPED_CALL: {
+            RR_skipped_call_args *args = &item->variant.call_args;
+            COPY_ITEM(args->kind);
+            switch (args->kind) {
+                case RR_CALL_CPU_MEM_RW:
+                    COPY_ITEM(args->variant.cpu_mem_rw_args);
+                    copy_bytes(args->variant.cpu_mem_rw_args.len);
+                    break;
+                case RR_CALL_CPU_MEM_UNMAP:
+                    COPY_ITEM(args->variant.cpu_mem_unmap);
+                    copy_bytes(args->variant.cpu_mem_unmap.len);
+                    break;
+                case RR_CALL_MEM_REGION_CHANGE:
+                    COPY_ITEM(args->variant.mem_region_change_args);
+                    copy_bytes(args->variant.mem_region_change_args.len);
+                    break;
+                case RR_CALL_HD_TRANSFER:
+                    COPY_ITEM(args->variant.hd_transfer_args);
+                    break;
+                case RR_CALL_NET_TRANSFER:
+                    COPY_ITEM(args->variant.net_transfer_args);
+                    break;
+                case RR_CALL_HANDLE_PACKET:
+                    COPY_ITEM(args->variant.handle_packet_args);
+                    copy_bytes(args->variant.handle_packet_args.size);
+                    break;
+                case RR_CALL_CPU_MEM_RW_ZERO:
+                case RR_CALL_CPU_MEM_RW_REF:
+                    // a checkpoint resets the dedup dictionary, so references
+                    // never point before the start of the cut
+                    COPY_ITEM(args->variant.cpu_mem_rw_args);
+                    break;
+                case RR_CALL_CPU_MEM_UNMAP_ZERO:
+                case RR_CALL_CPU_MEM_UNMAP_REF:
+                    COPY_ITEM(args->variant.cpu_mem_unmap);
+                    break;
+                case RR_CALL_DEDUP_RESET:
+                    break;
+                case RR_CALL_CHECKSUM:
+                    // the cut starts at a checkpoint, as does the interval of
+                    // its first checksum
+                    COPY_ITEM(args->variant.checksum_args);
+                    break;
+                case RR_CALL_CPU_SWITCH:
+                    COPY_ITEM(args->variant.cpu_switch_args);
+                    break;
+                default:
+                    die("unknown skipped call kind in nondet log");
+            }
+        } break;
+        case RR_LAST:
+            return false;
+        case RR_DEBUG:
+            break;
+        default:
+            die("unknown entry kind in nondet log");
+    }
+    return true;
+}
+
+// Replay of the cut starts on the first vCPU, so switch to the one that ran
+// from the checkpoint on, as the recording did.
+static void write_cpu_switch(uint32_t cpu_index)
+{
+    RR_log_entry item;
+    RR_skipped_call_args *args = &item.variant.call_args;
+
+    memset(&item, 0, sizeof(item));
+    item.header.kind = RR_SKIPPED_CALL;
+    item.header.callsite_loc = RR_CALLSITE_MAIN_LOOP_WAIT;
+    args->kind = RR_CALL_CPU_SWITCH;
+    args->variant.cpu_switch_args.cpu_index = cpu_index;
+    out_write(&item.header.prog_point, sizeof(item.header.prog_point));
+    out_write(&item.header.kind, sizeof(item.header.kind));
+    out_write(&item.header.callsite_loc, sizeof(item.header.callsite_loc));
+    out_write(&args->kind, sizeof(args->kind));
+    out_write(&args->variant.cpu_switch_args,
+              sizeof(args->variant.cpu_switch_args));
+}
+
+// Copy a file, leaving holes for zero chunks as the RAM images have them.
+// Returns false if src does not exist.
+static bool copy_file(const char *src, const char *dst)
+{
+    static uint8_t buf[COPY_CHUNK];
+    FILE *from, *to;
+    size_t n;
+    off_t size = 0;
+
+    from = fopen(src, "rb");
+    if (!from) {
+        return false;
+    }
+    to = fopen(dst, "wb");
+    if (!to) {
+        die("cannot create the new snapshot");
+    }
+    while ((n = fread(buf, 1, sizeof(buf), from)) > 0) {
+        if (buffer_is_zero(buf, n)) {
+            if (fseeko(to, n, SEEK_CUR) != 0) {
+                die("cannot write the new snapshot");
+            }
+        } else if (fwrite(buf, 1, n, to) != n) {
+            die("cannot write the new snapshot");
+        }
+        size += n;
+    }
+    fflush(to);
+    if (ferror(from) || ftruncate(fileno(to), size) != 0) {
+        die("cannot copy the snapshot");
+    }
+    fclose(from);
+    fclose(to);
+    return true;
+}
+
+// the last checkpoint at or before instr in <name>-rr-nondet.idx
+static RR_checkpoint find_checkpoint(const char *name, uint64_t instr)
+{
+    char *idx_name = g_strdup_printf("%s-rr-nondet.idx", name);
+    FILE *idx = fopen(idx_name, "rb");
+    RR_checkpoint ckpt, found = {0};
+
+    if (!idx) {
+        die("the recording has no checkpoint index; record it with "
+            "-record-checkpoint-interval");
+    }
+    while (fread(&ckpt, sizeof(ckpt), 1, idx) == 1 &&
+           ckpt.guest_instr_count <= instr) {
+        found = ckpt;
+    }
+    fclose(idx);
+    g_free(idx_name);
+    return found;
+}
+
+int main(int argc, char **argv)
+{
+    RR_prog_point header, last;
+    RR_checkpoint ckpt;
+    RR_log_entry item;
+    uint64_t start, end;
+    char *name, *new_name, *src, *dst, *ram_src, *ram_dst;
+
+    if (argc != 4 && argc != 5) {
+        fprintf(stderr, "usage: %s <name> <new-name> <start-instr> "
+                "[<end-instr>]\n", argv[0]);
+        return 1;
+    }
+    name = argv[1];
+    new_name = argv[2];
+    start = strtoull(argv[3], NULL, 0);
+    end = argc > 4 ? strtoull(argv[4], NULL, 0) : UINT64_MAX;
+    if (end <= start) {
+        die("the end of the cut must come after its start");
+    }
+
+    ckpt = find_checkpoint(name, start);
+    base_count = ckpt.guest_instr_count;
+    printf("cutting from checkpoint %u at instr %" PRIu64 "\n", ckpt.id,
+           base_count);
+
+    // the snapshot of the checkpoint becomes the snapshot of the cut
+    src = ckpt.id == 0 ? g_strdup_printf("%s-rr-snp", name)
+                       : g_strdup_printf("%s-rr-snp-%u", name, ckpt.id);
+    dst = g_strdup_printf("%s-rr-snp", new_name);
+    if (!copy_file(src, dst)) {
+        die("cannot open the snapshot of the checkpoint");
+    }
+    ram_src = g_strdup_printf("%s.ram", src);
+    ram_dst = g_strdup_printf("%s.ram", dst);
+    copy_file(ram_src, ram_dst);
+
+    g_free(src);
+    src = g_strdup_printf("%s-rr-nondet.log", name);
+    in_fp = fopen(src, "rb");
+    if (!in_fp) {
+        die("cannot open the nondet log");
+    }
+    in_read(&header, sizeof(header));
+    if (rr_zlog_is_compressed_header(header.pc)) {
+        // no random access into a compressed log; inflate up to the offset
+        in_zlog = rr_zlog_open_read(in_fp);
+        if (rr_zlog_skip(in_zlog, ckpt.log_offset - sizeof(header)) !=
+            ckpt.log_offset - sizeof(header)) {
+            die("nondet log is truncated");
+        }
+    } else if (fseeko(in_fp, ckpt.log_offset, SEEK_SET) != 0) {
+        die("nondet log is truncated");
+    }
+
+    g_free(dst);
+    dst = g_strdup_printf("%s-rr-nondet.log", new_name);
+    out_fp = fopen(dst, "wb");
+    if (!out_fp) {
+        die("cannot create the new nondet log");
+    }
+    // fixed up at the end
+    memset(&last, 0, sizeof(last));
+    out_write(&last, sizeof(last));
+    if (ckpt.cpu_index != 0) {
+        write_cpu_switch(ckpt.cpu_index);
+    }
+
+    for (;;) {
+        memset(&item, 0, sizeof(item));
+        in_read(&item.header.prog_point, sizeof(item.header.prog_point));
+        in_read(&item.header.kind, sizeof(item.header.kind));
+        in_read(&item.header.callsite_loc, sizeof(item.header.callsite_loc));
+        if (item.header.prog_point.guest_instr_count > end) {
+            // replay of the cut stops once it has executed up to end
+            item.header.kind = RR_LAST;
+            item.header.callsite_loc = RR_CALLSITE_LAST;
+            item.header.prog_point.guest_instr_count = end;
+            item.header.prog_point.pc = 0;
+            item.header.prog_point.secondary = 0;
+            copy_entry(&item);
+            break;
+        }
+        if (!copy_entry(&item)) {
+            break;
+        }
+    }
+    last = item.header.prog_point;
+    last.guest_instr_count -= base_count;
+    if (fseeko(out_fp, 0, SEEK_SET) != 0) {
+        die("cannot write the new nondet log");
+    }
+    out_write(&last, sizeof(last));
+    if (fclose(out_fp) != 0) {
+        die("cannot write the new nondet log");
+    }
+    printf("wrote %s-rr-snp and %s with %" PRIu64 " instructions\n",
+           new_name, dst, last.guest_instr_count);
+
+    if (in_zlog) {
+        rr_zlog_close(in_zlog);
+    }
+    fclose(in_fp);
+    g_free(src);
+    g_free(dst);
+    g_free(ram_src);
+    g_free(ram_dst);
+    return 0;
+}
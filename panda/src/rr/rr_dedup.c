@@ -0,0 +1,150 @@
+/*
+ * Payload deduplication dictionary for record/replay nondet logs
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+
+#include <zlib.h>
+
+#include "panda/rr/rr_dedup.h"
+
+typedef struct {
+    const uint8_t *data;
+    uint32_t len;
+    uint32_t hash;
+    uint64_t seq;
+} RR_dedup_slot;
+
+struct RR_dedup {
+    bool copy_payloads;
+    RR_dedup_slot slots[RR_DEDUP_MAX_SLOTS];
+    uint64_t oldest; // sequence number of the oldest payload still held
+    uint64_t next;   // sequence number the next insertion gets
+    uint64_t bytes;  // total length of the held payloads
+    GHashTable *index; // RR_dedup_slot* -> itself, by content; record only
+};
+
+static guint rr_dedup_slot_hash(gconstpointer key)
+{
+    return ((const RR_dedup_slot *)key)->hash;
+}
+
+static gboolean rr_dedup_slot_equal(gconstpointer a, gconstpointer b)
+{
+    const RR_dedup_slot *sa = a, *sb = b;
+    return sa->len == sb->len && sa->hash == sb->hash &&
+        memcmp(sa->data, sb->data, sa->len) == 0;
+}
+
+static inline uint32_t rr_dedup_hash(const uint8_t *buf, uint32_t len)
+{
+    return crc32(crc32(0, Z_NULL, 0), buf, len);
+}
+
+static inline RR_dedup_slot *rr_dedup_slot(RR_dedup *dd, uint64_t seq)
+{
+    return &dd->slots[seq % RR_DEDUP_MAX_SLOTS];
+}
+
+static void rr_dedup_evict_oldest(RR_dedup *dd)
+{
+    RR_dedup_slot *slot = rr_dedup_slot(dd, dd->oldest);
+
+    if (dd->index) {
+        g_hash_table_remove(dd->index, slot);
+    }
+    if (dd->copy_payloads) {
+        g_free((uint8_t *)slot->data);
+    }
+    dd->bytes -= slot->len;
+    slot->data = NULL;
+    slot->len = 0;
+    dd->oldest++;
+}
+
+// the record and replay sides must evict in exactly the same order, so this
+// depends only on the sequence of lengths inserted
+static void rr_dedup_insert_hashed(RR_dedup *dd, const uint8_t *buf,
+                                   uint32_t len, uint32_t hash)
+{
+    RR_dedup_slot *slot;
+
+    while (dd->next - dd->oldest == RR_DEDUP_MAX_SLOTS ||
+           (dd->next > dd->oldest && dd->bytes + len > RR_DEDUP_MAX_BYTES)) {
+        rr_dedup_evict_oldest(dd);
+    }
+    slot = rr_dedup_slot(dd, dd->next);
+    slot->data = dd->copy_payloads ? g_memdup(buf, len) : buf;
+    slot->len = len;
+    slot->hash = hash;
+    slot->seq = dd->next++;
+    dd->bytes += len;
+    if (dd->index) {
+        g_hash_table_replace(dd->index, slot, slot);
+    }
+}
+
+RR_dedup *rr_dedup_new(bool with_index, bool copy_payloads)
+{
+    RR_dedup *dd = g_new0(RR_dedup, 1);
+
+    dd->copy_payloads = copy_payloads;
+    if (with_index) {
+        dd->index = g_hash_table_new(rr_dedup_slot_hash, rr_dedup_slot_equal);
+    }
+    return dd;
+}
+
+void rr_dedup_reset(RR_dedup *dd)
+{
+    while (dd->oldest < dd->next) {
+        rr_dedup_evict_oldest(dd);
+    }
+}
+
+void rr_dedup_free(RR_dedup *dd)
+{
+    rr_dedup_reset(dd);
+    if (dd->index) {
+        g_hash_table_destroy(dd->index);
+    }
+    g_free(dd);
+}
+
+int64_t rr_dedup_lookup_insert(RR_dedup *dd, const uint8_t *buf, uint32_t len)
+{
+    RR_dedup_slot key = { .data = buf, .len = len };
+    RR_dedup_slot *found;
+
+    assert(dd->index && rr_dedup_eligible(len));
+    key.hash = rr_dedup_hash(buf, len);
+    found = g_hash_table_lookup(dd->index, &key);
+    if (found) {
+        return found->seq;
+    }
+    rr_dedup_insert_hashed(dd, buf, len, key.hash);
+    return -1;
+}
+
+void rr_dedup_insert(RR_dedup *dd, const uint8_t *buf, uint32_t len)
+{
+    // replay never looks payloads up by content, so skip the hashing
+    rr_dedup_insert_hashed(dd, buf, len, 0);
+}
+
+const uint8_t *rr_dedup_get(RR_dedup *dd, uint64_t seq, uint32_t len)
+{
+    RR_dedup_slot *slot;
+
+    if (seq < dd->oldest || seq >= dd->next) {
+        return NULL;
+    }
+    slot = rr_dedup_slot(dd, seq);
+    if (slot->len != len) {
+        return NULL;
+    }
+    return slot->data;
+}
@@ -34,6 +34,9 @@
 #include <sys/stat.h>
 #include <sys/resource.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 #include <libgen.h>
@@ -44,12 +47,29 @@
 #include "qemu-common.h"
 #include "qmp-commands.h"
 #include "hmp.h"
+#include "qapi-visit.h"
+#include "qapi/qobject-output-visitor.h"
+#include "qapi/qmp/qjson.h"
 #include "panda/rr/rr_log.h"
+#include "panda/rr/rr_zlog.h"
+#include "panda/rr/rr_dedup.h"
+#include "qemu/cutils.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qemu/rcu.h"
+#include "qemu/main-loop.h"
+#include "block/aio.h"
+#include "sysemu/cpus.h"
 #include "migration/migration.h"
 #include "include/exec/address-spaces.h"
 #include "migration/qemu-file.h"
 #include "io/channel-file.h"
+#include "exec/ram_addr.h"
 #include "sysemu/sysemu.h"
+#include "panda/plugin.h"
+#include "panda/callback_support.h"
+#include "panda/plog.h"
 /******************************************************************************************/
 /* GLOBALS */
 /******************************************************************************************/
@@ -68,6 +88,48 @@ volatile sig_atomic_t rr_skipped_callsite_location = 0;
 // mz the log of non-deterministic events
 RR_log* rr_nondet_log = NULL;
 
+// the vCPU that has the instruction count, see rr_log.h
+CPUState* rr_current_cpu = NULL;
+
+// set by -record-compress: new recordings get a block-compressed nondet log
+bool rr_record_compressed = false;
+
+// set by -record-dedup: new recordings store repeated and all-zero DMA
+// payloads as references
+bool rr_record_dedup = false;
+
+// set by -record-mapped-ram: the snapshots of new recordings keep guest RAM
+// in a separate image that replay maps copy-on-write
+bool rr_record_mapped_ram = false;
+
+// set by -record-packets: NICs log each packet with its place in guest RAM
+bool rr_record_packets = false;
+
+// set by -record-checkpoint-interval: take a full snapshot every this many
+// guest instructions while recording (0 means only the initial snapshot)
+uint64_t rr_checkpoint_interval = 0;
+// set by -record-checksum-interval: log checksums of the guest registers and
+// of the pages written since the last checksum every this many guest
+// instructions, for replay to check (0 means never)
+uint64_t rr_checksum_interval = 0;
+// set by -replay-start: begin replay at the last checkpoint at or before this
+// instruction count
+uint64_t rr_replay_start_instr = 0;
+// set by -replay-end: treat the replay as finished at this instruction count
+uint64_t rr_replay_end_instr = 0;
+// set by -replay-fork: at this instruction count, fork a child replay for
+// each line of plugins in rr_replay_fork_file, at most rr_replay_fork_jobs
+// (0 for no limit) at a time
+uint64_t rr_replay_fork_instr = 0;
+const char* rr_replay_fork_file = NULL;
+uint32_t rr_replay_fork_jobs = 0;
+volatile sig_atomic_t rr_replay_fork_requested = 0;
+// set by -replay-stats: write an rr_stats pandalog entry every this many
+// guest instructions during replay (0 means never)
+uint64_t rr_replay_stats_interval = 0;
+// set by -replay-stats-file
+const char* rr_replay_stats_file = NULL;
+
 #define RR_RECORD_FROM_REQUEST 2
 #define RR_RECORD_REQUEST 1
 
@@ -83,7 +145,8 @@ double rr_get_percentage(void)
         rr_nondet_log->last_prog_point.guest_instr_count;
 }
 
-static inline uint8_t rr_log_is_empty(void)
+// true once every byte of the log file has been decoded into an entry
+static inline uint8_t rr_log_file_consumed(void)
 {
     if ((rr_nondet_log->type == REPLAY) &&
         (rr_nondet_log->size == rr_nondet_log->bytes_read)) {
@@ -93,6 +156,17 @@ static inline uint8_t rr_log_is_empty(void)
     }
 }
 
+static uint8_t rr_prefetch_is_drained(void);
+
+// true once every entry in the log has been handed to the replay queue
+static inline uint8_t rr_log_is_empty(void)
+{
+    if (rr_nondet_log->type != REPLAY) {
+        return 0;
+    }
+    return rr_prefetch_is_drained();
+}
+
 RR_debug_level_type rr_debug_level = RR_DEBUG_NOISY;
 
 // used as a signal that TB cache needs flushing.
@@ -118,8 +192,13 @@ RR_log_entry* rr_get_queue_head(void) { return rr_queue_head; }
 // Check if replay is really finished. Conditions:
 // 1) The log is empty
 // 2) The only thing in the queue is RR_LAST
+// or we have reached the instruction count given to -replay-end
 uint8_t rr_replay_finished(void)
 {
+    if (rr_replay_end_instr != 0 &&
+        rr_get_guest_instr_count() >= rr_replay_end_instr) {
+        return 1;
+    }
     return rr_log_is_empty()
         && rr_queue_head->header.kind == RR_LAST
         && rr_get_guest_instr_count() >=
@@ -131,6 +210,10 @@ uint8_t rr_replay_finished(void)
 volatile unsigned long long rr_number_of_log_entries[RR_LAST];
 volatile unsigned long long rr_size_of_log_entries[RR_LAST];
 volatile unsigned long long rr_max_num_queue_entries;
+// wall clock (get_clock()) when record/replay began, and time spent replaying
+// skipped calls, for info rr-stats
+static int64_t rr_start_ns;
+static uint64_t rr_skipped_calls_ns;
 
 // mz a history of last few log entries for replay
 // mz use rr_print_history() to dump in a debugger
@@ -258,16 +341,70 @@ static inline void rr_assert_fail(const char* exp, const char* file, int line,
 /* RECORD */
 /******************************************************************************************/
 
+// Entries are staged in wbuf and handed to stdio or the compressor in large
+// chunks, so a small entry costs a few memcpys instead of a locked fwrite
+// per field.
+#define RR_RECORD_BUF_SIZE (256 * 1024)
+
+static void rr_write_out(const void *ptr, size_t len) {
+    size_t result;
+    if (rr_nondet_log->zlog) {
+        result = rr_zlog_write(rr_nondet_log->zlog, ptr, len);
+    } else {
+        result = fwrite(ptr, 1, len, rr_nondet_log->fp);
+    }
+    rr_assert(result == len);
+}
+
+static void rr_flush_record_buf(void) {
+    if (rr_nondet_log->wbuf_used > 0) {
+        rr_write_out(rr_nondet_log->wbuf, rr_nondet_log->wbuf_used);
+        rr_nondet_log->wbuf_used = 0;
+    }
+}
+
+static inline void rr_log_append(const void *ptr, size_t len) {
+    RR_log *log = rr_nondet_log;
+    if (log->wbuf_used + len > RR_RECORD_BUF_SIZE) {
+        rr_flush_record_buf();
+        if (len > RR_RECORD_BUF_SIZE) {
+            // big DMA payloads skip the buffer
+            rr_write_out(ptr, len);
+            return;
+        }
+    }
+    memcpy(log->wbuf + log->wbuf_used, ptr, len);
+    log->wbuf_used += len;
+}
+
 static inline size_t rr_fwrite(void *ptr, size_t size, size_t nmemb) {
-    size_t result = fwrite(ptr, size, nmemb, rr_nondet_log->fp);
-    rr_assert(result == nmemb);
-    return result;
+    rr_log_append(ptr, size * nmemb);
+    return nmemb;
+}
+
+// Write an entry whose variant is a single value, as the port I/O, rdtsc
+// and interrupt entries are, without going through current_item.
+static inline void rr_write_scalar_item(uint8_t kind, RR_callsite_id call_site,
+                                        const void *data, size_t size)
+{
+    uint8_t rec[sizeof(RR_prog_point) + 2 + sizeof(uint64_t)];
+    RR_prog_point pp = rr_prog_point();
+
+    rr_assert(rr_in_record());
+    memcpy(rec, &pp, sizeof(pp));
+    rec[sizeof(pp)] = kind;
+    rec[sizeof(pp) + 1] = call_site;
+    memcpy(rec + sizeof(pp) + 2, data, size);
+    rr_log_append(rec, sizeof(pp) + 2 + size);
+
+    rr_nondet_log->last_prog_point = pp;
+    rr_nondet_log->item_number++;
 }
 
 // mz write the current log item to file
 static inline void rr_write_item(void)
 {
-    RR_log_entry item = rr_nondet_log->current_item;
+    RR_log_entry* item = &rr_nondet_log->current_item;
 
     // mz save the header
     rr_assert(rr_in_record());
@@ -275,35 +412,35 @@ static inline void rr_write_item(void)
 
 #define RR_WRITE_ITEM(field) rr_fwrite(&(field), sizeof(field), 1)
     // mz this is more compact, as it doesn't include extra padding.
-    RR_WRITE_ITEM(item.header.prog_point);
-    RR_WRITE_ITEM(item.header.kind);
-    RR_WRITE_ITEM(item.header.callsite_loc);
+    RR_WRITE_ITEM(item->header.prog_point);
+    RR_WRITE_ITEM(item->header.kind);
+    RR_WRITE_ITEM(item->header.callsite_loc);
 
     // mz also save the program point in the log structure to ensure that our
     // header will include the latest program point.
-    rr_nondet_log->last_prog_point = item.header.prog_point;
+    rr_nondet_log->last_prog_point = item->header.prog_point;
 
-    switch (item.header.kind) {
+    switch (item->header.kind) {
         case RR_INPUT_1:
-            RR_WRITE_ITEM(item.variant.input_1);
+            RR_WRITE_ITEM(item->variant.input_1);
             break;
         case RR_INPUT_2:
-            RR_WRITE_ITEM(item.variant.input_2);
+            RR_WRITE_ITEM(item->variant.input_2);
             break;
         case RR_INPUT_4:
-            RR_WRITE_ITEM(item.variant.input_4);
+            RR_WRITE_ITEM(item->variant.input_4);
             break;
         case RR_INPUT_8:
-            RR_WRITE_ITEM(item.variant.input_8);
+            RR_WRITE_ITEM(item->variant.input_8);
             break;
         case RR_INTERRUPT_REQUEST:
-            RR_WRITE_ITEM(item.variant.interrupt_request);
+            RR_WRITE_ITEM(item->variant.interrupt_request);
             break;
         case RR_EXIT_REQUEST:
-            RR_WRITE_ITEM(item.variant.exit_request);
+            RR_WRITE_ITEM(item->variant.exit_request);
             break;
         case RR_SKIPPED_CALL: {
-            RR_skipped_call_args* args = &item.variant.call_args;
+            RR_skipped_call_args* args = &item->variant.call_args;
             // mz write kind first!
             RR_WRITE_ITEM(args->kind);
             switch (args->kind) {
@@ -333,6 +470,23 @@ static inline void rr_write_item(void)
                     rr_fwrite(args->variant.handle_packet_args.buf,
                             args->variant.handle_packet_args.size, 1);
                     break;
+                case RR_CALL_CPU_MEM_RW_ZERO:
+                case RR_CALL_CPU_MEM_RW_REF:
+                    // buf holds the dedup sequence number; no payload
+                    RR_WRITE_ITEM(args->variant.cpu_mem_rw_args);
+                    break;
+                case RR_CALL_CPU_MEM_UNMAP_ZERO:
+                case RR_CALL_CPU_MEM_UNMAP_REF:
+                    RR_WRITE_ITEM(args->variant.cpu_mem_unmap);
+                    break;
+                case RR_CALL_DEDUP_RESET:
+                    break;
+                case RR_CALL_CHECKSUM:
+                    RR_WRITE_ITEM(args->variant.checksum_args);
+                    break;
+                case RR_CALL_CPU_SWITCH:
+                    RR_WRITE_ITEM(args->variant.cpu_switch_args);
+                    break;
                 default:
                     // mz unimplemented
                     rr_assert(0 && "Unimplemented skipped call!");
@@ -366,65 +520,25 @@ void rr_record_debug(RR_callsite_id call_site)
 // mz record 1-byte CPU input to log file
 void rr_record_input_1(RR_callsite_id call_site, uint8_t data)
 {
-    RR_log_entry* item = &(rr_nondet_log->current_item);
-    // mz just in case
-    memset(item, 0, sizeof(RR_log_entry));
-
-    item->header.kind = RR_INPUT_1;
-    item->header.callsite_loc = call_site;
-    item->header.prog_point = rr_prog_point();
-
-    item->variant.input_1 = data;
-
-    rr_write_item();
+    rr_write_scalar_item(RR_INPUT_1, call_site, &data, sizeof(data));
 }
 
 // mz record 2-byte CPU input to file
 void rr_record_input_2(RR_callsite_id call_site, uint16_t data)
 {
-    RR_log_entry* item = &(rr_nondet_log->current_item);
-    // mz just in case
-    memset(item, 0, sizeof(RR_log_entry));
-
-    item->header.kind = RR_INPUT_2;
-    item->header.callsite_loc = call_site;
-    item->header.prog_point = rr_prog_point();
-
-    item->variant.input_2 = data;
-
-    rr_write_item();
+    rr_write_scalar_item(RR_INPUT_2, call_site, &data, sizeof(data));
 }
 
 // mz record 4-byte CPU input to file
 void rr_record_input_4(RR_callsite_id call_site, uint32_t data)
 {
-    RR_log_entry* item = &(rr_nondet_log->current_item);
-    // mz just in case
-    memset(item, 0, sizeof(RR_log_entry));
-
-    item->header.kind = RR_INPUT_4;
-    item->header.callsite_loc = call_site;
-    item->header.prog_point = rr_prog_point();
-
-    item->variant.input_4 = data;
-
-    rr_write_item();
+    rr_write_scalar_item(RR_INPUT_4, call_site, &data, sizeof(data));
 }
 
 // mz record 8-byte CPU input to file
 void rr_record_input_8(RR_callsite_id call_site, uint64_t data)
 {
-    RR_log_entry* item = &(rr_nondet_log->current_item);
-    // mz just in case
-    memset(item, 0, sizeof(RR_log_entry));
-
-    item->header.kind = RR_INPUT_8;
-    item->header.callsite_loc = call_site;
-    item->header.prog_point = rr_prog_point();
-
-    item->variant.input_8 = data;
-
-    rr_write_item();
+    rr_write_scalar_item(RR_INPUT_8, call_site, &data, sizeof(data));
 }
 
 int panda_current_interrupt_request = 0;
@@ -439,36 +553,62 @@ void rr_record_interrupt_request(RR_callsite_id call_site,
                                  uint32_t interrupt_request)
 {
     if (panda_current_interrupt_request != interrupt_request) {
-        RR_log_entry* item = &(rr_nondet_log->current_item);
-        memset(item, 0, sizeof(RR_log_entry));
-
-        item->header.kind = RR_INTERRUPT_REQUEST;
-        item->header.callsite_loc = call_site;
-        item->header.prog_point = rr_prog_point();
-
-        item->variant.interrupt_request = interrupt_request;
+        int32_t value = interrupt_request;
+        rr_write_scalar_item(RR_INTERRUPT_REQUEST, call_site, &value,
+                             sizeof(value));
         panda_current_interrupt_request = interrupt_request;
-        rr_write_item();
     }
 }
 
 void rr_record_exit_request(RR_callsite_id call_site, uint32_t exit_request)
 {
     if (exit_request != 0) {
-        RR_log_entry* item = &(rr_nondet_log->current_item);
-        // mz just in case
-        memset(item, 0, sizeof(RR_log_entry));
-
-        item->header.kind = RR_EXIT_REQUEST;
-        item->header.callsite_loc = call_site;
-        item->header.prog_point = rr_prog_point();
+        // logged as 16 bits, like RR_log_entry.variant.exit_request
+        uint16_t value = exit_request;
+        rr_write_scalar_item(RR_EXIT_REQUEST, call_site, &value,
+                             sizeof(value));
+    }
+}
 
-        item->variant.exit_request = exit_request;
+// With -record-dedup, an all-zero payload is logged as a *_ZERO call and a
+// repeat of a recent payload as a *_REF call whose buf field holds the
+// dedup sequence number; neither carries the payload itself.
+static void rr_record_dedup_payload(RR_skipped_call_args* args, uint8_t** buf,
+                                    uint64_t len, RR_skipped_call_kind zero,
+                                    RR_skipped_call_kind ref)
+{
+    int64_t seq;
 
-        rr_write_item();
+    if (!rr_nondet_log->dedup) {
+        return;
+    }
+    if (buffer_is_zero(*buf, len)) {
+        args->kind = zero;
+        *buf = NULL;
+    } else if (rr_dedup_eligible(len) &&
+               (seq = rr_dedup_lookup_insert(rr_nondet_log->dedup, *buf, len))
+                   >= 0) {
+        args->kind = ref;
+        *buf = (uint8_t*)(uintptr_t)seq;
     }
 }
 
+// Start a fresh dedup dictionary.  Logged so that replay resets at the same
+// point; recording does this at the start of the log and at every checkpoint.
+static void rr_record_dedup_reset(void)
+{
+    RR_log_entry* item = &(rr_nondet_log->current_item);
+    memset(item, 0, sizeof(RR_log_entry));
+
+    item->header.kind = RR_SKIPPED_CALL;
+    item->header.callsite_loc = RR_CALLSITE_LAST;
+    item->header.prog_point = rr_prog_point();
+    item->variant.call_args.kind = RR_CALL_DEDUP_RESET;
+
+    rr_dedup_reset(rr_nondet_log->dedup);
+    rr_write_item();
+}
+
 // mz record call to cpu_physical_memory_rw() that will need to be replayed.
 // mz only "write" modifications are recorded
 void rr_record_cpu_mem_rw_call(RR_callsite_id call_site, hwaddr addr,
@@ -486,6 +626,9 @@ void rr_record_cpu_mem_rw_call(RR_callsite_id call_site, hwaddr addr,
     item->variant.call_args.variant.cpu_mem_rw_args.addr = addr;
     item->variant.call_args.variant.cpu_mem_rw_args.buf = (uint8_t *)buf;
     item->variant.call_args.variant.cpu_mem_rw_args.len = len;
+    rr_record_dedup_payload(&item->variant.call_args,
+            &item->variant.call_args.variant.cpu_mem_rw_args.buf, len,
+            RR_CALL_CPU_MEM_RW_ZERO, RR_CALL_CPU_MEM_RW_REF);
     // mz is_write is dropped on the floor, as we only record writes
 
     rr_write_item();
@@ -512,6 +655,9 @@ void rr_record_cpu_mem_unmap(RR_callsite_id call_site, hwaddr addr,
     item->variant.call_args.variant.cpu_mem_unmap.addr = addr;
     item->variant.call_args.variant.cpu_mem_unmap.buf = (uint8_t *)buf;
     item->variant.call_args.variant.cpu_mem_unmap.len = len;
+    rr_record_dedup_payload(&item->variant.call_args,
+            &item->variant.call_args.variant.cpu_mem_unmap.buf, len,
+            RR_CALL_CPU_MEM_UNMAP_ZERO, RR_CALL_CPU_MEM_UNMAP_REF);
     // mz is_write is dropped on the floor, as we only record writes
 
     rr_write_item();
@@ -636,6 +782,236 @@ static void rr_record_end_of_log(void)
     rr_write_item();
 }
 
+/******************************************************************************************/
+/* CHECKSUMS */
+/******************************************************************************************/
+
+#ifdef CONFIG_SOFTMMU
+// With -record-checksum-interval, the recording logs an RR_CALL_CHECKSUM
+// entry from the main loop every so often.  It holds checksums of the guest
+// registers and of the RAM pages written since the previous one, which the
+// migration dirty bitmap keeps track of.  Replay tracks written pages the
+// same way and compares, so a divergence shows up within one interval.
+
+// instruction count the dirty bitmap has been tracking writes since
+static uint64_t rr_checksum_since = 0;
+static uint64_t rr_next_checksum_instr = 0;
+static bool rr_checksum_tracking = false;
+static bool rr_checksum_diverged = false;
+
+typedef struct {
+    uint32_t crc;
+    uint64_t pages;
+} RR_dirty_checksum;
+
+// The guest's view of its registers.  Record takes checksums with the CPU
+// outside cpu_exec and replay from inside it, where TCG keeps some of them
+// in other forms (x86 eflags, for one), so env can't be hashed as a whole.
+static uint32_t rr_checksum_regs_of(CPUState* cpu)
+{
+    CPUArchState* env = cpu->env_ptr;
+    uint32_t crc = crc32(0, Z_NULL, 0);
+#if defined(TARGET_I386)
+    uint32_t eflags = cpu_compute_eflags(env);
+    int i;
+
+    crc = crc32(crc, (const Bytef*)env->regs, sizeof(env->regs));
+    crc = crc32(crc, (const Bytef*)&env->eip, sizeof(env->eip));
+    crc = crc32(crc, (const Bytef*)&eflags, sizeof(eflags));
+    for (i = 0; i < 6; i++) {
+        crc = crc32(crc, (const Bytef*)&env->segs[i].selector,
+                    sizeof(env->segs[i].selector));
+        crc = crc32(crc, (const Bytef*)&env->segs[i].base,
+                    sizeof(env->segs[i].base));
+    }
+    crc = crc32(crc, (const Bytef*)env->cr, sizeof(env->cr));
+#elif defined(TARGET_ARM)
+    uint32_t psr;
+
+    if (is_a64(env)) {
+        psr = pstate_read(env);
+        crc = crc32(crc, (const Bytef*)env->xregs, sizeof(env->xregs));
+        crc = crc32(crc, (const Bytef*)&env->pc, sizeof(env->pc));
+    } else {
+        psr = cpsr_read(env);
+        crc = crc32(crc, (const Bytef*)env->regs, sizeof(env->regs));
+    }
+    crc = crc32(crc, (const Bytef*)&psr, sizeof(psr));
+#else
+    target_ulong pc = panda_current_pc(cpu);
+
+    crc = crc32(crc, (const Bytef*)&pc, sizeof(pc));
+#endif
+    return crc;
+}
+
+// Hash and clear the dirty pages of one RAM block.
+static int rr_checksum_dirty_block(const char* block_name, void* host_addr,
+                                   ram_addr_t offset, ram_addr_t length,
+                                   void* opaque)
+{
+    RR_dirty_checksum* sum = opaque;
+    ram_addr_t page;
+
+    for (page = 0; page < length; page += TARGET_PAGE_SIZE) {
+        ram_addr_t addr = offset + page;
+        if (!cpu_physical_memory_get_dirty(addr, TARGET_PAGE_SIZE,
+                                           DIRTY_MEMORY_MIGRATION)) {
+            continue;
+        }
+        sum->crc = crc32(sum->crc, (const Bytef*)&addr, sizeof(addr));
+        sum->crc = crc32(sum->crc, (const Bytef*)host_addr + page,
+                         MIN(TARGET_PAGE_SIZE, length - page));
+        sum->pages++;
+    }
+    cpu_physical_memory_test_and_clear_dirty(offset, length,
+                                             DIRTY_MEMORY_MIGRATION);
+    return 0;
+}
+
+static int rr_clear_dirty_block(const char* block_name, void* host_addr,
+                                ram_addr_t offset, ram_addr_t length,
+                                void* opaque)
+{
+    cpu_physical_memory_test_and_clear_dirty(offset, length,
+                                             DIRTY_MEMORY_MIGRATION);
+    return 0;
+}
+
+// Track the pages written from here on.  Called with the global mutex held
+// at the start of record and replay, and after each checkpoint, since
+// savevm stops dirty logging and consumes the bitmap.
+static void rr_checksum_start(void)
+{
+    memory_global_dirty_log_start();
+    qemu_ram_foreach_block(rr_clear_dirty_block, NULL);
+    rr_checksum_tracking = true;
+    rr_checksum_diverged = false;
+    rr_checksum_since = rr_get_guest_instr_count();
+}
+
+static void rr_checksum_stop(void)
+{
+    if (rr_checksum_tracking) {
+        memory_global_dirty_log_stop();
+        rr_checksum_tracking = false;
+    }
+}
+
+// checksums of the guest now; starts the next interval
+static void rr_compute_checksum(RR_checksum_args* args)
+{
+    RR_dirty_checksum sum = { crc32(0, Z_NULL, 0), 0 };
+    uint64_t instr_count = rr_get_guest_instr_count();
+
+    qemu_ram_foreach_block(rr_checksum_dirty_block, &sum);
+    args->instrs = instr_count - rr_checksum_since;
+    args->pages = sum.pages;
+    args->regs = rr_checksum_regs_of(first_cpu);
+    args->mem = sum.crc;
+    rr_checksum_since = instr_count;
+}
+
+static void rr_record_checksum(void)
+{
+    RR_log_entry* item = &(rr_nondet_log->current_item);
+    memset(item, 0, sizeof(RR_log_entry));
+
+    // replay handles it with the other entries of this main loop iteration
+    item->header.kind = RR_SKIPPED_CALL;
+    item->header.callsite_loc = RR_CALLSITE_MAIN_LOOP_WAIT;
+    item->header.prog_point = rr_prog_point();
+    item->variant.call_args.kind = RR_CALL_CHECKSUM;
+    rr_compute_checksum(&item->variant.call_args.variant.checksum_args);
+
+    rr_write_item();
+}
+
+// With several vCPUs, record and replay keep to the round-robin scheduling
+// of single-threaded TCG, so only one vCPU runs at a time and the order of
+// its memory accesses with the others' is fixed by where it switches.  The
+// log has one stream for all of them: record logs an RR_CALL_CPU_SWITCH
+// whenever the scheduler moves on, and every entry between two switches is
+// the running vCPU's.  Replay doesn't schedule by itself; it runs
+// rr_current_cpu until it reaches the next switch.
+
+static void rr_switch_cpu(CPUState* cpu)
+{
+    cpu->rr_guest_instr_count = rr_get_guest_instr_count();
+    rr_current_cpu = cpu;
+}
+
+void rr_record_cpu_switch(CPUState* cpu)
+{
+    RR_log_entry* item = &(rr_nondet_log->current_item);
+    memset(item, 0, sizeof(RR_log_entry));
+
+    // replay handles it at the top of the cpu_exec loop, and stops
+    // executing there as it does for interrupts
+    item->header.kind = RR_SKIPPED_CALL;
+    item->header.callsite_loc = RR_CALLSITE_MAIN_LOOP_WAIT;
+    item->header.prog_point = rr_prog_point();
+    item->variant.call_args.kind = RR_CALL_CPU_SWITCH;
+    item->variant.call_args.variant.cpu_switch_args.cpu_index = cpu->cpu_index;
+    rr_write_item();
+
+    rr_switch_cpu(cpu);
+}
+
+static void rr_replay_cpu_switch(RR_cpu_switch_args* args)
+{
+    CPUState* cpu = qemu_get_cpu(args->cpu_index);
+
+    rr_assert(cpu != NULL);
+    rr_switch_cpu(cpu);
+}
+
+// called from the main loop with the global mutex held
+void rr_maybe_checksum(void)
+{
+    if (!rr_in_record() || !rr_checksum_tracking ||
+        rr_get_guest_instr_count() < rr_next_checksum_instr) {
+        return;
+    }
+    rr_record_checksum();
+    rr_next_checksum_instr = rr_get_guest_instr_count() + rr_checksum_interval;
+}
+
+static void rr_replay_checksum(RR_checksum_args* recorded)
+{
+    RR_checksum_args now;
+    uint64_t since = rr_checksum_since;
+    // A replay that starts at a checkpoint tracks pages from there, as did
+    // the recording.  One cut out by scissors doesn't; compare only the
+    // registers at its first checksum.
+    bool same_interval =
+        rr_get_guest_instr_count() - since == recorded->instrs;
+    bool regs_ok, mem_ok;
+
+    if (!rr_checksum_tracking || rr_checksum_diverged) {
+        return;
+    }
+    rr_compute_checksum(&now);
+    regs_ok = now.regs == recorded->regs;
+    mem_ok = !same_interval ||
+        (now.pages == recorded->pages && now.mem == recorded->mem);
+    if (regs_ok && mem_ok) {
+        return;
+    }
+    printf("REPLAY DIVERGED between instr %" PRIu64 " and %" PRIu64 ":\n",
+           since, rr_get_guest_instr_count());
+    if (!regs_ok) {
+        printf(">>> guest registers differ\n");
+    }
+    if (!mem_ok) {
+        printf(">>> pages written differ (%" PRIu64 " in replay, %" PRIu64
+               " in record)\n", now.pages, recorded->pages);
+    }
+    rr_checksum_diverged = true;
+    panda_end_replay();
+}
+#endif
+
 /******************************************************************************************/
 /* REPLAY */
 /******************************************************************************************/
@@ -643,6 +1019,72 @@ static void rr_record_end_of_log(void)
 // mz avoid actually releasing memory
 static RR_log_entry* recycle_list = NULL;
 
+// During replay a prefetch thread decodes log entries ahead of the CPU so
+// that the file reads (and decompression, for compressed logs) happen off
+// the vCPU thread.  Decoded entries travel to the vCPU thread through the
+// ready ring; used entries travel back through the spare ring, which takes
+// the place of recycle_list while the prefetcher runs.  Each ring has
+// exactly one producer and one consumer, so no locks are needed.
+#define RR_PREFETCH_RING_SIZE 4096 // must be a power of 2
+
+typedef struct {
+    RR_log_entry* slots[RR_PREFETCH_RING_SIZE];
+    unsigned head; // only written by the producer
+    unsigned tail; // only written by the consumer
+} RR_entry_ring;
+
+static struct {
+    bool running;
+    bool stopping;
+    bool eof; // the thread has decoded the last entry in the file
+    RR_log_entry* pending; // decoded but not yet pushed when the thread stopped
+    RR_entry_ring ready;
+    RR_entry_ring spare;
+    QemuEvent ready_ev; // set after the thread pushes to ready
+    QemuEvent space_ev; // set after the vCPU thread pops from ready
+    QemuThread thread;
+} rr_prefetch;
+
+static bool rr_ring_push(RR_entry_ring* ring, RR_log_entry* entry)
+{
+    unsigned head = ring->head;
+    if (head - atomic_load_acquire(&ring->tail) == RR_PREFETCH_RING_SIZE) {
+        return false;
+    }
+    ring->slots[head & (RR_PREFETCH_RING_SIZE - 1)] = entry;
+    atomic_store_release(&ring->head, head + 1);
+    return true;
+}
+
+static RR_log_entry* rr_ring_peek(RR_entry_ring* ring)
+{
+    unsigned tail = ring->tail;
+    if (atomic_load_acquire(&ring->head) == tail) {
+        return NULL;
+    }
+    return ring->slots[tail & (RR_PREFETCH_RING_SIZE - 1)];
+}
+
+static RR_log_entry* rr_ring_pop(RR_entry_ring* ring)
+{
+    RR_log_entry* entry = rr_ring_peek(ring);
+    if (entry != NULL) {
+        atomic_store_release(&ring->tail, ring->tail + 1);
+    }
+    return entry;
+}
+
+// buffers that point into the log mapping belong to the mapping
+static inline void rr_free_buf(void* buf)
+{
+    uint8_t* p = buf;
+    if (rr_nondet_log && rr_nondet_log->map && p >= rr_nondet_log->map &&
+        p < rr_nondet_log->map + rr_nondet_log->size) {
+        return;
+    }
+    g_free(buf);
+}
+
 static inline void free_entry_params(RR_log_entry* entry)
 {
     // mz cleanup associated resources
@@ -650,15 +1092,15 @@ static inline void free_entry_params(RR_log_entry* entry)
     case RR_SKIPPED_CALL:
         switch (entry->variant.call_args.kind) {
         case RR_CALL_CPU_MEM_RW:
-            g_free(entry->variant.call_args.variant.cpu_mem_rw_args.buf);
+            rr_free_buf(entry->variant.call_args.variant.cpu_mem_rw_args.buf);
             entry->variant.call_args.variant.cpu_mem_rw_args.buf = NULL;
             break;
         case RR_CALL_CPU_MEM_UNMAP:
-            g_free(entry->variant.call_args.variant.cpu_mem_unmap.buf);
+            rr_free_buf(entry->variant.call_args.variant.cpu_mem_unmap.buf);
             entry->variant.call_args.variant.cpu_mem_unmap.buf = NULL;
             break;
         case RR_CALL_HANDLE_PACKET:
-            g_free(entry->variant.call_args.variant.handle_packet_args.buf);
+            rr_free_buf(entry->variant.call_args.variant.handle_packet_args.buf);
             entry->variant.call_args.variant.handle_packet_args.buf = NULL;
             break;
         }
@@ -677,6 +1119,19 @@ static inline void free_entry_params(RR_log_entry* entry)
 static inline void add_to_recycle_list(RR_log_entry* entry)
 {
     free_entry_params(entry);
+    // mz save item in history
+    // mz NB: we're not saving the buffer here (for
+    // RR_SKIPPED_CALL/RR_CALL_CPU_MEM_RW),
+    // mz so don't try to read it later!
+    rr_log_entry_history[rr_hist_index] = *entry;
+    rr_hist_index = (rr_hist_index + 1) % RR_HIST_SIZE;
+    if (rr_prefetch.running) {
+        // the prefetch thread owns allocation; hand the entry back to it
+        if (!rr_ring_push(&rr_prefetch.spare, entry)) {
+            g_free(entry);
+        }
+        return;
+    }
     // mz add to the recycle list
     if (recycle_list == NULL) {
         recycle_list = entry;
@@ -684,23 +1139,20 @@ static inline void add_to_recycle_list(RR_log_entry* entry)
         entry->next = recycle_list;
         recycle_list = entry;
     }
-    // mz save item in history
-    // mz NB: we're not saving the buffer here (for
-    // RR_SKIPPED_CALL/RR_CALL_CPU_MEM_RW),
-    // mz so don't try to read it later!
-    rr_log_entry_history[rr_hist_index] = *entry;
-    rr_hist_index = (rr_hist_index + 1) % RR_HIST_SIZE;
 }
 
 // mz allocate a new entry (not filled yet)
 static inline RR_log_entry* alloc_new_entry(void)
 {
     RR_log_entry* new_entry = NULL;
-    if (recycle_list != NULL) {
+    if (rr_prefetch.running) {
+        new_entry = rr_ring_pop(&rr_prefetch.spare);
+    } else if (recycle_list != NULL) {
         new_entry = recycle_list;
         recycle_list = recycle_list->next;
         new_entry->next = NULL;
-    } else {
+    }
+    if (new_entry == NULL) {
         new_entry = g_new(RR_log_entry, 1);
     }
     memset(new_entry, 0, sizeof(RR_log_entry));
@@ -708,12 +1160,68 @@ static inline RR_log_entry* alloc_new_entry(void)
 }
 
 static inline size_t rr_fread(void *ptr, size_t size, size_t nmemb) {
-    size_t result = fread(ptr, size, nmemb, rr_nondet_log->fp);
+    size_t result;
+    if (rr_nondet_log->map) {
+        uint64_t avail = rr_nondet_log->size - rr_nondet_log->bytes_read;
+        result = size ? MIN(nmemb, avail / size) : nmemb;
+        memcpy(ptr, rr_nondet_log->map + rr_nondet_log->bytes_read,
+               result * size);
+    } else if (rr_nondet_log->zlog) {
+        result = rr_zlog_read(rr_nondet_log->zlog, ptr, size * nmemb);
+        result = size ? result / size : nmemb;
+    } else {
+        result = fread(ptr, size, nmemb, rr_nondet_log->fp);
+    }
     rr_nondet_log->bytes_read += nmemb * size;
     rr_assert(result == nmemb);
     return result;
 }
 
+// mz read a len-byte payload.  With a mapped log this is just a pointer into
+// the mapping; otherwise a fresh buffer that free_entry_params will free.
+static inline void* rr_fread_buf(size_t len)
+{
+    void* buf;
+    if (rr_nondet_log->map) {
+        rr_assert(rr_nondet_log->bytes_read + len <= rr_nondet_log->size);
+        buf = rr_nondet_log->map + rr_nondet_log->bytes_read;
+        rr_nondet_log->bytes_read += len;
+        return buf;
+    }
+    buf = g_malloc(len);
+    rr_fread(buf, 1, len);
+    return buf;
+}
+
+// mz a DMA payload stored in full.  Deduplicated logs remember it in case
+// later entries refer back to it, just as recording did (all-zero payloads
+// never get here in a deduplicated log).
+static inline void* rr_fread_payload(size_t len)
+{
+    void* buf = rr_fread_buf(len);
+    if (rr_nondet_log->dedup && rr_dedup_eligible(len)) {
+        rr_dedup_insert(rr_nondet_log->dedup, buf, len);
+    }
+    return buf;
+}
+
+// mz the payload for a *_ZERO or *_REF call.  seq is the buf field as logged.
+static inline void* rr_dedup_payload(bool is_ref, uint8_t* seq, size_t len)
+{
+    const uint8_t* data;
+    if (!is_ref) {
+        return g_malloc0(len);
+    }
+    rr_assert(rr_nondet_log->dedup != NULL);
+    data = rr_dedup_get(rr_nondet_log->dedup, (uintptr_t)seq, len);
+    rr_assert(data != NULL);
+    // mz payloads in a mapped log can be shared; free_entry_params knows
+    if (rr_nondet_log->map) {
+        return (void*)data;
+    }
+    return g_memdup(data, len);
+}
+
 // mz fill an entry
 static RR_log_entry* rr_read_item(void)
 {
@@ -722,7 +1230,7 @@ static RR_log_entry* rr_read_item(void)
 
     // mz read header
     rr_assert(rr_in_replay());
-    rr_assert(!rr_log_is_empty());
+    rr_assert(!rr_log_file_consumed());
     rr_assert(rr_nondet_log->fp != NULL);
 
     item.header.file_pos = rr_nondet_log->bytes_read;
@@ -761,21 +1269,44 @@ static RR_log_entry* rr_read_item(void)
                 case RR_CALL_CPU_MEM_RW:
                     RR_READ_ITEM(args->variant.cpu_mem_rw_args);
                     // mz buffer length in args->variant.cpu_mem_rw_args.len
-                    // mz always allocate a new one. we free it when the item is added
-                    // to the recycle list
+                    // mz we free it when the item is added to the recycle list
                     args->variant.cpu_mem_rw_args.buf =
-                        g_malloc(args->variant.cpu_mem_rw_args.len);
-                    // mz read the buffer
-                    rr_fread(args->variant.cpu_mem_rw_args.buf, 1,
-                            args->variant.cpu_mem_rw_args.len);
+                        rr_fread_payload(args->variant.cpu_mem_rw_args.len);
                     break;
                 case RR_CALL_CPU_MEM_UNMAP:
                     RR_READ_ITEM(args->variant.cpu_mem_unmap);
                     args->variant.cpu_mem_unmap.buf =
-                        g_malloc(args->variant.cpu_mem_unmap.len);
-                    rr_fread(args->variant.cpu_mem_unmap.buf, 1,
-                                args->variant.cpu_mem_unmap.len);
+                        rr_fread_payload(args->variant.cpu_mem_unmap.len);
+                    break;
+                // deduplicated payloads turn back into ordinary calls here,
+                // so nothing past rr_read_item ever sees these kinds
+                case RR_CALL_CPU_MEM_RW_ZERO:
+                case RR_CALL_CPU_MEM_RW_REF:
+                    RR_READ_ITEM(args->variant.cpu_mem_rw_args);
+                    args->variant.cpu_mem_rw_args.buf = rr_dedup_payload(
+                        args->kind == RR_CALL_CPU_MEM_RW_REF,
+                        args->variant.cpu_mem_rw_args.buf,
+                        args->variant.cpu_mem_rw_args.len);
+                    args->kind = RR_CALL_CPU_MEM_RW;
+                    break;
+                case RR_CALL_CPU_MEM_UNMAP_ZERO:
+                case RR_CALL_CPU_MEM_UNMAP_REF:
+                    RR_READ_ITEM(args->variant.cpu_mem_unmap);
+                    args->variant.cpu_mem_unmap.buf = rr_dedup_payload(
+                        args->kind == RR_CALL_CPU_MEM_UNMAP_REF,
+                        args->variant.cpu_mem_unmap.buf,
+                        args->variant.cpu_mem_unmap.len);
+                    args->kind = RR_CALL_CPU_MEM_UNMAP;
                     break;
+                case RR_CALL_DEDUP_RESET:
+                    // not a real entry; reset and hand back the next one
+                    if (!rr_nondet_log->dedup) {
+                        rr_nondet_log->dedup =
+                            rr_dedup_new(false, rr_nondet_log->map == NULL);
+                    }
+                    rr_dedup_reset(rr_nondet_log->dedup);
+                    rr_nondet_log->item_number++;
+                    return rr_read_item();
                 case RR_CALL_MEM_REGION_CHANGE:
                     RR_READ_ITEM(args->variant.mem_region_change_args);
                     args->variant.mem_region_change_args.name =
@@ -791,18 +1322,22 @@ static RR_log_entry* rr_read_item(void)
                     RR_READ_ITEM(args->variant.net_transfer_args);
                     break;
 
+                case RR_CALL_CHECKSUM:
+                    RR_READ_ITEM(args->variant.checksum_args);
+                    break;
+
+                case RR_CALL_CPU_SWITCH:
+                    RR_READ_ITEM(args->variant.cpu_switch_args);
+                    break;
+
                 case RR_CALL_HANDLE_PACKET:
                     RR_READ_ITEM(args->variant.handle_packet_args);
                     // mz XXX HACK
                     args->old_buf_addr = (uint64_t)args->variant.handle_packet_args.buf;
-                    // mz buffer length in args->variant.cpu_mem_rw_args.len
-                    // mz always allocate a new one. we free it when the item is added
-                    // to the recycle list
+                    // mz buffer length in args->variant.handle_packet_args.size
+                    // mz we free it when the item is added to the recycle list
                     args->variant.handle_packet_args.buf =
-                        g_malloc(args->variant.handle_packet_args.size);
-                    // mz read the buffer
-                    rr_fread(args->variant.handle_packet_args.buf,
-                            args->variant.handle_packet_args.size, 1);
+                        rr_fread_buf(args->variant.handle_packet_args.size);
                     break;
 
                 default:
@@ -830,6 +1365,192 @@ static RR_log_entry* rr_read_item(void)
     return result;
 }
 
+static void* rr_prefetch_thread(void* opaque)
+{
+    RR_log_entry* entry = rr_prefetch.pending;
+
+    rr_prefetch.pending = NULL;
+    while (entry != NULL || !rr_log_file_consumed()) {
+        if (entry == NULL) {
+            entry = rr_read_item();
+        }
+        while (!rr_ring_push(&rr_prefetch.ready, entry)) {
+            qemu_event_reset(&rr_prefetch.space_ev);
+            if (atomic_read(&rr_prefetch.stopping)) {
+                // for rr_prefetch_spawn() to push, or rr_prefetch_stop()
+                // to free
+                rr_prefetch.pending = entry;
+                return NULL;
+            }
+            if (rr_ring_push(&rr_prefetch.ready, entry)) {
+                break;
+            }
+            qemu_event_wait(&rr_prefetch.space_ev);
+        }
+        entry = NULL;
+        qemu_event_set(&rr_prefetch.ready_ev);
+        if (atomic_read(&rr_prefetch.stopping)) {
+            return NULL;
+        }
+    }
+    atomic_store_release(&rr_prefetch.eof, true);
+    qemu_event_set(&rr_prefetch.ready_ev);
+    return NULL;
+}
+
+static void rr_prefetch_spawn(void)
+{
+    rr_prefetch.stopping = false;
+    rr_prefetch.running = true;
+    qemu_thread_create(&rr_prefetch.thread, "rr_prefetch", rr_prefetch_thread,
+                       NULL, QEMU_THREAD_JOINABLE);
+}
+
+static void rr_prefetch_start(void)
+{
+    memset(&rr_prefetch, 0, sizeof(rr_prefetch));
+    qemu_event_init(&rr_prefetch.ready_ev, false);
+    qemu_event_init(&rr_prefetch.space_ev, false);
+    rr_prefetch_spawn();
+}
+
+// Join the prefetch thread, keeping everything it decoded; the rings still
+// feed the queue once rr_prefetch_spawn() starts it again.  A thread started
+// at the end of the log just sets eof again and exits.  The vCPU must
+// not be replaying meanwhile.
+static bool rr_prefetch_pause(void)
+{
+    if (!rr_prefetch.running) {
+        return false;
+    }
+    atomic_set(&rr_prefetch.stopping, true);
+    qemu_event_set(&rr_prefetch.space_ev);
+    qemu_thread_join(&rr_prefetch.thread);
+    rr_prefetch.running = false;
+    return true;
+}
+
+// Stop the prefetch thread and free whatever it decoded that the queue never
+// got to.  After this, replay state (stats, recycle_list) is single-threaded
+// again.
+static void rr_prefetch_stop(void)
+{
+    RR_log_entry* entry;
+
+    if (!rr_prefetch_pause()) {
+        return;
+    }
+    if (rr_prefetch.pending != NULL) {
+        free_entry_params(rr_prefetch.pending);
+        g_free(rr_prefetch.pending);
+        rr_prefetch.pending = NULL;
+    }
+    while ((entry = rr_ring_pop(&rr_prefetch.ready)) != NULL) {
+        free_entry_params(entry);
+        g_free(entry);
+    }
+    while ((entry = rr_ring_pop(&rr_prefetch.spare)) != NULL) {
+        g_free(entry);
+    }
+    qemu_event_destroy(&rr_prefetch.ready_ev);
+    qemu_event_destroy(&rr_prefetch.space_ev);
+}
+
+// Block until the prefetch thread has decoded the next entry, without
+// taking it off the ring.  Returns NULL once the whole log has been consumed.
+static RR_log_entry* rr_prefetch_peek(void)
+{
+    RR_log_entry* entry;
+    for (;;) {
+        entry = rr_ring_peek(&rr_prefetch.ready);
+        if (entry != NULL) {
+            return entry;
+        }
+        qemu_event_reset(&rr_prefetch.ready_ev);
+        entry = rr_ring_peek(&rr_prefetch.ready);
+        if (entry != NULL) {
+            return entry;
+        }
+        if (atomic_load_acquire(&rr_prefetch.eof)) {
+            // eof is published after the last push, so check once more
+            return rr_ring_peek(&rr_prefetch.ready);
+        }
+        qemu_event_wait(&rr_prefetch.ready_ev);
+    }
+}
+
+static uint8_t rr_prefetch_is_drained(void)
+{
+    if (!rr_prefetch.running) {
+        return rr_log_file_consumed();
+    }
+    return atomic_load_acquire(&rr_prefetch.eof) &&
+        rr_ring_peek(&rr_prefetch.ready) == NULL;
+}
+
+// next entry to go into the replay queue, or NULL if the log is exhausted
+static RR_log_entry* rr_next_decoded_entry(void)
+{
+    RR_log_entry* entry;
+    if (!rr_prefetch.running) {
+        return rr_read_item();
+    }
+    entry = rr_prefetch_peek();
+    if (entry != NULL) {
+        rr_ring_pop(&rr_prefetch.ready);
+        qemu_event_set(&rr_prefetch.space_ev);
+    }
+    return entry;
+}
+
+// Offset in the (uncompressed) log of the next entry the replay has not yet
+// consumed.  The file position itself runs ahead of replay when prefetching.
+uint64_t rr_next_entry_file_pos(void)
+{
+    RR_log_entry* entry;
+    if (rr_queue_head != NULL) {
+        return rr_queue_head->header.file_pos;
+    }
+    if (rr_prefetch.running) {
+        entry = rr_prefetch_peek();
+        if (entry != NULL) {
+            return entry->header.file_pos;
+        }
+    }
+    return rr_nondet_log->bytes_read;
+}
+
+static double rr_per_sec(uint64_t n, int64_t elapsed_ns)
+{
+    return elapsed_ns > 0 ? n * 1e9 / elapsed_ns : 0.0;
+}
+
+// periodic copy of the replay counters, see -replay-stats
+static void rr_write_stats_pandalog(void)
+{
+    Panda__LogEntry ple = PANDA__LOG_ENTRY__INIT;
+    Panda__RrStats rs = PANDA__RR_STATS__INIT;
+    uint64_t entries[RR_LAST];
+    int64_t elapsed_ns = get_clock() - rr_start_ns;
+    int i;
+
+    for (i = 0; i < RR_LAST; i++) {
+        entries[i] = rr_number_of_log_entries[i];
+    }
+    rs.instr_per_sec = rr_per_sec(rr_get_guest_instr_count(), elapsed_ns);
+    rs.log_bytes = rr_nondet_log->bytes_read;
+    rs.log_bytes_per_sec = rr_per_sec(rs.log_bytes, elapsed_ns);
+    rs.n_entries = RR_LAST;
+    rs.entries = entries;
+    rs.skipped_calls_ns = rr_skipped_calls_ns;
+    if (panda_cb_profiling) {
+        rs.n_callback_ns = PANDA_CB_LAST;
+        rs.callback_ns = panda_cb_type_ns;
+    }
+    ple.rr_stats = &rs;
+    pandalog_write_entry(&ple);
+}
+
 #define RR_MAX_QUEUE_LEN 65536
 
 // mz fill the queue of log entries from the file
@@ -843,7 +1564,10 @@ static void rr_fill_queue(void)
     rr_assert(rr_queue_head == NULL && rr_queue_tail == NULL);
 
     while (!rr_log_is_empty()) {
-        log_entry = rr_read_item();
+        log_entry = rr_next_decoded_entry();
+        if (log_entry == NULL) {
+            break;
+        }
 
         // mz add it to the queue
         if (rr_queue_head == NULL) {
@@ -873,6 +1597,16 @@ static void rr_fill_queue(void)
         replay_progress();
         next_progress += 1;
     }
+    if (rr_replay_stats_interval && pandalog) {
+        static uint64_t next_stats = 0;
+        uint64_t instr = rr_get_guest_instr_count();
+        if (next_stats == 0) {
+            next_stats = instr + rr_replay_stats_interval;
+        } else if (instr >= next_stats) {
+            rr_write_stats_pandalog();
+            next_stats = instr + rr_replay_stats_interval;
+        }
+    }
 }
 
 // mz return next log entry from the queue
@@ -1128,6 +1862,7 @@ static MemoryRegion * rr_memory_region_find_parent(MemoryRegion *root, MemoryReg
 void rr_replay_skipped_calls_internal(RR_callsite_id call_site)
 {
 #ifdef CONFIG_SOFTMMU
+    int64_t start_ns = get_clock();
     uint8_t replay_done = 0;
     do {
         RR_log_entry* current_item =
@@ -1176,6 +1911,36 @@ void rr_replay_skipped_calls_internal(RR_callsite_id call_site)
                                           /*is_write=*/1,
                                           args.variant.cpu_mem_unmap.len);
             } break;
+            case RR_CALL_CHECKSUM:
+                rr_replay_checksum(&args.variant.checksum_args);
+                break;
+            case RR_CALL_CPU_SWITCH:
+                // the rest of this program point belongs to the next vCPU;
+                // cpu_exec() leaves it to the scheduler
+                rr_replay_cpu_switch(&args.variant.cpu_switch_args);
+                replay_done = 1;
+                break;
+            case RR_CALL_HANDLE_PACKET:
+                panda_callbacks_replay_handle_packet(first_cpu,
+                        args.variant.handle_packet_args.buf,
+                        args.variant.handle_packet_args.size,
+                        args.variant.handle_packet_args.direction,
+                        args.old_buf_addr);
+                break;
+            case RR_CALL_HD_TRANSFER:
+                panda_callbacks_replay_hd_transfer(first_cpu,
+                        args.variant.hd_transfer_args.type,
+                        args.variant.hd_transfer_args.src_addr,
+                        args.variant.hd_transfer_args.dest_addr,
+                        args.variant.hd_transfer_args.num_bytes);
+                break;
+            case RR_CALL_NET_TRANSFER:
+                panda_callbacks_replay_net_transfer(first_cpu,
+                        args.variant.net_transfer_args.type,
+                        args.variant.net_transfer_args.src_addr,
+                        args.variant.net_transfer_args.dest_addr,
+                        args.variant.net_transfer_args.num_bytes);
+                break;
             default:
                 // mz sanity check
                 rr_assert(0);
@@ -1191,6 +1956,7 @@ void rr_replay_skipped_calls_internal(RR_callsite_id call_site)
             }
         }
     } while (!replay_done);
+    rr_skipped_calls_ns += get_clock() - start_ns;
 #endif
 }
 
@@ -1224,6 +1990,16 @@ void rr_create_record_log(const char* filename)
     //(as that can jump //sporadically).
     fwrite(&(rr_nondet_log->last_prog_point), sizeof(RR_prog_point), 1,
            rr_nondet_log->fp);
+
+    // everything after the header goes through the compressor, if requested
+    if (rr_record_compressed) {
+        rr_nondet_log->zlog = rr_zlog_open_write(rr_nondet_log->fp,
+                RR_ZLOG_DEFAULT_BLOCK_SIZE, Z_BEST_SPEED);
+    }
+    rr_nondet_log->wbuf = g_malloc(RR_RECORD_BUF_SIZE);
+    if (rr_record_dedup) {
+        rr_nondet_log->dedup = rr_dedup_new(true, true);
+    }
 }
 
 // create replay log
@@ -1250,21 +2026,76 @@ void rr_create_replay_log(const char* filename)
     // mz read the last program point from the log header.
     rr_assert(rr_fread(&(rr_nondet_log->last_prog_point),
                 sizeof(RR_prog_point), 1) == 1);
+
+    // a compressed log records its logical size in the header; from here on
+    // size and bytes_read count uncompressed bytes.
+    if (rr_zlog_is_compressed_header(rr_nondet_log->last_prog_point.pc)) {
+        rr_nondet_log->size = rr_nondet_log->last_prog_point.secondary;
+        rr_nondet_log->zlog = rr_zlog_open_read(rr_nondet_log->fp);
+        rr_nondet_log->last_prog_point.pc = 0;
+        rr_nondet_log->last_prog_point.secondary = 0;
+        if (rr_debug_whisper()) {
+            qemu_log("%s is compressed.  len=%llu bytes uncompressed.\n",
+                     rr_nondet_log->name, rr_nondet_log->size);
+        }
+    } else {
+        // uncompressed logs are read straight out of a private mapping so
+        // DMA and packet payloads need neither a malloc nor a copy.  Private
+        // and writable so whoever gets a payload can still scribble on it.
+        void* map = mmap(NULL, rr_nondet_log->size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE, fileno(rr_nondet_log->fp), 0);
+        if (map != MAP_FAILED) {
+            madvise(map, rr_nondet_log->size, MADV_SEQUENTIAL);
+            rr_nondet_log->map = map;
+        } else if (rr_debug_whisper()) {
+            qemu_log("could not map %s; reading it instead.\n",
+                     rr_nondet_log->name);
+        }
+    }
 }
 
 // close file and free associated memory
 void rr_destroy_log(void)
 {
     if (rr_nondet_log->fp) {
+        RR_prog_point header = rr_nondet_log->last_prog_point;
+        if (rr_nondet_log->type == RECORD) {
+            rr_flush_record_buf();
+        }
+        if (rr_nondet_log->zlog) {
+            RR_zlog *zlog = rr_nondet_log->zlog;
+            uint64_t raw_bytes = rr_zlog_tell(zlog);
+            rr_nondet_log->zlog = NULL;
+
+            if (rr_zlog_close(zlog) != 0) {
+                fprintf(stderr, "Error writing compressed nondet log %s\n",
+                        rr_nondet_log->name);
+            }
+            if (rr_nondet_log->type == RECORD) {
+                header.pc = RR_ZLOG_MAGIC;
+                header.secondary = sizeof(RR_prog_point) + raw_bytes;
+                printf("nondet log: %" PRIu64 " bytes, compressed to %ld\n",
+                       raw_bytes,
+                       ftell(rr_nondet_log->fp) - (long)sizeof(RR_prog_point));
+            }
+        }
         // mz if in record, update the header with the last written prog point.
         if (rr_nondet_log->type == RECORD) {
             rewind(rr_nondet_log->fp);
-            fwrite(&(rr_nondet_log->last_prog_point), sizeof(RR_prog_point), 1,
-                   rr_nondet_log->fp);
+            fwrite(&header, sizeof(RR_prog_point), 1, rr_nondet_log->fp);
         }
         fclose(rr_nondet_log->fp);
         rr_nondet_log->fp = NULL;
     }
+    if (rr_nondet_log->dedup) {
+        rr_dedup_free(rr_nondet_log->dedup);
+        rr_nondet_log->dedup = NULL;
+    }
+    if (rr_nondet_log->map) {
+        munmap(rr_nondet_log->map, rr_nondet_log->size);
+        rr_nondet_log->map = NULL;
+    }
+    g_free(rr_nondet_log->wbuf);
     g_free(rr_nondet_log->name);
     g_free(rr_nondet_log);
     rr_nondet_log = NULL;
@@ -1346,6 +2177,259 @@ static inline void rr_get_nondet_log_file_name(char* rr_name, char* rr_path,
     snprintf(file_name, file_name_len, "%s/%s-rr-nondet.log", rr_path, rr_name);
 }
 
+static inline void rr_get_checkpoint_file_name(char* rr_name, char* rr_path,
+                                               uint32_t id, char* file_name,
+                                               size_t file_name_len)
+{
+    rr_assert(rr_name != NULL && rr_path != NULL);
+    if (id == 0) {
+        // checkpoint 0 is the snapshot the recording started from
+        rr_get_snapshot_file_name(rr_name, rr_path, file_name, file_name_len);
+    } else {
+        snprintf(file_name, file_name_len, "%s/%s-rr-snp-%u", rr_path, rr_name,
+                 id);
+    }
+}
+
+// the RAM image that goes with a snapshot written with -record-mapped-ram
+static inline void rr_get_ram_image_file_name(const char* snapshot_name,
+                                              char* file_name,
+                                              size_t file_name_len)
+{
+    snprintf(file_name, file_name_len, "%s.ram", snapshot_name);
+}
+
+// write a snapshot of the guest to snapshot_name, with its RAM image if
+// recording with -record-mapped-ram
+static int rr_save_snapshot(const char* snapshot_name)
+{
+    char ram_name[1040];
+    int ret;
+
+    QIOChannelFile* ioc =
+        qio_channel_file_new_path(snapshot_name, O_WRONLY | O_CREAT, 0660,
+                                  NULL);
+    if (ioc == NULL) {
+        return -1;
+    }
+    if (rr_record_mapped_ram) {
+        rr_get_ram_image_file_name(snapshot_name, ram_name, sizeof(ram_name));
+        ram_set_mapped_image(ram_name);
+    }
+    QEMUFile* snp = qemu_fopen_channel_output(QIO_CHANNEL(ioc));
+    ret = qemu_savevm_state(snp, NULL);
+    qemu_fclose(snp);
+    ram_set_mapped_image(NULL);
+    return ret;
+}
+
+static inline void rr_get_index_file_name(char* rr_name, char* rr_path,
+                                          char* file_name, size_t file_name_len)
+{
+    rr_assert(rr_name != NULL && rr_path != NULL);
+    snprintf(file_name, file_name_len, "%s/%s-rr-nondet.idx", rr_path, rr_name);
+}
+
+/******************************************************************************************/
+/* CHECKPOINTS */
+/******************************************************************************************/
+
+// While recording with a checkpoint interval, every checkpoint gets a full
+// snapshot file and a record in the index file next to the nondet log.
+// Checkpoints are only taken from the main loop, at the same point where
+// begin_record takes its snapshot, so replay can load one, seek the nondet
+// log to the recorded offset and carry on as if the recording began there.
+static FILE* rr_checkpoint_index = NULL;
+static char* rr_checkpoint_path = NULL;
+static char* rr_checkpoint_name = NULL;
+static uint32_t rr_next_checkpoint_id = 0;
+static uint64_t rr_next_checkpoint_instr = 0;
+
+// logical offset in the nondet log of the next entry to be written
+static uint64_t rr_record_log_offset(void)
+{
+    if (rr_nondet_log->zlog) {
+        return sizeof(RR_prog_point) + rr_zlog_tell(rr_nondet_log->zlog) +
+            rr_nondet_log->wbuf_used;
+    }
+    return ftell(rr_nondet_log->fp) + rr_nondet_log->wbuf_used;
+}
+
+static void rr_write_checkpoint_record(uint64_t instr_count)
+{
+    RR_checkpoint ckpt = {0};
+    ckpt.guest_instr_count = instr_count;
+    ckpt.log_offset = rr_record_log_offset();
+    ckpt.id = rr_next_checkpoint_id++;
+    ckpt.cpu_index = rr_current_cpu ? rr_current_cpu->cpu_index : 0;
+    // replay starting here won't have seen any earlier payloads
+    if (ckpt.id != 0 && rr_nondet_log->dedup) {
+        rr_record_dedup_reset();
+    }
+    rr_assert(fwrite(&ckpt, sizeof(ckpt), 1, rr_checkpoint_index) == 1);
+    fflush(rr_checkpoint_index);
+    rr_next_checkpoint_instr = instr_count + rr_checkpoint_interval;
+}
+
+static void rr_begin_checkpoints(char* rr_name, char* rr_path)
+{
+    char name_buf[1024];
+
+    if (rr_checkpoint_interval == 0) {
+        return;
+    }
+    rr_get_index_file_name(rr_name, rr_path, name_buf, sizeof(name_buf));
+    rr_checkpoint_index = fopen(name_buf, "w");
+    if (rr_checkpoint_index == NULL) {
+        fprintf(stderr, "Could not open checkpoint index %s; recording "
+                "without checkpoints\n", name_buf);
+        return;
+    }
+    printf("writing checkpoint index:\t%s\n", name_buf);
+    rr_checkpoint_path = g_strdup(rr_path);
+    rr_checkpoint_name = g_strdup(rr_name);
+    rr_next_checkpoint_id = 0;
+    // the snapshot begin_record just wrote is checkpoint 0
+    rr_write_checkpoint_record(0);
+}
+
+static void rr_end_checkpoints(void)
+{
+    if (rr_checkpoint_index == NULL) {
+        return;
+    }
+    fclose(rr_checkpoint_index);
+    rr_checkpoint_index = NULL;
+    g_free(rr_checkpoint_path);
+    g_free(rr_checkpoint_name);
+    rr_checkpoint_path = NULL;
+    rr_checkpoint_name = NULL;
+}
+
+// called from the main loop with the global mutex held
+void rr_maybe_checkpoint(void)
+{
+#ifdef CONFIG_SOFTMMU
+    char name_buf[1024];
+    uint64_t instr_count;
+
+    if (!rr_in_record() || rr_checkpoint_index == NULL) {
+        return;
+    }
+    instr_count = rr_get_guest_instr_count();
+    if (instr_count < rr_next_checkpoint_instr) {
+        return;
+    }
+    rr_get_checkpoint_file_name(rr_checkpoint_name, rr_checkpoint_path,
+                                rr_next_checkpoint_id, name_buf,
+                                sizeof(name_buf));
+    printf("writing checkpoint at instr %" PRIu64 ":\t%s\n", instr_count,
+           name_buf);
+    // close the checksum interval, so that one starts at the checkpoint
+    if (rr_checksum_tracking && rr_checksum_since != instr_count) {
+        rr_record_checksum();
+    }
+    // mz whatever savevm touches must not end up in the nondet log
+    rr_mode = RR_OFF;
+    int ret = rr_save_snapshot(name_buf);
+    rr_mode = RR_RECORD;
+    if (rr_checksum_tracking) {
+        rr_checksum_start();
+    }
+    if (ret < 0) {
+        fprintf(stderr, "Failed to write checkpoint %s\n", name_buf);
+        rr_next_checkpoint_instr = instr_count + rr_checkpoint_interval;
+        return;
+    }
+    rr_write_checkpoint_record(instr_count);
+#endif
+}
+
+// The checkpoint index of the recording being replayed, and where in it the
+// replay started.  Kept after replay ends so plugins can still look at it
+// while they're unloaded.
+static GArray* rr_replay_index = NULL;
+static RR_checkpoint rr_replay_start = {0};
+static char* rr_replay_base = NULL;
+
+// Read the whole checkpoint index, if there is one.
+static void rr_load_replay_index(char* rr_name, char* rr_path)
+{
+    char name_buf[1024];
+    RR_checkpoint ckpt;
+
+    if (rr_replay_index) {
+        g_array_free(rr_replay_index, true);
+        rr_replay_index = NULL;
+    }
+    rr_get_index_file_name(rr_name, rr_path, name_buf, sizeof(name_buf));
+    FILE* index = fopen(name_buf, "r");
+    if (index == NULL) {
+        return;
+    }
+    rr_replay_index = g_array_new(false, false, sizeof(RR_checkpoint));
+    while (fread(&ckpt, sizeof(ckpt), 1, index) == 1) {
+        g_array_append_val(rr_replay_index, ckpt);
+    }
+    fclose(index);
+}
+
+// Find the last checkpoint at or before instr_count.  Returns false if there
+// is no usable index, in which case replay starts from the beginning.
+static bool rr_find_checkpoint(uint64_t instr_count, RR_checkpoint* result)
+{
+    bool found = false;
+    guint i;
+
+    if (rr_replay_index == NULL) {
+        return false;
+    }
+    for (i = 0; i < rr_replay_index->len; i++) {
+        RR_checkpoint* ckpt = &g_array_index(rr_replay_index, RR_checkpoint, i);
+        if (ckpt->guest_instr_count > instr_count) {
+            break;
+        }
+        *result = *ckpt;
+        found = true;
+    }
+    return found;
+}
+
+const RR_checkpoint* rr_replay_checkpoints(size_t* n)
+{
+    if (rr_replay_index == NULL) {
+        *n = 0;
+        return NULL;
+    }
+    *n = rr_replay_index->len;
+    return (const RR_checkpoint*)rr_replay_index->data;
+}
+
+const RR_checkpoint* rr_replay_start_checkpoint(void)
+{
+    return &rr_replay_start;
+}
+
+const char* rr_replay_base_name(void)
+{
+    return rr_replay_base;
+}
+
+// skip the replay log forward to a checkpoint's logical offset
+static void rr_seek_replay_log(uint64_t offset)
+{
+    rr_assert(offset >= rr_nondet_log->bytes_read);
+    rr_assert(offset <= rr_nondet_log->size);
+    if (rr_nondet_log->zlog) {
+        // no random access into a compressed log; inflate up to the offset
+        uint64_t skip = offset - rr_nondet_log->bytes_read;
+        rr_assert(rr_zlog_skip(rr_nondet_log->zlog, skip) == skip);
+    } else if (!rr_nondet_log->map) {
+        rr_assert(fseek(rr_nondet_log->fp, offset, SEEK_SET) == 0);
+    }
+    rr_nondet_log->bytes_read = offset;
+}
+
 void rr_reset_state(CPUState* cpu_state)
 {
     // set flag to signal that we'll be needing the tb flushed.
@@ -1354,6 +2438,7 @@ void rr_reset_state(CPUState* cpu_state)
     rr_record_in_progress = 0;
     rr_skipped_callsite_location = 0;
     cpu_state->rr_guest_instr_count = 0;
+    rr_current_cpu = cpu_state;
 }
 
 //////////////////////////////////////////////////////////////
@@ -1363,8 +2448,28 @@ void rr_reset_state(CPUState* cpu_state)
 #ifdef CONFIG_SOFTMMU
 
 #include "qapi/error.h"
+#include "qemu/error-report.h"
+
+// recording needs the vCPUs to take turns
+static bool rr_record_check_accel(Error** errp)
+{
+    // instruction counts and the hooks that log nondet inputs live in TCG
+    if (!tcg_enabled()) {
+        error_setg(errp, "can't record without TCG; savevm, then restart "
+                   "with -accel tcg and record from the snapshot");
+        return false;
+    }
+    if (qemu_tcg_mttcg_enabled()) {
+        error_setg(errp, "can't record with multi-threaded TCG; "
+                   "restart with -accel tcg,thread=single");
+        return false;
+    }
+    return true;
+}
+
 void qmp_begin_record(const char* file_name, Error** errp)
 {
+    if (!rr_record_check_accel(errp)) return;
     rr_record_requested = RR_RECORD_REQUEST;
     rr_requested_name = g_strdup(file_name);
 }
@@ -1372,6 +2477,7 @@ void qmp_begin_record(const char* file_name, Error** errp)
 void qmp_begin_record_from(const char* snapshot, const char* file_name,
                                   Error** errp)
 {
+    if (!rr_record_check_accel(errp)) return;
     rr_record_requested = RR_RECORD_FROM_REQUEST;
     rr_snapshot_name = g_strdup(snapshot);
     rr_requested_name = g_strdup(file_name);
@@ -1391,24 +2497,84 @@ void qmp_end_replay(Error** errp)
 
 void panda_end_replay(void) { rr_end_replay_requested = 1; }
 
+RrStats* qmp_query_rr_stats(Error** errp)
+{
+    RrStats* stats = g_new0(RrStats, 1);
+    RrEntryStatsList** entries = &stats->entries;
+    RrCallbackStatsList** callbacks = &stats->callbacks;
+    int i;
+
+    stats->mode = g_strdup(rr_in_replay() ? "replay" :
+                           rr_in_record() ? "record" : "off");
+    if (rr_off()) {
+        return stats;
+    }
+    stats->guest_instructions = rr_get_guest_instr_count();
+    stats->elapsed_ns = get_clock() - rr_start_ns;
+    stats->instructions_per_sec =
+        rr_per_sec(stats->guest_instructions, stats->elapsed_ns);
+    if (rr_in_record()) {
+        stats->log_bytes = stats->log_size = rr_record_log_offset();
+    } else {
+        stats->has_total_instructions = true;
+        stats->total_instructions =
+            rr_nondet_log->last_prog_point.guest_instr_count;
+        stats->log_bytes = rr_nondet_log->bytes_read;
+        stats->log_size = rr_nondet_log->size;
+    }
+    stats->log_bytes_per_sec = rr_per_sec(stats->log_bytes, stats->elapsed_ns);
+    for (i = 0; i < RR_LAST; i++) {
+        RrEntryStatsList* e;
+        if (rr_number_of_log_entries[i] == 0) {
+            continue;
+        }
+        e = g_new0(RrEntryStatsList, 1);
+        e->value = g_new0(RrEntryStats, 1);
+        e->value->kind = g_strdup(get_log_entry_kind_string(i));
+        e->value->count = rr_number_of_log_entries[i];
+        e->value->bytes = rr_size_of_log_entries[i];
+        *entries = e;
+        entries = &e->next;
+    }
+    stats->skipped_calls_ns = rr_skipped_calls_ns;
+    for (i = 0; i < PANDA_CB_LAST; i++) {
+        RrCallbackStatsList* c;
+        if (panda_cb_type_ns[i] == 0) {
+            continue;
+        }
+        c = g_new0(RrCallbackStatsList, 1);
+        c->value = g_new0(RrCallbackStats, 1);
+        c->value->type = g_strdup(panda_cb_type_name(i));
+        c->value->ns = panda_cb_type_ns[i];
+        *callbacks = c;
+        callbacks = &c->next;
+    }
+    stats->plugins = panda_plugin_profile_stats();
+    return stats;
+}
+
+
 #include "qemu-common.h"    // Monitor def
+#include "monitor/monitor.h"
 #include "qapi/qmp/qdict.h" // QDict def
 
 // HMP commands (the "monitor")
 void hmp_begin_record(Monitor* mon, const QDict* qdict)
 {
-    Error* err;
+    Error* err = NULL;
     const char* file_name = qdict_get_try_str(qdict, "file_name");
     qmp_begin_record(file_name, &err);
+    if (err) error_report_err(err);
 }
 
 // HMP commands (the "monitor")
 void hmp_begin_record_from(Monitor* mon, const QDict* qdict)
 {
-    Error* err;
+    Error* err = NULL;
     const char* snapshot = qdict_get_try_str(qdict, "snapshot");
     const char* file_name = qdict_get_try_str(qdict, "file_name");
     qmp_begin_record_from(snapshot, file_name, &err);
+    if (err) error_report_err(err);
 }
 
 void hmp_end_record(Monitor* mon, const QDict* qdict)
@@ -1423,6 +2589,68 @@ void hmp_end_replay(Monitor* mon, const QDict* qdict)
     qmp_end_replay(&err);
 }
 
+void hmp_info_rr_stats(Monitor* mon, const QDict* qdict)
+{
+    RrStats* stats = qmp_query_rr_stats(NULL);
+    RrEntryStatsList* e;
+    RrCallbackStatsList* c;
+
+    monitor_printf(mon, "mode: %s\n", stats->mode);
+    if (rr_off()) {
+        qapi_free_RrStats(stats);
+        return;
+    }
+    monitor_printf(mon, "elapsed: %.3f seconds\n", stats->elapsed_ns / 1e9);
+    monitor_printf(mon, "guest instructions: %" PRId64, stats->guest_instructions);
+    if (stats->has_total_instructions) {
+        monitor_printf(mon, " of %" PRId64, stats->total_instructions);
+    }
+    monitor_printf(mon, " (%.0f/sec)\n", stats->instructions_per_sec);
+    monitor_printf(mon, "nondet log: %" PRId64 " of %" PRId64 " bytes (%.0f/sec)\n",
+                   stats->log_bytes, stats->log_size, stats->log_bytes_per_sec);
+    for (e = stats->entries; e; e = e->next) {
+        monitor_printf(mon, "  %-24s %12" PRId64 " entries %14" PRId64 " bytes\n",
+                       e->value->kind, e->value->count, e->value->bytes);
+    }
+    monitor_printf(mon, "skipped calls: %.3f seconds\n",
+                   stats->skipped_calls_ns / 1e9);
+    if (!panda_cb_profiling) {
+        monitor_printf(mon, "callbacks: not profiled (use -panda-profile)\n");
+    }
+    for (c = stats->callbacks; c; c = c->next) {
+        monitor_printf(mon, "  %-32s %10.3f seconds\n", c->value->type,
+                       c->value->ns / 1e9);
+    }
+    qapi_free_RrStats(stats);
+}
+
+// -replay-stats-file: the counters as query-rr-stats has them at the end
+// of the replay, before they are reset
+static void rr_write_stats_file(void)
+{
+    RrStats* stats = qmp_query_rr_stats(NULL);
+    QObject* obj;
+    QString* str;
+    Visitor* v = qobject_output_visitor_new(&obj);
+    FILE* f;
+
+    visit_type_RrStats(v, NULL, &stats, &error_abort);
+    visit_complete(v, &obj);
+    str = qobject_to_json_pretty(obj);
+    f = fopen(rr_replay_stats_file, "w");
+    if (f) {
+        fprintf(f, "%s\n", qstring_get_str(str));
+        fclose(f);
+    } else {
+        fprintf(stderr, "Couldn't write replay stats to %s: %s\n",
+                rr_replay_stats_file, strerror(errno));
+    }
+    QDECREF(str);
+    qobject_decref(obj);
+    visit_free(v);
+    qapi_free_RrStats(stats);
+}
+
 #endif // CONFIG_SOFTMMU
 
 static time_t rr_start_time;
@@ -1455,16 +2683,13 @@ int rr_do_begin_record(const char* file_name_full, CPUState* cpu_state)
         global_state_store_running();
         rr_get_snapshot_file_name(rr_name, rr_path, name_buf, sizeof(name_buf));
         printf("writing snapshot:\t%s\n", name_buf);
-        QIOChannelFile* ioc =
-            qio_channel_file_new_path(name_buf, O_WRONLY | O_CREAT, 0660, NULL);
-        QEMUFile* snp = qemu_fopen_channel_output(QIO_CHANNEL(ioc));
-        snapshot_ret = qemu_savevm_state(snp, NULL);
-        qemu_fclose(snp);
+        snapshot_ret = rr_save_snapshot(name_buf);
         // log_all_cpu_states();
     }
 
     // save the time so we can report how long record takes
     time(&rr_start_time);
+    rr_start_ns = get_clock();
 
     // second, open non-deterministic input log for write.
     rr_get_nondet_log_file_name(rr_name, rr_path, name_buf, sizeof(name_buf));
@@ -1472,10 +2697,21 @@ int rr_do_begin_record(const char* file_name_full, CPUState* cpu_state)
     rr_create_record_log(name_buf);
     // reset record/replay counters and flags
     rr_reset_state(cpu_state);
+    // index the snapshot we just took so replay can start from it
+    if (snapshot_ret >= 0) {
+        rr_begin_checkpoints(rr_name, rr_path);
+    }
     g_free(rr_path_base);
     g_free(rr_name_base);
     // set global to turn on recording
     rr_mode = RR_RECORD;
+    if (rr_nondet_log->dedup) {
+        rr_record_dedup_reset();
+    }
+    if (rr_checksum_interval > 0) {
+        rr_checksum_start();
+        rr_next_checksum_instr = rr_checksum_interval;
+    }
     // cpu_set_log(CPU_LOG_TB_IN_ASM|CPU_LOG_RR);
     return snapshot_ret;
 #endif
@@ -1504,6 +2740,8 @@ void rr_do_end_record(void)
     // log_all_cpu_states();
 
     rr_destroy_log();
+    rr_end_checkpoints();
+    rr_checksum_stop();
 
     g_free(rr_path_base);
     g_free(rr_name_base);
@@ -1530,8 +2768,22 @@ int rr_do_begin_replay(const char* file_name_full, CPUState* cpu_state)
         qemu_log("Begin vm replay for file_name_full = %s\n", file_name_full);
         qemu_log("path = [%s]  file_name_base = [%s]\n", rr_path, rr_name);
     }
-    // first retrieve snapshot
-    rr_get_snapshot_file_name(rr_name, rr_path, name_buf, sizeof(name_buf));
+    g_free(rr_replay_base);
+    rr_replay_base = g_strdup_printf("%s/%s", rr_path, rr_name);
+    rr_load_replay_index(rr_name, rr_path);
+    // first retrieve snapshot, or the checkpoint closest to where the user
+    // asked replay to start
+    RR_checkpoint start = {0};
+    if (rr_replay_start_instr > 0) {
+        if (rr_find_checkpoint(rr_replay_start_instr, &start)) {
+            printf("starting replay at checkpoint %u, instr %" PRIu64 "\n",
+                   start.id, start.guest_instr_count);
+        } else {
+            printf("no checkpoint index; replaying from the beginning\n");
+        }
+    }
+    rr_get_checkpoint_file_name(rr_name, rr_path, start.id, name_buf,
+                                sizeof(name_buf));
     if (rr_debug_whisper()) {
         qemu_log("reading snapshot:\t%s\n", name_buf);
     }
@@ -1544,11 +2796,20 @@ int rr_do_begin_replay(const char* file_name_full, CPUState* cpu_state)
     }
     QEMUFile* snp = qemu_fopen_channel_input(QIO_CHANNEL(ioc));
 
+    // snapshots that keep RAM in an image say so in the stream, which then
+    // maps the image instead of copying every page
+    char ram_name[1040];
+    rr_get_ram_image_file_name(name_buf, ram_name, sizeof(ram_name));
+    if (access(ram_name, R_OK) == 0) {
+        ram_set_mapped_image(ram_name);
+    }
+
     qemu_system_reset(VMRESET_SILENT);
     migration_incoming_state_new(snp);
     snapshot_ret = qemu_loadvm_state(snp);
     qemu_fclose(snp);
     migration_incoming_state_destroy();
+    ram_set_mapped_image(NULL);
 
     if (snapshot_ret < 0) {
         fprintf(stderr, "Failed to load vmstate\n");
@@ -1559,17 +2820,32 @@ int rr_do_begin_replay(const char* file_name_full, CPUState* cpu_state)
 
     // save the time so we can report how long replay takes
     time(&rr_start_time);
+    rr_start_ns = get_clock();
+    rr_skipped_calls_ns = 0;
 
     // second, open non-deterministic input log for read.
     rr_get_nondet_log_file_name(rr_name, rr_path, name_buf, sizeof(name_buf));
     printf("opening nondet log for read :\t%s\n", name_buf);
     rr_create_replay_log(name_buf);
+    if (start.id != 0) {
+        rr_seek_replay_log(start.log_offset);
+    }
+    rr_replay_start = start;
     // reset record/replay counters and flags
     rr_reset_state(cpu_state);
+    cpu_state->rr_guest_instr_count = start.guest_instr_count;
+    if (start.cpu_index != cpu_state->cpu_index) {
+        RR_cpu_switch_args first = { .cpu_index = start.cpu_index };
+        rr_replay_cpu_switch(&first);
+    }
+    // cheap if the recording has no checksums: each page is only caught
+    // the first time it is written
+    rr_checksum_start();
     // set global to turn on replay
     rr_mode = RR_REPLAY;
 
-    // mz fill the queue!
+    // start decoding entries in the background, then fill the queue!
+    rr_prefetch_start();
     rr_fill_queue();
     return 0; // snapshot_ret;
 #endif
@@ -1584,6 +2860,11 @@ void rr_do_end_replay(int is_error)
     // dump cpu state at exit as a sanity check.
     int i;
     replay_progress();
+    // the stats below are updated by the prefetch thread
+    rr_prefetch_stop();
+    if (rr_replay_stats_file) {
+        rr_write_stats_file();
+    }
     if (is_error) {
         printf("ERROR: replay failed!\n");
     } else {
@@ -1647,6 +2928,7 @@ void rr_do_end_replay(int is_error)
     // log_all_cpu_states();
     // close logs
     rr_destroy_log();
+    rr_checksum_stop();
     // turn off replay
     rr_mode = RR_OFF;
 
@@ -1660,6 +2942,146 @@ void rr_do_end_replay(int is_error)
 #endif // CONFIG_SOFTMMU
 }
 
+#ifdef CONFIG_SOFTMMU
+// -replay-fork: replay up to rr_replay_fork_instr once, then fork a child
+// per line of rr_replay_fork_file.  Each child loads that line's plugins and
+// replays on from the same point, sharing the parent's memory copy-on-write,
+// so the common prefix of many analyses is only replayed once.
+
+bool rr_replay_fork_due(void)
+{
+    if (rr_replay_fork_file == NULL || rr_replay_fork_requested ||
+        rr_get_guest_instr_count() < rr_replay_fork_instr) {
+        return false;
+    }
+    rr_replay_fork_requested = 1;
+    return true;
+}
+
+// Put back in the child what fork() didn't copy, and what it shouldn't share
+// with its siblings.
+static void rr_replay_fork_child(const char* plugins, bool prefetching)
+{
+    rcu_after_fork();
+    aio_context_after_fork(qemu_get_aio_context());
+    aio_context_after_fork(iohandler_get_aio_context());
+    qemu_tcg_vcpus_after_fork();
+
+    if (rr_nondet_log->map == NULL) {
+        // the stdio read position lives in the file description, which is
+        // shared with the siblings; read from a fresh one
+        int old_fd = fileno(rr_nondet_log->fp);
+        int fd = open(rr_nondet_log->name, O_RDONLY);
+        rr_assert(fd >= 0);
+        rr_assert(lseek(fd, lseek(old_fd, 0, SEEK_CUR), SEEK_SET) >= 0);
+        rr_assert(dup2(fd, old_fd) == old_fd);
+        close(fd);
+    }
+    if (prefetching) {
+        rr_prefetch_spawn();
+    }
+
+    if (!panda_load_plugin_list(plugins)) {
+        fprintf(stderr, "replay-fork: cannot load %s\n", plugins);
+        exit(1);
+    }
+    // the inherited code was translated without the new plugins' callbacks
+    panda_do_flush_tb();
+    vm_start();
+}
+
+void rr_do_replay_fork(void)
+{
+    gchar* contents;
+    gchar** lines;
+    GPtrArray* analyses = g_ptr_array_new();
+    GError* err = NULL;
+    const char* file = rr_replay_fork_file;
+    uint32_t next = 0, running = 0, failed = 0;
+    bool prefetching;
+    guint i;
+
+    // only ever fork once
+    rr_replay_fork_file = NULL;
+    rr_replay_fork_requested = 0;
+    if (!g_file_get_contents(file, &contents, NULL, &err)) {
+        fprintf(stderr, "replay-fork: %s\n", err->message);
+        exit(1);
+    }
+    lines = g_strsplit(contents, "\n", -1);
+    for (i = 0; lines[i] != NULL; i++) {
+        char* line = g_strstrip(lines[i]);
+        if (line[0] != '\0' && line[0] != '#') {
+            g_ptr_array_add(analyses, line);
+        }
+    }
+    if (analyses->len == 0) {
+        fprintf(stderr, "replay-fork: no plugins in %s\n", file);
+        exit(1);
+    }
+    if (pandalog) {
+        // its writer threads would not survive the fork
+        fprintf(stderr, "replay-fork: -pandalog can't be used before the "
+                "fork point\n");
+        exit(1);
+    }
+
+    printf("replay-fork: forking %u analyses at instr %" PRIu64 "\n",
+           analyses->len, rr_get_guest_instr_count());
+    prefetching = rr_prefetch_pause();
+    // or the children would write out each other's buffered output
+    fflush(NULL);
+
+    while (next < analyses->len || running > 0) {
+        int status;
+        pid_t pid;
+
+        if (next < analyses->len &&
+            (rr_replay_fork_jobs == 0 || running < rr_replay_fork_jobs)) {
+            pid = fork();
+            if (pid == 0) {
+                rr_replay_fork_child(g_ptr_array_index(analyses, next),
+                                     prefetching);
+                g_ptr_array_free(analyses, TRUE);
+                g_strfreev(lines);
+                g_free(contents);
+                return;
+            }
+            if (pid < 0) {
+                perror("replay-fork: fork");
+                failed++;
+            } else {
+                printf("replay-fork: pid %d runs %s\n", (int)pid,
+                       (char*)g_ptr_array_index(analyses, next));
+                running++;
+            }
+            next++;
+            continue;
+        }
+        pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("replay-fork: waitpid");
+            break;
+        }
+        running--;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            printf("replay-fork: pid %d failed\n", (int)pid);
+            failed++;
+        }
+    }
+    printf("replay-fork: %u of %u analyses succeeded\n",
+           analyses->len - failed, analyses->len);
+    fflush(stdout);
+    // The children have taken over the replay, and the plugins loaded
+    // before the fork have written their results from each of them; skip
+    // their uninit and exit handlers here.
+    _exit(failed ? 1 : 0);
+}
+#endif
+
 #ifdef CONFIG_SOFTMMU
 uint32_t rr_checksum_memory(void);
 uint32_t rr_checksum_memory(void) {
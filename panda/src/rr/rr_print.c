@@ -7,6 +7,7 @@
 #include "qemu/osdep.h"
 #include "cpu.h"
 #include "panda/rr/rr_log.h"
+#include "panda/rr/rr_zlog.h"
 
 /******************************************************************************************/
 /* GLOBALS */
@@ -24,9 +25,32 @@ volatile sig_atomic_t rr_skipped_callsite_location = 0;
 //mz the log of non-deterministic events
 RR_log *rr_nondet_log = NULL;
 
+// position in the (uncompressed) log stream
+static inline uint64_t log_tell(void) {
+    if (rr_nondet_log->zlog) {
+        return sizeof(RR_prog_point) + rr_zlog_tell(rr_nondet_log->zlog);
+    }
+    return ftell(rr_nondet_log->fp);
+}
+
+static inline size_t log_fread(void *ptr, size_t size, size_t nmemb) {
+    if (rr_nondet_log->zlog) {
+        return rr_zlog_read(rr_nondet_log->zlog, ptr, size * nmemb) / size;
+    }
+    return fread(ptr, size, nmemb, rr_nondet_log->fp);
+}
+
+static inline void log_skip(size_t len) {
+    if (rr_nondet_log->zlog) {
+        assert(rr_zlog_skip(rr_nondet_log->zlog, len) == len);
+    } else {
+        fseek(rr_nondet_log->fp, len, SEEK_CUR);
+    }
+}
+
 static inline uint8_t log_is_empty(void) {
     if ((rr_nondet_log->type == REPLAY) &&
-        (rr_nondet_log->size - ftell(rr_nondet_log->fp) == 0)) {
+        (rr_nondet_log->size - log_tell() == 0)) {
         return 1;
     }
     else {
@@ -90,6 +114,30 @@ static void rr_spit_log_entry(RR_log_entry item) {
                     case RR_CALL_CPU_MEM_UNMAP:
                         callbytes = sizeof(args->variant.cpu_mem_unmap) + args->variant.cpu_mem_unmap.len;
                         break;
+                    case RR_CALL_CPU_MEM_RW_ZERO:
+                    case RR_CALL_CPU_MEM_RW_REF:
+                        callbytes = sizeof(args->variant.cpu_mem_rw_args);
+                        break;
+                    case RR_CALL_CPU_MEM_UNMAP_ZERO:
+                    case RR_CALL_CPU_MEM_UNMAP_REF:
+                        callbytes = sizeof(args->variant.cpu_mem_unmap);
+                        break;
+                    case RR_CALL_DEDUP_RESET:
+                        callbytes = 0;
+                        break;
+                    case RR_CALL_CHECKSUM:
+                        callbytes = sizeof(args->variant.checksum_args);
+                        printf("\tchecksum: regs 0x%08x, %" PRIu64 " pages written in %" PRIu64 " instrs, mem 0x%08x\n",
+                            args->variant.checksum_args.regs,
+                            args->variant.checksum_args.pages,
+                            args->variant.checksum_args.instrs,
+                            args->variant.checksum_args.mem);
+                        break;
+                    case RR_CALL_CPU_SWITCH:
+                        callbytes = sizeof(args->variant.cpu_switch_args);
+                        printf("\tswitch to vCPU %u\n",
+                            args->variant.cpu_switch_args.cpu_index);
+                        break;
                     case RR_CALL_HD_TRANSFER:
                         callbytes = sizeof(args->variant.hd_transfer_args);
                         printf("This is a HD transfer. Source: 0x%lx, Dest: 0x%lx, Len: %d\n",
@@ -162,9 +210,9 @@ static RR_log_entry *rr_read_item(void) {
     assert (rr_nondet_log->fp != NULL);
 
     //mz XXX we assume that the log is not trucated - should probably fix this.
-    if (fread(&(item->header.prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp) != 1) {
+    if (log_fread(&(item->header.prog_point), sizeof(RR_prog_point), 1) != 1) {
         //mz an error occurred
-        if (feof(rr_nondet_log->fp)) {
+        if (rr_nondet_log->zlog || feof(rr_nondet_log->fp)) {
             // replay is done - we've reached the end of file
             //mz we should never get here!
             assert(0);
@@ -176,72 +224,87 @@ static RR_log_entry *rr_read_item(void) {
         }
     }
     //mz this is more compact, as it doesn't include extra padding.
-    assert(fread(&(item->header.kind), sizeof(item->header.kind), 1, rr_nondet_log->fp) == 1);
-    assert(fread(&(item->header.callsite_loc), sizeof(item->header.callsite_loc), 1, rr_nondet_log->fp) == 1);
+    assert(log_fread(&(item->header.kind), sizeof(item->header.kind), 1) == 1);
+    assert(log_fread(&(item->header.callsite_loc), sizeof(item->header.callsite_loc), 1) == 1);
 
     //mz read the rest of the item
     switch (item->header.kind) {
         case RR_INPUT_1:
-            assert(fread(&(item->variant.input_1), sizeof(item->variant.input_1), 1, rr_nondet_log->fp) == 1);
+            assert(log_fread(&(item->variant.input_1), sizeof(item->variant.input_1), 1) == 1);
             break;
         case RR_INPUT_2:
-            assert(fread(&(item->variant.input_2), sizeof(item->variant.input_2), 1, rr_nondet_log->fp) == 1);
+            assert(log_fread(&(item->variant.input_2), sizeof(item->variant.input_2), 1) == 1);
             break;
         case RR_INPUT_4:
-            assert(fread(&(item->variant.input_4), sizeof(item->variant.input_4), 1, rr_nondet_log->fp) == 1);
+            assert(log_fread(&(item->variant.input_4), sizeof(item->variant.input_4), 1) == 1);
             break;
         case RR_INPUT_8:
-            assert(fread(&(item->variant.input_8), sizeof(item->variant.input_8), 1, rr_nondet_log->fp) == 1);
+            assert(log_fread(&(item->variant.input_8), sizeof(item->variant.input_8), 1) == 1);
             break;
         case RR_INTERRUPT_REQUEST:
-            assert(fread(&(item->variant.interrupt_request), sizeof(item->variant.interrupt_request), 1, rr_nondet_log->fp) == 1);
+            assert(log_fread(&(item->variant.interrupt_request), sizeof(item->variant.interrupt_request), 1) == 1);
             break;
         case RR_EXIT_REQUEST:
-            assert(fread(&(item->variant.exit_request), sizeof(item->variant.exit_request), 1, rr_nondet_log->fp) == 1);
+            assert(log_fread(&(item->variant.exit_request), sizeof(item->variant.exit_request), 1) == 1);
             break;
         case RR_SKIPPED_CALL:
             {
                 RR_skipped_call_args *args = &item->variant.call_args;
                 //mz read kind first!
-                assert(fread(&(args->kind), sizeof(args->kind), 1, rr_nondet_log->fp) == 1);
+                assert(log_fread(&(args->kind), sizeof(args->kind), 1) == 1);
                 switch(args->kind) {
                     case RR_CALL_CPU_MEM_RW:
-                        assert(fread(&(args->variant.cpu_mem_rw_args), sizeof(args->variant.cpu_mem_rw_args), 1, rr_nondet_log->fp) == 1);
+                        assert(log_fread(&(args->variant.cpu_mem_rw_args), sizeof(args->variant.cpu_mem_rw_args), 1) == 1);
                         //mz buffer length in args->variant.cpu_mem_rw_args.len
                         //mz always allocate a new one. we free it when the item is added to the recycle list
                         //args->variant.cpu_mem_rw_args.buf = g_malloc(args->variant.cpu_mem_rw_args.len);
                         //mz read the buffer
                         //assert(fread(args->variant.cpu_mem_rw_args.buf, 1, args->variant.cpu_mem_rw_args.len, rr_nondet_log->fp) > 0);
-                        fseek(rr_nondet_log->fp, args->variant.cpu_mem_rw_args.len, SEEK_CUR);
+                        log_skip(args->variant.cpu_mem_rw_args.len);
                         break;
                     case RR_CALL_CPU_MEM_UNMAP:
-                        assert(fread(&(args->variant.cpu_mem_unmap), sizeof(args->variant.cpu_mem_unmap), 1, rr_nondet_log->fp) == 1);
+                        assert(log_fread(&(args->variant.cpu_mem_unmap), sizeof(args->variant.cpu_mem_unmap), 1) == 1);
                         //mz buffer length in args->variant.cpu_mem_unmap.len
                         //mz always allocate a new one. we free it when the item is added to the recycle list
                         //args->variant.cpu_mem_unmap.buf = g_malloc(args->variant.cpu_mem_unmap.len);
                         //mz read the buffer
                         //assert(fread(args->variant.cpu_mem_unmap.buf, 1, args->variant.cpu_mem_unmap.len, rr_nondet_log->fp) > 0);
-                        fseek(rr_nondet_log->fp, args->variant.cpu_mem_unmap.len, SEEK_CUR);
+                        log_skip(args->variant.cpu_mem_unmap.len);
                         break;
                     case RR_CALL_MEM_REGION_CHANGE:
-                        assert(fread(&(args->variant.mem_region_change_args),
-                            sizeof(args->variant.mem_region_change_args), 1,
-                            rr_nondet_log->fp) == 1);
-                        fseek(rr_nondet_log->fp, args->variant.mem_region_change_args.len, SEEK_CUR);
+                        assert(log_fread(&(args->variant.mem_region_change_args),
+                            sizeof(args->variant.mem_region_change_args), 1) == 1);
+                        log_skip(args->variant.mem_region_change_args.len);
                         break;
                     case RR_CALL_HD_TRANSFER:
-                        assert(fread(&(args->variant.hd_transfer_args),
-                              sizeof(args->variant.hd_transfer_args), 1, rr_nondet_log->fp) == 1);
+                        assert(log_fread(&(args->variant.hd_transfer_args),
+                              sizeof(args->variant.hd_transfer_args), 1) == 1);
                         break;
                     case RR_CALL_HANDLE_PACKET:
-                        assert(fread(&(args->variant.handle_packet_args),
-                              sizeof(args->variant.handle_packet_args), 1, rr_nondet_log->fp) == 1);
-                        fseek(rr_nondet_log->fp,
-                            args->variant.handle_packet_args.size, SEEK_CUR);
+                        assert(log_fread(&(args->variant.handle_packet_args),
+                              sizeof(args->variant.handle_packet_args), 1) == 1);
+                        log_skip(args->variant.handle_packet_args.size);
                         break;
                     case RR_CALL_NET_TRANSFER:
-                        assert(fread(&(args->variant.net_transfer_args),
-                              sizeof(args->variant.net_transfer_args), 1, rr_nondet_log->fp) == 1);
+                        assert(log_fread(&(args->variant.net_transfer_args),
+                              sizeof(args->variant.net_transfer_args), 1) == 1);
+                        break;
+                    case RR_CALL_CPU_MEM_RW_ZERO:
+                    case RR_CALL_CPU_MEM_RW_REF:
+                        //mz deduplicated payload, nothing follows
+                        assert(log_fread(&(args->variant.cpu_mem_rw_args), sizeof(args->variant.cpu_mem_rw_args), 1) == 1);
+                        break;
+                    case RR_CALL_CPU_MEM_UNMAP_ZERO:
+                    case RR_CALL_CPU_MEM_UNMAP_REF:
+                        assert(log_fread(&(args->variant.cpu_mem_unmap), sizeof(args->variant.cpu_mem_unmap), 1) == 1);
+                        break;
+                    case RR_CALL_DEDUP_RESET:
+                        break;
+                    case RR_CALL_CHECKSUM:
+                        assert(log_fread(&(args->variant.checksum_args), sizeof(args->variant.checksum_args), 1) == 1);
+                        break;
+                    case RR_CALL_CPU_SWITCH:
+                        assert(log_fread(&(args->variant.cpu_switch_args), sizeof(args->variant.cpu_switch_args), 1) == 1);
                         break;
                     default:
                         //mz unimplemented
@@ -282,6 +345,12 @@ void rr_create_replay_log (const char *filename) {
      rr_nondet_log->name, rr_nondet_log->size);
   //mz read the last program point from the log header.
   assert(fread(&(rr_nondet_log->last_prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp) == 1);
+  if (rr_zlog_is_compressed_header(rr_nondet_log->last_prog_point.pc)) {
+    rr_nondet_log->size = rr_nondet_log->last_prog_point.secondary;
+    rr_nondet_log->zlog = rr_zlog_open_read(rr_nondet_log->fp);
+    fprintf (stdout, "log is compressed.  len=%llu bytes uncompressed.\n",
+       rr_nondet_log->size);
+  }
 }
 
 int main(int argc, char **argv) {
@@ -0,0 +1,282 @@
+/*
+ * Block-compressed byte stream for record/replay nondet logs
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+
+#include <zlib.h>
+
+#include "panda/rr/rr_zlog.h"
+
+// mz number of blocks that may be waiting on the writer thread before the
+// emulation thread has to wait for it.
+#define RR_ZLOG_NUM_BLOCKS 4
+
+typedef struct {
+    uint8_t *data;
+    uint32_t len;
+    bool ready; // full and owned by the writer thread
+} RR_zlog_block;
+
+typedef struct {
+    uint32_t raw_len;
+    uint32_t comp_len;
+} RR_zlog_frame;
+
+struct RR_zlog {
+    FILE *fp;
+    bool writing;
+    size_t block_size;
+    uint64_t total_raw;
+    uint64_t total_comp;
+
+    // write side
+    int level;
+    RR_zlog_block blocks[RR_ZLOG_NUM_BLOCKS];
+    int head; // block being filled by the emulation thread
+    int tail; // next block the writer thread will compress
+    bool stopping;
+    bool error;
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+
+    // read side
+    uint8_t *raw;
+    uint32_t raw_len;
+    uint32_t raw_pos;
+    uint8_t *comp;
+    size_t comp_cap;
+    bool eof;
+};
+
+static bool rr_zlog_write_frame(RR_zlog *zl, uint8_t *out, size_t out_cap,
+                                const RR_zlog_block *block)
+{
+    RR_zlog_frame frame;
+    uLongf comp_len = out_cap;
+
+    if (compress2(out, &comp_len, block->data, block->len, zl->level) != Z_OK) {
+        return false;
+    }
+    frame.raw_len = block->len;
+    frame.comp_len = comp_len;
+    if (fwrite(&frame, sizeof(frame), 1, zl->fp) != 1 ||
+        fwrite(out, 1, comp_len, zl->fp) != comp_len) {
+        return false;
+    }
+    zl->total_comp += sizeof(frame) + comp_len;
+    return true;
+}
+
+static void *rr_zlog_writer_thread(void *opaque)
+{
+    RR_zlog *zl = opaque;
+    size_t out_cap = compressBound(zl->block_size);
+    uint8_t *out = g_malloc(out_cap);
+
+    qemu_mutex_lock(&zl->lock);
+    for (;;) {
+        RR_zlog_block *block = &zl->blocks[zl->tail];
+        while (!block->ready && !zl->stopping) {
+            qemu_cond_wait(&zl->cond, &zl->lock);
+        }
+        if (!block->ready) {
+            // stopping and nothing left to drain
+            break;
+        }
+        qemu_mutex_unlock(&zl->lock);
+
+        bool ok = rr_zlog_write_frame(zl, out, out_cap, block);
+
+        qemu_mutex_lock(&zl->lock);
+        if (!ok) {
+            zl->error = true;
+        }
+        block->len = 0;
+        block->ready = false;
+        zl->tail = (zl->tail + 1) % RR_ZLOG_NUM_BLOCKS;
+        qemu_cond_broadcast(&zl->cond);
+    }
+    qemu_mutex_unlock(&zl->lock);
+
+    g_free(out);
+    return NULL;
+}
+
+// hand the current block to the writer thread and wait for the next one to
+// become free.  Called with zl->lock not held.
+static void rr_zlog_submit_block(RR_zlog *zl)
+{
+    qemu_mutex_lock(&zl->lock);
+    zl->blocks[zl->head].ready = true;
+    zl->head = (zl->head + 1) % RR_ZLOG_NUM_BLOCKS;
+    qemu_cond_broadcast(&zl->cond);
+    while (zl->blocks[zl->head].ready) {
+        qemu_cond_wait(&zl->cond, &zl->lock);
+    }
+    qemu_mutex_unlock(&zl->lock);
+}
+
+RR_zlog *rr_zlog_open_write(FILE *fp, size_t block_size, int level)
+{
+    RR_zlog *zl = g_new0(RR_zlog, 1);
+    int i;
+
+    zl->fp = fp;
+    zl->writing = true;
+    zl->block_size = block_size ? block_size : RR_ZLOG_DEFAULT_BLOCK_SIZE;
+    zl->level = level;
+    for (i = 0; i < RR_ZLOG_NUM_BLOCKS; i++) {
+        zl->blocks[i].data = g_malloc(zl->block_size);
+    }
+    qemu_mutex_init(&zl->lock);
+    qemu_cond_init(&zl->cond);
+    qemu_thread_create(&zl->thread, "rr_zlog_writer", rr_zlog_writer_thread,
+                       zl, QEMU_THREAD_JOINABLE);
+    return zl;
+}
+
+RR_zlog *rr_zlog_open_read(FILE *fp)
+{
+    RR_zlog *zl = g_new0(RR_zlog, 1);
+
+    zl->fp = fp;
+    zl->writing = false;
+    return zl;
+}
+
+size_t rr_zlog_write(RR_zlog *zl, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    size_t remaining = len;
+
+    assert(zl->writing);
+    while (remaining > 0) {
+        RR_zlog_block *block = &zl->blocks[zl->head];
+        size_t n = MIN(remaining, zl->block_size - block->len);
+
+        memcpy(block->data + block->len, p, n);
+        block->len += n;
+        p += n;
+        remaining -= n;
+        if (block->len == zl->block_size) {
+            rr_zlog_submit_block(zl);
+        }
+    }
+    zl->total_raw += len;
+    return len;
+}
+
+// mz decompress the next frame into zl->raw.  returns false at end of stream
+static bool rr_zlog_fill(RR_zlog *zl)
+{
+    RR_zlog_frame frame;
+    uLongf raw_len;
+
+    if (zl->eof) {
+        return false;
+    }
+    if (fread(&frame, sizeof(frame), 1, zl->fp) != 1) {
+        zl->eof = true;
+        return false;
+    }
+    if (frame.comp_len > zl->comp_cap) {
+        zl->comp_cap = frame.comp_len;
+        zl->comp = g_realloc(zl->comp, zl->comp_cap);
+    }
+    if (frame.raw_len > zl->block_size) {
+        zl->block_size = frame.raw_len;
+        zl->raw = g_realloc(zl->raw, zl->block_size);
+    }
+    if (fread(zl->comp, 1, frame.comp_len, zl->fp) != frame.comp_len) {
+        zl->eof = true;
+        return false;
+    }
+    raw_len = frame.raw_len;
+    if (uncompress(zl->raw, &raw_len, zl->comp, frame.comp_len) != Z_OK ||
+        raw_len != frame.raw_len) {
+        fprintf(stderr, "rr_zlog: corrupt frame at offset %ld\n",
+                ftell(zl->fp));
+        zl->eof = true;
+        return false;
+    }
+    zl->total_comp += sizeof(frame) + frame.comp_len;
+    zl->raw_len = frame.raw_len;
+    zl->raw_pos = 0;
+    return true;
+}
+
+static size_t rr_zlog_consume(RR_zlog *zl, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    size_t done = 0;
+
+    assert(!zl->writing);
+    while (done < len) {
+        if (zl->raw_pos == zl->raw_len && !rr_zlog_fill(zl)) {
+            break;
+        }
+        size_t n = MIN(len - done, zl->raw_len - zl->raw_pos);
+        if (p) {
+            memcpy(p + done, zl->raw + zl->raw_pos, n);
+        }
+        zl->raw_pos += n;
+        done += n;
+    }
+    zl->total_raw += done;
+    return done;
+}
+
+size_t rr_zlog_read(RR_zlog *zl, void *buf, size_t len)
+{
+    return rr_zlog_consume(zl, buf, len);
+}
+
+size_t rr_zlog_skip(RR_zlog *zl, size_t len)
+{
+    return rr_zlog_consume(zl, NULL, len);
+}
+
+uint64_t rr_zlog_tell(RR_zlog *zl)
+{
+    return zl->total_raw;
+}
+
+uint64_t rr_zlog_compressed_bytes(RR_zlog *zl)
+{
+    return zl->total_comp;
+}
+
+int rr_zlog_close(RR_zlog *zl)
+{
+    int ret = 0;
+    int i;
+
+    if (zl->writing) {
+        if (zl->blocks[zl->head].len > 0) {
+            rr_zlog_submit_block(zl);
+        }
+        qemu_mutex_lock(&zl->lock);
+        zl->stopping = true;
+        qemu_cond_broadcast(&zl->cond);
+        qemu_mutex_unlock(&zl->lock);
+        qemu_thread_join(&zl->thread);
+
+        ret = zl->error ? -1 : 0;
+        qemu_cond_destroy(&zl->cond);
+        qemu_mutex_destroy(&zl->lock);
+        for (i = 0; i < RR_ZLOG_NUM_BLOCKS; i++) {
+            g_free(zl->blocks[i].data);
+        }
+    } else {
+        g_free(zl->raw);
+        g_free(zl->comp);
+    }
+    g_free(zl);
+    return ret;
+}
@@ -28,7 +28,9 @@
 #include "qapi/qobject-output-visitor.h"
 #include "qapi/qmp/qerror.h"
 #include "qapi/qmp/qjson.h"
+#include "qapi/qmp/types.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "qemu/config-file.h"
 #include "qemu/option.h"
 #include "qemu/error-report.h"
@@ -1446,6 +1448,8 @@ enum ImgConvertBlockStatus {
     BLK_BACKING_FILE,
 };
 
+#define MAX_COROUTINES 16
+
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1453,24 +1457,36 @@ typedef struct ImgConvertState {
     int64_t src_cur_offset;
     int64_t total_sectors;
     int64_t allocated_sectors;
+    int64_t allocated_done;
+    int64_t sector_num;
+    int64_t wr_offs;
     enum ImgConvertBlockStatus status;
     int64_t sector_next_status;
     BlockBackend *target;
     bool has_zero_init;
     bool compressed;
     bool target_has_backing;
+    bool wr_in_order;
     int min_sparse;
     size_t cluster_sectors;
     size_t buf_sectors;
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+    CoMutex lock;
+    int ret;
 } ImgConvertState;
 
-static void convert_select_part(ImgConvertState *s, int64_t sector_num)
+static void convert_select_part(ImgConvertState *s, int64_t sector_num,
+                                int *src_cur, int64_t *src_cur_offset)
 {
-    assert(sector_num >= s->src_cur_offset);
-    while (sector_num - s->src_cur_offset >= s->src_sectors[s->src_cur]) {
-        s->src_cur_offset += s->src_sectors[s->src_cur];
-        s->src_cur++;
-        assert(s->src_cur < s->src_num);
+    *src_cur = 0;
+    *src_cur_offset = 0;
+    while (sector_num - *src_cur_offset >= s->src_sectors[*src_cur]) {
+        *src_cur_offset += s->src_sectors[*src_cur];
+        (*src_cur)++;
+        assert(*src_cur < s->src_num);
     }
 }
 
@@ -1479,7 +1495,7 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     int64_t ret;
     int n;
 
-    convert_select_part(s, sector_num);
+    convert_select_part(s, sector_num, &s->src_cur, &s->src_cur_offset);
 
     assert(s->total_sectors > sector_num);
     n = MIN(s->total_sectors - sector_num, BDRV_REQUEST_MAX_SECTORS);
@@ -1542,28 +1558,34 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     return n;
 }
 
-static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
-                        uint8_t *buf)
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
 {
-    int n;
-    int ret;
+    int n, ret;
+    QEMUIOVector qiov;
+    struct iovec iov;
 
     assert(nb_sectors <= s->buf_sectors);
     while (nb_sectors > 0) {
         BlockBackend *blk;
-        int64_t bs_sectors;
+        int src_cur;
+        int64_t bs_sectors, src_cur_offset;
 
         /* In the case of compression with multiple source files, we can get a
          * nb_sectors that spreads into the next part. So we must be able to
          * read across multiple BDSes for one convert_read() call. */
-        convert_select_part(s, sector_num);
-        blk = s->src[s->src_cur];
-        bs_sectors = s->src_sectors[s->src_cur];
-
-        n = MIN(nb_sectors, bs_sectors - (sector_num - s->src_cur_offset));
-        ret = blk_pread(blk,
-                        (sector_num - s->src_cur_offset) << BDRV_SECTOR_BITS,
-                        buf, n << BDRV_SECTOR_BITS);
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        blk = s->src[src_cur];
+        bs_sectors = s->src_sectors[src_cur];
+
+        n = MIN(nb_sectors, bs_sectors - (sector_num - src_cur_offset));
+        iov.iov_base = buf;
+        iov.iov_len = n << BDRV_SECTOR_BITS;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = blk_co_preadv(
+                blk, (sector_num - src_cur_offset) << BDRV_SECTOR_BITS,
+                n << BDRV_SECTOR_BITS, &qiov, 0);
         if (ret < 0) {
             return ret;
         }
@@ -1576,15 +1598,18 @@ static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     return 0;
 }
 
-static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
-                         const uint8_t *buf)
+static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
+                                         int nb_sectors, uint8_t *buf,
+                                         enum ImgConvertBlockStatus status)
 {
     int ret;
+    QEMUIOVector qiov;
+    struct iovec iov;
 
     while (nb_sectors > 0) {
         int n = nb_sectors;
 
-        switch (s->status) {
+        switch (status) {
         case BLK_BACKING_FILE:
             /* If we have a backing file, leave clusters unallocated that are
              * unallocated in the source image, so that the backing file is
@@ -1605,9 +1630,13 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
                     break;
                 }
 
-                ret = blk_pwrite_compressed(s->target,
-                                            sector_num << BDRV_SECTOR_BITS,
-                                            buf, n << BDRV_SECTOR_BITS);
+                iov.iov_base = buf;
+                iov.iov_len = n << BDRV_SECTOR_BITS;
+                qemu_iovec_init_external(&qiov, &iov, 1);
+
+                ret = blk_co_pwritev(s->target, sector_num << BDRV_SECTOR_BITS,
+                                     n << BDRV_SECTOR_BITS, &qiov,
+                                     BDRV_REQ_WRITE_COMPRESSED);
                 if (ret < 0) {
                     return ret;
                 }
@@ -1620,8 +1649,12 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
             if (!s->min_sparse ||
                 is_allocated_sectors_min(buf, n, &n, s->min_sparse))
             {
-                ret = blk_pwrite(s->target, sector_num << BDRV_SECTOR_BITS,
-                                 buf, n << BDRV_SECTOR_BITS, 0);
+                iov.iov_base = buf;
+                iov.iov_len = n << BDRV_SECTOR_BITS;
+                qemu_iovec_init_external(&qiov, &iov, 1);
+
+                ret = blk_co_pwritev(s->target, sector_num << BDRV_SECTOR_BITS,
+                                     n << BDRV_SECTOR_BITS, &qiov, 0);
                 if (ret < 0) {
                     return ret;
                 }
@@ -1633,8 +1666,9 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
             if (s->has_zero_init) {
                 break;
             }
-            ret = blk_pwrite_zeroes(s->target, sector_num << BDRV_SECTOR_BITS,
-                                    n << BDRV_SECTOR_BITS, 0);
+            ret = blk_co_pwrite_zeroes(s->target,
+                                       sector_num << BDRV_SECTOR_BITS,
+                                       n << BDRV_SECTOR_BITS, 0);
             if (ret < 0) {
                 return ret;
             }
@@ -1649,12 +1683,118 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     return 0;
 }
 
-static int convert_do_copy(ImgConvertState *s)
+static void coroutine_fn convert_co_do_copy(void *opaque)
 {
+    ImgConvertState *s = opaque;
     uint8_t *buf = NULL;
-    int64_t sector_num, allocated_done;
-    int ret;
-    int n;
+    int ret, i;
+    int index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    s->running_coroutines++;
+    buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    while (1) {
+        int n;
+        int64_t sector_num;
+        enum ImgConvertBlockStatus status;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        n = convert_iteration_sectors(s, s->sector_num);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            s->ret = n;
+            break;
+        }
+        /* Save the current sector and allocation status, and move the global
+         * position on so that other coroutines can already continue reading
+         * beyond this request */
+        sector_num = s->sector_num;
+        status = s->status;
+        if (!s->min_sparse && s->status == BLK_ZERO) {
+            n = MIN(n, s->buf_sectors);
+        }
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (status == BLK_DATA || (!s->min_sparse && status == BLK_ZERO)) {
+            s->allocated_done += n;
+            qemu_progress_print(100.0 * s->allocated_done /
+                                        s->allocated_sectors, 0);
+        }
+
+        if (status == BLK_DATA) {
+            ret = convert_co_read(s, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+            }
+        } else if (!s->min_sparse && status == BLK_ZERO) {
+            status = BLK_DATA;
+            memset(buf, 0x00, n * BDRV_SECTOR_SIZE);
+        }
+
+        if (s->wr_in_order) {
+            /* keep writes in order */
+            while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+        }
+
+        if (s->ret == -EINPROGRESS) {
+            ret = convert_co_write(s, sector_num, n, buf, status);
+            if (ret < 0) {
+                error_report("error while writing sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* reenter the coroutine that might have waited
+             * for this write to complete */
+            s->wr_offs = sector_num + n;
+            for (i = 0; i < s->num_coroutines; i++) {
+                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+                    /*
+                     * A -> B -> A cannot occur because A has
+                     * s->wait_sector_num[i] == -1 during A -> B.  Therefore
+                     * B will never enter A during this time window.
+                     */
+                    qemu_coroutine_enter(s->co[i]);
+                    break;
+                }
+            }
+        }
+    }
+
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        /* the convert job finished successfully */
+        s->ret = 0;
+    }
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int ret, i, n;
+    int64_t sector_num = 0;
 
     /* Check whether we have zero initialisation or can get it efficiently */
     s->has_zero_init = s->min_sparse && !s->target_has_backing
@@ -1675,21 +1815,15 @@ static int convert_do_copy(ImgConvertState *s)
     if (s->compressed) {
         if (s->cluster_sectors <= 0 || s->cluster_sectors > s->buf_sectors) {
             error_report("invalid cluster size");
-            ret = -EINVAL;
-            goto fail;
+            return -EINVAL;
         }
         s->buf_sectors = s->cluster_sectors;
     }
-    buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
 
-    /* Calculate allocated sectors for progress */
-    s->allocated_sectors = 0;
-    sector_num = 0;
     while (sector_num < s->total_sectors) {
         n = convert_iteration_sectors(s, sector_num);
         if (n < 0) {
-            ret = n;
-            goto fail;
+            return n;
         }
         if (s->status == BLK_DATA || (!s->min_sparse && s->status == BLK_ZERO))
         {
@@ -1699,61 +1833,29 @@ static int convert_do_copy(ImgConvertState *s)
     }
 
     /* Do the copy */
-    s->src_cur = 0;
-    s->src_cur_offset = 0;
     s->sector_next_status = 0;
+    s->ret = -EINPROGRESS;
 
-    sector_num = 0;
-    allocated_done = 0;
-
-    while (sector_num < s->total_sectors) {
-        n = convert_iteration_sectors(s, sector_num);
-        if (n < 0) {
-            ret = n;
-            goto fail;
-        }
-        if (s->status == BLK_DATA || (!s->min_sparse && s->status == BLK_ZERO))
-        {
-            allocated_done += n;
-            qemu_progress_print(100.0 * allocated_done / s->allocated_sectors,
-                                0);
-        }
-
-        if (s->status == BLK_DATA) {
-            ret = convert_read(s, sector_num, n, buf);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64
-                             ": %s", sector_num, strerror(-ret));
-                goto fail;
-            }
-        } else if (!s->min_sparse && s->status == BLK_ZERO) {
-            n = MIN(n, s->buf_sectors);
-            memset(buf, 0, n * BDRV_SECTOR_SIZE);
-            s->status = BLK_DATA;
-        }
-
-        ret = convert_write(s, sector_num, n, buf);
-        if (ret < 0) {
-            error_report("error while writing sector %" PRId64
-                         ": %s", sector_num, strerror(-ret));
-            goto fail;
-        }
+    qemu_co_mutex_init(&s->lock);
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy, s);
+        s->wait_sector_num[i] = -1;
+        qemu_coroutine_enter(s->co[i]);
+    }
 
-        sector_num += n;
+    while (s->running_coroutines) {
+        main_loop_wait(false);
     }
 
-    if (s->compressed) {
+    if (s->ret == 0 && s->compressed) {
         /* signal EOF to align */
         ret = blk_pwrite_compressed(s->target, 0, NULL, 0);
         if (ret < 0) {
-            goto fail;
+            return ret;
         }
     }
 
-    ret = 0;
-fail:
-    qemu_vfree(buf);
-    return ret;
+    return s->ret;
 }
 
 static int img_convert(int argc, char **argv)
@@ -1781,6 +1883,8 @@ static int img_convert(int argc, char **argv)
     QemuOpts *sn_opts = NULL;
     ImgConvertState state;
     bool image_opts = false;
+    bool wr_in_order = true;
+    long num_coroutines = 8;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -1796,7 +1900,7 @@ static int img_convert(int argc, char **argv)
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qn",
+        c = getopt_long(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qnm:W",
                         long_options, NULL);
         if (c == -1) {
             break;
@@ -1888,6 +1992,18 @@ static int img_convert(int argc, char **argv)
         case 'n':
             skip_create = 1;
             break;
+        case 'm':
+            if (qemu_strtol(optarg, NULL, 0, &num_coroutines) ||
+                num_coroutines < 1 || num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                ret = -1;
+                goto fail_getopt;
+            }
+            break;
+        case 'W':
+            wr_in_order = false;
+            break;
         case OPTION_OBJECT:
             opts = qemu_opts_parse_noisily(&qemu_object_opts,
                                            optarg, true);
@@ -1901,6 +2017,12 @@ static int img_convert(int argc, char **argv)
         }
     }
 
+    if (!wr_in_order && compress) {
+        error_report("Out of order write and compress are mutually exclusive");
+        ret = -1;
+        goto fail_getopt;
+    }
+
     if (qemu_opts_foreach(&qemu_object_opts,
                           user_creatable_add_opts_foreach,
                           NULL, NULL)) {
@@ -2147,6 +2269,8 @@ static int img_convert(int argc, char **argv)
         .min_sparse         = min_sparse,
         .cluster_sectors    = cluster_sectors,
         .buf_sectors        = bufsectors,
+        .wr_in_order        = wr_in_order,
+        .num_coroutines     = num_coroutines,
     };
     ret = convert_do_copy(&state);
 
@@ -3488,7 +3612,99 @@ out_no_progress:
     return 0;
 }
 
-typedef struct BenchData {
+/*
+ * Latency histogram with HDR-style log-linear buckets: values below
+ * BENCH_HIST_SUB get a bucket each, every power of two above that is split
+ * into BENCH_HIST_SUB buckets, so any bucket is within 1/BENCH_HIST_SUB of
+ * the values in it.
+ */
+#define BENCH_HIST_SUB_BITS 4
+#define BENCH_HIST_SUB (1 << BENCH_HIST_SUB_BITS)
+#define BENCH_HIST_BUCKETS ((64 - BENCH_HIST_SUB_BITS + 1) * BENCH_HIST_SUB)
+
+/* Most depths or buffer sizes that one run can sweep */
+#define BENCH_MAX_SWEEP 16
+
+typedef struct BenchHistogram {
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+    uint64_t buckets[BENCH_HIST_BUCKETS];
+} BenchHistogram;
+
+static int bench_hist_index(uint64_t v)
+{
+    int e;
+
+    if (v < BENCH_HIST_SUB) {
+        return v;
+    }
+    e = 63 - clz64(v);
+    return (e - BENCH_HIST_SUB_BITS + 1) * BENCH_HIST_SUB
+           + ((v >> (e - BENCH_HIST_SUB_BITS)) & (BENCH_HIST_SUB - 1));
+}
+
+/* Smallest value that goes into bucket i */
+static uint64_t bench_hist_lower(int i)
+{
+    int e = i / BENCH_HIST_SUB + BENCH_HIST_SUB_BITS - 1;
+
+    if (i < BENCH_HIST_SUB) {
+        return i;
+    }
+    return (uint64_t)(BENCH_HIST_SUB + i % BENCH_HIST_SUB)
+           << (e - BENCH_HIST_SUB_BITS);
+}
+
+static void bench_hist_add(BenchHistogram *h, uint64_t v)
+{
+    if (h->count == 0 || v < h->min) {
+        h->min = v;
+    }
+    if (v > h->max) {
+        h->max = v;
+    }
+    h->count++;
+    h->sum += v;
+    h->buckets[bench_hist_index(v)]++;
+}
+
+/*
+ * Value at or below which the fraction q of the samples lie, as the highest
+ * value of its bucket
+ */
+static uint64_t bench_hist_quantile(BenchHistogram *h, double q)
+{
+    uint64_t rank = q * h->count;
+    uint64_t seen = 0;
+    int i;
+
+    if (rank >= h->count) {
+        return h->max;
+    }
+    for (i = 0; i < BENCH_HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > rank) {
+            uint64_t high = i + 1 < BENCH_HIST_BUCKETS
+                            ? bench_hist_lower(i + 1) - 1 : UINT64_MAX;
+            return MIN(high, h->max);
+        }
+    }
+    return h->max;
+}
+
+typedef struct BenchData BenchData;
+
+/* One of the depth request slots, with its own part of the buffer */
+typedef struct BenchRequest {
+    BenchData *b;
+    QEMUIOVector qiov;
+    int64_t start_ns;
+    struct BenchRequest *next_free;
+} BenchRequest;
+
+struct BenchData {
     BlockBackend *blk;
     uint64_t image_size;
     bool write;
@@ -3499,12 +3715,16 @@ typedef struct BenchData {
     int flush_interval;
     bool drain_on_flush;
     uint8_t *buf;
-    QEMUIOVector *qiov;
+    BenchRequest *reqs;
+    BenchRequest *free_reqs;
 
     int in_flight;
     bool in_flush;
     uint64_t offset;
-} BenchData;
+    BenchHistogram hist;
+};
+
+static void bench_cb(void *opaque, int ret);
 
 static void bench_undrained_flush_cb(void *opaque, int ret)
 {
@@ -3514,6 +3734,17 @@ static void bench_undrained_flush_cb(void *opaque, int ret)
     }
 }
 
+static void bench_req_cb(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    BenchData *b = req->b;
+
+    bench_hist_add(&b->hist, get_clock() - req->start_ns);
+    req->next_free = b->free_reqs;
+    b->free_reqs = req;
+    bench_cb(b, ret);
+}
+
 static void bench_cb(void *opaque, int ret)
 {
     BenchData *b = opaque;
@@ -3559,12 +3790,16 @@ static void bench_cb(void *opaque, int ret)
     }
 
     while (b->n > b->in_flight && b->in_flight < b->nrreq) {
+        BenchRequest *req = b->free_reqs;
+
+        b->free_reqs = req->next_free;
+        req->start_ns = get_clock();
         if (b->write) {
-            acb = blk_aio_pwritev(b->blk, b->offset, b->qiov, 0,
-                                  bench_cb, b);
+            acb = blk_aio_pwritev(b->blk, b->offset, &req->qiov, 0,
+                                  bench_req_cb, req);
         } else {
-            acb = blk_aio_preadv(b->blk, b->offset, b->qiov, 0,
-                                 bench_cb, b);
+            acb = blk_aio_preadv(b->blk, b->offset, &req->qiov, 0,
+                                 bench_req_cb, req);
         }
         if (!acb) {
             error_report("Failed to issue request");
@@ -3576,6 +3811,143 @@ static void bench_cb(void *opaque, int ret)
     }
 }
 
+/* Parse a comma-separated list of sizes or counts for a sweep */
+static int bench_parse_list(const char *arg, bool sizes, int *vals)
+{
+    char **items = g_strsplit(arg, ",", -1);
+    int n = 0;
+    int i;
+
+    for (i = 0; items[i]; i++) {
+        int64_t val;
+        char *end;
+
+        if (n == BENCH_MAX_SWEEP) {
+            n = -1;
+            break;
+        }
+        errno = 0;
+        if (sizes) {
+            val = qemu_strtosz_suffix(items[i], &end, QEMU_STRTOSZ_DEFSUFFIX_B);
+        } else {
+            val = strtol(items[i], &end, 0);
+        }
+        if (errno || val <= 0 || val > INT_MAX || *end || end == items[i]) {
+            n = -1;
+            break;
+        }
+        vals[n++] = val;
+    }
+    g_strfreev(items);
+    return n ?: -1;
+}
+
+/* Run one pass of the sweep; returns its wall time in seconds */
+static double bench_run(BenchData *data, int pattern)
+{
+    int64_t t1, t2;
+    int i;
+
+    data->buf = blk_blockalign(data->blk, data->nrreq * data->bufsize);
+    memset(data->buf, pattern, data->nrreq * data->bufsize);
+
+    data->reqs = g_new0(BenchRequest, data->nrreq);
+    data->free_reqs = NULL;
+    for (i = data->nrreq - 1; i >= 0; i--) {
+        BenchRequest *req = &data->reqs[i];
+        req->b = data;
+        qemu_iovec_init(&req->qiov, 1);
+        qemu_iovec_add(&req->qiov,
+                       data->buf + i * data->bufsize, data->bufsize);
+        req->next_free = data->free_reqs;
+        data->free_reqs = req;
+    }
+
+    t1 = get_clock();
+    bench_cb(data, 0);
+
+    while (data->n > 0) {
+        main_loop_wait(false);
+    }
+    t2 = get_clock();
+
+    for (i = 0; i < data->nrreq; i++) {
+        qemu_iovec_destroy(&data->reqs[i].qiov);
+    }
+    g_free(data->reqs);
+    data->reqs = NULL;
+    qemu_vfree(data->buf);
+    data->buf = NULL;
+
+    return (t2 - t1) / 1e9;
+}
+
+static const struct {
+    const char *name;
+    double q;
+} bench_quantiles[] = {
+    { "p50", 0.5 },
+    { "p90", 0.9 },
+    { "p99", 0.99 },
+    { "p99.9", 0.999 },
+};
+
+static void bench_dump_human(BenchData *data, int count, double secs)
+{
+    BenchHistogram *h = &data->hist;
+    int i;
+
+    printf("Run completed in %3.3f seconds.\n", secs);
+    printf("%.0f IOPS, %.2f MiB/s\n", count / secs,
+           (double)count * data->bufsize / secs / (1024 * 1024));
+    printf("Latency (us): min %.1f, mean %.1f", h->min / 1e3,
+           h->sum / h->count / 1e3);
+    for (i = 0; i < ARRAY_SIZE(bench_quantiles); i++) {
+        printf(", %s %.1f", bench_quantiles[i].name,
+               bench_hist_quantile(h, bench_quantiles[i].q) / 1e3);
+    }
+    printf(", max %.1f\n", h->max / 1e3);
+}
+
+static QDict *bench_dump_json(BenchData *data, int count, double secs)
+{
+    BenchHistogram *h = &data->hist;
+    QDict *res = qdict_new();
+    QDict *lat = qdict_new();
+    QList *hist = qlist_new();
+    int i;
+
+    qdict_put(res, "write", qbool_from_bool(data->write));
+    qdict_put(res, "depth", qint_from_int(data->nrreq));
+    qdict_put(res, "buffer-size", qint_from_int(data->bufsize));
+    qdict_put(res, "count", qint_from_int(count));
+    qdict_put(res, "seconds", qfloat_from_double(secs));
+    qdict_put(res, "iops", qfloat_from_double(count / secs));
+    qdict_put(res, "bytes-per-second",
+              qfloat_from_double((double)count * data->bufsize / secs));
+
+    qdict_put(lat, "min", qint_from_int(h->min));
+    qdict_put(lat, "mean", qfloat_from_double(h->sum / h->count));
+    for (i = 0; i < ARRAY_SIZE(bench_quantiles); i++) {
+        qdict_put(lat, bench_quantiles[i].name,
+                  qint_from_int(bench_hist_quantile(h, bench_quantiles[i].q)));
+    }
+    qdict_put(lat, "max", qint_from_int(h->max));
+    qdict_put(res, "latency-ns", lat);
+
+    /* Only the buckets that have samples, as [lowest value, count] */
+    for (i = 0; i < BENCH_HIST_BUCKETS; i++) {
+        if (h->buckets[i]) {
+            QList *bucket = qlist_new();
+            qlist_append(bucket, qint_from_int(bench_hist_lower(i)));
+            qlist_append(bucket, qint_from_int(h->buckets[i]));
+            qlist_append(hist, bucket);
+        }
+    }
+    qdict_put(res, "histogram", hist);
+    return res;
+}
+
 static int img_bench(int argc, char **argv)
 {
     int c, ret = 0;
@@ -3584,9 +3956,11 @@ static int img_bench(int argc, char **argv)
     bool image_opts = false;
     bool is_write = false;
     int count = 75000;
-    int depth = 64;
+    int depths[BENCH_MAX_SWEEP] = { 64 };
+    int num_depths = 1;
     int64_t offset = 0;
-    size_t bufsize = 4096;
+    int bufsizes[BENCH_MAX_SWEEP] = { 4096 };
+    int num_bufsizes = 1;
     int pattern = 0;
     size_t step = 0;
     int flush_interval = 0;
@@ -3596,8 +3970,11 @@ static int img_bench(int argc, char **argv)
     BenchData data = {};
     int flags = 0;
     bool writethrough = false;
-    struct timeval t1, t2;
-    int i;
+    OutputFormat output_format = OFORMAT_HUMAN;
+    const char *output = NULL;
+    QList *results = NULL;
+    int min_depth;
+    int i, j;
 
     for (;;) {
         static const struct option long_options[] = {
@@ -3606,6 +3983,7 @@ static int img_bench(int argc, char **argv)
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {"pattern", required_argument, 0, OPTION_PATTERN},
             {"no-drain", no_argument, 0, OPTION_NO_DRAIN},
+            {"output", required_argument, 0, OPTION_OUTPUT},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, "hc:d:f:no:qs:S:t:w", long_options, NULL);
@@ -3630,16 +4008,12 @@ static int img_bench(int argc, char **argv)
             break;
         }
         case 'd':
-        {
-            char *end;
-            errno = 0;
-            depth = strtoul(optarg, &end, 0);
-            if (errno || *end || depth > INT_MAX) {
+            num_depths = bench_parse_list(optarg, false, depths);
+            if (num_depths < 0) {
                 error_report("Invalid queue depth specified");
                 return 1;
             }
             break;
-        }
         case 'f':
             fmt = optarg;
             break;
@@ -3663,19 +4037,12 @@ static int img_bench(int argc, char **argv)
             quiet = true;
             break;
         case 's':
-        {
-            int64_t sval;
-            char *end;
-
-            sval = qemu_strtosz_suffix(optarg, &end, QEMU_STRTOSZ_DEFSUFFIX_B);
-            if (sval < 0 || sval > INT_MAX || *end) {
+            num_bufsizes = bench_parse_list(optarg, true, bufsizes);
+            if (num_bufsizes < 0) {
                 error_report("Invalid buffer size specified");
                 return 1;
             }
-
-            bufsize = sval;
             break;
-        }
         case 'S':
         {
             int64_t sval;
@@ -3730,6 +4097,9 @@ static int img_bench(int argc, char **argv)
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
+        case OPTION_OUTPUT:
+            output = optarg;
+            break;
         }
     }
 
@@ -3738,12 +4108,25 @@ static int img_bench(int argc, char **argv)
     }
     filename = argv[argc - 1];
 
+    if (output && !strcmp(output, "json")) {
+        output_format = OFORMAT_JSON;
+    } else if (output && !strcmp(output, "human")) {
+        output_format = OFORMAT_HUMAN;
+    } else if (output) {
+        error_report("--output must be used with human or json as argument.");
+        return 1;
+    }
+
     if (!is_write && flush_interval) {
         error_report("--flush-interval is only available in write tests");
         ret = -1;
         goto out;
     }
-    if (flush_interval && flush_interval < depth) {
+    min_depth = depths[0];
+    for (i = 1; i < num_depths; i++) {
+        min_depth = MIN(min_depth, depths[i]);
+    }
+    if (flush_interval && flush_interval < min_depth) {
         error_report("Flush interval can't be smaller than depth");
         ret = -1;
         goto out;
@@ -3761,50 +4144,56 @@ static int img_bench(int argc, char **argv)
         goto out;
     }
 
-    data = (BenchData) {
-        .blk            = blk,
-        .image_size     = image_size,
-        .bufsize        = bufsize,
-        .step           = step ?: bufsize,
-        .nrreq          = depth,
-        .n              = count,
-        .offset         = offset,
-        .write          = is_write,
-        .flush_interval = flush_interval,
-        .drain_on_flush = drain_on_flush,
-    };
-    printf("Sending %d %s requests, %d bytes each, %d in parallel "
-           "(starting at offset %" PRId64 ", step size %d)\n",
-           data.n, data.write ? "write" : "read", data.bufsize, data.nrreq,
-           data.offset, data.step);
-    if (flush_interval) {
-        printf("Sending flush every %d requests\n", flush_interval);
-    }
+    if (output_format == OFORMAT_JSON) {
+        results = qlist_new();
+    }
+
+    /* Every buffer size at every depth, each a run of its own */
+    for (i = 0; i < num_bufsizes; i++) {
+        for (j = 0; j < num_depths; j++) {
+            double secs;
+
+            data = (BenchData) {
+                .blk            = blk,
+                .image_size     = image_size,
+                .bufsize        = bufsizes[i],
+                .step           = step ?: bufsizes[i],
+                .nrreq          = depths[j],
+                .n              = count,
+                .offset         = offset,
+                .write          = is_write,
+                .flush_interval = flush_interval,
+                .drain_on_flush = drain_on_flush,
+            };
+            if (output_format == OFORMAT_HUMAN) {
+                printf("Sending %d %s requests, %d bytes each, %d in parallel "
+                       "(starting at offset %" PRId64 ", step size %d)\n",
+                       data.n, data.write ? "write" : "read", data.bufsize,
+                       data.nrreq, data.offset, data.step);
+                if (flush_interval) {
+                    printf("Sending flush every %d requests\n",
+                           flush_interval);
+                }
+            }
 
-    data.buf = blk_blockalign(blk, data.nrreq * data.bufsize);
-    memset(data.buf, pattern, data.nrreq * data.bufsize);
+            secs = bench_run(&data, pattern);
 
-    data.qiov = g_new(QEMUIOVector, data.nrreq);
-    for (i = 0; i < data.nrreq; i++) {
-        qemu_iovec_init(&data.qiov[i], 1);
-        qemu_iovec_add(&data.qiov[i],
-                       data.buf + i * data.bufsize, data.bufsize);
+            if (output_format == OFORMAT_JSON) {
+                qlist_append(results, bench_dump_json(&data, count, secs));
+            } else {
+                bench_dump_human(&data, count, secs);
+            }
+        }
     }
 
-    gettimeofday(&t1, NULL);
-    bench_cb(&data, 0);
-
-    while (data.n > 0) {
-        main_loop_wait(false);
+    if (results) {
+        QString *str = qobject_to_json_pretty(QOBJECT(results));
+        printf("%s\n", qstring_get_str(str));
+        QDECREF(str);
     }
-    gettimeofday(&t2, NULL);
-
-    printf("Run completed in %3.3f seconds.\n",
-           (t2.tv_sec - t1.tv_sec)
-           + ((double)(t2.tv_usec - t1.tv_usec) / 1000000));
 
 out:
-    qemu_vfree(data.buf);
+    QDECREF(results);
     blk_unref(blk);
 
     if (ret) {
@@ -36,6 +36,7 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                kernel_irqchip=on|off|split controls accelerated irqchip support (default=off)\n"
     "                vmport=on|off|auto controls emulation of vmport (default: auto)\n"
     "                kvm_shadow_mem=size of KVM shadow MMU in bytes\n"
+    "                kvm-dirty-ring-size=n track dirty pages in per-vCPU rings of n entries (default: 0, use the bitmap)\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
     "                mem-merge=on|off controls memory merge support (default: on)\n"
     "                igd-passthru=on|off controls IGD GFX passthrough support (default=off)\n"
@@ -66,6 +67,11 @@ value based on accel. For accel=xen the default is off otherwise the default
 is on.
 @item kvm_shadow_mem=size
 Defines the size of the KVM shadow MMU.
+@item kvm-dirty-ring-size=@var{n}
+Have KVM report dirty pages through a ring of @var{n} entries per vCPU
+instead of a bitmap per memory slot, so that dirty page tracking costs in
+proportion to the pages written rather than to the size of guest memory.
+@var{n} must be a power of two.  The default, 0, keeps using the bitmap.
 @item dump-guest-core=on|off
 Include guest memory in a core dump. The default is on.
 @item mem-merge=on|off
@@ -85,6 +91,24 @@ Enables or disables NVDIMM support. The default is off.
 @end table
 ETEXI
 
+DEF("accel", HAS_ARG, QEMU_OPTION_accel,
+    "-accel [accel=]accelerator[,thread=single|multi]\n"
+    "                select accelerator (kvm, xen or tcg)\n"
+    "                thread=single|multi (enable multi-threaded TCG)\n", QEMU_ARCH_ALL)
+STEXI
+@item -accel @var{name}[,prop=@var{value}[,...]]
+@findex -accel
+This is used to enable an accelerator. Depending on the target architecture,
+kvm, xen, or tcg can be available. By default, tcg is used.
+@table @option
+@item thread=single|multi
+Controls the number of TCG threads. When TCG is multi-threaded there will be
+one thread per vCPU, so guests with several vCPUs can use as many host CPUs.
+This is only available for x86 guests, and not together with -icount,
+record/replay, PANDA plugins or LLVM.
+@end table
+ETEXI
+
 HXCOMM Deprecated by -machine
 DEF("M", HAS_ARG, QEMU_OPTION_M, "", QEMU_ARCH_ALL)
 
@@ -518,7 +542,7 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,rerror=ignore|stop|report]\n"
-    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native]\n"
+    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native|io_uring]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
     "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
@@ -561,7 +585,7 @@ These options have the same definition as they have in @option{-hdachs}.
 @item cache=@var{cache}
 @var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native" or "io_uring" and selects between pthread based disk I/O, native Linux AIO and Linux io_uring.  Unlike native AIO, io_uring also works without @option{cache=none}.
 @item discard=@var{discard}
 @var{discard} is one of "ignore" (or "off") or "unmap" (or "on") and controls whether @dfn{discard} (also known as @dfn{trim} or @dfn{unmap}) requests are ignored or passed to the filesystem.  Some machine types may not support discard requests.
 @item format=@var{format}
@@ -3785,6 +3809,8 @@ the path to either a shared memory or huge page filesystem mount.
 The @option{share} boolean option determines whether the memory
 region is marked as private to QEMU, or shared. The latter allows
 a co-operating external process to access the QEMU memory region.
+With @option{prealloc=on}, the memory is allocated up front by
+@option{prealloc-threads} threads, by default one per guest CPU.
 
 @item -object rng-random,id=@var{id},filename=@var{/dev/random}
 
@@ -4052,20 +4078,114 @@ DEF("llvm", 0, QEMU_OPTION_execute_llvm,
     "-llvm           execute code using LLVM JIT\n", QEMU_ARCH_ALL)
 DEF("generate-llvm", 0, QEMU_OPTION_generate_llvm,
     "-generate-llvm  translate code into LLVM but don't execute it\n", QEMU_ARCH_ALL)
+DEF("llvm-tier", HAS_ARG, QEMU_OPTION_llvm_tier,
+    "-llvm-tier <n>  with -llvm, run each TB as TCG until it has run <n> times\n", QEMU_ARCH_ALL)
+DEF("llvm-trace", HAS_ARG, QEMU_OPTION_llvm_trace,
+    "-llvm-trace <n> with -llvm, compile chains of TBs that follow each other <n> times in a row into one function\n", QEMU_ARCH_ALL)
+DEF("llvm-async", 0, QEMU_OPTION_llvm_async,
+    "-llvm-async     generate LLVM code on a background thread, running TBs as TCG meanwhile\n", QEMU_ARCH_ALL)
+DEF("llvm-tb-cache", HAS_ARG, QEMU_OPTION_llvm_tb_cache,
+    "-llvm-tb-cache <n>\n"
+    "                keep up to <n> unused LLVM functions for retranslated TBs (0 = off)\n", QEMU_ARCH_ALL)
 #endif
 
 DEF("record-from", HAS_ARG, QEMU_OPTION_record_from,
     "-record-from <snapshot>\n"
     "                load snapshot <snapshot> and begin recording\n", QEMU_ARCH_ALL)
 
+DEF("record-compress", 0, QEMU_OPTION_record_compress,
+    "-record-compress\n"
+    "                write block-compressed nondet logs for new recordings\n", QEMU_ARCH_ALL)
+
+DEF("record-dedup", 0, QEMU_OPTION_record_dedup,
+    "-record-dedup\n"
+    "                store repeated DMA payloads once in new recordings\n", QEMU_ARCH_ALL)
+
+DEF("record-mapped-ram", 0, QEMU_OPTION_record_mapped_ram,
+    "-record-mapped-ram\n"
+    "                keep guest RAM of new recordings in images replay can map\n", QEMU_ARCH_ALL)
+
+DEF("record-packets", 0, QEMU_OPTION_record_packets,
+    "-record-packets\n"
+    "                log network packets and their place in guest RAM in new recordings\n", QEMU_ARCH_ALL)
+
+DEF("record-checkpoint-interval", HAS_ARG, QEMU_OPTION_record_checkpoint_interval,
+    "-record-checkpoint-interval <instructions>\n"
+    "                snapshot the guest every <instructions> while recording\n", QEMU_ARCH_ALL)
+
+DEF("record-checksum-interval", HAS_ARG, QEMU_OPTION_record_checksum_interval,
+    "-record-checksum-interval <instructions>\n"
+    "                log guest checksums every <instructions> for replay to check\n", QEMU_ARCH_ALL)
+
 DEF("replay", HAS_ARG, QEMU_OPTION_replay,
     "-replay </path/to/snapshot-prefix>\n"
     "                replay the recording that starts at <snapshot>\n", QEMU_ARCH_ALL)
 
+DEF("replay-start", HAS_ARG, QEMU_OPTION_replay_start,
+    "-replay-start <instruction>\n"
+    "                start replay at the last checkpoint before <instruction>\n", QEMU_ARCH_ALL)
+
+DEF("replay-end", HAS_ARG, QEMU_OPTION_replay_end,
+    "-replay-end <instruction>\n"
+    "                end replay once <instruction> instructions have executed\n", QEMU_ARCH_ALL)
+
+DEF("replay-fork", HAS_ARG, QEMU_OPTION_replay_fork,
+    "-replay-fork <instruction>:<file>[:<jobs>]\n"
+    "                replay up to <instruction> once, then fork a replay for each\n"
+    "                line of -panda plugins in <file>, <jobs> at a time\n", QEMU_ARCH_ALL)
+
+DEF("replay-stats", HAS_ARG, QEMU_OPTION_replay_stats,
+    "-replay-stats <instructions>\n"
+    "                write replay throughput counters to the pandalog every <instructions>\n", QEMU_ARCH_ALL)
+
+DEF("replay-stats-file", HAS_ARG, QEMU_OPTION_replay_stats_file,
+    "-replay-stats-file <file>\n"
+    "                write the replay counters (as query-rr-stats) to <file> as JSON\n"
+    "                when the replay ends\n", QEMU_ARCH_ALL)
+
+DEF("tb-profile", HAS_ARG, QEMU_OPTION_tb_profile,
+    "-tb-profile <us>\n"
+    "                count TB executions and chain exits, and sample where time goes\n"
+    "                every <us> microseconds of CPU time (see 'info tb-profile')\n", QEMU_ARCH_ALL)
+
+DEF("exec-stats", HAS_ARG, QEMU_OPTION_exec_stats,
+    "-exec-stats <file>\n"
+    "                count guest instructions, translations and helper calls, and\n"
+    "                write them to <file> as JSON at exit (see tests/tcg/bench)\n", QEMU_ARCH_ALL)
+
+DEF("tb-cache", HAS_ARG, QEMU_OPTION_tb_cache,
+    "-tb-cache <file>\n"
+    "                keep translated code in <file> and reuse it in later runs\n"
+    "                of the same QEMU binary and guest\n", QEMU_ARCH_ALL)
+
+DEF("tlb-asids", HAS_ARG, QEMU_OPTION_tlb_asids,
+    "-tlb-asids <n>\n"
+    "                keep the TLBs of up to <n> other address spaces across guest\n"
+    "                context switches (x86 PCID, ARM ASID) instead of flushing\n", QEMU_ARCH_ALL)
+
 DEF("pandalog", HAS_ARG, QEMU_OPTION_pandalog,
     "-pandalog <filename>\n"
     "                enable panda logging to file\n", QEMU_ARCH_ALL)
 
+DEF("pandalog-columns", HAS_ARG, QEMU_OPTION_pandalog_columns,
+    "-pandalog-columns <dir>\n"
+    "                also write pandalog entries to <dir> as one numpy file per field\n"
+    "                (on its own, instead of a pandalog)\n", QEMU_ARCH_ALL)
+
+DEF("pandalog-codec", HAS_ARG, QEMU_OPTION_pandalog_codec,
+    "-pandalog-codec zlib[:<level>]|none\n"
+    "                compress pandalog chunks with zlib (default level 9) or not at all\n", QEMU_ARCH_ALL)
+
+DEF("pandalog-threads", HAS_ARG, QEMU_OPTION_pandalog_threads,
+    "-pandalog-threads <n>\n"
+    "                compress and write pandalog chunks on <n> threads (default 2),\n"
+    "                or 0 to write them on the emulation thread\n", QEMU_ARCH_ALL)
+
+DEF("pandalog-mem", HAS_ARG, QEMU_OPTION_pandalog_mem,
+    "-pandalog-mem <MB>\n"
+    "                wait for the pandalog threads rather than let chunks waiting\n"
+    "                to be written hold more than <MB> megabytes\n", QEMU_ARCH_ALL)
+
 DEF("panda-plugin", HAS_ARG, QEMU_OPTION_panda_plugin,
     "-panda-plugin <file>\n"
     "                load PANDA plugin from <file>\n", QEMU_ARCH_ALL)
@@ -4074,6 +4194,18 @@ DEF("panda-arg", HAS_ARG, QEMU_OPTION_panda_arg,
     "-panda-arg <plugin:opt=val>\n"
     "                pass <opt=val> to <plugin>\n", QEMU_ARCH_ALL)
 
+DEF("panda-profile", 0, QEMU_OPTION_panda_profile,
+    "-panda-profile\n"
+    "                time plugin callbacks (see info rr-stats)\n", QEMU_ARCH_ALL)
+
+DEF("panda-start", HAS_ARG, QEMU_OPTION_panda_start,
+    "-panda-start <instr>\n"
+    "                keep plugins asleep until <instr> instructions have run\n", QEMU_ARCH_ALL)
+
+DEF("panda-end", HAS_ARG, QEMU_OPTION_panda_end,
+    "-panda-end <instr>\n"
+    "                put plugins to sleep again at <instr>\n", QEMU_ARCH_ALL)
+
 DEF("panda", HAS_ARG, QEMU_OPTION_panda_plugins,
     "-panda <plugin1_name:opt1=val1,opt2=val2;plugin2_name>\n"
     "               load <plugin1> with <opt1=val1> and <opt2=val2>; load <plugin2>\n"
@@ -73,7 +73,14 @@ static QEMUClock qemu_clocks[QEMU_CLOCK_MAX];
 struct QEMUTimerList {
     QEMUClock *clock;
     QemuMutex active_timers_lock;
-    QEMUTimer *active_timers;
+    /* Binary min-heap of the pending timers.  Timers with the same
+     * expire_time are ordered by when they were armed, so they fire in the
+     * same order as with a sorted list.
+     */
+    QEMUTimer **active_timers;
+    int nb_active_timers;
+    int active_timers_size;
+    uint64_t seq;
     QLIST_ENTRY(QEMUTimerList) list;
     QEMUTimerListNotifyCB *notify_cb;
     void *notify_opaque;
@@ -124,6 +131,7 @@ void timerlist_free(QEMUTimerList *timer_list)
         QLIST_REMOVE(timer_list, list);
     }
     qemu_mutex_destroy(&timer_list->active_timers_lock);
+    g_free(timer_list->active_timers);
     g_free(timer_list);
 }
 
@@ -180,7 +188,7 @@ void qemu_clock_enable(QEMUClockType type, bool enabled)
 
 bool timerlist_has_timers(QEMUTimerList *timer_list)
 {
-    return !!timer_list->active_timers;
+    return atomic_read(&timer_list->nb_active_timers) != 0;
 }
 
 bool qemu_clock_has_timers(QEMUClockType type)
@@ -194,11 +202,11 @@ bool timerlist_expired(QEMUTimerList *timer_list)
     int64_t expire_time;
 
     qemu_mutex_lock(&timer_list->active_timers_lock);
-    if (!timer_list->active_timers) {
+    if (!timer_list->nb_active_timers) {
         qemu_mutex_unlock(&timer_list->active_timers_lock);
         return false;
     }
-    expire_time = timer_list->active_timers->expire_time;
+    expire_time = timer_list->active_timers[0]->expire_time;
     qemu_mutex_unlock(&timer_list->active_timers_lock);
 
     return expire_time < qemu_clock_get_ns(timer_list->clock->type);
@@ -229,11 +237,11 @@ int64_t timerlist_deadline_ns(QEMUTimerList *timer_list)
      * the caller should notice the change and there is no race condition.
      */
     qemu_mutex_lock(&timer_list->active_timers_lock);
-    if (!timer_list->active_timers) {
+    if (!timer_list->nb_active_timers) {
         qemu_mutex_unlock(&timer_list->active_timers_lock);
         return -1;
     }
-    expire_time = timer_list->active_timers->expire_time;
+    expire_time = timer_list->active_timers[0]->expire_time;
     qemu_mutex_unlock(&timer_list->active_timers_lock);
 
     delta = expire_time - qemu_clock_get_ns(timer_list->clock->type);
@@ -358,43 +366,101 @@ void timer_free(QEMUTimer *ts)
     g_free(ts);
 }
 
-static void timer_del_locked(QEMUTimerList *timer_list, QEMUTimer *ts)
+static inline bool timer_before(QEMUTimer *a, QEMUTimer *b)
 {
-    QEMUTimer **pt, *t;
+    return a->expire_time < b->expire_time ||
+           (a->expire_time == b->expire_time && a->seq < b->seq);
+}
 
-    ts->expire_time = -1;
-    pt = &timer_list->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            *pt = t->next;
+static inline void timerlist_heap_set(QEMUTimerList *timer_list, int i,
+                                      QEMUTimer *ts)
+{
+    timer_list->active_timers[i] = ts;
+    ts->heap_index = i;
+}
+
+/* Put ts at position i of the heap, or closer to the root */
+static void timerlist_sift_up(QEMUTimerList *timer_list, int i, QEMUTimer *ts)
+{
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        QEMUTimer *t = timer_list->active_timers[parent];
+
+        if (!timer_before(ts, t)) {
             break;
         }
-        pt = &t->next;
+        timerlist_heap_set(timer_list, i, t);
+        i = parent;
     }
+    timerlist_heap_set(timer_list, i, ts);
 }
 
-static bool timer_mod_ns_locked(QEMUTimerList *timer_list,
-                                QEMUTimer *ts, int64_t expire_time)
+/* Put ts at position i of the heap, or further from the root */
+static void timerlist_sift_down(QEMUTimerList *timer_list, int i,
+                                QEMUTimer *ts)
 {
-    QEMUTimer **pt, *t;
+    int n = timer_list->nb_active_timers;
 
-    /* add the timer in the sorted list */
-    pt = &timer_list->active_timers;
     for (;;) {
-        t = *pt;
-        if (!timer_expired_ns(t, expire_time)) {
+        int child = 2 * i + 1;
+        QEMUTimer *t;
+
+        if (child >= n) {
             break;
         }
-        pt = &t->next;
+        t = timer_list->active_timers[child];
+        if (child + 1 < n &&
+            timer_before(timer_list->active_timers[child + 1], t)) {
+            t = timer_list->active_timers[++child];
+        }
+        if (!timer_before(t, ts)) {
+            break;
+        }
+        timerlist_heap_set(timer_list, i, t);
+        i = child;
+    }
+    timerlist_heap_set(timer_list, i, ts);
+}
+
+static void timer_del_locked(QEMUTimerList *timer_list, QEMUTimer *ts)
+{
+    QEMUTimer *last;
+    int i;
+
+    if (ts->expire_time == -1) {
+        return;
+    }
+    ts->expire_time = -1;
+
+    /* Move the last timer into the hole and restore the heap order */
+    i = ts->heap_index;
+    last = timer_list->active_timers[--timer_list->nb_active_timers];
+    if (last == ts) {
+        return;
+    }
+    if (i > 0 && timer_before(last, timer_list->active_timers[(i - 1) / 2])) {
+        timerlist_sift_up(timer_list, i, last);
+    } else {
+        timerlist_sift_down(timer_list, i, last);
     }
+}
+
+static bool timer_mod_ns_locked(QEMUTimerList *timer_list,
+                                QEMUTimer *ts, int64_t expire_time)
+{
+    if (timer_list->nb_active_timers == timer_list->active_timers_size) {
+        timer_list->active_timers_size =
+            MAX(timer_list->active_timers_size * 2, 16);
+        timer_list->active_timers =
+            g_renew(QEMUTimer *, timer_list->active_timers,
+                    timer_list->active_timers_size);
+    }
+
     ts->expire_time = MAX(expire_time, 0);
-    ts->next = *pt;
-    *pt = ts;
+    ts->seq = timer_list->seq++;
+    timerlist_sift_up(timer_list, timer_list->nb_active_timers++, ts);
 
-    return pt == &timer_list->active_timers;
+    return ts->heap_index == 0;
 }
 
 static void timerlist_rearm(QEMUTimerList *timer_list)
@@ -488,7 +554,7 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
     void *opaque;
 
     qemu_event_reset(&timer_list->timers_done_ev);
-    if (!timer_list->clock->enabled || !timer_list->active_timers) {
+    if (!timer_list->clock->enabled || !timerlist_has_timers(timer_list)) {
         goto out;
     }
 
@@ -516,16 +582,14 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
     current_time = qemu_clock_get_ns(timer_list->clock->type);
     for(;;) {
         qemu_mutex_lock(&timer_list->active_timers_lock);
-        ts = timer_list->active_timers;
+        ts = timer_list->nb_active_timers ? timer_list->active_timers[0] : NULL;
         if (!timer_expired_ns(ts, current_time)) {
             qemu_mutex_unlock(&timer_list->active_timers_lock);
             break;
         }
 
         /* remove timer from the list before calling the callback */
-        timer_list->active_timers = ts->next;
-        ts->next = NULL;
-        ts->expire_time = -1;
+        timer_del_locked(timer_list, ts);
         cb = ts->cb;
         opaque = ts->opaque;
         qemu_mutex_unlock(&timer_list->active_timers_lock);
@@ -674,10 +738,10 @@ static void qemu_clock_stop_timers(QEMUClockType type)
     QEMUTimerList *timer_list;
     QEMUClock *clock = qemu_clock_ptr(type);
     QLIST_FOREACH(timer_list, &clock->timerlists, list) {
-        if (timer_list->active_timers) {
+        if (timerlist_has_timers(timer_list)) {
             if (debug)
                 printf("Deleting timerlist for QEMUClockType: %d\n", type);
-            timer_del(timer_list->active_timers);
+            timer_del(timer_list->active_timers[0]);
         }
     }
     return;
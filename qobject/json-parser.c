@@ -204,12 +204,14 @@ static QString *qstring_from_escaped_str(JSONParserContext *ctxt,
                 goto out;
             }
         } else {
-            char dummy[2];
+            /* Copy the whole run up to the next escape or quote at once */
+            const char *start = ptr++;
 
-            dummy[0] = *ptr++;
-            dummy[1] = 0;
-
-            qstring_append(str, dummy);
+            while (*ptr && *ptr != '\\' &&
+                   *ptr != (double_quote ? '"' : '\'')) {
+                ptr++;
+            }
+            qstring_append_len(str, start, ptr - start);
         }
     }
 
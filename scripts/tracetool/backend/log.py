@@ -22,28 +22,47 @@ PUBLIC = True
 def generate_h_begin(events, group):
     out('#include "qemu/log.h"',
         '')
+    for event in events:
+        out('void _log_%(api)s(%(args)s);',
+            api=event.api(),
+            args=event.args)
+    out('')
 
 
 def generate_h(event, group):
-    argnames = ", ".join(event.args.names())
-    if len(event.args) > 0:
-        argnames = ", " + argnames
-
     if "vcpu" in event.properties:
         # already checked on the generic format code
         cond = "true"
     else:
         cond = "trace_event_get_state(%s)" % ("TRACE_" + event.name.upper())
 
+    # The formatting code stays out of line, away from the hot paths that
+    # the tracepoints are in
     out('        if (%(cond)s) {',
-        '            struct timeval _now;',
-        '            gettimeofday(&_now, NULL);',
-        '            qemu_log_mask(LOG_TRACE, "%%d@%%zd.%%06zd:%(name)s " %(fmt)s "\\n",',
-        '                          getpid(),',
-        '                          (size_t)_now.tv_sec, (size_t)_now.tv_usec',
-        '                          %(argnames)s);',
+        '            _log_%(api)s(%(args)s);',
         '        }',
         cond=cond,
+        api=event.api(),
+        args=", ".join(event.args.names()))
+
+
+def generate_c(event, group):
+    argnames = ", ".join(event.args.names())
+    if len(event.args) > 0:
+        argnames = ", " + argnames
+
+    out('void _log_%(api)s(%(args)s)',
+        '{',
+        '    struct timeval _now;',
+        '    gettimeofday(&_now, NULL);',
+        '    qemu_log_mask(LOG_TRACE, "%%d@%%zd.%%06zd:%(name)s " %(fmt)s "\\n",',
+        '                  getpid(),',
+        '                  (size_t)_now.tv_sec, (size_t)_now.tv_usec',
+        '                  %(argnames)s);',
+        '}',
+        '',
+        api=event.api(),
+        args=event.args,
         name=event.name,
         fmt=event.fmt.rstrip("\n"),
         argnames=argnames)
@@ -18,7 +18,11 @@
 #include "qemu/osdep.h"
 #include "slirp.h"
 
-#define MBUF_THRESH 30
+/*
+ * Number of mbufs kept for reuse once freed; guests with many connections
+ * keep far more than a few dozen in flight.
+ */
+#define MBUF_THRESH 256
 
 /*
  * Find a nice value for msize
@@ -16,10 +16,78 @@
 static void sofcantrcvmore(struct socket *so);
 static void sofcantsendmore(struct socket *so);
 
+static guint so_key_hash(gconstpointer opaque)
+{
+    const uint8_t *p = opaque;
+    guint h = 0;
+    int i;
+
+    for (i = 0; i < sizeof(struct socket_key); i++) {
+        h = h * 31 + p[i];
+    }
+    return h;
+}
+
+static gboolean so_key_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, sizeof(struct socket_key));
+}
+
+GHashTable *so_hash_new(void)
+{
+    return g_hash_table_new(so_key_hash, so_key_equal);
+}
+
+static void so_key_fill_addr(uint8_t *addr, uint16_t *port, uint16_t *family,
+                             struct sockaddr_storage *ss)
+{
+    *family = ss->ss_family;
+    switch (ss->ss_family) {
+    case AF_INET:
+        memcpy(addr, &((struct sockaddr_in *)ss)->sin_addr, 4);
+        *port = ((struct sockaddr_in *)ss)->sin_port;
+        break;
+    case AF_INET6:
+        memcpy(addr, &((struct sockaddr_in6 *)ss)->sin6_addr, 16);
+        *port = ((struct sockaddr_in6 *)ss)->sin6_port;
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static void so_key_fill(struct socket_key *key, struct sockaddr_storage *lhost,
+                        struct sockaddr_storage *fhost)
+{
+    memset(key, 0, sizeof(*key));
+    so_key_fill_addr(key->laddr, &key->lport, &key->lfamily, lhost);
+    if (fhost) {
+        so_key_fill_addr(key->faddr, &key->fport, &key->ffamily, fhost);
+    }
+}
+
+static void so_hash_remove(struct socket *so)
+{
+    if (so->so_hash) {
+        if (g_hash_table_lookup(so->so_hash, &so->so_key) == so) {
+            g_hash_table_remove(so->so_hash, &so->so_key);
+        }
+        so->so_hash = NULL;
+    }
+}
+
+/*
+ * Find the socket with the given addresses in the list at head.  hash
+ * remembers the sockets found earlier by their key; since the addresses of
+ * a socket can change behind its back, a hit is only used if it still
+ * matches, and the list is walked otherwise.
+ */
 struct socket *solookup(struct socket **last, struct socket *head,
+        GHashTable *hash,
         struct sockaddr_storage *lhost, struct sockaddr_storage *fhost)
 {
     struct socket *so = *last;
+    struct socket_key key;
 
     /* Optimisation */
     if (so != head && sockaddr_equal(&(so->lhost.ss), lhost)
@@ -27,9 +95,24 @@ struct socket *solookup(struct socket **last, struct socket *head,
         return so;
     }
 
+    so_key_fill(&key, lhost, fhost);
+    so = g_hash_table_lookup(hash, &key);
+    if (so) {
+        if (sockaddr_equal(&(so->lhost.ss), lhost)
+                && (!fhost || sockaddr_equal(&so->fhost.ss, fhost))) {
+            *last = so;
+            return so;
+        }
+        so_hash_remove(so);
+    }
+
     for (so = head->so_next; so != head; so = so->so_next) {
         if (sockaddr_equal(&(so->lhost.ss), lhost)
                 && (!fhost || sockaddr_equal(&so->fhost.ss, fhost))) {
+            so_hash_remove(so);
+            so->so_key = key;
+            so->so_hash = hash;
+            g_hash_table_insert(hash, &so->so_key, so);
             *last = so;
             return so;
         }
@@ -96,6 +179,7 @@ sofree(struct socket *so)
       slirp->icmp_last_so = &slirp->icmp;
   }
   m_free(so->so_m);
+  so_hash_remove(so);
 
   if(so->so_next && so->so_prev)
     remque(so);  /* crashes if so is not in a queue */
@@ -11,6 +11,17 @@
 #define SO_EXPIRE 240000
 #define SO_EXPIREFAST 10000
 
+/*
+ * Addresses a socket was looked up by, as the key of a solookup() table.
+ * IPv4 addresses use the first four bytes of the address fields.
+ */
+struct socket_key {
+    uint8_t laddr[16];
+    uint8_t faddr[16];
+    uint16_t lport, fport;
+    uint16_t lfamily, ffamily;
+};
+
 /*
  * Our socket structure
  */
@@ -70,6 +81,9 @@ struct socket {
   struct sbuf so_rcv;		/* Receive buffer */
   struct sbuf so_snd;		/* Send buffer */
   void * extra;			/* Extra pointer */
+
+  GHashTable *so_hash;		/* solookup() table that has this socket */
+  struct socket_key so_key;	/* and its key there */
 };
 
 
@@ -134,7 +148,8 @@ static inline socklen_t sockaddr_size(struct sockaddr_storage *a)
     }
 }
 
-struct socket *solookup(struct socket **, struct socket *,
+GHashTable *so_hash_new(void);
+struct socket *solookup(struct socket **, struct socket *, GHashTable *,
         struct sockaddr_storage *, struct sockaddr_storage *);
 struct socket *socreate(Slirp *);
 void sofree(struct socket *);
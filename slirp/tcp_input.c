@@ -394,7 +394,8 @@ findso:
 	    g_assert_not_reached();
 	}
 
-	so = solookup(&slirp->tcp_last_so, &slirp->tcb, &lhost, &fhost);
+	so = solookup(&slirp->tcp_last_so, &slirp->tcb, slirp->tcp_hash,
+		      &lhost, &fhost);
 
 	/*
 	 * If the state is CLOSED (i.e., TCB does not exist) then
@@ -54,6 +54,7 @@ tcp_init(Slirp *slirp)
     slirp->tcp_iss = 1;		/* wrong */
     slirp->tcb.so_next = slirp->tcb.so_prev = &slirp->tcb;
     slirp->tcp_last_so = &slirp->tcb;
+    slirp->tcp_hash = so_hash_new();
 }
 
 void tcp_cleanup(Slirp *slirp)
@@ -61,6 +62,7 @@ void tcp_cleanup(Slirp *slirp)
     while (slirp->tcb.so_next != &slirp->tcb) {
         tcp_close(sototcpcb(slirp->tcb.so_next));
     }
+    g_hash_table_destroy(slirp->tcp_hash);
 }
 
 /*
@@ -49,6 +49,7 @@ udp_init(Slirp *slirp)
 {
     slirp->udb.so_next = slirp->udb.so_prev = &slirp->udb;
     slirp->udp_last_so = &slirp->udb;
+    slirp->udp_hash = so_hash_new();
 }
 
 void udp_cleanup(Slirp *slirp)
@@ -56,6 +57,7 @@ void udp_cleanup(Slirp *slirp)
     while (slirp->udb.so_next != &slirp->udb) {
         udp_detach(slirp->udb.so_next);
     }
+    g_hash_table_destroy(slirp->udp_hash);
 }
 
 /* m->m_data  points at ip packet header
@@ -163,7 +165,8 @@ udp_input(register struct mbuf *m, int iphlen)
 	/*
 	 * Locate pcb for datagram.
 	 */
-	so = solookup(&slirp->udp_last_so, &slirp->udb, &lhost, NULL);
+	so = solookup(&slirp->udp_last_so, &slirp->udb, slirp->udp_hash,
+		      &lhost, NULL);
 
 	if (so == NULL) {
 	  /*
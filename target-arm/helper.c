@@ -480,6 +480,38 @@ static void fcse_write(CPUARMState *env, const ARMCPRegInfo *ri, uint64_t value)
     }
 }
 
+/* Whether ASID changes switch TLBs (-tlb-asids) rather than flush.  Only
+ * done with a single security state and no hypervisor, where the ASID
+ * is all that tells translation regimes' address spaces apart.
+ */
+static bool arm_tlb_asid_tagged(CPUARMState *env)
+{
+#ifdef CONFIG_USER_ONLY
+    return false;
+#else
+    return tlb_asid_slots && !arm_feature(env, ARM_FEATURE_EL2)
+        && !arm_feature(env, ARM_FEATURE_EL3);
+#endif
+}
+
+/* ASIDs are 8 bits, or 16 with AArch64 TCR_EL1.AS */
+static int arm_asid_bits(CPUARMState *env)
+{
+    return (arm_el_is_aa64(env, 1)
+            && extract64(env->cp15.tcr_el[1].raw_tcr, 36, 1)) ? 16 : 8;
+}
+
+/* The ASID with the long-descriptor format: TTBCR.A1 says which TTBR
+ * holds it.
+ */
+static uint64_t arm_ttbr_asid(CPUARMState *env)
+{
+    uint64_t ttbr = (env->cp15.tcr_el[1].raw_tcr & TTBCR_A1) ?
+        env->cp15.ttbr1_el[1] : env->cp15.ttbr0_el[1];
+
+    return extract64(ttbr, 48, arm_asid_bits(env));
+}
+
 static void contextidr_write(CPUARMState *env, const ARMCPRegInfo *ri,
                              uint64_t value)
 {
@@ -488,10 +520,15 @@ static void contextidr_write(CPUARMState *env, const ARMCPRegInfo *ri,
     if (raw_read(env, ri) != value && !arm_feature(env, ARM_FEATURE_MPU)
         && !extended_addresses_enabled(env)) {
         /* For VMSA (when not using the LPAE long descriptor page table
-         * format) this register includes the ASID, so do a TLB flush.
+         * format) this register includes the ASID, so do a TLB flush,
+         * or switch TLBs if they are tagged with it.
          * For PMSA it is purely a process ID and no action is needed.
          */
-        tlb_flush(CPU(cpu), 1);
+        if (!arm_tlb_asid_tagged(env)) {
+            tlb_flush(CPU(cpu), 1);
+        } else if ((raw_read(env, ri) ^ value) & 0xff) {
+            tlb_switch_asid(CPU(cpu), value & 0xff, false);
+        }
     }
     raw_write(env, ri, value);
 }
@@ -520,6 +557,10 @@ static void tlbiasid_write(CPUARMState *env, const ARMCPRegInfo *ri,
     /* Invalidate by ASID (TLBIASID) */
     ARMCPU *cpu = arm_env_get_cpu(env);
 
+    if (arm_tlb_asid_tagged(env)) {
+        tlb_flush_asid(CPU(cpu), value & 0xff);
+        return;
+    }
     tlb_flush(CPU(cpu), value == 0);
 }
 
@@ -2487,11 +2528,20 @@ static void vmsa_ttbr_write(CPUARMState *env, const ARMCPRegInfo *ri,
                             uint64_t value)
 {
     /* 64 bit accesses to the TTBRs can change the ASID and so we
-     * must flush the TLB.
+     * must flush the TLB, or switch TLBs if they are tagged with it.
      */
     if (cpreg_field_is_64bit(ri)) {
         ARMCPU *cpu = arm_env_get_cpu(env);
 
+        if (arm_tlb_asid_tagged(env)) {
+            uint64_t asid = arm_ttbr_asid(env);
+
+            raw_write(env, ri, value);
+            if (arm_ttbr_asid(env) != asid) {
+                tlb_switch_asid(CPU(cpu), arm_ttbr_asid(env), false);
+            }
+            return;
+        }
         tlb_flush(CPU(cpu), 1);
     }
     raw_write(env, ri, value);
@@ -2871,6 +2921,18 @@ static void tlbi_aa64_vmalle1_write(CPUARMState *env, const ARMCPRegInfo *ri,
     }
 }
 
+static void tlbi_aa64_aside1_write(CPUARMState *env, const ARMCPRegInfo *ri,
+                                   uint64_t value)
+{
+    ARMCPU *cpu = arm_env_get_cpu(env);
+
+    if (arm_tlb_asid_tagged(env)) {
+        tlb_flush_asid(CPU(cpu), extract64(value, 48, arm_asid_bits(env)));
+        return;
+    }
+    tlbi_aa64_vmalle1_write(env, ri, value);
+}
+
 static void tlbi_aa64_vmalle1is_write(CPUARMState *env, const ARMCPRegInfo *ri,
                                       uint64_t value)
 {
@@ -3286,7 +3348,7 @@ static const ARMCPRegInfo v8_cp_reginfo[] = {
     { .name = "TLBI_ASIDE1", .state = ARM_CP_STATE_AA64,
       .opc0 = 1, .opc1 = 0, .crn = 8, .crm = 7, .opc2 = 2,
       .access = PL1_W, .type = ARM_CP_NO_RAW,
-      .writefn = tlbi_aa64_vmalle1_write },
+      .writefn = tlbi_aa64_aside1_write },
     { .name = "TLBI_VAAE1", .state = ARM_CP_STATE_AA64,
       .opc0 = 1, .opc1 = 0, .crn = 8, .crm = 7, .opc2 = 3,
       .access = PL1_W, .type = ARM_CP_NO_RAW,
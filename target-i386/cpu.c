@@ -2267,6 +2267,15 @@ static uint32_t x86_cpu_get_supported_feature_word(FeatureWord w,
                                                     wi->cpuid_reg);
     } else if (tcg_enabled()) {
         r = wi->tcg_features;
+#if defined(TARGET_X86_64) && !defined(CONFIG_USER_ONLY)
+        /* PCIDs only make sense with TLBs to tag with them */
+        if (tlb_asid_slots && w == FEAT_1_ECX) {
+            r |= CPUID_EXT_PCID;
+        }
+        if (tlb_asid_slots && w == FEAT_7_0_EBX) {
+            r |= CPUID_7_0_EBX_INVPCID;
+        }
+#endif
     } else {
         return ~0;
     }
@@ -37,6 +37,10 @@
    close to the modifying instruction */
 #define TARGET_HAS_PRECISE_SMC
 
+/* the helpers that reach the APIC take the BQL, and LOCKed instructions
+   use the atomic helpers, so vCPUs can run on threads of their own */
+#define TARGET_SUPPORTS_MTTCG
+
 #ifdef TARGET_X86_64
 #define I386_ELF_MACHINE  EM_X86_64
 #define ELF_MACHINE_UNAME "x86_64"
@@ -1443,6 +1447,7 @@ void breakpoint_handler(CPUState *cs);
 /* will be suppressed */
 void cpu_x86_update_cr0(CPUX86State *env, uint32_t new_cr0);
 void cpu_x86_update_cr3(CPUX86State *env, target_ulong new_cr3);
+void cpu_x86_update_cr3_noflush(CPUX86State *env, target_ulong new_cr3);
 void cpu_x86_update_cr4(CPUX86State *env, uint32_t new_cr4);
 void cpu_x86_update_dr7(CPUX86State *env, uint32_t new_dr7);
 
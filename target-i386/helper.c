@@ -635,20 +635,38 @@ void cpu_x86_update_cr0(CPUX86State *env, uint32_t new_cr0)
 
 /* XXX: in legacy PAE mode, generate a GPF if reserved bits are set in
    the PDPT */
-void cpu_x86_update_cr3(CPUX86State *env, target_ulong new_cr3)
+static void x86_update_cr3(CPUX86State *env, target_ulong new_cr3, bool flush)
 {
     X86CPU *cpu = x86_env_get_cpu(env);
+    /* the PCID says which TLB entries to use, not which address space */
+    target_ulong pcid_mask = (env->cr[4] & CR4_PCIDE_MASK) ? 0xfff : 0;
 
-    panda_callbacks_asid_changed(ENV_GET_CPU(env), env->cr[3], new_cr3);
+    panda_callbacks_asid_changed(ENV_GET_CPU(env), env->cr[3] & ~pcid_mask,
+                                 new_cr3 & ~pcid_mask);
 
     env->cr[3] = new_cr3;
     if (env->cr[0] & CR0_PG_MASK) {
         qemu_log_mask(CPU_LOG_MMU,
                         "CR3 update: CR3=" TARGET_FMT_lx "\n", new_cr3);
-        tlb_flush(CPU(cpu), 0);
+        if (env->cr[4] & CR4_PCIDE_MASK) {
+            tlb_switch_asid(CPU(cpu), new_cr3 & 0xfff, flush);
+        } else {
+            tlb_flush(CPU(cpu), 0);
+        }
     }
 }
 
+void cpu_x86_update_cr3(CPUX86State *env, target_ulong new_cr3)
+{
+    x86_update_cr3(env, new_cr3, true);
+}
+
+/* MOV to CR3 with bit 63 set: the new PCID's TLB entries are kept */
+void cpu_x86_update_cr3_noflush(CPUX86State *env, target_ulong new_cr3)
+{
+    x86_update_cr3(env, new_cr3, false);
+}
+
 void cpu_x86_update_cr4(CPUX86State *env, uint32_t new_cr4)
 {
     X86CPU *cpu = x86_env_get_cpu(env);
@@ -659,7 +677,7 @@ void cpu_x86_update_cr4(CPUX86State *env, uint32_t new_cr4)
 #endif
     if ((new_cr4 ^ env->cr[4]) &
         (CR4_PGE_MASK | CR4_PAE_MASK | CR4_PSE_MASK |
-         CR4_SMEP_MASK | CR4_SMAP_MASK)) {
+         CR4_SMEP_MASK | CR4_SMAP_MASK | CR4_PCIDE_MASK)) {
         tlb_flush(CPU(cpu), 1);
     }
 
@@ -685,6 +703,10 @@ void cpu_x86_update_cr4(CPUX86State *env, uint32_t new_cr4)
         new_cr4 &= ~CR4_PKE_MASK;
     }
 
+    if (!(env->features[FEAT_1_ECX] & CPUID_EXT_PCID)) {
+        new_cr4 &= ~CR4_PCIDE_MASK;
+    }
+
     env->cr[4] = new_cr4;
     env->hflags = hflags;
 
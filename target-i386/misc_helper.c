@@ -23,6 +23,7 @@
 #include "exec/exec-all.h"
 #include "exec/cpu_ldst.h"
 #include "exec/address-spaces.h"
+#include "qemu/main-loop.h"
 
 #ifdef CONFIG_SOFTMMU
 #include "panda/rr/rr_log.h"
@@ -142,7 +143,16 @@ target_ulong helper_read_crN(CPUX86State *env, int reg)
         break;
     case 8:
         if (!(env->hflags2 & HF2_VINTR_MASK)) {
+            /* the APIC is a device; multi-threaded TCG runs this
+               without the BQL */
+            bool locked = !qemu_mutex_iothread_locked();
+            if (locked) {
+                qemu_mutex_lock_iothread();
+            }
             val = cpu_get_apic_tpr(x86_env_get_cpu(env)->apic_state);
+            if (locked) {
+                qemu_mutex_unlock_iothread();
+            }
         } else {
             val = env->v_tpr;
         }
@@ -159,6 +169,13 @@ void helper_write_crN(CPUX86State *env, int reg, target_ulong t0)
         cpu_x86_update_cr0(env, t0);
         break;
     case 3:
+#ifdef TARGET_X86_64
+        if ((env->cr[4] & CR4_PCIDE_MASK) && (t0 & (1ULL << 63))) {
+            /* bit 63 only says not to flush; CR3 doesn't hold it */
+            cpu_x86_update_cr3_noflush(env, t0 & ~(1ULL << 63));
+            break;
+        }
+#endif
         cpu_x86_update_cr3(env, t0);
         break;
     case 4:
@@ -166,7 +183,14 @@ void helper_write_crN(CPUX86State *env, int reg, target_ulong t0)
         break;
     case 8:
         if (!(env->hflags2 & HF2_VINTR_MASK)) {
+            bool locked = !qemu_mutex_iothread_locked();
+            if (locked) {
+                qemu_mutex_lock_iothread();
+            }
             cpu_set_apic_tpr(x86_env_get_cpu(env)->apic_state, t0);
+            if (locked) {
+                qemu_mutex_unlock_iothread();
+            }
         }
         env->v_tpr = t0 & 0x0f;
         break;
@@ -193,6 +217,33 @@ void helper_invlpg(CPUX86State *env, target_ulong addr)
     tlb_flush_page(CPU(cpu), addr);
 }
 
+void helper_invpcid(CPUX86State *env, target_ulong type, target_ulong addr)
+{
+    X86CPU *cpu = x86_env_get_cpu(env);
+    uint64_t pcid = cpu_ldq_data_ra(env, addr, GETPC());
+    uint64_t linear = cpu_ldq_data_ra(env, addr + 8, GETPC());
+
+    if (pcid > 0xfff) {
+        raise_exception_ra(env, EXCP0D_GPF, GETPC());
+    }
+    switch (type) {
+    case 0:
+        /* one address in one PCID; the TLB drops it from all of them */
+        tlb_flush_page(CPU(cpu), linear);
+        break;
+    case 1:
+        tlb_flush_asid(CPU(cpu), pcid);
+        break;
+    case 2:
+    case 3:
+        /* every PCID, with or without global entries */
+        tlb_flush(CPU(cpu), type == 2);
+        break;
+    default:
+        raise_exception_ra(env, EXCP0D_GPF, GETPC());
+    }
+}
+
 void helper_rdtsc(CPUX86State *env)
 {
     uint64_t val;
@@ -262,9 +313,17 @@ void helper_wrmsr(CPUX86State *env)
     case MSR_IA32_SYSENTER_EIP:
         env->sysenter_eip = val;
         break;
-    case MSR_IA32_APICBASE:
+    case MSR_IA32_APICBASE: {
+        bool locked = !qemu_mutex_iothread_locked();
+        if (locked) {
+            qemu_mutex_lock_iothread();
+        }
         cpu_set_apic_base(x86_env_get_cpu(env)->apic_state, val);
+        if (locked) {
+            qemu_mutex_unlock_iothread();
+        }
         break;
+    }
     case MSR_EFER:
         {
             uint64_t update_mask;
@@ -419,9 +478,17 @@ void helper_rdmsr(CPUX86State *env)
     case MSR_IA32_SYSENTER_EIP:
         val = env->sysenter_eip;
         break;
-    case MSR_IA32_APICBASE:
+    case MSR_IA32_APICBASE: {
+        bool locked = !qemu_mutex_iothread_locked();
+        if (locked) {
+            qemu_mutex_lock_iothread();
+        }
         val = cpu_get_apic_base(x86_env_get_cpu(env)->apic_state);
+        if (locked) {
+            qemu_mutex_unlock_iothread();
+        }
         break;
+    }
     case MSR_EFER:
         val = env->efer;
         break;
@@ -2207,12 +2207,24 @@ void glue(helper_pclmulqdq, SUFFIX)(CPUX86State *env, Reg *d, Reg *s,
     d->Q(1) = resh;
 }
 
+/* The host AES instructions work on the bytes in memory order, which is the
+ * order of B() only on little-endian hosts.  */
+#ifdef HOST_WORDS_BIGENDIAN
+#define AES_ACCEL_OK false
+#else
+#define AES_ACCEL_OK (AES_accel != NULL)
+#endif
+
 void glue(helper_aesdec, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
 {
     int i;
     Reg st = *d;
     Reg rk = *s;
 
+    if (AES_ACCEL_OK) {
+        AES_accel->dec(&d->B(0), &d->B(0), &s->B(0));
+        return;
+    }
     for (i = 0 ; i < 4 ; i++) {
         d->L(i) = rk.L(i) ^ bswap32(AES_Td0[st.B(AES_ishifts[4*i+0])] ^
                                     AES_Td1[st.B(AES_ishifts[4*i+1])] ^
@@ -2227,6 +2239,10 @@ void glue(helper_aesdeclast, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     Reg st = *d;
     Reg rk = *s;
 
+    if (AES_ACCEL_OK) {
+        AES_accel->declast(&d->B(0), &d->B(0), &s->B(0));
+        return;
+    }
     for (i = 0; i < 16; i++) {
         d->B(i) = rk.B(i) ^ (AES_isbox[st.B(AES_ishifts[i])]);
     }
@@ -2238,6 +2254,10 @@ void glue(helper_aesenc, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     Reg st = *d;
     Reg rk = *s;
 
+    if (AES_ACCEL_OK) {
+        AES_accel->enc(&d->B(0), &d->B(0), &s->B(0));
+        return;
+    }
     for (i = 0 ; i < 4 ; i++) {
         d->L(i) = rk.L(i) ^ bswap32(AES_Te0[st.B(AES_shifts[4*i+0])] ^
                                     AES_Te1[st.B(AES_shifts[4*i+1])] ^
@@ -2252,6 +2272,10 @@ void glue(helper_aesenclast, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     Reg st = *d;
     Reg rk = *s;
 
+    if (AES_ACCEL_OK) {
+        AES_accel->enclast(&d->B(0), &d->B(0), &s->B(0));
+        return;
+    }
     for (i = 0; i < 16; i++) {
         d->B(i) = rk.B(i) ^ (AES_sbox[st.B(AES_shifts[i])]);
     }
@@ -2263,6 +2287,10 @@ void glue(helper_aesimc, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     int i;
     Reg tmp = *s;
 
+    if (AES_ACCEL_OK) {
+        AES_accel->imc(&d->B(0), &s->B(0));
+        return;
+    }
     for (i = 0 ; i < 4 ; i++) {
         d->L(i) = bswap32(AES_imc[tmp.B(4*i+0)][0] ^
                           AES_imc[tmp.B(4*i+1)][1] ^
@@ -2284,6 +2312,8 @@ void glue(helper_aeskeygenassist, SUFFIX)(CPUX86State *env, Reg *d, Reg *s,
     d->L(1) = (d->L(0) << 24 | d->L(0) >> 8) ^ ctrl;
     d->L(3) = (d->L(2) << 24 | d->L(2) >> 8) ^ ctrl;
 }
+
+#undef AES_ACCEL_OK
 #endif
 
 #undef SHIFT
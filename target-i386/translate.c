@@ -23,6 +23,7 @@
 #include "disas/disas.h"
 #include "exec/exec-all.h"
 #include "tcg-op.h"
+#include "tcg-op-gvec.h"
 #include "exec/cpu_ldst.h"
 
 #ifdef CONFIG_SOFTMMU
@@ -2945,6 +2946,84 @@ static const struct SSEOpHelper_eppi sse_op_table7[256] = {
     [0xdf] = AESNI_OP(aeskeygenassist),
 };
 
+/* The MMX/SSE integer operations that are expanded inline, 64 bits at a
+   time, rather than left to the helpers in ops_sse.h.  Returns false for
+   the ones that aren't.  */
+static bool gen_sse_gvec(int b, int op1_offset, int op2_offset, int oprsz)
+{
+    switch (b) {
+    case 0x54: /* andps, andpd */
+    case 0xdb: /* pand */
+        tcg_gen_gvec_and(op1_offset, op1_offset, op2_offset, oprsz);
+        break;
+    case 0x55: /* andnps, andnpd */
+    case 0xdf: /* pandn */
+        tcg_gen_gvec_andc(op1_offset, op2_offset, op1_offset, oprsz);
+        break;
+    case 0x56: /* orps, orpd */
+    case 0xeb: /* por */
+        tcg_gen_gvec_or(op1_offset, op1_offset, op2_offset, oprsz);
+        break;
+    case 0x57: /* xorps, xorpd */
+    case 0xef: /* pxor */
+        tcg_gen_gvec_xor(op1_offset, op1_offset, op2_offset, oprsz);
+        break;
+    case 0xfc ... 0xfe: /* paddb, paddw, paddl */
+        tcg_gen_gvec_add(MO_8 + b - 0xfc, op1_offset, op1_offset, op2_offset,
+                         oprsz);
+        break;
+    case 0xd4: /* paddq */
+        tcg_gen_gvec_add(MO_64, op1_offset, op1_offset, op2_offset, oprsz);
+        break;
+    case 0xf8 ... 0xfb: /* psubb, psubw, psubl, psubq */
+        tcg_gen_gvec_sub(MO_8 + b - 0xf8, op1_offset, op1_offset, op2_offset,
+                         oprsz);
+        break;
+    case 0x74 ... 0x76: /* pcmpeqb, pcmpeqw, pcmpeql */
+        tcg_gen_gvec_cmp(TCG_COND_EQ, MO_8 + b - 0x74, op1_offset,
+                         op1_offset, op2_offset, oprsz);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+/* Likewise the shifts by an immediate; op is the reg field of the modrm
+   byte, as in sse_op_table2.  */
+static bool gen_sse_gvec_shifti(int b, int op, int offset, int count,
+                                int oprsz)
+{
+    unsigned vece = MO_16 + ((b - 1) & 3);
+    int bits = 8 << vece;
+
+    switch (op) {
+    case 2: /* psrl */
+        if (count >= bits) {
+            tcg_gen_gvec_dup64i(offset, oprsz, 0);
+        } else {
+            tcg_gen_gvec_shri(vece, offset, offset, count, oprsz);
+        }
+        break;
+    case 4: /* psra */
+        if (vece == MO_64) {
+            return false;
+        }
+        tcg_gen_gvec_sari(vece, offset, offset, MIN(count, bits - 1), oprsz);
+        break;
+    case 6: /* psll */
+        if (count >= bits) {
+            tcg_gen_gvec_dup64i(offset, oprsz, 0);
+        } else {
+            tcg_gen_gvec_shli(vece, offset, offset, count, oprsz);
+        }
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
 static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     target_ulong pc_start, int rex_r)
 {
@@ -3354,6 +3433,22 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
 	        goto unknown_op;
             }
             val = cpu_ldub_code(env, s->pc++);
+            sse_fn_epp = sse_op_table2[((b - 1) & 3) * 8 +
+                                       (((modrm >> 3)) & 7)][b1];
+            if (!sse_fn_epp) {
+                goto unknown_op;
+            }
+            if (is_xmm) {
+                rm = (modrm & 7) | REX_B(s);
+                op2_offset = offsetof(CPUX86State,xmm_regs[rm]);
+            } else {
+                rm = (modrm & 7);
+                op2_offset = offsetof(CPUX86State,fpregs[rm].mmx);
+            }
+            if (gen_sse_gvec_shifti(b, (modrm >> 3) & 7, op2_offset, val,
+                                    is_xmm ? 16 : 8)) {
+                break;
+            }
             if (is_xmm) {
                 tcg_gen_movi_tl(cpu_T0, val);
                 tcg_gen_st32_tl(cpu_T0, cpu_env, offsetof(CPUX86State,xmm_t0.ZMM_L(0)));
@@ -3367,18 +3462,6 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                 tcg_gen_st32_tl(cpu_T0, cpu_env, offsetof(CPUX86State,mmx_t0.MMX_L(1)));
                 op1_offset = offsetof(CPUX86State,mmx_t0);
             }
-            sse_fn_epp = sse_op_table2[((b - 1) & 3) * 8 +
-                                       (((modrm >> 3)) & 7)][b1];
-            if (!sse_fn_epp) {
-                goto unknown_op;
-            }
-            if (is_xmm) {
-                rm = (modrm & 7) | REX_B(s);
-                op2_offset = offsetof(CPUX86State,xmm_regs[rm]);
-            } else {
-                rm = (modrm & 7);
-                op2_offset = offsetof(CPUX86State,fpregs[rm].mmx);
-            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op2_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op1_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
@@ -4371,6 +4454,9 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             sse_fn_eppt(cpu_env, cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
         default:
+            if (gen_sse_gvec(b, op1_offset, op2_offset, is_xmm ? 16 : 8)) {
+                break;
+            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
@@ -8202,9 +8288,40 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
     case 0x10e ... 0x10f:
         /* 3DNow! instructions, ignore prefixes */
         s->prefix &= ~(PREFIX_REPZ | PREFIX_REPNZ | PREFIX_DATA);
+    case 0x138:
+        /* invpcid is 66 0f 38 82; the rest of 0f 38 is SSE */
+        if ((prefixes & (PREFIX_DATA | PREFIX_REPZ | PREFIX_REPNZ)) ==
+            PREFIX_DATA && cpu_ldub_code(env, s->pc) == 0x82) {
+            if (!(s->cpuid_7_0_ebx_features & CPUID_7_0_EBX_INVPCID)) {
+                goto illegal_op;
+            }
+            s->pc++;
+            modrm = cpu_ldub_code(env, s->pc++);
+            if ((modrm >> 6) == 3) {
+                goto illegal_op;
+            }
+            if (s->cpl != 0) {
+                gen_exception(s, EXCP0D_GPF, pc_start - s->cs_base);
+                break;
+            }
+            reg = ((modrm >> 3) & 7) | rex_r;
+            gen_update_cc_op(s);
+            gen_jmp_im(pc_start - s->cs_base);
+            gen_lea_modrm(env, s, modrm);
+            tcg_gen_mov_tl(cpu_T0, cpu_regs[reg]);
+            if (!CODE64(s)) {
+                tcg_gen_ext32u_tl(cpu_T0, cpu_T0);
+            }
+            gen_helper_invpcid(cpu_env, cpu_T0, cpu_A0);
+            gen_jmp_im(s->pc - s->cs_base);
+            gen_eob(s);
+            break;
+        }
+        gen_sse(env, s, b, pc_start, rex_r);
+        break;
     case 0x110 ... 0x117:
     case 0x128 ... 0x12f:
-    case 0x138 ... 0x13a:
+    case 0x139 ... 0x13a:
     case 0x150 ... 0x179:
     case 0x17c ... 0x17f:
     case 0x1c2:
@@ -8448,8 +8565,9 @@ void gen_intermediate_code(CPUX86State *env, TranslationBlock *tb)
 
 #ifdef CONFIG_SOFTMMU
         //mz let's count this instruction
-        // In LLVM mode we generate this more efficiently.
-        if (rr_mode != RR_OFF && !generate_llvm) {
+        // In LLVM mode the LLVM code does this more efficiently, but the
+        // TCG code still needs it for blocks a plugin runs without LLVM.
+        if (rr_mode != RR_OFF || generate_llvm) {
             gen_op_update_panda_pc(pc_ptr);
             gen_op_update_rr_icount();
         }
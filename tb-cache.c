@@ -0,0 +1,401 @@
+/*
+ * Persistent TB cache (-tb-cache)
+ *
+ * TBs translated in one run are kept in a file, host code and all, and
+ * the next run copies them into the code buffer instead of translating
+ * the same guest code again.  A TB is looked up by everything its code
+ * depends on: where the guest code is in RAM, the TB's pc, cs_base, flags
+ * and cflags, and the few global settings that change what gets
+ * generated (tb_cache_mode()).  It is only used if the guest code is
+ * still byte for byte what it was translated from.
+ *
+ * The code refers to things that move from one process to the next: the
+ * TranslationBlock, the prologue, helpers in QEMU itself.  The backend
+ * notes where while it generates the code (tcg_note_code_ref()), and
+ * tcg_apply_code_relocs() fixes them up on the way back in.  Code the
+ * backend can't describe is never written out.  The file is only good
+ * for the QEMU binary that wrote it, and for one guest configuration: it
+ * is started over when the binary changes, but nothing checks -cpu.
+ *
+ * New translations are appended as they are made, and also go in the
+ * in-memory table, so the same code needn't be translated twice in one
+ * run either (after a loadvm, say).
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#define NO_CPU_IO_DEFS
+#include "cpu.h"
+#include "exec/exec-all.h"
+#include "exec/memory.h"
+#include "exec/tb-hash.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "tcg.h"
+#include "translate-all.h"
+
+#include "panda/rr/rr_log.h"
+#include "panda/plugin.h"
+
+#define TB_CACHE_MAGIC "QEMUTBC"
+#define TB_CACHE_VERSION 2
+
+typedef struct TBCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t target_long_bits;
+    char target[16];            /* TARGET_NAME */
+    /* the binary that wrote it */
+    uint64_t exe_size;
+    int64_t exe_mtime;
+    uint64_t text_size;
+} TBCacheHeader;
+
+/* One TB.  In the file, it's followed by its relocations, its host code
+   and search data, and then its guest code.  */
+typedef struct TBCacheRecord {
+    /* the key */
+    uint64_t phys_pc;
+    uint64_t pc;
+    uint64_t cs_base;
+    uint32_t flags;
+    uint32_t cflags;
+    uint32_t mode;
+    /* the rest of the TB */
+    uint16_t size;
+    uint16_t icount;
+    uint32_t code_size;
+    uint32_t search_size;
+    uint32_t nb_relocs;
+    uint16_t jmp_reset_offset[2];
+    uint16_t jmp_insn_offset[2];
+} TBCacheRecord;
+
+typedef struct TBCacheEntry {
+    TBCacheRecord rec;
+    struct TBCacheEntry *next;  /* same key, different guest code */
+    TCGCodeReloc *relocs;
+    uint8_t *code;
+    uint8_t *guest;
+} TBCacheEntry;
+
+/* guard against reading garbage as a record */
+#define TB_CACHE_MAX_CODE (1 << 20)
+
+static FILE *tb_cache_file;
+static GHashTable *tb_cache_table;
+static unsigned tb_cache_loaded;
+static unsigned tb_cache_hits;
+static unsigned tb_cache_misses;
+static unsigned tb_cache_stored;
+
+static guint tb_cache_hash(gconstpointer p)
+{
+    const TBCacheRecord *r = p;
+
+    return tb_hash_func(r->phys_pc, r->pc, r->flags);
+}
+
+static gboolean tb_cache_equal(gconstpointer a, gconstpointer b)
+{
+    const TBCacheRecord *ra = a, *rb = b;
+
+    return ra->phys_pc == rb->phys_pc && ra->pc == rb->pc &&
+           ra->cs_base == rb->cs_base && ra->flags == rb->flags &&
+           ra->cflags == rb->cflags && ra->mode == rb->mode;
+}
+
+/* settings outside the TB that change the code generated for it: record
+ * or replay, -singlestep, gdb single stepping, and PANDA memory callbacks,
+ * which switch the softmmu slow path to the helpers that call them
+ */
+static uint32_t tb_cache_mode(CPUState *cpu)
+{
+    return (rr_mode != RR_OFF) | (singlestep << 1) |
+           (!!cpu->singlestep_enabled << 2) | (panda_use_memcb << 3);
+}
+
+static bool tb_cache_usable(TranslationBlock *tb)
+{
+    if (!TCG_TARGET_HAS_CODE_RELOCS || !tb_cache_file ||
+        (tb->cflags & CF_NOCACHE) || tb_profile_enabled ||
+        exec_stats_enabled ||
+        tb->panda_inline_exec) {
+        return false;
+    }
+#ifdef CONFIG_LLVM
+    if (generate_llvm) {
+        return false;
+    }
+#endif
+    /* plugins that watch or add to the translation */
+    return !panda_cbs[PANDA_CB_BEFORE_BLOCK_TRANSLATE] &&
+           !panda_cbs[PANDA_CB_AFTER_BLOCK_TRANSLATE] &&
+           !panda_cbs[PANDA_CB_INSN_TRANSLATE];
+}
+
+static TBCacheEntry *tb_cache_entry_new(const TBCacheRecord *rec)
+{
+    size_t relocs = rec->nb_relocs * sizeof(TCGCodeReloc);
+    size_t code = rec->code_size + rec->search_size;
+    TBCacheEntry *e = g_malloc(sizeof(*e) + relocs + code + rec->size);
+
+    e->rec = *rec;
+    e->next = NULL;
+    e->relocs = (TCGCodeReloc *)(e + 1);
+    e->code = (uint8_t *)e->relocs + relocs;
+    e->guest = e->code + code;
+    return e;
+}
+
+static void tb_cache_insert(TBCacheEntry *e)
+{
+    e->next = g_hash_table_lookup(tb_cache_table, &e->rec);
+    g_hash_table_replace(tb_cache_table, &e->rec, e);
+}
+
+/* the next record in f, or NULL at the end or at a partly written one */
+static TBCacheEntry *tb_cache_read(FILE *f)
+{
+    TBCacheRecord rec;
+    TBCacheEntry *e;
+
+    if (fread(&rec, sizeof(rec), 1, f) != 1 ||
+        rec.size == 0 || rec.size > 2 * TARGET_PAGE_SIZE ||
+        rec.code_size + (uint64_t)rec.search_size > TB_CACHE_MAX_CODE ||
+        rec.nb_relocs > TCG_MAX_CODE_RELOCS) {
+        return NULL;
+    }
+    e = tb_cache_entry_new(&rec);
+    if (fread(e->relocs, sizeof(TCGCodeReloc), rec.nb_relocs, f) !=
+            rec.nb_relocs ||
+        fread(e->code, 1, rec.code_size + rec.search_size, f) !=
+            rec.code_size + rec.search_size ||
+        fread(e->guest, 1, rec.size, f) != rec.size) {
+        g_free(e);
+        return NULL;
+    }
+    return e;
+}
+
+static void tb_cache_header(TBCacheHeader *h)
+{
+    struct stat st;
+
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, TB_CACHE_MAGIC, sizeof(TB_CACHE_MAGIC));
+    h->version = TB_CACHE_VERSION;
+    h->target_long_bits = TARGET_LONG_BITS;
+    pstrcpy(h->target, sizeof(h->target), TARGET_NAME);
+    if (stat("/proc/self/exe", &st) == 0) {
+        h->exe_size = st.st_size;
+        h->exe_mtime = st.st_mtime;
+    }
+#if TCG_TARGET_HAS_CODE_RELOCS
+    {
+        extern const char __executable_start[], etext[];
+
+        h->text_size = etext - __executable_start;
+    }
+#endif
+}
+
+void tb_cache_open(const char *path)
+{
+    TBCacheHeader want, have;
+    TBCacheEntry *e;
+    long good = 0;
+    FILE *f;
+
+    if (!TCG_TARGET_HAS_CODE_RELOCS) {
+        error_report("-tb-cache isn't supported on this host");
+        exit(1);
+    }
+    f = fopen(path, "r+b");
+    if (f == NULL) {
+        f = fopen(path, "w+b");
+    }
+    if (f == NULL) {
+        error_report("-tb-cache %s: %s", path, strerror(errno));
+        exit(1);
+    }
+    tb_cache_table = g_hash_table_new(tb_cache_hash, tb_cache_equal);
+    tb_cache_header(&want);
+    if (fread(&have, sizeof(have), 1, f) == 1) {
+        if (memcmp(&have, &want, sizeof(want)) == 0) {
+            good = ftell(f);
+            while ((e = tb_cache_read(f)) != NULL) {
+                tb_cache_insert(e);
+                tb_cache_loaded++;
+                good = ftell(f);
+            }
+        } else {
+            error_report("-tb-cache %s: written by another QEMU binary, "
+                         "starting over", path);
+        }
+    }
+    /* drop whatever a crash left half written, and carry on after it */
+    if (good == 0) {
+        rewind(f);
+        fwrite(&want, sizeof(want), 1, f);
+        good = sizeof(want);
+    }
+    if (fseek(f, good, SEEK_SET) != 0 || ftruncate(fileno(f), good) != 0) {
+        error_report("-tb-cache %s: %s", path, strerror(errno));
+        exit(1);
+    }
+    tb_cache_file = f;
+}
+
+/* whether the guest code at pc, on the page at phys_pc, is still e's */
+static bool tb_cache_guest_matches(CPUArchState *env, target_ulong pc,
+                                   tb_page_addr_t phys_pc,
+                                   const TBCacheEntry *e)
+{
+    size_t len = MIN(e->rec.size, TARGET_PAGE_SIZE - (pc & ~TARGET_PAGE_MASK));
+    tb_page_addr_t phys_page2;
+
+    if (memcmp(qemu_map_ram_ptr(NULL, phys_pc), e->guest, len) != 0) {
+        return false;
+    }
+    if (len == e->rec.size) {
+        return true;
+    }
+    /* as for a translation, this may fault the second page in */
+    phys_page2 = get_page_addr_code(env, (pc & TARGET_PAGE_MASK) +
+                                    TARGET_PAGE_SIZE);
+    return memcmp(qemu_map_ram_ptr(NULL, phys_page2), e->guest + len,
+                  e->rec.size - len) == 0;
+}
+
+static void tb_cache_key(TBCacheRecord *rec, CPUState *cpu,
+                         TranslationBlock *tb, tb_page_addr_t phys_pc)
+{
+    memset(rec, 0, sizeof(*rec));
+    rec->phys_pc = phys_pc;
+    rec->pc = tb->pc;
+    rec->cs_base = tb->cs_base;
+    rec->flags = tb->flags;
+    rec->cflags = tb->cflags;
+    rec->mode = tb_cache_mode(cpu);
+}
+
+/* Put the cached code for tb, set up but for pc, cs_base, flags and
+ * cflags, at tb->tc_ptr.  Returns the size of its code, with the size of
+ * the search data after it in *search_size; 0 if there's no cached code
+ * for it; or -1 if it doesn't fit in the region.
+ */
+int tb_cache_load(CPUState *cpu, TranslationBlock *tb,
+                  tb_page_addr_t phys_pc, int *search_size)
+{
+    TBCacheRecord key;
+    TBCacheEntry *e;
+
+    if (!tb_cache_usable(tb)) {
+        return 0;
+    }
+    tb_cache_key(&key, cpu, tb, phys_pc);
+    for (e = g_hash_table_lookup(tb_cache_table, &key); e; e = e->next) {
+        if (tb_cache_guest_matches(cpu->env_ptr, tb->pc, phys_pc, e)) {
+            break;
+        }
+    }
+    if (e == NULL) {
+        tb_cache_misses++;
+        return 0;
+    }
+    if (tb->tc_ptr + e->rec.code_size + e->rec.search_size >
+        tcg_ctx.code_gen_highwater) {
+        return -1;
+    }
+    memcpy(tb->tc_ptr, e->code, e->rec.code_size + e->rec.search_size);
+    if (!tcg_apply_code_relocs(&tcg_ctx, tb, e->relocs, e->rec.nb_relocs)) {
+        /* the helpers are too far from the code buffer this time */
+        tb_cache_misses++;
+        return 0;
+    }
+    tb->size = e->rec.size;
+    tb->icount = e->rec.icount;
+    tb->tc_search = tb->tc_ptr + e->rec.code_size;
+    tb->jmp_reset_offset[0] = e->rec.jmp_reset_offset[0];
+    tb->jmp_reset_offset[1] = e->rec.jmp_reset_offset[1];
+#ifdef USE_DIRECT_JUMP
+    tb->jmp_insn_offset[0] = e->rec.jmp_insn_offset[0];
+    tb->jmp_insn_offset[1] = e->rec.jmp_insn_offset[1];
+#endif
+    flush_icache_range((uintptr_t)tb->tc_ptr,
+                       (uintptr_t)tb->tc_ptr + e->rec.code_size);
+    tb_cache_hits++;
+    *search_size = e->rec.search_size;
+    return e->rec.code_size;
+}
+
+/* Keep tb, just translated, if the backend could say how to move it.  */
+void tb_cache_store(CPUState *cpu, TranslationBlock *tb,
+                    tb_page_addr_t phys_pc, int code_size, int search_size)
+{
+    TBCacheRecord rec;
+    TBCacheEntry *e;
+    tb_page_addr_t phys_page2;
+    size_t len;
+
+    if (!tb_cache_usable(tb) || !tcg_ctx.code_relocs_ok || tb->size == 0) {
+        return;
+    }
+    tb_cache_key(&rec, cpu, tb, phys_pc);
+    rec.size = tb->size;
+    rec.icount = tb->icount;
+    rec.code_size = code_size;
+    rec.search_size = search_size;
+    rec.nb_relocs = tcg_ctx.nb_code_relocs;
+    rec.jmp_reset_offset[0] = tb->jmp_reset_offset[0];
+    rec.jmp_reset_offset[1] = tb->jmp_reset_offset[1];
+#ifdef USE_DIRECT_JUMP
+    rec.jmp_insn_offset[0] = tb->jmp_insn_offset[0];
+    rec.jmp_insn_offset[1] = tb->jmp_insn_offset[1];
+#endif
+    e = tb_cache_entry_new(&rec);
+    memcpy(e->relocs, tcg_ctx.code_relocs,
+           rec.nb_relocs * sizeof(TCGCodeReloc));
+    memcpy(e->code, tb->tc_ptr, code_size + search_size);
+    len = MIN(rec.size, TARGET_PAGE_SIZE - (tb->pc & ~TARGET_PAGE_MASK));
+    memcpy(e->guest, qemu_map_ram_ptr(NULL, phys_pc), len);
+    if (len < rec.size) {
+        /* in the TLB since the translation read it */
+        phys_page2 = get_page_addr_code(cpu->env_ptr,
+                                        (tb->pc & TARGET_PAGE_MASK) +
+                                        TARGET_PAGE_SIZE);
+        memcpy(e->guest + len, qemu_map_ram_ptr(NULL, phys_page2),
+               rec.size - len);
+    }
+    tb_cache_insert(e);
+    tb_cache_stored++;
+
+    fwrite(&e->rec, sizeof(e->rec), 1, tb_cache_file);
+    fwrite(e->relocs, sizeof(TCGCodeReloc), rec.nb_relocs, tb_cache_file);
+    fwrite(e->code, 1, code_size + search_size, tb_cache_file);
+    fwrite(e->guest, 1, rec.size, tb_cache_file);
+}
+
+/* Get ready to generate code for tb, noting what it refers to if it may
+   go in the cache.  */
+void tb_cache_gen_start(TranslationBlock *tb)
+{
+    tcg_ctx.record_code_relocs = tb_cache_usable(tb);
+    tcg_ctx.code_relocs_ok = true;
+    tcg_ctx.nb_code_relocs = 0;
+    tcg_ctx.code_relocs_tb = tb;
+}
+
+void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    if (!tb_cache_file) {
+        return;
+    }
+    cpu_fprintf(f, "TB cache            %u loaded, %u hits, %u misses, "
+                "%u stored\n", tb_cache_loaded, tb_cache_hits,
+                tb_cache_misses, tb_cache_stored);
+}
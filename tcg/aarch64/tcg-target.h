@@ -15,6 +15,8 @@
 
 #define TCG_TARGET_INSN_UNIT_SIZE  4
 #define TCG_TARGET_TLB_DISPLACEMENT_BITS 24
+#define TCG_TARGET_IMPLEMENTS_DYN_TLB 1
+#define TCG_TARGET_HAS_CODE_RELOCS 0
 #undef TCG_TARGET_STACK_GROWSUP
 
 typedef enum {
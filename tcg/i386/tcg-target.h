@@ -27,6 +27,7 @@
 
 #define TCG_TARGET_INSN_UNIT_SIZE  1
 #define TCG_TARGET_TLB_DISPLACEMENT_BITS 31
+#define TCG_TARGET_IMPLEMENTS_DYN_TLB 1
 
 #ifdef __x86_64__
 # define TCG_TARGET_REG_BITS  64
@@ -36,6 +37,14 @@
 # define TCG_TARGET_NB_REGS    8
 #endif
 
+/* the TB cache can only move the 64-bit code, and finds QEMU's own code
+   with the symbols GNU ld defines */
+#if TCG_TARGET_REG_BITS == 64 && defined(__linux__)
+# define TCG_TARGET_HAS_CODE_RELOCS 1
+#else
+# define TCG_TARGET_HAS_CODE_RELOCS 0
+#endif
+
 typedef enum {
     TCG_REG_EAX = 0,
     TCG_REG_ECX,
@@ -28,6 +28,8 @@
 
 #define TCG_TARGET_INSN_UNIT_SIZE 16
 #define TCG_TARGET_TLB_DISPLACEMENT_BITS 21
+#define TCG_TARGET_IMPLEMENTS_DYN_TLB 0
+#define TCG_TARGET_HAS_CODE_RELOCS 0
 
 typedef struct {
     uint64_t lo __attribute__((aligned(16)));
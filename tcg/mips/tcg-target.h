@@ -29,6 +29,8 @@
 
 #define TCG_TARGET_INSN_UNIT_SIZE 4
 #define TCG_TARGET_TLB_DISPLACEMENT_BITS 16
+#define TCG_TARGET_IMPLEMENTS_DYN_TLB 0
+#define TCG_TARGET_HAS_CODE_RELOCS 0
 #define TCG_TARGET_NB_REGS 32
 
 typedef enum {
@@ -27,6 +27,8 @@
 
 #define TCG_TARGET_INSN_UNIT_SIZE 2
 #define TCG_TARGET_TLB_DISPLACEMENT_BITS 19
+#define TCG_TARGET_IMPLEMENTS_DYN_TLB 0
+#define TCG_TARGET_HAS_CODE_RELOCS 0
 
 typedef enum TCGReg {
     TCG_REG_R0 = 0,
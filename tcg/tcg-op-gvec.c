@@ -0,0 +1,462 @@
+/*
+ * Generic vector operation expansion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "cpu.h"
+#include "exec/exec-all.h"
+#include "tcg.h"
+#include "tcg-op.h"
+#include "tcg-op-gvec.h"
+
+typedef void GVecGen3Fn(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b);
+typedef void GVecGen2iFn(unsigned vece, TCGv_i64 d, TCGv_i64 a, int64_t c);
+
+static void expand_3(unsigned vece, uint32_t dofs, uint32_t aofs,
+                     uint32_t bofs, uint32_t oprsz, GVecGen3Fn *fn)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    uint32_t i;
+
+    tcg_debug_assert(oprsz % 8 == 0);
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, tcg_ctx.tcg_env, aofs + i);
+        tcg_gen_ld_i64(t1, tcg_ctx.tcg_env, bofs + i);
+        fn(vece, t0, t0, t1);
+        tcg_gen_st_i64(t0, tcg_ctx.tcg_env, dofs + i);
+    }
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t0);
+}
+
+static void expand_2i(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      int64_t c, uint32_t oprsz, GVecGen2iFn *fn)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    uint32_t i;
+
+    tcg_debug_assert(oprsz % 8 == 0);
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, tcg_ctx.tcg_env, aofs + i);
+        fn(vece, t0, t0, c);
+        tcg_gen_st_i64(t0, tcg_ctx.tcg_env, dofs + i);
+    }
+    tcg_temp_free_i64(t0);
+}
+
+void tcg_gen_gvec_mov(uint32_t dofs, uint32_t aofs, uint32_t oprsz)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    uint32_t i;
+
+    tcg_debug_assert(oprsz % 8 == 0);
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, tcg_ctx.tcg_env, aofs + i);
+        tcg_gen_st_i64(t0, tcg_ctx.tcg_env, dofs + i);
+    }
+    tcg_temp_free_i64(t0);
+}
+
+void tcg_gen_gvec_dup64i(uint32_t dofs, uint32_t oprsz, uint64_t x)
+{
+    TCGv_i64 t0 = tcg_const_i64(x);
+    uint32_t i;
+
+    tcg_debug_assert(oprsz % 8 == 0);
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_st_i64(t0, tcg_ctx.tcg_env, dofs + i);
+    }
+    tcg_temp_free_i64(t0);
+}
+
+/* Logic */
+
+static void gen_and(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_and_i64(d, a, b);
+}
+
+static void gen_or(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_or_i64(d, a, b);
+}
+
+static void gen_xor(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_xor_i64(d, a, b);
+}
+
+static void gen_andc(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_andc_i64(d, a, b);
+}
+
+void tcg_gen_gvec_and(uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz)
+{
+    expand_3(MO_64, dofs, aofs, bofs, oprsz, gen_and);
+}
+
+void tcg_gen_gvec_or(uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                     uint32_t oprsz)
+{
+    expand_3(MO_64, dofs, aofs, bofs, oprsz, gen_or);
+}
+
+void tcg_gen_gvec_xor(uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz)
+{
+    if (aofs == bofs) {
+        /* the usual way to clear a register */
+        tcg_gen_gvec_dup64i(dofs, oprsz, 0);
+        return;
+    }
+    expand_3(MO_64, dofs, aofs, bofs, oprsz, gen_xor);
+}
+
+void tcg_gen_gvec_andc(uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                       uint32_t oprsz)
+{
+    expand_3(MO_64, dofs, aofs, bofs, oprsz, gen_andc);
+}
+
+/* Arithmetic.  m has the top bit of each element: the low bits are added
+   without letting the carry out of the element, and the top bit is then
+   the sum of the two top bits and that carry.  */
+
+static void gen_addv_mask(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b, TCGv_i64 m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_andc_i64(t1, a, m);
+    tcg_gen_andc_i64(t2, b, m);
+    tcg_gen_xor_i64(t3, a, b);
+    tcg_gen_add_i64(d, t1, t2);
+    tcg_gen_and_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+/* likewise, with the top bits set in a so no borrow leaves an element */
+static void gen_subv_mask(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b, TCGv_i64 m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_or_i64(t1, a, m);
+    tcg_gen_andc_i64(t2, b, m);
+    tcg_gen_eqv_i64(t3, a, b);
+    tcg_gen_sub_i64(d, t1, t2);
+    tcg_gen_and_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+void tcg_gen_vec_add8_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 m = tcg_const_i64(dup_const(MO_8, 0x80));
+    gen_addv_mask(d, a, b, m);
+    tcg_temp_free_i64(m);
+}
+
+void tcg_gen_vec_add16_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 m = tcg_const_i64(dup_const(MO_16, 0x8000));
+    gen_addv_mask(d, a, b, m);
+    tcg_temp_free_i64(m);
+}
+
+void tcg_gen_vec_add32_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+
+    /* the high half can't carry in from the low one if that's zero */
+    tcg_gen_andi_i64(t1, a, ~0xffffffffull);
+    tcg_gen_add_i64(t2, a, b);
+    tcg_gen_add_i64(t1, t1, b);
+    tcg_gen_deposit_i64(d, t1, t2, 0, 32);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+}
+
+void tcg_gen_vec_sub8_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 m = tcg_const_i64(dup_const(MO_8, 0x80));
+    gen_subv_mask(d, a, b, m);
+    tcg_temp_free_i64(m);
+}
+
+void tcg_gen_vec_sub16_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 m = tcg_const_i64(dup_const(MO_16, 0x8000));
+    gen_subv_mask(d, a, b, m);
+    tcg_temp_free_i64(m);
+}
+
+void tcg_gen_vec_sub32_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+
+    tcg_gen_andi_i64(t1, b, ~0xffffffffull);
+    tcg_gen_sub_i64(t2, a, b);
+    tcg_gen_sub_i64(t1, a, t1);
+    tcg_gen_deposit_i64(d, t1, t2, 0, 32);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+}
+
+static void gen_add(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    switch (vece) {
+    case MO_8:
+        tcg_gen_vec_add8_i64(d, a, b);
+        break;
+    case MO_16:
+        tcg_gen_vec_add16_i64(d, a, b);
+        break;
+    case MO_32:
+        tcg_gen_vec_add32_i64(d, a, b);
+        break;
+    default:
+        tcg_gen_add_i64(d, a, b);
+        break;
+    }
+}
+
+static void gen_sub(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    switch (vece) {
+    case MO_8:
+        tcg_gen_vec_sub8_i64(d, a, b);
+        break;
+    case MO_16:
+        tcg_gen_vec_sub16_i64(d, a, b);
+        break;
+    case MO_32:
+        tcg_gen_vec_sub32_i64(d, a, b);
+        break;
+    default:
+        tcg_gen_sub_i64(d, a, b);
+        break;
+    }
+}
+
+void tcg_gen_gvec_add(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz)
+{
+    expand_3(vece, dofs, aofs, bofs, oprsz, gen_add);
+}
+
+void tcg_gen_gvec_sub(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz)
+{
+    expand_3(vece, dofs, aofs, bofs, oprsz, gen_sub);
+}
+
+/* Comparison.  An element of a ^ b is zero iff its low bits plus all ones
+   don't carry into the top bit and the top bit itself is clear; that
+   leaves one bit per equal element, which a multiply spreads over it.  */
+
+static void gen_cmpeq(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    unsigned bits = 8 << vece;
+    uint64_t low = dup_const(vece, (1ull << (bits - 1)) - 1);
+    TCGv_i64 t = tcg_temp_new_i64();
+
+    tcg_gen_xor_i64(t, a, b);
+    if (vece == MO_64) {
+        tcg_gen_setcondi_i64(TCG_COND_EQ, d, t, 0);
+        tcg_gen_neg_i64(d, d);
+    } else {
+        tcg_gen_andi_i64(d, t, low);
+        tcg_gen_addi_i64(d, d, low);
+        tcg_gen_or_i64(d, d, t);
+        tcg_gen_ori_i64(d, d, low);
+        tcg_gen_not_i64(d, d);
+        tcg_gen_shri_i64(d, d, bits - 1);
+        tcg_gen_muli_i64(d, d, (2ull << (bits - 1)) - 1);
+    }
+    tcg_temp_free_i64(t);
+}
+
+static void gen_cmpne(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    gen_cmpeq(vece, d, a, b);
+    tcg_gen_not_i64(d, d);
+}
+
+void tcg_gen_gvec_cmp(TCGCond cond, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz)
+{
+    switch (cond) {
+    case TCG_COND_EQ:
+        expand_3(vece, dofs, aofs, bofs, oprsz, gen_cmpeq);
+        break;
+    case TCG_COND_NE:
+        expand_3(vece, dofs, aofs, bofs, oprsz, gen_cmpne);
+        break;
+    default:
+        tcg_abort();
+    }
+}
+
+/* Shifts.  The whole 64 bits are shifted, and the bits that crossed into
+   the next element masked off.  */
+
+static void gen_shli_mask(unsigned vece, TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    uint64_t mask = dup_const(vece, (MAKE_64BIT_MASK(0, 8 << vece)) << c);
+
+    tcg_gen_shli_i64(d, a, c);
+    tcg_gen_andi_i64(d, d, mask);
+}
+
+static void gen_shri_mask(unsigned vece, TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    uint64_t mask = dup_const(vece, (MAKE_64BIT_MASK(0, 8 << vece)) >> c);
+
+    tcg_gen_shri_i64(d, a, c);
+    tcg_gen_andi_i64(d, d, mask);
+}
+
+/* a logical shift, with each element's sign bit copied into the bits
+   above where it landed */
+static void gen_sari_mask(unsigned vece, TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    unsigned bits = 8 << vece;
+    uint64_t s_mask = dup_const(vece, (1ull << (bits - 1)) >> c);
+    uint64_t c_mask = dup_const(vece, MAKE_64BIT_MASK(0, bits) >> c);
+    TCGv_i64 s = tcg_temp_new_i64();
+
+    tcg_gen_shri_i64(d, a, c);
+    tcg_gen_andi_i64(s, d, s_mask);
+    tcg_gen_muli_i64(s, s, (2 << c) - 2);
+    tcg_gen_andi_i64(d, d, c_mask);
+    tcg_gen_or_i64(d, d, s);
+
+    tcg_temp_free_i64(s);
+}
+
+void tcg_gen_vec_shl8i_i64(TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    gen_shli_mask(MO_8, d, a, c);
+}
+
+void tcg_gen_vec_shl16i_i64(TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    gen_shli_mask(MO_16, d, a, c);
+}
+
+void tcg_gen_vec_shr8i_i64(TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    gen_shri_mask(MO_8, d, a, c);
+}
+
+void tcg_gen_vec_shr16i_i64(TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    gen_shri_mask(MO_16, d, a, c);
+}
+
+void tcg_gen_vec_sar8i_i64(TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    gen_sari_mask(MO_8, d, a, c);
+}
+
+void tcg_gen_vec_sar16i_i64(TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    gen_sari_mask(MO_16, d, a, c);
+}
+
+static void gen_shli(unsigned vece, TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    if (vece == MO_64) {
+        tcg_gen_shli_i64(d, a, c);
+    } else {
+        gen_shli_mask(vece, d, a, c);
+    }
+}
+
+static void gen_shri(unsigned vece, TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    if (vece == MO_64) {
+        tcg_gen_shri_i64(d, a, c);
+    } else {
+        gen_shri_mask(vece, d, a, c);
+    }
+}
+
+static void gen_sari(unsigned vece, TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    if (vece == MO_64) {
+        tcg_gen_sari_i64(d, a, c);
+    } else {
+        gen_sari_mask(vece, d, a, c);
+    }
+}
+
+void tcg_gen_gvec_shli(unsigned vece, uint32_t dofs, uint32_t aofs,
+                       int64_t shift, uint32_t oprsz)
+{
+    tcg_debug_assert(shift >= 0 && shift < (8 << vece));
+    if (shift == 0) {
+        if (dofs != aofs) {
+            tcg_gen_gvec_mov(dofs, aofs, oprsz);
+        }
+        return;
+    }
+    expand_2i(vece, dofs, aofs, shift, oprsz, gen_shli);
+}
+
+void tcg_gen_gvec_shri(unsigned vece, uint32_t dofs, uint32_t aofs,
+                       int64_t shift, uint32_t oprsz)
+{
+    tcg_debug_assert(shift >= 0 && shift < (8 << vece));
+    if (shift == 0) {
+        if (dofs != aofs) {
+            tcg_gen_gvec_mov(dofs, aofs, oprsz);
+        }
+        return;
+    }
+    expand_2i(vece, dofs, aofs, shift, oprsz, gen_shri);
+}
+
+void tcg_gen_gvec_sari(unsigned vece, uint32_t dofs, uint32_t aofs,
+                       int64_t shift, uint32_t oprsz)
+{
+    tcg_debug_assert(shift >= 0 && shift < (8 << vece));
+    if (shift == 0) {
+        if (dofs != aofs) {
+            tcg_gen_gvec_mov(dofs, aofs, oprsz);
+        }
+        return;
+    }
+    expand_2i(vece, dofs, aofs, shift, oprsz, gen_sari);
+}
@@ -250,6 +250,63 @@ TCGLabel *gen_new_label(void)
     return l;
 }
 
+/* -tb-cache: note that the field just written, at code_ptr minus its
+   size, refers to dest, in case that moves from one run to the next */
+
+#if TCG_TARGET_HAS_CODE_RELOCS
+extern const char __executable_start[], etext[];
+
+static void __attribute__((unused))
+tcg_note_code_ref(TCGContext *s, bool rel32, uintptr_t dest)
+{
+    uintptr_t tb = (uintptr_t)s->code_relocs_tb;
+    uintptr_t prologue = (uintptr_t)s->code_gen_prologue;
+    TCGCodeReloc *r;
+    int kind;
+
+    if (!s->record_code_relocs) {
+        return;
+    }
+    if (dest >= (uintptr_t)s->code_buf && dest <= (uintptr_t)s->code_ptr) {
+        if (rel32) {
+            /* moves with the code */
+            return;
+        }
+        dest -= (uintptr_t)s->code_buf;
+        kind = TCG_CODE_RELOC_SELF;
+    } else if ((dest & ~(uintptr_t)TB_EXIT_MASK) == tb) {
+        dest -= tb;
+        kind = TCG_CODE_RELOC_TB;
+    } else if (dest >= prologue && dest < (uintptr_t)s->code_gen_buffer) {
+        dest -= prologue;
+        kind = TCG_CODE_RELOC_PROLOGUE;
+    } else if (dest >= (uintptr_t)__executable_start &&
+               dest < (uintptr_t)etext) {
+        dest -= (uintptr_t)__executable_start;
+        kind = TCG_CODE_RELOC_HOST;
+    } else {
+        /* a plugin's helper, say */
+        s->code_relocs_ok = false;
+        return;
+    }
+    if (s->nb_code_relocs == TCG_MAX_CODE_RELOCS) {
+        s->code_relocs_ok = false;
+        return;
+    }
+    r = &s->code_relocs[s->nb_code_relocs++];
+    r->offset = tcg_current_code_size(s) - (rel32 ? 4 : 8);
+    r->kind = kind;
+    r->rel32 = rel32;
+    r->pad = 0;
+    r->addend = dest;
+}
+#else
+static inline void tcg_note_code_ref(TCGContext *s, bool rel32,
+                                     uintptr_t dest)
+{
+}
+#endif
+
 #include "tcg-target.inc.c"
 
 /* pool based memory allocation */
@@ -318,6 +375,9 @@ static const TCGHelperInfo all_helpers[] = {
 #include "exec/helper-tcg.h"
 };
 
+bool tcg_count_helpers;
+static uint64_t helper_calls[ARRAY_SIZE(all_helpers)];
+
 static int indirect_reg_alloc_order[ARRAY_SIZE(tcg_target_reg_alloc_order)];
 
 void tcg_context_init(TCGContext *s)
@@ -404,9 +464,8 @@ void tcg_prologue_init(TCGContext *s)
     s->code_gen_buffer_size = total_size;
 
     /* Compute a high-water mark, at which we voluntarily flush the buffer
-       and start over.  The size here is arbitrary, significantly larger
-       than we expect the code generation for any one opcode to require.  */
-    s->code_gen_highwater = s->code_gen_buffer + (total_size - 1024);
+       and start over.  TB regions move it as they are filled in turn.  */
+    s->code_gen_highwater = s->code_gen_buffer + (total_size - TCG_HIGHWATER);
 
     tcg_register_jit(s->code_gen_buffer, total_size);
 
@@ -441,6 +500,7 @@ void tcg_func_start(TCGContext *s)
     s->gen_op_buf[0].prev = 0;
     s->gen_next_op_idx = 1;
     s->gen_next_parm_idx = 0;
+    memset(s->panda_tcg_only_ops, 0, sizeof(s->panda_tcg_only_ops));
 
     s->be = tcg_malloc(sizeof(TCGBackendData));
 }
@@ -736,6 +796,17 @@ void tcg_gen_callN(TCGContext *s, void *func, TCGArg ret,
     flags = info->flags;
     sizemask = info->sizemask;
 
+    if (tcg_count_helpers) {
+        TCGv_ptr ptr = tcg_const_ptr(&helper_calls[info - all_helpers]);
+        TCGv_i64 calls = tcg_temp_new_i64();
+
+        tcg_gen_ld_i64(calls, ptr, 0);
+        tcg_gen_addi_i64(calls, calls, 1);
+        tcg_gen_st_i64(calls, ptr, 0);
+        tcg_temp_free_i64(calls);
+        tcg_temp_free_ptr(ptr);
+    }
+
 #if defined(__sparc__) && !defined(__arch64__) \
     && !defined(CONFIG_TCG_INTERPRETER)
     /* We have 64-bit values in one register, but need to pass as two
@@ -1422,6 +1493,74 @@ static inline void tcg_la_bb_end(TCGContext *s, uint8_t *temp_state)
     }
 }
 
+/* liveness analysis: what has to hold at the start of a basic block, given
+   the state at its first op: globals and local temps that are read before
+   they're written, or that have to be in memory by then for any other
+   reason, have to be in memory on the way in; everything else is dead. */
+static void tcg_la_bb_entry(TCGContext *s, uint8_t *dst,
+                            const uint8_t *temp_state)
+{
+    int i, n;
+
+    for (i = 0, n = s->nb_temps; i < n; i++) {
+        if (i < s->nb_globals || s->temps[i].temp_local) {
+            dst[i] = temp_state[i] == TS_DEAD ? TS_DEAD : TS_DEAD | TS_MEM;
+        } else {
+            dst[i] = TS_DEAD;
+        }
+    }
+}
+
+/* liveness analysis: end of a basic block ended by OP.  Branches within
+   the TB are forward, so by the time the backward walk gets to one, the
+   block it goes to has been seen and what it needs is known: a write to a
+   global (a guest flag, say) that every path overwrites before reading
+   it, and before anything that needs it in memory, is dead.  Without
+   this, every global had to be in memory at every branch. */
+static void tcg_la_bb_end_op(TCGContext *s, uint8_t *temp_state,
+                             uint8_t *label_state, TCGOp *op, TCGArg *args)
+{
+    int nb_temps = s->nb_temps;
+    TCGLabel *l;
+    int i;
+
+    switch (op->opc) {
+    case INDEX_op_set_label:
+        l = arg_label(args[0]);
+        tcg_la_bb_entry(s, label_state + l->id * nb_temps, temp_state);
+        memcpy(temp_state, label_state + l->id * nb_temps, nb_temps);
+        return;
+    case INDEX_op_br:
+        l = arg_label(args[0]);
+        break;
+    case INDEX_op_brcond_i32:
+    case INDEX_op_brcond_i64:
+        l = arg_label(args[3]);
+        break;
+    case INDEX_op_brcond2_i32:
+        l = arg_label(args[5]);
+        break;
+    default:
+        tcg_la_bb_end(s, temp_state);
+        return;
+    }
+
+    if (label_state[l->id * nb_temps] == 0) {
+        /* a backward branch, to a block not seen yet */
+        tcg_la_bb_end(s, temp_state);
+        return;
+    }
+    if (op->opc == INDEX_op_br) {
+        memcpy(temp_state, label_state + l->id * nb_temps, nb_temps);
+        return;
+    }
+    /* needed on the way into either block */
+    tcg_la_bb_entry(s, temp_state, temp_state);
+    for (i = 0; i < nb_temps; i++) {
+        temp_state[i] |= label_state[l->id * nb_temps + i];
+    }
+}
+
 /* Liveness analysis : update the opc_arg_life array to tell if a
    given input arguments is dead. Instructions updating dead
    temporaries are removed. */
@@ -1429,7 +1568,11 @@ static void liveness_pass_1(TCGContext *s, uint8_t *temp_state)
 {
     int nb_globals = s->nb_globals;
     int oi, oi_prev;
+    /* per label, what the block it starts needs on the way in; all 0
+       until the walk gets to the label */
+    uint8_t *label_state = tcg_malloc(s->nb_labels * s->nb_temps + 1);
 
+    memset(label_state, 0, s->nb_labels * s->nb_temps + 1);
     tcg_la_func_end(s, temp_state);
 
     for (oi = s->gen_op_buf[0].prev; oi != 0; oi = oi_prev) {
@@ -1626,7 +1769,7 @@ static void liveness_pass_1(TCGContext *s, uint8_t *temp_state)
 
                 /* if end of basic block, update */
                 if (def->flags & TCG_OPF_BB_END) {
-                    tcg_la_bb_end(s, temp_state);
+                    tcg_la_bb_end_op(s, temp_state, label_state, op, args);
                 } else if (def->flags & TCG_OPF_SIDE_EFFECTS) {
                     /* globals should be synced to memory */
                     for (i = 0; i < nb_globals; i++) {
@@ -2518,6 +2661,20 @@ void tcg_dump_op_count(FILE *f, fprintf_function cpu_fprintf)
 }
 #endif
 
+void tcg_dump_helper_calls(FILE *f)
+{
+    const char *sep = "";
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(all_helpers); i++) {
+        if (helper_calls[i]) {
+            fprintf(f, "%s\n        \"%s\": %" PRIu64, sep,
+                    all_helpers[i].name, helper_calls[i]);
+            sep = ",";
+        }
+    }
+}
+
 
 int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
 {
@@ -2694,6 +2851,52 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
     return tcg_current_code_size(s);
 }
 
+/* Point the code the TB cache copied to tb->tc_ptr at what it refers to
+   in this process.  Fails if a displacement no longer fits.  */
+bool tcg_apply_code_relocs(TCGContext *s, TranslationBlock *tb,
+                           const TCGCodeReloc *relocs, int nb_relocs)
+{
+#if TCG_TARGET_HAS_CODE_RELOCS
+    uint8_t *code = tb->tc_ptr;
+    int i;
+
+    for (i = 0; i < nb_relocs; i++) {
+        const TCGCodeReloc *r = &relocs[i];
+        uintptr_t base;
+        intptr_t disp;
+
+        switch (r->kind) {
+        case TCG_CODE_RELOC_SELF:
+            base = (uintptr_t)code;
+            break;
+        case TCG_CODE_RELOC_TB:
+            base = (uintptr_t)tb;
+            break;
+        case TCG_CODE_RELOC_PROLOGUE:
+            base = (uintptr_t)s->code_gen_prologue;
+            break;
+        case TCG_CODE_RELOC_HOST:
+            base = (uintptr_t)__executable_start;
+            break;
+        default:
+            return false;
+        }
+        if (r->rel32) {
+            disp = base + r->addend - (uintptr_t)(code + r->offset + 4);
+            if (disp != (int32_t)disp) {
+                return false;
+            }
+            stl_le_p(code + r->offset, disp);
+        } else {
+            stq_le_p(code + r->offset, base + r->addend);
+        }
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
 #ifdef CONFIG_PROFILER
 void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf)
 {
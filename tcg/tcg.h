@@ -597,6 +597,28 @@ typedef struct TCGTemp {
 
 typedef struct TCGContext TCGContext;
 
+/* A place in a TB's code that refers to something whose address changes
+   from one run to the next, so the TB cache (-tb-cache) can move the code
+   into another process.  The field is a 64-bit address or a 32-bit
+   displacement from its own end, and what it refers to is addend bytes
+   past the base kind names.  */
+typedef enum TCGCodeRelocKind {
+    TCG_CODE_RELOC_SELF,        /* the TB's own code */
+    TCG_CODE_RELOC_TB,          /* the TranslationBlock */
+    TCG_CODE_RELOC_PROLOGUE,    /* code_gen_prologue */
+    TCG_CODE_RELOC_HOST,        /* QEMU's own code (__executable_start) */
+} TCGCodeRelocKind;
+
+typedef struct TCGCodeReloc {
+    uint32_t offset;            /* of the field, from the start of the code */
+    uint8_t kind;               /* TCGCodeRelocKind */
+    uint8_t rel32;
+    uint16_t pad;
+    int64_t addend;
+} TCGCodeReloc;
+
+#define TCG_MAX_CODE_RELOCS 1024
+
 typedef struct TCGTempSet {
     unsigned long l[BITS_TO_LONGS(TCG_MAX_TEMPS)];
 } TCGTempSet;
@@ -705,6 +727,15 @@ struct TCGContext {
 
     TBContext tb_ctx;
 
+    /* -tb-cache: while record_code_relocs is set, the backend notes where
+       the code refers to addresses that change from run to run, and
+       clears code_relocs_ok if it refers to one the cache can't move */
+    bool record_code_relocs;
+    bool code_relocs_ok;
+    int nb_code_relocs;
+    TranslationBlock *code_relocs_tb;
+    TCGCodeReloc code_relocs[TCG_MAX_CODE_RELOCS];
+
     /* Track which vCPU triggers events */
     CPUState *cpu;                      /* *_trans */
     TCGv_env tcg_env;                   /* *_exec  */
@@ -721,6 +752,9 @@ struct TCGContext {
 
     TCGOp gen_op_buf[OPC_BUF_SIZE];
     TCGArg gen_opparam_buf[OPPARAM_BUF_SIZE];
+    /* PANDA: ops that only the TCG code gets; the LLVM translation does
+       the same job its own way.  Indexed like gen_op_buf.  */
+    unsigned long panda_tcg_only_ops[BITS_TO_LONGS(OPC_BUF_SIZE)];
 
     uint16_t gen_insn_end_off[TCG_MAX_INSNS];
     target_ulong gen_insn_data[TCG_MAX_INSNS][TARGET_INSN_START_WORDS];
@@ -729,6 +763,18 @@ struct TCGContext {
 extern TCGContext tcg_ctx;
 extern bool parallel_cpus;
 
+/* Room left past code_gen_highwater; significantly larger than we
+   expect the code generation for any one opcode to require.  */
+#define TCG_HIGHWATER 1024
+
+/* A guest whose words don't fit in a host register can't have its TLB
+ * entries updated atomically, which multi-threaded TCG relies on.  */
+#if TARGET_LONG_BITS > TCG_TARGET_REG_BITS
+#define TCG_OVERSIZED_GUEST 1
+#else
+#define TCG_OVERSIZED_GUEST 0
+#endif
+
 static inline void tcg_set_insn_param(int op_idx, int arg, TCGArg v)
 {
     int op_argi = tcg_ctx.gen_op_buf[op_idx].args;
@@ -741,6 +787,16 @@ static inline int tcg_op_buf_count(void)
     return tcg_ctx.gen_next_op_idx;
 }
 
+/* PANDA: mark the ops emitted since tcg_op_buf_count() returned FIRST as
+   TCG-only (see panda_tcg_only_ops).  */
+static inline void tcg_mark_tcg_only_ops(int first)
+{
+    int i;
+    for (i = first; i < tcg_ctx.gen_next_op_idx; i++) {
+        set_bit(i, tcg_ctx.panda_tcg_only_ops);
+    }
+}
+
 /* Test for whether to terminate the TB for using too many opcodes.  */
 static inline bool tcg_op_buf_full(void)
 {
@@ -778,6 +834,8 @@ void tcg_prologue_init(TCGContext *s);
 void tcg_func_start(TCGContext *s);
 
 int tcg_gen_code(TCGContext *s, TranslationBlock *tb);
+bool tcg_apply_code_relocs(TCGContext *s, TranslationBlock *tb,
+                           const TCGCodeReloc *relocs, int nb_relocs);
 
 void tcg_set_frame(TCGContext *s, TCGReg reg, intptr_t start, intptr_t size);
 
@@ -842,6 +900,11 @@ int tcg_check_temp_count(void);
 void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf);
 void tcg_dump_op_count(FILE *f, fprintf_function cpu_fprintf);
 
+/* Have generated code count its calls to each helper (for -exec-stats) */
+extern bool tcg_count_helpers;
+/* Write the nonzero counts as the members of a JSON object */
+void tcg_dump_helper_calls(FILE *f);
+
 #define TCG_CT_ALIAS  0x80
 #define TCG_CT_IALIAS 0x40
 #define TCG_CT_REG    0x01
@@ -915,7 +978,10 @@ void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs);
 #define TCGV_NAT_TO_PTR(n) MAKE_TCGV_PTR(GET_TCGV_I64(n))
 #define TCGV_PTR_TO_NAT(n) MAKE_TCGV_I64(GET_TCGV_PTR(n))
 
-#define tcg_const_ptr(V) TCGV_NAT_TO_PTR(tcg_const_i64((intptr_t)(V)))
+/* a host address in the code: the TB cache (-tb-cache) can't keep it */
+#define tcg_const_ptr(V) \
+    (tcg_ctx.code_relocs_ok = false, \
+     TCGV_NAT_TO_PTR(tcg_const_i64((intptr_t)(V))))
 #define tcg_global_reg_new_ptr(R, N) \
     TCGV_NAT_TO_PTR(tcg_global_reg_new_i64((R), (N)))
 #define tcg_global_mem_new_ptr(R, O, N) \
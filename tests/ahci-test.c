@@ -1441,6 +1441,44 @@ static void test_ncq_simple(void)
     ahci_shutdown(ahci);
 }
 
+/**
+ * Command completion coalescing: with CC = 2, only every second NCQ
+ * completion raises the CCC interrupt, and the port never raises its own.
+ */
+static void test_ncq_coalescing(void)
+{
+    AHCIQState *ahci;
+    uint64_t ptr;
+    uint32_t reg, ccc_int;
+    uint8_t port;
+
+    ahci = ahci_boot_and_enable(NULL);
+    g_assert(BITSET(ahci->cap, AHCI_CAP_CCCS));
+    port = ahci_port_select(ahci);
+    ahci_port_clear(ahci, port);
+    ptr = ahci_alloc(ahci, 4096);
+
+    /* The timeout only runs when the test steps the clock */
+    ahci_wreg(ahci, AHCI_CCCPORTS, 1 << port);
+    ahci_wreg(ahci, AHCI_CCCCTL, AHCI_CCCCTL_EN | (2 << 8) | (0xFFFF << 16));
+    ccc_int = (ahci_rreg(ahci, AHCI_CCCCTL) >> 3) & 0x1F;
+
+    ahci_guest_io(ahci, port, READ_FPDMA_QUEUED, ptr, 4096, 0);
+    reg = ahci_rreg(ahci, AHCI_IS);
+    ASSERT_BIT_CLEAR(reg, 1 << ccc_int);
+
+    ahci_guest_io(ahci, port, READ_FPDMA_QUEUED, ptr, 4096, 0);
+    reg = ahci_rreg(ahci, AHCI_IS);
+    ASSERT_BIT_SET(reg, 1 << ccc_int);
+    ASSERT_BIT_CLEAR(reg, 1 << port);
+
+    ahci_wreg(ahci, AHCI_IS, 1 << ccc_int);
+    g_assert_cmphex(ahci_rreg(ahci, AHCI_IS), ==, 0);
+
+    ahci_free(ahci, ptr);
+    ahci_shutdown(ahci);
+}
+
 static int prepare_iso(size_t size, unsigned char **buf, char **name)
 {
     char cdrom_path[] = "/tmp/qtest.iso.XXXXXX";
@@ -1933,6 +1971,7 @@ int main(int argc, char **argv)
     qtest_add_func("/ahci/io/ncq/simple", test_ncq_simple);
     qtest_add_func("/ahci/migrate/ncq/simple", test_migrate_ncq);
     qtest_add_func("/ahci/io/ncq/retry", test_halted_ncq);
+    qtest_add_func("/ahci/io/ncq/coalescing", test_ncq_coalescing);
     qtest_add_func("/ahci/migrate/ncq/halted", test_migrate_halted_ncq);
 
     qtest_add_func("/ahci/cdrom/dma/single", test_cdrom_dma);
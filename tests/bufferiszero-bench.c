@@ -0,0 +1,110 @@
+/*
+ * buffer_is_zero() microbenchmark
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "qemu/timer.h"
+
+static size_t buf_size = 4096;
+static long dirty_offset = -1;
+static unsigned int duration = 1;
+
+static const char commands_string[] =
+    " -s = buffer size in bytes (default 4096)\n"
+    " -o = offset of a non-zero byte in the buffer (default: all zero)\n"
+    " -d = duration in seconds per accelerator";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hs:o:d:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 's':
+            buf_size = atol(optarg);
+            break;
+        case 'o':
+            dirty_offset = atol(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        default:
+            usage_complete(argv);
+            exit(1);
+        }
+    }
+
+    if (buf_size == 0 || dirty_offset >= (long)buf_size) {
+        fprintf(stderr, "invalid buffer size or offset\n");
+        exit(1);
+    }
+}
+
+static void run_one(const uint8_t *buf, unsigned int accel)
+{
+    int64_t start, end, now;
+    uint64_t n = 0;
+    bool expected = dirty_offset < 0;
+
+    start = get_clock();
+    end = start + duration * NANOSECONDS_PER_SECOND;
+    do {
+        unsigned int i;
+
+        /* Check the clock only every so often */
+        for (i = 0; i < 1024; i++) {
+            if (buffer_is_zero(buf, buf_size) != expected) {
+                fprintf(stderr, "wrong result from buffer_is_zero\n");
+                exit(1);
+            }
+        }
+        n += 1024;
+        now = get_clock();
+    } while (now < end);
+
+    printf("accel %u: %.2f ns/call, %.2f MB/s\n", accel,
+           (double)(now - start) / n,
+           (double)n * buf_size * 1000 / (now - start));
+}
+
+int main(int argc, char *argv[])
+{
+    uint8_t *buf;
+    unsigned int accel = 0;
+
+    parse_args(argc, argv);
+
+    buf = qemu_memalign(64, buf_size);
+    memset(buf, 0, buf_size);
+    if (dirty_offset >= 0) {
+        buf[dirty_offset] = 1;
+    }
+
+    printf("size %zu, %s\n", buf_size,
+           dirty_offset < 0 ? "zero" : "non-zero");
+
+    /* The most preferred accelerator comes first */
+    do {
+        run_one(buf, accel++);
+    } while (test_buffer_is_zero_next_accel());
+
+    qemu_vfree(buf);
+    return 0;
+}
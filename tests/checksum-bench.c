@@ -0,0 +1,100 @@
+/*
+ * net_checksum_add() microbenchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+#include "net/checksum.h"
+
+static unsigned int duration = 1;
+static unsigned int offset;
+
+static const char commands_string[] =
+    " -o = misalignment of the buffer in bytes (default 0)\n"
+    " -d = duration in seconds per size";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "ho:d:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'o':
+            offset = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        default:
+            usage_complete(argv);
+            exit(1);
+        }
+    }
+
+    if (offset >= 64) {
+        fprintf(stderr, "invalid offset\n");
+        exit(1);
+    }
+}
+
+static void run_one(uint8_t *buf, int len)
+{
+    int64_t start, end, now;
+    uint64_t n = 0;
+    uint32_t sum = 0;
+
+    start = get_clock();
+    end = start + duration * NANOSECONDS_PER_SECOND;
+    do {
+        unsigned int i;
+
+        /* Check the clock only every so often */
+        for (i = 0; i < 1024; i++) {
+            sum += net_checksum_add(len, buf);
+        }
+        n += 1024;
+        now = get_clock();
+    } while (now < end);
+
+    printf("size %5d: %8.2f ns/call, %8.2f MB/s (sum %04x)\n", len,
+           (double)(now - start) / n,
+           (double)n * len * 1000 / (now - start),
+           net_checksum_finish(sum));
+}
+
+int main(int argc, char *argv[])
+{
+    /* Headers, typical MTU, jumbo frames and TSO/GSO segments */
+    static const int sizes[] = { 20, 64, 576, 1500, 9000, 65535 };
+    uint8_t *buf;
+    int i;
+
+    parse_args(argc, argv);
+
+    buf = qemu_memalign(64, 65536 + 64);
+    for (i = 0; i < 65536 + 64; i++) {
+        buf[i] = i * 7;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        run_one(buf + offset, sizes[i]);
+    }
+
+    qemu_vfree(buf);
+    return 0;
+}
@@ -0,0 +1,37 @@
+/*
+ * Floating-point workload for TCG benchmarks: double-precision adds,
+ * multiplies, divides and square roots, i.e. mostly softfloat helpers.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+int main(int argc, char **argv)
+{
+    unsigned long n = argc > 1 ? strtoul(argv[1], NULL, 0) : 200;
+    double sum = 0;
+    unsigned long i;
+    int x, y, k;
+
+    /* a small Mandelbrot set, n times over */
+    for (i = 0; i < n; i++) {
+        for (y = 0; y < 64; y++) {
+            for (x = 0; x < 64; x++) {
+                double cr = x / 32.0 - 1.5, ci = y / 32.0 - 1.0;
+                double zr = 0, zi = 0;
+
+                for (k = 0; k < 32 && zr * zr + zi * zi < 4.0; k++) {
+                    double t = zr * zr - zi * zi + cr;
+                    zi = 2 * zr * zi + ci;
+                    zr = t;
+                }
+                sum += sqrt(zr * zr + zi * zi) / (k + 1);
+            }
+        }
+    }
+    printf("fp: %.6e\n", sum);
+    return 0;
+}
@@ -0,0 +1,31 @@
+/*
+ * Integer workload for TCG benchmarks: shifts, multiplies, divides and
+ * data-dependent branches on registers, no memory to speak of.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+int main(int argc, char **argv)
+{
+    unsigned long n = argc > 1 ? strtoul(argv[1], NULL, 0) : 20000000;
+    uint32_t x = 2463534242u, sum = 0;
+    unsigned long i;
+
+    for (i = 0; i < n; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        if (x & 1) {
+            sum += x * 2654435761u;
+        } else {
+            sum ^= x / ((i & 0xff) + 1);
+        }
+        sum = (sum << 3) | (sum >> 29);
+    }
+    printf("int: %08x\n", sum);
+    return 0;
+}
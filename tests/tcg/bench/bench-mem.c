@@ -0,0 +1,53 @@
+/*
+ * Memory-bound workload for TCG benchmarks: a dependent walk through a
+ * random cycle over a buffer much larger than the TLB covers, then a
+ * streaming pass over it.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#define SLOTS (4 << 20)    /* 16 MB of uint32_t */
+
+int main(int argc, char **argv)
+{
+    unsigned long n = argc > 1 ? strtoul(argv[1], NULL, 0) : 8;
+    uint32_t *next = malloc(SLOTS * sizeof(*next));
+    uint32_t x = 2463534242u, p = 0, sum = 0;
+    unsigned long i, j;
+
+    if (!next) {
+        perror("malloc");
+        return 1;
+    }
+    /* Sattolo's shuffle makes one cycle through every slot */
+    for (i = 0; i < SLOTS; i++) {
+        next[i] = i;
+    }
+    for (i = SLOTS - 1; i > 0; i--) {
+        uint32_t t;
+
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        j = x % i;
+        t = next[i];
+        next[i] = next[j];
+        next[j] = t;
+    }
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < SLOTS / 4; j++) {
+            p = next[p];
+        }
+        for (j = 0; j < SLOTS; j++) {
+            sum += next[j];
+        }
+    }
+    printf("mem: %08x %08x\n", p, sum);
+    free(next);
+    return 0;
+}
@@ -0,0 +1,45 @@
+/*
+ * Self-modifying-code workload for TCG benchmarks: store to the page of a
+ * function between calls to it, so its translation is thrown away and
+ * redone every time.  The byte written is the one already there, so the
+ * code itself never changes.
+ *
+ * On ABIs where a function pointer isn't the code address (ppc64 ELFv1
+ * descriptors, for one) this only writes a data page.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static __attribute__((noinline)) unsigned smc_target(unsigned x)
+{
+    return x * 31 + 7;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long n = argc > 1 ? strtoul(argv[1], NULL, 0) : 20000;
+    unsigned (*volatile fn)(unsigned) = smc_target;
+    volatile uint8_t *code = (volatile uint8_t *)(uintptr_t)fn;
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t base = (uintptr_t)code & ~(page - 1);
+    unsigned long i;
+    unsigned sum = 0;
+
+    if (mprotect((void *)base, 2 * page,
+                 PROT_READ | PROT_WRITE | PROT_EXEC) < 0) {
+        perror("mprotect");
+        return 1;
+    }
+    for (i = 0; i < n; i++) {
+        *code = *code;
+        sum = fn(sum);
+    }
+    printf("smc: %08x\n", sum);
+    return 0;
+}
@@ -0,0 +1,33 @@
+/*
+ * Syscall-heavy workload for TCG benchmarks: cheap system calls back to
+ * back, so the cost is in leaving and re-entering generated code and in
+ * the syscall layer.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+int main(int argc, char **argv)
+{
+    unsigned long n = argc > 1 ? strtoul(argv[1], NULL, 0) : 500000;
+    int fd = open("/dev/null", O_WRONLY);
+    unsigned long i, sum = 0;
+    char c = 0;
+
+    if (fd < 0) {
+        perror("/dev/null");
+        return 1;
+    }
+    for (i = 0; i < n; i++) {
+        sum += getppid() != 0;
+        sum += write(fd, &c, 1);
+        sum += lseek(fd, 0, SEEK_SET) == 0;
+    }
+    close(fd);
+    printf("syscall: %lu\n", sum);
+    return 0;
+}
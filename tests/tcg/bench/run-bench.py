@@ -0,0 +1,134 @@
+#!/usr/bin/env python
+#
+# Run the TCG benchmark workloads under one or more QEMUs with -exec-stats
+# and report guest MIPS, translation time, TB cache hit rates and helper
+# calls per workload, as JSON.  With --baseline, compare with an earlier
+# report and fail if a workload got slower than --threshold allows.
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import tempfile
+
+
+def run_one(qemu, workload, args):
+    fd, stats_path = tempfile.mkstemp(suffix='.json')
+    os.close(fd)
+    try:
+        cmd = [qemu, '-exec-stats', stats_path, workload] + args
+        with open(os.devnull, 'w') as null:
+            subprocess.check_call(cmd, stdout=null)
+        with open(stats_path) as f:
+            return json.load(f)
+    finally:
+        os.unlink(stats_path)
+
+
+def summarize(stats, top_helpers):
+    wall = stats['wall-ns']
+    hits = stats['jump-cache-hits'] + stats['jump-cache-victim-hits']
+    lookups = hits + stats['jump-cache-misses']
+    translated = stats['tb-translated']
+    helpers = sorted(stats['helper-calls'].items(),
+                     key=lambda kv: kv[1], reverse=True)
+    return {
+        'wall-ns': wall,
+        'guest-insns': stats['guest-insns'],
+        'mips': stats['guest-insns'] * 1e3 / wall if wall else 0,
+        'tb-translated': translated,
+        'translate-ns': stats['translate-ns'],
+        'translate-share': float(stats['translate-ns']) / wall if wall else 0,
+        # lookups that the jump cache missed went to the TB hash table,
+        # and the ones that missed there too were translated
+        'jump-cache-hit-rate':
+            float(hits) / lookups if lookups else 0,
+        'tb-cache-hit-rate':
+            1 - float(translated) / lookups if lookups else 0,
+        'tb-flushes': stats['tb-flushes'],
+        'tb-invalidations': stats['tb-invalidations'],
+        'helper-calls': sum(stats['helper-calls'].values()),
+        'top-helpers': dict(helpers[:top_helpers]),
+    }
+
+
+def best_of(runs):
+    # the fastest run is the one least disturbed by the host
+    return min(runs, key=lambda r: r['wall-ns'])
+
+
+def compare(results, baseline, threshold):
+    def key(r):
+        return (os.path.basename(r['qemu']), os.path.basename(r['workload']))
+
+    old = dict((key(r), r) for r in baseline)
+    failed = False
+    for r in results:
+        b = old.get(key(r))
+        if b is None or not b['mips']:
+            continue
+        change = r['mips'] / b['mips'] - 1
+        r['mips-change'] = change
+        mark = ''
+        if change < -threshold:
+            mark = '  <-- slower'
+            failed = True
+        sys.stderr.write('%-12s %-16s %8.1f MIPS (%+.1f%%)%s\n' %
+                         (os.path.basename(r['qemu']),
+                          os.path.basename(r['workload']),
+                          r['mips'], change * 100, mark))
+    return failed
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Run TCG benchmark workloads under linux-user QEMUs')
+    parser.add_argument('--qemu', action='append', required=True,
+                        help='linux-user QEMU to run (may be repeated)')
+    parser.add_argument('--repeat', type=int, default=3,
+                        help='runs per workload; the fastest is reported')
+    parser.add_argument('--arg', action='append', default=[],
+                        help='argument for the workloads, e.g. an '
+                        'iteration count')
+    parser.add_argument('--top-helpers', type=int, default=10,
+                        help='most called helpers to list')
+    parser.add_argument('--output', help='write the report here, not '
+                        'to stdout')
+    parser.add_argument('--baseline', help='earlier report to compare with')
+    parser.add_argument('--threshold', type=float, default=0.05,
+                        help='MIPS loss that counts as a regression '
+                        '(default 0.05)')
+    parser.add_argument('workloads', nargs='+')
+    args = parser.parse_args()
+
+    results = []
+    for qemu in args.qemu:
+        for workload in args.workloads:
+            runs = [summarize(run_one(qemu, workload, args.arg),
+                              args.top_helpers)
+                    for i in range(args.repeat)]
+            r = best_of(runs)
+            r['qemu'] = qemu
+            r['workload'] = workload
+            results.append(r)
+
+    failed = False
+    if args.baseline:
+        with open(args.baseline) as f:
+            failed = compare(results, json.load(f), args.threshold)
+
+    report = json.dumps(results, indent=4, sort_keys=True)
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(report + '\n')
+    else:
+        print(report)
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
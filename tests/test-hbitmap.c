@@ -789,6 +789,7 @@ static void hbitmap_test_serialize_range(TestHBitmapData *data,
     hbitmap_serialize_part(data->hb, buf, 0, data->size);
     hbitmap_reset_all(data->hb);
     hbitmap_deserialize_part(data->hb, buf, 0, data->size, true);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, count);
 
     for (i = 0; i < data->size; i++) {
         int is_set = hbitmap_get(data->hb, i);
@@ -881,6 +882,8 @@ static void test_hbitmap_serialize_zeroes(TestHBitmapData *data,
 
     for (i = 0; i < num_positions; i++) {
         hbitmap_deserialize_zeroes(data->hb, positions[i], min_l1, true);
+        g_assert_cmpint(hbitmap_count(data->hb), ==,
+                        (num_positions - 1 - i) * L1);
         hbitmap_iter_init(&iter, data->hb, 0);
         next = hbitmap_iter_next(&iter);
         if (i == num_positions - 1) {
@@ -891,6 +894,182 @@ static void test_hbitmap_serialize_zeroes(TestHBitmapData *data,
     }
 }
 
+static bool hbitmap_test_get_shadow(TestHBitmapData *data, uint64_t i)
+{
+    return data->bits[i >> LOG_BITS_PER_LONG] &
+           (1UL << (i & (BITS_PER_LONG - 1)));
+}
+
+/* Check hbitmap_next_zero and hbitmap_next_dirty_area against the shadow
+ * bitmap, starting at start.
+ */
+static void hbitmap_test_check_next(TestHBitmapData *data, uint64_t start)
+{
+    uint64_t area = start, count = data->size - start;
+    uint64_t i, j;
+    bool found;
+
+    for (i = start; i < data->size && hbitmap_test_get_shadow(data, i); i++) {
+        /* nothing */
+    }
+    g_assert_cmpint(hbitmap_next_zero(data->hb, start), ==,
+                    i == data->size ? -1 : i);
+
+    found = hbitmap_next_dirty_area(data->hb, &area, &count);
+    for (i = start; i < data->size && !hbitmap_test_get_shadow(data, i); i++) {
+        /* nothing */
+    }
+    if (i == data->size) {
+        g_assert(!found);
+        return;
+    }
+    for (j = i; j < data->size && hbitmap_test_get_shadow(data, j); j++) {
+        /* nothing */
+    }
+    g_assert(found);
+    g_assert_cmpint(area, ==, i);
+    g_assert_cmpint(count, ==, j - i);
+}
+
+static void test_hbitmap_next(TestHBitmapData *data, const void *unused)
+{
+    uint64_t starts[] = { 0, 1, 2, L1 - 1, L1, L1 + 2, L2 - 1, L2, L2 + 1,
+                          L2 + L1 * 3, L3 - 2, L3 - 1 };
+    int i;
+
+    hbitmap_test_init(data, L3, 0);
+    for (i = 0; i < ARRAY_SIZE(starts); i++) {
+        hbitmap_test_check_next(data, starts[i]);
+    }
+
+    hbitmap_test_set(data, 0, 1);
+    hbitmap_test_set(data, L1 - 1, 3);
+    hbitmap_test_set(data, L2, L1 * 5 + 7);
+    hbitmap_test_set(data, L3 - 1, 1);
+    for (i = 0; i < ARRAY_SIZE(starts); i++) {
+        hbitmap_test_check_next(data, starts[i]);
+    }
+
+    hbitmap_test_set(data, 0, L3);
+    for (i = 0; i < ARRAY_SIZE(starts); i++) {
+        hbitmap_test_check_next(data, starts[i]);
+    }
+}
+
+static void test_hbitmap_next_granularity(TestHBitmapData *data,
+                                          const void *unused)
+{
+    uint64_t start, count;
+
+    hbitmap_test_init(data, L1 * 2, 1);
+    hbitmap_set(data->hb, 5, 2);
+
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0), ==, 0);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 5), ==, 8);
+
+    /* The run covers whole groups, but is cut to the requested range */
+    start = 5;
+    count = 100;
+    g_assert(hbitmap_next_dirty_area(data->hb, &start, &count));
+    g_assert_cmpint(start, ==, 5);
+    g_assert_cmpint(count, ==, 3);
+
+    start = 0;
+    count = 5;
+    g_assert(hbitmap_next_dirty_area(data->hb, &start, &count));
+    g_assert_cmpint(start, ==, 4);
+    g_assert_cmpint(count, ==, 1);
+
+    start = 8;
+    count = 100;
+    g_assert(!hbitmap_next_dirty_area(data->hb, &start, &count));
+}
+
+static void test_hbitmap_merge(TestHBitmapData *data, const void *unused)
+{
+    HBitmap *b = hbitmap_alloc(L3, 0);
+
+    hbitmap_test_init(data, L3, 0);
+    hbitmap_test_set(data, 0, L1 + 3);
+    hbitmap_test_set(data, L2 * 3, 7);
+
+    hbitmap_set(b, L1, L1);
+    hbitmap_set(b, L2 * 5, 1);
+    hbitmap_set(b, L3 - L1, L1);
+    g_assert(hbitmap_merge(data->hb, b));
+
+    bitmap_set(data->bits, L1, L1);
+    bitmap_set(data->bits, L2 * 5, 1);
+    bitmap_set(data->bits, L3 - L1, L1);
+    hbitmap_test_check(data, 0);
+
+    hbitmap_free(b);
+    b = hbitmap_alloc(L3, 1);
+    g_assert(!hbitmap_merge(data->hb, b));
+    hbitmap_free(b);
+}
+
+static void test_hbitmap_intersect(TestHBitmapData *data, const void *unused)
+{
+    HBitmap *b = hbitmap_alloc(L3, 0);
+
+    hbitmap_test_init(data, L3, 0);
+    hbitmap_test_set(data, 0, L2);
+    hbitmap_test_set(data, L3 - 1, 1);
+
+    hbitmap_set(b, L1 / 2, L1);
+    hbitmap_set(b, L2 - 3, 8);
+    g_assert(hbitmap_intersect(data->hb, b));
+
+    bitmap_clear(data->bits, 0, L1 / 2);
+    bitmap_clear(data->bits, L1 * 3 / 2, L2 - 3 - L1 * 3 / 2);
+    bitmap_clear(data->bits, L3 - 1, 1);
+    hbitmap_test_check(data, 0);
+    hbitmap_test_check_next(data, 0);
+
+    hbitmap_free(b);
+}
+
+static void test_hbitmap_serialize_extents(TestHBitmapData *data,
+                                           const void *unused)
+{
+    /* Room for two extents at a time */
+    uint8_t buf[32];
+    HBitmap *b = hbitmap_alloc(L3, 0);
+    uint64_t pos, end, i;
+    size_t len;
+
+    hbitmap_test_init(data, L3, 0);
+    hbitmap_test_set(data, 0, 1);
+    hbitmap_test_set(data, L1 - 1, 3);
+    hbitmap_test_set(data, L2, L1 * 2);
+    hbitmap_test_set(data, L2 * 7, 5);
+    hbitmap_test_set(data, L3 - 9, 9);
+
+    /* Stale bits in the destination are cleared */
+    hbitmap_set(b, L2 * 3, L1);
+
+    for (pos = 0; pos < L3; pos = end) {
+        len = hbitmap_serialize_extents(data->hb, buf, sizeof(buf),
+                                        pos, L3 - pos, &end);
+        g_assert_cmpint(len, <=, sizeof(buf));
+        g_assert_cmpint(end, >, pos);
+        g_assert(hbitmap_deserialize_extents(b, buf, len, pos, end));
+    }
+
+    for (i = 0; i < L3; i++) {
+        g_assert_cmpint(hbitmap_get(b, i), ==, hbitmap_get(data->hb, i));
+    }
+    g_assert_cmpint(hbitmap_count(b), ==, hbitmap_count(data->hb));
+
+    /* An extent outside of the range is rejected */
+    stq_le_p(buf, 0);
+    stq_le_p(buf + 8, L1);
+    g_assert(!hbitmap_deserialize_extents(b, buf, 16, L1, L2));
+
+    hbitmap_free(b);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -955,6 +1134,14 @@ int main(int argc, char **argv)
                      test_hbitmap_serialize_part);
     hbitmap_test_add("/hbitmap/serialize/zeroes",
                      test_hbitmap_serialize_zeroes);
+    hbitmap_test_add("/hbitmap/serialize/extents",
+                     test_hbitmap_serialize_extents);
+
+    hbitmap_test_add("/hbitmap/next/general", test_hbitmap_next);
+    hbitmap_test_add("/hbitmap/next/granularity",
+                     test_hbitmap_next_granularity);
+    hbitmap_test_add("/hbitmap/merge", test_hbitmap_merge);
+    hbitmap_test_add("/hbitmap/intersect", test_hbitmap_intersect);
     g_test_run();
 
     return 0;
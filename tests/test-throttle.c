@@ -15,6 +15,7 @@
 #include "qemu/osdep.h"
 #include <math.h>
 #include "block/aio.h"
+#include "qemu/coroutine.h"
 #include "qapi/error.h"
 #include "qemu/throttle.h"
 #include "qemu/error-report.h"
@@ -617,6 +618,24 @@ static void test_groups(void)
     g_assert(!strcmp(throttle_group_get_name(blk2), "foo"));
     g_assert(blkp1->throttle_state == blkp3->throttle_state);
 
+    /* Weights are per member and survive moving to another group */
+    g_assert_cmpint(throttle_group_get_weight(blk1), ==,
+                    THROTTLE_GROUP_DEFAULT_WEIGHT);
+    throttle_group_set_weight(blk3, 300);
+    g_assert_cmpint(throttle_group_get_weight(blk1), ==,
+                    THROTTLE_GROUP_DEFAULT_WEIGHT);
+    g_assert_cmpint(throttle_group_get_weight(blk3), ==, 300);
+    throttle_group_unregister_blk(blk3);
+    throttle_group_register_blk(blk3, "foo");
+    g_assert(blkp2->throttle_state == blkp3->throttle_state);
+    g_assert_cmpint(throttle_group_get_weight(blk2), ==,
+                    THROTTLE_GROUP_DEFAULT_WEIGHT);
+    g_assert_cmpint(throttle_group_get_weight(blk3), ==, 300);
+    throttle_group_unregister_blk(blk3);
+    throttle_group_register_blk(blk3, "bar");
+    g_assert(blkp1->throttle_state == blkp3->throttle_state);
+    g_assert_cmpint(throttle_group_get_weight(blk3), ==, 300);
+
     /* Setting the config of a group member affects the whole group */
     throttle_config_init(&cfg1);
     cfg1.buckets[THROTTLE_BPS_READ].avg  = 500000;
@@ -648,6 +667,77 @@ static void test_groups(void)
     g_assert(blkp3->throttle_state == NULL);
 }
 
+/* tests for weighted fair queueing between group members */
+#define FAIR_REQS   150
+#define FAIR_WINDOW 40
+
+typedef struct {
+    BlockBackend *blk;
+    int member;
+} FairReq;
+
+/* the member of each request that got through, in order */
+static int fair_log[2 * FAIR_REQS];
+static int fair_served;
+
+static void coroutine_fn fair_req_co(void *opaque)
+{
+    FairReq *req = opaque;
+
+    throttle_group_co_io_limits_intercept(req->blk, 4096, false);
+    fair_log[fair_served++] = req->member;
+}
+
+static void test_groups_fair(void)
+{
+    ThrottleConfig cfg;
+    BlockBackend *blk[2];
+    FairReq reqs[2][FAIR_REQS];
+    int served[2] = { 0, 0 };
+    int queued_at, i, j;
+
+    for (i = 0; i < 2; i++) {
+        blk[i] = blk_new();
+        throttle_group_register_blk(blk[i], "fair");
+    }
+    throttle_group_set_weight(blk[0], 300);
+    throttle_group_set_weight(blk[1], 100);
+
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = 1000;
+    throttle_group_config(blk[0], &cfg);
+
+    /* The first member uses up the burst, then both queue behind it */
+    fair_served = 0;
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < FAIR_REQS; j++) {
+            reqs[i][j].blk = blk[i];
+            reqs[i][j].member = i;
+            qemu_coroutine_enter(qemu_coroutine_create(fair_req_co,
+                                                       &reqs[i][j]));
+        }
+    }
+    queued_at = fair_served;
+    g_assert_cmpint(queued_at, <=, FAIR_REQS - FAIR_WINDOW);
+
+    while (fair_served < 2 * FAIR_REQS) {
+        aio_poll(ctx, true);
+    }
+
+    /* While both have requests queued, 3:1 weights give a 3:1 service
+     * ratio, give or take the request that was already waiting */
+    for (i = queued_at; i < queued_at + FAIR_WINDOW; i++) {
+        served[fair_log[i]]++;
+    }
+    g_assert_cmpint(served[0], >=, FAIR_WINDOW * 3 / 4 - 1);
+    g_assert_cmpint(served[0], <=, FAIR_WINDOW * 3 / 4 + 1);
+
+    for (i = 0; i < 2; i++) {
+        throttle_group_unregister_blk(blk[i]);
+        blk_unref(blk[i]);
+    }
+}
+
 int main(int argc, char **argv)
 {
     qemu_init_main_loop(&error_fatal);
@@ -673,6 +763,7 @@ int main(int argc, char **argv)
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
     g_test_add_func("/throttle/groups",             test_groups);
+    g_test_add_func("/throttle/groups/fair",        test_groups_fair);
     return g_test_run();
 }
 
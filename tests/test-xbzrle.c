@@ -14,6 +14,7 @@
 #include "qemu-common.h"
 #include "qemu/cutils.h"
 #include "include/migration/migration.h"
+#include "include/migration/page_cache.h"
 
 #define PAGE_SIZE 4096
 
@@ -174,6 +175,103 @@ static void test_encode_decode(void)
     }
 }
 
+/* Pages with changed runs of random lengths, at random offsets */
+static void fill_random_runs(GRand *rand, uint8_t *old_buf, uint8_t *new_buf)
+{
+    int i = 0;
+
+    memset(old_buf, 0x55, PAGE_SIZE);
+    memset(new_buf, 0x55, PAGE_SIZE);
+    while (i < PAGE_SIZE) {
+        int zrun = g_rand_int_range(rand, 0, 100);
+        int nzrun = g_rand_int_range(rand, 1, 70);
+
+        for (i += zrun; i < PAGE_SIZE && nzrun; i++, nzrun--) {
+            new_buf[i] = old_buf[i] + g_rand_int_range(rand, 1, 256);
+        }
+    }
+}
+
+static void test_encode_decode_accel(void)
+{
+    uint8_t *old_buf = g_malloc(PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    guint32 seed = g_test_rand_int();
+    int dlen[100];
+    int i, rc;
+    bool first = true;
+
+    /* Every implementation must produce the same stream as the first */
+    do {
+        GRand *rand = g_rand_new_with_seed(seed);
+
+        for (i = 0; i < ARRAY_SIZE(dlen); i++) {
+            fill_random_runs(rand, old_buf, new_buf);
+            rc = xbzrle_encode_buffer(old_buf, new_buf, PAGE_SIZE,
+                                      compressed, PAGE_SIZE);
+            if (first) {
+                dlen[i] = rc;
+            } else {
+                g_assert_cmpint(rc, ==, dlen[i]);
+            }
+            if (rc > 0) {
+                g_assert_cmpint(xbzrle_decode_buffer(compressed, rc, old_buf,
+                                                     PAGE_SIZE), <=,
+                                PAGE_SIZE);
+                g_assert(memcmp(old_buf, new_buf, PAGE_SIZE) == 0);
+            }
+        }
+        g_rand_free(rand);
+        first = false;
+    } while (test_xbzrle_next_accel());
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(compressed);
+}
+
+static void test_page_cache(void)
+{
+    /* Two sets of four pages */
+    PageCache *cache = cache_init(8, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE];
+    uint64_t i;
+
+    /* Pages 0, 2, 4 and 6 all map to the first set */
+    for (i = 0; i < 4; i++) {
+        memset(page, i, PAGE_SIZE);
+        g_assert_cmpint(cache_insert(cache, i * 2 * PAGE_SIZE, page, 0), ==, 0);
+    }
+    for (i = 0; i < 4; i++) {
+        g_assert(cache_is_cached(cache, i * 2 * PAGE_SIZE, 0));
+        g_assert_cmpint(get_cached_data(cache, i * 2 * PAGE_SIZE)[0], ==, i);
+    }
+
+    /* The set is full of fresh pages */
+    g_assert_cmpint(cache_insert(cache, 8 * PAGE_SIZE, page, 1), ==, -1);
+    g_assert(!cache_is_cached(cache, 8 * PAGE_SIZE, 1));
+    g_assert(get_cached_data(cache, 8 * PAGE_SIZE) == NULL);
+
+    /* The other set is still empty */
+    g_assert_cmpint(cache_insert(cache, PAGE_SIZE, page, 1), ==, 0);
+
+    /* Page 0 has been used recently, page 2 has not */
+    g_assert(cache_is_cached(cache, 0, 2));
+    memset(page, 0x44, PAGE_SIZE);
+    g_assert_cmpint(cache_insert(cache, 8 * PAGE_SIZE, page, 2), ==, 0);
+    g_assert(cache_is_cached(cache, 0, 2));
+    g_assert(!cache_is_cached(cache, 2 * PAGE_SIZE, 2));
+    g_assert_cmpint(get_cached_data(cache, 8 * PAGE_SIZE)[0], ==, 0x44);
+
+    /* Shrinking keeps the most recently used pages */
+    g_assert_cmpint(cache_resize(cache, 4), ==, 4);
+    g_assert(cache_is_cached(cache, 0, 2));
+    g_assert(cache_is_cached(cache, 8 * PAGE_SIZE, 2));
+
+    cache_fini(cache);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +284,9 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/page_cache", test_page_cache);
+    /* Last, as it leaves the slowest implementation selected */
+    g_test_add_func("/xbzrle/encode_decode_accel", test_encode_decode_accel);
 
     return g_test_run();
 }
@@ -0,0 +1,114 @@
+/*
+ * xbzrle_encode_buffer() microbenchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "qemu/timer.h"
+#include "include/migration/migration.h"
+
+#define PAGE_SIZE 4096
+
+static unsigned int run_len = 8;
+static unsigned int gap_len = 256;
+static unsigned int duration = 1;
+
+static const char commands_string[] =
+    " -r = length of each changed run in bytes (default 8)\n"
+    " -g = unchanged bytes between runs (default 256)\n"
+    " -d = duration in seconds per accelerator";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hr:g:d:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'r':
+            run_len = atoi(optarg);
+            break;
+        case 'g':
+            gap_len = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        default:
+            usage_complete(argv);
+            exit(1);
+        }
+    }
+}
+
+static void run_one(uint8_t *old_buf, uint8_t *new_buf, uint8_t *dst,
+                    unsigned int accel)
+{
+    int64_t start, end, now;
+    uint64_t n = 0;
+    int len = 0;
+
+    start = get_clock();
+    end = start + duration * NANOSECONDS_PER_SECOND;
+    do {
+        unsigned int i;
+
+        /* Check the clock only every so often */
+        for (i = 0; i < 1024; i++) {
+            len = xbzrle_encode_buffer(old_buf, new_buf, PAGE_SIZE, dst,
+                                       PAGE_SIZE);
+        }
+        n += 1024;
+        now = get_clock();
+    } while (now < end);
+
+    printf("accel %u: %d bytes, %.2f ns/page, %.2f MB/s\n", accel, len,
+           (double)(now - start) / n,
+           (double)n * PAGE_SIZE * 1000 / (now - start));
+}
+
+int main(int argc, char *argv[])
+{
+    uint8_t *old_buf, *new_buf, *dst;
+    unsigned int accel = 0;
+    unsigned int i, j;
+
+    parse_args(argc, argv);
+
+    old_buf = qemu_memalign(64, PAGE_SIZE);
+    new_buf = qemu_memalign(64, PAGE_SIZE);
+    dst = g_malloc(PAGE_SIZE);
+    memset(old_buf, 0, PAGE_SIZE);
+    memset(new_buf, 0, PAGE_SIZE);
+    for (i = gap_len; i < PAGE_SIZE; i += gap_len) {
+        for (j = 0; j < run_len && i < PAGE_SIZE; j++, i++) {
+            new_buf[i] = 1;
+        }
+    }
+
+    printf("runs of %u bytes every %u bytes\n", run_len, gap_len + run_len);
+
+    /* The most preferred accelerator comes first */
+    do {
+        run_one(old_buf, new_buf, dst, accel++);
+    } while (test_xbzrle_next_accel());
+
+    qemu_vfree(old_buf);
+    qemu_vfree(new_buf);
+    g_free(dst);
+    return 0;
+}
@@ -49,6 +49,9 @@ struct ThreadPoolElement {
     /* Access to this list is protected by lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
+    /* Link in pool->completed, then in pool->done.  */
+    QSLIST_ENTRY(ThreadPoolElement) next_done;
+
     /* Access to this list is protected by the global mutex.  */
     QLIST_ENTRY(ThreadPoolElement) all;
 };
@@ -62,8 +65,15 @@ struct ThreadPool {
     int max_threads;
     QEMUBH *new_thread_bh;
 
+    /* Requests that finished since the completion bottom half last ran,
+     * pushed without taking lock.  Whoever finds the list empty schedules
+     * the bottom half, so that a burst of completions costs one wakeup.
+     */
+    QSLIST_HEAD(, ThreadPoolElement) completed;
+
     /* The following variables are only accessed from one AioContext. */
     QLIST_HEAD(, ThreadPoolElement) head;
+    QSLIST_HEAD(, ThreadPoolElement) done;
 
     /* The following variables are protected by lock.  */
     QTAILQ_HEAD(, ThreadPoolElement) request_list;
@@ -74,6 +84,21 @@ struct ThreadPool {
     bool stopping;
 };
 
+static void thread_pool_push_completed(ThreadPool *pool,
+                                       ThreadPoolElement *req)
+{
+    ThreadPoolElement *first;
+
+    do {
+        first = atomic_read(&pool->completed.slh_first);
+        req->next_done.sle_next = first;
+    } while (atomic_cmpxchg(&pool->completed.slh_first, first, req) != first);
+
+    if (!first) {
+        qemu_bh_schedule(pool->completion_bh);
+    }
+}
+
 static void *worker_thread(void *opaque)
 {
     ThreadPool *pool = opaque;
@@ -108,10 +133,9 @@ static void *worker_thread(void *opaque)
         /* Write ret before state.  */
         smp_wmb();
         req->state = THREAD_DONE;
+        thread_pool_push_completed(pool, req);
 
         qemu_mutex_lock(&pool->lock);
-
-        qemu_bh_schedule(pool->completion_bh);
     }
 
     pool->cur_threads--;
@@ -163,13 +187,19 @@ static void spawn_thread(ThreadPool *pool)
 static void thread_pool_completion_bh(void *opaque)
 {
     ThreadPool *pool = opaque;
-    ThreadPoolElement *elem, *next;
-
-restart:
-    QLIST_FOREACH_SAFE(elem, &pool->head, all, next) {
-        if (elem->state != THREAD_DONE) {
+    ThreadPoolElement *elem;
+
+    for (;;) {
+        elem = QSLIST_FIRST(&pool->done);
+        if (!elem) {
+            if (!atomic_read(&pool->completed.slh_first)) {
+                break;
+            }
+            QSLIST_MOVE_ATOMIC(&pool->done, &pool->completed);
             continue;
         }
+        QSLIST_REMOVE_HEAD(&pool->done, next_done);
+        assert(elem->state == THREAD_DONE);
 
         trace_thread_pool_complete(pool, elem, elem->common.opaque,
                                    elem->ret);
@@ -186,7 +216,6 @@ restart:
 
             elem->common.cb(elem->common.opaque, elem->ret);
             qemu_aio_unref(elem);
-            goto restart;
         } else {
             qemu_aio_unref(elem);
         }
@@ -209,10 +238,10 @@ static void thread_pool_cancel(BlockAIOCB *acb)
          */
         qemu_sem_timedwait(&pool->sem, 0) == 0) {
         QTAILQ_REMOVE(&pool->request_list, elem, reqs);
-        qemu_bh_schedule(pool->completion_bh);
 
         elem->state = THREAD_DONE;
         elem->ret = -ECANCELED;
+        thread_pool_push_completed(pool, elem);
     }
 
     qemu_mutex_unlock(&pool->lock);
@@ -301,6 +330,8 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
     QLIST_INIT(&pool->head);
+    QSLIST_INIT(&pool->completed);
+    QSLIST_INIT(&pool->done);
     QTAILQ_INIT(&pool->request_list);
 }
 
@@ -46,10 +46,16 @@ static bool trace_writeout_enabled;
 enum {
     TRACE_BUF_LEN = 4096 * 64,
     TRACE_BUF_FLUSH_THRESHOLD = TRACE_BUF_LEN / 4,
+    /* Records start on this boundary in the buffer, so the event ID that
+     * holds the valid flag never wraps around */
+    TRACE_RECORD_ALIGN = sizeof(uint64_t),
 };
 
-uint8_t trace_buf[TRACE_BUF_LEN];
+uint8_t trace_buf[TRACE_BUF_LEN] __attribute__((aligned(TRACE_RECORD_ALIGN)));
 static volatile gint trace_idx;
+/* Set by the thread that kicks the writeout thread until it wakes up, so
+ * that the others don't all take trace_lock while the buffer is filling */
+static volatile gint trace_kick_pending;
 static unsigned int writeout_idx;
 static volatile gint dropped_events;
 static uint32_t trace_pid;
@@ -80,48 +86,64 @@ static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size
 
 static void clear_buffer_range(unsigned int idx, size_t len)
 {
-    uint32_t num = 0;
-    while (num < len) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = 0;
-        num++;
+    size_t chunk;
+
+    idx %= TRACE_BUF_LEN;
+    chunk = MIN(len, TRACE_BUF_LEN - idx);
+    memset(&trace_buf[idx], 0, chunk);
+    memset(trace_buf, 0, len - chunk);
+}
+
+static void write_buffer_to_file(unsigned int idx, size_t len)
+{
+    size_t unused __attribute__ ((unused));
+    size_t chunk;
+
+    idx %= TRACE_BUF_LEN;
+    chunk = MIN(len, TRACE_BUF_LEN - idx);
+    unused = fwrite(&trace_buf[idx], chunk, 1, trace_fp);
+    if (len > chunk) {
+        unused = fwrite(trace_buf, len - chunk, 1, trace_fp);
     }
 }
+
 /**
- * Read a trace record from the trace buffer
+ * Write a trace record from the trace buffer to the trace file
  *
  * @idx         Trace buffer index
- * @record      Trace record to fill
  *
- * Returns false if the record is not valid.
+ * The record is written straight from the buffer; producers cannot reuse
+ * its space before writeout_idx moves past it.
+ *
+ * Returns the space taken by the record in the buffer, or 0 if the record
+ * is not valid.
  */
-static bool get_trace_record(unsigned int idx, TraceRecord **recordptr)
+static unsigned int write_trace_record(unsigned int idx)
 {
-    uint64_t event_flag = 0;
+    uint64_t type = TRACE_RECORD_TYPE_EVENT;
+    size_t unused __attribute__ ((unused));
     TraceRecord record;
-    /* read the event flag to see if its a valid record */
-    read_from_buffer(idx, &record, sizeof(event_flag));
 
+    /* read the event flag to see if its a valid record */
+    read_from_buffer(idx, &record.event, sizeof(record.event));
     if (!(record.event & TRACE_RECORD_VALID)) {
-        return false;
+        return 0;
     }
 
     smp_rmb(); /* read memory barrier before accessing record */
-    /* read the record header to know record length */
     read_from_buffer(idx, &record, sizeof(TraceRecord));
-    *recordptr = malloc(record.length); /* don't use g_malloc, can deadlock when traced */
-    /* make a copy of record to avoid being overwritten */
-    read_from_buffer(idx, *recordptr, record.length);
-    smp_rmb(); /* memory barrier before clearing valid flag */
-    (*recordptr)->event &= ~TRACE_RECORD_VALID;
+    record.event &= ~TRACE_RECORD_VALID;
+    unused = fwrite(&type, sizeof(type), 1, trace_fp);
+    unused = fwrite(&record, sizeof(TraceRecord), 1, trace_fp);
+    write_buffer_to_file(idx + sizeof(TraceRecord),
+                         record.length - sizeof(TraceRecord));
+
     /* clear the trace buffer range for consumed record otherwise any byte
      * with its MSB set may be considered as a valid event id when the writer
      * thread crosses this range of buffer again.
      */
     clear_buffer_range(idx, record.length);
-    return true;
+    return ROUND_UP(record.length, TRACE_RECORD_ALIGN);
 }
 
 /**
@@ -150,17 +172,17 @@ static void wait_for_trace_records_available(void)
         g_cond_wait(&trace_available_cond, &trace_lock);
     }
     trace_available = false;
+    g_atomic_int_set(&trace_kick_pending, 0);
     g_mutex_unlock(&trace_lock);
 }
 
 static gpointer writeout_thread(gpointer opaque)
 {
-    TraceRecord *recordptr;
     union {
         TraceRecord rec;
         uint8_t bytes[sizeof(TraceRecord) + sizeof(uint64_t)];
     } dropped;
-    unsigned int idx = 0;
+    unsigned int idx = 0, len;
     int dropped_count;
     size_t unused __attribute__ ((unused));
     uint64_t type = TRACE_RECORD_TYPE_EVENT;
@@ -182,11 +204,9 @@ static gpointer writeout_thread(gpointer opaque)
             unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
         }
 
-        while (get_trace_record(idx, &recordptr)) {
-            unused = fwrite(&type, sizeof(type), 1, trace_fp);
-            unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
-            writeout_idx += recordptr->length;
-            free(recordptr); /* don't use g_free, can deadlock when traced */
+        while ((len = write_trace_record(idx)) != 0) {
+            smp_wmb(); /* clear the record before handing its space back */
+            writeout_idx += len;
             idx = writeout_idx % TRACE_BUF_LEN;
         }
 
@@ -218,7 +238,7 @@ int trace_record_start(TraceBufferRecord *rec, uint32_t event, size_t datasize)
     do {
         old_idx = g_atomic_int_get(&trace_idx);
         smp_rmb();
-        new_idx = old_idx + rec_len;
+        new_idx = old_idx + ROUND_UP(rec_len, TRACE_RECORD_ALIGN);
 
         if (new_idx - writeout_idx > TRACE_BUF_LEN) {
             /* Trace Buffer Full, Event dropped ! */
@@ -242,39 +262,40 @@ int trace_record_start(TraceBufferRecord *rec, uint32_t event, size_t datasize)
 
 static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
 {
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        data_ptr[x++] = trace_buf[idx++];
-    }
+    size_t chunk;
+
+    idx %= TRACE_BUF_LEN;
+    chunk = MIN(size, TRACE_BUF_LEN - idx);
+    memcpy(dataptr, &trace_buf[idx], chunk);
+    memcpy((uint8_t *)dataptr + chunk, trace_buf, size - chunk);
 }
 
 static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size)
 {
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = data_ptr[x++];
-    }
-    return idx; /* most callers wants to know where to write next */
+    size_t chunk;
+
+    idx %= TRACE_BUF_LEN;
+    chunk = MIN(size, TRACE_BUF_LEN - idx);
+    memcpy(&trace_buf[idx], dataptr, chunk);
+    memcpy(trace_buf, (uint8_t *)dataptr + chunk, size - chunk);
+    /* most callers wants to know where to write next */
+    return (idx + size) % TRACE_BUF_LEN;
 }
 
 void trace_record_finish(TraceBufferRecord *rec)
 {
-    TraceRecord record;
-    read_from_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
+    uint64_t event;
+
+    /* the event ID is aligned, so it is never split by the end of the
+     * buffer */
+    memcpy(&event, &trace_buf[rec->tbuf_idx], sizeof(event));
     smp_wmb(); /* write barrier before marking as valid */
-    record.event |= TRACE_RECORD_VALID;
-    write_to_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
+    event |= TRACE_RECORD_VALID;
+    memcpy(&trace_buf[rec->tbuf_idx], &event, sizeof(event));
 
     if (((unsigned int)g_atomic_int_get(&trace_idx) - writeout_idx)
-        > TRACE_BUF_FLUSH_THRESHOLD) {
+        > TRACE_BUF_FLUSH_THRESHOLD &&
+        g_atomic_int_compare_and_exchange(&trace_kick_pending, 0, 1)) {
         flush_trace_file(false);
     }
 }
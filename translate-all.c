@@ -77,6 +77,8 @@
 
 #include "panda/rr/rr_log.h"
 #include "panda/callback_support.h"
+#include "panda/common.h"
+#include "panda/plugin.h"
 
 /* #define DEBUG_TB_INVALIDATE */
 /* #define DEBUG_TB_FLUSH */
@@ -121,7 +123,16 @@ typedef struct PageDesc {
        of lookups we do to a given page to use a bitmap */
     unsigned int code_write_count;
     unsigned long *code_bitmap;
+    /* With MTTCG, first_tb is written with both tb_lock and this lock
+     * held, and read with either; code_write_count and code_bitmap are
+     * only used with this lock held.  That lets a write to a code page
+     * check the bitmap without tb_lock, which a vCPU translating for
+     * LLVM may hold for a long time.  A thread takes a second page lock
+     * only with tb_lock held, and never waits for tb_lock with one.
+     */
+    QemuSpin lock;
 #else
+    /* written with the mmap_lock held, read with atomic_read without it */
     unsigned long flags;
 #endif
 } PageDesc;
@@ -166,8 +177,14 @@ TCGContext tcg_ctx;
 bool parallel_cpus;
 
 /* translation block context */
-#ifdef CONFIG_USER_ONLY
 __thread int have_tb_lock;
+
+/* System emulation only needs tb_lock when vCPUs have threads of their
+   own; otherwise the BQL already serialises everything.  */
+#ifdef CONFIG_USER_ONLY
+#define tb_lock_needed() true
+#else
+#define tb_lock_needed() qemu_tcg_mttcg_enabled()
 #endif
 
 static void page_table_config_init(void)
@@ -192,32 +209,50 @@ static void page_table_config_init(void)
 
 void tb_lock(void)
 {
-#ifdef CONFIG_USER_ONLY
-    assert(!have_tb_lock);
-    qemu_mutex_lock(&tcg_ctx.tb_ctx.tb_lock);
-    have_tb_lock++;
-#endif
+    if (tb_lock_needed()) {
+        assert(!have_tb_lock);
+        qemu_mutex_lock(&tcg_ctx.tb_ctx.tb_lock);
+        have_tb_lock++;
+    }
 }
 
 void tb_unlock(void)
 {
-#ifdef CONFIG_USER_ONLY
-    assert(have_tb_lock);
-    have_tb_lock--;
-    qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
-#endif
+    if (tb_lock_needed()) {
+        assert(have_tb_lock);
+        have_tb_lock--;
+        qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
+    }
 }
 
 void tb_lock_reset(void)
 {
-#ifdef CONFIG_USER_ONLY
     if (have_tb_lock) {
         qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
         have_tb_lock = 0;
     }
-#endif
 }
 
+#ifdef CONFIG_SOFTMMU
+static inline void page_lock(PageDesc *p)
+{
+    if (tb_lock_needed()) {
+        qemu_spin_lock(&p->lock);
+    }
+}
+
+static inline void page_unlock(PageDesc *p)
+{
+    if (tb_lock_needed()) {
+        qemu_spin_unlock(&p->lock);
+    }
+}
+#else
+/* the mmap_lock covers the PageDescs */
+#define page_lock(p) do { } while (0)
+#define page_unlock(p) do { } while (0)
+#endif
+
 #ifdef DEBUG_LOCKING
 #define DEBUG_TB_LOCKS 1
 #else
@@ -236,6 +271,9 @@ void tb_lock_reset(void)
 
 
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr);
+static TranslationBlock *tb_find_tcg_pc(uintptr_t tc_ptr);
+static void tb_profile_drain(void);
+static void exec_stats_retire(TranslationBlock *tbs, int n);
 
 void cpu_gen_init(void)
 {
@@ -546,6 +584,11 @@ static PageDesc *page_find_alloc(tb_page_addr_t index, int alloc)
             return NULL;
         }
         pd = g_new0(PageDesc, V_L2_SIZE);
+#ifdef CONFIG_SOFTMMU
+        for (i = 0; i < V_L2_SIZE; i++) {
+            qemu_spin_init(&pd[i].lock);
+        }
+#endif
         atomic_rcu_set(lp, pd);
     }
 
@@ -878,25 +921,92 @@ bool tcg_enabled(void)
     return tcg_ctx.code_gen_buffer != NULL;
 }
 
+/* Region r's slice of tbs[], of which the first region_nb_tbs[r] are in use */
+static inline TranslationBlock *tb_region_tbs(int r)
+{
+    return &tcg_ctx.tb_ctx.tbs[r * tcg_ctx.tb_ctx.region_max_tbs];
+}
+
+static inline void *tb_region_start(int r)
+{
+    return tcg_ctx.code_gen_buffer + r * tcg_ctx.tb_ctx.region_size;
+}
+
+/* End of the code generated into region r so far */
+static inline void *tb_region_code_end(int r)
+{
+    return r == tcg_ctx.tb_ctx.region ? tcg_ctx.code_gen_ptr
+                                      : tcg_ctx.tb_ctx.region_end[r];
+}
+
+/* Generate code into region r from its start; it must be empty. */
+static void tb_region_enter(int r)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    void *end;
+
+    if (r == ctx->nb_regions - 1) {
+        end = tcg_ctx.code_gen_buffer + tcg_ctx.code_gen_buffer_size;
+    } else {
+        end = tb_region_start(r + 1);
+    }
+    ctx->region = r;
+    ctx->region_end[r] = tb_region_start(r);
+    tcg_ctx.code_gen_ptr = tb_region_start(r);
+    tcg_ctx.code_gen_highwater = end - TCG_HIGHWATER;
+}
+
+/* Done on the first allocation, as user mode only sets up the prologue,
+   and with it the final buffer size, once the guest base is known. */
+static void tb_regions_init(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    size_t n = tcg_ctx.code_gen_buffer_size / TB_REGION_MIN_SIZE;
+    int r;
+
+    ctx->nb_regions = MAX(MIN(n, TB_MAX_REGIONS), 1);
+    ctx->region_size = QEMU_ALIGN_DOWN(tcg_ctx.code_gen_buffer_size /
+                                       ctx->nb_regions, CODE_GEN_ALIGN);
+    ctx->region_max_tbs = tcg_ctx.code_gen_max_blocks / ctx->nb_regions;
+    for (r = 0; r < ctx->nb_regions; r++) {
+        ctx->region_nb_tbs[r] = 0;
+        ctx->region_end[r] = tb_region_start(r);
+    }
+    tb_region_enter(0);
+}
+
 /*
- * Allocate a new translation block. Flush the translation buffer if
- * too many translation blocks or too much generated code.
+ * Allocate a new translation block in the current region.  Returns NULL
+ * if it has too many translation blocks; the caller makes room with
+ * tb_evict_region().
  *
  * Called with tb_lock held.
  */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    TBContext *ctx = &tcg_ctx.tb_ctx;
     TranslationBlock *tb;
 
     assert_tb_lock();
 
-    if (tcg_ctx.tb_ctx.nb_tbs >= tcg_ctx.code_gen_max_blocks) {
+    if (unlikely(!ctx->nb_regions)) {
+        tb_regions_init();
+    }
+    if (ctx->region_nb_tbs[ctx->region] >= ctx->region_max_tbs) {
         return NULL;
     }
-    tb = &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs++];
+    tb = &tb_region_tbs(ctx->region)[ctx->region_nb_tbs[ctx->region]++];
+    ctx->nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
     tb->invalid = false;
+    memset(tb->panda_data, 0, sizeof(tb->panda_data));
+    tb->asid = 0;
+    tb->panda_uninstr = false;
+    tb->panda_inline_exec = false;
+    tb->prof_execs = 0;
+    tb->prof_entries = 0;
+    tb->prof_samples = 0;
 #ifdef CONFIG_LLVM
     tcg_llvm_tb_alloc(tb);
 #endif
@@ -906,18 +1016,24 @@ static TranslationBlock *tb_alloc(target_ulong pc)
 /* Called with tb_lock held.  */
 void tb_free(TranslationBlock *tb)
 {
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    int n = ctx->region_nb_tbs[ctx->region];
+
     assert_tb_lock();
 
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (tcg_ctx.tb_ctx.nb_tbs > 0 &&
-            tb == &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs - 1]) {
+    if (n > 0 && tb == &tb_region_tbs(ctx->region)[n - 1]) {
+        if (exec_stats_enabled) {
+            exec_stats_retire(tb, 1);
+        }
         tcg_ctx.code_gen_ptr = tb->tc_ptr;
 #if defined(CONFIG_LLVM)
         tcg_llvm_tb_free(tb);
 #endif
-        tcg_ctx.tb_ctx.nb_tbs--;
+        ctx->region_nb_tbs[ctx->region]--;
+        ctx->nb_tbs--;
     }
 }
 
@@ -963,17 +1079,12 @@ static void page_flush_tb(void)
     }
 }
 
-/* flush all the translation blocks */
-static void do_tb_flush(CPUState *cpu, run_on_cpu_data tb_flush_count)
+/* Called with tb_lock held.  */
+static void tb_flush_all(CPUState *cpu)
 {
-    tb_lock();
-
-    /* If it is already been done on request of another CPU,
-     * just retry.
-     */
-    if (tcg_ctx.tb_ctx.tb_flush_count != tb_flush_count.host_int) {
-        goto done;
-    }
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    size_t htable_size;
+    int r;
 
 #if defined(DEBUG_TB_FLUSH)
     printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
@@ -986,33 +1097,57 @@ static void do_tb_flush(CPUState *cpu, run_on_cpu_data tb_flush_count)
         > tcg_ctx.code_gen_buffer_size) {
         cpu_abort(cpu, "Internal error: code buffer overflow\n");
     }
+    if (tb_profile_enabled) {
+        tb_profile_drain();
+    }
 
+    for (r = 0; r < ctx->nb_regions; r++) {
+        if (exec_stats_enabled) {
+            exec_stats_retire(tb_region_tbs(r), ctx->region_nb_tbs[r]);
+        }
 #if defined(CONFIG_LLVM)
-    int i2;
-    for(i2 = 0; i2 < tcg_ctx.tb_ctx.nb_tbs; ++i2){
-        tcg_llvm_tb_free(&tcg_ctx.tb_ctx.tbs[i2]);
-    }
+        int i2;
+        for (i2 = 0; i2 < ctx->region_nb_tbs[r]; ++i2) {
+            tcg_llvm_tb_free(&tb_region_tbs(r)[i2]);
+        }
 #endif
+        ctx->region_nb_tbs[r] = 0;
+        ctx->region_end[r] = tb_region_start(r);
+    }
 
     CPU_FOREACH(cpu) {
-        int i;
-
-        for (i = 0; i < TB_JMP_CACHE_SIZE; ++i) {
-            atomic_set(&cpu->tb_jmp_cache[i], NULL);
-        }
+        cpu_tb_jmp_cache_clear(cpu);
     }
 
-    tcg_ctx.tb_ctx.nb_tbs = 0;
-    qht_reset_size(&tcg_ctx.tb_ctx.htable, CODE_GEN_HTABLE_SIZE);
+    /* the guest will likely translate as much code again, so size the table
+       for twice what it held rather than growing it back from scratch */
+    htable_size = MAX(CODE_GEN_HTABLE_SIZE, (size_t)ctx->nb_tbs * 2);
+    ctx->nb_tbs = 0;
+    qht_reset_size(&ctx->htable, htable_size);
     page_flush_tb();
 
-    tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
+    if (ctx->nb_regions) {
+        tb_region_enter(0);
+    } else {
+        tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
+    }
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
-    atomic_mb_set(&tcg_ctx.tb_ctx.tb_flush_count,
-                  tcg_ctx.tb_ctx.tb_flush_count + 1);
+    atomic_mb_set(&ctx->tb_flush_count, ctx->tb_flush_count + 1);
+}
+
+/* flush all the translation blocks */
+static void do_tb_flush(CPUState *cpu, run_on_cpu_data tb_flush_count)
+{
+    tb_lock();
+
+    /* If it is already been done on request of another CPU,
+     * just retry.
+     */
+    if (tcg_ctx.tb_ctx.tb_flush_count == tb_flush_count.host_int) {
+        tb_flush_all(cpu);
+    }
 
-done:
     tb_unlock();
 }
 
@@ -1025,6 +1160,99 @@ void tb_flush(CPUState *cpu)
     }
 }
 
+/* Move on to the next region, evicting the TBs it holds.  */
+static void do_tb_evict_region(CPUState *cpu, run_on_cpu_data tb_evict_count)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TranslationBlock *tbs;
+    int next, i;
+
+    tb_lock();
+
+    if (ctx->tb_evict_count != tb_evict_count.host_int) {
+        goto done;
+    }
+
+    next = (ctx->region + 1) % ctx->nb_regions;
+    if (ctx->region_nb_tbs[next] == ctx->nb_tbs) {
+        /* nothing would be left; with one region, this is every time */
+        tb_flush_all(cpu);
+        goto evicted;
+    }
+
+    if (tb_profile_enabled) {
+        tb_profile_drain();
+    }
+    ctx->region_end[ctx->region] = tcg_ctx.code_gen_ptr;
+    tbs = tb_region_tbs(next);
+    if (exec_stats_enabled) {
+        exec_stats_retire(tbs, ctx->region_nb_tbs[next]);
+    }
+    for (i = 0; i < ctx->region_nb_tbs[next]; i++) {
+        if (!tbs[i].invalid) {
+            tb_phys_invalidate(&tbs[i], -1);
+        }
+#if defined(CONFIG_LLVM)
+        tcg_llvm_tb_free(&tbs[i]);
+#endif
+    }
+    ctx->nb_tbs -= ctx->region_nb_tbs[next];
+    ctx->region_nb_tbs[next] = 0;
+    tb_region_enter(next);
+    /* jump cache entries that missed an invalidation (they can move
+       between ways while it runs) must not outlive their TBs */
+    CPU_FOREACH(cpu) {
+        cpu_tb_jmp_cache_clear(cpu);
+    }
+
+evicted:
+    atomic_mb_set(&ctx->tb_evict_count, ctx->tb_evict_count + 1);
+done:
+    tb_unlock();
+}
+
+/* Make room for more TBs.  Like tb_flush(), this is done once every vCPU
+   is out of generated code, which nothing may jump into the evicted
+   region from any more.  */
+static void tb_evict_region(CPUState *cpu)
+{
+    unsigned tb_evict_count = atomic_mb_read(&tcg_ctx.tb_ctx.tb_evict_count);
+    async_safe_run_on_cpu(cpu, do_tb_evict_region,
+                          RUN_ON_CPU_HOST_INT(tb_evict_count));
+}
+
+/* Invalidate the TBs match() accepts, to have them retranslated the next
+ * time they run, as for self-modifying code, without a full flush.  This
+ * may be done from inside generated code: the current TB runs on to its
+ * end.  Returns how many were invalidated.
+ */
+int tb_invalidate_matching(bool (*match)(TranslationBlock *tb, void *opaque),
+                           void *opaque)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    bool locked = !have_tb_lock;
+    int r, i, n = 0;
+
+    if (locked) {
+        tb_lock();
+    }
+    for (r = 0; r < ctx->nb_regions; r++) {
+        TranslationBlock *tbs = tb_region_tbs(r);
+
+        for (i = 0; i < ctx->region_nb_tbs[r]; i++) {
+            if (!tbs[i].invalid && !(tbs[i].cflags & CF_NOCACHE) &&
+                match(&tbs[i], opaque)) {
+                tb_phys_invalidate(&tbs[i], -1);
+                n++;
+            }
+        }
+    }
+    if (locked) {
+        tb_unlock();
+    }
+    return n;
+}
+
 #ifdef DEBUG_TB_CHECK
 
 static void
@@ -1114,7 +1342,7 @@ static inline void tb_remove_from_jmp_list(TranslationBlock *tb, int n)
         /* now we can suppress tb(n) from the list */
         *ptb = tb->jmp_list_next[n];
 
-        tb->jmp_list_next[n] = (uintptr_t)NULL;
+        atomic_set(&tb->jmp_list_next[n], (uintptr_t)NULL);
     }
 }
 
@@ -1146,7 +1374,7 @@ static inline void tb_jmp_unlink(TranslationBlock *tb)
         }
         tb_reset_jump(tb1, n1);
         *ptb = tb1->jmp_list_next[n1];
-        tb1->jmp_list_next[n1] = (uintptr_t)NULL;
+        atomic_set(&tb1->jmp_list_next[n1], (uintptr_t)NULL);
     }
 }
 
@@ -1159,6 +1387,7 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     CPUState *cpu;
     PageDesc *p;
     uint32_t h;
+    int i;
     tb_page_addr_t phys_pc;
 
     assert_tb_lock();
@@ -1173,20 +1402,31 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
         p = page_find(tb->page_addr[0] >> TARGET_PAGE_BITS);
+        page_lock(p);
         tb_page_remove(&p->first_tb, tb);
         invalidate_page_bitmap(p);
+        page_unlock(p);
     }
     if (tb->page_addr[1] != -1 && tb->page_addr[1] != page_addr) {
         p = page_find(tb->page_addr[1] >> TARGET_PAGE_BITS);
+        page_lock(p);
         tb_page_remove(&p->first_tb, tb);
         invalidate_page_bitmap(p);
+        page_unlock(p);
     }
 
     /* remove the TB from the hash list */
     h = tb_jmp_cache_hash_func(tb->pc);
     CPU_FOREACH(cpu) {
-        if (atomic_read(&cpu->tb_jmp_cache[h]) == tb) {
-            atomic_set(&cpu->tb_jmp_cache[h], NULL);
+        for (i = 0; i < TB_JMP_CACHE_WAYS; i++) {
+            if (atomic_read(&cpu->tb_jmp_cache[h].way[i].tb) == tb) {
+                atomic_set(&cpu->tb_jmp_cache[h].way[i].tb, NULL);
+            }
+        }
+        for (i = 0; i < TB_JMP_VICTIM_SIZE; i++) {
+            if (atomic_read(&cpu->tb_jmp_victim[i].tb) == tb) {
+                atomic_set(&cpu->tb_jmp_victim[i].tb, NULL);
+            }
         }
     }
 
@@ -1247,12 +1487,14 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 
     tb->page_addr[n] = page_addr;
     p = page_find_alloc(page_addr >> TARGET_PAGE_BITS, 1);
+    page_lock(p);
     tb->page_next[n] = p->first_tb;
 #ifndef CONFIG_USER_ONLY
     page_already_protected = p->first_tb != NULL;
 #endif
     p->first_tb = (TranslationBlock *)((uintptr_t)tb | n);
     invalidate_page_bitmap(p);
+    page_unlock(p);
 
 #if defined(CONFIG_USER_ONLY)
     if (p->flags & PAGE_WRITE) {
@@ -1272,7 +1514,7 @@ static inline void tb_alloc_page(TranslationBlock *tb,
                 continue;
             }
             prot |= p2->flags;
-            p2->flags &= ~PAGE_WRITE;
+            atomic_set(&p2->flags, p2->flags & ~PAGE_WRITE);
           }
         mprotect(g2h(page_addr), qemu_host_page_size,
                  (prot & PAGE_BITS) & ~PAGE_WRITE);
@@ -1331,11 +1573,15 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     target_ulong virt_page2;
     tcg_insn_unit *gen_code_buf;
     int gen_code_size, search_size;
+    int prof_state = tb_profile_state;
+    int64_t stats_start = exec_stats_enabled ? get_clock() : 0;
 #ifdef CONFIG_PROFILER
     int64_t ti;
 #endif
     assert_memory_lock();
 
+    /* a longjmp out of here is reset by cpu_exec() */
+    tb_profile_state = TB_PROF_TRANSLATE;
     phys_pc = get_page_addr_code(env, pc);
     if (use_icount && !(cflags & CF_IGNORE_ICOUNT)) {
         cflags |= CF_USE_ICOUNT;
@@ -1344,8 +1590,8 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb = tb_alloc(pc);
     if (unlikely(!tb)) {
  buffer_overflow:
-        /* flush must be done */
-        tb_flush(cpu);
+        /* the region is full; move on to the next */
+        tb_evict_region(cpu);
         mmap_unlock();
         cpu_loop_exit(cpu);
     }
@@ -1355,6 +1601,24 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
+    if (panda_tb_asid) {
+        tb->asid = panda_current_asid(cpu);
+    }
+    tb->panda_uninstr = !panda_instr_enabled(cpu);
+    tb->panda_inline_exec = panda_inline_block_exec();
+
+#ifdef CONFIG_SOFTMMU
+    /* translated in an earlier run, perhaps */
+    gen_code_size = tb_cache_load(cpu, tb, phys_pc, &search_size);
+    if (unlikely(gen_code_size < 0)) {
+        tb_free(tb);
+        goto buffer_overflow;
+    }
+    if (gen_code_size > 0) {
+        goto cached;
+    }
+    tb_cache_gen_start(tb);
+#endif
 
 #ifdef CONFIG_PROFILER
     tcg_ctx.tb_count1++; /* includes aborted translations because of
@@ -1396,17 +1660,23 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     gen_code_size = tcg_gen_code(&tcg_ctx, tb);
 
 #if defined(CONFIG_LLVM)
-    if (generate_llvm)
+    if (generate_llvm && !tb->panda_uninstr &&
+        (!execute_llvm || !llvm_tier_threshold || (cflags & CF_LLVM)))
         tcg_llvm_gen_code(tcg_llvm_ctx, &tcg_ctx, tb);
 #endif
 
     if (unlikely(gen_code_size < 0)) {
+        tb_free(tb);
         goto buffer_overflow;
     }
     search_size = encode_search(tb, (void *)gen_code_buf + gen_code_size);
     if (unlikely(search_size < 0)) {
+        tb_free(tb);
         goto buffer_overflow;
     }
+#ifdef CONFIG_SOFTMMU
+    tb_cache_store(cpu, tb, phys_pc, gen_code_size, search_size);
+#endif
 
 #ifdef CONFIG_PROFILER
     tcg_ctx.code_time += profile_getclock();
@@ -1442,11 +1712,13 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
 #ifdef CONFIG_LLVM
     // Sanity check. We had a bug before where we were misrecording
     // translated code sizes, and so TC blocks appeared to overlap.
-    int i;
-    if (generate_llvm) {
-        for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
-            TranslationBlock *other = &tcg_ctx.tb_ctx.tbs[i];
-            if (tb == other) continue;
+    int r, i;
+    for (r = 0; generate_llvm && r < tcg_ctx.tb_ctx.nb_regions; r++) {
+        for (i = 0; i < tcg_ctx.tb_ctx.region_nb_tbs[r]; i++) {
+            TranslationBlock *other = &tb_region_tbs(r)[i];
+            // TBs with the same ops share a function (see tcg-llvm.h)
+            if (tb == other || !other->llvm_function ||
+                    other->llvm_function == tb->llvm_function) continue;
             if (other->llvm_tc_ptr <= tb->llvm_tc_ptr &&
                     tb->llvm_tc_ptr < other->llvm_tc_end) {
                 assert(false && "Allocating apparently overlapping blocks!");
@@ -1458,6 +1730,9 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     }
 #endif
 
+#ifdef CONFIG_SOFTMMU
+ cached:
+#endif
     tcg_ctx.code_gen_ptr = (void *)
         ROUND_UP((uintptr_t)gen_code_buf + gen_code_size + search_size,
                  CODE_GEN_ALIGN);
@@ -1488,6 +1763,11 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
      * through the physical hash table and physical page list.
      */
     tb_link_page(tb, phys_pc, phys_page2);
+    tb_profile_state = prof_state;
+    if (exec_stats_enabled) {
+        exec_stats.tb_translated++;
+        exec_stats.translate_ns += get_clock() - stats_start;
+    }
     return tb;
 }
 
@@ -1614,9 +1894,12 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
         tb = tb_next;
     }
 #if !defined(CONFIG_USER_ONLY)
-    /* if no code remaining, no need to continue to use slow writes */
+    /* if no code remaining, no need to continue to use slow writes.
+       nothing can be added to the page without tb_lock. */
     if (!p->first_tb) {
+        page_lock(p);
         invalidate_page_bitmap(p);
+        page_unlock(p);
         tlb_unprotect_code(start);
     }
 #endif
@@ -1633,10 +1916,12 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
 
 #ifdef CONFIG_SOFTMMU
 /* len must be <= 8 and start must be a multiple of len.
- * Called via softmmu_template.h when code areas are written to with
- * tb_lock held.
+ * Called via softmmu_template.h when code areas are written to, without
+ * tb_lock.  Returns true, with tb_lock taken, if the write may hit a TB;
+ * the caller keeps it until the write is done, so that the TBs can't be
+ * translated again from the old code in between.
  */
-void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
+bool tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
 {
     PageDesc *p;
 
@@ -1653,13 +1938,12 @@ void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
 
     p = page_find(start >> TARGET_PAGE_BITS);
     if (!p) {
-        return;
+        return false;
     }
+    page_lock(p);
     if (!p->code_bitmap &&
         ++p->code_write_count >= SMC_BITMAP_USE_THRESHOLD) {
-        /* build code bitmap.  FIXME: writes should be protected by
-         * tb_lock, reads by tb_lock or RCU.
-         */
+        /* build code bitmap.  the page lock keeps the TB list still */
         build_page_bitmap(p);
     }
     if (p->code_bitmap) {
@@ -1668,13 +1952,16 @@ void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
 
         nr = start & ~TARGET_PAGE_MASK;
         b = p->code_bitmap[BIT_WORD(nr)] >> (nr & (BITS_PER_LONG - 1));
-        if (b & ((1 << len) - 1)) {
-            goto do_invalidate;
+        if (!(b & ((1 << len) - 1))) {
+            page_unlock(p);
+            return false;
         }
-    } else {
-    do_invalidate:
-        tb_invalidate_phys_page_range(start, start + len, 1);
     }
+    page_unlock(p);
+
+    tb_lock();
+    tb_invalidate_phys_page_range(start, start + len, 1);
+    return true;
 }
 #else
 /* Called with mmap_lock held. If pc is not 0 then it indicates the
@@ -1702,7 +1989,11 @@ static bool tb_invalidate_phys_page(tb_page_addr_t addr, uintptr_t pc)
 
     addr &= TARGET_PAGE_MASK;
     p = page_find(addr >> TARGET_PAGE_BITS);
-    if (!p) {
+    /* TBs are only added to a page with the mmap_lock held, so a page
+       without any can be skipped without bothering the threads that
+       hold tb_lock to translate.  page_unprotect comes here for every
+       target page of the host page that was written.  */
+    if (!p || !p->first_tb) {
         return false;
     }
 
@@ -1759,9 +2050,11 @@ static bool tb_invalidate_phys_page(tb_page_addr_t addr, uintptr_t pc)
    tb[1].tc_ptr. Return NULL if not found */
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
 {
-    int m_min, m_max, m;
-    uintptr_t v;
+#ifdef CONFIG_LLVM
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    int m, r;
     TranslationBlock *tb;
+#endif
 
     if (tcg_ctx.tb_ctx.nb_tbs <= 0) {
         return NULL;
@@ -1776,29 +2069,55 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
                 && tc_ptr <  (uintptr_t)tb->llvm_tc_end) {
             return tb;
         }
+        /* a trace inlines its TBs' code, and sets last_tb as it goes */
+        TranslationBlock *head = tcg_llvm_runtime.trace_tb;
+        if (tb && head
+                && tc_ptr >= (uintptr_t)head->llvm_trace_tc_ptr
+                && tc_ptr <  (uintptr_t)head->llvm_trace_tc_end) {
+            return tb;
+        }
         /* then do linear search. */
-        for (m = 0; m < tcg_ctx.tb_ctx.nb_tbs; m++) {
-            tb = &tcg_ctx.tb_ctx.tbs[m];
-            if (tb->llvm_function
-                    && tc_ptr >= (uintptr_t)tb->llvm_tc_ptr
-                    && tc_ptr <  (uintptr_t)tb->llvm_tc_end) {
-                return tb;
+        for (r = 0; r < ctx->nb_regions; r++) {
+            for (m = 0; m < ctx->region_nb_tbs[r]; m++) {
+                tb = &tb_region_tbs(r)[m];
+                if (tb->llvm_function
+                        && tc_ptr >= (uintptr_t)tb->llvm_tc_ptr
+                        && tc_ptr <  (uintptr_t)tb->llvm_tc_end) {
+                    return tb;
+                }
             }
         }
         return NULL;
     }
 #endif
 
-    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
-        tc_ptr >= (uintptr_t)tcg_ctx.code_gen_ptr) {
+    return tb_find_tcg_pc(tc_ptr);
+}
+
+/* tb_find_pc() for TCG code, whatever execute_llvm says */
+static TranslationBlock *tb_find_tcg_pc(uintptr_t tc_ptr)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    int m_min, m_max, m, r;
+    uintptr_t v;
+    TranslationBlock *tb, *tbs;
+
+    if (!ctx->nb_tbs || tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer) {
+        return NULL;
+    }
+    r = MIN((tc_ptr - (uintptr_t)tcg_ctx.code_gen_buffer) / ctx->region_size,
+            ctx->nb_regions - 1);
+    if (tc_ptr >= (uintptr_t)tb_region_code_end(r) ||
+        ctx->region_nb_tbs[r] == 0) {
         return NULL;
     }
     /* binary search (cf Knuth) */
+    tbs = tb_region_tbs(r);
     m_min = 0;
-    m_max = tcg_ctx.tb_ctx.nb_tbs - 1;
+    m_max = ctx->region_nb_tbs[r] - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tcg_ctx.tb_ctx.tbs[m];
+        tb = &tbs[m];
         v = (uintptr_t)tb->tc_ptr;
         if (v == tc_ptr) {
             return tb;
@@ -1808,7 +2127,254 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tcg_ctx.tb_ctx.tbs[m_max];
+    return &tbs[m_max];
+}
+
+/* TB hot-path profiler (-tb-profile).  Execution counts come from a
+ * counter bumped at the top of each TB (gen_tb_start), so they include
+ * TBs entered through chained jumps; cpu_tb_exec() counts the chains it
+ * starts and how they end.  Time is sampled: a SIGPROF timer interrupts
+ * whichever thread is using the CPU, and the handler files the sample by
+ * what the thread was doing.  Samples in generated code are queued by host
+ * PC and charged to their TB later by tb_profile_drain(), which doesn't
+ * have to be async-signal-safe.
+ */
+bool tb_profile_enabled;
+TBProfile tb_profile;
+__thread int tb_profile_state;
+
+#define TB_PROFILE_RING_SIZE 65536
+
+static uintptr_t tb_profile_ring[TB_PROFILE_RING_SIZE];
+static unsigned tb_profile_ring_head;   /* next slot to fill */
+static unsigned tb_profile_ring_tail;   /* next slot to drain */
+
+#ifndef _WIN32
+static uintptr_t tb_profile_host_pc(void *puc)
+{
+#if defined(__linux__) && defined(__x86_64__)
+    return ((ucontext_t *)puc)->uc_mcontext.gregs[REG_RIP];
+#elif defined(__linux__) && defined(__i386__)
+    return ((ucontext_t *)puc)->uc_mcontext.gregs[REG_EIP];
+#elif defined(__linux__) && defined(__aarch64__)
+    return ((ucontext_t *)puc)->uc_mcontext.pc;
+#else
+    /* can't tell generated code from helpers: it all counts as helpers */
+    return 0;
+#endif
+}
+
+static void tb_profile_signal(int sig, siginfo_t *info, void *puc)
+{
+    uintptr_t pc;
+    unsigned slot;
+
+    if (tb_profile_state == TB_PROF_TRANSLATE) {
+        tb_profile.samples[TB_PROF_SAMPLE_TRANSLATE]++;
+        return;
+    } else if (tb_profile_state != TB_PROF_EXEC) {
+        tb_profile.samples[TB_PROF_SAMPLE_OTHER]++;
+        return;
+    }
+    pc = tb_profile_host_pc(puc);
+    if (pc < (uintptr_t)tcg_ctx.code_gen_buffer ||
+        pc >= (uintptr_t)tcg_ctx.code_gen_buffer +
+              tcg_ctx.code_gen_buffer_size) {
+        tb_profile.samples[TB_PROF_SAMPLE_HELPER]++;
+        return;
+    }
+    tb_profile.samples[TB_PROF_SAMPLE_CODE]++;
+    /* a slot the drain hasn't got to since the last lap means it's full */
+    slot = atomic_fetch_inc(&tb_profile_ring_head) % TB_PROFILE_RING_SIZE;
+    if (atomic_cmpxchg(&tb_profile_ring[slot], 0, pc) != 0) {
+        tb_profile.samples_dropped++;
+    }
+}
+#endif
+
+void tb_profile_start(unsigned period_us)
+{
+#ifndef _WIN32
+    struct sigaction act;
+    struct itimerval it;
+
+    memset(&act, 0, sizeof(act));
+    act.sa_sigaction = tb_profile_signal;
+    act.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&act.sa_mask);
+    sigaction(SIGPROF, &act, NULL);
+
+    it.it_interval.tv_sec = period_us / 1000000;
+    it.it_interval.tv_usec = period_us % 1000000;
+    it.it_value = it.it_interval;
+    setitimer(ITIMER_PROF, &it, NULL);
+#endif
+    tb_profile.period_us = period_us;
+    tb_profile_enabled = true;
+}
+
+/* Threads start with every signal blocked (qemu_thread_create), so the
+   vCPU threads have to ask for SIGPROF to be sampled at all.  */
+void tb_profile_thread_init(void)
+{
+#ifndef _WIN32
+    sigset_t set;
+
+    if (!tb_profile_enabled) {
+        return;
+    }
+    sigemptyset(&set);
+    sigaddset(&set, SIGPROF);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+#endif
+}
+
+/* Charge the queued code samples to their TBs.  Done before TBs go away,
+   or their samples would land on whatever is translated there next.
+
+   Called with tb_lock held.  */
+static void tb_profile_drain(void)
+{
+    unsigned head = atomic_read(&tb_profile_ring_head);
+    unsigned tail = tb_profile_ring_tail;
+    TranslationBlock *tb;
+    uintptr_t pc;
+
+    if (head - tail > TB_PROFILE_RING_SIZE) {
+        tail = head - TB_PROFILE_RING_SIZE;
+    }
+    for (; tail != head; tail++) {
+        pc = atomic_xchg(&tb_profile_ring[tail % TB_PROFILE_RING_SIZE], 0);
+        if (!pc) {
+            /* still being written; it'll be picked up next lap */
+            continue;
+        }
+        tb = tb_find_tcg_pc(pc);
+        if (tb) {
+            tb->prof_samples++;
+        } else {
+            tb_profile.samples_dropped++;
+        }
+    }
+    tb_profile_ring_tail = tail;
+}
+
+static int tb_profile_cmp(const void *a, const void *b)
+{
+    uint64_t ea = (*(TranslationBlock * const *)a)->prof_execs;
+    uint64_t eb = (*(TranslationBlock * const *)b)->prof_execs;
+
+    return ea < eb ? 1 : ea > eb ? -1 : 0;
+}
+
+/* -exec-stats: what a run cost the emulator, written out as JSON when
+   QEMU exits, for benchmarking TCG itself.  Guest instructions come from
+   the TB execution counters that -tb-profile uses, as executions times
+   instructions, so a TB left early (an exception, say) counts in full.  */
+bool exec_stats_enabled;
+ExecStats exec_stats;
+static char *exec_stats_path;
+
+void exec_stats_start(const char *path)
+{
+    exec_stats_path = g_strdup(path);
+    exec_stats.start_ns = get_clock();
+    exec_stats_enabled = true;
+    tcg_count_helpers = true;
+}
+
+/* Keep the instructions of TBs that are about to go away */
+static void exec_stats_retire(TranslationBlock *tbs, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        exec_stats.retired_insns += tbs[i].prof_execs * tbs[i].icount;
+    }
+}
+
+void exec_stats_dump(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    uint64_t insns, jmp_hits = 0, jmp_victim_hits = 0, jmp_misses = 0;
+    CPUState *cpu;
+    FILE *f;
+    int r, i;
+
+    if (!exec_stats_enabled) {
+        return;
+    }
+    f = fopen(exec_stats_path, "w");
+    if (!f) {
+        fprintf(stderr, "qemu: -exec-stats: can't write %s: %s\n",
+                exec_stats_path, strerror(errno));
+        return;
+    }
+
+    tb_lock();
+    insns = exec_stats.retired_insns;
+    for (r = 0; r < ctx->nb_regions; r++) {
+        TranslationBlock *tbs = tb_region_tbs(r);
+
+        for (i = 0; i < ctx->region_nb_tbs[r]; i++) {
+            insns += tbs[i].prof_execs * tbs[i].icount;
+        }
+    }
+    CPU_FOREACH(cpu) {
+        jmp_hits += cpu->tb_jmp_cache_hits;
+        jmp_victim_hits += cpu->tb_jmp_victim_hits;
+        jmp_misses += cpu->tb_jmp_cache_misses;
+    }
+
+    fprintf(f, "{\n");
+    fprintf(f, "    \"wall-ns\": %" PRId64 ",\n",
+            get_clock() - exec_stats.start_ns);
+    fprintf(f, "    \"guest-insns\": %" PRIu64 ",\n", insns);
+    fprintf(f, "    \"tb-translated\": %" PRIu64 ",\n",
+            exec_stats.tb_translated);
+    fprintf(f, "    \"translate-ns\": %" PRId64 ",\n",
+            exec_stats.translate_ns);
+    fprintf(f, "    \"tb-flushes\": %u,\n",
+            atomic_read(&ctx->tb_flush_count));
+    fprintf(f, "    \"tb-evictions\": %u,\n",
+            atomic_read(&ctx->tb_evict_count));
+    fprintf(f, "    \"tb-invalidations\": %d,\n",
+            ctx->tb_phys_invalidate_count);
+    fprintf(f, "    \"jump-cache-hits\": %" PRIu64 ",\n", jmp_hits);
+    fprintf(f, "    \"jump-cache-victim-hits\": %" PRIu64 ",\n",
+            jmp_victim_hits);
+    fprintf(f, "    \"jump-cache-misses\": %" PRIu64 ",\n", jmp_misses);
+    fprintf(f, "    \"helper-calls\": {");
+    tcg_dump_helper_calls(f);
+    fprintf(f, "\n    }\n}\n");
+    tb_unlock();
+
+    fclose(f);
+}
+
+int tb_profile_top(TranslationBlock **tbs, int n)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TranslationBlock **all, *tb;
+    int r, i, nb = 0;
+
+    assert_tb_lock();
+    tb_profile_drain();
+
+    all = g_new(TranslationBlock *, ctx->nb_tbs);
+    for (r = 0; r < ctx->nb_regions; r++) {
+        for (i = 0; i < ctx->region_nb_tbs[r]; i++) {
+            tb = &tb_region_tbs(r)[i];
+            if (!tb->invalid && tb->prof_execs) {
+                all[nb++] = tb;
+            }
+        }
+    }
+    qsort(all, nb, sizeof(*all), tb_profile_cmp);
+    n = MIN(n, nb);
+    memcpy(tbs, all, n * sizeof(*tbs));
+    g_free(all);
+    return n;
 }
 
 #if !defined(CONFIG_USER_ONLY)
@@ -1943,11 +2509,21 @@ void tb_flush_jmp_cache(CPUState *cpu, target_ulong addr)
        overlap the flushed page.  */
     i = tb_jmp_cache_hash_page(addr - TARGET_PAGE_SIZE);
     memset(&cpu->tb_jmp_cache[i], 0,
-           TB_JMP_PAGE_SIZE * sizeof(TranslationBlock *));
+           TB_JMP_PAGE_SIZE * sizeof(TBJmpCacheSet));
 
     i = tb_jmp_cache_hash_page(addr);
     memset(&cpu->tb_jmp_cache[i], 0,
-           TB_JMP_PAGE_SIZE * sizeof(TranslationBlock *));
+           TB_JMP_PAGE_SIZE * sizeof(TBJmpCacheSet));
+
+    /* the victim buffer isn't indexed by page */
+    addr &= TARGET_PAGE_MASK;
+    for (i = 0; i < TB_JMP_VICTIM_SIZE; i++) {
+        TranslationBlock *tb = cpu->tb_jmp_victim[i].tb;
+        if (tb && ((tb->pc & TARGET_PAGE_MASK) == addr ||
+                   (tb->pc & TARGET_PAGE_MASK) == addr - TARGET_PAGE_SIZE)) {
+            cpu->tb_jmp_victim[i].tb = NULL;
+        }
+    }
 }
 
 static void print_qht_statistics(FILE *f, fprintf_function cpu_fprintf,
@@ -1986,14 +2562,20 @@ static void print_qht_statistics(FILE *f, fprintf_function cpu_fprintf,
     cpu_fprintf(f, "TB hash avg chain   %0.3f buckets. Histogram: %s\n",
                 qdist_avg(&hst.chain), hgram);
     g_free(hgram);
+    cpu_fprintf(f, "TB hash resizes     %u\n", hst.resizes);
 }
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    int i, r, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    size_t host_code_size;
     TranslationBlock *tb;
     struct qht_stats hst;
+    uint64_t jmp_hits = 0, jmp_victim_hits = 0, jmp_misses = 0;
+    uint64_t htable_misses = 0;
+    CPUState *cpu;
 
     tb_lock();
 
@@ -2002,40 +2584,43 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
-        tb = &tcg_ctx.tb_ctx.tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size) {
-            max_target_code_size = tb->size;
-        }
-        if (tb->page_addr[1] != -1) {
-            cross_page++;
-        }
-        if (tb->jmp_reset_offset[0] != TB_JMP_RESET_OFFSET_INVALID) {
-            direct_jmp_count++;
-            if (tb->jmp_reset_offset[1] != TB_JMP_RESET_OFFSET_INVALID) {
-                direct_jmp2_count++;
+    host_code_size = 0;
+    for (r = 0; r < ctx->nb_regions; r++) {
+        host_code_size += tb_region_code_end(r) - tb_region_start(r);
+        for (i = 0; i < ctx->region_nb_tbs[r]; i++) {
+            tb = &tb_region_tbs(r)[i];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->jmp_reset_offset[0] != TB_JMP_RESET_OFFSET_INVALID) {
+                direct_jmp_count++;
+                if (tb->jmp_reset_offset[1] != TB_JMP_RESET_OFFSET_INVALID) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%zd\n",
-                tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer,
-                tcg_ctx.code_gen_highwater - tcg_ctx.code_gen_buffer);
+    cpu_fprintf(f, "gen code size       %zd/%zd\n",
+                host_code_size, tcg_ctx.code_gen_buffer_size);
+    cpu_fprintf(f, "TB regions          %d (filling %d)\n",
+                ctx->nb_regions, ctx->region);
     cpu_fprintf(f, "TB count            %d/%d\n",
             tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
             tcg_ctx.tb_ctx.nb_tbs ? target_code_size /
                     tcg_ctx.tb_ctx.nb_tbs : 0,
             max_target_code_size);
-    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-            tcg_ctx.tb_ctx.nb_tbs ? (tcg_ctx.code_gen_ptr -
-                                     tcg_ctx.code_gen_buffer) /
+    cpu_fprintf(f, "TB avg host size    %zd bytes (expansion ratio: %0.1f)\n",
+            tcg_ctx.tb_ctx.nb_tbs ? host_code_size /
                                      tcg_ctx.tb_ctx.nb_tbs : 0,
-                target_code_size ? (double) (tcg_ctx.code_gen_ptr -
-                                             tcg_ctx.code_gen_buffer) /
-                                             target_code_size : 0);
+                target_code_size ? (double) host_code_size /
+                                            target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n", cross_page,
             tcg_ctx.tb_ctx.nb_tbs ? (cross_page * 100) /
                                     tcg_ctx.tb_ctx.nb_tbs : 0);
@@ -2051,12 +2636,45 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     print_qht_statistics(f, cpu_fprintf, hst);
     qht_statistics_destroy(&hst);
 
+    CPU_FOREACH(cpu) {
+        jmp_hits += cpu->tb_jmp_cache_hits;
+        jmp_victim_hits += cpu->tb_jmp_victim_hits;
+        jmp_misses += cpu->tb_jmp_cache_misses;
+        htable_misses += cpu->tb_htable_misses;
+    }
+    cpu_fprintf(f, "TB jump cache       %d sets, %d-way, %d victims\n",
+                TB_JMP_CACHE_SIZE, TB_JMP_CACHE_WAYS, TB_JMP_VICTIM_SIZE);
+    cpu_fprintf(f, "TB jump cache hits  %" PRIu64 " (%0.2f%%, %" PRIu64
+                " from victims), %" PRIu64 " misses\n",
+                jmp_hits + jmp_victim_hits,
+                jmp_hits + jmp_victim_hits + jmp_misses ?
+                (double)(jmp_hits + jmp_victim_hits) * 100 /
+                (jmp_hits + jmp_victim_hits + jmp_misses) : 0,
+                jmp_victim_hits, jmp_misses);
+    /* every jump cache miss looks in the hash table */
+    cpu_fprintf(f, "TB hash lookups     %" PRIu64 " (%0.2f%% found), %" PRIu64
+                " misses\n", jmp_misses,
+                jmp_misses ? (double)(jmp_misses - htable_misses) * 100 /
+                jmp_misses : 0, htable_misses);
+
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %u\n",
             atomic_read(&tcg_ctx.tb_ctx.tb_flush_count));
+    cpu_fprintf(f, "TB evict count      %u\n",
+            atomic_read(&tcg_ctx.tb_ctx.tb_evict_count));
     cpu_fprintf(f, "TB invalidate count %d\n",
             tcg_ctx.tb_ctx.tb_phys_invalidate_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    cpu_fprintf(f, "TLB resize count    %d\n", tlb_resize_count);
+#endif
+    if (tlb_asid_slots) {
+        cpu_fprintf(f, "TLB ASID switches   %d (%d to a kept TLB)\n",
+                    tlb_asid_switch_count, tlb_asid_hit_count);
+    }
+#ifdef CONFIG_SOFTMMU
+    tb_cache_dump_info(f, cpu_fprintf);
+#endif
     tcg_dump_info(f, cpu_fprintf);
 
     tb_unlock();
@@ -2067,11 +2685,105 @@ void dump_opcount_info(FILE *f, fprintf_function cpu_fprintf)
     tcg_dump_op_count(f, cpu_fprintf);
 }
 
+static double tb_profile_pct(uint64_t n, uint64_t total)
+{
+    return total ? (double)n * 100 / total : 0;
+}
+
+void dump_tb_profile(FILE *f, fprintf_function cpu_fprintf, int n)
+{
+    static const char * const sample_names[TB_PROF_SAMPLE_NB] = {
+        "generated code", "helpers", "translation", "elsewhere",
+    };
+    static const char * const exit_names[TB_PROF_EXIT_NB] = {
+        "jump slot 0", "jump slot 1", "icount expired", "exit requested",
+        "not chainable",
+    };
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    uint64_t samples = 0, exits = 0, execs = 0, entries = 0;
+    TranslationBlock **top, *tb;
+    struct qdist hist;
+    char *hgram;
+    int r, i;
+
+    if (!tb_profile_enabled) {
+        cpu_fprintf(f, "TB profiling is off (see -tb-profile)\n");
+        return;
+    }
+
+    tb_lock();
+
+    top = g_new(TranslationBlock *, MAX(n, 1));
+    n = tb_profile_top(top, n);
+
+    qdist_init(&hist);
+    for (r = 0; r < ctx->nb_regions; r++) {
+        for (i = 0; i < ctx->region_nb_tbs[r]; i++) {
+            tb = &tb_region_tbs(r)[i];
+            if (tb->invalid || !tb->prof_execs) {
+                continue;
+            }
+            execs += tb->prof_execs;
+            entries += tb->prof_entries;
+            qdist_inc(&hist, 63 - clz64(tb->prof_execs));
+        }
+    }
+    for (i = 0; i < TB_PROF_SAMPLE_NB; i++) {
+        samples += tb_profile.samples[i];
+    }
+    for (i = 0; i < TB_PROF_EXIT_NB; i++) {
+        exits += tb_profile.exits[i];
+    }
+
+    cpu_fprintf(f, "samples             %" PRIu64 " every %u us\n",
+                samples, tb_profile.period_us);
+    for (i = 0; i < TB_PROF_SAMPLE_NB; i++) {
+        cpu_fprintf(f, "  %-17s %0.1f%%\n", sample_names[i],
+                    tb_profile_pct(tb_profile.samples[i], samples));
+    }
+    if (tb_profile.samples_dropped) {
+        cpu_fprintf(f, "  (%" PRIu64 " code samples not charged to a TB)\n",
+                    tb_profile.samples_dropped);
+    }
+    cpu_fprintf(f, "TB executions       %" PRIu64 " in cached TBs, "
+                "%0.1f%% through chained jumps\n", execs,
+                execs ? 100 - tb_profile_pct(entries, execs) : 0);
+    cpu_fprintf(f, "chain exits         %" PRIu64 "\n", exits);
+    for (i = 0; i < TB_PROF_EXIT_NB; i++) {
+        cpu_fprintf(f, "  %-17s %0.1f%%\n", exit_names[i],
+                    tb_profile_pct(tb_profile.exits[i], exits));
+    }
+    if (qdist_sample_count(&hist)) {
+        hgram = qdist_pr(&hist, 0, QDIST_PR_BORDER | QDIST_PR_LABELS |
+                         QDIST_PR_NODECIMAL | QDIST_PR_NOBINRANGE);
+        cpu_fprintf(f, "TB log2 executions  %0.1f avg. Histogram: %s\n",
+                    qdist_avg(&hist), hgram);
+        g_free(hgram);
+    }
+    qdist_destroy(&hist);
+
+    if (n) {
+        cpu_fprintf(f, "\n%-18s %5s %5s %14s %7s %8s %7s\n", "guest pc",
+                    "size", "insns", "executions", "", "entries", "samples");
+    }
+    for (i = 0; i < n; i++) {
+        tb = top[i];
+        cpu_fprintf(f, "0x" TARGET_FMT_lx " %5u %5u %14" PRIu64
+                    " %6.2f%% %8" PRIu64 " %7u\n",
+                    tb->pc, tb->size, tb->icount, tb->prof_execs,
+                    tb_profile_pct(tb->prof_execs, execs),
+                    tb->prof_entries, tb->prof_samples);
+    }
+    g_free(top);
+
+    tb_unlock();
+}
+
 #else /* CONFIG_USER_ONLY */
 
 void cpu_interrupt(CPUState *cpu, int mask)
 {
-    cpu->interrupt_request |= mask;
+    atomic_or(&cpu->interrupt_request, mask);
     cpu->tcg_exit_req = 1;
 }
 
@@ -2195,7 +2907,7 @@ int page_get_flags(target_ulong address)
     if (!p) {
         return 0;
     }
-    return p->flags;
+    return atomic_read(&p->flags);
 }
 
 /* Modify the flags of a page and invalidate the code if necessary.
@@ -2233,13 +2945,14 @@ void page_set_flags(target_ulong start, target_ulong end, int flags)
             p->first_tb) {
             tb_invalidate_phys_page(addr, 0);
         }
-        p->flags = flags;
+        atomic_set(&p->flags, flags);
     }
 }
 
 int page_check_range(target_ulong start, target_ulong len, int flags)
 {
-    PageDesc *p;
+    PageDesc *p = NULL;
+    unsigned long pflags;
     target_ulong end;
     target_ulong addr;
 
@@ -2265,24 +2978,34 @@ int page_check_range(target_ulong start, target_ulong len, int flags)
     for (addr = start, len = end - start;
          len != 0;
          len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
-        p = page_find(addr >> TARGET_PAGE_BITS);
-        if (!p) {
-            return -1;
+        tb_page_addr_t index = addr >> TARGET_PAGE_BITS;
+
+        /* The descriptors of the pages in one leaf of l1_map are
+           contiguous and leaves are never freed, so only walk the map
+           again when crossing into the next leaf.  */
+        if (p && (index & (V_L2_SIZE - 1))) {
+            p++;
+        } else {
+            p = page_find(index);
+            if (!p) {
+                return -1;
+            }
         }
-        if (!(p->flags & PAGE_VALID)) {
+        pflags = atomic_read(&p->flags);
+        if (!(pflags & PAGE_VALID)) {
             return -1;
         }
 
-        if ((flags & PAGE_READ) && !(p->flags & PAGE_READ)) {
+        if ((flags & PAGE_READ) && !(pflags & PAGE_READ)) {
             return -1;
         }
         if (flags & PAGE_WRITE) {
-            if (!(p->flags & PAGE_WRITE_ORG)) {
+            if (!(pflags & PAGE_WRITE_ORG)) {
                 return -1;
             }
             /* unprotect the page if it was put read-only because it
                contains translated code */
-            if (!(p->flags & PAGE_WRITE)) {
+            if (!(pflags & PAGE_WRITE)) {
                 if (!page_unprotect(addr, 0)) {
                     return -1;
                 }
@@ -2326,7 +3049,7 @@ int page_unprotect(target_ulong address, uintptr_t pc)
         current_tb_invalidated = false;
         for (addr = host_start ; addr < host_end ; addr += TARGET_PAGE_SIZE) {
             p = page_find(addr >> TARGET_PAGE_BITS);
-            p->flags |= PAGE_WRITE;
+            atomic_set(&p->flags, p->flags | PAGE_WRITE);
             prot |= p->flags;
 
             /* and since the content will be modified, we must invalidate
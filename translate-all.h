@@ -23,12 +23,23 @@
 
 
 /* translate-all.c */
-void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len);
+bool tb_invalidate_phys_page_fast(tb_page_addr_t start, int len);
 void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
                                    int is_cpu_write_access);
 void tb_invalidate_phys_range(tb_page_addr_t start, tb_page_addr_t end);
 void tb_check_watchpoint(CPUState *cpu);
 
+#ifdef CONFIG_SOFTMMU
+/* tb-cache.c */
+void tb_cache_open(const char *path);
+void tb_cache_gen_start(TranslationBlock *tb);
+int tb_cache_load(CPUState *cpu, TranslationBlock *tb,
+                  tb_page_addr_t phys_pc, int *search_size);
+void tb_cache_store(CPUState *cpu, TranslationBlock *tb,
+                    tb_page_addr_t phys_pc, int code_size, int search_size);
+void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf);
+#endif
+
 #ifdef CONFIG_USER_ONLY
 int page_unprotect(target_ulong address, uintptr_t pc);
 #endif
@@ -26,13 +26,15 @@ uintptr_t qemu_real_host_page_size;
 intptr_t qemu_real_host_page_mask;
 
 #ifndef CONFIG_USER_ONLY
-/* mask must never be zero, except for A20 change call */
+/* mask must never be zero, except for A20 change call.  The BQL isn't
+ * needed: the bits are set atomically, and qemu_cpu_kick() doesn't need it
+ * to wake the target vCPU.
+ */
 static void tcg_handle_interrupt(CPUState *cpu, int mask)
 {
     int old_mask;
 
-    old_mask = cpu->interrupt_request;
-    cpu->interrupt_request |= mask;
+    old_mask = atomic_fetch_or(&cpu->interrupt_request, mask);
 
     /*
      * If called from iothread context, wake the target cpu in
@@ -214,13 +214,20 @@ static void qemu_spice_create_update(SimpleSpiceDisplay *ssd)
     guest = surface_data(ssd->ds);
     mirror = (void *)pixman_image_get_data(ssd->mirror);
     for (y = ssd->dirty.top; y < ssd->dirty.bottom; y++) {
+        bool unchanged;
+
         yoff1 = y * surface_stride(ssd->ds);
         yoff2 = y * pixman_image_get_stride(ssd->mirror);
+        /* most dirty rows have not changed at all, check them in one go */
+        xoff = ssd->dirty.left * bpp;
+        unchanged = memcmp(guest + yoff1 + xoff, mirror + yoff2 + xoff,
+                           (ssd->dirty.right - ssd->dirty.left) * bpp) == 0;
         for (x = ssd->dirty.left; x < ssd->dirty.right; x += blksize) {
             xoff = x * bpp;
             blk = x / blksize;
             bw = MIN(blksize, ssd->dirty.right - x);
-            if (memcmp(guest + yoff1 + xoff,
+            if (unchanged ||
+                memcmp(guest + yoff1 + xoff,
                        mirror + yoff2 + xoff,
                        bw * bpp) == 0) {
                 if (dirty_top[blk] != -1) {
@@ -2883,8 +2883,8 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     line_bytes = MIN(server_stride, guest_ll);
 
     for (;;) {
-        int x;
-        uint8_t *guest_ptr, *server_ptr;
+        int x, x_first, x_last, x_end;
+        uint8_t *guest_ptr, *server_ptr, *guest_line, *server_line;
         unsigned long offset = find_next_bit((unsigned long *) &vd->guest.dirty,
                                              height * VNC_DIRTY_BPL(&vd->guest),
                                              y * VNC_DIRTY_BPL(&vd->guest));
@@ -2893,40 +2893,68 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
             break;
         }
         y = offset / VNC_DIRTY_BPL(&vd->guest);
-        x = offset % VNC_DIRTY_BPL(&vd->guest);
+        x_first = x = offset % VNC_DIRTY_BPL(&vd->guest);
+        x_end = DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
+        x_last = find_last_bit(vd->guest.dirty[y], x_end);
+        if (x >= x_end || x_last >= x_end) {
+            y++;
+            continue;
+        }
+        x_end = x_last + 1;
 
-        server_ptr = server_row0 + y * server_stride + x * cmp_bytes;
+        server_line = server_row0 + y * server_stride;
 
         if (vd->guest.format != VNC_SERVER_FB_FORMAT) {
-            qemu_pixman_linebuf_fill(tmpbuf, vd->guest.fb, width, 0, y);
-            guest_ptr = (uint8_t *)pixman_image_get_data(tmpbuf);
+            /* only convert the span that has dirty bits */
+            int px = x_first * VNC_DIRTY_PIXELS_PER_BIT;
+            qemu_pixman_linebuf_fill(tmpbuf, vd->guest.fb,
+                                     MIN(width,
+                                         x_end * VNC_DIRTY_PIXELS_PER_BIT) - px,
+                                     px, y);
+            guest_line = (uint8_t *)pixman_image_get_data(tmpbuf);
         } else {
-            guest_ptr = guest_row0 + y * guest_stride;
-        }
-        guest_ptr += x * cmp_bytes;
-
-        for (; x < DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
-             x++, guest_ptr += cmp_bytes, server_ptr += cmp_bytes) {
-            int _cmp_bytes = cmp_bytes;
-            if (!test_and_clear_bit(x, vd->guest.dirty[y])) {
-                continue;
-            }
-            if ((x + 1) * cmp_bytes > line_bytes) {
-                _cmp_bytes = line_bytes - x * cmp_bytes;
-            }
-            assert(_cmp_bytes >= 0);
-            if (memcmp(server_ptr, guest_ptr, _cmp_bytes) == 0) {
+            guest_line = guest_row0 + y * guest_stride + x_first * cmp_bytes;
+        }
+
+        while (x < x_end) {
+            /*
+             * Pages are dirty for any write, so most of the line often has
+             * not changed: compare each run of dirty chunks in one go before
+             * looking at its chunks separately.
+             */
+            int x2 = find_next_zero_bit(vd->guest.dirty[y], x_end, x);
+            int run_bytes = MIN(x2 * cmp_bytes, line_bytes) - x * cmp_bytes;
+
+            server_ptr = server_line + x * cmp_bytes;
+            guest_ptr = guest_line + (x - x_first) * cmp_bytes;
+            if (run_bytes <= 0 ||
+                memcmp(server_ptr, guest_ptr, run_bytes) == 0) {
+                bitmap_clear(vd->guest.dirty[y], x, x2 - x);
+                x = find_next_bit(vd->guest.dirty[y], x_end, x2);
                 continue;
             }
-            memcpy(server_ptr, guest_ptr, _cmp_bytes);
-            if (!vd->non_adaptive) {
-                vnc_rect_updated(vd, x * VNC_DIRTY_PIXELS_PER_BIT,
-                                 y, &tv);
-            }
-            QTAILQ_FOREACH(vs, &vd->clients, next) {
-                set_bit(x, vs->dirty[y]);
+            for (; x < x2;
+                 x++, guest_ptr += cmp_bytes, server_ptr += cmp_bytes) {
+                int _cmp_bytes = cmp_bytes;
+                clear_bit(x, vd->guest.dirty[y]);
+                if ((x + 1) * cmp_bytes > line_bytes) {
+                    _cmp_bytes = line_bytes - x * cmp_bytes;
+                }
+                if (_cmp_bytes <= 0 ||
+                    memcmp(server_ptr, guest_ptr, _cmp_bytes) == 0) {
+                    continue;
+                }
+                memcpy(server_ptr, guest_ptr, _cmp_bytes);
+                if (!vd->non_adaptive) {
+                    vnc_rect_updated(vd, x * VNC_DIRTY_PIXELS_PER_BIT,
+                                     y, &tv);
+                }
+                QTAILQ_FOREACH(vs, &vd->clients, next) {
+                    set_bit(x, vs->dirty[y]);
+                }
+                has_dirty++;
             }
-            has_dirty++;
+            x = find_next_bit(vd->guest.dirty[y], x_end, x2);
         }
 
         y++;
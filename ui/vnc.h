@@ -243,6 +243,7 @@ struct VncRectEntry
 struct VncJob
 {
     VncState *vs;
+    bool running;       /* taken by an encoding thread */
 
     QLIST_HEAD(, VncRectEntry) rectangles;
     QTAILQ_ENTRY(VncJob) next;
@@ -166,6 +166,81 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
     }
 }
 
+int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start)
+{
+    uint64_t item = start >> hb->granularity;
+    size_t pos = item >> BITS_PER_LEVEL;
+    const unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
+    size_t sz = hb->sizes[HBITMAP_LEVELS - 1];
+    unsigned long cur;
+    uint64_t res;
+
+    assert(item < hb->size);
+
+    /* Pretend that the bits before start are set */
+    cur = last_lev[pos] | ((1UL << (item & (BITS_PER_LONG - 1))) - 1);
+    if (cur == ~0UL) {
+        /* The upper levels only know about set bits, so this has to look
+         * at the words themselves.  Test four at a time, which compilers
+         * turn into vector code. */
+        pos++;
+        while (pos + 4 <= sz &&
+               (last_lev[pos] & last_lev[pos + 1] &
+                last_lev[pos + 2] & last_lev[pos + 3]) == ~0UL) {
+            pos += 4;
+        }
+        while (pos < sz && last_lev[pos] == ~0UL) {
+            pos++;
+        }
+        if (pos == sz) {
+            return -1;
+        }
+        cur = last_lev[pos];
+    }
+
+    res = ((uint64_t)pos << BITS_PER_LEVEL) + ctol(cur);
+    if (res >= hb->size) {
+        return -1;
+    }
+
+    /* start may be in the middle of the group that the zero bit covers */
+    return MAX(res << hb->granularity, start);
+}
+
+bool hbitmap_next_dirty_area(const HBitmap *hb, uint64_t *start,
+                             uint64_t *count)
+{
+    uint64_t size = hb->size << hb->granularity;
+    uint64_t end, gran = 1ULL << hb->granularity;
+    HBitmapIter hbi;
+    int64_t first, area_end;
+
+    if (*start >= size || *count == 0) {
+        return false;
+    }
+    end = *count > size - *start ? size : *start + *count;
+
+    hbitmap_iter_init(&hbi, hb, *start);
+    first = hbitmap_iter_next(&hbi);
+    if (first < 0 || first >= end) {
+        return false;
+    }
+
+    if (first + gran >= end) {
+        area_end = end;
+    } else {
+        area_end = hbitmap_next_zero(hb, first + gran);
+        if (area_end < 0 || area_end > end) {
+            area_end = end;
+        }
+    }
+
+    /* The iterator returns the start of the group, which may be earlier */
+    *start = MAX(first, *start);
+    *count = area_end - *start;
+    return true;
+}
+
 bool hbitmap_empty(const HBitmap *hb)
 {
     return hb->count == 0;
@@ -510,6 +585,59 @@ void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
     }
 }
 
+size_t hbitmap_serialize_extents(const HBitmap *hb, uint8_t *buf,
+                                 size_t size, uint64_t start, uint64_t count,
+                                 uint64_t *end)
+{
+    uint64_t stop = MIN(start + count, hb->size << hb->granularity);
+    uint64_t pos = start;
+    size_t used = 0;
+
+    while (pos < stop) {
+        uint64_t area = pos, n = stop - pos;
+
+        if (!hbitmap_next_dirty_area(hb, &area, &n)) {
+            pos = stop;
+            break;
+        }
+        if (size - used < 16) {
+            /* Everything up to the area that did not fit is described */
+            pos = area;
+            break;
+        }
+        stq_le_p(buf + used, area);
+        stq_le_p(buf + used + 8, n);
+        used += 16;
+        pos = area + n;
+    }
+
+    *end = pos;
+    return used;
+}
+
+bool hbitmap_deserialize_extents(HBitmap *hb, const uint8_t *buf,
+                                 size_t size, uint64_t start, uint64_t end)
+{
+    uint64_t area, n;
+    size_t i;
+
+    if (size % 16 || start > end || end > hb->size << hb->granularity) {
+        return false;
+    }
+    if (end > start) {
+        hbitmap_reset(hb, start, end - start);
+    }
+    for (i = 0; i < size; i += 16) {
+        area = ldq_le_p(buf + i);
+        n = ldq_le_p(buf + i + 8);
+        if (area < start || area > end || n == 0 || n > end - area) {
+            return false;
+        }
+        hbitmap_set(hb, area, n);
+    }
+    return true;
+}
+
 void hbitmap_deserialize_finish(HBitmap *bitmap)
 {
     int64_t i, size, prev_size;
@@ -532,6 +660,10 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
     }
 
     bitmap->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+
+    /* The last level was written directly, so the count is stale */
+    bitmap->count = bitmap->size ? hb_count_between(bitmap, 0,
+                                                    bitmap->size - 1) : 0;
 }
 
 void hbitmap_free(HBitmap *hb)
@@ -621,6 +753,52 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
 }
 
 
+/* Word @pos of the last level became nonzero: set the bits that lead to it
+ * in the upper levels.  Level 0 has the sentinel, so the loop always ends
+ * on a word that was already nonzero. */
+static void hb_set_word_up(HBitmap *hb, uint64_t pos)
+{
+    int i;
+
+    for (i = HBITMAP_LEVELS - 2; i >= 0; i--) {
+        unsigned long *elem = &hb->levels[i][pos >> BITS_PER_LEVEL];
+        unsigned long old = *elem;
+
+        *elem |= 1UL << (pos & (BITS_PER_LONG - 1));
+        if (old) {
+            break;
+        }
+        pos >>= BITS_PER_LEVEL;
+    }
+}
+
+/* Word @pos of the last level became zero: the opposite of the above */
+static void hb_reset_word_up(HBitmap *hb, uint64_t pos)
+{
+    int i;
+
+    for (i = HBITMAP_LEVELS - 2; i >= 0; i--) {
+        unsigned long *elem = &hb->levels[i][pos >> BITS_PER_LEVEL];
+
+        *elem &= ~(1UL << (pos & (BITS_PER_LONG - 1)));
+        if (*elem) {
+            break;
+        }
+        pos >>= BITS_PER_LEVEL;
+    }
+}
+
+/* Tell the meta bitmap that word @pos of the last level changed */
+static void hb_word_changed(HBitmap *hb, uint64_t pos)
+{
+    uint64_t first = pos << BITS_PER_LEVEL;
+
+    if (hb->meta) {
+        hbitmap_set(hb->meta, first << hb->granularity,
+                    MIN(BITS_PER_LONG, hb->size - first) << hb->granularity);
+    }
+}
+
 /**
  * Given HBitmaps A and B, let A := A (BITOR) B.
  * Bitmap B will not be modified.
@@ -630,8 +808,9 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
  */
 bool hbitmap_merge(HBitmap *a, const HBitmap *b)
 {
-    int i;
-    uint64_t j;
+    HBitmapIter hbi;
+    unsigned long cur, old;
+    size_t pos;
 
     if ((a->size != b->size) || (a->granularity != b->granularity)) {
         return false;
@@ -641,14 +820,55 @@ bool hbitmap_merge(HBitmap *a, const HBitmap *b)
         return true;
     }
 
-    /* This merge is O(size), as BITS_PER_LONG and HBITMAP_LEVELS are constant.
-     * It may be possible to improve running times for sparsely populated maps
-     * by using hbitmap_iter_next, but this is suboptimal for dense maps.
+    /* B's upper levels lead straight to its nonzero words, so the merge
+     * costs as much as iterating over B, not O(size).
      */
-    for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
-        for (j = 0; j < a->sizes[i]; j++) {
-            a->levels[i][j] |= b->levels[i][j];
+    hbitmap_iter_init(&hbi, b, 0);
+    while ((pos = hbitmap_iter_next_word(&hbi, &cur)) != (size_t)-1) {
+        old = a->levels[HBITMAP_LEVELS - 1][pos];
+        if ((old | cur) == old) {
+            continue;
+        }
+        a->levels[HBITMAP_LEVELS - 1][pos] = old | cur;
+        a->count += ctpopl(cur & ~old);
+        if (!old) {
+            hb_set_word_up(a, pos);
+        }
+        hb_word_changed(a, pos);
+    }
+
+    return true;
+}
+
+bool hbitmap_intersect(HBitmap *a, const HBitmap *b)
+{
+    HBitmapIter hbi;
+    unsigned long cur, new;
+    size_t pos;
+
+    if ((a->size != b->size) || (a->granularity != b->granularity)) {
+        return false;
+    }
+
+    if (hbitmap_count(a) == 0) {
+        return true;
+    }
+
+    /* Only the nonzero words of A can change.  Clearing bits under the
+     * iterator's current position is fine.
+     */
+    hbitmap_iter_init(&hbi, a, 0);
+    while ((pos = hbitmap_iter_next_word(&hbi, &cur)) != (size_t)-1) {
+        new = cur & b->levels[HBITMAP_LEVELS - 1][pos];
+        if (new == cur) {
+            continue;
+        }
+        a->levels[HBITMAP_LEVELS - 1][pos] = new;
+        a->count -= ctpopl(cur & ~new);
+        if (!new) {
+            hb_reset_word_up(a, pos);
         }
+        hb_word_changed(a, pos);
     }
 
     return true;
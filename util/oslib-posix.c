@@ -38,6 +38,7 @@
 #include <libgen.h>
 #include <sys/signal.h>
 #include "qemu/cutils.h"
+#include "qemu/thread.h"
 
 #ifdef CONFIG_LINUX
 #include <sys/syscall.h>
@@ -315,18 +316,70 @@ char *qemu_get_exec_dir(void)
     return g_strdup(exec_dir);
 }
 
-static sigjmp_buf sigjump;
+typedef struct MemsetThread {
+    QemuThread thread;
+    char *addr;
+    size_t numpages;
+    size_t hpagesize;
+    sigjmp_buf env;
+    bool failed;
+} MemsetThread;
+
+static MemsetThread *memset_thread;
+static int memset_num_threads;
 
 static void sigbus_handler(int signal)
 {
-    siglongjmp(sigjump, 1);
+    int i;
+
+    /* SIGBUS from a page fault goes to the thread that touched the page */
+    for (i = 0; i < memset_num_threads; i++) {
+        if (qemu_thread_is_self(&memset_thread[i].thread)) {
+            siglongjmp(memset_thread[i].env, 1);
+        }
+    }
+    abort();
 }
 
-void os_mem_prealloc(int fd, char *area, size_t memory, Error **errp)
+static void *do_touch_pages(void *opaque)
 {
-    int ret;
-    struct sigaction act, oldact;
+    MemsetThread *t = opaque;
     sigset_t set, oldset;
+    size_t i;
+
+    /* unblock SIGBUS */
+    sigemptyset(&set);
+    sigaddset(&set, SIGBUS);
+    pthread_sigmask(SIG_UNBLOCK, &set, &oldset);
+
+    if (sigsetjmp(t->env, 1)) {
+        t->failed = true;
+    } else {
+        /* MAP_POPULATE silently ignores failures */
+        for (i = 0; i < t->numpages; i++) {
+            memset(t->addr + t->hpagesize * i, 0, 1);
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    return NULL;
+}
+
+/*
+ * Touch every page of area from up to max_threads threads.  The NUMA
+ * policy of the area has been set by the caller, so which thread touches
+ * a page does not change the node its memory comes from.
+ */
+void os_mem_prealloc(int fd, char *area, size_t memory, int max_threads,
+                     Error **errp)
+{
+    int ret, i;
+    struct sigaction act, oldact;
+    size_t hpagesize = qemu_fd_getpagesize(fd);
+    size_t numpages = DIV_ROUND_UP(memory, hpagesize);
+    size_t pages_per_thread;
+    long host_procs = sysconf(_SC_NPROCESSORS_ONLN);
+    bool failed = false;
 
     memset(&act, 0, sizeof(act));
     act.sa_handler = &sigbus_handler;
@@ -339,23 +392,35 @@ void os_mem_prealloc(int fd, char *area, size_t memory, Error **errp)
         return;
     }
 
-    /* unblock SIGBUS */
-    sigemptyset(&set);
-    sigaddset(&set, SIGBUS);
-    pthread_sigmask(SIG_UNBLOCK, &set, &oldset);
+    memset_num_threads = MAX(max_threads, 1);
+    if (host_procs > 0) {
+        memset_num_threads = MIN(memset_num_threads, host_procs);
+    }
+    memset_num_threads = MIN(memset_num_threads, MAX(numpages, 1));
+    pages_per_thread = DIV_ROUND_UP(numpages, memset_num_threads);
+
+    memset_thread = g_new0(MemsetThread, memset_num_threads);
+    for (i = 0; i < memset_num_threads; i++) {
+        size_t first = MIN(numpages, i * pages_per_thread);
+
+        memset_thread[i].addr = area + first * hpagesize;
+        memset_thread[i].numpages = MIN(pages_per_thread, numpages - first);
+        memset_thread[i].hpagesize = hpagesize;
+        qemu_thread_create(&memset_thread[i].thread, "touch_pages",
+                           do_touch_pages, &memset_thread[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < memset_num_threads; i++) {
+        qemu_thread_join(&memset_thread[i].thread);
+        failed |= memset_thread[i].failed;
+    }
+    g_free(memset_thread);
+    memset_thread = NULL;
+    memset_num_threads = 0;
 
-    if (sigsetjmp(sigjump, 1)) {
+    if (failed) {
         error_setg(errp, "os_mem_prealloc: Insufficient free host memory "
             "pages available to allocate guest RAM\n");
-    } else {
-        int i;
-        size_t hpagesize = qemu_fd_getpagesize(fd);
-        size_t numpages = DIV_ROUND_UP(memory, hpagesize);
-
-        /* MAP_POPULATE silently ignores failures */
-        for (i = 0; i < numpages; i++) {
-            memset(area + (hpagesize * i), 0, 1);
-        }
     }
 
     ret = sigaction(SIGBUS, &oldact, NULL);
@@ -364,7 +429,6 @@ void os_mem_prealloc(int fd, char *area, size_t memory, Error **errp)
         perror("os_mem_prealloc: failed to reinstall signal handler");
         exit(1);
     }
-    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
 }
 
 
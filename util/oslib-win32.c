@@ -539,7 +539,8 @@ int getpagesize(void)
     return system_info.dwPageSize;
 }
 
-void os_mem_prealloc(int fd, char *area, size_t memory, Error **errp)
+void os_mem_prealloc(int fd, char *area, size_t memory, int max_threads,
+                     Error **errp)
 {
     int i;
     size_t pagesize = getpagesize();
@@ -133,9 +133,17 @@ struct qht_map {
 /* trigger a resize when n_added_buckets > n_buckets / div */
 #define QHT_NR_ADDED_BUCKETS_THRESHOLD_DIV 8
 
+/*
+ * Also trigger a resize when an insertion makes a chain longer than this many
+ * buckets, since every lookup in it walks that many cache lines.  This needs
+ * a quarter of the load that the n_added_buckets threshold asks for, so that
+ * one chain of colliding hashes does not keep doubling a mostly empty table.
+ */
+#define QHT_CHAIN_THRESHOLD 4
+
 static void qht_do_resize_reset(struct qht *ht, struct qht_map *new,
                                 bool reset);
-static void qht_grow_maybe(struct qht *ht);
+static void qht_grow_maybe(struct qht *ht, uint32_t hash);
 
 #ifdef QHT_DEBUG
 
@@ -302,6 +310,14 @@ static inline bool qht_map_needs_resize(struct qht_map *map)
     return atomic_read(&map->n_added_buckets) > map->n_added_buckets_threshold;
 }
 
+static inline bool qht_map_chain_needs_resize(struct qht_map *map,
+                                              size_t chain_len)
+{
+    return chain_len > QHT_CHAIN_THRESHOLD &&
+        atomic_read(&map->n_added_buckets) * 4 >
+        map->n_added_buckets_threshold;
+}
+
 static inline void qht_chain_destroy(struct qht_bucket *head)
 {
     struct qht_bucket *curr = head->next;
@@ -357,6 +373,7 @@ void qht_init(struct qht *ht, size_t n_elems, unsigned int mode)
     size_t n_buckets = qht_elems_to_buckets(n_elems);
 
     ht->mode = mode;
+    ht->n_resizes = 0;
     qemu_mutex_init(&ht->lock);
     map = qht_map_create(n_buckets);
     atomic_rcu_set(&ht->map, map);
@@ -443,9 +460,15 @@ void *qht_do_lookup(struct qht_bucket *head, qht_lookup_func_t func,
                     const void *userp, uint32_t hash)
 {
     struct qht_bucket *b = head;
+    struct qht_bucket *next;
     int i;
 
     do {
+        /* fetch the next bucket of the chain while this one is searched */
+        next = atomic_rcu_read(&b->next);
+        if (next) {
+            __builtin_prefetch(next);
+        }
         for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
             if (atomic_read(&b->hashes[i]) == hash) {
                 /* The pointer is dereferenced before seqlock_read_retry,
@@ -459,7 +482,7 @@ void *qht_do_lookup(struct qht_bucket *head, qht_lookup_func_t func,
                 }
             }
         }
-        b = atomic_rcu_read(&b->next);
+        b = next;
     } while (b);
 
     return NULL;
@@ -510,6 +533,7 @@ static bool qht_insert__locked(struct qht *ht, struct qht_map *map,
     struct qht_bucket *b = head;
     struct qht_bucket *prev = NULL;
     struct qht_bucket *new = NULL;
+    size_t chain_len = 0;
     int i;
 
     do {
@@ -524,6 +548,7 @@ static bool qht_insert__locked(struct qht *ht, struct qht_map *map,
         }
         prev = b;
         b = b->next;
+        chain_len++;
     } while (b);
 
     b = qemu_memalign(QHT_BUCKET_ALIGN, sizeof(*b));
@@ -531,7 +556,9 @@ static bool qht_insert__locked(struct qht *ht, struct qht_map *map,
     new = b;
     i = 0;
     atomic_inc(&map->n_added_buckets);
-    if (unlikely(qht_map_needs_resize(map)) && needs_resize) {
+    if (unlikely(qht_map_needs_resize(map) ||
+                 qht_map_chain_needs_resize(map, chain_len + 1)) &&
+        needs_resize) {
         *needs_resize = true;
     }
 
@@ -548,7 +575,27 @@ static bool qht_insert__locked(struct qht *ht, struct qht_map *map,
     return true;
 }
 
-static __attribute__((noinline)) void qht_grow_maybe(struct qht *ht)
+/* call with ht->lock held */
+static size_t qht_map_chain_len(struct qht_map *map, uint32_t hash)
+{
+    struct qht_bucket *head = qht_map_to_bucket(map, hash);
+    struct qht_bucket *b;
+    size_t chain_len = 0;
+
+    qemu_spin_lock(&head->lock);
+    for (b = head; b; b = b->next) {
+        chain_len++;
+    }
+    qemu_spin_unlock(&head->lock);
+    return chain_len;
+}
+
+/*
+ * An insertion of @hash asked for a resize. The map it went into may have
+ * been resized and freed since, so decide again on the current map.
+ */
+static __attribute__((noinline))
+void qht_grow_maybe(struct qht *ht, uint32_t hash)
 {
     struct qht_map *map;
 
@@ -561,7 +608,8 @@ static __attribute__((noinline)) void qht_grow_maybe(struct qht *ht)
     }
     map = ht->map;
     /* another thread might have just performed the resize we were after */
-    if (qht_map_needs_resize(map)) {
+    if (qht_map_needs_resize(map) ||
+        qht_map_chain_needs_resize(map, qht_map_chain_len(map, hash))) {
         struct qht_map *new = qht_map_create(map->n_buckets * 2);
 
         qht_do_resize(ht, new);
@@ -585,7 +633,7 @@ bool qht_insert(struct qht *ht, void *p, uint32_t hash)
     qemu_spin_unlock(&b->lock);
 
     if (unlikely(needs_resize) && ht->mode & QHT_MODE_AUTO_RESIZE) {
-        qht_grow_maybe(ht);
+        qht_grow_maybe(ht, hash);
     }
     return ret;
 }
@@ -760,6 +808,7 @@ static void qht_do_resize_reset(struct qht *ht, struct qht_map *new, bool reset)
     }
 
     g_assert_cmpuint(new->n_buckets, !=, old->n_buckets);
+    ht->n_resizes++;
     qht_map_iter__all_locked(ht, old, qht_map_copy, new);
     qht_map_debug__all_locked(new);
 
@@ -796,6 +845,7 @@ void qht_statistics_init(struct qht *ht, struct qht_stats *stats)
 
     stats->used_head_buckets = 0;
     stats->entries = 0;
+    stats->resizes = atomic_read(&ht->n_resizes);
     qdist_init(&stats->chain);
     qdist_init(&stats->occupancy);
     /* bail out if the qht has not yet been initialized */
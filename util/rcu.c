@@ -46,6 +46,12 @@ QemuEvent rcu_gp_event;
 static QemuMutex rcu_registry_lock;
 static QemuMutex rcu_sync_lock;
 
+/* Grace periods started and completed so far, protected by rcu_sync_lock
+ * but also read outside it by synchronize_rcu.
+ */
+static unsigned long rcu_sync_started;
+static unsigned long rcu_sync_done;
+
 /*
  * Check whether a quiescent state was crossed between the beginning of
  * update_counter_and_wait and now.
@@ -138,7 +144,22 @@ static void wait_for_readers(void)
 
 void synchronize_rcu(void)
 {
+    unsigned long started;
+
+    /* Any grace period that starts after this point waits for the readers
+     * that could still see what the caller has just unpublished, so writers
+     * that queue up on rcu_sync_lock behind a grace period can all share the
+     * next one instead of running one each.  The barrier orders the caller's
+     * stores before the read of rcu_sync_started.
+     */
+    started = atomic_mb_read(&rcu_sync_started);
+
     qemu_mutex_lock(&rcu_sync_lock);
+    if ((long)(atomic_read(&rcu_sync_done) - started) >= 1) {
+        qemu_mutex_unlock(&rcu_sync_lock);
+        return;
+    }
+    atomic_set(&rcu_sync_started, rcu_sync_started + 1);
     qemu_mutex_lock(&rcu_registry_lock);
 
     if (!QLIST_EMPTY(&registry)) {
@@ -163,6 +184,7 @@ void synchronize_rcu(void)
     }
 
     qemu_mutex_unlock(&rcu_registry_lock);
+    atomic_mb_set(&rcu_sync_done, rcu_sync_started);
     qemu_mutex_unlock(&rcu_sync_lock);
 }
 
@@ -177,6 +199,11 @@ static struct rcu_head *head = &dummy, **tail = &dummy.next;
 static int rcu_call_count;
 static QemuEvent rcu_call_ready_event;
 
+/* Number of drain_call_rcu callers; while nonzero callbacks are processed
+ * as soon as they are queued.
+ */
+static int rcu_call_expedited;
+
 static void enqueue(struct rcu_head *node)
 {
     struct rcu_head **old_tail;
@@ -240,8 +267,11 @@ static void *call_rcu_thread(void *opaque)
          * Fetch rcu_call_count now, we only must process elements that were
          * added before synchronize_rcu() starts.
          */
-        while (n == 0 || (n < RCU_CALL_MIN_SIZE && ++tries <= 5)) {
-            g_usleep(10000);
+        while (n == 0 || (n < RCU_CALL_MIN_SIZE && ++tries <= 5 &&
+                          !atomic_read(&rcu_call_expedited))) {
+            if (!atomic_read(&rcu_call_expedited)) {
+                g_usleep(10000);
+            }
             if (n == 0) {
                 qemu_event_reset(&rcu_call_ready_event);
                 n = atomic_read(&rcu_call_count);
@@ -284,6 +314,43 @@ void call_rcu1(struct rcu_head *node, void (*func)(struct rcu_head *node))
     qemu_event_set(&rcu_call_ready_event);
 }
 
+struct rcu_drain {
+    struct rcu_head rcu;
+    QemuEvent done;
+};
+
+static void drain_rcu_callback(struct rcu_head *node)
+{
+    struct rcu_drain *drain = container_of(node, struct rcu_drain, rcu);
+
+    qemu_event_set(&drain->done);
+}
+
+/* The call_rcu thread runs callbacks in order, so once ours has run every
+ * callback queued before it has too.
+ */
+void drain_call_rcu(void)
+{
+    struct rcu_drain drain;
+    bool locked = qemu_mutex_iothread_locked();
+
+    memset(&drain, 0, sizeof(drain));
+    qemu_event_init(&drain.done, false);
+
+    /* the callbacks run with the iothread lock taken */
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    atomic_inc(&rcu_call_expedited);
+    call_rcu1(&drain.rcu, drain_rcu_callback);
+    qemu_event_wait(&drain.done);
+    atomic_dec(&rcu_call_expedited);
+    if (locked) {
+        qemu_mutex_lock_iothread();
+    }
+    qemu_event_destroy(&drain.done);
+}
+
 void rcu_register_thread(void)
 {
     assert(rcu_reader.ctr == 0);
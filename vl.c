@@ -144,13 +144,27 @@ extern bool panda_load_plugin(const char *);
 extern void panda_unload_plugins(void);
 extern char *panda_plugin_path(const char *name);
 void panda_set_os_name(char *os_name);
+extern bool panda_cb_profiling;
+void panda_sleep_plugins(void);
+void panda_enable_plugin_at(void *plugin, uint64_t instr);
+void panda_disable_plugin_at(void *plugin, uint64_t instr);
+void tb_profile_start(unsigned period_us);
+void tb_cache_open(const char *path);
+void exec_stats_start(const char *path);
+void exec_stats_dump(void);
+extern unsigned tlb_asid_slots;
 
 void pandalog_open(const char *path, const char *mode);
 int  pandalog_close(void);
+int  pandalog_set_codec(const char *spec);
+int  pandalog_open_columns(const char *dir);
+extern int pandalog_threads;
+extern uint64_t pandalog_mem_limit;
 int pandalog = 0;
 int panda_in_main_loop = 0;
 
 #include "panda/rr/rr_log_all.h"
+#include "panda/panda_api.h"
 
 #ifdef CONFIG_LLVM
 struct TCGLLVMContext;
@@ -159,6 +173,10 @@ extern struct TCGLLVMContext* tcg_llvm_ctx;
 extern int generate_llvm;
 extern int execute_llvm;
 extern const int has_llvm_engine;
+extern unsigned tcg_llvm_tb_cache_size;
+extern unsigned llvm_tier_threshold;
+extern unsigned llvm_trace_threshold;
+extern int tcg_llvm_async;
 
 struct TCGLLVMContext* tcg_llvm_initialize(void);
 void tcg_llvm_destroy(void);
@@ -507,6 +525,25 @@ static QemuOptsList qemu_icount_opts = {
     },
 };
 
+static QemuOptsList qemu_accel_opts = {
+    .name = "accel",
+    .implied_opt_name = "accel",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_accel_opts.head),
+    .merge_lists = true,
+    .desc = {
+        {
+            .name = "accel",
+            .type = QEMU_OPT_STRING,
+            .help = "Select the type of accelerator",
+        }, {
+            .name = "thread",
+            .type = QEMU_OPT_STRING,
+            .help = "Enable/disable multi-threaded TCG",
+        },
+        { /* end of list */ }
+    },
+};
+
 static QemuOptsList qemu_semihosting_config_opts = {
     .name = "semihosting-config",
     .implied_opt_name = "enable",
@@ -2033,6 +2070,13 @@ static void main_loop(void)
             sigprocmask(SIG_SETMASK, &oldset, NULL);
         }
 
+        if (rr_in_record()) {
+            sigprocmask(SIG_BLOCK, &blockset, &oldset);
+            rr_maybe_checksum();
+            rr_maybe_checkpoint();
+            sigprocmask(SIG_SETMASK, &oldset, NULL);
+        }
+
         //mz 05.2012 We have the global mutex here, so this should be OK.
         if (rr_end_record_requested && rr_in_record()) {
             rr_do_end_record();
@@ -2048,6 +2092,13 @@ static void main_loop(void)
             rr_end_replay_requested = 0;
             vm_stop(RUN_STATE_PAUSED);
         }
+        if (rr_replay_fork_requested && rr_in_replay() &&
+            !runstate_is_running()) {
+            sigprocmask(SIG_BLOCK, &blockset, &oldset);
+            // returns in each child, with the VM running again
+            rr_do_replay_fork();
+            sigprocmask(SIG_SETMASK, &oldset, NULL);
+        }
 
 #ifdef CONFIG_PROFILER
         dev_time += profile_getclock() - ti;
@@ -3085,7 +3136,7 @@ static int global_init_func(void *opaque, QemuOpts *opts, Error **errp)
     return 0;
 }
 
-int main(int argc, char **argv, char **envp)
+int main_aux(int argc, char **argv, char **envp, PandaMainMode pmm)
 {
     int i;
     int snapshot, linux_boot;
@@ -3096,6 +3147,10 @@ int main(int argc, char **argv, char **envp)
     DisplayState *ds;
     int cyls, heads, secs, translation;
     QemuOpts *hda_opts = NULL, *opts, *machine_opts, *icount_opts = NULL;
+    QemuOpts *accel_opts = NULL;
+    unsigned tb_profile_period = 0;
+    const char *tb_cache_path = NULL;
+    const char *exec_stats_path = NULL;
     QemuOptsList *olist;
     int optind;
     const char *optarg;
@@ -3130,6 +3185,8 @@ int main(int argc, char **argv, char **envp)
     // In order to load PANDA plugins all at once at the end
     const char * panda_plugin_files[64] = {};
     int nb_panda_plugins = 0;
+    uint64_t panda_start_instr = 0;
+    uint64_t panda_end_instr = 0;
 
     module_call_init(MODULE_INIT_TRACE);
 
@@ -3171,6 +3228,7 @@ int main(int argc, char **argv, char **envp)
     qemu_add_opts(&qemu_name_opts);
     qemu_add_opts(&qemu_numa_opts);
     qemu_add_opts(&qemu_icount_opts);
+    qemu_add_opts(&qemu_accel_opts);
     qemu_add_opts(&qemu_semihosting_config_opts);
     qemu_add_opts(&qemu_fw_cfg_opts);
 #ifdef CONFIG_LIBISCSI
@@ -3832,6 +3890,29 @@ int main(int argc, char **argv, char **envp)
                     exit(1);
                 }
                 break;
+            case QEMU_OPTION_accel:
+                accel_opts = qemu_opts_parse_noisily(qemu_find_opts("accel"),
+                                                     optarg, true);
+                if (!accel_opts) {
+                    exit(1);
+                }
+                optarg = qemu_opt_get(accel_opts, "accel");
+                if (!optarg) {
+                    error_report("-accel needs an accelerator");
+                    exit(1);
+                }
+                olist = qemu_find_opts("machine");
+                if (strcmp("kvm", optarg) == 0) {
+                    qemu_opts_parse_noisily(olist, "accel=kvm", false);
+                } else if (strcmp("xen", optarg) == 0) {
+                    qemu_opts_parse_noisily(olist, "accel=xen", false);
+                } else if (strcmp("tcg", optarg) == 0) {
+                    qemu_opts_parse_noisily(olist, "accel=tcg", false);
+                } else {
+                    error_report("Unknown accelerator %s", optarg);
+                    exit(1);
+                }
+                break;
              case QEMU_OPTION_no_kvm:
                 olist = qemu_find_opts("machine");
                 qemu_opts_parse_noisily(olist, "accel=tcg", false);
@@ -4160,7 +4241,123 @@ int main(int argc, char **argv, char **envp)
                 }
                 generate_llvm = 1;
                 break;
+            case QEMU_OPTION_llvm_async:
+                tcg_llvm_async = 1;
+                break;
+            case QEMU_OPTION_llvm_tier:
+                {
+                    char *end;
+                    long long n = strtoll(optarg, &end, 0);
+                    if (*end != '\0' || n < 0 || n > UINT_MAX) {
+                        error_report("-llvm-tier needs a number of runs");
+                        exit(1);
+                    }
+                    llvm_tier_threshold = n;
+                }
+                break;
+            case QEMU_OPTION_llvm_trace:
+                {
+                    char *end;
+                    long long n = strtoll(optarg, &end, 0);
+                    if (*end != '\0' || n < 0 || n > UINT_MAX) {
+                        error_report("-llvm-trace needs a number of runs");
+                        exit(1);
+                    }
+                    llvm_trace_threshold = n;
+                }
+                break;
+            case QEMU_OPTION_llvm_tb_cache:
+                {
+                    char *end;
+                    long long n = strtoll(optarg, &end, 0);
+                    if (*end != '\0' || n < 0 || n > UINT_MAX) {
+                        error_report("-llvm-tb-cache needs a number of functions");
+                        exit(1);
+                    }
+                    tcg_llvm_tb_cache_size = n;
+                }
+                break;
 #endif
+            case QEMU_OPTION_record_compress:
+                rr_record_compressed = true;
+                break;
+            case QEMU_OPTION_record_dedup:
+                rr_record_dedup = true;
+                break;
+            case QEMU_OPTION_record_mapped_ram:
+                rr_record_mapped_ram = true;
+                break;
+            case QEMU_OPTION_record_packets:
+                rr_record_packets = true;
+                break;
+            case QEMU_OPTION_record_checksum_interval:
+                rr_checksum_interval = strtoull(optarg, NULL, 0);
+                break;
+            case QEMU_OPTION_record_checkpoint_interval:
+                rr_checkpoint_interval = strtoull(optarg, NULL, 0);
+                break;
+            case QEMU_OPTION_replay_start:
+                rr_replay_start_instr = strtoull(optarg, NULL, 0);
+                break;
+            case QEMU_OPTION_replay_fork:
+                {
+                    // <instruction>:<file>[:<jobs>]
+                    char *end;
+                    rr_replay_fork_instr = strtoull(optarg, &end, 0);
+                    if (*end != ':' || end[1] == '\0') {
+                        error_report("-replay-fork takes "
+                                     "<instruction>:<file>[:<jobs>]");
+                        exit(1);
+                    }
+                    char *file = g_strdup(end + 1);
+                    char *jobs = strrchr(file, ':');
+                    if (jobs != NULL && jobs[1] != '\0' &&
+                        strspn(jobs + 1, "0123456789") == strlen(jobs + 1)) {
+                        *jobs++ = '\0';
+                        rr_replay_fork_jobs = strtoul(jobs, NULL, 0);
+                    }
+                    rr_replay_fork_file = file;
+                    break;
+                }
+            case QEMU_OPTION_replay_end:
+                rr_replay_end_instr = strtoull(optarg, NULL, 0);
+                break;
+            case QEMU_OPTION_replay_stats:
+                rr_replay_stats_interval = strtoull(optarg, NULL, 0);
+                break;
+            case QEMU_OPTION_replay_stats_file:
+                rr_replay_stats_file = optarg;
+                break;
+            case QEMU_OPTION_tb_profile:
+                {
+                    char *end;
+                    long long n = strtoll(optarg, &end, 0);
+                    if (*end != '\0' || n <= 0 || n > UINT_MAX) {
+                        error_report("-tb-profile needs a sample period in "
+                                     "microseconds");
+                        exit(1);
+                    }
+                    tb_profile_period = n;
+                }
+                break;
+            case QEMU_OPTION_tb_cache:
+                tb_cache_path = optarg;
+                break;
+            case QEMU_OPTION_exec_stats:
+                exec_stats_path = optarg;
+                break;
+            case QEMU_OPTION_tlb_asids:
+                {
+                    char *end;
+                    long n = strtol(optarg, &end, 0);
+                    if (*end != '\0' || n < 0 || n > 256) {
+                        error_report("-tlb-asids needs a number of address "
+                                     "spaces from 0 to 256");
+                        exit(1);
+                    }
+                    tlb_asid_slots = n;
+                }
+                break;
             case QEMU_OPTION_replay:
                 display_type = DT_NONE;
                 replay_name = optarg;
@@ -4170,11 +4367,51 @@ int main(int argc, char **argv, char **envp)
                 pandalog_open(optarg, "w");
                 printf ("pandalogging to [%s]\n", optarg);
                 break;
+            case QEMU_OPTION_pandalog_columns:
+                pandalog = 1;
+                if (!pandalog_open_columns(optarg)) {
+                    exit(1);
+                }
+                printf ("pandalog columns in [%s]\n", optarg);
+                break;
+            case QEMU_OPTION_pandalog_codec:
+                if (!pandalog_set_codec(optarg)) {
+                    error_report("unknown pandalog codec %s", optarg);
+                    exit(1);
+                }
+                break;
+            case QEMU_OPTION_pandalog_threads:
+                pandalog_threads = strtol(optarg, NULL, 0);
+                if (pandalog_threads < 0) {
+                    error_report("-pandalog-threads can't be negative");
+                    exit(1);
+                }
+                break;
+            case QEMU_OPTION_pandalog_mem:
+                {
+                    char *end;
+                    long long mb = strtoll(optarg, &end, 0);
+                    if (*end != '\0' || mb < 0) {
+                        error_report("-pandalog-mem needs a size in MB");
+                        exit(1);
+                    }
+                    pandalog_mem_limit = (uint64_t) mb << 20;
+                }
+                break;
             case QEMU_OPTION_panda_arg:
                 if(!panda_add_arg(optarg, strlen(optarg))) {
                     fprintf(stderr, "WARN: Couldn't add PANDA arg '%s': argument too long,\n", optarg);
                 }
                 break;
+            case QEMU_OPTION_panda_profile:
+                panda_cb_profiling = true;
+                break;
+            case QEMU_OPTION_panda_start:
+                panda_start_instr = strtoull(optarg, NULL, 0);
+                break;
+            case QEMU_OPTION_panda_end:
+                panda_end_instr = strtoull(optarg, NULL, 0);
+                break;
             case QEMU_OPTION_panda_plugin:
                 panda_plugin_files[nb_panda_plugins++] = optarg;
                 printf ("adding %s to panda_plugin_files %d\n", optarg, nb_panda_plugins-1);
@@ -4250,6 +4487,13 @@ int main(int argc, char **argv, char **envp)
           abort();
       }
     }
+    if (panda_start_instr > 0) {
+        panda_sleep_plugins();
+        panda_enable_plugin_at(NULL, panda_start_instr);
+    }
+    if (panda_end_instr > 0) {
+        panda_disable_plugin_at(NULL, panda_end_instr);
+    }
 
     replay_configure(icount_opts);
 
@@ -4630,6 +4874,46 @@ int main(int argc, char **argv, char **envp)
         qemu_opts_del(icount_opts);
     }
 
+    if (replay_name && !tcg_enabled()) {
+        error_report("-replay needs TCG");
+        exit(1);
+    }
+    if (tcg_enabled()) {
+        qemu_tcg_configure(accel_opts, &error_fatal);
+        /* record/replay, plugins and LLVM all assume one vCPU runs at a
+           time */
+        bool single_only = replay_name || nb_panda_plugins;
+#if defined(CONFIG_LLVM)
+        single_only = single_only || generate_llvm || execute_llvm;
+#endif
+        if (qemu_tcg_mttcg_enabled() && single_only) {
+            error_report("-accel tcg,thread=multi doesn't work with replay, "
+                         "plugins or LLVM");
+            exit(1);
+        }
+    }
+    if (tb_profile_period) {
+        if (!tcg_enabled()) {
+            error_report("-tb-profile needs TCG");
+            exit(1);
+        }
+        tb_profile_start(tb_profile_period);
+    }
+    if (tb_cache_path) {
+        if (!tcg_enabled()) {
+            error_report("-tb-cache needs TCG");
+            exit(1);
+        }
+        tb_cache_open(tb_cache_path);
+    }
+    if (exec_stats_path) {
+        if (!tcg_enabled()) {
+            error_report("-exec-stats needs TCG");
+            exit(1);
+        }
+        exec_stats_start(exec_stats_path);
+    }
+
     if (default_net) {
         QemuOptsList *net = qemu_find_opts("net");
         qemu_opts_set(net, NULL, "type", "nic", &error_abort);
@@ -4903,10 +5187,24 @@ int main(int argc, char **argv, char **envp)
 
     os_setup_post();
 
+    if (pmm == PANDA_INIT) {
+        return 0;
+    }
+    main_loop_run();
+    main_cleanup();
+    return 0;
+}
+
+void main_loop_run(void)
+{
     panda_in_main_loop = 1;
     main_loop();
     panda_in_main_loop = 0;
+}
 
+void main_cleanup(void)
+{
+    exec_stats_dump();
     replay_disable_events();
     iothread_stop_all();
 
@@ -4927,6 +5225,9 @@ int main(int argc, char **argv, char **envp)
         tcg_llvm_cleanup();
     }
 #endif
+}
 
-    return 0;
+int main(int argc, char **argv, char **envp)
+{
+    return main_aux(argc, argv, envp, PANDA_NORMAL);
 }